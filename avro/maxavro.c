@@ -18,13 +18,6 @@
 #include <log_manager.h>
 #include <errno.h>
 
-/** Maximum byte size of an integer value */
-#define MAX_INTEGER_SIZE 10
-
-#define avro_decode(n) ((n >> 1) ^ -(n & 1))
-#define encode_long(n) ((n << 1) ^ (n >> 63))
-#define more_bytes(b) (b & 0x80)
-
 /**
  * @brief Read an Avro integer
  *
@@ -48,7 +41,7 @@ bool maxavro_read_integer(MAXAVRO_FILE* file, uint64_t *dest)
             file->last_error = MAXAVRO_ERR_VALUE_OVERFLOW;
             return false;
         }
-        size_t rdsz = fread(&byte, sizeof(byte), 1, file->file);
+        size_t rdsz = fread(&byte, sizeof(byte), 1, file->data);
         if (rdsz != sizeof(byte))
         {
             if (rdsz != 0)
@@ -113,7 +106,7 @@ char* maxavro_read_string(MAXAVRO_FILE* file)
         key = malloc(len + 1);
         if (key)
         {
-            size_t nread = fread(key, 1, len, file->file);
+            size_t nread = fread(key, 1, len, file->data);
             if (nread == len)
             {
                 key[len] = '\0';
@@ -149,7 +142,7 @@ bool maxavro_skip_string(MAXAVRO_FILE* file)
 
     if (maxavro_read_integer(file, &len))
     {
-        if (fseek(file->file, len, SEEK_CUR) != 0)
+        if (fseek(file->data, len, SEEK_CUR) != 0)
         {
             file->last_error = MAXAVRO_ERR_IO;
         }
@@ -186,7 +179,7 @@ uint64_t avro_length_string(const char* str)
  */
 bool maxavro_read_float(MAXAVRO_FILE* file, float *dest)
 {
-    size_t nread = fread(dest, 1, sizeof(*dest), file->file);
+    size_t nread = fread(dest, 1, sizeof(*dest), file->data);
     if (nread != sizeof(*dest) && nread != 0)
     {
         file->last_error = MAXAVRO_ERR_IO;
@@ -217,7 +210,7 @@ uint64_t avro_length_float(float val)
  */
 bool maxavro_read_double(MAXAVRO_FILE* file, double *dest)
 {
-    size_t nread = fread(dest, 1, sizeof(*dest), file->file);
+    size_t nread = fread(dest, 1, sizeof(*dest), file->data);
     if (nread != sizeof(*dest) && nread != 0)
     {
         file->last_error = MAXAVRO_ERR_IO;
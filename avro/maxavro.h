@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 #include <jansson.h>
 #include <buffer.h>
 
@@ -27,6 +28,13 @@
 /** The file magic */
 static const char avro_magic[] = {0x4f, 0x62, 0x6a, 0x01};
 
+/** Maximum byte size of an integer value */
+#define MAX_INTEGER_SIZE 10
+
+#define avro_decode(n) ((n >> 1) ^ -(n & 1))
+#define encode_long(n) ((n << 1) ^ (n >> 63))
+#define more_bytes(b) (b & 0x80)
+
 enum maxavro_value_type
 {
     MAXAVRO_TYPE_UNKNOWN = 0,
@@ -60,12 +68,24 @@ enum maxavro_error
     MAXAVRO_ERR_NONE,
     MAXAVRO_ERR_IO,
     MAXAVRO_ERR_MEMORY,
-    MAXAVRO_ERR_VALUE_OVERFLOW
+    MAXAVRO_ERR_VALUE_OVERFLOW,
+    MAXAVRO_ERR_CODEC
+};
+
+/** The compression codecs of the data blocks */
+enum maxavro_codec
+{
+    MAXAVRO_CODEC_NULL,
+    MAXAVRO_CODEC_DEFLATE,
+    MAXAVRO_CODEC_SNAPPY,
+    MAXAVRO_CODEC_UNKNOWN
 };
 
 typedef struct
 {
     FILE* file;
+    FILE* data; /*< Where the records are read from, either the file itself or
+                 * the decompressed data block of a compressed file */
     char* filename; /*< The filename */
     MAXAVRO_SCHEMA* schema;
     uint64_t blocks_read; /*< Total number of data blocks read */
@@ -74,7 +94,10 @@ typedef struct
     uint64_t records_in_block;
     uint64_t records_read_from_block;
     uint64_t bytes_read_from_block;
-    uint64_t block_size; /*< Size of the block in bytes */
+    uint64_t block_size; /*< Size of the block in bytes as stored in the file */
+    enum maxavro_codec codec; /*< Compression codec of the data blocks */
+    uint8_t *buffer; /*< The decompressed data block */
+    size_t buffersize; /*< Size of the decompressed data block buffer */
 
     /** The position @c ftell returns before the first record is read  */
     long header_end_pos;
@@ -115,6 +138,14 @@ typedef struct
     MAXAVRO_FILE *avrofile; /*< The current open file */
 } MAXAVRO_DATABLOCK;
 
+/** A record encoded as a JSON string */
+typedef struct
+{
+    char *data; /*< The null-terminated JSON object */
+    size_t len; /*< Length of the JSON object */
+    size_t size; /*< Allocated size of the buffer */
+} MAXAVRO_JSON_BUFFER;
+
 typedef struct avro_map_value
 {
     char* key;
@@ -137,6 +168,18 @@ bool maxavro_datablock_add_string(MAXAVRO_DATABLOCK *file, const char* str);
 bool maxavro_datablock_add_float(MAXAVRO_DATABLOCK *file, float val);
 bool maxavro_datablock_add_double(MAXAVRO_DATABLOCK *file, double val);
 
+/** Encoding values in-memory */
+uint64_t maxavro_encode_integer(uint8_t* buffer, uint64_t val);
+uint64_t maxavro_encode_string(uint8_t* dest, const char* str);
+uint64_t maxavro_encode_float(uint8_t* dest, float val);
+uint64_t maxavro_encode_double(uint8_t* dest, double val);
+
+/** Writing values straight to disk*/
+bool maxavro_write_integer(FILE *file, uint64_t val);
+bool maxavro_write_string(FILE *file, const char* str);
+bool maxavro_write_float(FILE *file, float val);
+bool maxavro_write_double(FILE *file, double val);
+
 /** Reading primitives */
 bool maxavro_read_integer(MAXAVRO_FILE *file, uint64_t *val);
 char* maxavro_read_string(MAXAVRO_FILE *file);
@@ -150,16 +193,24 @@ void maxavro_map_free(MAXAVRO_MAP *value);
 
 /** Reading and seeking records */
 json_t* maxavro_record_read_json(MAXAVRO_FILE *file);
+bool maxavro_record_read_json_string(MAXAVRO_FILE *file, MAXAVRO_JSON_BUFFER *buf,
+                                     uint64_t *integers);
+void maxavro_json_buffer_free(MAXAVRO_JSON_BUFFER *buf);
 GWBUF* maxavro_record_read_binary(MAXAVRO_FILE *file);
 bool maxavro_record_seek(MAXAVRO_FILE *file, uint64_t offset);
 bool maxavro_record_set_pos(MAXAVRO_FILE *file, long pos);
 bool maxavro_next_block(MAXAVRO_FILE *file);
+bool maxavro_record_binary_range(MAXAVRO_FILE *file, off_t *offset, size_t *len);
 
 /** File operations */
 MAXAVRO_FILE* maxavro_file_open(const char* filename);
 void maxavro_file_close(MAXAVRO_FILE *file);
 GWBUF* maxavro_file_binary_header(MAXAVRO_FILE *file);
 
+/** Compression codecs */
+enum maxavro_codec maxavro_get_codec(const char *name);
+const char* maxavro_codec_to_string(enum maxavro_codec codec);
+
 /** File error functions */
 enum maxavro_error maxavro_get_error(MAXAVRO_FILE *file);
 const char* maxavro_get_error_string(MAXAVRO_FILE *file);
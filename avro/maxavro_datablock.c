@@ -15,6 +15,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <zlib.h>
+
+#ifdef HAVE_SNAPPY
+#include <snappy-c.h>
+#endif
 
 /**
  * @file maxavro_datablock.c - Experimental Avro interface for storing data
@@ -22,18 +27,6 @@
  * TODO: Fix the code and take it into use if the Avro C client library is removed
  */
 
-/** Encoding values in-memory */
-uint64_t maxavro_encode_integer(uint8_t* buffer, uint64_t val);
-uint64_t maxavro_encode_string(uint8_t* dest, const char* str);
-uint64_t maxavro_encode_float(uint8_t* dest, float val);
-uint64_t maxavro_encode_double(uint8_t* dest, double val);
-
-/** Writing values straight to disk*/
-bool maxavro_write_integer(FILE *file, uint64_t val);
-bool maxavro_write_string(FILE *file, const char* str);
-bool maxavro_write_float(FILE *file, float val);
-bool maxavro_write_double(FILE *file, double val);
-
 MAXAVRO_DATABLOCK* maxavro_datablock_allocate(MAXAVRO_FILE *file, size_t buffersize)
 {
     MAXAVRO_DATABLOCK *datablock = malloc(sizeof(MAXAVRO_DATABLOCK));
@@ -58,17 +51,96 @@ void maxavro_datablock_free(MAXAVRO_DATABLOCK* block)
     }
 }
 
+/**
+ * Compress the data of a block with the codec of the file
+ *
+ * @param block Block to compress
+ * @param dest_len Length of the compressed data
+ * @return Newly allocated compressed data or NULL on error
+ */
+static uint8_t* compress_datablock(MAXAVRO_DATABLOCK* block, size_t *dest_len)
+{
+    uint8_t *rval = NULL;
+
+    if (block->avrofile->codec == MAXAVRO_CODEC_DEFLATE)
+    {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+
+        /** The deflate codec uses raw deflate data without the zlib header */
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                         8, Z_DEFAULT_STRATEGY) == Z_OK)
+        {
+            size_t size = deflateBound(&stream, block->datasize);
+
+            if ((rval = malloc(size)))
+            {
+                stream.next_in = block->buffer;
+                stream.avail_in = block->datasize;
+                stream.next_out = rval;
+                stream.avail_out = size;
+
+                if (deflate(&stream, Z_FINISH) == Z_STREAM_END)
+                {
+                    *dest_len = stream.total_out;
+                }
+                else
+                {
+                    free(rval);
+                    rval = NULL;
+                }
+            }
+            deflateEnd(&stream);
+        }
+    }
+#ifdef HAVE_SNAPPY
+    else if (block->avrofile->codec == MAXAVRO_CODEC_SNAPPY)
+    {
+        /** The compressed data is followed by the big-endian CRC32 of the data */
+        size_t size = snappy_max_compressed_length(block->datasize);
+
+        if ((rval = malloc(size + 4)))
+        {
+            if (snappy_compress((char*)block->buffer, block->datasize, (char*)rval, &size) == SNAPPY_OK)
+            {
+                uint32_t crc = crc32(0, block->buffer, block->datasize);
+                rval[size] = crc >> 24;
+                rval[size + 1] = crc >> 16;
+                rval[size + 2] = crc >> 8;
+                rval[size + 3] = crc;
+                *dest_len = size + 4;
+            }
+            else
+            {
+                free(rval);
+                rval = NULL;
+            }
+        }
+    }
+#endif
+
+    return rval;
+}
+
 bool maxavro_datablock_finalize(MAXAVRO_DATABLOCK* block)
 {
     bool rval = true;
     FILE *file = block->avrofile->file;
+    uint8_t *data = block->buffer;
+    size_t datasize = block->datasize;
+
+    if (block->avrofile->codec != MAXAVRO_CODEC_NULL &&
+        (data = compress_datablock(block, &datasize)) == NULL)
+    {
+        return false;
+    }
 
     /** Store the current position so we can truncate the file if a write fails */
     long pos = ftell(file);
 
     if (!maxavro_write_integer(file, block->records) ||
-        !maxavro_write_integer(file, block->datasize) ||
-        fwrite(block->buffer, 1, block->datasize, file) != block->datasize ||
+        !maxavro_write_integer(file, datasize) ||
+        fwrite(data, 1, datasize, file) != datasize ||
         fwrite(block->avrofile->sync, 1, SYNC_MARKER_SIZE, file) != SYNC_MARKER_SIZE)
     {
         int fd = fileno(file);
@@ -80,9 +152,14 @@ bool maxavro_datablock_finalize(MAXAVRO_DATABLOCK* block)
     {
         /** The current block is successfully written, reset datablock for
          * a new write. */
-        block->buffersize = 0;
+        block->datasize = 0;
         block->records = 0;
     }
+
+    if (data != block->buffer)
+    {
+        free(data);
+    }
     return rval;
 }
 
@@ -14,8 +14,16 @@
 #include "maxavro.h"
 #include <errno.h>
 #include <string.h>
+#include <zlib.h>
 #include <log_manager.h>
 
+#ifdef HAVE_SNAPPY
+#include <snappy-c.h>
+#endif
+
+/** Length of the CRC32 checksum that follows the snappy compressed data */
+#define SNAPPY_CRC_SIZE 4
+
 
 static bool maxavro_read_sync(FILE *file, uint8_t* sync)
 {
@@ -67,6 +75,14 @@ bool maxavro_read_datablock_start(MAXAVRO_FILE* file)
     /** The actual start of the binary block */
     file->block_start_pos = ftell(file->file);
     file->metadata_read = false;
+
+    if (file->data != file->file)
+    {
+        /** Discard the previous decompressed data block */
+        fclose(file->data);
+        file->data = file->file;
+    }
+
     uint64_t records, bytes;
     bool rval = maxavro_read_integer(file, &records) && maxavro_read_integer(file, &bytes);
 
@@ -93,7 +109,7 @@ bool maxavro_read_datablock_start(MAXAVRO_FILE* file)
 /** The header metadata is encoded as an Avro map with @c bytes encoded
  * key-value pairs. A @c bytes value is written as a length encoded string
  * where the length of the value is stored as a @c long followed by the
- * actual data. */
+ * actual data. The codec of the file is read from the same map. */
 static char* read_schema(MAXAVRO_FILE* file)
 {
     char *rval = NULL;
@@ -102,10 +118,13 @@ static char* read_schema(MAXAVRO_FILE* file)
 
     while (map)
     {
-        if (strcmp(map->key, "avro.schema") == 0)
+        if (strcmp(map->key, "avro.schema") == 0 && rval == NULL)
         {
             rval = strdup(map->value);
-            break;
+        }
+        else if (strcmp(map->key, "avro.codec") == 0)
+        {
+            file->codec = maxavro_get_codec(map->value);
         }
         map = map->next;
     }
@@ -114,6 +133,12 @@ static char* read_schema(MAXAVRO_FILE* file)
     {
         MXS_ERROR("No schema found from Avro header.");
     }
+    else if (file->codec == MAXAVRO_CODEC_UNKNOWN)
+    {
+        MXS_ERROR("Unsupported Avro codec in the header of '%s'.", file->filename);
+        free(rval);
+        rval = NULL;
+    }
 
     maxavro_map_free(head);
     return rval;
@@ -158,6 +183,8 @@ MAXAVRO_FILE* maxavro_file_open(const char* filename)
     if (avrofile)
     {
         avrofile->file = file;
+        avrofile->data = file;
+        avrofile->codec = MAXAVRO_CODEC_NULL;
         avrofile->filename = strdup(filename);
         char *schema = read_schema(avrofile);
         avrofile->schema = schema ? maxavro_schema_alloc(schema) : NULL;
@@ -172,7 +199,10 @@ MAXAVRO_FILE* maxavro_file_open(const char* filename)
             free(avrofile);
             avrofile = NULL;
         }
-        avrofile->header_end_pos = avrofile->block_start_pos;
+        else
+        {
+            avrofile->header_end_pos = avrofile->block_start_pos;
+        }
         free(schema);
     }
     else
@@ -213,6 +243,9 @@ const char* maxavro_get_error_string(MAXAVRO_FILE *file)
         case MAXAVRO_ERR_VALUE_OVERFLOW:
             return "MAXAVRO_ERR_VALUE_OVERFLOW";
 
+        case MAXAVRO_ERR_CODEC:
+            return "MAXAVRO_ERR_CODEC";
+
         case MAXAVRO_ERR_NONE:
             return "MAXAVRO_ERR_NONE";
 
@@ -229,7 +262,12 @@ void maxavro_file_close(MAXAVRO_FILE *file)
 {
     if (file)
     {
+        if (file->data != file->file)
+        {
+            fclose(file->data);
+        }
         fclose(file->file);
+        free(file->buffer);
         free(file->filename);
         maxavro_schema_free(file->schema);
         free(file);
@@ -264,3 +302,238 @@ GWBUF* maxavro_file_binary_header(MAXAVRO_FILE *file)
     }
     return rval;
 }
+
+/**
+ * @brief Get a compression codec by its name
+ *
+ * @param name Name of the codec as stored in the @c avro.codec metadata
+ * @return The codec or MAXAVRO_CODEC_UNKNOWN if the codec is not supported
+ */
+enum maxavro_codec maxavro_get_codec(const char *name)
+{
+    if (strcmp(name, "null") == 0)
+    {
+        return MAXAVRO_CODEC_NULL;
+    }
+    else if (strcmp(name, "deflate") == 0)
+    {
+        return MAXAVRO_CODEC_DEFLATE;
+    }
+#ifdef HAVE_SNAPPY
+    else if (strcmp(name, "snappy") == 0)
+    {
+        return MAXAVRO_CODEC_SNAPPY;
+    }
+#endif
+
+    return MAXAVRO_CODEC_UNKNOWN;
+}
+
+/**
+ * @brief Get the name of a compression codec
+ *
+ * @param codec The codec
+ * @return Name of the codec
+ */
+const char* maxavro_codec_to_string(enum maxavro_codec codec)
+{
+    switch (codec)
+    {
+        case MAXAVRO_CODEC_NULL:
+            return "null";
+
+        case MAXAVRO_CODEC_DEFLATE:
+            return "deflate";
+
+        case MAXAVRO_CODEC_SNAPPY:
+            return "snappy";
+
+        default:
+            return "unknown";
+    }
+}
+
+/**
+ * @brief Make sure the decompressed data block buffer is large enough
+ *
+ * @param file File being read
+ * @param size Required size of the buffer
+ * @return True if the buffer is large enough
+ */
+static bool reserve_buffer(MAXAVRO_FILE *file, size_t size)
+{
+    if (size > file->buffersize)
+    {
+        void *tmp = realloc(file->buffer, size);
+
+        if (tmp == NULL)
+        {
+            file->last_error = MAXAVRO_ERR_MEMORY;
+            return false;
+        }
+
+        file->buffer = tmp;
+        file->buffersize = size;
+    }
+    return true;
+}
+
+/**
+ * @brief Decompress a deflate compressed data block
+ *
+ * The deflate codec stores the data as raw deflate data without the zlib
+ * header and checksum.
+ *
+ * @param file File being read
+ * @param src Compressed data
+ * @param len Length of the compressed data
+ * @param dest_len Length of the decompressed data
+ * @return True if the data was decompressed
+ */
+static bool inflate_block(MAXAVRO_FILE *file, uint8_t *src, size_t len, size_t *dest_len)
+{
+    z_stream stream;
+    int rc = Z_OK;
+
+    memset(&stream, 0, sizeof(stream));
+
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+    {
+        file->last_error = MAXAVRO_ERR_MEMORY;
+        return false;
+    }
+
+    stream.next_in = src;
+    stream.avail_in = len;
+
+    while (rc == Z_OK)
+    {
+        if (stream.total_out == file->buffersize &&
+            !reserve_buffer(file, file->buffersize ? file->buffersize * 2 : len * 4))
+        {
+            break;
+        }
+
+        stream.next_out = file->buffer + stream.total_out;
+        stream.avail_out = file->buffersize - stream.total_out;
+        rc = inflate(&stream, Z_NO_FLUSH);
+    }
+
+    *dest_len = stream.total_out;
+    inflateEnd(&stream);
+
+    if (rc != Z_STREAM_END && file->last_error == MAXAVRO_ERR_NONE)
+    {
+        MXS_ERROR("Failed to decompress deflate data block in '%s': %s", file->filename,
+                  stream.msg ? stream.msg : "corrupted data");
+        file->last_error = MAXAVRO_ERR_CODEC;
+    }
+
+    return rc == Z_STREAM_END;
+}
+
+/**
+ * @brief Decompress a snappy compressed data block
+ *
+ * The snappy codec stores the compressed data followed by the big-endian
+ * CRC32 checksum of the uncompressed data.
+ *
+ * @param file File being read
+ * @param src Compressed data
+ * @param len Length of the compressed data including the checksum
+ * @param dest_len Length of the decompressed data
+ * @return True if the data was decompressed
+ */
+static bool snappy_block(MAXAVRO_FILE *file, uint8_t *src, size_t len, size_t *dest_len)
+{
+#ifdef HAVE_SNAPPY
+    if (len >= SNAPPY_CRC_SIZE)
+    {
+        uint8_t *crc = src + len - SNAPPY_CRC_SIZE;
+        len -= SNAPPY_CRC_SIZE;
+
+        if (snappy_uncompressed_length((char*)src, len, dest_len) == SNAPPY_OK)
+        {
+            if (!reserve_buffer(file, *dest_len))
+            {
+                return false;
+            }
+
+            if (snappy_uncompress((char*)src, len, (char*)file->buffer, dest_len) == SNAPPY_OK &&
+                crc32(0, file->buffer, *dest_len) ==
+                ((uint32_t)crc[0] << 24 | crc[1] << 16 | crc[2] << 8 | crc[3]))
+            {
+                return true;
+            }
+        }
+    }
+
+    MXS_ERROR("Failed to decompress snappy data block in '%s'.", file->filename);
+#endif
+    file->last_error = MAXAVRO_ERR_CODEC;
+    return false;
+}
+
+/**
+ * @brief Decompress the current data block of a compressed file
+ *
+ * The records of a compressed data block are read from the decompressed
+ * block. The block is decompressed only when the first record is read so
+ * that the blocks sent as-is to binary clients are never decompressed.
+ *
+ * @param file File being read
+ * @return True if the records of the block can be read
+ */
+bool maxavro_datablock_load(MAXAVRO_FILE *file)
+{
+    if (file->codec == MAXAVRO_CODEC_NULL || file->data != file->file)
+    {
+        return true;
+    }
+
+    uint8_t *src = malloc(file->block_size);
+    size_t len = 0;
+    bool rval = false;
+
+    if (src == NULL)
+    {
+        file->last_error = MAXAVRO_ERR_MEMORY;
+        return false;
+    }
+
+    fseek(file->file, file->data_start_pos, SEEK_SET);
+
+    if (fread(src, 1, file->block_size, file->file) != file->block_size)
+    {
+        if (ferror(file->file))
+        {
+            MXS_ERROR("Failed to read file '%s': %d %s", file->filename, errno, strerror(errno));
+            file->last_error = MAXAVRO_ERR_IO;
+        }
+        else
+        {
+            /** The block is still being written */
+            clearerr(file->file);
+            fseek(file->file, file->data_start_pos, SEEK_SET);
+        }
+    }
+    else if ((file->codec == MAXAVRO_CODEC_DEFLATE ?
+              inflate_block(file, src, file->block_size, &len) :
+              snappy_block(file, src, file->block_size, &len)) &&
+             reserve_buffer(file, 1))
+    {
+        /** An empty block still needs a readable stream */
+        if ((file->data = fmemopen(file->buffer, len > 0 ? len : 1, "rb")))
+        {
+            rval = true;
+        }
+        else
+        {
+            file->data = file->file;
+            file->last_error = MAXAVRO_ERR_MEMORY;
+        }
+    }
+
+    free(src);
+    return rval;
+}
@@ -17,9 +17,12 @@
 #include <skygw_debug.h>
 #include <log_manager.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <math.h>
 
 bool maxavro_read_datablock_start(MAXAVRO_FILE *file);
 bool maxavro_verify_block(MAXAVRO_FILE *file);
+bool maxavro_datablock_load(MAXAVRO_FILE *file);
 const char* type_to_string(enum maxavro_value_type type);
 
 /**
@@ -38,7 +41,7 @@ static json_t* read_and_pack_value(MAXAVRO_FILE *file, MAXAVRO_SCHEMA_FIELD *fie
         case MAXAVRO_TYPE_BOOL:
         {
             int i = 0;
-            if (fread(&i, 1, 1, file->file) == 1)
+            if (fread(&i, 1, 1, file->data) == 1)
             {
                 value = json_pack("b", i);
             }
@@ -151,7 +154,8 @@ json_t* maxavro_record_read_json(MAXAVRO_FILE *file)
 
     json_t* object = NULL;
 
-    if (file->records_read_from_block < file->records_in_block)
+    if (file->records_read_from_block < file->records_in_block &&
+        maxavro_datablock_load(file))
     {
         object = json_object();
 
@@ -185,8 +189,381 @@ json_t* maxavro_record_read_json(MAXAVRO_FILE *file)
     return object;
 }
 
+/**
+ * @brief Make room for more data in a JSON buffer
+ *
+ * @param buf Buffer to grow
+ * @param len Number of bytes that will be appended to the buffer
+ * @return True if the buffer has room for @p len more bytes
+ */
+static bool json_buffer_reserve(MAXAVRO_JSON_BUFFER *buf, size_t len)
+{
+    if (buf->len + len + 1 > buf->size)
+    {
+        size_t size = buf->size ? buf->size : 256;
+
+        while (buf->len + len + 1 > size)
+        {
+            size *= 2;
+        }
+
+        char *data = realloc(buf->data, size);
+
+        if (data == NULL)
+        {
+            return false;
+        }
+
+        buf->data = data;
+        buf->size = size;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Append a string to a JSON buffer
+ *
+ * @param buf Buffer to append to
+ * @param str String to append
+ * @param len Length of @p str
+ * @return True if the string was appended
+ */
+static bool json_buffer_append(MAXAVRO_JSON_BUFFER *buf, const char *str, size_t len)
+{
+    if (!json_buffer_reserve(buf, len))
+    {
+        return false;
+    }
+
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    return true;
+}
+
+/**
+ * @brief Append a quoted and escaped JSON string to a JSON buffer
+ *
+ * The escaping is the same that json_dumps does without any flags. The
+ * source may point into the reserved part of the buffer as long as it is
+ * past the space the escaped string can take.
+ *
+ * @param buf Buffer to append to
+ * @param str String to append
+ * @param len Length of @p str
+ */
+static void json_buffer_append_quoted(MAXAVRO_JSON_BUFFER *buf, const char *str, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *dest = buf->data + buf->len;
+
+    *dest++ = '"';
+
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = str[i];
+
+        switch (c)
+        {
+            case '"':
+            case '\\':
+                *dest++ = '\\';
+                *dest++ = c;
+                break;
+
+            case '\b':
+                *dest++ = '\\';
+                *dest++ = 'b';
+                break;
+
+            case '\f':
+                *dest++ = '\\';
+                *dest++ = 'f';
+                break;
+
+            case '\n':
+                *dest++ = '\\';
+                *dest++ = 'n';
+                break;
+
+            case '\r':
+                *dest++ = '\\';
+                *dest++ = 'r';
+                break;
+
+            case '\t':
+                *dest++ = '\\';
+                *dest++ = 't';
+                break;
+
+            default:
+                if (c < 0x20)
+                {
+                    memcpy(dest, "\\u00", 4);
+                    dest[4] = hex[c >> 4];
+                    dest[5] = hex[c & 0xf];
+                    dest += 6;
+                }
+                else
+                {
+                    *dest++ = c;
+                }
+                break;
+        }
+    }
+
+    *dest++ = '"';
+    buf->len = dest - buf->data;
+}
+
+/**
+ * @brief Read a string value and append it to a JSON buffer
+ *
+ * The raw string is read into the end of the reserved space and escaped
+ * from there, so no temporary copy of the string is needed.
+ *
+ * @param file File to read from
+ * @param buf Buffer to append to
+ * @return True if the value was read
+ */
+static bool read_json_string(MAXAVRO_FILE *file, MAXAVRO_JSON_BUFFER *buf)
+{
+    uint64_t len;
+
+    if (!maxavro_read_integer(file, &len))
+    {
+        return false;
+    }
+
+    /** At most six bytes per character and the quotes, followed by the raw value */
+    size_t escaped = len * 6 + 2;
+
+    if (!json_buffer_reserve(buf, escaped + len))
+    {
+        file->last_error = MAXAVRO_ERR_MEMORY;
+        return false;
+    }
+
+    char *raw = buf->data + buf->len + escaped;
+    size_t nread = fread(raw, 1, len, file->data);
+
+    if (nread != len)
+    {
+        if (nread != 0)
+        {
+            file->last_error = MAXAVRO_ERR_IO;
+        }
+        return false;
+    }
+
+    json_buffer_append_quoted(buf, raw, len);
+    return true;
+}
+
+/**
+ * @brief Read a single value and append it to a JSON buffer
+ *
+ * @param file File to read from
+ * @param field The field of the value
+ * @param buf Buffer to append to
+ * @param integer Where integer and enum values are stored, may be NULL
+ * @return True if the value was read
+ */
+static bool read_json_value(MAXAVRO_FILE *file, MAXAVRO_SCHEMA_FIELD *field,
+                            MAXAVRO_JSON_BUFFER *buf, uint64_t *integer)
+{
+    char str[64];
+    int len = 0;
+
+    switch (field->type)
+    {
+        case MAXAVRO_TYPE_BOOL:
+        {
+            uint8_t b;
+
+            if (fread(&b, 1, 1, file->data) != 1)
+            {
+                return false;
+            }
+            len = snprintf(str, sizeof(str), "%s", b ? "true" : "false");
+        }
+        break;
+
+        case MAXAVRO_TYPE_INT:
+        case MAXAVRO_TYPE_LONG:
+        {
+            uint64_t val = 0;
+
+            if (!maxavro_read_integer(file, &val))
+            {
+                return false;
+            }
+
+            if (integer)
+            {
+                *integer = val;
+            }
+            len = snprintf(str, sizeof(str), "%lld", (long long)val);
+        }
+        break;
+
+        case MAXAVRO_TYPE_ENUM:
+        {
+            uint64_t val = 0;
+            json_t *arr = field->extra;
+            ss_dassert(arr);
+            ss_dassert(json_is_array(arr));
+
+            if (!maxavro_read_integer(file, &val) || val >= json_array_size(arr))
+            {
+                return false;
+            }
+
+            if (integer)
+            {
+                *integer = val;
+            }
+
+            const char *symbol = json_string_value(json_array_get(arr, val));
+            size_t symlen = strlen(symbol);
+
+            if (!json_buffer_reserve(buf, symlen * 6 + 2))
+            {
+                return false;
+            }
+
+            json_buffer_append_quoted(buf, symbol, symlen);
+            return true;
+        }
+
+        case MAXAVRO_TYPE_FLOAT:
+        case MAXAVRO_TYPE_DOUBLE:
+        {
+            double d = 0;
+
+            if (!maxavro_read_double(file, &d))
+            {
+                return false;
+            }
+
+            if (isfinite(d))
+            {
+                /** Same format as json_dumps uses for reals */
+                len = snprintf(str, sizeof(str), "%.17g", d);
+
+                if (strspn(str, "-0123456789") == (size_t)len)
+                {
+                    strcat(str, ".0");
+                    len += 2;
+                }
+            }
+            else
+            {
+                len = snprintf(str, sizeof(str), "null");
+            }
+        }
+        break;
+
+        case MAXAVRO_TYPE_BYTES:
+        case MAXAVRO_TYPE_STRING:
+            return read_json_string(file, buf);
+
+        default:
+            MXS_ERROR("Unimplemented type: %d", field->type);
+            return false;
+    }
+
+    return json_buffer_append(buf, str, len);
+}
+
+/**
+ * @brief Read a record and encode it as a JSON string
+ *
+ * The record is encoded straight from the data block into the buffer without
+ * building a JSON object first. The output is identical to what json_dumps
+ * produces for the object returned by maxavro_record_read_json with the
+ * JSON_PRESERVE_ORDER flag. The buffer is reused by the following calls, so
+ * a single buffer can be used to encode any number of records.
+ *
+ * @param file File to read from
+ * @param buf Buffer where the record is stored, must be zero initialized
+ * before the first call and freed with maxavro_json_buffer_free
+ * @param integers Array of file->schema->num_fields values where the values
+ * of integer and enum fields are stored, may be NULL
+ * @return True if a record was read, false at the end of the data block or
+ * if an error occurred
+ */
+bool maxavro_record_read_json_string(MAXAVRO_FILE *file, MAXAVRO_JSON_BUFFER *buf,
+                                     uint64_t *integers)
+{
+    if ((!file->metadata_read && !maxavro_read_datablock_start(file)) ||
+        file->records_read_from_block >= file->records_in_block ||
+        !maxavro_datablock_load(file))
+    {
+        return false;
+    }
+
+    buf->len = 0;
+    json_buffer_append(buf, "{", 1);
+
+    for (size_t i = 0; i < file->schema->num_fields; i++)
+    {
+        MAXAVRO_SCHEMA_FIELD *field = &file->schema->fields[i];
+        size_t namelen = strlen(field->name);
+
+        if (!json_buffer_reserve(buf, namelen * 6 + 6) ||
+            (i > 0 && !json_buffer_append(buf, ", ", 2)))
+        {
+            file->last_error = MAXAVRO_ERR_MEMORY;
+            return false;
+        }
+
+        json_buffer_append_quoted(buf, field->name, namelen);
+        json_buffer_append(buf, ": ", 2);
+
+        if (!read_json_value(file, field, buf, integers ? &integers[i] : NULL))
+        {
+            long pos = ftell(file->file);
+            MXS_ERROR("Failed to read field value '%s', type '%s' at "
+                      "file offset %ld, record numer %lu.",
+                      field->name, type_to_string(field->type),
+                      pos, file->records_read);
+            return false;
+        }
+    }
+
+    if (!json_buffer_append(buf, "}", 1))
+    {
+        file->last_error = MAXAVRO_ERR_MEMORY;
+        return false;
+    }
+
+    buf->data[buf->len] = '\0';
+    file->records_read_from_block++;
+    file->records_read++;
+    return true;
+}
+
+/**
+ * @brief Free the memory of a JSON buffer
+ *
+ * @param buf Buffer to free
+ */
+void maxavro_json_buffer_free(MAXAVRO_JSON_BUFFER *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->size = 0;
+}
+
 static void skip_record(MAXAVRO_FILE *file)
 {
+    if (!maxavro_datablock_load(file))
+    {
+        return;
+    }
+
     for (size_t i = 0; i < file->schema->num_fields; i++)
     {
         skip_value(file, file->schema->fields[i].type);
@@ -254,7 +631,6 @@ bool maxavro_record_seek(MAXAVRO_FILE *file, uint64_t offset)
         {
             /** Skip full blocks that don't have the position we want */
             offset -= file->records_in_block;
-            fseek(file->file, file->block_size, SEEK_CUR);
             maxavro_next_block(file);
         }
 
@@ -286,6 +662,36 @@ bool maxavro_record_set_pos(MAXAVRO_FILE *file, long pos)
     return maxavro_verify_block(file) && maxavro_read_datablock_start(file);
 }
 
+/**
+ * @brief Get the file range of the current data block
+ *
+ * The range covers the complete binary data block and the sync marker that
+ * follows it, i.e. the same data that maxavro_record_read_binary returns, so
+ * that the block can be sent straight from the file. The position of the file
+ * is not changed, call maxavro_next_block once the block has been sent.
+ *
+ * @param file File to read from
+ * @param offset Offset of the block in the file
+ * @param len Length of the block and the sync marker
+ * @return True if the whole block is in the file, false if the block is
+ * still being written or an error occurred
+ */
+bool maxavro_record_binary_range(MAXAVRO_FILE *file, off_t *offset, size_t *len)
+{
+    struct stat st;
+
+    if (file->last_error != MAXAVRO_ERR_NONE ||
+        (!file->metadata_read && !maxavro_read_datablock_start(file)))
+    {
+        return false;
+    }
+
+    *offset = file->block_start_pos;
+    *len = (file->data_start_pos - file->block_start_pos) + file->block_size + SYNC_MARKER_SIZE;
+
+    return fstat(fileno(file->file), &st) == 0 && st.st_size >= *offset + (off_t)*len;
+}
+
 /**
  * @brief Read native Avro data
  *
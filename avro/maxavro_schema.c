@@ -91,6 +91,12 @@ static enum maxavro_value_type unpack_to_type(json_t *object,
         type = tmp;
     }
 
+    if (json_is_string(object))
+    {
+        /** A primitive type given by its name */
+        type = object;
+    }
+
     if (type && json_is_string(type))
     {
         const char *value = json_string_value(type);
@@ -35,7 +35,7 @@ uint64_t maxavro_encode_integer(uint8_t* buffer, uint64_t val)
     uint64_t encval = encode_long(val);
     uint8_t nbytes = 0;
 
-    while (more_bytes(encval))
+    while (encval > 0x7f)
     {
         buffer[nbytes++] = 0x80 | (0x7f & encval);
         encval >>= 7;
@@ -64,7 +64,7 @@ uint64_t maxavro_encode_string(uint8_t* dest, const char* str)
 {
     uint64_t slen = strlen(str);
     uint64_t ilen = maxavro_encode_integer(dest, slen);
-    memcpy(dest, str, slen);
+    memcpy(dest + ilen, str, slen);
     return slen + ilen;
 }
 
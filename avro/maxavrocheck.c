@@ -13,6 +13,9 @@
 
 /**
  * @file maxavrocheck.c - Simple Avro file validator
+ *
+ * With the --jobs option the files are checked by several threads and the
+ * total throughput is reported once all files are checked.
  */
 
 #include <maxavro.h>
@@ -23,16 +26,40 @@
 #include <errno.h>
 #include <limits.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 #include <skygw_debug.h>
 
 static int verbose = 0;
 static uint64_t seekto = 0;
 static int64_t num_rows = -1;
 static bool dump = false;
+static int jobs = 1;
+
+/** Totals of the checked files */
+typedef struct
+{
+    uint64_t blocks;
+    uint64_t records;
+    uint64_t bytes;
+} CHECK_STATS;
+
+/** The files shared by the checking threads */
+typedef struct
+{
+    char **files;
+    int n_files;
+    int next;           /*< Next file to check */
+    int rval;
+    CHECK_STATS stats;
+    pthread_mutex_t lock;
+} CHECK_QUEUE;
 
-int check_file(const char* filename)
+int check_file(const char* filename, CHECK_STATS *stats)
 {
-    MAXAVRO_FILE *file = maxavro_file_open(filename);
+    MAXAVRO_FILE *file = filename ? maxavro_file_open(filename) : NULL;
+    uint64_t seek = seekto;
+    int64_t rows = num_rows;
 
     if (!file)
     {
@@ -41,7 +68,7 @@ int check_file(const char* filename)
 
     int rval = 0;
 
-    if (!dump)
+    if (!dump && jobs == 1)
     {
         printf("File sync marker: ");
         for (int i = 0; i < sizeof(file->sync); i++)
@@ -57,25 +84,26 @@ int check_file(const char* filename)
      * which can be checked to make sure the file is not corrupted. */
     do
     {
-        if (seekto > 0)
+        if (seek > 0)
         {
-            maxavro_record_seek(file, seekto);
-            seekto = 0;
+            maxavro_record_seek(file, seek);
+            seek = 0;
         }
 
         if (verbose > 1 || dump)
         {
             json_t* row;
-            while (num_rows != 0 && (row = maxavro_record_read_json(file)))
+            while (rows != 0 && (row = maxavro_record_read_json(file)))
             {
                 char *json = json_dumps(row, JSON_PRESERVE_ORDER);
                 if (json)
                 {
                     printf("%s\n", json);
+                    free(json);
                     json_decref(row);
-                    if (num_rows > 0)
+                    if (rows > 0)
                     {
-                        num_rows--;
+                        rows--;
                     }
                 }
                 else
@@ -92,7 +120,7 @@ int check_file(const char* filename)
                    file->records_in_block, file->block_size);
         }
     }
-    while (num_rows != 0 && maxavro_next_block(file));
+    while (rows != 0 && maxavro_next_block(file));
 
     if (maxavro_get_error(file) != MAXAVRO_ERR_NONE)
     {
@@ -107,17 +135,120 @@ int check_file(const char* filename)
                file->blocks_read, file->records_read, file->bytes_read);
     }
 
+    stats->blocks += file->blocks_read;
+    stats->records += file->records_read;
+    stats->bytes += file->bytes_read;
 
     maxavro_file_close(file);
     return rval;
 }
 
+/**
+ * Check files until all files are checked
+ *
+ * @param data The shared file queue
+ * @return Always NULL
+ */
+static void* check_thread(void *data)
+{
+    CHECK_QUEUE *queue = (CHECK_QUEUE*)data;
+    CHECK_STATS stats = {0, 0, 0};
+    int rval = 0;
+    char pathbuf[PATH_MAX + 1];
+
+    while (true)
+    {
+        pthread_mutex_lock(&queue->lock);
+        int i = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (i >= queue->n_files)
+        {
+            break;
+        }
+
+        if (check_file(realpath(queue->files[i], pathbuf), &stats))
+        {
+            printf("Failed to process file: %s\n", queue->files[i]);
+            rval = 1;
+        }
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->stats.blocks += stats.blocks;
+    queue->stats.records += stats.records;
+    queue->stats.bytes += stats.bytes;
+    queue->rval |= rval;
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/**
+ * Check the files with several threads and report the throughput
+ *
+ * @param files The files
+ * @param n_files Number of files
+ * @return 0 if all files were valid
+ */
+static int check_parallel(char **files, int n_files)
+{
+    CHECK_QUEUE queue = {files, n_files, 0, 0, {0, 0, 0}};
+    pthread_t threads[jobs];
+    int started = 0;
+    double start = now();
+
+    pthread_mutex_init(&queue.lock, NULL);
+
+    for (int i = 0; i < jobs; i++)
+    {
+        if (pthread_create(&threads[started], NULL, check_thread, &queue) == 0)
+        {
+            started++;
+        }
+    }
+
+    if (started == 0)
+    {
+        printf("Failed to start the checking threads.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    double secs = now() - start;
+
+    if (secs <= 0)
+    {
+        secs = 0.000001;
+    }
+
+    printf("Checked %d files with %d threads in %.3f seconds: %lu blocks, %lu records, "
+           "%lu bytes, %.0f records/s, %.2f MiB/s\n", n_files, started, secs,
+           queue.stats.blocks, queue.stats.records, queue.stats.bytes,
+           queue.stats.records / secs, queue.stats.bytes / secs / 1024 / 1024);
+
+    pthread_mutex_destroy(&queue.lock);
+    return queue.rval;
+}
+
 static struct option long_options[] =
 {
     {"verbose",   no_argument, 0, 'v'},
     {"dump",  no_argument, 0, 'd'},
-    {"from",  no_argument, 0, 'f'},
-    {"count", no_argument, 0, 'c'},
+    {"from",  required_argument, 0, 'f'},
+    {"count", required_argument, 0, 'c'},
+    {"jobs", required_argument, 0, 'j'},
     {0, 0, 0, 0}
 };
 
@@ -126,14 +257,14 @@ int main(int argc, char** argv)
 
     if (argc < 2)
     {
-        printf("Usage: %s FILE\n", argv[0]);
+        printf("Usage: %s [-v] [-d] [-f RECORD] [-c COUNT] [-j JOBS] FILE...\n", argv[0]);
         return 1;
     }
 
     char c;
     int option_index;
 
-    while ((c = getopt_long(argc, argv, "vdf:c:", long_options, &option_index)) >= 0)
+    while ((c = getopt_long(argc, argv, "vdf:c:j:", long_options, &option_index)) >= 0)
     {
         switch (c)
         {
@@ -149,14 +280,35 @@ int main(int argc, char** argv)
             case 'c':
                 num_rows = strtol(optarg, NULL, 10);
                 break;
+            case 'j':
+                jobs = strtol(optarg, NULL, 10);
+                break;
+        }
+    }
+
+    if (jobs < 1)
+    {
+        printf("The number of jobs must be at least 1.\n");
+        return 1;
+    }
+    else if (jobs > 1)
+    {
+        if (verbose || dump)
+        {
+            printf("The --verbose and --dump options can't be used with --jobs.\n");
+            return 1;
         }
+
+        return check_parallel(argv + optind, argc - optind);
     }
 
     int rval = 0;
     char pathbuf[PATH_MAX + 1];
+    CHECK_STATS stats = {0, 0, 0};
+
     for (int i = optind; i < argc; i++)
     {
-        if (check_file(realpath(argv[i], pathbuf)))
+        if (check_file(realpath(argv[i], pathbuf), &stats))
         {
             printf("Failed to process file: %s\n", argv[i]);
             rval = 1;
@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file maxavro_benchmark.c - Encoding and decoding speed of maxavro
+ *
+ * Measures the speed of encoding and reading values, writing and reading data
+ * blocks and converting records to JSON. The benchmarks are run on synthetic
+ * records that look like the records the avrorouter creates. Avro files given
+ * on the command line, e.g. files captured from a running avrorouter, are
+ * also read with all the reading methods.
+ *
+ * Usage: maxavro_benchmark [-n RECORDS] [-b BLOCK_RECORDS] [-c CODEC] [FILE...]
+ */
+
+#include <maxavro.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+/** The schema of the synthetic records */
+static const char bench_schema[] =
+    "{\"namespace\": \"MaxScaleChangeDataSchema.avro\", \"type\": \"record\", "
+    "\"name\": \"ChangeRecord\", \"fields\": ["
+    "{\"name\": \"domain\", \"type\": \"int\"}, "
+    "{\"name\": \"server_id\", \"type\": \"int\"}, "
+    "{\"name\": \"sequence\", \"type\": \"int\"}, "
+    "{\"name\": \"event_number\", \"type\": \"int\"}, "
+    "{\"name\": \"timestamp\", \"type\": \"int\"}, "
+    "{\"name\": \"event_type\", \"type\": {\"type\": \"enum\", \"name\": \"EVENT_TYPES\", "
+    "\"symbols\": [\"insert\", \"update_before\", \"update_after\", \"delete\"]}}, "
+    "{\"name\": \"id\", \"type\": \"long\"}, "
+    "{\"name\": \"name\", \"type\": \"string\"}, "
+    "{\"name\": \"amount\", \"type\": \"double\"}]}";
+
+/** Largest encoded size of a synthetic record */
+#define BENCH_RECORD_MAX 128
+
+static uint64_t n_records = 1000000;
+static uint64_t block_records = 1000;
+static enum maxavro_codec codec = MAXAVRO_CODEC_NULL;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void report(const char *name, uint64_t records, uint64_t bytes, double start)
+{
+    double secs = now() - start;
+
+    if (secs <= 0)
+    {
+        secs = 0.000001;
+    }
+
+    printf("%-32s %10lu records %8.3f s %12.0f records/s %10.2f MiB/s\n", name, records,
+           secs, records / secs, bytes / secs / 1024 / 1024);
+}
+
+static void make_name(char *dest, size_t size, uint64_t i)
+{
+    snprintf(dest, size, "customer-%lu", i);
+}
+
+/** Encode the synthetic records into a buffer */
+static size_t bench_encode(uint8_t *buffer)
+{
+    double start = now();
+    uint8_t *ptr = buffer;
+    char name[64];
+
+    for (uint64_t i = 0; i < n_records; i++)
+    {
+        make_name(name, sizeof(name), i);
+        ptr += maxavro_encode_integer(ptr, 0);
+        ptr += maxavro_encode_integer(ptr, 1);
+        ptr += maxavro_encode_integer(ptr, i / 10);
+        ptr += maxavro_encode_integer(ptr, i % 10);
+        ptr += maxavro_encode_integer(ptr, 1476500000 + i / 100);
+        ptr += maxavro_encode_integer(ptr, i % 4);
+        ptr += maxavro_encode_integer(ptr, i * 7);
+        ptr += maxavro_encode_string(ptr, name);
+        ptr += maxavro_encode_double(ptr, i * 1.5);
+    }
+
+    report("maxavro_encode_*", n_records, ptr - buffer, start);
+    return ptr - buffer;
+}
+
+/** Read the values of the synthetic records back */
+static bool bench_read_values(uint8_t *buffer, size_t len)
+{
+    MAXAVRO_FILE file;
+    memset(&file, 0, sizeof(file));
+    file.filename = "memory";
+
+    if ((file.data = fmemopen(buffer, len, "rb")) == NULL)
+    {
+        printf("Failed to open memory stream.\n");
+        return false;
+    }
+
+    double start = now();
+    bool rval = true;
+
+    for (uint64_t i = 0; i < n_records && rval; i++)
+    {
+        uint64_t val;
+        double d;
+        char *str;
+
+        for (int j = 0; j < 7 && rval; j++)
+        {
+            rval = maxavro_read_integer(&file, &val);
+        }
+
+        if (rval && (str = maxavro_read_string(&file)))
+        {
+            free(str);
+            rval = maxavro_read_double(&file, &d);
+        }
+        else
+        {
+            rval = false;
+        }
+    }
+
+    if (rval)
+    {
+        report("maxavro_read_*", n_records, len, start);
+    }
+    else
+    {
+        printf("Failed to read the encoded values.\n");
+    }
+
+    fclose(file.data);
+    return rval;
+}
+
+/** Write the file header with the schema, the codec and a sync marker */
+static bool write_header(MAXAVRO_FILE *file)
+{
+    for (int i = 0; i < SYNC_MARKER_SIZE; i++)
+    {
+        file->sync[i] = rand();
+    }
+
+    return fwrite(avro_magic, 1, AVRO_MAGIC_SIZE, file->file) == AVRO_MAGIC_SIZE &&
+           maxavro_write_integer(file->file, 2) &&
+           maxavro_write_string(file->file, "avro.schema") &&
+           maxavro_write_string(file->file, bench_schema) &&
+           maxavro_write_string(file->file, "avro.codec") &&
+           maxavro_write_string(file->file, maxavro_codec_to_string(file->codec)) &&
+           maxavro_write_integer(file->file, 0) &&
+           fwrite(file->sync, 1, SYNC_MARKER_SIZE, file->file) == SYNC_MARKER_SIZE;
+}
+
+/** Write the synthetic records into an Avro file */
+static bool bench_write_blocks(const char *path)
+{
+    MAXAVRO_FILE file;
+    memset(&file, 0, sizeof(file));
+    file.codec = codec;
+
+    if ((file.file = fopen(path, "wb")) == NULL || !write_header(&file))
+    {
+        printf("Failed to create file '%s'.\n", path);
+        return false;
+    }
+
+    MAXAVRO_DATABLOCK *block = maxavro_datablock_allocate(&file, block_records * BENCH_RECORD_MAX);
+    double start = now();
+    bool rval = block != NULL;
+    char name[64];
+
+    for (uint64_t i = 0; i < n_records && rval; i++)
+    {
+        make_name(name, sizeof(name), i);
+        rval = maxavro_datablock_add_integer(block, 0) &&
+               maxavro_datablock_add_integer(block, 1) &&
+               maxavro_datablock_add_integer(block, i / 10) &&
+               maxavro_datablock_add_integer(block, i % 10) &&
+               maxavro_datablock_add_integer(block, 1476500000 + i / 100) &&
+               maxavro_datablock_add_integer(block, i % 4) &&
+               maxavro_datablock_add_integer(block, i * 7) &&
+               maxavro_datablock_add_string(block, name) &&
+               maxavro_datablock_add_double(block, i * 1.5);
+        block->records++;
+
+        if (rval && (block->records == block_records || i == n_records - 1))
+        {
+            rval = maxavro_datablock_finalize(block);
+        }
+    }
+
+    rval = fflush(file.file) == 0 && rval;
+
+    if (rval)
+    {
+        char title[64];
+        snprintf(title, sizeof(title), "block write (%s)", maxavro_codec_to_string(codec));
+        report(title, n_records, ftell(file.file), start);
+    }
+    else
+    {
+        printf("Failed to write data blocks to '%s'.\n", path);
+    }
+
+    maxavro_datablock_free(block);
+    fclose(file.file);
+    return rval;
+}
+
+/** The ways a file can be read */
+enum bench_read
+{
+    BENCH_READ_BLOCKS,
+    BENCH_READ_BINARY,
+    BENCH_READ_JSON,
+    BENCH_READ_JSON_STRING
+};
+
+static const char* bench_read_names[] =
+{
+    "block read",
+    "binary block read",
+    "JSON objects with json_dumps",
+    "JSON strings",
+};
+
+/** Read all records of a file with one of the reading methods */
+static bool bench_read_file(const char *path, enum bench_read type)
+{
+    MAXAVRO_FILE *file = maxavro_file_open(path);
+
+    if (file == NULL)
+    {
+        printf("Failed to open file '%s'.\n", path);
+        return false;
+    }
+
+    MAXAVRO_JSON_BUFFER buf = {NULL, 0, 0};
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    double start = now();
+
+    switch (type)
+    {
+        case BENCH_READ_BLOCKS:
+            do
+            {
+                records += file->records_in_block;
+                bytes += file->block_size;
+            }
+            while (maxavro_next_block(file));
+            break;
+
+        case BENCH_READ_BINARY:
+        {
+            GWBUF *data;
+
+            while ((data = maxavro_record_read_binary(file)))
+            {
+                records = file->records_read;
+                bytes += gwbuf_length(data);
+                gwbuf_free(data);
+            }
+        }
+        break;
+
+        case BENCH_READ_JSON:
+            do
+            {
+                json_t *row;
+
+                while ((row = maxavro_record_read_json(file)))
+                {
+                    char *json = json_dumps(row, JSON_PRESERVE_ORDER);
+                    bytes += json ? strlen(json) : 0;
+                    records++;
+                    free(json);
+                    json_decref(row);
+                }
+            }
+            while (maxavro_next_block(file));
+            break;
+
+        case BENCH_READ_JSON_STRING:
+            do
+            {
+                while (maxavro_record_read_json_string(file, &buf, NULL))
+                {
+                    bytes += buf.len;
+                    records++;
+                }
+            }
+            while (maxavro_next_block(file));
+            break;
+    }
+
+    bool rval = maxavro_get_error(file) == MAXAVRO_ERR_NONE;
+
+    if (rval)
+    {
+        report(bench_read_names[type], records, bytes, start);
+    }
+    else
+    {
+        printf("Failed to read file '%s': %s\n", path, maxavro_get_error_string(file));
+    }
+
+    maxavro_json_buffer_free(&buf);
+    maxavro_file_close(file);
+    return rval;
+}
+
+static bool bench_read_all(const char *path)
+{
+    bool rval = true;
+
+    for (int i = BENCH_READ_BLOCKS; i <= BENCH_READ_JSON_STRING; i++)
+    {
+        rval = bench_read_file(path, i) && rval;
+    }
+
+    return rval;
+}
+
+int main(int argc, char** argv)
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "n:b:c:")) >= 0)
+    {
+        switch (c)
+        {
+            case 'n':
+                n_records = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'b':
+                block_records = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'c':
+                codec = maxavro_get_codec(optarg);
+                break;
+
+            default:
+                printf("Usage: %s [-n RECORDS] [-b BLOCK_RECORDS] [-c CODEC] [FILE...]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (n_records == 0 || block_records == 0 || codec == MAXAVRO_CODEC_UNKNOWN)
+    {
+        printf("Invalid record count, block size or codec.\n");
+        return 1;
+    }
+
+    int rval = 0;
+    uint8_t *buffer = malloc(n_records * BENCH_RECORD_MAX);
+    char path[] = "/tmp/maxavro_benchmark_XXXXXX";
+    int fd = mkstemp(path);
+
+    printf("Synthetic records: %lu records, %lu records per block\n", n_records, block_records);
+
+    if (buffer == NULL || fd == -1)
+    {
+        printf("Failed to allocate memory or create a temporary file.\n");
+        rval = 1;
+    }
+    else if (!bench_read_values(buffer, bench_encode(buffer)) ||
+             !bench_write_blocks(path) || !bench_read_all(path))
+    {
+        rval = 1;
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+        unlink(path);
+    }
+
+    free(buffer);
+
+    for (int i = optind; i < argc; i++)
+    {
+        printf("File %s:\n", argv[i]);
+
+        if (!bench_read_all(argv[i]))
+        {
+            rval = 1;
+        }
+    }
+
+    return rval;
+}
@@ -37,6 +37,7 @@
   check_include_files(sys/ioctl.h HAVE_SYS_IOCTL)
   check_include_files(syslog.h HAVE_SYSLOG)
   check_include_files(sys/param.h HAVE_SYS_PARAM)
+  check_include_files(sys/sdt.h HAVE_SYS_SDT)
   check_include_files(sys/socket.h HAVE_SYS_SOCKET)
   check_include_files(sys/stat.h HAVE_SYS_STAT)
   check_include_files(sys/time.h HAVE_SYS_TIME)
@@ -53,3 +53,6 @@ set(WITH_TCMALLOC FALSE CACHE BOOL "Use tcmalloc as the memory allocator")
 
 # Use jemalloc as the memory allocator
 set(WITH_JEMALLOC FALSE CACHE BOOL "Use jemalloc as the memory allocator")
+
+# Compile the USDT probes, requires sys/sdt.h
+set(WITH_PROBES TRUE CACHE BOOL "Compile the USDT probes for perf and bpftrace")
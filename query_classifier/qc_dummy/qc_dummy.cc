@@ -14,7 +14,7 @@
 #include <modules.h>
 #include <query_classifier.h>
 
-qc_parse_result_t qc_parse(GWBUF* querybuf)
+qc_parse_result_t qc_parse(GWBUF* querybuf, uint32_t collect)
 {
     return QC_QUERY_INVALID;
 }
@@ -91,6 +91,7 @@ static uint32_t resolve_query_type(THD* thd);
 static bool skygw_stmt_causes_implicit_commit(LEX* lex, int* autocommit_stmt);
 
 static int is_autocommit_stmt(LEX* lex);
+static bool is_read_only_trx_stmt(LEX* lex);
 static parsing_info_t* parsing_info_init(void (*donefun)(void *));
 static void parsing_info_set_plain_str(void* ptr, char* str);
 /** Free THD context and close MYSQL */
@@ -124,7 +125,7 @@ bool ensure_query_is_parsed(GWBUF* query)
     return parsed;
 }
 
-qc_parse_result_t qc_parse(GWBUF* querybuf)
+qc_parse_result_t qc_parse(GWBUF* querybuf, uint32_t collect)
 {
     bool parsed = ensure_query_is_parsed(querybuf);
 
@@ -631,6 +632,12 @@ static uint32_t resolve_query_type(THD* thd)
 
     case SQLCOM_BEGIN:
         type |= QUERY_TYPE_BEGIN_TRX;
+#if defined(MYSQL_START_TRANS_OPT_READ_ONLY)
+        if (lex->start_transaction_opt & MYSQL_START_TRANS_OPT_READ_ONLY)
+        {
+            type |= QUERY_TYPE_READ_ONLY_TRX;
+        }
+#endif
         goto return_qtype;
         break;
 
@@ -663,6 +670,16 @@ static uint32_t resolve_query_type(THD* thd)
         goto return_qtype;
         break;
 
+    case SQLCOM_SET_OPTION:
+        type |= QUERY_TYPE_WRITE;
+
+        /** SET TRANSACTION READ ONLY, applies to the next transaction */
+        if (lex->option_type == OPT_DEFAULT && is_read_only_trx_stmt(lex))
+        {
+            type |= QUERY_TYPE_READ_ONLY_TRX;
+        }
+        break;
+
     default:
         type |= QUERY_TYPE_WRITE;
         break;
@@ -1001,6 +1018,36 @@ return_rc:
     return rc;
 }
 
+/**
+ * Checks whether a SET statement makes the next transaction read-only,
+ * that is, whether it is SET TRANSACTION READ ONLY.
+ *
+ * @param lex The parsed SET statement.
+ *
+ * @return True if the last assignment of tx_read_only enables it.
+ */
+static bool is_read_only_trx_stmt(LEX* lex)
+{
+    struct list_node* node;
+    set_var* setvar;
+    Item* item = NULL;
+
+    node = lex->var_list.first_node();
+
+    while ((setvar = (set_var*) node->info) != NULL)
+    {
+        if (setvar->var && setvar->var->name.str &&
+            strcasecmp(setvar->var->name.str, "tx_read_only") == 0)
+        {
+            item = setvar->value;
+        }
+
+        node = node->next;
+    }
+
+    return item != NULL && item->type() == Item::INT_ITEM && item->val_int() != 0;
+}
+
 #if defined(NOT_USED)
 
 char* qc_get_stmtname(GWBUF* buf)
@@ -1008,9 +1055,9 @@ char* qc_get_stmtname(GWBUF* buf)
     MYSQL* mysql;
 
     if (buf == NULL ||
-        buf->gwbuf_bufobj == NULL ||
-        buf->gwbuf_bufobj->bo_data == NULL ||
-        (mysql = (MYSQL *) ((parsing_info_t *) buf->gwbuf_bufobj->bo_data)->pi_handle) == NULL ||
+        buf->sbuf->bufobj == NULL ||
+        buf->sbuf->bufobj->bo_data == NULL ||
+        (mysql = (MYSQL *) ((parsing_info_t *) buf->sbuf->bufobj->bo_data)->pi_handle) == NULL ||
         mysql->thd == NULL ||
         (THD *) (mysql->thd))->lex == NULL ||
         (THD *) (mysql->thd))->lex->prepared_stmt_name == NULL)
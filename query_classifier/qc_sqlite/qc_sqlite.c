@@ -13,15 +13,19 @@
 
 #include <sqliteInt.h>
 
+#include <ctype.h>
 #include <signal.h>
 #include <string.h>
+#include <atomic.h>
 #include <log_manager.h>
+#include <memstats.h>
 #include <modinfo.h>
 #include <mysql_client_server_protocol.h>
 #include <platform.h>
 #include <query_classifier.h>
 #include <skygw_utils.h>
 #include <modutil.h>
+#include <spinlock.h>
 #include "builtin_functions.h"
 
 //#define QC_TRACE_ENABLED
@@ -75,8 +79,12 @@ typedef struct qc_sqlite_info
     char** database_names;           // Array of database names used in the query.
     size_t database_names_len;       // The used entries in database_names.
     size_t database_names_capacity;  // The capacity of database_names.
+    char* strings;                   // The block holding all the strings above.
     int keyword_1;                   // The first encountered keyword.
     int keyword_2;                   // The second encountered keyword.
+    int refcount;                    // The buffers and the cache referring to this.
+    uint32_t collect;                // What was collected, a bitmask of qc_collect_info_t.
+    struct qc_sqlite_info* complete; // The statement parsed with everything collected.
 } QC_SQLITE_INFO;
 
 typedef enum qc_log_level
@@ -88,6 +96,65 @@ typedef enum qc_log_level
 } qc_log_level_t;
 
 
+/**
+ * The default number of classifications cached by each thread.
+ */
+#define QC_CACHE_DEFAULT_SIZE 1024
+
+/**
+ * The longest canonical statement that is cached.
+ */
+#define QC_CACHE_MAX_LEN 2048
+
+/**
+ * A cached classification of a canonical statement.
+ */
+typedef struct qc_cache_entry
+{
+    uint64_t hash;        // The hash of the canonical statement.
+    char* canonical;      // The canonical statement, NULL if the entry is unused.
+    size_t len;           // The length of the canonical statement.
+    QC_SQLITE_INFO* info; // The classification.
+} QC_CACHE_ENTRY;
+
+/**
+ * The cache statistics of a thread.
+ */
+typedef struct qc_cache_thread
+{
+    QC_CACHE_STATS stats;
+    struct qc_cache_thread* next;
+} QC_CACHE_THREAD;
+
+/**
+ * The size of a chunk of the arena of a thread.
+ */
+#define QC_ARENA_CHUNK_SIZE (64 * 1024)
+
+/**
+ * The largest allocation made from the arena, larger ones are made with malloc.
+ */
+#define QC_ARENA_MAX_ALLOC (QC_ARENA_CHUNK_SIZE / 8)
+
+/**
+ * A chunk of the arena of a thread. The allocations follow it.
+ */
+typedef struct qc_arena_chunk
+{
+    size_t used;  // The bytes allocated from the chunk.
+    size_t live;  // The allocations not yet freed.
+    bool retired; // Whether the thread has moved on to another chunk.
+} QC_ARENA_CHUNK;
+
+/**
+ * The header preceding every allocation made by sqlite3.
+ */
+typedef struct qc_arena_header
+{
+    QC_ARENA_CHUNK* chunk; // The chunk of the allocation, NULL if made with malloc.
+    size_t size;           // The size of the allocation.
+} QC_ARENA_HEADER;
+
 /**
  * The state of qc_sqlite.
  */
@@ -95,6 +162,11 @@ static struct
 {
     bool initialized;
     qc_log_level_t log_level;
+    size_t cache_size;              // The number of entries in the cache of a thread.
+    size_t max_parse_len;           // The longest statement parsed in full, 0 if there is no limit.
+    SPINLOCK cache_lock;            // Protects cache_threads and cache_retired.
+    QC_CACHE_THREAD* cache_threads; // The statistics of the running threads.
+    QC_CACHE_STATS cache_retired;   // The statistics of the threads that have ended.
 } this_unit;
 
 /**
@@ -105,6 +177,11 @@ static thread_local struct
     bool initialized;
     sqlite3* db;      // Thread specific database handle.
     QC_SQLITE_INFO* info;
+    QC_CACHE_ENTRY* cache;              // The cached classifications, cache_size entries.
+    QC_CACHE_THREAD* cache_stats;       // The cache statistics of the thread.
+    char canonical[QC_CACHE_MAX_LEN];   // The canonical form of the statement being parsed.
+    QC_ARENA_CHUNK* arena;              // The chunk sqlite3 currently allocates from.
+    bool arena_active;                  // Whether a statement is being parsed.
 } this_thread;
 
 
@@ -165,6 +242,294 @@ static char* mxs_strdup(const char* s1)
     return s2;
 }
 
+/**
+ * The memory that stays within the classifier, unlike the results returned to
+ * the callers, is counted to it in the memory statistics, see memstats.h.
+ */
+static void* qc_malloc(size_t size)
+{
+    void* p = memstats_malloc(MEMSTATS_CLASSIFIER, size);
+    if (!p)
+    {
+        raise(SIGABRT);
+    }
+
+    return p;
+}
+
+static void* qc_calloc(size_t n, size_t size)
+{
+    void* p = memstats_calloc(MEMSTATS_CLASSIFIER, n, size);
+    if (!p)
+    {
+        raise(SIGABRT);
+    }
+
+    return p;
+}
+
+static void qc_free(void* p)
+{
+    memstats_free(MEMSTATS_CLASSIFIER, p);
+}
+
+
+/**
+ * ARENA
+ *
+ * While a statement is being parsed, sqlite3 makes dozens of small allocations
+ * that are all freed before sqlite3_prepare returns. They are made from a chunk
+ * of memory of the thread by bumping a pointer, and freeing them only counts how
+ * many of them are still live. Once none is, the chunk is reused from the start.
+ *
+ * Some allocations, like the error message of the database handle, live past the
+ * statement. A chunk holding such an allocation is not reused but replaced with a
+ * new one when it runs out, and freed once its last allocation is. Outside parsing
+ * and for large allocations, malloc is used.
+ *
+ * A chunk is only used by the thread that owns it, which holds as sqlite3 objects
+ * allocated while parsing belong to the database handle of the thread.
+ */
+
+static QC_ARENA_CHUNK* arena_chunk(size_t needed)
+{
+    if (!this_thread.arena_active || (needed > QC_ARENA_MAX_ALLOC))
+    {
+        return NULL;
+    }
+
+    QC_ARENA_CHUNK* chunk = this_thread.arena;
+
+    if (chunk && (chunk->used + needed > QC_ARENA_CHUNK_SIZE))
+    {
+        if (chunk->live == 0)
+        {
+            chunk->used = 0;
+        }
+        else
+        {
+            chunk->retired = true;
+            chunk = NULL;
+        }
+    }
+
+    if (!chunk && (chunk = memstats_malloc(MEMSTATS_CLASSIFIER, sizeof(*chunk) + QC_ARENA_CHUNK_SIZE)))
+    {
+        chunk->used = 0;
+        chunk->live = 0;
+        chunk->retired = false;
+        this_thread.arena = chunk;
+    }
+
+    return chunk;
+}
+
+static void* arena_malloc(int n)
+{
+    size_t size = ROUND8(n);
+    size_t needed = sizeof(QC_ARENA_HEADER) + size;
+    QC_ARENA_CHUNK* chunk = arena_chunk(needed);
+    QC_ARENA_HEADER* header;
+
+    if (chunk)
+    {
+        header = (QC_ARENA_HEADER*) ((char*) (chunk + 1) + chunk->used);
+        chunk->used += needed;
+        chunk->live++;
+    }
+    else if (!(header = memstats_malloc(MEMSTATS_CLASSIFIER, needed)))
+    {
+        return NULL;
+    }
+
+    header->chunk = chunk;
+    header->size = size;
+
+    return header + 1;
+}
+
+static void arena_free(void* p)
+{
+    if (p)
+    {
+        QC_ARENA_HEADER* header = (QC_ARENA_HEADER*) p - 1;
+        QC_ARENA_CHUNK* chunk = header->chunk;
+
+        if (!chunk)
+        {
+            qc_free(header);
+        }
+        else if (--chunk->live == 0)
+        {
+            if (chunk->retired)
+            {
+                qc_free(chunk);
+            }
+            else
+            {
+                chunk->used = 0;
+            }
+        }
+    }
+}
+
+static void* arena_realloc(void* p, int n)
+{
+    if (!p)
+    {
+        return arena_malloc(n);
+    }
+
+    QC_ARENA_HEADER* header = (QC_ARENA_HEADER*) p - 1;
+    QC_ARENA_CHUNK* chunk = header->chunk;
+    size_t size = ROUND8(n);
+
+    if (!chunk)
+    {
+        if (!this_thread.arena_active)
+        {
+            if (!(header = memstats_realloc(MEMSTATS_CLASSIFIER, header, sizeof(*header) + size)))
+            {
+                return NULL;
+            }
+
+            header->size = size;
+            return header + 1;
+        }
+    }
+    else if (((char*) p + header->size == (char*) (chunk + 1) + chunk->used) &&
+             (chunk->used - header->size + size <= QC_ARENA_CHUNK_SIZE))
+    {
+        // The last allocation of the chunk grows or shrinks in place.
+        chunk->used = chunk->used - header->size + size;
+        header->size = size;
+        return p;
+    }
+
+    void* q = arena_malloc(n);
+
+    if (q)
+    {
+        memcpy(q, p, header->size < size ? header->size : size);
+        arena_free(p);
+    }
+
+    return q;
+}
+
+static int arena_size(void* p)
+{
+    return p ? ((QC_ARENA_HEADER*) p - 1)->size : 0;
+}
+
+static int arena_roundup(int n)
+{
+    return ROUND8(n);
+}
+
+static int arena_init(void* data)
+{
+    return SQLITE_OK;
+}
+
+static void arena_shutdown(void* data)
+{
+}
+
+static const sqlite3_mem_methods arena_methods =
+{
+    arena_malloc,
+    arena_free,
+    arena_realloc,
+    arena_size,
+    arena_roundup,
+    arena_init,
+    arena_shutdown,
+    NULL
+};
+
+/**
+ * Makes sqlite3 allocate from the arena of the thread while a statement is parsed.
+ */
+static void arena_begin(void)
+{
+    ss_dassert(!this_thread.arena_active);
+    this_thread.arena_active = true;
+}
+
+/**
+ * Ends the parsing of a statement. Unless something allocated during the
+ * parsing still lives, the arena is reused from the start.
+ */
+static void arena_end(void)
+{
+    ss_dassert(this_thread.arena_active);
+    this_thread.arena_active = false;
+
+    if (this_thread.arena && (this_thread.arena->live == 0))
+    {
+        this_thread.arena->used = 0;
+    }
+}
+
+/**
+ * Frees the arena of a thread, once the database handle has been closed.
+ */
+static void arena_release(void)
+{
+    QC_ARENA_CHUNK* chunk = this_thread.arena;
+
+    if (chunk)
+    {
+        if (chunk->live == 0)
+        {
+            qc_free(chunk);
+        }
+        else
+        {
+            chunk->retired = true;
+        }
+
+        this_thread.arena = NULL;
+    }
+}
+
+/**
+ * Allocation functions for the strings collected while parsing. They are made
+ * from the arena and copied into a single block once the statement has been
+ * parsed, see info_pack.
+ */
+static void* info_malloc(size_t size)
+{
+    void* p = arena_malloc(size);
+    if (!p)
+    {
+        raise(SIGABRT);
+    }
+
+    return p;
+}
+
+static void* info_realloc(void* p, size_t size)
+{
+    p = arena_realloc(p, size);
+    if (!p)
+    {
+        raise(SIGABRT);
+    }
+
+    return p;
+}
+
+static char* info_strdup(const char* s1)
+{
+    size_t len = strlen(s1) + 1;
+    char* s2 = info_malloc(len);
+    memcpy(s2, s1, len);
+
+    return s2;
+}
+
 
 /**
  * HELPERS
@@ -179,19 +544,32 @@ typedef enum qc_token_position
 
 static void append_affected_field(QC_SQLITE_INFO* info, const char* s);
 static void buffer_object_free(void* data);
-static char** copy_string_array(char** strings, int* pn);
+static const char* cache_canonicalize(const char* query, size_t len, size_t* pLen, uint64_t* pHash);
+static void cache_end(void);
+static QC_SQLITE_INFO* cache_get(const char* canonical, size_t len, uint64_t hash);
+static void cache_init(void);
+static void cache_put(const char* canonical, size_t len, uint64_t hash, QC_SQLITE_INFO* info);
+static bool classify_trivial_query(GWBUF* query, uint32_t* pTypes, qc_query_op_t* pOp);
+static char* compact_query(const char* query, size_t len, size_t* pLen);
+static char** copy_string_array(const char* const* strings, int* pn);
 static void enlarge_string_array(size_t n, size_t len, char*** ppzStrings, size_t* pCapacity);
-static bool ensure_query_is_parsed(GWBUF* query);
-static void free_string_array(char** sa);
-static QC_SQLITE_INFO* get_query_info(GWBUF* query);
-static QC_SQLITE_INFO* info_alloc(void);
+static inline bool collects(const QC_SQLITE_INFO* info, uint32_t collect);
+static bool ensure_query_is_parsed(GWBUF* query, uint32_t collect);
+static QC_SQLITE_INFO* get_query_info(GWBUF* query, uint32_t collect);
+static const char* get_query_string(GWBUF* query, size_t* pLen);
+static QC_SQLITE_INFO* info_alloc(uint32_t collect);
+static QC_SQLITE_INFO* info_complete(GWBUF* query, QC_SQLITE_INFO* info);
 static void info_finish(QC_SQLITE_INFO* info);
 static void info_free(QC_SQLITE_INFO* info);
-static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info);
+static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info, uint32_t collect);
+static void info_pack(QC_SQLITE_INFO* info);
+static QC_SQLITE_INFO* info_ref(QC_SQLITE_INFO* info);
+static void info_release(QC_SQLITE_INFO* info);
 static bool is_submitted_query(const QC_SQLITE_INFO* info, const Parse* pParse);
 static void log_invalid_data(GWBUF* query, const char* message);
-static bool parse_query(GWBUF* query);
-static void parse_query_string(const char* query, size_t len);
+static bool parse_query(GWBUF* query, uint32_t collect);
+static void parse_query_bounded(QC_SQLITE_INFO* info, const char* query, size_t len, bool suppress_logging);
+static void parse_query_string(QC_SQLITE_INFO* info, const char* query, size_t len, bool suppress_logging);
 static bool query_is_parsed(GWBUF* query);
 static bool should_exclude(const char* zName, const ExprList* pExclude);
 static void update_affected_fields(QC_SQLITE_INFO* info,
@@ -248,23 +626,19 @@ extern void maxscaleCollectInfoFromSelect(Parse*, Select*);
  */
 static void buffer_object_free(void* data)
 {
-    info_free((QC_SQLITE_INFO*) data);
+    info_release((QC_SQLITE_INFO*) data);
 }
 
-static char** copy_string_array(char** strings, int* pn)
+static char** copy_string_array(const char* const* strings, int* pn)
 {
-    size_t n = 0;
-
-    char** ss = strings;
     *pn = 0;
 
-    while (*ss)
+    while (strings[*pn])
     {
-        ++ss;
         ++(*pn);
     }
 
-    ss = (char**) mxs_malloc((*pn + 1) * sizeof(char*));
+    char** ss = (char**) mxs_malloc((*pn + 1) * sizeof(char*));
 
     ss[*pn] = 0;
 
@@ -282,68 +656,103 @@ static void enlarge_string_array(size_t n, size_t len, char*** ppzStrings, size_
     {
         int capacity = *pCapacity ? *pCapacity * 2 : 4;
 
-        *ppzStrings = (char**) mxs_realloc(*ppzStrings, capacity * sizeof(char**));
+        *ppzStrings = (char**) info_realloc(*ppzStrings, capacity * sizeof(char**));
         *pCapacity = capacity;
     }
 }
 
-static bool ensure_query_is_parsed(GWBUF* query)
+static inline bool collects(const QC_SQLITE_INFO* info, uint32_t collect)
+{
+    return (info->collect & collect) == collect;
+}
+
+static bool ensure_query_is_parsed(GWBUF* query, uint32_t collect)
 {
     bool parsed = query_is_parsed(query);
 
     if (!parsed)
     {
-        parsed = parse_query(query);
+        parsed = parse_query(query, collect);
     }
 
     return parsed;
 }
 
-static void free_string_array(char** sa)
+static QC_SQLITE_INFO* get_query_info(GWBUF* query, uint32_t collect)
 {
-    if (sa)
+    QC_SQLITE_INFO* info = NULL;
+
+    if (ensure_query_is_parsed(query, collect))
     {
-        char** s = sa;
+        info = (QC_SQLITE_INFO*) gwbuf_get_buffer_object_data(query, GWBUF_PARSING_INFO);
+        ss_dassert(info);
 
-        while (*s)
+        if (!collects(info, collect))
         {
-            free(*s);
-            ++s;
+            info = info_complete(query, info);
         }
-
-        free(sa);
     }
+
+    return info;
 }
 
-static QC_SQLITE_INFO* get_query_info(GWBUF* query)
+static const char* get_query_string(GWBUF* query, size_t* pLen)
 {
-    QC_SQLITE_INFO* info = NULL;
+    // TODO: Somewhere it needs to be ensured that this buffer is contiguous.
+    // TODO: Where is it checked that the GWBUF really contains a query?
+    uint8_t* data = (uint8_t*) GWBUF_DATA(query);
+    *pLen = MYSQL_GET_PACKET_LEN(data) - 1; // Subtract 1 for packet type byte.
 
-    if (ensure_query_is_parsed(query))
-    {
-        info = (QC_SQLITE_INFO*) gwbuf_get_buffer_object_data(query, GWBUF_PARSING_INFO);
-        ss_dassert(info);
-    }
+    return (const char*) &data[5]; // TODO: Are there symbolic constants somewhere?
+}
+
+static QC_SQLITE_INFO* info_alloc(uint32_t collect)
+{
+    QC_SQLITE_INFO* info = qc_malloc(sizeof(*info));
+
+    info_init(info, collect);
 
     return info;
 }
 
-static QC_SQLITE_INFO* info_alloc(void)
+/**
+ * Returns the classification of a statement with everything collected. The
+ * statement was parsed with less collected, so it is parsed again, but only
+ * once however much is asked for later. The classification may be shared with
+ * other buffers and threads, whichever parses it first provides the complete
+ * classification to the others.
+ *
+ * @param query A buffer containing the statement.
+ * @param info  The classification of the statement in the buffer.
+ *
+ * @return The complete classification.
+ */
+static QC_SQLITE_INFO* info_complete(GWBUF* query, QC_SQLITE_INFO* info)
 {
-    QC_SQLITE_INFO* info = mxs_malloc(sizeof(*info));
+    if (info->complete == NULL)
+    {
+        size_t len;
+        const char* s = get_query_string(query, &len);
+        char* compacted = compact_query(s, len, &len);
+        QC_SQLITE_INFO* complete = info_alloc(QC_COLLECT_ALL);
 
-    info_init(info);
+        // Any problems were logged when the statement was parsed the first time.
+        parse_query_bounded(complete, compacted ? compacted : s, len, true);
+        qc_free(compacted);
 
-    return info;
+        if (!__sync_bool_compare_and_swap(&info->complete, NULL, complete))
+        {
+            info_release(complete);
+        }
+    }
+
+    return info->complete;
 }
 
 static void info_finish(QC_SQLITE_INFO* info)
 {
-    free(info->affected_fields);
-    free_string_array(info->table_names);
-    free_string_array(info->table_fullnames);
-    free(info->created_table_name);
-    free_string_array(info->database_names);
+    info_release(info->complete);
+    qc_free(info->strings);
 }
 
 static void info_free(QC_SQLITE_INFO* info)
@@ -351,11 +760,11 @@ static void info_free(QC_SQLITE_INFO* info)
     if (info)
     {
         info_finish(info);
-        free(info);
+        qc_free(info);
     }
 }
 
-static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info)
+static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info, uint32_t collect)
 {
     memset(info, 0, sizeof(*info));
 
@@ -379,153 +788,1433 @@ static QC_SQLITE_INFO* info_init(QC_SQLITE_INFO* info)
     info->database_names = NULL;
     info->database_names_len = 0;
     info->database_names_capacity = 0;
+    info->strings = NULL;
     info->keyword_1 = 0; // Sqlite3 starts numbering tokens from 1, so 0 means
     info->keyword_2 = 0; // that we have not seen a keyword.
+    info->refcount = 1;
+    info->collect = collect;
+    info->complete = NULL;
 
     return info;
 }
 
-static void parse_query_string(const char* query, size_t len)
+static size_t string_array_chars(char** strings, size_t len)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        n += strlen(strings[i]) + 1;
+    }
+
+    return n;
+}
+
+static char* pack_string(char* s, char** ppChars)
+{
+    size_t len = strlen(s) + 1;
+    char* copy = memcpy(*ppChars, s, len);
+
+    *ppChars += len;
+    arena_free(s);
+
+    return copy;
+}
+
+static char** pack_string_array(char** strings, size_t len, char*** ppPtrs, char** ppChars)
+{
+    char** copy = *ppPtrs;
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        copy[i] = pack_string(strings[i], ppChars);
+    }
+
+    copy[len] = NULL;
+    *ppPtrs += len + 1;
+    arena_free(strings);
+
+    return copy;
+}
+
+/**
+ * Moves the strings collected while parsing a statement from the arena into a
+ * single block, the pointer arrays first and the characters after them.
+ *
+ * @param info The classification of a statement that has just been parsed.
+ */
+static void info_pack(QC_SQLITE_INFO* info)
+{
+    size_t n_ptrs = 0;
+    size_t n_chars = 0;
+
+    if (info->table_names)
+    {
+        n_ptrs += info->table_names_len + 1;
+        n_chars += string_array_chars(info->table_names, info->table_names_len);
+    }
+
+    if (info->table_fullnames)
+    {
+        n_ptrs += info->table_fullnames_len + 1;
+        n_chars += string_array_chars(info->table_fullnames, info->table_fullnames_len);
+    }
+
+    if (info->database_names)
+    {
+        n_ptrs += info->database_names_len + 1;
+        n_chars += string_array_chars(info->database_names, info->database_names_len);
+    }
+
+    if (info->affected_fields)
+    {
+        n_chars += info->affected_fields_len + 1;
+    }
+
+    if (info->created_table_name)
+    {
+        n_chars += strlen(info->created_table_name) + 1;
+    }
+
+    if (n_chars != 0 || n_ptrs != 0)
+    {
+        info->strings = qc_malloc(n_ptrs * sizeof(char*) + n_chars);
+
+        char** pPtrs = (char**) info->strings;
+        char* pChars = info->strings + n_ptrs * sizeof(char*);
+
+        if (info->table_names)
+        {
+            info->table_names = pack_string_array(info->table_names, info->table_names_len,
+                                                  &pPtrs, &pChars);
+            info->table_names_capacity = info->table_names_len + 1;
+        }
+
+        if (info->table_fullnames)
+        {
+            info->table_fullnames = pack_string_array(info->table_fullnames, info->table_fullnames_len,
+                                                      &pPtrs, &pChars);
+            info->table_fullnames_capacity = info->table_fullnames_len + 1;
+        }
+
+        if (info->database_names)
+        {
+            info->database_names = pack_string_array(info->database_names, info->database_names_len,
+                                                     &pPtrs, &pChars);
+            info->database_names_capacity = info->database_names_len + 1;
+        }
+
+        if (info->affected_fields)
+        {
+            info->affected_fields = pack_string(info->affected_fields, &pChars);
+            info->affected_fields_capacity = info->affected_fields_len + 1;
+        }
+
+        if (info->created_table_name)
+        {
+            info->created_table_name = pack_string(info->created_table_name, &pChars);
+        }
+    }
+}
+
+/**
+ * Adds a reference to a classification. A classification is immutable once
+ * the statement has been parsed, so the buffers of all statements with the same
+ * canonical form can share it with the cache, also across threads.
+ *
+ * @param info A classification.
+ *
+ * @return The same classification.
+ */
+static QC_SQLITE_INFO* info_ref(QC_SQLITE_INFO* info)
+{
+    atomic_add(&info->refcount, 1);
+
+    return info;
+}
+
+/**
+ * Releases a reference to a classification, freeing it when that was the
+ * last reference.
+ *
+ * @param info A classification.
+ */
+static void info_release(QC_SQLITE_INFO* info)
+{
+    if (info && atomic_add(&info->refcount, -1) == 1)
+    {
+        info_free(info);
+    }
+}
+
+static void parse_query_string(QC_SQLITE_INFO* info, const char* query, size_t len, bool suppress_logging)
+{
+    sqlite3_stmt* stmt = NULL;
+    const char* tail = NULL;
+
+    ss_dassert(this_thread.db);
+    ss_dassert(!this_thread.info);
+    this_thread.info = info;
+    this_thread.info->query = query;
+    this_thread.info->query_len = len;
+
+    arena_begin();
+
+    int rc = sqlite3_prepare(this_thread.db, query, len, &stmt, &tail);
+
+    const int max_len = 512; // Maximum length of logged statement.
+    const int l = (len > max_len ? max_len : len);
+    const char* suffix = (len > max_len ? "..." : "");
+    const char* format;
+
+    if (rc != SQLITE_OK)
+    {
+        if (qc_info_was_tokenized(this_thread.info->status))
+        {
+            format =
+                "qc_sqlite: Statement was classified only based on keywords "
+                "(Sqlite3 error: %s, %s): \"%.*s%s\"";
+        }
+        else
+        {
+            if (qc_info_was_parsed(this_thread.info->status))
+            {
+                format =
+                    "qc_sqlite: Statement was only partially parsed "
+                    "(Sqlite3 error: %s, %s): \"%.*s%s\"";
+
+                // The status was set to QC_QUERY_PARSED, but sqlite3 returned an
+                // error. Most likely, query contains some excess unrecognized stuff.
+                this_thread.info->status = QC_QUERY_PARTIALLY_PARSED;
+            }
+            else
+            {
+                format =
+                    "qc_sqlite: Statement was neither parsed nor recognized from keywords "
+                    "(Sqlite3 error: %s, %s): \"%.*s%s\"";
+            }
+        }
+
+        if (!suppress_logging && (this_unit.log_level > QC_LOG_NOTHING))
+        {
+            bool log_warning = false;
+
+            switch (this_unit.log_level)
+            {
+            case QC_LOG_NON_PARSED:
+                log_warning = this_thread.info->status < QC_QUERY_PARSED;
+                break;
+
+            case QC_LOG_NON_PARTIALLY_PARSED:
+                log_warning = this_thread.info->status < QC_QUERY_PARTIALLY_PARSED;
+                break;
+
+            case QC_LOG_NON_TOKENIZED:
+                log_warning = this_thread.info->status < QC_QUERY_TOKENIZED;
+                break;
+
+            default:
+                ss_dassert(!true);
+                break;
+            }
+
+            if (log_warning)
+            {
+                MXS_WARNING(format, sqlite3_errstr(rc), sqlite3_errmsg(this_thread.db), l, query, suffix);
+            }
+        }
+    }
+    else if (!suppress_logging)
+    {
+        if (qc_info_was_tokenized(this_thread.info->status))
+        {
+            // This suggests a callback from the parser into this module is not made.
+            format =
+                "qc_sqlite: Statement was classified only based on keywords, "
+                "even though the statement was parsed: \"%.*s%s\"";
+
+            MXS_WARNING(format, l, query, suffix);
+        }
+        else if (!qc_info_was_parsed(this_thread.info->status))
+        {
+            // This suggests there are keywords that should be recognized but are not,
+            // a tentative classification cannot be (or is not) made using the keywords
+            // seen and/or a callback from the parser into this module is not made.
+            format = "qc_sqlite: Statement was parsed, but not classified: \"%.*s%s\"";
+
+            MXS_ERROR(format, l, query, suffix);
+        }
+    }
+
+    if (stmt)
+    {
+        sqlite3_finalize(stmt);
+    }
+
+    info_pack(this_thread.info);
+    arena_end();
+
+    this_thread.info->query = NULL;
+    this_thread.info->query_len = 0;
+    this_thread.info = NULL;
+}
+
+static bool parse_query(GWBUF* query, uint32_t collect)
+{
+    bool parsed = false;
+    ss_dassert(!query_is_parsed(query));
+
+    size_t len;
+    const char* s = get_query_string(query, &len);
+    char* compacted = compact_query(s, len, &len);
+
+    if (compacted)
+    {
+        s = compacted;
+    }
+
+    size_t canonical_len = 0;
+    uint64_t hash = 0;
+    const char* canonical = NULL;
+
+    if (this_unit.max_parse_len == 0 || len <= this_unit.max_parse_len)
+    {
+        canonical = cache_canonicalize(s, len, &canonical_len, &hash);
+    }
+
+    QC_SQLITE_INFO* info = canonical ? cache_get(canonical, canonical_len, hash) : NULL;
+
+    if (info)
+    {
+        gwbuf_add_buffer_object(query, GWBUF_PARSING_INFO, info, buffer_object_free);
+        parsed = true;
+    }
+    else if ((info = info_alloc(collect)) != NULL)
+    {
+        parse_query_bounded(info, s, len, false);
+
+        if (canonical)
+        {
+            cache_put(canonical, canonical_len, hash, info);
+        }
+
+        // TODO: Add return value to gwbuf_add_buffer_object.
+        // Always added; also when it was not recognized. If it was not recognized now,
+        // it won't be if we try a second time.
+        gwbuf_add_buffer_object(query, GWBUF_PARSING_INFO, info, buffer_object_free);
+        parsed = true;
+    }
+    else
+    {
+        MXS_ERROR("qc_sqlite: Could not allocate structure for containing parse data.");
+    }
+
+    qc_free(compacted);
+
+    return parsed;
+}
+
+static bool query_is_parsed(GWBUF* query)
+{
+    return query && GWBUF_IS_PARSED(query);
+}
+
+/**
+ * CLASSIFICATION CACHE
+ *
+ * Most statements are the same few statements with different literals. The
+ * classification does not depend on the literals, apart from a few statements
+ * like SET autocommit=0, so each thread caches the classifications by the
+ * canonical form of the statements, where the string and number literals are
+ * replaced with '?'. As the cache is thread specific it needs no locks.
+ */
+
+static inline bool is_identifier_char(char c)
+{
+    return isalnum((unsigned char)c) || c == '_' || c == '$' || (unsigned char)c >= 0x80;
+}
+
+/**
+ * Checks whether a query begins with a particular keyword, ignoring leading
+ * whitespace and comments.
+ *
+ * @param query    The query.
+ * @param len      The length of the query.
+ * @param keyword  The keyword in upper case.
+ *
+ * @return True, if the first word of the query is the keyword.
+ */
+static bool query_begins_with(const char* query, size_t len, const char* keyword)
+{
+    const char* p = query;
+    const char* end = query + len;
+
+    while (p < end)
+    {
+        if (isspace((unsigned char)*p))
+        {
+            ++p;
+        }
+        else if (*p == '/' && p + 1 < end && p[1] == '*')
+        {
+            p += 2;
+            while (p + 1 < end && !(p[0] == '*' && p[1] == '/'))
+            {
+                ++p;
+            }
+            p += 2;
+        }
+        else if (*p == '#' || (*p == '-' && p + 2 < end && p[1] == '-' && isspace((unsigned char)p[2])))
+        {
+            while (p < end && *p != '\n')
+            {
+                ++p;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    size_t n = strlen(keyword);
+
+    return (size_t)(end - p) >= n &&
+        strncasecmp(p, keyword, n) == 0 &&
+        ((size_t)(end - p) == n || !is_identifier_char(p[n]));
+}
+
+/**
+ * Computes the canonical form of a query into a thread specific buffer. The
+ * quoted identifiers and the comments are copied as such.
+ *
+ * @param query  The query.
+ * @param len    The length of the query.
+ * @param pLen   On return, the length of the canonical form.
+ * @param pHash  On return, the hash of the canonical form.
+ *
+ * @return The canonical form, or NULL if the classification of the query
+ *         cannot be cached.
+ */
+static const char* cache_canonicalize(const char* query, size_t len, size_t* pLen, uint64_t* pHash)
+{
+    if (this_thread.cache == NULL ||
+        query_begins_with(query, len, "SET") ||
+        query_begins_with(query, len, "PREPARE"))
+    {
+        // The value of a variable affects the type of SET and the type of PREPARE
+        // is that of the prepared statement, given as a string.
+        return NULL;
+    }
+
+    char* out = this_thread.canonical;
+    const char* p = query;
+    const char* end = query + len;
+    size_t n = 0;
+
+    while (p < end)
+    {
+        const char* start = p;
+        bool literal = false;
+
+        if (*p == '\'')
+        {
+            ++p;
+            while (p < end && *p != '\'')
+            {
+                p += (*p == '\\') ? 2 : 1;
+            }
+            ++p;
+            literal = true;
+        }
+        else if (*p == '"' || *p == '`')
+        {
+            char quote = *p++;
+
+            while (p < end && *p != quote)
+            {
+                p += (*p == '\\' && quote == '"') ? 2 : 1;
+            }
+            ++p;
+        }
+        else if (*p == '/' && p + 1 < end && p[1] == '*')
+        {
+            if ((p + 2 < end && p[2] == '!') || (p + 3 < end && p[2] == 'M' && p[3] == '!'))
+            {
+                // The contents of an executable comment are parsed.
+                return NULL;
+            }
+
+            p += 2;
+            while (p + 1 < end && !(p[0] == '*' && p[1] == '/'))
+            {
+                ++p;
+            }
+            p += 2;
+        }
+        else if (*p == '#' || (*p == '-' && p + 2 < end && p[1] == '-' && isspace((unsigned char)p[2])))
+        {
+            while (p < end && *p != '\n')
+            {
+                ++p;
+            }
+        }
+        else if (isdigit((unsigned char)*p) && (p == query || !is_identifier_char(p[-1])))
+        {
+            while (p < end && isdigit((unsigned char)*p))
+            {
+                ++p;
+            }
+            if (p < end && *p == '.')
+            {
+                ++p;
+                while (p < end && isdigit((unsigned char)*p))
+                {
+                    ++p;
+                }
+            }
+            if (p + 1 < end && (*p == 'e' || *p == 'E') &&
+                (isdigit((unsigned char)p[1]) || p[1] == '+' || p[1] == '-'))
+            {
+                p += 2;
+                while (p < end && isdigit((unsigned char)*p))
+                {
+                    ++p;
+                }
+            }
+
+            // An identifier may begin with digits, e.g. 1st_column.
+            literal = !(p < end && is_identifier_char(*p));
+
+            while (p < end && is_identifier_char(*p))
+            {
+                ++p;
+            }
+        }
+        else if (is_identifier_char(*p))
+        {
+            while (p < end && is_identifier_char(*p))
+            {
+                ++p;
+            }
+        }
+        else
+        {
+            ++p;
+        }
+
+        if (p > end)
+        {
+            p = end;
+        }
+
+        if (literal)
+        {
+            if (n + 1 > sizeof(this_thread.canonical))
+            {
+                return NULL;
+            }
+            out[n++] = '?';
+        }
+        else
+        {
+            if (n + (p - start) > sizeof(this_thread.canonical))
+            {
+                return NULL;
+            }
+            memcpy(out + n, start, p - start);
+            n += p - start;
+        }
+    }
+
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        hash = (hash ^ (unsigned char)out[i]) * 1099511628211ULL;
+    }
+
+    *pLen = n;
+    *pHash = hash;
+
+    return out;
+}
+
+/**
+ * Looks up the classification of a canonical statement.
+ *
+ * @param canonical  The canonical statement.
+ * @param len        Its length.
+ * @param hash       Its hash.
+ *
+ * @return A new reference to the classification, or NULL if it is not cached.
+ */
+static QC_SQLITE_INFO* cache_get(const char* canonical, size_t len, uint64_t hash)
+{
+    QC_CACHE_ENTRY* entry = &this_thread.cache[hash % this_unit.cache_size];
+    QC_SQLITE_INFO* info = NULL;
+
+    if (entry->canonical &&
+        entry->hash == hash &&
+        entry->len == len &&
+        memcmp(entry->canonical, canonical, len) == 0)
+    {
+        info = info_ref(entry->info);
+        this_thread.cache_stats->stats.hits++;
+    }
+    else
+    {
+        this_thread.cache_stats->stats.misses++;
+    }
+
+    return info;
+}
+
+/**
+ * Caches the classification of a canonical statement, replacing the
+ * classification of another statement with the same slot.
+ *
+ * @param canonical  The canonical statement.
+ * @param len        Its length.
+ * @param hash       Its hash.
+ * @param info       The classification of the statement.
+ */
+static void cache_put(const char* canonical, size_t len, uint64_t hash, QC_SQLITE_INFO* info)
+{
+    if (info->types & (QUERY_TYPE_ENABLE_AUTOCOMMIT | QUERY_TYPE_DISABLE_AUTOCOMMIT))
+    {
+        return;
+    }
+
+    QC_CACHE_ENTRY* entry = &this_thread.cache[hash % this_unit.cache_size];
+    QC_CACHE_STATS* stats = &this_thread.cache_stats->stats;
+
+    if (entry->canonical)
+    {
+        qc_free(entry->canonical);
+        info_release(entry->info);
+        stats->evictions++;
+    }
+    else
+    {
+        stats->entries++;
+    }
+
+    entry->canonical = qc_malloc(len);
+    memcpy(entry->canonical, canonical, len);
+    entry->len = len;
+    entry->hash = hash;
+    entry->info = info_ref(info);
+}
+
+/**
+ * Creates the cache of the calling thread, unless caching is disabled.
+ */
+static void cache_init(void)
+{
+    if (this_unit.cache_size == 0)
+    {
+        return;
+    }
+
+    this_thread.cache = qc_calloc(this_unit.cache_size, sizeof(QC_CACHE_ENTRY));
+    this_thread.cache_stats = qc_calloc(1, sizeof(QC_CACHE_THREAD));
+    this_thread.cache_stats->stats.size = this_unit.cache_size;
+
+    spinlock_acquire(&this_unit.cache_lock);
+    this_thread.cache_stats->next = this_unit.cache_threads;
+    this_unit.cache_threads = this_thread.cache_stats;
+    spinlock_release(&this_unit.cache_lock);
+}
+
+/**
+ * Frees the cache of the calling thread. Its statistics are kept in the
+ * statistics of the threads that have ended.
+ */
+static void cache_end(void)
+{
+    if (this_thread.cache == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < this_unit.cache_size; ++i)
+    {
+        QC_CACHE_ENTRY* entry = &this_thread.cache[i];
+
+        if (entry->canonical)
+        {
+            qc_free(entry->canonical);
+            info_release(entry->info);
+        }
+    }
+
+    qc_free(this_thread.cache);
+    this_thread.cache = NULL;
+
+    QC_CACHE_THREAD* stats = this_thread.cache_stats;
+
+    spinlock_acquire(&this_unit.cache_lock);
+    QC_CACHE_THREAD** pp = &this_unit.cache_threads;
+
+    while (*pp != stats)
+    {
+        pp = &(*pp)->next;
+    }
+    *pp = stats->next;
+
+    this_unit.cache_retired.hits += stats->stats.hits;
+    this_unit.cache_retired.misses += stats->stats.misses;
+    this_unit.cache_retired.evictions += stats->stats.evictions;
+    spinlock_release(&this_unit.cache_lock);
+
+    qc_free(stats);
+    this_thread.cache_stats = NULL;
+}
+
+/**
+ * TRIVIAL STATEMENTS
+ *
+ * Transaction control, SET autocommit, SELECT 1, USE and the common SHOW
+ * statements are sent by connectors and connection pools all the time. Their
+ * type and operation are recognized from the tokens, without parsing and without
+ * allocating anything. Only the forms the parser classifies the same way are
+ * recognized, everything else is parsed.
+ */
+
+/**
+ * A minimal tokenizer of a statement.
+ */
+typedef struct qc_lexer
+{
+    const char* p;   // The next character.
+    const char* end; // The end of the statement.
+    const char* z;   // The current token.
+    size_t n;        // The length of the current token, 0 at the end of the statement.
+} QC_LEXER;
+
+static const char* lexer_skip(const char* p, const char* end)
+{
+    while (p < end)
+    {
+        if (isspace((unsigned char)*p))
+        {
+            ++p;
+        }
+        else if (*p == '/' && p + 2 < end && p[1] == '*' && p[2] != '!' && p[2] != 'M')
+        {
+            // The contents of executable comments are parsed, so they are
+            // not skipped. Nor is '#' as sqlite does not regard it a comment.
+            p += 2;
+            while (p + 1 < end && !(p[0] == '*' && p[1] == '/'))
+            {
+                ++p;
+            }
+
+            if (p + 1 >= end)
+            {
+                // An unterminated comment is left to the parser.
+                return p - 2;
+            }
+            p += 2;
+        }
+        else if (*p == '-' && p + 2 < end && p[1] == '-' && isspace((unsigned char)p[2]))
+        {
+            while (p < end && *p != '\n')
+            {
+                ++p;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return p;
+}
+
+/**
+ * Moves to the next token. A word and an identifier quoted with backticks are
+ * single tokens, any other character is a token of its own.
+ *
+ * @param lexer  The tokenizer.
+ *
+ * @return False, if the statement cannot be tokenized.
+ */
+static bool lexer_next(QC_LEXER* lexer)
+{
+    const char* p = lexer_skip(lexer->p, lexer->end);
+    const char* end = lexer->end;
+
+    if (p < end && *p == ';')
+    {
+        // Only whitespace and comments may follow the terminating semicolon.
+        const char* q = lexer_skip(p + 1, end);
+
+        if (q != end)
+        {
+            return false;
+        }
+        p = q;
+    }
+
+    lexer->z = p;
+
+    if (p == end)
+    {
+        lexer->n = 0;
+        return true;
+    }
+
+    if (*p == '`')
+    {
+        ++p;
+        while (p < end && *p != '`')
+        {
+            ++p;
+        }
+
+        if (p == end || (p + 1 < end && p[1] == '`'))
+        {
+            // Unterminated, or with an escaped backtick.
+            return false;
+        }
+        ++p;
+    }
+    else if (is_identifier_char(*p))
+    {
+        while (p < end && is_identifier_char(*p))
+        {
+            ++p;
+        }
+    }
+    else
+    {
+        ++p;
+    }
+
+    lexer->n = p - lexer->z;
+    lexer->p = p;
+
+    return true;
+}
+
+static inline bool lexer_at_end(const QC_LEXER* lexer)
+{
+    return lexer->n == 0;
+}
+
+static bool lexer_is(const QC_LEXER* lexer, const char* word)
+{
+    size_t n = strlen(word);
+
+    return lexer->n == n && strncasecmp(lexer->z, word, n) == 0;
+}
+
+static bool lexer_is_integer(const QC_LEXER* lexer)
+{
+    size_t i = 0;
+
+    while (i < lexer->n && isdigit((unsigned char)lexer->z[i]))
+    {
+        ++i;
+    }
+
+    return lexer->n != 0 && i == lexer->n;
+}
+
+static inline bool lexer_is_name(const QC_LEXER* lexer)
+{
+    return lexer->n != 0 && (*lexer->z == '`' || is_identifier_char(*lexer->z));
+}
+
+/**
+ * Recognizes SHOW {DATABASES|SCHEMAS}, SHOW [FULL] TABLES,
+ * SHOW [GLOBAL|SESSION|LOCAL] VARIABLES, SHOW WARNINGS and
+ * SHOW {MASTER|SLAVE} STATUS.
+ */
+static bool classify_trivial_show(QC_LEXER* lexer, uint32_t* pTypes)
+{
+    if (!lexer_next(lexer))
+    {
+        return false;
+    }
+
+    if (lexer_is(lexer, "DATABASES") || lexer_is(lexer, "SCHEMAS"))
+    {
+        *pTypes = QUERY_TYPE_SHOW_DATABASES;
+    }
+    else if (lexer_is(lexer, "WARNINGS"))
+    {
+        *pTypes = QUERY_TYPE_WRITE;
+    }
+    else if (lexer_is(lexer, "MASTER") || lexer_is(lexer, "SLAVE"))
+    {
+        *pTypes = lexer_is(lexer, "MASTER") ? QUERY_TYPE_WRITE : QUERY_TYPE_READ;
+
+        if (!lexer_next(lexer) || !lexer_is(lexer, "STATUS"))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        bool full = lexer_is(lexer, "FULL");
+        bool global = lexer_is(lexer, "GLOBAL");
+
+        if ((full || global || lexer_is(lexer, "SESSION") || lexer_is(lexer, "LOCAL")) &&
+            !lexer_next(lexer))
+        {
+            return false;
+        }
+
+        if (lexer_is(lexer, "TABLES") && !global)
+        {
+            *pTypes = QUERY_TYPE_SHOW_TABLES;
+        }
+        else if (lexer_is(lexer, "VARIABLES") && !full)
+        {
+            *pTypes = global ? QUERY_TYPE_GSYSVAR_READ : QUERY_TYPE_SYSVAR_READ;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return lexer_next(lexer);
+}
+
+/**
+ * Recognizes SET [GLOBAL|SESSION|LOCAL] autocommit = value and
+ * SET @@[{global|session|local}.]autocommit = value, where the value is
+ * 0, 1, ON, OFF, TRUE or FALSE.
+ */
+static bool classify_trivial_set(QC_LEXER* lexer, uint32_t* pTypes)
+{
+    if (!lexer_next(lexer))
+    {
+        return false;
+    }
+
+    if (lexer_is(lexer, "GLOBAL") || lexer_is(lexer, "SESSION") || lexer_is(lexer, "LOCAL"))
+    {
+        if (!lexer_next(lexer))
+        {
+            return false;
+        }
+    }
+    else if (lexer_is(lexer, "@"))
+    {
+        if (!lexer_next(lexer) || !lexer_is(lexer, "@") || !lexer_next(lexer))
+        {
+            return false;
+        }
+
+        if (lexer_is(lexer, "GLOBAL") || lexer_is(lexer, "SESSION") || lexer_is(lexer, "LOCAL"))
+        {
+            if (!lexer_next(lexer) || !lexer_is(lexer, ".") || !lexer_next(lexer))
+            {
+                return false;
+            }
+        }
+    }
+
+    if (!lexer_is(lexer, "autocommit") ||
+        !lexer_next(lexer) || !lexer_is(lexer, "=") ||
+        !lexer_next(lexer))
+    {
+        return false;
+    }
+
+    *pTypes = QUERY_TYPE_GSYSVAR_WRITE;
+
+    if (lexer_is(lexer, "1") || lexer_is(lexer, "ON") || lexer_is(lexer, "TRUE"))
+    {
+        *pTypes |= (QUERY_TYPE_ENABLE_AUTOCOMMIT | QUERY_TYPE_COMMIT);
+    }
+    else if (lexer_is(lexer, "0") || lexer_is(lexer, "OFF") || lexer_is(lexer, "FALSE"))
+    {
+        *pTypes |= (QUERY_TYPE_BEGIN_TRX | QUERY_TYPE_DISABLE_AUTOCOMMIT);
+    }
+    else
+    {
+        return false;
+    }
+
+    return lexer_next(lexer);
+}
+
+/**
+ * Classifies a trivial statement without parsing it.
+ *
+ * @param query   A buffer containing a COM_QUERY packet.
+ * @param pTypes  On return, the types of the statement.
+ * @param pOp     On return, the operation of the statement.
+ *
+ * @return True, if the statement was trivial and was classified. If the
+ *         statement has already been parsed, false is returned.
+ */
+static bool classify_trivial_query(GWBUF* query, uint32_t* pTypes, qc_query_op_t* pOp)
+{
+    if (query_is_parsed(query) ||
+        GWBUF_LENGTH(query) < MYSQL_HEADER_LEN + 1)
+    {
+        return false;
+    }
+
+    const uint8_t* data = (const uint8_t*) GWBUF_DATA(query);
+    size_t len = MYSQL_GET_PACKET_LEN(data) - 1;
+
+    if (GWBUF_LENGTH(query) < MYSQL_HEADER_LEN + 1 + len)
+    {
+        return false;
+    }
+
+    const char* s = (const char*) &data[MYSQL_HEADER_LEN + 1];
+    QC_LEXER lexer = { s, s + len, s, 0 };
+    uint32_t types = QUERY_TYPE_UNKNOWN;
+    qc_query_op_t op = QUERY_OP_UNDEFINED;
+
+    if (!lexer_next(&lexer))
+    {
+        return false;
+    }
+
+    if (lexer_is(&lexer, "BEGIN") || lexer_is(&lexer, "COMMIT") || lexer_is(&lexer, "ROLLBACK"))
+    {
+        types = lexer_is(&lexer, "BEGIN") ? QUERY_TYPE_BEGIN_TRX :
+            lexer_is(&lexer, "COMMIT") ? QUERY_TYPE_COMMIT : QUERY_TYPE_ROLLBACK;
+
+        if (!lexer_next(&lexer) || (lexer_is(&lexer, "TRANSACTION") && !lexer_next(&lexer)))
+        {
+            return false;
+        }
+    }
+    else if (lexer_is(&lexer, "START"))
+    {
+        types = QUERY_TYPE_BEGIN_TRX;
+
+        if (!lexer_next(&lexer) || !lexer_is(&lexer, "TRANSACTION") || !lexer_next(&lexer))
+        {
+            return false;
+        }
+    }
+    else if (lexer_is(&lexer, "SELECT"))
+    {
+        types = QUERY_TYPE_READ;
+        op = QUERY_OP_SELECT;
+
+        if (!lexer_next(&lexer) || !lexer_is_integer(&lexer) || !lexer_next(&lexer))
+        {
+            return false;
+        }
+    }
+    else if (lexer_is(&lexer, "USE"))
+    {
+        types = QUERY_TYPE_SESSION_WRITE;
+        op = QUERY_OP_CHANGE_DB;
+
+        if (!lexer_next(&lexer) || !lexer_is_name(&lexer) || !lexer_next(&lexer))
+        {
+            return false;
+        }
+    }
+    else if (lexer_is(&lexer, "SHOW"))
+    {
+        if (!classify_trivial_show(&lexer, &types))
+        {
+            return false;
+        }
+    }
+    else if (lexer_is(&lexer, "SET"))
+    {
+        if (!classify_trivial_set(&lexer, &types))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    if (!lexer_at_end(&lexer))
+    {
+        return false;
+    }
+
+    *pTypes = types;
+    *pOp = op;
+
+    return true;
+}
+
+/**
+ * LONG STATEMENTS
+ *
+ * Bulk inserts and statements with long IN lists can be megabytes long, yet
+ * their classification only depends on the rest of the statement. Before a
+ * long statement is parsed, the rows after the first one of a VALUES list and
+ * the elements after the first one of an IN list are removed, provided they
+ * consist of literals only. What remains is usually short enough to be cached,
+ * so bulk inserts with any number of rows share a classification. A statement
+ * that is still longer than max_parse_len is classified from its head.
+ */
+
+/**
+ * Skips a string, a number or a constant.
+ *
+ * @param p    The start of the literal.
+ * @param end  The end of the statement.
+ *
+ * @return The end of the literal, or NULL if there is no literal at p.
+ */
+static const char* skip_literal(const char* p, const char* end)
+{
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        p = lexer_skip(p + 1, end);
+    }
+
+    if (p + 1 < end && (*p == 'x' || *p == 'X' || *p == 'b' || *p == 'B') && p[1] == '\'')
+    {
+        ++p;
+    }
+
+    if (p == end)
+    {
+        return NULL;
+    }
+    else if (*p == '\'')
+    {
+        ++p;
+        while (p < end)
+        {
+            if (*p == '\\')
+            {
+                p += 2;
+            }
+            else if (*p != '\'')
+            {
+                ++p;
+            }
+            else if (p + 1 < end && p[1] == '\'')
+            {
+                // A doubled quote is a quote within the string.
+                p += 2;
+            }
+            else
+            {
+                return p + 1;
+            }
+        }
+
+        return NULL;
+    }
+    else if (isdigit((unsigned char)*p) || *p == '.')
+    {
+        // The sign of an exponent is part of the number.
+        while (p < end && (isalnum((unsigned char)*p) || *p == '.' ||
+                           ((*p == '+' || *p == '-') && (p[-1] == 'e' || p[-1] == 'E'))))
+        {
+            ++p;
+        }
+        return p;
+    }
+    else
+    {
+        const char* start = p;
+
+        while (p < end && is_identifier_char(*p))
+        {
+            ++p;
+        }
+
+        size_t n = p - start;
+
+        if ((n == 4 && (strncasecmp(start, "NULL", 4) == 0 || strncasecmp(start, "TRUE", 4) == 0)) ||
+            (n == 5 && strncasecmp(start, "FALSE", 5) == 0) ||
+            (n == 7 && strncasecmp(start, "DEFAULT", 7) == 0))
+        {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Skips a parenthesized list of literals.
+ *
+ * @param p           The opening parenthesis.
+ * @param end         The end of the statement.
+ * @param pFirstEnd   If not NULL, on return the end of the first literal.
+ * @param pN          If not NULL, on return the number of literals.
+ *
+ * @return The end of the list, or NULL if it is not a list of literals.
+ */
+static const char* skip_literal_list(const char* p, const char* end,
+                                     const char** pFirstEnd, size_t* pN)
+{
+    size_t n = 0;
+
+    ss_dassert(*p == '(');
+
+    do
+    {
+        p = skip_literal(lexer_skip(p + 1, end), end);
+
+        if (p == NULL)
+        {
+            return NULL;
+        }
+
+        if (n++ == 0 && pFirstEnd)
+        {
+            *pFirstEnd = p;
+        }
+
+        p = lexer_skip(p, end);
+    }
+    while (p < end && *p == ',');
+
+    if (p == end || *p != ')')
+    {
+        return NULL;
+    }
+
+    if (pN)
+    {
+        *pN = n;
+    }
+
+    return p + 1;
+}
+
+/**
+ * Skips a parenthesized expression.
+ *
+ * @param p    The opening parenthesis.
+ * @param end  The end of the statement.
+ *
+ * @return The end of the expression, or NULL if the parenthesis is not closed.
+ */
+static const char* skip_parenthesized(const char* p, const char* end)
+{
+    int depth = 0;
+
+    while (p < end)
+    {
+        if (*p == '\'' || *p == '"' || *p == '`')
+        {
+            char quote = *p++;
+
+            while (p < end && *p != quote)
+            {
+                p += (*p == '\\' && quote != '`') ? 2 : 1;
+            }
+        }
+        else if (*p == '(')
+        {
+            ++depth;
+        }
+        else if (*p == ')' && --depth == 0)
+        {
+            return p + 1;
+        }
+        ++p;
+    }
+
+    return NULL;
+}
+
+/**
+ * The keyword preceding an opening parenthesis.
+ */
+typedef enum qc_list_keyword
 {
-    sqlite3_stmt* stmt = NULL;
-    const char* tail = NULL;
+    QC_LIST_NONE,
+    QC_LIST_VALUES, // VALUES or VALUE
+    QC_LIST_IN      // IN
+} qc_list_keyword_t;
 
-    ss_dassert(this_thread.db);
-    int rc = sqlite3_prepare(this_thread.db, query, len, &stmt, &tail);
+/**
+ * Removes the literal rows after the first one of the VALUES lists and the
+ * literals after the first one of the IN lists of a long statement.
+ *
+ * @param query  The statement.
+ * @param len    Its length.
+ * @param pLen   On return, the length of the compacted statement.
+ *
+ * @return The compacted statement, to be freed with qc_free, or NULL if the
+ *         statement is short or nothing could be removed.
+ */
+static char* compact_query(const char* query, size_t len, size_t* pLen)
+{
+    if (len <= QC_CACHE_MAX_LEN)
+    {
+        return NULL;
+    }
 
-    const int max_len = 512; // Maximum length of logged statement.
-    const int l = (len > max_len ? max_len : len);
-    const char* suffix = (len > max_len ? "..." : "");
-    const char* format;
+    char* out = NULL;
+    size_t n = 0;
+    const char* from = query; // The start of the text not yet copied.
+    const char* p = query;
+    const char* end = query + len;
+    qc_list_keyword_t keyword = QC_LIST_NONE;
 
-    if (rc != SQLITE_OK)
+    while ((p = lexer_skip(p, end)) < end)
     {
-        if (qc_info_was_tokenized(this_thread.info->status))
+        const char* drop = NULL; // The start of the text to remove.
+        const char* next = NULL; // The end of the text to remove.
+
+        if (*p == '\'' || *p == '"' || *p == '`')
         {
-            format =
-                "qc_sqlite: Statement was classified only based on keywords "
-                "(Sqlite3 error: %s, %s): \"%.*s%s\"";
+            char quote = *p++;
+
+            while (p < end && *p != quote)
+            {
+                p += (*p == '\\' && quote != '`') ? 2 : 1;
+            }
+            ++p;
+            keyword = QC_LIST_NONE;
         }
-        else
+        else if (is_identifier_char(*p))
         {
-            if (qc_info_was_parsed(this_thread.info->status))
+            const char* start = p;
+
+            while (p < end && is_identifier_char(*p))
             {
-                format =
-                    "qc_sqlite: Statement was only partially parsed "
-                    "(Sqlite3 error: %s, %s): \"%.*s%s\"";
+                ++p;
+            }
 
-                // The status was set to QC_QUERY_PARSED, but sqlite3 returned an
-                // error. Most likely, query contains some excess unrecognized stuff.
-                this_thread.info->status = QC_QUERY_PARTIALLY_PARSED;
+            size_t l = p - start;
+
+            if ((l == 6 && strncasecmp(start, "VALUES", 6) == 0) ||
+                (l == 5 && strncasecmp(start, "VALUE", 5) == 0))
+            {
+                keyword = QC_LIST_VALUES;
+            }
+            else if (l == 2 && strncasecmp(start, "IN", 2) == 0)
+            {
+                keyword = QC_LIST_IN;
             }
             else
             {
-                format =
-                    "qc_sqlite: Statement was neither parsed nor recognized from keywords "
-                    "(Sqlite3 error: %s, %s): \"%.*s%s\"";
+                keyword = QC_LIST_NONE;
             }
         }
-
-        if (this_unit.log_level > QC_LOG_NOTHING)
+        else if (*p == '(' && keyword == QC_LIST_VALUES)
         {
-            bool log_warning = false;
+            const char* row_end = skip_parenthesized(p, end);
 
-            switch (this_unit.log_level)
+            if (row_end == NULL)
             {
-            case QC_LOG_NON_PARSED:
-                log_warning = this_thread.info->status < QC_QUERY_PARSED;
                 break;
+            }
 
-            case QC_LOG_NON_PARTIALLY_PARSED:
-                log_warning = this_thread.info->status < QC_QUERY_PARTIALLY_PARSED;
-                break;
+            // The first row is kept as it is, the literal rows following it are removed.
+            p = row_end;
 
-            case QC_LOG_NON_TOKENIZED:
-                log_warning = this_thread.info->status < QC_QUERY_TOKENIZED;
-                break;
+            while (true)
+            {
+                const char* q = lexer_skip(p, end);
 
-            default:
-                ss_dassert(!true);
-                break;
+                if (q == end || *q != ',')
+                {
+                    break;
+                }
+
+                q = lexer_skip(q + 1, end);
+
+                if (q == end || *q != '(' || (q = skip_literal_list(q, end, NULL, NULL)) == NULL)
+                {
+                    break;
+                }
+
+                p = q;
             }
 
-            if (log_warning)
+            if (p != row_end)
             {
-                MXS_WARNING(format, sqlite3_errstr(rc), sqlite3_errmsg(this_thread.db), l, query, suffix);
+                drop = row_end;
+                next = p;
             }
+            keyword = QC_LIST_NONE;
         }
-    }
-    else
-    {
-        if (qc_info_was_tokenized(this_thread.info->status))
+        else if (*p == '(' && keyword == QC_LIST_IN)
         {
-            // This suggests a callback from the parser into this module is not made.
-            format =
-                "qc_sqlite: Statement was classified only based on keywords, "
-                "even though the statement was parsed: \"%.*s%s\"";
+            const char* first_end;
+            size_t count;
+            const char* list_end = skip_literal_list(p, end, &first_end, &count);
 
-            MXS_WARNING(format, l, query, suffix);
+            if (list_end && count > 1)
+            {
+                drop = first_end;
+                next = list_end - 1;
+            }
+            p = list_end ? list_end : p + 1;
+            keyword = QC_LIST_NONE;
         }
-        else if (!qc_info_was_parsed(this_thread.info->status))
+        else
         {
-            // This suggests there are keywords that should be recognized but are not,
-            // a tentative classification cannot be (or is not) made using the keywords
-            // seen and/or a callback from the parser into this module is not made.
-            format = "qc_sqlite: Statement was parsed, but not classified: \"%.*s%s\"";
+            ++p;
+            keyword = QC_LIST_NONE;
+        }
 
-            MXS_ERROR(format, l, query, suffix);
+        if (drop)
+        {
+            if (out == NULL)
+            {
+                out = qc_malloc(len);
+            }
+
+            memcpy(out + n, from, drop - from);
+            n += drop - from;
+            from = next;
         }
     }
 
-    if (stmt)
+    if (out)
     {
-        sqlite3_finalize(stmt);
+        memcpy(out + n, from, end - from);
+        n += end - from;
+        *pLen = n;
     }
+
+    return out;
 }
 
-static bool parse_query(GWBUF* query)
+/**
+ * Parses a statement, or only its head if it is longer than max_parse_len.
+ * A statement classified from its head is regarded as partially parsed and,
+ * as whatever follows the head is not known, as a write.
+ *
+ * @param info              The info structure to fill.
+ * @param query             The statement.
+ * @param len               Its length.
+ * @param suppress_logging  Whether problems should not be logged.
+ */
+static void parse_query_bounded(QC_SQLITE_INFO* info, const char* query, size_t len, bool suppress_logging)
 {
-    bool parsed = false;
-    ss_dassert(!query_is_parsed(query));
-
-    QC_SQLITE_INFO* info = info_alloc();
-
-    if (info)
+    if (this_unit.max_parse_len != 0 && len > this_unit.max_parse_len)
     {
-        this_thread.info = info;
-
-        // TODO: Somewhere it needs to be ensured that this buffer is contiguous.
-        // TODO: Where is it checked that the GWBUF really contains a query?
-        uint8_t* data = (uint8_t*) GWBUF_DATA(query);
-        size_t len = MYSQL_GET_PACKET_LEN(data) - 1; // Subtract 1 for packet type byte.
-
-        const char* s = (const char*) &data[5]; // TODO: Are there symbolic constants somewhere?
-
-        this_thread.info->query = s;
-        this_thread.info->query_len = len;
-        parse_query_string(s, len);
-        this_thread.info->query = NULL;
-        this_thread.info->query_len = 0;
-
-        // TODO: Add return value to gwbuf_add_buffer_object.
-        // Always added; also when it was not recognized. If it was not recognized now,
-        // it won't be if we try a second time.
-        gwbuf_add_buffer_object(query, GWBUF_PARSING_INFO, info, buffer_object_free);
-        parsed = true;
+        // The head will not parse, so the failure is not logged.
+        parse_query_string(info, query, this_unit.max_parse_len, true);
 
-        this_thread.info = NULL;
+        if (info->status > QC_QUERY_PARTIALLY_PARSED)
+        {
+            info->status = QC_QUERY_PARTIALLY_PARSED;
+        }
+        info->types |= QUERY_TYPE_WRITE;
     }
     else
     {
-        MXS_ERROR("qc_sqlite: Could not allocate structure for containing parse data.");
+        parse_query_string(info, query, len, suppress_logging);
     }
-
-    return parsed;
-}
-
-static bool query_is_parsed(GWBUF* query)
-{
-    return query && GWBUF_IS_PARSED(query);
 }
 
 /*
@@ -627,6 +2316,11 @@ static void log_invalid_data(GWBUF* query, const char* message)
 
 static void append_affected_field(QC_SQLITE_INFO* info, const char* s)
 {
+    if (!collects(info, QC_COLLECT_FIELDS))
+    {
+        return;
+    }
+
     size_t len = strlen(s);
     size_t required_len = info->affected_fields_len + len + 1; // 1 for NULL
 
@@ -647,7 +2341,7 @@ static void append_affected_field(QC_SQLITE_INFO* info, const char* s)
             info->affected_fields_capacity *= 2;
         }
 
-        info->affected_fields = mxs_realloc(info->affected_fields, info->affected_fields_capacity);
+        info->affected_fields = info_realloc(info->affected_fields, info->affected_fields_capacity);
     }
 
     if (info->affected_fields_len != 0)
@@ -715,7 +2409,7 @@ static void update_affected_fields(QC_SQLITE_INFO* info,
         break;
 
     case TK_ID:
-        if ((pExpr->flags & EP_DblQuoted) == 0)
+        if (collects(info, QC_COLLECT_FIELDS) && ((pExpr->flags & EP_DblQuoted) == 0))
         {
             if ((strcasecmp(zToken, "true") != 0) && (strcasecmp(zToken, "false") != 0))
             {
@@ -907,7 +2601,12 @@ static void update_affected_fields_from_select(QC_SQLITE_INFO* info,
 
 static void update_database_names(QC_SQLITE_INFO* info, const char* zDatabase)
 {
-    char* zCopy = mxs_strdup(zDatabase);
+    if (!collects(info, QC_COLLECT_DATABASES))
+    {
+        return;
+    }
+
+    char* zCopy = info_strdup(zDatabase);
     exposed_sqlite3Dequote(zCopy);
 
     enlarge_string_array(1, info->database_names_len,
@@ -918,7 +2617,17 @@ static void update_database_names(QC_SQLITE_INFO* info, const char* zDatabase)
 
 static void update_names(QC_SQLITE_INFO* info, const char* zDatabase, const char* zTable)
 {
-    char* zCopy = mxs_strdup(zTable);
+    if (zDatabase)
+    {
+        update_database_names(info, zDatabase);
+    }
+
+    if (!collects(info, QC_COLLECT_TABLES))
+    {
+        return;
+    }
+
+    char* zCopy = info_strdup(zTable);
     // TODO: Is this call really needed. Check also sqlite3Dequote.
     exposed_sqlite3Dequote(zCopy);
 
@@ -928,18 +2637,16 @@ static void update_names(QC_SQLITE_INFO* info, const char* zDatabase, const char
 
     if (zDatabase)
     {
-        zCopy = mxs_malloc(strlen(zDatabase) + 1 + strlen(zTable) + 1);
+        zCopy = info_malloc(strlen(zDatabase) + 1 + strlen(zTable) + 1);
 
         strcpy(zCopy, zDatabase);
         strcat(zCopy, ".");
         strcat(zCopy, zTable);
         exposed_sqlite3Dequote(zCopy);
-
-        update_database_names(info, zDatabase);
     }
     else
     {
-        zCopy = mxs_strdup(zCopy);
+        zCopy = info_strdup(zCopy);
     }
 
     enlarge_string_array(1, info->table_fullnames_len,
@@ -1010,7 +2717,7 @@ void mxs_sqlite3Analyze(Parse* pParse, SrcList* pSrcList)
     exposed_sqlite3SrcListDelete(pParse->db, pSrcList);
 }
 
-void mxs_sqlite3BeginTransaction(Parse* pParse, int type)
+void mxs_sqlite3BeginTransaction(Parse* pParse, int type, int characteristics)
 {
     QC_TRACE();
 
@@ -1019,6 +2726,11 @@ void mxs_sqlite3BeginTransaction(Parse* pParse, int type)
 
     info->status = QC_QUERY_PARSED;
     info->types = QUERY_TYPE_BEGIN_TRX;
+
+    if (characteristics & MXS_TRX_READ_ONLY)
+    {
+        info->types |= QUERY_TYPE_READ_ONLY_TRX;
+    }
 }
 
 void mxs_sqlite3BeginTrigger(Parse *pParse,      /* The parse context of the CREATE TRIGGER statement */
@@ -1427,7 +3139,10 @@ void mxs_sqlite3StartTable(Parse *pParse,   /* Parser context */
             update_names(info, NULL, name);
         }
 
-        info->created_table_name = mxs_strdup(info->table_names[0]);
+        if (collects(info, QC_COLLECT_TABLES))
+        {
+            info->created_table_name = info_strdup(info->table_names[0]);
+        }
     }
     else
     {
@@ -2040,6 +3755,7 @@ void maxscaleSet(Parse* pParse, int scope, mxs_set_t kind, ExprList* pList)
     switch (kind)
     {
     case MXS_SET_TRANSACTION:
+    case MXS_SET_TRANSACTION_READ_ONLY:
         if ((scope == TK_GLOBAL) || (scope == TK_SESSION))
         {
             info->types = QUERY_TYPE_GSYSVAR_WRITE;
@@ -2048,6 +3764,12 @@ void maxscaleSet(Parse* pParse, int scope, mxs_set_t kind, ExprList* pList)
         {
             ss_dassert(scope == 0);
             info->types = QUERY_TYPE_WRITE;
+
+            // Without a scope, the characteristics apply to the next transaction only.
+            if (kind == MXS_SET_TRANSACTION_READ_ONLY)
+            {
+                info->types |= QUERY_TYPE_READ_ONLY_TRX;
+            }
         }
         break;
 
@@ -2374,7 +4096,7 @@ static bool qc_sqlite_init(const char* args);
 static void qc_sqlite_end(void);
 static bool qc_sqlite_thread_init(void);
 static void qc_sqlite_thread_end(void);
-static qc_parse_result_t qc_sqlite_parse(GWBUF* query);
+static qc_parse_result_t qc_sqlite_parse(GWBUF* query, uint32_t collect);
 static uint32_t qc_sqlite_get_type(GWBUF* query);
 static qc_query_op_t qc_sqlite_get_operation(GWBUF* query);
 static char* qc_sqlite_get_created_table_name(GWBUF* query);
@@ -2385,6 +4107,11 @@ static char* qc_sqlite_get_canonical(GWBUF* query);
 static bool qc_sqlite_query_has_clause(GWBUF* query);
 static char* qc_sqlite_get_affected_fields(GWBUF* query);
 static char** qc_sqlite_get_database_names(GWBUF* query, int* sizep);
+static bool qc_sqlite_get_cache_stats(QC_CACHE_STATS* stats);
+static const char* qc_sqlite_get_created_table_name_view(GWBUF* query);
+static const char* const* qc_sqlite_get_table_names_view(GWBUF* query, int* tblsize, bool fullnames);
+static const char* qc_sqlite_get_affected_fields_view(GWBUF* query);
+static const char* const* qc_sqlite_get_database_names_view(GWBUF* query, int* sizep);
 
 static bool get_key_and_value(char* arg, const char** pkey, const char** pvalue)
 {
@@ -2402,6 +4129,8 @@ static bool get_key_and_value(char* arg, const char** pkey, const char** pvalue)
 }
 
 static char ARG_LOG_UNRECOGNIZED_STATEMENTS[] = "log_unrecognized_statements";
+static char ARG_CACHE_SIZE[] = "cache_size";
+static char ARG_MAX_PARSE_LEN[] = "max_parse_len";
 
 static bool qc_sqlite_init(const char* args)
 {
@@ -2409,42 +4138,89 @@ static bool qc_sqlite_init(const char* args)
     assert(!this_unit.initialized);
 
     qc_log_level_t log_level = QC_LOG_NOTHING;
+    size_t cache_size = QC_CACHE_DEFAULT_SIZE;
+    size_t max_parse_len = 0;
 
     if (args)
     {
-        char arg[strlen(args) + 1];
-        strcpy(arg, args);
+        char copy[strlen(args) + 1];
+        strcpy(copy, args);
 
-        const char* key;
-        const char* value;
+        char* saveptr;
+        char* arg = strtok_r(copy, ",", &saveptr);
 
-        if (get_key_and_value(arg, &key, &value))
+        while (arg)
         {
-            if (strcmp(key, ARG_LOG_UNRECOGNIZED_STATEMENTS) == 0)
+            const char* key;
+            const char* value;
+
+            if (get_key_and_value(arg, &key, &value))
             {
                 char *end;
 
-                long l = strtol(value, &end, 0);
+                if (strcmp(key, ARG_LOG_UNRECOGNIZED_STATEMENTS) == 0)
+                {
+                    long l = strtol(value, &end, 0);
+
+                    if ((*end == 0) && (l >= QC_LOG_NOTHING) && (l <= QC_LOG_NON_TOKENIZED))
+                    {
+                        log_level = l;
+                    }
+                    else
+                    {
+                        MXS_WARNING("qc_sqlite: '%s' is not a number between %d and %d.",
+                                    value, QC_LOG_NOTHING, QC_LOG_NON_TOKENIZED);
+                    }
+                }
+                else if (strcmp(key, ARG_CACHE_SIZE) == 0)
+                {
+                    long l = strtol(value, &end, 0);
 
-                if ((*end == 0) && (l >= QC_LOG_NOTHING) && (l <= QC_LOG_NON_TOKENIZED))
+                    if ((*end == 0) && (l >= 0))
+                    {
+                        cache_size = l;
+                    }
+                    else
+                    {
+                        MXS_WARNING("qc_sqlite: '%s' is not a non-negative number.", value);
+                    }
+                }
+                else if (strcmp(key, ARG_MAX_PARSE_LEN) == 0)
                 {
-                    log_level = l;
+                    long l = strtol(value, &end, 0);
+
+                    if ((*end == 0) && (l >= 0))
+                    {
+                        max_parse_len = l;
+                    }
+                    else
+                    {
+                        MXS_WARNING("qc_sqlite: '%s' is not a non-negative number.", value);
+                    }
                 }
                 else
                 {
-                    MXS_WARNING("qc_sqlite: '%s' is not a number between %d and %d.",
-                                value, QC_LOG_NOTHING, QC_LOG_NON_TOKENIZED);
+                    MXS_WARNING("qc_sqlite: '%s' is not a recognized argument.", key);
                 }
             }
             else
             {
-                MXS_WARNING("qc_sqlite: '%s' is not a recognized argument.", key);
+                MXS_WARNING("qc_sqlite: '%s' is not a recognized argument string.", arg);
             }
+
+            arg = strtok_r(NULL, ",", &saveptr);
         }
-        else
-        {
-            MXS_WARNING("qc_sqlite: '%s' is not a recognized argument string.", args);
-        }
+    }
+
+    spinlock_init(&this_unit.cache_lock);
+    this_unit.cache_size = cache_size;
+    this_unit.max_parse_len = max_parse_len;
+
+    // The memory statistics of sqlite3 would serialize all allocations behind a mutex.
+    if ((sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 0) != SQLITE_OK) ||
+        (sqlite3_config(SQLITE_CONFIG_MALLOC, &arena_methods) != SQLITE_OK))
+    {
+        MXS_WARNING("qc_sqlite: Could not make sqlite3 allocate from a per-thread arena.");
     }
 
     if (sqlite3_initialize() == 0)
@@ -2520,6 +4296,7 @@ static bool qc_sqlite_thread_init(void)
     int rc = sqlite3_open(":memory:", &this_thread.db);
     if (rc == SQLITE_OK)
     {
+        cache_init();
         this_thread.initialized = true;
 
         MXS_INFO("qc_sqlite: In-memory sqlite database successfully opened for thread %lu.",
@@ -2550,16 +4327,20 @@ static void qc_sqlite_thread_end(void)
     }
 
     this_thread.db = NULL;
+
+    arena_release();
+    cache_end();
+
     this_thread.initialized = false;
 }
 
-static qc_parse_result_t qc_sqlite_parse(GWBUF* query)
+static qc_parse_result_t qc_sqlite_parse(GWBUF* query, uint32_t collect)
 {
     QC_TRACE();
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, collect);
 
     return info ? info->status : QC_QUERY_INVALID;
 }
@@ -2571,23 +4352,28 @@ static uint32_t qc_sqlite_get_type(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     uint32_t types = QUERY_TYPE_UNKNOWN;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    qc_query_op_t op;
 
-    if (info)
+    if (!classify_trivial_query(query, &types, &op))
     {
-        if (qc_info_is_valid(info->status))
+        QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
+
+        if (info)
         {
-            types = info->types;
+            if (qc_info_is_valid(info->status))
+            {
+                types = info->types;
+            }
+            else if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+            {
+                log_invalid_data(query, "cannot report query type");
+            }
         }
-        else if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+        else
         {
-            log_invalid_data(query, "cannot report query type");
+            MXS_ERROR("qc_sqlite: The query could not be parsed. Response not valid.");
         }
     }
-    else
-    {
-        MXS_ERROR("qc_sqlite: The query could not be parsed. Response not valid.");
-    }
 
     return types;
 }
@@ -2599,44 +4385,46 @@ static qc_query_op_t qc_sqlite_get_operation(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     qc_query_op_t op = QUERY_OP_UNDEFINED;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    uint32_t types;
 
-    if (info)
+    if (!classify_trivial_query(query, &types, &op))
     {
-        if (qc_info_is_valid(info->status))
+        QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
+
+        if (info)
         {
-            op = info->operation;
+            if (qc_info_is_valid(info->status))
+            {
+                op = info->operation;
+            }
+            else if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+            {
+                log_invalid_data(query, "cannot report query operation");
+            }
         }
-        else if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+        else
         {
-            log_invalid_data(query, "cannot report query operation");
+            MXS_ERROR("qc_sqlite: The query could not be parsed. Response not valid.");
         }
     }
-    else
-    {
-        MXS_ERROR("qc_sqlite: The query could not be parsed. Response not valid.");
-    }
 
     return op;
 }
 
-static char* qc_sqlite_get_created_table_name(GWBUF* query)
+static const char* qc_sqlite_get_created_table_name_view(GWBUF* query)
 {
     QC_TRACE();
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    char* created_table_name = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    const char* created_table_name = NULL;
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_TABLES);
 
     if (info)
     {
         if (qc_info_is_valid(info->status))
         {
-            if (info->created_table_name)
-            {
-                created_table_name = mxs_strdup(info->created_table_name);
-            }
+            created_table_name = info->created_table_name;
         }
         else if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
         {
@@ -2651,6 +4439,14 @@ static char* qc_sqlite_get_created_table_name(GWBUF* query)
     return created_table_name;
 }
 
+static char* qc_sqlite_get_created_table_name(GWBUF* query)
+{
+    QC_TRACE();
+    const char* created_table_name = qc_sqlite_get_created_table_name_view(query);
+
+    return created_table_name ? mxs_strdup(created_table_name) : NULL;
+}
+
 static bool qc_sqlite_is_drop_table_query(GWBUF* query)
 {
     QC_TRACE();
@@ -2658,7 +4454,7 @@ static bool qc_sqlite_is_drop_table_query(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     bool is_drop_table = false;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2686,7 +4482,7 @@ static bool qc_sqlite_is_real_query(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     bool is_real_query = false;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2707,14 +4503,16 @@ static bool qc_sqlite_is_real_query(GWBUF* query)
     return is_real_query;
 }
 
-static char** qc_sqlite_get_table_names(GWBUF* query, int* tblsize, bool fullnames)
+static const char* const* qc_sqlite_get_table_names_view(GWBUF* query, int* tblsize, bool fullnames)
 {
     QC_TRACE();
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    char** table_names = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    const char* const* table_names = NULL;
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_TABLES);
+
+    *tblsize = 0;
 
     if (info)
     {
@@ -2722,20 +4520,13 @@ static char** qc_sqlite_get_table_names(GWBUF* query, int* tblsize, bool fullnam
         {
             if (fullnames)
             {
-                table_names = info->table_fullnames;
+                table_names = (const char* const*) info->table_fullnames;
+                *tblsize = info->table_fullnames_len;
             }
             else
             {
-                table_names = info->table_names;
-            }
-
-            if (table_names)
-            {
-                table_names = copy_string_array(table_names, tblsize);
-            }
-            else
-            {
-                *tblsize = 0;
+                table_names = (const char* const*) info->table_names;
+                *tblsize = info->table_names_len;
             }
         }
         else if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
@@ -2751,6 +4542,14 @@ static char** qc_sqlite_get_table_names(GWBUF* query, int* tblsize, bool fullnam
     return table_names;
 }
 
+static char** qc_sqlite_get_table_names(GWBUF* query, int* tblsize, bool fullnames)
+{
+    QC_TRACE();
+    const char* const* table_names = qc_sqlite_get_table_names_view(query, tblsize, fullnames);
+
+    return table_names ? copy_string_array(table_names, tblsize) : NULL;
+}
+
 static char* qc_sqlite_get_canonical(GWBUF* query)
 {
     QC_TRACE();
@@ -2769,7 +4568,7 @@ static bool qc_sqlite_query_has_clause(GWBUF* query)
     ss_dassert(this_thread.initialized);
 
     bool has_clause = false;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_ESSENTIALS);
 
     if (info)
     {
@@ -2790,14 +4589,14 @@ static bool qc_sqlite_query_has_clause(GWBUF* query)
     return has_clause;
 }
 
-static char* qc_sqlite_get_affected_fields(GWBUF* query)
+static const char* qc_sqlite_get_affected_fields_view(GWBUF* query)
 {
     QC_TRACE();
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    char* affected_fields = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    const char* affected_fields = NULL;
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_FIELDS);
 
     if (info)
     {
@@ -2820,26 +4619,33 @@ static char* qc_sqlite_get_affected_fields(GWBUF* query)
         affected_fields = "";
     }
 
-    return mxs_strdup(affected_fields);
+    return affected_fields;
 }
 
-static char** qc_sqlite_get_database_names(GWBUF* query, int* sizep)
+static char* qc_sqlite_get_affected_fields(GWBUF* query)
+{
+    QC_TRACE();
+
+    return mxs_strdup(qc_sqlite_get_affected_fields_view(query));
+}
+
+static const char* const* qc_sqlite_get_database_names_view(GWBUF* query, int* sizep)
 {
     QC_TRACE();
     ss_dassert(this_unit.initialized);
     ss_dassert(this_thread.initialized);
 
-    char** database_names = NULL;
-    QC_SQLITE_INFO* info = get_query_info(query);
+    const char* const* database_names = NULL;
+    QC_SQLITE_INFO* info = get_query_info(query, QC_COLLECT_DATABASES);
+
+    *sizep = 0;
 
     if (info)
     {
         if (qc_info_is_valid(info->status))
         {
-            if (info->database_names)
-            {
-                database_names = copy_string_array(info->database_names, sizep);
-            }
+            database_names = (const char* const*) info->database_names;
+            *sizep = info->database_names_len;
         }
         else if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
         {
@@ -2854,6 +4660,37 @@ static char** qc_sqlite_get_database_names(GWBUF* query, int* sizep)
     return database_names;
 }
 
+static char** qc_sqlite_get_database_names(GWBUF* query, int* sizep)
+{
+    QC_TRACE();
+    const char* const* database_names = qc_sqlite_get_database_names_view(query, sizep);
+
+    return database_names ? copy_string_array(database_names, sizep) : NULL;
+}
+
+static bool qc_sqlite_get_cache_stats(QC_CACHE_STATS* stats)
+{
+    QC_TRACE();
+    ss_dassert(this_unit.initialized);
+
+    memset(stats, 0, sizeof(*stats));
+
+    spinlock_acquire(&this_unit.cache_lock);
+    *stats = this_unit.cache_retired;
+
+    for (QC_CACHE_THREAD* t = this_unit.cache_threads; t; t = t->next)
+    {
+        stats->size += t->stats.size;
+        stats->entries += t->stats.entries;
+        stats->hits += t->stats.hits;
+        stats->misses += t->stats.misses;
+        stats->evictions += t->stats.evictions;
+    }
+    spinlock_release(&this_unit.cache_lock);
+
+    return this_unit.cache_size != 0;
+}
+
 /**
  * EXPORTS
  */
@@ -2877,6 +4714,11 @@ static QUERY_CLASSIFIER qc =
     qc_sqlite_query_has_clause,
     qc_sqlite_get_affected_fields,
     qc_sqlite_get_database_names,
+    qc_sqlite_get_cache_stats,
+    qc_sqlite_get_created_table_name_view,
+    qc_sqlite_get_table_names_view,
+    qc_sqlite_get_affected_fields_view,
+    qc_sqlite_get_database_names_view,
 };
 
 
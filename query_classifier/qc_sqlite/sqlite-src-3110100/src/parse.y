@@ -69,7 +69,7 @@
 extern void mxs_sqlite3AlterFinishAddColumn(Parse *, Token *);
 extern void mxs_sqlite3AlterBeginAddColumn(Parse *, SrcList *);
 extern void mxs_sqlite3Analyze(Parse *, SrcList *);
-extern void mxs_sqlite3BeginTransaction(Parse*, int);
+extern void mxs_sqlite3BeginTransaction(Parse*, int type, int characteristics);
 extern void mxs_sqlite3CommitTransaction(Parse*);
 extern void mxs_sqlite3CreateIndex(Parse*,Token*,Token*,SrcList*,ExprList*,int,Token*,
                                    Expr*, int, int);
@@ -294,7 +294,7 @@ cmdx ::= cmd.           { sqlite3FinishCoding(pParse); }
 //
 
 %ifdef MAXSCALE
-cmd ::= BEGIN transtype(Y) trans_opt.  {mxs_sqlite3BeginTransaction(pParse, Y);}
+cmd ::= BEGIN transtype(Y) trans_opt.  {mxs_sqlite3BeginTransaction(pParse, Y, 0);}
 %endif
 %ifndef MAXSCALE
 cmd ::= BEGIN transtype(Y) trans_opt.  {sqlite3BeginTransaction(pParse, Y);}
@@ -2959,19 +2959,26 @@ cmd ::= SET variable_assignments(Y). {
   maxscaleSet(pParse, 0, MXS_SET_VARIABLES, Y);
 }
 
-transaction_characteristic ::= READ WRITE.
-transaction_characteristic ::= READ id.                 // READ ONLY
-transaction_characteristic ::= id id transaction_level. // ISOLATION LEVEL transaction_level
+%type transaction_characteristic {int}
+transaction_characteristic(A) ::= READ WRITE. {A = 0;}
+transaction_characteristic(A) ::= READ id(X).            // READ ONLY
+{
+  A = (X.n == 4 && sqlite3StrNICmp(X.z, "ONLY", 4) == 0) ? MXS_TRX_READ_ONLY : 0;
+}
+transaction_characteristic(A) ::= id id transaction_level. {A = 0;} // ISOLATION LEVEL transaction_level
 
 transaction_level ::= id READ. // REPEATABLE READ
 transaction_level ::= READ id. // {READ COMMITTED|READ UNCOMMITTED}
 transaction_level ::= id.      // SERIALIZABLE
 
-transaction_characteristics ::= transaction_characteristic.
-transaction_characteristics ::= transaction_characteristics COMMA transaction_characteristic.
+%type transaction_characteristics {int}
+transaction_characteristics(A) ::= transaction_characteristic(X). {A = X;}
+transaction_characteristics(A) ::= transaction_characteristics(X) COMMA transaction_characteristic(Y). {
+  A = X | Y;
+}
 
-cmd ::= SET set_scope(X) TRANSACTION transaction_characteristics. {
-  maxscaleSet(pParse, X, MXS_SET_TRANSACTION, 0);
+cmd ::= SET set_scope(X) TRANSACTION transaction_characteristics(Y). {
+  maxscaleSet(pParse, X, (Y & MXS_TRX_READ_ONLY) ? MXS_SET_TRANSACTION_READ_ONLY : MXS_SET_TRANSACTION, 0);
 }
 
 //////////////////////// The USE statement ////////////////////////////////////
@@ -3144,8 +3151,24 @@ show(A) ::= SHOW WARNINGS show_warnings_options. {
 //////////////////////// The START TRANSACTION statement ////////////////////////////////////
 //
 
-cmd ::= START TRANSACTION. {
-  mxs_sqlite3BeginTransaction(pParse, 0);
+%type start_transaction_characteristic {int}
+start_transaction_characteristic(A) ::= READ WRITE. {A = 0;}
+start_transaction_characteristic(A) ::= READ id(X).      // READ ONLY
+{
+  A = (X.n == 4 && sqlite3StrNICmp(X.z, "ONLY", 4) == 0) ? MXS_TRX_READ_ONLY : 0;
+}
+start_transaction_characteristic(A) ::= WITH id id. {A = 0;} // WITH CONSISTENT SNAPSHOT
+
+%type start_transaction_characteristics {int}
+start_transaction_characteristics(A) ::= . {A = 0;}
+start_transaction_characteristics(A) ::= start_transaction_characteristic(X). {A = X;}
+start_transaction_characteristics(A) ::=
+  start_transaction_characteristics(X) COMMA start_transaction_characteristic(Y). {
+  A = X | Y;
+}
+
+cmd ::= START TRANSACTION start_transaction_characteristics(X). {
+  mxs_sqlite3BeginTransaction(pParse, 0, X);
 }
 
 //////////////////////// The TRUNCATE statement ////////////////////////////////////
@@ -4103,9 +4103,13 @@ typedef struct MxsDrop
 typedef enum mxs_set
 {
     MXS_SET_VARIABLES,
-    MXS_SET_TRANSACTION
+    MXS_SET_TRANSACTION,
+    MXS_SET_TRANSACTION_READ_ONLY
 } mxs_set_t;
 
+/* Transaction characteristics of SET TRANSACTION and START TRANSACTION. */
+#define MXS_TRX_READ_ONLY 0x01
+
 typedef enum mxs_show
 {
     MXS_SHOW_COLUMNS,
@@ -0,0 +1,595 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file benchmark.cc - Measure the speed of query classifiers
+ *
+ * The statements of the given files are classified by each classifier, using
+ * the same calls the routers make, once per round in each of the threads. The
+ * time and the number of memory allocations of every call are recorded. The
+ * allocations are counted by replacing malloc and friends of glibc in this
+ * executable, which also catches those made by the loaded classifiers.
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <gwdirs.h>
+#include <log_manager.h>
+#include <mysql_client_server_protocol.h>
+#include <query_classifier.h>
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::ifstream;
+using std::istream;
+using std::string;
+using std::vector;
+
+extern "C"
+{
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t nmemb, size_t size);
+    void* __libc_realloc(void* ptr, size_t size);
+    void  __libc_free(void* ptr);
+}
+
+namespace
+{
+
+__thread uint64_t n_allocations;
+
+}
+
+extern "C"
+{
+
+void* malloc(size_t size)
+{
+    ++n_allocations;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+    ++n_allocations;
+    return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    ++n_allocations;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr)
+{
+    __libc_free(ptr);
+}
+
+}
+
+namespace
+{
+
+char USAGE[] =
+    "usage: qc_benchmark [-c classifier]... [-A args] [-t threads] [-r rounds] [-e] [-l] [-j] file...\n\n"
+    "-c    a classifier to measure, may be repeated, default qc_sqlite\n"
+    "-A    arguments for the classifiers\n"
+    "-t    the number of threads classifying the statements, default 1\n"
+    "-r    the number of times each thread classifies the statements, default 1\n"
+    "-e    parse only what the routers need for routing, by default everything is collected\n"
+    "-l    every line is a statement, by default statements end with a semicolon\n"
+    "-j    print the results as JSON, one object per classifier per line\n";
+
+enum api_t
+{
+    API_PARSE,
+    API_GET_TYPE,
+    API_GET_OPERATION,
+    API_GET_CREATED_TABLE_NAME,
+    API_IS_DROP_TABLE_QUERY,
+    API_IS_REAL_QUERY,
+    API_GET_TABLE_NAMES,
+    API_QUERY_HAS_CLAUSE,
+    API_GET_AFFECTED_FIELDS,
+    API_GET_DATABASE_NAMES,
+    API_N
+};
+
+const char* API_NAMES[API_N] =
+{
+    "qc_parse",
+    "qc_get_type",
+    "qc_get_operation",
+    "qc_get_created_table_name",
+    "qc_is_drop_table_query",
+    "qc_is_real_query",
+    "qc_get_table_names",
+    "qc_query_has_clause",
+    "qc_get_affected_fields",
+    "qc_get_database_names"
+};
+
+struct ApiStats
+{
+    uint64_t calls;
+    uint64_t nsecs;
+    uint64_t allocations;
+};
+
+struct Worker
+{
+    pthread_t thread;
+    QUERY_CLASSIFIER* pClassifier;
+    const vector<string>* pStatements;
+    size_t rounds;
+    uint32_t collect;
+    bool ok;
+    ApiStats stats[API_N];
+};
+
+uint64_t now()
+{
+    timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define MEASURE(stats, api, call) \
+    do \
+    { \
+        uint64_t allocations = n_allocations; \
+        uint64_t start = now(); \
+        call; \
+        (stats)[api].nsecs += now() - start; \
+        (stats)[api].allocations += n_allocations - allocations; \
+        ++(stats)[api].calls; \
+    } \
+    while (false)
+
+GWBUF* create_gwbuf(const string& s)
+{
+    size_t len = s.length() + 1;
+    size_t gwbuf_len = len + MYSQL_HEADER_LEN + 1;
+
+    GWBUF* gwbuf = gwbuf_alloc(gwbuf_len);
+
+    *((unsigned char*)((char*)GWBUF_DATA(gwbuf))) = len;
+    *((unsigned char*)((char*)GWBUF_DATA(gwbuf) + 1)) = (len >> 8);
+    *((unsigned char*)((char*)GWBUF_DATA(gwbuf) + 2)) = (len >> 16);
+    *((unsigned char*)((char*)GWBUF_DATA(gwbuf) + 3)) = 0x00;
+    *((unsigned char*)((char*)GWBUF_DATA(gwbuf) + 4)) = 0x03;
+    memcpy((char*)GWBUF_DATA(gwbuf) + 5, s.c_str(), s.length() + 1);
+
+    return gwbuf;
+}
+
+void free_strings(char** strings, int n)
+{
+    if (strings)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            free(strings[i]);
+        }
+
+        free(strings);
+    }
+}
+
+/**
+ * Classify a statement the way the routers do. The results are freed outside
+ * the measured calls.
+ */
+void classify(QUERY_CLASSIFIER* pClassifier, uint32_t collect, GWBUF* pStmt, ApiStats* stats)
+{
+    char* zName;
+    char** pzNames;
+    int n;
+
+    MEASURE(stats, API_PARSE, pClassifier->qc_parse(pStmt, collect));
+    MEASURE(stats, API_GET_TYPE, pClassifier->qc_get_type(pStmt));
+    MEASURE(stats, API_GET_OPERATION, pClassifier->qc_get_operation(pStmt));
+    MEASURE(stats, API_IS_DROP_TABLE_QUERY, pClassifier->qc_is_drop_table_query(pStmt));
+    MEASURE(stats, API_IS_REAL_QUERY, pClassifier->qc_is_real_query(pStmt));
+    MEASURE(stats, API_QUERY_HAS_CLAUSE, pClassifier->qc_query_has_clause(pStmt));
+
+    if (collect & QC_COLLECT_TABLES)
+    {
+        MEASURE(stats, API_GET_CREATED_TABLE_NAME, zName = pClassifier->qc_get_created_table_name(pStmt));
+        free(zName);
+
+        n = 0;
+        MEASURE(stats, API_GET_TABLE_NAMES, pzNames = pClassifier->qc_get_table_names(pStmt, &n, true));
+        free_strings(pzNames, n);
+    }
+
+    if (collect & QC_COLLECT_FIELDS)
+    {
+        MEASURE(stats, API_GET_AFFECTED_FIELDS, zName = pClassifier->qc_get_affected_fields(pStmt));
+        free(zName);
+    }
+
+    if (collect & QC_COLLECT_DATABASES)
+    {
+        n = 0;
+        MEASURE(stats, API_GET_DATABASE_NAMES, pzNames = pClassifier->qc_get_database_names(pStmt, &n));
+        free_strings(pzNames, n);
+    }
+}
+
+void* run_worker(void* pData)
+{
+    Worker* pWorker = static_cast<Worker*>(pData);
+    QUERY_CLASSIFIER* pClassifier = pWorker->pClassifier;
+    const vector<string>& statements = *pWorker->pStatements;
+
+    pWorker->ok = pClassifier->qc_thread_init();
+
+    if (pWorker->ok)
+    {
+        for (size_t round = 0; round < pWorker->rounds; ++round)
+        {
+            for (vector<string>::const_iterator i = statements.begin(); i != statements.end(); ++i)
+            {
+                GWBUF* pStmt = create_gwbuf(*i);
+                classify(pClassifier, pWorker->collect, pStmt, pWorker->stats);
+                gwbuf_free(pStmt);
+            }
+        }
+
+        pClassifier->qc_thread_end();
+    }
+
+    return NULL;
+}
+
+inline void trim(string& s)
+{
+    const char WHITESPACE[] = " \t\r\n";
+    string::size_type first = s.find_first_not_of(WHITESPACE);
+
+    if (first == string::npos)
+    {
+        s.clear();
+    }
+    else
+    {
+        s = s.substr(first, s.find_last_not_of(WHITESPACE) - first + 1);
+    }
+}
+
+/**
+ * Read the statements of a file. Empty lines and lines starting with '#' or
+ * "--" are skipped.
+ *
+ * @param in         The file
+ * @param statements The vector the statements are appended to
+ * @param per_line   If true, every line is a statement as in captured
+ *                   workloads, otherwise a statement ends with a line ending
+ *                   with a semicolon as in input.sql
+ */
+void read_statements(istream& in, vector<string>& statements, bool per_line)
+{
+    string line;
+    string statement;
+
+    while (std::getline(in, line))
+    {
+        trim(line);
+
+        if (!line.empty() && (line.at(0) != '#') && (line.substr(0, 2) != "--"))
+        {
+            statement += line;
+
+            if (per_line || (line.at(line.length() - 1) == ';'))
+            {
+                statements.push_back(statement);
+                statement.clear();
+            }
+            else
+            {
+                statement += " ";
+            }
+        }
+    }
+
+    if (!statement.empty())
+    {
+        statements.push_back(statement);
+    }
+}
+
+QUERY_CLASSIFIER* get_classifier(const char* zName, const char* zArgs)
+{
+    size_t len = strlen(zName);
+    char libdir[len + 4];
+
+    sprintf(libdir, "../%s", zName);
+
+    set_libdir(strdup(libdir));
+
+    QUERY_CLASSIFIER* pClassifier = qc_load(zName);
+
+    if (!pClassifier)
+    {
+        cerr << "error: Could not load classifier " << zName << "." << endl;
+    }
+    else if (!pClassifier->qc_init(zArgs))
+    {
+        cerr << "error: Could not init classifier " << zName << "." << endl;
+        qc_unload(pClassifier);
+        pClassifier = 0;
+    }
+
+    return pClassifier;
+}
+
+void put_classifier(QUERY_CLASSIFIER* pClassifier)
+{
+    pClassifier->qc_end();
+    qc_unload(pClassifier);
+}
+
+void report(const char* zClassifier, size_t n_threads, uint64_t n_statements,
+            uint64_t nsecs, const ApiStats* stats, bool json)
+{
+    double secs = nsecs / 1000000000.0;
+    double statements_per_sec = secs > 0 ? n_statements / secs : 0;
+    uint64_t allocations = 0;
+
+    for (int i = 0; i < API_N; ++i)
+    {
+        allocations += stats[i].allocations;
+    }
+
+    double allocations_per_statement = n_statements ? (double)allocations / n_statements : 0;
+
+    if (json)
+    {
+        cout << "{\"classifier\": \"" << zClassifier << "\""
+             << ", \"threads\": " << n_threads
+             << ", \"statements\": " << n_statements
+             << ", \"seconds\": " << secs
+             << ", \"statements_per_second\": " << statements_per_sec
+             << ", \"allocations_per_statement\": " << allocations_per_statement
+             << ", \"calls\": {";
+
+        bool first = true;
+
+        for (int i = 0; i < API_N; ++i)
+        {
+            if (stats[i].calls)
+            {
+                cout << (first ? "" : ", ") << "\"" << API_NAMES[i] << "\": "
+                     << "{\"calls\": " << stats[i].calls
+                     << ", \"ns_per_call\": " << (double)stats[i].nsecs / stats[i].calls
+                     << ", \"allocations_per_call\": " << (double)stats[i].allocations / stats[i].calls
+                     << "}";
+                first = false;
+            }
+        }
+
+        cout << "}}" << endl;
+    }
+    else
+    {
+        cout << "Classifier               : " << zClassifier << endl
+             << "Threads                  : " << n_threads << endl
+             << "Statements               : " << n_statements << endl
+             << "Time (s)                 : " << secs << endl
+             << "Statements/s             : " << statements_per_sec << endl
+             << "Allocations/statement    : " << allocations_per_statement << endl
+             << endl;
+
+        printf("%-26s %12s %12s %12s\n", "Call", "Calls", "ns/call", "Allocs/call");
+
+        for (int i = 0; i < API_N; ++i)
+        {
+            if (stats[i].calls)
+            {
+                printf("%-26s %12llu %12.1f %12.2f\n", API_NAMES[i],
+                       (unsigned long long)stats[i].calls,
+                       (double)stats[i].nsecs / stats[i].calls,
+                       (double)stats[i].allocations / stats[i].calls);
+            }
+        }
+
+        cout << endl;
+    }
+}
+
+bool benchmark(const char* zClassifier, const char* zArgs, const vector<string>& statements,
+               size_t n_threads, size_t rounds, uint32_t collect, bool json)
+{
+    QUERY_CLASSIFIER* pClassifier = get_classifier(zClassifier, zArgs);
+
+    if (!pClassifier)
+    {
+        return false;
+    }
+
+    vector<Worker> workers(n_threads);
+    bool ok = true;
+    uint64_t start = now();
+
+    for (size_t i = 0; i < n_threads; ++i)
+    {
+        Worker& worker = workers[i];
+
+        memset(&worker, 0, sizeof(worker));
+        worker.pClassifier = pClassifier;
+        worker.pStatements = &statements;
+        worker.rounds = rounds;
+        worker.collect = collect;
+
+        if (pthread_create(&worker.thread, NULL, run_worker, &worker) != 0)
+        {
+            cerr << "error: Could not create thread." << endl;
+            n_threads = i;
+            ok = false;
+            break;
+        }
+    }
+
+    ApiStats stats[API_N] = {};
+
+    for (size_t i = 0; i < n_threads; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+
+        if (!workers[i].ok)
+        {
+            cerr << "error: Could not init classifier " << zClassifier << " for a thread." << endl;
+            ok = false;
+        }
+
+        for (int j = 0; j < API_N; ++j)
+        {
+            stats[j].calls += workers[i].stats[j].calls;
+            stats[j].nsecs += workers[i].stats[j].nsecs;
+            stats[j].allocations += workers[i].stats[j].allocations;
+        }
+    }
+
+    uint64_t nsecs = now() - start;
+
+    if (ok)
+    {
+        report(zClassifier, n_threads, stats[API_PARSE].calls, nsecs, stats, json);
+    }
+
+    put_classifier(pClassifier);
+
+    return ok;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    int rc = EXIT_SUCCESS;
+
+    vector<const char*> classifiers;
+    const char* zArgs = NULL;
+    size_t n_threads = 1;
+    size_t rounds = 1;
+    uint32_t collect = QC_COLLECT_ALL;
+    bool per_line = false;
+    bool json = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "c:A:t:r:elj")) != -1)
+    {
+        switch (c)
+        {
+        case 'c':
+            classifiers.push_back(optarg);
+            break;
+
+        case 'A':
+            zArgs = optarg;
+            break;
+
+        case 't':
+            n_threads = atoi(optarg);
+            break;
+
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+
+        case 'e':
+            collect = QC_COLLECT_ESSENTIALS;
+            break;
+
+        case 'l':
+            per_line = true;
+            break;
+
+        case 'j':
+            json = true;
+            break;
+
+        default:
+            rc = EXIT_FAILURE;
+            break;
+        };
+    }
+
+    if ((rc == EXIT_SUCCESS) && (optind < argc) && (n_threads > 0) && (rounds > 0))
+    {
+        vector<string> statements;
+
+        for (int i = optind; i < argc; ++i)
+        {
+            ifstream in(argv[i]);
+
+            if (in)
+            {
+                read_statements(in, statements, per_line);
+            }
+            else
+            {
+                cerr << "error: Could not open " << argv[i] << "." << endl;
+                rc = EXIT_FAILURE;
+            }
+        }
+
+        if (classifiers.empty())
+        {
+            classifiers.push_back("qc_sqlite");
+        }
+
+        if (rc == EXIT_SUCCESS)
+        {
+            set_datadir(strdup("/tmp"));
+            set_langdir(strdup("."));
+            set_process_datadir(strdup("/tmp"));
+
+            if (mxs_log_init(NULL, ".", MXS_LOG_TARGET_DEFAULT))
+            {
+                for (vector<const char*>::iterator i = classifiers.begin(); i != classifiers.end(); ++i)
+                {
+                    if (!benchmark(*i, zArgs, statements, n_threads, rounds, collect, json))
+                    {
+                        rc = EXIT_FAILURE;
+                    }
+                }
+
+                mxs_log_finish();
+            }
+            else
+            {
+                cerr << "error: Could not initialize log." << endl;
+                rc = EXIT_FAILURE;
+            }
+        }
+    }
+    else
+    {
+        cout << USAGE << endl;
+        rc = EXIT_FAILURE;
+    }
+
+    return rc;
+}
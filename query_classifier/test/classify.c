@@ -141,6 +141,10 @@ char* get_types_as_string(uint32_t types)
     {
         s = append(s, "QUERY_TYPE_SHOW_TABLES", &len);
     }
+    if (types & QUERY_TYPE_READ_ONLY_TRX)
+    {
+        s = append(s, "QUERY_TYPE_READ_ONLY_TRX", &len);
+    }
 
     if (!s)
     {
@@ -13,3 +13,5 @@ QUERY_TYPE_BEGIN_TRX
 QUERY_TYPE_ROLLBACK
 QUERY_TYPE_COMMIT
 QUERY_TYPE_SESSION_WRITE
+QUERY_TYPE_BEGIN_TRX|QUERY_TYPE_READ_ONLY_TRX
+QUERY_TYPE_WRITE|QUERY_TYPE_READ_ONLY_TRX
@@ -13,3 +13,5 @@ BEGIN;
 ROLLBACK;
 COMMIT;
 use X;
+START TRANSACTION READ ONLY;
+SET TRANSACTION READ ONLY;
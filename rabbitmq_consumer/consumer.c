@@ -25,6 +25,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/time.h>
+
+/** The defaults of batch_size and batch_timeout */
+#define DEFAULT_BATCH_SIZE 100
+#define DEFAULT_BATCH_TIMEOUT 200
 
 typedef struct delivery_t
 {
@@ -38,15 +43,37 @@ typedef struct consumer_t
     char *hostname, *vhost, *user, *passwd, *queue, *dbserver, *dbname, *dbuser, *dbpasswd;
     DELIVERY* query_stack;
     int port, dbport;
+    int batch_size;     /*< Messages written in one transaction */
+    int batch_timeout;  /*< Milliseconds a message may wait for its batch to fill */
 } CONSUMER;
 
+/**
+ * The messages waiting to be written. The statements of all the messages are
+ * sent in one multi-statement transaction and the messages are acknowledged
+ * once it commits.
+ */
+typedef struct batch_t
+{
+    char *sql;              /*< START TRANSACTION and the statements of the messages */
+    size_t len;             /*< Length of sql */
+    size_t size;            /*< Size of the allocation of sql */
+    size_t *ends;           /*< Where the statements of each message end in sql */
+    uint64_t *tags;         /*< The delivery tags of the messages */
+    int count;              /*< Messages in the batch */
+    struct timeval started; /*< When the first message was added */
+} BATCH;
+
 static int all_ok;
 static FILE* out_fd;
 static CONSUMER* c_inst;
 static char* DB_DATABASE = "CREATE DATABASE IF NOT EXISTS %s;";
 static char* DB_TABLE =
     "CREATE TABLE IF NOT EXISTS pairs (tag VARCHAR(64) PRIMARY KEY NOT NULL, query VARCHAR(2048), reply VARCHAR(2048), date_in DATETIME NOT NULL, date_out DATETIME DEFAULT NULL, counter INT DEFAULT 1)";
-static char* DB_INSERT = "INSERT INTO pairs(tag, query, date_in) VALUES ('%s','%s',FROM_UNIXTIME(%s))";
+static char* DB_INSERT =
+    "INSERT INTO pairs(tag, query, date_in) SELECT '%s','%s',FROM_UNIXTIME(%s) FROM DUAL "
+    "WHERE NOT EXISTS (SELECT 1 FROM pairs WHERE query='%s')";
+static char* DB_BEGIN = "START TRANSACTION;";
+static char* DB_COMMIT = "COMMIT";
 static char* DB_UPDATE = "UPDATE pairs SET reply='%s', date_out=FROM_UNIXTIME(%s) WHERE tag='%s'";
 static char* DB_INCREMENT =
     "UPDATE pairs SET counter = counter+1, date_out=FROM_UNIXTIME(%s) WHERE query='%s'";
@@ -114,6 +141,14 @@ int handler(void* user, const char* section, const char* name,
         {
             out_fd = fopen(value, "ab");
         }
+        else if (strcmp(name, "batch_size") == 0)
+        {
+            c_inst->batch_size = atoi(value);
+        }
+        else if (strcmp(name, "batch_timeout") == 0)
+        {
+            c_inst->batch_timeout = atoi(value);
+        }
 
     }
 
@@ -151,7 +186,7 @@ int connectToServer(MYSQL* server)
                                         NULL,
                                         c_inst->dbport,
                                         NULL,
-                                        0);
+                                        CLIENT_MULTI_STATEMENTS);
 
 
     if (result == NULL)
@@ -197,11 +232,91 @@ int connectToServer(MYSQL* server)
     return 1;
 }
 
-int sendMessage(MYSQL* server, amqp_message_t* msg)
+/**
+ * Append text to the statements of a batch
+ *
+ * @param batch The batch
+ * @param str   The text
+ * @return 0 on success, 1 if memory could not be allocated
+ */
+int appendBatch(BATCH* batch, const char* str)
+{
+    size_t len = strlen(str);
+
+    if (batch->len + len + 1 > batch->size)
+    {
+        size_t size = (batch->len + len + 1) * 2;
+        char* sql = realloc(batch->sql, size);
+
+        if (sql == NULL)
+        {
+            return 1;
+        }
+        batch->sql = sql;
+        batch->size = size;
+    }
+    memcpy(batch->sql + batch->len, str, len + 1);
+    batch->len += len;
+    return 0;
+}
+
+/**
+ * Start a new batch
+ *
+ * @param batch The batch
+ */
+void resetBatch(BATCH* batch)
+{
+    batch->len = 0;
+    batch->count = 0;
+    appendBatch(batch, DB_BEGIN);
+}
+
+/**
+ * Run one or more statements and read all their results
+ *
+ * @param server    The SQL server
+ * @param sql       The statements, separated by semicolons
+ * @param len       Length of sql
+ * @return 0 on success, non-zero if a statement failed
+ */
+int runStatements(MYSQL* server, const char* sql, size_t len)
 {
-    int buffsz = (int)((msg->body.len + 1) * 2 + 1) +
+    int status;
+
+    if (mysql_real_query(server, sql, len))
+    {
+        return 1;
+    }
+
+    /** The results of all the statements must be read before the next query */
+    do
+    {
+        MYSQL_RES* res = mysql_store_result(server);
+        if (res)
+        {
+            mysql_free_result(res);
+        }
+    }
+    while ((status = mysql_next_result(server)) == 0);
+
+    return status > 0;
+}
+
+/**
+ * Add the statements of a message to a batch
+ *
+ * @param server    The SQL server, used for escaping the values
+ * @param batch     The batch
+ * @param msg       The message
+ * @param tag       The delivery tag of the message
+ * @return 0 if the message was added, 1 if it is not valid
+ */
+int addMessage(MYSQL* server, BATCH* batch, amqp_message_t* msg, uint64_t tag)
+{
+    int buffsz = (int)((msg->body.len + 1) * 2 + 1) * 5 +
                  (int)((msg->properties.correlation_id.len + 1) * 2 + 1) +
-                 strlen(DB_INSERT),
+                 strlen(DB_INCREMENT) + strlen(DB_INSERT) + 3,
                  rval = 0;
     char* saved;
     char *qstr = calloc(buffsz, sizeof(char)),
@@ -237,25 +352,19 @@ int sendMessage(MYSQL* server, amqp_message_t* msg)
     if (strncmp(msg->properties.message_id.bytes,
                 "query", msg->properties.message_id.len) == 0)
     {
-
-        sprintf(qstr, DB_INCREMENT, clndate, clnmsg);
-        rval = mysql_query(server, qstr);
-
-        if (mysql_affected_rows(server) == 0)
-        {
-            memset(qstr, 0, buffsz);
-            sprintf(qstr, DB_INSERT, clntag, clnmsg, clndate);
-            rval = mysql_query(server, qstr);
-        }
-
+        /** The insert only happens if the update found no row, as one statement */
+        int n = sprintf(qstr, DB_INCREMENT, clndate, clnmsg);
+        qstr[n++] = ';';
+        n += sprintf(qstr + n, DB_INSERT, clntag, clnmsg, clndate, clnmsg);
+        qstr[n++] = ';';
+        qstr[n] = '\0';
     }
     else if (strncmp(msg->properties.message_id.bytes,
                      "reply", msg->properties.message_id.len) == 0)
     {
-
-        sprintf(qstr, DB_UPDATE, clnmsg, clndate, clntag);
-        rval = mysql_query(server, qstr);
-
+        int n = sprintf(qstr, DB_UPDATE, clnmsg, clndate, clntag);
+        qstr[n++] = ';';
+        qstr[n] = '\0';
     }
     else
     {
@@ -263,13 +372,21 @@ int sendMessage(MYSQL* server, amqp_message_t* msg)
         goto cleanup;
     }
 
-
-    if (rval)
+    if (appendBatch(batch, qstr))
     {
-        fprintf(stderr, "Could not send query to SQL server:%s\n", mysql_error(server));
+        fprintf(stderr, "Fatal Error: Cannot allocate enough memory.\n");
+        rval = 1;
         goto cleanup;
     }
 
+    if (batch->count == 0)
+    {
+        gettimeofday(&batch->started, NULL);
+    }
+    batch->ends[batch->count] = batch->len;
+    batch->tags[batch->count] = tag;
+    batch->count++;
+
 cleanup:
     free(qstr);
     free(rawmsg);
@@ -282,6 +399,68 @@ cleanup:
     return rval;
 }
 
+/**
+ * Write the messages of a batch in one transaction and acknowledge them all
+ * with one acknowledgement once it has committed. If the transaction fails,
+ * the messages are written one at a time so that only the messages that
+ * fail are rejected.
+ *
+ * @param server    The SQL server
+ * @param conn      The RabbitMQ connection
+ * @param channel   The channel the messages were received from
+ * @param batch     The batch, empty when this returns
+ */
+void flushBatch(MYSQL* server, amqp_connection_state_t conn, int channel, BATCH* batch)
+{
+    if (batch->count == 0)
+    {
+        return;
+    }
+
+    if (appendBatch(batch, DB_COMMIT) == 0 && runStatements(server, batch->sql, batch->len) == 0)
+    {
+        amqp_basic_ack(conn, channel, batch->tags[batch->count - 1], 1);
+    }
+    else
+    {
+        fprintf(stderr, "Could not write a batch of %d messages to SQL server, "
+                "writing them one at a time: %s\n", batch->count, mysql_error(server));
+        runStatements(server, "ROLLBACK", strlen("ROLLBACK"));
+
+        size_t start = strlen(DB_BEGIN);
+
+        for (int i = 0; i < batch->count; i++)
+        {
+            if (runStatements(server, batch->sql + start, batch->ends[i] - start))
+            {
+                fprintf(stderr, "Could not send query to SQL server:%s\n", mysql_error(server));
+                amqp_basic_reject(conn, channel, batch->tags[i], 0);
+            }
+            else
+            {
+                amqp_basic_ack(conn, channel, batch->tags[i], 0);
+            }
+            start = batch->ends[i];
+        }
+    }
+    resetBatch(batch);
+}
+
+/**
+ * Milliseconds since the first message was added to a batch
+ *
+ * @param batch The batch
+ * @return The age of the batch
+ */
+long batchAge(BATCH* batch)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - batch->started.tv_sec) * 1000 +
+           (now.tv_usec - batch->started.tv_usec) / 1000;
+}
+
 int sendToServer(MYSQL* server, amqp_message_t* a, amqp_message_t* b)
 {
 
@@ -402,6 +581,7 @@ int main(int argc, char** argv)
     amqp_frame_t frame;
     struct timeval timeout;
     MYSQL db_inst;
+    BATCH batch = {0};
     char ch, *cnfname = NULL, *cnfpath = NULL;
     static const char* fname = "consumer.cnf";
     const char* default_path = "@CMAKE_INSTALL_PREFIX@/etc";
@@ -411,6 +591,8 @@ int main(int argc, char** argv)
         fprintf(stderr, "Fatal Error: Cannot allocate enough memory.\n");
         return 1;
     }
+    c_inst->batch_size = DEFAULT_BATCH_SIZE;
+    c_inst->batch_timeout = DEFAULT_BATCH_TIMEOUT;
 
     if (signal(SIGINT, sighndl) == SIG_IGN)
     {
@@ -489,6 +671,19 @@ int main(int argc, char** argv)
         goto fatal_error;
     }
 
+    if (c_inst->batch_size < 1)
+    {
+        c_inst->batch_size = 1;
+    }
+
+    if ((batch.ends = calloc(c_inst->batch_size, sizeof(size_t))) == NULL ||
+        (batch.tags = calloc(c_inst->batch_size, sizeof(uint64_t))) == NULL)
+    {
+        fprintf(stderr, "Fatal Error: Cannot allocate enough memory.\n");
+        goto fatal_error;
+    }
+    resetBatch(&batch);
+
     connectToServer(&db_inst);
 
     if ((conn = amqp_new_connection()) == NULL ||
@@ -527,18 +722,28 @@ int main(int argc, char** argv)
         fprintf(stderr, "Error: Cannot allocate enough memory.\n");
         goto error;
     }
+    /** The broker keeps sending while a batch waits for its acknowledgement */
+    amqp_basic_qos(conn, channel, 0, c_inst->batch_size * 2, 0);
     amqp_basic_consume(conn, channel, amqp_cstring_bytes(c_inst->queue), amqp_empty_bytes, 0, 0, 0,
                        amqp_empty_table);
 
     while (all_ok)
     {
+        struct timeval batch_wait = {c_inst->batch_timeout / 1000, (c_inst->batch_timeout % 1000) * 1000};
 
-        status = amqp_simple_wait_frame_noblock(conn, &frame, &timeout);
+        status = amqp_simple_wait_frame_noblock(conn, &frame, batch.count ? &batch_wait : &timeout);
 
         /**No frames to read from server, possibly out of messages*/
         if (status == AMQP_STATUS_TIMEOUT)
         {
-            sleep(timeout.tv_sec);
+            if (batch.count)
+            {
+                flushBatch(&db_inst, conn, channel, &batch);
+            }
+            else
+            {
+                sleep(timeout.tv_sec);
+            }
             continue;
         }
 
@@ -549,20 +754,19 @@ int main(int argc, char** argv)
 
             amqp_read_message(conn, channel, reply, 0);
 
-            if (sendMessage(&db_inst, reply))
+            if (addMessage(&db_inst, &batch, reply, decoded->delivery_tag))
             {
 
                 fprintf(stderr, "\33[31;1mRabbitMQ Error\33[0m: Received malformed message.\n");
                 amqp_basic_reject(conn, channel, decoded->delivery_tag, 0);
-                amqp_destroy_message(reply);
 
             }
-            else
-            {
-
-                amqp_basic_ack(conn, channel, decoded->delivery_tag, 0);
-                amqp_destroy_message(reply);
+            amqp_destroy_message(reply);
 
+            if (batch.count >= c_inst->batch_size ||
+                (batch.count && batchAge(&batch) >= c_inst->batch_timeout))
+            {
+                flushBatch(&db_inst, conn, channel, &batch);
             }
 
         }
@@ -577,6 +781,7 @@ int main(int argc, char** argv)
     }
 
     fprintf(out_fd, "Shutting down...\n");
+    flushBatch(&db_inst, conn, channel, &batch);
 error:
 
     mysql_close(&db_inst);
@@ -599,6 +804,10 @@ error:
     amqp_destroy_connection(conn);
 fatal_error:
 
+    free(batch.sql);
+    free(batch.ends);
+    free(batch.tags);
+
     if (out_fd)
     {
         fclose(out_fd);
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file affinity.c - Consistent hashing of sessions to servers
+ *
+ * The score of a server is weight / -ln(u) where u is a uniform value in
+ * (0, 1) hashed from the key and the server name. The highest of these is
+ * the highest random weight, which picks each server with a probability
+ * proportional to its weight.
+ */
+
+#include <affinity.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <dcb.h>
+#include <mysql_client_server_protocol.h>
+
+bool affinity_parse_key(const char *str, affinity_key_t *type)
+{
+    bool rval = true;
+
+    if (strcasecmp(str, "client") == 0)
+    {
+        *type = AFFINITY_CLIENT;
+    }
+    else if (strcasecmp(str, "user") == 0)
+    {
+        *type = AFFINITY_USER;
+    }
+    else if (strcasecmp(str, "database") == 0)
+    {
+        *type = AFFINITY_DATABASE;
+    }
+    else
+    {
+        rval = false;
+    }
+
+    return rval;
+}
+
+const char* affinity_session_key(affinity_key_t type, SESSION *session)
+{
+    DCB *dcb = session->client_dcb;
+    const char *key = NULL;
+
+    if (dcb == NULL)
+    {
+        return NULL;
+    }
+
+    switch (type)
+    {
+        case AFFINITY_CLIENT:
+            key = dcb->remote;
+            break;
+
+        case AFFINITY_USER:
+            key = dcb->user;
+            break;
+
+        case AFFINITY_DATABASE:
+            if (dcb->data)
+            {
+                key = ((MYSQL_session *)dcb->data)->db;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    /** Sessions without a key are balanced normally */
+    return key && *key ? key : NULL;
+}
+
+/**
+ * 64-bit FNV-1a hash of a string, continuing from a previous hash
+ */
+static uint64_t
+affinity_hash(uint64_t hash, const char *str)
+{
+    for (const unsigned char *c = (const unsigned char *) str; *c; c++)
+    {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+double affinity_score(const char *key, const char *server, int weight)
+{
+    if (weight <= 0)
+    {
+        return 0;
+    }
+
+    uint64_t hash = affinity_hash(14695981039346656037ULL, key);
+    /** Separate the key from the server so that "ab" + "c" != "a" + "bc" */
+    hash = (hash ^ 0xff) * 1099511628211ULL;
+    hash = affinity_hash(hash, server);
+
+    /** FNV-1a mixes the last bytes poorly, finish with the MurmurHash3 mixer */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    /** The top 53 bits as a value in (0, 1) */
+    double u = ((hash >> 11) + 0.5) / 9007199254740992.0;
+
+    return weight / -log(u);
+}
@@ -34,15 +34,24 @@
  *                                      accessed by "show buffers" maxadmin command
  * 20/12/2015   Martin Brampton         Change gwbuf_free to free the whole list; add the
  *                                      gwbuf_count and gwbuf_alloc_and_load functions.
+ * 14/10/2016   Core Team               Allocate the header, shared buffer and data in one
+ *                                      block from the buffer pools.
+ * 15/10/2016   Core Team               Add gwbuf_grow
+ * 15/10/2016   Core Team               Count the buffers in the memory statistics
  *
  * @endverbatim
  */
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
 #include <buffer.h>
 #include <atomic.h>
 #include <skygw_debug.h>
 #include <skygw_utils.h>
 #include <spinlock.h>
+#include <bufpool.h>
+#include <memstats.h>
+#include <dcb.h>
 #include <hint.h>
 #include <log_manager.h>
 #include <errno.h>
@@ -54,6 +63,47 @@
 static HASHTABLE *buffer_hashtable = NULL;
 #endif
 
+/**
+ * The inline properties of a buffer. A slot with the ID 0 is free.
+ */
+typedef struct
+{
+    uint16_t id[GWBUF_N_PROPERTIES];    /*< The property IDs */
+    uint8_t  owned;                     /*< Bit i set if value[i] is freed with the buffer */
+    void     *value[GWBUF_N_PROPERTIES];
+} GWBUF_PROPERTIES;
+
+/**
+ * A buffer header and its inline properties, the properties are outside of
+ * GWBUF so that the header fits in a cache line.
+ */
+typedef struct
+{
+    GWBUF            buf;
+    GWBUF_PROPERTIES props;
+} GWBUF_HEADER;
+
+/**
+ * The memory block of a buffer allocated by gwbuf_alloc. The data follows the
+ * shared buffer in the same block. The clones of the buffer have headers of
+ * their own, the block is freed when the last reference to the data is gone.
+ */
+typedef struct
+{
+    GWBUF_HEADER head;
+    SHARED_BUF   sbuf;
+} GWBUF_BLOCK;
+
+#define GWBUF_PROPS(b) (&((GWBUF_HEADER *)(b))->props)
+
+/** The maximum number of property names */
+#define GWBUF_MAX_PROPERTY_IDS 1024
+
+/** The interned property names, the ID is the index plus one */
+static char *property_names[GWBUF_MAX_PROPERTY_IDS];
+static int n_property_names = 0;
+static SPINLOCK property_lock = SPINLOCK_INIT;
+
 static void gwbuf_free_one(GWBUF *buf);
 static buffer_object_t* gwbuf_remove_buffer_object(GWBUF*           buf,
                                                    buffer_object_t* bufobj);
@@ -68,9 +118,8 @@ static void gwbuf_remove_from_hashtable(GWBUF *buf);
 /**
  * Allocate a new gateway buffer structure of size bytes.
  *
- * For now we allocate memory directly from malloc for buffer the management
- * structure and the actual data buffer itself. We may swap at a future date
- * to a more efficient mechanism.
+ * The buffer header, the shared buffer and the data are allocated as one block
+ * from the buffer pools, see bufpool.h.
  *
  * @param       size The size in bytes of the data area required
  * @return      Pointer to the buffer structure or NULL if memory could not
@@ -79,36 +128,26 @@ static void gwbuf_remove_from_hashtable(GWBUF *buf);
 GWBUF *
 gwbuf_alloc(unsigned int size)
 {
-    GWBUF      *rval;
-    SHARED_BUF *sbuf;
-
-    /* Allocate the buffer header */
-    if ((rval = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
-    {
-        goto retblock;
-    }
-
-    /* Allocate the shared data buffer */
-    if ((sbuf = (SHARED_BUF *)malloc(sizeof(SHARED_BUF))) == NULL)
-    {
-        free(rval);
-        rval = NULL;
-        goto retblock;
-    }
+    GWBUF       *rval = NULL;
+    SHARED_BUF  *sbuf;
+    GWBUF_BLOCK *block;
+    size_t      blocksize = sizeof(GWBUF_BLOCK) + size;
 
-    /* Allocate the space for the actual data */
-    if ((sbuf->data = (unsigned char *)malloc(size)) == NULL)
+    /* Allocate the header, the shared buffer and the data */
+    if ((block = (GWBUF_BLOCK *)bufpool_alloc(blocksize)) == NULL)
     {
-        ss_dassert(sbuf->data != NULL);
-        free(rval);
-        free(sbuf);
-        rval = NULL;
         goto retblock;
     }
-    spinlock_init(&rval->gwbuf_lock);
+    memstats_add(MEMSTATS_BUFFERS, blocksize, 1);
+    rval = &block->head.buf;
+    memset(&block->head.props, 0, sizeof(block->head.props));
+    sbuf = &block->sbuf;
+    sbuf->data = (unsigned char *)(block + 1);
+    sbuf->size = blocksize;
+    sbuf->refcount = 1;
+    sbuf->bufobj = NULL;
     rval->start = sbuf->data;
     rval->end = (void *)((char *)rval->start + size);
-    sbuf->refcount = 1;
     rval->sbuf = sbuf;
     rval->next = NULL;
     rval->tail = rval;
@@ -116,7 +155,6 @@ gwbuf_alloc(unsigned int size)
     rval->properties = NULL;
     rval->gwbuf_type = GWBUF_TYPE_UNDEFINED;
     rval->gwbuf_info = GWBUF_INFO_NONE;
-    rval->gwbuf_bufobj = NULL;
     CHK_GWBUF(rval);
 retblock:
     if (rval == NULL)
@@ -228,26 +266,48 @@ gwbuf_remove_from_hashtable(GWBUF *buf)
     hashtable_delete(buffer_hashtable, buf);
 }
 
+#endif
+
 /**
- * Print all buffer traces via a given print DCB
+ * Print the statistics of the buffer pools and, if buffer tracing is
+ * enabled, all buffer traces via a given print DCB
  *
  * @param pdcb  Print DCB for output
  */
 void
 dprintAllBuffers(void *pdcb)
 {
+    DCB *dcb = (DCB *)pdcb;
+    BUFPOOL_STATS stats;
+    int i;
+
+    dcb_printf(dcb, "Buffer Pools\n\n");
+    dcb_printf(dcb, " %-10s | %-12s | %-12s | %-10s | %-10s | %-10s\n",
+               "Block Size", "Hits", "Misses", "Depot Gets", "Depot Puts", "Depot Size");
+    dcb_printf(dcb, "------------+--------------+--------------+------------+------------+------------\n");
+    for (i = 0; i < BUFPOOL_N_CLASSES; i++)
+    {
+        bufpool_get_stats(i, &stats);
+        dcb_printf(dcb, " %-10lu | %-12lu | %-12lu | %-10lu | %-10lu | %-10d\n",
+                   (unsigned long)stats.size, stats.hits, stats.misses,
+                   stats.depot_gets, stats.depot_puts, stats.depot_size);
+    }
+    dcb_printf(dcb, "\nUnpooled allocations: %d\n", bufpool_unpooled());
+
+#if defined(BUFFER_TRACE)
     void *buf;
     char *backtrace;
     HASHITERATOR *buffers = hashtable_iterator(buffer_hashtable);
+    dcb_printf(dcb, "\n");
     while (NULL != (buf = hashtable_next(buffers)))
     {
-        dcb_printf((DCB *)pdcb, "Buffer: %p\n", (void *)buf);
+        dcb_printf(dcb, "Buffer: %p\n", (void *)buf);
         backtrace = hashtable_fetch(buffer_hashtable, buf);
-        dcb_printf((DCB *)pdcb, "%s", backtrace);
+        dcb_printf(dcb, "%s", backtrace);
     }
     hashtable_iterator_free(buffers);
-}
 #endif
+}
 
 /**
  * Free a list of gateway buffers
@@ -258,8 +318,6 @@ void
 gwbuf_free(GWBUF *buf)
 {
     GWBUF *nextbuf;
-    BUF_PROPERTY    *prop;
-    buffer_object_t *bo;
 
     while (buf)
     {
@@ -280,25 +338,37 @@ gwbuf_free_one(GWBUF *buf)
 {
     BUF_PROPERTY    *prop;
     buffer_object_t *bo;
-
-    if (atomic_add(&buf->sbuf->refcount, -1) == 1)
+    SHARED_BUF      *sbuf = buf->sbuf;
+    GWBUF_BLOCK     *block = (GWBUF_BLOCK *)((char *)sbuf - offsetof(GWBUF_BLOCK, sbuf));
+    GWBUF_PROPERTIES *props = GWBUF_PROPS(buf);
+    bool            embedded = buf == &block->head.buf;
+    int             i;
+    bool            last = atomic_add(&sbuf->refcount, -1) == 1;
+
+    if (last)
     {
-        free(buf->sbuf->data);
-        free(buf->sbuf);
-        bo = buf->gwbuf_bufobj;
+        bo = sbuf->bufobj;
 
         while (bo != NULL)
         {
             bo = gwbuf_remove_buffer_object(buf, bo);
         }
-
+    }
+    for (i = 0; props->owned && i < GWBUF_N_PROPERTIES; i++)
+    {
+        if (props->owned & (1 << i))
+        {
+            free(props->value[i]);
+        }
     }
     while (buf->properties)
     {
         prop = buf->properties;
         buf->properties = prop->next;
-        free(prop->name);
-        free(prop->value);
+        if (prop->owned)
+        {
+            free(prop->value);
+        }
         free(prop);
     }
     /** Release the hint */
@@ -311,7 +381,17 @@ gwbuf_free_one(GWBUF *buf)
 #if defined(BUFFER_TRACE)
     gwbuf_remove_from_hashtable(buf);
 #endif
-    free(buf);
+    /** The header of the original buffer is freed with the data */
+    if (!embedded)
+    {
+        memstats_add(MEMSTATS_BUFFERS, -(int64_t)sizeof(GWBUF_HEADER), -1);
+        bufpool_free(buf, sizeof(GWBUF_HEADER));
+    }
+    if (last)
+    {
+        memstats_add(MEMSTATS_BUFFERS, -(int64_t)sbuf->size, -1);
+        bufpool_free(block, sbuf->size);
+    }
 }
 
 /**
@@ -329,7 +409,7 @@ gwbuf_clone(GWBUF *buf)
 {
     GWBUF *rval;
 
-    if ((rval = (GWBUF *)calloc(1, sizeof(GWBUF))) == NULL)
+    if ((rval = (GWBUF *)bufpool_alloc(sizeof(GWBUF_HEADER))) == NULL)
     {
         ss_dassert(rval != NULL);
         char errbuf[STRERROR_BUFLEN];
@@ -338,13 +418,14 @@ gwbuf_clone(GWBUF *buf)
         return NULL;
     }
 
+    memstats_add(MEMSTATS_BUFFERS, sizeof(GWBUF_HEADER), 1);
+    memset(rval, 0, sizeof(GWBUF_HEADER));
     atomic_add(&buf->sbuf->refcount, 1);
     rval->sbuf = buf->sbuf;
     rval->start = buf->start;
     rval->end = buf->end;
     rval->gwbuf_type = buf->gwbuf_type;
     rval->gwbuf_info = buf->gwbuf_info;
-    rval->gwbuf_bufobj = buf->gwbuf_bufobj;
     rval->tail = rval;
     rval->next = NULL;
     CHK_GWBUF(rval);
@@ -380,6 +461,7 @@ GWBUF* gwbuf_clone_all(GWBUF* buf)
         clonebuf->next = gwbuf_clone(buf);
         clonebuf = clonebuf->next;
     }
+    rval->tail = clonebuf;
     return rval;
 }
 
@@ -393,7 +475,7 @@ static GWBUF *gwbuf_clone_portion(GWBUF *buf,
     CHK_GWBUF(buf);
     ss_dassert(start_offset + length <= GWBUF_LENGTH(buf));
 
-    if ((clonebuf = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
+    if ((clonebuf = (GWBUF *)bufpool_alloc(sizeof(GWBUF_HEADER))) == NULL)
     {
         ss_dassert(clonebuf != NULL);
         char errbuf[STRERROR_BUFLEN];
@@ -401,6 +483,7 @@ static GWBUF *gwbuf_clone_portion(GWBUF *buf,
                   strerror_r(errno, errbuf, sizeof(errbuf)));
         return NULL;
     }
+    memstats_add(MEMSTATS_BUFFERS, sizeof(GWBUF_HEADER), 1);
     atomic_add(&buf->sbuf->refcount, 1);
     clonebuf->sbuf = buf->sbuf;
     clonebuf->gwbuf_type = buf->gwbuf_type; /*< clone info bits too */
@@ -408,9 +491,9 @@ static GWBUF *gwbuf_clone_portion(GWBUF *buf,
     clonebuf->end = (void *)((char *)clonebuf->start + length);
     clonebuf->gwbuf_type = buf->gwbuf_type; /*< clone the type for now */
     clonebuf->properties = NULL;
+    memset(GWBUF_PROPS(clonebuf), 0, sizeof(GWBUF_PROPERTIES));
     clonebuf->hint = NULL;
     clonebuf->gwbuf_info = buf->gwbuf_info;
-    clonebuf->gwbuf_bufobj = buf->gwbuf_bufobj;
     clonebuf->next = NULL;
     clonebuf->tail = clonebuf;
     CHK_GWBUF(clonebuf);
@@ -688,6 +771,7 @@ gwbuf_rtrim(GWBUF *head, unsigned int n_bytes)
     if (GWBUF_EMPTY(head))
     {
         rval = head->next;
+        head->next = NULL;
         gwbuf_free(head);
     }
     return rval;
@@ -743,19 +827,21 @@ void gwbuf_add_buffer_object(GWBUF* buf,
     newb->bo_data = data;
     newb->bo_donefun_fp = donefun_fp;
     newb->bo_next = NULL;
-    /** Lock */
-    spinlock_acquire(&buf->gwbuf_lock);
-    p_b = &buf->gwbuf_bufobj;
-    /** Search the end of the list and add there */
-    while (*p_b != NULL)
+    p_b = &buf->sbuf->bufobj;
+    /**
+     * Add to the end of the list. The objects are only removed when the data
+     * is freed, so a failed swap means another clone appended to the list.
+     */
+    do
     {
-        p_b = &(*p_b)->bo_next;
+        while (*p_b != NULL)
+        {
+            p_b = &(*p_b)->bo_next;
+        }
     }
-    *p_b = newb;
+    while (!__sync_bool_compare_and_swap(p_b, NULL, newb));
     /** Set flag */
     buf->gwbuf_info |= GWBUF_INFO_PARSED;
-    /** Unlock */
-    spinlock_release(&buf->gwbuf_lock);
 }
 
 /**
@@ -771,16 +857,12 @@ void* gwbuf_get_buffer_object_data(GWBUF* buf, bufobj_id_t id)
     buffer_object_t* bo;
 
     CHK_GWBUF(buf);
-    /** Lock */
-    spinlock_acquire(&buf->gwbuf_lock);
-    bo = buf->gwbuf_bufobj;
+    bo = buf->sbuf->bufobj;
 
     while (bo != NULL && bo->bo_id != id)
     {
         bo = bo->bo_next;
     }
-    /** Unlock */
-    spinlock_release(&buf->gwbuf_lock);
     if (bo)
     {
         return bo->bo_data;
@@ -803,17 +885,117 @@ static buffer_object_t* gwbuf_remove_buffer_object(GWBUF* buf, buffer_object_t*
 }
 
 /**
- * Add a property to a buffer.
+ * Find the ID of a property name
  *
- * @param buf   The buffer to add the property to
  * @param name  The property name
+ * @param add   Whether to add the name if it is not found
+ * @return      The property ID or 0 if not found
+ */
+static int
+gwbuf_find_property_id(const char *name, bool add)
+{
+    int i;
+    int id = 0;
+
+    spinlock_acquire(&property_lock);
+    for (i = 0; i < n_property_names; i++)
+    {
+        if (strcmp(property_names[i], name) == 0)
+        {
+            id = i + 1;
+            break;
+        }
+    }
+    if (id == 0 && add && n_property_names < GWBUF_MAX_PROPERTY_IDS &&
+        (property_names[n_property_names] = strdup(name)) != NULL)
+    {
+        id = ++n_property_names;
+    }
+    spinlock_release(&property_lock);
+    return id;
+}
+
+/**
+ * Return the ID of a property name. The ID does not change, the callers
+ * should look it up once and use it for all buffers.
+ *
+ * @param name  The property name
+ * @return      The property ID or 0 if there are too many property names
+ */
+int
+gwbuf_property_id(const char *name)
+{
+    int id = gwbuf_find_property_id(name, true);
+
+    if (id == 0)
+    {
+        MXS_ERROR("Failed to register the buffer property '%s'.", name);
+    }
+    return id;
+}
+
+/**
+ * Set a property of a buffer, replacing any earlier value
+ *
+ * @param buf   The buffer
+ * @param id    The property ID
  * @param value The property value
+ * @param owned Whether the value is freed with the buffer
  * @return      Non-zero on success
  */
-int
-gwbuf_add_property(GWBUF *buf, char *name, char *value)
+static int
+gwbuf_store_property(GWBUF *buf, int id, void *value, bool owned)
 {
+    GWBUF_PROPERTIES *props = GWBUF_PROPS(buf);
     BUF_PROPERTY *prop;
+    int i, slot = -1;
+
+    if (id <= 0)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < GWBUF_N_PROPERTIES; i++)
+    {
+        if (props->id[i] == id || (slot == -1 && props->id[i] == 0))
+        {
+            slot = i;
+            if (props->id[i] == id)
+            {
+                break;
+            }
+        }
+    }
+
+    if (slot == -1 || props->id[slot] != id)
+    {
+        for (prop = buf->properties; prop && prop->id != id; prop = prop->next)
+        {
+            ;
+        }
+        if (prop)
+        {
+            if (prop->owned)
+            {
+                free(prop->value);
+            }
+            prop->value = value;
+            prop->owned = owned;
+            return 1;
+        }
+    }
+
+    if (slot != -1)
+    {
+        if (props->owned & (1 << slot))
+        {
+            free(props->value[slot]);
+        }
+        props->id[slot] = id;
+        props->value[slot] = value;
+        props->owned = owned ? props->owned | (1 << slot) : props->owned & ~(1 << slot);
+        return 1;
+    }
 
     if ((prop = malloc(sizeof(BUF_PROPERTY))) == NULL)
     {
@@ -823,40 +1005,101 @@ gwbuf_add_property(GWBUF *buf, char *name, char *value)
                   strerror_r(errno, errbuf, sizeof(errbuf)));
         return 0;
     }
-    prop->name = strdup(name);
-    prop->value = strdup(value);
-    spinlock_acquire(&buf->gwbuf_lock);
+    prop->id = id;
+    prop->value = value;
+    prop->owned = owned;
     prop->next = buf->properties;
     buf->properties = prop;
-    spinlock_release(&buf->gwbuf_lock);
     return 1;
 }
 
+/**
+ * Set a property of a buffer. The value is not copied and must stay valid
+ * for the lifetime of the buffer.
+ *
+ * @param buf   The buffer to add the property to
+ * @param id    The property ID returned by gwbuf_property_id
+ * @param value The property value
+ * @return      Non-zero on success
+ */
+int
+gwbuf_set_property(GWBUF *buf, int id, void *value)
+{
+    return gwbuf_store_property(buf, id, value, false);
+}
+
 /**
  * Return the value of a buffer property
+ *
  * @param buf   The buffer itself
- * @param name  The name of the property to return
+ * @param id    The property ID returned by gwbuf_property_id
  * @return The property value or NULL if the property was not found.
  */
-char *
-gwbuf_get_property(GWBUF *buf, char *name)
+void *
+gwbuf_get_property_value(GWBUF *buf, int id)
 {
+    GWBUF_PROPERTIES *props = GWBUF_PROPS(buf);
     BUF_PROPERTY *prop;
+    int i;
 
-    spinlock_acquire(&buf->gwbuf_lock);
-    prop = buf->properties;
-    while (prop && strcmp(prop->name, name) != 0)
+    for (i = 0; i < GWBUF_N_PROPERTIES; i++)
     {
-        prop = prop->next;
+        if (props->id[i] == id)
+        {
+            return props->value[i];
+        }
     }
-    spinlock_release(&buf->gwbuf_lock);
-    if (prop)
+    for (prop = buf->properties; prop; prop = prop->next)
     {
-        return prop->value;
+        if (prop->id == id)
+        {
+            return prop->value;
+        }
     }
     return NULL;
 }
 
+/**
+ * Add a property to a buffer. The value is copied, gwbuf_set_property
+ * avoids the copy and the lookup of the name.
+ *
+ * @param buf   The buffer to add the property to
+ * @param name  The property name
+ * @param value The property value
+ * @return      Non-zero on success
+ */
+int
+gwbuf_add_property(GWBUF *buf, char *name, char *value)
+{
+    char *copy;
+    int id = gwbuf_property_id(name);
+
+    if (id == 0 || (copy = strdup(value)) == NULL)
+    {
+        return 0;
+    }
+    if (!gwbuf_store_property(buf, id, copy, true))
+    {
+        free(copy);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Return the value of a buffer property
+ * @param buf   The buffer itself
+ * @param name  The name of the property to return
+ * @return The property value or NULL if the property was not found.
+ */
+char *
+gwbuf_get_property(GWBUF *buf, char *name)
+{
+    int id = gwbuf_find_property_id(name, false);
+
+    return id ? (char *)gwbuf_get_property_value(buf, id) : NULL;
+}
+
 
 /**
  * Convert a chain of GWBUF structures into a single GWBUF structure
@@ -897,6 +1140,43 @@ gwbuf_make_contiguous(GWBUF *orig)
     return newbuf;
 }
 
+/**
+ * Grow the last buffer of a chain in place
+ *
+ * The buffer is extended into the unused end of its memory block. This is
+ * possible when the data is not shared with clones and the size class of the
+ * block has room for it. The added bytes are not initialised.
+ *
+ * @param head  The buffer chain
+ * @param bytes Number of bytes to add
+ * @return True if the buffer was extended, false if a new buffer is needed
+ */
+bool
+gwbuf_grow(GWBUF *head, unsigned int bytes)
+{
+    GWBUF *buf = head->tail;
+    SHARED_BUF *sbuf = buf->sbuf;
+    GWBUF_BLOCK *block = (GWBUF_BLOCK *)((char *)sbuf - offsetof(GWBUF_BLOCK, sbuf));
+    size_t used = (char *)buf->end - (char *)block + bytes;
+
+    CHK_GWBUF(buf);
+
+    if (sbuf->refcount != 1 || used > bufpool_capacity(sbuf->size))
+    {
+        return false;
+    }
+
+    /** The block is freed by its size, which must stay in the same class */
+    if (used > sbuf->size)
+    {
+        memstats_add(MEMSTATS_BUFFERS, used - sbuf->size, 0);
+        sbuf->size = used;
+    }
+
+    buf->end = (char *)buf->end + bytes;
+    return true;
+}
+
 /**
  * Add hint to a buffer.
  *
@@ -909,7 +1189,6 @@ gwbuf_add_hint(GWBUF *buf, HINT *hint)
 {
     HINT *ptr;
 
-    spinlock_acquire(&buf->gwbuf_lock);
     if (buf->hint)
     {
         ptr = buf->hint;
@@ -923,10 +1202,126 @@ gwbuf_add_hint(GWBUF *buf, HINT *hint)
     {
         buf->hint = hint;
     }
-    spinlock_release(&buf->gwbuf_lock);
     return 1;
 }
 
+/**
+ * @brief Return a pointer to bytes of a buffer chain if they are contiguous
+ *
+ * @param buffer Buffer chain
+ * @param offset Offset of the first byte from the start of the chain
+ * @param bytes Number of bytes
+ * @return Pointer to the bytes or NULL if the bytes span several buffers or
+ * are past the end of the chain
+ */
+uint8_t *gwbuf_peek(GWBUF *buffer, size_t offset, size_t bytes)
+{
+    GWBUF_ITERATOR iter;
+
+    gwbuf_iter_init(&iter, buffer);
+    if (gwbuf_iter_skip(&iter, offset) < offset)
+    {
+        return NULL;
+    }
+    return gwbuf_iter_peek(&iter, bytes);
+}
+
+/**
+ * Move an iterator past the empty buffers and the end of its current buffer
+ *
+ * @param iter The iterator
+ */
+static inline void gwbuf_iter_normalize(GWBUF_ITERATOR *iter)
+{
+    while (iter->buf && iter->ptr >= (uint8_t *)iter->buf->end)
+    {
+        if ((iter->buf = iter->buf->next))
+        {
+            iter->ptr = (uint8_t *)GWBUF_DATA(iter->buf);
+        }
+    }
+}
+
+/**
+ * @brief Initialise an iterator to the start of a buffer chain
+ *
+ * @param iter The iterator
+ * @param head The buffer chain, may be NULL
+ */
+void gwbuf_iter_init(GWBUF_ITERATOR *iter, GWBUF *head)
+{
+    iter->buf = head;
+    iter->ptr = head ? (uint8_t *)GWBUF_DATA(head) : NULL;
+    gwbuf_iter_normalize(iter);
+}
+
+/**
+ * @brief Advance an iterator
+ *
+ * @param iter The iterator
+ * @param bytes Number of bytes to skip
+ * @return Number of bytes skipped, less than @c bytes if the end of the chain
+ * was reached
+ */
+size_t gwbuf_iter_skip(GWBUF_ITERATOR *iter, size_t bytes)
+{
+    size_t skipped = 0;
+
+    while (iter->buf && skipped < bytes)
+    {
+        size_t n = MIN((size_t)((uint8_t *)iter->buf->end - iter->ptr), bytes - skipped);
+        iter->ptr += n;
+        skipped += n;
+        gwbuf_iter_normalize(iter);
+    }
+    return skipped;
+}
+
+/**
+ * @brief Copy bytes at the position of an iterator without advancing it
+ *
+ * @param iter The iterator
+ * @param bytes Number of bytes to copy
+ * @param dest Destination where the bytes are copied
+ * @return Number of bytes copied, less than @c bytes if the end of the chain
+ * was reached
+ */
+size_t gwbuf_iter_copy(GWBUF_ITERATOR *iter, size_t bytes, uint8_t *dest)
+{
+    GWBUF_ITERATOR pos = *iter;
+    size_t copied = 0;
+
+    while (pos.buf && copied < bytes)
+    {
+        size_t n = MIN((size_t)((uint8_t *)pos.buf->end - pos.ptr), bytes - copied);
+        memcpy(dest + copied, pos.ptr, n);
+        pos.ptr += n;
+        copied += n;
+        gwbuf_iter_normalize(&pos);
+    }
+    return copied;
+}
+
+/**
+ * @brief Return a pointer to the bytes at the position of an iterator if they
+ * are contiguous
+ *
+ * The caller can read the bytes in place when they are in one buffer and fall
+ * back to gwbuf_iter_copy when they are not.
+ *
+ * @param iter The iterator
+ * @param bytes Number of bytes
+ * @return Pointer to the bytes or NULL if they span several buffers
+ */
+uint8_t *gwbuf_iter_peek(GWBUF_ITERATOR *iter, size_t bytes)
+{
+    if (iter->buf && (size_t)((uint8_t *)iter->buf->end - iter->ptr) >= bytes)
+    {
+        return iter->ptr;
+    }
+    return NULL;
+}
+
 /**
  * @brief Copy bytes from a buffer
  *
@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file bufpool.c  - Size classed memory pools for the buffers
+ *
+ * The free blocks of a class in a thread cache form a magazine. A thread
+ * allocates from and frees to its own magazine. When the magazine is full on a
+ * free, it is handed to the depot and the thread starts a new one. When the
+ * magazine is empty on an allocation, the thread takes a full magazine from the
+ * depot, and only if the depot is empty as well is the block allocated with
+ * malloc. A thread cache is flushed to the depot when the thread exits.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <bufpool.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <platform.h>
+
+/** The maximum number of magazines of a class kept in the depot */
+#define BUFPOOL_DEPOT_MAX 16
+
+/**
+ * The size classes. The smallest class holds the buffers that share the data
+ * of another buffer, the largest one a full read of MAX_BUFFER_SIZE bytes and
+ * the buffer header.
+ */
+static const struct
+{
+    size_t size;       /*< The size of the blocks */
+    int    magazine;   /*< The number of blocks in a full magazine */
+} classes[BUFPOOL_N_CLASSES] =
+{
+    {128, 128},
+    {512, 64},
+    {2048, 32},
+    {8192, 16},
+    {32768 + 256, 4}
+};
+
+/**
+ * A free block. The blocks of a magazine are linked by next, the magazines
+ * in the depot by next_magazine of their first block, which also holds the
+ * number of blocks in the magazine.
+ */
+typedef struct bufpool_item
+{
+    struct bufpool_item *next;
+    struct bufpool_item *next_magazine;
+    int                 count;
+} BUFPOOL_ITEM;
+
+/**
+ * A magazine of free blocks
+ */
+typedef struct
+{
+    BUFPOOL_ITEM *items;
+    int          count;
+} BUFPOOL_MAGAZINE;
+
+/**
+ * The cache of a thread. The caches are never freed, so that the statistics of
+ * the threads that have exited are still counted.
+ */
+typedef struct bufpool_cache
+{
+    BUFPOOL_MAGAZINE     magazines[BUFPOOL_N_CLASSES];
+    unsigned long        hits[BUFPOOL_N_CLASSES];
+    unsigned long        misses[BUFPOOL_N_CLASSES];
+    unsigned long        depot_gets[BUFPOOL_N_CLASSES];
+    unsigned long        depot_puts[BUFPOOL_N_CLASSES];
+    struct bufpool_cache *next;  /*< The next cache in the list of all caches */
+} BUFPOOL_CACHE;
+
+/**
+ * The depot of a class
+ */
+typedef struct
+{
+    SPINLOCK     lock;
+    BUFPOOL_ITEM *magazines;   /*< The full magazines */
+    int          count;        /*< No. of magazines */
+} BUFPOOL_DEPOT;
+
+static BUFPOOL_DEPOT depots[BUFPOOL_N_CLASSES];
+static BUFPOOL_CACHE *all_caches = NULL;
+static SPINLOCK caches_lock = SPINLOCK_INIT_NAMED("buffer pool caches");
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static thread_local BUFPOOL_CACHE *thread_cache = NULL;
+static int n_unpooled = 0;
+
+static void bufpool_flush(void *data);
+
+/**
+ * Create the key whose destructor flushes the cache of an exiting thread
+ */
+static void
+bufpool_init_key()
+{
+    int i;
+
+    for (i = 0; i < BUFPOOL_N_CLASSES; i++)
+    {
+        spinlock_init_named(&depots[i].lock, "buffer pool depot");
+    }
+    pthread_key_create(&cache_key, bufpool_flush);
+}
+
+/**
+ * Return the cache of the calling thread, creating it on the first call
+ *
+ * @return The cache or NULL if memory could not be allocated
+ */
+static BUFPOOL_CACHE *
+bufpool_cache()
+{
+    if (thread_cache == NULL)
+    {
+        pthread_once(&cache_key_once, bufpool_init_key);
+        if ((thread_cache = (BUFPOOL_CACHE *)calloc(1, sizeof(BUFPOOL_CACHE))) != NULL)
+        {
+            pthread_setspecific(cache_key, thread_cache);
+            spinlock_acquire(&caches_lock);
+            thread_cache->next = all_caches;
+            all_caches = thread_cache;
+            spinlock_release(&caches_lock);
+        }
+    }
+    return thread_cache;
+}
+
+/**
+ * Find the class of an allocation
+ *
+ * @param size  The size of the allocation
+ * @return      The class or -1 if the allocation is not pooled
+ */
+static int
+bufpool_class(size_t size)
+{
+    int i;
+
+    for (i = 0; i < BUFPOOL_N_CLASSES; i++)
+    {
+        if (size <= classes[i].size)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Give a full magazine to the depot, or free its blocks if the depot is full
+ *
+ * @param pool      The class of the magazine
+ * @param magazine  The magazine, empty on return
+ * @return          True if the magazine was given to the depot
+ */
+static bool
+bufpool_depot_put(int pool, BUFPOOL_MAGAZINE *magazine)
+{
+    BUFPOOL_DEPOT *depot = &depots[pool];
+    bool rval = false;
+
+    if (magazine->items == NULL)
+    {
+        return false;
+    }
+
+    spinlock_acquire(&depot->lock);
+    if (depot->count < BUFPOOL_DEPOT_MAX)
+    {
+        magazine->items->next_magazine = depot->magazines;
+        magazine->items->count = magazine->count;
+        depot->magazines = magazine->items;
+        depot->count++;
+        rval = true;
+    }
+    spinlock_release(&depot->lock);
+
+    if (!rval)
+    {
+        while (magazine->items)
+        {
+            BUFPOOL_ITEM *item = magazine->items;
+            magazine->items = item->next;
+            free(item);
+        }
+    }
+    magazine->items = NULL;
+    magazine->count = 0;
+    return rval;
+}
+
+/**
+ * Take a full magazine from the depot
+ *
+ * @param pool      The class of the magazine
+ * @param magazine  The empty magazine to fill
+ * @return          True if a magazine was taken
+ */
+static bool
+bufpool_depot_get(int pool, BUFPOOL_MAGAZINE *magazine)
+{
+    BUFPOOL_DEPOT *depot = &depots[pool];
+    BUFPOOL_ITEM *items = NULL;
+
+    /** A dirty read avoids the lock when the depot is empty */
+    if (depot->magazines == NULL)
+    {
+        return false;
+    }
+
+    spinlock_acquire(&depot->lock);
+    if ((items = depot->magazines) != NULL)
+    {
+        depot->magazines = items->next_magazine;
+        depot->count--;
+    }
+    spinlock_release(&depot->lock);
+
+    if (items)
+    {
+        magazine->items = items;
+        magazine->count = items->count;
+    }
+    return items != NULL;
+}
+
+/**
+ * Flush the cache of an exiting thread to the depot
+ *
+ * @param data  The cache of the thread
+ */
+static void
+bufpool_flush(void *data)
+{
+    BUFPOOL_CACHE *cache = (BUFPOOL_CACHE *)data;
+    int i;
+
+    for (i = 0; i < BUFPOOL_N_CLASSES; i++)
+    {
+        bufpool_depot_put(i, &cache->magazines[i]);
+    }
+}
+
+/**
+ * Allocate a block of memory
+ *
+ * @param size  The size of the block
+ * @return      The block or NULL if memory could not be allocated
+ */
+void *
+bufpool_alloc(size_t size)
+{
+    int pool = bufpool_class(size);
+    BUFPOOL_CACHE *cache;
+
+    if (pool < 0)
+    {
+        atomic_add(&n_unpooled, 1);
+        return malloc(size);
+    }
+    if ((cache = bufpool_cache()) == NULL)
+    {
+        return malloc(classes[pool].size);
+    }
+
+    BUFPOOL_MAGAZINE *magazine = &cache->magazines[pool];
+
+    if (magazine->items == NULL && bufpool_depot_get(pool, magazine))
+    {
+        cache->depot_gets[pool]++;
+    }
+    if (magazine->items)
+    {
+        BUFPOOL_ITEM *item = magazine->items;
+        magazine->items = item->next;
+        magazine->count--;
+        cache->hits[pool]++;
+        return item;
+    }
+    cache->misses[pool]++;
+    return malloc(classes[pool].size);
+}
+
+/**
+ * Free a block of memory allocated with bufpool_alloc
+ *
+ * @param ptr   The block
+ * @param size  The size the block was allocated with
+ */
+void
+bufpool_free(void *ptr, size_t size)
+{
+    int pool = bufpool_class(size);
+    BUFPOOL_CACHE *cache;
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+    if (pool < 0 || (cache = bufpool_cache()) == NULL)
+    {
+        free(ptr);
+        return;
+    }
+
+    BUFPOOL_MAGAZINE *magazine = &cache->magazines[pool];
+    BUFPOOL_ITEM *item = (BUFPOOL_ITEM *)ptr;
+
+    if (magazine->count >= classes[pool].magazine &&
+        bufpool_depot_put(pool, magazine))
+    {
+        cache->depot_puts[pool]++;
+    }
+    item->next = magazine->items;
+    magazine->items = item;
+    magazine->count++;
+}
+
+/**
+ * Get the statistics of a size class, summed over all threads
+ *
+ * @param pool  The class, from 0 to BUFPOOL_N_CLASSES - 1
+ * @param stats The statistics
+ */
+void
+bufpool_get_stats(int pool, BUFPOOL_STATS *stats)
+{
+    BUFPOOL_CACHE *cache;
+
+    stats->size = classes[pool].size;
+    stats->hits = 0;
+    stats->misses = 0;
+    stats->depot_gets = 0;
+    stats->depot_puts = 0;
+    stats->depot_size = depots[pool].count;
+
+    spinlock_acquire(&caches_lock);
+    for (cache = all_caches; cache; cache = cache->next)
+    {
+        stats->hits += cache->hits[pool];
+        stats->misses += cache->misses[pool];
+        stats->depot_gets += cache->depot_gets[pool];
+        stats->depot_puts += cache->depot_puts[pool];
+    }
+    spinlock_release(&caches_lock);
+}
+
+/**
+ * Return the usable size of a block allocated with bufpool_alloc
+ *
+ * A pooled block is as large as its class. The user of the block may use
+ * all of it, as long as the block is freed with a size of the same class.
+ *
+ * @param size  The size the block was allocated with
+ * @return      The usable size of the block
+ */
+size_t
+bufpool_capacity(size_t size)
+{
+    int pool = bufpool_class(size);
+
+    return pool < 0 ? size : classes[pool].size;
+}
+
+/**
+ * Return the number of allocations that were too large to be pooled
+ *
+ * @return The number of unpooled allocations
+ */
+int
+bufpool_unpooled()
+{
+    return n_unpooled;
+}
@@ -72,6 +72,7 @@
 #include <sys/utsname.h>
 #include <dbusers.h>
 #include <gw.h>
+#include <thread.h>
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
@@ -120,9 +121,10 @@ static char *service_params[] =
     "password",
     "enable_root_user",
     "max_connections",
-    /* "max_queued_connections", */
-    /* "queued_connection_timeout", */
+    "max_queued_connections",
+    "queued_connection_timeout",
     "connection_timeout",
+    "max_session_memory",
     "auth_all_servers",
     "strip_db_esc",
     "localhost_match_wildcard_host",
@@ -138,6 +140,9 @@ static char *service_params[] =
     "log_auth_warnings",
     "source", /**< Avrorouter only */
     "retry_on_failure",
+    "compression",
+    "session_track",
+    "thread_group",
     NULL
 };
 
@@ -156,6 +161,11 @@ static char *listener_params[] =
     "ssl_key",
     "ssl_version",
     "ssl_cert_verify_depth",
+    "ssl_session_cache",
+    "ssl_ktls",
+    "exclusive_accept",
+    "busy_poll",
+    "thread_group",
     NULL
 };
 
@@ -170,6 +180,8 @@ static char *monitor_params[] =
     "script",
     "events",
     "mysql51_replication",
+    "probe_threads",
+    "liveness_check",
     "monitor_interval",
     "detect_replication_lag",
     "detect_stale_master",
@@ -180,6 +192,7 @@ static char *monitor_params[] =
     "available_when_donor",
     "disable_master_role_setting",
     "use_priority",
+    "flow_control_weighting",
     NULL
 };
 
@@ -189,16 +202,23 @@ static char *server_params[] =
     "protocol",
     "port",
     "address",
+    "socket",
     "monitoruser",
     "monitorpw",
     "persistpoolmax",
     "persistmaxtime",
+    "persistminsize",
+    "compression",
+    "connect_rate",
+    "max_handshakes",
     "ssl_cert",
     "ssl_ca_cert",
     "ssl",
     "ssl_key",
     "ssl_version",
     "ssl_cert_verify_depth",
+    "ssl_session_cache",
+    "ssl_ktls",
     NULL
 };
 
@@ -412,7 +432,12 @@ config_load(char *file)
 
     config_file = file;
 
-    if (check_config_objects(config.next) && process_config_context(config.next))
+    if (gateway.writeq_high_water && gateway.writeq_low_water >= gateway.writeq_high_water)
+    {
+        MXS_ERROR("The value of 'writeq_low_water' must be smaller than the value "
+                  "of 'writeq_high_water'.");
+    }
+    else if (check_config_objects(config.next) && process_config_context(config.next))
     {
         rval = true;
     }
@@ -830,14 +855,68 @@ free_config_context(CONFIG_CONTEXT *context)
 }
 
 /**
- * Return the number of configured threads
+ * Return the number of polling threads, the threads of the default group
+ * and of the named thread groups together
  *
  * @return The number of threads configured in the config file
  */
 int
 config_threadcount()
 {
-    return gateway.n_threads;
+    int n = gateway.n_threads;
+
+    for (int i = 0; i < gateway.n_thread_groups; i++)
+    {
+        n += gateway.thread_groups[i].n_threads;
+    }
+    return n;
+}
+
+/**
+ * Return the number of named polling thread groups
+ *
+ * @return The number of groups, not counting the default group
+ */
+int
+config_thread_group_count()
+{
+    return gateway.n_thread_groups;
+}
+
+/**
+ * Return the configuration of a named polling thread group
+ *
+ * @param group The group, from 1 to config_thread_group_count()
+ * @return The configuration of the group
+ */
+const THREAD_GROUP_CONF *
+config_thread_group(int group)
+{
+    ss_dassert(group > 0 && group <= gateway.n_thread_groups);
+    return &gateway.thread_groups[group - 1];
+}
+
+/**
+ * Find a polling thread group by name
+ *
+ * @param name  The name of the group, "default" for the default group
+ * @return The group, 0 for the default group or -1 if there is no such group
+ */
+int
+config_thread_group_find(const char *name)
+{
+    if (strcasecmp(name, "default") == 0)
+    {
+        return 0;
+    }
+    for (int i = 0; i < gateway.n_thread_groups; i++)
+    {
+        if (strcasecmp(gateway.thread_groups[i].name, name) == 0)
+        {
+            return i + 1;
+        }
+    }
+    return -1;
 }
 
 /**
@@ -864,6 +943,100 @@ config_pollsleep()
     return gateway.pollsleep;
 }
 
+/**
+ * Return whether each polling thread has its own epoll instance and event
+ * queue and DCBs are bound to the thread that created them.
+ *
+ * @return True if polling thread affinity is enabled
+ */
+bool
+config_poll_affinity()
+{
+    return gateway.poll_affinity;
+}
+
+/**
+ * Return whether idle polling threads may process DCBs that are owned by
+ * busy threads when polling thread affinity is enabled.
+ *
+ * @return True if work stealing is enabled
+ */
+bool
+config_poll_work_stealing()
+{
+    return gateway.poll_steal;
+}
+
+/**
+ * Return whether the polling threads adapt the number of non-blocking polls
+ * and the timeout of the blocking polls to the rate of events they receive.
+ *
+ * @return True if adaptive polling is enabled
+ */
+bool
+config_poll_adaptive()
+{
+    return gateway.poll_adaptive;
+}
+
+/**
+ * Return the list of CPUs the polling threads are bound to
+ *
+ * @return The CPU list or NULL if the polling threads are not bound to CPUs
+ */
+const char *
+config_threads_affinity()
+{
+    return gateway.threads_affinity;
+}
+
+/**
+ * Return the list of NUMA nodes the polling threads are spread over
+ *
+ * @return The node list or NULL if the polling threads are not bound to nodes
+ */
+const char *
+config_numa_nodes()
+{
+    return gateway.numa_nodes;
+}
+
+/**
+ * Return the list of CPUs the monitor, housekeeper and other threads that
+ * are not polling threads are bound to
+ *
+ * @return The CPU list or NULL if the threads are not bound to CPUs
+ */
+const char *
+config_auxiliary_threads_affinity()
+{
+    return gateway.aux_affinity;
+}
+
+/**
+ * Return the size of the write queue of a client or backend DCB above which
+ * the other DCBs of the session stop reading
+ *
+ * @return The high water mark in bytes, 0 if the flow control is disabled
+ */
+unsigned int
+config_writeq_high_water()
+{
+    return gateway.writeq_high_water;
+}
+
+/**
+ * Return the size of the write queue of a DCB below which the reads stopped
+ * by its high water mark are resumed
+ *
+ * @return The low water mark in bytes
+ */
+unsigned int
+config_writeq_low_water()
+{
+    return gateway.writeq_low_water;
+}
+
 /**
  * Return the feedback config data pointer
  *
@@ -891,6 +1064,120 @@ static struct
     { NULL, 0 }
 };
 
+/**
+ * Store the value of a global item that is a list of CPUs or NUMA nodes
+ *
+ * @param name  The item name
+ * @param value The item value
+ * @param dest  Where the value is stored
+ * @return 0 on error
+ */
+static int
+set_cpulist_item(const char *name, const char *value, char **dest)
+{
+    cpu_set_t set;
+
+    if (!thread_parse_cpulist(value, &set))
+    {
+        MXS_ERROR("Invalid value for '%s': %s", name, value);
+        return 0;
+    }
+    free(*dest);
+    *dest = strdup(value);
+    return 1;
+}
+
+/**
+ * Free the named polling thread groups
+ */
+static void
+free_thread_groups()
+{
+    for (int i = 0; i < gateway.n_thread_groups; i++)
+    {
+        free(gateway.thread_groups[i].name);
+        free(gateway.thread_groups[i].cpus);
+    }
+    gateway.n_thread_groups = 0;
+}
+
+/**
+ * Parse the named polling thread groups. The groups are separated by '|' and
+ * each one is name:threads or name:threads:cpulist.
+ *
+ * @param value The value of thread_groups
+ * @return 0 on error
+ */
+static int
+set_thread_groups(const char *value)
+{
+    char *copy = strdup(value);
+    char *saveptr;
+    int rval = 1;
+
+    free_thread_groups();
+    if (copy == NULL)
+    {
+        return 0;
+    }
+
+    for (char *tok = strtok_r(copy, "|", &saveptr); tok && rval; tok = strtok_r(NULL, "|", &saveptr))
+    {
+        char *name = trim(tok);
+        char *threads = strchr(name, ':');
+        char *cpus = threads ? strchr(threads + 1, ':') : NULL;
+        char *end;
+        cpu_set_t set;
+        THREAD_GROUP_CONF *group = &gateway.thread_groups[gateway.n_thread_groups];
+
+        if (threads)
+        {
+            *threads++ = '\0';
+            name = trim(name);
+        }
+        if (cpus)
+        {
+            *cpus++ = '\0';
+            cpus = trim(cpus);
+        }
+
+        if (threads == NULL || *name == '\0' || config_thread_group_find(name) != -1)
+        {
+            MXS_ERROR("Invalid or duplicate thread group in 'thread_groups': %s", value);
+            rval = 0;
+        }
+        else if ((group->n_threads = strtol(threads, &end, 10)) <= 0 || *trim(end) != '\0')
+        {
+            MXS_ERROR("Invalid number of threads for thread group '%s': %s", name, threads);
+            rval = 0;
+        }
+        else if (cpus && !thread_parse_cpulist(cpus, &set))
+        {
+            MXS_ERROR("Invalid CPU list for thread group '%s': %s", name, cpus);
+            rval = 0;
+        }
+        else if (gateway.n_thread_groups == MAX_THREAD_GROUPS)
+        {
+            MXS_ERROR("Too many thread groups in 'thread_groups', at most %d are allowed.",
+                      MAX_THREAD_GROUPS);
+            rval = 0;
+        }
+        else
+        {
+            group->name = strdup(name);
+            group->cpus = cpus ? strdup(cpus) : NULL;
+            gateway.n_thread_groups++;
+        }
+    }
+    free(copy);
+
+    if (!rval)
+    {
+        free_thread_groups();
+    }
+    return rval;
+}
+
 /**
  * Configuration handler for items in the global [MaxScale] section
  *
@@ -941,10 +1228,127 @@ handle_global_item(const char *name, const char *value)
     {
         gateway.pollsleep = atoi(value);
     }
+    else if (strcmp(name, "poll_thread_affinity") == 0)
+    {
+        int truthval = config_truth_value((char*)value);
+        if (truthval == -1)
+        {
+            MXS_ERROR("Invalid value for 'poll_thread_affinity': %s", value);
+            return 0;
+        }
+        gateway.poll_affinity = truthval;
+    }
+    else if (strcmp(name, "poll_work_stealing") == 0)
+    {
+        int truthval = config_truth_value((char*)value);
+        if (truthval == -1)
+        {
+            MXS_ERROR("Invalid value for 'poll_work_stealing': %s", value);
+            return 0;
+        }
+        gateway.poll_steal = truthval;
+    }
+    else if (strcmp(name, "adaptive_polling") == 0)
+    {
+        int truthval = config_truth_value((char*)value);
+        if (truthval == -1)
+        {
+            MXS_ERROR("Invalid value for 'adaptive_polling': %s", value);
+            return 0;
+        }
+        gateway.poll_adaptive = truthval;
+    }
+    else if (strcmp(name, "threads_affinity") == 0)
+    {
+        return set_cpulist_item(name, value, &gateway.threads_affinity);
+    }
+    else if (strcmp(name, "numa_nodes") == 0)
+    {
+        return set_cpulist_item(name, value, &gateway.numa_nodes);
+    }
+    else if (strcmp(name, "auxiliary_threads_affinity") == 0)
+    {
+        return set_cpulist_item(name, value, &gateway.aux_affinity);
+    }
+    else if (strcmp(name, "thread_groups") == 0)
+    {
+        return set_thread_groups(value);
+    }
+    else if (strcmp(name, "writeq_high_water") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.writeq_high_water = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'writeq_high_water': %s", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "writeq_low_water") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.writeq_low_water = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'writeq_low_water': %s", value);
+            return 0;
+        }
+    }
     else if (strcmp(name, "ms_timestamp") == 0)
     {
         mxs_log_set_highprecision_enabled(config_truth_value((char*)value));
     }
+    else if (strcmp(name, "log_deferred_formatting") == 0)
+    {
+        mxs_log_set_deferred_enabled(config_truth_value((char*)value));
+    }
+    else if (strcmp(name, "log_rotate_size") == 0)
+    {
+        char* endptr;
+        long intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            mxs_log_set_rotate_size((size_t)intval * 1024 * 1024);
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'log_rotate_size', expected megabytes: %s", value);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "log_compress") == 0)
+    {
+        mxs_log_set_compress_enabled(config_truth_value((char*)value));
+    }
+    else if (strcmp(name, "log_throttling") == 0)
+    {
+        char* endptr;
+        long count = strtol(value, &endptr, 0);
+        long window = 0;
+
+        if (*endptr == ',')
+        {
+            window = strtol(endptr + 1, &endptr, 0);
+        }
+
+        if (*endptr == '\0' && count >= 0 && (count == 0 || window > 0))
+        {
+            mxs_log_set_throttling(count, window);
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'log_throttling', expected <count>,<milliseconds>: %s", value);
+            return 0;
+        }
+    }
     else if (strcmp(name, "auth_connect_timeout") == 0)
     {
         char* endptr;
@@ -1004,6 +1408,65 @@ handle_global_item(const char *name, const char *value)
     {
         gateway.qc_args = strdup(value);
     }
+    else if (strcmp(name, "query_classifier_shadow") == 0)
+    {
+        int len = strlen(value);
+        int max_len = sizeof(gateway.qc_shadow_name) - 1;
+
+        if (len <= max_len)
+        {
+            strcpy(gateway.qc_shadow_name, value);
+        }
+        else
+        {
+            MXS_ERROR("The length of '%s' is %d, while the maximum length is %d.",
+                      value, len, max_len);
+            return 0;
+        }
+    }
+    else if (strcmp(name, "query_classifier_shadow_args") == 0)
+    {
+        gateway.qc_shadow_args = strdup(value);
+    }
+    else if (strcmp(name, "query_classifier_shadow_sample") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval > 0 && intval <= 100)
+        {
+            gateway.qc_shadow_sample = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid percentage for 'query_classifier_shadow_sample': %s", value);
+        }
+    }
+    else if (strcmp(name, "query_classifier_shadow_threads") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval > 0)
+        {
+            gateway.qc_shadow_threads = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'query_classifier_shadow_threads': %s", value);
+        }
+    }
+    else if (strcmp(name, "query_trace_sample") == 0)
+    {
+        char* endptr;
+        int intval = strtol(value, &endptr, 0);
+        if (*endptr == '\0' && intval >= 0)
+        {
+            gateway.query_trace_sample = intval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'query_trace_sample': %s", value);
+        }
+    }
     else
     {
         for (i = 0; lognames[i].name; i++)
@@ -1035,6 +1498,10 @@ free_ssl_structure(SSL_LISTENER *ssl)
     if (ssl)
     {
         SSL_CTX_free(ssl->ctx);
+        if (ssl->ssl_session)
+        {
+            SSL_SESSION_free(ssl->ssl_session);
+        }
         free(ssl->ssl_key);
         free(ssl->ssl_cert);
         free(ssl->ssl_ca_cert);
@@ -1074,6 +1541,31 @@ make_ssl_structure (CONFIG_CONTEXT *obj, bool require_cert, int *error_count)
             ssl_version = config_get_value(obj->parameters, "ssl_version");
             ssl_cert_verify_depth = config_get_value(obj->parameters, "ssl_cert_verify_depth");
             new_ssl->ssl_init_done = false;
+            spinlock_init(&new_ssl->ssl_session_lock);
+
+            char *ssl_session_cache = config_get_value(obj->parameters, "ssl_session_cache");
+            char *ssl_ktls = config_get_value(obj->parameters, "ssl_ktls");
+            int truthval;
+
+            new_ssl->ssl_session_cache = true;
+
+            if (ssl_session_cache)
+            {
+                if ((truthval = config_truth_value(ssl_session_cache)) == -1)
+                {
+                    local_errors++;
+                }
+                new_ssl->ssl_session_cache = truthval == 1;
+            }
+
+            if (ssl_ktls)
+            {
+                if ((truthval = config_truth_value(ssl_ktls)) == -1)
+                {
+                    local_errors++;
+                }
+                new_ssl->ssl_ktls = truthval == 1;
+            }
 
             if (ssl_version)
             {
@@ -1220,6 +1712,15 @@ global_defaults()
     gateway.n_threads = DEFAULT_NTHREADS;
     gateway.n_nbpoll = DEFAULT_NBPOLLS;
     gateway.pollsleep = DEFAULT_POLLSLEEP;
+    gateway.poll_affinity = 0;
+    gateway.poll_steal = 0;
+    gateway.poll_adaptive = 0;
+    gateway.threads_affinity = NULL;
+    gateway.numa_nodes = NULL;
+    gateway.aux_affinity = NULL;
+    free_thread_groups();
+    gateway.writeq_high_water = 0;
+    gateway.writeq_low_water = 0;
     gateway.auth_conn_timeout = DEFAULT_AUTH_CONNECT_TIMEOUT;
     gateway.auth_read_timeout = DEFAULT_AUTH_READ_TIMEOUT;
     gateway.auth_write_timeout = DEFAULT_AUTH_WRITE_TIMEOUT;
@@ -1262,6 +1763,11 @@ global_defaults()
 
     /* query_classifier */
     memset(gateway.qc_name, 0, sizeof(gateway.qc_name));
+    memset(gateway.qc_shadow_name, 0, sizeof(gateway.qc_shadow_name));
+    gateway.qc_shadow_args = NULL;
+    gateway.qc_shadow_sample = DEFAULT_QC_SHADOW_SAMPLE;
+    gateway.qc_shadow_threads = DEFAULT_QC_SHADOW_THREADS;
+    gateway.query_trace_sample = 0;
 }
 
 /**
@@ -1322,6 +1828,7 @@ process_config_update(CONFIG_CONTEXT *context)
                     const char *max_queued_connections;
                     const char *queued_connection_timeout;
                     char *connection_timeout;
+                    char *max_session_memory;
 
                     char* auth_all_servers;
                     char* strip_db_esc;
@@ -1336,6 +1843,7 @@ process_config_update(CONFIG_CONTEXT *context)
                     max_connections = config_get_value_string(obj->parameters, "max_connections");
                     max_queued_connections = config_get_value_string(obj->parameters, "max_queued_connections");
                     queued_connection_timeout = config_get_value_string(obj->parameters, "queued_connection_timeout");
+                    max_session_memory = config_get_value(obj->parameters, "max_session_memory");
                     user = config_get_value(obj->parameters, "user");
                     auth = config_get_password(obj->parameters);
 
@@ -1352,6 +1860,18 @@ process_config_update(CONFIG_CONTEXT *context)
                         service->log_auth_warnings = (bool)truthval;
                     }
 
+                    char *compression = config_get_value(obj->parameters, "compression");
+                    if (compression && (truthval = config_truth_value(compression)) != -1)
+                    {
+                        service->compression = (bool)truthval;
+                    }
+
+                    char *session_track = config_get_value(obj->parameters, "session_track");
+                    if (session_track && (truthval = config_truth_value(session_track)) != -1)
+                    {
+                        service->session_track = (bool)truthval;
+                    }
+
                     CONFIG_PARAMETER* param;
 
                     if ((param = config_get_param(obj->parameters, "ignore_databases")))
@@ -1394,6 +1914,11 @@ process_config_update(CONFIG_CONTEXT *context)
                                                        atoi(queued_connection_timeout));
                         }
 
+                        if (max_session_memory)
+                        {
+                            serviceSetSessionMemoryLimit(service, atoi(max_session_memory));
+                        }
+
                         if (auth_all_servers)
                         {
                             serviceAuthAllServers(service, config_truth_value(auth_all_servers));
@@ -1512,9 +2037,19 @@ process_config_update(CONFIG_CONTEXT *context)
         {
             char *address = config_get_value(obj->parameters, "address");
             char *port = config_get_value(obj->parameters, "port");
+            char *socket = config_get_value(obj->parameters, "socket");
 
-            if (address && port &&
-                (server = server_find(address, atoi(port))) != NULL)
+            if (socket && (server = server_find(address ? address : socket,
+                                                port ? atoi(port) : 0)) != NULL)
+            {
+                char *protocol = config_get_value(obj->parameters, "protocol");
+                char *monuser = config_get_value(obj->parameters, "monuser");
+                char *monpw = config_get_value(obj->parameters, "monpw");
+                server_update(server, protocol, monuser, monpw);
+                obj->element = server;
+            }
+            else if (!socket && address && port &&
+                     (server = server_find(address, atoi(port))) != NULL)
             {
                 char *protocol = config_get_value(obj->parameters, "protocol");
                 char *monuser = config_get_value(obj->parameters, "monuser");
@@ -2242,6 +2777,22 @@ int create_new_service(CONFIG_CONTEXT *obj)
                                    atoi(max_queued_connections), atoi(queued_connection_timeout));
     }
 
+    char *max_session_memory = config_get_value(obj->parameters, "max_session_memory");
+    if (max_session_memory && !serviceSetSessionMemoryLimit(obj->element, atoi(max_session_memory)))
+    {
+        MXS_ERROR("Invalid value for 'max_session_memory' for service '%s': %s",
+                  obj->object, max_session_memory);
+        error_count++;
+    }
+
+    char *thread_group = config_get_value(obj->parameters, "thread_group");
+    if (thread_group && (service->thread_group = config_thread_group_find(thread_group)) < 0)
+    {
+        MXS_ERROR("Unknown thread group for service '%s': %s", obj->object, thread_group);
+        service->thread_group = 0;
+        error_count++;
+    }
+
     char *auth_all_servers = config_get_value(obj->parameters, "auth_all_servers");
     if (auth_all_servers)
     {
@@ -2312,6 +2863,34 @@ int create_new_service(CONFIG_CONTEXT *obj)
         }
     }
 
+    char *compression = config_get_value(obj->parameters, "compression");
+    if (compression)
+    {
+        int truthval = config_truth_value(compression);
+        if (truthval != -1)
+        {
+            service->compression = (bool) truthval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'compression': %s", compression);
+        }
+    }
+
+    char *session_track = config_get_value(obj->parameters, "session_track");
+    if (session_track)
+    {
+        int truthval = config_truth_value(session_track);
+        if (truthval != -1)
+        {
+            service->session_track = (bool) truthval;
+        }
+        else
+        {
+            MXS_ERROR("Invalid value for 'session_track': %s", session_track);
+        }
+    }
+
     if ((param = config_get_param(obj->parameters, "ignore_databases")))
     {
         service_set_param_value(obj->element, param, param->value, 0, STRING_TYPE);
@@ -2416,11 +2995,27 @@ int create_new_server(CONFIG_CONTEXT *obj)
     int error_count = 0;
     char *address = config_get_value(obj->parameters, "address");
     char *port = config_get_value(obj->parameters, "port");
+    char *socket = config_get_value(obj->parameters, "socket");
     char *protocol = config_get_value(obj->parameters, "protocol");
     char *monuser = config_get_value(obj->parameters, "monitoruser");
     char *monpw = config_get_value(obj->parameters, "monitorpw");
 
-    if (address && port && protocol)
+    if (socket && protocol)
+    {
+        /** The servers are identified by the socket path when there is no address */
+        if ((obj->element = server_alloc(address ? address : socket, protocol,
+                                         port ? atoi(port) : 0)) &&
+            (((SERVER *)obj->element)->socket = strdup(socket)))
+        {
+            server_set_unique_name(obj->element, obj->object);
+        }
+        else
+        {
+            MXS_ERROR("Failed to create a new server, memory allocation failed.");
+            error_count++;
+        }
+    }
+    else if (address && port && protocol)
     {
         if ((obj->element = server_alloc(address, protocol, atoi(port))))
         {
@@ -2436,7 +3031,8 @@ int create_new_server(CONFIG_CONTEXT *obj)
     {
         obj->element = NULL;
         MXS_ERROR("Server '%s' is missing a required configuration parameter. A "
-                  "server must have address, port and protocol defined.", obj->object);
+                  "server must have address, port and protocol or socket and "
+                  "protocol defined.", obj->object);
         error_count++;
     }
 
@@ -2478,6 +3074,56 @@ int create_new_server(CONFIG_CONTEXT *obj)
             }
         }
 
+        const char *persistmin = config_get_value_string(obj->parameters, "persistminsize");
+        if (persistmin)
+        {
+            server->persistminsize = strtol(persistmin, &endptr, 0);
+            if (*endptr != '\0')
+            {
+                MXS_ERROR("Invalid value for 'persistminsize' for server %s: %s",
+                          server->unique_name, persistmin);
+            }
+        }
+
+        const char *connect_rate = config_get_value_string(obj->parameters, "connect_rate");
+        if (connect_rate)
+        {
+            server->connect_rate = strtol(connect_rate, &endptr, 0);
+            if (*endptr != '\0' || server->connect_rate < 0)
+            {
+                MXS_ERROR("Invalid value for 'connect_rate' for server %s: %s",
+                          server->unique_name, connect_rate);
+                server->connect_rate = 0;
+            }
+        }
+
+        const char *max_handshakes = config_get_value_string(obj->parameters, "max_handshakes");
+        if (max_handshakes)
+        {
+            server->max_handshakes = strtol(max_handshakes, &endptr, 0);
+            if (*endptr != '\0' || server->max_handshakes < 0)
+            {
+                MXS_ERROR("Invalid value for 'max_handshakes' for server %s: %s",
+                          server->unique_name, max_handshakes);
+                server->max_handshakes = 0;
+            }
+        }
+
+        char *compression = config_get_value(obj->parameters, "compression");
+        if (compression)
+        {
+            int truthval = config_truth_value(compression);
+            if (truthval != -1)
+            {
+                server->compression = (bool)truthval;
+            }
+            else
+            {
+                MXS_ERROR("Invalid value for 'compression' for server %s: %s",
+                          server->unique_name, compression);
+            }
+        }
+
         CONFIG_PARAMETER *params = obj->parameters;
 
         server->server_ssl = make_ssl_structure(obj, false, &error_count);
@@ -2718,6 +3364,35 @@ int create_new_listener(CONFIG_CONTEXT *obj, bool startnow)
     char *protocol = config_get_value(obj->parameters, "protocol");
     char *socket = config_get_value(obj->parameters, "socket");
     char *authenticator = config_get_value(obj->parameters, "authenticator");
+    char *exclusive_accept = config_get_value(obj->parameters, "exclusive_accept");
+    int exclusive = 0;
+
+    if (exclusive_accept && (exclusive = config_truth_value(exclusive_accept)) == -1)
+    {
+        MXS_ERROR("Invalid value for 'exclusive_accept' in listener '%s': %s",
+                  obj->object, exclusive_accept);
+        return 1;
+    }
+
+    char *busy_poll_str = config_get_value(obj->parameters, "busy_poll");
+    int busy_poll = 0;
+
+    if (busy_poll_str && (busy_poll = atoi(busy_poll_str)) <= 0)
+    {
+        MXS_ERROR("Invalid value for 'busy_poll' in listener '%s': %s",
+                  obj->object, busy_poll_str);
+        return 1;
+    }
+
+    char *thread_group_str = config_get_value(obj->parameters, "thread_group");
+    int thread_group = -1;
+
+    if (thread_group_str && (thread_group = config_thread_group_find(thread_group_str)) < 0)
+    {
+        MXS_ERROR("Unknown thread group for listener '%s': %s",
+                  obj->object, thread_group_str);
+        return 1;
+    }
 
     if (service_name && protocol && (socket || port))
     {
@@ -2735,7 +3410,13 @@ int create_new_listener(CONFIG_CONTEXT *obj, bool startnow)
                 }
                 else
                 {
-                    serviceAddProtocol(service, protocol, socket, 0, authenticator, ssl_info);
+                    if (serviceAddProtocol(service, protocol, socket, 0, authenticator, ssl_info))
+                    {
+                        /** The new listener is added to the head of the list */
+                        service->ports->exclusive_accept = exclusive;
+                        service->ports->busy_poll = busy_poll;
+                        service->ports->thread_group = thread_group;
+                    }
                     if (startnow)
                     {
                         serviceStartProtocol(service, protocol, 0);
@@ -2755,7 +3436,13 @@ int create_new_listener(CONFIG_CONTEXT *obj, bool startnow)
                 }
                 else
                 {
-                    serviceAddProtocol(service, protocol, address, atoi(port), authenticator, ssl_info);
+                    if (serviceAddProtocol(service, protocol, address, atoi(port), authenticator, ssl_info))
+                    {
+                        /** The new listener is added to the head of the list */
+                        service->ports->exclusive_accept = exclusive;
+                        service->ports->busy_poll = busy_poll;
+                        service->ports->thread_group = thread_group;
+                    }
                     if (startnow)
                     {
                         serviceStartProtocol(service, protocol, atoi(port));
@@ -31,6 +31,10 @@
  * 13/10/14     Massimiliano Pinto  Added (user@host)@db authentication
  * 04/12/14     Massimiliano Pinto  Added support for IPv$ wildcard hosts: a.%, a.%.% and a.b.%
  * 25/05/16     Massimiliano Pinto  Removed log message for duplicate entry while adding an user
+ * 15/10/2016   Core Team           Build the new tables privately and retire the replaced ones
+ * 15/10/2016   Core Team           Per-user index of the grants for the lookups
+ * 15/10/2016   Core Team           Fetch the users from all the backends at the same time
+ * 15/10/2016   Core Team           Save the users as a binary snapshot
  *
  * @endverbatim
  */
@@ -50,6 +54,11 @@
 #include <mysqld_error.h>
 #include <regex.h>
 #include <mysql_utils.h>
+#include <thread.h>
+#include <hash.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /** Don't include the root user */
 #define USERS_QUERY_NO_ROOT " AND user.user NOT IN ('root')"
@@ -121,16 +130,58 @@
 MaxScale authentication will proceed without including database permissions. \
 See earlier error messages for user '%s' for more information."
 
-static int add_databases(SERVICE *service, MYSQL *con);
+/** The magic string at the start of a users snapshot */
+#define DBUSERS_SNAPSHOT_MAGIC "MXSUSERS"
+#define DBUSERS_SNAPSHOT_MAGIC_LEN 8
+
+/** The version of the snapshot format */
+#define DBUSERS_SNAPSHOT_VERSION 1
+
+/**
+ * The header of a users snapshot. The header is followed by the entries of the
+ * users table. The snapshot is only read by the MaxScale that wrote it so the
+ * integers are stored in the host byte order.
+ */
+typedef struct
+{
+    char     magic[DBUSERS_SNAPSHOT_MAGIC_LEN];
+    uint32_t version;
+    uint32_t count;                     /**< Number of entries */
+    uint64_t size;                      /**< Size of the whole snapshot */
+    uint8_t  cksum[SHA_DIGEST_LENGTH];  /**< Checksum of the users table */
+    uint8_t  anonymous;                 /**< The backends have anonymous users */
+    uint8_t  pad[3];
+} DBUSERS_SNAPSHOT_HEADER;
+
+/**
+ * An entry of a users snapshot. The entry is followed by the user name, the
+ * database, if any, the host name pattern and the authentication data, each
+ * NUL terminated. The entries are aligned to four bytes.
+ */
+typedef struct
+{
+    uint32_t addr;          /**< The IPv4 address in network byte order */
+    int32_t  netmask;
+    uint16_t user_len;
+    uint16_t hostname_len;
+    uint16_t auth_len;
+    int16_t  resource_len;  /**< Length of the database, -1 if there is none */
+} DBUSERS_SNAPSHOT_ENTRY;
+
+/** The size of a snapshot entry with the given string lengths */
+#define DBUSERS_SNAPSHOT_ENTRY_LEN(user, resource, hostname, auth)          \
+    ((sizeof(DBUSERS_SNAPSHOT_ENTRY) + (user) + 1 +                         \
+      ((resource) >= 0 ? (size_t)(resource) + 1 : 0) +                      \
+      (hostname) + 1 + (auth) + 1 + 3) & ~(size_t)3)
+
 static int add_wildcard_users(USERS *users, char* name, char* host,
                               char* password, char* anydb, char* db, HASHTABLE* hash);
 static void *dbusers_keyread(int fd);
-static int dbusers_keywrite(int fd, void *key);
 static void *dbusers_valueread(int fd);
-static int dbusers_valuewrite(int fd, void *value);
-static int get_all_users(SERVICE *service, USERS *users);
-static int get_databases(SERVICE *, MYSQL *);
-static int get_users(SERVICE *service, USERS *users);
+static MYSQL_RES *fetch_databases(SERVICE *service, MYSQL *con);
+static int get_all_users(SERVICE *service, USERS *users, HASHTABLE **resources);
+static int get_databases(SERVICE *, MYSQL *, HASHTABLE **);
+static int get_users(SERVICE *service, USERS *users, HASHTABLE **resources);
 static MYSQL *gw_mysql_init(void);
 static int gw_mysql_set_timeouts(MYSQL* handle);
 static bool host_has_singlechar_wildcard(const char *host);
@@ -143,11 +194,15 @@ static int resource_add(HASHTABLE *, char *, char *);
 static HASHTABLE *resource_alloc();
 static void *resource_fetch(HASHTABLE *, char *);
 static void resource_free(HASHTABLE *resource);
+static void resource_retire(HASHTABLE *resources);
 static int uh_cmpfun(void* v1, void* v2);
 static int uh_hfun(void* key);
 static void *uh_keydup(void* key);
 static void uh_keyfree(void* key);
 static int wildcard_db_grant(char* str);
+static bool grants_index_add(HASHTABLE *index, MYSQL_USER_HOST *key, char *auth);
+static void grants_free(void *data);
+static void grants_index_build(USERS *users);
 
 /**
  * Get the user data query with databases
@@ -245,13 +300,16 @@ static bool host_matches_singlechar_wildcard(const char* user, const char* wild)
 int
 load_mysql_users(SERVICE *service)
 {
-    return get_users(service, service->users);
+    return get_users(service, service->users, &service->resources);
 }
 
 /**
  * Reload the user/passwd form mysql.user table into the service users' hashtable
  * environment.
  *
+ * The new tables are built privately and replace the old ones at once. The old
+ * tables are freed once no polling thread can be reading them.
+ *
  * @param service   The current service
  * @return      -1 on any error or the number of users inserted (0 means no users at all)
  */
@@ -260,6 +318,7 @@ reload_mysql_users(SERVICE *service)
 {
     int i;
     USERS *newusers, *oldusers;
+    HASHTABLE *newresources = NULL;
     HASHTABLE *oldresources;
 
     if ((newusers = mysql_users_alloc()) == NULL)
@@ -267,21 +326,21 @@ reload_mysql_users(SERVICE *service)
         return 0;
     }
 
-    oldresources = service->resources;
-
-    i = get_users(service, newusers);
+    i = get_users(service, newusers, &newresources);
 
     spinlock_acquire(&service->spin);
     oldusers = service->users;
+    oldresources = service->resources;
 
     service->users = newusers;
+    service->resources = newresources;
 
     spinlock_release(&service->spin);
 
     /* free the old table */
-    users_free(oldusers);
+    users_retire(oldusers);
     /* free old resources */
-    resource_free(oldresources);
+    resource_retire(oldresources);
 
     return i;
 }
@@ -291,6 +350,10 @@ reload_mysql_users(SERVICE *service)
  * environment.
  * The replacement is succesful only if the users' table checksums differ
  *
+ * The new tables are built privately, the users and the database names of the
+ * service stay usable while the users are loaded. The replaced tables are
+ * freed once no polling thread can be reading them.
+ *
  * @param service   The current service
  * @return      -1 on any error or the number of users inserted (0 means no users at all)
  */
@@ -299,6 +362,7 @@ replace_mysql_users(SERVICE *service)
 {
     int i;
     USERS *newusers, *oldusers;
+    HASHTABLE *newresources = NULL;
     HASHTABLE *oldresources;
 
     if ((newusers = mysql_users_alloc()) == NULL)
@@ -306,21 +370,19 @@ replace_mysql_users(SERVICE *service)
         return -1;
     }
 
-    oldresources = service->resources;
-
     /* load db users ad db grants */
-    i = get_users(service, newusers);
+    i = get_users(service, newusers, &newresources);
 
     if (i <= 0)
     {
         users_free(newusers);
-        /* restore resources */
-        service->resources = oldresources;
+        resource_free(newresources);
         return i;
     }
 
     spinlock_acquire(&service->spin);
     oldusers = service->users;
+    oldresources = service->resources;
 
     /* digest compare */
     if (oldusers != NULL && memcmp(oldusers->cksum, newusers->cksum,
@@ -342,15 +404,17 @@ replace_mysql_users(SERVICE *service)
         service->users = newusers;
     }
 
-    /* free old resources */
-    resource_free(oldresources);
+    service->resources = newresources;
 
     spinlock_release(&service->spin);
 
+    /* free old resources */
+    resource_retire(oldresources);
+
     if (i && oldusers)
     {
         /* free the old table */
-        users_free(oldusers);
+        users_retire(oldusers);
     }
 
     return i;
@@ -526,15 +590,17 @@ int add_mysql_users_with_host_ipv4(USERS *users, const char *user, const char *h
 }
 
 /**
- * Add the database specific grants from mysql.db table into the service resources hashtable
- * environment.
+ * Fetch the names of the databases of a backend server
+ *
+ * The names are fetched only if the service user is allowed to see all of
+ * the databases.
  *
  * @param service   The current service
- * @param users     The users table into which to load the users
- * @return          -1 on any error or the number of users inserted (0 means no users at all)
+ * @param con       Connection to the server
+ * @return          The result of SHOW DATABASES or NULL if the names are not available
  */
-static int
-add_databases(SERVICE *service, MYSQL *con)
+static MYSQL_RES *
+fetch_databases(SERVICE *service, MYSQL *con)
 {
     MYSQL_ROW row;
     MYSQL_RES *result = NULL;
@@ -548,7 +614,7 @@ add_databases(SERVICE *service, MYSQL *con)
 
     if (service_user == NULL || service_passwd == NULL)
     {
-        return -1;
+        return NULL;
     }
 
     if (mysql_query(con, get_showdbs_priv_query))
@@ -557,7 +623,7 @@ add_databases(SERVICE *service, MYSQL *con)
                   "error: %s.",
                   service->name,
                   mysql_error(con));
-        return -1;
+        return NULL;
     }
 
     result = mysql_store_result(con);
@@ -568,7 +634,7 @@ add_databases(SERVICE *service, MYSQL *con)
                   "error: %s.",
                   service->name,
                   mysql_error(con));
-        return -1;
+        return NULL;
     }
 
     /* Result has only one row */
@@ -592,7 +658,7 @@ add_databases(SERVICE *service, MYSQL *con)
     if (!ndbs)
     {
         /* return if no db names are available */
-        return 0;
+        return NULL;
     }
 
     if (mysql_query(con, "SHOW DATABASES"))
@@ -602,7 +668,7 @@ add_databases(SERVICE *service, MYSQL *con)
                   service->name,
                   mysql_error(con));
 
-        return -1;
+        return NULL;
     }
 
     result = mysql_store_result(con);
@@ -613,22 +679,9 @@ add_databases(SERVICE *service, MYSQL *con)
                   "error: %s.",
                   service->name,
                   mysql_error(con));
-
-        return -1;
-    }
-
-    /* insert key and value "" */
-    while ((row = mysql_fetch_row(result)))
-    {
-        if (resource_add(service->resources, row[0], ""))
-        {
-            MXS_DEBUG("%s: Adding database %s to the resouce hash.", service->name, row[0]);
-        }
     }
 
-    mysql_free_result(result);
-
-    return ndbs;
+    return result;
 }
 
 /**
@@ -640,7 +693,7 @@ add_databases(SERVICE *service, MYSQL *con)
  * @return          -1 on any error or the number of users inserted (0 means no users at all)
  */
 static int
-get_databases(SERVICE *service, MYSQL *con)
+get_databases(SERVICE *service, MYSQL *con, HASHTABLE **resources)
 {
     MYSQL_ROW row;
     MYSQL_RES *result = NULL;
@@ -723,14 +776,14 @@ get_databases(SERVICE *service, MYSQL *con)
         return -1;
     }
 
-    /* Now populate service->resources hashatable with db names */
-    service->resources = resource_alloc();
+    /* Now populate the resources hashatable with db names */
+    *resources = resource_alloc();
 
     /* insert key and value "" */
     while ((row = mysql_fetch_row(result)))
     {
         MXS_DEBUG("%s: Adding database %s to the resouce hash.", service->name, row[0]);
-        resource_add(service->resources, row[0], "");
+        resource_add(*resources, row[0], "");
     }
 
     mysql_free_result(result);
@@ -738,487 +791,466 @@ get_databases(SERVICE *service, MYSQL *con)
     return ndbs;
 }
 
+/** The users and the database names fetched from one backend server */
+typedef struct users_fetch
+{
+    SERVICE    *service;
+    SERVER     *server;
+    const char *user;       /**< The service user */
+    const char *password;   /**< The decrypted password of the service user */
+    MYSQL_RES  *users;      /**< The users, NULL if they could not be fetched */
+    MYSQL_RES  *databases;  /**< The database names, NULL if not available */
+    bool       db_grants;   /**< Whether the users come with their database grants */
+    THREAD     thread;      /**< The thread fetching from the server */
+    bool       started;     /**< Whether the thread was started */
+} USERS_FETCH;
+
 /**
- * Load the user/passwd from mysql.user table into the service users' hashtable
- * environment from all the backend servers.
+ * Fetch the users and the database names from one backend server
  *
- * @param service   The current service
- * @param users     The users table into which to load the users
- * @return          -1 on any error or the number of users inserted
+ * The results are stored in the USERS_FETCH and the connection is closed
+ * before returning. The connect, read and write timeouts of the connection
+ * are the auth_connect_timeout, auth_read_timeout and auth_write_timeout
+ * parameters.
+ *
+ * @param data The USERS_FETCH of the server
  */
-static int
-get_all_users(SERVICE *service, USERS *users)
+static void
+fetch_server_users(void *data)
 {
-    MYSQL *con = NULL;
-    MYSQL_ROW row;
-    MYSQL_RES *result = NULL;
-    char *service_user = NULL;
-    char *service_passwd = NULL;
-    char *dpwd = NULL;
-    int total_users = 0;
-    SERVER_REF *server;
-    const char *userquery;
-    char *tmp;
-    unsigned char hash[SHA_DIGEST_LENGTH] = "";
-    char *users_data = NULL;
-    char *final_data = NULL;
-    char dbnm[MYSQL_DATABASE_MAXLEN + 1];
-    int nusers = -1;
-    int users_data_row_len = MYSQL_USER_MAXLEN + MYSQL_HOST_MAXLEN +
-                             MYSQL_PASSWORD_LEN + sizeof(char) + MYSQL_DATABASE_MAXLEN;
-    int dbnames = 0;
-    int db_grants = 0;
-    bool anon_user = false;
+    USERS_FETCH *fetch = (USERS_FETCH*)data;
+    SERVICE *service = fetch->service;
+    SERVER *server = fetch->server;
+    MYSQL *con;
 
-    if (serviceGetUser(service, &service_user, &service_passwd) == 0)
+    if (service->svc_do_shutdown || (con = gw_mysql_init()) == NULL)
     {
-        ss_dassert(service_passwd == NULL || service_user == NULL);
-        return -1;
+        return;
     }
 
-    if (service->svc_do_shutdown)
+    if (mxs_mysql_real_connect(con, server, fetch->user, fetch->password) == NULL)
     {
-        return -1;
+        MXS_ERROR("Failure loading users data from backend "
+                  "[%s:%i] for service [%s]. MySQL error %i, %s",
+                  server->name, server->port,
+                  service->name, mysql_errno(con), mysql_error(con));
+        mysql_close(con);
+        return;
     }
 
-    dpwd = decryptPassword(service_passwd);
-    final_data = (char*) malloc(sizeof(char));
-    *final_data = '\0';
+    if (server->server_string == NULL &&
+        !server_set_version_string(server, mysql_get_server_info(con)))
+    {
+        mysql_close(con);
+        return;
+    }
 
-    /**
-     * Attempt to connect to one of the databases database or until we run
-     * out of databases
-     * to try
-     */
-    server = service->dbref;
+    fetch->databases = fetch_databases(service, con);
 
-    if (server == NULL)
+    char querybuffer[MAX_QUERY_STR_LEN];
+    const char *userquery = get_users_db_query(server->server_string,
+                                               service->enable_root, querybuffer);
+    bool ok = true;
+
+    /* send first the query that fetches users and db grants */
+    if (mysql_query(con, userquery) == 0)
     {
-        goto cleanup;
+        MXS_DEBUG("[%s] Loading users with db grants from [%s:%i].",
+                  service->name, server->name, server->port);
+        fetch->db_grants = true;
     }
+    else if (mysql_errno(con) == ER_TABLEACCESS_DENIED_ERROR)
+    {
+        /*
+         * We have got ER_TABLEACCESS_DENIED_ERROR
+         * try loading users from mysql.user without DB names.
+         */
+        MXS_ERROR("Failed to retrieve users: %s", mysql_error(con));
+        MXS_ERROR(ERROR_NO_SHOW_DATABASES, service->name, fetch->user);
 
-    service->resources = resource_alloc();
+        userquery = get_users_query(server->server_string,
+                                    service->enable_root, querybuffer);
 
-    while (server != NULL)
-    {
-        while (!service->svc_do_shutdown && server != NULL)
+        if (mysql_query(con, userquery))
         {
-            con = gw_mysql_init();
-            if (con)
-            {
-                if (mxs_mysql_real_connect(con, server->server, service_user, dpwd) == NULL)
-                {
-                    MXS_ERROR("Failure loading users data from backend "
-                              "[%s:%i] for service [%s]. MySQL error %i, %s",
-                              server->server->name, server->server->port,
-                              service->name, mysql_errno(con), mysql_error(con));
-                    mysql_close(con);
-                }
-                else
-                {
-                    /** Successfully connected to a server */
-                    break;
-                }
-            }
-            else
-            {
-                server = NULL;
-                break;
-            }
-
-            server = server->next;
+            MXS_ERROR("Loading users for service [%s] encountered "
+                      "error: [%s], code %i",
+                      service->name,
+                      mysql_error(con),
+                      mysql_errno(con));
+            ok = false;
         }
-
-        if (server == NULL)
+        else
         {
-            MXS_ERROR("Unable to get user data from backend database "
-                      "for service [%s]. Missing server information.",
-                      service->name);
-            goto cleanup;
+            MXS_NOTICE("Loading users from [mysql.user] without access to [mysql.db] for "
+                       "service [%s]. MaxScale Authentication with DBname on connect "
+                       "will not consider database grants.",
+                       service->name);
         }
+    }
+    else
+    {
+        MXS_ERROR("Loading users with dbnames for service [%s] encountered "
+                  "error: [%s], MySQL errno %i",
+                  service->name,
+                  mysql_error(con),
+                  mysql_errno(con));
+        ok = false;
+    }
 
-        add_databases(service, con);
-        mysql_close(con);
-        server = server->next;
+    if (ok)
+    {
+        if ((fetch->users = mysql_store_result(con)) == NULL)
+        {
+            MXS_ERROR("Loading users for service %s encountered error: %s.",
+                      service->name,
+                      mysql_error(con));
+        }
+        else if (mysql_num_rows(fetch->users) == 0)
+        {
+            MXS_ERROR("Counting users for service %s returned 0.", service->name);
+            mysql_free_result(fetch->users);
+            fetch->users = NULL;
+        }
     }
 
-    server = service->dbref;
+    mysql_close(con);
+}
+
+/**
+ * Thread entry point for fetching the users from one backend server
+ *
+ * @param data The USERS_FETCH of the server
+ */
+static void
+fetch_server_users_thread(void *data)
+{
+    mysql_thread_init();
+    fetch_server_users(data);
+    mysql_thread_end();
+}
+
+/**
+ * Add the users fetched from one backend server into the users table
+ *
+ * @param service   The current service
+ * @param users     The users table into which to add the users
+ * @param fetch     The users fetched from the server
+ * @param users_data The data of the users for the checksum, appended to
+ * @param anon_user Set to true if the server has anonymous users
+ * @return          The number of users added
+ */
+static int
+add_fetched_users(SERVICE *service, USERS *users, USERS_FETCH *fetch,
+                  char *users_data, bool *anon_user)
+{
+    MYSQL_ROW row;
+    char dbnm[MYSQL_DATABASE_MAXLEN + 1];
+    int users_data_row_len = MYSQL_USER_MAXLEN + MYSQL_HOST_MAXLEN +
+                             MYSQL_PASSWORD_LEN + sizeof(char) + MYSQL_DATABASE_MAXLEN;
+    char *end = users_data + strlen(users_data);
+    int total_users = 0;
 
-    while (server != NULL)
+    while ((row = mysql_fetch_row(fetch->users)))
     {
-        while (!service->svc_do_shutdown && server != NULL)
-        {
-            con = gw_mysql_init();
-            if (con)
-            {
-                if (mxs_mysql_real_connect(con, server->server, service_user, dpwd) == NULL)
-                {
-                    MXS_ERROR("Failure loading users data from backend "
-                              "[%s:%i] for service [%s]. MySQL error %i, %s",
-                              server->server->name, server->server->port,
-                              service->name, mysql_errno(con), mysql_error(con));
-                    mysql_close(con);
-                }
-                else
-                {
-                    /** Successfully connected to a server */
-                    break;
-                }
-            }
-            else
-            {
-                server = NULL;
-                break;
-            }
 
-            server = server->next;
-        }
+        /**
+         * Up to six fields could be returned.
+         * user,host,passwd,concat(),anydb,db
+         * passwd+1 (escaping the first byte that is '*')
+         */
+
+        int rc = 0;
+        char *password = NULL;
 
-        if (server == NULL)
+        /** If the username is empty, the backend server still has anonymous
+         * user in it. This will mean that localhost addresses do not match
+         * the wildcard host '%' */
+        if (strlen(row[0]) == 0)
         {
-            MXS_ERROR("Unable to get user data from backend database "
-                      "for service [%s]. Missing server information.",
-                      service->name);
-            goto cleanup;
+            *anon_user = true;
+            continue;
         }
 
-        if (server->server->server_string == NULL)
+        if (row[2] != NULL)
         {
-            const char *server_string = mysql_get_server_info(con);
-            if (!server_set_version_string(server->server, server_string))
+            /* detect mysql_old_password (pre 4.1 protocol) */
+            if (strlen(row[2]) == 16)
             {
-                mysql_close(con);
-                goto cleanup;
+                MXS_ERROR("%s: The user %s@%s has on old password in the "
+                          "backend database. MaxScale does not support these "
+                          "old passwords. This user will not be able to connect "
+                          "via MaxScale. Update the users password to correct "
+                          "this.",
+                          service->name,
+                          row[0],
+                          row[1]);
+                continue;
             }
-        }
 
-        char querybuffer[MAX_QUERY_STR_LEN];
-        /** Count users. Start with users and db grants for users */
-        const char *usercount = get_usercount_query(server->server->server_string,
-                                                    service->enable_root, querybuffer);
-        if (mysql_query(con, usercount))
-        {
-            if (mysql_errno(con) != ER_TABLEACCESS_DENIED_ERROR)
+            if (strlen(row[2]) > 1)
             {
-                /* This is an error we cannot handle, return */
-                MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
-                          service->name,
-                          mysql_error(con));
-                mysql_close(con);
-                goto cleanup;
+                password = row[2] + 1;
             }
             else
             {
-                /*
-                 * We have got ER_TABLEACCESS_DENIED_ERROR
-                 * try counting users from mysql.user without DB names.
-                 */
-                if (mysql_query(con, MYSQL_USERS_COUNT))
+                password = row[2];
+            }
+        }
+
+        /*
+         * add user@host and DB global priv and specificsa grant (if possible)
+         */
+        bool havedb = false;
+
+        if (fetch->db_grants)
+        {
+            /* we have dbgrants, store them */
+            if (row[5])
+            {
+                unsigned long *rowlen = mysql_fetch_lengths(fetch->users);
+                memcpy(dbnm, row[5], rowlen[5]);
+                memset(dbnm + rowlen[5], 0, 1);
+                havedb = true;
+                if (service->strip_db_esc)
                 {
-                    MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
+                    strip_escape_chars(dbnm);
+                    MXS_DEBUG("[%s]: %s -> %s",
                               service->name,
-                              mysql_error(con));
-                    mysql_close(con);
-                    goto cleanup;
+                              row[5],
+                              dbnm);
                 }
             }
-        }
 
-        result = mysql_store_result(con);
+            rc = add_mysql_users_with_host_ipv4(users, row[0], row[1],
+                                                password, row[4],
+                                                havedb ? dbnm : NULL);
 
-        if (result == NULL)
+            MXS_DEBUG("%s: Adding user:%s host:%s anydb:%s db:%s.",
+                      service->name, row[0], row[1], row[4],
+                      havedb ? dbnm : NULL);
+        }
+        else
         {
-            MXS_ERROR("Loading users for service [%s] encountered error: [%s].",
-                      service->name,
-                      mysql_error(con));
-            mysql_close(con);
-            goto cleanup;
+            /* we don't have dbgrants, simply set ANY DB for the user */
+            rc = add_mysql_users_with_host_ipv4(users, row[0], row[1],
+                                                password, "Y", NULL);
         }
 
-        row = mysql_fetch_row(result);
-
-        nusers = atoi(row[0]);
-
-        mysql_free_result(result);
-
-        if (!nusers)
-        {
-            MXS_ERROR("Counting users for service %s returned 0.", service->name);
-            mysql_close(con);
-            goto cleanup;
-        }
-
-        userquery = get_users_db_query(server->server->server_string,
-                                       service->enable_root, querybuffer);
-
-        /* send first the query that fetches users and db grants */
-        if (mysql_query(con, userquery))
+        if (rc == 1)
         {
-            /*
-             * An error occurred executing the query
-             *
-             * Check mysql_errno() against ER_TABLEACCESS_DENIED_ERROR)
-             */
-
-            if (1142 != mysql_errno(con))
+            if (fetch->db_grants)
             {
-                /* This is an error we cannot handle, return */
-
-                MXS_ERROR("Loading users with dbnames for service [%s] encountered "
-                          "error: [%s], MySQL errno %i",
-                          service->name,
-                          mysql_error(con),
-                          mysql_errno(con));
+                char dbgrant[MYSQL_DATABASE_MAXLEN + 1] = "";
+                if (row[4] != NULL)
+                {
+                    if (strcmp(row[4], "Y") == 0)
+                    {
+                        strcpy(dbgrant, "ANY");
+                    }
+                    else if (row[5])
+                    {
+                        strncpy(dbgrant, row[5], MYSQL_DATABASE_MAXLEN);
+                    }
+                }
 
-                mysql_close(con);
+                if (!strlen(dbgrant))
+                {
+                    strcpy(dbgrant, "no db");
+                }
 
-                goto cleanup;
+                /* Log the user being added with its db grants */
+                MXS_INFO("%s: User %s@%s for database %s added to service user table.",
+                         service->name, row[0], row[1], dbgrant);
             }
             else
             {
-                /*
-                 * We have got ER_TABLEACCESS_DENIED_ERROR
-                 * try loading users from mysql.user without DB names.
-                 */
-
-                MXS_ERROR("Failed to retrieve users: %s", mysql_error(con));
-                MXS_ERROR(ERROR_NO_SHOW_DATABASES, service->name, service_user);
-
-                userquery = get_users_query(server->server->server_string,
-                                            service->enable_root, querybuffer);
-
-                if (mysql_query(con, userquery))
-                {
-                    MXS_ERROR("Loading users for service [%s] encountered "
-                              "error: [%s], code %i",
-                              service->name,
-                              mysql_error(con),
-                              mysql_errno(con));
-
-                    mysql_close(con);
-
-                    goto cleanup;
-                }
-
-                /* users successfully loaded but without db grants */
-
-                MXS_NOTICE("Loading users from [mysql.user] without access to [mysql.db] for "
-                           "service [%s]. MaxScale Authentication with DBname on connect "
-                           "will not consider database grants.",
-                           service->name);
+                /* Log the user being added (without db grants) */
+                MXS_INFO("%s: User %s@%s added to service user table.",
+                         service->name, row[0], row[1]);
             }
+
+            /* Append data in the memory area for SHA1 digest */
+            strncat(end, row[3], users_data_row_len);
+            end += strlen(end);
+            total_users++;
         }
         else
         {
-            /*
-             * users successfully loaded with db grants.
-             */
-            MXS_DEBUG("[%s] Loading users with db grants.", service->name);
-            db_grants = 1;
+            /** Log errors and not the duplicate user */
+            if (service->log_auth_warnings && rc != -1)
+            {
+                MXS_WARNING("Failed to add user %s@%s for service [%s]."
+                            " This user will be unavailable via MaxScale.",
+                            row[0], row[1], service->name);
+            }
         }
+    }
 
-        result = mysql_store_result(con);
-
-        if (result == NULL)
-        {
-            MXS_ERROR("Loading users for service %s encountered error: %s.",
-                      service->name,
-                      mysql_error(con));
+    return total_users;
+}
 
-            mysql_free_result(result);
-            mysql_close(con);
+/**
+ * Load the user/passwd from mysql.user table into the service users' hashtable
+ * environment from all the backend servers.
+ *
+ * The users and the database names are fetched from all the servers at the
+ * same time, each server in its own thread. The results are merged in the
+ * order of the servers of the service once all the servers have answered or
+ * timed out. A server that cannot be reached or fails to return its users is
+ * left out.
+ *
+ * @param service   The current service
+ * @param users     The users table into which to load the users
+ * @return          -1 on any error or the number of users inserted
+ */
+static int
+get_all_users(SERVICE *service, USERS *users, HASHTABLE **resources)
+{
+    char *service_user = NULL;
+    char *service_passwd = NULL;
+    char *dpwd = NULL;
+    int total_users = 0;
+    SERVER_REF *server;
+    USERS_FETCH *fetch;
+    unsigned char hash[SHA_DIGEST_LENGTH] = "";
+    char *users_data = NULL;
+    size_t nrows = 0;
+    int users_data_row_len = MYSQL_USER_MAXLEN + MYSQL_HOST_MAXLEN +
+                             MYSQL_PASSWORD_LEN + sizeof(char) + MYSQL_DATABASE_MAXLEN;
+    int nservers = 0;
+    int nloaded = 0;
+    bool anon_user = false;
 
-            goto cleanup;
-        }
+    if (serviceGetUser(service, &service_user, &service_passwd) == 0)
+    {
+        ss_dassert(service_passwd == NULL || service_user == NULL);
+        return -1;
+    }
 
-        users_data = (char *) calloc(nusers, (users_data_row_len * sizeof(char)) + 1);
+    if (service->svc_do_shutdown)
+    {
+        return -1;
+    }
 
-        if (users_data == NULL)
-        {
-            char errbuf[STRERROR_BUFLEN];
-            MXS_ERROR("Memory allocation for user data failed due to %d, %s.",
-                      errno,
-                      strerror_r(errno, errbuf, sizeof(errbuf)));
-            mysql_free_result(result);
-            mysql_close(con);
+    for (server = service->dbref; server; server = server->next)
+    {
+        nservers++;
+    }
 
-            goto cleanup;
-        }
+    if (nservers == 0)
+    {
+        return 0;
+    }
 
-        while ((row = mysql_fetch_row(result)))
-        {
+    if ((fetch = calloc(nservers, sizeof(*fetch))) == NULL ||
+        (dpwd = decryptPassword(service_passwd)) == NULL)
+    {
+        free(fetch);
+        return -1;
+    }
 
-            /**
-             * Up to six fields could be returned.
-             * user,host,passwd,concat(),anydb,db
-             * passwd+1 (escaping the first byte that is '*')
-             */
+    server = service->dbref;
 
-            int rc = 0;
-            char *password = NULL;
+    for (int i = 0; i < nservers; i++, server = server->next)
+    {
+        fetch[i].service = service;
+        fetch[i].server = server->server;
+        fetch[i].user = service_user;
+        fetch[i].password = dpwd;
+        fetch[i].started = thread_start(&fetch[i].thread, fetch_server_users_thread,
+                                        &fetch[i]) != NULL;
+    }
 
-            /** If the username is empty, the backend server still has anonymous
-             * user in it. This will mean that localhost addresses do not match
-             * the wildcard host '%' */
-            if (strlen(row[0]) == 0)
-            {
-                anon_user = true;
-                continue;
-            }
+    for (int i = 0; i < nservers; i++)
+    {
+        if (fetch[i].started)
+        {
+            thread_wait(fetch[i].thread);
+        }
+        else
+        {
+            /** No thread for the server, fetch the users in this one */
+            fetch_server_users(&fetch[i]);
+        }
+    }
 
-            if (row[2] != NULL)
-            {
-                /* detect mysql_old_password (pre 4.1 protocol) */
-                if (strlen(row[2]) == 16)
-                {
-                    MXS_ERROR("%s: The user %s@%s has on old password in the "
-                              "backend database. MaxScale does not support these "
-                              "old passwords. This user will not be able to connect "
-                              "via MaxScale. Update the users password to correct "
-                              "this.",
-                              service->name,
-                              row[0],
-                              row[1]);
-                    continue;
-                }
+    free(dpwd);
 
-                if (strlen(row[2]) > 1)
-                {
-                    password = row[2] + 1;
-                }
-                else
-                {
-                    password = row[2];
-                }
-            }
+    *resources = resource_alloc();
 
-            /*
-             * add user@host and DB global priv and specificsa grant (if possible)
-             */
-            bool havedb = false;
+    for (int i = 0; i < nservers; i++)
+    {
+        if (fetch[i].databases)
+        {
+            MYSQL_ROW row;
 
-            if (db_grants)
+            /* insert key and value "" */
+            while ((row = mysql_fetch_row(fetch[i].databases)))
             {
-                /* we have dbgrants, store them */
-                if (row[5])
+                if (resource_add(*resources, row[0], ""))
                 {
-                    unsigned long *rowlen = mysql_fetch_lengths(result);
-                    memcpy(dbnm, row[5], rowlen[5]);
-                    memset(dbnm + rowlen[5], 0, 1);
-                    havedb = true;
-                    if (service->strip_db_esc)
-                    {
-                        strip_escape_chars(dbnm);
-                        MXS_DEBUG("[%s]: %s -> %s",
-                                  service->name,
-                                  row[5],
-                                  dbnm);
-                    }
+                    MXS_DEBUG("%s: Adding database %s to the resouce hash.",
+                              service->name, row[0]);
                 }
-
-                rc = add_mysql_users_with_host_ipv4(users, row[0], row[1],
-                                                    password, row[4],
-                                                    havedb ? dbnm : NULL);
-
-                MXS_DEBUG("%s: Adding user:%s host:%s anydb:%s db:%s.",
-                          service->name, row[0], row[1], row[4],
-                          havedb ? dbnm : NULL);
-            }
-            else
-            {
-                /* we don't have dbgrants, simply set ANY DB for the user */
-                rc = add_mysql_users_with_host_ipv4(users, row[0], row[1],
-                                                    password, "Y", NULL);
             }
 
-            if (rc == 1)
-            {
-                if (db_grants)
-                {
-                    char dbgrant[MYSQL_DATABASE_MAXLEN + 1] = "";
-                    if (row[4] != NULL)
-                    {
-                        if (strcmp(row[4], "Y") == 0)
-                        {
-                            strcpy(dbgrant, "ANY");
-                        }
-                        else if (row[5])
-                        {
-                            strncpy(dbgrant, row[5], MYSQL_DATABASE_MAXLEN);
-                        }
-                    }
+            mysql_free_result(fetch[i].databases);
+        }
 
-                    if (!strlen(dbgrant))
-                    {
-                        strcpy(dbgrant, "no db");
-                    }
+        if (fetch[i].users)
+        {
+            nrows += mysql_num_rows(fetch[i].users);
+        }
+    }
 
-                    /* Log the user being added with its db grants */
-                    MXS_INFO("%s: User %s@%s for database %s added to service user table.",
-                             service->name, row[0], row[1], dbgrant);
-                }
-                else
-                {
-                    /* Log the user being added (without db grants) */
-                    MXS_INFO("%s: User %s@%s added to service user table.",
-                             service->name, row[0], row[1]);
-                }
+    if (nrows > 0 && (users_data = calloc(nrows, users_data_row_len + 1)) == NULL)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Memory allocation for user data failed due to %d, %s.",
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
 
-                /* Append data in the memory area for SHA1 digest */
-                strncat(users_data, row[3], users_data_row_len);
-                total_users++;
-            }
-            else
+    for (int i = 0; i < nservers; i++)
+    {
+        if (fetch[i].users)
+        {
+            if (users_data)
             {
-                /** Log errors and not the duplicate user */
-                if (service->log_auth_warnings && rc != -1)
-                {
-                    MXS_WARNING("Failed to add user %s@%s for service [%s]."
-                                " This user will be unavailable via MaxScale.",
-                                row[0], row[1], service->name);
-                }
+                total_users += add_fetched_users(service, users, &fetch[i],
+                                                 users_data, &anon_user);
+                nloaded++;
             }
-        }
-
-        mysql_free_result(result);
-        mysql_close(con);
 
-        if ((tmp = realloc(final_data, (strlen(final_data) + strlen(users_data)
-                                        + 1) * sizeof(char))) == NULL)
-        {
-            free(users_data);
-            goto cleanup;
+            mysql_free_result(fetch[i].users);
         }
+    }
 
-        final_data = tmp;
+    free(fetch);
 
-        strcat(final_data, users_data);
+    if (nloaded == 0)
+    {
+        MXS_ERROR("Unable to get user data from backend database for service [%s]."
+                  " Failed to load the users from any of the backend databases.",
+                  service->name);
         free(users_data);
-
-        if (service->users_from_all)
-        {
-            server = server->next;
-        }
-        else
-        {
-            server = NULL;
-        }
+        return -1;
     }
 
     /* compute SHA1 digest for users' data */
-    SHA1((const unsigned char *) final_data, strlen(final_data), hash);
+    SHA1((const unsigned char *) users_data, strlen(users_data), hash);
 
     memcpy(users->cksum, hash, SHA_DIGEST_LENGTH);
 
+    users->anonymous = anon_user;
+
     /** Set the parameter if it is not configured by the user */
     if (service->localhost_match_wildcard_host == SERVICE_PARAM_UNINIT)
     {
         service->localhost_match_wildcard_host = anon_user ? 0 : 1;
     }
-cleanup:
 
-    free(dpwd);
-    free(final_data);
+    free(users_data);
 
     return total_users;
 }
@@ -1232,7 +1264,7 @@ cleanup:
  * @return          -1 on any error or the number of users inserted
  */
 static int
-get_users(SERVICE *service, USERS *users)
+get_users(SERVICE *service, USERS *users, HASHTABLE **resources)
 {
     MYSQL *con = NULL;
     MYSQL_ROW row;
@@ -1264,7 +1296,7 @@ get_users(SERVICE *service, USERS *users)
 
     if (service->users_from_all)
     {
-        return get_all_users(service, users);
+        return get_all_users(service, users, resources);
     }
 
     con = gw_mysql_init();
@@ -1509,13 +1541,13 @@ get_users(SERVICE *service, USERS *users)
     if (db_grants)
     {
         /* load all mysql database names */
-        dbnames = get_databases(service, con);
+        dbnames = get_databases(service, con, resources);
         MXS_DEBUG("Loaded %d MySQL Database Names for service [%s]",
                   dbnames, service->name);
     }
     else
     {
-        service->resources = NULL;
+        *resources = NULL;
     }
 
     while ((row = mysql_fetch_row(result)))
@@ -1663,6 +1695,8 @@ get_users(SERVICE *service, USERS *users)
 
     memcpy(users->cksum, hash, SHA_DIGEST_LENGTH);
 
+    users->anonymous = anon_user;
+
     /** Set the parameter if it is not configured by the user */
     if (service->localhost_match_wildcard_host == SERVICE_PARAM_UNINIT)
     {
@@ -1708,6 +1742,18 @@ mysql_users_alloc()
                          (HASHMEMORYFN) strdup, (HASHMEMORYFN) uh_keyfree,
                          (HASHMEMORYFN) free);
 
+    /* the index of the grants by user name, see mysql_users_find */
+    if ((rval->index = hashtable_alloc(USERS_HASHTABLE_DEFAULT_SIZE, simple_str_hash,
+                                       strcmp)) == NULL)
+    {
+        hashtable_free(rval->data);
+        free(rval);
+        return NULL;
+    }
+
+    hashtable_memory_fns(rval->index, (HASHMEMORYFN) strdup, NULL,
+                         (HASHMEMORYFN) free, (HASHMEMORYFN) grants_free);
+
     return rval;
 }
 
@@ -1724,33 +1770,406 @@ mysql_users_add(USERS *users, MYSQL_USER_HOST *key, char *auth)
 {
     int add;
 
-    if (key == NULL || key->user == NULL)
+    if (key == NULL || key->user == NULL)
+    {
+        return 0;
+    }
+
+    atomic_add(&users->stats.n_adds, 1);
+    add = hashtable_add(users->data, key, auth);
+    atomic_add(&users->stats.n_entries, add);
+
+    if (add && users->index && !grants_index_add(users->index, key, auth))
+    {
+        /* the lookups can't use an incomplete index */
+        hashtable_free(users->index);
+        users->index = NULL;
+    }
+
+    return add;
+}
+
+/**
+ * Fetch the authentication data for a particular user from the users table
+ *
+ * @param users The MySQL users table
+ * @param key   The key with user@host
+ * @return  The authentication data or NULL on error
+ */
+char *mysql_users_fetch(USERS *users, MYSQL_USER_HOST *key)
+{
+    if (key == NULL)
+    {
+        return NULL;
+    }
+    atomic_add(&users->stats.n_fetches, 1);
+    return hashtable_fetch(users->data, key);
+}
+
+/**
+ * The grants of a user are indexed by the host part of the grant. The network
+ * grants are stored in a binary trie of the IPv4 address bits, a node at depth
+ * n holds the grants of the networks with an n bit netmask. The grants for
+ * hostname patterns with single character wildcards are kept in a list. The
+ * patterns of the database grants are compiled when the grant is indexed.
+ */
+
+/** A grant of a user from a host */
+typedef struct mysql_grant
+{
+    char *resource;             /**< NULL for no database grants, "" for any database */
+    bool  db_pattern;           /**< The database name is a pattern */
+    regex_t db_re;              /**< The compiled pattern of the database name */
+    char *auth;                 /**< The SHA1(SHA1(password)) in hex */
+    struct mysql_grant *next;
+} MYSQL_GRANT;
+
+/** A node of the binary trie of the network grants */
+typedef struct mysql_grant_node
+{
+    struct mysql_grant_node *child[2];
+    MYSQL_GRANT *grants;        /**< Grants of the network that ends at this node */
+} MYSQL_GRANT_NODE;
+
+/** The grants for a hostname pattern */
+typedef struct mysql_host_pattern
+{
+    char pattern[MYSQL_HOST_MAXLEN + 1];
+    MYSQL_GRANT *grants;
+    struct mysql_host_pattern *next;
+} MYSQL_HOST_PATTERN;
+
+/** All grants of one user */
+typedef struct
+{
+    MYSQL_GRANT_NODE root;      /**< The grants from any host are in the root */
+    MYSQL_HOST_PATTERN *patterns;
+} MYSQL_USER_GRANTS;
+
+static void grant_list_free(MYSQL_GRANT *grant)
+{
+    while (grant)
+    {
+        MYSQL_GRANT *next = grant->next;
+
+        if (grant->db_pattern)
+        {
+            regfree(&grant->db_re);
+        }
+        free(grant->resource);
+        free(grant->auth);
+        free(grant);
+        grant = next;
+    }
+}
+
+static void grant_node_free(MYSQL_GRANT_NODE *node)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (node->child[i])
+        {
+            grant_node_free(node->child[i]);
+            free(node->child[i]);
+        }
+    }
+    grant_list_free(node->grants);
+}
+
+/**
+ * Free the grants of a user, the value free function of the index
+ *
+ * @param data The grants of the user
+ */
+static void grants_free(void *data)
+{
+    MYSQL_USER_GRANTS *grants = (MYSQL_USER_GRANTS *)data;
+
+    grant_node_free(&grants->root);
+
+    while (grants->patterns)
+    {
+        MYSQL_HOST_PATTERN *next = grants->patterns->next;
+        grant_list_free(grants->patterns->grants);
+        free(grants->patterns);
+        grants->patterns = next;
+    }
+
+    free(grants);
+}
+
+/**
+ * Compile a database name pattern the same way the users table comparison
+ * matches it: every '%' matches any characters and the match is not anchored.
+ *
+ * @param re      The regular expression to compile
+ * @param pattern The database name pattern
+ * @return True if the pattern was compiled
+ */
+static bool grant_compile_db(regex_t *re, const char *pattern)
+{
+    char db[MYSQL_DATABASE_MAXLEN * 2 + 1];
+    char *ptr = db;
+
+    for (const char *c = pattern; *c && ptr - db < (int)sizeof(db) - 2; c++)
+    {
+        if (*c == '%')
+        {
+            *ptr++ = '.';
+        }
+        *ptr++ = *c == '%' ? '*' : *c;
+    }
+    *ptr = '\0';
+
+    return regcomp(re, db, REG_ICASE | REG_NOSUB) == 0;
+}
+
+/**
+ * Check if a grant allows access to a database
+ *
+ * @param grant The grant
+ * @param db    The requested database, NULL or empty if none
+ * @return True if the grant allows the access
+ */
+static bool grant_allows_db(MYSQL_GRANT *grant, const char *db)
+{
+    if (db == NULL || *db == '\0' ||
+        (grant->resource && (*grant->resource == '\0' || strcmp(grant->resource, db) == 0)))
+    {
+        return true;
+    }
+
+    return grant->db_pattern && regexec(&grant->db_re, db, 0, NULL, 0) == 0;
+}
+
+/**
+ * Find the grant of a list that allows access to a database
+ *
+ * @param grant The first grant of the list
+ * @param db    The requested database
+ * @return The authentication data of the grant or NULL if none allow the access
+ */
+static char *grant_list_find(MYSQL_GRANT *grant, const char *db)
+{
+    for (; grant; grant = grant->next)
+    {
+        if (grant_allows_db(grant, db))
+        {
+            return grant->auth;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Add an entry of the users table to the index
+ *
+ * @param index The index of the users table
+ * @param key   The user, the host and the database of the entry
+ * @param auth  The authentication data of the entry
+ * @return True on success, false if memory allocation failed
+ */
+static bool grants_index_add(HASHTABLE *index, MYSQL_USER_HOST *key, char *auth)
+{
+    MYSQL_USER_GRANTS *grants = hashtable_fetch(index, key->user);
+    MYSQL_GRANT *grant;
+    MYSQL_GRANT **list;
+
+    if (grants == NULL)
+    {
+        if ((grants = calloc(1, sizeof(MYSQL_USER_GRANTS))) == NULL)
+        {
+            return false;
+        }
+        if (!hashtable_add(index, key->user, grants))
+        {
+            free(grants);
+            return false;
+        }
+    }
+
+    if (*key->hostname)
+    {
+        MYSQL_HOST_PATTERN *pattern = grants->patterns;
+
+        while (pattern && strcmp(pattern->pattern, key->hostname))
+        {
+            pattern = pattern->next;
+        }
+
+        if (pattern == NULL)
+        {
+            if ((pattern = calloc(1, sizeof(MYSQL_HOST_PATTERN))) == NULL)
+            {
+                return false;
+            }
+            strcpy(pattern->pattern, key->hostname);
+            pattern->next = grants->patterns;
+            grants->patterns = pattern;
+        }
+
+        list = &pattern->grants;
+    }
+    else
+    {
+        MYSQL_GRANT_NODE *node = &grants->root;
+        uint32_t addr = ntohl(key->ipv4.sin_addr.s_addr);
+
+        for (int i = 0; i < key->netmask && i < 32; i++)
+        {
+            int bit = (addr >> (31 - i)) & 1;
+
+            if (node->child[bit] == NULL &&
+                (node->child[bit] = calloc(1, sizeof(MYSQL_GRANT_NODE))) == NULL)
+            {
+                return false;
+            }
+            node = node->child[bit];
+        }
+
+        list = &node->grants;
+    }
+
+    if ((grant = calloc(1, sizeof(MYSQL_GRANT))) == NULL ||
+        (key->resource && (grant->resource = strdup(key->resource)) == NULL) ||
+        (grant->auth = strdup(auth ? auth : "")) == NULL)
+    {
+        grant_list_free(grant);
+        return false;
+    }
+
+    if (grant->resource && strchr(grant->resource, '%'))
+    {
+        grant->db_pattern = grant_compile_db(&grant->db_re, grant->resource);
+    }
+
+    /* keep the order in which the grants were added */
+    while (*list)
+    {
+        list = &(*list)->next;
+    }
+    *list = grant;
+
+    return true;
+}
+
+/**
+ * Build the index of a users table that was filled without it
+ *
+ * @param users The users table
+ */
+static void grants_index_build(USERS *users)
+{
+    HASHITERATOR *iter;
+    MYSQL_USER_HOST *key;
+
+    if (users->index == NULL || (iter = hashtable_iterator(users->data)) == NULL)
+    {
+        return;
+    }
+
+    while ((key = hashtable_next(iter)))
+    {
+        if (!grants_index_add(users->index, key, hashtable_fetch(users->data, key)))
+        {
+            hashtable_free(users->index);
+            users->index = NULL;
+            break;
+        }
+    }
+
+    hashtable_iterator_free(iter);
+}
+
+/**
+ * Find the authentication data of a client
+ *
+ * The grants are searched from the most specific network to the least
+ * specific one: the client address, the class C, B and A networks of it and
+ * finally the hostname patterns and the grants from any host. On each level
+ * the grants must also allow access to the requested database. The network
+ * levels are found with one walk down the address trie of the user.
+ *
+ * @param users     The users table
+ * @param key       The user, the client address and hostname and the database
+ * @param wildcards Also search the network and pattern grants, otherwise
+ *                  only the grants for the exact address are used
+ * @return The authentication data or NULL if no grant matches
+ */
+char *mysql_users_find(USERS *users, MYSQL_USER_HOST *key, bool wildcards)
+{
+    MYSQL_GRANT_NODE *path[33];
+    MYSQL_USER_GRANTS *grants;
+    char *rval = NULL;
+    int depth = 0;
+
+    if (key == NULL || key->user == NULL)
+    {
+        return NULL;
+    }
+
+    if (users->index == NULL)
+    {
+        /* fall back to the lookups of the users table */
+        MYSQL_USER_HOST lookup = *key;
+        uint32_t masks[] = {0xFFFFFFFF, 0xFFFFFF00, 0xFFFF0000, 0xFF000000, 0};
+        uint32_t addr = ntohl(key->ipv4.sin_addr.s_addr);
+
+        for (int i = 0; i < (wildcards ? 5 : 1) && rval == NULL; i++)
+        {
+            lookup.ipv4.sin_addr.s_addr = htonl(addr & masks[i]);
+            lookup.netmask = 32 - 8 * i;
+            rval = mysql_users_fetch(users, &lookup);
+        }
+
+        return rval;
+    }
+
+    atomic_add(&users->stats.n_fetches, 1);
+
+    if ((grants = hashtable_fetch(users->index, key->user)) == NULL)
     {
-        return 0;
+        return NULL;
     }
 
-    atomic_add(&users->stats.n_adds, 1);
-    add = hashtable_add(users->data, key, auth);
-    atomic_add(&users->stats.n_entries, add);
+    uint32_t addr = ntohl(key->ipv4.sin_addr.s_addr);
+    MYSQL_GRANT_NODE *node = &grants->root;
 
-    return add;
-}
+    path[depth] = node;
 
-/**
- * Fetch the authentication data for a particular user from the users table
- *
- * @param users The MySQL users table
- * @param key   The key with user@host
- * @return  The authentication data or NULL on error
- */
-char *mysql_users_fetch(USERS *users, MYSQL_USER_HOST *key)
-{
-    if (key == NULL)
+    while (depth < 32 && (node = node->child[(addr >> (31 - depth)) & 1]))
     {
-        return NULL;
+        path[++depth] = node;
     }
-    atomic_add(&users->stats.n_fetches, 1);
-    return hashtable_fetch(users->data, key);
+
+    /* the grants on the exact address and, with wildcards, the networks of it */
+    for (int i = depth; i > 0 && rval == NULL; i--)
+    {
+        if (path[i]->grants && (wildcards || i == 32))
+        {
+            rval = grant_list_find(path[i]->grants, key->resource);
+        }
+    }
+
+    if (rval == NULL && wildcards && *key->hostname)
+    {
+        for (MYSQL_HOST_PATTERN *pattern = grants->patterns; pattern && rval == NULL;
+             pattern = pattern->next)
+        {
+            if (host_matches_singlechar_wildcard(key->hostname, pattern->pattern))
+            {
+                rval = grant_list_find(pattern->grants, key->resource);
+            }
+        }
+    }
+
+    if (rval == NULL && wildcards)
+    {
+        rval = grant_list_find(grants->root.grants, key->resource);
+    }
+
+    return rval;
 }
 
 /**
@@ -1771,8 +2190,13 @@ static int uh_hfun(void* key)
     }
     else
     {
-        return (*hu->user + * (hu->user + 1) +
-                (unsigned int) (hu->ipv4.sin_addr.s_addr & 0xFF000000 / (256 * 256 * 256)));
+        /**
+         * Entries that match may differ in the rest of the address because of
+         * the netmask, so only the first byte of the address is hashed.
+         */
+        uint8_t first = ((uint8_t *)&hu->ipv4.sin_addr.s_addr)[0];
+
+        return (int)hash_bytes(&first, 1, hash_str(hu->user, hash_seed()));
     }
 }
 
@@ -2042,6 +2466,52 @@ resource_free(HASHTABLE *resources)
     }
 }
 
+/** A replaced resources table waiting to be freed */
+typedef struct
+{
+    EPOCH_ENTRY entry;
+    HASHTABLE   *resources;
+} RETIRED_RESOURCES;
+
+/**
+ * Epoch callback that frees a retired resources table
+ *
+ * @param data The retired table
+ */
+static void
+resource_retired_free(void *data)
+{
+    RETIRED_RESOURCES *retired = (RETIRED_RESOURCES *)data;
+
+    resource_free(retired->resources);
+    free(retired);
+}
+
+/**
+ * Free a replaced resources table once no polling thread can be reading it
+ *
+ * @param resources The resources table
+ */
+static void
+resource_retire(HASHTABLE *resources)
+{
+    RETIRED_RESOURCES *retired;
+
+    if (resources == NULL)
+    {
+        return;
+    }
+
+    if ((retired = (RETIRED_RESOURCES *)malloc(sizeof(RETIRED_RESOURCES))) == NULL)
+    {
+        resource_free(resources);
+        return;
+    }
+
+    retired->resources = resources;
+    epoch_retire(&retired->entry, resource_retired_free, retired);
+}
+
 /**
  * Allocate a MySQL database names table
  *
@@ -2264,83 +2734,6 @@ retblock:
     return rc;
 }
 
-/*
- * Serialise a key for the dbusers hashtable to a file
- *
- * @param fd    File descriptor to write to
- * @param key   The key to write
- * @return      0 on error, 1 if the key was written
- */
-static int
-dbusers_keywrite(int fd, void *key)
-{
-    MYSQL_USER_HOST *dbkey = (MYSQL_USER_HOST *) key;
-    int tmp;
-
-    tmp = strlen(dbkey->user);
-    if (write(fd, &tmp, sizeof(tmp)) != sizeof(tmp))
-    {
-        return 0;
-    }
-    if (write(fd, dbkey->user, tmp) != tmp)
-    {
-        return 0;
-    }
-    if (write(fd, &dbkey->ipv4, sizeof(dbkey->ipv4)) != sizeof(dbkey->ipv4))
-    {
-        return 0;
-    }
-    if (write(fd, &dbkey->netmask, sizeof(dbkey->netmask)) != sizeof(dbkey->netmask))
-    {
-        return 0;
-    }
-    if (dbkey->resource)
-    {
-        tmp = strlen(dbkey->resource);
-        if (write(fd, &tmp, sizeof(tmp)) != sizeof(tmp))
-        {
-            return 0;
-        }
-        if (write(fd, dbkey->resource, tmp) != tmp)
-        {
-            return 0;
-        }
-    }
-    else // NULL is valid, so represent with a length of -1
-    {
-        tmp = -1;
-        if (write(fd, &tmp, sizeof(tmp)) != sizeof(tmp))
-        {
-            return 0;
-        }
-    }
-    return 1;
-}
-
-/**
- * Serialise a value for the dbusers hashtable to a file
- *
- * @param fd    File descriptor to write to
- * @param value The value to write
- * @return      0 on error, 1 if the value was written
- */
-static int
-dbusers_valuewrite(int fd, void *value)
-{
-    int tmp;
-
-    tmp = strlen(value);
-    if (write(fd, &tmp, sizeof(tmp)) != sizeof(tmp))
-    {
-        return 0;
-    }
-    if (write(fd, value, tmp) != tmp)
-    {
-        return 0;
-    }
-    return 1;
-}
-
 /**
  * Unserialise a key for the dbusers hashtable from a file
  *
@@ -2451,29 +2844,308 @@ dbusers_valueread(int fd)
 }
 
 /**
- * Save the dbusers data to a hashtable file
+ * Load the dbusers data from a file saved in the hashtable format
+ *
+ * @param users     The hashtable that stores the user data
+ * @param filename  The filename to laod the data from
+ * @return      The number of entries loaded or -1 on error
+ */
+static int
+dbusers_load_hashtable(USERS *users, const char *filename)
+{
+    int rval = hashtable_load(users->data, filename, dbusers_keyread, dbusers_valueread);
+
+    if (rval > 0)
+    {
+        grants_index_build(users);
+    }
+
+    return rval;
+}
+/**
+ * Append an entry of the users table to a snapshot
+ *
+ * @param buf   The snapshot, reallocated if needed
+ * @param size  Size of the snapshot so far, updated
+ * @param alloc Allocated size of the snapshot, updated
+ * @param key   The key of the entry
+ * @param auth  The authentication data of the entry
+ * @return True on success, false on memory allocation failure or if a field is too long
+ */
+static bool
+dbusers_snapshot_add(uint8_t **buf, size_t *size, size_t *alloc,
+                     MYSQL_USER_HOST *key, const char *auth)
+{
+    size_t user_len = strlen(key->user);
+    size_t hostname_len = strlen(key->hostname);
+    size_t resource_len = key->resource ? strlen(key->resource) : 0;
+    size_t auth_len = strlen(auth);
+
+    if (user_len > UINT16_MAX || auth_len > UINT16_MAX || resource_len > INT16_MAX)
+    {
+        return false;
+    }
+
+    size_t len = DBUSERS_SNAPSHOT_ENTRY_LEN(user_len, key->resource ? (int)resource_len : -1,
+                                            hostname_len, auth_len);
+
+    if (*size + len > *alloc)
+    {
+        size_t newalloc = (*alloc + len) * 2;
+        uint8_t *tmp = realloc(*buf, newalloc);
+
+        if (tmp == NULL)
+        {
+            return false;
+        }
+
+        *buf = tmp;
+        *alloc = newalloc;
+    }
+
+    uint8_t *ptr = *buf + *size;
+    DBUSERS_SNAPSHOT_ENTRY entry;
+
+    entry.addr = key->ipv4.sin_addr.s_addr;
+    entry.netmask = key->netmask;
+    entry.user_len = user_len;
+    entry.hostname_len = hostname_len;
+    entry.auth_len = auth_len;
+    entry.resource_len = key->resource ? (int)resource_len : -1;
+
+    memset(ptr, 0, len);
+    memcpy(ptr, &entry, sizeof(entry));
+    ptr += sizeof(entry);
+    memcpy(ptr, key->user, user_len + 1);
+    ptr += user_len + 1;
+
+    if (key->resource)
+    {
+        memcpy(ptr, key->resource, resource_len + 1);
+        ptr += resource_len + 1;
+    }
+
+    memcpy(ptr, key->hostname, hostname_len + 1);
+    ptr += hostname_len + 1;
+    memcpy(ptr, auth, auth_len + 1);
+
+    *size += len;
+    return true;
+}
+
+/**
+ * Save the dbusers data to a snapshot file
+ *
+ * The snapshot is built in memory and written to a temporary file that
+ * then replaces the old snapshot, a reader never sees a partial file.
  *
  * @param users     The hashtable that stores the user data
  * @param filename  The filename to save the data in
- * @return      The number of entries saved
+ * @return      The number of entries saved or -1 on error
  */
 int
 dbusers_save(USERS *users, const char *filename)
 {
-    return hashtable_save(users->data, filename, dbusers_keywrite, dbusers_valuewrite);
+    DBUSERS_SNAPSHOT_HEADER header;
+    size_t alloc = USERS_HASHTABLE_DEFAULT_SIZE * 128;
+    size_t size = sizeof(header);
+    uint8_t *buf = malloc(alloc);
+    HASHITERATOR *iter = hashtable_iterator(users->data);
+    MYSQL_USER_HOST *key;
+    int count = 0;
+    bool ok = buf != NULL && iter != NULL;
+
+    while (ok && (key = hashtable_next(iter)) != NULL)
+    {
+        char *auth = hashtable_fetch(users->data, key);
+
+        if (auth)
+        {
+            ok = dbusers_snapshot_add(&buf, &size, &alloc, key, auth);
+            count++;
+        }
+    }
+
+    if (iter)
+    {
+        hashtable_iterator_free(iter);
+    }
+
+    if (!ok)
+    {
+        MXS_ERROR("Failed to create the snapshot of the users for '%s'.", filename);
+        free(buf);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DBUSERS_SNAPSHOT_MAGIC, DBUSERS_SNAPSHOT_MAGIC_LEN);
+    header.version = DBUSERS_SNAPSHOT_VERSION;
+    header.count = count;
+    header.size = size;
+    memcpy(header.cksum, users->cksum, SHA_DIGEST_LENGTH);
+    header.anonymous = users->anonymous;
+    memcpy(buf, &header, sizeof(header));
+
+    char tmpname[PATH_MAX + 1];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+    int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd == -1 || write(fd, buf, size) != (ssize_t)size ||
+        close(fd) != 0 || rename(tmpname, filename) != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to write the users to '%s': %d, %s", filename,
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+
+        if (fd != -1)
+        {
+            close(fd);
+            unlink(tmpname);
+        }
+
+        count = -1;
+    }
+
+    free(buf);
+    return count;
+}
+
+/**
+ * Load the dbusers data from a snapshot mapped into memory
+ *
+ * @param users     The users table to load into
+ * @param map       The snapshot
+ * @param size      Size of the snapshot
+ * @return      The number of entries loaded or -1 if the snapshot is not valid
+ */
+static int
+dbusers_load_snapshot(USERS *users, const uint8_t *map, size_t size)
+{
+    DBUSERS_SNAPSHOT_HEADER header;
+
+    memcpy(&header, map, sizeof(header));
+
+    if (header.version != DBUSERS_SNAPSHOT_VERSION || header.size != size)
+    {
+        return -1;
+    }
+
+    const uint8_t *ptr = map + sizeof(header);
+    const uint8_t *end = map + size;
+    int rval = 0;
+
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        DBUSERS_SNAPSHOT_ENTRY entry;
+
+        if ((size_t)(end - ptr) < sizeof(entry))
+        {
+            return -1;
+        }
+
+        memcpy(&entry, ptr, sizeof(entry));
+
+        size_t len = DBUSERS_SNAPSHOT_ENTRY_LEN(entry.user_len, entry.resource_len,
+                                                entry.hostname_len, entry.auth_len);
+
+        if ((size_t)(end - ptr) < len || entry.hostname_len > MYSQL_HOST_MAXLEN ||
+            entry.resource_len < -1)
+        {
+            return -1;
+        }
+
+        MYSQL_USER_HOST key;
+        const char *str = (const char*)ptr + sizeof(entry);
+
+        memset(&key, 0, sizeof(key));
+        key.user = (char*)str;
+        str += entry.user_len + 1;
+
+        if (entry.resource_len >= 0)
+        {
+            key.resource = (char*)str;
+            str += entry.resource_len + 1;
+        }
+
+        memcpy(key.hostname, str, entry.hostname_len);
+        key.hostname[entry.hostname_len] = '\0';
+        str += entry.hostname_len + 1;
+
+        const char *auth = str;
+
+        if (key.user[entry.user_len] != '\0' || auth[entry.auth_len] != '\0' ||
+            (key.resource && key.resource[entry.resource_len] != '\0'))
+        {
+            return -1;
+        }
+
+        key.ipv4.sin_family = AF_INET;
+        key.ipv4.sin_addr.s_addr = entry.addr;
+        key.netmask = entry.netmask;
+
+        rval += mysql_users_add(users, &key, (char*)auth);
+        ptr += len;
+    }
+
+    memcpy(users->cksum, header.cksum, SHA_DIGEST_LENGTH);
+    users->anonymous = header.anonymous;
+
+    return rval;
 }
 
 /**
- * Load the dbusers data from a saved hashtable file
+ * Load the dbusers data from a snapshot file
+ *
+ * The file is mapped into memory and the entries are added straight from the
+ * mapping. Files saved in the older hashtable format are also read.
  *
  * @param users     The hashtable that stores the user data
  * @param filename  The filename to laod the data from
- * @return      The number of entries loaded
+ * @return      The number of entries loaded or -1 on error
  */
 int
 dbusers_load(USERS *users, const char *filename)
 {
-    return hashtable_load(users->data, filename, dbusers_keyread, dbusers_valueread);
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DBUSERS_SNAPSHOT_HEADER))
+    {
+        close(fd);
+        return dbusers_load_hashtable(users, filename);
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    int rval;
+
+    if (memcmp(map, DBUSERS_SNAPSHOT_MAGIC, DBUSERS_SNAPSHOT_MAGIC_LEN) == 0)
+    {
+        if ((rval = dbusers_load_snapshot(users, map, st.st_size)) == -1)
+        {
+            MXS_ERROR("The users snapshot '%s' is corrupted.", filename);
+        }
+    }
+    else
+    {
+        rval = dbusers_load_hashtable(users, filename);
+    }
+
+    munmap(map, st.st_size);
+    return rval;
 }
 
 /**
@@ -59,6 +59,16 @@
  * 07/02/2016   Martin Brampton         Make dcb_read_SSL & dcb_create_SSL internal,
  *                                      further small SSL logic changes
  * 31/05/2016   Martin Brampton         Implement connection throttling
+ * 15/10/2016   Core Team               Resume TLS sessions of backend connections,
+ *                                      write through kernel TLS
+ * 15/10/2016   Core Team               Listen on the sockets of the previous process
+ * 15/10/2016   Core Team               Count the bytes moved by each polling thread
+ * 15/10/2016   Core Team               Static probes for tracing tools
+ * 15/10/2016   Core Team               Count the DCBs in the memory statistics
+ * 15/10/2016   Core Team               Release the queued client connections
+ * 15/10/2016   Core Team               Callbacks in a fixed array, server state
+ *                                      changes only visit the DCBs of the server
+ * 15/10/2016   Core Team               Connection rate limit of the servers
  *
  * @endverbatim
  */
@@ -84,53 +94,122 @@
 #include <hashtable.h>
 #include <listener.h>
 #include <hk_heartbeat.h>
+#include <latency.h>
+#include <timer.h>
+#include <epoch.h>
+#include <bufpool.h>
+#include <handoff.h>
+#include <probes.h>
+#include <memstats.h>
+#include <platform.h>
+#include <limits.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
-static  DCB             *allDCBs = NULL;        /* Diagnostics need a list of DCBs */
-static  DCB             *lastDCB = NULL;
-static  DCB             *wasfreeDCB = NULL;
-static  int             freeDCBcount = 0;
+/** The number of shards in the registry of the DCBs in use */
+#define DCB_REGISTRY_SHARDS 16
+
+/**
+ * A shard of the registry of the DCBs in use. The diagnostics need a list of
+ * the DCBs, which is split in shards so that the allocation and the freeing of
+ * DCBs by different threads do not serialise on one lock.
+ */
+typedef struct
+{
+    SPINLOCK        lock;
+    DCB             *head;
+} DCB_REGISTRY;
+
+static  DCB_REGISTRY    dcb_registry[DCB_REGISTRY_SHARDS] =
+{
+    [0 ... DCB_REGISTRY_SHARDS - 1] = {SPINLOCK_INIT_NAMED("DCB registry"), NULL}
+};
+static  int             next_registry_shard = 0;
+static  thread_local int registry_shard = -1;  /* The shard of the calling thread */
 static  int             nDCBs = 0;
+static  thread_local bool defer_writes = false;     /* Set while a thread dispatches an event */
+static  thread_local DCB *deferred_flush = NULL;    /* DCBs written during the dispatch */
 static  int             maxDCBs = 0;
-static  DCB             *zombies = NULL;
 static  int             nzombies = 0;
 static  int             maxzombies = 0;
-static  SPINLOCK        dcbspin = SPINLOCK_INIT;
-static  SPINLOCK        zombiespin = SPINLOCK_INIT;
+static  SPINLOCK        zombiespin = SPINLOCK_INIT_NAMED("DCB zombies");
+
+/** The smallest read buffer */
+#define DCB_READ_MIN_SIZE 512
+
+/**
+ * The number of bytes read from a DCB before the rest of the data is left for
+ * a later event, so that one fast client does not starve the others
+ */
+#define DCB_READ_BUDGET (256 * 1024)
+
+/**
+ * The maximum number of buffers of the write queue written with a single
+ * writev call
+ */
+#define DCB_MAX_IOVECS IOV_MAX
+
+/**
+ * The size of the block into which the small buffers of the write queue are
+ * coalesced for a single SSL_write, the maximum size of a TLS record
+ */
+#define DCB_SSL_COALESCE_SIZE 16384
+
+/** The size of the pipes of spliced DCBs and the most moved with one splice call */
+#define DCB_SPLICE_PIPE_SIZE (1024 * 1024)
+
+/** The I/O vectors and the SSL coalescing block of the polling threads */
+static thread_local struct iovec write_iov[DCB_MAX_IOVECS];
+static thread_local unsigned char ssl_coalesce[DCB_SSL_COALESCE_SIZE];
 
 static void dcb_final_free(DCB *dcb);
 static void dcb_call_callback(DCB *dcb, DCB_REASON reason);
 static int  dcb_null_write(DCB *dcb, GWBUF *buf);
 static int  dcb_null_auth(DCB *dcb, SERVER *server, SESSION *session, GWBUF *buf);
-static inline int  dcb_isvalid_nolock(DCB *dcb);
-static inline DCB * dcb_find_in_list(DCB *dcb);
-static inline void dcb_process_victim_queue(DCB *listofdcb);
+static void dcb_add_to_zombies(DCB *dcb);
+static void dcb_process_zombie(void *data);
 static void dcb_stop_polling_and_shutdown (DCB *dcb);
 static bool dcb_maybe_add_persistent(DCB *);
+static void dcb_splice_drained(DCB *dcb);
+static void dcb_splice_detach(DCB *dcb);
+static void dcb_splice_release(DCB *dcb);
 static inline bool dcb_write_parameter_check(DCB *dcb, GWBUF *queue);
-static int dcb_bytes_readable(DCB *dcb);
+static int dcb_read_size(DCB *dcb);
 static int dcb_read_no_bytes_available(DCB *dcb, int nreadtotal);
 static int dcb_create_SSL(DCB* dcb, SSL_LISTENER *ssl);
+static void dcb_SSL_established(DCB *dcb);
 static int dcb_read_SSL(DCB *dcb, GWBUF **head);
-static GWBUF *dcb_basic_read(DCB *dcb, int bytesavailable, int maxbytes, int nreadtotal, int *nsingleread);
+static GWBUF *dcb_basic_read(DCB *dcb, int bufsize, int *nsingleread);
 static GWBUF *dcb_basic_read_SSL(DCB *dcb, int *nsingleread);
 #if defined(FAKE_CODE)
 static inline void dcb_write_fake_code(DCB *dcb);
 #endif
 static void dcb_log_write_failure(DCB *dcb, GWBUF *queue, int eno);
 static inline void dcb_write_tidy_up(DCB *dcb, bool below_water);
+static inline void dcb_writeq_add(DCB *dcb, int bytes);
+static void dcb_flow_stop(DCB *dcb);
+static void dcb_flow_resume(DCB *dcb);
+static void dcb_flow_close(DCB *dcb);
 static int gw_write(DCB *dcb, GWBUF *writeq, bool *stop_writing);
 static int gw_write_SSL(DCB *dcb, GWBUF *writeq, bool *stop_writing);
 static int dcb_log_errors_SSL (DCB *dcb, const char *called_by, int ret);
 static int dcb_accept_one_connection(DCB *listener, struct sockaddr *client_conn);
+static DCB *dcb_release_queued(DCB *listener);
+static void dcb_wake_queued(DCB *dcb);
 static int dcb_listen_create_socket_inet(const char *config_bind);
 static int dcb_listen_create_socket_unix(const char *config_bind);
 static int dcb_set_socket_option(int sockfd, int level, int optname, void *optval, socklen_t optlen);
-static void dcb_add_to_all_list(DCB *dcb);
-static DCB *dcb_find_free();
+static void dcb_set_client_options(DCB *listener, int sockfd);
+static void dcb_registry_add(DCB *dcb);
+static void dcb_registry_remove(DCB *dcb);
+static void dcb_server_link(DCB *dcb, SERVER *server);
+static void dcb_server_unlink(DCB *dcb);
+static void dcb_clear_callbacks(DCB *dcb);
 static GWBUF *dcb_grab_writeq(DCB *dcb, bool first_time);
 
 size_t dcb_get_session_id(
@@ -165,17 +244,6 @@ bool dcb_get_ses_log_info(
     return false;
 }
 
-/**
- * Return the pointer to the list of zombie DCB's
- *
- * @return Zombies DCB list
- */
-DCB *
-dcb_get_zombies(void)
-{
-    return zombies;
-}
-
 /**
  * Allocate or recycle a new DCB.
  *
@@ -189,19 +257,22 @@ DCB *
 dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
 {
     DCB *newdcb;
+    int n;
 
-    spinlock_acquire(&dcbspin);
-    if ((newdcb = dcb_find_free()) == NULL)
+    /** The DCBs come from the per-thread caches of the buffer pools */
+    if ((newdcb = bufpool_alloc(sizeof(DCB))) == NULL)
     {
-        spinlock_release(&dcbspin);
         return NULL;
     }
-    nDCBs++;
-    if (nDCBs > maxDCBs)
+    memstats_add(MEMSTATS_DCBS, sizeof(DCB), 1);
+    memset(newdcb, 0, sizeof(DCB));
+    newdcb->dcb_is_in_use = true;
+    dcb_registry_add(newdcb);
+    n = atomic_add(&nDCBs, 1) + 1;
+    if (n > maxDCBs)
     {
-        maxDCBs = nDCBs;
+        maxDCBs = n;
     }
-    spinlock_release(&dcbspin);
 
     newdcb->dcb_chk_top = CHK_NUM_DCB;
     newdcb->dcb_chk_tail = CHK_NUM_DCB;
@@ -225,21 +296,31 @@ dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
     newdcb->evq.prev = NULL;
     newdcb->evq.pending_events = 0;
     newdcb->evq.processing = 0;
+    newdcb->evq.owner = -1;
     spinlock_init(&newdcb->evq.eventqlock);
 
     memset(&newdcb->stats, 0, sizeof(DCBSTATS));        // Zero the statistics
     newdcb->state = DCB_STATE_ALLOC;
-    bitmask_init(&newdcb->memdata.bitmask);
     newdcb->writeqlen = 0;
-    newdcb->high_water = 0;
-    newdcb->low_water = 0;
+    if (role == DCB_ROLE_CLIENT_HANDLER || role == DCB_ROLE_BACKEND_HANDLER)
+    {
+        newdcb->high_water = config_writeq_high_water();
+        newdcb->low_water = config_writeq_low_water();
+    }
+    else
+    {
+        newdcb->high_water = 0;
+        newdcb->low_water = 0;
+    }
     newdcb->session = NULL;
     newdcb->server = NULL;
     newdcb->service = NULL;
     newdcb->nextpersistent = NULL;
     newdcb->persistentstart = 0;
-    newdcb->callbacks = NULL;
+    newdcb->n_callbacks = 0;
+    newdcb->cb_reasons = 0;
     newdcb->data = NULL;
+    newdcb->splice = NULL;
 
     newdcb->listener = listener;
     newdcb->ssl_state = SSL_HANDSHAKE_UNKNOWN;
@@ -251,92 +332,192 @@ dcb_alloc(dcb_role_t role, SERV_LISTENER *listener)
 }
 
 /**
- * Add a new DCB to the list of all DCBs.
+ * Add a DCB to the registry shard of the calling thread. Each thread adds
+ * to its own shard, so that threads accepting connections at the same time
+ * do not contend for the lock.
  *
- * Must be called with the general DCB lock held.
- *
- * A pointer, lastDCB, is held to find the end of the list, and the new DCB
- * is linked to the end of the list.  The pointer, wasfreeDCB, that is used to
- * search for a free DCB is initialised if not already set. There cannot be
- * any free DCBs until this routine has been called at least once, so
- * wasfreeDCB will not be referred to before it is initialised.
+ * @param dcb    The DCB to be added to the registry
+ */
+static void
+dcb_registry_add(DCB *dcb)
+{
+    if (registry_shard < 0)
+    {
+        registry_shard = atomic_add(&next_registry_shard, 1) % DCB_REGISTRY_SHARDS;
+    }
+
+    DCB_REGISTRY *shard = &dcb_registry[registry_shard];
+
+    dcb->registry = registry_shard;
+    dcb->prev = NULL;
+    spinlock_acquire(&shard->lock);
+    dcb->next = shard->head;
+    if (shard->head)
+    {
+        shard->head->prev = dcb;
+    }
+    shard->head = dcb;
+    spinlock_release(&shard->lock);
+}
+
+/**
+ * Remove a DCB from its registry shard
  *
- * @param dcb    The DCB to be added to the list
+ * @param dcb    The DCB to be removed from the registry
  */
 static void
-dcb_add_to_all_list(DCB *dcb)
+dcb_registry_remove(DCB *dcb)
 {
-    if (allDCBs == NULL)
+    DCB_REGISTRY *shard = &dcb_registry[dcb->registry];
+
+    spinlock_acquire(&shard->lock);
+    if (dcb->prev)
     {
-        allDCBs = dcb;
+        dcb->prev->next = dcb->next;
     }
     else
     {
-        lastDCB->next = dcb;
+        shard->head = dcb->next;
     }
-    lastDCB = dcb;
-    if (NULL == wasfreeDCB)
+    if (dcb->next)
     {
-        wasfreeDCB = dcb;
+        dcb->next->prev = dcb->prev;
     }
+    spinlock_release(&shard->lock);
+    dcb->next = NULL;
+    dcb->prev = NULL;
 }
 
 /**
- * Find a free DCB or allocate memory for a new one.
+ * Add a backend DCB to the DCBs connected to a server. The DCB stays in the
+ * list while it is in the persistent pool of the server.
  *
- * This routine looks to see whether there are free DCB memory areas.
- * If not, new memory is allocated, if possible, and the new DCB is added to
- * the list of all DCBs.
- *
- * Must be called with the general DCB lock held.
+ * @param dcb    The DCB
+ * @param server The server the DCB is connected to
+ */
+static void
+dcb_server_link(DCB *dcb, SERVER *server)
+{
+    dcb->server = server;
+    dcb->prevserver = NULL;
+    spinlock_acquire(&server->dcbs_lock);
+    dcb->nextserver = server->dcbs;
+    if (server->dcbs)
+    {
+        server->dcbs->prevserver = dcb;
+    }
+    server->dcbs = dcb;
+    spinlock_release(&server->dcbs_lock);
+}
+
+/**
+ * Remove a DCB from the DCBs connected to its server
  *
- * @return An available DCB or NULL if none could be allocated.
+ * @param dcb    The DCB, which may not have a server
  */
-static DCB *
-dcb_find_free()
+static void
+dcb_server_unlink(DCB *dcb)
 {
-    DCB *nextdcb;
-    int loopcount = 0;
+    SERVER *server = dcb->server;
 
-    if (freeDCBcount <= 0)
+    if (server == NULL)
     {
-        DCB *newdcb;
-        if ((newdcb = calloc(1, sizeof(DCB))) == NULL)
-        {
-            return NULL;
-        }
-        newdcb->next = NULL;
-        dcb_add_to_all_list(newdcb);
-        newdcb->dcb_is_in_use = true;
-        return newdcb;
+        return;
+    }
+
+    spinlock_acquire(&server->dcbs_lock);
+    if (dcb->prevserver)
+    {
+        dcb->prevserver->nextserver = dcb->nextserver;
     }
-    /* Starting at the last place a free DCB was found, loop through the */
-    /* list of DCBs searching for one that is not in use. */
-    while (wasfreeDCB->dcb_is_in_use)
+    else
+    {
+        server->dcbs = dcb->nextserver;
+    }
+    if (dcb->nextserver)
+    {
+        dcb->nextserver->prevserver = dcb->prevserver;
+    }
+    spinlock_release(&server->dcbs_lock);
+    dcb->nextserver = NULL;
+    dcb->prevserver = NULL;
+}
+
+/**
+ * Lock all the shards of the registry. Only the diagnostics and the other
+ * functions that need to see every DCB walk the registry.
+ */
+static void
+dcb_registry_lock()
+{
+    int i;
+
+    for (i = 0; i < DCB_REGISTRY_SHARDS; i++)
+    {
+        spinlock_acquire(&dcb_registry[i].lock);
+    }
+}
+
+/**
+ * Unlock all the shards of the registry
+ */
+static void
+dcb_registry_unlock()
+{
+    int i;
+
+    for (i = DCB_REGISTRY_SHARDS - 1; i >= 0; i--)
+    {
+        spinlock_release(&dcb_registry[i].lock);
+    }
+}
+
+/**
+ * Find the first DCB of the registry at or after a shard
+ *
+ * Must be called with the registry locked.
+ *
+ * @param shard  The shard to start from
+ * @return       The first DCB or NULL if the shards are empty
+ */
+static DCB *
+dcb_registry_shard_first(int shard)
+{
+    for (; shard < DCB_REGISTRY_SHARDS; shard++)
     {
-        wasfreeDCB = wasfreeDCB->next;
-        if (NULL == wasfreeDCB)
+        if (dcb_registry[shard].head)
         {
-            loopcount++;
-            if (loopcount > 1)
-            {
-                /* Shouldn't need to loop round more than once */
-                MXS_ERROR("Find free DCB failed to find a free DCB even"
-                          " though the free count was positive");
-                return NULL;
-            }
-            wasfreeDCB = allDCBs;
+            return dcb_registry[shard].head;
         }
     }
-    /* Dropping out of the loop means we have found a DCB that is not in use */
-    freeDCBcount--;
-    ss_dassert(freeDCBcount >= 0);
-    /* Clear the old data, then reset the list forward link */
-    nextdcb = wasfreeDCB->next;
-    memset(wasfreeDCB, 0, sizeof(DCB));
-    wasfreeDCB->next = nextdcb;
-    wasfreeDCB->dcb_is_in_use = true;
-    return wasfreeDCB;
+    return NULL;
+}
+
+/**
+ * Return the first DCB of the registry
+ *
+ * Must be called with the registry locked.
+ *
+ * @return The first DCB or NULL if there are no DCBs in use
+ */
+static DCB *
+dcb_registry_first()
+{
+    return dcb_registry_shard_first(0);
+}
+
+/**
+ * Return the DCB following a DCB in the registry
+ *
+ * Must be called with the registry locked.
+ *
+ * @param dcb    The current DCB
+ * @return       The next DCB or NULL if the DCB is the last one
+ */
+static DCB *
+dcb_registry_next(DCB *dcb)
+{
+    return dcb->next ? dcb->next : dcb_registry_shard_first(dcb->registry + 1);
 }
 
 
@@ -452,7 +633,6 @@ dcb_final_free(DCB *dcb)
 void
 dcb_free_all_memory(DCB *dcb)
 {
-    DCB_CALLBACK *cb_dcb;
     ss_dassert(dcb->dcb_is_in_use);
 
     if (dcb->protocol && (!DCB_IS_CLONE(dcb)))
@@ -476,6 +656,10 @@ dcb_free_all_memory(DCB *dcb)
     {
         free(dcb->user);
     }
+    if (dcb->splice)
+    {
+        dcb_splice_release(dcb);
+    }
 
     /* Clear write and read buffers */
     if (dcb->delayq)
@@ -494,274 +678,169 @@ dcb_free_all_memory(DCB *dcb)
         dcb->dcb_readqueue = NULL;
     }
 
-    spinlock_acquire(&dcb->cb_lock);
-    while ((cb_dcb = dcb->callbacks) != NULL)
-    {
-        dcb->callbacks = cb_dcb->next;
-        free(cb_dcb);
-    }
-    spinlock_release(&dcb->cb_lock);
+    dcb_clear_callbacks(dcb);
     if (dcb->ssl)
     {
         SSL_free(dcb->ssl);
     }
-    bitmask_free(&dcb->memdata.bitmask);
 
-    /* We never free the actual DCB, it is available for reuse*/
-    spinlock_acquire(&dcbspin);
+    dcb_server_unlink(dcb);
+    dcb_registry_remove(dcb);
     dcb->dcb_is_in_use = false;
-    freeDCBcount++;
-    nDCBs--;
-    spinlock_release(&dcbspin);
+    atomic_add(&nDCBs, -1);
+    memstats_add(MEMSTATS_DCBS, -(int64_t)sizeof(DCB), -1);
+    bufpool_free(dcb, sizeof(DCB));
 
 }
 
 /**
- * Process the DCB zombie queue
+ * Add a DCB to the zombies. The DCB is processed once every polling thread
+ * has passed the end of its polling loop, at which point no thread can be
+ * processing an event that accesses the DCB.
+ *
+ * @param dcb   The zombie DCB
+ */
+static void
+dcb_add_to_zombies(DCB *dcb)
+{
+    if (atomic_add(&nzombies, 1) + 1 > maxzombies)
+    {
+        maxzombies = nzombies;
+    }
+    epoch_retire(&dcb->memdata.entry, dcb_process_zombie, dcb);
+}
+
+/**
+ * Process a zombie DCB that is no longer referenced by the polling threads
  *
- * This routine is called by each of the polling threads with
- * the thread id of the polling thread. It must clear the bit in
- * the memdata bitmask for the polling thread that calls it. If the
- * operation of clearing this bit means that no bits are set in
- * the memdata.bitmask then the DCB is no longer able to be
- * referenced and it can be finally removed.
+ * This is called by a polling thread at the end of its polling loop. A DCB
+ * that is still in the poll set is removed from it and the protocol is closed,
+ * after which the DCB becomes a zombie again as events for it may already have
+ * been returned by epoll_wait. Otherwise the file descriptor is closed, the DCB
+ * marked as disconnected and the DCB itself is finally freed.
  *
- * @param       threadid        The thread ID of the caller
+ * @param data  The zombie DCB
  */
-DCB *
-dcb_process_zombies(int threadid)
+static void
+dcb_process_zombie(void *data)
 {
-    DCB *zombiedcb;
-    DCB *previousdcb = NULL, *nextdcb;
-    DCB *listofdcb = NULL;
+    DCB *dcb = (DCB *)data;
 
-    /**
-     * Perform a dirty read to see if there is anything in the queue.
-     * This avoids threads hitting the queue spinlock when the queue
-     * is empty. This will really help when the only entry is being
-     * freed, since the queue is updated before the expensive call to
-     * dcb_final_free.
+    CHK_DCB(dcb);
+    atomic_add(&nzombies, -1);
+
+    /*
+     * Skip processing of DCB's that are
+     * in the event queue waiting to be processed.
      */
-    if (!zombies)
+    if (dcb->evq.next || dcb->evq.prev)
     {
-        return NULL;
+        dcb_add_to_zombies(dcb);
+        return;
     }
 
-    /*
-     * Process the zombie queue and create a list of DCB's that can be
-     * finally freed. This processing is down under a spinlock that
-     * will prevent new entries being added to the zombie queue. Therefore
-     * we do not want to do any expensive operations under this spinlock
-     * as it will block other threads. The expensive operations will be
-     * performed on the victim queue within holding the zombie queue
-     * spinlock.
+    MXS_DEBUG("%lu [%s] Remove dcb "
+              "%p fd %d in state %s from the "
+              "list of zombies.",
+              pthread_self(),
+              __func__,
+              dcb,
+              dcb->fd,
+              STRDCBSTATE(dcb->state));
+    /*<
+     * Stop dcb's listening and modify state accordingly.
      */
-    spinlock_acquire(&zombiespin);
-    zombiedcb = zombies;
-    while (zombiedcb)
+    spinlock_acquire(&dcb->dcb_initlock);
+    if (dcb->state == DCB_STATE_POLLING  || dcb->state == DCB_STATE_LISTENING)
     {
-        CHK_DCB(zombiedcb);
-        nextdcb = zombiedcb->memdata.next;
-        /*
-         * Skip processing of DCB's that are
-         * in the event queue waiting to be processed.
-         */
-        if (zombiedcb->evq.next || zombiedcb->evq.prev)
+        if (dcb->state == DCB_STATE_LISTENING)
         {
-            previousdcb = zombiedcb;
+            MXS_ERROR("%lu [%s] Error : Removing DCB %p but was in state %s "
+                      "which is not expected for a call to dcb_close, although it"
+                      "should be processed correctly. ",
+                      pthread_self(),
+                      __func__,
+                      dcb,
+                      STRDCBSTATE(dcb->state));
         }
         else
         {
-
-            if (bitmask_clear_without_spinlock(&zombiedcb->memdata.bitmask, threadid))
+            /* Must be DCB_STATE_POLLING */
+            spinlock_release(&dcb->dcb_initlock);
+            if (0 == dcb->persistentstart && dcb_maybe_add_persistent(dcb))
             {
-                /**
-                 * Remove the DCB from the zombie queue
-                 * and call the final free routine for the
-                 * DCB
-                 *
-                 * zombiedcb is the DCB we are processing
-                 * previousdcb is the previous DCB on the zombie
-                 * queue or NULL if the DCB is at the head of the
-                 * queue.  Remove zombiedcb from the zombies list.
-                 */
-                if (NULL == previousdcb)
-                {
-                    zombies = zombiedcb->memdata.next;
-                }
-                else
-                {
-                    previousdcb->memdata.next = zombiedcb->memdata.next;
-                }
-
-                MXS_DEBUG("%lu [%s] Remove dcb "
-                          "%p fd %d in state %s from the "
-                          "list of zombies.",
-                          pthread_self(),
-                          __func__,
-                          zombiedcb,
-                          zombiedcb->fd,
-                          STRDCBSTATE(zombiedcb->state));
-                /*<
-                 * Move zombie dcb to linked list of victim dcbs.
-                 * The variable dcb is used to hold the last DCB
-                 * to have been added to the linked list, or NULL
-                 * if none has yet been added.  If the list
-                 * (listofdcb) is not NULL, then it follows that
-                 * dcb will also not be null.
-                 */
-                nzombies--;
-                zombiedcb->memdata.next = listofdcb;
-                listofdcb = zombiedcb;
+                /* Have taken DCB into persistent pool, no further killing */
+                return;
             }
-            else
+            dcb_stop_polling_and_shutdown(dcb);
+            dcb_add_to_zombies(dcb);
+            return;
+        }
+    }
+    /*
+     * Into the final close logic, so if DCB is for backend server, we
+     * must decrement the number of current connections.
+     */
+    if (DCB_ROLE_CLIENT_HANDLER == dcb->dcb_role)
+    {
+        if (dcb->service)
+        {
+            if (dcb->protocol)
             {
-                /* Since we didn't remove this dcb from the zombies
-                   list, we need to advance the previous pointer */
-                previousdcb = zombiedcb;
+                atomic_add(&dcb->service->client_count, -1);
+                dcb_wake_queued(dcb);
             }
         }
-        zombiedcb = nextdcb;
+        else
+        {
+            MXS_ERROR("Closing client handler DCB, but it has no related service");
+        }
     }
-    spinlock_release(&zombiespin);
-
-    if (listofdcb)
+    if (dcb->server && 0 == dcb->persistentstart)
     {
-        dcb_process_victim_queue(listofdcb);
+        atomic_add(&dcb->server->stats.n_current, -1);
     }
 
-    return zombies;
-}
-
-/**
- * Process the victim queue, selected from the list of zombies
- *
- * These are the DCBs that are not in use by any thread.  The corresponding
- * file descriptor is closed, the DCB marked as disconnected and the DCB
- * itself is finally freed.
- *
- * @param       listofdcb       The first victim DCB
- */
-static inline void
-dcb_process_victim_queue(DCB *listofdcb)
-{
-    DCB *dcb = listofdcb;
-
-    while (dcb != NULL)
+    if (dcb->fd > 0)
     {
-        DCB *nextdcb;
         /*<
-         * Stop dcb's listening and modify state accordingly.
-         */
-        spinlock_acquire(&dcb->dcb_initlock);
-        if (dcb->state == DCB_STATE_POLLING  || dcb->state == DCB_STATE_LISTENING)
-        {
-            if (dcb->state == DCB_STATE_LISTENING)
-            {
-                MXS_ERROR("%lu [%s] Error : Removing DCB %p but was in state %s "
-                          "which is not expected for a call to dcb_close, although it"
-                          "should be processed correctly. ",
-                          pthread_self(),
-                          __func__,
-                          dcb,
-                          STRDCBSTATE(dcb->state));
-            }
-            else
-            {
-                /* Must be DCB_STATE_POLLING */
-                spinlock_release(&dcb->dcb_initlock);
-                if (0 == dcb->persistentstart && dcb_maybe_add_persistent(dcb))
-                {
-                    /* Have taken DCB into persistent pool, no further killing */
-                    dcb = dcb->memdata.next;
-                    continue;
-                }
-                else
-                {
-                    DCB *next2dcb;
-                    dcb_stop_polling_and_shutdown(dcb);
-                    spinlock_acquire(&zombiespin);
-                    bitmask_copy(&dcb->memdata.bitmask, poll_bitmask());
-                    next2dcb = dcb->memdata.next;
-                    dcb->memdata.next = zombies;
-                    zombies = dcb;
-                    nzombies++;
-                    if (nzombies > maxzombies)
-                    {
-                        maxzombies = nzombies;
-                    }
-                    spinlock_release(&zombiespin);
-                    dcb = next2dcb;
-                    continue;
-                }
-            }
-        }
-        /*
-         * Into the final close logic, so if DCB is for backend server, we
-         * must decrement the number of current connections.
+         * Close file descriptor and move to clean-up phase.
          */
-        if (DCB_ROLE_CLIENT_HANDLER == dcb->dcb_role)
-        {
-            if (dcb->service)
-            {
-                if (dcb->protocol)
-                {
-                    atomic_add(&dcb->service->client_count, -1);
-                }
-            }
-            else
-            {
-                MXS_ERROR("Closing client handler DCB, but it has no related service");
-            }
-        }
-        if (dcb->server && 0 == dcb->persistentstart)
+        if (close(dcb->fd) < 0)
         {
-            atomic_add(&dcb->server->stats.n_current, -1);
+            int eno = errno;
+            errno = 0;
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("%lu [dcb_process_zombie] Error : Failed to close "
+                      "socket %d on dcb %p due error %d, %s.",
+                      pthread_self(),
+                      dcb->fd,
+                      dcb,
+                      eno,
+                      strerror_r(eno, errbuf, sizeof(errbuf)));
         }
-
-        if (dcb->fd > 0)
+        else
         {
-            /*<
-             * Close file descriptor and move to clean-up phase.
-             */
-            if (close(dcb->fd) < 0)
-            {
-                int eno = errno;
-                errno = 0;
-                char errbuf[STRERROR_BUFLEN];
-                MXS_ERROR("%lu [dcb_process_victim_queue] Error : Failed to close "
-                          "socket %d on dcb %p due error %d, %s.",
-                          pthread_self(),
-                          dcb->fd,
-                          dcb,
-                          eno,
-                          strerror_r(eno, errbuf, sizeof(errbuf)));
-            }
-            else
-            {
 #if defined(FAKE_CODE)
-                conn_open[dcb->fd] = false;
+            conn_open[dcb->fd] = false;
 #endif /* FAKE_CODE */
-                dcb->fd = DCBFD_CLOSED;
+            dcb->fd = DCBFD_CLOSED;
 
-                MXS_DEBUG("%lu [dcb_process_victim_queue] Closed socket "
-                          "%d on dcb %p.",
-                          pthread_self(),
-                          dcb->fd,
-                          dcb);
-            }
+            MXS_DEBUG("%lu [dcb_process_zombie] Closed socket "
+                      "%d on dcb %p.",
+                      pthread_self(),
+                      dcb->fd,
+                      dcb);
         }
+    }
 
-        dcb_get_ses_log_info(dcb,
-                             &mxs_log_tls.li_sesid,
-                             &mxs_log_tls.li_enabled_priorities);
+    dcb_get_ses_log_info(dcb,
+                         &mxs_log_tls.li_sesid,
+                         &mxs_log_tls.li_enabled_priorities);
 
-        dcb->state = DCB_STATE_DISCONNECTED;
-        nextdcb = dcb->memdata.next;
-        spinlock_release(&dcb->dcb_initlock);
-        dcb_final_free(dcb);
-        dcb = nextdcb;
-    }
+    dcb->state = DCB_STATE_DISCONNECTED;
+    spinlock_release(&dcb->dcb_initlock);
+    dcb_final_free(dcb);
     /** Reset threads session data */
     mxs_log_tls.li_sesid = 0;
 }
@@ -785,21 +864,268 @@ dcb_stop_polling_and_shutdown(DCB *dcb)
 }
 
 /**
- * Connect to a server
- *
- * This routine will create a server connection
- * If successful the new dcb will be put in
- * epoll set by dcb->func.connect
+ * Refill the tokens of the connect queue of a server and take one for a new
+ * connection if the connection may start now. The caller holds the lock of
+ * the connect queue.
  *
- * @param server        The server to connect to
- * @param session       The session this connection is being made for
- * @param protocol      The protocol module to use
- * @return              The new allocated dcb or NULL if the DCB was not connected
+ * @param server        The server
+ * @return              True if the connection may start
  */
-DCB *
-dcb_connect(SERVER *server, SESSION *session, const char *protocol)
+static bool
+dcb_connect_take(SERVER *server)
 {
-    DCB         *dcb;
+    SERVER_CONNECT_QUEUE *connq = &server->connq;
+    uint64_t now = latency_now();
+
+    if (server->connect_rate > 0)
+    {
+        connq->tokens += (double)(now - connq->refilled) * server->connect_rate / 1000000;
+        if (connq->tokens > server->connect_rate)
+        {
+            connq->tokens = server->connect_rate;
+        }
+    }
+    connq->refilled = now;
+
+    if ((server->connect_rate > 0 && connq->tokens < 1) ||
+        (server->max_handshakes > 0 && connq->n_handshakes >= server->max_handshakes))
+    {
+        return false;
+    }
+
+    if (server->connect_rate > 0)
+    {
+        connq->tokens -= 1;
+    }
+    connq->n_handshakes++;
+    return true;
+}
+
+/**
+ * Start the timer of the connect queue of a server. The caller holds the lock
+ * of the connect queue, which must not be empty.
+ *
+ * @param server        The server
+ */
+static void
+dcb_connect_arm(SERVER *server)
+{
+    DCB *next = ILIST_ENTRY(server->connq.queue.head, DCB, connnode);
+
+    if (!timer_pending(&server->connq.timer))
+    {
+        timer_add(poll_timer_wheel(next), &server->connq.timer, 1);
+    }
+}
+
+/**
+ * Queue a new backend connection until the connection rate limit of the
+ * server lets it start. The DCB is returned to the router as if it was
+ * connecting: it is in the polling state without a socket, like a clone, and
+ * the protocol keeps the writes until the connection has authenticated.
+ *
+ * @param dcb           The new DCB, linked to the session
+ * @param server        The server to connect to
+ * @param session       The session the connection is for
+ * @return              The DCB or NULL if the protocol failed to prepare it
+ */
+static DCB *
+dcb_connect_defer(DCB *dcb, SERVER *server, SESSION *session)
+{
+    if (dcb->func.defer(dcb, server, session) == 0)
+    {
+        dcb->state = DCB_STATE_DISCONNECTED;
+        dcb_final_free(dcb);
+        return NULL;
+    }
+
+    dcb_server_link(dcb, server);
+    dcb->dcb_server_status = server->status;
+    dcb->dcb_port = server->port;
+    dcb->flags |= DCBF_CONNECT_QUEUED;
+    dcb->state = DCB_STATE_POLLING;
+    poll_dcb_set_owner(dcb);
+
+    spinlock_acquire(&server->connq.lock);
+    ilist_push(&server->connq.queue, &dcb->connnode);
+    server->connq.n_queued++;
+    dcb_connect_arm(server);
+    spinlock_release(&server->connq.lock);
+
+    MXS_DEBUG("%lu [dcb_connect] Queued the connection to server %s:%d, "
+              "backend dcb %p.", pthread_self(), server->name, server->port, dcb);
+
+    atomic_add(&server->stats.n_connections, 1);
+    atomic_add(&server->stats.n_current, 1);
+
+    return dcb;
+}
+
+/**
+ * Connect a DCB taken from the connect queue of a server. The caller holds the
+ * lock of the connect queue, so the DCB cannot be closed while it connects. If
+ * the connect fails, a hangup is sent to the DCB so that the router handles the
+ * failure like that of any other backend connection.
+ *
+ * @param dcb           The queued DCB
+ * @param server        The server to connect to
+ */
+static void
+dcb_connect_start(DCB *dcb, SERVER *server)
+{
+    int fd = dcb->func.connect(dcb, server, dcb->session);
+
+    spinlock_acquire(&dcb->dcb_initlock);
+    dcb->flags |= DCBF_HANDSHAKE;
+    spinlock_release(&dcb->dcb_initlock);
+
+    if (fd != DCBFD_CLOSED)
+    {
+        dcb->fd = fd;
+        dcb->state = DCB_STATE_ALLOC;
+        MXS_PROBE3(backend__connect, dcb, server->unique_name, fd);
+
+        if (poll_add_dcb(dcb) == 0)
+        {
+            spinlock_acquire(&dcb->dcb_initlock);
+            dcb->flags &= ~DCBF_CONNECT_QUEUED;
+            spinlock_release(&dcb->dcb_initlock);
+            return;
+        }
+
+        dcb->state = DCB_STATE_POLLING;
+        close(fd);
+        dcb->fd = DCBFD_CLOSED;
+    }
+
+    MXS_ERROR("Failed to connect to server %s:%d for a queued connection.",
+              server->name, server->port);
+
+    /** The DCB keeps DCBF_CONNECT_QUEUED so that it is not pooled */
+    spinlock_acquire(&dcb->dcb_initlock);
+    dcb->flags &= ~DCBF_HANDSHAKE;
+    spinlock_release(&dcb->dcb_initlock);
+    server->connq.n_handshakes--;
+    poll_fake_hangup_event(dcb);
+}
+
+/**
+ * The timer function of the connect queue of a server. Starts the queued
+ * connections the limits allow, the oldest first, and runs again on the next
+ * heartbeat while connections are left in the queue.
+ *
+ * @param data          The server
+ */
+void
+dcb_connect_queued(void *data)
+{
+    SERVER *server = (SERVER *)data;
+    SERVER_CONNECT_QUEUE *connq = &server->connq;
+
+    spinlock_acquire(&connq->lock);
+    while (!ilist_empty(&connq->queue) && dcb_connect_take(server))
+    {
+        DCB *dcb = ILIST_ENTRY(ilist_pop(&connq->queue), DCB, connnode);
+        connq->n_queued--;
+        dcb_connect_start(dcb, server);
+    }
+
+    if (!ilist_empty(&connq->queue))
+    {
+        dcb_connect_arm(server);
+    }
+    spinlock_release(&connq->lock);
+}
+
+/**
+ * Remove a DCB from the connect queue of its server if it is still in it
+ *
+ * @param dcb           The DCB being closed
+ */
+static void
+dcb_connect_dequeue(DCB *dcb)
+{
+    SERVER_CONNECT_QUEUE *connq = &dcb->server->connq;
+    ILIST_NODE *prev = NULL;
+
+    spinlock_acquire(&connq->lock);
+    for (ILIST_NODE *node = connq->queue.head; node; prev = node, node = node->next)
+    {
+        if (node == &dcb->connnode)
+        {
+            if (prev)
+            {
+                prev->next = node->next;
+            }
+            else
+            {
+                connq->queue.head = node->next;
+            }
+            if (connq->queue.tail == node)
+            {
+                connq->queue.tail = prev;
+            }
+            connq->n_queued--;
+            break;
+        }
+    }
+    spinlock_release(&connq->lock);
+}
+
+/**
+ * Give back the handshake slot of a connection to a server
+ *
+ * @param server        The server
+ */
+static void
+dcb_connect_release(SERVER *server)
+{
+    spinlock_acquire(&server->connq.lock);
+    server->connq.n_handshakes--;
+    spinlock_release(&server->connq.lock);
+}
+
+/**
+ * Called by the protocol when the handshake of a backend connection has ended,
+ * successfully or not, and when the connection is closed. The next queued
+ * connection to the server may then start its handshake.
+ *
+ * @param dcb           The backend DCB
+ */
+void
+dcb_handshake_done(DCB *dcb)
+{
+    bool counted;
+
+    spinlock_acquire(&dcb->dcb_initlock);
+    if ((counted = (dcb->flags & DCBF_HANDSHAKE) != 0))
+    {
+        dcb->flags &= ~DCBF_HANDSHAKE;
+    }
+    spinlock_release(&dcb->dcb_initlock);
+
+    if (counted)
+    {
+        dcb_connect_release(dcb->server);
+    }
+}
+
+/**
+ * Connect to a server
+ *
+ * This routine will create a server connection
+ * If successful the new dcb will be put in
+ * epoll set by dcb->func.connect
+ *
+ * @param server        The server to connect to
+ * @param session       The session this connection is being made for
+ * @param protocol      The protocol module to use
+ * @return              The new allocated dcb or NULL if the DCB was not connected
+ */
+DCB *
+dcb_connect(SERVER *server, SESSION *session, const char *protocol)
+{
+    DCB         *dcb;
     GWPROTOCOL  *funcs;
     int         fd;
     int         rc;
@@ -810,7 +1136,7 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
     {
         MXS_DEBUG("%lu [dcb_connect] Looking for persistent connection DCB "
                   "user %s protocol %s\n", pthread_self(), user, protocol);
-        dcb = server_get_persistent(server, user, protocol);
+        dcb = server_get_persistent(server, user, protocol, session->client_dcb);
         if (dcb)
         {
             /**
@@ -827,6 +1153,14 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
             MXS_DEBUG("%lu [dcb_connect] Reusing a persistent connection, dcb %p\n",
                       pthread_self(), dcb);
             dcb->persistentstart = 0;
+
+            if (dcb->func.reuse && dcb->func.reuse(dcb) == 0)
+            {
+                MXS_DEBUG("%lu [dcb_connect] Failed to reset the persistent "
+                          "connection, dcb %p\n", pthread_self(), dcb);
+                dcb_close(dcb);
+                return NULL;
+            }
             return dcb;
         }
         else
@@ -865,6 +1199,23 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
         dcb_final_free(dcb);
         return NULL;
     }
+
+    if (SERVER_CONNECT_LIMITED(server) && dcb->func.defer)
+    {
+        bool start;
+
+        /** The connections start in the order they were made */
+        spinlock_acquire(&server->connq.lock);
+        start = ilist_empty(&server->connq.queue) && dcb_connect_take(server);
+        spinlock_release(&server->connq.lock);
+
+        if (!start)
+        {
+            return dcb_connect_defer(dcb, server, session);
+        }
+        dcb->flags |= DCBF_HANDSHAKE;
+    }
+
     fd = dcb->func.connect(dcb, server, session);
 
     if (fd == DCBFD_CLOSED)
@@ -877,6 +1228,10 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
                   dcb,
                   session->client_dcb,
                   session->client_dcb->fd);
+        if (dcb->flags & DCBF_HANDSHAKE)
+        {
+            dcb_connect_release(server);
+        }
         dcb->state = DCB_STATE_DISCONNECTED;
         dcb_final_free(dcb);
         return NULL;
@@ -896,11 +1251,12 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
      * Successfully connected to backend. Assign file descriptor to dcb
      */
     dcb->fd = fd;
+    MXS_PROBE3(backend__connect, dcb, server->unique_name, fd);
 
     /**
-     * Add server pointer to dcb
+     * Add server pointer to dcb and the dcb to the DCBs of the server
      */
-    dcb->server = server;
+    dcb_server_link(dcb, server);
 
     /** Copy status field to DCB */
     dcb->dcb_server_status = server->status;
@@ -920,6 +1276,7 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
 
     if (rc)
     {
+        dcb_handshake_done(dcb);
         dcb->state = DCB_STATE_DISCONNECTED;
         dcb_final_free(dcb);
         return NULL;
@@ -940,6 +1297,10 @@ dcb_connect(SERVER *server, SESSION *session, const char *protocol)
  * parameter indicates the maximum number of bytes to be read (needed
  * for SSL processing) with 0 meaning no limit.
  *
+ * The socket is read until a read returns less than the size of its buffer or
+ * DCB_READ_BUDGET bytes have been read, without asking for the number of bytes
+ * available first.
+ *
  * @param dcb       The DCB to read from
  * @param head      Pointer to linked list to append data to
  * @param maxbytes  Maximum bytes to read (0 = no limit)
@@ -951,6 +1312,7 @@ int dcb_read(DCB   *dcb,
 {
     int     nsingleread = 0;
     int     nreadtotal = 0;
+    int     nread = 0;      /*< Bytes read from the socket by this call */
 
     if (dcb->dcb_readqueue)
     {
@@ -980,40 +1342,56 @@ int dcb_read(DCB   *dcb,
 
     while (0 == maxbytes || nreadtotal < maxbytes)
     {
-        int bytes_available;
+        GWBUF *buffer;
+        int bufsize = dcb_read_size(dcb);
 
-        bytes_available = dcb_bytes_readable(dcb);
-        if (bytes_available <= 0)
+        if (maxbytes)
         {
-            return bytes_available < 0 ? -1 :
-                   /** Handle closed client socket */
-                   dcb_read_no_bytes_available(dcb, nreadtotal);
+            bufsize = MIN(bufsize, maxbytes - nreadtotal);
         }
-        else
+
+        if ((buffer = dcb_basic_read(dcb, bufsize, &nsingleread)) == NULL)
         {
-            GWBUF *buffer;
-            dcb->last_read = hkheartbeat;
+            /** Handle closed client socket */
+            return dcb_read_no_bytes_available(dcb, nreadtotal);
+        }
 
-            buffer = dcb_basic_read(dcb, bytes_available, maxbytes, nreadtotal, &nsingleread);
-            if (buffer)
-            {
-                nreadtotal += nsingleread;
-                /* <editor-fold defaultstate="collapsed" desc=" Debug Logging "> */
-                MXS_DEBUG("%lu [dcb_read] Read %d bytes from dcb %p in state %s "
-                          "fd %d.",
-                          pthread_self(),
-                          nsingleread,
-                          dcb,
-                          STRDCBSTATE(dcb->state),
-                          dcb->fd);
-                /* </editor-fold> */
-                /*< Append read data to the gwbuf */
-                *head = gwbuf_append(*head, buffer);
-            }
-            else
-            {
-                break;
-            }
+        dcb->last_read = hkheartbeat;
+        nreadtotal += nsingleread;
+        nread += nsingleread;
+        poll_thread_io(nsingleread, 0);
+        MXS_PROBE3(dcb__read, dcb, dcb->fd, nsingleread);
+        /* <editor-fold defaultstate="collapsed" desc=" Debug Logging "> */
+        MXS_DEBUG("%lu [dcb_read] Read %d bytes from dcb %p in state %s "
+                  "fd %d.",
+                  pthread_self(),
+                  nsingleread,
+                  dcb,
+                  STRDCBSTATE(dcb->state),
+                  dcb->fd);
+        /* </editor-fold> */
+        /*< Append read data to the gwbuf */
+        *head = gwbuf_append(*head, buffer);
+
+        /**
+         * A short read empties the socket. Data that arrives after it
+         * generates a new edge triggered event, so reading again here would
+         * only return EAGAIN.
+         */
+        if (nsingleread < bufsize)
+        {
+            break;
+        }
+
+        /**
+         * The socket may still have data but the DCB has had its share of
+         * this event. The rest is read when the fake event is processed,
+         * after the other DCBs in the queue.
+         */
+        if (nread >= DCB_READ_BUDGET && (0 == maxbytes || nreadtotal < maxbytes))
+        {
+            poll_fake_read_event(dcb);
+            break;
         }
     } /*< while (0 == maxbytes || nreadtotal < maxbytes) */
 
@@ -1021,35 +1399,20 @@ int dcb_read(DCB   *dcb,
 }
 
 /**
- * Find the number of bytes available for the DCB's socket
+ * Find the size of the next read of a DCB. The buffer is twice the moving
+ * average of the recent reads, so that a DCB whose reads fill their buffers
+ * moves to larger buffers, and one that receives small packets does not
+ * waste memory on large ones.
  *
  * @param dcb       The DCB to read from
- * @return          -1 on error, otherwise the total number of bytes available
+ * @return          The size of the read buffer
  */
 static int
-dcb_bytes_readable(DCB *dcb)
+dcb_read_size(DCB *dcb)
 {
-    int bytesavailable;
+    int size = dcb->read_size * 2;
 
-    if (-1 == ioctl(dcb->fd, FIONREAD, &bytesavailable))
-    {
-        char errbuf[STRERROR_BUFLEN];
-        /* <editor-fold defaultstate="collapsed" desc=" Error Logging "> */
-        MXS_ERROR("%lu [dcb_read] Error : ioctl FIONREAD for dcb %p in "
-                  "state %s fd %d failed due error %d, %s.",
-                  pthread_self(),
-                  dcb,
-                  STRDCBSTATE(dcb->state),
-                  dcb->fd,
-                  errno,
-                  strerror_r(errno, errbuf, sizeof(errbuf)));
-        /* </editor-fold> */
-        return -1;
-    }
-    else
-    {
-        return bytesavailable;
-    }
+    return size < DCB_READ_MIN_SIZE ? DCB_READ_MIN_SIZE : MIN(size, MAX_BUFFER_SIZE);
 }
 
 /**
@@ -1086,25 +1449,19 @@ dcb_read_no_bytes_available(DCB *dcb, int nreadtotal)
 
 /**
  * Basic read function to carry out a single read operation on the DCB socket.
+ * The buffer is trimmed to the number of bytes read and the moving average of
+ * the read sizes of the DCB is updated.
  *
  * @param dcb               The DCB to read from
- * @param bytesavailable    Pointer to linked list to append data to
- * @param maxbytes          Maximum bytes to read (0 = no limit)
- * @param nreadtotal        Total number of bytes already read
+ * @param bufsize           The size of the read buffer
  * @param nsingleread       To be set as the number of bytes read this time
  * @return                  GWBUF* buffer containing new data, or null.
  */
 static GWBUF *
-dcb_basic_read(DCB *dcb, int bytesavailable, int maxbytes, int nreadtotal, int *nsingleread)
+dcb_basic_read(DCB *dcb, int bufsize, int *nsingleread)
 {
     GWBUF *buffer;
 
-    int bufsize = MIN(bytesavailable, MAX_BUFFER_SIZE);
-    if (maxbytes)
-    {
-        bufsize = MIN(bufsize, maxbytes - nreadtotal);
-    }
-
     if ((buffer = gwbuf_alloc(bufsize)) == NULL)
     {
         /*<
@@ -1125,10 +1482,20 @@ dcb_basic_read(DCB *dcb, int bytesavailable, int maxbytes, int nreadtotal, int *
     }
     else
     {
+        errno = 0;
         *nsingleread = read(dcb->fd, GWBUF_DATA(buffer), bufsize);
         dcb->stats.n_reads++;
 
-        if (*nsingleread <= 0)
+        if (*nsingleread > 0)
+        {
+            if (*nsingleread < bufsize)
+            {
+                buffer = gwbuf_rtrim(buffer, bufsize - *nsingleread);
+            }
+            dcb->read_size = dcb->read_size ?
+                (3 * dcb->read_size + *nsingleread) / 4 : *nsingleread;
+        }
+        else
         {
             if (errno != 0 && errno != EAGAIN && errno != EWOULDBLOCK)
             {
@@ -1202,6 +1569,8 @@ dcb_read_SSL(DCB *dcb, GWBUF **head)
         }
     }
 
+    poll_thread_io(nreadtotal, 0);
+    MXS_PROBE3(dcb__read, dcb, dcb->fd, nreadtotal);
     ss_dassert(gwbuf_length(*head) == (start_length + nreadtotal));
 
     return nsingleread < 0 ? nsingleread : nreadtotal;
@@ -1393,8 +1762,24 @@ dcb_write(DCB *dcb, GWBUF *queue)
      * If it did not already have data, we call the drain write queue
      * function immediately to attempt to write the data.
      */
-    atomic_add(&dcb->writeqlen, gwbuf_length(queue));
+    dcb_writeq_add(dcb, gwbuf_length(queue));
     dcb->writeq = gwbuf_append(dcb->writeq, queue);
+    /*
+     * During an event dispatch the first write to an empty queue only puts
+     * the DCB on the deferred flush list of the thread. The writes made by
+     * the rest of the dispatch are appended to the queue and the whole
+     * queue is written with one writev by dcb_flush_writes.
+     */
+    if (empty_queue && defer_writes)
+    {
+        if (!dcb->flush_pending)
+        {
+            dcb->flush_pending = true;
+            dcb->nextflush = deferred_flush;
+            deferred_flush = dcb;
+        }
+        empty_queue = false;
+    }
     spinlock_release(&dcb->writeqlock);
     dcb->stats.n_buffered++;
     MXS_DEBUG("%lu [dcb_write] Append to writequeue. %d writes "
@@ -1413,39 +1798,202 @@ dcb_write(DCB *dcb, GWBUF *queue)
     return 1;
 }
 
-#if defined(FAKE_CODE)
 /**
- * Fake code for dcb_write
- * (Should have fuller description)
- *
- * @param dcb   The DCB of the client
+ * Start deferring the writes of the calling thread. The writes to DCBs with
+ * empty write queues are not written until dcb_flush_writes is called, so
+ * that the replies made while one event is dispatched leave in one write.
  */
-static inline void
-dcb_write_fake_code(DCB *dcb)
+void
+dcb_defer_writes()
 {
-    if (dcb->session != NULL)
+    defer_writes = true;
+}
+
+/**
+ * Stop deferring the writes of the calling thread and write the queues of
+ * the DCBs written to since dcb_defer_writes was called.
+ */
+void
+dcb_flush_writes()
+{
+    defer_writes = false;
+
+    while (deferred_flush)
     {
-        if (dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER && fail_next_client_fd)
-        {
-            dcb_fake_write_errno[dcb->fd] = 32;
-            dcb_fake_write_ev[dcb->fd] = 29;
-            fail_next_client_fd = false;
-        }
-        else if (dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER && fail_next_backend_fd)
+        DCB *dcb = deferred_flush;
+
+        spinlock_acquire(&dcb->writeqlock);
+        deferred_flush = dcb->nextflush;
+        dcb->nextflush = NULL;
+        dcb->flush_pending = false;
+        spinlock_release(&dcb->writeqlock);
+
+        if (dcb->fd > 0)
         {
-            dcb_fake_write_errno[dcb->fd] = 32;
-            dcb_fake_write_ev[dcb->fd] = 29;
-            fail_next_backend_fd = false;
+            dcb_drain_writeq(dcb);
         }
     }
 }
-#endif /* FAKE_CODE */
 
 /**
- * Check the parameters for dcb_write
+ * Write a header followed by a range of a file to a DCB. The range is sent
+ * with sendfile(2) and is never copied to user space. Only a DCB that does
+ * not use SSL, or whose TLS records the kernel encrypts, and has nothing in
+ * its write queue can be written to this way.
+ * What the socket does not accept at once is read into the write queue and
+ * written when the socket is writable again.
  *
- * @param dcb   The DCB of the client
- * @param queue Queue of buffers to write
+ * @param dcb       The DCB to write to
+ * @param head      The header, freed by the call if the DCB was written to
+ * @param fd        The file to send
+ * @param offset    Offset of the range in the file
+ * @param len       Length of the range
+ * @return 1 if the data was written or queued, 0 if the DCB cannot be written
+ *         to with sendfile and the data must be written with dcb_write and
+ *         -1 if the file could not be read
+ */
+int
+dcb_write_file(DCB *dcb, GWBUF *head, int fd, off_t offset, size_t len)
+{
+    bool below_water = (dcb->high_water && dcb->writeqlen < dcb->high_water);
+    bool blocked = false;
+    bool idle;
+    int rval = 1;
+
+    if ((dcb->ssl && !dcb->ssl_ktls_send) || dcb->fd <= 0 || dcb->state != DCB_STATE_POLLING)
+    {
+        return 0;
+    }
+
+    /** The draining flag keeps dcb_drain_writeq from writing in between */
+    spinlock_acquire(&dcb->writeqlock);
+    if ((idle = (dcb->writeq == NULL && !dcb->draining_flag)))
+    {
+        dcb->draining_flag = true;
+    }
+    spinlock_release(&dcb->writeqlock);
+
+    if (!idle)
+    {
+        return 0;
+    }
+
+    errno = 0;
+
+    /** MSG_MORE lets the header leave in the same segment as the file data */
+    while (head && !blocked)
+    {
+        ssize_t n = send(dcb->fd, GWBUF_DATA(head), GWBUF_LENGTH(head), MSG_MORE | MSG_NOSIGNAL);
+
+        if (n > 0)
+        {
+            head = gwbuf_consume(head, n);
+        }
+        else
+        {
+            blocked = true;
+        }
+    }
+
+    while (!blocked && len > 0)
+    {
+        ssize_t n = sendfile(dcb->fd, fd, &offset, len);
+
+        if (n > 0)
+        {
+            len -= n;
+            poll_thread_io(0, n);
+        }
+        else
+        {
+            blocked = true;
+        }
+    }
+
+    if (blocked && errno != 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EPIPE)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Write to dcb %p in state %s fd %d failed due errno %d, %s",
+                  dcb, STRDCBSTATE(dcb->state), dcb->fd, errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+
+    if (len > 0)
+    {
+        GWBUF *rest = gwbuf_alloc(len);
+
+        if (rest && pread(fd, GWBUF_DATA(rest), len, offset) == (ssize_t)len)
+        {
+            head = gwbuf_append(head, rest);
+        }
+        else
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to read %lu bytes at %lu of file %d for dcb %p: %s",
+                      len, (unsigned long)offset, fd, dcb,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+            gwbuf_free(rest);
+            rval = -1;
+        }
+    }
+
+    spinlock_acquire(&dcb->writeqlock);
+    if (head)
+    {
+        dcb_writeq_add(dcb, gwbuf_length(head));
+        dcb->writeq = gwbuf_append(head, dcb->writeq);
+        dcb->stats.n_buffered++;
+    }
+    /** Data written to the DCB in the meantime is written now if the socket is not full */
+    bool drain = dcb->writeq && !blocked;
+    dcb->draining_flag = false;
+    dcb->drain_called_while_busy = false;
+    spinlock_release(&dcb->writeqlock);
+
+    dcb->stats.n_writes++;
+
+    if (drain)
+    {
+        dcb_drain_writeq(dcb);
+    }
+    dcb_write_tidy_up(dcb, below_water);
+
+    return rval;
+}
+
+#if defined(FAKE_CODE)
+/**
+ * Fake code for dcb_write
+ * (Should have fuller description)
+ *
+ * @param dcb   The DCB of the client
+ */
+static inline void
+dcb_write_fake_code(DCB *dcb)
+{
+    if (dcb->session != NULL)
+    {
+        if (dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER && fail_next_client_fd)
+        {
+            dcb_fake_write_errno[dcb->fd] = 32;
+            dcb_fake_write_ev[dcb->fd] = 29;
+            fail_next_client_fd = false;
+        }
+        else if (dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER && fail_next_backend_fd)
+        {
+            dcb_fake_write_errno[dcb->fd] = 32;
+            dcb_fake_write_ev[dcb->fd] = 29;
+            fail_next_backend_fd = false;
+        }
+    }
+}
+#endif /* FAKE_CODE */
+
+/**
+ * Check the parameters for dcb_write
+ *
+ * @param dcb   The DCB of the client
+ * @param queue Queue of buffers to write
  * @return true if parameters acceptable, false otherwise
  */
 static inline bool
@@ -1582,6 +2130,199 @@ dcb_write_tidy_up(DCB *dcb, bool below_water)
         atomic_add(&dcb->stats.n_high_water, 1);
         dcb_call_callback(dcb, DCB_REASON_HIGH_WATER);
     }
+    if (!dcb->flow_stopped && dcb->writeqlen > 0 &&
+        ((dcb->high_water && dcb->writeqlen > dcb->high_water) ||
+         (dcb->session && session_over_memory_limit(dcb->session))))
+    {
+        dcb_flow_stop(dcb);
+    }
+}
+
+/**
+ * Return the session whose flow a DCB takes part in. Only the client and
+ * backend DCBs of real sessions are flow controlled.
+ *
+ * @param dcb   The DCB
+ * @return      The session or NULL if the DCB is not flow controlled
+ */
+static inline SESSION *
+dcb_flow_session(DCB *dcb)
+{
+    SESSION *session = dcb->session;
+
+    if (session && session->state != SESSION_STATE_DUMMY && session->client_dcb &&
+        (dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER || dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER))
+    {
+        return session;
+    }
+    return NULL;
+}
+
+/**
+ * Add to the length of the write queue of a DCB and to the bytes its session
+ * buffers
+ *
+ * @param dcb   The DCB
+ * @param bytes The bytes queued, negative for the bytes written
+ */
+static inline void
+dcb_writeq_add(DCB *dcb, int bytes)
+{
+    SESSION *session = dcb_flow_session(dcb);
+
+    atomic_add(&dcb->writeqlen, bytes);
+    if (session && !dcb->dcb_is_zombie)
+    {
+        session_buffered_add(session, bytes, true);
+    }
+}
+
+/**
+ * Stop the reads that fill the write queue of a DCB. The write queue of a client
+ * DCB is filled by the backends of the session, the write queues of the backend
+ * DCBs by the client. The reads are stopped when they are next attempted.
+ *
+ * @param dcb   The DCB whose write queue crossed the high water mark
+ */
+static void
+dcb_flow_stop(DCB *dcb)
+{
+    SESSION *session = dcb_flow_session(dcb);
+
+    if (session && __sync_bool_compare_and_swap(&dcb->flow_stopped, false, true) &&
+        dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER)
+    {
+        atomic_add(&session->n_flow_stopped, 1);
+    }
+}
+
+/**
+ * Resume the reads of the DCBs that wait for the session to drain. The DCBs
+ * get a fake read event and stall again if their peers are still full.
+ *
+ * @param session   The session
+ */
+static void
+dcb_flow_wake(SESSION *session)
+{
+    DCB *stalled;
+
+    spinlock_acquire(&session->ses_lock);
+    stalled = session->stalled;
+    session->stalled = NULL;
+    for (DCB *ptr = stalled; ptr; ptr = ptr->nextstalled)
+    {
+        ptr->stalled = false;
+    }
+    spinlock_release(&session->ses_lock);
+
+    while (stalled)
+    {
+        DCB *next = stalled->nextstalled;
+        stalled->nextstalled = NULL;
+        poll_fake_read_event(stalled);
+        stalled = next;
+    }
+}
+
+/**
+ * Resume the reads stopped by a DCB once its write queue is below the low
+ * water mark
+ *
+ * @param dcb   The DCB whose write queue has drained
+ */
+static void
+dcb_flow_resume(DCB *dcb)
+{
+    SESSION *session = dcb_flow_session(dcb);
+
+    if (__sync_bool_compare_and_swap(&dcb->flow_stopped, true, false) && session)
+    {
+        if (dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER)
+        {
+            atomic_add(&session->n_flow_stopped, -1);
+        }
+        dcb_flow_wake(session);
+    }
+}
+
+/**
+ * Remove a closing DCB from the flow control of its session
+ *
+ * @param dcb   The DCB being closed
+ */
+static void
+dcb_flow_close(DCB *dcb)
+{
+    SESSION *session = dcb_flow_session(dcb);
+
+    if (session == NULL)
+    {
+        return;
+    }
+    if (dcb->stalled)
+    {
+        spinlock_acquire(&session->ses_lock);
+        for (DCB **ptr = &session->stalled; *ptr; ptr = &(*ptr)->nextstalled)
+        {
+            if (*ptr == dcb)
+            {
+                *ptr = dcb->nextstalled;
+                break;
+            }
+        }
+        dcb->stalled = false;
+        dcb->nextstalled = NULL;
+        spinlock_release(&session->ses_lock);
+    }
+    /** The reads stopped by a closing DCB would otherwise never resume */
+    dcb_flow_resume(dcb);
+}
+
+/**
+ * Check whether the write queue the data read from a DCB goes to is full
+ *
+ * @param dcb       The DCB
+ * @param session   The session of the DCB
+ * @return          True if the data has to wait
+ */
+static inline bool
+dcb_flow_blocked(DCB *dcb, SESSION *session)
+{
+    return dcb->dcb_role == DCB_ROLE_BACKEND_HANDLER ?
+           session->client_dcb->flow_stopped : session->n_flow_stopped > 0;
+}
+
+/**
+ * Check whether a DCB must not be read because the write queue its data goes
+ * to is above the high water mark. A backend DCB waits while the client DCB of
+ * the session is full, a client DCB while any of the backend DCBs is full. The
+ * DCB is then put on the list of the session and its reads are resumed by a
+ * fake read event once the full write queue is below the low water mark.
+ *
+ * @param dcb   The DCB about to be read
+ * @return      True if the DCB must not be read now
+ */
+bool
+dcb_read_stalled(DCB *dcb)
+{
+    SESSION *session = dcb_flow_session(dcb);
+    bool rval = false;
+
+    if (session && dcb_flow_blocked(dcb, session))
+    {
+        spinlock_acquire(&session->ses_lock);
+        /** Checked again as the flow may have resumed before the lock */
+        if ((rval = dcb_flow_blocked(dcb, session)) && !dcb->stalled)
+        {
+            dcb->stalled = true;
+            dcb->nextstalled = session->stalled;
+            session->stalled = dcb;
+            dcb->stats.n_stalls++;
+        }
+        spinlock_release(&session->ses_lock);
+    }
+    return rval;
 }
 
 /**
@@ -1621,6 +2362,10 @@ dcb_drain_writeq(DCB *dcb)
     if (NULL == local_writeq)
     {
         dcb_call_callback(dcb, DCB_REASON_DRAINED);
+        if (dcb->splice)
+        {
+            dcb_splice_drained(dcb);
+        }
         return 0;
     }
     above_water = (dcb->low_water && gwbuf_length(local_writeq) > dcb->low_water);
@@ -1634,7 +2379,7 @@ dcb_drain_writeq(DCB *dcb)
             bool stop_writing = false;
             int written;
             /* The value put into written will be >= 0 */
-            if (dcb->ssl)
+            if (dcb->ssl && !dcb->ssl_ktls_send)
             {
                 written = gw_write_SSL(dcb, local_writeq, &stop_writing);
             }
@@ -1683,6 +2428,10 @@ dcb_drain_writeq(DCB *dcb)
     while ((local_writeq = dcb_grab_writeq(dcb, false)) != NULL);
     /* The write queue has drained, potentially need to call a callback function */
     dcb_call_callback(dcb, DCB_REASON_DRAINED);
+    if (dcb->splice)
+    {
+        dcb_splice_drained(dcb);
+    }
 
 wrap_up:
 
@@ -1692,7 +2441,9 @@ wrap_up:
      */
     if (total_written)
     {
-        atomic_add(&dcb->writeqlen, -total_written);
+        dcb_writeq_add(dcb, -total_written);
+        poll_thread_io(0, total_written);
+        MXS_PROBE3(dcb__write, dcb, dcb->fd, total_written);
 
         /* Check if the draining has taken us from above water to below water */
         if (above_water && dcb->writeqlen < dcb->low_water)
@@ -1701,6 +2452,10 @@ wrap_up:
             dcb_call_callback(dcb, DCB_REASON_LOW_WATER);
         }
 
+        if (dcb->flow_stopped && dcb->writeqlen <= dcb->low_water)
+        {
+            dcb_flow_resume(dcb);
+        }
     }
     return total_written;
 }
@@ -1743,8 +2498,273 @@ dcb_grab_writeq(DCB *dcb, bool first_time)
         dcb->draining_flag = local_writeq ? true : false;
         dcb->writeq = NULL;
     }
-    spinlock_release(&dcb->writeqlock);
-    return local_writeq;
+    spinlock_release(&dcb->writeqlock);
+    return local_writeq;
+}
+
+/**
+ * Join two DCBs so that the data read from either of them is written to the
+ * other one with splice(2). The DCBs must not use SSL and the write queues are
+ * still drained before any spliced data is written. Each DCB starts splicing
+ * at its next read event, from then on its read events are not passed to the
+ * protocol module.
+ *
+ * @param a     The first DCB
+ * @param b     The second DCB
+ * @return      1 if the DCBs were joined, 0 otherwise
+ */
+int
+dcb_splice(DCB *a, DCB *b)
+{
+    DCB_SPLICE *sp;
+    int i;
+
+    if (a->ssl || b->ssl || a->splice || b->splice)
+    {
+        return 0;
+    }
+    if ((sp = (DCB_SPLICE *)calloc(1, sizeof(DCB_SPLICE))) == NULL)
+    {
+        return 0;
+    }
+    if (pipe2(sp->pipe[0], O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        free(sp);
+        return 0;
+    }
+    if (pipe2(sp->pipe[1], O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        close(sp->pipe[0][0]);
+        close(sp->pipe[0][1]);
+        free(sp);
+        return 0;
+    }
+    for (i = 0; i < 2; i++)
+    {
+        /** A larger pipe means fewer calls, the default size is used on failure */
+        fcntl(sp->pipe[i][1], F_SETPIPE_SZ, DCB_SPLICE_PIPE_SIZE);
+    }
+    spinlock_init(&sp->lock);
+    sp->dcb[0] = a;
+    sp->dcb[1] = b;
+    sp->refcount = 2;
+
+    /** A closing DCB is detached with the zombie lock held */
+    spinlock_acquire(&zombiespin);
+    if (a->dcb_is_zombie || b->dcb_is_zombie)
+    {
+        spinlock_release(&zombiespin);
+        for (i = 0; i < 2; i++)
+        {
+            close(sp->pipe[i][0]);
+            close(sp->pipe[i][1]);
+        }
+        free(sp);
+        return 0;
+    }
+    a->splice = sp;
+    b->splice = sp;
+    spinlock_release(&zombiespin);
+    return 1;
+}
+
+/**
+ * Move data from one spliced DCB to the other. The pipe is first emptied to
+ * the destination, and only then more data is read from the source. This stops
+ * when the source has no more data, in which case the next read event
+ * continues, or when the destination blocks, in which case the next drain of
+ * the write queue of the destination continues.
+ *
+ * Must be called with the splice lock held.
+ *
+ * @param sp    The spliced DCBs
+ * @param i     The index of the source DCB
+ */
+static void
+dcb_splice_pump(DCB_SPLICE *sp, int i)
+{
+    DCB *src = sp->dcb[i];
+    DCB *dst = sp->dcb[1 - i];
+    ssize_t n;
+
+    /** Once either DCB is closed the session is closing as well */
+    if (src == NULL || dst == NULL || !sp->active[i])
+    {
+        return;
+    }
+
+    while (true)
+    {
+        /**
+         * The write queue lock is held until the data is written, so that data
+         * queued with dcb_write after the check is written after this data.
+         */
+        spinlock_acquire(&dst->writeqlock);
+        if (dst->writeq == NULL && !dst->draining_flag)
+        {
+            while (sp->pending[i] > 0 &&
+                   (n = splice(sp->pipe[i][0], NULL, dst->fd, NULL, sp->pending[i],
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0)
+            {
+                sp->pending[i] -= n;
+                dst->stats.n_writes++;
+                poll_thread_io(0, n);
+            }
+            if (sp->pending[i] > 0 && errno != EAGAIN)
+            {
+                spinlock_release(&dst->writeqlock);
+                poll_fake_hangup_event(dst);
+                return;
+            }
+        }
+        spinlock_release(&dst->writeqlock);
+
+        if (sp->pending[i] > 0)
+        {
+            return;
+        }
+
+        n = splice(src->fd, NULL, sp->pipe[i][1], NULL, DCB_SPLICE_PIPE_SIZE,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            sp->pending[i] += n;
+            src->stats.n_reads++;
+            poll_thread_io(n, 0);
+            src->last_read = hkheartbeat;
+        }
+        else
+        {
+            if (n == 0 || errno != EAGAIN)
+            {
+                poll_fake_hangup_event(src);
+            }
+            return;
+        }
+    }
+}
+
+/**
+ * Find the index of a DCB in the spliced DCBs
+ *
+ * @param sp    The spliced DCBs
+ * @param dcb   The DCB
+ * @return      The index or -1 if the DCB has been detached
+ */
+static int
+dcb_splice_index(DCB_SPLICE *sp, DCB *dcb)
+{
+    return sp->dcb[0] == dcb ? 0 : sp->dcb[1] == dcb ? 1 : -1;
+}
+
+/**
+ * Handle a read event of a spliced DCB. On the first event any incomplete
+ * packet left in the read queue by the protocol module is queued for writing
+ * to the other DCB.
+ *
+ * @param dcb   The DCB that has data to read
+ * @return      0
+ */
+int
+dcb_splice_read(DCB *dcb)
+{
+    DCB_SPLICE *sp = dcb->splice;
+    DCB *peer = NULL;
+    GWBUF *readq = NULL;
+    int i;
+
+    spinlock_acquire(&sp->lock);
+    if ((i = dcb_splice_index(sp, dcb)) >= 0 && !sp->active[i])
+    {
+        peer = sp->dcb[1 - i];
+        readq = dcb->dcb_readqueue;
+        dcb->dcb_readqueue = NULL;
+    }
+    spinlock_release(&sp->lock);
+
+    /** Not written with the splice lock held as draining the queue takes it */
+    if (readq)
+    {
+        if (peer)
+        {
+            dcb_write(peer, readq);
+        }
+        else
+        {
+            gwbuf_free(readq);
+        }
+    }
+
+    spinlock_acquire(&sp->lock);
+    if ((i = dcb_splice_index(sp, dcb)) >= 0)
+    {
+        sp->active[i] = true;
+        dcb_splice_pump(sp, i);
+    }
+    spinlock_release(&sp->lock);
+    return 0;
+}
+
+/**
+ * Continue writing the spliced data to a DCB once its write queue is drained
+ *
+ * @param dcb   The DCB whose write queue was drained
+ */
+static void
+dcb_splice_drained(DCB *dcb)
+{
+    DCB_SPLICE *sp = dcb->splice;
+    int i;
+
+    spinlock_acquire(&sp->lock);
+    if ((i = dcb_splice_index(sp, dcb)) >= 0)
+    {
+        dcb_splice_pump(sp, 1 - i);
+    }
+    spinlock_release(&sp->lock);
+}
+
+/**
+ * Detach a closing DCB from the DCB it is spliced to
+ *
+ * @param dcb   The closing DCB
+ */
+static void
+dcb_splice_detach(DCB *dcb)
+{
+    DCB_SPLICE *sp = dcb->splice;
+    int i;
+
+    spinlock_acquire(&sp->lock);
+    if ((i = dcb_splice_index(sp, dcb)) >= 0)
+    {
+        sp->dcb[i] = NULL;
+    }
+    spinlock_release(&sp->lock);
+}
+
+/**
+ * Release the reference of a DCB that is being freed to the spliced DCBs. The
+ * pipes are closed when both DCBs have been freed.
+ *
+ * @param dcb   The DCB being freed
+ */
+static void
+dcb_splice_release(DCB *dcb)
+{
+    DCB_SPLICE *sp = dcb->splice;
+    int i;
+
+    dcb->splice = NULL;
+    if (atomic_add(&sp->refcount, -1) == 1)
+    {
+        for (i = 0; i < 2; i++)
+        {
+            close(sp->pipe[i][0]);
+            close(sp->pipe[i][1]);
+        }
+        free(sp);
+    }
 }
 
 /**
@@ -1774,6 +2794,20 @@ dcb_close(DCB *dcb)
         raise(SIGABRT);
     }
 
+    /**
+     * A queued connection never starts once it is closed. If the connect
+     * queue is starting it, it is waited for.
+     */
+    if (dcb->flags & DCBF_CONNECT_QUEUED)
+    {
+        dcb_connect_dequeue(dcb);
+    }
+
+    if (dcb->flags & DCBF_HANDSHAKE)
+    {
+        dcb_handshake_done(dcb);
+    }
+
     /**
      * dcb_close may be called for freshly created dcb, in which case
      * it only needs to be freed.
@@ -1793,6 +2827,26 @@ dcb_close(DCB *dcb)
         return;
     }
 
+    /** The writes deferred by this dispatch are sent before the DCB is closed */
+    if (dcb->flush_pending)
+    {
+        dcb_drain_writeq(dcb);
+    }
+
+    if (dcb->stalled || dcb->flow_stopped)
+    {
+        dcb_flow_close(dcb);
+    }
+
+    /** The data left in the write queue is discarded with the DCB */
+    SESSION *session = dcb_flow_session(dcb);
+    int unwritten = dcb->writeqlen;
+
+    if (session && unwritten > 0)
+    {
+        session_buffered_add(session, -unwritten, true);
+    }
+
     spinlock_acquire(&zombiespin);
     if (!dcb->dcb_is_zombie)
     {
@@ -1807,24 +2861,15 @@ dcb_close(DCB *dcb)
                 dcb->user = strdup(user);
             }
         }
+        if (dcb->splice)
+        {
+            dcb_splice_detach(dcb);
+        }
         /*<
-         * Add closing dcb to the top of the list, setting zombie marker
+         * Set the zombie marker and add the closing dcb to the zombies
          */
         dcb->dcb_is_zombie = true;
-        dcb->memdata.next = zombies;
-        zombies = dcb;
-        nzombies++;
-        if (nzombies > maxzombies)
-        {
-            maxzombies = nzombies;
-        }
-        /*< Set bit for each maxscale thread. This should be done before
-         * the state is changed, so as to protect the DCB from premature
-         * destruction. */
-        if (dcb->server)
-        {
-            bitmask_copy(&dcb->memdata.bitmask, poll_bitmask());
-        }
+        dcb_add_to_zombies(dcb);
     }
     spinlock_release(&zombiespin);
 }
@@ -1846,10 +2891,16 @@ dcb_maybe_add_persistent(DCB *dcb)
         && dcb->server->persistpoolmax
         && (dcb->server->status & SERVER_RUNNING)
         && !dcb->dcb_errhandle_called
-        && !(dcb->flags & DCBF_HUNG)
-        && (poolcount = dcb_persistent_clean_count(dcb, false)) < dcb->server->persistpoolmax)
-    {
-        DCB_CALLBACK *loopcallback;
+        && !(dcb->flags & (DCBF_HUNG | DCBF_CONNECT_QUEUED))
+        && dcb->splice == NULL
+        && (poolcount = dcb_persistent_clean_count(dcb->server,
+                                                   server_persistent_pool(dcb->server, dcb),
+                                                   false)) >= 0
+        && dcb->server->stats.n_persistent < dcb->server->persistpoolmax)
+    {
+        SERVER_POOL *pool = server_persistent_pool(dcb->server, dcb);
+        DCB **stack;
+        int n_persistent;
         MXS_DEBUG("%lu [dcb_maybe_add_persistent] Adding DCB to persistent pool, user %s.\n",
                   pthread_self(),
                   dcb->user);
@@ -1868,18 +2919,15 @@ dcb_maybe_add_persistent(DCB *dcb)
                 session_free(local_session);
             }
         }
-        spinlock_acquire(&dcb->cb_lock);
-        while ((loopcallback = dcb->callbacks) != NULL)
-        {
-            dcb->callbacks = loopcallback->next;
-            free(loopcallback);
-        }
-        spinlock_release(&dcb->cb_lock);
-        spinlock_acquire(&dcb->server->persistlock);
-        dcb->nextpersistent = dcb->server->persistent;
-        dcb->server->persistent = dcb;
-        spinlock_release(&dcb->server->persistlock);
-        atomic_add(&dcb->server->stats.n_persistent, 1);
+        dcb_clear_callbacks(dcb);
+        dcb->persistentkey = server_persistent_key(dcb->user, dcb->protoname);
+        spinlock_acquire(&pool->lock);
+        stack = &pool->stacks[dcb->persistentkey % SERVER_POOL_BUCKETS];
+        dcb->nextpersistent = *stack;
+        *stack = dcb;
+        spinlock_release(&pool->lock);
+        n_persistent = atomic_add(&dcb->server->stats.n_persistent, 1) + 1;
+        dcb->server->persistmax = MAX(dcb->server->persistmax, n_persistent);
         atomic_add(&dcb->server->stats.n_current, -1);
         return true;
     }
@@ -1956,6 +3004,8 @@ printDCB(DCB *dcb)
            dcb->stats.n_high_water);
     printf("\t\tNo. of Low Water Events:    %d\n",
            dcb->stats.n_low_water);
+    printf("\t\tNo. of Read Stalls:         %d\n",
+           dcb->stats.n_stalls);
 }
 /**
  * Display an entry from the spinlock statistics data
@@ -1979,14 +3029,14 @@ void printAllDCBs()
 {
     DCB *dcb;
 
-    spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
+    dcb_registry_lock();
+    dcb = dcb_registry_first();
     while (dcb)
     {
         printDCB(dcb);
-        dcb = dcb->next;
+        dcb = dcb_registry_next(dcb);
     }
-    spinlock_release(&dcbspin);
+    dcb_registry_unlock();
 }
 
 /**
@@ -2055,14 +3105,9 @@ dprintOneDCB(DCB *pdcb, DCB *dcb)
         dcb_printf(pdcb, "\tRole:                     %s\n", rolename);
         free(rolename);
     }
-    if (!bitmask_isallclear(&dcb->memdata.bitmask))
+    if (dcb->dcb_is_zombie)
     {
-        char *bitmasktext = bitmask_render_readable(&dcb->memdata.bitmask);
-        if (bitmasktext)
-        {
-            dcb_printf(pdcb, "\tBitMask:                %s\n", bitmasktext);
-            free(bitmasktext);
-        }
+        dcb_printf(pdcb, "\tZombie epoch:             %lu\n", dcb->memdata.entry.epoch);
     }
     dcb_printf(pdcb, "\tStatistics:\n");
     dcb_printf(pdcb, "\t\tNo. of Reads:             %d\n", dcb->stats.n_reads);
@@ -2071,6 +3116,7 @@ dprintOneDCB(DCB *pdcb, DCB *dcb)
     dcb_printf(pdcb, "\t\tNo. of Accepts:           %d\n", dcb->stats.n_accepts);
     dcb_printf(pdcb, "\t\tNo. of High Water Events: %d\n", dcb->stats.n_high_water);
     dcb_printf(pdcb, "\t\tNo. of Low Water Events:  %d\n", dcb->stats.n_low_water);
+    dcb_printf(pdcb, "\t\tNo. of Read Stalls:       %d\n", dcb->stats.n_stalls);
     if (dcb->flags & DCBF_CLONE)
     {
         dcb_printf(pdcb, "\t\tDCB is a clone.\n");
@@ -2094,20 +3140,23 @@ dprintAllDCBs(DCB *pdcb)
 {
     DCB *dcb;
 
-    spinlock_acquire(&dcbspin);
+    dcb_registry_lock();
 #if SPINLOCK_PROFILE
-    dcb_printf(pdcb, "DCB List Spinlock Statistics:\n");
-    spinlock_stats(&dcbspin, spin_reporter, pdcb);
+    for (int i = 0; i < DCB_REGISTRY_SHARDS; i++)
+    {
+        dcb_printf(pdcb, "DCB Registry Shard %d Spinlock Statistics:\n", i);
+        spinlock_stats(&dcb_registry[i].lock, spin_reporter, pdcb);
+    }
     dcb_printf(pdcb, "Zombie Queue Lock Statistics:\n");
     spinlock_stats(&zombiespin, spin_reporter, pdcb);
 #endif
-    dcb = allDCBs;
+    dcb = dcb_registry_first();
     while (dcb)
     {
         dprintOneDCB(pdcb, dcb);
-        dcb = dcb->next;
+        dcb = dcb_registry_next(dcb);
     }
-    spinlock_release(&dcbspin);
+    dcb_registry_unlock();
 }
 
 /**
@@ -2120,8 +3169,8 @@ dListDCBs(DCB *pdcb)
 {
     DCB *dcb;
 
-    spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
+    dcb_registry_lock();
+    dcb = dcb_registry_first();
     dcb_printf(pdcb, "Descriptor Control Blocks\n");
     dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n");
     dcb_printf(pdcb, " %-16s | %-26s | %-18s | %s\n",
@@ -2136,10 +3185,10 @@ dListDCBs(DCB *pdcb)
                        ((dcb->session && dcb->session->service) ? dcb->session->service->name : ""),
                        (dcb->remote ? dcb->remote : ""));
         }
-        dcb = dcb->next;
+        dcb = dcb_registry_next(dcb);
     }
     dcb_printf(pdcb, "------------------+----------------------------+--------------------+----------\n\n");
-    spinlock_release(&dcbspin);
+    dcb_registry_unlock();
 }
 
 /**
@@ -2152,8 +3201,8 @@ dListClients(DCB *pdcb)
 {
     DCB *dcb;
 
-    spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
+    dcb_registry_lock();
+    dcb = dcb_registry_first();
     dcb_printf(pdcb, "Client Connections\n");
     dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n");
     dcb_printf(pdcb, " %-15s | %-16s | %-20s | %s\n",
@@ -2169,10 +3218,10 @@ dListClients(DCB *pdcb)
                              dcb->session->service->name : ""),
                        dcb->session);
         }
-        dcb = dcb->next;
+        dcb = dcb_registry_next(dcb);
     }
     dcb_printf(pdcb, "-----------------+------------------+----------------------+------------\n\n");
-    spinlock_release(&dcbspin);
+    dcb_registry_unlock();
 }
 
 
@@ -2244,6 +3293,8 @@ dprintDCB(DCB *pdcb, DCB *dcb)
                dcb->stats.n_high_water);
     dcb_printf(pdcb, "\t\tNo. of Low Water Events:  %d\n",
                dcb->stats.n_low_water);
+    dcb_printf(pdcb, "\t\tNo. of Read Stalls:       %d\n",
+               dcb->stats.n_stalls);
     if (DCB_POLL_BUSY(dcb))
     {
         dcb_printf(pdcb, "\t\tPending events in the queue:      %x %s\n",
@@ -2368,7 +3419,13 @@ void dcb_hashtable_stats(
 /**
  * Write data to a DCB socket through an SSL structure. The SSL structure is
  * linked from the DCB. All communication is encrypted and done via the SSL
- * structure. Data is written from the DCB write queue.
+ * structure. Data is written from the DCB write queue. Buffers smaller than
+ * DCB_SSL_COALESCE_SIZE are copied into one block so that a chain of small
+ * buffers is written as one TLS record.
+ *
+ * A retried write coalesces the same leading bytes of the queue again, as the
+ * queue is only appended to, but possibly into the block of another thread.
+ * This is why the SSL structure accepts a moving write buffer.
  *
  * @param dcb           The DCB having an SSL connection
  * @param writeq        A buffer list containing the data to be written
@@ -2379,8 +3436,23 @@ static int
 gw_write_SSL(DCB *dcb, GWBUF *writeq, bool *stop_writing)
 {
     int written;
+    void *data = GWBUF_DATA(writeq);
+    int len = GWBUF_LENGTH(writeq);
+
+    if (writeq->next && len < DCB_SSL_COALESCE_SIZE)
+    {
+        GWBUF *ptr;
 
-    written = SSL_write(dcb->ssl, GWBUF_DATA(writeq), GWBUF_LENGTH(writeq));
+        len = 0;
+        for (ptr = writeq; ptr && len + GWBUF_LENGTH(ptr) <= DCB_SSL_COALESCE_SIZE; ptr = ptr->next)
+        {
+            memcpy(ssl_coalesce + len, GWBUF_DATA(ptr), GWBUF_LENGTH(ptr));
+            len += GWBUF_LENGTH(ptr);
+        }
+        data = ssl_coalesce;
+    }
+
+    written = SSL_write(dcb->ssl, data, len);
 
     *stop_writing = false;
     switch ((SSL_get_error(dcb->ssl, written)))
@@ -2433,7 +3505,8 @@ gw_write_SSL(DCB *dcb, GWBUF *writeq, bool *stop_writing)
 }
 
 /**
- * Write data to a DCB. The data is taken from the DCB's write queue.
+ * Write data to a DCB. The data is taken from the DCB's write queue. Up to
+ * DCB_MAX_IOVECS buffers of the queue are written with a single writev call.
  *
  * @param dcb           The DCB to write buffer
  * @param writeq        A buffer list containing the data to be written
@@ -2447,8 +3520,21 @@ gw_write(DCB *dcb, GWBUF *writeq, bool *stop_writing)
     int fd = dcb->fd;
     size_t nbytes = GWBUF_LENGTH(writeq);
     void *buf = GWBUF_DATA(writeq);
+    struct iovec *iov = write_iov;
+    int iovcnt = 0;
+    GWBUF *ptr;
     int saved_errno;
 
+    for (ptr = writeq; ptr && iovcnt < DCB_MAX_IOVECS; ptr = ptr->next)
+    {
+        if (GWBUF_LENGTH(ptr) > 0)
+        {
+            iov[iovcnt].iov_base = GWBUF_DATA(ptr);
+            iov[iovcnt].iov_len = GWBUF_LENGTH(ptr);
+            iovcnt++;
+        }
+    }
+
     errno = 0;
 
 #if defined(FAKE_CODE)
@@ -2463,14 +3549,14 @@ gw_write(DCB *dcb, GWBUF *writeq, bool *stop_writing)
             errno = dcb_fake_write_errno[fd];
         }
     }
-    else if (fd > 0)
+    else if (fd > 0 && iovcnt > 0)
     {
-        written = write(fd, buf, nbytes);
+        written = writev(fd, iov, iovcnt);
     }
 #else
-    if (fd > 0)
+    if (fd > 0 && iovcnt > 0)
     {
-        written = write(fd, buf, nbytes);
+        written = writev(fd, iov, iovcnt);
     }
 #endif /* FAKE_CODE */
 
@@ -2561,8 +3647,8 @@ gw_write(DCB *dcb, GWBUF *writeq, bool *stop_writing)
  * Duplicate registrations are not allowed, therefore an error will be
  * returned if the specific function, reason and userdata triple
  * are already registered.
- * An error will also be returned if the is insufficient memeory available to
- * create the registration.
+ * An error will also be returned if the DCB already has DCB_MAX_CALLBACKS
+ * callbacks. The callbacks are kept in the DCB, adding one allocates no memory.
  *
  * @param dcb           The DCB to add the callback to
  * @param reason        The callback reason
@@ -2576,48 +3662,71 @@ dcb_add_callback(DCB *dcb,
                  int (*callback)(struct dcb *, DCB_REASON, void *),
                  void *userdata)
 {
-    DCB_CALLBACK *cb, *ptr, *lastcb = NULL;
+    int i;
 
-    if ((ptr = (DCB_CALLBACK *)malloc(sizeof(DCB_CALLBACK))) == NULL)
-    {
-        return 0;
-    }
-    ptr->reason = reason;
-    ptr->cb = callback;
-    ptr->userdata = userdata;
-    ptr->next = NULL;
     spinlock_acquire(&dcb->cb_lock);
-    cb = dcb->callbacks;
-    while (cb)
+    for (i = 0; i < dcb->n_callbacks; i++)
     {
+        DCB_CALLBACK *cb = &dcb->callbacks[i];
+
         if (cb->reason == reason && cb->cb == callback &&
             cb->userdata == userdata)
         {
             /* Callback is a duplicate, abandon it */
-            free(ptr);
             spinlock_release(&dcb->cb_lock);
             return 0;
         }
-        lastcb = cb;
-        cb = cb->next;
-    }
-    if (NULL == lastcb)
-    {
-        dcb->callbacks = ptr;
     }
-    else
+    if (dcb->n_callbacks == DCB_MAX_CALLBACKS)
     {
-        lastcb->next = ptr;
+        spinlock_release(&dcb->cb_lock);
+        MXS_ERROR("DCB %p already has %d callbacks, cannot add a callback for %s.",
+                  dcb, DCB_MAX_CALLBACKS, STRDCBREASON(reason));
+        return 0;
     }
+    dcb->callbacks[dcb->n_callbacks].reason = reason;
+    dcb->callbacks[dcb->n_callbacks].cb = callback;
+    dcb->callbacks[dcb->n_callbacks].userdata = userdata;
+    dcb->n_callbacks++;
+    dcb->cb_reasons |= DCB_REASON_BIT(reason);
     spinlock_release(&dcb->cb_lock);
     return 1;
 }
 
 /**
- * Remove a callback from the callback list for the DCB
+ * Find a callback of a DCB. The caller holds cb_lock.
+ *
+ * @param dcb           The DCB
+ * @param reason        The callback reason
+ * @param callback      The callback function
+ * @param userdata      The user data of the callback
+ * @return              Index of the callback or -1 if it is not registered
+ */
+static int
+dcb_find_callback(DCB *dcb,
+                  DCB_REASON reason,
+                  int (*callback)(struct dcb *, DCB_REASON, void *),
+                  void *userdata)
+{
+    int i;
+
+    for (i = 0; i < dcb->n_callbacks; i++)
+    {
+        if (dcb->callbacks[i].reason == reason &&
+            dcb->callbacks[i].cb == callback &&
+            dcb->callbacks[i].userdata == userdata)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Remove a callback from the callbacks of the DCB
  *
- * Searches down the linked list to find the callback with a matching reason, function
- * and userdata.
+ * Searches the callbacks to find the callback with a matching reason, function
+ * and userdata. The callbacks after it keep their order.
  *
  * @param dcb           The DCB to add the callback to
  * @param reason        The callback reason
@@ -2631,141 +3740,135 @@ dcb_remove_callback(DCB *dcb,
                     int (*callback)(struct dcb *, DCB_REASON, void *),
                     void *userdata)
 {
-    DCB_CALLBACK *cb, *pcb = NULL;
-    int          rval = 0;
+    int i;
+    int rval = 0;
 
     spinlock_acquire(&dcb->cb_lock);
-    cb = dcb->callbacks;
-    if (cb == NULL)
-    {
-        rval = 0;
-    }
-    else
+    if ((i = dcb_find_callback(dcb, reason, callback, userdata)) >= 0)
     {
-        while (cb)
+        dcb->n_callbacks--;
+        memmove(&dcb->callbacks[i], &dcb->callbacks[i + 1],
+                (dcb->n_callbacks - i) * sizeof(DCB_CALLBACK));
+        dcb->cb_reasons = 0;
+        for (i = 0; i < dcb->n_callbacks; i++)
         {
-            if (cb->reason == reason &&
-                cb->cb == callback &&
-                cb->userdata == userdata)
-            {
-                if (pcb != NULL)
-                {
-                    pcb->next = cb->next;
-                }
-                else
-                {
-                    dcb->callbacks = cb->next;
-                }
-                spinlock_release(&dcb->cb_lock);
-                free(cb);
-                rval = 1;
-                break;
-            }
-            pcb = cb;
-            cb = cb->next;
+            dcb->cb_reasons |= DCB_REASON_BIT(dcb->callbacks[i].reason);
         }
+        rval = 1;
     }
-    if (!rval)
-    {
-        spinlock_release(&dcb->cb_lock);
-    }
+    spinlock_release(&dcb->cb_lock);
     return rval;
 }
 
+/**
+ * Remove all the callbacks of a DCB
+ *
+ * @param dcb           The DCB
+ */
+static void
+dcb_clear_callbacks(DCB *dcb)
+{
+    spinlock_acquire(&dcb->cb_lock);
+    dcb->n_callbacks = 0;
+    dcb->cb_reasons = 0;
+    spinlock_release(&dcb->cb_lock);
+}
+
 /**
  * Call the set of callbacks registered for a particular reason.
  *
+ * The callbacks are called without cb_lock held, so a callback may add or
+ * remove callbacks. A callback removed by an earlier one is not called. The
+ * DCBs with no callback for the reason are passed without taking the lock.
+ *
  * @param dcb           The DCB to call the callbacks regarding
  * @param reason        The reason that has triggered the call
  */
 static void
 dcb_call_callback(DCB *dcb, DCB_REASON reason)
 {
-    DCB_CALLBACK *cb, *nextcb;
+    DCB_CALLBACK calls[DCB_MAX_CALLBACKS];
+    int n_calls = 0;
+    int i;
+
+    if ((dcb->cb_reasons & DCB_REASON_BIT(reason)) == 0)
+    {
+        return;
+    }
 
     spinlock_acquire(&dcb->cb_lock);
-    cb = dcb->callbacks;
-    while (cb)
+    for (i = 0; i < dcb->n_callbacks; i++)
     {
-        if (cb->reason == reason)
+        if (dcb->callbacks[i].reason == reason)
         {
-            nextcb = cb->next;
-            spinlock_release(&dcb->cb_lock);
+            calls[n_calls++] = dcb->callbacks[i];
+        }
+    }
+    spinlock_release(&dcb->cb_lock);
 
-            MXS_DEBUG("%lu [dcb_call_callback] %s",
-                      pthread_self(),
-                      STRDCBREASON(reason));
+    for (i = 0; i < n_calls; i++)
+    {
+        bool registered;
 
-            cb->cb(dcb, reason, cb->userdata);
-            spinlock_acquire(&dcb->cb_lock);
-            cb = nextcb;
-        }
-        else
+        if (i > 0)
         {
-            cb = cb->next;
+            spinlock_acquire(&dcb->cb_lock);
+            registered = dcb_find_callback(dcb, reason, calls[i].cb, calls[i].userdata) >= 0;
+            spinlock_release(&dcb->cb_lock);
+
+            if (!registered)
+            {
+                continue;
+            }
         }
+
+        MXS_DEBUG("%lu [dcb_call_callback] %s",
+                  pthread_self(),
+                  STRDCBREASON(reason));
+
+        calls[i].cb(dcb, reason, calls[i].userdata);
     }
-    spinlock_release(&dcb->cb_lock);
 }
 
 /**
- * Check the passed DCB to ensure it is in the list of allDCBS
+ * Check the passed DCB to ensure it is in the registry of the DCBs in use
+ *
+ * The shards are searched one at a time, so that the check does not stop
+ * the allocation of DCBs in all threads.
  *
  * @param       dcb     The DCB to check
- * @return      1 if the DCB is in the list, otherwise 0
+ * @return      1 if the DCB is in the registry, otherwise 0
  */
 int
 dcb_isvalid(DCB *dcb)
 {
     int rval = 0;
+    int i;
 
-    if (dcb)
+    for (i = 0; dcb && rval == 0 && i < DCB_REGISTRY_SHARDS; i++)
     {
-        spinlock_acquire(&dcbspin);
-        rval = dcb_isvalid_nolock(dcb);
-        spinlock_release(&dcbspin);
-    }
+        DCB *ptr;
 
-    return rval;
-}
-
-/**
- * Find a DCB in the list of all DCB's
- *
- * @param dcb       The DCB to find
- * @return          A pointer to the DCB or NULL if not in the list
- */
-static inline DCB *
-dcb_find_in_list (DCB *dcb)
-{
-    DCB *ptr = NULL;
-    if (dcb)
-    {
-        ptr = allDCBs;
-        while (ptr && (false == ptr->dcb_is_in_use || ptr != dcb))
+        spinlock_acquire(&dcb_registry[i].lock);
+        for (ptr = dcb_registry[i].head; ptr; ptr = ptr->next)
         {
-            ptr = ptr->next;
+            if (ptr == dcb)
+            {
+                rval = 1;
+                break;
+            }
         }
+        spinlock_release(&dcb_registry[i].lock);
     }
-    return ptr;
-}
 
-/**
- * Check the passed DCB to ensure it is in the list of allDCBS.
- * Requires that the DCB list is already locked before call.
- *
- * @param       dcb     The DCB to check
- * @return      1 if the DCB is in the list, otherwise 0
- */
-static inline int
-dcb_isvalid_nolock(DCB *dcb)
-{
-    return (dcb == dcb_find_in_list(dcb));
+    return rval;
 }
 
 /**
  * Call all the callbacks on all DCB's that match the server and the reason given
  *
+ * Only the DCBs connected to the server are visited.
+ *
  * @param reason        The DCB_REASON that triggers the callback
  */
 void
@@ -2782,26 +3885,18 @@ dcb_call_foreach(struct server* server, DCB_REASON reason)
     case DCB_REASON_NOT_RESPONDING:
     {
         DCB *dcb;
-        spinlock_acquire(&dcbspin);
-        dcb = allDCBs;
+        spinlock_acquire(&server->dcbs_lock);
 
-        while (dcb != NULL)
+        for (dcb = server->dcbs; dcb != NULL; dcb = dcb->nextserver)
         {
-            if (false == dcb->dcb_is_in_use)
-            {
-                dcb = dcb->next;
-                continue;
-            }
             spinlock_acquire(&dcb->dcb_initlock);
-            if (dcb->state == DCB_STATE_POLLING && dcb->server &&
-                strcmp(dcb->server->unique_name,server->unique_name) == 0)
+            if (dcb->state == DCB_STATE_POLLING)
             {
                 dcb_call_callback(dcb, DCB_REASON_NOT_RESPONDING);
             }
             spinlock_release(&dcb->dcb_initlock);
-            dcb = dcb->next;
         }
-        spinlock_release(&dcbspin);
+        spinlock_release(&server->dcbs_lock);
         break;
     }
 
@@ -2812,9 +3907,9 @@ dcb_call_foreach(struct server* server, DCB_REASON reason)
 }
 
 /**
- * Call all the callbacks on all DCB's that match the server and the reason given
+ * Send a fake hangup event to all the DCBs connected to the server
  *
- * @param reason        The DCB_REASON that triggers the callback
+ * @param server        The server whose connections are hung up
  */
 void
 dcb_hangup_foreach(struct server* server)
@@ -2822,26 +3917,18 @@ dcb_hangup_foreach(struct server* server)
     MXS_DEBUG("%lu [dcb_hangup_foreach]", pthread_self());
 
     DCB *dcb;
-    spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
+    spinlock_acquire(&server->dcbs_lock);
 
-    while (dcb != NULL)
+    for (dcb = server->dcbs; dcb != NULL; dcb = dcb->nextserver)
     {
-        if (false == dcb->dcb_is_in_use)
-        {
-            dcb = dcb->next;
-            continue;
-        }
         spinlock_acquire(&dcb->dcb_initlock);
-        if (dcb->state == DCB_STATE_POLLING && dcb->server &&
-            strcmp(dcb->server->unique_name, server->unique_name) == 0)
+        if (dcb->state == DCB_STATE_POLLING)
         {
             poll_fake_hangup_event(dcb);
         }
         spinlock_release(&dcb->dcb_initlock);
-        dcb = dcb->next;
     }
-    spinlock_release(&dcbspin);
+    spinlock_release(&server->dcbs_lock);
 }
 
 
@@ -2881,61 +3968,61 @@ dcb_null_auth(DCB *dcb, SERVER *server, SESSION *session, GWBUF *buf)
 }
 
 /**
- * Check persistent pool for expiry or excess size and count
+ * Check persistent pools for expiry and count
  *
- * @param dcb           The DCB being closed.
- * @param cleanall      Boolean, if true the whole pool is cleared for the
- *                      server related to the given DCB
- * @return              A count of the DCBs remaining in the pool
+ * @param server        The server whose pools are checked
+ * @param pool          The pool to check or NULL for all the pools of the
+ *                      server
+ * @param cleanall      Boolean, if true the pools are cleared
+ * @return              A count of the DCBs remaining in the pools
  */
 int
-dcb_persistent_clean_count(DCB *dcb, bool cleanall)
+dcb_persistent_clean_count(SERVER *server, SERVER_POOL *pool, bool cleanall)
 {
     int count = 0;
-    if (dcb && dcb->server)
+    if (server)
     {
-        SERVER *server = dcb->server;
-        DCB *previousdcb = NULL;
         DCB *persistentdcb, *nextdcb;
         DCB *disposals = NULL;
+        int first = pool ? pool - server->persistent : 0;
+        int last = pool ? first + 1 : server->n_persistent_pools;
+        int i, j;
 
         CHK_SERVER(server);
-        spinlock_acquire(&server->persistlock);
-        persistentdcb = server->persistent;
-        while (persistentdcb)
-        {
-            CHK_DCB(persistentdcb);
-            nextdcb = persistentdcb->nextpersistent;
-            if (cleanall
-                || persistentdcb-> dcb_errhandle_called
-                || count >= server->persistpoolmax
-                || persistentdcb->server == NULL
-                || !(persistentdcb->server->status & SERVER_RUNNING)
-                || (time(NULL) - persistentdcb->persistentstart) > server->persistmaxtime)
+        for (i = first; i < last; i++)
+        {
+            SERVER_POOL *cleaned = &server->persistent[i];
+
+            spinlock_acquire(&cleaned->lock);
+            for (j = 0; j < SERVER_POOL_BUCKETS; j++)
             {
-                /* Remove from persistent pool */
-                if (previousdcb)
-                {
-                    previousdcb->nextpersistent = nextdcb;
-                }
-                else
+                DCB **previous = &cleaned->stacks[j];
+
+                while ((persistentdcb = *previous) != NULL)
                 {
-                    server->persistent = nextdcb;
+                    CHK_DCB(persistentdcb);
+                    if (cleanall
+                        || persistentdcb-> dcb_errhandle_called
+                        || persistentdcb->server == NULL
+                        || !(persistentdcb->server->status & SERVER_RUNNING)
+                        || SERVER_PERSISTENT_EXPIRED(server, persistentdcb))
+                    {
+                        /* Remove from persistent pool */
+                        *previous = persistentdcb->nextpersistent;
+                        /* Add removed DCBs to disposal list for processing outside spinlock */
+                        persistentdcb->nextpersistent = disposals;
+                        disposals = persistentdcb;
+                        atomic_add(&server->stats.n_persistent, -1);
+                    }
+                    else
+                    {
+                        count++;
+                        previous = &persistentdcb->nextpersistent;
+                    }
                 }
-                /* Add removed DCBs to disposal list for processing outside spinlock */
-                persistentdcb->nextpersistent = disposals;
-                disposals = persistentdcb;
-                atomic_add(&server->stats.n_persistent, -1);
-            }
-            else
-            {
-                count++;
-                previousdcb = persistentdcb;
             }
-            persistentdcb = nextdcb;
+            spinlock_release(&cleaned->lock);
         }
-        server->persistmax = MAX(server->persistmax, count);
-        spinlock_release(&server->persistlock);
         /** Call possible callback for this DCB in case of close */
         while (disposals)
         {
@@ -2964,8 +4051,8 @@ dcb_count_by_usage(DCB_USAGE usage)
     int rval = 0;
     DCB *dcb;
 
-    spinlock_acquire(&dcbspin);
-    dcb = allDCBs;
+    dcb_registry_lock();
+    dcb = dcb_registry_first();
     while (dcb)
     {
         if (dcb->dcb_is_in_use)
@@ -3008,9 +4095,9 @@ dcb_count_by_usage(DCB_USAGE usage)
                 break;
             }
         }
-        dcb = dcb->next;
+        dcb = dcb_registry_next(dcb);
     }
-    spinlock_release(&dcbspin);
+    dcb_registry_unlock();
     return rval;
 }
 
@@ -3030,15 +4117,43 @@ dcb_create_SSL(DCB* dcb, SSL_LISTENER *ssl)
         return -1;
     }
 
+    /** See gw_write_SSL */
+    SSL_set_mode(dcb->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
     if (SSL_set_fd(dcb->ssl, dcb->fd) == 0)
     {
         MXS_ERROR("Failed to set file descriptor for SSL connection.");
         return -1;
     }
 
+    /** Only backend connections store sessions, see new_session_callback */
+    spinlock_acquire(&ssl->ssl_session_lock);
+    if (ssl->ssl_session)
+    {
+        SSL_set_session(dcb->ssl, ssl->ssl_session);
+    }
+    spinlock_release(&ssl->ssl_session_lock);
+
     return 0;
 }
 
+/**
+ * Mark the SSL handshake of a DCB as done. If the kernel encrypts the records
+ * sent on the socket, the data is written directly to the socket with the
+ * same writev calls as on connections without SSL.
+ *
+ * @param dcb DCB whose handshake completed
+ */
+static void
+dcb_SSL_established(DCB *dcb)
+{
+    dcb->ssl_state = SSL_ESTABLISHED;
+    dcb->ssl_read_want_write = false;
+#ifdef BIO_get_ktls_send
+    dcb->ssl_ktls_send = BIO_get_ktls_send(SSL_get_wbio(dcb->ssl));
+#endif
+}
+
 /**
  * Accept a SSL connection and do the SSL authentication handshake.
  * This function accepts a client connection to a DCB. It assumes that the SSL
@@ -3070,9 +4185,9 @@ int dcb_accept_SSL(DCB* dcb)
     switch (SSL_get_error(dcb->ssl, ssl_rval))
     {
         case SSL_ERROR_NONE:
-            MXS_DEBUG("SSL_accept done for %s@%s", user, remote);
-            dcb->ssl_state = SSL_ESTABLISHED;
-            dcb->ssl_read_want_write = false;
+            MXS_DEBUG("SSL_accept done for %s@%s%s", user, remote,
+                      SSL_session_reused(dcb->ssl) ? ", session resumed" : "");
+            dcb_SSL_established(dcb);
             return 1;
 
         case SSL_ERROR_WANT_READ:
@@ -3144,9 +4259,9 @@ int dcb_connect_SSL(DCB* dcb)
     switch (SSL_get_error(dcb->ssl, ssl_rval))
     {
         case SSL_ERROR_NONE:
-            MXS_DEBUG("SSL_connect done for %s", dcb->remote);
-            dcb->ssl_state = SSL_ESTABLISHED;
-            dcb->ssl_read_want_write = false;
+            MXS_DEBUG("SSL_connect done for %s%s", dcb->remote,
+                      SSL_session_reused(dcb->ssl) ? ", session resumed" : "");
+            dcb_SSL_established(dcb);
             return_code = 1;
             break;
 
@@ -3201,6 +4316,77 @@ int dcb_connect_SSL(DCB* dcb)
     return return_code;
 }
 
+/**
+ * @brief Wake a listener that has connections waiting for a closed one
+ *
+ * Each listener queues the connections it accepted over the limit of the
+ * service and only it releases them. The listener of the closed client is
+ * woken if it has queued connections, otherwise the first one that has.
+ *
+ * @param dcb   The client DCB being closed
+ */
+static void
+dcb_wake_queued(DCB *dcb)
+{
+    SERV_LISTENER *own = dcb->listener;
+
+    if (own && own->listener && own->queued_connections &&
+        mxs_queue_count(own->queued_connections) > 0)
+    {
+        poll_fake_read_event(own->listener);
+        return;
+    }
+
+    for (SERV_LISTENER *port = dcb->service->ports; port; port = port->next)
+    {
+        if (port->listener && port->queued_connections &&
+            mxs_queue_count(port->queued_connections) > 0)
+        {
+            poll_fake_read_event(port->listener);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Release a queued client connection of a listener
+ *
+ * The connections that the listener accepted when the service was at its
+ * connection limit are released in the order they were queued once the
+ * service is below the limit. The ones that waited too long are rejected.
+ *
+ * @param listener  Listener DCB that is accepting connections
+ * @return A queued client DCB of the listener or NULL if there is none to release
+ */
+static DCB *
+dcb_release_queued(DCB *listener)
+{
+    SERVICE *service = listener->session->service;
+    QUEUE_CONFIG *queue = listener->listener->queued_connections;
+    QUEUE_ENTRY entry;
+
+    while (queue &&
+           (service->max_connections == 0 || service->client_count < service->max_connections) &&
+           mxs_dequeue(queue, &entry))
+    {
+        DCB *client_dcb = (DCB *)entry.queued_object;
+
+        if (mxs_queue_expired(queue, &entry))
+        {
+            if (client_dcb->func.connlimit)
+            {
+                client_dcb->func.connlimit(client_dcb, service->max_connections);
+            }
+            dcb_close(client_dcb);
+        }
+        else
+        {
+            return client_dcb;
+        }
+    }
+    return NULL;
+}
+
 /**
  * @brief Accept a new client connection, given a listener, return new DCB
  *
@@ -3218,10 +4404,12 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
 {
     DCB *client_dcb = NULL;
     int c_sock;
-    int sendbuf;
     struct sockaddr_storage client_conn;
-    socklen_t optlen = sizeof(sendbuf);
-    char errbuf[STRERROR_BUFLEN];
+
+    if ((client_dcb = dcb_release_queued(listener)) != NULL)
+    {
+        return client_dcb;
+    }
 
     if ((c_sock = dcb_accept_one_connection(listener, (struct sockaddr *)&client_conn)) >= 0)
     {
@@ -3234,23 +4422,14 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
 #if defined(FAKE_CODE)
         conn_open[c_sock] = true;
 #endif /* FAKE_CODE */
-        /* set nonblocking  */
-        sendbuf = GW_CLIENT_SO_SNDBUF;
-
-        if (setsockopt(c_sock, SOL_SOCKET, SO_SNDBUF, &sendbuf, optlen) != 0)
-        {
-            MXS_ERROR("Failed to set socket options. Error %d: %s",
-                      errno, strerror_r(errno, errbuf, sizeof(errbuf)));
-        }
-
-        sendbuf = GW_CLIENT_SO_RCVBUF;
-
-        if (setsockopt(c_sock, SOL_SOCKET, SO_RCVBUF, &sendbuf, optlen) != 0)
+        /**
+         * The TCP sockets inherit the buffer sizes and SO_BUSY_POLL from the
+         * listening socket, the Unix domain sockets do not.
+         */
+        if (((struct sockaddr *)&client_conn)->sa_family == AF_UNIX)
         {
-            MXS_ERROR("Failed to set socket options. Error %d: %s",
-                      errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+            dcb_set_client_options(listener, c_sock);
         }
-        setnonblocking(c_sock);
 
         client_dcb = dcb_alloc(DCB_ROLE_CLIENT_HANDLER, listener->listener);
 
@@ -3262,7 +4441,7 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
         else
         {
             const char *authenticator_name = "NullAuth";
-            GWAUTHENTICATOR *authfuncs;
+            GWAUTHENTICATOR *authfuncs = listener->listener->authfuncs;
 
             client_dcb->service = listener->session->service;
             client_dcb->session = session_set_dummy(client_dcb);
@@ -3294,32 +4473,37 @@ dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs)
                 }
             }
             memcpy(&client_dcb->func, protocol_funcs, sizeof(GWPROTOCOL));
-            if (listener->listener->authenticator)
-            {
-                authenticator_name = listener->listener->authenticator;
-            }
-            else if (client_dcb->func.auth_default != NULL)
+            /** The authenticator is looked up once per listener, not for every client */
+            if (authfuncs == NULL)
             {
-                authenticator_name = client_dcb->func.auth_default();
-            }
-            if ((authfuncs = (GWAUTHENTICATOR *)load_module(authenticator_name,
-                                                            MODULE_AUTHENTICATOR)) == NULL)
-            {
-                if ((authfuncs = (GWAUTHENTICATOR *)load_module("NullAuth",
+                if (listener->listener->authenticator)
+                {
+                    authenticator_name = listener->listener->authenticator;
+                }
+                else if (client_dcb->func.auth_default != NULL)
+                {
+                    authenticator_name = client_dcb->func.auth_default();
+                }
+                if ((authfuncs = (GWAUTHENTICATOR *)load_module(authenticator_name,
                                                                 MODULE_AUTHENTICATOR)) == NULL)
                 {
-                    MXS_ERROR("Failed to load authenticator module for %s, free dcb %p\n",
-                              authenticator_name,
-                              client_dcb);
-                    dcb_close(client_dcb);
-                    return NULL;
+                    if ((authfuncs = (GWAUTHENTICATOR *)load_module("NullAuth",
+                                                                    MODULE_AUTHENTICATOR)) == NULL)
+                    {
+                        MXS_ERROR("Failed to load authenticator module for %s, free dcb %p\n",
+                                  authenticator_name,
+                                  client_dcb);
+                        dcb_close(client_dcb);
+                        return NULL;
+                    }
                 }
+                listener->listener->authfuncs = authfuncs;
             }
             memcpy(&(client_dcb->authfunc), authfuncs, sizeof(GWAUTHENTICATOR));
             if (client_dcb->service->max_connections &&
                 client_dcb->service->client_count >= client_dcb->service->max_connections)
             {
-                if (!mxs_enqueue(client_dcb->service->queued_connections, client_dcb))
+                if (!mxs_enqueue(listener->listener->queued_connections, client_dcb))
                 {
                     if (client_dcb->func.connlimit)
                     {
@@ -3367,10 +4551,11 @@ dcb_accept_one_connection(DCB *listener, struct sockaddr *client_conn)
             fail_accept_errno = 0;
 #endif /* FAKE_CODE */
 
-            /* new connection from client */
-            c_sock = accept(listener->fd,
-                            client_conn,
-                            &client_len);
+            /* new connection from client, non-blocking from the start */
+            c_sock = accept4(listener->fd,
+                             client_conn,
+                             &client_len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
             eno = errno;
             errno = 0;
 #if defined(FAKE_CODE)
@@ -3456,7 +4641,11 @@ dcb_listen(DCB *listener, const char *config, const char *protocol_name)
     int listener_socket;
 
     listener->fd = -1;
-    if (strchr(config, '/'))
+    if ((listener_socket = handoff_take_listener(config)) >= 0)
+    {
+        MXS_NOTICE("Using the listening socket of the previous process for %s.", config);
+    }
+    else if (strchr(config, '/'))
     {
         listener_socket = dcb_listen_create_socket_unix(config);
     }
@@ -3469,6 +4658,11 @@ dcb_listen(DCB *listener, const char *config, const char *protocol_name)
         return -1;
     }
 
+    if (!strchr(config, '/'))
+    {
+        dcb_set_client_options(listener, listener_socket);
+    }
+
     if (listen(listener_socket, 10 * SOMAXCONN) != 0)
     {
         char errbuf[STRERROR_BUFLEN];
@@ -3668,6 +4862,38 @@ dcb_set_socket_option(int sockfd, int level, int optname, void *optval, socklen_
     return 0;
 }
 
+/**
+ * @brief Set the options of the client sockets of a listener
+ *
+ * Set on a TCP listening socket before it listens, the options are inherited
+ * by the sockets that accept returns, so the accept path makes no system calls
+ * for them.
+ *
+ * @param listener  The listener DCB
+ * @param sockfd    The listening socket or an accepted client socket
+ */
+static void
+dcb_set_client_options(DCB *listener, int sockfd)
+{
+    int bufsize = GW_CLIENT_SO_SNDBUF;
+
+    dcb_set_socket_option(sockfd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    bufsize = GW_CLIENT_SO_RCVBUF;
+    dcb_set_socket_option(sockfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+#ifdef SO_BUSY_POLL
+    /** The receives of a latency-critical listener busy wait on the device queue */
+    if (listener->listener && listener->listener->busy_poll > 0 &&
+        setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &listener->listener->busy_poll,
+                   sizeof(listener->listener->busy_poll)) != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_WARNING("Failed to set SO_BUSY_POLL of a client socket. Error %d: %s",
+                    errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+    }
+#endif
+}
+
 /**
  * Convert a DCB role to a string, the returned
  * string has been malloc'd and must be free'd by the caller
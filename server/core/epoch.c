@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file epoch.c  - Epoch based memory reclamation
+ *
+ * Every retired object is stamped with a new value of the global epoch and
+ * appended to the list of retired objects, which is therefore in epoch order.
+ * At a quiescent state a thread records the global epoch it has seen. An object
+ * is unreferenced once the smallest epoch recorded by the threads is at least
+ * the epoch of the object, and as the list is ordered the unreferenced objects
+ * are always at the head of the list.
+ *
+ * Checking whether anything can be reclaimed costs one read of each thread's
+ * epoch, which are kept on cache lines of their own so that the threads do not
+ * contend when recording them.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <epoch.h>
+#include <spinlock.h>
+#include <platform.h>
+
+#define EPOCH_CACHE_LINE 64
+
+/**
+ * The epoch recorded by a thread at its last quiescent state
+ */
+typedef struct
+{
+    volatile unsigned long epoch;
+    char pad[EPOCH_CACHE_LINE - sizeof(unsigned long)];
+} EPOCH_THREAD;
+
+static EPOCH_THREAD *threads = NULL;           /*< The epochs of the threads */
+static int n_threads = 0;                      /*< No. of threads */
+static volatile unsigned long global_epoch = 0;
+static SPINLOCK retired_lock = SPINLOCK_INIT_NAMED("epoch retired");  /*< Protects the list of retired objects */
+static EPOCH_ENTRY *retired = NULL;            /*< The oldest retired object */
+static EPOCH_ENTRY *retired_tail = NULL;       /*< The newest retired object */
+static volatile unsigned long oldest_epoch = ULONG_MAX; /*< The epoch of the oldest object */
+static int n_retired = 0;                      /*< No. of retired objects */
+static thread_local bool reporting = false;    /*< The calling thread reports quiescent states */
+
+/**
+ * Initialise the reclamation for a number of threads. Until this is called
+ * the retired objects are reclaimed by the next call to epoch_quiescent.
+ *
+ * @param nthr  The number of threads that report quiescent states
+ */
+void
+epoch_init(int nthr)
+{
+    int i;
+
+    if ((threads = (EPOCH_THREAD *)calloc(nthr, sizeof(EPOCH_THREAD))) == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < nthr; i++)
+    {
+        threads[i].epoch = global_epoch;
+    }
+    n_threads = nthr;
+}
+
+/**
+ * Retire an object. The function is called once no thread can reference the
+ * object anymore, by a thread reporting a quiescent state. The function may
+ * retire the object again.
+ *
+ * @param entry The entry embedded in the object
+ * @param fn    The function to call
+ * @param data  Data passed to the function
+ */
+void
+epoch_retire(EPOCH_ENTRY *entry, void (*fn)(void *), void *data)
+{
+    entry->fn = fn;
+    entry->data = data;
+    entry->next = NULL;
+
+    spinlock_acquire(&retired_lock);
+    entry->epoch = ++global_epoch;
+    if (retired_tail)
+    {
+        retired_tail->next = entry;
+    }
+    else
+    {
+        retired = entry;
+        oldest_epoch = entry->epoch;
+    }
+    retired_tail = entry;
+    n_retired++;
+    spinlock_release(&retired_lock);
+}
+
+/**
+ * Find the smallest epoch recorded by the threads
+ *
+ * @return The epoch up to which all retired objects are unreferenced
+ */
+static unsigned long
+epoch_safe()
+{
+    unsigned long safe = ULONG_MAX;
+    int i;
+
+    for (i = 0; i < n_threads; i++)
+    {
+        unsigned long epoch = threads[i].epoch;
+
+        if (epoch < safe)
+        {
+            safe = epoch;
+        }
+    }
+    return safe;
+}
+
+/**
+ * Report a quiescent state of a thread and reclaim the objects that are no
+ * longer referenced. The calling thread must not hold references to retired
+ * objects.
+ *
+ * @param thread_id The ID of the calling thread
+ * @return          The number of objects reclaimed
+ */
+int
+epoch_quiescent(int thread_id)
+{
+    EPOCH_ENTRY *entry;
+    EPOCH_ENTRY *last = NULL;
+    unsigned long safe;
+    int n = 0;
+
+    if (thread_id >= 0 && thread_id < n_threads)
+    {
+        /** The references of this thread must be gone before the epoch is seen */
+        __sync_synchronize();
+        threads[thread_id].epoch = global_epoch;
+        reporting = true;
+    }
+
+    /** A dirty read avoids the lock when there is nothing to reclaim */
+    if (retired == NULL || oldest_epoch > (safe = epoch_safe()))
+    {
+        return 0;
+    }
+
+    spinlock_acquire(&retired_lock);
+    entry = retired;
+    while (retired && retired->epoch <= safe)
+    {
+        last = retired;
+        retired = retired->next;
+        n_retired--;
+        n++;
+    }
+    if (retired == NULL)
+    {
+        retired_tail = NULL;
+        oldest_epoch = ULONG_MAX;
+    }
+    else
+    {
+        oldest_epoch = retired->epoch;
+    }
+    if (last)
+    {
+        last->next = NULL;
+    }
+    else
+    {
+        entry = NULL;
+    }
+    spinlock_release(&retired_lock);
+
+    /** The functions are called without the lock, they may retire the object again */
+    while (entry)
+    {
+        EPOCH_ENTRY *next = entry->next;
+        entry->fn(entry->data);
+        entry = next;
+    }
+
+    return n;
+}
+
+/**
+ * Return the number of retired objects that have not yet been reclaimed
+ *
+ * @return The number of retired objects
+ */
+int
+epoch_pending()
+{
+    return n_retired;
+}
+
+/**
+ * Check whether the calling thread reports quiescent states. Such a thread can
+ * read objects that other threads retire without taking locks, as the objects
+ * are not reclaimed before the thread has passed its next quiescent state.
+ *
+ * @return True if the calling thread reports quiescent states
+ */
+bool
+epoch_reporting()
+{
+    return reporting;
+}
@@ -12,6 +12,23 @@
  */
 
 #include <externcmd.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <spinlock.h>
+#include <thread.h>
+
+/** How often the executor checks the running commands, in milliseconds */
+#define EXTERNCMD_POLL_MS 100
+
+extern char **environ;
+
+static SPINLOCK excmd_lock = SPINLOCK_INIT;
+static EXTERNCMD* excmd_queue = NULL;      /*< Commands waiting to be executed */
+static int excmd_queued = 0;               /*< Length of the queue */
+static bool excmd_started = false;         /*< Whether the executor thread runs */
+static THREAD excmd_thread;
+static EXTERNCMD* excmd_running[EXTERNCMD_RUNNING_MAX]; /*< Only used by the executor */
 
 /**
  * Tokenize a string into arguments suitable for a execvp call.
@@ -104,6 +121,11 @@ EXTERNCMD* externcmd_allocate(char* argstr)
     if (argstr && cmd && argv)
     {
         cmd->argv = argv;
+        cmd->n_exec = 0;
+        cmd->child = 0;
+        cmd->started = 0;
+        cmd->killed = false;
+        cmd->next = NULL;
         if (tokenize_arguments(argstr, cmd->argv) == 0)
         {
             if (access(cmd->argv[0], X_OK) != 0)
@@ -166,27 +188,217 @@ int externcmd_execute(EXTERNCMD* cmd)
 {
     int rval = 0;
     pid_t pid;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    int err;
 
-    pid = fork();
+    /** The child must not inherit the blocked or ignored signals of MaxScale */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGPIPE);
+    sigaddset(&sigs, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
 
-    if (pid < 0)
+    if ((err = posix_spawnp(&pid, cmd->argv[0], NULL, &attr, cmd->argv, environ)) != 0)
     {
         char errbuf[STRERROR_BUFLEN];
-        MXS_ERROR("Failed to execute command '%s', fork failed: [%d] %s",
-                  cmd->argv[0], errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        MXS_ERROR("Failed to execute command '%s': [%d] %s",
+                  cmd->argv[0], err, strerror_r(err, errbuf, sizeof(errbuf)));
         rval = -1;
     }
-    else if (pid == 0)
-    {
-        /** Child process, execute command */
-        execvp(cmd->argv[0], cmd->argv);
-        _exit(1);
-    }
     else
     {
         cmd->child = pid;
         cmd->n_exec++;
-        MXS_DEBUG("[monitor_exec_cmd] Forked child process %d : %s.", pid, cmd->argv[0]);
+        MXS_DEBUG("[monitor_exec_cmd] Spawned child process %d : %s.", pid, cmd->argv[0]);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    return rval;
+}
+
+/**
+ * Check whether two commands have the same arguments
+ * @param a First command
+ * @param b Second command
+ * @return True if the arguments are identical
+ */
+static bool externcmd_same_args(const EXTERNCMD* a, const EXTERNCMD* b)
+{
+    int i;
+
+    for (i = 0; a->argv[i] && b->argv[i]; i++)
+    {
+        if (strcmp(a->argv[i], b->argv[i]) != 0)
+        {
+            return false;
+        }
+    }
+
+    return a->argv[i] == NULL && b->argv[i] == NULL;
+}
+
+/**
+ * Check the running commands, free the finished ones and kill the ones that
+ * have exceeded the timeout. The SIGCHLD handler of MaxScale may reap the child
+ * before this function does, in which case waitpid fails with ECHILD.
+ */
+static void externcmd_check_running()
+{
+    time_t now = time(NULL);
+
+    for (int i = 0; i < EXTERNCMD_RUNNING_MAX; i++)
+    {
+        EXTERNCMD* cmd = excmd_running[i];
+
+        if (cmd == NULL)
+        {
+            continue;
+        }
+
+        int status;
+        pid_t rc = waitpid(cmd->child, &status, WNOHANG);
+
+        if (rc == 0)
+        {
+            if (!cmd->killed && now - cmd->started >= EXTERNCMD_TIMEOUT)
+            {
+                MXS_ERROR("Command '%s' did not finish in %d seconds, killing process %d.",
+                          cmd->argv[0], EXTERNCMD_TIMEOUT, cmd->child);
+                kill(cmd->child, SIGKILL);
+                cmd->killed = true;
+            }
+        }
+        else if (rc == cmd->child || (rc == -1 && errno == ECHILD))
+        {
+            if (rc == cmd->child && WIFEXITED(status) && WEXITSTATUS(status) != 0)
+            {
+                MXS_WARNING("Command '%s' exited with status %d.",
+                            cmd->argv[0], WEXITSTATUS(status));
+            }
+
+            excmd_running[i] = NULL;
+            externcmd_free(cmd);
+        }
+    }
+}
+
+/**
+ * Start queued commands until the concurrency limit is reached
+ */
+static void externcmd_start_queued()
+{
+    for (int i = 0; i < EXTERNCMD_RUNNING_MAX; i++)
+    {
+        if (excmd_running[i])
+        {
+            continue;
+        }
+
+        spinlock_acquire(&excmd_lock);
+        EXTERNCMD* cmd = excmd_queue;
+
+        if (cmd)
+        {
+            excmd_queue = cmd->next;
+            excmd_queued--;
+        }
+        spinlock_release(&excmd_lock);
+
+        if (cmd == NULL)
+        {
+            break;
+        }
+
+        cmd->next = NULL;
+
+        if (externcmd_execute(cmd) == 0)
+        {
+            cmd->started = time(NULL);
+            excmd_running[i] = cmd;
+        }
+        else
+        {
+            externcmd_free(cmd);
+        }
+    }
+}
+
+/**
+ * The thread that executes the queued commands
+ * @param data Unused
+ */
+static void externcmd_executor(void* data)
+{
+    while (true)
+    {
+        externcmd_check_running();
+        externcmd_start_queued();
+        thread_millisleep(EXTERNCMD_POLL_MS);
+    }
+}
+
+/**
+ * Queue a command for asynchronous execution. The command is started by a
+ * separate thread so that the caller never waits for the process. At most
+ * EXTERNCMD_RUNNING_MAX commands run at the same time and a command that runs
+ * longer than EXTERNCMD_TIMEOUT seconds is killed. A command identical to one
+ * that is still waiting in the queue is dropped, as the queued one already
+ * covers it.
+ *
+ * The queue takes the ownership of @c cmd, which must not be used after this call.
+ * @param cmd Command to execute
+ * @return True if the command was queued or an identical command was already queued,
+ * false if the queue is full or the executor could not be started
+ */
+bool externcmd_execute_async(EXTERNCMD* cmd)
+{
+    bool rval = true;
+    bool coalesced = false;
+
+    spinlock_acquire(&excmd_lock);
+
+    if (!excmd_started && thread_start(&excmd_thread, externcmd_executor, NULL) != NULL)
+    {
+        excmd_started = true;
+    }
+
+    if (!excmd_started || excmd_queued >= EXTERNCMD_QUEUE_MAX)
+    {
+        rval = false;
+    }
+    else
+    {
+        EXTERNCMD** tail = &excmd_queue;
+
+        while (*tail && !coalesced)
+        {
+            coalesced = externcmd_same_args(*tail, cmd);
+            tail = &(*tail)->next;
+        }
+
+        if (!coalesced)
+        {
+            cmd->next = NULL;
+            *tail = cmd;
+            excmd_queued++;
+        }
+    }
+
+    spinlock_release(&excmd_lock);
+
+    if (coalesced)
+    {
+        MXS_INFO("Command '%s' is already queued with the same arguments.", cmd->argv[0]);
+        externcmd_free(cmd);
+    }
+    else if (!rval)
+    {
+        MXS_ERROR("Cannot queue command '%s', %s.", cmd->argv[0], excmd_started ?
+                  "too many commands are waiting" : "failed to start the executor thread");
+        externcmd_free(cmd);
     }
 
     return rval;
@@ -19,6 +19,7 @@
  *
  * Date         Who                     Description
  * 29/05/14     Mark Riddoch            Initial implementation
+ * 15/10/16     Core Team               Result set of the statements tracked by the filters
  *
  * @endverbatim
  */
@@ -26,14 +27,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <filter.h>
 #include <session.h>
 #include <modules.h>
 #include <spinlock.h>
+#include <atomic.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 
-static SPINLOCK filter_spin = SPINLOCK_INIT;    /**< Protects the list of all filters */
+static SPINLOCK filter_spin = SPINLOCK_INIT_NAMED("filters");    /**< Protects the list of all filters */
 static FILTER_DEF *allFilters = NULL;           /**< The list of all filters */
 
 static void filter_free_parameters(FILTER_DEF *filter);
@@ -62,6 +65,7 @@ filter_alloc(char *name, char *module)
     filter->options = NULL;
     filter->obj = NULL;
     filter->parameters = NULL;
+    filter->n_sessions = 0;
 
     spinlock_init(&filter->spin);
 
@@ -274,6 +278,128 @@ dListFilters(DCB *dcb)
     spinlock_release(&filter_spin);
 }
 
+/**
+ * Write the metrics of the filters
+ *
+ * @param metrics       The output
+ */
+void
+filter_metrics(METRICS *metrics)
+{
+    FILTER_DEF *ptr;
+    char name[256], module[256];
+
+    metrics_header(metrics, "maxscale_filter_sessions_total", "counter",
+                   "Sessions the filter has been applied to");
+    spinlock_acquire(&filter_spin);
+    for (ptr = allFilters; ptr; ptr = ptr->next)
+    {
+        metrics_printf(metrics, "maxscale_filter_sessions_total{filter=\"%s\",module=\"%s\"} %d\n",
+                       metrics_label(ptr->name, name, sizeof(name)),
+                       metrics_label(ptr->module, module, sizeof(module)), ptr->n_sessions);
+    }
+    spinlock_release(&filter_spin);
+}
+
+/**
+ * Provide a row to the result set of the statements tracked by the filters.
+ * Only the filters whose module has the getStatements entry point have rows.
+ *
+ * @param set   The result set
+ * @param data  The index of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+filterStatementRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    int n = *rowno;
+    char buf[40];
+    RESULT_ROW *row;
+    FILTER_DEF *ptr;
+    FILTER_STATEMENT_STATS stats;
+
+    spinlock_acquire(&filter_spin);
+
+    for (ptr = allFilters; ptr; ptr = ptr->next)
+    {
+        if (ptr->obj && ptr->obj->getStatements && ptr->filter)
+        {
+            int n_stmts = ptr->obj->getStatements(ptr->filter, n, &stats);
+
+            if (n < n_stmts)
+            {
+                break;
+            }
+
+            n -= n_stmts;
+        }
+    }
+
+    if (ptr == NULL)
+    {
+        spinlock_release(&filter_spin);
+        free(data);
+        return NULL;
+    }
+    (*rowno)++;
+
+    row = resultset_make_row(set);
+    resultset_row_set(row, 0, ptr->name);
+    resultset_row_set(row, 1, stats.sql);
+    snprintf(buf, sizeof(buf), "%" PRIu64, stats.duration.count);
+    resultset_row_set(row, 2, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, stats.duration.sum);
+    resultset_row_set(row, 3, buf);
+    snprintf(buf, sizeof(buf), "%.0f", stats.duration.mean);
+    resultset_row_set(row, 4, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, stats.duration.p50);
+    resultset_row_set(row, 5, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, stats.duration.p90);
+    resultset_row_set(row, 6, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, stats.duration.p99);
+    resultset_row_set(row, 7, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, stats.duration.max);
+    resultset_row_set(row, 8, buf);
+    spinlock_release(&filter_spin);
+    return row;
+}
+
+/**
+ * Return a result set with the statements tracked by the filters. The
+ * execution times are in microseconds.
+ *
+ * @return A Result set
+ */
+RESULTSET *
+filterGetStatementList()
+{
+    RESULTSET *set;
+    int *data;
+
+    if ((data = (int *)malloc(sizeof(int))) == NULL)
+    {
+        return NULL;
+    }
+    *data = 0;
+    if ((set = resultset_create(filterStatementRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Filter", 25, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Statement", 80, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Count", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Total Time", 15, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Avg Time", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "P50", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "P90", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "P99", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Max Time", 10, COL_TYPE_VARCHAR);
+
+    return set;
+}
+
 /**
  * Add a router option to a service
  *
@@ -426,6 +552,7 @@ filterApply(FILTER_DEF *filter, SESSION *session, DOWNSTREAM *downstream)
         return NULL;
     }
     filter->obj->setDownstream(me->instance, me->session, downstream);
+    atomic_add(&filter->n_sessions, 1);
 
     return me;
 }
@@ -470,3 +597,19 @@ filterUpstream(FILTER_DEF *filter, void *fsession, UPSTREAM *upstream)
     }
     return me;
 }
+
+/**
+ * Get the packets a filter is interested in
+ *
+ * @param filter        The filter
+ * @return              The interest mask of the filter instance
+ */
+uint64_t
+filterInterest(FILTER_DEF *filter)
+{
+    if (filter->obj->getInterest == NULL)
+    {
+        return FILTER_INTEREST_ALL;
+    }
+    return filter->obj->getInterest(filter->filter);
+}
@@ -32,6 +32,9 @@
  * 29/06/14     Massimiliano Pinto      Addition of pidfile
  * 10/08/15     Markus Makela           Added configurable directory locations
  * 19/01/16     Markus Makela           Set cwd to log directory
+ * 15/10/16     Core Team               Added the --handoff option
+ * 15/10/16     Core Team               Sampled query tracing
+ * 15/10/16     Core Team               Memory accounting by subsystem
  * @endverbatim
  */
 #define _XOPEN_SOURCE 700
@@ -60,6 +63,8 @@
 #include <maxconfig.h>
 #include <maxscale/poll.h>
 #include <housekeeper.h>
+#include <handoff.h>
+#include <thread.h>
 #include <service.h>
 #include <memlog.h>
 
@@ -76,6 +81,8 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <query_classifier.h>
+#include <trace.h>
+#include <memstats.h>
 
 #include <execinfo.h>
 
@@ -140,11 +147,13 @@ static struct option long_options[] =
     {"syslog",           required_argument, 0, 's'},
     {"maxlog",           required_argument, 0, 'S'},
     {"log_augmentation", required_argument, 0, 'G'},
+    {"handoff",          no_argument,       0, 'H'},
     {"version",          no_argument,       0, 'v'},
     {"version-full",     no_argument,       0, 'V'},
     {"help",             no_argument,       0, '?'},
     {0, 0, 0, 0}
 };
+static bool handoff_requested = false;
 static bool syslog_configured = false;
 static bool maxlog_configured = false;
 static bool log_to_shm_configured = false;
@@ -156,6 +165,8 @@ static void log_flush_cb(void* arg);
 static int write_pid_file(); /* write MaxScale pidfile */
 static void unlink_pidfile(void); /* remove pidfile */
 static void unlock_pidfile();
+static void release_pidfile(void);
+static bool reacquire_pidfile(void);
 static void libmysqld_done(void);
 static bool file_write_header(FILE* outfile);
 static bool file_write_footer(FILE* outfile);
@@ -897,6 +908,7 @@ static void usage(void)
             "  -S, --maxlog=[yes|no]       log messages to MaxScale log (default: yes)\n"
             "  -G, --log_augmentation=0|1  augment messages with the name of the function\n"
             "                              where the message was logged (default: 0)\n"
+            "  -H, --handoff               take the listeners over from the running MaxScale\n"
             "  -v, --version               print version info and exit\n"
             "  -V, --version-full          print full version info and exit\n"
             "  -?, --help                  show this help\n"
@@ -1254,6 +1266,8 @@ int main(int argc, char **argv)
     sigset_t saved_mask;
     bool config_check = false;
     bool to_stdout = false;
+    bool handed_off = false;
+    char handoff_path[PATH_MAX + 1];
     void   (*exitfunp[4])(void) = { mxs_log_finish, cleanup_process_datadir, write_footer, NULL };
 
     *syslog_enabled = 1;
@@ -1294,7 +1308,7 @@ int main(int argc, char **argv)
         }
     }
 
-    while ((opt = getopt_long(argc, argv, "dcf:l:vVs:S:?L:D:C:B:U:A:P:G:N:E:",
+    while ((opt = getopt_long(argc, argv, "dcf:l:vVs:S:?L:D:C:B:U:A:P:G:N:E:H",
                               long_options, &option_index)) != -1)
     {
         bool succp = true;
@@ -1512,6 +1526,10 @@ int main(int argc, char **argv)
                 config_check = true;
                 break;
 
+            case 'H':
+                handoff_requested = true;
+                break;
+
             default:
                 usage();
                 succp = false;
@@ -1896,8 +1914,19 @@ int main(int argc, char **argv)
     }
     libmysql_initialized = TRUE;
 
+    snprintf(handoff_path, sizeof(handoff_path), "%s/%s", get_piddir(), HANDOFF_SOCKET_NAME);
+
+    /**
+     * The running MaxScale gives its listeners and the PID file over to this
+     * process and keeps running until its sessions have closed.
+     */
+    if (handoff_requested)
+    {
+        handed_off = handoff_receive(handoff_path);
+    }
+
     /** Check if a MaxScale process is already running */
-    if (pid_file_exists())
+    if (!handed_off && pid_file_exists())
     {
         /** There is a process with the PID of the maxscale.pid file running.
          * Assuming that this is an already running MaxScale process, we
@@ -1925,12 +1954,33 @@ int main(int argc, char **argv)
      */
     mysql_thread_init();
 
+    /**
+     * Bind the main thread to the CPUs of the auxiliary threads. The monitor,
+     * housekeeper and log flushing threads created below inherit the affinity,
+     * the polling threads bind themselves to their own CPUs.
+     */
+    if (config_auxiliary_threads_affinity())
+    {
+        cpu_set_t aux_cpus;
+        thread_parse_cpulist(config_auxiliary_threads_affinity(), &aux_cpus);
+        if (!thread_set_cpus(&aux_cpus))
+        {
+            MXS_ERROR("Failed to bind the auxiliary threads to the CPUs '%s'.",
+                      config_auxiliary_threads_affinity());
+        }
+    }
+
     /** Start all monitors */
     monitorStartAll();
 
     /** Start the services that were created above */
     n_services = serviceStartAll();
 
+    if (handed_off)
+    {
+        handoff_complete(n_services != 0);
+    }
+
     if (n_services == 0)
     {
         char* logerr = "Failed to start all MaxScale services. Exiting.";
@@ -1955,6 +2005,17 @@ int main(int argc, char **argv)
      * Start the housekeeper thread
      */
     hkinit();
+    memstats_init();
+
+    /** The shadow classifier only reports, MaxScale runs without it */
+    if (*cnf->qc_shadow_name &&
+        !qc_shadow_start(cnf->qc_shadow_name, cnf->qc_shadow_args,
+                         cnf->qc_shadow_sample, cnf->qc_shadow_threads))
+    {
+        MXS_ERROR("Failed to start the shadow query classifier '%s'.", cnf->qc_shadow_name);
+    }
+
+    trace_init(cnf->query_trace_sample);
 
     /*<
      * Start the polling threads, note this is one less than is
@@ -1977,6 +2038,12 @@ int main(int argc, char **argv)
         }
     }
 
+    if (!handoff_start(handoff_path, release_pidfile, reacquire_pidfile, shutdown_server))
+    {
+        MXS_WARNING("Failed to create the handoff socket, a new MaxScale can't take the "
+                    "listeners over from this process.");
+    }
+
     MXS_NOTICE("MaxScale started with %d server threads.", config_threadcount());
     /**
      * Successful start, notify the parent process that it can exit.
@@ -2012,6 +2079,7 @@ int main(int argc, char **argv)
     /** Release mysql thread context*/
     mysql_thread_end();
 
+    qc_shadow_stop();
     qc_end();
 
     utils_end();
@@ -2105,6 +2173,27 @@ static void unlock_pidfile()
     }
 }
 
+/**
+ * Give the PID file over to a new process, this process neither unlocks
+ * nor removes it at exit
+ */
+static void release_pidfile(void)
+{
+    unlock_pidfile();
+    pidfd = PIDFD_CLOSED;
+    pidfile[0] = '\0';
+}
+
+/**
+ * Take the PID file back after a new process failed to take it over
+ *
+ * @return True if the PID file was locked and written
+ */
+static bool reacquire_pidfile(void)
+{
+    return write_pid_file() == 0;
+}
+
 /**
  * Unlink pid file, called at program exit
  */
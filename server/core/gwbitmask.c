@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdbool.h>
 #include <gwbitmask.h>
 
 /**
@@ -27,16 +28,22 @@
  *
  * Please note limitations to these mechanisms:
  *
- * 1. The initial size and increment size MUST be exact multiples of 8
+ * 1. The initial size and increment size MUST be exact multiples of the
+ * bits in a word and the initial size a multiple of the increment size
  * 2. Only suitable for a compact set of bit numbers i.e. the numbering
  * needs to start near to 0 and grow without sizeable gaps
- * 3. It is assumed that a bit number bigger than the current size can
- * be accommodated by adding a single extra block of bits
- * 4. During copy, if memory cannot be allocated, a zero length bitmap is
- * created as the destination. This will test true for all bits clear, which
+ * 3. Bit numbers beyond BIT_MAX_BLOCKS increments are ignored: they are
+ * never set and always test clear
+ * 4. If memory cannot be allocated for the bits, they are not set. During
+ * copy, this can make the destination test true for all bits clear, which
  * may be a serious error. However, the memory requirement is very small and
  * is only likely to fail in circumstances where a lot else is going wrong.
  *
+ * The bits are set and cleared with atomic operations on the words that hold
+ * them and tested without locking. The blocks of bits are never moved or
+ * freed before bitmask_free, so only the growth of the bitmask, and copying
+ * to it, takes the lock.
+ *
  * @verbatim
  * Revision History
  *
@@ -46,38 +53,51 @@
  * 17/10/15     Martin Brampton     Added display of bitmask
  * 04/01/16     Martin Brampton     Changed bitmask_clear to not lock and return
  *                                  whether bitmask is clear; added bitmask_clear_with_lock.
+ * 15/10/2016   Core Team           Lock-free bit operations on words
  *
  * @endverbatim
  */
 
-static int bitmask_isset_without_spinlock(GWBITMASK *bitmask, int bit);
 static int bitmask_count_bits_set(GWBITMASK *bitmask);
+static bool bitmask_grow(GWBITMASK *bitmask, int length);
 
-static const unsigned char bitmapclear[8] =
+/**
+ * Return the word that holds a bit
+ *
+ * @param bitmask       Pointer the bitmask
+ * @param bit           The bit, must be less than the length of the bitmask
+ * @return              Pointer to the word
+ */
+static inline unsigned long *
+bitmask_word(GWBITMASK *bitmask, int bit)
 {
-    255 - 1, 255 - 2, 255 - 4, 255 - 8, 255 - 16, 255 - 32, 255 - 64, 255 - 128
-};
-static const unsigned char bitmapset[8] =
+    return &bitmask->blocks[bit / BIT_LENGTH_INC][(bit % BIT_LENGTH_INC) / BITMASK_WORD_BITS];
+}
+
+/**
+ * Return the mask of a bit in its word
+ *
+ * @param bit           The bit
+ * @return              The mask
+ */
+static inline unsigned long
+bitmask_bit(int bit)
 {
-    1, 2, 4, 8, 16, 32, 64, 128
-};
+    return 1UL << (bit % BITMASK_WORD_BITS);
+}
 
 /**
  * Initialise a bitmask
  *
  * @param bitmask       Pointer the bitmask
- * @return              The value of *variable before the add occurred
  */
 void
 bitmask_init(GWBITMASK *bitmask)
 {
-    bitmask->length = BIT_LENGTH_INITIAL;
-    bitmask->size = bitmask->length / 8;
-    if ((bitmask->bits = calloc(bitmask->size, 1)) == NULL)
-    {
-        bitmask->length = bitmask->size = 0;
-    }
+    memset(bitmask->blocks, 0, sizeof(bitmask->blocks));
+    bitmask->length = bitmask->size = 0;
     spinlock_init(&bitmask->lock);
+    bitmask_grow(bitmask, BIT_LENGTH_INITIAL);
 }
 
 /**
@@ -88,19 +108,49 @@ bitmask_init(GWBITMASK *bitmask)
 void
 bitmask_free(GWBITMASK *bitmask)
 {
-    if (bitmask->length)
+    for (int i = 0; i < BIT_MAX_BLOCKS; i++)
+    {
+        free(bitmask->blocks[i]);
+        bitmask->blocks[i] = NULL;
+    }
+    bitmask->length = bitmask->size = 0;
+}
+
+/**
+ * Extend a bitmask to at least a length. The new blocks are published before
+ * the length so that a thread that sees the length also sees the blocks.
+ *
+ * @param bitmask       Pointer the bitmask
+ * @param length        The number of bits required
+ * @return              True if the bitmask has at least the length
+ */
+static bool
+bitmask_grow(GWBITMASK *bitmask, int length)
+{
+    spinlock_acquire(&bitmask->lock);
+    while (bitmask->length < length && bitmask->length / BIT_LENGTH_INC < BIT_MAX_BLOCKS)
     {
-        free(bitmask->bits);
-        bitmask->length = bitmask->size = 0;
+        int block = bitmask->length / BIT_LENGTH_INC;
+
+        if (bitmask->blocks[block] == NULL &&
+            (bitmask->blocks[block] = calloc(BITMASK_BLOCK_WORDS, sizeof(unsigned long))) == NULL)
+        {
+            break;
+        }
+        __sync_synchronize();
+        bitmask->length += BIT_LENGTH_INC;
+        bitmask->size += BIT_LENGTH_INC / 8;
     }
+    spinlock_release(&bitmask->lock);
+
+    return bitmask->length >= length;
 }
 
 /**
  * Set the bit at the specified bit position in the bitmask.
  * The bitmask will automatically be extended if the bit is
- * beyond the current bitmask length. Note that growth is only
- * by a single increment - the bit numbers used need to be a
- * fairly dense set.
+ * beyond the current bitmask length. Note that the bit numbers
+ * used need to be a fairly dense set.
  *
  * @param bitmask       Pointer the bitmask
  * @param bit           Bit to set
@@ -108,36 +158,18 @@ bitmask_free(GWBITMASK *bitmask)
 void
 bitmask_set(GWBITMASK *bitmask, int bit)
 {
-    unsigned char *ptr = bitmask->bits;
-
-    spinlock_acquire(&bitmask->lock);
-    if (bit >= 8)
+    if (bit < bitmask->length || bitmask_grow(bitmask, bit + 1))
     {
-        while (bit >= bitmask->length)
-        {
-            bitmask->bits = realloc(bitmask->bits,
-                                    (bitmask->size + (BIT_LENGTH_INC / 8)));
-            memset(bitmask->bits + (bitmask->size), 0,
-                   BIT_LENGTH_INC / 8);
-            bitmask->length += BIT_LENGTH_INC;
-            bitmask->size += (BIT_LENGTH_INC / 8);
-        }
-
-        ptr += (bit / 8);
-        bit = bit % 8;
+        __sync_fetch_and_or(bitmask_word(bitmask, bit), bitmask_bit(bit));
     }
-    *ptr |= bitmapset[bit];
-    spinlock_release(&bitmask->lock);
 }
 
 /**
  * Clear the bit at the specified bit position in the bitmask.
  * Bits beyond the bitmask length are always assumed to be clear, so no
  * action is needed if the bit parameter is beyond the length.
- * Note that this function does not lock the bitmask, but assumes that
- * it is under the exclusive control of the caller.  If you want to use the
- * bitmask spinlock to protect access while clearing the bit, then call
- * the alternative bitmask_clear.
+ * The bit is cleared atomically, the name remains from the time when
+ * bitmask_clear took the lock and this function did not.
  *
  * @param bitmask       Pointer the bitmask
  * @param bit           Bit to clear
@@ -146,31 +178,15 @@ bitmask_set(GWBITMASK *bitmask, int bit)
 int
 bitmask_clear_without_spinlock(GWBITMASK *bitmask, int bit)
 {
-    unsigned char *ptr = bitmask->bits;
-    int i;
-
     if (bit < bitmask->length)
     {
-        if (bit >= 8)
-        {
-            ptr += (bit / 8);
-            bit = bit % 8;
-        }
-        *ptr &= bitmapclear[bit];
+        __sync_fetch_and_and(bitmask_word(bitmask, bit), ~bitmask_bit(bit));
     }
-    ptr = bitmask->bits;
-    for (i = 0; i < bitmask->size; i++)
-    {
-        if (*(ptr + i) != 0)
-        {
-            return 0;
-        }
-    }
-    return 1;
+    return bitmask_isallclear(bitmask);
 }
 
 /**
- * Clear the bit at the specified bit position in the bitmask using a spinlock.
+ * Clear the bit at the specified bit position in the bitmask.
  * See bitmask_clear_without_spinlock for more details
  *
  * @param bitmask       Pointer the bitmask
@@ -180,19 +196,13 @@ bitmask_clear_without_spinlock(GWBITMASK *bitmask, int bit)
 int
 bitmask_clear(GWBITMASK *bitmask, int bit)
 {
-    int result;
-
-    spinlock_acquire(&bitmask->lock);
-    result = bitmask_clear_without_spinlock(bitmask, bit);
-    spinlock_release(&bitmask->lock);
-    return result;
+    return bitmask_clear_without_spinlock(bitmask, bit);
 }
 
 /**
  * Return a non-zero value if the bit at the specified bit
  * position in the bitmask is set. If the specified bit is outside the
  * bitmask, it is assumed to be unset; the bitmask is not extended.
- * This function wraps bitmask_isset_without_spinlock with a spinlock.
  *
  * @param bitmask       Pointer the bitmask
  * @param bit           Bit to test
@@ -200,39 +210,11 @@ bitmask_clear(GWBITMASK *bitmask, int bit)
 int
 bitmask_isset(GWBITMASK *bitmask, int bit)
 {
-    int result;
-
-    spinlock_acquire(&bitmask->lock);
-    result = bitmask_isset_without_spinlock(bitmask, bit);
-    spinlock_release(&bitmask->lock);
-    return result;
-}
-
-/**
- * Return a non-zero value if the bit at the specified bit
- * position in the bitmask is set.  Should be called while holding a
- * lock on the bitmask or having control of it in some other way.
- *
- * Bits beyond the current length are deemed unset.
- *
- * @param bitmask       Pointer the bitmask
- * @param bit           Bit to test
- */
-static int
-bitmask_isset_without_spinlock(GWBITMASK *bitmask, int bit)
-{
-    unsigned char *ptr = bitmask->bits;
-
     if (bit >= bitmask->length)
     {
         return 0;
     }
-    if (bit >= 8)
-    {
-        ptr += (bit / 8);
-        bit = bit % 8;
-    }
-    return *ptr & bitmapset[bit];
+    return (*(volatile unsigned long *)bitmask_word(bitmask, bit) & bitmask_bit(bit)) != 0;
 }
 
 /**
@@ -247,30 +229,30 @@ bitmask_isset_without_spinlock(GWBITMASK *bitmask, int bit)
 int
 bitmask_isallclear(GWBITMASK *bitmask)
 {
-    unsigned char *ptr = bitmask->bits;
-    int i;
-    int result = 1;
+    int blocks = bitmask->length / BIT_LENGTH_INC;
 
-    spinlock_acquire(&bitmask->lock);
-    for (i = 0; i < bitmask->size; i++)
+    for (int i = 0; i < blocks; i++)
     {
-        if (*(ptr + i) != 0)
+        volatile unsigned long *words = bitmask->blocks[i];
+
+        for (int j = 0; j < BITMASK_BLOCK_WORDS; j++)
         {
-            result = 0;
-            break;
+            if (words[j] != 0)
+            {
+                return 0;
+            }
         }
     }
-    spinlock_release(&bitmask->lock);
-
-    return result;
+    return 1;
 }
 
 /**
- * Copy the contents of one bitmap to another.
+ * Copy the contents of one bitmap to another. The blocks of the destination
+ * are reused so that threads using it are not left with freed memory.
  *
- * On memory failure, a zero length bitmask is created in the destination,
- * which could seriously undermine the logic.  Given the small size of the
- * bitmask, this is unlikely to happen.
+ * On memory failure, the destination is shorter than the source, which could
+ * seriously undermine the logic.  Given the small size of the bitmask, this
+ * is unlikely to happen.
  *
  * @param dest  Bitmap tp update
  * @param src   Bitmap to copy
@@ -278,24 +260,22 @@ bitmask_isallclear(GWBITMASK *bitmask)
 void
 bitmask_copy(GWBITMASK *dest, GWBITMASK *src)
 {
-    spinlock_acquire(&src->lock);
+    int length = src->length;
+    int blocks;
+
+    bitmask_grow(dest, length);
+    blocks = dest->length / BIT_LENGTH_INC;
+
     spinlock_acquire(&dest->lock);
-    if (dest->length)
-    {
-        free(dest->bits);
-    }
-    if ((dest->bits = malloc(src->size)) == NULL)
-    {
-        dest->length = 0;
-    }
-    else
+    for (int i = 0; i < blocks; i++)
     {
-        dest->length = src->length;
-        dest->size = src->size;
-        memcpy(dest->bits, src->bits, src->size);
+        for (int j = 0; j < BITMASK_BLOCK_WORDS; j++)
+        {
+            dest->blocks[i][j] = i * BIT_LENGTH_INC < length ?
+                                 ((volatile unsigned long *)src->blocks[i])[j] : 0;
+        }
     }
     spinlock_release(&dest->lock);
-    spinlock_release(&src->lock);
 }
 
 /**
@@ -316,9 +296,9 @@ bitmask_render_readable(GWBITMASK *bitmask)
     char onebit[5];
     char *result;
     int count_set = 0;
+    int length = bitmask->length;
 
-    spinlock_acquire(&bitmask->lock);
-    if (999 < bitmask->length)
+    if (999 < length)
     {
         result = malloc(sizeof(toobig));
         if (result)
@@ -335,15 +315,20 @@ bitmask_render_readable(GWBITMASK *bitmask)
             if (result)
             {
                 result[0] = 0;
-                for (int i = 0; i < bitmask->length; i++)
+                /** Bits set after counting are left out to stay within the string */
+                for (int i = 0; i < length && count_set > 0; i++)
                 {
-                    if (bitmask_isset_without_spinlock(bitmask, i))
+                    if (bitmask_isset(bitmask, i))
                     {
                         sprintf(onebit, "%d,", i);
                         strcat(result, onebit);
+                        count_set--;
                     }
                 }
-                result[strlen(result) - 1] = 0;
+                if (result[0])
+                {
+                    result[strlen(result) - 1] = 0;
+                }
             }
         }
         else
@@ -355,7 +340,6 @@ bitmask_render_readable(GWBITMASK *bitmask)
             }
         }
     }
-    spinlock_release(&bitmask->lock);
     return result;
 }
 
@@ -369,19 +353,17 @@ bitmask_render_readable(GWBITMASK *bitmask)
 static int
 bitmask_count_bits_set(GWBITMASK *bitmask)
 {
-    const unsigned char oneBits[] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
-    unsigned char partresults;
+    int blocks = bitmask->length / BIT_LENGTH_INC;
     int result = 0;
-    unsigned char *ptr, *eptr;
 
-    ptr = bitmask->bits;
-    eptr = ptr + (bitmask->length / 8);
-    while (ptr < eptr)
+    for (int i = 0; i < blocks; i++)
     {
-        partresults = oneBits[*ptr & 0x0f];
-        partresults += oneBits[*ptr >> 4];
-        result += partresults;
-        ptr++;
+        volatile unsigned long *words = bitmask->blocks[i];
+
+        for (int j = 0; j < BITMASK_BLOCK_WORDS; j++)
+        {
+            result += __builtin_popcountl(words[j]);
+        }
     }
     return result;
 }
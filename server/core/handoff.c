@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file handoff.c  - Handing the listening sockets over to a new process
+ *
+ * The processes talk over a SOCK_SEQPACKET socket so that every message is
+ * received as a whole. The new process sends HANDOFF_REQUEST, the old process
+ * answers with one message per listener, holding the address the listener was
+ * started with and the listening socket as SCM_RIGHTS ancillary data, and ends
+ * the list with an empty message. The new process sends HANDOFF_READY once its
+ * services have been started.
+ */
+
+#include <handoff.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <service.h>
+#include <dcb.h>
+#include <thread.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+#define HANDOFF_REQUEST "HANDOFF"
+#define HANDOFF_READY   "READY"
+
+/** Maximum length of a listener address */
+#define HANDOFF_BIND_MAX (PATH_MAX + 40)
+
+/** A listening socket received from the old process */
+typedef struct handoff_listener
+{
+    char *bind;                     /*< The address the listener was started with */
+    int fd;                         /*< The listening socket */
+    struct handoff_listener *next;
+} HANDOFF_LISTENER;
+
+/** The listeners not yet taken by the services, only used by the main thread */
+static HANDOFF_LISTENER *handoff_listeners = NULL;
+/** Connection to the old process until the services have been started */
+static int handoff_conn = -1;
+
+static int handoff_sock = -1;
+static void (*handoff_release)(void) = NULL;
+static bool (*handoff_acquire)(void) = NULL;
+static void (*handoff_shutdown)(void) = NULL;
+static THREAD handoff_thr;
+
+/**
+ * Send one message, optionally with a file descriptor
+ *
+ * @param sock  The socket
+ * @param str   The message
+ * @param fd    The file descriptor or -1
+ * @return True if the message was sent
+ */
+static bool
+handoff_send(int sock, const char *str, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)str;
+    iov.iov_len = strlen(str) + 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0)
+    {
+        struct cmsghdr *cmsg;
+
+        memset(cbuf, 0, sizeof(cbuf));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)iov.iov_len;
+}
+
+/**
+ * Receive one message and the file descriptor sent with it
+ *
+ * @param sock  The socket
+ * @param dest  Where the message is stored
+ * @param size  Size of @c dest
+ * @param fd    Where the file descriptor is stored, -1 if none was sent
+ * @return True if a complete message was received
+ */
+static bool
+handoff_recv(int sock, char *dest, size_t size, int *fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = dest;
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    *fd = -1;
+
+    do
+    {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    }
+    while (n < 0 && errno == EINTR);
+
+    for (cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if (n <= 0 || (msg.msg_flags & MSG_TRUNC) || dest[n - 1] != '\0')
+    {
+        if (*fd >= 0)
+        {
+            close(*fd);
+            *fd = -1;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Fill in the address of the handoff socket
+ *
+ * @param addr  The address
+ * @param path  Path of the socket
+ * @return True if the path fits in the address
+ */
+static bool
+handoff_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        MXS_ERROR("The path of the handoff socket '%s' is too long.", path);
+        return false;
+    }
+
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+/**
+ * Receive the listening sockets from the running MaxScale. The services take
+ * them with handoff_take_listener when they start their listeners.
+ *
+ * @param path  Path of the handoff socket of the running MaxScale
+ * @return True if the listeners were received
+ */
+bool
+handoff_receive(const char *path)
+{
+    struct sockaddr_un addr;
+    char bind[HANDOFF_BIND_MAX];
+    int sock, fd, n = 0;
+
+    if (!handoff_addr(&addr, path))
+    {
+        return false;
+    }
+
+    if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0 ||
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to connect to the running MaxScale at '%s': %d, %s",
+                  path, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        if (sock >= 0)
+        {
+            close(sock);
+        }
+        return false;
+    }
+
+    if (!handoff_send(sock, HANDOFF_REQUEST, -1))
+    {
+        MXS_ERROR("Failed to request the listeners of the running MaxScale.");
+        close(sock);
+        return false;
+    }
+
+    while (handoff_recv(sock, bind, sizeof(bind), &fd))
+    {
+        HANDOFF_LISTENER *listener;
+
+        if (*bind == '\0')
+        {
+            /** The end of the listeners */
+            handoff_conn = sock;
+            MXS_NOTICE("Received %d listening sockets from the running MaxScale.", n);
+            return true;
+        }
+
+        if (fd < 0 || (listener = malloc(sizeof(HANDOFF_LISTENER))) == NULL ||
+            (listener->bind = strdup(bind)) == NULL)
+        {
+            MXS_ERROR("Failed to receive the listener '%s' from the running MaxScale.", bind);
+            if (fd >= 0)
+            {
+                close(fd);
+                free(listener);
+            }
+            continue;
+        }
+
+        listener->fd = fd;
+        listener->next = handoff_listeners;
+        handoff_listeners = listener;
+        n++;
+    }
+
+    MXS_ERROR("The running MaxScale closed the handoff connection before "
+              "sending all of its listeners.");
+    close(sock);
+    handoff_complete(false);
+    return false;
+}
+
+/**
+ * Take a listening socket received from the old process
+ *
+ * @param bind  The address of the listener
+ * @return The listening socket or -1 if no socket was received for the address
+ */
+int
+handoff_take_listener(const char *bind)
+{
+    for (HANDOFF_LISTENER **prev = &handoff_listeners; *prev; prev = &(*prev)->next)
+    {
+        HANDOFF_LISTENER *listener = *prev;
+
+        if (strcmp(listener->bind, bind) == 0)
+        {
+            int fd = listener->fd;
+            *prev = listener->next;
+            free(listener->bind);
+            free(listener);
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Tell the old process that the services have been started and close the
+ * listening sockets that were not taken by any service.
+ *
+ * @param success       Whether the services were started
+ */
+void
+handoff_complete(bool success)
+{
+    while (handoff_listeners)
+    {
+        HANDOFF_LISTENER *listener = handoff_listeners;
+
+        handoff_listeners = listener->next;
+        MXS_WARNING("The listener '%s' of the previous MaxScale is not configured, closing it.",
+                    listener->bind);
+        close(listener->fd);
+        free(listener->bind);
+        free(listener);
+    }
+
+    if (handoff_conn >= 0)
+    {
+        if (success && !handoff_send(handoff_conn, HANDOFF_READY, -1))
+        {
+            MXS_ERROR("Failed to tell the previous MaxScale that the services have started.");
+        }
+        close(handoff_conn);
+        handoff_conn = -1;
+    }
+}
+
+/**
+ * Send one listener to the new process
+ *
+ * @param bind  The address of the listener
+ * @param fd    The listening socket
+ * @param data  The connection to the new process
+ */
+static void
+handoff_send_listener(const char *bind, int fd, void *data)
+{
+    if (!handoff_send(*(int *)data, bind, fd))
+    {
+        MXS_ERROR("Failed to send the listener '%s' to the new MaxScale.", bind);
+    }
+}
+
+/**
+ * Take the PID file back after the new process failed to start. The new
+ * process may still hold the lock on it for a moment while it exits.
+ */
+static void
+handoff_reacquire(void)
+{
+    for (int i = 0; i < HANDOFF_ACQUIRE_RETRIES; i++)
+    {
+        if (i > 0)
+        {
+            thread_millisleep(500);
+        }
+
+        if (handoff_acquire())
+        {
+            MXS_NOTICE("Took the PID file back from the new MaxScale.");
+            return;
+        }
+    }
+
+    MXS_ERROR("Failed to take the PID file back from the new MaxScale, "
+              "this process continues without one.");
+}
+
+/**
+ * Serve a handoff request
+ *
+ * @param conn  Connection to the new process
+ * @return True if the new process started its services
+ */
+static bool
+handoff_serve(int conn)
+{
+    char buf[HANDOFF_BIND_MAX];
+    int fd, n;
+
+    if (!handoff_recv(conn, buf, sizeof(buf), &fd) || strcmp(buf, HANDOFF_REQUEST) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    n = serviceForEachListener(handoff_send_listener, &conn);
+    MXS_NOTICE("Sent %d listening sockets to a new MaxScale process.", n);
+
+    /** The new process takes the PID file over before it starts its services */
+    handoff_release();
+
+    if (!handoff_send(conn, "", -1))
+    {
+        MXS_ERROR("Failed to send the listeners to the new MaxScale.");
+        handoff_reacquire();
+        return false;
+    }
+
+    if (!handoff_recv(conn, buf, sizeof(buf), &fd) || strcmp(buf, HANDOFF_READY) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        MXS_ERROR("The new MaxScale failed to start its services, this process continues "
+                  "to accept the connections.");
+        handoff_reacquire();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * The thread that waits for a new process and drains the sessions once the
+ * listeners have been handed over
+ *
+ * @param data Unused
+ */
+static void
+handoff_main(void *data)
+{
+    int conn;
+    bool done = false;
+
+    while (!done)
+    {
+        if ((conn = accept(handoff_sock, NULL, NULL)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to accept a connection to the handoff socket: %d, %s",
+                      errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+            return;
+        }
+
+        done = handoff_serve(conn);
+        close(conn);
+    }
+
+    close(handoff_sock);
+    handoff_sock = -1;
+
+    int listeners = serviceStopAll();
+    int sessions = dcb_count_by_usage(DCB_USAGE_CLIENT);
+    MXS_NOTICE("The new MaxScale has started, stopped %d listeners and waiting for "
+               "%d client sessions to close.", listeners, sessions);
+
+    for (int i = 0; i < HANDOFF_DRAIN_TIMEOUT && sessions > 0; i++)
+    {
+        thread_millisleep(1000);
+        sessions = dcb_count_by_usage(DCB_USAGE_CLIENT);
+    }
+
+    if (sessions > 0)
+    {
+        MXS_WARNING("%d client sessions still open after %d seconds, shutting down anyway.",
+                    sessions, HANDOFF_DRAIN_TIMEOUT);
+    }
+    else
+    {
+        MXS_NOTICE("All client sessions have closed, shutting down.");
+    }
+
+    handoff_shutdown();
+}
+
+/**
+ * Start waiting for a new MaxScale process to hand the listeners to
+ *
+ * @param path      Path of the handoff socket
+ * @param release   Called to release the PID file for the new process
+ * @param acquire   Called to lock and write the PID file again if the new
+ *                  process fails, returns true on success
+ * @param shutdown  Called to shut this process down once the sessions have closed
+ * @return True if the handoff socket was created
+ */
+bool
+handoff_start(const char *path, void (*release)(void), bool (*acquire)(void),
+              void (*shutdown)(void))
+{
+    struct sockaddr_un addr;
+    char errbuf[STRERROR_BUFLEN];
+
+    if (!handoff_addr(&addr, path))
+    {
+        return false;
+    }
+
+    if ((handoff_sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+    {
+        MXS_ERROR("Failed to create the handoff socket: %d, %s",
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        return false;
+    }
+
+    /** The socket left by a previous process */
+    unlink(path);
+
+    if (bind(handoff_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        chmod(path, S_IRUSR | S_IWUSR) != 0 || listen(handoff_sock, 1) != 0)
+    {
+        MXS_ERROR("Failed to listen on the handoff socket '%s': %d, %s",
+                  path, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        close(handoff_sock);
+        handoff_sock = -1;
+        return false;
+    }
+
+    handoff_release = release;
+    handoff_acquire = acquire;
+    handoff_shutdown = shutdown;
+
+    if (thread_start(&handoff_thr, handoff_main, NULL) == NULL)
+    {
+        MXS_ERROR("Failed to start the handoff thread.");
+        close(handoff_sock);
+        handoff_sock = -1;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file hash.c  - Seeded hashing of keys
+ *
+ * The construction follows wyhash: the words of the key are combined with the
+ * seed and a set of odd constants and folded with the two halves of their
+ * 128-bit product. The keys of up to 16 bytes are read with at most four
+ * overlapping loads and no loop.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 15/10/2016   Core Team       Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <hash.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+#define HASH_P3 0x589965cc75374cc3ULL
+
+static uint64_t process_seed;
+static pthread_once_t process_seed_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Fold the 128-bit product of two words into one word
+ */
+static inline uint64_t
+hash_mix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t
+hash_read64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t
+hash_read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * Hash a key
+ *
+ * @param data  The key
+ * @param len   The length of the key in bytes
+ * @param seed  The seed, usually hash_seed()
+ * @return The hash of the key
+ */
+uint64_t
+hash_bytes(const void *data, size_t len, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t a, b;
+
+    seed ^= HASH_P0;
+
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            size_t mid = (len >> 3) << 2;
+
+            a = (hash_read32(p) << 32) | hash_read32(p + mid);
+            b = (hash_read32(p + len - 4) << 32) | hash_read32(p + len - 4 - mid);
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t left = len;
+
+        if (left > 48)
+        {
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+
+            /** The lanes do not depend on each other and their multiplications overlap */
+            do
+            {
+                seed = hash_mix(hash_read64(p) ^ HASH_P1, hash_read64(p + 8) ^ seed);
+                seed1 = hash_mix(hash_read64(p + 16) ^ HASH_P2, hash_read64(p + 24) ^ seed1);
+                seed2 = hash_mix(hash_read64(p + 32) ^ HASH_P3, hash_read64(p + 40) ^ seed2);
+                p += 48;
+                left -= 48;
+            }
+            while (left > 48);
+            seed ^= seed1 ^ seed2;
+        }
+
+        while (left > 16)
+        {
+            seed = hash_mix(hash_read64(p) ^ HASH_P1, hash_read64(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+
+        /** The last 16 bytes of the key, overlapping the bytes already mixed */
+        a = hash_read64(p + left - 16);
+        b = hash_read64(p + left - 8);
+    }
+
+    return hash_mix(HASH_P1 ^ len, hash_mix(a ^ HASH_P1, b ^ seed));
+}
+
+/**
+ * Choose the seed of the process from /dev/urandom, or from the clock and the
+ * process ID if it cannot be read
+ */
+static void
+hash_init_seed(void)
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd == -1 || read(fd, &process_seed, sizeof(process_seed)) != sizeof(process_seed))
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        process_seed = hash_mix(((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^ HASH_P2,
+                                (uint64_t)getpid() ^ HASH_P3);
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+/**
+ * Return the seed of the hash tables of the process. The seed is chosen on
+ * the first call and stays the same for the lifetime of the process.
+ *
+ * @return The seed
+ */
+uint64_t
+hash_seed(void)
+{
+    pthread_once(&process_seed_once, hash_init_seed);
+    return process_seed;
+}
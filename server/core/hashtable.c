@@ -17,7 +17,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
 #include <hashtable.h>
+#include <epoch.h>
 
 /**
  * @file hashtable.c General purpose hashtable routines
@@ -26,13 +29,11 @@
  * a hash function and optional functions to call make copies of the key
  * and value and to free them.
  *
- * The hashtable is arrange as a set of linked lists, the number of linked
- * lists being the hashsize as requested by the user. Entries are hashed by
- * calling the hash function that is passed in by the user, this is used as
- * an index into the array of linked lists, usign modulo hashsize.
- *
- * The linked lists are searched using the key comparison function that is
- * passed into the hash table creation routine.
+ * The entries are kept in an array of slots that is searched with linear
+ * probing from the slot selected by the hash of the key. A deleted entry leaves
+ * a marker in its slot so that the searches for the keys stored after it still
+ * reach them. The keys are compared with the key comparison function that is
+ * passed into the hash table creation routine, and only when the hashes match.
  *
  * By default the hash table keeps the original pointers that are passed in
  * for the keys and values, however two functions can be supplied to copy these
@@ -40,10 +41,22 @@
  * the key and the value, if the actions required are different the called functions
  * must understand how to differenate the key and value.
  *
- * The hash table implements a single write, multiple reader locking policy by
- * using a pair of counters and a spinlock. The spinlock is used to protect the
- * number of readers and writers counters when taking out locks. Releasing of
- * locks uses pure atomic actions and thus does not require spinlock protection.
+ * The writers lock one of HASHTABLE_STRIPES spinlocks, selected by the hash of
+ * the key, so the operations on the same key are serialised while those on
+ * other keys proceed in parallel. The writers claim free slots with an atomic
+ * compare and swap, since the probe sequences of keys of different stripes
+ * overlap.
+ *
+ * A thread that reports quiescent states to the epoch reclamation reads the
+ * table without taking any locks. Once such a read has been done, the deleted
+ * keys and values and the replaced slot arrays are retired instead of being
+ * freed immediately. Other threads lock the stripe of the key they look up.
+ *
+ * When the slots fill up a new array is allocated and the entries are moved to
+ * it a few slots at a time by the writers, so that no single operation has to
+ * rehash the whole table. While the entries are moved both arrays are searched,
+ * the old one first as the entries are copied to the new array before they are
+ * removed from the old one.
  *
  * @verbatim
  * Revision History
@@ -59,14 +72,60 @@
  * @endverbatim
  */
 
-static  void hashtable_read_lock(HASHTABLE *table);
-static  void hashtable_read_unlock(HASHTABLE *table);
-static  void hashtable_write_lock(HASHTABLE *table);
-static  void hashtable_write_unlock(HASHTABLE *table);
+/** The key of a slot that has never been used */
+#define HASHTABLE_EMPTY    NULL
+/** The key of a slot whose entry has been deleted */
+#define HASHTABLE_DELETED  ((void *)1)
+/** The key of a slot claimed by a writer that has not yet stored the entry */
+#define HASHTABLE_RESERVED ((void *)2)
+
+#define HASHTABLE_IS_KEY(k) ((uintptr_t)(k) > (uintptr_t)HASHTABLE_RESERVED)
+
+/** The smallest number of slots of a table */
+#define HASHTABLE_MIN_SLOTS 8
+
+/** The number of slots moved to the new array by each write during a resize */
+#define HASHTABLE_MIGRATE 16
+
+/**
+ * A slot of the table. The key is stored last, so a reader that sees the key
+ * also sees the hash and the value.
+ */
+typedef struct
+{
+    void * volatile       key;
+    void * volatile       value;
+    volatile unsigned int hash;
+} HASHSLOT;
+
+/**
+ * An array of slots
+ */
+typedef struct hashslots
+{
+    EPOCH_ENTRY  entry;    /*< Used to retire the array after a resize */
+    unsigned int mask;     /*< The number of slots minus one */
+    int          used;     /*< No. of slots that are not empty */
+    HASHSLOT     slot[];
+} HASHSLOTS;
+
+/**
+ * A deleted entry that may still be read by lock-free readers
+ */
+typedef struct
+{
+    EPOCH_ENTRY  entry;
+    HASHMEMORYFN kfreefn;
+    HASHMEMORYFN vfreefn;
+    void         *key;
+    void         *value;
+} HASHTABLE_RETIRED;
+
 static HASHTABLE *hashtable_alloc_real(HASHTABLE* target,
                                        int size,
                                        int (*hashfn)(),
                                        int (*cmpfn)());
+static void hashtable_migrate(HASHTABLE *table, int count);
 
 /**
  * Special null function used as default memory allfunctions in the hashtable
@@ -108,6 +167,383 @@ HASHTABLE* hashtable_alloc_flat(HASHTABLE* target,
     return hashtable_alloc_real(target, size, hashfn, cmpfn);
 }
 
+/**
+ * Mix the bits of a hash, the linear probing needs the low bits of the hashes
+ * of similar keys to differ
+ *
+ * @param table The hash table
+ * @param key   The key
+ * @return      The hash of the key
+ */
+static unsigned int
+hashtable_hash(HASHTABLE *table, void *key)
+{
+    unsigned int hash = (unsigned int)table->hashfn(key);
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/**
+ * Return the write lock of a key
+ *
+ * @param table The hash table
+ * @param hash  The hash of the key
+ * @return      The lock
+ */
+static inline SPINLOCK *
+hashtable_stripe(HASHTABLE *table, unsigned int hash)
+{
+    return &table->stripes[hash % HASHTABLE_STRIPES];
+}
+
+/**
+ * Allocate an array of slots
+ *
+ * @param size  The minimum number of slots
+ * @return      The array or NULL if memory could not be allocated
+ */
+static HASHSLOTS *
+hashtable_slots_alloc(int size)
+{
+    HASHSLOTS *slots;
+    unsigned int n = HASHTABLE_MIN_SLOTS;
+
+    while (n < (unsigned int)size && n < INT_MAX / 2)
+    {
+        n *= 2;
+    }
+    if ((slots = (HASHSLOTS *)calloc(1, sizeof(HASHSLOTS) + n * sizeof(HASHSLOT))) != NULL)
+    {
+        slots->mask = n - 1;
+    }
+    return slots;
+}
+
+/**
+ * Free the keys and values of an array of slots and the array itself
+ *
+ * @param table The hash table
+ * @param slots The array
+ */
+static void
+hashtable_slots_free(HASHTABLE *table, HASHSLOTS *slots)
+{
+    unsigned int i;
+
+    if (slots == NULL)
+    {
+        return;
+    }
+    for (i = 0; i <= slots->mask; i++)
+    {
+        if (HASHTABLE_IS_KEY(slots->slot[i].key))
+        {
+            table->kfreefn(slots->slot[i].key);
+            table->vfreefn(slots->slot[i].value);
+        }
+    }
+    free(slots);
+}
+
+/**
+ * Find the slot of a key. The caller must either hold the stripe lock of the
+ * key or report quiescent states.
+ *
+ * @param table The hash table
+ * @param slots The array to search, may be NULL
+ * @param hash  The hash of the key
+ * @param key   The key
+ * @param found Set to the stored key that matched
+ * @return      The slot or NULL if the key is not in the array
+ */
+static HASHSLOT *
+hashtable_find(HASHTABLE *table, HASHSLOTS *slots, unsigned int hash,
+               void *key, void **found)
+{
+    unsigned int i, n;
+
+    if (slots == NULL)
+    {
+        return NULL;
+    }
+
+    for (i = hash & slots->mask, n = 0; n <= slots->mask; i = (i + 1) & slots->mask, n++)
+    {
+        HASHSLOT *slot = &slots->slot[i];
+        void *k = slot->key;
+
+        if (k == HASHTABLE_EMPTY)
+        {
+            break;
+        }
+        if (HASHTABLE_IS_KEY(k) && slot->hash == hash && table->cmpfn(key, k) == 0)
+        {
+            *found = k;
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Claim a free slot for a key. The slot is reserved until the entry is stored.
+ *
+ * @param slots The array to claim the slot from
+ * @param hash  The hash of the key
+ * @return      The slot or NULL if the array is full
+ */
+static HASHSLOT *
+hashtable_claim(HASHSLOTS *slots, unsigned int hash)
+{
+    unsigned int i, n;
+
+    for (i = hash & slots->mask, n = 0; n <= slots->mask; i = (i + 1) & slots->mask, n++)
+    {
+        HASHSLOT *slot = &slots->slot[i];
+        void *k = slot->key;
+
+        if ((k == HASHTABLE_EMPTY || k == HASHTABLE_DELETED) &&
+            __sync_bool_compare_and_swap(&slot->key, k, HASHTABLE_RESERVED))
+        {
+            if (k == HASHTABLE_EMPTY)
+            {
+                atomic_add(&slots->used, 1);
+            }
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Store an entry in a claimed slot
+ *
+ * @param slot  The slot
+ * @param hash  The hash of the key
+ * @param key   The key
+ * @param value The value
+ */
+static void
+hashtable_store(HASHSLOT *slot, unsigned int hash, void *key, void *value)
+{
+    slot->hash = hash;
+    slot->value = value;
+    __sync_synchronize();
+    slot->key = key;
+}
+
+/**
+ * Check whether an array has too few free slots left
+ *
+ * @param slots The array
+ * @return      True if the table should be resized
+ */
+static inline bool
+hashtable_full(HASHSLOTS *slots)
+{
+    return ((unsigned long)slots->used + 1) * 4 > ((unsigned long)slots->mask + 1) * 3;
+}
+
+/**
+ * Free a deleted entry or the slots replaced by a resize, or retire them if
+ * they may still be read without locks. The entry must already be unreachable.
+ *
+ * @param table The hash table
+ * @param entry The epoch entry of the object
+ * @param fn    The function that frees the object
+ * @param data  The object
+ */
+static void
+hashtable_dispose(HASHTABLE *table, EPOCH_ENTRY *entry, void (*fn)(void *), void *data)
+{
+    /** Pairs with the barrier of a lock-free reader after it sets the flag */
+    __sync_synchronize();
+    if (table->lockfree_reads)
+    {
+        epoch_retire(entry, fn, data);
+    }
+    else
+    {
+        fn(data);
+    }
+}
+
+/**
+ * Free a retired entry
+ *
+ * @param data  The entry
+ */
+static void
+hashtable_retired_free(void *data)
+{
+    HASHTABLE_RETIRED *retired = (HASHTABLE_RETIRED *)data;
+
+    retired->kfreefn(retired->key);
+    retired->vfreefn(retired->value);
+    free(retired);
+}
+
+/**
+ * Lock all stripes of the table and mark the slot arrays as being swapped
+ *
+ * @param table The hash table, the spinlock of which is held
+ */
+static void
+hashtable_swap_begin(HASHTABLE *table)
+{
+    int i;
+
+    for (i = 0; i < HASHTABLE_STRIPES; i++)
+    {
+        spinlock_acquire(&table->stripes[i]);
+    }
+    table->resize_seq++;
+    __sync_synchronize();
+}
+
+/**
+ * End the swap of the slot arrays
+ *
+ * @param table The hash table
+ */
+static void
+hashtable_swap_end(HASHTABLE *table)
+{
+    int i;
+
+    __sync_synchronize();
+    table->resize_seq++;
+    for (i = 0; i < HASHTABLE_STRIPES; i++)
+    {
+        spinlock_release(&table->stripes[i]);
+    }
+}
+
+/**
+ * Start a resize of the table. A resize that is in progress is completed
+ * first. The table grows if more than half of the slots hold entries, otherwise
+ * it is rebuilt at the same size to get rid of the deleted entries.
+ *
+ * @param table The hash table
+ * @param force Resize even if the slots are not full
+ * @return      False if the new slots could not be allocated
+ */
+static bool
+hashtable_grow(HASHTABLE *table, bool force)
+{
+    HASHSLOTS *slots;
+    unsigned int size;
+    bool rval = true;
+
+    spinlock_acquire(&table->spin);
+    while (table->resizing)
+    {
+        spinlock_release(&table->spin);
+        hashtable_migrate(table, INT_MAX);
+        spinlock_acquire(&table->spin);
+    }
+
+    size = table->slots->mask + 1;
+    if (force || hashtable_full(table->slots))
+    {
+        if ((table->n_elements + 1) * 2 > size)
+        {
+            size *= 2;
+        }
+        if ((slots = hashtable_slots_alloc(size)) != NULL)
+        {
+            hashtable_swap_begin(table);
+            table->resizing = table->slots;
+            table->slots = slots;
+            table->migrate_next = 0;
+            table->migrated = 0;
+            hashtable_swap_end(table);
+        }
+        else
+        {
+            rval = false;
+        }
+    }
+    spinlock_release(&table->spin);
+    return rval;
+}
+
+/**
+ * Move entries of a resize in progress to the new slots
+ *
+ * @param table The hash table
+ * @param count The maximum number of slots to move
+ */
+static void
+hashtable_migrate(HASHTABLE *table, int count)
+{
+    HASHSLOTS *old;
+    int start, end, size, i;
+
+    /** A dirty read avoids the lock when there is no resize */
+    if (table->resizing == NULL)
+    {
+        return;
+    }
+
+    spinlock_acquire(&table->spin);
+    if ((old = table->resizing) == NULL ||
+        (start = table->migrate_next) >= (size = old->mask + 1))
+    {
+        spinlock_release(&table->spin);
+        return;
+    }
+    end = count < size - start ? start + count : size;
+    table->migrate_next = end;
+    spinlock_release(&table->spin);
+
+    /**
+     * No entries are added to the old slots, and the new slots are not replaced
+     * until all claimed slots have been moved
+     */
+    for (i = start; i < end; i++)
+    {
+        HASHSLOT *slot = &old->slot[i];
+        void *key = slot->key;
+
+        if (HASHTABLE_IS_KEY(key))
+        {
+            SPINLOCK *lock = hashtable_stripe(table, slot->hash);
+            HASHSLOT *dest;
+
+            spinlock_acquire(lock);
+            if (slot->key == key)
+            {
+                dest = hashtable_claim(table->slots, slot->hash);
+                ss_dassert(dest != NULL);
+                if (dest)
+                {
+                    hashtable_store(dest, slot->hash, key, slot->value);
+                    __sync_synchronize();
+                    slot->key = HASHTABLE_DELETED;
+                }
+            }
+            spinlock_release(lock);
+        }
+    }
+
+    spinlock_acquire(&table->spin);
+    table->migrated += end - start;
+    if (table->migrated == size)
+    {
+        hashtable_swap_begin(table);
+        table->resizing = NULL;
+        hashtable_swap_end(table);
+        hashtable_dispose(table, &old->entry, free, old);
+    }
+    spinlock_release(&table->spin);
+}
+
 static HASHTABLE *
 hashtable_alloc_real(HASHTABLE* target,
                      int        size,
@@ -115,6 +551,7 @@ hashtable_alloc_real(HASHTABLE* target,
                      int (*cmpfn)())
 {
     HASHTABLE *rval;
+    int i;
 
     if (target == NULL)
     {
@@ -141,16 +578,25 @@ hashtable_alloc_real(HASHTABLE* target,
     rval->vcopyfn = nullfn;
     rval->kfreefn = nullfn;
     rval->vfreefn = nullfn;
-    rval->n_readers = 0;
-    rval->writelock = 0;
+    rval->resizing = NULL;
+    rval->migrate_next = 0;
+    rval->migrated = 0;
+    rval->resize_seq = 0;
+    rval->lockfree_reads = 0;
     rval->n_elements = 0;
     spinlock_init(&rval->spin);
-    if ((rval->entries = (HASHENTRIES **)calloc(rval->hashsize, sizeof(HASHENTRIES *))) == NULL)
+    for (i = 0; i < HASHTABLE_STRIPES; i++)
     {
-        free(rval);
+        spinlock_init(&rval->stripes[i]);
+    }
+    if ((rval->slots = hashtable_slots_alloc(rval->hashsize)) == NULL)
+    {
+        if (!rval->ht_isflat)
+        {
+            free(rval);
+        }
         return NULL;
     }
-    memset(rval->entries, 0, rval->hashsize * sizeof(HASHENTRIES *));
 
     return rval;
 }
@@ -163,30 +609,13 @@ hashtable_alloc_real(HASHTABLE* target,
 void
 hashtable_free(HASHTABLE *table)
 {
-    int i;
-    HASHENTRIES *entry, *ptr;
-
     if (table == NULL)
     {
         return;
     }
 
-    hashtable_write_lock(table);
-    for (i = 0; i < table->hashsize; i++)
-    {
-        entry = table->entries[i];
-        while (entry)
-        {
-            ptr = entry->next;
-            table->kfreefn(entry->key);
-            table->vfreefn(entry->value);
-            free(entry);
-            entry = ptr;
-        }
-    }
-    free(table->entries);
-
-    hashtable_write_unlock(table);
+    hashtable_slots_free(table, table->resizing);
+    hashtable_slots_free(table, table->slots);
     if (!table->ht_isflat)
     {
         free(table);
@@ -240,77 +669,69 @@ hashtable_memory_fns(HASHTABLE   *table,
 int
 hashtable_add(HASHTABLE *table, void *key, void *value)
 {
-    unsigned int            hashkey;
-    HASHENTRIES     *entry;
+    unsigned int hashkey;
+    SPINLOCK *lock;
+    HASHSLOT *slot;
+    void *found;
 
     if (table == NULL || key == NULL || value == NULL)
     {
         return 0;
     }
 
-    if (table->hashsize <= 0)
-    {
-        return 0;
-    }
-    else
-    {
-        hashkey = table->hashfn(key) % table->hashsize;
-    }
-    hashtable_write_lock(table);
-    entry = table->entries[hashkey % table->hashsize];
-    while (entry && table->cmpfn(key, entry->key) != 0)
-    {
-        entry = entry->next;
-    }
-    if (entry && table->cmpfn(key, entry->key) == 0)
+    hashkey = hashtable_hash(table, key);
+    lock = hashtable_stripe(table, hashkey);
+
+    if (table->resizing == NULL && hashtable_full(table->slots))
     {
-        /* Duplicate key value */
-        hashtable_write_unlock(table);
-        return 0;
+        hashtable_grow(table, false);
     }
-    else
+
+    spinlock_acquire(lock);
+    while (true)
     {
-        HASHENTRIES *ptr = (HASHENTRIES *)malloc(sizeof(HASHENTRIES));
-        if (ptr == NULL)
+        if (hashtable_find(table, table->resizing, hashkey, key, &found) ||
+            hashtable_find(table, table->slots, hashkey, key, &found))
         {
-            hashtable_write_unlock(table);
+            /* Duplicate key value */
+            spinlock_release(lock);
             return 0;
         }
-
-        /* copy the key */
-        ptr->key = table->kcopyfn(key);
-
-        /* check succesfull key copy */
-        if (ptr->key  == NULL)
+        if ((slot = hashtable_claim(table->slots, hashkey)) != NULL)
+        {
+            break;
+        }
+        /** The slots filled up while a resize was in progress */
+        spinlock_release(lock);
+        if (!hashtable_grow(table, true))
         {
-            free(ptr);
-            hashtable_write_unlock(table);
-
             return 0;
         }
+        spinlock_acquire(lock);
+    }
 
-        /* copy the value */
-        ptr->value = table->vcopyfn(value);
+    /* copy the key */
+    void *k = table->kcopyfn(key);
+    void *v = NULL;
 
-        /* check succesfull value copy */
-        if  (ptr->value == NULL)
+    /* check succesfull key and value copy */
+    if (k == NULL || (v = table->vcopyfn(value)) == NULL)
+    {
+        if (k)
         {
             /* remove the key ! */
-            table->kfreefn(ptr->key);
-            free(ptr);
-
-            /* value not copied, return */
-            hashtable_write_unlock(table);
-
-            return 0;
+            table->kfreefn(k);
         }
-
-        ptr->next = table->entries[hashkey % table->hashsize];
-        table->entries[hashkey % table->hashsize] = ptr;
+        slot->key = HASHTABLE_DELETED;
+        spinlock_release(lock);
+        return 0;
     }
-    table->n_elements++;
-    hashtable_write_unlock(table);
 
+    hashtable_store(slot, hashkey, k, v);
+    atomic_add(&table->n_elements, 1);
+    spinlock_release(lock);
+
+    hashtable_migrate(table, HASHTABLE_MIGRATE);
     return 1;
 }
 
@@ -325,67 +746,100 @@ int
 hashtable_delete(HASHTABLE *table, void *key)
 {
     unsigned int hashkey;
-    HASHENTRIES *entry, *ptr;
+    SPINLOCK *lock;
+    HASHSLOT *slot;
+    void *found, *value;
+    HASHTABLE_RETIRED *retired;
 
     if (table == NULL || key == NULL)
     {
         return 0;
     }
 
-    hashkey = table->hashfn(key) % table->hashsize;
-    hashtable_write_lock(table);
-    entry = table->entries[hashkey % table->hashsize];
-    while (entry && entry->key && table->cmpfn(key, entry->key) != 0)
-    {
-        entry = entry->next;
-    }
-    if (entry == NULL)
+    hashkey = hashtable_hash(table, key);
+    lock = hashtable_stripe(table, hashkey);
+    spinlock_acquire(lock);
+    if ((slot = hashtable_find(table, table->resizing, hashkey, key, &found)) == NULL &&
+        (slot = hashtable_find(table, table->slots, hashkey, key, &found)) == NULL)
     {
         /* Not found */
-        hashtable_write_unlock(table);
+        spinlock_release(lock);
         return 0;
     }
+    value = slot->value;
+    slot->key = HASHTABLE_DELETED;
+    atomic_add(&table->n_elements, -1);
+    assert(table->n_elements >= 0);
+    spinlock_release(lock);
 
-    if (entry == table->entries[hashkey % table->hashsize])
+    if ((retired = (HASHTABLE_RETIRED *)malloc(sizeof(HASHTABLE_RETIRED))) != NULL)
     {
-        /* We are removing from the first entry */
-        table->entries[hashkey % table->hashsize] = entry->next;
-        table->kfreefn(entry->key);
-        table->vfreefn(entry->value);
-
-        if (entry->next != NULL)
-        {
-            entry->key = entry->next->key;
-            entry->value = entry->next->value;
-        }
-        else
-        {
-            entry->key = NULL;
-            entry->value = NULL;
-        }
-        free(entry);
+        retired->kfreefn = table->kfreefn;
+        retired->vfreefn = table->vfreefn;
+        retired->key = found;
+        retired->value = value;
+        hashtable_dispose(table, &retired->entry, hashtable_retired_free, retired);
     }
     else
     {
-        ptr = table->entries[hashkey % table->hashsize];
-        while (ptr && ptr->next != entry)
+        table->kfreefn(found);
+        table->vfreefn(value);
+    }
+
+    hashtable_migrate(table, HASHTABLE_MIGRATE);
+    return 1;
+}
+
+/**
+ * Fetch an item without taking locks. The calling thread reports quiescent
+ * states, so the entries read are not freed before it returns.
+ *
+ * @param table         The hash table
+ * @param hashkey       The hash of the key
+ * @param key           The key value
+ * @return The item or NULL if the item was not found
+ */
+static void *
+hashtable_fetch_lockfree(HASHTABLE *table, unsigned int hashkey, void *key)
+{
+    int seq;
+
+    if (!table->lockfree_reads)
+    {
+        table->lockfree_reads = 1;
+        __sync_synchronize();
+    }
+
+    do
+    {
+        HASHSLOT *slot;
+        void *found;
+
+        while ((seq = table->resize_seq) & 1)
         {
-            ptr = ptr->next;
+            ;
         }
-        if (ptr == NULL)
+        __sync_synchronize();
+
+        if ((slot = hashtable_find(table, table->resizing, hashkey, key, &found)) ||
+            (slot = hashtable_find(table, table->slots, hashkey, key, &found)))
         {
-            hashtable_write_unlock(table);
-            return 0;       /* This should never happen */
+            void *value = slot->value;
+
+            __sync_synchronize();
+            if (slot->key == found)
+            {
+                return value;
+            }
+            /** The entry was moved or replaced, look again */
+            seq = -1;
+            continue;
         }
-        ptr->next = entry->next;
-        table->kfreefn(entry->key);
-        table->vfreefn(entry->value);
-        free(entry);
+        __sync_synchronize();
     }
-    table->n_elements--;
-    assert(table->n_elements >= 0);
-    hashtable_write_unlock(table);
-    return 1;
+    while (seq != table->resize_seq);
+
+    return NULL;
 }
 
 /**
@@ -399,29 +853,61 @@ void *
 hashtable_fetch(HASHTABLE *table, void *key)
 {
     unsigned int hashkey;
-    HASHENTRIES *entry;
+    SPINLOCK *lock;
+    HASHSLOT *slot;
+    void *found, *value = NULL;
 
-    if (table == NULL || key == NULL || 0 == table->hashsize)
+    if (table == NULL || key == NULL)
     {
         return NULL;
     }
 
-    hashkey = table->hashfn(key) % table->hashsize;
-    hashtable_read_lock(table);
-    entry = table->entries[hashkey % table->hashsize];
-    while (entry && entry->key && table->cmpfn(key, entry->key) != 0)
+    hashkey = hashtable_hash(table, key);
+    if (epoch_reporting())
     {
-        entry = entry->next;
+        return hashtable_fetch_lockfree(table, hashkey, key);
     }
-    if (entry == NULL)
+
+    lock = hashtable_stripe(table, hashkey);
+    spinlock_acquire(lock);
+    if ((slot = hashtable_find(table, table->resizing, hashkey, key, &found)) ||
+        (slot = hashtable_find(table, table->slots, hashkey, key, &found)))
     {
-        hashtable_read_unlock(table);
-        return NULL;
+        value = slot->value;
     }
-    else
+    spinlock_release(lock);
+    return value;
+}
+
+/**
+ * Count the entries of an array of slots and find the longest distance of an
+ * entry from the slot selected by its hash
+ *
+ * @param slots         The array, may be NULL
+ * @param nelems        Incremented by the number of entries
+ * @param longest       Set to the longest probe sequence if it is longer
+ */
+static void
+hashtable_slots_stats(HASHSLOTS *slots, int *nelems, int *longest)
+{
+    unsigned int i;
+
+    if (slots == NULL)
+    {
+        return;
+    }
+    for (i = 0; i <= slots->mask; i++)
     {
-        hashtable_read_unlock(table);
-        return entry->value;
+        if (HASHTABLE_IS_KEY(slots->slot[i].key))
+        {
+            int probes = ((i - slots->slot[i].hash) & slots->mask) + 1;
+
+            (*nelems)++;
+            if (probes > *longest)
+            {
+                *longest = probes;
+            }
+        }
     }
 }
 
@@ -433,37 +919,18 @@ hashtable_fetch(HASHTABLE *table, void *key)
 void
 hashtable_stats(HASHTABLE *table)
 {
-    int total, longest, i, j;
-    HASHENTRIES *entries;
+    int hashsize, total, longest;
 
     if (table == NULL)
     {
         return;
     }
 
-    printf("Hashtable: %p, size %d\n", table, table->hashsize);
-    total = 0;
-    longest = 0;
-    hashtable_read_lock(table);
-    for (i = 0; i < table->hashsize; i++)
-    {
-        j = 0;
-        entries = table->entries[i];
-        while (entries)
-        {
-            j++;
-            entries = entries->next;
-        }
-        total += j;
-        if (j > longest)
-        {
-            longest = j;
-        }
-    }
-    hashtable_read_unlock(table);
+    hashtable_get_stats(table, &hashsize, &total, &longest);
+    printf("Hashtable: %p, size %d\n", table, hashsize);
     printf("\tNo. of entries:       %d\n", total);
-    printf("\tAverage chain length: %.1f\n", (float)total / table->hashsize);
-    printf("\tLongest chain length: %d\n", longest);
+    printf("\tLoad factor:          %.2f\n", (float)total / hashsize);
+    printf("\tLongest probe length: %d\n", longest);
 }
 
 /**
@@ -474,13 +941,13 @@ hashtable_stats(HASHTABLE *table)
  *          <description>
  *
  * @param hashsize - <usage>
- *          <description>
+ *          The number of slots of the table
  *
  * @param nelems - <usage>
- *          <description>
+ *          The number of entries
  *
  * @param longest - <usage>
- *          <description>
+ *          The longest number of slots searched to find an entry
  *
  * @return void
  *
@@ -492,9 +959,6 @@ void hashtable_get_stats(void* table,
                          int*  longest)
 {
     HASHTABLE* ht;
-    HASHENTRIES* entries;
-    int i;
-    int j;
 
     *nelems = 0;
     *longest = 0;
@@ -504,128 +968,20 @@ void hashtable_get_stats(void* table,
     {
         ht = (HASHTABLE *)table;
         CHK_HASHTABLE(ht);
-        hashtable_read_lock(ht);
-
-        for (i = 0; i < ht->hashsize; i++)
-        {
-            j = 0;
-            entries = ht->entries[i];
-            while (entries)
-            {
-                j++;
-                entries = entries->next;
-            }
-            *nelems += j;
-            if (j > *longest)
-            {
-                *longest = j;
-            }
-        }
-        *hashsize = ht->hashsize;
-        hashtable_read_unlock(ht);
-    }
-}
-
-
-/**
- * Take a read lock on the hashtable.
- *
- * The hashtable support multiple readers and a single writer,
- * we have a spinlock to protect the two counts, n_readers and
- * writelock.
- *
- * We take the hashtable spinlock and then check that writelock
- * is set to zero. If not we release the spinlock and do dirty
- * reads of writelock until it goes to 0. Once it is zero we
- * acquire the spinlock again and test that writelock is still
- * 0.
- *
- * With writelock set to zero we increment n_readers with the
- * spinlock still held.
- *
- * @param table         The hashtable to lock.
- */
-static void
-hashtable_read_lock(HASHTABLE *table)
-{
-    spinlock_acquire(&table->spin);
-    while (table->writelock)
-    {
-        spinlock_release(&table->spin);
-        while (table->writelock)
-        {
-            ;
-        }
-        spinlock_acquire(&table->spin);
-    }
-    atomic_add(&table->n_readers, 1);
-    spinlock_release(&table->spin);
-}
-
-/**
- * Release a previously obtained readlock.
- *
- * Simply decrement the n_readers value for the hash table
- *
- * @param table         The hash table to unlock
- */
-static void
-hashtable_read_unlock(HASHTABLE *table)
-{
-    atomic_add(&table->n_readers, -1);
-}
-
-/**
- * Obtain an exclusive write lock for the hash table.
- *
- * We acquire the hashtable spinlock, check for the number of
- * readers beign zero. If it is not we hold the spinlock and
- * loop waiting for the n_readers to reach zero. This will prevent
- * any new readers beign granted access but will not prevent current
- * readers releasing the read lock.
- *
- * Once we have no readers we increment writelock and test if we are
- * the only writelock holder, if not we repeat the process. We hold
- * the spinlock throughout the process since both read and write
- * locks do not require the spinlock to be acquired.
- *
- * @param table The table to lock for updates
- */
-static void
-hashtable_write_lock(HASHTABLE *table)
-{
-    int available;
-
-    spinlock_acquire(&table->spin);
-    do
-    {
-        while (table->n_readers)
-        {
-            ;
-        }
-        available = atomic_add(&table->writelock, 1);
-        if (available != 0)
-        {
-            atomic_add(&table->writelock, -1);
-        }
+        /** The slot arrays are only replaced with the spinlock held */
+        spinlock_acquire(&ht->spin);
+        hashtable_slots_stats(ht->resizing, nelems, longest);
+        hashtable_slots_stats(ht->slots, nelems, longest);
+        *hashsize = ht->slots->mask + 1;
+        spinlock_release(&ht->spin);
     }
-    while (available != 0);
-    spinlock_release(&table->spin);
-}
-
-/**
- * Release the write lock on the hash table.
- *
- * @param table The hash table to unlock
- */
-static void
-hashtable_write_unlock(HASHTABLE *table)
-{
-    atomic_add(&table->writelock, -1);
 }
 
 /**
- * Create an iterator on a hash table
+ * Create an iterator on a hash table. A resize in progress is completed so
+ * that all entries are in the slots the iterator walks. Entries added or
+ * deleted while the table is being walked, or moved by a resize started
+ * meanwhile, may be missed or returned twice.
  *
  * @param table         The table to ceate an iterator on
  * @return      An iterator to use in future calls
@@ -637,9 +993,9 @@ hashtable_iterator(HASHTABLE *table)
 
     if ((rval = (HASHITERATOR *)malloc(sizeof(HASHITERATOR))) != NULL)
     {
+        hashtable_migrate(table, INT_MAX);
         rval->table = table;
-        rval->chain = 0;
-        rval->depth = -1;
+        rval->slot = 0;
     }
     return rval;
 }
@@ -653,40 +1009,27 @@ hashtable_iterator(HASHTABLE *table)
 void *
 hashtable_next(HASHITERATOR *iter)
 {
-    int i;
-    HASHENTRIES *entries;
+    HASHSLOTS *slots;
+    void *key = NULL;
 
     if (iter == NULL)
     {
         return NULL;
     }
 
-    iter->depth++;
-    while (iter->chain < iter->table->hashsize)
+    spinlock_acquire(&iter->table->spin);
+    slots = iter->table->slots;
+    while (key == NULL && (unsigned int)iter->slot <= slots->mask)
     {
-        hashtable_read_lock(iter->table);
-        if ((entries = iter->table->entries[iter->chain]) != NULL)
-        {
-            i = 0;
-            while (entries && i < iter->depth)
-            {
-                entries = entries->next;
-                i++;
-            }
-            hashtable_read_unlock(iter->table);
-            if (entries)
-            {
-                return entries->key;
-            }
-        }
-        else
+        void *k = slots->slot[iter->slot++].key;
+
+        if (HASHTABLE_IS_KEY(k))
         {
-            hashtable_read_unlock(iter->table);
+            key = k;
         }
-        iter->depth = 0;
-        iter->chain++;
     }
-    return NULL;
+    spinlock_release(&iter->table->spin);
+    return key;
 }
 
 /**
@@ -821,8 +1164,5 @@ hashtable_load(HASHTABLE *table, const char *filename,
 int hashtable_size(HASHTABLE *table)
 {
     assert(table);
-    spinlock_acquire(&table->spin);
-    int rval = table->n_elements;
-    spinlock_release(&table->spin);
-    return rval;
+    return table->n_elements;
 }
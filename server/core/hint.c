@@ -13,6 +13,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <platform.h>
+#include <spinlock.h>
 #include <hint.h>
 
 /**
@@ -23,10 +26,124 @@
  *
  * Date         Who             Description
  * 25/07/14     Mark Riddoch    Initial implementation
+ * 15/10/2016   Core Team       Per-thread pool of hints with inline strings
+ * 15/10/2016   Core Team       Interned names of the servers and parameters
  *
  * @endverbatim
  */
 
+/** Space for the data and the value strings stored inside a hint */
+#define HINT_INLINE_SIZE 64
+
+/** Maximum number of free hints kept by each thread */
+#define HINT_POOL_SIZE   256
+
+/**
+ * A hint with storage for short data and value strings. The hints are
+ * allocated as blocks so that creating a hint with short strings takes
+ * no extra allocations.
+ */
+typedef struct hint_block
+{
+    HINT hint;                    /*< The hint, must be the first member */
+    size_t used;                  /*< Bytes used from the inline storage */
+    char storage[HINT_INLINE_SIZE]; /*< Inline storage for the strings */
+} HINT_BLOCK;
+
+/** The most names that get an ID, the names after them get none */
+#define HINT_MAX_NAMES   1024
+
+/** Slots of the table of the names, twice the names to keep the probes short */
+#define HINT_NAME_SLOTS  (2 * HINT_MAX_NAMES)
+
+/**
+ * An interned name. The name is set last, so a slot with a name is complete.
+ */
+typedef struct
+{
+    char * volatile name;   /*< The name, NULL if the slot is free */
+    int             id;     /*< The ID of the name */
+} HINT_NAME;
+
+static HINT_NAME hint_names[HINT_NAME_SLOTS];
+static int hint_n_names = 0;
+static SPINLOCK hint_names_lock = SPINLOCK_INIT;
+
+/** Free hints of this thread, linked through hint.next */
+static thread_local HINT_BLOCK *hint_pool = NULL;
+static thread_local int hint_pool_count = 0;
+
+/**
+ * Allocate a hint, from the pool of this thread if possible
+ *
+ * @return A new hint or NULL on memory allocation failure
+ */
+static HINT *
+hint_get()
+{
+    HINT_BLOCK *block = hint_pool;
+
+    if (block)
+    {
+        hint_pool = (HINT_BLOCK *)block->hint.next;
+        hint_pool_count--;
+    }
+    else if ((block = (HINT_BLOCK *)malloc(sizeof(HINT_BLOCK))) == NULL)
+    {
+        return NULL;
+    }
+
+    block->used = 0;
+    block->hint.data = NULL;
+    block->hint.value = NULL;
+    block->hint.dsize = 0;
+    block->hint.id = 0;
+    block->hint.next = NULL;
+    return &block->hint;
+}
+
+/**
+ * Copy a string into a hint, into the inline storage if it fits
+ *
+ * @param hint  The hint allocated with hint_get
+ * @param str   The string to copy
+ * @return The copy of the string
+ */
+static char *
+hint_strdup(HINT *hint, const char *str)
+{
+    HINT_BLOCK *block = (HINT_BLOCK *)hint;
+    size_t len = strlen(str) + 1;
+
+    if (len <= HINT_INLINE_SIZE - block->used)
+    {
+        char *rval = block->storage + block->used;
+        memcpy(rval, str, len);
+        block->used += len;
+        return rval;
+    }
+
+    return strdup(str);
+}
+
+/**
+ * Free a string of a hint if it is not stored inline
+ *
+ * @param hint  The hint
+ * @param str   The string
+ */
+static void
+hint_strfree(HINT *hint, void *str)
+{
+    HINT_BLOCK *block = (HINT_BLOCK *)hint;
+    char *ptr = (char *)str;
+
+    if (ptr < block->storage || ptr >= block->storage + HINT_INLINE_SIZE)
+    {
+        free(str);
+    }
+}
+
 
 /**
  * Duplicate a list of hints
@@ -44,28 +161,20 @@ hint_dup(HINT *hint)
     ptr1 = hint;
     while (ptr1)
     {
-        if ((ptr2 = (HINT *)malloc(sizeof(HINT))) == NULL)
+        if ((ptr2 = hint_get()) == NULL)
         {
             return nlhead;
         }
         ptr2->type = ptr1->type;
+        ptr2->id = ptr1->id;
         if (ptr1->data)
         {
-            ptr2->data = strdup(ptr1->data);
-        }
-        else
-        {
-            ptr2->data = NULL;
+            ptr2->data = hint_strdup(ptr2, ptr1->data);
         }
         if (ptr1->value)
         {
-            ptr2->value = strdup(ptr1->value);
-        }
-        else
-        {
-            ptr2->value = NULL;
+            ptr2->value = hint_strdup(ptr2, ptr1->value);
         }
-        ptr2->next = NULL;
         if (nltail)
         {
             nltail->next = ptr2;
@@ -94,7 +203,7 @@ hint_create_route(HINT *head, HINT_TYPE type, char *data)
 {
     HINT *hint;
 
-    if ((hint = (HINT *)malloc(sizeof(HINT))) == NULL)
+    if ((hint = hint_get()) == NULL)
     {
         return head;
     }
@@ -102,13 +211,12 @@ hint_create_route(HINT *head, HINT_TYPE type, char *data)
     hint->type = type;
     if (data)
     {
-        hint->data = strdup(data);
-    }
-    else
-    {
-        hint->data = NULL;
+        hint->data = hint_strdup(hint, data);
+        if (type == HINT_ROUTE_TO_NAMED_SERVER)
+        {
+            hint->id = hint_name_id(data);
+        }
     }
-    hint->value = NULL;
     return hint;
 }
 
@@ -125,20 +233,24 @@ hint_create_parameter(HINT *head, char *pname, char *value)
 {
     HINT *hint;
 
-    if ((hint = (HINT *)malloc(sizeof(HINT))) == NULL)
+    if ((hint = hint_get()) == NULL)
     {
         return head;
     }
     hint->next = head;
     hint->type = HINT_PARAMETER;
-    hint->data = strdup(pname);
-    hint->value = strdup(value);
+    hint->data = hint_strdup(hint, pname);
+    hint->value = hint_strdup(hint, value);
+    hint->id = hint_name_id(pname);
     return hint;
 }
 
 /**
  * free_hint - free a hint
  *
+ * The hint is returned to the pool of the calling thread unless the pool
+ * is full.
+ *
  * @param hint          The hint to free
  */
 void
@@ -146,13 +258,23 @@ hint_free(HINT *hint)
 {
     if (hint->data)
     {
-        free(hint->data);
+        hint_strfree(hint, hint->data);
     }
     if (hint->value)
     {
-        free(hint->value);
+        hint_strfree(hint, hint->value);
+    }
+
+    if (hint_pool_count < HINT_POOL_SIZE)
+    {
+        hint->next = (HINT *)hint_pool;
+        hint_pool = (HINT_BLOCK *)hint;
+        hint_pool_count++;
+    }
+    else
+    {
+        free(hint);
     }
-    free(hint);
 }
 
 bool hint_exists(HINT**    p_hint,
@@ -170,3 +292,88 @@ bool hint_exists(HINT**    p_hint,
     }
     return succp;
 }
+
+/**
+ * Hash a name, ignoring case
+ *
+ * @param name  The name
+ * @return The slot to start looking for the name from
+ */
+static int
+hint_name_hash(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*name)
+    {
+        hash = (hash ^ tolower((unsigned char)*name++)) * 16777619u;
+    }
+    return hash % HINT_NAME_SLOTS;
+}
+
+/**
+ * Find a name in the table of the names
+ *
+ * @param name  The name
+ * @param slot  The slot where the name is or, if it is not there, the first
+ *              free slot is stored here
+ * @return The ID of the name or 0 if it is not there
+ */
+static int
+hint_name_find(const char *name, int *slot)
+{
+    int i = hint_name_hash(name);
+
+    for (int n = 0; n < HINT_NAME_SLOTS; n++, i = (i + 1) % HINT_NAME_SLOTS)
+    {
+        char *ptr = hint_names[i].name;
+
+        if (ptr == NULL)
+        {
+            break;
+        }
+        if (strcasecmp(ptr, name) == 0)
+        {
+            *slot = i;
+            return hint_names[i].id;
+        }
+    }
+    *slot = i;
+    return 0;
+}
+
+/**
+ * Return the ID of a server or parameter name, giving the name an ID on its
+ * first use. The names are compared ignoring case. The routers compare the
+ * IDs of the hints with the IDs of the names they know instead of the names.
+ * Looking up a name that has an ID takes no lock.
+ *
+ * @param name  The name
+ * @return The ID of the name or 0 if the table of the names is full
+ */
+int
+hint_name_id(const char *name)
+{
+    int slot;
+    int id = hint_name_find(name, &slot);
+
+    if (id == 0)
+    {
+        spinlock_acquire(&hint_names_lock);
+        if ((id = hint_name_find(name, &slot)) == 0 && hint_n_names < HINT_MAX_NAMES)
+        {
+            char *copy = strdup(name);
+
+            if (copy)
+            {
+                id = ++hint_n_names;
+                hint_names[slot].id = id;
+                /** The ID must be set before the name makes the slot visible */
+                __sync_synchronize();
+                hint_names[slot].name = copy;
+            }
+        }
+        spinlock_release(&hint_names_lock);
+    }
+    return id;
+}
@@ -29,6 +29,10 @@
  * The housekeeper also maintains a global variable, hkheartbeat, that
  * is incremented every 100ms.
  *
+ * The tasks are timers in a timer wheel that is run by the housekeeper
+ * thread on every heartbeat. The list of tasks is only used to find the
+ * tasks by name and to display them.
+ *
  * @verbatim
  * Revision History
  *
@@ -46,13 +50,20 @@ static HKTASK *tasks = NULL;
 /**
  * Spinlock to protect the tasks list
  */
-static SPINLOCK tasklock = SPINLOCK_INIT;
+static SPINLOCK tasklock = SPINLOCK_INIT_NAMED("housekeeper tasks");
+
+/**
+ * The timer wheel of the housekeeper thread
+ */
+static TIMER_WHEEL hk_wheel;
 
 static int do_shutdown = 0;
 long hkheartbeat = 0; /*< One heartbeat is 100 milliseconds */
 static THREAD hk_thr_handle;
 
 static void hkthread(void *);
+static void hktask_run(void *);
+static bool hktask_unlink(HKTASK *task);
 
 /**
  * Initialise the housekeeper thread
@@ -103,6 +114,7 @@ hktask_add(const char *name, void (*taskfn)(void *), void *data, int frequency)
     task->type = HK_REPEATED;
     task->nextdue = time(0) + frequency;
     task->next = NULL;
+    timer_init(&task->timer, hktask_run, task);
     spinlock_acquire(&tasklock);
     ptr = tasks;
     while (ptr && ptr->next)
@@ -131,6 +143,7 @@ hktask_add(const char *name, void (*taskfn)(void *), void *data, int frequency)
     {
         tasks = task;
     }
+    timer_add(&hk_wheel, &task->timer, frequency * 10);
     spinlock_release(&tasklock);
 
     return task->nextdue;
@@ -169,6 +182,7 @@ hktask_oneshot(const char *name, void (*taskfn)(void *), void *data, int when)
     task->type = HK_ONESHOT;
     task->nextdue = time(0) + when;
     task->next = NULL;
+    timer_init(&task->timer, hktask_run, task);
     spinlock_acquire(&tasklock);
     ptr = tasks;
     while (ptr && ptr->next)
@@ -183,6 +197,7 @@ hktask_oneshot(const char *name, void (*taskfn)(void *), void *data, int when)
     {
         tasks = task;
     }
+    timer_add(&hk_wheel, &task->timer, when * 10);
     spinlock_release(&tasklock);
 
     return task->nextdue;
@@ -192,6 +207,8 @@ hktask_oneshot(const char *name, void (*taskfn)(void *), void *data, int when)
 /**
  * Remove a named task from the housekeepers task list
  *
+ * If the task is being run, this waits until the task function returns.
+ *
  * @param name          The task name to remove
  * @return              Returns 0 if the task could not be removed
  */
@@ -219,6 +236,7 @@ hktask_remove(const char *name)
 
     if (ptr)
     {
+        timer_remove(&ptr->timer);
         free(ptr->name);
         free(ptr);
         return 1;
@@ -229,72 +247,95 @@ hktask_remove(const char *name)
     }
 }
 
+/**
+ * Remove a task from the task list
+ *
+ * @param task  The task to remove
+ * @return      True if the task was in the list
+ */
+static bool
+hktask_unlink(HKTASK *task)
+{
+    HKTASK *ptr, *lptr = NULL;
+
+    spinlock_acquire(&tasklock);
+    ptr = tasks;
+    while (ptr && ptr != task)
+    {
+        lptr = ptr;
+        ptr = ptr->next;
+    }
+    if (ptr && lptr)
+    {
+        lptr->next = ptr->next;
+    }
+    else if (ptr)
+    {
+        tasks = ptr->next;
+    }
+    spinlock_release(&tasklock);
+
+    return ptr != NULL;
+}
+
+/**
+ * The timer function of the housekeeper tasks.
+ *
+ * A repeated task is added back to the timer wheel before the task function
+ * is called so that the task can remove itself. A one-shot task is removed
+ * after the task function returns, unless the task function removed it.
+ *
+ * @param data  The task
+ */
+static void
+hktask_run(void *data)
+{
+    HKTASK *task = (HKTASK *)data;
+    void (*taskfn)(void *) = task->task;
+    void *taskdata = task->data;
+
+    if (task->type == HK_ONESHOT)
+    {
+        (*taskfn)(taskdata);
+        if (hktask_unlink(task))
+        {
+            timer_remove(&task->timer);
+            free(task->name);
+            free(task);
+        }
+    }
+    else
+    {
+        spinlock_acquire(&tasklock);
+        task->nextdue = time(0) + task->frequency;
+        timer_add(&hk_wheel, &task->timer, task->frequency * 10);
+        spinlock_release(&tasklock);
+        (*taskfn)(taskdata);
+    }
+}
 
 /**
  * The housekeeper thread implementation.
  *
- * This function is responsible for executing the housekeeper tasks.
- *
- * The implementation of the callng of the task functions is such that
- * the tasks are called without the tasklock spinlock being held. This
- * allows manipulation of the housekeeper task list during execution of
- * one of the tasks. The resutl is that upon completion of a task the
- * search for tasks to run must restart from the start of the queue.
- * It is vital that the task->nextdue tiem is updated before the task
- * is run.
+ * This function is responsible for maintaining the heartbeat and for
+ * running the timer wheel of the housekeeper tasks. The task functions
+ * are called without any locks being held, which allows the tasks to
+ * manipulate the housekeeper task list.
  *
  * @param       data            Unused, here to satisfy the thread system
  */
 void
 hkthread(void *data)
 {
-    HKTASK *ptr;
-    time_t now;
-    void (*taskfn)(void *);
-    void *taskdata;
-    int i;
-
     for (;;)
     {
-        for (i = 0; i < 10; i++)
-        {
-            if (do_shutdown)
-            {
-                return;
-            }
-            thread_millisleep(100);
-            hkheartbeat++;
-        }
-        now = time(0);
-        spinlock_acquire(&tasklock);
-        ptr = tasks;
-        while (ptr)
+        if (do_shutdown)
         {
-            if (ptr->nextdue <= now)
-            {
-                ptr->nextdue = now + ptr->frequency;
-                taskfn = ptr->task;
-                taskdata = ptr->data;
-                // We need to copy type and name, in case hktask_remove is called from
-                // the callback. Otherwise we will access freed data.
-                HKTASK_TYPE type = ptr->type;
-                char name[strlen(ptr->name) + 1];
-                strcpy(name, ptr->name);
-                spinlock_release(&tasklock);
-                (*taskfn)(taskdata);
-                if (type == HK_ONESHOT)
-                {
-                    hktask_remove(name);
-                }
-                spinlock_acquire(&tasklock);
-                ptr = tasks;
-            }
-            else
-            {
-                ptr = ptr->next;
-            }
+            return;
         }
-        spinlock_release(&tasklock);
+        thread_millisleep(100);
+        hkheartbeat++;
+        timer_wheel_run(&hk_wheel, hkheartbeat);
     }
 }
 
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file latency.c  - Query latency histograms
+ *
+ * The services and servers are created from the configuration before the
+ * statistics know the number of threads, so a histogram is allocated when the
+ * first latency of its kind is added. Two threads adding the first latency at
+ * the same time both allocate one and the one that loses the race frees its
+ * copy.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <latency.h>
+#include <dcb.h>
+#include <metrics.h>
+
+static const char *kind_names[LATENCY_N_KINDS] =
+{
+    "read",
+    "write"
+};
+
+/**
+ * Return the current time of the monotonic clock
+ *
+ * @return The time in microseconds
+ */
+uint64_t
+latency_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Return the name of a kind of query
+ *
+ * @param kind  The kind
+ * @return      The name, "read" or "write"
+ */
+const char *
+latency_kind_name(latency_kind_t kind)
+{
+    return kind_names[kind];
+}
+
+/**
+ * Add the latency of a query
+ *
+ * @param latency   The histograms of the service or the server
+ * @param kind      Whether the query was routed as a read or a write
+ * @param usecs     The latency in microseconds
+ */
+void
+latency_add(LATENCY *latency, latency_kind_t kind, uint64_t usecs)
+{
+    ts_histogram_t histogram = latency->histograms[kind];
+
+    if (histogram == NULL)
+    {
+        if ((histogram = ts_histogram_alloc()) == NULL)
+        {
+            return;
+        }
+        if (!__sync_bool_compare_and_swap(&latency->histograms[kind], NULL, histogram))
+        {
+            ts_histogram_free(histogram);
+            histogram = latency->histograms[kind];
+        }
+    }
+    ts_histogram_add(histogram, usecs);
+}
+
+/**
+ * Get the summary of the latencies of a kind of query
+ *
+ * @param latency   The histograms of the service or the server
+ * @param kind      The kind of query
+ * @param summary   The summary, all zero if no query of the kind has completed
+ */
+void
+latency_get(LATENCY *latency, latency_kind_t kind, ts_histogram_summary_t *summary)
+{
+    if (latency->histograms[kind])
+    {
+        ts_histogram_get(latency->histograms[kind], -1, summary);
+    }
+    else
+    {
+        memset(summary, 0, sizeof(*summary));
+    }
+}
+
+/**
+ * Free the histograms of a service or a server
+ *
+ * @param latency   The histograms
+ */
+void
+latency_free(LATENCY *latency)
+{
+    int i;
+
+    for (i = 0; i < LATENCY_N_KINDS; i++)
+    {
+        ts_histogram_free(latency->histograms[i]);
+        latency->histograms[i] = NULL;
+    }
+}
+
+/**
+ * Print the latency percentiles of a service or a server in the format of
+ * the dprint functions
+ *
+ * @param dcb       The DCB to print to
+ * @param latency   The histograms
+ */
+void
+latency_print(DCB *dcb, LATENCY *latency)
+{
+    static const char *titles[LATENCY_N_KINDS] =
+    {
+        "Read latency (us):",
+        "Write latency (us):"
+    };
+    ts_histogram_summary_t sum;
+    int i;
+
+    for (i = 0; i < LATENCY_N_KINDS; i++)
+    {
+        latency_get(latency, i, &sum);
+        dcb_printf(dcb, "\t%-36s %" PRIu64 " queries, p50 %" PRIu64 ", p99 %" PRIu64
+                   ", p99.9 %" PRIu64 "\n", titles[i], sum.count, sum.p50, sum.p99, sum.p999);
+    }
+}
+
+/**
+ * Write the latencies of a service or a server as Prometheus summaries. The
+ * caller writes the header of the metric.
+ *
+ * @param metrics   The output
+ * @param name      The name of the metric
+ * @param labels    The labels identifying the service or the server
+ * @param latency   The histograms
+ */
+void
+latency_metrics(METRICS *metrics, const char *name, const char *labels, LATENCY *latency)
+{
+    char buf[512];
+    int i;
+
+    for (i = 0; i < LATENCY_N_KINDS; i++)
+    {
+        if (latency->histograms[i])
+        {
+            snprintf(buf, sizeof(buf), "%s,kind=\"%s\"", labels, kind_names[i]);
+            metrics_summary(metrics, name, buf, latency->histograms[i], -1);
+        }
+    }
+}
@@ -24,6 +24,7 @@
  *
  * Date         Who                     Description
  * 26/01/16     Martin Brampton         Initial implementation
+ * 15/10/2016   Core Team               TLS session resumption and kernel TLS
  *
  * @endverbatim
  */
@@ -39,6 +40,10 @@ static RSA *rsa_512 = NULL;
 static RSA *rsa_1024 = NULL;
 
 static RSA *tmp_rsa_callback(SSL *s, int is_export, int keylength);
+static int new_session_callback(SSL *ssl, SSL_SESSION *session);
+
+/** The session ID context of the sessions MaxScale accepts */
+#define LISTENER_SSL_SESSION_CONTEXT "MaxScale"
 
 /**
  * Create a new listener structure
@@ -61,7 +66,15 @@ listener_alloc(char *protocol, char *address, unsigned short port, char *authent
         proto->address = address ? strdup(address) : NULL;
         proto->port = port;
         proto->authenticator = authenticator ? strdup(authenticator) : NULL;
+        proto->authfuncs = NULL;
         proto->ssl = ssl;
+        proto->exclusive_accept = false;
+        proto->busy_poll = 0;
+        proto->thread_group = -1;
+        proto->auth_cache = NULL;
+        proto->auth_cache_hits = 0;
+        proto->auth_cache_misses = 0;
+        proto->queued_connections = NULL;
     }
     return proto;
 }
@@ -178,6 +191,38 @@ listener_init_SSL(SSL_LISTENER *ssl_listener)
         /** Disable SSLv3 */
         SSL_CTX_set_options(ssl_listener->ctx, SSL_OP_NO_SSLv3);
 
+        if (ssl_listener->ssl_session_cache)
+        {
+            /**
+             * Clients resume their sessions from the cache of the context or
+             * with session tickets. For backend connections the latest
+             * session is stored by new_session_callback and reused by the
+             * next connection to the server.
+             */
+            SSL_CTX_set_app_data(ssl_listener->ctx, ssl_listener);
+            SSL_CTX_set_session_cache_mode(ssl_listener->ctx,
+                                           SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_CLIENT);
+            SSL_CTX_set_session_id_context(ssl_listener->ctx,
+                                           (unsigned char*)LISTENER_SSL_SESSION_CONTEXT,
+                                           sizeof(LISTENER_SSL_SESSION_CONTEXT) - 1);
+            SSL_CTX_sess_set_new_cb(ssl_listener->ctx, new_session_callback);
+        }
+        else
+        {
+            SSL_CTX_set_session_cache_mode(ssl_listener->ctx, SSL_SESS_CACHE_OFF);
+            SSL_CTX_set_options(ssl_listener->ctx, SSL_OP_NO_TICKET);
+        }
+
+        if (ssl_listener->ssl_ktls)
+        {
+#ifdef SSL_OP_ENABLE_KTLS
+            SSL_CTX_set_options(ssl_listener->ctx, SSL_OP_ENABLE_KTLS);
+#else
+            MXS_WARNING("The OpenSSL library does not support kernel TLS, "
+                        "the records are encrypted by MaxScale.");
+#endif
+        }
+
         /** Generate the 512-bit and 1024-bit RSA keys */
         if (rsa_512 == NULL)
         {
@@ -247,6 +292,38 @@ listener_init_SSL(SSL_LISTENER *ssl_listener)
     return 0;
 }
 
+/**
+ * Store the latest session of a backend connection so that the next
+ * connection to the server can resume it. Sessions of client connections are
+ * left to the session cache of the context.
+ *
+ * @param ssl     The connection
+ * @param session The new session
+ * @return 1 if the reference to the session was taken, 0 otherwise
+ */
+static int
+new_session_callback(SSL *ssl, SSL_SESSION *session)
+{
+    SSL_LISTENER *ssl_listener = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    if (SSL_is_server(ssl) || ssl_listener == NULL)
+    {
+        return 0;
+    }
+
+    spinlock_acquire(&ssl_listener->ssl_session_lock);
+    SSL_SESSION *old = ssl_listener->ssl_session;
+    ssl_listener->ssl_session = session;
+    spinlock_release(&ssl_listener->ssl_session_lock);
+
+    if (old)
+    {
+        SSL_SESSION_free(old);
+    }
+
+    return 1;
+}
+
 /**
  * The RSA key generation callback function for OpenSSL.
  * @param s SSL structure
@@ -379,8 +379,11 @@ unregister_module(const char *module)
 
     /*<
      * The module is now not in the linked list and all
-     * memory related to it can be freed
+     * memory related to it can be freed. The log messages whose
+     * formatting was deferred may refer to the format strings of
+     * the module, they are written before it is unloaded.
      */
+    mxs_log_flush_sync();
     dlclose(mod->handle);
     free(mod->module);
     free(mod->type);
@@ -22,9 +22,15 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <time.h>
 #include <atomic.h>
+#include <ilist.h>
+#include <zlib.h>
 
-#include <mlist.h>
 #include <skygw_debug.h>
 #include <skygw_types.h>
 #include <skygw_utils.h>
@@ -32,7 +38,6 @@
 #define MAX_PREFIXLEN 250
 #define MAX_SUFFIXLEN 250
 #define MAX_PATHLEN   512
-#define MAXNBLOCKBUFS 10
 
 /** for procname */
 #if !defined(_GNU_SOURCE)
@@ -45,13 +50,6 @@ static const char LOGFILE_NAME_SUFFIX[] = ".log";
 extern char *program_invocation_name;
 extern char *program_invocation_short_name;
 
-typedef enum
-{
-    BB_READY = 0x00,
-    BB_FULL,
-    BB_CLEARED
-} blockbuf_state_t;
-
 typedef enum
 {
     FILEWRITER_INIT,
@@ -86,7 +84,6 @@ enum log_flush
 
 #if defined(SS_DEBUG)
 static int write_index;
-static int block_start_index;
 static int prevval;
 static simple_mutex_t msg_mutex;
 #endif
@@ -96,19 +93,36 @@ static simple_mutex_t msg_mutex;
  */
 static int DEFAULT_LOG_AUGMENTATION = 0;
 
+/**
+ * Default throttling, the number of messages a call site may log in a window
+ * of milliseconds.
+ */
+#define DEFAULT_LOG_THROTTLE_COUNT  10
+#define DEFAULT_LOG_THROTTLE_WINDOW 1000
+
 static struct
 {
-    int  augmentation;     // Can change during the lifetime of log_manager.
-    bool do_highprecision; // Can change during the lifetime of log_manager.
-    bool do_syslog;        // Can change during the lifetime of log_manager.
-    bool do_maxlog;        // Can change during the lifetime of log_manager.
-    bool use_stdout;       // Can NOT changed during the lifetime of log_manager.
+    int    augmentation;     // Can change during the lifetime of log_manager.
+    bool   do_highprecision; // Can change during the lifetime of log_manager.
+    bool   do_syslog;        // Can change during the lifetime of log_manager.
+    bool   do_maxlog;        // Can change during the lifetime of log_manager.
+    bool   do_deferred;      // Can change during the lifetime of log_manager.
+    size_t throttle_count;   // Can change during the lifetime of log_manager.
+    size_t throttle_window;  // Can change during the lifetime of log_manager.
+    size_t rotate_size;      // Can change during the lifetime of log_manager.
+    bool   do_compress;      // Can change during the lifetime of log_manager.
+    bool   use_stdout;       // Can NOT changed during the lifetime of log_manager.
 } log_config =
 {
     DEFAULT_LOG_AUGMENTATION, // augmentation
     false,                    // do_highprecision
     true,                     // do_syslog
     true,                     // do_maxlog
+    false,                    // do_deferred
+    DEFAULT_LOG_THROTTLE_COUNT,  // throttle_count
+    DEFAULT_LOG_THROTTLE_WINDOW, // throttle_window
+    0,                        // rotate_size
+    false,                    // do_compress
     false                     // use_stdout
 };
 
@@ -173,6 +187,8 @@ struct filewriter
     logmanager_t*      fwr_logmgr;
     /** Physical files */
     skygw_file_t*      fwr_file;
+    /** Bytes in the current file, compared to the rotation size */
+    size_t             fwr_file_size;
     /** fwr_logmes is for messages from log clients */
     skygw_message_t*   fwr_logmes;
     /** fwr_clientmes is for messages to log clients */
@@ -184,26 +200,78 @@ struct filewriter
 };
 
 /**
- * Log client's string is copied to block-sized log buffer, which is passed
- * to file writer thread.
+ * The size of the log ring of a thread. It holds several messages of the
+ * maximum length so that a burst of messages does not fill it up before the
+ * file writer thread wakes up.
+ */
+#define LOG_RING_SIZE (16 * MAX_LOGSTRLEN)
+
+/**
+ * The log messages of a thread waiting for the file writer thread. The thread
+ * is the only producer and the file writer the only consumer, so the ring
+ * needs no locks: the producer only moves lr_head and the consumer only
+ * lr_tail. The positions count the bytes ever written and consumed, they are
+ * reduced modulo the size when the buffer is accessed. A message that does not
+ * fit is dropped and counted instead of waiting for the file writer.
  */
-typedef struct blockbuf
+typedef struct logring
 {
-#if defined(SS_DEBUG)
-    skygw_chk_t    bb_chk_top;
-#endif
-    blockbuf_state_t bb_state; /**State of the block buffer*/
-    simple_mutex_t bb_mutex;    /**< bb_buf_used, bb_isfull */
-    int            bb_refcount; /**< protected by list mutex. #of clients */
-//        int            bb_blankcount; /**< # of blanks used btw strings */
-    size_t         bb_buf_size;
-    size_t         bb_buf_left;
-    size_t         bb_buf_used;
-    char           bb_buf[MAX_LOGSTRLEN];
-#if defined(SS_DEBUG)
-    skygw_chk_t    bb_chk_tail;
-#endif
-} blockbuf_t;
+    volatile size_t  lr_head;     /**< Bytes written by the thread */
+    volatile size_t  lr_tail;     /**< Bytes written to the file by the file writer */
+    volatile size_t  lr_dropped;  /**< Messages dropped because the ring was full */
+    size_t           lr_reported; /**< Dropped messages already reported in the log */
+    volatile bool    lr_orphaned; /**< The thread has exited */
+    ILIST_NODE       lr_node;     /**< The node in the list of all rings */
+    char             lr_buf[LOG_RING_SIZE];
+} logring_t;
+
+static ISTACK log_rings = ISTACK_INIT;  /**< All rings, the newest first */
+static pthread_key_t log_ring_key;      /**< Orphans the ring of an exiting thread */
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+static __thread logring_t* log_ring = NULL;
+static __thread char log_scratch[MAX_LOGSTRLEN];
+
+/**
+ * The first byte of a deferred message in a ring. A formatted message never
+ * contains it, so the file writer can tell the two apart.
+ */
+#define LOG_RECORD_MARKER '\0'
+
+/**
+ * A message whose formatting is deferred to the file writer thread. The
+ * logging thread copies the arguments after the header and the file writer
+ * formats them with the format, which must therefore remain valid: the
+ * format strings are literals of the executable or of a module. The header
+ * and the arguments are copied to the ring byte by byte, so they are read
+ * with memcpy.
+ */
+typedef struct logdeferred
+{
+    char           ld_marker;         /**< LOG_RECORD_MARKER */
+    uint8_t        ld_priority;       /**< Syslog priority */
+    uint8_t        ld_augmentation;   /**< The augmentation when the message was logged */
+    uint8_t        ld_highprecision;  /**< Whether the timestamp has milliseconds */
+    uint32_t       ld_len;            /**< The length of the header and the arguments */
+    struct timeval ld_time;           /**< The time when the message was logged */
+    size_t         ld_sesid;          /**< The session id, 0 if none */
+    const char*    ld_format;         /**< The printf format of the message */
+    const char*    ld_function;       /**< The function where the message was logged */
+} logdeferred_t;
+
+/**
+ * A log file left behind by a rotation. The file writer only switches to the
+ * new file and the log archiver thread closes the old one, which fsyncs it,
+ * and compresses it if compression is enabled.
+ */
+typedef struct logarchive
+{
+    skygw_file_t*  la_file;      /**< The old log file */
+    bool           la_compress;  /**< Whether the file is compressed after closing */
+    ILIST_NODE     la_node;      /**< The node in the archiver queue */
+} logarchive_t;
+
+/** The size of the blocks in which the archiver compresses a file */
+#define LOG_ARCHIVE_BLOCK_SIZE (64 * 1024)
 
 /**
  * logfile object corresponds to physical file(s) where
@@ -229,8 +297,6 @@ struct logfile
     char*            lf_full_link_name; /**< complete symlink name */
     int              lf_nfiles_max;
     size_t           lf_file_size;
-    /** list of block-sized log buffers */
-    mlist_t          lf_blockbuf_list;
     size_t           lf_buf_size;
     bool             lf_flushflag;
     bool                 lf_rotateflag;
@@ -270,6 +336,14 @@ struct logmanager
     logfile_t        lm_logfile;
     filewriter_t     lm_filewriter;
     mxs_log_target_t lm_target;
+    /** The thread that closes and compresses the rotated files */
+    skygw_thread_t*  lm_archiver;
+    /** lm_archivemes is for files to the archiver */
+    skygw_message_t* lm_archivemes;
+    /** lm_archiverdone is for messages from the archiver */
+    skygw_message_t* lm_archiverdone;
+    ILIST            lm_archiveq;     /**< The files to archive, oldest first */
+    int              lm_archiveq_lock;
 #if defined(SS_DEBUG)
     skygw_chk_t      lm_chk_tail;
 #endif
@@ -298,6 +372,7 @@ static void logfile_flush(logfile_t* lf);
 static void logfile_rotate(logfile_t* lf);
 static bool logfile_build_name(logfile_t* lf);
 static bool logfile_open_file(filewriter_t* fw, logfile_t* lf);
+static bool logfile_switch(logmanager_t* lm, filewriter_t* fwr, logfile_t* lf);
 static char* form_full_file_name(strpart_t* parts, logfile_t* lf, int seqnoidx);
 
 static bool filewriter_init(logmanager_t* logmanager,
@@ -307,6 +382,7 @@ static bool fnames_conf_init(fnames_conf_t* fn, const char* logdir);
 static void fnames_conf_done(fnames_conf_t* fn);
 static void fnames_conf_free_memory(fnames_conf_t* fn);
 static void* thr_filewriter_fun(void* data);
+static void* thr_logarchiver_fun(void* data);
 static logfile_t* logmanager_get_logfile(logmanager_t* lm);
 static bool logmanager_register(bool writep);
 static void logmanager_unregister(void);
@@ -321,14 +397,21 @@ static int logmanager_write_log(int            priority,
                                 size_t         len,
                                 const char*    str);
 
-static blockbuf_t* blockbuf_init();
-static void blockbuf_node_done(void* bb_data);
-static char* blockbuf_get_writepos(blockbuf_t** p_bb,
-                                   size_t       str_len,
-                                   bool         flush);
-
-static void blockbuf_register(blockbuf_t* bb);
-static void blockbuf_unregister(blockbuf_t* bb);
+static size_t logline_format(char*                 wp,
+                             int                   priority,
+                             size_t                sesid,
+                             const struct timeval* tv,
+                             bool                  do_highprecision,
+                             bool                  do_syslog,
+                             size_t                prefix_len,
+                             size_t                str_len,
+                             const char*           str);
+static logring_t* logring_get();
+static void logring_write(const char* str, size_t len, bool flush);
+static void logring_drain(logring_t* ring, skygw_file_t* file, bool flush);
+static bool logdeferred_write(int priority, const char* function, const char* format, va_list valist);
+static size_t logdeferred_format(const char* record, char* line);
+static void log_throttle_report();
 static char* add_slash(char* str);
 
 static bool check_file_and_path(char* filename,
@@ -362,14 +445,17 @@ static bool logmanager_init_nomutex(const char* ident,
     lm->lm_chk_top   = CHK_NUM_LOGMANAGER;
     lm->lm_chk_tail  = CHK_NUM_LOGMANAGER;
     write_index = 0;
-    block_start_index = 0;
     prevval = -1;
     simple_mutex_init(&msg_mutex, "Message mutex");
 #endif
     lm->lm_clientmes = skygw_message_init();
     lm->lm_logmes    = skygw_message_init();
+    lm->lm_archivemes = skygw_message_init();
+    lm->lm_archiverdone = skygw_message_init();
+    ilist_init(&lm->lm_archiveq);
 
-    if (lm->lm_clientmes == NULL || lm->lm_logmes == NULL)
+    if (lm->lm_clientmes == NULL || lm->lm_logmes == NULL ||
+        lm->lm_archivemes == NULL || lm->lm_archiverdone == NULL)
     {
         err = 1;
         goto return_succ;
@@ -419,6 +505,24 @@ static bool logmanager_init_nomutex(const char* ident,
         goto return_succ;
     }
 
+    /** Start the archiver before the file writer that gives it the rotated files */
+    lm->lm_archiver = skygw_thread_init("logarchiver thr", thr_logarchiver_fun, NULL);
+
+    if (lm->lm_archiver == NULL)
+    {
+        err = 1;
+        goto return_succ;
+    }
+
+    if ((err = skygw_thread_start(lm->lm_archiver)) != 0)
+    {
+        skygw_thread_done(lm->lm_archiver);
+        lm->lm_archiver = NULL;
+        goto return_succ;
+    }
+    /** Wait message from logarchiver_thr */
+    skygw_message_wait(lm->lm_archiverdone);
+
     /** Initialize and start filewriter thread */
     fw->fwr_thread = skygw_thread_init("filewriter thr", thr_filewriter_fun, (void *)fw);
 
@@ -507,6 +611,14 @@ static void logmanager_done_nomutex(void)
         skygw_thread_done(fwr->fwr_thread);
     }
 
+    /** The file writer may have rotated the file while it stopped */
+    if (lm->lm_archiver)
+    {
+        skygw_thread_set_exitflag(lm->lm_archiver, lm->lm_archivemes, lm->lm_archiverdone);
+        skygw_thread_done(lm->lm_archiver);
+        lm->lm_archiver = NULL;
+    }
+
     /** Free filewriter memory. */
     filewriter_done(fwr);
 
@@ -520,6 +632,8 @@ static void logmanager_done_nomutex(void)
     fnames_conf_done(&lm->lm_fnames_conf);
     skygw_message_done(lm->lm_clientmes);
     skygw_message_done(lm->lm_logmes);
+    skygw_message_done(lm->lm_archivemes);
+    skygw_message_done(lm->lm_archiverdone);
 
     /** Set global pointer NULL to prevent access to freed data. */
     free(lm);
@@ -599,14 +713,6 @@ static int logmanager_write_log(int            priority,
                                 size_t         str_len,
                                 const char*    str)
 {
-    logfile_t*   lf;
-    char*        wp;
-    int          err = 0;
-    blockbuf_t*  bb;
-    blockbuf_t*  bb_c;
-    size_t       timestamp_len;
-    int          i;
-
     // The config parameters are copied to local variables, because the values in
     // log_config may change during the course of the function, with would have
     // unpleasant side-effects.
@@ -619,9 +725,81 @@ static int logmanager_write_log(int            priority,
     CHK_LOGMANAGER(lm);
 
     // All messages are now logged to the error log file.
-    lf = &lm->lm_logfile;
+    logfile_t* lf = &lm->lm_logfile;
     CHK_LOGFILE(lf);
 
+#if defined (SS_LOG_DEBUG)
+    {
+        char *copy, *tok;
+        int tokval;
+
+        simple_mutex_lock(&msg_mutex, true);
+        copy = strdup(str);
+        tok = strtok(copy, "|");
+        tok = strtok(NULL, "|");
+
+        if (strstr(str, "message|") && tok)
+        {
+            tokval = atoi(tok);
+
+            if (prevval > 0)
+            {
+                ss_dassert(tokval == (prevval + 1));
+            }
+            prevval = tokval;
+        }
+        free(copy);
+        simple_mutex_unlock(&msg_mutex);
+    }
+#endif
+    /**
+     * The message is formatted in a buffer of the thread and copied to the
+     * ring of the thread once it is complete.
+     */
+    size_t len = logline_format(log_scratch, priority, mxs_log_tls.li_sesid, NULL,
+                                do_highprecision, do_syslog, prefix_len, str_len, str);
+
+    if (do_maxlog)
+    {
+        // All messages are now logged to the error log file.
+        logring_write(log_scratch, len, flush == LOG_FLUSH_YES);
+    }
+
+    return 0;
+}
+
+/**
+ * Format a line of the log file: the timestamp, the session id of an info
+ * message and the message, truncated to the size of the buffer of the log
+ * file. Messages of priority notice and above are also written to syslog.
+ *
+ * @param wp                The buffer, MAX_LOGSTRLEN bytes
+ * @param priority          Syslog priority
+ * @param sesid             The session id of the message, 0 if none
+ * @param tv                The time of the message, NULL for the current time
+ * @param do_highprecision  Whether the timestamp has milliseconds
+ * @param do_syslog         Whether the message is written to syslog
+ * @param prefix_len        length of prefix to be stripped away when syslogging
+ * @param str_len           length of str (including terminating NULL).
+ * @param str               The prefix and the message
+ *
+ * @return The length of the line, which ends with a line feed but is not
+ *         NULL terminated
+ */
+static size_t logline_format(char*                 wp,
+                             int                   priority,
+                             size_t                sesid,
+                             const struct timeval* tv,
+                             bool                  do_highprecision,
+                             bool                  do_syslog,
+                             size_t                prefix_len,
+                             size_t                str_len,
+                             const char*           str)
+{
+    char*        msg = wp;
+    size_t       timestamp_len;
+    logfile_t*   lf = &lm->lm_logfile;
+
     /** Length of string that will be written, limited by bufsize */
     size_t safe_str_len;
     /** Length of session id */
@@ -632,9 +810,9 @@ static int logmanager_write_log(int            priority,
      * If session id is stored to mxs_log_tls structure, allocate
      * room for session id too.
      */
-    if ((priority == LOG_INFO) && (mxs_log_tls.li_sesid != 0))
+    if ((priority == LOG_INFO) && (sesid != 0))
     {
-        sesid_str_len = 5 * sizeof(char) + get_decimal_len(mxs_log_tls.li_sesid);
+        sesid_str_len = 5 * sizeof(char) + get_decimal_len(sesid);
     }
     else
     {
@@ -661,50 +839,6 @@ static int logmanager_write_log(int            priority,
     {
         safe_str_len = timestamp_len - sizeof(char) + cmplen + str_len;
     }
-    /**
-     * Seek write position and register to block buffer.
-     * Then print formatted string to write position.
-     */
-
-#if defined (SS_LOG_DEBUG)
-    {
-        char *copy, *tok;
-        int tokval;
-
-        simple_mutex_lock(&msg_mutex, true);
-        copy = strdup(str);
-        tok = strtok(copy, "|");
-        tok = strtok(NULL, "|");
-
-        if (strstr(str, "message|") && tok)
-        {
-            tokval = atoi(tok);
-
-            if (prevval > 0)
-            {
-                ss_dassert(tokval == (prevval + 1));
-            }
-            prevval = tokval;
-        }
-        free(copy);
-        simple_mutex_unlock(&msg_mutex);
-    }
-#endif
-    /** Book space for log string from buffer */
-    if (do_maxlog)
-    {
-        // All messages are now logged to the error log file.
-        wp = blockbuf_get_writepos(&bb, safe_str_len, flush);
-    }
-    else
-    {
-        wp = (char*)malloc(sizeof(char) * (timestamp_len - sizeof(char) + cmplen + str_len + 1));
-    }
-
-    if (wp == NULL)
-    {
-        return -1;
-    }
 
 #if defined (SS_LOG_DEBUG)
     {
@@ -718,7 +852,11 @@ static int logmanager_write_log(int            priority,
      * to wp.
      * Returned timestamp_len doesn't include terminating null.
      */
-    if (do_highprecision)
+    if (tv)
+    {
+        timestamp_len = snprint_timestamp_tv(wp, timestamp_len, tv, do_highprecision);
+    }
+    else if (do_highprecision)
     {
         timestamp_len = snprint_timestamp_hp(wp, timestamp_len);
     }
@@ -731,7 +869,7 @@ static int logmanager_write_log(int            priority,
         /**
          * Write session id
          */
-        snprintf(wp + timestamp_len, sesid_str_len, "[%lu]  ", mxs_log_tls.li_sesid);
+        snprintf(wp + timestamp_len, sesid_str_len, "[%lu]  ", sesid);
         sesid_str_len -= 1; /*< don't calculate terminating char anymore */
     }
     /**
@@ -777,403 +915,246 @@ static int logmanager_write_log(int            priority,
     }
     wp[safe_str_len - 1] = '\n';
 
-    if (do_maxlog)
-    {
-        blockbuf_unregister(bb);
-    }
-    else
-    {
-        free(wp);
-    }
-
-    return err;
+    return wp + safe_str_len - msg;
 }
 
 /**
- * Register writer to a block buffer. When reference counter is non-zero the
- * flusher thread doesn't write the block to disk.
+ * Mark the ring of an exiting thread orphaned. The file writer frees it once
+ * it has written the remaining messages.
  *
- * @param bb    block buffer
+ * @param data  The ring of the thread
  */
-static void blockbuf_register(blockbuf_t* bb)
+static void logring_orphan(void* data)
 {
-    CHK_BLOCKBUF(bb);
-    ss_dassert(bb->bb_refcount >= 0);
-    atomic_add(&bb->bb_refcount, 1);
+    logring_t* ring = (logring_t *)data;
+
+    /** A destructor that runs later and logs gets a new ring */
+    log_ring = NULL;
+    __sync_synchronize();
+    ring->lr_orphaned = true;
+}
+
+static void logring_init_key()
+{
+    pthread_key_create(&log_ring_key, logring_orphan);
 }
 
 /**
- * Unregister writer from block buffer. If the buffer got filled up and there
- * are no other registered writers anymore, notify the flusher thread.
+ * Return the ring of the calling thread, creating it on the first call
  *
- * @param bb    block buffer
+ * @return The ring or NULL if memory could not be allocated
  */
-static void blockbuf_unregister(blockbuf_t* bb)
+static logring_t* logring_get()
 {
-    logfile_t* lf;
-
-    CHK_BLOCKBUF(bb);
-    ss_dassert(bb->bb_refcount >= 1);
-    lf = &lm->lm_logfile;
-    CHK_LOGFILE(lf);
-    /**
-     * if this is the last client in a full buffer, send write request.
-     */
-    if (atomic_add(&bb->bb_refcount, -1) == 1 && bb->bb_state == BB_FULL)
+    if (log_ring == NULL)
     {
-        skygw_message_send(lf->lf_logmes);
+        pthread_once(&log_ring_once, logring_init_key);
+
+        if ((log_ring = (logring_t *)calloc(1, sizeof(logring_t))) != NULL)
+        {
+            pthread_setspecific(log_ring_key, log_ring);
+            istack_push(&log_rings, &log_ring->lr_node);
+        }
     }
-    ss_dassert(bb->bb_refcount >= 0);
+    return log_ring;
 }
 
-
 /**
- * @node (write brief function description here)
- *
- * Parameters:
- * @param id - <usage>
- *          <description>
- *
- * @param str_len - <usage>
- *          <description>
- *
- * @return
- *
- *
- * @details List mutex now protects both the list and the contents of it.
- * TODO : It should be so that adding and removing nodes of the list is protected
- * by the list mutex. Buffer modifications should be protected by buffer
- * mutex.
+ * Copy a complete message to the ring of the calling thread. The file writer
+ * is woken up if the message must be flushed or if the ring is half full.
  *
+ * @param str   The message
+ * @param len   The length of the message
+ * @param flush Whether the message should be written to the file at once
  */
-static char* blockbuf_get_writepos(blockbuf_t** p_bb,
-                                   size_t       str_len,
-                                   bool         flush)
+static void logring_write(const char* str, size_t len, bool flush)
 {
-    logfile_t*     lf;
-    mlist_t*       bb_list;
-    char*          pos = NULL;
-    mlist_node_t*  node;
-    blockbuf_t*    bb;
-#if defined(SS_DEBUG)
-    bool           succ;
-#endif
+    logring_t* ring = logring_get();
 
-    CHK_LOGMANAGER(lm);
-    lf = &lm->lm_logfile;
-    CHK_LOGFILE(lf);
-    bb_list = &lf->lf_blockbuf_list;
+    if (ring == NULL)
+    {
+        return;
+    }
 
-    /** Lock list */
-    simple_mutex_lock(&bb_list->mlist_mutex, true);
-    CHK_MLIST(bb_list);
+    size_t head = ring->lr_head;
+    size_t used = head - ring->lr_tail;
 
-    if (bb_list->mlist_nodecount > 0)
+    if (LOG_RING_SIZE - used < len)
     {
-        /**
-         * At least block buffer exists on the list.
-         */
-        node = bb_list->mlist_first;
+        ring->lr_dropped += 1;
+        return;
+    }
 
-        /** Loop over blockbuf list to find write position */
-        while (true)
-        {
-            CHK_MLIST_NODE(node);
+    size_t pos = head % LOG_RING_SIZE;
+    size_t n = MIN(len, LOG_RING_SIZE - pos);
 
-            /** Unlock list */
-            simple_mutex_unlock(&bb_list->mlist_mutex);
+    memcpy(ring->lr_buf + pos, str, n);
+    memcpy(ring->lr_buf, str + n, len - n);
 
-            bb = (blockbuf_t *)node->mlnode_data;
-            CHK_BLOCKBUF(bb);
+    /** The message must be in the ring before the file writer sees the new head */
+    __sync_synchronize();
+    ring->lr_head = head + len;
 
-            /** Lock buffer */
-            simple_mutex_lock(&bb->bb_mutex, true);
+    if (flush || (used < LOG_RING_SIZE / 2 && used + len >= LOG_RING_SIZE / 2))
+    {
+        skygw_message_send(lm->lm_logfile.lf_logmes);
+    }
+}
 
-            if (bb->bb_state == BB_FULL || bb->bb_buf_left < str_len)
-            {
-                /**
-                 * This block buffer is too full.
-                 * Send flush request to file writer thread. This causes
-                 * flushing all buffers, and (eventually) frees buffer space.
-                 */
-                blockbuf_register(bb);
+/**
+ * Copy bytes out of a ring, wrapping around at its end
+ *
+ * @param ring  The ring
+ * @param tail  The position of the first byte
+ * @param dest  Where the bytes are copied
+ * @param len   The number of bytes
+ */
+static void logring_copy(logring_t* ring, size_t tail, char* dest, size_t len)
+{
+    size_t pos = tail % LOG_RING_SIZE;
+    size_t n = MIN(len, LOG_RING_SIZE - pos);
 
-                bb->bb_state = BB_FULL;
+    memcpy(dest, ring->lr_buf + pos, n);
+    memcpy(dest + n, ring->lr_buf, len - n);
+}
 
-                blockbuf_unregister(bb);
+/**
+ * Write formatted messages to the log file, disabling the log if that fails
+ *
+ * @param file  The log file
+ * @param buf   The messages
+ * @param len   The length of the messages
+ * @param flush Whether the file should be flushed to disk
+ */
+static void logring_write_file(skygw_file_t* file, char* buf, size_t len, bool flush)
+{
+    int err = skygw_file_write(file, buf, len, flush);
 
-                /** Unlock buffer */
-                simple_mutex_unlock(&bb->bb_mutex);
+    lm->lm_filewriter.fwr_file_size += len;
 
-                /** Lock list */
-                simple_mutex_lock(&bb_list->mlist_mutex, true);
+    if (err)
+    {
+        // TODO: Log this to syslog.
+        char errbuf[STRERROR_BUFLEN];
+        fprintf(stderr,
+                "Error : Writing to the log-file %s failed due to (%d, %s). "
+                "Disabling writing to the log.",
+                lm->lm_logfile.lf_full_file_name,
+                err,
+                strerror_r(err, errbuf, sizeof(errbuf)));
 
+        mxs_log_set_maxlog_enabled(false);
+    }
+}
 
-                /**
-                 * If next node exists move forward. Else check if there is
-                 * space for a new block buffer on the list.
-                 */
-                if (node != bb_list->mlist_last)
-                {
-                    node = node->mlnode_next;
-                    continue;
-                }
-                /**
-                 * All buffers on the list are full.
-                 */
-                if (bb_list->mlist_nodecount < bb_list->mlist_nodecount_max)
-                {
-                    /**
-                     * New node is created
-                     */
-                    if ((bb = blockbuf_init()) == NULL)
-                    {
-                        simple_mutex_unlock(&bb_list->mlist_mutex);
-                        return NULL;
-                    }
+/**
+ * Write the messages in a ring to the log file. The formatted messages are
+ * written as they are and the deferred ones are formatted first. Called only
+ * by the file writer thread.
+ *
+ * @param ring  The ring
+ * @param file  The log file
+ * @param flush Whether the file should be flushed to disk
+ */
+static void logring_drain(logring_t* ring, skygw_file_t* file, bool flush)
+{
+    /** Only the file writer uses these */
+    static char record[MAX_LOGSTRLEN];
+    static char line[MAX_LOGSTRLEN];
 
-                    CHK_BLOCKBUF(bb);
+    size_t head = ring->lr_head;
+    size_t tail = ring->lr_tail;
+    size_t dropped = ring->lr_dropped;
 
-                    /**
-                     * Increase version to odd to mark list update active
-                     * update.
-                     */
-                    bb_list->mlist_versno += 1;
-                    ss_dassert(bb_list->mlist_versno % 2 == 1);
+    /** The messages up to the head must be read after the head */
+    __sync_synchronize();
 
-                    ss_debug(succ = ) mlist_add_data_nomutex(bb_list, bb);
-                    ss_dassert(succ);
+    while (tail < head)
+    {
+        size_t pos = tail % LOG_RING_SIZE;
+        size_t n = MIN(head - tail, LOG_RING_SIZE - pos);
+        char* start = ring->lr_buf + pos;
+        char* marker = (char *)memchr(start, LOG_RECORD_MARKER, n);
 
-                    /**
-                     * Increase version to even to mark completion of update.
-                     */
-                    bb_list->mlist_versno += 1;
-                    ss_dassert(bb_list->mlist_versno % 2 == 0);
-                }
-                else
-                {
-                    /**
-                     * List and buffers are full.
-                     * Reset to the beginning of the list, and wait until
-                     * there is a block buffer with enough space.
-                     */
-                    simple_mutex_unlock(&bb_list->mlist_mutex);
-                    simple_mutex_lock(&bb_list->mlist_mutex, true);
-
-                    node = bb_list->mlist_first;
-                    continue;
-                }
+        if (marker == start)
+        {
+            uint32_t len;
 
-            }
-            else if (bb->bb_state == BB_CLEARED)
+            logring_copy(ring, tail + offsetof(logdeferred_t, ld_len), (char *)&len, sizeof(len));
+            logring_copy(ring, tail, record, len);
+            n = len;
+            logring_write_file(file, line, logdeferred_format(record, line), flush && tail + n == head);
+        }
+        else
+        {
+            if (marker)
             {
+                /** The formatted messages before the next deferred one */
+                n = marker - start;
+            }
+            logring_write_file(file, start, n, flush && tail + n == head);
+        }
+        tail += n;
+    }
 
-                /**
-                 *Move the cleared buffer to the end of the list if it is the first one in the list
-                 */
+    /** The messages must be copied before the thread can overwrite them */
+    __sync_synchronize();
+    ring->lr_tail = tail;
 
-                simple_mutex_unlock(&bb->bb_mutex);
-                simple_mutex_lock(&bb_list->mlist_mutex, true);
+    if (dropped != ring->lr_reported)
+    {
+        char buf[128];
+        size_t len = get_timestamp_len();
 
-                if (node == bb_list->mlist_first)
-                {
+        len = snprint_timestamp(buf, len);
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        "warning: %lu log messages of a thread were dropped, "
+                        "the log could not be written fast enough.\n",
+                        dropped - ring->lr_reported);
+        skygw_file_write(file, buf, MIN(len, sizeof(buf) - 1), flush);
+        ring->lr_reported = dropped;
+    }
+}
 
-                    if ((bb_list->mlist_nodecount > 1) && (node != bb_list->mlist_last))
-                    {
-                        bb_list->mlist_last->mlnode_next = bb_list->mlist_first;
-                        bb_list->mlist_first = bb_list->mlist_first->mlnode_next;
-                        bb_list->mlist_last->mlnode_next->mlnode_next = NULL;
-                        bb_list->mlist_last = bb_list->mlist_last->mlnode_next;
-                    }
+/**
+ * Set log augmentation.
+ *
+ * @param bits One of the log_augmentation_t constants.
+ */
+void mxs_log_set_augmentation(int bits)
+{
+    log_config.augmentation = bits & MXS_LOG_AUGMENTATION_MASK;
+}
 
-                    ss_dassert(node == bb_list->mlist_last);
+/**
+ * Helper for skygw_log_write and friends.
+ *
+ * @param int        The syslog priority.
+ * @param file       The name of the file where the logging was made.
+ * @param int        The line where the logging was made.
+ * @param function   The function where the logging was made.
+ * @param prefix_len The length of the text to be stripped away when syslogging.
+ * @param len        Length of str, including terminating NULL.
+ * @param str        String
+ * @param flush      Whether the message should be flushed.
+ *
+ * @return 0 if the logging to at least one log succeeded.
+ */
 
-                    simple_mutex_unlock(&bb_list->mlist_mutex);
-                    simple_mutex_lock(&bb->bb_mutex, true);
+static int log_write(int            priority,
+                     const char*    file,
+                     int            line,
+                     const char*    function,
+                     size_t         prefix_len,
+                     size_t         len,
+                     const char*    str,
+                     enum log_flush flush)
+{
+    int rv = -1;
 
-                    bb->bb_state = BB_READY;
-
-                    simple_mutex_unlock(&bb->bb_mutex);
-                    simple_mutex_lock(&bb_list->mlist_mutex, true);
-                    node = bb_list->mlist_first;
-                }
-                else
-                {
-                    if (node->mlnode_next)
-                    {
-                        node = node->mlnode_next;
-                    }
-                    else
-                    {
-                        node = bb_list->mlist_first;
-                    }
-                    continue;
-                }
-
-            }
-            else if (bb->bb_state == BB_READY)
-            {
-                /**
-                 * There is space for new log string.
-                 */
-                break;
-            }
-        } /** while (true) */
-    }
-    else
-    {
-
-        /**
-         * Create the first block buffer to logfile's blockbuf list.
-         */
-
-        if ((bb = blockbuf_init()) == NULL)
-        {
-            return NULL;
-        }
-
-        CHK_BLOCKBUF(bb);
-
-        /** Lock buffer */
-        simple_mutex_lock(&bb->bb_mutex, true);
-        /**
-         * Increase version to odd to mark list update active update.
-         */
-        bb_list->mlist_versno += 1;
-        ss_dassert(bb_list->mlist_versno % 2 == 1);
-
-        ss_debug(succ = ) mlist_add_data_nomutex(bb_list, bb);
-        ss_dassert(succ);
-
-        /**
-         * Increase version to even to mark completion of update.
-         */
-        bb_list->mlist_versno += 1;
-        ss_dassert(bb_list->mlist_versno % 2 == 0);
-
-        /** Unlock list */
-        simple_mutex_unlock(&bb_list->mlist_mutex);
-    } /* if (bb_list->mlist_nodecount > 0) */
-
-    ss_dassert(pos == NULL);
-    ss_dassert(!(bb->bb_state == BB_FULL || bb->bb_buf_left < str_len));
-    ss_dassert(bb_list->mlist_nodecount <= bb_list->mlist_nodecount_max);
-
-    /**
-     * Registration to blockbuf adds reference for the write operation.
-     * It indicates that client has allocated space from the buffer,
-     * but not written yet. As long as refcount > 0 buffer can't be
-     * written to disk.
-     */
-    blockbuf_register(bb);
-    *p_bb = bb;
-    /**
-     * At this point list mutex is held and bb points to a node with
-     * enough space available. pos is not yet set.
-     */
-    pos = &bb->bb_buf[bb->bb_buf_used];
-    bb->bb_buf_used += str_len;
-    bb->bb_buf_left -= str_len;
-
-    ss_dassert((pos >= &bb->bb_buf[0]) && (pos <= &bb->bb_buf[MAX_LOGSTRLEN - str_len]));
-
-    /** read checkmark */
-    /** TODO: add buffer overflow checkmark
-        chk_val = (int)bb->bb_buf[bb->bb_buf_used-count_len];
-        ss_dassert(chk_val == bb->bb_strcount);
-    */
-
-    /** TODO : write next checkmark
-        bb->bb_strcount += 1;
-        memcpy(&bb->bb_buf[bb->bb_buf_used], &bb->bb_strcount, count_len);
-        bb->bb_buf_used += count_len;
-        bb->bb_buf_left -= count_len;
-    */
-
-    /**
-     * If flush flag is set, set buffer full. As a consequence, no-one
-     * can write to it before it is flushed to disk.
-     */
-    bb->bb_state = (flush == true ? BB_FULL : bb->bb_state);
-
-    /** Unlock buffer */
-    simple_mutex_unlock(&bb->bb_mutex);
-    return pos;
-}
-
-static void blockbuf_node_done(void* bb_data)
-{
-    blockbuf_t* bb = (blockbuf_t *)bb_data;
-    simple_mutex_done(&bb->bb_mutex);
-}
-
-
-static blockbuf_t* blockbuf_init()
-{
-    blockbuf_t* bb;
-
-    if ((bb = (blockbuf_t *) calloc(1, sizeof (blockbuf_t))))
-    {
-#if defined(SS_DEBUG)
-        bb->bb_chk_top = CHK_NUM_BLOCKBUF;
-        bb->bb_chk_tail = CHK_NUM_BLOCKBUF;
-#endif
-        simple_mutex_init(&bb->bb_mutex, "Blockbuf mutex");
-        bb->bb_buf_left = MAX_LOGSTRLEN;
-        bb->bb_buf_size = MAX_LOGSTRLEN;
-#if defined(SS_LOG_DEBUG)
-        sprintf(bb->bb_buf, "[block:%d]", atomic_add(&block_start_index, 1));
-        bb->bb_buf_used += strlen(bb->bb_buf);
-        bb->bb_buf_left -= strlen(bb->bb_buf);
-#endif
-        CHK_BLOCKBUF(bb);
-    }
-    else
-    {
-        fprintf(stderr, "Error: Memory allocation failed when initializing log manager block buffers.");
-    }
-    return bb;
-}
-
-/**
- * Set log augmentation.
- *
- * @param bits One of the log_augmentation_t constants.
- */
-void mxs_log_set_augmentation(int bits)
-{
-    log_config.augmentation = bits & MXS_LOG_AUGMENTATION_MASK;
-}
-
-/**
- * Helper for skygw_log_write and friends.
- *
- * @param int        The syslog priority.
- * @param file       The name of the file where the logging was made.
- * @param int        The line where the logging was made.
- * @param function   The function where the logging was made.
- * @param prefix_len The length of the text to be stripped away when syslogging.
- * @param len        Length of str, including terminating NULL.
- * @param str        String
- * @param flush      Whether the message should be flushed.
- *
- * @return 0 if the logging to at least one log succeeded.
- */
-
-static int log_write(int            priority,
-                     const char*    file,
-                     int            line,
-                     const char*    function,
-                     size_t         prefix_len,
-                     size_t         len,
-                     const char*    str,
-                     enum log_flush flush)
-{
-    int rv = -1;
-
-    if (logmanager_register(true))
-    {
-        CHK_LOGMANAGER(lm);
+    if (logmanager_register(true))
+    {
+        CHK_LOGMANAGER(lm);
 
         rv = logmanager_write_log(priority, flush, prefix_len, len, str);
 
@@ -1569,6 +1550,13 @@ static bool logfile_open_file(filewriter_t* fw, logfile_t* lf)
         // Error logged by skygw_file_init to stderr.
         rv = false;
     }
+    else
+    {
+        /** The file is appended to, its size counts towards the rotation size */
+        struct stat st;
+
+        fw->fwr_file_size = fstat(fileno(fw->fwr_file->sf_file), &st) == 0 ? st.st_size : 0;
+    }
 
     return rv;
 }
@@ -1904,23 +1892,6 @@ static bool logfile_init(logfile_t*    logfile,
     {
         goto return_with_succ;
     }
-    /**
-     * Create a block buffer list for log file. Clients' writes go to buffers
-     * from where separate log flusher thread writes them to disk.
-     */
-    if (mlist_init(&logfile->lf_blockbuf_list,
-                   NULL,
-                   strdup("logfile block buffer list"),
-                   blockbuf_node_done,
-                   MAXNBLOCKBUFS) == NULL)
-    {
-        ss_dfprintf(stderr,
-                    "*\n* Error : Initializing buffers for log files "
-                    "failed.");
-        logfile_free_memory(logfile);
-        goto return_with_succ;
-    }
-
     succ = true;
     logfile->lf_state = RUN;
     CHK_LOGFILE(logfile);
@@ -1962,11 +1933,6 @@ static void logfile_done(logfile_t* lf)
             ss_dassert(lf->lf_npending_writes == 0);
         /** fallthrough */
         case INIT:
-            /** Test if list is initialized before freeing it */
-            if (lf->lf_blockbuf_list.mlist_versno != 0)
-            {
-                mlist_done(&lf->lf_blockbuf_list);
-            }
             logfile_free_memory(lf);
             lf->lf_state = DONE;
         /** fallthrough */
@@ -2087,149 +2053,277 @@ static bool thr_flush_file(logmanager_t *lm, filewriter_t *fwr)
     lf->lf_flushflag  = false;
     lf->lf_rotateflag = false;
     release_lock(&lf->lf_spinlock);
+
+    size_t rotate_size = log_config.rotate_size;
+
     /**
      * Log rotation :
-     * Close current, and open a new file for the log.
+     * Open a new file for the log and leave the old one to the archiver.
+     * The messages in the rings are written to the new file.
+     */
+    if (rotate_logfile ||
+        (rotate_size && !log_config.use_stdout && fwr->fwr_file_size >= rotate_size))
+    {
+        logfile_switch(lm, fwr, lf);
+        file = fwr->fwr_file;
+    }
+    /**
+     * Write the rings of the threads. The rings of the exited threads are
+     * freed once they are empty. The threads push their rings without a lock
+     * and this is the only thread that removes them.
      */
-    if (rotate_logfile)
+    bool flush = flush_logfile || do_flushall;
+    ILIST_NODE* prev = NULL;
+    ILIST_NODE* node = log_rings.head;
+
+    while (node != NULL)
     {
-        bool succ;
+        logring_t* ring = ILIST_ENTRY(node, logring_t, lr_node);
+        ILIST_NODE* next = node->next;
+        bool orphaned = ring->lr_orphaned;
 
-        lf->lf_name_seqno += 1; /*< new sequence number */
+        /** The thread of an orphaned ring has written its last message */
+        __sync_synchronize();
+        logring_drain(ring, file, flush);
 
-        if (!(succ = logfile_build_name(lf)))
-        {
-            lf->lf_name_seqno -= 1; /*< restore */
-        }
-        else if ((succ = logfile_open_file(fwr, lf)))
+        if (orphaned)
         {
-            if (log_config.use_stdout)
-            {
-                skygw_file_free(file);
-            }
-            else
-            {
-                skygw_file_close(file, false); /*< close old file */
-            }
+            istack_remove(&log_rings, prev, node);
+            free(ring);
         }
-
-        if (!succ)
+        else
         {
-            MXS_ERROR("Log rotation failed. "
-                      "Creating replacement file %s "
-                      "failed. Continuing "
-                      "logging to existing file.",
-                      lf->lf_full_file_name);
+            prev = node;
         }
-        return true;
+        node = next;
     }
+
     /**
-     * get logfile's block buffer list
+     * Writer's exit flag was set after checking it.
+     * Loop is restarted to ensure that all logfiles are
+     * flushed.
      */
-    mlist_t *bb_list = &lf->lf_blockbuf_list;
-#if defined(SS_DEBUG)
-    simple_mutex_lock(&bb_list->mlist_mutex, true);
-    CHK_MLIST(bb_list);
-    simple_mutex_unlock(&bb_list->mlist_mutex);
-#endif
-    mlist_node_t *node = bb_list->mlist_first;
 
-    while (node != NULL)
+    bool done = true;
+
+    if (flushall_started_flag)
+    {
+        flushall_started_flag = false;
+        flushall_done_flag = true;
+        done = false;
+    }
+
+    return done;
+}
+
+/**
+ * Give a rotated log file to the archiver thread
+ *
+ * @param lm        The log manager
+ * @param file      The old log file
+ * @param compress  Whether the file should be compressed
+ */
+static void logarchive_add(logmanager_t* lm, skygw_file_t* file, bool compress)
+{
+    logarchive_t* archive = (logarchive_t *)malloc(sizeof(logarchive_t));
+
+    if (archive == NULL)
     {
-        int err = 0;
+        /** Close it here rather than leak it */
+        skygw_file_close(file, false);
+        return;
+    }
+
+    archive->la_file = file;
+    archive->la_compress = compress;
 
-        CHK_MLIST_NODE(node);
-        blockbuf_t *bb = (blockbuf_t *)node->mlnode_data;
-        CHK_BLOCKBUF(bb);
+    acquire_lock(&lm->lm_archiveq_lock);
+    ilist_push(&lm->lm_archiveq, &archive->la_node);
+    release_lock(&lm->lm_archiveq_lock);
 
-        /** Lock block buffer */
-        simple_mutex_lock(&bb->bb_mutex, true);
+    skygw_message_send(lm->lm_archivemes);
+}
+
+/**
+ * Switch the log to a file with the next sequence number. The new file is
+ * opened before the old one is released, so if opening it fails the log is
+ * still written to the old file. The old file is closed and compressed by the
+ * archiver thread so that the file writer can go on draining the rings.
+ *
+ * @param lm    The log manager
+ * @param fwr   The file writer
+ * @param lf    The log file
+ * @return True if the log was switched to a new file
+ */
+static bool logfile_switch(logmanager_t* lm, filewriter_t* fwr, logfile_t* lf)
+{
+    skygw_file_t* file = fwr->fwr_file;
+    size_t file_size = fwr->fwr_file_size;
+    char* file_name = lf->lf_full_file_name;
+    char* link_name = lf->lf_full_link_name;
+    bool succ;
 
-        blockbuf_state_t flush_blockbuf = bb->bb_state;
+    lf->lf_full_file_name = NULL;
+    lf->lf_full_link_name = NULL;
+    lf->lf_name_seqno += 1; /*< new sequence number */
 
-        if (bb->bb_buf_used != 0 &&
-            ((flush_blockbuf == BB_FULL) || flush_logfile || do_flushall))
+    if ((succ = logfile_build_name(lf) && logfile_open_file(fwr, lf)))
+    {
+        if (log_config.use_stdout)
         {
-            /**
-             * buffer is at least half-full
-             * -> write to disk
-             */
-            while (bb->bb_refcount > 0)
-            {
-                simple_mutex_unlock(&bb->bb_mutex);
-                simple_mutex_lock(&bb->bb_mutex, true);
-            }
-            err = skygw_file_write(file,
-                                   (void *)bb->bb_buf,
-                                   bb->bb_buf_used,
-                                   (flush_logfile || do_flushall));
-            if (err)
-            {
-                // TODO: Log this to syslog.
-                char errbuf[STRERROR_BUFLEN];
-                fprintf(stderr,
-                        "Error : Writing to the log-file %s failed due to (%d, %s). "
-                        "Disabling writing to the log.",
-                        lf->lf_full_file_name,
-                        err,
-                        strerror_r(err, errbuf, sizeof(errbuf)));
-
-                mxs_log_set_maxlog_enabled(false);
-            }
-            /**
-             * Reset buffer's counters and mark
-             * not full.
-             */
-            bb->bb_buf_left = bb->bb_buf_size;
-            bb->bb_buf_used = 0;
-            memset(bb->bb_buf, 0, bb->bb_buf_size);
-            bb->bb_state = BB_CLEARED;
-#if defined(SS_LOG_DEBUG)
-            sprintf(bb->bb_buf, "[block:%d]", atomic_add(&block_start_index, 1));
-            bb->bb_buf_used += strlen(bb->bb_buf);
-            bb->bb_buf_left -= strlen(bb->bb_buf);
-#endif
+            skygw_file_free(file);
+        }
+        else
+        {
+            /** A link in the log directory would point to the removed file */
+            logarchive_add(lm, file, log_config.do_compress && !lf->lf_store_shmem);
+        }
+        free(file_name);
+        free(link_name);
+    }
+    else
+    {
+        MXS_ERROR("Log rotation failed. "
+                  "Creating replacement file %s "
+                  "failed. Continuing "
+                  "logging to existing file.",
+                  lf->lf_full_file_name ? lf->lf_full_file_name : "");
+
+        lf->lf_name_seqno -= 1; /*< restore */
+        free(lf->lf_full_file_name);
+        free(lf->lf_full_link_name);
+        lf->lf_full_file_name = file_name;
+        lf->lf_full_link_name = link_name;
+        fwr->fwr_file = file;
+        /** A failed size based rotation is retried after as many bytes again */
+        fwr->fwr_file_size = file_size < log_config.rotate_size ? file_size : 0;
+    }
+
+    return succ;
+}
+
+/**
+ * Compress a closed log file to a file with the suffix .gz and remove it. If
+ * the compression fails the file is kept as it is.
+ *
+ * @param name  The name of the file
+ */
+static void logarchive_compress(const char* name)
+{
+    /** Only the archiver uses this */
+    static char block[LOG_ARCHIVE_BLOCK_SIZE];
+    char gzname[PATH_MAX];
+    gzFile gz = NULL;
+    ssize_t n = -1;
+    bool succ = false;
+    int fd = open(name, O_RDONLY);
+
+    snprintf(gzname, sizeof(gzname), "%s.gz", name);
+
+    if (fd != -1 && (gz = gzopen(gzname, "wb")) != NULL)
+    {
+        succ = true;
 
+        while (succ && (n = read(fd, block, sizeof(block))) > 0)
+        {
+            succ = gzwrite(gz, block, n) == n;
+        }
+
+        /** gzclose writes the end of the stream */
+        succ = gzclose(gz) == Z_OK && succ && n == 0;
+    }
+
+    if (succ)
+    {
+        unlink(name);
+    }
+    else
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Compressing the rotated log file %s failed: %d, %s. The file is "
+                  "left uncompressed.", name, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+
+        if (gz)
+        {
+            unlink(gzname);
         }
-        /** Release lock to block buffer */
-        simple_mutex_unlock(&bb->bb_mutex);
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+/**
+ * Close and compress the files in the archiver queue
+ *
+ * @param lm    The log manager
+ */
+static void logarchive_drain(logmanager_t* lm)
+{
+    ILIST_NODE* node;
+
+    do
+    {
+        acquire_lock(&lm->lm_archiveq_lock);
+        node = ilist_pop(&lm->lm_archiveq);
+        release_lock(&lm->lm_archiveq_lock);
 
-        size_t vn1;
-        size_t vn2;
-        /** Consistent lock-free read on the list */
-        do
+        if (node)
         {
-            while ((vn1 = bb_list->mlist_versno) % 2 != 0)
+            logarchive_t* archive = ILIST_ENTRY(node, logarchive_t, la_node);
+            char* name = archive->la_compress ? strdup(archive->la_file->sf_fname) : NULL;
+
+            skygw_file_close(archive->la_file, false);
+
+            if (name)
             {
-                continue;
+                logarchive_compress(name);
+                free(name);
             }
-            node = node->mlnode_next;
-            vn2 = bb_list->mlist_versno;
+            free(archive);
         }
-        while (vn1 != vn2 && node);
+    }
+    while (node);
+}
 
-    } /* while (node != NULL) */
+/**
+ * @node The log archiver thread. Closes the files left behind by the
+ * rotations, which flushes them to disk, and compresses them. The file writer
+ * would otherwise wait for the disk and the compression while the rings of
+ * the threads fill up. The files left in the queue when the thread is told
+ * to exit are handled before it exits.
+ *
+ * @param data  thread context, skygw_thread_t
+ *
+ * @return NULL
+ */
+static void* thr_logarchiver_fun(void* data)
+{
+    skygw_thread_t* thr = (skygw_thread_t *)data;
 
-    /**
-     * Writer's exit flag was set after checking it.
-     * Loop is restarted to ensure that all logfiles are
-     * flushed.
-     */
+    ss_debug(skygw_thread_set_state(thr, THR_RUNNING));
 
-    bool done = true;
+    /** Inform log manager about the state. */
+    skygw_message_send(lm->lm_archiverdone);
 
-    if (flushall_started_flag)
+    while (!skygw_thread_must_exit(thr))
     {
-        flushall_started_flag = false;
-        flushall_done_flag = true;
-        done = false;
+        skygw_message_wait(lm->lm_archivemes);
+        logarchive_drain(lm);
     }
 
-    return done;
+    logarchive_drain(lm);
+
+    ss_debug(skygw_thread_set_state(thr, THR_STOPPED));
+    /** Inform log manager that the archiver thread has stopped. */
+    skygw_message_send(lm->lm_archiverdone);
+    return NULL;
 }
 
 /**
- * @node Writes block buffers of logfiles to physical log files on disk.
+ * @node Writes the log rings of the threads to the log file on disk.
  *
  * Parameters:
  * @param data - thread context, skygw_thread_t
@@ -2238,38 +2332,20 @@ static bool thr_flush_file(logmanager_t *lm, filewriter_t *fwr)
  * @return
  *
  *
- * @details Waits until receives wake-up message. Scans through block buffer
- * lists of each logfile object.
+ * @details Waits until receives wake-up message and then writes the messages
+ * in the rings of all threads to the log file. A thread wakes the file writer
+ * when its ring becomes half full or when it logs a message that must be
+ * flushed, the log flusher thread wakes it periodically otherwise.
  *
- * Block buffer is written to log file if
- * 1. bb_state == true,
- * 2. logfile object's lf_flushflag == true, or
- * 3. skygw_thread_must_exit returns true.
+ * Log file is flushed (fsync'd) if the logfile object's lf_flushflag is set
+ * or if skygw_thread_must_exit returns true.
  *
- * Log file is flushed (fsync'd) in cases #2 and #3.
- *
- * Concurrency control : block buffer is accessed by file writer (this) and
- * log clients. File writer reads and sets each logfile object's flushflag
- * with spinlock. Another protected section is when block buffer's metadata is
- * read, and optionally the write operation.
- *
- * When block buffer is marked full, logfile's flushflag is set, other
- * log clients don't try to access buffer(s). There may, however, be
- * active writes, on the block in parallel with file writer operations.
- * Each active write corresponds to bb_refcounter values.
- * On the other hand, file writer doesn't process the block buffer before
- * its refcount is zero.
- *
- * Every log file obj. has its own block buffer (linked) list.
- * List is accessed by log clients, which add nodes if necessary, and
- * by file writer which traverses the list and accesses block buffers
- * included in list nodes.
- * List modifications are protected with version numbers.
- * Before
- modification, version is increased by one to be odd. After the
- * completion, it is increased again to even. List can be read only when
- * version is even and read is consistent only if version hasn't changed
- * during the read.
+ * Concurrency control : each ring has a single producer, the thread that owns
+ * it, and a single consumer, the file writer. The producer only advances the
+ * head and the consumer only the tail, with memory barriers ordering the
+ * copying of the messages and the moving of the positions, so neither ever
+ * waits for the other. A thread whose ring is full drops the message and the
+ * file writer reports the number of dropped messages in the log.
  */
 static void* thr_filewriter_fun(void* data)
 {
@@ -2465,19 +2541,66 @@ void mxs_log_set_maxlog_enabled(bool enabled)
 
 
 /**
- * Explicitly ensure that all pending log messages are flushed.
+ * Enable/disable deferred formatting of info and debug messages.
  *
- * @return 0 if the flushing was successfully initiated, otherwise -1.
- *
- * Note that the return value only indicates whether the flushing was
- * successfully initiated, not whether the actual flushing has been
- * performed.
+ * @param enabled True, if the file writer thread should format the info and debug
+ *                messages, false if the logging threads should format them.
  */
-int mxs_log_flush()
+void mxs_log_set_deferred_enabled(bool enabled)
 {
-    int err = -1;
+    log_config.do_deferred = enabled;
 
-    if (logmanager_register(false))
+    MXS_NOTICE("deferred formatting of info and debug messages is %s.", enabled ? "enabled" : "disabled");
+}
+
+/**
+ * Set the size at which the file writer rotates the log file.
+ *
+ * @param size  The size of the log file in bytes, 0 disables the size based rotation
+ */
+void mxs_log_set_rotate_size(size_t size)
+{
+    log_config.rotate_size = size;
+
+    if (size)
+    {
+        MXS_NOTICE("The log file is rotated when it reaches %lu bytes.", size);
+    }
+    else
+    {
+        MXS_NOTICE("Size based log rotation is disabled.");
+    }
+}
+
+/**
+ * Enable/disable the compression of rotated log files.
+ *
+ * @param enabled True, if the rotated log files should be compressed, false otherwise.
+ */
+void mxs_log_set_compress_enabled(bool enabled)
+{
+    log_config.do_compress = enabled;
+
+    MXS_NOTICE("compression of rotated log files is %s.", enabled ? "enabled" : "disabled");
+}
+
+/**
+ * Explicitly ensure that all pending log messages are flushed.
+ *
+ * @return 0 if the flushing was successfully initiated, otherwise -1.
+ *
+ * Note that the return value only indicates whether the flushing was
+ * successfully initiated, not whether the actual flushing has been
+ * performed. The messages suppressed by the throttling of call sites whose
+ * window has ended are counted in the log before the flush.
+ */
+int mxs_log_flush()
+{
+    int err = -1;
+
+    log_throttle_report();
+
+    if (logmanager_register(false))
     {
         CHK_LOGMANAGER(lm);
 
@@ -2538,8 +2661,8 @@ int mxs_log_flush_sync(void)
 }
 
 /**
- * Rotate the log-file. That is, close the current one and create a new one
- * with a larger sequence number.
+ * Rotate the log-file. That is, create a new one with a larger sequence number
+ * and let the log archiver close, and possibly compress, the current one.
  *
  * @return 0 if the rotating was successfully initiated, otherwise -1.
  *
@@ -2733,6 +2856,708 @@ static enum log_flush priority_to_flush(int priority)
     }
 }
 
+/**
+ * The kinds of arguments of the conversions of a printf format
+ */
+typedef enum logarg
+{
+    LOG_ARG_NONE,        /**< %% */
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_INTMAX,
+    LOG_ARG_SIZE,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_LDOUBLE,
+    LOG_ARG_PTR,
+    LOG_ARG_STR,
+    LOG_ARG_UNSUPPORTED  /**< %n, %m, %ls, positional arguments... */
+} logarg_t;
+
+/** The longest conversion that can be deferred */
+#define LOG_SPEC_MAXLEN 24
+
+/**
+ * A conversion of a printf format
+ */
+typedef struct logspec
+{
+    logarg_t type;       /**< The kind of the argument */
+    int      n_stars;    /**< The number of int arguments before it given with '*' */
+    bool     star_prec;  /**< Whether the last of them is the precision */
+    int      prec;       /**< The precision given in the format, -1 if none */
+} logspec_t;
+
+/**
+ * Parse a conversion of a printf format
+ *
+ * @param fmt   The '%' starting the conversion
+ * @param spec  The parsed conversion
+ *
+ * @return The character after the conversion
+ */
+static const char* logspec_parse(const char* fmt, logspec_t* spec)
+{
+    const char* p = fmt + 1;
+    char length = 0;
+
+    spec->type = LOG_ARG_UNSUPPORTED;
+    spec->n_stars = 0;
+    spec->star_prec = false;
+    spec->prec = -1;
+
+    while (*p && strchr("-+ #0'", *p))
+    {
+        p++;
+    }
+    if (*p == '*')
+    {
+        spec->n_stars++;
+        p++;
+    }
+    while (isdigit(*p))
+    {
+        p++;
+    }
+    if (*p == '$')
+    {
+        return p + 1;
+    }
+    if (*p == '.')
+    {
+        p++;
+        if (*p == '*')
+        {
+            spec->n_stars++;
+            spec->star_prec = true;
+            p++;
+        }
+        else
+        {
+            spec->prec = 0;
+            while (isdigit(*p))
+            {
+                spec->prec = spec->prec * 10 + (*p++ - '0');
+            }
+        }
+    }
+
+    switch (*p)
+    {
+        case 'h':
+            length = *p++;
+            if (*p == 'h')
+            {
+                p++;
+            }
+            break;
+
+        case 'l':
+            length = *p++;
+            if (*p == 'l')
+            {
+                length = 'q';
+                p++;
+            }
+            break;
+
+        case 'q':
+        case 'j':
+        case 'z':
+        case 't':
+        case 'L':
+            length = *p++;
+            break;
+
+        default:
+            break;
+    }
+
+    char conversion = *p;
+
+    if (conversion == '\0')
+    {
+        return p;
+    }
+    p++;
+
+    if (p - fmt > LOG_SPEC_MAXLEN)
+    {
+        return p;
+    }
+
+    switch (conversion)
+    {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            switch (length)
+            {
+                case 0:
+                case 'h':
+                    spec->type = LOG_ARG_INT;
+                    break;
+
+                case 'l':
+                    spec->type = LOG_ARG_LONG;
+                    break;
+
+                case 'q':
+                    spec->type = LOG_ARG_LLONG;
+                    break;
+
+                case 'j':
+                    spec->type = LOG_ARG_INTMAX;
+                    break;
+
+                case 'z':
+                    spec->type = LOG_ARG_SIZE;
+                    break;
+
+                case 't':
+                    spec->type = LOG_ARG_PTRDIFF;
+                    break;
+            }
+            break;
+
+        case 'c':
+            if (length == 0)
+            {
+                spec->type = LOG_ARG_INT;
+            }
+            break;
+
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            if (length == 0 || length == 'l')
+            {
+                spec->type = LOG_ARG_DOUBLE;
+            }
+            else if (length == 'L')
+            {
+                spec->type = LOG_ARG_LDOUBLE;
+            }
+            break;
+
+        case 's':
+            if (length == 0)
+            {
+                spec->type = LOG_ARG_STR;
+            }
+            break;
+
+        case 'p':
+            if (length == 0)
+            {
+                spec->type = LOG_ARG_PTR;
+            }
+            break;
+
+        case '%':
+            if (p - fmt == 2)
+            {
+                spec->type = LOG_ARG_NONE;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return p;
+}
+
+/**
+ * Append bytes to the deferred message being built in the scratch buffer
+ *
+ * @param len   The length of the message, updated
+ * @param data  The bytes
+ * @param n     The number of bytes
+ *
+ * @return False if the message would not fit in the buffer
+ */
+static bool logdeferred_put(size_t* len, const void* data, size_t n)
+{
+    if (*len + n > sizeof(log_scratch))
+    {
+        return false;
+    }
+    memcpy(log_scratch + *len, data, n);
+    *len += n;
+    return true;
+}
+
+#define LOGDEFERRED_PUT(type) \
+    do { \
+        type value = va_arg(valist, type); \
+        ok = logdeferred_put(&len, &value, sizeof(value)); \
+    } while (false)
+
+/**
+ * Write a message to the ring of the calling thread without formatting it.
+ * The arguments are copied as they are, apart from the strings which are
+ * copied by value, and formatted by the file writer thread.
+ *
+ * @param priority  Syslog priority
+ * @param function  The function where the message was logged
+ * @param format    The printf format of the message
+ * @param valist    The arguments
+ *
+ * @return True if the message was written, false if the format has a
+ *         conversion that cannot be deferred or the arguments do not fit in
+ *         a message, in which case the message must be formatted now
+ */
+static bool logdeferred_write(int priority, const char* function, const char* format, va_list valist)
+{
+    logdeferred_t header;
+    size_t len = sizeof(header);
+    const char* fmt = format;
+    bool ok = true;
+
+    while (ok && (fmt = strchr(fmt, '%')) != NULL)
+    {
+        logspec_t spec;
+        fmt = logspec_parse(fmt, &spec);
+        int prec = spec.prec;
+
+        for (int i = 0; ok && i < spec.n_stars; i++)
+        {
+            int star = va_arg(valist, int);
+
+            if (spec.star_prec && i == spec.n_stars - 1)
+            {
+                prec = star;
+            }
+            ok = logdeferred_put(&len, &star, sizeof(star));
+        }
+
+        if (!ok)
+        {
+            break;
+        }
+
+        switch (spec.type)
+        {
+            case LOG_ARG_NONE:
+                break;
+
+            case LOG_ARG_INT:
+                LOGDEFERRED_PUT(int);
+                break;
+
+            case LOG_ARG_LONG:
+                LOGDEFERRED_PUT(long);
+                break;
+
+            case LOG_ARG_LLONG:
+                LOGDEFERRED_PUT(long long);
+                break;
+
+            case LOG_ARG_INTMAX:
+                LOGDEFERRED_PUT(intmax_t);
+                break;
+
+            case LOG_ARG_SIZE:
+                LOGDEFERRED_PUT(size_t);
+                break;
+
+            case LOG_ARG_PTRDIFF:
+                LOGDEFERRED_PUT(ptrdiff_t);
+                break;
+
+            case LOG_ARG_DOUBLE:
+                LOGDEFERRED_PUT(double);
+                break;
+
+            case LOG_ARG_LDOUBLE:
+                LOGDEFERRED_PUT(long double);
+                break;
+
+            case LOG_ARG_PTR:
+                LOGDEFERRED_PUT(void*);
+                break;
+
+            case LOG_ARG_STR:
+                {
+                    const char* str = va_arg(valist, const char*);
+
+                    if (str == NULL)
+                    {
+                        /** As glibc, which prints nothing if the precision is too short */
+                        str = prec < 0 || prec >= 6 ? "(null)" : "";
+                    }
+
+                    size_t n = prec >= 0 ? strnlen(str, prec) : strlen(str);
+
+                    ok = logdeferred_put(&len, str, n) && logdeferred_put(&len, "", 1);
+                }
+                break;
+
+            default:
+                ok = false;
+                break;
+        }
+    }
+
+    if (ok)
+    {
+        header.ld_marker = LOG_RECORD_MARKER;
+        header.ld_priority = priority;
+        header.ld_augmentation = log_config.augmentation;
+        header.ld_highprecision = log_config.do_highprecision;
+        header.ld_len = len;
+        gettimeofday(&header.ld_time, NULL);
+        header.ld_sesid = mxs_log_tls.li_sesid;
+        header.ld_format = format;
+        header.ld_function = function;
+        memcpy(log_scratch, &header, sizeof(header));
+
+        logring_write(log_scratch, len, false);
+    }
+
+    return ok;
+}
+
+#define LOGDEFERRED_FORMAT(type) \
+    do { \
+        type value; \
+        memcpy(&value, args, sizeof(value)); \
+        args += sizeof(value); \
+        n = snprintf(msg + len, room, conversion, value); \
+    } while (false)
+
+/**
+ * Format a deferred message. Called only by the file writer thread.
+ *
+ * @param record    The header and the arguments of the message
+ * @param line      The buffer for the formatted line, MAX_LOGSTRLEN bytes
+ *
+ * @return The length of the line
+ */
+static size_t logdeferred_format(const char* record, char* line)
+{
+    static char msg[MAX_LOGSTRLEN];
+    logdeferred_t header;
+
+    memcpy(&header, record, sizeof(header));
+
+    const char* args = record + sizeof(header);
+    const char* fmt = header.ld_format;
+    log_prefix_t prefix = priority_to_prefix(header.ld_priority);
+    size_t len = snprintf(msg, sizeof(msg), "%s", prefix.text);
+
+    if (header.ld_augmentation & MXS_LOG_AUGMENT_WITH_FUNCTION)
+    {
+        len += snprintf(msg + len, sizeof(msg) - len, "(%s): ", header.ld_function);
+        len = MIN(len, sizeof(msg) - 1);
+    }
+
+    while (*fmt && len < sizeof(msg) - 1)
+    {
+        const char* pct = strchr(fmt, '%');
+        size_t room = sizeof(msg) - len;
+        size_t n = pct ? pct - fmt : strlen(fmt);
+
+        n = MIN(n, room - 1);
+        memcpy(msg + len, fmt, n);
+        len += n;
+
+        if (pct == NULL || len == sizeof(msg) - 1)
+        {
+            break;
+        }
+
+        /**
+         * The conversion is copied with the values of the stars written in
+         * place of them, a negative precision is the same as no precision.
+         */
+        logspec_t spec;
+        char conversion[LOG_SPEC_MAXLEN + 2 * 12];
+        size_t clen = 0;
+
+        fmt = logspec_parse(pct, &spec);
+
+        for (const char* p = pct; p < fmt; p++)
+        {
+            if (*p == '*')
+            {
+                int star;
+                memcpy(&star, args, sizeof(star));
+                args += sizeof(star);
+
+                if (star < 0 && p[-1] == '.')
+                {
+                    clen--;
+                }
+                else
+                {
+                    clen += sprintf(conversion + clen, "%d", star);
+                }
+            }
+            else
+            {
+                conversion[clen++] = *p;
+            }
+        }
+        conversion[clen] = '\0';
+
+        room = sizeof(msg) - len;
+
+        switch (spec.type)
+        {
+            case LOG_ARG_INT:
+                LOGDEFERRED_FORMAT(int);
+                break;
+
+            case LOG_ARG_LONG:
+                LOGDEFERRED_FORMAT(long);
+                break;
+
+            case LOG_ARG_LLONG:
+                LOGDEFERRED_FORMAT(long long);
+                break;
+
+            case LOG_ARG_INTMAX:
+                LOGDEFERRED_FORMAT(intmax_t);
+                break;
+
+            case LOG_ARG_SIZE:
+                LOGDEFERRED_FORMAT(size_t);
+                break;
+
+            case LOG_ARG_PTRDIFF:
+                LOGDEFERRED_FORMAT(ptrdiff_t);
+                break;
+
+            case LOG_ARG_DOUBLE:
+                LOGDEFERRED_FORMAT(double);
+                break;
+
+            case LOG_ARG_LDOUBLE:
+                LOGDEFERRED_FORMAT(long double);
+                break;
+
+            case LOG_ARG_PTR:
+                LOGDEFERRED_FORMAT(void*);
+                break;
+
+            case LOG_ARG_STR:
+                n = snprintf(msg + len, room, conversion, args);
+                args += strlen(args) + 1;
+                break;
+
+            default:
+                n = snprintf(msg + len, room, "%%");
+                break;
+        }
+
+        len += MIN(n, room - 1);
+    }
+    msg[len] = '\0';
+
+    return logline_format(line, header.ld_priority, header.ld_sesid, &header.ld_time,
+                          header.ld_highprecision, false, prefix.len, len + 1, msg);
+}
+
+/**
+ * The number of call sites whose errors and warnings are throttled
+ * independently. Call sites hashing to the same slot share it, the latest one
+ * taking it over.
+ */
+#define LOG_THROTTLE_SLOTS 1024
+
+/**
+ * The messages logged by a call site in the current window
+ */
+typedef struct log_throttle
+{
+    int         lt_lock;       /**< Protects the slot */
+    const char* lt_file;       /**< The file of the call site */
+    int         lt_line;       /**< The line of the call site */
+    uint64_t    lt_start;      /**< The start of the window in milliseconds */
+    size_t      lt_count;      /**< Messages logged in the window */
+    size_t      lt_suppressed; /**< Messages suppressed in the window */
+} log_throttle_t;
+
+static log_throttle_t log_throttles[LOG_THROTTLE_SLOTS];
+
+/** Set while the throttling itself logs, its messages are never throttled */
+static __thread bool log_throttle_reporting = false;
+
+/**
+ * Return the current time of the coarse monotonic clock
+ *
+ * @return The time in milliseconds
+ */
+static uint64_t log_throttle_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Log the number of messages of a call site that were suppressed
+ *
+ * @param file          The file of the call site
+ * @param line          The line of the call site
+ * @param suppressed    The number of suppressed messages
+ */
+static void log_throttle_summary(const char* file, int line, size_t suppressed)
+{
+    log_throttle_reporting = true;
+    MXS_WARNING("%lu similar messages logged at %s:%d were suppressed.", suppressed, file, line);
+    log_throttle_reporting = false;
+}
+
+/**
+ * Check whether a call site may log an error or a warning. A call site may
+ * log a number of messages in a window, the rest are dropped before they are
+ * formatted. The suppression is logged when it starts and the number of
+ * suppressed messages once the window has ended, either when the call site
+ * logs again or at the next flush of the log.
+ *
+ * @param priority  Syslog priority
+ * @param file      The file of the call site
+ * @param line      The line of the call site
+ *
+ * @return True if the message should be logged
+ */
+static bool log_throttle(int priority, const char* file, int line)
+{
+    size_t max_count = log_config.throttle_count;
+    size_t window = log_config.throttle_window;
+
+    if (priority > LOG_WARNING || max_count == 0 || log_throttle_reporting)
+    {
+        return true;
+    }
+
+    uint64_t now = log_throttle_now();
+    log_throttle_t* lt = &log_throttles[((uintptr_t)file ^ ((uintptr_t)line * 2654435761u)) %
+                                        LOG_THROTTLE_SLOTS];
+    const char* prev_file = file;
+    int prev_line = line;
+    size_t suppressed = 0;
+    bool start = false;
+    bool rval = true;
+
+    acquire_lock(&lt->lt_lock);
+
+    if (lt->lt_file != file || lt->lt_line != line || now - lt->lt_start >= window)
+    {
+        prev_file = lt->lt_file;
+        prev_line = lt->lt_line;
+        suppressed = lt->lt_suppressed;
+        lt->lt_file = file;
+        lt->lt_line = line;
+        lt->lt_start = now;
+        lt->lt_count = 0;
+        lt->lt_suppressed = 0;
+    }
+
+    if (lt->lt_count < max_count)
+    {
+        lt->lt_count++;
+    }
+    else
+    {
+        start = lt->lt_suppressed++ == 0;
+        rval = false;
+    }
+
+    release_lock(&lt->lt_lock);
+
+    if (suppressed)
+    {
+        log_throttle_summary(prev_file, prev_line, suppressed);
+    }
+    if (start)
+    {
+        log_throttle_reporting = true;
+        MXS_WARNING("Messages logged at %s:%d are suppressed for the rest of "
+                    "the window of %lu milliseconds, %lu were logged.",
+                    file, line, window, max_count);
+        log_throttle_reporting = false;
+    }
+
+    return rval;
+}
+
+/**
+ * Log the number of suppressed messages of the call sites whose window has
+ * ended without them logging again.
+ */
+static void log_throttle_report()
+{
+    uint64_t now = log_throttle_now();
+    size_t window = log_config.throttle_window;
+
+    for (int i = 0; i < LOG_THROTTLE_SLOTS; i++)
+    {
+        log_throttle_t* lt = &log_throttles[i];
+
+        /** A dirty read skips the slots with nothing to report */
+        if (lt->lt_suppressed && now - lt->lt_start >= window)
+        {
+            const char* file = NULL;
+            int line = 0;
+            size_t suppressed = 0;
+
+            acquire_lock(&lt->lt_lock);
+            if (lt->lt_suppressed && now - lt->lt_start >= window)
+            {
+                file = lt->lt_file;
+                line = lt->lt_line;
+                suppressed = lt->lt_suppressed;
+                lt->lt_start = now;
+                lt->lt_count = 0;
+                lt->lt_suppressed = 0;
+            }
+            release_lock(&lt->lt_lock);
+
+            if (suppressed)
+            {
+                log_throttle_summary(file, line, suppressed);
+            }
+        }
+    }
+}
+
+/**
+ * Set the throttling of errors and warnings.
+ *
+ * @param count     The number of messages a call site may log in a window,
+ *                  0 disables the throttling
+ * @param window    The length of the window in milliseconds
+ */
+void mxs_log_set_throttling(size_t count, size_t window)
+{
+    log_config.throttle_count = count;
+    log_config.throttle_window = window;
+
+    if (count)
+    {
+        MXS_NOTICE("Throttling of errors and warnings: %lu messages of a call site "
+                   "in %lu milliseconds.", count, window);
+    }
+    else
+    {
+        MXS_NOTICE("Throttling of errors and warnings is disabled.");
+    }
+}
+
 /**
  * Log a message of a particular priority.
  *
@@ -2753,10 +3578,35 @@ int mxs_log_message(int priority,
 
     if ((priority & ~LOG_PRIMASK) == 0) // Check that the priority is ok,
     {
-        if (MXS_LOG_PRIORITY_IS_ENABLED(priority))
+        if (MXS_LOG_PRIORITY_IS_ENABLED(priority) && log_throttle(priority, file, line))
         {
             va_list valist;
 
+            /**
+             * Info and debug messages are never written to syslog, so when
+             * deferred formatting is enabled they are only copied to the
+             * ring and the file writer formats them.
+             */
+            if ((priority == LOG_INFO || priority == LOG_DEBUG) &&
+                log_config.do_deferred && log_config.do_maxlog)
+            {
+                bool deferred = false;
+
+                if (logmanager_register(true))
+                {
+                    va_start(valist, format);
+                    deferred = logdeferred_write(priority, function, format, valist);
+                    va_end(valist);
+
+                    logmanager_unregister();
+                }
+
+                if (deferred)
+                {
+                    return 0;
+                }
+            }
+
             /**
              * Find out the length of log string (to be formatted str).
              */
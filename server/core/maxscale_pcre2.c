@@ -21,10 +21,283 @@
  *
  * Date       Who           Description
  * 30-10-2015 Markus Makela Initial implementation
+ * 15-10-2016 Core Team     JIT compiled patterns with per-thread matching data
  * @endverbatim
  */
 
 #include <maxscale_pcre2.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <platform.h>
+
+/** Initial and maximum size of the JIT stack of a thread */
+#define MXS_PCRE2_JIT_STACK_MIN (32 * 1024)
+#define MXS_PCRE2_JIT_STACK_MAX (1024 * 1024)
+
+/** The matching data of the calling thread and the number of pairs it holds */
+static thread_local pcre2_match_data *thread_match_data = NULL;
+static thread_local uint32_t thread_match_pairs = 0;
+
+/** The match context of the calling thread, with the JIT stack of the thread */
+static thread_local pcre2_match_context *thread_match_context = NULL;
+static thread_local pcre2_jit_stack *thread_jit_stack = NULL;
+
+/**
+ * Return matching data of the calling thread that can hold the captured
+ * substrings of a pattern. The data is owned by the thread and must not be
+ * kept over calls of other functions that may match patterns.
+ *
+ * @param code The compiled pattern
+ * @return The matching data or NULL if memory could not be allocated
+ */
+pcre2_match_data* mxs_pcre2_thread_match_data(const pcre2_code *code)
+{
+    uint32_t captures = 0;
+
+    pcre2_pattern_info(code, PCRE2_INFO_CAPTURECOUNT, &captures);
+
+    if (thread_match_data == NULL || thread_match_pairs < captures + 1)
+    {
+        pcre2_match_data *mdata = pcre2_match_data_create(captures + 1, NULL);
+
+        if (mdata == NULL)
+        {
+            return NULL;
+        }
+
+        if (thread_match_data)
+        {
+            pcre2_match_data_free(thread_match_data);
+        }
+
+        thread_match_data = mdata;
+        thread_match_pairs = captures + 1;
+    }
+
+    return thread_match_data;
+}
+
+/**
+ * Return the match context of the calling thread. The context holds the JIT
+ * stack of the thread which is used instead of the small default stack.
+ *
+ * @return The match context or NULL if memory could not be allocated
+ */
+pcre2_match_context* mxs_pcre2_thread_match_context()
+{
+    if (thread_match_context == NULL)
+    {
+        pcre2_match_context *context = pcre2_match_context_create(NULL);
+        pcre2_jit_stack *stack = pcre2_jit_stack_create(MXS_PCRE2_JIT_STACK_MIN,
+                                                        MXS_PCRE2_JIT_STACK_MAX, NULL);
+
+        if (context == NULL)
+        {
+            if (stack)
+            {
+                pcre2_jit_stack_free(stack);
+            }
+            return NULL;
+        }
+
+        if (stack)
+        {
+            /** Without a stack of its own the JIT code uses a 32K stack on the machine stack */
+            pcre2_jit_stack_assign(context, NULL, stack);
+        }
+
+        thread_match_context = context;
+        thread_jit_stack = stack;
+    }
+
+    return thread_match_context;
+}
+
+/**
+ * Check if a character has a special meaning in a PCRE or a POSIX pattern
+ *
+ * @param c The character
+ * @return True if the character is not always a literal
+ */
+static bool is_special(char c)
+{
+    return strchr("\\^$.[]|()?*+{}", c) != NULL;
+}
+
+/**
+ * Find the literal text that a pattern starts with, ignoring a leading ^.
+ * Every string matching the pattern contains the literal, so it can be
+ * searched for before the pattern is matched. The literal is found
+ * conservatively so that it is valid for PCRE, POSIX basic and POSIX
+ * extended syntax, e.g. the character before a quantifier is not included
+ * and patterns with alternatives have no literal.
+ *
+ * Patterns compiled with PCRE2_EXTENDED must not be given to this function.
+ *
+ * @param pattern The pattern
+ * @param length The length of the literal is stored here
+ * @return The literal or NULL if the pattern has none
+ */
+char* mxs_pcre2_required_literal(const char *pattern, size_t *length)
+{
+    const char *start = *pattern == '^' ? pattern + 1 : pattern;
+    size_t len = 0;
+
+    if (strchr(pattern, '|'))
+    {
+        return NULL;
+    }
+
+    while (start[len] && !is_special(start[len]) && (unsigned char)start[len] < 0x80)
+    {
+        len++;
+    }
+
+    if (len > 0 && (start[len] == '?' || start[len] == '*' || start[len] == '{'))
+    {
+        /** The last character is optional */
+        len--;
+    }
+
+    if (len == 0)
+    {
+        return NULL;
+    }
+
+    char *rval = strndup(start, len);
+
+    if (rval)
+    {
+        *length = len;
+    }
+
+    return rval;
+}
+
+/**
+ * Check if a string contains a literal
+ *
+ * @param subject The string
+ * @param length Length of the string
+ * @param literal The literal
+ * @param literal_len Length of the literal
+ * @param caseless Whether the case of ASCII letters is ignored
+ * @return True if the literal was found
+ */
+bool mxs_pcre2_contains(const char *subject, size_t length, const char *literal,
+                        size_t literal_len, bool caseless)
+{
+    if (!caseless)
+    {
+        return memmem(subject, length, literal, literal_len) != NULL;
+    }
+
+    for (size_t i = 0; i + literal_len <= length; i++)
+    {
+        if (strncasecmp(subject + i, literal, literal_len) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Compile a pattern for concurrent matching with mxs_pcre2_pattern_match.
+ * The pattern is JIT compiled if the PCRE2 library supports it.
+ *
+ * @param pattern The pattern
+ * @param options PCRE2 compilation options
+ * @param error The PCRE2 error code is stored here if compilation fails
+ * @param erroffset The offset of the error in the pattern is stored here
+ * @return The compiled pattern or NULL on error. If memory allocation failed,
+ * @c error is set to 0.
+ */
+MXS_PCRE2_PATTERN* mxs_pcre2_pattern_compile(const char *pattern, uint32_t options,
+                                             int *error, size_t *erroffset)
+{
+    MXS_PCRE2_PATTERN *rval = calloc(1, sizeof(MXS_PCRE2_PATTERN));
+
+    *error = 0;
+    *erroffset = 0;
+
+    if (rval == NULL)
+    {
+        return NULL;
+    }
+
+    if ((rval->code = pcre2_compile((PCRE2_SPTR) pattern, PCRE2_ZERO_TERMINATED,
+                                    options, error, erroffset, NULL)) == NULL)
+    {
+        free(rval);
+        return NULL;
+    }
+
+    /** Matching works without JIT if the library does not support it */
+    rval->jit = pcre2_jit_compile(rval->code, PCRE2_JIT_COMPLETE) == 0;
+
+    /** With Unicode case folding, ASCII letters also match some other characters */
+    if ((options & PCRE2_EXTENDED) == 0 &&
+        ((options & PCRE2_CASELESS) == 0 || (options & PCRE2_UTF) == 0))
+    {
+        rval->literal = mxs_pcre2_required_literal(pattern, &rval->literal_len);
+        rval->caseless = (options & PCRE2_CASELESS) != 0;
+    }
+
+    return rval;
+}
+
+/**
+ * Free a pattern compiled with mxs_pcre2_pattern_compile
+ *
+ * @param pattern The pattern to free
+ */
+void mxs_pcre2_pattern_free(MXS_PCRE2_PATTERN *pattern)
+{
+    if (pattern)
+    {
+        pcre2_code_free(pattern->code);
+        free(pattern->literal);
+        free(pattern);
+    }
+}
+
+/**
+ * Match a subject against a pattern. The pattern is only matched if the
+ * subject contains the literal text of the pattern. The matching data of the
+ * calling thread is used, so a pattern can be matched by any number of
+ * threads at the same time.
+ *
+ * @param pattern The pattern
+ * @param subject The subject
+ * @param length Length of the subject
+ * @return MXS_PCRE2_MATCH if the subject matches, MXS_PCRE2_NOMATCH if it does
+ * not and MXS_PCRE2_ERROR if an error occurred
+ */
+mxs_pcre2_result_t mxs_pcre2_pattern_match(MXS_PCRE2_PATTERN *pattern, const char *subject,
+                                           size_t length)
+{
+    if (pattern->literal &&
+        !mxs_pcre2_contains(subject, length, pattern->literal, pattern->literal_len,
+                            pattern->caseless))
+    {
+        return MXS_PCRE2_NOMATCH;
+    }
+
+    pcre2_match_data *mdata = mxs_pcre2_thread_match_data(pattern->code);
+
+    if (mdata == NULL)
+    {
+        return MXS_PCRE2_ERROR;
+    }
+
+    int rc = pcre2_match(pattern->code, (PCRE2_SPTR) subject, length, 0, 0, mdata,
+                         mxs_pcre2_thread_match_context());
+
+    return rc > 0 ? MXS_PCRE2_MATCH : rc == PCRE2_ERROR_NOMATCH ? MXS_PCRE2_NOMATCH : MXS_PCRE2_ERROR;
+}
 
 /**
  * Utility wrapper for PCRE2 library function call pcre2_substitute.
@@ -14,11 +14,23 @@
 /**
  * @file memlog.c  - Implementation of memory logging mechanism for debug purposes
  *
+ * Every thread logs to a ring of its own in each memory log, so logging an
+ * item takes no lock and the threads do not contend. The first
+ * MEMLOG_MAX_THREADS threads that log get a ring, the ones after them share
+ * a ring under a lock. A flush merges the items of all the rings in the
+ * order they were logged.
+ *
+ * A log that is flushed automatically is flushed by the thread whose ring
+ * fills up. A log that is not keeps the latest items of each thread, and an
+ * explicit flush while the threads are logging may write an item that is
+ * being overwritten.
+ *
  * @verbatim
  * Revision History
  *
  * Date         Who             Description
  * 26/09/14     Mark Riddoch    Initial implementation
+ * 15/10/2016   Core Team       A ring for each thread
  *
  * @endverbatim
  */
@@ -27,16 +39,22 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <atomic.h>
+#include <platform.h>
 
 static MEMLOG *memlogs = NULL;
 static SPINLOCK memlock = SPINLOCK_INIT;
+static int memlog_next_thread = 0;
+static thread_local int memlog_thread = -1;
 
 /**
  * Create a new instance of a memory logger.
  *
  * @param name  The name of the memory log
  * @param type  The type of item being logged
- * @param size  The number of items to store in memory before flushign to disk
+ * @param size  The number of items each thread stores in memory before
+ *              flushing to disk
  *
  * @return MEMLOG*      A memory log handle
  */
@@ -45,37 +63,22 @@ memlog_create(char *name, MEMLOGTYPE type, int size)
 {
     MEMLOG *log;
 
-    if ((log = (MEMLOG *)malloc(sizeof(MEMLOG))) == NULL)
+    if ((log = (MEMLOG *)calloc(1, sizeof(MEMLOG))) == NULL)
     {
         return NULL;
     }
 
-    log->name = strdup(name);
-    spinlock_init(&log->lock);
-    log->type = type;
-    log->offset = 0;
-    log->size = size;
-    log->flags = 0;
-    switch (type)
-    {
-    case ML_INT:
-        log->values = malloc(sizeof(int) * size);
-        break;
-    case ML_LONG:
-        log->values = malloc(sizeof(long) * size);
-        break;
-    case ML_LONGLONG:
-        log->values = malloc(sizeof(long long) * size);
-        break;
-    case ML_STRING:
-        log->values = malloc(sizeof(char *) * size);
-        break;
-    }
-    if (log->values == NULL)
+    if ((log->name = strdup(name)) == NULL)
     {
         free(log);
         return NULL;
     }
+    spinlock_init(&log->lock);
+    spinlock_init(&log->shared_lock);
+    log->type = type;
+    log->size = size;
+    log->flags = 0;
+
     spinlock_acquire(&memlock);
     log->next = memlogs;
     memlogs = log;
@@ -98,7 +101,6 @@ memlog_destroy(MEMLOG *log)
     {
         memlog_flush(log);
     }
-    free(log->values);
 
     spinlock_acquire(&memlock);
     if (memlogs == log)
@@ -118,10 +120,37 @@ memlog_destroy(MEMLOG *log)
         }
     }
     spinlock_release(&memlock);
+    for (int i = 0; i <= MEMLOG_MAX_THREADS; i++)
+    {
+        free(log->rings[i]);
+    }
     free(log->name);
     free(log);
 }
 
+/**
+ * Return the ring of the calling thread, allocating it on the first call
+ *
+ * @param log   The memory logger
+ * @param slot  The slot of the calling thread
+ * @return The ring or NULL if it could not be allocated
+ */
+static MEMLOG_RING *
+memlog_ring(MEMLOG *log, int slot)
+{
+    MEMLOG_RING *ring = log->rings[slot];
+
+    if (ring == NULL &&
+        (ring = (MEMLOG_RING *)calloc(1, sizeof(MEMLOG_RING) + log->size * sizeof(MEMLOG_ENTRY))) != NULL &&
+        !__sync_bool_compare_and_swap(&log->rings[slot], NULL, ring))
+    {
+        /** Another thread created the shared ring */
+        free(ring);
+        ring = log->rings[slot];
+    }
+    return ring;
+}
+
 /**
  * Log a data item to the memory logger
  *
@@ -131,37 +160,50 @@ memlog_destroy(MEMLOG *log)
 void
 memlog_log(MEMLOG *log, void *value)
 {
+    MEMLOG_RING *ring;
+    MEMLOG_ENTRY *entry;
+    struct timespec now;
+    unsigned long head;
+    bool shared;
+
     if (!log)
     {
         return;
     }
-    spinlock_acquire(&log->lock);
-    switch (log->type)
-    {
-    case ML_INT:
-        ((int *)(log->values))[log->offset] = (intptr_t)value;
-        break;
-    case ML_LONG:
-        ((long *)(log->values))[log->offset] = (long)value;
-        break;
-    case ML_LONGLONG:
-        ((long long *)(log->values))[log->offset] = (long long)value;
-        break;
-    case ML_STRING:
-        ((char **)(log->values))[log->offset] = (char *)value;
-        break;
-    }
-    log->offset++;
-    if (log->offset == log->size)
+    if (memlog_thread == -1)
     {
-        if ((log->flags & MLNOAUTOFLUSH) == 0)
+        memlog_thread = atomic_add(&memlog_next_thread, 1);
+        if (memlog_thread > MEMLOG_MAX_THREADS)
         {
-            memlog_flush(log);
+            memlog_thread = MEMLOG_MAX_THREADS;
         }
-        log->offset = 0;
-        log->iflags = MLWRAPPED;
     }
-    spinlock_release(&log->lock);
+    if ((ring = memlog_ring(log, memlog_thread)) == NULL)
+    {
+        return;
+    }
+    if ((shared = memlog_thread == MEMLOG_MAX_THREADS))
+    {
+        spinlock_acquire(&log->shared_lock);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    head = ring->head;
+    entry = &ring->entries[head % log->size];
+    entry->timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    entry->value = (intptr_t)value;
+    /** The item must be complete before the flush can see it */
+    __sync_synchronize();
+    ring->head = head + 1;
+
+    if (shared)
+    {
+        spinlock_release(&log->shared_lock);
+    }
+    if ((log->flags & MLNOAUTOFLUSH) == 0 && head + 1 - ring->flushed >= (unsigned long)log->size)
+    {
+        memlog_flush(log);
+    }
 }
 
 /**
@@ -177,9 +219,7 @@ memlog_flush_all()
     log = memlogs;
     while (log)
     {
-        spinlock_acquire(&log->lock);
         memlog_flush(log);
-        spinlock_release(&log->lock);
         log = log->next;
     }
     spinlock_release(&memlock);
@@ -198,69 +238,99 @@ memlog_set(MEMLOG *log, unsigned int flags)
 }
 
 /**
- * Flush a memory log to disk
- *
- * Assumes the the log->lock has been acquired by the caller
+ * Compare the timestamps of two items
+ */
+static int
+memlog_entry_cmp(const void *a, const void *b)
+{
+    const MEMLOG_ENTRY *ea = (const MEMLOG_ENTRY *)a;
+    const MEMLOG_ENTRY *eb = (const MEMLOG_ENTRY *)b;
+
+    return ea->timestamp < eb->timestamp ? -1 : ea->timestamp > eb->timestamp ? 1 : 0;
+}
+
+/**
+ * Flush a memory log to disk. The items of all the threads that have not been
+ * written yet are written in the order they were logged.
  *
  * @param log   The memory log to flush
  */
 void
 memlog_flush(MEMLOG *log)
 {
+    MEMLOG_ENTRY *entries = NULL;
+    unsigned long heads[MEMLOG_MAX_THREADS + 1];
+    int n = 0, i;
     FILE *fp;
-    int i;
 
-    if ((fp = fopen(log->name, "a")) == NULL)
+    spinlock_acquire(&log->lock);
+    for (i = 0; i <= MEMLOG_MAX_THREADS; i++)
     {
-        return;
+        MEMLOG_RING *ring = log->rings[i];
+
+        heads[i] = ring ? ring->head : 0;
+        if (ring && heads[i] != ring->flushed)
+        {
+            n += heads[i] - ring->flushed < (unsigned long)log->size ?
+                 heads[i] - ring->flushed : log->size;
+        }
     }
-    if ((log->flags & MLNOAUTOFLUSH) && (log->iflags & MLWRAPPED))
+    __sync_synchronize();
+
+    if (n > 0 && (entries = (MEMLOG_ENTRY *)malloc(n * sizeof(MEMLOG_ENTRY))) != NULL)
     {
-        for (i = 0; i < log->size; i++)
+        n = 0;
+        for (i = 0; i <= MEMLOG_MAX_THREADS; i++)
         {
-            int ind = (i + log->offset) % log->size;
-            switch (log->type)
+            MEMLOG_RING *ring = log->rings[i];
+            unsigned long pos;
+
+            if (ring == NULL)
             {
-            case ML_INT:
-                fprintf(fp, "%d\n",
-                        ((int *)(log->values))[ind]);
-                break;
-            case ML_LONG:
-                fprintf(fp, "%ld\n",
-                        ((long *)(log->values))[ind]);
-                break;
-            case ML_LONGLONG:
-                fprintf(fp, "%lld\n",
-                        ((long long *)(log->values))[ind]);
-                break;
-            case ML_STRING:
-                fprintf(fp, "%s\n",
-                        ((char **)(log->values))[ind]);
-                break;
+                continue;
+            }
+            /** A ring that was not flushed in time only has the latest items */
+            pos = heads[i] - ring->flushed > (unsigned long)log->size ?
+                  heads[i] - log->size : ring->flushed;
+            for (; pos < heads[i]; pos++)
+            {
+                entries[n++] = ring->entries[pos % log->size];
             }
         }
+        qsort(entries, n, sizeof(MEMLOG_ENTRY), memlog_entry_cmp);
     }
-    else
+
+    /** The items are dropped if they cannot be written */
+    for (i = 0; i <= MEMLOG_MAX_THREADS; i++)
     {
-        for (i = 0; i < log->offset; i++)
+        if (log->rings[i])
+        {
+            log->rings[i]->flushed = heads[i];
+        }
+    }
+
+    if (entries && (fp = fopen(log->name, "a")) != NULL)
+    {
+        for (i = 0; i < n; i++)
         {
             switch (log->type)
             {
             case ML_INT:
-                fprintf(fp, "%d\n", ((int *)(log->values))[i]);
+                fprintf(fp, "%d\n", (int)entries[i].value);
                 break;
             case ML_LONG:
-                fprintf(fp, "%ld\n", ((long *)(log->values))[i]);
+                fprintf(fp, "%ld\n", (long)entries[i].value);
                 break;
             case ML_LONGLONG:
-                fprintf(fp, "%lld\n", ((long long *)(log->values))[i]);
+                fprintf(fp, "%lld\n", (long long)entries[i].value);
                 break;
             case ML_STRING:
-                fprintf(fp, "%s\n", ((char **)(log->values))[i]);
+                fprintf(fp, "%s\n", (char *)entries[i].value);
                 break;
             }
         }
+        fclose(fp);
     }
-    log->offset = 0;
-    fclose(fp);
+    spinlock_release(&log->lock);
+    free(entries);
 }
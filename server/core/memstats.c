@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file memstats.c  - Memory accounting by subsystem
+ *
+ * The counters of a thread are allocated when it first counts something and
+ * are never freed: memory allocated by a thread may be freed by another one,
+ * so only the sum over all threads is meaningful and the counts of a thread
+ * that has ended are still part of it. The size of an allocation is taken
+ * from malloc_usable_size, so nothing is stored with the allocation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <memstats.h>
+#include <platform.h>
+#include <spinlock.h>
+#include <housekeeper.h>
+#include <dcb.h>
+
+/** How often the housekeeper samples the high-water marks, in seconds */
+#define MEMSTATS_SAMPLE_FREQ 1
+
+/**
+ * The counters of a thread
+ */
+typedef struct memstats_thread
+{
+    int64_t bytes[MEMSTATS_MAX_TAGS];       /*< Bytes allocated less bytes freed */
+    int64_t blocks[MEMSTATS_MAX_TAGS];      /*< Allocations less frees */
+    struct memstats_thread *next;           /*< The next thread */
+} MEMSTATS_THREAD;
+
+static SPINLOCK memstats_lock = SPINLOCK_INIT;  /*< Protects the tags and the list of threads */
+static const char *tag_names[MEMSTATS_MAX_TAGS] =
+{
+    "buffers",
+    "dcbs",
+    "sessions",
+    "query_classifier",
+    "other"
+};
+static int n_tags = MEMSTATS_N_CORE_TAGS;
+static int64_t high_water[MEMSTATS_MAX_TAGS];
+static MEMSTATS_THREAD *all_threads = NULL;
+static thread_local MEMSTATS_THREAD *this_thread = NULL;
+
+static void memstats_sample(void *data);
+
+/**
+ * Start sampling the high-water marks, called once the housekeeper runs
+ */
+void
+memstats_init()
+{
+    hktask_add("Memory high-water marks", memstats_sample, NULL, MEMSTATS_SAMPLE_FREQ);
+}
+
+/**
+ * Return the tag of a module or a subsystem, registering it on the first call.
+ * The modules that are made of several files get the same tag in each of them.
+ *
+ * @param name  The name of the tag, the name of the module by convention
+ * @return The tag, MEMSTATS_OTHER if there is no room for more tags
+ */
+int
+memstats_tag(const char *name)
+{
+    int tag;
+
+    spinlock_acquire(&memstats_lock);
+    for (tag = 0; tag < n_tags; tag++)
+    {
+        if (strcmp(tag_names[tag], name) == 0)
+        {
+            break;
+        }
+    }
+    if (tag == n_tags)
+    {
+        char *copy;
+
+        if (n_tags < MEMSTATS_MAX_TAGS && (copy = strdup(name)) != NULL)
+        {
+            tag_names[n_tags++] = copy;
+        }
+        else
+        {
+            tag = MEMSTATS_OTHER;
+        }
+    }
+    spinlock_release(&memstats_lock);
+
+    return tag;
+}
+
+/**
+ * Return the counters of the calling thread
+ *
+ * @return The counters or NULL if they could not be allocated
+ */
+static inline MEMSTATS_THREAD *
+memstats_thread()
+{
+    if (this_thread == NULL &&
+        (this_thread = (MEMSTATS_THREAD *)calloc(1, sizeof(MEMSTATS_THREAD))) != NULL)
+    {
+        spinlock_acquire(&memstats_lock);
+        this_thread->next = all_threads;
+        all_threads = this_thread;
+        spinlock_release(&memstats_lock);
+    }
+    return this_thread;
+}
+
+/**
+ * Count memory that was allocated or freed without the allocation functions
+ * of this file, e.g. the blocks of the buffer pools
+ *
+ * @param tag       The tag
+ * @param bytes     The bytes allocated, negative for the bytes freed
+ * @param blocks    The allocations made, negative for the allocations freed
+ */
+void
+memstats_add(int tag, int64_t bytes, int blocks)
+{
+    MEMSTATS_THREAD *counters = memstats_thread();
+
+    if (counters)
+    {
+        counters->bytes[tag] += bytes;
+        counters->blocks[tag] += blocks;
+    }
+}
+
+/**
+ * Allocate memory counted to a tag
+ *
+ * @param tag   The tag
+ * @param size  The size of the allocation
+ * @return The memory or NULL if it could not be allocated
+ */
+void *
+memstats_malloc(int tag, size_t size)
+{
+    void *ptr = malloc(size);
+
+    if (ptr)
+    {
+        memstats_add(tag, malloc_usable_size(ptr), 1);
+    }
+    return ptr;
+}
+
+/**
+ * Allocate zeroed memory counted to a tag
+ *
+ * @param tag   The tag
+ * @param nmemb The number of elements
+ * @param size  The size of an element
+ * @return The memory or NULL if it could not be allocated
+ */
+void *
+memstats_calloc(int tag, size_t nmemb, size_t size)
+{
+    void *ptr = calloc(nmemb, size);
+
+    if (ptr)
+    {
+        memstats_add(tag, malloc_usable_size(ptr), 1);
+    }
+    return ptr;
+}
+
+/**
+ * Resize memory counted to a tag
+ *
+ * @param tag   The tag the memory was allocated with
+ * @param ptr   The memory, may be NULL
+ * @param size  The new size
+ * @return The resized memory or NULL if it could not be allocated, in which
+ *         case the original memory is left as it was
+ */
+void *
+memstats_realloc(int tag, void *ptr, size_t size)
+{
+    size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+    void *new_ptr = realloc(ptr, size);
+
+    if (new_ptr)
+    {
+        memstats_add(tag, (int64_t)malloc_usable_size(new_ptr) - (int64_t)old_size, ptr ? 0 : 1);
+    }
+    return new_ptr;
+}
+
+/**
+ * Duplicate a string into memory counted to a tag
+ *
+ * @param tag   The tag
+ * @param str   The string
+ * @return The copy or NULL if it could not be allocated
+ */
+char *
+memstats_strdup(int tag, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = memstats_malloc(tag, len);
+
+    if (copy)
+    {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+/**
+ * Free memory allocated with the allocation functions of this file
+ *
+ * @param tag   The tag the memory was allocated with
+ * @param ptr   The memory, may be NULL
+ */
+void
+memstats_free(int tag, void *ptr)
+{
+    if (ptr)
+    {
+        memstats_add(tag, -(int64_t)malloc_usable_size(ptr), -1);
+        free(ptr);
+    }
+}
+
+/**
+ * Return the memory statistics of the tags and update their high-water marks
+ *
+ * @param stats Array of at least n elements for the statistics
+ * @param n     The size of the array
+ * @return The number of tags returned
+ */
+int
+memstats_get(MEMSTATS *stats, int n)
+{
+    MEMSTATS_THREAD *counters;
+    int i;
+
+    spinlock_acquire(&memstats_lock);
+    n = n < n_tags ? n : n_tags;
+    for (i = 0; i < n; i++)
+    {
+        stats[i].name = tag_names[i];
+        stats[i].bytes = 0;
+        stats[i].blocks = 0;
+    }
+    for (counters = all_threads; counters; counters = counters->next)
+    {
+        for (i = 0; i < n; i++)
+        {
+            stats[i].bytes += counters->bytes[i];
+            stats[i].blocks += counters->blocks[i];
+        }
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (stats[i].bytes > high_water[i])
+        {
+            high_water[i] = stats[i].bytes;
+        }
+        stats[i].high_water = high_water[i];
+    }
+    spinlock_release(&memstats_lock);
+
+    return n;
+}
+
+/**
+ * The housekeeper task that keeps the high-water marks
+ *
+ * @param data  Not used
+ */
+static void
+memstats_sample(void *data)
+{
+    MEMSTATS stats[MEMSTATS_MAX_TAGS];
+
+    memstats_get(stats, MEMSTATS_MAX_TAGS);
+}
+
+/**
+ * Print the memory in use by each subsystem and module
+ *
+ * @param dcb   The DCB to print to
+ */
+void
+dShowMemory(DCB *dcb)
+{
+    MEMSTATS stats[MEMSTATS_MAX_TAGS];
+    int n = memstats_get(stats, MEMSTATS_MAX_TAGS);
+    int64_t total = 0;
+
+    dcb_printf(dcb, "%-24s | %-14s | %-12s | %s\n", "Subsystem", "Bytes", "Allocations", "High-water");
+    dcb_printf(dcb, "-------------------------+----------------+--------------+---------------\n");
+    for (int i = 0; i < n; i++)
+    {
+        dcb_printf(dcb, "%-24s | %14lld | %12lld | %14lld\n", stats[i].name,
+                   (long long)stats[i].bytes, (long long)stats[i].blocks,
+                   (long long)stats[i].high_water);
+        total += stats[i].bytes;
+    }
+    dcb_printf(dcb, "-------------------------+----------------+--------------+---------------\n");
+    dcb_printf(dcb, "%-24s | %14lld |\n", "Total", (long long)total);
+}
+
+/**
+ * The rows of the result set of the memory statistics
+ */
+typedef struct
+{
+    int      row;                       /*< The next row */
+    int      n;                         /*< The number of rows */
+    MEMSTATS stats[MEMSTATS_MAX_TAGS];  /*< The statistics when the result set was created */
+} MEMSTATS_ROWS;
+
+/**
+ * Provide a row to the result set of the memory statistics
+ *
+ * @param set   The result set
+ * @param data  The rows
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+memstatsRowCallback(RESULTSET *set, void *data)
+{
+    MEMSTATS_ROWS *rows = (MEMSTATS_ROWS *)data;
+    MEMSTATS *stats;
+    char buf[40];
+    RESULT_ROW *row;
+
+    if (rows->row >= rows->n)
+    {
+        free(data);
+        return NULL;
+    }
+    stats = &rows->stats[rows->row++];
+    row = resultset_make_row(set);
+    resultset_row_set(row, 0, (char *)stats->name);
+    snprintf(buf, sizeof(buf), "%lld", (long long)stats->bytes);
+    resultset_row_set(row, 1, buf);
+    snprintf(buf, sizeof(buf), "%lld", (long long)stats->blocks);
+    resultset_row_set(row, 2, buf);
+    snprintf(buf, sizeof(buf), "%lld", (long long)stats->high_water);
+    resultset_row_set(row, 3, buf);
+    return row;
+}
+
+/**
+ * Return a result set with the memory in use by each subsystem and module
+ *
+ * @return A Result set
+ */
+RESULTSET *
+memstatsGetList()
+{
+    RESULTSET *set;
+    MEMSTATS_ROWS *data;
+
+    if ((data = (MEMSTATS_ROWS *)malloc(sizeof(MEMSTATS_ROWS))) == NULL)
+    {
+        return NULL;
+    }
+    data->row = 0;
+    data->n = memstats_get(data->stats, MEMSTATS_MAX_TAGS);
+    if ((set = resultset_create(memstatsRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Subsystem", 24, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Bytes", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Allocations", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "High Water", 20, COL_TYPE_VARCHAR);
+
+    return set;
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file metrics.c  - Statistics in the Prometheus text exposition format
+ *
+ * Every metric family starts with its HELP and TYPE lines and all of its
+ * samples follow them, which is why the modules walk their objects once for
+ * each family they write.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <metrics.h>
+#include <service.h>
+#include <server.h>
+#include <filter.h>
+#include <maxscale/poll.h>
+
+/** The size of the buffers the metrics are written to */
+#define METRICS_BUFSIZE 16384
+
+/** The longest line of the output */
+#define METRICS_LINE 1024
+
+/**
+ * Send the buffer that has been filled to the client
+ *
+ * @param metrics   The output
+ */
+static void
+metrics_flush(METRICS *metrics)
+{
+    if (metrics->buf)
+    {
+        if (GWBUF_LENGTH(metrics->buf) > 0)
+        {
+            metrics->dcb->func.write(metrics->dcb, metrics->buf);
+        }
+        else
+        {
+            gwbuf_free(metrics->buf);
+        }
+        metrics->buf = NULL;
+    }
+}
+
+/**
+ * Write the metrics of all services, servers, filters and polling threads
+ *
+ * @param dcb   The client to write to
+ */
+void
+metrics_stream(DCB *dcb)
+{
+    METRICS metrics = {dcb, NULL};
+
+    service_metrics(&metrics);
+    server_metrics(&metrics);
+    filter_metrics(&metrics);
+    poll_metrics(&metrics);
+    metrics_flush(&metrics);
+}
+
+/**
+ * Append formatted output to the metrics. A buffer is sent to the client once
+ * a line does not fit into it anymore.
+ *
+ * @param metrics   The output
+ * @param fmt       The format
+ */
+void
+metrics_printf(METRICS *metrics, const char *fmt, ...)
+{
+    va_list args;
+    char line[METRICS_LINE];
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    if (len < 0)
+    {
+        return;
+    }
+    if (len >= (int)sizeof(line))
+    {
+        len = sizeof(line) - 1;
+    }
+
+    if (metrics->buf && GWBUF_LENGTH(metrics->buf) + len > METRICS_BUFSIZE)
+    {
+        metrics_flush(metrics);
+    }
+    if (metrics->buf == NULL)
+    {
+        if ((metrics->buf = gwbuf_alloc(METRICS_BUFSIZE)) == NULL)
+        {
+            return;
+        }
+        metrics->buf->end = metrics->buf->start;
+    }
+    memcpy(metrics->buf->end, line, len);
+    metrics->buf->end = (char *)metrics->buf->end + len;
+}
+
+/**
+ * Start a metric family
+ *
+ * @param metrics   The output
+ * @param name      The name of the metric
+ * @param type      The type: counter, gauge or summary
+ * @param help      The description of the metric
+ */
+void
+metrics_header(METRICS *metrics, const char *name, const char *type, const char *help)
+{
+    metrics_printf(metrics, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Escape the value of a label. Backslashes, double quotes and line feeds must
+ * be escaped with a backslash.
+ *
+ * @param value The value
+ * @param buf   The buffer for the escaped value
+ * @param len   The length of the buffer
+ * @return      The escaped value, truncated to fit the buffer
+ */
+const char *
+metrics_label(const char *value, char *buf, int len)
+{
+    int i = 0;
+
+    for (; *value && i < len - 2; value++)
+    {
+        if (*value == '\\' || *value == '"' || *value == '\n')
+        {
+            buf[i++] = '\\';
+            buf[i++] = *value == '\n' ? 'n' : *value;
+        }
+        else
+        {
+            buf[i++] = *value;
+        }
+    }
+    buf[i] = '\0';
+    return buf;
+}
+
+/**
+ * Write the samples of a summary from a histogram
+ *
+ * @param metrics   The output
+ * @param name      The name of the metric
+ * @param labels    The labels of the samples, without the braces
+ * @param histogram The histogram
+ * @param thread    The thread whose values are written, or -1 for all threads
+ */
+void
+metrics_summary(METRICS *metrics, const char *name, const char *labels,
+                ts_histogram_t histogram, int thread)
+{
+    ts_histogram_summary_t sum;
+
+    ts_histogram_get(histogram, thread, &sum);
+    metrics_printf(metrics, "%s{%s,quantile=\"0.5\"} %" PRIu64 "\n", name, labels, sum.p50);
+    metrics_printf(metrics, "%s{%s,quantile=\"0.9\"} %" PRIu64 "\n", name, labels, sum.p90);
+    metrics_printf(metrics, "%s{%s,quantile=\"0.99\"} %" PRIu64 "\n", name, labels, sum.p99);
+    metrics_printf(metrics, "%s{%s,quantile=\"0.999\"} %" PRIu64 "\n", name, labels, sum.p999);
+    metrics_printf(metrics, "%s_sum{%s} %" PRIu64 "\n", name, labels, sum.sum);
+    metrics_printf(metrics, "%s_count{%s} %" PRIu64 "\n", name, labels, sum.count);
+}
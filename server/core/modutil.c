@@ -21,6 +21,8 @@
  * 04/06/14     Mark Riddoch            Initial implementation
  * 24/10/14     Massimiliano Pinto      Added modutil_send_mysql_err_packet, modutil_create_mysql_err_msg
  * 04/01/16     Martin Brampton         Streamline code in modutil_get_complete_packets
+ * 15/10/2016   Core Team               Rewrite the SQL of modutil_replace_SQL in place
+ * 15/10/2016   Core Team               Packet scan of replies, used to count the signal packets
  *
  * @endverbatim
  */
@@ -31,6 +33,10 @@
 #include <modutil.h>
 #include <strings.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /** These are used when converting MySQL wildcards to regular expressions */
 static SPINLOCK re_lock = SPINLOCK_INIT;
 static bool pattern_init = false;
@@ -205,56 +211,106 @@ retblock:
  * The routine takes care of the modification needed to the MySQL packet,
  * returning a GWBUF chain that can be used to send the data to a MySQL server
  *
+ * The statement is rewritten in place, also when the packet is split over a
+ * chain of buffers. A shorter statement trims the chain and a longer one
+ * extends the last buffer in place when its memory block has room for it,
+ * otherwise a buffer with the rest of the statement is appended. Only data
+ * shared with clones of the buffer is copied into a new buffer, in which case
+ * the original is freed.
+ *
  * @param orig  The original request in a GWBUF
  * @param sql   The SQL text to replace in the packet
- * @return A newly formed GWBUF containing the MySQL packet.
+ * @return The buffer with the new MySQL packet or NULL on error
  */
 GWBUF *
 modutil_replace_SQL(GWBUF *orig, char *sql)
 {
-    unsigned char   *ptr;
-    int     length, newlength;
-    GWBUF   *addition;
-
     if (!modutil_is_SQL(orig))
     {
         return NULL;
     }
-    ptr = GWBUF_DATA(orig);
-    length = *ptr++;
-    length += (*ptr++ << 8);
-    length += (*ptr++ << 16);
-    ptr += 2;  // Skip sequence id  and COM_QUERY byte
 
-    newlength = strlen(sql);
-    if (length - 1 == newlength)
+    unsigned int newlength = strlen(sql);
+    uint8_t *ptr = GWBUF_DATA(orig);
+
+    for (GWBUF *buf = orig; buf; buf = buf->next)
     {
-        /* New SQL is the same length as old */
-        memcpy(ptr, sql, newlength);
+        if (buf->sbuf->refcount > 1)
+        {
+            /** Modifying shared data would change the clones as well */
+            GWBUF *rval = gwbuf_alloc(newlength + 5);
+
+            if (rval)
+            {
+                uint8_t *data = GWBUF_DATA(rval);
+                gw_mysql_set_byte3(data, newlength + 1);
+                data[3] = ptr[3];
+                data[4] = ptr[4];
+                memcpy(data + 5, sql, newlength);
+                rval->gwbuf_type = orig->gwbuf_type;
+                rval->hint = hint_dup(orig->hint);
+                gwbuf_free(orig);
+            }
+
+            return rval;
+        }
     }
-    else if (length - 1 > newlength)
+
+    unsigned int available = gwbuf_length(orig) - 5;
+
+    if (newlength > available && !gwbuf_grow(orig, newlength - available))
     {
-        /* New SQL is shorter */
-        memcpy(ptr, sql, newlength);
-        GWBUF_RTRIM(orig, (length - 1) - newlength);
-        ptr = GWBUF_DATA(orig);
-        *ptr++ = (newlength + 1) & 0xff;
-        *ptr++ = ((newlength + 1) >> 8) & 0xff;
-        *ptr++ = ((newlength + 1) >> 16) & 0xff;
+        GWBUF *addition = gwbuf_alloc(newlength - available);
+
+        if (addition == NULL)
+        {
+            return NULL;
+        }
+
+        addition->gwbuf_type = orig->gwbuf_type;
+        orig = gwbuf_append(orig, addition);
     }
-    else
+
+    gw_mysql_set_byte3(ptr, newlength + 1);
+
+    /** Copy the statement over the old one, buffer by buffer */
+    GWBUF *buf = orig;
+    unsigned int offset = 5;
+    unsigned int copied = 0;
+
+    while (true)
     {
-        memcpy(ptr, sql, length - 1);
-        addition = gwbuf_alloc(newlength - (length - 1));
-        memcpy(GWBUF_DATA(addition), &sql[length - 1], newlength - (length - 1));
-        ptr = GWBUF_DATA(orig);
-        *ptr++ = (newlength + 1) & 0xff;
-        *ptr++ = ((newlength + 1) >> 8) & 0xff;
-        *ptr++ = ((newlength + 1) >> 16) & 0xff;
-        addition->gwbuf_type = orig->gwbuf_type;
-        orig->next = addition;
+        unsigned int n = GWBUF_LENGTH(buf) - offset;
+
+        if (n > newlength - copied)
+        {
+            n = newlength - copied;
+        }
+
+        memcpy((uint8_t *)GWBUF_DATA(buf) + offset, sql + copied, n);
+        copied += n;
+        offset += n;
+
+        if (copied == newlength || buf->next == NULL)
+        {
+            break;
+        }
+
+        buf = buf->next;
+        offset = 0;
     }
 
+    /** Drop what is left of a longer statement */
+    buf->end = (uint8_t *)GWBUF_DATA(buf) + offset;
+
+    if (buf->next)
+    {
+        gwbuf_free(buf->next);
+        buf->next = NULL;
+    }
+
+    orig->tail = buf;
+
     return orig;
 }
 
@@ -271,39 +327,24 @@ modutil_replace_SQL(GWBUF *orig, char *sql)
 char *
 modutil_get_SQL(GWBUF *buf)
 {
-    unsigned int len, length;
-    unsigned char *ptr;
-    char *dptr, *rval = NULL;
+    GWBUF_ITERATOR iter;
+    uint8_t header[MYSQL_HEADER_LEN + 1];
+    size_t length;
+    char *rval = NULL;
 
     if (modutil_is_SQL(buf) || modutil_is_SQL_prepare(buf) ||
         MYSQL_IS_COM_INIT_DB((uint8_t*)GWBUF_DATA(buf)))
     {
-        ptr = GWBUF_DATA(buf);
-        length = *ptr++;
-        length += (*ptr++ << 8);
-        length += (*ptr++ << 16);
+        gwbuf_iter_init(&iter, buf);
+        gwbuf_iter_copy(&iter, sizeof(header), header);
+        length = gw_mysql_get_byte3(header);
 
-        if ((rval = (char *) malloc(length + 1)))
+        if (length > 0 && (rval = (char *) malloc(length)))
         {
-            dptr = rval;
-            ptr += 2; // Skip sequence id  and COM_QUERY byte
-            len = GWBUF_LENGTH(buf) - 5;
-
-            while (buf && length > 0)
-            {
-                int clen = length > len ? len : length;
-                memcpy(dptr, ptr, clen);
-                dptr += clen;
-                length -= clen;
-                buf = buf->next;
-
-                if (buf)
-                {
-                    ptr = GWBUF_DATA(buf);
-                    len = GWBUF_LENGTH(buf);
-                }
-            }
-            *dptr = 0;
+            /** Skip the header and the command byte, the text may span buffers */
+            gwbuf_iter_skip(&iter, sizeof(header));
+            length = gwbuf_iter_copy(&iter, length - 1, (uint8_t *)rval);
+            rval[length] = 0;
         }
     }
     return rval;
@@ -556,49 +597,22 @@ return_packetbuf:
  */
 static size_t get_complete_packets_length(GWBUF *buffer)
 {
+    GWBUF_ITERATOR iter;
     uint8_t packet_len[3];
-    uint32_t buflen = GWBUF_LENGTH(buffer);
-    size_t offset = 0;
     size_t total = 0;
 
-    while (buffer && gwbuf_copy_data(buffer, offset, 3, packet_len) == 3)
+    gwbuf_iter_init(&iter, buffer);
+
+    while (gwbuf_iter_copy(&iter, 3, packet_len) == 3)
     {
-        uint32_t len = gw_mysql_get_byte3(packet_len) + MYSQL_HEADER_LEN;
+        size_t len = gw_mysql_get_byte3(packet_len) + MYSQL_HEADER_LEN;
 
-        if (len < buflen)
+        /** The chain ends with an incomplete packet */
+        if (gwbuf_iter_skip(&iter, len) < len)
         {
-            offset += len;
-            total += len;
-            buflen -= len;
-        }
-        /** The packet is spread across multiple buffers or a buffer ends with
-         * a complete packet. */
-        else
-        {
-            uint32_t read_len = len;
-
-            while (read_len >= buflen && buffer)
-            {
-                read_len -= buflen;
-                buffer = buffer->next;
-                buflen = buffer ? GWBUF_LENGTH(buffer) : 0;
-            }
-
-            /** Either the buffer ended with a complete packet or the buffer
-             * contains more data than is required. */
-            if (read_len == 0 || (buffer && read_len < buflen))
-            {
-                total += len;
-                offset = read_len;
-                buflen -= read_len;
-            }
-            /** The buffer chain contains at least one incomplete packet */
-            else
-            {
-                ss_dassert(!buffer);
-                break;
-            }
+            break;
         }
+        total += len;
     }
 
     return total;
@@ -643,82 +657,211 @@ GWBUF* modutil_get_complete_packets(GWBUF **p_readbuf)
 }
 
 /**
- * Count the number of EOF, OK or ERR packets in the buffer. Only complete
- * packets are inspected and the buffer is assumed to only contain whole packets.
- * If partial packets are in the buffer, they are ignored. The caller must handle the
- * detection of partial packets in buffers.
- * @param reply Buffer to use
- * @param use_ok Whether the DEPRECATE_EOF flag is set
- * @param n_found If there were previous packets found
- * @return Number of EOF packets
+ * Whether the first payload byte of a packet can start an OK, EOF, ERR or
+ * LOCAL INFILE packet. The column definitions and the rows of a result set
+ * start with a length-encoded string and are mostly told apart by this byte.
  */
-int
-modutil_count_signal_packets(GWBUF *reply, int use_ok,  int n_found, int* more)
+static inline bool scan_is_signal(uint8_t cmd)
 {
-    unsigned char* ptr = (unsigned char*) reply->start;
-    unsigned char* end = (unsigned char*) reply->end;
-    unsigned char* prev = ptr;
-    int pktlen, eof = 0, err = 0;
-    int errlen = 0, eoflen = 0;
-    int iserr = 0, iseof = 0;
-    bool moreresults = false;
-    while (ptr < end)
+    return cmd == 0x00 || cmd == 0xfb || cmd == 0xfe || cmd == 0xff;
+}
+
+/**
+ * Initialise a packet scan to the start of a reply
+ *
+ * @param scan The scan
+ */
+void modutil_scan_init(MODUTIL_PACKET_SCAN *scan)
+{
+    memset(scan, 0, sizeof(*scan));
+}
+
+/**
+ * @brief Scan the packets of a reply
+ *
+ * The packets are walked by their headers and the payload is skipped without
+ * copying or joining the buffers. The callback is called for the packets that
+ * can be OK, EOF, ERR or LOCAL INFILE packets, the other packets are only
+ * counted unless @c all_packets is set. The start of a packet that is short or
+ * spans buffers is gathered into the scan, also across calls, so the callback
+ * always gets the first bytes of a packet in one place.
+ *
+ * @param scan  The scan, initialised with modutil_scan_init
+ * @param buf   The next buffers of the reply
+ * @param fn    The callback
+ * @param data  Data passed to the callback
+ * @return Number of bytes of @c buf scanned. This is less than the length of
+ * @c buf only if the callback stopped the scan, the rest of the packet it was
+ * called for is then included.
+ */
+size_t modutil_scan_packets(MODUTIL_PACKET_SCAN *scan, GWBUF *buf, modutil_scan_fn fn, void *data)
+{
+    size_t scanned = 0;
+    bool stop = false;
+
+    for (; buf; buf = buf->next)
     {
-        pktlen = MYSQL_GET_PACKET_LEN(ptr) + 4;
+        uint8_t *ptr = (uint8_t*)GWBUF_DATA(buf);
+        uint8_t *end = (uint8_t*)buf->end;
 
-        if ((iserr = PTR_IS_ERR(ptr)) || (iseof = PTR_IS_EOF(ptr)))
+        while (ptr < end)
         {
-            if (iserr)
+            if (scan->skip > 0)
             {
-                err++;
-                errlen = pktlen;
+                size_t n = MIN(scan->skip, (size_t)(end - ptr));
+                ptr += n;
+                scanned += n;
+                scan->skip -= n;
+                continue;
             }
-            else if (iseof)
+
+            if (stop)
             {
-                eof++;
-                eoflen = pktlen;
+                return scanned;
             }
-        }
 
-        if ((ptr + pktlen) > end || (eof + n_found) >= 2)
-        {
-            moreresults = PTR_EOF_MORE_RESULTS(ptr);
-            ptr = prev;
-            break;
+            uint8_t *header = NULL;
+            size_t pktlen = 0;
+
+            if (scan->header_len == 0 && end - ptr > MYSQL_HEADER_LEN)
+            {
+                /** The header and the first payload byte are in this buffer */
+                pktlen = gw_mysql_get_byte3(ptr) + MYSQL_HEADER_LEN;
+
+                if (pktlen > MYSQL_HEADER_LEN && !scan->all_packets &&
+                    !scan_is_signal(ptr[MYSQL_HEADER_LEN]))
+                {
+                    scan->n_packets++;
+                    scan->skip = pktlen;
+                    continue;
+                }
+
+                if (pktlen >= MODUTIL_SCAN_HEADER_LEN && end - ptr >= MODUTIL_SCAN_HEADER_LEN)
+                {
+                    header = ptr;
+                    scan->skip = pktlen;
+                }
+            }
+
+            if (header == NULL)
+            {
+                size_t n;
+
+                if (scan->header_len == 0)
+                {
+                    memset(scan->header, 0, sizeof(scan->header));
+                }
+
+                /** Gather the header first and then as much of the payload as is passed on */
+                do
+                {
+                    size_t want = scan->header_len < MYSQL_HEADER_LEN ? MYSQL_HEADER_LEN :
+                                  MIN(gw_mysql_get_byte3(scan->header) + MYSQL_HEADER_LEN,
+                                      MODUTIL_SCAN_HEADER_LEN);
+                    n = MIN(want - scan->header_len, (size_t)(end - ptr));
+                    memcpy(scan->header + scan->header_len, ptr, n);
+                    scan->header_len += n;
+                    ptr += n;
+                    scanned += n;
+                }
+                while (n > 0);
+
+                if (scan->header_len < MYSQL_HEADER_LEN ||
+                    scan->header_len < MIN(gw_mysql_get_byte3(scan->header) + MYSQL_HEADER_LEN,
+                                           MODUTIL_SCAN_HEADER_LEN))
+                {
+                    /** The rest is in the next buffer */
+                    continue;
+                }
+
+                header = scan->header;
+                pktlen = gw_mysql_get_byte3(header) + MYSQL_HEADER_LEN;
+                scan->skip = pktlen - scan->header_len;
+                scan->header_len = 0;
+
+                if (!scan->all_packets &&
+                    !(pktlen > MYSQL_HEADER_LEN && scan_is_signal(header[MYSQL_HEADER_LEN])))
+                {
+                    scan->n_packets++;
+                    continue;
+                }
+            }
+
+            scan->n_packets++;
+            stop = !fn(data, header, pktlen);
         }
+    }
+
+    return scanned;
+}
+
+/** The state of modutil_count_signal_packets */
+typedef struct
+{
+    MODUTIL_PACKET_SCAN scan;       /*< The scan of the reply */
+    int                 n_found;    /*< EOF packets found before this reply */
+    int                 eof;        /*< EOF packets found */
+    int                 err;        /*< ERR packets found */
+    uint64_t            last;       /*< Index of the last EOF or ERR packet plus one */
+    bool                more;       /*< Whether more results follow the last EOF */
+} signal_count_t;
+
+static bool count_signal_packet(void *data, uint8_t *header, size_t pktlen)
+{
+    signal_count_t *count = (signal_count_t*)data;
 
-        prev = ptr;
-        ptr += pktlen;
+    if (PTR_IS_ERR(header))
+    {
+        count->err++;
+        count->last = count->scan.n_packets;
     }
+    else if (PTR_IS_EOF(header))
+    {
+        count->eof++;
+        count->last = count->scan.n_packets;
+    }
+
+    if (count->eof + count->n_found >= 2)
+    {
+        count->more = PTR_EOF_MORE_RESULTS(header);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Count the number of EOF or ERR packets in the buffer. The buffer is assumed
+ * to only contain whole packets, it may be a chain of buffers. The rows of a
+ * result set are skipped by their headers.
+ * @param reply Buffer to use
+ * @param use_ok Whether the DEPRECATE_EOF flag is set
+ * @param n_found If there were previous packets found
+ * @param more Set to true if the EOF that ends the result set has more results
+ * @return Number of EOF packets
+ */
+int
+modutil_count_signal_packets(GWBUF *reply, int use_ok,  int n_found, int* more)
+{
+    signal_count_t count = {.n_found = n_found};
 
+    modutil_scan_init(&count.scan);
+    size_t scanned = modutil_scan_packets(&count.scan, reply, count_signal_packet, &count);
 
     /*
      * If there were new EOF/ERR packets found, make sure that they are the last
      * packet in the buffer.
      */
-    if ((eof || err) && n_found)
+    if ((count.eof || count.err) && n_found &&
+        (count.last != count.scan.n_packets || scanned < gwbuf_length(reply)))
     {
-        if (err)
-        {
-            ptr -= errlen;
-            if (!PTR_IS_ERR(ptr))
-            {
-                err = 0;
-            }
-        }
-        else
-        {
-            ptr -= eoflen;
-            if (!PTR_IS_EOF(ptr))
-            {
-                eof = 0;
-            }
-        }
+        count.eof = 0;
+        count.err = 0;
     }
 
-    *more = moreresults;
+    *more = count.more;
 
-    return (eof + err);
+    return (count.eof + count.err);
 }
 
 /**
@@ -791,6 +934,91 @@ static void modutil_reply_routing_error(DCB*     backend_dcb,
     return;
 }
 
+/**
+ * The bytes at which the scans below stop to update their state. Every other
+ * byte is skipped, sixteen at a time when SSE2 is available.
+ */
+typedef struct stop_set
+{
+    const char* bytes; /*< The bytes, at most eight */
+    int         n;     /*< The number of bytes */
+#if defined(__SSE2__)
+    __m128i     v[8];  /*< Each byte in all lanes */
+#endif
+} STOP_SET;
+
+static inline void stop_set_init(STOP_SET* set, const char* bytes, int n)
+{
+    set->bytes = bytes;
+    set->n = n;
+#if defined(__SSE2__)
+    for (int i = 0; i < n; i++)
+    {
+        set->v[i] = _mm_set1_epi8(bytes[i]);
+    }
+#endif
+}
+
+#if defined(__SSE2__)
+static inline int stop_set_mask(const STOP_SET* set, __m128i x)
+{
+    __m128i m = _mm_cmpeq_epi8(x, set->v[0]);
+
+    for (int i = 1; i < set->n; i++)
+    {
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, set->v[i]));
+    }
+
+    return _mm_movemask_epi8(m);
+}
+#endif
+
+/**
+ * Find the first byte of a stop set
+ *
+ * @param set   The stop set
+ * @param p     Where to start the search
+ * @param start The start of the memory area, which may be read before @p p
+ * @param end   The end of the memory area
+ * @return Pointer to the first byte of the set or @p end if there is none
+ */
+static inline char* find_stop(const STOP_SET* set, char* p, char* start, char* end)
+{
+#if defined(__SSE2__)
+    for (; end - p >= 16; p += 16)
+    {
+        int mask = stop_set_mask(set, _mm_loadu_si128((const __m128i*)p));
+
+        if (mask)
+        {
+            return p + __builtin_ctz(mask);
+        }
+    }
+
+    /** The tail is covered by the last sixteen bytes of the area, if it has them */
+    if (p < end && end - start >= 16)
+    {
+        int mask = stop_set_mask(set, _mm_loadu_si128((const __m128i*)(end - 16)));
+        mask >>= 16 - (end - p);
+
+        return mask ? p + __builtin_ctz(mask) : end;
+    }
+#endif
+
+    for (; p < end; p++)
+    {
+        for (int i = 0; i < set->n; i++)
+        {
+            if (*p == set->bytes[i])
+            {
+                return p;
+            }
+        }
+    }
+
+    return end;
+}
+
 /**
  * Find the first occurrence of a character in a string. This function ignores
  * escaped characters and all characters that are enclosed in single or double quotes.
@@ -803,12 +1031,30 @@ static void modutil_reply_routing_error(DCB*     backend_dcb,
 char* strnchr_esc(char* ptr, char c, int len)
 {
     char* p = (char*)ptr;
-    char* start = p;
+    char* end = p + len;
     bool quoted = false, escaped = false;
-    char qc;
+    char qc = 0;
+    char stops[] = {'\\', '\'', '"', c};
+    STOP_SET plain, single_quoted, double_quoted;
 
-    while (p < start + len)
+    /** Inside quotes only the closing quote and escapes matter */
+    stop_set_init(&plain, stops, 4);
+    stop_set_init(&single_quoted, stops, 2);
+    stop_set_init(&double_quoted, "\\\"", 2);
+
+    while (p < end)
     {
+        if (!escaped)
+        {
+            const STOP_SET* set = !quoted ? &plain : qc == '\'' ? &single_quoted : &double_quoted;
+            p = find_stop(set, p, ptr, end);
+
+            if (p == end)
+            {
+                break;
+            }
+        }
+
         if (escaped)
         {
             escaped = false;
@@ -851,10 +1097,31 @@ char* strnchr_esc_mysql(char* ptr, char c, int len)
     char* p = (char*) ptr;
     char* start = p, *end = start + len;
     bool quoted = false, escaped = false, backtick = false, comment = false;
-    char qc;
+    char qc = 0;
+    char stops[] = {'\\', '\'', '"', '/', '`', '#', '-', c};
+    STOP_SET plain, single_quoted, double_quoted, in_comment, in_backticks;
+
+    /** Inside a quote, comment or identifier only what can end it matters */
+    stop_set_init(&plain, stops, 8);
+    stop_set_init(&single_quoted, "'", 1);
+    stop_set_init(&double_quoted, "\"", 1);
+    stop_set_init(&in_comment, "*", 1);
+    stop_set_init(&in_backticks, "`", 1);
 
     while (p < end)
     {
+        if (!escaped)
+        {
+            const STOP_SET* set = quoted ? (qc == '\'' ? &single_quoted : &double_quoted) :
+                                  comment ? &in_comment : backtick ? &in_backticks : &plain;
+            p = find_stop(set, p, start, end);
+
+            if (p == end)
+            {
+                break;
+            }
+        }
+
         if (escaped)
         {
             escaped = false;
@@ -1173,8 +1440,6 @@ mxs_pcre2_result_t modutil_mysql_wildcard_match(const char* pattern, const char*
 /*
  * Replace user-provided literals with question marks.
  *
- * TODO: Make the canonicalization allocate only one buffer of memory
- *
  * @param querybuf GWBUF with a COM_QUERY statement
  * @return A copy of the query in its canonical form or NULL if an error occurred.
  */
@@ -1186,37 +1451,10 @@ char* modutil_get_canonical(GWBUF* querybuf)
     {
         size_t srcsize = GWBUF_LENGTH(querybuf) - MYSQL_HEADER_LEN - 1;
         char *src = (char*)GWBUF_DATA(querybuf) + MYSQL_HEADER_LEN + 1;
-        size_t destsize = 0;
-        char *dest = NULL;
 
-        if (replace_quoted((const char**)&src, &srcsize, &dest, &destsize))
+        if ((querystr = malloc(CANONICAL_SQL_SIZE(srcsize))))
         {
-            /** Reset the buffers so that the old result is reused and a new
-             * result is created.*/
-            src = dest;
-            srcsize = destsize;
-            dest = NULL;
-            destsize = 0;
-
-            if (remove_mysql_comments((const char**)&src, &srcsize, &dest, &destsize))
-            {
-                /** Both buffers now contain allocated memory so all we need
-                 * to do is to swap them */
-                if (replace_values((const char**)&dest, &destsize, &src, &srcsize))
-                {
-                    querystr = squeeze_whitespace(src);
-                    free(dest);
-                }
-                else
-                {
-                    free(src);
-                    free(dest);
-                }
-            }
-            else
-            {
-                free(src);
-            }
+            canonicalize_sql(src, srcsize, querystr);
         }
     }
 
@@ -24,6 +24,8 @@
  * 30/10/14     Massimiliano Pinto      Addition of disable_master_failback parameter
  * 07/11/14     Massimiliano Pinto      Addition of monitor network timeouts
  * 08/05/15     Markus Makela           Moved common monitor variables to MONITOR struct
+ * 15/10/2016   Core Team               Multi-statement queries of the monitors
+ * 15/10/2016   Core Team               Cached system variables of the servers
  *
  * @endverbatim
  */
@@ -56,7 +58,7 @@ const monitor_def_t monitor_event_definitions[MAX_MONITOR_EVENT] =
 #undef ADDITEM
 
 static MONITOR  *allMonitors = NULL;
-static SPINLOCK monLock = SPINLOCK_INIT;
+static SPINLOCK monLock = SPINLOCK_INIT_NAMED("monitors");
 
 static void monitor_servers_free(MONITOR_SERVERS *servers);
 
@@ -902,18 +904,17 @@ monitor_launch_script(MONITOR* mon, MONITOR_SERVERS* ptr, char* script)
         externcmd_substitute_arg(cmd, "[$]SYNCEDLIST", nodelist);
     }
 
-    if (externcmd_execute(cmd))
+    /** The script is run by a separate thread so a slow script does not delay monitoring */
+    if (externcmd_execute_async(cmd))
     {
-        MXS_ERROR("Failed to execute script '%s' on server state change event '%s'.",
-                  script, mon_get_event_name(ptr));
+        MXS_NOTICE("Queued monitor script '%s' on event '%s'.",
+                   script, mon_get_event_name(ptr));
     }
     else
     {
-        MXS_NOTICE("Executed monitor script '%s' on event '%s'.",
-                   script, mon_get_event_name(ptr));
+        MXS_ERROR("Failed to execute script '%s' on server state change event '%s'.",
+                  script, mon_get_event_name(ptr));
     }
-
-    externcmd_free(cmd);
 }
 
 /**
@@ -958,6 +959,74 @@ mon_parse_event_string(bool* events, size_t count, char* given_string)
     return 0;
 }
 
+/**
+ * Execute several statements with one round trip. The connection must have
+ * been created with mon_connect_to_db which enables the multi-statements.
+ *
+ * @param database Monitored database
+ * @param query    The statements separated by semicolons
+ * @param results  Where the results of the statements are stored, NULL for a
+ *                 statement that failed or was not executed. The caller frees
+ *                 the results.
+ * @param n        Number of statements
+ * @return True if all statements succeeded
+ */
+bool
+mon_query_multi(MONITOR_SERVERS *database, const char *query, MYSQL_RES **results, int n)
+{
+    int i = 0;
+
+    memset(results, 0, n * sizeof(*results));
+
+    if (mysql_query(database->con, query) == 0)
+    {
+        do
+        {
+            MYSQL_RES *result = mysql_store_result(database->con);
+
+            if (i < n)
+            {
+                results[i++] = result;
+            }
+            else if (result)
+            {
+                mysql_free_result(result);
+            }
+        }
+        while (mysql_next_result(database->con) == 0);
+    }
+
+    return i == n && mysql_errno(database->con) == 0;
+}
+
+/**
+ * Store the global system variables of a server read with
+ * MON_SERVER_VARIABLES_QUERY. The variables are left as they were if the
+ * query failed.
+ *
+ * @param database Monitored database
+ * @param result   The result of the query or NULL, freed by this function
+ */
+void
+mon_store_server_variables(MONITOR_SERVERS *database, MYSQL_RES *result)
+{
+    if (result == NULL)
+    {
+        return;
+    }
+
+    MYSQL_ROW row;
+
+    if (mysql_num_fields(result) == SERVER_N_VARS && (row = mysql_fetch_row(result)))
+    {
+        for (int i = 0; i < SERVER_N_VARS; i++)
+        {
+            server_set_variable(database->server, (server_var_t)i, row[i]);
+        }
+    }
+    mysql_free_result(result);
+}
+
 /**
  * Connect to a database. This will always leave a valid database handle in the
  * database->con pointer. This allows the user to call MySQL C API functions to
@@ -996,6 +1065,14 @@ mon_connect_to_db(MONITOR* mon, MONITOR_SERVERS *database)
         bool result = (mxs_mysql_real_connect(database->con, database->server, uname, dpwd) != NULL);
         time_t end = time(NULL);
 
+        /** The monitors read the state of a server with one multi-statement query */
+        if (result && mysql_set_server_option(database->con, MYSQL_OPTION_MULTI_STATEMENTS_ON) != 0)
+        {
+            MXS_WARNING("Failed to enable multi-statements on the monitor connection "
+                        "to server '%s': %s", database->server->unique_name,
+                        mysql_error(database->con));
+        }
+
         if (!result)
         {
             if ((int) difftime(end, start) >= mon->connect_timeout)
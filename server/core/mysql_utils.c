@@ -172,5 +172,10 @@ MYSQL *mxs_mysql_real_connect(MYSQL *con, SERVER *server, const char *user, cons
 #endif
     }
 
+    if (server->socket)
+    {
+        return mysql_real_connect(con, "localhost", user, passwd, NULL, 0, server->socket, 0);
+    }
+
     return mysql_real_connect(con, server->name, user, passwd, NULL, server->port, NULL, 0);
 }
@@ -15,9 +15,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <sys/epoll.h>
 #include <errno.h>
+#include <time.h>
 #include <maxscale/poll.h>
 #include <dcb.h>
 #include <atomic.h>
@@ -31,13 +33,21 @@
 #include <mysql.h>
 #include <resultset.h>
 #include <session.h>
+#include <listener.h>
+#include <service.h>
 #include <statistics.h>
 #include <query_classifier.h>
+#include <platform.h>
+#include <timer.h>
+#include <epoch.h>
+#include <thread.h>
+#include <rdtsc.h>
+#include <probes.h>
+#include <random_jkiss.h>
 
 #define         PROFILE_POLL    0
 
 #if PROFILE_POLL
-#include <rdtsc.h>
 #include <memlog.h>
 
 extern unsigned long hkheartbeat;
@@ -80,7 +90,62 @@ int max_poll_sleep;
  */
 #define MUTEX_EPOLL     0
 
-static int epoll_fd = -1;    /*< The epoll file descriptor */
+/**
+ * The minimum number of DCBs with pending events an event queue must have
+ * before an idle thread will steal work from it. This leaves the owning thread
+ * with work of its own while the rest is shared with the idle threads.
+ */
+#define POLL_STEAL_THRESHOLD 2
+
+/**
+ * EPOLLEXCLUSIVE is supported by Linux 4.5 and later. It is defined here for
+ * older headers, older kernels reject it and the listener is added without it.
+ */
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+/**
+ * A queue of DCBs that have events pending. By default there is a single
+ * queue and a single epoll instance shared by all the polling threads. When
+ * polling thread affinity is enabled each polling thread has an epoll instance
+ * and an event queue of its own and a DCB is queued to the thread that owns it.
+ * With work stealing an idle thread may also process a DCB that is in the queue
+ * of another thread, so the processing flag of the DCB, not the owner, is what
+ * keeps two threads from processing it at once.
+ */
+typedef struct
+{
+    DCB      *head;     /*< The first DCB in the queue */
+    int      pending;   /*< No. of DCBs in the queue with pending events */
+    SPINLOCK lock;      /*< Protects the queue */
+} POLL_QUEUE;
+
+/**
+ * A group of polling threads with consecutive IDs. The services and listeners
+ * assigned to a named group are only served by its threads, which keeps heavy
+ * services from starving the others. Group 0 is the default group, made of
+ * the threads configured with 'threads'. The groups need polling thread
+ * affinity, as it gives each thread an epoll instance of its own.
+ */
+typedef struct
+{
+    int first;          /*< The ID of the first thread of the group */
+    int n;              /*< No. of threads in the group */
+} POLL_GROUP;
+
+static int *epoll_fds = NULL;       /*< The epoll file descriptors */
+static POLL_QUEUE *pollqs = NULL;   /*< The event queues, one per epoll descriptor */
+static int n_pollqs = 0;            /*< No. of epoll descriptors and event queues */
+static bool poll_affinity = false;  /*< DCBs are bound to a polling thread */
+static bool poll_steal = false;     /*< Idle threads process DCBs of busy threads */
+static int next_owner = 0;          /*< Used to assign owners to DCBs created outside polling threads */
+static thread_local int current_poll_thread = -1; /*< ID of the calling polling thread */
+static TIMER_WHEEL *timer_wheels = NULL;  /*< The timer wheels of the polling threads */
+static cpu_set_t *thread_cpus = NULL;     /*< The CPUs of each polling thread, NULL if not bound */
+static POLL_GROUP *poll_groups = NULL;    /*< The thread groups, the default group first */
+static int n_poll_groups = 1;             /*< No. of thread groups */
+static int *thread_groups = NULL;         /*< The group of each polling thread */
 static int do_shutdown = 0;  /*< Flag the shutdown of the poll subsystem */
 static GWBITMASK poll_mask;
 #if MUTEX_EPOLL
@@ -89,11 +154,14 @@ static simple_mutex_t epoll_wait_mutex; /*< serializes calls to epoll_wait */
 static int n_waiting = 0;    /*< No. of threads in epoll_wait */
 
 static int process_pollq(int thread_id);
+static bool process_dcb_events(DCB *dcb, uint32_t ev, int thread_id);
 static void poll_add_event_to_dcb(DCB* dcb, GWBUF* buf, __uint32_t ev);
+static void poll_queue_events(POLL_QUEUE *queue, DCB *dcb, uint32_t ev);
 static bool poll_dcb_session_check(DCB *dcb, const char *);
-
-DCB *eventq = NULL;
-SPINLOCK pollqlock = SPINLOCK_INIT;
+static inline int poll_dcb_queue_index(DCB *dcb);
+static POLL_QUEUE *poll_find_victim(int thread_id);
+static void poll_init_groups();
+static int poll_dcb_group(DCB *dcb);
 
 /**
  * Thread load average, this is the average number of descriptors in each
@@ -133,6 +201,13 @@ typedef struct
     int n_fds;          /*< No. of descriptors thread is processing */
     DCB *cur_dcb;       /*< Current DCB being processed */
     uint32_t event;     /*< Current event being processed */
+    clockid_t cpu_clock;        /*< CPU time clock of the thread */
+    bool has_cpu_clock;         /*< Whether cpu_clock is valid */
+    unsigned long n_events;     /*< No. of DCB events dispatched */
+    unsigned long bytes_in;     /*< Bytes read from the sockets */
+    unsigned long bytes_out;    /*< Bytes written to the sockets */
+    CYCLES dispatch_cycles;     /*< Time spent processing the events */
+    CYCLES zombie_cycles;       /*< Time spent collecting zombies and retired data */
 } THREAD_DATA;
 
 static THREAD_DATA *thread_data = NULL;    /*< Status of each thread */
@@ -168,6 +243,9 @@ static struct
     int evq_max;                /*< Maximum event queue length */
     int wake_evqpending;        /*< Woken from epoll_wait with pending events in queue */
     ts_stats_t *blockingpolls;  /*< Number of epoll_waits with a timeout specified */
+    ts_stats_t *n_steals;       /*< Number of DCBs processed for other threads */
+    ts_histogram_t qdelay;      /*< Microseconds from epoll_wait to dispatch */
+    ts_histogram_t exectime;    /*< Microseconds spent processing the events */
 } pollStats;
 
 #define N_QUEUE_TIMES   30
@@ -182,6 +260,59 @@ static struct
     unsigned long maxexectime;
 } queueStats;
 
+/**
+ * The number of buckets in the latency histograms. Bucket 0 counts the values
+ * below one microsecond and bucket n the values from 2^(n-1) up to 2^n
+ * microseconds, the last bucket also counts everything above it.
+ */
+#define N_LATENCY_BUCKETS 20
+
+/**
+ * The number of buckets in the histogram of events per wakeup. Bucket n counts
+ * the wakeups with 2^n up to 2^(n+1) - 1 events.
+ */
+#define N_WAKEUP_BUCKETS 10
+
+/**
+ * The histogram of events per wakeup of a polling thread. Only the owning
+ * thread updates it, so no locking is needed. The latencies are recorded in
+ * the histograms of pollStats.
+ */
+typedef struct
+{
+    unsigned long wakeups[N_WAKEUP_BUCKETS];   /*< Events returned by epoll_wait */
+} POLL_HISTOGRAMS;
+
+static POLL_HISTOGRAMS *histograms = NULL; /*< The histograms of each thread */
+
+/** The bounds of the non-blocking polls an adaptive thread makes before blocking */
+#define POLL_ADAPT_MAX_SPINS 256
+/** The events per second at which the blocking timeout of a thread is halved */
+#define POLL_ADAPT_BUSY_RATE 1000
+
+/**
+ * The adaptive polling of a thread. The spins and the timeout are decided
+ * again once every heartbeat from what the thread saw during it: the spins
+ * double while a quarter of the non-blocking polls return events and halve
+ * while fewer than one in sixteen does, and the timeout shrinks as the rate
+ * of events grows. Only the owning thread updates the controller.
+ */
+typedef struct
+{
+    long window;                /*< The heartbeat the current window started at */
+    int spin_polls;             /*< Non-blocking polls made in the window */
+    int spin_hits;              /*< Non-blocking polls that returned events */
+    int events;                 /*< Events received in the window */
+    int rate;                   /*< Events per second in the last window */
+    int spins;                  /*< Non-blocking polls made before blocking */
+    int sleep;                  /*< Timeout of the blocking polls in milliseconds */
+    unsigned long n_raised;     /*< Times the spins were raised */
+    unsigned long n_lowered;    /*< Times the spins were lowered */
+} POLL_ADAPT;
+
+static POLL_ADAPT *poll_adapt = NULL;       /*< Of each thread, NULL unless adaptive_polling */
+static double cycles_per_usec = 1.0;       /*< Time-stamp counter frequency */
+
 /**
  * How frequently to call the poll_loadav function used to monitor the load
  * average of the poll subsystem.
@@ -192,6 +323,14 @@ static struct
  */
 static void poll_loadav(void *);
 
+static void poll_calibrate_cycles();
+static void poll_init_affinity();
+static void poll_record_latency(ts_histogram_t histogram, CYCLES cycles);
+static void poll_record_wakeup(int thread_id, int nfds);
+static void dprintPollHistograms(DCB *dcb);
+static void poll_adapt_update(POLL_ADAPT *adapt);
+static void dprintPollAdaptive(DCB *dcb);
+
 /**
  * Function to analyse error return from epoll_ctl
  */
@@ -207,20 +346,54 @@ poll_init()
 {
     int i;
 
-    if (epoll_fd != -1)
+    if (epoll_fds != NULL)
     {
         return;
     }
-    if ((epoll_fd = epoll_create(MAX_EVENTS)) == -1)
+    n_threads = config_threadcount();
+    poll_affinity = config_poll_affinity();
+    poll_init_groups();
+    n_pollqs = poll_affinity ? n_threads : 1;
+    poll_steal = poll_affinity && n_pollqs > 1 && config_poll_work_stealing();
+
+    if ((epoll_fds = (int *)malloc(n_pollqs * sizeof(int))) == NULL ||
+        (pollqs = (POLL_QUEUE *)calloc(n_pollqs, sizeof(POLL_QUEUE))) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+    for (i = 0; i < n_pollqs; i++)
+    {
+        if ((epoll_fds[i] = epoll_create(MAX_EVENTS)) == -1)
+        {
+            perror("epoll_create");
+            exit(-1);
+        }
+        pollqs[i].head = NULL;
+        pollqs[i].pending = 0;
+        spinlock_init_named(&pollqs[i].lock, "poll event queue");
+    }
+    if ((timer_wheels = (TIMER_WHEEL *)malloc(n_threads * sizeof(TIMER_WHEEL))) == NULL)
     {
-        perror("epoll_create");
+        perror("Fatal error: Memory allocation failed.");
         exit(-1);
     }
+    for (i = 0; i < n_threads; i++)
+    {
+        timer_wheel_init(&timer_wheels[i], hkheartbeat);
+    }
     memset(&pollStats, 0, sizeof(pollStats));
     memset(&queueStats, 0, sizeof(queueStats));
+    if ((histograms = (POLL_HISTOGRAMS *)calloc(n_threads, sizeof(POLL_HISTOGRAMS))) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+    poll_calibrate_cycles();
+    poll_init_affinity();
+    epoch_init(n_threads);
     bitmask_init(&poll_mask);
-    n_threads = config_threadcount();
-    if ((thread_data = (THREAD_DATA *)malloc(n_threads * sizeof(THREAD_DATA))) != NULL)
+    if ((thread_data = (THREAD_DATA *)calloc(n_threads, sizeof(THREAD_DATA))) != NULL)
     {
         for (i = 0; i < n_threads; i++)
         {
@@ -237,7 +410,10 @@ poll_init()
         (pollStats.n_pollev = ts_stats_alloc()) == NULL ||
         (pollStats.n_nbpollev = ts_stats_alloc()) == NULL ||
         (pollStats.n_nothreads = ts_stats_alloc()) == NULL ||
-        (pollStats.blockingpolls = ts_stats_alloc()) == NULL)
+        (pollStats.blockingpolls = ts_stats_alloc()) == NULL ||
+        (pollStats.n_steals = ts_stats_alloc()) == NULL ||
+        (pollStats.qdelay = ts_histogram_alloc()) == NULL ||
+        (pollStats.exectime = ts_histogram_alloc()) == NULL)
     {
         perror("Fatal error: Memory allocation failed.");
         exit(-1);
@@ -263,11 +439,173 @@ poll_init()
     number_poll_spins = config_nbpolls();
     max_poll_sleep = config_pollsleep();
 
+    if (config_poll_adaptive() &&
+        (poll_adapt = (POLL_ADAPT *)calloc(n_threads, sizeof(POLL_ADAPT))) != NULL)
+    {
+        for (i = 0; i < n_threads; i++)
+        {
+            poll_adapt[i].window = hkheartbeat;
+            poll_adapt[i].spins = number_poll_spins;
+            poll_adapt[i].sleep = max_poll_sleep;
+        }
+    }
+
 #if PROFILE_POLL
     plog = memlog_create("EventQueueWaitTime", ML_LONG, 10000);
 #endif
 }
 
+/**
+ * Divide the polling threads into the default group and the named thread
+ * groups. The threads of the default group come first so that the main
+ * thread, which is polling thread 0, is always in the default group.
+ */
+static void
+poll_init_groups()
+{
+    int n_groups = config_thread_group_count();
+    int i, next;
+
+    if (n_groups > 0 && !poll_affinity)
+    {
+        MXS_NOTICE("Polling thread affinity is enabled for the thread groups.");
+        poll_affinity = true;
+    }
+    n_poll_groups = n_groups + 1;
+
+    if ((poll_groups = (POLL_GROUP *)calloc(n_poll_groups, sizeof(POLL_GROUP))) == NULL ||
+        (thread_groups = (int *)calloc(n_threads, sizeof(int))) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+
+    poll_groups[0].n = n_threads;
+    for (i = 1; i < n_poll_groups; i++)
+    {
+        poll_groups[i].n = config_thread_group(i)->n_threads;
+        poll_groups[0].n -= poll_groups[i].n;
+    }
+    for (i = 0, next = 0; i < n_poll_groups; i++)
+    {
+        poll_groups[i].first = next;
+        for (int j = 0; j < poll_groups[i].n; j++)
+        {
+            thread_groups[next++] = i;
+        }
+        if (i > 0)
+        {
+            MXS_NOTICE("Thread group '%s' has polling threads %d to %d.",
+                       config_thread_group(i)->name, poll_groups[i].first, next - 1);
+        }
+    }
+}
+
+/**
+ * Decide the CPUs each polling thread runs on. With threads_affinity each
+ * thread is bound to one CPU of the list, with numa_nodes the threads are
+ * spread evenly over the nodes and bound to the CPUs of their node. If only
+ * the other threads are bound to CPUs, the polling threads keep the affinity
+ * the process started with instead of inheriting the affinity of the threads
+ * that created them.
+ */
+static void
+poll_init_affinity()
+{
+    const char *cpulist = config_threads_affinity();
+    const char *nodelist = config_numa_nodes();
+    bool bind = cpulist || nodelist || config_auxiliary_threads_affinity();
+    int n_default = poll_groups[0].n;
+    cpu_set_t process_set;
+    cpu_set_t set;
+    int ids[CPU_SETSIZE];
+    int n_ids = 0;
+    int i;
+
+    for (i = 1; i < n_poll_groups; i++)
+    {
+        bind = bind || config_thread_group(i)->cpus;
+    }
+    if (!bind)
+    {
+        return;
+    }
+    if ((thread_cpus = (cpu_set_t *)calloc(n_threads, sizeof(cpu_set_t))) == NULL)
+    {
+        perror("Fatal error: Memory allocation failed.");
+        exit(-1);
+    }
+    if (cpulist && nodelist)
+    {
+        MXS_WARNING("Both 'threads_affinity' and 'numa_nodes' are defined, "
+                    "'numa_nodes' is ignored.");
+        nodelist = NULL;
+    }
+
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &process_set) != 0)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to get the CPU affinity of the process, the polling "
+                  "threads are not bound to CPUs: %d, %s",
+                  errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        free(thread_cpus);
+        thread_cpus = NULL;
+        return;
+    }
+    if (thread_parse_cpulist(cpulist ? cpulist : nodelist ? nodelist : "", &set))
+    {
+        for (i = 0; i < CPU_SETSIZE; i++)
+        {
+            if (CPU_ISSET(i, &set))
+            {
+                ids[n_ids++] = i;
+            }
+        }
+    }
+
+    /** threads_affinity and numa_nodes apply to the default group */
+    for (i = 0; i < n_default; i++)
+    {
+        if (cpulist && n_ids)
+        {
+            CPU_ZERO(&thread_cpus[i]);
+            CPU_SET(ids[i % n_ids], &thread_cpus[i]);
+        }
+        else if (nodelist && n_ids)
+        {
+            int node = ids[i * n_ids / n_default];
+
+            if (!thread_numa_node_cpus(node, &thread_cpus[i]))
+            {
+                MXS_ERROR("Failed to find the CPUs of NUMA node %d, the polling "
+                          "threads are not bound to CPUs.", node);
+                free(thread_cpus);
+                thread_cpus = NULL;
+                return;
+            }
+        }
+        else
+        {
+            thread_cpus[i] = process_set;
+        }
+    }
+
+    /** The threads of a named group share the CPUs of the group */
+    for (int group = 1; group < n_poll_groups; group++)
+    {
+        const char *cpus = config_thread_group(group)->cpus;
+
+        if (cpus == NULL || !thread_parse_cpulist(cpus, &set))
+        {
+            set = process_set;
+        }
+        for (i = poll_groups[group].first; i < poll_groups[group].first + poll_groups[group].n; i++)
+        {
+            thread_cpus[i] = set;
+        }
+    }
+}
+
 /**
  * Add a DCB to the set of descriptors within the polling
  * environment.
@@ -334,11 +672,59 @@ poll_add_dcb(DCB *dcb)
      * The only possible failure that will not cause a crash is
      * running out of system resources.
      */
-    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dcb->fd, &ev);
-    if (rc)
+    if (poll_affinity && dcb->dcb_role == DCB_ROLE_SERVICE_LISTENER)
+    {
+        /**
+         * Listeners are not owned by any thread, they are added to the
+         * epoll set of every thread of their group so that all of them
+         * accept connections.
+         */
+        POLL_GROUP *group = &poll_groups[poll_dcb_group(dcb)];
+        int i;
+
+        if (dcb->listener && dcb->listener->exclusive_accept)
+        {
+            /**
+             * Only one of the threads is woken up for a new connection
+             * instead of all the threads racing to accept it.
+             */
+            ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+        }
+
+        rc = 0;
+        for (i = group->first; i < group->first + group->n; i++)
+        {
+            if (epoll_ctl(epoll_fds[i], EPOLL_CTL_ADD, dcb->fd, &ev) == 0)
+            {
+                continue;
+            }
+            if (group->first == i && EINVAL == errno && (ev.events & EPOLLEXCLUSIVE))
+            {
+                MXS_WARNING("EPOLLEXCLUSIVE is not supported by the kernel, all polling "
+                            "threads are woken up for new connections to port %d.",
+                            dcb->listener->port);
+                ev.events &= ~EPOLLEXCLUSIVE;
+                i--;
+            }
+            else if ((rc = poll_resolve_error(dcb, errno, true)))
+            {
+                break;
+            }
+        }
+        while (rc && i-- > group->first)
+        {
+            epoll_ctl(epoll_fds[i], EPOLL_CTL_DEL, dcb->fd, &ev);
+        }
+    }
+    else
     {
-        /* Some errors are actually considered acceptable */
-        rc = poll_resolve_error(dcb, errno, true);
+        poll_dcb_set_owner(dcb);
+        rc = epoll_ctl(epoll_fds[poll_dcb_queue_index(dcb)], EPOLL_CTL_ADD, dcb->fd, &ev);
+        if (rc)
+        {
+            /* Some errors are actually considered acceptable */
+            rc = poll_resolve_error(dcb, errno, true);
+        }
     }
     if (0 == rc)
     {
@@ -401,15 +787,29 @@ poll_remove_dcb(DCB *dcb)
     spinlock_release(&dcb->dcb_initlock);
     if (dcbfd > 0)
     {
-        rc = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dcbfd, &ev);
-        /**
-         * The poll_resolve_error function will always
-         * return 0 or crash.  So if it returns non-zero result,
-         * things have gone wrong and we crash.
-         */
-        if (rc)
+        int first = poll_dcb_queue_index(dcb);
+        int last = first + 1;
+        int i;
+
+        if (poll_affinity && dcb->dcb_role == DCB_ROLE_SERVICE_LISTENER)
         {
-            rc = poll_resolve_error(dcb, errno, false);
+            POLL_GROUP *group = &poll_groups[poll_dcb_group(dcb)];
+
+            first = group->first;
+            last = group->first + group->n;
+        }
+        for (i = first, rc = 0; i < last && 0 == rc; i++)
+        {
+            rc = epoll_ctl(epoll_fds[i], EPOLL_CTL_DEL, dcbfd, &ev);
+            /**
+             * The poll_resolve_error function will always
+             * return 0 or crash.  So if it returns non-zero result,
+             * things have gone wrong and we crash.
+             */
+            if (rc)
+            {
+                rc = poll_resolve_error(dcb, errno, false);
+            }
         }
         if (rc)
         {
@@ -420,87 +820,270 @@ poll_remove_dcb(DCB *dcb)
 }
 
 /**
- * Check error returns from epoll_ctl. Most result in a crash since they
- * are "impossible". Adding when already present is assumed non-fatal.
- * Likewise, removing when not present is assumed non-fatal.
- * It is assumed that callers to poll routines can handle the failure
- * that results from hitting system limit, although an error is written
- * here to record the problem.
+ * Return the index of the epoll descriptor and the event queue used for a DCB.
  *
- * @param errornum      The errno set by epoll_ctl
- * @param adding        True for adding to poll list, false for removing
- * @return              -1 on error or 0 for possibly revised return code
+ * @param dcb   The DCB
+ * @return      Index into the epoll descriptor and event queue arrays
  */
-static int
-poll_resolve_error(DCB *dcb, int errornum, bool adding)
+static inline int
+poll_dcb_queue_index(DCB *dcb)
 {
-    if (adding)
+    if (dcb->evq.owner >= 0 && dcb->evq.owner < n_pollqs)
     {
-        if (EEXIST == errornum)
-        {
-            MXS_ERROR("%lu [poll_resolve_error] Error : epoll_ctl could not add, "
-                      "already exists for DCB %p.",
-                      pthread_self(),
-                      dcb);
-            // Assume another thread added and no serious harm done
-            return 0;
-        }
-        if (ENOSPC == errornum)
-        {
-            MXS_ERROR("%lu [poll_resolve_error] The limit imposed by "
-                      "/proc/sys/fs/epoll/max_user_watches was "
-                      "encountered while trying to register (EPOLL_CTL_ADD) a new "
-                      "file descriptor on an epoll instance for dcb %p.",
-                      pthread_self(),
-                      dcb);
-            /* Failure - assume handled by callers */
-            return -1;
-        }
+        return dcb->evq.owner;
     }
-    else
+    /** The queued events of a listener go to the first thread of its group */
+    if (n_poll_groups > 1 && dcb->dcb_role == DCB_ROLE_SERVICE_LISTENER)
     {
-        /* Must be removing */
-        if (ENOENT == errornum)
-        {
-            MXS_ERROR("%lu [poll_resolve_error] Error : epoll_ctl could not remove, "
-                      "not found, for dcb %p.",
-                      pthread_self(),
-                      dcb);
-            // Assume another thread removed and no serious harm done
-            return 0;
-        }
+        return poll_groups[poll_dcb_group(dcb)].first;
     }
-    /* Common checks for add or remove - crash MaxScale */
-    if (EBADF == errornum)
+    return 0;
+}
+
+/**
+ * Return the polling thread group of a DCB. Listeners and client DCBs use the
+ * group of their listener, the other DCBs the group of their service.
+ *
+ * @param dcb   The DCB
+ * @return      The thread group, 0 for the default group
+ */
+static int
+poll_dcb_group(DCB *dcb)
+{
+    SERVICE *service = dcb->service;
+    int group = 0;
+
+    if (service == NULL && dcb->session && dcb->session->state != SESSION_STATE_DUMMY)
     {
-        raise(SIGABRT);
+        service = dcb->session->service;
     }
-    if (EINVAL == errornum)
+    if (dcb->listener && dcb->listener->thread_group >= 0)
     {
-        raise(SIGABRT);
+        group = dcb->listener->thread_group;
     }
-    if (ENOMEM == errornum)
+    else if (service)
     {
-        raise(SIGABRT);
+        group = service->thread_group;
     }
-    if (EPERM == errornum)
+    return group < n_poll_groups ? group : 0;
+}
+
+/**
+ * Assign an owning polling thread to a DCB if polling thread affinity is
+ * enabled and the DCB does not yet have one. Backend DCBs are owned by the
+ * thread that owns the client DCB of the session so that all the DCBs of a
+ * session are processed by the same thread. Other DCBs are owned by the thread
+ * that creates them if it is in the thread group of the DCB, otherwise the
+ * threads of the group are assigned in a round-robin fashion.
+ *
+ * @param dcb   The DCB to assign an owner to
+ */
+void
+poll_dcb_set_owner(DCB *dcb)
+{
+    if (poll_affinity && dcb->evq.owner < 0)
     {
-        raise(SIGABRT);
+        DCB *client = dcb->session ? dcb->session->client_dcb : NULL;
+        int group = poll_dcb_group(dcb);
+
+        if (client && client != dcb && client->evq.owner >= 0)
+        {
+            dcb->evq.owner = client->evq.owner;
+        }
+        else if (current_poll_thread >= 0 && thread_groups[current_poll_thread] == group)
+        {
+            dcb->evq.owner = current_poll_thread;
+        }
+        else
+        {
+            dcb->evq.owner = poll_groups[group].first +
+                (unsigned int)atomic_add(&next_owner, 1) % poll_groups[group].n;
+        }
     }
-    /* Undocumented error number */
-    raise(SIGABRT);
-    /* The following statement should never be reached, but avoids compiler warning */
-    return -1;
 }
 
-#define BLOCKINGPOLL 0  /*< Set BLOCKING POLL to 1 if using a single thread and to make
-                         *  debugging easier.
-                         */
-
 /**
- * The main polling loop
+ * Return the timer wheel to use for the timers of a DCB. With polling thread
+ * affinity this is the wheel of the thread that owns the DCB, otherwise it is
+ * the wheel of the calling thread. Outside of the polling threads the wheel
+ * of the first polling thread is used.
  *
- * This routine does the polling and despatches of IO events
+ * @param dcb   The DCB the timer is for or NULL
+ * @return      The timer wheel
+ */
+TIMER_WHEEL *
+poll_timer_wheel(DCB *dcb)
+{
+    if (poll_affinity && dcb && dcb->evq.owner >= 0)
+    {
+        return &timer_wheels[dcb->evq.owner];
+    }
+    return &timer_wheels[current_poll_thread >= 0 ? current_poll_thread : 0];
+}
+
+/**
+ * Check whether a DCB belongs to the same polling thread as another one. This
+ * is always the case unless polling thread affinity is enabled, in which case
+ * the owners of the DCBs must match. A DCB without an owner matches any DCB.
+ *
+ * @param dcb   The DCB to check
+ * @param other The DCB it is compared to or NULL for the calling thread
+ * @return      True if the DCB belongs to the thread of the other one
+ */
+bool
+poll_dcb_same_owner(DCB *dcb, DCB *other)
+{
+    return !poll_affinity || dcb->evq.owner < 0 || dcb->evq.owner == poll_dcb_thread(other);
+}
+
+/**
+ * Return the polling thread a DCB belongs to. With polling thread affinity
+ * this is the owner of the DCB, otherwise, or if the DCB is NULL, it is the
+ * calling thread. Outside of the polling threads the first thread is used.
+ *
+ * @param dcb   The DCB or NULL
+ * @return      The ID of the polling thread
+ */
+int
+poll_dcb_thread(DCB *dcb)
+{
+    if (poll_affinity && dcb && dcb->evq.owner >= 0)
+    {
+        return dcb->evq.owner;
+    }
+    return current_poll_thread >= 0 ? current_poll_thread : 0;
+}
+
+/**
+ * Return the ID of the calling polling thread
+ *
+ * @return      The ID of the polling thread or -1 if the caller is not a
+ *              polling thread
+ */
+int
+poll_current_thread()
+{
+    return current_poll_thread;
+}
+
+/**
+ * Return the measured frequency of the time-stamp counter
+ *
+ * @return Time-stamp counter cycles per microsecond
+ */
+double
+poll_cycles_per_usec()
+{
+    return cycles_per_usec;
+}
+
+/**
+ * Add the bytes a polling thread has moved to its statistics. The calls made
+ * by other threads are ignored.
+ *
+ * @param bytes_in      Bytes read from a socket
+ * @param bytes_out     Bytes written to a socket
+ */
+void
+poll_thread_io(int bytes_in, int bytes_out)
+{
+    if (current_poll_thread >= 0 && thread_data)
+    {
+        THREAD_DATA *data = &thread_data[current_poll_thread];
+
+        if (bytes_in > 0)
+        {
+            data->bytes_in += bytes_in;
+        }
+        if (bytes_out > 0)
+        {
+            data->bytes_out += bytes_out;
+        }
+    }
+}
+
+/**
+ * Check error returns from epoll_ctl. Most result in a crash since they
+ * are "impossible". Adding when already present is assumed non-fatal.
+ * Likewise, removing when not present is assumed non-fatal.
+ * It is assumed that callers to poll routines can handle the failure
+ * that results from hitting system limit, although an error is written
+ * here to record the problem.
+ *
+ * @param errornum      The errno set by epoll_ctl
+ * @param adding        True for adding to poll list, false for removing
+ * @return              -1 on error or 0 for possibly revised return code
+ */
+static int
+poll_resolve_error(DCB *dcb, int errornum, bool adding)
+{
+    if (adding)
+    {
+        if (EEXIST == errornum)
+        {
+            MXS_ERROR("%lu [poll_resolve_error] Error : epoll_ctl could not add, "
+                      "already exists for DCB %p.",
+                      pthread_self(),
+                      dcb);
+            // Assume another thread added and no serious harm done
+            return 0;
+        }
+        if (ENOSPC == errornum)
+        {
+            MXS_ERROR("%lu [poll_resolve_error] The limit imposed by "
+                      "/proc/sys/fs/epoll/max_user_watches was "
+                      "encountered while trying to register (EPOLL_CTL_ADD) a new "
+                      "file descriptor on an epoll instance for dcb %p.",
+                      pthread_self(),
+                      dcb);
+            /* Failure - assume handled by callers */
+            return -1;
+        }
+    }
+    else
+    {
+        /* Must be removing */
+        if (ENOENT == errornum)
+        {
+            MXS_ERROR("%lu [poll_resolve_error] Error : epoll_ctl could not remove, "
+                      "not found, for dcb %p.",
+                      pthread_self(),
+                      dcb);
+            // Assume another thread removed and no serious harm done
+            return 0;
+        }
+    }
+    /* Common checks for add or remove - crash MaxScale */
+    if (EBADF == errornum)
+    {
+        raise(SIGABRT);
+    }
+    if (EINVAL == errornum)
+    {
+        raise(SIGABRT);
+    }
+    if (ENOMEM == errornum)
+    {
+        raise(SIGABRT);
+    }
+    if (EPERM == errornum)
+    {
+        raise(SIGABRT);
+    }
+    /* Undocumented error number */
+    raise(SIGABRT);
+    /* The following statement should never be reached, but avoids compiler warning */
+    return -1;
+}
+
+#define BLOCKINGPOLL 0  /*< Set BLOCKING POLL to 1 if using a single thread and to make
+                         *  debugging easier.
+                         */
+
+/**
+ * The main polling loop
+ *
+ * This routine does the polling and despatches of IO events
  * to the DCB's. It may be called either directly or as the entry point
  * of a polling thread within the gateway.
  *
@@ -546,6 +1129,10 @@ poll_resolve_error(DCB *dcb, int errornum, bool adding)
  * point there is an event to be processed then the value will be reduced to 10% again
  * for the next blocking call.
  *
+ * With adaptive_polling the number of non-blocking polls and the longest
+ * blocking timeout are decided by the controller of the thread, see
+ * POLL_ADAPT, instead of non_blocking_polls and poll_sleep.
+ *
  * @param arg   The thread ID passed as a void * to satisfy the threading package
  */
 void
@@ -555,8 +1142,26 @@ poll_waitevents(void *arg)
     int i, nfds, timeout_bias = 1;
     intptr_t thread_id = (intptr_t)arg;
     int poll_spins = 0;
+    int epoll_fd = epoll_fds[poll_affinity ? thread_id : 0];
+    POLL_QUEUE *queue = &pollqs[poll_affinity ? thread_id : 0];
+    POLL_ADAPT *adapt = poll_adapt ? &poll_adapt[thread_id] : NULL;
+    int spins = number_poll_spins;
+    int sleep = max_poll_sleep;
 
     ts_stats_set_thread_id(thread_id);
+    current_poll_thread = thread_id;
+    random_jkiss_init();
+
+    if (thread_cpus && !thread_set_cpus(&thread_cpus[thread_id]))
+    {
+        MXS_ERROR("Failed to set the CPU affinity of polling thread %d.", (int)thread_id);
+    }
+
+    if (thread_data)
+    {
+        thread_data[thread_id].has_cpu_clock =
+            pthread_getcpuclockid(pthread_self(), &thread_data[thread_id].cpu_clock) == 0;
+    }
 
     /** Add this thread to the bitmask of running polling threads */
     bitmask_set(&poll_mask, thread_id);
@@ -567,11 +1172,21 @@ poll_waitevents(void *arg)
 
     while (1)
     {
-        if (pollStats.evq_pending == 0 && timeout_bias < 10)
+        if (queue->pending == 0 && timeout_bias < 10)
         {
             timeout_bias++;
         }
 
+        if (adapt)
+        {
+            if (adapt->window != hkheartbeat)
+            {
+                poll_adapt_update(adapt);
+            }
+            spins = adapt->spins;
+            sleep = adapt->sleep;
+        }
+
         atomic_add(&n_waiting, 1);
 #if BLOCKINGPOLL
         nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
@@ -586,7 +1201,14 @@ poll_waitevents(void *arg)
         }
 
         ts_stats_add(pollStats.n_polls, 1);
-        if ((nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 0)) == -1)
+        nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 0);
+        if (adapt && nfds >= 0)
+        {
+            adapt->spin_polls++;
+            adapt->spin_hits += nfds > 0;
+        }
+
+        if (nfds == -1)
         {
             atomic_add(&n_waiting, -1);
             int eno = errno;
@@ -606,14 +1228,15 @@ poll_waitevents(void *arg)
          * We calculate a timeout bias to alter the length of the blocking
          * call based on the time since we last received an event to process
          */
-        else if (nfds == 0 && pollStats.evq_pending == 0 && poll_spins++ > number_poll_spins)
+        else if (nfds == 0 && queue->pending == 0 && poll_spins++ > spins &&
+                 !(poll_steal && poll_find_victim(thread_id)))
         {
             ts_stats_add(pollStats.blockingpolls, 1);
             nfds = epoll_wait(epoll_fd,
                               events,
                               MAX_EVENTS,
-                              (max_poll_sleep * timeout_bias) / 10);
-            if (nfds == 0 && pollStats.evq_pending)
+                              (sleep * timeout_bias) / 10);
+            if (nfds == 0 && queue->pending)
             {
                 atomic_add(&pollStats.wake_evqpending, 1);
                 poll_spins = 0;
@@ -635,10 +1258,14 @@ poll_waitevents(void *arg)
         if (nfds > 0)
         {
             timeout_bias = 1;
-            if (poll_spins <= number_poll_spins + 1)
+            if (poll_spins <= spins + 1)
             {
                 ts_stats_add(pollStats.n_nbpollev, 1);
             }
+            if (adapt)
+            {
+                adapt->events += nfds;
+            }
             poll_spins = 0;
             MXS_DEBUG("%lu [poll_waitevents] epoll_wait found %d fds",
                       pthread_self(),
@@ -653,6 +1280,7 @@ poll_waitevents(void *arg)
             }
 
             pollStats.n_fds[(nfds < MAXNFDS ? (nfds - 1) : MAXNFDS - 1)]++;
+            poll_record_wakeup(thread_id, nfds);
 
             load_average = (load_average * load_samples + nfds) / (load_samples + 1);
             atomic_add(&load_samples, 1);
@@ -667,47 +1295,27 @@ poll_waitevents(void *arg)
              * If the DCB was not already in the queue then it was
              * idle and is added to the queue to process after
              * setting the event bits.
+             *
+             * With polling thread affinity the listeners are in the
+             * epoll set of every thread. Their events are processed
+             * immediately by the thread that received them instead of
+             * being queued.
              */
             for (i = 0; i < nfds; i++)
             {
                 DCB *dcb = (DCB *)events[i].data.ptr;
                 __uint32_t ev = events[i].events;
 
-                spinlock_acquire(&pollqlock);
-                if (DCB_POLL_BUSY(dcb))
-                {
-                    if (dcb->evq.pending_events == 0)
-                    {
-                        pollStats.evq_pending++;
-                        dcb->evq.inserted = hkheartbeat;
-                    }
-                    dcb->evq.pending_events |= ev;
-                }
-                else
+                if (poll_affinity && dcb->dcb_role == DCB_ROLE_SERVICE_LISTENER)
                 {
-                    dcb->evq.pending_events = ev;
-                    if (eventq)
-                    {
-                        dcb->evq.prev = eventq->evq.prev;
-                        eventq->evq.prev->evq.next = dcb;
-                        eventq->evq.prev = dcb;
-                        dcb->evq.next = eventq;
-                    }
-                    else
-                    {
-                        eventq = dcb;
-                        dcb->evq.prev = dcb;
-                        dcb->evq.next = dcb;
-                    }
-                    pollStats.evq_length++;
-                    pollStats.evq_pending++;
-                    dcb->evq.inserted = hkheartbeat;
-                    if (pollStats.evq_length > pollStats.evq_max)
-                    {
-                        pollStats.evq_max = pollStats.evq_length;
-                    }
+                    process_dcb_events(dcb, ev, thread_id);
+                    mxs_log_tls.li_sesid = 0;
+                    continue;
                 }
-                spinlock_release(&pollqlock);
+
+                spinlock_acquire(&queue->lock);
+                poll_queue_events(queue, dcb, ev);
+                spinlock_release(&queue->lock);
             }
         }
 
@@ -722,19 +1330,19 @@ poll_waitevents(void *arg)
             timeout_bias = 1;
         }
 
-        if (check_timeouts && hkheartbeat >= next_timeout_check)
-        {
-            process_idle_sessions();
-        }
+        timer_wheel_run(&timer_wheels[thread_id], hkheartbeat);
 
         if (thread_data)
         {
+            CYCLES zombie_start = rdtsc();
             thread_data[thread_id].state = THREAD_ZPROCESSING;
+            epoch_quiescent(thread_id);
+            thread_data[thread_id].zombie_cycles += rdtsc() - zombie_start;
+            thread_data[thread_id].state = THREAD_IDLE;
         }
-        dcb_process_zombies(thread_id);
-        if (thread_data)
+        else
         {
-            thread_data[thread_id].state = THREAD_IDLE;
+            epoch_quiescent(thread_id);
         }
 
         if (do_shutdown)
@@ -807,22 +1415,29 @@ poll_set_maxwait(unsigned int maxwait)
  * @param thread_id     The thread ID of the calling thread
  * @return              0 if no DCB's have been processed
  */
-static int
-process_pollq(int thread_id)
+/**
+ * Take the first DCB that is not already being processed from an event queue.
+ * The DCB is marked as being processed and its pending events are moved to
+ * the processing events. The DCB remains in the queue while it is processed.
+ *
+ * @param queue The event queue
+ * @param ev    Pointer where the events to process are stored
+ * @return      The DCB to process or NULL if there is nothing to process
+ */
+static DCB *
+poll_queue_take(POLL_QUEUE *queue, uint32_t *ev)
 {
     DCB *dcb;
     int found = 0;
-    uint32_t ev;
-    unsigned long qtime;
 
-    spinlock_acquire(&pollqlock);
-    if (eventq == NULL)
+    spinlock_acquire(&queue->lock);
+    if (queue->head == NULL)
     {
         /* Nothing to process */
-        spinlock_release(&pollqlock);
-        return 0;
+        spinlock_release(&queue->lock);
+        return NULL;
     }
-    dcb = eventq;
+    dcb = queue->head;
     if (dcb->evq.next == dcb->evq.prev && dcb->evq.processing == 0)
     {
         found = 1;
@@ -831,8 +1446,8 @@ process_pollq(int thread_id)
     else if (dcb->evq.next == dcb->evq.prev)
     {
         /* Only item in queue is being processed */
-        spinlock_release(&pollqlock);
-        return 0;
+        spinlock_release(&queue->lock);
+        return NULL;
     }
     else
     {
@@ -840,7 +1455,7 @@ process_pollq(int thread_id)
         {
             dcb = dcb->evq.next;
         }
-        while (dcb != eventq && dcb->evq.processing == 1);
+        while (dcb != queue->head && dcb->evq.processing == 1);
 
         if (dcb->evq.processing == 0)
         {
@@ -851,17 +1466,69 @@ process_pollq(int thread_id)
     }
     if (found)
     {
-        ev = dcb->evq.pending_events;
-        dcb->evq.processing_events = ev;
+        *ev = dcb->evq.pending_events;
+        dcb->evq.processing_events = *ev;
         dcb->evq.pending_events = 0;
-        pollStats.evq_pending--;
-        ss_dassert(pollStats.evq_pending >= 0);
+        queue->pending--;
+        atomic_add(&pollStats.evq_pending, -1);
+        ss_dassert(queue->pending >= 0);
     }
-    spinlock_release(&pollqlock);
+    spinlock_release(&queue->lock);
+
+    return found ? dcb : NULL;
+}
+
+/**
+ * Check whether another thread has enough pending work in its event queue
+ * for the calling thread to steal some of it.
+ *
+ * @param thread_id     The thread ID of the calling thread
+ * @return              The event queue to steal from or NULL if there is none
+ */
+static POLL_QUEUE *
+poll_find_victim(int thread_id)
+{
+    /** Work is only stolen within a thread group */
+    POLL_GROUP *group = &poll_groups[thread_groups[thread_id]];
+    int i;
 
-    if (found == 0)
+    for (i = 1; i < group->n; i++)
     {
-        return 0;
+        POLL_QUEUE *queue = &pollqs[group->first + (thread_id - group->first + i) % group->n];
+
+        if (queue->pending >= POLL_STEAL_THRESHOLD)
+        {
+            return queue;
+        }
+    }
+    return NULL;
+}
+
+static int
+process_pollq(int thread_id)
+{
+    DCB *dcb;
+    uint32_t ev;
+    unsigned long qtime;
+    CYCLES started;
+    POLL_QUEUE *queue = &pollqs[poll_affinity ? thread_id : 0];
+
+    if ((dcb = poll_queue_take(queue, &ev)) == NULL)
+    {
+        POLL_QUEUE *victim;
+
+        /**
+         * Nothing to do in our own queue, steal a DCB from a busy thread.
+         * The DCB stays in the queue of its owner, the processing flag
+         * prevents the owner from processing it at the same time.
+         */
+        if (!poll_steal || (victim = poll_find_victim(thread_id)) == NULL ||
+            (dcb = poll_queue_take(victim, &ev)) == NULL)
+        {
+            return 0;
+        }
+        queue = victim;
+        ts_stats_add(pollStats.n_steals, 1);
     }
 
 #if PROFILE_POLL
@@ -869,6 +1536,8 @@ process_pollq(int thread_id)
 #endif
     qtime = hkheartbeat - dcb->evq.inserted;
     dcb->evq.started = hkheartbeat;
+    started = rdtsc();
+    poll_record_latency(pollStats.qdelay, started - dcb->evq.queued);
 
     if (qtime > N_QUEUE_TIMES)
     {
@@ -883,51 +1552,153 @@ process_pollq(int thread_id)
         queueStats.maxqtime = qtime;
     }
 
+    /** The writes made while the events are processed are flushed together */
+    dcb_defer_writes();
+    MXS_PROBE3(poll__dispatch__start, thread_id, dcb, ev);
+    bool processed = process_dcb_events(dcb, ev, thread_id);
+    MXS_PROBE3(poll__dispatch__end, thread_id, dcb, processed);
+    dcb_flush_writes();
+
+    if (!processed)
+    {
+        return 0;
+    }
+
+    CYCLES elapsed = rdtsc() - started;
+    poll_record_latency(pollStats.exectime, elapsed);
 
-    CHK_DCB(dcb);
     if (thread_data)
     {
-        thread_data[thread_id].state = THREAD_PROCESSING;
-        thread_data[thread_id].cur_dcb = dcb;
-        thread_data[thread_id].event = ev;
+        thread_data[thread_id].dispatch_cycles += elapsed;
+        thread_data[thread_id].n_events++;
     }
+    qtime = hkheartbeat - dcb->evq.started;
 
-#if defined(FAKE_CODE)
-    if (dcb_fake_write_ev[dcb->fd] != 0)
+    if (qtime > N_QUEUE_TIMES)
     {
-        MXS_DEBUG("%lu [poll_waitevents] "
-                  "Added fake events %d to ev %d.",
-                  pthread_self(),
-                  dcb_fake_write_ev[dcb->fd],
-                  ev);
-        ev |= dcb_fake_write_ev[dcb->fd];
-        dcb_fake_write_ev[dcb->fd] = 0;
+        queueStats.exectimes[N_QUEUE_TIMES]++;
     }
-#endif /* FAKE_CODE */
-    ss_debug(spinlock_acquire(&dcb->dcb_initlock));
-    ss_dassert(dcb->state != DCB_STATE_ALLOC);
-    /* It isn't obvious that this is impossible */
-    /* ss_dassert(dcb->state != DCB_STATE_DISCONNECTED); */
-    if (DCB_STATE_DISCONNECTED == dcb->state)
+    else
     {
-        return 0;
+        queueStats.exectimes[qtime % N_QUEUE_TIMES]++;
+    }
+    if (qtime > queueStats.maxexectime)
+    {
+        queueStats.maxexectime = qtime;
     }
-    ss_debug(spinlock_release(&dcb->dcb_initlock));
 
-    MXS_DEBUG("%lu [poll_waitevents] event %d dcb %p "
-              "role %s",
-              pthread_self(),
-              ev,
-              dcb,
-              STRDCBROLE(dcb->dcb_role));
+    spinlock_acquire(&queue->lock);
+    dcb->evq.processing_events = 0;
 
-    if (ev & EPOLLOUT)
+    if (dcb->evq.pending_events == 0)
     {
-        int eno = 0;
-        eno = gw_getsockerrno(dcb->fd);
-
-        if (eno == 0)
-        {
+        /* No pending events so remove from the queue */
+        if (dcb->evq.prev != dcb)
+        {
+            dcb->evq.prev->evq.next = dcb->evq.next;
+            dcb->evq.next->evq.prev = dcb->evq.prev;
+            if (queue->head == dcb)
+            {
+                queue->head = dcb->evq.next;
+            }
+        }
+        else
+        {
+            queue->head = NULL;
+        }
+        dcb->evq.next = NULL;
+        dcb->evq.prev = NULL;
+        atomic_add(&pollStats.evq_length, -1);
+    }
+    else
+    {
+        /*
+         * We have a pending event, move to the end of the queue
+         * if there are any other DCB's in the queue.
+         *
+         * If we are the first item on the queue this is easy, we
+         * just bump the head of the queue.
+         */
+        if (dcb->evq.prev != dcb)
+        {
+            if (queue->head == dcb)
+            {
+                queue->head = dcb->evq.next;
+            }
+            else
+            {
+                dcb->evq.prev->evq.next = dcb->evq.next;
+                dcb->evq.next->evq.prev = dcb->evq.prev;
+                dcb->evq.prev = queue->head->evq.prev;
+                dcb->evq.next = queue->head;
+                queue->head->evq.prev = dcb;
+                dcb->evq.prev->evq.next = dcb;
+            }
+        }
+    }
+    dcb->evq.processing = 0;
+    /** Reset session id from thread's local storage */
+    mxs_log_tls.li_sesid = 0;
+    spinlock_release(&queue->lock);
+
+    return 1;
+}
+
+/**
+ * Call the protocol entry points of a DCB for a set of events.
+ *
+ * @param dcb           The DCB with the events
+ * @param ev            The events to process
+ * @param thread_id     The thread ID of the calling thread
+ * @return              False if the DCB was disconnected and nothing was done
+ */
+static bool
+process_dcb_events(DCB *dcb, uint32_t ev, int thread_id)
+{
+    CHK_DCB(dcb);
+    if (thread_data)
+    {
+        thread_data[thread_id].state = THREAD_PROCESSING;
+        thread_data[thread_id].cur_dcb = dcb;
+        thread_data[thread_id].event = ev;
+    }
+
+#if defined(FAKE_CODE)
+    if (dcb_fake_write_ev[dcb->fd] != 0)
+    {
+        MXS_DEBUG("%lu [poll_waitevents] "
+                  "Added fake events %d to ev %d.",
+                  pthread_self(),
+                  dcb_fake_write_ev[dcb->fd],
+                  ev);
+        ev |= dcb_fake_write_ev[dcb->fd];
+        dcb_fake_write_ev[dcb->fd] = 0;
+    }
+#endif /* FAKE_CODE */
+    ss_debug(spinlock_acquire(&dcb->dcb_initlock));
+    ss_dassert(dcb->state != DCB_STATE_ALLOC);
+    /* It isn't obvious that this is impossible */
+    /* ss_dassert(dcb->state != DCB_STATE_DISCONNECTED); */
+    if (DCB_STATE_DISCONNECTED == dcb->state)
+    {
+        return false;
+    }
+    ss_debug(spinlock_release(&dcb->dcb_initlock));
+
+    MXS_DEBUG("%lu [poll_waitevents] event %d dcb %p "
+              "role %s",
+              pthread_self(),
+              ev,
+              dcb,
+              STRDCBROLE(dcb->dcb_role));
+
+    if (ev & EPOLLOUT)
+    {
+        int eno = 0;
+        eno = gw_getsockerrno(dcb->fd);
+
+        if (eno == 0)
+        {
             ts_stats_add(pollStats.n_write, 1);
             /** Read session id to thread's local storage */
             dcb_get_ses_log_info(dcb,
@@ -994,9 +1765,17 @@ process_pollq(int thread_id)
                                   dcb_accept_SSL(dcb) :
                                   dcb_connect_SSL(dcb);
                 }
-                if (1 == return_code)
+                /** The reads wait while the data has nowhere to go */
+                if (1 == return_code && !dcb_read_stalled(dcb))
                 {
-                    dcb->func.read(dcb);
+                    if (dcb->splice)
+                    {
+                        dcb_splice_read(dcb);
+                    }
+                    else
+                    {
+                        dcb->func.read(dcb);
+                    }
                 }
             }
         }
@@ -1110,76 +1889,8 @@ process_pollq(int thread_id)
         }
     }
 #endif
-    qtime = hkheartbeat - dcb->evq.started;
-
-    if (qtime > N_QUEUE_TIMES)
-    {
-        queueStats.exectimes[N_QUEUE_TIMES]++;
-    }
-    else
-    {
-        queueStats.exectimes[qtime % N_QUEUE_TIMES]++;
-    }
-    if (qtime > queueStats.maxexectime)
-    {
-        queueStats.maxexectime = qtime;
-    }
-
-    spinlock_acquire(&pollqlock);
-    dcb->evq.processing_events = 0;
 
-    if (dcb->evq.pending_events == 0)
-    {
-        /* No pending events so remove from the queue */
-        if (dcb->evq.prev != dcb)
-        {
-            dcb->evq.prev->evq.next = dcb->evq.next;
-            dcb->evq.next->evq.prev = dcb->evq.prev;
-            if (eventq == dcb)
-            {
-                eventq = dcb->evq.next;
-            }
-        }
-        else
-        {
-            eventq = NULL;
-        }
-        dcb->evq.next = NULL;
-        dcb->evq.prev = NULL;
-        pollStats.evq_length--;
-    }
-    else
-    {
-        /*
-         * We have a pending event, move to the end of the queue
-         * if there are any other DCB's in the queue.
-         *
-         * If we are the first item on the queue this is easy, we
-         * just bump the eventq pointer.
-         */
-        if (dcb->evq.prev != dcb)
-        {
-            if (eventq == dcb)
-            {
-                eventq = dcb->evq.next;
-            }
-            else
-            {
-                dcb->evq.prev->evq.next = dcb->evq.next;
-                dcb->evq.next->evq.prev = dcb->evq.prev;
-                dcb->evq.prev = eventq->evq.prev;
-                dcb->evq.next = eventq;
-                eventq->evq.prev = dcb;
-                dcb->evq.prev->evq.next = dcb;
-            }
-        }
-    }
-    dcb->evq.processing = 0;
-    /** Reset session id from thread's local storage */
-    mxs_log_tls.li_sesid = 0;
-    spinlock_release(&pollqlock);
-
-    return 1;
+    return true;
 }
 
 /**
@@ -1254,25 +1965,25 @@ dprintPollStats(DCB *dcb)
     int i;
 
     dcb_printf(dcb, "\nPoll Statistics.\n\n");
-    dcb_printf(dcb, "No. of epoll cycles:                           %d\n",
+    dcb_printf(dcb, "No. of epoll cycles:                           %" PRId64 "\n",
                ts_stats_sum(pollStats.n_polls));
-    dcb_printf(dcb, "No. of epoll cycles with wait:                         %d\n",
+    dcb_printf(dcb, "No. of epoll cycles with wait:                         %" PRId64 "\n",
                ts_stats_sum(pollStats.blockingpolls));
-    dcb_printf(dcb, "No. of epoll calls returning events:           %d\n",
+    dcb_printf(dcb, "No. of epoll calls returning events:           %" PRId64 "\n",
                ts_stats_sum(pollStats.n_pollev));
-    dcb_printf(dcb, "No. of non-blocking calls returning events:    %d\n",
+    dcb_printf(dcb, "No. of non-blocking calls returning events:    %" PRId64 "\n",
                ts_stats_sum(pollStats.n_nbpollev));
-    dcb_printf(dcb, "No. of read events:                            %d\n",
+    dcb_printf(dcb, "No. of read events:                            %" PRId64 "\n",
                ts_stats_sum(pollStats.n_read));
-    dcb_printf(dcb, "No. of write events:                           %d\n",
+    dcb_printf(dcb, "No. of write events:                           %" PRId64 "\n",
                ts_stats_sum(pollStats.n_write));
-    dcb_printf(dcb, "No. of error events:                           %d\n",
+    dcb_printf(dcb, "No. of error events:                           %" PRId64 "\n",
                ts_stats_sum(pollStats.n_error));
-    dcb_printf(dcb, "No. of hangup events:                          %d\n",
+    dcb_printf(dcb, "No. of hangup events:                          %" PRId64 "\n",
                ts_stats_sum(pollStats.n_hup));
-    dcb_printf(dcb, "No. of accept events:                          %d\n",
+    dcb_printf(dcb, "No. of accept events:                          %" PRId64 "\n",
                ts_stats_sum(pollStats.n_accept));
-    dcb_printf(dcb, "No. of times no threads polling:               %d\n",
+    dcb_printf(dcb, "No. of times no threads polling:               %" PRId64 "\n",
                ts_stats_sum(pollStats.n_nothreads));
     dcb_printf(dcb, "Current event queue length:                    %d\n",
                pollStats.evq_length);
@@ -1282,6 +1993,11 @@ dprintPollStats(DCB *dcb)
                pollStats.evq_pending);
     dcb_printf(dcb, "No. of wakeups with pending queue:             %d\n",
                pollStats.wake_evqpending);
+    if (poll_steal)
+    {
+        dcb_printf(dcb, "No. of DCBs stolen from other threads:         %" PRId64 "\n",
+                   ts_stats_sum(pollStats.n_steals));
+    }
 
     dcb_printf(dcb, "No of poll completions with descriptors\n");
     dcb_printf(dcb, "\tNo. of descriptors\tNo. of poll completions.\n");
@@ -1292,9 +2008,22 @@ dprintPollStats(DCB *dcb)
     dcb_printf(dcb, "\t>= %d\t\t\t%d\n", MAXNFDS,
                pollStats.n_fds[MAXNFDS - 1]);
 
+    if (poll_adapt)
+    {
+        dprintPollAdaptive(dcb);
+    }
+
+    if (histograms)
+    {
+        dprintPollHistograms(dcb);
+    }
+
 #if SPINLOCK_PROFILE
-    dcb_printf(dcb, "Event queue lock statistics:\n");
-    spinlock_stats(&pollqlock, spin_reporter, dcb);
+    for (i = 0; i < n_pollqs; i++)
+    {
+        dcb_printf(dcb, "Event queue %d lock statistics:\n", i);
+        spinlock_stats(&pollqs[i].lock, spin_reporter, dcb);
+    }
 #endif
 }
 
@@ -1357,6 +2086,37 @@ event_to_string(uint32_t event)
     return str;
 }
 
+/**
+ * Return the CPU time a polling thread has used
+ *
+ * @param thread_id     The polling thread
+ * @return The CPU time in seconds or 0 if the thread has not started
+ */
+static double
+poll_thread_cpu_time(int thread_id)
+{
+    struct timespec ts;
+
+    if (thread_data[thread_id].has_cpu_clock &&
+        clock_gettime(thread_data[thread_id].cpu_clock, &ts) == 0)
+    {
+        return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+    }
+    return 0.0;
+}
+
+/**
+ * Convert time-stamp counter cycles to seconds
+ *
+ * @param cycles        The cycles
+ * @return The seconds
+ */
+static double
+poll_cycles_to_seconds(CYCLES cycles)
+{
+    return cycles / cycles_per_usec / 1000000.0;
+}
+
 /**
  * Print the thread status for all the polling threads
  *
@@ -1419,6 +2179,18 @@ dShowThreads(DCB *dcb)
     dcb_printf(dcb, "15 Minute Average: %.2f, 5 Minute Average: %.2f, "
                "1 Minute Average: %.2f\n\n", qavg15, qavg5, qavg1);
 
+    if (n_poll_groups > 1)
+    {
+        dcb_printf(dcb, "Thread group %-16s threads %d to %d\n", "default",
+                   poll_groups[0].first, poll_groups[0].first + poll_groups[0].n - 1);
+        for (i = 1; i < n_poll_groups; i++)
+        {
+            dcb_printf(dcb, "Thread group %-16s threads %d to %d\n", config_thread_group(i)->name,
+                       poll_groups[i].first, poll_groups[i].first + poll_groups[i].n - 1);
+        }
+        dcb_printf(dcb, "\n");
+    }
+
     if (thread_data == NULL)
     {
         return;
@@ -1483,6 +2255,18 @@ dShowThreads(DCB *dcb)
             }
         }
     }
+
+    dcb_printf(dcb, "\n ID | CPU (s)  | Events     | Bytes In       | Bytes Out      | Dispatch (s) | Collect (s)\n");
+    dcb_printf(dcb, "----+----------+------------+----------------+----------------+--------------+------------\n");
+    for (i = 0; i < n_threads; i++)
+    {
+        THREAD_DATA *data = &thread_data[i];
+
+        dcb_printf(dcb, " %2d | %8.2f | %10lu | %14lu | %14lu | %12.2f | %11.2f\n",
+                   i, poll_thread_cpu_time(i), data->n_events, data->bytes_in, data->bytes_out,
+                   poll_cycles_to_seconds(data->dispatch_cycles),
+                   poll_cycles_to_seconds(data->zombie_cycles));
+    }
 }
 
 /**
@@ -1544,48 +2328,66 @@ static void poll_add_event_to_dcb(DCB*       dcb,
                                   GWBUF*     buf,
                                   __uint32_t ev)
 {
+    POLL_QUEUE *queue = &pollqs[poll_dcb_queue_index(dcb)];
+
     /** Add buf to readqueue */
     spinlock_acquire(&dcb->authlock);
     dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue, buf);
     spinlock_release(&dcb->authlock);
 
-    spinlock_acquire(&pollqlock);
+    spinlock_acquire(&queue->lock);
+    poll_queue_events(queue, dcb, ev);
+    spinlock_release(&queue->lock);
+}
 
-    /** Set event to DCB */
+/**
+ * Add events to a DCB. If the DCB is not already in the event queue it
+ * is appended to the tail of the queue, otherwise the events are added to
+ * the pending events of the DCB. The caller must hold the queue lock.
+ *
+ * @param queue The event queue of the DCB
+ * @param dcb   The DCB the events are for
+ * @param ev    The events to add
+ */
+static void
+poll_queue_events(POLL_QUEUE *queue, DCB *dcb, uint32_t ev)
+{
     if (DCB_POLL_BUSY(dcb))
     {
         if (dcb->evq.pending_events == 0)
         {
-            pollStats.evq_pending++;
+            queue->pending++;
+            atomic_add(&pollStats.evq_pending, 1);
+            dcb->evq.inserted = hkheartbeat;
+            dcb->evq.queued = rdtsc();
         }
         dcb->evq.pending_events |= ev;
     }
     else
     {
         dcb->evq.pending_events = ev;
-        /** Add DCB to eventqueue if it isn't already there */
-        if (eventq)
+        if (queue->head)
         {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
+            dcb->evq.prev = queue->head->evq.prev;
+            queue->head->evq.prev->evq.next = dcb;
+            queue->head->evq.prev = dcb;
+            dcb->evq.next = queue->head;
         }
         else
         {
-            eventq = dcb;
+            queue->head = dcb;
             dcb->evq.prev = dcb;
             dcb->evq.next = dcb;
         }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
-
-        if (pollStats.evq_length > pollStats.evq_max)
+        queue->pending++;
+        atomic_add(&pollStats.evq_pending, 1);
+        dcb->evq.inserted = hkheartbeat;
+        dcb->evq.queued = rdtsc();
+        if (atomic_add(&pollStats.evq_length, 1) >= pollStats.evq_max)
         {
             pollStats.evq_max = pollStats.evq_length;
         }
     }
-    spinlock_release(&pollqlock);
 }
 
 /*
@@ -1642,8 +2444,9 @@ poll_fake_read_event(DCB *dcb)
 void
 poll_fake_event(DCB *dcb, enum EPOLL_EVENTS ev)
 {
+    POLL_QUEUE *queue = &pollqs[poll_dcb_queue_index(dcb)];
 
-    spinlock_acquire(&pollqlock);
+    spinlock_acquire(&queue->lock);
     /*
      * If the DCB is already on the queue, there are no pending events and
      * there are other events on the queue, then
@@ -1653,49 +2456,17 @@ poll_fake_event(DCB *dcb, enum EPOLL_EVENTS ev)
     {
         dcb->evq.prev->evq.next = dcb->evq.next;
         dcb->evq.next->evq.prev = dcb->evq.prev;
-        if (eventq == dcb)
+        if (queue->head == dcb)
         {
-            eventq = dcb->evq.next;
+            queue->head = dcb->evq.next;
         }
         dcb->evq.next = NULL;
         dcb->evq.prev = NULL;
-        pollStats.evq_length--;
+        atomic_add(&pollStats.evq_length, -1);
     }
 
-    if (DCB_POLL_BUSY(dcb))
-    {
-        if (dcb->evq.pending_events == 0)
-        {
-            pollStats.evq_pending++;
-        }
-        dcb->evq.pending_events |= ev;
-    }
-    else
-    {
-        dcb->evq.pending_events = ev;
-        dcb->evq.inserted = hkheartbeat;
-        if (eventq)
-        {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
-        }
-        else
-        {
-            eventq = dcb;
-            dcb->evq.prev = dcb;
-            dcb->evq.next = dcb;
-        }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
-        dcb->evq.inserted = hkheartbeat;
-        if (pollStats.evq_length > pollStats.evq_max)
-        {
-            pollStats.evq_max = pollStats.evq_length;
-        }
-    }
-    spinlock_release(&pollqlock);
+    poll_queue_events(queue, dcb, ev);
+    spinlock_release(&queue->lock);
 }
 
 /*
@@ -1713,42 +2484,11 @@ poll_fake_hangup_event(DCB *dcb)
 #else
     uint32_t ev = EPOLLHUP;
 #endif
+    POLL_QUEUE *queue = &pollqs[poll_dcb_queue_index(dcb)];
 
-    spinlock_acquire(&pollqlock);
-    if (DCB_POLL_BUSY(dcb))
-    {
-        if (dcb->evq.pending_events == 0)
-        {
-            pollStats.evq_pending++;
-        }
-        dcb->evq.pending_events |= ev;
-    }
-    else
-    {
-        dcb->evq.pending_events = ev;
-        dcb->evq.inserted = hkheartbeat;
-        if (eventq)
-        {
-            dcb->evq.prev = eventq->evq.prev;
-            eventq->evq.prev->evq.next = dcb;
-            eventq->evq.prev = dcb;
-            dcb->evq.next = eventq;
-        }
-        else
-        {
-            eventq = dcb;
-            dcb->evq.prev = dcb;
-            dcb->evq.next = dcb;
-        }
-        pollStats.evq_length++;
-        pollStats.evq_pending++;
-        dcb->evq.inserted = hkheartbeat;
-        if (pollStats.evq_length > pollStats.evq_max)
-        {
-            pollStats.evq_max = pollStats.evq_length;
-        }
-    }
-    spinlock_release(&pollqlock);
+    spinlock_acquire(&queue->lock);
+    poll_queue_events(queue, dcb, ev);
+    spinlock_release(&queue->lock);
 }
 
 /**
@@ -1761,31 +2501,42 @@ dShowEventQ(DCB *pdcb)
 {
     DCB *dcb;
     char *tmp1, *tmp2;
+    int i;
 
-    spinlock_acquire(&pollqlock);
-    if (eventq == NULL)
+    for (i = 0; i < n_pollqs; i++)
     {
-        /* Nothing to process */
-        spinlock_release(&pollqlock);
-        return;
-    }
-    dcb = eventq;
-    dcb_printf(pdcb, "\nEvent Queue.\n");
-    dcb_printf(pdcb, "%-16s | %-10s | %-18s | %s\n", "DCB", "Status", "Processing Events",
-               "Pending Events");
-    dcb_printf(pdcb, "-----------------+------------+--------------------+-------------------\n");
-    do
-    {
-        dcb_printf(pdcb, "%-16p | %-10s | %-18s | %-18s\n", dcb,
-                   dcb->evq.processing ? "Processing" : "Pending",
-                   (tmp1 = event_to_string(dcb->evq.processing_events)),
-                   (tmp2 = event_to_string(dcb->evq.pending_events)));
-        free(tmp1);
-        free(tmp2);
-        dcb = dcb->evq.next;
+        spinlock_acquire(&pollqs[i].lock);
+        if (pollqs[i].head == NULL)
+        {
+            /* Nothing to process */
+            spinlock_release(&pollqs[i].lock);
+            continue;
+        }
+        dcb = pollqs[i].head;
+        if (poll_affinity)
+        {
+            dcb_printf(pdcb, "\nEvent Queue of Thread %d.\n", i);
+        }
+        else
+        {
+            dcb_printf(pdcb, "\nEvent Queue.\n");
+        }
+        dcb_printf(pdcb, "%-16s | %-10s | %-18s | %s\n", "DCB", "Status", "Processing Events",
+                   "Pending Events");
+        dcb_printf(pdcb, "-----------------+------------+--------------------+-------------------\n");
+        do
+        {
+            dcb_printf(pdcb, "%-16p | %-10s | %-18s | %-18s\n", dcb,
+                       dcb->evq.processing ? "Processing" : "Pending",
+                       (tmp1 = event_to_string(dcb->evq.processing_events)),
+                       (tmp2 = event_to_string(dcb->evq.pending_events)));
+            free(tmp1);
+            free(tmp2);
+            dcb = dcb->evq.next;
+        }
+        while (dcb != pollqs[i].head);
+        spinlock_release(&pollqs[i].lock);
     }
-    while (dcb != eventq);
-    spinlock_release(&pollqlock);
 }
 
 
@@ -1927,3 +2678,500 @@ eventTimesGetList()
 
     return set;
 }
+
+/**
+ * Measure the frequency of the time-stamp counter against the monotonic clock.
+ * The measurement takes ten milliseconds.
+ */
+static void
+poll_calibrate_cycles()
+{
+    struct timespec start, now;
+    CYCLES begin, end;
+    long usecs;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    begin = rdtsc();
+    do
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        usecs = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+    }
+    while (usecs < 10000);
+    end = rdtsc();
+
+    if (end > begin)
+    {
+        cycles_per_usec = (double)(end - begin) / usecs;
+    }
+}
+
+/**
+ * Add a duration to a latency histogram
+ *
+ * @param histogram The histogram
+ * @param cycles    The duration in time-stamp counter cycles
+ */
+static void
+poll_record_latency(ts_histogram_t histogram, CYCLES cycles)
+{
+    uint64_t usecs = (uint64_t)(cycles / cycles_per_usec);
+
+    /** A negative duration, from a counter of another processor, wraps around */
+    if ((long long)cycles < 0)
+    {
+        usecs = 0;
+    }
+    ts_histogram_add(histogram, usecs);
+}
+
+/**
+ * Add a wakeup of a polling thread to the histogram of events per wakeup
+ *
+ * @param thread_id The polling thread
+ * @param nfds      The number of events epoll_wait returned
+ */
+static void
+poll_record_wakeup(int thread_id, int nfds)
+{
+    int bucket = 0;
+
+    while ((nfds >>= 1) && bucket < N_WAKEUP_BUCKETS - 1)
+    {
+        bucket++;
+    }
+    histograms[thread_id].wakeups[bucket]++;
+}
+
+/**
+ * Format the range of a latency histogram bucket
+ *
+ * @param bucket The bucket
+ * @param buf    Buffer where the range is stored
+ * @param len    Length of the buffer
+ */
+static void
+poll_latency_label(int bucket, char *buf, int len)
+{
+    if (bucket == 0)
+    {
+        snprintf(buf, len, "< 1us");
+    }
+    else if (bucket == N_LATENCY_BUCKETS - 1)
+    {
+        snprintf(buf, len, ">= %luus", 1UL << (bucket - 1));
+    }
+    else
+    {
+        snprintf(buf, len, "%lu - %luus", 1UL << (bucket - 1), 1UL << bucket);
+    }
+}
+
+/**
+ * Format the range of a histogram bucket of events per wakeup
+ *
+ * @param bucket The bucket
+ * @param buf    Buffer where the range is stored
+ * @param len    Length of the buffer
+ */
+static void
+poll_wakeup_label(int bucket, char *buf, int len)
+{
+    if (bucket == 0)
+    {
+        snprintf(buf, len, "1");
+    }
+    else if (bucket == N_WAKEUP_BUCKETS - 1)
+    {
+        snprintf(buf, len, ">= %d", 1 << bucket);
+    }
+    else
+    {
+        snprintf(buf, len, "%d - %d", 1 << bucket, (1 << (bucket + 1)) - 1);
+    }
+}
+
+/**
+ * Count the durations of a latency histogram bucket
+ *
+ * @param histogram The histogram
+ * @param thread    The polling thread, or -1 for all threads
+ * @param bucket    The bucket
+ * @return          The number of durations in the bucket
+ */
+static uint64_t
+poll_latency_count(ts_histogram_t histogram, int thread, int bucket)
+{
+    uint64_t lo = bucket == 0 ? 0 : 1UL << (bucket - 1);
+    uint64_t hi = bucket == N_LATENCY_BUCKETS - 1 ? UINT64_MAX : 1UL << bucket;
+
+    return ts_histogram_range(histogram, thread, lo, hi);
+}
+
+/**
+ * Print the summary of a latency histogram
+ *
+ * @param dcb       DCB to print to
+ * @param name      The name of the histogram
+ * @param histogram The histogram
+ */
+static void
+poll_print_summary(DCB *dcb, const char *name, ts_histogram_t histogram)
+{
+    ts_histogram_summary_t sum;
+
+    ts_histogram_get(histogram, -1, &sum);
+    dcb_printf(dcb, "\t%-12s %10" PRIu64 " %8" PRIu64 "us %8.0fus %8" PRIu64 "us %8" PRIu64
+               "us %8" PRIu64 "us %8" PRIu64 "us %8" PRIu64 "us\n", name, sum.count, sum.min,
+               sum.mean, sum.p50, sum.p90, sum.p99, sum.p999, sum.max);
+}
+
+/**
+ * Print the event loop latency histograms. The histograms of all threads are
+ * summed and the median and the tail of each thread are shown separately.
+ *
+ * @param dcb   DCB to print to
+ */
+static void
+dprintPollHistograms(DCB *dcb)
+{
+    unsigned long wakeups[N_WAKEUP_BUCKETS] = {0};
+    char label[40];
+    int i, j;
+
+    for (i = 0; i < n_threads; i++)
+    {
+        for (j = 0; j < N_WAKEUP_BUCKETS; j++)
+        {
+            wakeups[j] += histograms[i].wakeups[j];
+        }
+    }
+
+    dcb_printf(dcb, "\nEvent loop latency, all threads\n");
+    dcb_printf(dcb, "\t%-20s %-14s %-14s\n", "Duration", "Queue delay", "Execution");
+    for (i = 0; i < N_LATENCY_BUCKETS; i++)
+    {
+        poll_latency_label(i, label, sizeof(label));
+        dcb_printf(dcb, "\t%-20s %-14" PRIu64 " %-14" PRIu64 "\n", label,
+                   poll_latency_count(pollStats.qdelay, -1, i),
+                   poll_latency_count(pollStats.exectime, -1, i));
+    }
+
+    dcb_printf(dcb, "\nEvents per wakeup, all threads\n");
+    dcb_printf(dcb, "\t%-20s %-14s\n", "No. of events", "No. of wakeups");
+    for (i = 0; i < N_WAKEUP_BUCKETS; i++)
+    {
+        poll_wakeup_label(i, label, sizeof(label));
+        dcb_printf(dcb, "\t%-20s %-14lu\n", label, wakeups[i]);
+    }
+
+    dcb_printf(dcb, "\nEvent loop latency distribution, all threads\n");
+    dcb_printf(dcb, "\t%-12s %10s %10s %10s %10s %10s %10s %10s %10s\n", "", "Count",
+               "Min", "Mean", "p50", "p90", "p99", "p99.9", "Max");
+    poll_print_summary(dcb, "Queue delay", pollStats.qdelay);
+    poll_print_summary(dcb, "Execution", pollStats.exectime);
+
+    dcb_printf(dcb, "\nEvent loop latency percentiles per thread\n");
+    dcb_printf(dcb, "\t%-6s %10s %10s %10s %10s %10s %10s\n", "Thread",
+               "Queue p50", "p99", "p99.9", "Exec p50", "p99", "p99.9");
+    for (i = 0; i < n_threads; i++)
+    {
+        dcb_printf(dcb, "\t%-6d", i);
+        dcb_printf(dcb, " %8" PRIu64 "us", ts_histogram_percentile(pollStats.qdelay, i, 50));
+        dcb_printf(dcb, " %8" PRIu64 "us", ts_histogram_percentile(pollStats.qdelay, i, 99));
+        dcb_printf(dcb, " %8" PRIu64 "us", ts_histogram_percentile(pollStats.qdelay, i, 99.9));
+        dcb_printf(dcb, " %8" PRIu64 "us", ts_histogram_percentile(pollStats.exectime, i, 50));
+        dcb_printf(dcb, " %8" PRIu64 "us", ts_histogram_percentile(pollStats.exectime, i, 99));
+        dcb_printf(dcb, " %8" PRIu64 "us", ts_histogram_percentile(pollStats.exectime, i, 99.9));
+        dcb_printf(dcb, "\n");
+    }
+}
+
+/**
+ * Decide the spins and the timeout of an adaptive polling thread from what it
+ * saw since the last decision and start a new window
+ *
+ * @param adapt The controller of the calling thread
+ */
+static void
+poll_adapt_update(POLL_ADAPT *adapt)
+{
+    long elapsed = hkheartbeat - adapt->window;
+
+    adapt->rate = elapsed > 0 ? adapt->events * 10 / elapsed : adapt->events;
+
+    if (adapt->spin_polls > 0)
+    {
+        if (adapt->spin_hits * 4 >= adapt->spin_polls && adapt->spins < POLL_ADAPT_MAX_SPINS)
+        {
+            adapt->spins = adapt->spins ? MIN(adapt->spins * 2, POLL_ADAPT_MAX_SPINS) : 1;
+            adapt->n_raised++;
+        }
+        else if (adapt->spin_hits * 16 < adapt->spin_polls && adapt->spins > 0)
+        {
+            adapt->spins /= 2;
+            adapt->n_lowered++;
+        }
+    }
+
+    /** An idle thread sleeps for max_poll_sleep, the busier the shorter */
+    adapt->sleep = MAX(1, (int)((long)max_poll_sleep * POLL_ADAPT_BUSY_RATE /
+                                (adapt->rate + POLL_ADAPT_BUSY_RATE)));
+
+    adapt->window = hkheartbeat;
+    adapt->spin_polls = 0;
+    adapt->spin_hits = 0;
+    adapt->events = 0;
+}
+
+/**
+ * Print the current decisions of the adaptive polling of each thread
+ *
+ * @param dcb   DCB to print to
+ */
+static void
+dprintPollAdaptive(DCB *dcb)
+{
+    dcb_printf(dcb, "\nAdaptive polling\n");
+    dcb_printf(dcb, "\t%-6s %10s %10s %12s %10s %10s\n", "Thread",
+               "Spins", "Sleep", "Events/s", "Raised", "Lowered");
+    for (int i = 0; i < n_threads; i++)
+    {
+        dcb_printf(dcb, "\t%-6d %10d %8dms %12d %10lu %10lu\n", i,
+                   poll_adapt[i].spins, poll_adapt[i].sleep, poll_adapt[i].rate,
+                   poll_adapt[i].n_raised, poll_adapt[i].n_lowered);
+    }
+}
+
+/**
+ * The position of the result set of the event loop latency histograms
+ */
+typedef struct
+{
+    int thread;     /*< The polling thread */
+    int histogram;  /*< The histogram of the thread, see latencyRowCallback */
+    int bucket;     /*< The bucket of the histogram */
+} LATENCY_ROW;
+
+/**
+ * Provide a row to the result set of the event loop latency histograms. The
+ * rows of each thread are the queue delay, execution time and events per wakeup
+ * histograms, in that order.
+ *
+ * @param set   The result set
+ * @param data  The position of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+latencyRowCallback(RESULTSET *set, void *data)
+{
+    static char *names[] = {"queue_delay", "execution", "events_per_wakeup"};
+    LATENCY_ROW *pos = (LATENCY_ROW *)data;
+    char buf[40];
+    unsigned long count;
+    RESULT_ROW *row;
+
+    if (pos->thread >= n_threads || histograms == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    row = resultset_make_row(set);
+    snprintf(buf, sizeof(buf), "%d", pos->thread);
+    resultset_row_set(row, 0, buf);
+    resultset_row_set(row, 1, names[pos->histogram]);
+    switch (pos->histogram)
+    {
+    case 0:
+        poll_latency_label(pos->bucket, buf, sizeof(buf));
+        count = poll_latency_count(pollStats.qdelay, pos->thread, pos->bucket);
+        break;
+    case 1:
+        poll_latency_label(pos->bucket, buf, sizeof(buf));
+        count = poll_latency_count(pollStats.exectime, pos->thread, pos->bucket);
+        break;
+    default:
+        poll_wakeup_label(pos->bucket, buf, sizeof(buf));
+        count = histograms[pos->thread].wakeups[pos->bucket];
+        break;
+    }
+    resultset_row_set(row, 2, buf);
+    snprintf(buf, sizeof(buf), "%lu", count);
+    resultset_row_set(row, 3, buf);
+
+    pos->bucket++;
+    if (pos->bucket >= (pos->histogram == 2 ? N_WAKEUP_BUCKETS : N_LATENCY_BUCKETS))
+    {
+        pos->bucket = 0;
+        if (++pos->histogram > 2)
+        {
+            pos->histogram = 0;
+            pos->thread++;
+        }
+    }
+    return row;
+}
+
+/**
+ * Return a result set with the event loop latency histograms of each
+ * polling thread
+ *
+ * @return A Result set
+ */
+RESULTSET *
+eventLatencyGetList()
+{
+    RESULTSET *set;
+    LATENCY_ROW *data;
+
+    if ((data = (LATENCY_ROW *)calloc(1, sizeof(LATENCY_ROW))) == NULL)
+    {
+        return NULL;
+    }
+    if ((set = resultset_create(latencyRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Thread", 6, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Histogram", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Bucket", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Count", 12, COL_TYPE_VARCHAR);
+
+    return set;
+}
+
+/**
+ * Provide a row to the result set of the load of the polling threads
+ *
+ * @param set   The result set
+ * @param data  The index of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+pollThreadsRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    char buf[40];
+    RESULT_ROW *row;
+
+    if (*rowno >= n_threads || thread_data == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    THREAD_DATA *thread = &thread_data[*rowno];
+
+    row = resultset_make_row(set);
+    snprintf(buf, sizeof(buf), "%d", *rowno);
+    resultset_row_set(row, 0, buf);
+    snprintf(buf, sizeof(buf), "%.3f", poll_thread_cpu_time(*rowno));
+    resultset_row_set(row, 1, buf);
+    snprintf(buf, sizeof(buf), "%lu", thread->n_events);
+    resultset_row_set(row, 2, buf);
+    snprintf(buf, sizeof(buf), "%lu", thread->bytes_in);
+    resultset_row_set(row, 3, buf);
+    snprintf(buf, sizeof(buf), "%lu", thread->bytes_out);
+    resultset_row_set(row, 4, buf);
+    snprintf(buf, sizeof(buf), "%.3f", poll_cycles_to_seconds(thread->dispatch_cycles));
+    resultset_row_set(row, 5, buf);
+    snprintf(buf, sizeof(buf), "%.3f", poll_cycles_to_seconds(thread->zombie_cycles));
+    resultset_row_set(row, 6, buf);
+    (*rowno)++;
+    return row;
+}
+
+/**
+ * Return a result set with the CPU time, dispatched events, bytes moved and
+ * the time spent dispatching events and collecting zombies of each polling
+ * thread
+ *
+ * @return A Result set
+ */
+RESULTSET *
+pollThreadsGetList()
+{
+    RESULTSET *set;
+    int *data;
+
+    if ((data = (int *)malloc(sizeof(int))) == NULL)
+    {
+        return NULL;
+    }
+    *data = 0;
+    if ((set = resultset_create(pollThreadsRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Thread", 6, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "CPU Time", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Events", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Bytes In", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Bytes Out", 20, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Dispatch Time", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Collect Time", 12, COL_TYPE_VARCHAR);
+
+    return set;
+}
+
+/**
+ * Write the metrics of the polling threads
+ *
+ * @param metrics   The output
+ */
+void
+poll_metrics(METRICS *metrics)
+{
+    static const struct
+    {
+        const char *type;
+        ts_stats_t **stats;
+    } events[] =
+    {
+        {"read", &pollStats.n_read},
+        {"write", &pollStats.n_write},
+        {"error", &pollStats.n_error},
+        {"hangup", &pollStats.n_hup},
+        {"accept", &pollStats.n_accept}
+    };
+    char labels[40];
+    int i;
+
+    if (pollStats.qdelay == NULL)
+    {
+        return;
+    }
+
+    metrics_header(metrics, "maxscale_poll_events_total", "counter",
+                   "Events processed by the polling threads");
+    for (i = 0; i < (int)(sizeof(events) / sizeof(events[0])); i++)
+    {
+        metrics_printf(metrics, "maxscale_poll_events_total{type=\"%s\"} %" PRId64 "\n",
+                       events[i].type, ts_stats_sum(*events[i].stats));
+    }
+    metrics_header(metrics, "maxscale_poll_cycles_total", "counter",
+                   "Calls to epoll_wait");
+    metrics_printf(metrics, "maxscale_poll_cycles_total %" PRId64 "\n",
+                   ts_stats_sum(pollStats.n_polls));
+    metrics_header(metrics, "maxscale_poll_event_queue_length", "gauge",
+                   "DCBs with events waiting to be processed");
+    metrics_printf(metrics, "maxscale_poll_event_queue_length %d\n", pollStats.evq_length);
+
+    metrics_header(metrics, "maxscale_poll_queue_delay_microseconds", "summary",
+                   "Time from epoll_wait returning an event to its processing");
+    for (i = 0; i < n_threads; i++)
+    {
+        snprintf(labels, sizeof(labels), "thread=\"%d\"", i);
+        metrics_summary(metrics, "maxscale_poll_queue_delay_microseconds", labels,
+                        pollStats.qdelay, i);
+    }
+    metrics_header(metrics, "maxscale_poll_execution_microseconds", "summary",
+                   "Time spent processing the events of a DCB");
+    for (i = 0; i < n_threads; i++)
+    {
+        snprintf(labels, sizeof(labels), "thread=\"%d\"", i);
+        metrics_summary(metrics, "maxscale_poll_execution_microseconds", labels,
+                        pollStats.exectime, i);
+    }
+}
@@ -11,10 +11,16 @@
  * Public License.
  */
 
+#include <string.h>
 #include <query_classifier.h>
 #include <log_manager.h>
 #include <modules.h>
 #include <modutil.h>
+#include <platform.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <trace.h>
+#include <probes.h>
 
 //#define QC_TRACE_ENABLED
 #undef QC_TRACE_ENABLED
@@ -29,6 +35,44 @@ static const char default_qc_name[] = "qc_sqlite";
 
 static QUERY_CLASSIFIER* classifier;
 
+/** The number of sampled statements that can wait for the shadow classifier */
+#define QC_SHADOW_QUEUE_SIZE 1024
+
+/** The longest prefix of a statement logged when the classifiers disagree */
+#define QC_SHADOW_LOG_LEN    256
+
+typedef struct qc_shadow_entry
+{
+    GWBUF*        stmt;      /*< A copy of the statement */
+    uint32_t      type;      /*< The type given by the classifier */
+    qc_query_op_t operation; /*< The operation given by the classifier */
+} QC_SHADOW_ENTRY;
+
+/**
+ * The shadow classifier. The statements are sampled on the request path,
+ * where only a copy of the statement is queued. The threads of the shadow
+ * classifier classify the copies and compare the results.
+ */
+static struct
+{
+    QUERY_CLASSIFIER* classifier; /*< The shadow classifier, NULL if not in use */
+    int               sample;     /*< The percentage of the statements sampled */
+    int               property;   /*< The buffer property marking a sampled statement */
+    int               n_threads;  /*< The number of threads */
+    THREAD*           threads;    /*< The threads */
+    volatile bool     running;    /*< Cleared to stop the threads */
+    SPINLOCK          lock;       /*< Protects the queue */
+    QC_SHADOW_ENTRY   queue[QC_SHADOW_QUEUE_SIZE];
+    int               head;       /*< The oldest entry of the queue */
+    int               count;      /*< The number of entries in the queue */
+    QC_SHADOW_STATS   stats;
+} shadow;
+
+/** Accumulates the sampling percentage, a statement is sampled when it reaches 100 */
+static thread_local int shadow_credit;
+
+static void shadow_sample(GWBUF* query, uint32_t type);
+
 
 bool qc_init(const char* plugin_name, const char* plugin_args)
 {
@@ -108,17 +152,28 @@ void qc_thread_end(void)
  * a query is asked for, the query will be parsed if it has not been parsed
  * yet. Also, if the query in the provided buffer has been parsed already
  * then this function will only return the result of that parsing; the query
- * will not be parsed again.
+ * will not be parsed again, unless something that was not collected then is
+ * asked for now.
+ *
+ * The functions that need more than the essentials, e.g. qc_get_table_names,
+ * ask for what they need themselves, so parsing is never incomplete. Asking
+ * up front for everything that will be needed only saves a second parse.
  *
- * @param query A GWBUF containing an SQL statement.
+ * @param query   A GWBUF containing an SQL statement.
+ * @param collect A bitmask of qc_collect_info_t values specifying what should
+ *                be collected in addition to the essentials.
  * @result To what extent the query could be parsed.
  */
-qc_parse_result_t qc_parse(GWBUF* query)
+qc_parse_result_t qc_parse(GWBUF* query, uint32_t collect)
 {
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_parse(query);
+    MXS_PROBE1(qc__parse__start, query);
+    qc_parse_result_t result = classifier->qc_parse(query, collect);
+    MXS_PROBE2(qc__parse__end, query, result);
+
+    return result;
 }
 
 /**
@@ -135,7 +190,16 @@ uint32_t qc_get_type(GWBUF* query)
     QC_TRACE();
     ss_dassert(classifier);
 
-    return classifier->qc_get_type(query);
+    uint32_t type = classifier->qc_get_type(query);
+
+    trace_point(trace_current, TRACE_CLASSIFY);
+
+    if (shadow.classifier)
+    {
+        shadow_sample(query, type);
+    }
+
+    return type;
 }
 
 qc_query_op_t qc_get_operation(GWBUF* query)
@@ -265,6 +329,200 @@ char** qc_get_database_names(GWBUF* query, int* sizep)
     return classifier->qc_get_database_names(query, sizep);
 }
 
+/**
+ * Returns the statistics of the cache of classifications.
+ *
+ * @param stats The statistics, summed over all threads.
+ *
+ * @return True, if the query classifier has a cache, false otherwise.
+ */
+bool qc_get_cache_stats(QC_CACHE_STATS* stats)
+{
+    QC_TRACE();
+    ss_dassert(classifier);
+
+    if (classifier->qc_get_cache_stats)
+    {
+        return classifier->qc_get_cache_stats(stats);
+    }
+    else
+    {
+        memset(stats, 0, sizeof(*stats));
+        return false;
+    }
+}
+
+/**
+ * Attaches a result of the classifier to a buffer so that it is freed with
+ * the buffer. Used for the views when the classifier cannot provide them.
+ *
+ * @param query A buffer containing a query.
+ * @param data  The result, may be NULL.
+ *
+ * @return The result.
+ */
+static void* view_attach(GWBUF* query, void* data)
+{
+    if (data)
+    {
+        gwbuf_add_buffer_object(query, GWBUF_CLASSIFIER_VIEW, data, free);
+    }
+
+    return data;
+}
+
+/**
+ * Moves an array of strings into a single block attached to a buffer.
+ *
+ * @param query   A buffer containing a query.
+ * @param strings An array of n strings, freed by this function. May be NULL.
+ * @param n       The number of strings.
+ *
+ * @return A NULL terminated copy of the array, or NULL if strings was NULL.
+ */
+static const char* const* view_attach_string_array(GWBUF* query, char** strings, int n)
+{
+    char** view = NULL;
+
+    if (strings)
+    {
+        size_t size = (n + 1) * sizeof(char*);
+
+        for (int i = 0; i < n; i++)
+        {
+            size += strlen(strings[i]) + 1;
+        }
+
+        if ((view = malloc(size)))
+        {
+            char* p = (char*)(view + n + 1);
+
+            for (int i = 0; i < n; i++)
+            {
+                size_t len = strlen(strings[i]) + 1;
+                view[i] = memcpy(p, strings[i], len);
+                p += len;
+            }
+
+            view[n] = NULL;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            free(strings[i]);
+        }
+
+        free(strings);
+    }
+
+    return (const char* const*) view_attach(query, view);
+}
+
+/**
+ * The view functions return the same as the corresponding functions without
+ * the _view suffix, but what they return is owned by the buffer and must not
+ * be modified or freed. It stays valid as long as the buffer does. With a
+ * classifier that provides them nothing is allocated, otherwise the result of
+ * the allocating function is attached to the buffer.
+ */
+
+/**
+ * Returns the name of the table created by the query.
+ *
+ * @param query A buffer containing a query.
+ *
+ * @return The name of the created table, or NULL.
+ */
+const char* qc_get_created_table_name_view(GWBUF* query)
+{
+    QC_TRACE();
+    ss_dassert(classifier);
+
+    if (classifier->qc_get_created_table_name_view)
+    {
+        return classifier->qc_get_created_table_name_view(query);
+    }
+    else
+    {
+        return view_attach(query, classifier->qc_get_created_table_name(query));
+    }
+}
+
+/**
+ * Returns the names of the tables accessed by the query.
+ *
+ * @param query     A buffer containing a query.
+ * @param tblsize   Set to the number of names.
+ * @param fullnames Whether the names should be qualified with the database.
+ *
+ * @return A NULL terminated array of names, or NULL.
+ */
+const char* const* qc_get_table_names_view(GWBUF* query, int* tblsize, bool fullnames)
+{
+    QC_TRACE();
+    ss_dassert(classifier);
+
+    if (classifier->qc_get_table_names_view)
+    {
+        return classifier->qc_get_table_names_view(query, tblsize, fullnames);
+    }
+    else
+    {
+        *tblsize = 0;
+        char** names = classifier->qc_get_table_names(query, tblsize, fullnames);
+
+        return view_attach_string_array(query, names, *tblsize);
+    }
+}
+
+/**
+ * Returns the fields affected by the query.
+ *
+ * @param query A buffer containing a query.
+ *
+ * @return The names of the fields separated by spaces, or NULL.
+ */
+const char* qc_get_affected_fields_view(GWBUF* query)
+{
+    QC_TRACE();
+    ss_dassert(classifier);
+
+    if (classifier->qc_get_affected_fields_view)
+    {
+        return classifier->qc_get_affected_fields_view(query);
+    }
+    else
+    {
+        return view_attach(query, classifier->qc_get_affected_fields(query));
+    }
+}
+
+/**
+ * Returns the names of the databases accessed by the query.
+ *
+ * @param query A buffer containing a query.
+ * @param sizep Set to the number of names.
+ *
+ * @return A NULL terminated array of names, or NULL.
+ */
+const char* const* qc_get_database_names_view(GWBUF* query, int* sizep)
+{
+    QC_TRACE();
+    ss_dassert(classifier);
+
+    if (classifier->qc_get_database_names_view)
+    {
+        return classifier->qc_get_database_names_view(query, sizep);
+    }
+    else
+    {
+        *sizep = 0;
+        char** names = classifier->qc_get_database_names(query, sizep);
+
+        return view_attach_string_array(query, names, *sizep);
+    }
+}
+
 /**
  * Returns the string representation of a query operation.
  *
@@ -513,6 +771,14 @@ struct type_name_info type_to_type_name_info(qc_query_type_t type)
 	}
 	break;
 
+    case QUERY_TYPE_READ_ONLY_TRX:
+        {
+            static const char name[] = "QUERY_TYPE_READ_ONLY_TRX";
+            info.name = name;
+            info.name_len = sizeof(name) - 1;
+	}
+	break;
+
     default:
         {
             static const char name[] = "UNKNOWN_QUERY_TYPE";
@@ -569,6 +835,7 @@ static const qc_query_type_t QUERY_TYPES[] =
     QUERY_TYPE_READ_TMP_TABLE,
     QUERY_TYPE_SHOW_DATABASES,
     QUERY_TYPE_SHOW_TABLES,
+    QUERY_TYPE_READ_ONLY_TRX,
 };
 
 static const int N_QUERY_TYPES = sizeof(QUERY_TYPES) / sizeof(QUERY_TYPES[0]);
@@ -638,3 +905,279 @@ char* qc_types_to_string(uint32_t types)
 
     return s;
 }
+
+/**
+ * Samples a classified statement for the shadow classifier. Nothing but a
+ * copy of the statement is made on the request path. If the queue is full,
+ * the statement is dropped.
+ *
+ * @param query The statement.
+ * @param type  The type the classifier gave to it.
+ */
+static void shadow_sample(GWBUF* query, uint32_t type)
+{
+    /** The type of a statement may be asked for several times, it is considered once */
+    if (gwbuf_get_property_value(query, shadow.property) ||
+        !gwbuf_set_property(query, shadow.property, (void*)query))
+    {
+        return;
+    }
+
+    if ((shadow_credit += shadow.sample) < 100)
+    {
+        return;
+    }
+
+    shadow_credit -= 100;
+
+    qc_query_op_t operation = classifier->qc_get_operation(query);
+    GWBUF* copy = gwbuf_alloc_and_load(GWBUF_LENGTH(query), GWBUF_DATA(query));
+
+    if (copy)
+    {
+        bool queued = false;
+
+        spinlock_acquire(&shadow.lock);
+
+        if (shadow.count < QC_SHADOW_QUEUE_SIZE)
+        {
+            QC_SHADOW_ENTRY* entry = &shadow.queue[(shadow.head + shadow.count) % QC_SHADOW_QUEUE_SIZE];
+            entry->stmt = copy;
+            entry->type = type;
+            entry->operation = operation;
+            shadow.count++;
+            queued = true;
+        }
+
+        spinlock_release(&shadow.lock);
+
+        if (queued)
+        {
+            __sync_fetch_and_add(&shadow.stats.sampled, 1);
+        }
+        else
+        {
+            gwbuf_free(copy);
+            __sync_fetch_and_add(&shadow.stats.dropped, 1);
+        }
+    }
+}
+
+/**
+ * Classifies a sampled statement with the shadow classifier and logs the
+ * difference if the classifiers disagree.
+ *
+ * @param entry The sampled statement, freed by this function.
+ */
+static void shadow_compare(QC_SHADOW_ENTRY* entry)
+{
+    uint32_t type = shadow.classifier->qc_get_type(entry->stmt);
+    qc_query_op_t operation = shadow.classifier->qc_get_operation(entry->stmt);
+
+    __sync_fetch_and_add(&shadow.stats.compared, 1);
+
+    if (type != entry->type)
+    {
+        __sync_fetch_and_add(&shadow.stats.type_mismatches, 1);
+    }
+
+    if (operation != entry->operation)
+    {
+        __sync_fetch_and_add(&shadow.stats.operation_mismatches, 1);
+    }
+
+    if (type != entry->type || operation != entry->operation)
+    {
+        char* sql;
+        int len;
+        char* types1 = qc_types_to_string(entry->type);
+        char* types2 = qc_types_to_string(type);
+
+        if (!modutil_extract_SQL(entry->stmt, &sql, &len))
+        {
+            sql = "";
+            len = 0;
+        }
+
+        MXS_WARNING("The query classifiers disagree on '%.*s': "
+                    "type %s != %s, operation %s != %s.",
+                    len < QC_SHADOW_LOG_LEN ? len : QC_SHADOW_LOG_LEN, sql,
+                    types1 ? types1 : "", types2 ? types2 : "",
+                    qc_op_to_string(entry->operation), qc_op_to_string(operation));
+
+        free(types1);
+        free(types2);
+    }
+
+    gwbuf_free(entry->stmt);
+}
+
+/**
+ * The entry point of the threads of the shadow classifier.
+ *
+ * @param arg Not used.
+ */
+static void shadow_main(void* arg)
+{
+    if (!shadow.classifier->qc_thread_init())
+    {
+        MXS_ERROR("Could not initialize the shadow query classifier for a thread.");
+        return;
+    }
+
+    while (shadow.running)
+    {
+        QC_SHADOW_ENTRY entry;
+        bool found = false;
+
+        spinlock_acquire(&shadow.lock);
+
+        if (shadow.count > 0)
+        {
+            entry = shadow.queue[shadow.head];
+            shadow.head = (shadow.head + 1) % QC_SHADOW_QUEUE_SIZE;
+            shadow.count--;
+            found = true;
+        }
+
+        spinlock_release(&shadow.lock);
+
+        if (found)
+        {
+            shadow_compare(&entry);
+        }
+        else
+        {
+            thread_millisleep(10);
+        }
+    }
+
+    shadow.classifier->qc_thread_end();
+}
+
+/**
+ * Starts a shadow classifier. A percentage of the statements whose type is
+ * asked for are classified again by it in the background, and the
+ * disagreements of the two classifiers are logged and counted. Must be
+ * called after qc_init and before the statements are classified.
+ *
+ * @param plugin_name The name of the shadow classifier.
+ * @param plugin_args The arguments of the shadow classifier, may be NULL.
+ * @param sample      The percentage of the statements sampled, 1 to 100.
+ * @param n_threads   The number of threads of the shadow classifier.
+ *
+ * @return True if the shadow classifier was started.
+ */
+bool qc_shadow_start(const char* plugin_name, const char* plugin_args, int sample, int n_threads)
+{
+    QC_TRACE();
+    ss_dassert(classifier);
+    ss_dassert(!shadow.classifier);
+
+    if (sample < 1 || sample > 100 || n_threads < 1)
+    {
+        MXS_ERROR("Invalid sampling percentage %d or number of threads %d of the "
+                  "shadow query classifier.", sample, n_threads);
+        return false;
+    }
+
+    QUERY_CLASSIFIER* plugin = qc_load(plugin_name);
+
+    if (!plugin)
+    {
+        return false;
+    }
+
+    if (plugin == classifier)
+    {
+        MXS_ERROR("The shadow query classifier %s is the query classifier itself.", plugin_name);
+        return false;
+    }
+
+    if ((shadow.property = gwbuf_property_id("qc_shadow")) == 0 ||
+        !plugin->qc_init(plugin_args))
+    {
+        return false;
+    }
+
+    if ((shadow.threads = calloc(n_threads, sizeof(THREAD))) == NULL)
+    {
+        plugin->qc_end();
+        return false;
+    }
+
+    spinlock_init(&shadow.lock);
+    shadow.sample = sample;
+    shadow.classifier = plugin;
+    shadow.running = true;
+
+    for (shadow.n_threads = 0; shadow.n_threads < n_threads; shadow.n_threads++)
+    {
+        if (thread_start(&shadow.threads[shadow.n_threads], shadow_main, NULL) == NULL)
+        {
+            MXS_ERROR("Could not start a thread of the shadow query classifier.");
+            break;
+        }
+    }
+
+    if (shadow.n_threads == 0)
+    {
+        qc_shadow_stop();
+        return false;
+    }
+
+    MXS_NOTICE("Shadow query classifier %s classifies %d%% of the statements in %d threads.",
+               plugin_name, sample, shadow.n_threads);
+    return true;
+}
+
+/**
+ * Stops the shadow classifier. Must be called once nothing is classified
+ * anymore and before qc_end.
+ */
+void qc_shadow_stop(void)
+{
+    QC_TRACE();
+
+    if (shadow.classifier)
+    {
+        shadow.running = false;
+
+        for (int i = 0; i < shadow.n_threads; i++)
+        {
+            thread_wait(shadow.threads[i]);
+        }
+
+        for (; shadow.count > 0; shadow.count--)
+        {
+            gwbuf_free(shadow.queue[shadow.head].stmt);
+            shadow.head = (shadow.head + 1) % QC_SHADOW_QUEUE_SIZE;
+        }
+
+        shadow.classifier->qc_end();
+        shadow.classifier = NULL;
+        free(shadow.threads);
+        shadow.threads = NULL;
+        shadow.n_threads = 0;
+    }
+}
+
+/**
+ * Returns the statistics of the shadow classifier.
+ *
+ * @param stats The statistics.
+ *
+ * @return True if a shadow classifier is in use, false otherwise.
+ */
+bool qc_get_shadow_stats(QC_SHADOW_STATS* stats)
+{
+    QC_TRACE();
+
+    if (!shadow.classifier)
+    {
+        return false;
+    }
+
+    *stats = shadow.stats;
+    return true;
+}
@@ -17,17 +17,26 @@
  * MaxScale contains a number of FIFO queues. This code attempts to provide
  * standard functions for handling them.
  *
+ * The queue is the bounded multi-producer, multi-consumer ring of Dmitry
+ * Vyukov. A producer claims the position at the end by a compare and swap
+ * once the sequence number of its cell shows that the cell was emptied, and
+ * then publishes the entry by setting the sequence number to the position
+ * plus one. A consumer does the same at the start and frees the cell for the
+ * next round of the ring by setting the sequence number to the position plus
+ * the size of the ring.
+ *
  * @verbatim
  * Revision History
  *
  * Date         Who                     Description
  * 27/04/16     Martin Brampton         Initial implementation
+ * 15/10/2016   Core Team               Lock-free queue with wait statistics
  *
  * @endverbatim
  */
 #include <stdlib.h>
 #include <queuemanager.h>
-#include <spinlock.h>
+#include <atomic.h>
 #include <log_manager.h>
 #include <hk_heartbeat.h>
 
@@ -38,7 +47,7 @@
  * for the use of a queue.
  *
  * @param limit         The maximum size of the queue
- * @param timeout       The maximum time for which an entry is valid
+ * @param timeout       The maximum time in seconds for which an entry is valid
  * @return QUEUE_CONFIG A queue configuration and anchor structure
  */
 QUEUE_CONFIG
@@ -51,15 +60,20 @@ QUEUE_CONFIG
         limit = CONNECTION_QUEUE_LIMIT;
     }
     new_queue = (QUEUE_CONFIG *)calloc(1, sizeof(QUEUE_CONFIG));
-    if (new_queue)
+    if (new_queue && (new_queue->cells = (QUEUE_CELL *)calloc(limit, sizeof(QUEUE_CELL))) != NULL)
     {
-        new_queue->queue_size = CONNECTION_QUEUE_LIMIT;
+        new_queue->queue_size = limit;
         new_queue->queue_limit = limit;
         new_queue->timeout = timeout;
-        spinlock_init(&new_queue->queue_lock);
+        for (int i = 0; i < limit; i++)
+        {
+            new_queue->cells[i].sequence = i;
+        }
     }
     else
     {
+        free(new_queue);
+        new_queue = NULL;
         MXS_ERROR("Failed to allocate memory for new queue in mxs_queue_alloc");
     }
     return new_queue;
@@ -75,68 +89,133 @@ QUEUE_CONFIG
  */
 void mxs_queue_free(QUEUE_CONFIG *queue_config)
 {
-    free(queue_config);
+    if (queue_config)
+    {
+        free(queue_config->cells);
+        free(queue_config);
+    }
 }
 
 /**
  * @brief Add an item to a queue
  *
- * Add a new item to a FIFO queue
+ * Add a new item to a FIFO queue, time-stamped with the housekeeper heartbeat
  *
  * @param queue_config  The configuration and anchor structure for the queue
  * @param new_entry     The new entry, to be added
- * @return bool         Whether the enqueue succeeded
+ * @return bool         Whether the enqueue succeeded, false if the queue is full
  */
 bool mxs_enqueue(QUEUE_CONFIG *queue_config, void *new_entry)
 {
-    bool result = false;
+    if (queue_config == NULL)
+    {
+        return false;
+    }
 
-    if (queue_config)
+    unsigned long pos = queue_config->end;
+
+    while (true)
     {
-        spinlock_acquire(&queue_config->queue_lock);
-        if (queue_config->queue_limit < queue_config->queue_size
-            && mxs_queue_count(queue_config) < queue_config->queue_size)
+        QUEUE_CELL *cell = &queue_config->cells[pos % queue_config->queue_size];
+        unsigned long sequence = cell->sequence;
+        __sync_synchronize();
+        long diff = (long)(sequence - pos);
+
+        if (diff == 0)
         {
-            queue_config->queue_array[queue_config->end].queued_object = new_entry;
-            queue_config->queue_array[queue_config->end].heartbeat = hkheartbeat;
-            queue_config->end++;
-            if (queue_config->end >= queue_config->queue_size)
+            /** The cell is free for this position, claim the position */
+            if (__sync_bool_compare_and_swap(&queue_config->end, pos, pos + 1))
             {
-                queue_config->end = 0;
+                cell->entry.queued_object = new_entry;
+                cell->entry.heartbeat = hkheartbeat;
+                /** The entry must be complete before the consumers can see it */
+                __sync_synchronize();
+                cell->sequence = pos + 1;
+                atomic_add(&queue_config->n_queued, 1);
+                return true;
             }
-            result = true;
         }
-        else
+        else if (diff < 0)
         {
-            result = false;
+            /** The cell still holds the entry of the previous round, the queue is full */
+            atomic_add(&queue_config->n_rejected, 1);
+            return false;
         }
-        spinlock_release(&queue_config->queue_lock);
+
+        pos = queue_config->end;
     }
-    return result;
 }
 
 /**
  * @brief Remove an item from a queue
  *
- * Remove an item from a FIFO queue
+ * Remove the oldest item from a FIFO queue and record how long it waited
  *
  * @param queue_config  The configuration and anchor structure for the queue
- * @return QUEUE_ENTRY  A structure defining the removed entry
+ * @param result        The removed entry is copied here
+ * @return bool         True if an entry was removed, false if the queue is empty
  */
-QUEUE_ENTRY *mxs_dequeue(QUEUE_CONFIG *queue_config)
+bool mxs_dequeue(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *result)
 {
-    int count;
-    QUEUE_ENTRY *result = NULL;
+    if (queue_config == NULL)
+    {
+        return false;
+    }
+
+    unsigned long pos = queue_config->start;
 
-    spinlock_acquire(&queue_config->queue_lock);
-    if (NULL == result && (count = mxs_queue_count(queue_config)) > 0)
+    while (true)
     {
-        result = &(queue_config->queue_array[queue_config->start++]);
-        if (queue_config->start >= queue_config->queue_size)
+        QUEUE_CELL *cell = &queue_config->cells[pos % queue_config->queue_size];
+        unsigned long sequence = cell->sequence;
+        __sync_synchronize();
+        long diff = (long)(sequence - (pos + 1));
+
+        if (diff == 0)
         {
-            queue_config->start = 0;
+            /** The cell holds the entry of this position, claim the position */
+            if (__sync_bool_compare_and_swap(&queue_config->start, pos, pos + 1))
+            {
+                *result = cell->entry;
+                /** The entry must be copied before the producers can reuse the cell */
+                __sync_synchronize();
+                cell->sequence = pos + queue_config->queue_size;
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            /** The entry of this position has not been published, the queue is empty */
+            return false;
         }
+
+        pos = queue_config->start;
+    }
+
+    int wait = (int)(hkheartbeat - result->heartbeat);
+    int max;
+
+    atomic_add(mxs_queue_expired(queue_config, result) ?
+               &queue_config->n_expired : &queue_config->n_released, 1);
+    atomic_add(&queue_config->total_wait, wait);
+    while (wait > (max = queue_config->max_wait) &&
+           !__sync_bool_compare_and_swap(&queue_config->max_wait, max, wait))
+    {
+        ;
     }
-    spinlock_release(&queue_config->queue_lock);
-    return result;
+
+    return true;
+}
+
+/**
+ * @brief Check whether an entry has been queued for longer than the timeout
+ *
+ * @param queue_config  The configuration and anchor structure for the queue
+ * @param entry         An entry removed from the queue
+ * @return bool         True if the entry is no longer valid
+ */
+bool mxs_queue_expired(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *entry)
+{
+    /** The heartbeat is incremented every 100 milliseconds */
+    return hkheartbeat - entry->heartbeat > (long)queue_config->timeout * 10;
 }
@@ -17,35 +17,46 @@
  * See http://www0.cs.ucl.ac.uk/staff/d.jones/GoodPracticeRNG.pdf for discussion of random
  * number generators (RNGs).
  *
+ * Each thread has its own generator, seeded from /dev/urandom on its first
+ * call, so the threads never wait for each other for a random number.
+ *
  * @verbatim
  * Revision History
  *
  * Date         Who             Description
  * 26/08/15     Martin Brampton Initial implementation
+ * 15/10/2016   Core Team       A generator for each thread
  *
  * @endverbatim
  */
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <spinlock.h>
+#include <platform.h>
 #include <random_jkiss.h>
 
 /* Public domain code for JKISS RNG - Comment header added */
 
+/**
+ * The state of the generator of a thread
+ */
+typedef struct
+{
+    unsigned int x, y, z, c;    /*< Seed variables */
+    bool         init;          /*< Whether the generator has been seeded */
+} JKISS_STATE;
+
 /* If possible, the seed variables will be set from /dev/urandom but
  * should that fail, these arbitrary numbers will be used as a last resort.
  */
-static unsigned int x = 123456789, y = 987654321, z = 43219876, c = 6543217; /* Seed variables */
-static bool init = false;
-
-static SPINLOCK random_jkiss_spinlock = SPINLOCK_INIT;
+static thread_local JKISS_STATE state = {123456789, 987654321, 43219876, 6543217, false};
 
-static unsigned int random_jkiss_devrand(void);
-static void random_init_jkiss(void);
+static bool random_jkiss_devrand(unsigned int *seed, int n);
 
 /***
  *
@@ -58,89 +69,92 @@ unsigned int
 random_jkiss(void)
 {
     unsigned long long t;
-    unsigned int result;
 
-    spinlock_acquire(&random_jkiss_spinlock);
-    if (!init)
+    if (!state.init)
     {
-        /* Must set init first because initialisation calls this function */
-        init = true;
-        spinlock_release(&random_jkiss_spinlock);
-        random_init_jkiss();
-        spinlock_acquire(&random_jkiss_spinlock);
+        random_jkiss_init();
     }
-    x = 314527869 * x + 1234567;
-    y ^= y << 5;
-    y ^= y >> 7;
-    y ^= y << 22;
-    t = 4294584393ULL * z + c;
-    c = t >> 32;
-    z = t;
-    result = x + y + z;
-    spinlock_release(&random_jkiss_spinlock);
-    return result;
+    state.x = 314527869 * state.x + 1234567;
+    state.y ^= state.y << 5;
+    state.y ^= state.y >> 7;
+    state.y ^= state.y << 22;
+    t = 4294584393ULL * state.z + state.c;
+    state.c = t >> 32;
+    state.z = t;
+    return state.x + state.y + state.z;
 }
 
 /* Own code adapted from http://www0.cs.ucl.ac.uk/staff/d.jones/GoodPracticeRNG.pdf */
 
 /***
  *
- * Obtain a seed random number from /dev/urandom if available.
+ * Obtain seed random numbers from /dev/urandom if available.
  *
- * @return  uint    Random number
+ * @param   seed    Array for the random numbers
+ * @param   n       The number of random numbers to read
+ * @return  bool    True if the numbers were read
  *
  */
-static unsigned int
-random_jkiss_devrand(void)
+static bool
+random_jkiss_devrand(unsigned int *seed, int n)
 {
     int fn;
-    unsigned int r;
+    bool rval;
 
     if ((fn = open("/dev/urandom", O_RDONLY)) == -1)
     {
-        return 0;
+        return false;
     }
 
-    if (read(fn, &r, sizeof(r)) != sizeof(r))
-    {
-        r = 0;
-    }
+    rval = read(fn, seed, n * sizeof(*seed)) == (ssize_t)(n * sizeof(*seed));
     close(fn);
-    return r;
+    return rval;
 }
 
 /***
  *
- * Initialise the generator using /dev/urandom if available, and warm up
- * with 1000 iterations
+ * Initialise the generator of the calling thread using /dev/urandom if
+ * available, and warm up with 100 iterations. The generator is initialised
+ * by its first use, threads that should not read /dev/urandom later on call
+ * this when they start.
  *
  */
-static void
-random_init_jkiss(void)
+void
+random_jkiss_init(void)
 {
-    int newrand, i;
+    unsigned int seed[4];
+    int i;
 
-    spinlock_acquire(&random_jkiss_spinlock);
-    if ((newrand = random_jkiss_devrand()) != 0)
+    if (state.init)
     {
-        x = newrand;
+        return;
     }
 
-    if ((newrand = random_jkiss_devrand()) != 0)
-    {
-        y = newrand;
-    }
+    /* Must set init first because the warm up calls random_jkiss */
+    state.init = true;
 
-    if ((newrand = random_jkiss_devrand()) != 0)
+    if (random_jkiss_devrand(seed, 4))
     {
-        z = newrand;
+        /* y and z must not be zero */
+        if (seed[0] != 0)
+        {
+            state.x = seed[0];
+        }
+        if (seed[1] != 0)
+        {
+            state.y = seed[1];
+        }
+        if (seed[2] != 0)
+        {
+            state.z = seed[2];
+        }
+        state.c = seed[3] % 698769068 + 1; /* Should be less than 698769069 */
     }
-
-    if ((newrand = random_jkiss_devrand()) != 0)
+    else
     {
-        c = newrand % 698769068 + 1; /* Should be less than 698769069 */
+        /* Keep the threads from all producing the same sequence */
+        state.x ^= (unsigned int)(uintptr_t)pthread_self();
     }
-    spinlock_release(&random_jkiss_spinlock);
 
     /* "Warm up" our random number generator */
     for (i = 0; i < 100; i++)
@@ -19,21 +19,28 @@
  *
  * Date         Who             Description
  * 17/02/15     Mark Riddoch    Initial implementation
+ * 15/10/2016   Core Team       Write the rows in batches
+ * 15/10/2016   Core Team       Server status of the EOF packets
+ * 15/10/2016   Core Team       Column lists and conditions
  *
  * @endverbatim
  */
 
+#include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <resultset.h>
 #include <buffer.h>
 #include <dcb.h>
+#include <skygw_utils.h>
 
 
 static int mysql_send_fieldcount(DCB *, int);
 static int mysql_send_columndef(DCB *, char *, int, int, uint8_t);
-static int mysql_send_eof(DCB *, int);
-static int mysql_send_row(DCB *, RESULT_ROW *, int);
+static int mysql_send_eof(DCB *, int, uint16_t);
+static GWBUF *mysql_make_row(RESULTSET *, RESULT_ROW *, int);
+static RESULT_ROW *resultset_next_row(RESULTSET *);
 
 
 /**
@@ -54,6 +61,10 @@ resultset_create(RESULT_ROW_CB func, void *data)
         rval->column = NULL;
         rval->userdata = data;
         rval->fetchrow = func;
+        rval->status = 0x0002;      // Autocommit enabled
+        rval->where = NULL;
+        rval->select = NULL;
+        rval->n_select = 0;
     }
     return rval;
 }
@@ -79,6 +90,14 @@ resultset_free(RESULTSET *resultset)
             resultset_column_free(col);
             col = next;
         }
+        while (resultset->where)
+        {
+            RESULT_COND *cond = resultset->where;
+            resultset->where = cond->next;
+            free(cond->value);
+            free(cond);
+        }
+        free(resultset->select);
         free(resultset);
     }
 }
@@ -128,6 +147,268 @@ resultset_add_column(RESULTSET *set, char *name, int len, RESULT_COL_TYPE type)
     return 1;
 }
 
+/**
+ * Find a column of a result set by its name, ignoring the case
+ *
+ * @param set   The result set
+ * @param name  The column name
+ * @return      The index of the column or -1 if there is no such column
+ */
+static int
+resultset_find_column(RESULTSET *set, const char *name)
+{
+    RESULT_COLUMN *col = set->column;
+
+    for (int i = 0; col; i++, col = col->next)
+    {
+        if (strcasecmp(col->name, name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Return a column of a result set by its index
+ *
+ * @param set   The result set
+ * @param index The index of the column
+ * @return      The column or NULL if there is no such column
+ */
+static RESULT_COLUMN *
+resultset_column_at(RESULTSET *set, int index)
+{
+    RESULT_COLUMN *col = set->column;
+
+    while (col && index-- > 0)
+    {
+        col = col->next;
+    }
+    return col;
+}
+
+/** The number of columns streamed to the client */
+#define RESULTSET_N_OUTPUT(set) ((set)->select ? (set)->n_select : (set)->n_cols)
+
+/** The index of the i:th column streamed to the client */
+#define RESULTSET_OUTPUT_COL(set, i) ((set)->select ? (set)->select[i] : (i))
+
+/**
+ * Add a column to the columns streamed to the client. By default all the
+ * columns are streamed, once a column is selected only the selected columns
+ * are, in the order they were selected.
+ *
+ * @param set   The result set
+ * @param name  The column name
+ * @return      1 if the column was selected, 0 if there is no such column or
+ *              memory allocation failed
+ */
+int
+resultset_select_column(RESULTSET *set, const char *name)
+{
+    int col = resultset_find_column(set, name);
+    int *select;
+
+    if (col < 0 || (select = realloc(set->select, (set->n_select + 1) * sizeof(int))) == NULL)
+    {
+        return 0;
+    }
+    select[set->n_select++] = col;
+    set->select = select;
+    return 1;
+}
+
+/**
+ * Add a condition that the streamed rows must satisfy
+ *
+ * @param set   The result set
+ * @param name  The name of the column the condition is on
+ * @param value The value the column must be equal to, ignoring the case, or
+ *              the LIKE pattern it must match
+ * @param like  Whether value is a LIKE pattern
+ * @return      1 if the condition was added, 0 if there is no such column or
+ *              memory allocation failed
+ */
+int
+resultset_add_condition(RESULTSET *set, const char *name, const char *value, bool like)
+{
+    int col = resultset_find_column(set, name);
+    RESULT_COND *cond;
+
+    if (col < 0 || (cond = (RESULT_COND *)malloc(sizeof(RESULT_COND))) == NULL)
+    {
+        return 0;
+    }
+    if ((cond->value = strdup(value)) == NULL)
+    {
+        free(cond);
+        return 0;
+    }
+    cond->col = col;
+    cond->like = like;
+    cond->next = set->where;
+    set->where = cond;
+    return 1;
+}
+
+/**
+ * Check whether a row callback has to set a column. The columns that are
+ * neither streamed nor in a condition may be left NULL, which saves the
+ * callbacks the work of formatting values that are thrown away.
+ *
+ * @param set   The result set
+ * @param col   The index of the column
+ * @return      True if the column is needed
+ */
+bool
+resultset_column_needed(RESULTSET *set, int col)
+{
+    if (set->select == NULL)
+    {
+        return true;
+    }
+    for (int i = 0; i < set->n_select; i++)
+    {
+        if (set->select[i] == col)
+        {
+            return true;
+        }
+    }
+    for (RESULT_COND *cond = set->where; cond; cond = cond->next)
+    {
+        if (cond->col == col)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Check a value against a condition
+ *
+ * @param cond  The condition
+ * @param value The value, NULL for SQL NULL which satisfies no condition
+ * @return      True if the value satisfies the condition
+ */
+static bool
+resultset_cond_matches(RESULT_COND *cond, const char *value)
+{
+    if (value == NULL)
+    {
+        return false;
+    }
+    return cond->like ? resultset_like(cond->value, value) : strcasecmp(cond->value, value) == 0;
+}
+
+/**
+ * Check a value against the conditions on a column. The row callbacks can use
+ * this to skip an item before making a row of it, the rows they return are
+ * checked in any case.
+ *
+ * @param set   The result set
+ * @param col   The index of the column
+ * @param value The value of the column, NULL for SQL NULL
+ * @return      True if the value satisfies the conditions on the column
+ */
+bool
+resultset_value_matches(RESULTSET *set, int col, const char *value)
+{
+    for (RESULT_COND *cond = set->where; cond; cond = cond->next)
+    {
+        if (cond->col == col && !resultset_cond_matches(cond, value))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Match a string against a SQL LIKE pattern, ignoring the case. A % matches
+ * any number of characters, an _ matches one character and a backslash
+ * escapes the character that follows it.
+ *
+ * @param pattern       The pattern
+ * @param str           The string
+ * @return              True if the string matches the pattern
+ */
+bool
+resultset_like(const char *pattern, const char *str)
+{
+    while (*pattern)
+    {
+        if (*pattern == '%')
+        {
+            while (*pattern == '%')
+            {
+                pattern++;
+            }
+            if (*pattern == '\0')
+            {
+                return true;
+            }
+            for (; *str; str++)
+            {
+                if (resultset_like(pattern, str))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+        if (*str == '\0')
+        {
+            return false;
+        }
+        if (*pattern != '_')
+        {
+            if (*pattern == '\\' && pattern[1])
+            {
+                pattern++;
+            }
+            if (tolower((unsigned char)*pattern) != tolower((unsigned char)*str))
+            {
+                return false;
+            }
+        }
+        pattern++;
+        str++;
+    }
+    return *str == '\0';
+}
+
+/**
+ * Fetch the next row that satisfies the conditions of a result set. The rows
+ * that do not are freed without being streamed.
+ *
+ * @param set   The result set
+ * @return      The row or NULL if there are no more rows
+ */
+static RESULT_ROW *
+resultset_next_row(RESULTSET *set)
+{
+    RESULT_ROW *row;
+
+    while ((row = (*set->fetchrow)(set, set->userdata)) != NULL)
+    {
+        RESULT_COND *cond = set->where;
+
+        while (cond && resultset_cond_matches(cond, cond->col < row->n_cols ?
+                                              row->cols[cond->col] : NULL))
+        {
+            cond = cond->next;
+        }
+        if (cond == NULL)
+        {
+            return row;
+        }
+        resultset_free_row(row);
+    }
+    return NULL;
+}
+
 /**
  * Free a result set column
  *
@@ -243,21 +524,46 @@ resultset_stream_mysql(RESULTSET *set, DCB *dcb)
     RESULT_ROW *row;
     uint8_t seqno = 2;
 
-    mysql_send_fieldcount(dcb, set->n_cols);
+    mysql_send_fieldcount(dcb, RESULTSET_N_OUTPUT(set));
 
-    col = set->column;
-    while (col)
+    for (int i = 0; i < RESULTSET_N_OUTPUT(set); i++)
     {
+        col = resultset_column_at(set, RESULTSET_OUTPUT_COL(set, i));
         mysql_send_columndef(dcb, col->name, col->type, col->len, seqno++);
-        col = col->next;
     }
-    mysql_send_eof(dcb, seqno++);
-    while ((row = (*set->fetchrow)(set, set->userdata)) != NULL)
+    mysql_send_eof(dcb, seqno++, set->status);
+
+    /** Each write is a separate send to the client, so the rows are batched */
+    GWBUF *batch = NULL;
+    int rows = 0;
+    size_t bytes = 0;
+
+    while ((row = resultset_next_row(set)) != NULL)
     {
-        mysql_send_row(dcb, row, seqno++);
+        GWBUF *pkt = mysql_make_row(set, row, seqno++);
         resultset_free_row(row);
+
+        if (pkt)
+        {
+            bytes += GWBUF_LENGTH(pkt);
+            batch = gwbuf_append(batch, pkt);
+            rows++;
+        }
+
+        if (rows >= RESULTSET_BATCH_ROWS || bytes >= RESULTSET_BATCH_BYTES)
+        {
+            dcb->func.write(dcb, batch);
+            batch = NULL;
+            rows = 0;
+            bytes = 0;
+        }
     }
-    mysql_send_eof(dcb, seqno);
+
+    if (batch)
+    {
+        dcb->func.write(dcb, batch);
+    }
+    mysql_send_eof(dcb, seqno, set->status);
 }
 
 /**
@@ -356,10 +662,11 @@ mysql_send_columndef(DCB *dcb, char *name, int type, int len, uint8_t seqno)
  *
  * @param dcb           The client connection
  * @param seqno         The sequence number of the EOF packet
+ * @param status        The server status
  * @return              Non-zero on success
  */
 static int
-mysql_send_eof(DCB *dcb, int seqno)
+mysql_send_eof(DCB *dcb, int seqno, uint16_t status)
 {
     GWBUF   *pkt;
     uint8_t *ptr;
@@ -376,40 +683,42 @@ mysql_send_eof(DCB *dcb, int seqno)
     *ptr++ = 0xfe;                          // Length of result string
     *ptr++ = 0x00;                          // No Errors
     *ptr++ = 0x00;
-    *ptr++ = 0x02;                          // Autocommit enabled
-    *ptr++ = 0x00;
+    *ptr++ = status & 0xff;                 // Server status
+    *ptr++ = status >> 8;
     return dcb->func.write(dcb, pkt);
 }
 
 
 
 /**
- * Send a row packet in a response packet sequence.
+ * Create a row packet of a response packet sequence.
  *
- * @param dcb           The client connection
+ * @param set           The result set of the row
  * @param row           The row to send
- * @param seqno         The sequence number of the EOF packet
- * @return              Non-zero on success
+ * @param seqno         The sequence number of the row packet
+ * @return              The packet or NULL on error
  */
-static int
-mysql_send_row(DCB *dcb, RESULT_ROW *row, int seqno)
+static GWBUF *
+mysql_make_row(RESULTSET *set, RESULT_ROW *row, int seqno)
 {
     GWBUF *pkt;
     int i, len = 4;
     uint8_t *ptr;
 
-    for (i = 0; i < row->n_cols; i++)
+    for (i = 0; i < RESULTSET_N_OUTPUT(set); i++)
     {
-        if (row->cols[i])
+        char *value = row->cols[RESULTSET_OUTPUT_COL(set, i)];
+
+        if (value)
         {
-            len += strlen(row->cols[i]);
+            len += strlen(value);
         }
         len++;
     }
 
     if ((pkt = gwbuf_alloc(len)) == NULL)
     {
-        return 0;
+        return NULL;
     }
     ptr = GWBUF_DATA(pkt);
     len -= 4;
@@ -417,13 +726,15 @@ mysql_send_row(DCB *dcb, RESULT_ROW *row, int seqno)
     *ptr++ = (len >> 8) & 0xff;
     *ptr++ = (len >> 16) & 0xff;
     *ptr++ = seqno;
-    for (i = 0; i < row->n_cols; i++)
+    for (i = 0; i < RESULTSET_N_OUTPUT(set); i++)
     {
-        if (row->cols[i])
+        char *value = row->cols[RESULTSET_OUTPUT_COL(set, i)];
+
+        if (value)
         {
-            len = strlen(row->cols[i]);
+            len = strlen(value);
             *ptr++ = len;
-            strncpy((char *)ptr, row->cols[i], len);
+            strncpy((char *)ptr, value, len);
             ptr += len;
         }
         else
@@ -432,7 +743,7 @@ mysql_send_row(DCB *dcb, RESULT_ROW *row, int seqno)
         }
     }
 
-    return dcb->func.write(dcb, pkt);
+    return pkt;
 }
 
 /**
@@ -462,6 +773,75 @@ value_is_numeric(char *value)
     return rval;
 }
 
+/**
+ * Text that is written to a DCB in one piece
+ */
+typedef struct
+{
+    char   *data;
+    size_t len;
+    size_t size;
+} RESULT_TEXT;
+
+/**
+ * Append formatted text to a text batch
+ *
+ * @param text  The batch
+ * @param fmt   The format
+ */
+static void
+text_printf(RESULT_TEXT *text, const char *fmt, ...)
+{
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = vsnprintf(text->data + text->len, text->size - text->len, fmt, args);
+    va_end(args);
+
+    if (n >= 0 && text->len + n >= text->size)
+    {
+        size_t size = MAX(text->size * 2, text->len + n + 1);
+        char *data = realloc(text->data, size);
+
+        if (data == NULL)
+        {
+            /** Drop the text that did not fit */
+            text->data[text->len] = '\0';
+            return;
+        }
+
+        text->data = data;
+        text->size = size;
+        va_start(args, fmt);
+        n = vsnprintf(text->data + text->len, text->size - text->len, fmt, args);
+        va_end(args);
+    }
+
+    if (n > 0)
+    {
+        text->len += n;
+    }
+}
+
+/**
+ * Write a text batch to a DCB and empty the batch
+ *
+ * @param text  The batch
+ * @param dcb   The DCB
+ */
+static void
+text_flush(RESULT_TEXT *text, DCB *dcb)
+{
+    GWBUF *buf;
+
+    if (text->len > 0 && (buf = gwbuf_alloc_and_load(text->len, text->data)) != NULL)
+    {
+        dcb->func.write(dcb, buf);
+    }
+    text->len = 0;
+}
+
 /**
  * Stream a result set encoding it as a JSON object
  * Each row is retrieved by calling the function passed in the
@@ -476,44 +856,59 @@ resultset_stream_json(RESULTSET *set, DCB *dcb)
     RESULT_COLUMN *col;
     RESULT_ROW *row;
     int rowno = 0;
+    RESULT_TEXT text;
 
-    dcb_printf(dcb, "[ ");
-    while ((row = (*set->fetchrow)(set, set->userdata)) != NULL)
+    text.size = RESULTSET_BATCH_BYTES;
+    text.len = 0;
+
+    if ((text.data = malloc(text.size)) == NULL)
+    {
+        return;
+    }
+
+    text_printf(&text, "[ ");
+    while ((row = resultset_next_row(set)) != NULL)
     {
-        int i = 0;
         if (rowno++ > 0)
         {
-            dcb_printf(dcb, ",\n");
+            text_printf(&text, ",\n");
         }
-        dcb_printf(dcb, "{ ");
-        col = set->column;
-        while (col)
+        text_printf(&text, "{ ");
+        for (int i = 0; i < RESULTSET_N_OUTPUT(set); i++)
         {
-            dcb_printf(dcb, "\"%s\" : ", col->name);
-            if (row->cols[i])
+            char *value = row->cols[RESULTSET_OUTPUT_COL(set, i)];
+
+            col = resultset_column_at(set, RESULTSET_OUTPUT_COL(set, i));
+            text_printf(&text, "\"%s\" : ", col->name);
+            if (value)
             {
-                if (value_is_numeric(row->cols[i]))
+                if (value_is_numeric(value))
                 {
-                    dcb_printf(dcb, "%s", row->cols[i]);
+                    text_printf(&text, "%s", value);
                 }
                 else
                 {
-                    dcb_printf(dcb, "\"%s\"", row->cols[i]);
+                    text_printf(&text, "\"%s\"", value);
                 }
             }
             else
             {
-                dcb_printf(dcb, "null");
+                text_printf(&text, "null");
             }
-            i++;
-            col = col->next;
-            if (col)
+            if (i + 1 < RESULTSET_N_OUTPUT(set))
             {
-                dcb_printf(dcb, ", ");
+                text_printf(&text, ", ");
             }
         }
         resultset_free_row(row);
-        dcb_printf(dcb, "}");
+        text_printf(&text, "}");
+
+        if (rowno % RESULTSET_BATCH_ROWS == 0 || text.len >= RESULTSET_BATCH_BYTES)
+        {
+            text_flush(&text, dcb);
+        }
     }
-    dcb_printf(dcb, "]\n");
+    text_printf(&text, "]\n");
+    text_flush(&text, dcb);
+    free(text.data);
 }
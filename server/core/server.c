@@ -29,6 +29,10 @@
  * 30/10/14     Massimiliano Pinto      Addition of SERVER_MASTER_STICKINESS description
  * 01/06/15     Massimiliano Pinto      Addition of server_update_address/port
  * 19/06/15     Martin Brampton         Extra code for persistent connections
+ * 15/10/2016   Core Team               Addition of Unix domain socket servers
+ * 15/10/2016   Core Team               Print the replication lag in milliseconds
+ * 15/10/2016   Core Team               Addition of cached system variables
+ * 15/10/2016   Core Team               Addition of the connection rate limit
  *
  * @endverbatim
  */
@@ -43,9 +47,13 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <gw_ssl.h>
+#include <maxconfig.h>
+#include <snapshot.h>
 
-static SPINLOCK server_spin = SPINLOCK_INIT;
+static SPINLOCK server_spin = SPINLOCK_INIT_NAMED("servers");
 static SERVER *allServers = NULL;
+static int n_server_states = 0;  /*< The next free index in the server states */
+static SNAPSHOT server_states_snap = SNAPSHOT_INIT;
 
 static void spin_reporter(void *, char *, int);
 static void server_parameter_free(SERVER_PARAM *tofree);
@@ -64,11 +72,18 @@ SERVER *
 server_alloc(char *servname, char *protocol, unsigned short port)
 {
     SERVER *server;
+    int n_pools = MAX(config_threadcount(), 1);
+    int i;
 
     if ((server = (SERVER *)calloc(1, sizeof(SERVER))) == NULL)
     {
         return NULL;
     }
+    if ((server->persistent = (SERVER_POOL *)calloc(n_pools, sizeof(SERVER_POOL))) == NULL)
+    {
+        free(server);
+        return NULL;
+    }
 #if defined(SS_DEBUG)
     server->server_chk_top = CHK_NUM_SERVER;
     server->server_chk_tail = CHK_NUM_SERVER;
@@ -79,22 +94,34 @@ server_alloc(char *servname, char *protocol, unsigned short port)
     server->status = SERVER_RUNNING;
     server->node_id = -1;
     server->rlag = -2;
+    server->rlag_us = -2;
+    server->load_weight = SERVER_LOAD_WEIGHT_MAX;
     server->master_id = -1;
     server->depth = -1;
     server->parameters = NULL;
     server->server_string = NULL;
     spinlock_init(&server->lock);
-    server->persistent = NULL;
+    spinlock_init(&server->dcbs_lock);
+    spinlock_init(&server->connq.lock);
+    ilist_init(&server->connq.queue);
+    timer_init(&server->connq.timer, dcb_connect_queued, server);
+    for (i = 0; i < n_pools; i++)
+    {
+        spinlock_init(&server->persistent[i].lock);
+    }
+    server->n_persistent_pools = n_pools;
     server->persistmax = 0;
     server->persistmaxtime = 0;
     server->persistpoolmax = 0;
+    server->persistminsize = 0;
     server->slave_configured = false;
-    spinlock_init(&server->persistlock);
 
     spinlock_acquire(&server_spin);
+    server->state_index = n_server_states++;
     server->next = allServers;
     allServers = server;
     spinlock_release(&server_spin);
+    server_states_publish();
 
     return server;
 }
@@ -130,83 +157,153 @@ server_free(SERVER *tofreeserver)
         }
     }
     spinlock_release(&server_spin);
+    server_states_publish();
 
     /* Clean up session and free the memory */
     free(tofreeserver->name);
+    free(tofreeserver->socket);
     free(tofreeserver->protocol);
     free(tofreeserver->unique_name);
     free(tofreeserver->server_string);
-    server_parameter_free(tofreeserver->parameters);
-
-    if (tofreeserver->persistent)
+    for (int i = 0; i < SERVER_N_VARS; i++)
     {
-        dcb_persistent_clean_count(tofreeserver->persistent, true);
+        free(tofreeserver->variables[i]);
     }
+    server_parameter_free(tofreeserver->parameters);
+
+    timer_remove(&tofreeserver->connq.timer);
+    dcb_persistent_clean_count(tofreeserver, NULL, true);
+    free(tofreeserver->persistent);
+    latency_free(&tofreeserver->latency);
     free(tofreeserver);
     return 1;
 }
 
+/**
+ * Return the persistent connection pool of a DCB, or of the calling thread if
+ * the DCB is NULL
+ *
+ * @param       server      The server of the pool
+ * @param       dcb         The DCB or NULL
+ * @return      The pool
+ */
+SERVER_POOL *
+server_persistent_pool(SERVER *server, DCB *dcb)
+{
+    return &server->persistent[poll_dcb_thread(dcb) % server->n_persistent_pools];
+}
+
+/**
+ * Calculate the key of a persistent connection
+ *
+ * @param       user        The name of the user of the connection
+ * @param       protocol    The name of the protocol of the connection
+ * @return      The hash of the user and the protocol
+ */
+unsigned int
+server_persistent_key(const char *user, const char *protocol)
+{
+    unsigned int key = 2166136261u;
+    const char *ptr;
+
+    for (ptr = user ? user : ""; *ptr; ptr++)
+    {
+        key = (key ^ (unsigned char)*ptr) * 16777619u;
+    }
+    key = (key ^ '/') * 16777619u;
+    for (ptr = protocol ? protocol : ""; *ptr; ptr++)
+    {
+        key = (key ^ (unsigned char)*ptr) * 16777619u;
+    }
+    return key;
+}
+
 /**
  * Get a DCB from the persistent connection pool, if possible
  *
+ * Only the pool of the polling thread that owns the client DCB is searched,
+ * the calling thread may have stolen the client DCB from its owner. The DCB
+ * released last is found first, as its data is the most likely to be in the
+ * cache.
+ *
  * @param       server      The server to set the name on
  * @param       user        The name of the user needing the connection
  * @param       protocol    The name of the protocol needed for the connection
+ * @param       client_dcb  The client DCB of the session or NULL
  */
 DCB *
-server_get_persistent(SERVER *server, char *user, const char *protocol)
+server_get_persistent(SERVER *server, char *user, const char *protocol, DCB *client_dcb)
 {
     DCB *dcb, *previous = NULL;
+    SERVER_POOL *pool;
+    DCB **stack;
+    unsigned int key;
+    bool stale = false;
+
+    if (server->stats.n_persistent <= 0 || !(server->status & SERVER_RUNNING))
+    {
+        return NULL;
+    }
 
-    if (server->persistent
-        && dcb_persistent_clean_count(server->persistent, false)
-        && server->persistent
-        && (server->status & SERVER_RUNNING))
+    pool = server_persistent_pool(server, client_dcb);
+    key = server_persistent_key(user, protocol);
+    stack = &pool->stacks[key % SERVER_POOL_BUCKETS];
+
+    spinlock_acquire(&pool->lock);
+    dcb = *stack;
+    while (dcb)
     {
-        spinlock_acquire(&server->persistlock);
-        dcb = server->persistent;
-        while (dcb)
+        if (dcb->persistentkey == key
+            && dcb->user
+            && dcb->protoname
+            && !dcb->dcb_errhandle_called
+            && !(dcb->flags & DCBF_HUNG)
+            && !SERVER_PERSISTENT_EXPIRED(server, dcb)
+            && poll_dcb_same_owner(dcb, client_dcb)
+            && 0 == strcmp(dcb->user, user)
+            && 0 == strcmp(dcb->protoname, protocol))
         {
-            if (dcb->user
-                && dcb->protoname
-                && !dcb-> dcb_errhandle_called
-                && !(dcb->flags & DCBF_HUNG)
-                && 0 == strcmp(dcb->user, user)
-                && 0 == strcmp(dcb->protoname, protocol))
+            if (NULL == previous)
             {
-                if (NULL == previous)
-                {
-                    server->persistent = dcb->nextpersistent;
-                }
-                else
-                {
-                    previous->nextpersistent = dcb->nextpersistent;
-                }
-                free(dcb->user);
-                dcb->user = NULL;
-                spinlock_release(&server->persistlock);
-                atomic_add(&server->stats.n_persistent, -1);
-                atomic_add(&server->stats.n_current, 1);
-                return dcb;
+                *stack = dcb->nextpersistent;
             }
             else
             {
-                MXS_DEBUG("%lu [server_get_persistent] Rejected dcb "
-                          "%p from pool, user %s looking for %s, protocol %s "
-                          "looking for %s, hung flag %s, error handle called %s.",
-                          pthread_self(),
-                          dcb,
-                          dcb->user ? dcb->user : "NULL",
-                          user,
-                          dcb->protoname ? dcb->protoname : "NULL",
-                          protocol,
-                          (dcb->flags & DCBF_HUNG) ? "true" : "false",
-                          dcb-> dcb_errhandle_called ? "true" : "false");
+                previous->nextpersistent = dcb->nextpersistent;
+            }
+            free(dcb->user);
+            dcb->user = NULL;
+            spinlock_release(&pool->lock);
+            atomic_add(&server->stats.n_persistent, -1);
+            atomic_add(&server->stats.n_current, 1);
+            return dcb;
+        }
+        else
+        {
+            MXS_DEBUG("%lu [server_get_persistent] Rejected dcb "
+                      "%p from pool, user %s looking for %s, protocol %s "
+                      "looking for %s, hung flag %s, error handle called %s.",
+                      pthread_self(),
+                      dcb,
+                      dcb->user ? dcb->user : "NULL",
+                      user,
+                      dcb->protoname ? dcb->protoname : "NULL",
+                      protocol,
+                      (dcb->flags & DCBF_HUNG) ? "true" : "false",
+                      dcb-> dcb_errhandle_called ? "true" : "false");
+            if (dcb->dcb_errhandle_called || SERVER_PERSISTENT_EXPIRED(server, dcb))
+            {
+                stale = true;
             }
-            previous = dcb;
-            dcb = dcb->nextpersistent;
         }
-        spinlock_release(&server->persistlock);
+        previous = dcb;
+        dcb = dcb->nextpersistent;
+    }
+    spinlock_release(&pool->lock);
+
+    if (stale)
+    {
+        dcb_persistent_clean_count(server, pool, false);
     }
     return NULL;
 }
@@ -405,6 +502,10 @@ dprintAllServersJson(DCB *dcb)
             {
                 dcb_printf(dcb, "    \"slaveDelay\": \"%d\",\n", server->rlag);
             }
+            if (server->rlag_us >= 0)
+            {
+                dcb_printf(dcb, "    \"slaveDelayMs\": \"%.3f\",\n", server->rlag_us / 1000.0);
+            }
         }
         if (server->node_ts > 0)
         {
@@ -447,7 +548,14 @@ dprintServer(DCB *dcb, SERVER *server)
     dcb_printf(dcb, "\tStatus:                              %s\n", stat);
     free(stat);
     dcb_printf(dcb, "\tProtocol:                            %s\n", server->protocol);
-    dcb_printf(dcb, "\tPort:                                %d\n", server->port);
+    if (server->socket)
+    {
+        dcb_printf(dcb, "\tSocket:                              %s\n", server->socket);
+    }
+    else
+    {
+        dcb_printf(dcb, "\tPort:                                %d\n", server->port);
+    }
     if (server->server_string)
     {
         dcb_printf(dcb, "\tServer Version:                      %s\n", server->server_string);
@@ -478,6 +586,14 @@ dprintServer(DCB *dcb, SERVER *server)
         {
             dcb_printf(dcb, "\tSlave delay:                         %d\n", server->rlag);
         }
+        if (server->rlag_us >= 0)
+        {
+            dcb_printf(dcb, "\tSlave delay (ms):                    %.3f\n", server->rlag_us / 1000.0);
+        }
+    }
+    if (server->load_weight < SERVER_LOAD_WEIGHT_MAX)
+    {
+        dcb_printf(dcb, "\tLoad weight:                         %.1f%%\n", server->load_weight / 10.0);
     }
     if (server->node_ts > 0)
     {
@@ -499,14 +615,28 @@ dprintServer(DCB *dcb, SERVER *server)
     dcb_printf(dcb, "\tNumber of connections:               %d\n", server->stats.n_connections);
     dcb_printf(dcb, "\tCurrent no. of conns:                %d\n", server->stats.n_current);
     dcb_printf(dcb, "\tCurrent no. of operations:           %d\n", server->stats.n_current_ops);
+    latency_print(dcb, &server->latency);
     if (server->persistpoolmax)
     {
         dcb_printf(dcb, "\tPersistent pool size:                %d\n", server->stats.n_persistent);
         dcb_printf(dcb, "\tPersistent measured pool size:       %d\n",
-                   dcb_persistent_clean_count(server->persistent, false));
+                   dcb_persistent_clean_count(server, NULL, false));
         dcb_printf(dcb, "\tPersistent actual size max:          %d\n", server->persistmax);
         dcb_printf(dcb, "\tPersistent pool size limit:          %ld\n", server->persistpoolmax);
         dcb_printf(dcb, "\tPersistent max time (secs):          %ld\n", server->persistmaxtime);
+        dcb_printf(dcb, "\tPersistent pool minimum size:        %ld\n", server->persistminsize);
+    }
+    if (SERVER_CONNECT_LIMITED(server))
+    {
+        dcb_printf(dcb, "\tConnection rate limit (per sec):     %d\n", server->connect_rate);
+        dcb_printf(dcb, "\tMaximum concurrent handshakes:       %d\n", server->max_handshakes);
+        dcb_printf(dcb, "\tCurrent no. of handshakes:           %d\n",
+                   server->connq.n_handshakes);
+        dcb_printf(dcb, "\tCurrent no. of queued connections:   %d\n", server->connq.n_queued);
+    }
+    if (server->compression)
+    {
+        dcb_printf(dcb, "\tCompressed protocol:                 Enabled\n");
     }
     if (server->server_ssl)
     {
@@ -548,19 +678,26 @@ void
 dprintPersistentDCBs(DCB *pdcb, SERVER *server)
 {
     DCB *dcb;
+    int i, j;
+
+    for (i = 0; i < server->n_persistent_pools; i++)
+    {
+        SERVER_POOL *pool = &server->persistent[i];
 
-    spinlock_acquire(&server->persistlock);
+        spinlock_acquire(&pool->lock);
 #if SPINLOCK_PROFILE
-    dcb_printf(pdcb, "DCB List Spinlock Statistics:\n");
-    spinlock_stats(&server->persistlock, spin_reporter, pdcb);
+        dcb_printf(pdcb, "Thread %d Pool Spinlock Statistics:\n", i);
+        spinlock_stats(&pool->lock, spin_reporter, pdcb);
 #endif
-    dcb = server->persistent;
-    while (dcb)
-    {
-        dprintOneDCB(pdcb, dcb);
-        dcb = dcb->nextpersistent;
+        for (j = 0; j < SERVER_POOL_BUCKETS; j++)
+        {
+            for (dcb = pool->stacks[j]; dcb; dcb = dcb->nextpersistent)
+            {
+                dprintOneDCB(pdcb, dcb);
+            }
+        }
+        spinlock_release(&pool->lock);
     }
-    spinlock_release(&server->persistlock);
 }
 
 /**
@@ -600,6 +737,111 @@ dListServers(DCB *dcb)
     spinlock_release(&server_spin);
 }
 
+/**
+ * The metrics of the servers, in the order they are written
+ */
+enum server_metric
+{
+    SERVER_METRIC_CONNECTIONS_TOTAL,
+    SERVER_METRIC_CONNECTIONS,
+    SERVER_METRIC_OPERATIONS,
+    SERVER_METRIC_UP,
+    SERVER_METRIC_MASTER,
+    SERVER_METRIC_SLAVE,
+    SERVER_METRIC_MAINTENANCE,
+    SERVER_METRIC_LAG,
+    SERVER_METRIC_COUNT
+};
+
+static const struct
+{
+    const char *name;
+    const char *type;
+    const char *help;
+} server_metric_defs[SERVER_METRIC_COUNT] =
+{
+    {"maxscale_server_connections_total", "counter", "Connections created to the server"},
+    {"maxscale_server_connections", "gauge", "Current connections to the server"},
+    {"maxscale_server_operations", "gauge", "Operations in progress on the server"},
+    {"maxscale_server_up", "gauge", "Whether the server is running"},
+    {"maxscale_server_master", "gauge", "Whether the server is a master"},
+    {"maxscale_server_slave", "gauge", "Whether the server is a slave"},
+    {"maxscale_server_maintenance", "gauge", "Whether the server is in maintenance mode"},
+    {"maxscale_server_replication_lag_seconds", "gauge", "Replication lag reported by the monitor"}
+};
+
+/**
+ * Write the metrics of the servers
+ *
+ * @param metrics       The output
+ */
+void
+server_metrics(METRICS *metrics)
+{
+    SERVER *server;
+    char name[256];
+    int i;
+
+    spinlock_acquire(&server_spin);
+    for (i = 0; i < SERVER_METRIC_COUNT; i++)
+    {
+        metrics_header(metrics, server_metric_defs[i].name, server_metric_defs[i].type,
+                       server_metric_defs[i].help);
+        for (server = allServers; server; server = server->next)
+        {
+            int value;
+
+            switch (i)
+            {
+            case SERVER_METRIC_CONNECTIONS_TOTAL:
+                value = server->stats.n_connections;
+                break;
+            case SERVER_METRIC_CONNECTIONS:
+                value = server->stats.n_current;
+                break;
+            case SERVER_METRIC_OPERATIONS:
+                value = server->stats.n_current_ops;
+                break;
+            case SERVER_METRIC_UP:
+                value = (server->status & SERVER_RUNNING) != 0;
+                break;
+            case SERVER_METRIC_MASTER:
+                value = (server->status & SERVER_MASTER) != 0;
+                break;
+            case SERVER_METRIC_SLAVE:
+                value = (server->status & SERVER_SLAVE) != 0;
+                break;
+            case SERVER_METRIC_MAINTENANCE:
+                value = (server->status & SERVER_MAINT) != 0;
+                break;
+            default:
+                value = server->rlag;
+                break;
+            }
+            /** The lag is negative when the monitor does not know it */
+            if (i != SERVER_METRIC_LAG || value >= 0)
+            {
+                metrics_printf(metrics, "%s{server=\"%s\"} %d\n", server_metric_defs[i].name,
+                               metrics_label(server->unique_name ? server->unique_name : server->name,
+                                             name, sizeof(name)), value);
+            }
+        }
+    }
+    metrics_header(metrics, "maxscale_server_query_latency_microseconds", "summary",
+                   "Time from routing a query to the server to writing the last packet of its reply");
+    for (server = allServers; server; server = server->next)
+    {
+        char labels[300];
+
+        snprintf(labels, sizeof(labels), "server=\"%s\"",
+                 metrics_label(server->unique_name ? server->unique_name : server->name,
+                               name, sizeof(name)));
+        latency_metrics(metrics, "maxscale_server_query_latency_microseconds", labels,
+                        &server->latency);
+    }
+    spinlock_release(&server_spin);
+}
+
 /**
  * Convert a set of  server status flags to a string, the returned
  * string has been malloc'd and must be free'd by the caller
@@ -673,6 +915,8 @@ server_status(SERVER *server)
 void
 server_set_status(SERVER *server, int bit)
 {
+    unsigned int status = server->status;
+
     server->status |= bit;
 
     /** clear error logged flag before the next failure */
@@ -680,6 +924,10 @@ server_set_status(SERVER *server, int bit)
     {
         server->master_err_is_logged = false;
     }
+    if (server->status != status)
+    {
+        server_states_publish();
+    }
 }
 
 /**
@@ -701,6 +949,7 @@ server_clear_set_status(SERVER *server, int specified_bits, int bits_to_set)
     if ((server->status & specified_bits) != bits_to_set)
     {
         server->status = (server->status & ~specified_bits) | bits_to_set;
+        server_states_publish();
     }
 }
 
@@ -713,7 +962,13 @@ server_clear_set_status(SERVER *server, int specified_bits, int bits_to_set)
 void
 server_clear_status(SERVER *server, int bit)
 {
+    unsigned int status = server->status;
+
     server->status &= ~bit;
+    if (server->status != status)
+    {
+        server_states_publish();
+    }
 }
 
 /**
@@ -725,7 +980,13 @@ server_clear_status(SERVER *server, int bit)
 void
 server_transfer_status(SERVER *dest_server, SERVER *source_server)
 {
+    unsigned int status = dest_server->status;
+
     dest_server->status = source_server->status;
+    if (dest_server->status != status)
+    {
+        server_states_publish();
+    }
 }
 
 /**
@@ -877,7 +1138,10 @@ serverRowCallback(RESULTSET *set, void *data)
 
     spinlock_acquire(&server_spin);
     server = allServers;
-    while (i < *rowno && server)
+    /** Skip the servers already sent and the ones the conditions exclude */
+    while (server && (i < *rowno ||
+                      !resultset_value_matches(set, 0, server->unique_name) ||
+                      !resultset_value_matches(set, 1, server->name)))
     {
         i++;
         server = server->next;
@@ -888,7 +1152,7 @@ serverRowCallback(RESULTSET *set, void *data)
         free(data);
         return NULL;
     }
-    (*rowno)++;
+    *rowno = i + 1;
     row = resultset_make_row(set);
     resultset_row_set(row, 0, server->unique_name);
     resultset_row_set(row, 1, server->name);
@@ -896,9 +1160,12 @@ serverRowCallback(RESULTSET *set, void *data)
     resultset_row_set(row, 2, buf);
     sprintf(buf, "%d", server->stats.n_current);
     resultset_row_set(row, 3, buf);
-    stat = server_status(server);
-    resultset_row_set(row, 4, stat);
-    free(stat);
+    if (resultset_column_needed(set, 4))
+    {
+        stat = server_status(server);
+        resultset_row_set(row, 4, stat);
+        free(stat);
+    }
     spinlock_release(&server_spin);
     return row;
 }
@@ -1030,3 +1297,275 @@ bool server_set_version_string(SERVER* server, const char* string)
     spinlock_release(&server->lock);
     return rval;
 }
+
+/**
+ * Get the current states of the servers. The states may only be read by a
+ * polling thread and must not be kept past the current event.
+ *
+ * @return The server states or NULL if there are no servers
+ */
+SERVER_STATES *
+server_states()
+{
+    return (SERVER_STATES *)snapshot_get(&server_states_snap);
+}
+
+/**
+ * Get the state of a server from a version of the server states. The state of
+ * a server that is not in the version is read from the server itself.
+ *
+ * @param states        The server states, may be NULL
+ * @param server        The server
+ * @return The state of the server
+ */
+SERVER_STATE
+server_get_state(SERVER_STATES *states, SERVER *server)
+{
+    SERVER_STATE state;
+
+    if (states && server->state_index < states->n_servers &&
+        states->servers[server->state_index].server == server)
+    {
+        return states->servers[server->state_index];
+    }
+    state.server = server;
+    state.status = server->status;
+    state.rlag = server->rlag;
+    state.rlag_us = server->rlag_us;
+    state.depth = server->depth;
+    return state;
+}
+
+/**
+ * Publish a new version of the server states from the current state of the
+ * servers. The monitors call this once they have updated the servers.
+ */
+void
+server_states_publish()
+{
+    SERVER_STATES *states;
+    SERVER *server;
+
+    snapshot_write_begin(&server_states_snap);
+    spinlock_acquire(&server_spin);
+    if ((states = (SERVER_STATES *)snapshot_alloc(sizeof(SERVER_STATES) +
+                                                  n_server_states * sizeof(SERVER_STATE))) != NULL)
+    {
+        states->n_servers = n_server_states;
+        memset(states->servers, 0, n_server_states * sizeof(SERVER_STATE));
+        for (server = allServers; server; server = server->next)
+        {
+            SERVER_STATE *state = &states->servers[server->state_index];
+
+            state->server = server;
+            state->status = server->status;
+            state->rlag = server->rlag;
+            state->rlag_us = server->rlag_us;
+            state->depth = server->depth;
+        }
+    }
+    spinlock_release(&server_spin);
+    snapshot_write_end(&server_states_snap, states);
+}
+
+/**
+ * Set the GTID position of a server. The monitors call this with the value of
+ * @@gtid_current_pos, a comma separated list of domain-server_id-sequence
+ * triplets.
+ *
+ * @param server        The server
+ * @param pos           The GTID position
+ * @param read_at       The latency_now() time before the position was read
+ * @return True if the position was set, false if it could not be parsed or
+ *         it has more than SERVER_GTID_MAX_DOMAINS domains
+ */
+bool
+server_set_gtid_pos(SERVER *server, const char *pos, uint64_t read_at)
+{
+    SERVER_GTID_POS gtid_pos;
+    const char *ptr = pos;
+    char *end;
+
+    gtid_pos.n_domains = 0;
+    gtid_pos.read_at = read_at;
+
+    while (*ptr)
+    {
+        if (gtid_pos.n_domains == SERVER_GTID_MAX_DOMAINS)
+        {
+            return false;
+        }
+
+        unsigned long domain = strtoul(ptr, &end, 10);
+
+        if (end == ptr || *end != '-')
+        {
+            return false;
+        }
+        ptr = end + 1;
+        strtoul(ptr, &end, 10);
+
+        if (end == ptr || *end != '-')
+        {
+            return false;
+        }
+        ptr = end + 1;
+        unsigned long long seq = strtoull(ptr, &end, 10);
+
+        if (end == ptr || (*end != ',' && *end != '\0'))
+        {
+            return false;
+        }
+        ptr = *end ? end + 1 : end;
+
+        gtid_pos.domains[gtid_pos.n_domains] = domain;
+        gtid_pos.seqs[gtid_pos.n_domains] = seq;
+        gtid_pos.n_domains++;
+    }
+
+    spinlock_acquire(&server->lock);
+    server->gtid_pos = gtid_pos;
+    spinlock_release(&server->lock);
+    return true;
+}
+
+/** The names of the cached system variables, in the order of server_var_t */
+static const char *server_var_names[SERVER_N_VARS] =
+{
+    "version_comment",
+    "tx_isolation",
+    "auto_increment_increment",
+    "max_allowed_packet",
+    "sql_mode"
+};
+
+/**
+ * Return the name of a cached system variable
+ *
+ * @param var   The variable
+ * @return The name of the variable
+ */
+const char *
+server_var_name(server_var_t var)
+{
+    return server_var_names[var];
+}
+
+/**
+ * Find a cached system variable by its name, ignoring the case
+ *
+ * @param name  The name, not necessarily null terminated
+ * @param len   The length of the name
+ * @return The variable or SERVER_N_VARS if it is not cached
+ */
+server_var_t
+server_var_find(const char *name, size_t len)
+{
+    int i;
+
+    for (i = 0; i < SERVER_N_VARS; i++)
+    {
+        if (strlen(server_var_names[i]) == len && strncasecmp(server_var_names[i], name, len) == 0)
+        {
+            break;
+        }
+    }
+    return (server_var_t)i;
+}
+
+/**
+ * Set the cached value of a global system variable of a server. The monitors
+ * call this with the values they read.
+ *
+ * @param server        The server
+ * @param var           The variable
+ * @param value         The value, NULL if it is not known
+ * @return True if the value was set, false if memory allocation failed
+ */
+bool
+server_set_variable(SERVER *server, server_var_t var, const char *value)
+{
+    char *copy = NULL;
+
+    if (value && (copy = strdup(value)) == NULL)
+    {
+        MXS_ERROR("Memory allocation failed.");
+        return false;
+    }
+
+    spinlock_acquire(&server->lock);
+    char *old = server->variables[var];
+    server->variables[var] = copy;
+    spinlock_release(&server->lock);
+
+    free(old);
+    return true;
+}
+
+/**
+ * Get the cached value of a global system variable of a server
+ *
+ * @param server        The server
+ * @param var           The variable
+ * @param buf           The buffer to copy the value to
+ * @param size          The size of the buffer
+ * @return True if the value is known and it fits in the buffer
+ */
+bool
+server_get_variable(SERVER *server, server_var_t var, char *buf, size_t size)
+{
+    bool rval = false;
+
+    spinlock_acquire(&server->lock);
+    if (server->variables[var] && strlen(server->variables[var]) < size)
+    {
+        strcpy(buf, server->variables[var]);
+        rval = true;
+    }
+    spinlock_release(&server->lock);
+    return rval;
+}
+
+/**
+ * Get the GTID position of a server
+ *
+ * @param server        The server
+ * @param pos           The structure to copy the position to
+ */
+void
+server_get_gtid_pos(SERVER *server, SERVER_GTID_POS *pos)
+{
+    spinlock_acquire(&server->lock);
+    *pos = server->gtid_pos;
+    spinlock_release(&server->lock);
+}
+
+/**
+ * Check if a GTID position has reached another one, i.e. if a server at the
+ * position has applied every transaction up to the target position.
+ *
+ * @param pos           The position of the server
+ * @param target        The target position
+ * @return True if every domain of the target is in the position with at
+ *         least as large a sequence number
+ */
+bool
+server_gtid_pos_reached(const SERVER_GTID_POS *pos, const SERVER_GTID_POS *target)
+{
+    for (int i = 0; i < target->n_domains; i++)
+    {
+        int j = 0;
+
+        while (j < pos->n_domains && pos->domains[j] != target->domains[i])
+        {
+            j++;
+        }
+
+        if (j == pos->n_domains || pos->seqs[j] < target->seqs[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
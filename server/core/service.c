@@ -34,6 +34,11 @@
  * 03/03/15     Massimiliano Pinto      Added config_enable_feedback_task() call in serviceStartAll
  * 19/06/15     Martin Brampton         More meaningful names for temp variables
  * 31/05/16     Martin Brampton         Implement connection throttling
+ * 15/10/2016   Core Team               Reload the users in a background thread
+ * 15/10/2016   Core Team               Start with the users of the snapshot
+ * 15/10/2016   Core Team               Prepare the services in parallel at startup
+ * 15/10/2016   Core Team               Hand the listeners over to a new process
+ * 15/10/2016   Core Team               Show the statistics of the connection queue
  *
  * @endverbatim
  */
@@ -42,6 +47,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <session.h>
 #include <service.h>
 #include <gw_protocol.h>
@@ -66,6 +72,8 @@
 #include <math.h>
 #include <version.h>
 #include <queuemanager.h>
+#include <thread.h>
+#include <mysql.h>
 
 /** To be used with configuration type checks */
 typedef struct typelib_st
@@ -88,7 +96,7 @@ typelib_t sqlvar_target_type =
     sqlvar_target_strings
 };
 
-static SPINLOCK service_spin = SPINLOCK_INIT;
+static SPINLOCK service_spin = SPINLOCK_INIT_NAMED("services");
 static SERVICE  *allServices = NULL;
 
 static int find_type(typelib_t* tl, const char* needle, int maxlen);
@@ -96,6 +104,7 @@ static int find_type(typelib_t* tl, const char* needle, int maxlen);
 static void service_add_qualified_param(SERVICE*          svc,
                                         CONFIG_PARAMETER* param);
 static void service_internal_restart(void *data);
+static void backend_stats_free(BACKEND_STATS *stats);
 
 /**
  * Allocate a new service for the gateway to support
@@ -137,8 +146,10 @@ service_alloc(const char *servname, const char *router)
     service->name = strdup(servname);
     service->routerModule = strdup(router);
     service->users_from_all = false;
-    service->queued_connections = NULL;
+    service->max_queued_connections = 0;
+    service->queued_connection_timeout = 0;
     service->resources = NULL;
+    service->users_reload_pending = 0;
     service->localhost_match_wildcard_host = SERVICE_PARAM_UNINIT;
     service->retry_start = true;
     service->conn_idle_timeout = SERVICE_NO_SESSION_TIMEOUT;
@@ -201,6 +212,164 @@ service_isvalid(SERVICE *service)
     return rval;
 }
 
+/**
+ * Get the path of the users snapshot of a service
+ *
+ * The snapshot is stored in the .cache directory of the service in the
+ * cache directory of MaxScale.
+ *
+ * @param service   The service
+ * @param path      Buffer of PATH_MAX + 1 bytes for the path
+ * @param create    Create the directories of the snapshot if they are missing
+ * @return          True if the path fits in the buffer
+ */
+static bool
+service_users_snapshot_path(SERVICE *service, char *path, bool create)
+{
+    const char *dirs[] = {"", "/.cache"};
+    int len = snprintf(path, PATH_MAX + 1, "%s/%s", get_cachedir(), service->name);
+
+    for (int i = 0; i < 2 && len <= PATH_MAX; i++)
+    {
+        len += snprintf(path + len, PATH_MAX + 1 - len, "%s", dirs[i]);
+
+        if (create && len <= PATH_MAX && access(path, R_OK) == -1 &&
+            mkdir(path, 0777) == -1 && errno != EEXIST)
+        {
+            char errbuf[STRERROR_BUFLEN];
+            MXS_ERROR("Failed to create directory '%s': [%d] %s",
+                      path,
+                      errno,
+                      strerror_r(errno, errbuf, sizeof(errbuf)));
+        }
+    }
+
+    if (len <= PATH_MAX)
+    {
+        len += snprintf(path + len, PATH_MAX + 1 - len, "/dbusers");
+    }
+
+    return len <= PATH_MAX;
+}
+
+/**
+ * Save the users of a service into the users snapshot
+ *
+ * @param service   The service
+ */
+static void
+service_save_users(SERVICE *service)
+{
+    char path[PATH_MAX + 1];
+
+    if (service_users_snapshot_path(service, path, true))
+    {
+        dbusers_save(service->users, path);
+    }
+}
+
+/**
+ * Initialize the MySQL users of a service
+ *
+ * The users are taken from the snapshot saved by the previous loading and then
+ * reloaded from the backends in the background. Without a snapshot, the users
+ * are loaded from the backends before returning.
+ *
+ * @param service The service
+ * @return Number of users loaded or -1 on error, in which case the service has
+ * no users table
+ */
+static int
+service_init_mysql_users(SERVICE *service)
+{
+    char path[PATH_MAX + 1];
+    bool from_snapshot = false;
+    int loaded;
+
+    /*
+     * Allocate specific data for MySQL users
+     * including hosts and db names
+     */
+    service->users = mysql_users_alloc();
+
+    /*
+     * Start with the users saved by the previous loading, the users
+     * are loaded from the backends in the background.
+     */
+    if (service_users_snapshot_path(service, path, false) &&
+        (loaded = dbusers_load(service->users, path)) > 0)
+    {
+        from_snapshot = true;
+        MXS_NOTICE("Loaded %d MySQL Users for service [%s] from '%s'.",
+                   loaded, service->name, path);
+
+        if (service->localhost_match_wildcard_host == SERVICE_PARAM_UNINIT)
+        {
+            service->localhost_match_wildcard_host = service->users->anonymous ? 0 : 1;
+        }
+    }
+    else
+    {
+        /* drop whatever a corrupted snapshot left in the table */
+        users_free(service->users);
+        service->users = mysql_users_alloc();
+
+        if ((loaded = load_mysql_users(service)) < 0)
+        {
+            users_free(service->users);
+            service->users = NULL;
+            return -1;
+        }
+
+        /* Save authentication data to file cache */
+        service_save_users(service);
+
+        if (loaded == 0)
+        {
+            MXS_ERROR("Service %s: failed to load any user "
+                      "information. Authentication will "
+                      "probably fail as a result.",
+                      service->name);
+        }
+
+        MXS_NOTICE("Loaded %d MySQL Users for service [%s].",
+                   loaded, service->name);
+    }
+
+    /* At service start last update is set to USERS_REFRESH_TIME seconds earlier.
+     * This way MaxScale could try reloading users' just after startup
+     */
+    service->rate_limit.last = time(NULL) - USERS_REFRESH_TIME;
+    service->rate_limit.nloads = 1;
+
+    if (from_snapshot)
+    {
+        service_refresh_users_async(service);
+    }
+
+    return loaded;
+}
+
+/**
+ * Get the address a listener is started with
+ *
+ * @param port  The listener
+ * @param dest  Where the address is stored
+ * @param size  Size of @c dest
+ */
+static void
+service_port_bind(SERV_LISTENER *port, char *dest, size_t size)
+{
+    if (port->address)
+    {
+        snprintf(dest, size, "%s:%d", port->address, port->port);
+    }
+    else
+    {
+        snprintf(dest, size, "0.0.0.0:%d", port->port);
+    }
+}
+
 /**
  * Start an individual port/protocol pair
  *
@@ -212,7 +381,7 @@ static int
 serviceStartPort(SERVICE *service, SERV_LISTENER *port)
 {
     int listeners = 0;
-    char config_bind[40];
+    char config_bind[PATH_MAX + 40];
     GWPROTOCOL *funcs;
 
     if (service == NULL || service->router == NULL || service->router_instance == NULL)
@@ -235,111 +404,27 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
         listener_init_SSL(port->ssl);
     }
 
-    if (strcmp(port->protocol, "MySQLClient") == 0)
+    if (port->queued_connections == NULL &&
+        service->max_queued_connections && service->queued_connection_timeout)
     {
-        int loaded;
+        /* If memory allocation fails, result will be null so no queue */
+        port->queued_connections = mxs_queue_alloc(service->max_queued_connections,
+                                                   service->queued_connection_timeout);
+    }
 
-        if (service->users == NULL)
+    if (strcmp(port->protocol, "MySQLClient") == 0)
+    {
+        if (service->users == NULL && service_init_mysql_users(service) < 0)
         {
-            /*
-             * Allocate specific data for MySQL users
-             * including hosts and db names
-             */
-            service->users = mysql_users_alloc();
-
-            if ((loaded = load_mysql_users(service)) < 0)
-            {
-                MXS_ERROR("Unable to load users for "
-                          "service %s listening at %s:%d.",
-                          service->name,
-                          (port->address == NULL ? "0.0.0.0" : port->address),
-                          port->port);
-
-                {
-                    /* Try loading authentication data from file cache */
-                    char *ptr, path[PATH_MAX + 1];
-                    strncpy(path, get_cachedir(), sizeof(path) - 1);
-                    strncat(path, "/", sizeof(path) - 1);
-                    strncat(path, service->name, sizeof(path) - 1);
-                    strncat(path, "/.cache/dbusers", sizeof(path) - 1);
-                    loaded = dbusers_load(service->users, path);
-                    if (loaded != -1)
-                    {
-                        MXS_ERROR("Using cached credential information.");
-                    }
-                }
-                if (loaded == -1)
-                {
-                    users_free(service->users);
-                    service->users = NULL;
-                    dcb_close(port->listener);
-                    port->listener = NULL;
-                    goto retblock;
-                }
-            }
-            else
-            {
-                /* Save authentication data to file cache */
-                char *ptr, path[PATH_MAX + 1];
-                int mkdir_rval = 0;
-                strncpy(path, get_cachedir(), PATH_MAX);
-                strncat(path, "/", 4096);
-                strncat(path, service->name, PATH_MAX);
-                if (access(path, R_OK) == -1)
-                {
-                    mkdir_rval = mkdir(path, 0777);
-                }
-
-                if (mkdir_rval)
-                {
-                    if (errno != EEXIST)
-                    {
-                        char errbuf[STRERROR_BUFLEN];
-                        MXS_ERROR("Failed to create directory '%s': [%d] %s",
-                                  path,
-                                  errno,
-                                  strerror_r(errno, errbuf, sizeof(errbuf)));
-                    }
-                    mkdir_rval = 0;
-                }
-
-                strncat(path, "/.cache", PATH_MAX);
-                if (access(path, R_OK) == -1)
-                {
-                    mkdir_rval = mkdir(path, 0777);
-                }
-
-                if (mkdir_rval)
-                {
-                    if (errno != EEXIST)
-                    {
-                        char errbuf[STRERROR_BUFLEN];
-                        MXS_ERROR("Failed to create directory '%s': [%d] %s",
-                                  path,
-                                  errno,
-                                  strerror_r(errno, errbuf, sizeof(errbuf)));
-                    }
-                    mkdir_rval = 0;
-                }
-                strncat(path, "/dbusers", PATH_MAX);
-                dbusers_save(service->users, path);
-            }
-            if (loaded == 0)
-            {
-                MXS_ERROR("Service %s: failed to load any user "
-                          "information. Authentication will "
-                          "probably fail as a result.",
-                          service->name);
-            }
-
-            /* At service start last update is set to USERS_REFRESH_TIME seconds earlier.
-             * This way MaxScale could try reloading users' just after startup
-             */
-            service->rate_limit.last = time(NULL) - USERS_REFRESH_TIME;
-            service->rate_limit.nloads = 1;
+            MXS_ERROR("Unable to load users for "
+                      "service %s listening at %s:%d.",
+                      service->name,
+                      (port->address == NULL ? "0.0.0.0" : port->address),
+                      port->port);
 
-            MXS_NOTICE("Loaded %d MySQL Users for service [%s].",
-                       loaded, service->name);
+            dcb_close(port->listener);
+            port->listener = NULL;
+            goto retblock;
         }
     }
     else
@@ -366,13 +451,12 @@ serviceStartPort(SERVICE *service, SERV_LISTENER *port)
     }
     memcpy(&(port->listener->func), funcs, sizeof(GWPROTOCOL));
 
-    if (port->address)
-    {
-        sprintf(config_bind, "%s:%d", port->address, port->port);
-    }
-    else
+    service_port_bind(port, config_bind, sizeof(config_bind));
+
+    /** The listener accepts in the thread group of the service unless it has one of its own */
+    if (port->thread_group < 0)
     {
-        sprintf(config_bind, "0.0.0.0:%d", port->port);
+        port->thread_group = service->thread_group;
     }
 
     if (port->listener->func.listen(port->listener, config_bind))
@@ -508,22 +592,18 @@ static void free_string_array(char** array)
 }
 
 /**
- * Start a service
- *
- * This function loads the protocol modules for each port on which the
- * service listens and starts the listener on that port
- *
- * Also create the router_instance for the service.
+ * Create the router instance of a service and start its listeners
  *
- * @param service       The Service that should be started
+ * @param service       The service
+ * @param permissions   Whether the service user has adequate permissions
  * @return      Returns the number of listeners created
  */
-int
-serviceStart(SERVICE *service)
+static int
+service_start_instance(SERVICE *service, bool permissions)
 {
     int listeners = 0;
 
-    if (check_service_permissions(service))
+    if (permissions)
     {
         char **router_options = copy_string_array(service->routerOptions);
         if ((service->router_instance = service->router->createInstance(
@@ -548,6 +628,23 @@ serviceStart(SERVICE *service)
     return listeners;
 }
 
+/**
+ * Start a service
+ *
+ * This function loads the protocol modules for each port on which the
+ * service listens and starts the listener on that port
+ *
+ * Also create the router_instance for the service.
+ *
+ * @param service       The Service that should be started
+ * @return      Returns the number of listeners created
+ */
+int
+serviceStart(SERVICE *service)
+{
+    return service_start_instance(service, check_service_permissions(service));
+}
+
 /**
  * Start an individual listener
  *
@@ -572,9 +669,102 @@ serviceStartProtocol(SERVICE *service, char *protocol, int port)
 }
 
 
+/** The services that the worker threads prepare for starting */
+typedef struct
+{
+    SERVICE **services;         /*< The services in the order they are started */
+    bool *permissions;          /*< Result of the permission check of each service */
+    double *elapsed;            /*< Time it took to prepare each service */
+    int *ready;                 /*< Set to 1 when a service has been prepared */
+    int n_services;
+    int next;                   /*< Next service to prepare */
+    SPINLOCK lock;
+} SERVICE_START_POOL;
+
+/** Current time in seconds */
+static double service_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/**
+ * Check whether a service has a listener for MySQL clients
+ *
+ * @param service The service
+ * @return True if one of the listeners uses the MySQLClient protocol
+ */
+static bool
+service_has_mysql_listener(SERVICE *service)
+{
+    for (SERV_LISTENER *port = service->ports; port; port = port->next)
+    {
+        if (strcmp(port->protocol, "MySQLClient") == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * The worker thread that checks the permissions and loads the users of the
+ * services. These need queries to the backends and take most of the time it
+ * takes to start a service. If the users of a service can't be loaded here,
+ * starting the listeners of the service tries it again and reports the error.
+ *
+ * @param data The SERVICE_START_POOL
+ */
+static void
+service_start_worker(void *data)
+{
+    SERVICE_START_POOL *pool = (SERVICE_START_POOL *)data;
+    int i;
+
+    mysql_thread_init();
+
+    while (true)
+    {
+        spinlock_acquire(&pool->lock);
+        i = pool->next < pool->n_services ? pool->next++ : -1;
+        spinlock_release(&pool->lock);
+
+        if (i < 0)
+        {
+            break;
+        }
+
+        SERVICE *service = pool->services[i];
+        double start = service_now();
+
+        if (!service->svc_do_shutdown)
+        {
+            pool->permissions[i] = check_service_permissions(service);
+
+            if (pool->permissions[i] && service->users == NULL &&
+                service_has_mysql_listener(service))
+            {
+                service_init_mysql_users(service);
+            }
+        }
+
+        pool->elapsed[i] = service_now() - start;
+        __sync_lock_test_and_set(&pool->ready[i], 1);
+    }
+
+    mysql_thread_end();
+}
+
 /**
  * Start all the services
  *
+ * The permissions of the services are checked and their users are loaded by
+ * a pool of SERVICE_START_THREADS threads. The listeners of each service are
+ * started in the order of the configuration as soon as the service has been
+ * prepared.
+ *
  * @return Return the number of services started
  */
 int
@@ -583,22 +773,92 @@ serviceStartAll()
     SERVICE *ptr;
     int n = 0, i;
     bool error = false;
+    SERVICE_START_POOL pool;
+    THREAD threads[SERVICE_START_THREADS];
+    int n_threads = 0;
+    double start = service_now();
+    double prepare = 0;
 
     config_enable_feedback_task();
 
-    ptr = allServices;
-    while (ptr && !ptr->svc_do_shutdown)
+    memset(&pool, 0, sizeof(pool));
+    spinlock_init(&pool.lock);
+
+    for (ptr = allServices; ptr; ptr = ptr->next)
     {
-        n += (i = serviceStart(ptr));
+        pool.n_services++;
+    }
+
+    pool.services = calloc(pool.n_services + 1, sizeof(SERVICE *));
+    pool.permissions = calloc(pool.n_services + 1, sizeof(bool));
+    pool.elapsed = calloc(pool.n_services + 1, sizeof(double));
+    pool.ready = calloc(pool.n_services + 1, sizeof(int));
 
-        if (i == 0)
+    if (pool.services == NULL || pool.permissions == NULL ||
+        pool.elapsed == NULL || pool.ready == NULL)
+    {
+        free(pool.services);
+        free(pool.permissions);
+        free(pool.elapsed);
+        free(pool.ready);
+        return 0;
+    }
+
+    for (ptr = allServices, i = 0; ptr; ptr = ptr->next, i++)
+    {
+        pool.services[i] = ptr;
+    }
+
+    while (n_threads < MIN(pool.n_services, SERVICE_START_THREADS) &&
+           thread_start(&threads[n_threads], service_start_worker, &pool))
+    {
+        n_threads++;
+    }
+
+    if (n_threads == 0)
+    {
+        /** Prepare the services in this thread if no worker could be started */
+        service_start_worker(&pool);
+    }
+
+    for (i = 0; i < pool.n_services && !pool.services[i]->svc_do_shutdown; i++)
+    {
+        int listeners;
+        ptr = pool.services[i];
+
+        while (!__sync_fetch_and_or(&pool.ready[i], 0))
+        {
+            thread_millisleep(10);
+        }
+
+        double started = service_now();
+        n += (listeners = service_start_instance(ptr, pool.permissions[i]));
+
+        MXS_INFO("Service '%s': prepared in %.2f seconds, listeners started in %.2f seconds.",
+                 ptr->name, pool.elapsed[i], service_now() - started);
+        prepare = MAX(prepare, pool.elapsed[i]);
+
+        if (listeners == 0)
         {
             MXS_ERROR("Failed to start service '%s'.", ptr->name);
             error = true;
         }
+    }
 
-        ptr = ptr->next;
+    /** Let the workers finish with the services that were skipped */
+    for (int j = 0; j < n_threads; j++)
+    {
+        thread_wait(threads[j]);
     }
+
+    MXS_NOTICE("Started %d services in %.2f seconds, the slowest service was prepared in %.2f seconds.",
+               i, service_now() - start, prepare);
+
+    free(pool.services);
+    free(pool.permissions);
+    free(pool.elapsed);
+    free(pool.ready);
+
     return error ? 0 : n;
 }
 
@@ -634,6 +894,62 @@ serviceStop(SERVICE *service)
     return listeners;
 }
 
+/**
+ * Stop the listeners of all services
+ *
+ * @return The number of listeners stopped
+ */
+int
+serviceStopAll()
+{
+    SERVICE *service;
+    int listeners = 0;
+
+    spinlock_acquire(&service_spin);
+    for (service = allServices; service; service = service->next)
+    {
+        listeners += serviceStop(service);
+    }
+    spinlock_release(&service_spin);
+
+    return listeners;
+}
+
+/**
+ * Call a function for every started listener of all services
+ *
+ * @param func  Function called with the address the listener was started
+ *              with and the listening socket
+ * @param data  Passed to @c func
+ * @return The number of listeners @c func was called for
+ */
+int
+serviceForEachListener(void (*func)(const char *bind, int fd, void *data), void *data)
+{
+    SERVICE *service;
+    SERV_LISTENER *port;
+    char bind[PATH_MAX + 40];
+    int listeners = 0;
+
+    spinlock_acquire(&service_spin);
+    for (service = allServices; service; service = service->next)
+    {
+        for (port = service->ports; port; port = port->next)
+        {
+            if (port->listener && port->listener->fd >= 0 &&
+                port->listener->session->state == SESSION_STATE_LISTENER)
+            {
+                service_port_bind(port, bind, sizeof(bind));
+                func(bind, port->listener->fd, data);
+                listeners++;
+            }
+        }
+    }
+    spinlock_release(&service_spin);
+
+    return listeners;
+}
+
 /**
  * Restart a service
  *
@@ -706,6 +1022,7 @@ service_free(SERVICE *service)
     {
         srv = service->dbref;
         service->dbref = service->dbref->next;
+        backend_stats_free(srv->stats);
         free(srv);
     }
 
@@ -720,6 +1037,7 @@ service_free(SERVICE *service)
     users_free(service->users);
     hashtable_free(service->resources);
     serviceClearRouterOptions(service);
+    latency_free(&service->latency);
 
     free(service);
     return 1;
@@ -800,6 +1118,7 @@ serviceAddBackend(SERVICE *service, SERVER *server)
     {
         sref->next = NULL;
         sref->server = server;
+        sref->stats = NULL;
 
         spinlock_acquire(&service->spin);
         if (service->dbref)
@@ -819,6 +1138,84 @@ serviceAddBackend(SERVICE *service, SERVER *server)
     }
 }
 
+/**
+ * Free the statistics of a server of a service
+ *
+ * @param stats The statistics or NULL
+ */
+static void
+backend_stats_free(BACKEND_STATS *stats)
+{
+    if (stats)
+    {
+        ts_stats_free(stats->queries);
+        ts_stats_free(stats->bytes_out);
+        ts_stats_free(stats->bytes_in);
+        ts_stats_free(stats->errors);
+        ts_stats_free(stats->reconnects);
+        ts_stats_free(stats->sescmd_replays);
+        ts_histogram_free(stats->latency);
+        free(stats);
+    }
+}
+
+/**
+ * Get the statistics of the traffic a service routes to one of its servers.
+ * The statistics are allocated the first time they are asked for and they
+ * are shared by all the router instances of the service.
+ *
+ * @param service       The service
+ * @param server        The server, one of the servers of the service
+ * @return The statistics or NULL if the server is not used by the service or
+ *         if memory allocation failed
+ */
+BACKEND_STATS *
+serviceGetBackendStats(SERVICE *service, SERVER *server)
+{
+    BACKEND_STATS *rval = NULL;
+
+    spinlock_acquire(&service->spin);
+
+    for (SERVER_REF *ref = service->dbref; ref; ref = ref->next)
+    {
+        if (ref->server == server)
+        {
+            if (ref->stats == NULL && (ref->stats = calloc(1, sizeof(BACKEND_STATS))))
+            {
+                BACKEND_STATS *stats = ref->stats;
+
+                stats->queries = ts_stats_alloc();
+                stats->bytes_out = ts_stats_alloc();
+                stats->bytes_in = ts_stats_alloc();
+                stats->errors = ts_stats_alloc();
+                stats->reconnects = ts_stats_alloc();
+                stats->sescmd_replays = ts_stats_alloc();
+                stats->latency = ts_histogram_alloc();
+
+                if (!stats->queries || !stats->bytes_out || !stats->bytes_in ||
+                    !stats->errors || !stats->reconnects || !stats->sescmd_replays ||
+                    !stats->latency)
+                {
+                    backend_stats_free(stats);
+                    ref->stats = NULL;
+                }
+            }
+            rval = ref->stats;
+            break;
+        }
+    }
+
+    spinlock_release(&service->spin);
+
+    if (rval == NULL)
+    {
+        MXS_ERROR("Failed to allocate the statistics of server '%s' in service '%s'.",
+                  server->unique_name, service->name);
+    }
+
+    return rval;
+}
+
 /**
  * Test if a server is part of a service
  *
@@ -1026,12 +1423,8 @@ serviceSetTimeout(SERVICE *service, int val)
         return 0;
     }
 
-    /** Enable the session timeout checks if and only if at least one service is
-     * configured with a idle timeout. */
-    if ((service->conn_idle_timeout = val))
-    {
-        enable_session_timeouts();
-    }
+    /** The timeout is applied to the sessions created after this */
+    service->conn_idle_timeout = val;
 
     return 1;
 }
@@ -1042,6 +1435,7 @@ serviceSetTimeout(SERVICE *service, int val)
  * @param max The maximum number of client connections at any one time
  * @param queued    The maximum number of connections to queue up when
  *                  max_connections clients are already connected
+ * @param timeout   The seconds a connection may stay queued
  * @return 1 on success, 0 when the values are invalid
  */
 int
@@ -1054,15 +1448,47 @@ serviceSetConnectionLimits(SERVICE *service, int max, int queued, int timeout)
     }
 
     service->max_connections = max;
-    if (queued && timeout)
+    service->max_queued_connections = queued;
+    service->queued_connection_timeout = timeout;
+
+    /** Each listener queues the connections it accepted, the started ones get their queue here */
+    for (SERV_LISTENER *port = service->ports; port; port = port->next)
     {
-        /* If memory allocation fails, result will be null so no queue */
-        service->queued_connections = mxs_queue_alloc(queued, timeout);
+        if (port->queued_connections)
+        {
+            /* The queue may hold connections, only the timeout changes on reload */
+            port->queued_connections->timeout = timeout;
+        }
+        else if (port->listener && queued && timeout)
+        {
+            /* If memory allocation fails, result will be null so no queue */
+            port->queued_connections = mxs_queue_alloc(queued, timeout);
+        }
     }
 
     return 1;
 }
 
+/**
+ * Sets the most bytes a session of the service may buffer in its write queues
+ * and router session. The limit applies to the sessions created after this.
+ * @param service Service to configure
+ * @param bytes The limit in bytes, 0 for no limit
+ * @return 1 on success, 0 when the value is invalid
+ */
+int
+serviceSetSessionMemoryLimit(SERVICE *service, int bytes)
+{
+    if (bytes < 0)
+    {
+        return 0;
+    }
+
+    service->max_session_memory = bytes;
+
+    return 1;
+}
+
 /**
  * Enable or disable the restarting of the service on failure.
  * @param service Service to configure
@@ -1253,6 +1679,27 @@ dprintAllServices(DCB *dcb)
     spinlock_release(&service_spin);
 }
 
+/**
+ * Print the statistics of the traffic a router has routed to a server. This
+ * is used by the diagnostics entry points of the routers.
+ *
+ * @param dcb           DCB to print data to
+ * @param server        The server
+ * @param stats         The statistics from serviceGetBackendStats
+ */
+void dprintBackendStats(DCB *dcb, SERVER *server, BACKEND_STATS *stats)
+{
+    ts_histogram_summary_t latency;
+    ts_histogram_get(stats->latency, -1, &latency);
+
+    dcb_printf(dcb, "\t\t%-20s %10" PRId64 " %12" PRId64 " %12" PRId64 " %7" PRId64
+               " %10" PRId64 " %10" PRIu64 " %10" PRIu64 "\n",
+               server->unique_name, ts_stats_sum(stats->queries),
+               ts_stats_sum(stats->bytes_out), ts_stats_sum(stats->bytes_in),
+               ts_stats_sum(stats->errors), ts_stats_sum(stats->reconnects),
+               latency.p50, latency.p99);
+}
+
 /**
  * Print details of a single service.
  *
@@ -1318,10 +1765,40 @@ void dprintService(DCB *dcb, SERVICE *service)
     }
     dcb_printf(dcb, "\tUsers data:                          %p\n",
                service->users);
+    for (SERV_LISTENER *port = service->ports; port; port = port->next)
+    {
+        if (port->auth_cache_hits || port->auth_cache_misses)
+        {
+            dcb_printf(dcb, "\tAuthentication cache (port %d):      %d hits, %d misses\n",
+                       port->port, port->auth_cache_hits, port->auth_cache_misses);
+        }
+    }
     dcb_printf(dcb, "\tTotal connections:                   %d\n",
                service->stats.n_sessions);
     dcb_printf(dcb, "\tCurrently connected:                 %d\n",
                service->stats.n_current);
+    for (SERV_LISTENER *port = service->ports; port; port = port->next)
+    {
+        if (port->queued_connections)
+        {
+            QUEUE_CONFIG *queue = port->queued_connections;
+            int n_removed = queue->n_released + queue->n_expired;
+
+            dcb_printf(dcb, "\tQueued connections (port %d):         %d (%d queued, %d rejected)\n",
+                       port->port, mxs_queue_count(queue), queue->n_queued, queue->n_rejected);
+            dcb_printf(dcb, "\tReleased connections (port %d):       %d (%d expired)\n",
+                       port->port, queue->n_released, queue->n_expired);
+            dcb_printf(dcb, "\tQueue wait (port %d, average/max):    %.1f/%.1f seconds\n",
+                       port->port, n_removed ? queue->total_wait / 10.0 / n_removed : 0.0,
+                       queue->max_wait / 10.0);
+        }
+    }
+    if (service->max_session_memory)
+    {
+        dcb_printf(dcb, "\tSession memory limit:                %d bytes (%d sessions closed)\n",
+                   service->max_session_memory, service->stats.n_memory_closed);
+    }
+    latency_print(dcb, &service->latency);
 }
 
 /**
@@ -1359,6 +1836,51 @@ dListServices(DCB *dcb)
     spinlock_release(&service_spin);
 }
 
+/**
+ * Write the metrics of the services
+ *
+ * @param metrics       The output
+ */
+void
+service_metrics(METRICS *metrics)
+{
+    SERVICE *service;
+    char name[256], router[256];
+
+    spinlock_acquire(&service_spin);
+    metrics_header(metrics, "maxscale_service_sessions_total", "counter",
+                   "Sessions created on the service");
+    for (service = allServices; service; service = service->next)
+    {
+        metrics_printf(metrics, "maxscale_service_sessions_total{service=\"%s\",router=\"%s\"} %d\n",
+                       metrics_label(service->name, name, sizeof(name)),
+                       metrics_label(service->routerModule, router, sizeof(router)),
+                       service->stats.n_sessions);
+    }
+    metrics_header(metrics, "maxscale_service_sessions", "gauge",
+                   "Current sessions of the service");
+    for (service = allServices; service; service = service->next)
+    {
+        metrics_printf(metrics, "maxscale_service_sessions{service=\"%s\",router=\"%s\"} %d\n",
+                       metrics_label(service->name, name, sizeof(name)),
+                       metrics_label(service->routerModule, router, sizeof(router)),
+                       service->stats.n_current);
+    }
+    metrics_header(metrics, "maxscale_service_query_latency_microseconds", "summary",
+                   "Time from routing a query to writing the last packet of its reply");
+    for (service = allServices; service; service = service->next)
+    {
+        char labels[600];
+
+        snprintf(labels, sizeof(labels), "service=\"%s\",router=\"%s\"",
+                 metrics_label(service->name, name, sizeof(name)),
+                 metrics_label(service->routerModule, router, sizeof(router)));
+        latency_metrics(metrics, "maxscale_service_query_latency_microseconds", labels,
+                        &service->latency);
+    }
+    spinlock_release(&service_spin);
+}
+
 /**
  * List the defined listeners in a tabular format.
  *
@@ -1489,6 +2011,11 @@ int service_refresh_users(SERVICE *service)
 
     ret = replace_mysql_users(service);
 
+    if (ret > 0)
+    {
+        service_save_users(service);
+    }
+
     /* remove lock */
     spinlock_release(&service->users_table_spin);
 
@@ -1502,6 +2029,50 @@ int service_refresh_users(SERVICE *service)
     }
 }
 
+/**
+ * The body of the thread that reloads the users of a service
+ *
+ * @param data The service
+ */
+static void service_users_loader(void *data)
+{
+    SERVICE *service = (SERVICE *)data;
+
+    service_refresh_users(service);
+    __sync_lock_release(&service->users_reload_pending);
+}
+
+/**
+ * Refresh the database users for the service without waiting for it
+ *
+ * The users are loaded in a background thread so that the polling thread that
+ * noticed the need for a reload is not stalled by the queries. The new users
+ * replace the old ones once they have been loaded. The requests made while a
+ * reload is pending are merged into it, a burst of failed logins causes at most
+ * one reload.
+ *
+ * @param service Service to reload
+ */
+void service_refresh_users_async(SERVICE *service)
+{
+    THREAD thr;
+
+    if (!__sync_bool_compare_and_swap(&service->users_reload_pending, 0, 1))
+    {
+        return;
+    }
+
+    if (thread_start(&thr, service_users_loader, service) == NULL)
+    {
+        MXS_ERROR("%s: Failed to start a thread for loading the users.", service->name);
+        __sync_lock_release(&service->users_reload_pending);
+    }
+    else
+    {
+        pthread_detach(thr);
+    }
+}
+
 bool service_set_param_value(SERVICE*            service,
                              CONFIG_PARAMETER*   param,
                              char*               valstr,
@@ -1989,6 +2560,232 @@ serviceGetList()
     return set;
 }
 
+/**
+ * Provide a row to the result set of the statistics of the servers of the
+ * services. Only the servers whose statistics are recorded by the router of
+ * the service have a row.
+ *
+ * @param set   The result set
+ * @param data  The index of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+serviceBackendStatsRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    int i = 0;
+    char buf[40];
+    RESULT_ROW *row;
+    SERVICE *service;
+    SERVER_REF *ref = NULL;
+
+    spinlock_acquire(&service_spin);
+
+    for (service = allServices; service; service = service->next)
+    {
+        for (ref = service->dbref; ref; ref = ref->next)
+        {
+            if (ref->stats && i++ == *rowno)
+            {
+                break;
+            }
+        }
+
+        if (ref)
+        {
+            break;
+        }
+    }
+
+    if (ref == NULL)
+    {
+        spinlock_release(&service_spin);
+        free(data);
+        return NULL;
+    }
+    (*rowno)++;
+
+    BACKEND_STATS *stats = ref->stats;
+    ts_histogram_summary_t latency;
+    ts_histogram_get(stats->latency, -1, &latency);
+
+    row = resultset_make_row(set);
+    resultset_row_set(row, 0, service->name);
+    resultset_row_set(row, 1, ref->server->unique_name);
+    snprintf(buf, sizeof(buf), "%" PRId64, ts_stats_sum(stats->queries));
+    resultset_row_set(row, 2, buf);
+    snprintf(buf, sizeof(buf), "%" PRId64, ts_stats_sum(stats->bytes_in));
+    resultset_row_set(row, 3, buf);
+    snprintf(buf, sizeof(buf), "%" PRId64, ts_stats_sum(stats->bytes_out));
+    resultset_row_set(row, 4, buf);
+    snprintf(buf, sizeof(buf), "%" PRId64, ts_stats_sum(stats->errors));
+    resultset_row_set(row, 5, buf);
+    snprintf(buf, sizeof(buf), "%" PRId64, ts_stats_sum(stats->reconnects));
+    resultset_row_set(row, 6, buf);
+    snprintf(buf, sizeof(buf), "%" PRId64, ts_stats_sum(stats->sescmd_replays));
+    resultset_row_set(row, 7, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, latency.count);
+    resultset_row_set(row, 8, buf);
+    snprintf(buf, sizeof(buf), "%.0f", latency.mean);
+    resultset_row_set(row, 9, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, latency.p50);
+    resultset_row_set(row, 10, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, latency.p99);
+    resultset_row_set(row, 11, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, latency.p999);
+    resultset_row_set(row, 12, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, latency.max);
+    resultset_row_set(row, 13, buf);
+    spinlock_release(&service_spin);
+    return row;
+}
+
+/**
+ * Return a result set with the statistics of the traffic each service routes
+ * to each of its servers. The latencies are in microseconds.
+ *
+ * @return A Result set
+ */
+RESULTSET *
+serviceGetBackendStatsList()
+{
+    RESULTSET *set;
+    int *data;
+
+    if ((data = (int *)malloc(sizeof(int))) == NULL)
+    {
+        return NULL;
+    }
+    *data = 0;
+    if ((set = resultset_create(serviceBackendStatsRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Service Name", 25, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Server", 25, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Queries", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Bytes In", 15, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Bytes Out", 15, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Errors", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Reconnects", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Sescmd Replays", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Replies", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Latency Avg", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Latency P50", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Latency P99", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Latency P99.9", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Latency Max", 10, COL_TYPE_VARCHAR);
+
+    return set;
+}
+
+/**
+ * Provide a row to the result set of the replication metrics of the slaves
+ * of the services. Only the services whose router has the getSlaveMetrics
+ * entry point have rows.
+ *
+ * @param set   The result set
+ * @param data  The index of the row to send
+ * @return The next row or NULL
+ */
+static RESULT_ROW *
+serviceSlaveMetricsRowCallback(RESULTSET *set, void *data)
+{
+    int *rowno = (int *)data;
+    int n = *rowno;
+    char buf[40];
+    RESULT_ROW *row;
+    SERVICE *service;
+    ROUTER_SLAVE_METRICS metrics;
+
+    spinlock_acquire(&service_spin);
+
+    for (service = allServices; service; service = service->next)
+    {
+        if (service->router && service->router->getSlaveMetrics && service->router_instance)
+        {
+            int n_slaves = service->router->getSlaveMetrics(service->router_instance, n, &metrics);
+
+            if (n < n_slaves)
+            {
+                break;
+            }
+
+            n -= n_slaves;
+        }
+    }
+
+    if (service == NULL)
+    {
+        spinlock_release(&service_spin);
+        free(data);
+        return NULL;
+    }
+    (*rowno)++;
+
+    row = resultset_make_row(set);
+    resultset_row_set(row, 0, service->name);
+    resultset_row_set(row, 1, metrics.host);
+    snprintf(buf, sizeof(buf), "%d", metrics.server_id);
+    resultset_row_set(row, 2, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, metrics.bytes_behind);
+    resultset_row_set(row, 3, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, metrics.seconds_behind);
+    resultset_row_set(row, 4, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, metrics.send_rate);
+    resultset_row_set(row, 5, buf);
+    snprintf(buf, sizeof(buf), "%.1f", metrics.catchup_ratio * 100.0);
+    resultset_row_set(row, 6, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, metrics.catchup_bursts.count);
+    resultset_row_set(row, 7, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, metrics.catchup_bursts.p50);
+    resultset_row_set(row, 8, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, metrics.catchup_bursts.p99);
+    resultset_row_set(row, 9, buf);
+    snprintf(buf, sizeof(buf), "%" PRIu64, metrics.catchup_bursts.max);
+    resultset_row_set(row, 10, buf);
+    spinlock_release(&service_spin);
+    return row;
+}
+
+/**
+ * Return a result set with the replication metrics of the slaves that
+ * replicate from the services. The burst durations are in microseconds.
+ *
+ * @return A Result set
+ */
+RESULTSET *
+serviceGetSlaveMetricsList()
+{
+    RESULTSET *set;
+    int *data;
+
+    if ((data = (int *)malloc(sizeof(int))) == NULL)
+    {
+        return NULL;
+    }
+    *data = 0;
+    if ((set = resultset_create(serviceSlaveMetricsRowCallback, data)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    resultset_add_column(set, "Service Name", 25, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Slave", 40, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Server Id", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Bytes Behind", 15, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Seconds Behind", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Send Rate", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Catchup Pct", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Bursts", 12, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Burst P50", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Burst P99", 10, COL_TYPE_VARCHAR);
+    resultset_add_column(set, "Burst Max", 10, COL_TYPE_VARCHAR);
+
+    return set;
+}
+
 /**
  * Function called by the housekeeper thread to retry starting of a service
  * @param data Service to restart
@@ -28,6 +28,8 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -40,30 +42,65 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <housekeeper.h>
+#include <maxscale/poll.h>
+#include <bufpool.h>
+#include <probes.h>
+#include <memstats.h>
 
 /** Global session id; updated safely by holding session_spin */
 static size_t session_id;
 
-static SPINLOCK session_spin = SPINLOCK_INIT;
-static SESSION *allSessions = NULL;
-static SESSION *lastSession = NULL;
-static SESSION *wasfreeSession = NULL;
-static int freeSessionCount = 0;
+static SPINLOCK session_spin = SPINLOCK_INIT_NAMED("session ID");
 
-static struct session session_dummy_struct;
+/** The number of buckets in the indexes of the sessions in use */
+#define SESSION_INDEX_BUCKETS 4096
+
+/** The number of locks the buckets of an index are striped over */
+#define SESSION_INDEX_LOCKS 64
 
 /**
- * These two are declared in session.h
+ * A hash index of the sessions in use. A bucket is protected by the lock of
+ * its stripe, so that adding, removing and finding a session lock one stripe.
+ * Only the diagnostics that walk all the sessions lock every stripe.
  */
-bool check_timeouts = false;
-long next_timeout_check = 0;
+typedef struct
+{
+    SPINLOCK lock[SESSION_INDEX_LOCKS];
+    SESSION  *buckets[SESSION_INDEX_BUCKETS];
+} SESSION_INDEX;
 
-static SPINLOCK timeout_lock = SPINLOCK_INIT;
+/** The sessions by their address, also the registry of the sessions in use */
+static SESSION_INDEX session_registry =
+{
+    {[0 ... SESSION_INDEX_LOCKS - 1] = SPINLOCK_INIT_NAMED("session registry")}
+};
+/** The sessions by their ID */
+static SESSION_INDEX sessions_by_id =
+{
+    {[0 ... SESSION_INDEX_LOCKS - 1] = SPINLOCK_INIT_NAMED("session ID index")}
+};
+/** The sessions by their router session */
+static SESSION_INDEX sessions_by_rses =
+{
+    {[0 ... SESSION_INDEX_LOCKS - 1] = SPINLOCK_INIT_NAMED("router session index")}
+};
+
+/** The link of a session in the bucket chain of an index */
+#define SESSION_INDEX_NEXT(s, link) (*(SESSION **)((char *)(s) + (link)))
+/** The lock of the stripe of a bucket */
+#define SESSION_INDEX_LOCK(index, bucket) (&(index)->lock[(bucket) % SESSION_INDEX_LOCKS])
+
+static struct session session_dummy_struct;
 
 static int session_setup_filters(SESSION *session);
+static int session_route_filter(void *instance, void *session, GWBUF *queue);
+static void session_idle_timeout(void *data);
 static void session_simple_free(SESSION *session, DCB *dcb);
-static void session_add_to_all_list(SESSION *session);
-static SESSION *session_find_free();
+static void session_index_add(SESSION_INDEX *index, size_t link, unsigned int bucket,
+                              SESSION *session);
+static void session_index_remove(SESSION_INDEX *index, size_t link, unsigned int bucket,
+                                 SESSION *session);
+static unsigned int session_ptr_bucket(void *ptr);
 static void session_final_free(SESSION *session);
 
 /**
@@ -82,9 +119,15 @@ session_alloc(SERVICE *service, DCB *client_dcb)
 {
     SESSION *session;
 
-    spinlock_acquire(&session_spin);
-    session = session_find_free();
-    spinlock_release(&session_spin);
+    /** The sessions come from the per-thread caches of the buffer pools */
+    if ((session = bufpool_alloc(sizeof(SESSION))) != NULL)
+    {
+        memstats_add(MEMSTATS_SESSIONS, sizeof(SESSION), 1);
+        memset(session, 0, sizeof(SESSION));
+        session->ses_is_in_use = true;
+        session_index_add(&session_registry, offsetof(SESSION, next),
+                          session_ptr_bucket(session), session);
+    }
     ss_info_dassert(session != NULL, "Allocating memory for session failed.");
 
     if (session == NULL)
@@ -103,6 +146,7 @@ session_alloc(SERVICE *service, DCB *client_dcb)
     session->ses_is_child = (bool) DCB_IS_CLONE(client_dcb);
     spinlock_init(&session->ses_lock);
     session->service = service;
+    session->memory_limit = service->max_session_memory;
     session->client_dcb = client_dcb;
     session->n_filters = 0;
     memset(&session->stats, 0, sizeof(SESSION_STATS));
@@ -136,7 +180,12 @@ session_alloc(SERVICE *service, DCB *client_dcb)
         client_dcb->dcb_role != DCB_ROLE_INTERNAL)
     {
         session->router_session = service->router->newSession(service->router_instance, session);
-        if (session->router_session == NULL)
+        if (session->router_session)
+        {
+            session_index_add(&sessions_by_rses, offsetof(SESSION, next_by_rses),
+                              session_ptr_bucket(session->router_session), session);
+        }
+        else
         {
             session->state = SESSION_STATE_TO_BE_FREED;
             MXS_ERROR("Failed to create new router session for service '%s'. "
@@ -203,100 +252,174 @@ session_alloc(SERVICE *service, DCB *client_dcb)
     /** Assign a session id and increase, insert session into list */
     session->ses_id = ++session_id;
     spinlock_release(&session_spin);
+    MXS_PROBE2(session__create, session->ses_id, service->name);
+    session_index_add(&sessions_by_id, offsetof(SESSION, next_by_id),
+                      session->ses_id % SESSION_INDEX_BUCKETS, session);
     atomic_add(&service->stats.n_sessions, 1);
     atomic_add(&service->stats.n_current, 1);
     CHK_SESSION(session);
 
     client_dcb->session = session;
+
+    if (SESSION_STATE_TO_BE_FREED != session->state &&
+        client_dcb->dcb_role == DCB_ROLE_CLIENT_HANDLER &&
+        service->conn_idle_timeout > 0)
+    {
+        timer_init(&session->idle_timer, session_idle_timeout, session);
+        timer_add(poll_timer_wheel(client_dcb), &session->idle_timer,
+                  service->conn_idle_timeout * 10);
+    }
     return SESSION_STATE_TO_BE_FREED == session->state ? NULL : session;
 }
 
 /**
- * Add a new session to the list of all sessions.
+ * Find the bucket of a pointer in an index
  *
- * Must be called with the general session lock held.
+ * @param ptr   The pointer
+ * @return      The bucket
+ */
+static unsigned int
+session_ptr_bucket(void *ptr)
+{
+    /** The low bits of an allocation are always the same, mix the rest */
+    return (unsigned int)(((uintptr_t)ptr >> 4) * 2654435761u) % SESSION_INDEX_BUCKETS;
+}
+
+/**
+ * Add a session to an index
  *
- * A pointer, lastSession, is held to find the end of the list, and the new session
- * is linked to the end of the list.  The pointer, wasfreeSession, that is used to
- * search for a free session is initialised if not already set. There cannot be
- * any free sessions (or any at all) until this routine has been called at least
- * once. Hence it will not be referred to until after it is initialised.
+ * @param index         The index
+ * @param link          The offset of the link of the index in the session
+ * @param bucket        The bucket of the session
+ * @param session       The session to be added
+ */
+static void
+session_index_add(SESSION_INDEX *index, size_t link, unsigned int bucket, SESSION *session)
+{
+    spinlock_acquire(SESSION_INDEX_LOCK(index, bucket));
+    SESSION_INDEX_NEXT(session, link) = index->buckets[bucket];
+    index->buckets[bucket] = session;
+    spinlock_release(SESSION_INDEX_LOCK(index, bucket));
+}
+
+/**
+ * Remove a session from an index. Nothing is done if the session is not in
+ * the bucket.
  *
- * @param session       The session to be added to the list
+ * @param index         The index
+ * @param link          The offset of the link of the index in the session
+ * @param bucket        The bucket of the session
+ * @param session       The session to be removed
  */
 static void
-session_add_to_all_list(SESSION *session)
+session_index_remove(SESSION_INDEX *index, size_t link, unsigned int bucket, SESSION *session)
 {
-    if (allSessions == NULL)
+    SESSION **ptr;
+
+    spinlock_acquire(SESSION_INDEX_LOCK(index, bucket));
+    for (ptr = &index->buckets[bucket]; *ptr; ptr = &SESSION_INDEX_NEXT(*ptr, link))
     {
-        allSessions = session;
+        if (*ptr == session)
+        {
+            *ptr = SESSION_INDEX_NEXT(session, link);
+            break;
+        }
     }
-    else
+    spinlock_release(SESSION_INDEX_LOCK(index, bucket));
+    SESSION_INDEX_NEXT(session, link) = NULL;
+}
+
+/**
+ * Remove a session from the index of the router sessions. This is done
+ * before the router session is freed, as its address may be reused.
+ *
+ * @param session       The session
+ */
+static void
+session_rses_remove(SESSION *session)
+{
+    if (session->router_session)
     {
-        lastSession->next = session;
+        session_index_remove(&sessions_by_rses, offsetof(SESSION, next_by_rses),
+                             session_ptr_bucket(session->router_session), session);
     }
-    lastSession = session;
-    if (NULL == wasfreeSession)
+}
+
+/**
+ * Lock all the stripes of the session registry
+ */
+static void
+session_registry_lock()
+{
+    int i;
+
+    for (i = 0; i < SESSION_INDEX_LOCKS; i++)
     {
-        wasfreeSession = session;
+        spinlock_acquire(&session_registry.lock[i]);
     }
 }
 
 /**
- * Find a free session or allocate memory for a new one.
- *
- * This routine looks to see whether there are free session memory areas.
- * If not, new memory is allocated, if possible, and the new session is added to
- * the list of all sessions.
- *
- * Must be called with the general session lock held.
- *
- * @return An available session or NULL if none could be allocated.
+ * Unlock all the stripes of the session registry
  */
-static SESSION *
-session_find_free()
+static void
+session_registry_unlock()
 {
-    SESSION *nextsession;
+    int i;
 
-    if (freeSessionCount <= 0)
+    for (i = SESSION_INDEX_LOCKS - 1; i >= 0; i--)
     {
-        SESSION *newsession;
-        if ((newsession = calloc(1, sizeof(SESSION))) == NULL)
-        {
-            return NULL;
-        }
-        newsession->next = NULL;
-        session_add_to_all_list(newsession);
-        newsession->ses_is_in_use = true;
-        return newsession;
+        spinlock_release(&session_registry.lock[i]);
     }
-    /* Starting at the last place a free session was found, loop through the */
-    /* list of sessions searching for one that is not in use. */
-    while (wasfreeSession->ses_is_in_use)
+}
+
+/**
+ * Find the first session of the registry at or after a bucket
+ *
+ * Must be called with the registry locked.
+ *
+ * @param bucket    The bucket to start from
+ * @return          The first session or NULL if the buckets are empty
+ */
+static SESSION *
+session_registry_bucket_first(unsigned int bucket)
+{
+    for (; bucket < SESSION_INDEX_BUCKETS; bucket++)
     {
-        int loopcount = 0;
-        wasfreeSession = wasfreeSession->next;
-        if (NULL == wasfreeSession)
+        if (session_registry.buckets[bucket])
         {
-            loopcount++;
-            if (loopcount > 1)
-            {
-                /* Shouldn't need to loop round more than once */
-                MXS_ERROR("Find free session failed to find a session even"
-                          " though free count was positive");
-                return NULL;
-            }
-            wasfreeSession = allSessions;
+            return session_registry.buckets[bucket];
         }
     }
-    /* Dropping out of the loop means we have found a session that is not in use */
-    freeSessionCount--;
-    /* Clear the old data, then reset the list forward link */
-    nextsession = wasfreeSession->next;
-    memset(wasfreeSession, 0, sizeof(SESSION));
-    wasfreeSession->next = nextsession;
-    wasfreeSession->ses_is_in_use = true;
-    return wasfreeSession;
+    return NULL;
+}
+
+/**
+ * Return the first session of the registry
+ *
+ * Must be called with the registry locked.
+ *
+ * @return The first session or NULL if there are no sessions in use
+ */
+static SESSION *
+session_registry_first()
+{
+    return session_registry_bucket_first(0);
+}
+
+/**
+ * Return the session following a session in the registry
+ *
+ * Must be called with the registry locked.
+ *
+ * @param session       The current session
+ * @return              The next session or NULL if the session is the last one
+ */
+static SESSION *
+session_registry_next(SESSION *session)
+{
+    return session->next ? session->next :
+           session_registry_bucket_first(session_ptr_bucket(session) + 1);
 }
 
 /**
@@ -413,6 +536,7 @@ session_simple_free(SESSION *session, DCB *dcb)
         {
             return;
         }
+        session_rses_remove(session);
         if (session && session->router_session)
         {
             session->service->router->freeSession(
@@ -449,6 +573,9 @@ session_free(SESSION *session)
         return false;
     }
     session->state = SESSION_STATE_TO_BE_FREED;
+    MXS_PROBE2(session__close, session->ses_id, session->service->name);
+    timer_remove(&session->idle_timer);
+    session_rses_remove(session);
 
     atomic_add(&session->service->stats.n_current, -1);
 
@@ -487,7 +614,7 @@ session_free(SESSION *session)
                                                              session->filters[i].session);
             }
         }
-        free(session->filters);
+        memstats_free(MEMSTATS_SESSIONS, session->filters);
     }
 
     MXS_INFO("Stopped %s client session [%lu]",
@@ -509,15 +636,23 @@ session_free(SESSION *session)
 static void
 session_final_free(SESSION *session)
 {
-    /* We never free the actual session, it is available for reuse*/
-    spinlock_acquire(&session_spin);
+    timer_remove(&session->idle_timer);
+    session_rses_remove(session);
+    if (session->ses_id)
+    {
+        session_index_remove(&sessions_by_id, offsetof(SESSION, next_by_id),
+                             session->ses_id % SESSION_INDEX_BUCKETS, session);
+    }
+    session_index_remove(&session_registry, offsetof(SESSION, next),
+                         session_ptr_bucket(session), session);
     session->ses_is_in_use = false;
-    freeSessionCount++;
-    spinlock_release(&session_spin);
+    memstats_add(MEMSTATS_SESSIONS, -(int64_t)sizeof(SESSION), -1);
+    bufpool_free(session, sizeof(SESSION));
 }
 
 /**
- * Check to see if a session is valid, i.e. in the list of all sessions
+ * Check to see if a session is valid, i.e. in the registry of the sessions
+ * in use. Only the bucket of the session is searched.
  *
  * @param session       Session to check
  * @return              1 if the session is valid otherwise 0
@@ -525,23 +660,18 @@ session_final_free(SESSION *session)
 int
 session_isvalid(SESSION *session)
 {
+    unsigned int bucket = session_ptr_bucket(session);
     SESSION *list_session;
-    int rval = 0;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    while (list_session)
+    spinlock_acquire(SESSION_INDEX_LOCK(&session_registry, bucket));
+    list_session = session_registry.buckets[bucket];
+    while (list_session && list_session != session)
     {
-        if (list_session->ses_is_in_use && list_session == session)
-        {
-            rval = 1;
-            break;
-        }
         list_session = list_session->next;
     }
-    spinlock_release(&session_spin);
+    spinlock_release(SESSION_INDEX_LOCK(&session_registry, bucket));
 
-    return rval;
+    return list_session != NULL;
 }
 
 /**
@@ -574,17 +704,17 @@ printAllSessions()
 {
     SESSION *list_session;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
+    session_registry_lock();
+    list_session = session_registry_first();
     while (list_session)
     {
         if (list_session->ses_is_in_use)
         {
             printSession(list_session);
         }
-        list_session = list_session->next;
+        list_session = session_registry_next(list_session);
     }
-    spinlock_release(&session_spin);
+    session_registry_unlock();
 }
 
 
@@ -601,13 +731,13 @@ CheckSessions()
     int noclients = 0;
     int norouter = 0;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
+    session_registry_lock();
+    list_session = session_registry_first();
     while (list_session)
     {
         if (false == list_session->ses_is_in_use)
         {
-            list_session = list_session->next;
+            list_session = session_registry_next(list_session);
             continue;
         }
         if (list_session->state != SESSION_STATE_LISTENER ||
@@ -624,20 +754,20 @@ CheckSessions()
                 noclients++;
             }
         }
-        list_session = list_session->next;
+        list_session = session_registry_next(list_session);
     }
-    spinlock_release(&session_spin);
+    session_registry_unlock();
     if (noclients)
     {
         printf("%d Sessions have no clients\n", noclients);
     }
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
+    session_registry_lock();
+    list_session = session_registry_first();
     while (list_session)
     {
         if (false == list_session->ses_is_in_use)
         {
-            list_session = list_session->next;
+            list_session = session_registry_next(list_session);
             continue;
         }
         if (list_session->state != SESSION_STATE_LISTENER ||
@@ -654,9 +784,9 @@ CheckSessions()
                 norouter++;
             }
         }
-        list_session = list_session->next;
+        list_session = session_registry_next(list_session);
     }
-    spinlock_release(&session_spin);
+    session_registry_unlock();
     if (norouter)
     {
         printf("%d Sessions have no router session\n", norouter);
@@ -676,21 +806,21 @@ dprintAllSessions(DCB *dcb)
 {
     SESSION *list_session;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
+    session_registry_lock();
+    list_session = session_registry_first();
     while (list_session)
     {
         if (false == list_session->ses_is_in_use)
         {
-            list_session = list_session->next;
+            list_session = session_registry_next(list_session);
             continue;
         }
 
         dprintSession(dcb, list_session);
 
-        list_session = list_session->next;
+        list_session = session_registry_next(list_session);
     }
-    spinlock_release(&session_spin);
+    session_registry_unlock();
 }
 
 /**
@@ -757,8 +887,8 @@ dListSessions(DCB *dcb)
 {
     SESSION *list_session;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
+    session_registry_lock();
+    list_session = session_registry_first();
     if (list_session)
     {
         dcb_printf(dcb, "Sessions.\n");
@@ -777,14 +907,14 @@ dListSessions(DCB *dcb)
                         : ""),
                        session_state(list_session->state));
         }
-        list_session = list_session->next;
+        list_session = session_registry_next(list_session);
     }
-    if (allSessions)
+    if (session_registry_first())
     {
         dcb_printf(dcb,
                    "-----------------+-----------------+----------------+--------------------------\n\n");
     }
-    spinlock_release(&session_spin);
+    session_registry_unlock();
 }
 
 /**
@@ -823,17 +953,16 @@ session_state(session_state_t state)
 
 SESSION* get_session_by_router_ses(void* rses)
 {
-    SESSION* ses = allSessions;
-
-    while (((ses->ses_is_in_use == false) || (ses->router_session != rses)) && ses->next != NULL)
-    {
-        ses = ses->next;
-    }
+    unsigned int bucket = session_ptr_bucket(rses);
+    SESSION* ses;
 
-    if (ses->ses_is_in_use == false || ses->router_session != rses)
+    spinlock_acquire(SESSION_INDEX_LOCK(&sessions_by_rses, bucket));
+    ses = sessions_by_rses.buckets[bucket];
+    while (ses && ses->router_session != rses)
     {
-        ses = NULL;
+        ses = ses->next_by_rses;
     }
+    spinlock_release(SESSION_INDEX_LOCK(&sessions_by_rses, bucket));
     return ses;
 }
 
@@ -858,8 +987,8 @@ session_setup_filters(SESSION *session)
     UPSTREAM *tail;
     int i;
 
-    if ((session->filters = calloc(service->n_filters,
-                                   sizeof(SESSION_FILTER))) == NULL)
+    if ((session->filters = memstats_calloc(MEMSTATS_SESSIONS, service->n_filters,
+                                            sizeof(SESSION_FILTER))) == NULL)
     {
         MXS_ERROR("Insufficient memory to allocate session filter "
                   "tracking.\n");
@@ -885,12 +1014,30 @@ session_setup_filters(SESSION *session)
         session->filters[i].filter = service->filters[i];
         session->filters[i].session = head->session;
         session->filters[i].instance = head->instance;
-        session->head = *head;
+        session->filters[i].interest = filterInterest(service->filters[i]);
+        if ((session->filters[i].interest & FILTER_INTEREST_COMMANDS) != FILTER_INTEREST_COMMANDS)
+        {
+            /** Link the filter so that the other commands skip it */
+            session->filters[i].down = *head;
+            session->filters[i].skip = session->head;
+            session->head.instance = &session->filters[i];
+            session->head.session = session;
+            session->head.routeQuery = session_route_filter;
+        }
+        else
+        {
+            session->head = *head;
+        }
         free(head);
     }
 
     for (i = 0; i < service->n_filters; i++)
     {
+        if ((session->filters[i].interest & FILTER_INTEREST_REPLIES) == 0)
+        {
+            /** The filter does not need to see the results */
+            continue;
+        }
         if ((tail = filterUpstream(service->filters[i],
                                    session->filters[i].session,
                                    &session->tail)) == NULL)
@@ -916,6 +1063,44 @@ session_setup_filters(SESSION *session)
     return 1;
 }
 
+/**
+ * Entry point for the link of a filter that is only interested in some of
+ * the commands. The packets of the other commands are routed past the filter.
+ * The streamed continuation of a packet takes the same path as the packet.
+ *
+ * @param       instance        The session filter
+ * @param       session         The session
+ * @param       queue           The packet to route
+ * @return      The return value of the routeQuery that was called
+ */
+static int
+session_route_filter(void *instance, void *session, GWBUF *queue)
+{
+    SESSION_FILTER *filter = (SESSION_FILTER *)instance;
+    DOWNSTREAM *next = &filter->down;
+
+    if (GWBUF_IS_TYPE_STREAM(queue))
+    {
+        if (filter->skipped)
+        {
+            next = &filter->skip;
+        }
+    }
+    else
+    {
+        uint8_t cmd = GWBUF_LENGTH(queue) > 4 ? ((uint8_t *)GWBUF_DATA(queue))[4] : 0xff;
+
+        filter->skipped = cmd < 32 && (filter->interest & FILTER_INTEREST_COMMAND(cmd)) == 0;
+
+        if (filter->skipped)
+        {
+            next = &filter->skip;
+        }
+    }
+
+    return next->routeQuery(next->instance, next->session, queue);
+}
+
 /**
  * Entry point for the final element int he upstream filter, i.e. the writing
  * of the data to the client.
@@ -932,6 +1117,97 @@ session_reply(void *instance, void *session, GWBUF *data)
     return the_session->client_dcb->func.write(the_session->client_dcb, data);
 }
 
+/**
+ * Start measuring the latency of a query. The client protocol calls this just
+ * before it routes a query whose reply it follows. A query is counted as a
+ * write unless the router tells otherwise.
+ *
+ * @param session   The session
+ */
+void
+session_latency_start(SESSION *session)
+{
+    session->query_start = latency_now();
+    session->query_kind = LATENCY_WRITE;
+    session->query_server = NULL;
+}
+
+/**
+ * Record where the router sent the query being measured
+ *
+ * @param session   The session
+ * @param server    The server the query was sent to
+ * @param is_write  True if the query was routed as a write
+ */
+void
+session_latency_target(SESSION *session, SERVER *server, bool is_write)
+{
+    MXS_PROBE3(route__target, session->ses_id, server ? server->unique_name : NULL, is_write);
+    if (session->query_start)
+    {
+        session->query_kind = is_write ? LATENCY_WRITE : LATENCY_READ;
+        session->query_server = server;
+        trace_point(&session->trace, TRACE_TARGET);
+    }
+}
+
+/**
+ * End measuring the latency of a query. The client protocol calls this when it
+ * writes the last packet of the reply to the client. The latency is added to
+ * the service and to the server that replied.
+ *
+ * @param session   The session
+ */
+void
+session_latency_end(SESSION *session)
+{
+    if (session->query_start)
+    {
+        uint64_t usecs = latency_now() - session->query_start;
+
+        latency_add(&session->service->latency, session->query_kind, usecs);
+        if (session->query_server)
+        {
+            latency_add(&session->query_server->latency, session->query_kind, usecs);
+        }
+        session->query_start = 0;
+        trace_end(session);
+    }
+}
+
+/**
+ * Count the bytes a session buffers. The bytes in the write queues drain by
+ * themselves and the flow control of the DCBs stops the reads that fill them
+ * while the session is over its limit. The other bytes, e.g. the session
+ * command history of a router, stay until the router releases them, so a
+ * session whose other bytes alone go over the limit is closed.
+ *
+ * @param session   The session
+ * @param bytes     The bytes buffered, negative for the bytes released
+ * @param in_writeq True if the bytes are in the write queue of a DCB
+ */
+void
+session_buffered_add(SESSION *session, int bytes, bool in_writeq)
+{
+    atomic_add(&session->buffered, bytes);
+
+    if (!in_writeq)
+    {
+        int held = atomic_add(&session->buffered_held, bytes) + bytes;
+
+        if (session->memory_limit && bytes > 0 && held > session->memory_limit &&
+            atomic_add(&session->memory_exceeded, 1) == 0 && session->client_dcb)
+        {
+            MXS_ERROR("Session %lu of service '%s' buffers %d bytes, more than "
+                      "the max_session_memory of %d bytes. Closing the session.",
+                      session->ses_id, session->service->name, held,
+                      session->memory_limit);
+            atomic_add(&session->service->stats.n_memory_closed, 1);
+            poll_fake_hangup_event(session->client_dcb);
+        }
+    }
+}
+
 /**
  * Return the client connection address or name
  *
@@ -985,135 +1261,166 @@ session_getUser(SESSION *session)
     return (session && session->client_dcb) ? session->client_dcb->user : NULL;
 }
 /**
- * Return the pointer to the list of all sessions.
- * @return Pointer to the list of all sessions.
- */
-SESSION *get_all_sessions()
-{
-    return allSessions;
-}
-
-/**
- * Enable the timing out of idle connections.
+ * Find a session in use by its ID and take a reference to it. The reference
+ * keeps the session from being freed and is dropped with session_free().
  *
- * This will prevent unnecessary acquisitions of the session spinlock if no
- * service is configured with a session idle timeout.
+ * @param id    The ID of the session
+ * @return      The session or NULL if no session in use has the ID
  */
-void enable_session_timeouts()
+SESSION *session_get_by_id(size_t id)
 {
-    check_timeouts = true;
-}
+    unsigned int bucket = id % SESSION_INDEX_BUCKETS;
+    SESSION *session;
 
+    spinlock_acquire(SESSION_INDEX_LOCK(&sessions_by_id, bucket));
+    session = sessions_by_id.buckets[bucket];
+    while (session && session->ses_id != id)
+    {
+        session = session->next_by_id;
+    }
+    if (session)
+    {
+        /** A session that lost its last reference stays in the index until it is freed */
+        int refcount;
+
+        do
+        {
+            refcount = session->refcount;
+        }
+        while (refcount > 0 &&
+               !__sync_bool_compare_and_swap(&session->refcount, refcount, refcount + 1));
+
+        if (refcount == 0)
+        {
+            session = NULL;
+        }
+    }
+    spinlock_release(SESSION_INDEX_LOCK(&sessions_by_id, bucket));
+    return session;
+}
 /**
- * Close sessions that have been idle for too long.
+ * The idle timeout timer function of a session.
+ *
+ * The timer is not moved every time the client sends data. Instead, when the
+ * timer expires, the session is closed if the client has been idle for longer
+ * than the timeout of the service, otherwise the timer is added back to expire
+ * when the timeout is next due.
  *
- * If the time since a session last sent data is greater than the set value in the
- * service, it is disconnected. The connection timeout is disabled by default.
+ * @param data  The session
  */
-void process_idle_sessions()
+static void
+session_idle_timeout(void *data)
 {
-    if (spinlock_acquire_nowait(&timeout_lock))
-    {
-        if (hkheartbeat >= next_timeout_check)
-        {
-            /** Because the resolution of the timeout is one second, we only need to
-             * check for it once per second. One heartbeat is 100 milliseconds. */
-            next_timeout_check = hkheartbeat + 10;
-            spinlock_acquire(&session_spin);
-            SESSION *all_session = allSessions;
+    SESSION *session = (SESSION *)data;
+    DCB *client_dcb = session->client_dcb;
+    long timeout = session->service->conn_idle_timeout * 10;
 
-            while (all_session)
-            {
-                if (all_session->ses_is_in_use &&
-                    all_session->service && all_session->client_dcb && all_session->client_dcb->state == DCB_STATE_POLLING &&
-                    hkheartbeat - all_session->client_dcb->last_read > all_session->service->conn_idle_timeout * 10)
-                {
-                    dcb_close(all_session->client_dcb);
-                }
+    if (session->ses_is_in_use && timeout > 0 &&
+        client_dcb && client_dcb->state == DCB_STATE_POLLING)
+    {
+        long idle = hkheartbeat - client_dcb->last_read;
 
-                all_session = all_session->next;
-            }
-            spinlock_release(&session_spin);
+        if (idle > timeout)
+        {
+            dcb_close(client_dcb);
+        }
+        else
+        {
+            timer_add(session->idle_timer.wheel, &session->idle_timer, timeout - idle + 1);
         }
-        spinlock_release(&timeout_lock);
     }
 }
 
 /**
- * Callback structure for the session list extraction
+ * Callback structure for the session list extraction. The position of the
+ * list is kept as a bucket of the registry and an offset in its chain, so that
+ * a row only locks the stripe of one bucket.
  */
 typedef struct
 {
-    int index;
+    unsigned int bucket;
+    int pos;
     SESSIONLISTFILTER filter;
 } SESSIONFILTER;
 
+/**
+ * Check the service and the state of a session against the conditions of a
+ * result set of sessions, so that no row is made of the sessions the
+ * conditions exclude
+ *
+ * @param set   The result set
+ * @param session The session
+ * @return True if the session may be in the result set
+ */
+static bool
+sessionRowWanted(RESULTSET *set, SESSION *session)
+{
+    return resultset_value_matches(set, 2, session->service && session->service->name ?
+                                   session->service->name : "") &&
+           resultset_value_matches(set, 3, session_state(session->state));
+}
+
 /**
  * Provide a row to the result set that defines the set of sessions
  *
  * @param set   The result set
- * @param data  The index of the row to send
+ * @param data  The position of the row to send
  * @return The next row or NULL
  */
 static RESULT_ROW *
 sessionRowCallback(RESULTSET *set, void *data)
 {
     SESSIONFILTER *cbdata = (SESSIONFILTER *)data;
-    int i = 0;
     char buf[20];
-    RESULT_ROW *row;
-    SESSION *list_session;
+    RESULT_ROW *row = NULL;
 
-    spinlock_acquire(&session_spin);
-    list_session = allSessions;
-    /* Skip to the first non-listener if not showing listeners */
-    while (false == list_session->ses_is_in_use ||
-           (list_session && cbdata->filter == SESSION_LIST_CONNECTION &&
-            list_session->state == SESSION_STATE_LISTENER))
-    {
-        list_session = list_session->next;
-    }
-    while (i < cbdata->index && list_session)
+    for (; row == NULL && cbdata->bucket < SESSION_INDEX_BUCKETS; cbdata->bucket++, cbdata->pos = 0)
     {
-        if (list_session->ses_is_in_use)
+        SPINLOCK *lock = SESSION_INDEX_LOCK(&session_registry, cbdata->bucket);
+        SESSION *list_session;
+        int i = 0;
+
+        spinlock_acquire(lock);
+        list_session = session_registry.buckets[cbdata->bucket];
+        while (list_session && i < cbdata->pos)
         {
-            if (cbdata->filter == SESSION_LIST_CONNECTION &&
-                list_session->state !=  SESSION_STATE_LISTENER)
-            {
-                i++;
-            }
-            else if (cbdata->filter == SESSION_LIST_ALL)
-            {
-                i++;
-            }
+            list_session = list_session->next;
+            i++;
+        }
+        /* Skip the sessions not in use, the listeners if not showing them and
+         * the sessions the conditions of the result set exclude */
+        while (list_session && (false == list_session->ses_is_in_use ||
+                                (cbdata->filter == SESSION_LIST_CONNECTION &&
+                                 list_session->state == SESSION_STATE_LISTENER) ||
+                                !sessionRowWanted(set, list_session)))
+        {
+            list_session = list_session->next;
+            i++;
+        }
+        if (list_session)
+        {
+            row = resultset_make_row(set);
+            snprintf(buf,19, "%p", list_session);
+            buf[19] = '\0';
+            resultset_row_set(row, 0, buf);
+            resultset_row_set(row, 1, ((list_session->client_dcb && list_session->client_dcb->remote)
+                                       ? list_session->client_dcb->remote : ""));
+            resultset_row_set(row, 2, (list_session->service && list_session->service->name
+                                       ? list_session->service->name : ""));
+            resultset_row_set(row, 3, session_state(list_session->state));
+        }
+        spinlock_release(lock);
+
+        if (row)
+        {
+            /** Continue from the next session of the same bucket */
+            cbdata->pos = i + 1;
+            return row;
         }
-        list_session = list_session->next;
-    }
-    /* Skip to the next non-listener if not showing listeners */
-    while (list_session && (false == list_session->ses_is_in_use ||
-                            (cbdata->filter == SESSION_LIST_CONNECTION &&
-                             list_session->state == SESSION_STATE_LISTENER)))
-    {
-        list_session = list_session->next;
-    }
-    if (list_session == NULL)
-    {
-        spinlock_release(&session_spin);
-        free(data);
-        return NULL;
     }
-    cbdata->index++;
-    row = resultset_make_row(set);
-    snprintf(buf,19, "%p", list_session);
-    buf[19] = '\0';
-    resultset_row_set(row, 0, buf);
-    resultset_row_set(row, 1, ((list_session->client_dcb && list_session->client_dcb->remote)
-                               ? list_session->client_dcb->remote : ""));
-    resultset_row_set(row, 2, (list_session->service && list_session->service->name
-                               ? list_session->service->name : ""));
-    resultset_row_set(row, 3, session_state(list_session->state));
-    spinlock_release(&session_spin);
-    return row;
+
+    free(data);
+    return NULL;
 }
 
 /**
@@ -1137,7 +1444,8 @@ sessionGetList(SESSIONLISTFILTER filter)
     {
         return NULL;
     }
-    data->index = 0;
+    data->bucket = 0;
+    data->pos = 0;
     data->filter = filter;
     if ((set = resultset_create(sessionRowCallback, data)) == NULL)
     {
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file slab.c  - Pools of fixed-size objects
+ *
+ * A slab is a header word that links it to the next slab, followed by the
+ * objects. The objects are rounded up to a multiple of the pointer size so
+ * that a free object can hold the link to the next free one.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 15/10/2016   Core Team       Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <string.h>
+#include <slab.h>
+#include <memstats.h>
+
+/** The alignment of the objects */
+#define SLAB_ALIGN sizeof(long double)
+
+/**
+ * Initialise a pool
+ *
+ * @param pool      The pool
+ * @param size      The size of an object
+ * @param per_slab  The number of objects to allocate at a time
+ * @param tag       The tag to count the slabs to in the memory statistics
+ */
+void
+slab_init(SLAB_POOL *pool, size_t size, int per_slab, int tag)
+{
+    pool->size = (size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    pool->per_slab = per_slab > 0 ? per_slab : 1;
+    pool->tag = tag;
+    pool->slabs = NULL;
+    pool->free = NULL;
+}
+
+/**
+ * Allocate an object from a pool
+ *
+ * @param pool  The pool
+ * @return A zeroed object or NULL if a slab could not be allocated
+ */
+void *
+slab_alloc(SLAB_POOL *pool)
+{
+    void *obj;
+
+    if (pool->free == NULL)
+    {
+        char *slab = (char *)memstats_malloc(pool->tag, SLAB_ALIGN + pool->size * pool->per_slab);
+
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        *(void **)slab = pool->slabs;
+        pool->slabs = slab;
+
+        for (int i = pool->per_slab - 1; i >= 0; i--)
+        {
+            obj = slab + SLAB_ALIGN + i * pool->size;
+            *(void **)obj = pool->free;
+            pool->free = obj;
+        }
+    }
+
+    obj = pool->free;
+    pool->free = *(void **)obj;
+    memset(obj, 0, pool->size);
+    return obj;
+}
+
+/**
+ * Return an object to its pool for reuse
+ *
+ * @param pool  The pool the object was allocated from
+ * @param obj   The object, may be NULL
+ */
+void
+slab_free(SLAB_POOL *pool, void *obj)
+{
+    if (obj)
+    {
+        *(void **)obj = pool->free;
+        pool->free = obj;
+    }
+}
+
+/**
+ * Free all the objects of a pool at once. The pool can be used again.
+ *
+ * @param pool  The pool
+ */
+void
+slab_release(SLAB_POOL *pool)
+{
+    void *slab = pool->slabs;
+
+    while (slab)
+    {
+        void *next = *(void **)slab;
+        memstats_free(pool->tag, slab);
+        slab = next;
+    }
+    pool->slabs = NULL;
+    pool->free = NULL;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file snapshot.c  - Published versions of read-mostly data
+ *
+ * Every version is preceded by a header holding the epoch entry with which it
+ * is retired, so that replacing a version needs no memory allocation besides
+ * the new version itself.
+ */
+
+#include <stdlib.h>
+#include <snapshot.h>
+#include <epoch.h>
+
+/**
+ * The header of a version
+ */
+typedef struct
+{
+    EPOCH_ENTRY entry;  /*< Used to retire the version */
+    long long   align;  /*< Aligns the data that follows */
+} SNAPSHOT_HEADER;
+
+#define SNAPSHOT_HEADER_OF(v) ((SNAPSHOT_HEADER *)(v) - 1)
+
+/**
+ * Allocate a new version. The version may be modified until it is published.
+ *
+ * @param size  The size of the version
+ * @return      The version or NULL if memory could not be allocated
+ */
+void *
+snapshot_alloc(size_t size)
+{
+    SNAPSHOT_HEADER *header;
+
+    if ((header = (SNAPSHOT_HEADER *)malloc(sizeof(SNAPSHOT_HEADER) + size)) == NULL)
+    {
+        return NULL;
+    }
+    return header + 1;
+}
+
+/**
+ * Free a version that has not been published
+ *
+ * @param version       The version
+ */
+void
+snapshot_discard(void *version)
+{
+    if (version)
+    {
+        free(SNAPSHOT_HEADER_OF(version));
+    }
+}
+
+/**
+ * Free a version that is no longer referenced
+ *
+ * @param data  The header of the version
+ */
+static void
+snapshot_free(void *data)
+{
+    free(data);
+}
+
+/**
+ * Start an update of a snapshot. The other writers are blocked until
+ * snapshot_write_end is called.
+ *
+ * @param snap  The snapshot
+ * @return      The current version, which must not be modified
+ */
+void *
+snapshot_write_begin(SNAPSHOT *snap)
+{
+    spinlock_acquire(&snap->lock);
+    return snap->current;
+}
+
+/**
+ * Publish a new version of a snapshot and end the update. The version that is
+ * replaced is freed once no polling thread can be reading it.
+ *
+ * @param snap          The snapshot
+ * @param version       The new version, or NULL to keep the current one
+ */
+void
+snapshot_write_end(SNAPSHOT *snap, void *version)
+{
+    void *old = snap->current;
+
+    if (version && version != old)
+    {
+        /** The contents of the version must be visible before the version is */
+        __sync_synchronize();
+        snap->current = version;
+        if (old)
+        {
+            SNAPSHOT_HEADER *header = SNAPSHOT_HEADER_OF(old);
+            epoch_retire(&header->entry, snapshot_free, header);
+        }
+    }
+    spinlock_release(&snap->lock);
+}
@@ -26,8 +26,54 @@
 #include <spinlock.h>
 #include <atomic.h>
 #include <time.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <skygw_debug.h>
 
+/** The number of times a contended lock is tried before the thread is parked */
+#define SPINLOCK_SPINS 1000
+
+/** The maximum number of named locks that are reported */
+#define SPINLOCK_MAX_NAMED 512
+
+static SPINLOCK *named_locks[SPINLOCK_MAX_NAMED]; /*< The named locks that have been contended */
+static int n_named = 0;
+static SPINLOCK named_lock = SPINLOCK_INIT;       /*< Protects the list of named locks */
+
+/**
+ * Read the cycle counter
+ *
+ * @return The current cycle count, or nanoseconds where there is no counter
+ */
+static inline unsigned long long
+spinlock_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long long)hi << 32) | lo;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Tell the processor that the thread is spinning
+ */
+static inline void
+spinlock_pause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#endif
+}
+
 /**
  * Initialise a spinlock.
  *
@@ -37,55 +83,122 @@ void
 spinlock_init(SPINLOCK *lock)
 {
     lock->lock = 0;
+    lock->registered = false;
+    lock->acquired = 0;
+    lock->contended = 0;
+    lock->wait_cycles = 0;
+    lock->name = NULL;
 #if SPINLOCK_PROFILE
     lock->spins = 0;
-    lock->acquired = 0;
+    lock->maxspins = 0;
     lock->waiting = 0;
     lock->max_waiting = 0;
-    lock->contended = 0;
 #endif
 }
 
 /**
- * Acquire a spinlock.
+ * Initialise a spinlock that is reported by spinlock_contention. The lock must
+ * not be freed.
  *
- * @param lock The spinlock to acquire
+ * @param lock The spinlock to initialise.
+ * @param name The name of the lock, not copied
  */
 void
-spinlock_acquire(SPINLOCK *lock)
+spinlock_init_named(SPINLOCK *lock, const char *name)
 {
-#if SPINLOCK_PROFILE
-    int spins = 0;
+    spinlock_init(lock);
+    lock->name = name;
+}
 
-    atomic_add(&(lock->waiting), 1);
-#endif
+/**
+ * Add a named lock to the list of the locks that are reported. A lock is added
+ * the first time it is contended.
+ *
+ * @param lock The spinlock
+ */
+static void
+spinlock_register(SPINLOCK *lock)
+{
+    int i;
 
-#ifdef __GNUC__
-    while (__sync_lock_test_and_set(&(lock->lock), 1))
-        while (lock->lock)
-        {
-#else
-    while (atomic_add(&(lock->lock), 1) != 0)
+    /** The list lock has no name, acquiring it never recurses here */
+    spinlock_acquire(&named_lock);
+    for (i = 0; i < n_named && named_locks[i] != lock; i++)
     {
-        atomic_add(&(lock->lock), -1);
-#endif
+        ;
+    }
+    if (i == n_named && n_named < SPINLOCK_MAX_NAMED)
+    {
+        named_locks[n_named++] = lock;
+    }
+    lock->registered = true;
+    spinlock_release(&named_lock);
+}
+
+/**
+ * Wait for a contended spinlock. The lock is tried for SPINLOCK_SPINS times,
+ * after that the thread marks the lock as having waiters and parks itself on
+ * the lock value until the holder releases it.
+ *
+ * @param lock The spinlock to acquire
+ */
+static void
+spinlock_wait(SPINLOCK *lock)
+{
+    unsigned long long start = spinlock_cycles();
+    int spins;
+
 #if SPINLOCK_PROFILE
-            atomic_add(&(lock->spins), 1);
-            spins++;
+    atomic_add(&(lock->waiting), 1);
 #endif
+    for (spins = 0; spins < SPINLOCK_SPINS; spins++)
+    {
+        spinlock_pause();
+        if (lock->lock == 0 && __sync_bool_compare_and_swap(&(lock->lock), 0, 1))
+        {
+            break;
         }
-#if SPINLOCK_PROFILE
-    if (spins)
+    }
+    if (spins == SPINLOCK_SPINS)
     {
-        lock->contended++;
-        if (lock->maxspins < spins)
+        while (__sync_lock_test_and_set(&(lock->lock), 2) != 0)
         {
-            lock->maxspins = spins;
+            syscall(SYS_futex, &(lock->lock), FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
         }
     }
+
+    /** The lock is now held, the statistics are protected by it */
+    lock->contended++;
+    lock->wait_cycles += spinlock_cycles() - start;
+    if (lock->name && !lock->registered)
+    {
+        spinlock_register(lock);
+    }
+#if SPINLOCK_PROFILE
+    lock->spins += spins;
+    if (lock->maxspins < spins)
+    {
+        lock->maxspins = spins;
+    }
+    atomic_add(&(lock->waiting), -1);
+#endif
+}
+
+/**
+ * Acquire a spinlock.
+ *
+ * @param lock The spinlock to acquire
+ */
+void
+spinlock_acquire(SPINLOCK *lock)
+{
+    if (!__sync_bool_compare_and_swap(&(lock->lock), 0, 1))
+    {
+        spinlock_wait(lock);
+    }
     lock->acquired++;
+#if SPINLOCK_PROFILE
     lock->owner = thread_self();
-    atomic_add(&(lock->waiting), -1);
 #endif
 }
 
@@ -98,27 +211,19 @@ spinlock_acquire(SPINLOCK *lock)
 int
 spinlock_acquire_nowait(SPINLOCK *lock)
 {
-#ifdef __GNUC__
-    if (__sync_lock_test_and_set(&(lock->lock), 1))
-    {
-        return FALSE;
-    }
-#else
-    if (atomic_add(&(lock->lock), 1) != 0)
+    if (!__sync_bool_compare_and_swap(&(lock->lock), 0, 1))
     {
-        atomic_add(&(lock->lock), -1);
         return FALSE;
     }
-#endif
-#if SPINLOCK_PROFILE
     lock->acquired++;
+#if SPINLOCK_PROFILE
     lock->owner = thread_self();
 #endif
     return TRUE;
 }
 
 /*
- * Release a spinlock.
+ * Release a spinlock. If threads may have been parked, one of them is woken up.
  *
  * @param lock The spinlock to release
  */
@@ -132,16 +237,15 @@ spinlock_release(SPINLOCK *lock)
         lock->max_waiting = lock->waiting;
     }
 #endif
-#ifdef __GNUC__
-    __sync_synchronize(); /* Memory barrier. */
-    lock->lock = 0;
-#else
-    atomic_add(&(lock->lock), -1);
-#endif
+    /** The fetch is a full memory barrier */
+    if (__sync_fetch_and_and(&(lock->lock), 0) == 2)
+    {
+        syscall(SYS_futex, &(lock->lock), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
 }
 
 /**
- * Report statistics on a spinlock. This only has an effect if the
+ * Report statistics on a spinlock. The spin counts are only reported if the
  * spinlock code has been compiled with the SPINLOCK_PROFILE option set.
  *
  * NB A callback function is used to return the data rather than
@@ -156,10 +260,18 @@ spinlock_release(SPINLOCK *lock)
 void
 spinlock_stats(SPINLOCK *lock, void (*reporter)(void *, char *, int), void *hdl)
 {
-#if SPINLOCK_PROFILE
     reporter(hdl, "Spinlock acquired", lock->acquired);
     if (lock->acquired)
     {
+        reporter(hdl, "Contended locks", lock->contended);
+        reporter(hdl, "Contention percentage",
+                 (lock->contended * 100) / lock->acquired);
+        if (lock->contended)
+        {
+            reporter(hdl, "Average wait cycles (when contended)",
+                     lock->wait_cycles / lock->contended);
+        }
+#if SPINLOCK_PROFILE
         reporter(hdl, "Total no. of spins", lock->spins);
         reporter(hdl, "Average no. of spins (overall)",
                  lock->spins / lock->acquired);
@@ -171,9 +283,67 @@ spinlock_stats(SPINLOCK *lock, void (*reporter)(void *, char *, int), void *hdl)
         reporter(hdl, "Maximum no. of spins", lock->maxspins);
         reporter(hdl, "Maximim no. of blocked threads",
                  lock->max_waiting);
-        reporter(hdl, "Contended locks", lock->contended);
-        reporter(hdl, "Contention percentage",
-                 (lock->contended * 100) / lock->acquired);
-    }
 #endif
+    }
+}
+
+/**
+ * Compare the contention of two locks, the lock with more wait cycles first
+ */
+static int
+spinlock_info_cmp(const void *a, const void *b)
+{
+    const SPINLOCK_INFO *ia = (const SPINLOCK_INFO *)a;
+    const SPINLOCK_INFO *ib = (const SPINLOCK_INFO *)b;
+
+    if (ia->wait_cycles == ib->wait_cycles)
+    {
+        return 0;
+    }
+    return ia->wait_cycles > ib->wait_cycles ? -1 : 1;
+}
+
+/**
+ * Get the statistics of the named locks that have been contended, ranked by
+ * the cycles spent waiting for them. The statistics are read without locking
+ * the locks and may be slightly out of date.
+ *
+ * @param info  Array for the statistics
+ * @param n     The size of the array
+ * @return      The number of locks in the array
+ */
+int
+spinlock_contention(SPINLOCK_INFO *info, int n)
+{
+    SPINLOCK_INFO *all;
+    int count, i;
+
+    if ((all = (SPINLOCK_INFO *)malloc(SPINLOCK_MAX_NAMED * sizeof(SPINLOCK_INFO))) == NULL)
+    {
+        return 0;
+    }
+
+    spinlock_acquire(&named_lock);
+    count = n_named;
+    for (i = 0; i < count; i++)
+    {
+        all[i].name = named_locks[i]->name;
+        all[i].address = named_locks[i];
+        all[i].acquired = named_locks[i]->acquired;
+        all[i].contended = named_locks[i]->contended;
+        all[i].wait_cycles = named_locks[i]->wait_cycles;
+    }
+    spinlock_release(&named_lock);
+
+    qsort(all, count, sizeof(SPINLOCK_INFO), spinlock_info_cmp);
+    if (count > n)
+    {
+        count = n;
+    }
+    for (i = 0; i < count; i++)
+    {
+        info[i] = all[i];
+    }
+    free(all);
+    return count;
 }
@@ -11,11 +11,54 @@
  * Public License.
  */
 
+/**
+ * @file statistics.c  - Lock-free statistics gathering
+ *
+ * The copy of a statistic of each thread starts on a cache line of its own so
+ * that the threads updating their copies do not invalidate the cache lines of
+ * each other. Threads that have not set a thread ID share the copy of thread 0.
+ */
+
 #include <statistics.h>
 #include <maxconfig.h>
 #include <string.h>
+#include <stdlib.h>
 #include <platform.h>
 
+#define TS_STATS_CACHE_LINE 64
+
+/** The number of sub-buckets of each power of two in a histogram */
+#define TS_HISTOGRAM_SUB_BITS 3
+#define TS_HISTOGRAM_SUB      (1 << TS_HISTOGRAM_SUB_BITS)
+
+/**
+ * The copy of a counter or a gauge of one thread
+ */
+typedef struct
+{
+    int64_t value;
+    char    pad[TS_STATS_CACHE_LINE - sizeof(int64_t)];
+} TS_STATS_SLOT;
+
+/**
+ * The copy of a histogram of one thread
+ */
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[TS_HISTOGRAM_BUCKETS];
+} TS_HISTOGRAM_SLOT;
+
+/** The size of the copy of a histogram, rounded up to whole cache lines */
+#define TS_HISTOGRAM_SLOT_SIZE \
+    ((sizeof(TS_HISTOGRAM_SLOT) + TS_STATS_CACHE_LINE - 1) & ~(TS_STATS_CACHE_LINE - 1))
+
+#define TS_HISTOGRAM_SLOT_OF(h, i) \
+    ((TS_HISTOGRAM_SLOT *)((char *)(h) + (i) * TS_HISTOGRAM_SLOT_SIZE))
+
 thread_local int current_thread_id = 0;
 
 static int thread_count = 0;
@@ -28,6 +71,10 @@ void ts_stats_init()
 {
     ss_dassert(!initialized);
     thread_count = config_threadcount();
+    if (thread_count < 1)
+    {
+        thread_count = 1;
+    }
     initialized = true;
 }
 
@@ -39,6 +86,25 @@ void ts_stats_end()
     ss_dassert(initialized);
 }
 
+/**
+ * Allocate memory aligned on a cache line and set it to zero
+ *
+ * @param size  The size of the memory
+ * @return      The memory or NULL if it could not be allocated
+ */
+static void *
+ts_stats_calloc(size_t size)
+{
+    void *rval;
+
+    if (posix_memalign(&rval, TS_STATS_CACHE_LINE, size) != 0)
+    {
+        return NULL;
+    }
+    memset(rval, 0, size);
+    return rval;
+}
+
 /**
  * Create a new statistics object
  *
@@ -47,7 +113,7 @@ void ts_stats_end()
 ts_stats_t ts_stats_alloc()
 {
     ss_dassert(initialized);
-    return calloc(thread_count, sizeof(int));
+    return ts_stats_calloc(thread_count * sizeof(TS_STATS_SLOT));
 }
 
 /**
@@ -70,6 +136,7 @@ void ts_stats_free(ts_stats_t stats)
 void ts_stats_set_thread_id(int id)
 {
     ss_dassert(initialized);
+    ss_dassert(id >= 0 && id < thread_count);
     current_thread_id = id;
 }
 
@@ -79,10 +146,10 @@ void ts_stats_set_thread_id(int id)
  * @param stats Statistics to add to
  * @param value Value to add
  */
-void ts_stats_add(ts_stats_t stats, int value)
+void ts_stats_add(ts_stats_t stats, int64_t value)
 {
     ss_dassert(initialized);
-    ((int*)stats)[current_thread_id] += value;
+    ((TS_STATS_SLOT*)stats)[current_thread_id].value += value;
 }
 
 /**
@@ -92,10 +159,10 @@ void ts_stats_add(ts_stats_t stats, int value)
  * @param stats Statistics to set
  * @param value Value to set to
  */
-void ts_stats_set(ts_stats_t stats, int value)
+void ts_stats_set(ts_stats_t stats, int64_t value)
 {
     ss_dassert(initialized);
-    ((int*)stats)[current_thread_id] = value;
+    ((TS_STATS_SLOT*)stats)[current_thread_id].value = value;
 }
 
 /**
@@ -104,13 +171,295 @@ void ts_stats_set(ts_stats_t stats, int value)
  * @param stats Statistics to read
  * @return Value of statistics
  */
-int ts_stats_sum(ts_stats_t stats)
+int64_t ts_stats_sum(ts_stats_t stats)
+{
+    return ts_stats_get(stats, TS_STATS_SUM);
+}
+
+/**
+ * Combine the values of the threads
+ *
+ * @param stats Statistics to read
+ * @param type  How the values are combined
+ * @return The combined value
+ */
+int64_t ts_stats_get(ts_stats_t stats, enum ts_stats_type type)
+{
+    ss_dassert(initialized);
+    TS_STATS_SLOT *slots = (TS_STATS_SLOT*)stats;
+    int64_t rval = slots[0].value;
+
+    for (int i = 1; i < thread_count; i++)
+    {
+        int64_t value = slots[i].value;
+
+        switch (type)
+        {
+        case TS_STATS_MIN:
+            if (value < rval)
+            {
+                rval = value;
+            }
+            break;
+
+        case TS_STATS_MAX:
+            if (value > rval)
+            {
+                rval = value;
+            }
+            break;
+
+        default:
+            rval += value;
+            break;
+        }
+    }
+
+    if (type == TS_STATS_AVG)
+    {
+        rval /= thread_count;
+    }
+    return rval;
+}
+
+/**
+ * Find the bucket of a value. The values below TS_HISTOGRAM_SUB have buckets of
+ * their own, the larger ones share a bucket with the values that have the same
+ * highest TS_HISTOGRAM_SUB_BITS + 1 bits.
+ *
+ * @param value The value
+ * @return      The bucket
+ */
+static int ts_histogram_bucket(uint64_t value)
+{
+    if (value < TS_HISTOGRAM_SUB)
+    {
+        return (int)value;
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    int bucket = (msb - TS_HISTOGRAM_SUB_BITS + 1) * TS_HISTOGRAM_SUB +
+        (int)((value >> (msb - TS_HISTOGRAM_SUB_BITS)) & (TS_HISTOGRAM_SUB - 1));
+
+    return bucket < TS_HISTOGRAM_BUCKETS ? bucket : TS_HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * Return the smallest value of a bucket
+ *
+ * @param bucket    The bucket
+ * @return          The smallest value that is recorded in the bucket
+ */
+static uint64_t ts_histogram_bucket_min(int bucket)
+{
+    if (bucket < TS_HISTOGRAM_SUB)
+    {
+        return bucket;
+    }
+
+    int shift = bucket / TS_HISTOGRAM_SUB - 1;
+    uint64_t sub = bucket % TS_HISTOGRAM_SUB;
+
+    return (TS_HISTOGRAM_SUB + sub) << shift;
+}
+
+/**
+ * Create a new histogram
+ *
+ * @return The histogram or NULL if memory allocation failed
+ */
+ts_histogram_t ts_histogram_alloc()
 {
     ss_dassert(initialized);
-    int sum = 0;
-    for (int i = 0; i < thread_count; i++)
+    return ts_stats_calloc(thread_count * TS_HISTOGRAM_SLOT_SIZE);
+}
+
+/**
+ * Free a histogram
+ *
+ * @param histogram The histogram to free
+ */
+void ts_histogram_free(ts_histogram_t histogram)
+{
+    free(histogram);
+}
+
+/**
+ * Record a value in a histogram
+ *
+ * @param histogram The histogram
+ * @param value     The value, for example a latency in microseconds
+ */
+void ts_histogram_add(ts_histogram_t histogram, uint64_t value)
+{
+    ss_dassert(initialized);
+    TS_HISTOGRAM_SLOT *slot = TS_HISTOGRAM_SLOT_OF(histogram, current_thread_id);
+
+    if (slot->count == 0 || value < slot->min)
+    {
+        slot->min = value;
+    }
+    if (value > slot->max)
+    {
+        slot->max = value;
+    }
+    slot->count++;
+    slot->sum += value;
+    slot->buckets[ts_histogram_bucket(value)]++;
+}
+
+/**
+ * Combine the copies of a histogram
+ *
+ * @param histogram The histogram
+ * @param thread    The thread whose copy is read, or -1 for all threads
+ * @param total     The combined copy
+ */
+static void ts_histogram_merge(ts_histogram_t histogram, int thread, TS_HISTOGRAM_SLOT *total)
+{
+    ss_dassert(initialized);
+    int first = thread < 0 ? 0 : thread;
+    int last = thread < 0 ? thread_count - 1 : thread;
+
+    memset(total, 0, sizeof(*total));
+    for (int i = first; i <= last; i++)
+    {
+        TS_HISTOGRAM_SLOT *slot = TS_HISTOGRAM_SLOT_OF(histogram, i);
+
+        if (slot->count == 0)
+        {
+            continue;
+        }
+        if (total->count == 0 || slot->min < total->min)
+        {
+            total->min = slot->min;
+        }
+        if (slot->max > total->max)
+        {
+            total->max = slot->max;
+        }
+        total->count += slot->count;
+        total->sum += slot->sum;
+        for (int j = 0; j < TS_HISTOGRAM_BUCKETS; j++)
+        {
+            total->buckets[j] += slot->buckets[j];
+        }
+    }
+}
+
+/**
+ * Find a percentile of a combined histogram. The largest value of the bucket
+ * holding the percentile is returned, limited to the values recorded.
+ *
+ * @param total The combined histogram
+ * @param pct   The percentile, between 0 and 100
+ * @return      The percentile or 0 if the histogram is empty
+ */
+static uint64_t ts_histogram_find(TS_HISTOGRAM_SLOT *total, double pct)
+{
+    uint64_t target = (uint64_t)(total->count * pct / 100);
+    uint64_t count = 0;
+
+    if (total->count == 0)
+    {
+        return 0;
+    }
+    if (target < 1)
     {
-        sum += ((int*)stats)[i];
+        target = 1;
+    }
+
+    for (int i = 0; i < TS_HISTOGRAM_BUCKETS - 1; i++)
+    {
+        count += total->buckets[i];
+        if (count >= target)
+        {
+            uint64_t value = ts_histogram_bucket_min(i + 1) - 1;
+
+            if (value < total->min)
+            {
+                value = total->min;
+            }
+            return value < total->max ? value : total->max;
+        }
+    }
+    return total->max;
+}
+
+/**
+ * Summarise the values recorded in a histogram
+ *
+ * @param histogram The histogram
+ * @param thread    The thread whose values are summarised, or -1 for all threads
+ * @param summary   The summary
+ */
+void ts_histogram_get(ts_histogram_t histogram, int thread, ts_histogram_summary_t *summary)
+{
+    TS_HISTOGRAM_SLOT total;
+
+    ts_histogram_merge(histogram, thread, &total);
+    summary->count = total.count;
+    summary->min = total.min;
+    summary->max = total.max;
+    summary->sum = total.sum;
+    summary->mean = total.count ? (double)total.sum / total.count : 0;
+    summary->p50 = ts_histogram_find(&total, 50);
+    summary->p90 = ts_histogram_find(&total, 90);
+    summary->p99 = ts_histogram_find(&total, 99);
+    summary->p999 = ts_histogram_find(&total, 99.9);
+}
+
+/**
+ * Find a percentile of the values recorded in a histogram
+ *
+ * @param histogram The histogram
+ * @param thread    The thread whose values are used, or -1 for all threads
+ * @param pct       The percentile, between 0 and 100
+ * @return          The percentile or 0 if no values have been recorded
+ */
+uint64_t ts_histogram_percentile(ts_histogram_t histogram, int thread, double pct)
+{
+    TS_HISTOGRAM_SLOT total;
+
+    ts_histogram_merge(histogram, thread, &total);
+    return ts_histogram_find(&total, pct);
+}
+
+/**
+ * Count the values of a histogram within a range. The count is exact when the
+ * limits are powers of two or below eight, otherwise the buckets holding the
+ * limits are counted if their smallest value is within the range.
+ *
+ * @param histogram The histogram
+ * @param thread    The thread whose values are counted, or -1 for all threads
+ * @param lo        The smallest value of the range
+ * @param hi        The value above the range, UINT64_MAX for no upper limit
+ * @return          The number of values from lo up to but not including hi
+ */
+uint64_t ts_histogram_range(ts_histogram_t histogram, int thread, uint64_t lo, uint64_t hi)
+{
+    ss_dassert(initialized);
+    int first = thread < 0 ? 0 : thread;
+    int last = thread < 0 ? thread_count - 1 : thread;
+    int from = ts_histogram_bucket(lo);
+    int to = hi == UINT64_MAX ? TS_HISTOGRAM_BUCKETS : ts_histogram_bucket(hi);
+    uint64_t rval = 0;
+
+    if (hi != UINT64_MAX && to == TS_HISTOGRAM_BUCKETS - 1 &&
+        hi > ts_histogram_bucket_min(TS_HISTOGRAM_BUCKETS - 1))
+    {
+        /** The last bucket holds all values above its smallest one */
+        to = TS_HISTOGRAM_BUCKETS;
+    }
+
+    for (int i = first; i <= last; i++)
+    {
+        TS_HISTOGRAM_SLOT *slot = TS_HISTOGRAM_SLOT_OF(histogram, i);
+
+        for (int j = from; j < to; j++)
+        {
+            rval += slot->buckets[j];
+        }
     }
-    return sum;
+    return rval;
 }
@@ -0,0 +1,686 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file core_benchmark.c - Microbenchmarks of the core
+ *
+ * Measures the buffers, the hash table, the spinlocks, the log manager write
+ * path, the splitting of MySQL packets and an epoll loopback echo. Every
+ * benchmark is run once to warm up and then for the given number of rounds,
+ * each round with the same number of operations on the same data, and the
+ * fastest, median and slowest rounds are reported. The benchmarks marked as
+ * threaded divide the operations between the threads.
+ *
+ * With -c the results are printed as CSV, one line per benchmark, so that runs
+ * can be compared by a script.
+ *
+ * Usage: core_benchmark [-n OPERATIONS] [-t THREADS] [-r ROUNDS] [-c] [NAME...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <buffer.h>
+#include <hashtable.h>
+#include <spinlock.h>
+#include <epoch.h>
+#include <modutil.h>
+#include <mysql_client_server_protocol.h>
+#include <log_manager.h>
+
+/** The most threads the threaded benchmarks can use */
+#define BENCH_MAX_THREADS 64
+
+/** The most rounds a benchmark can be run */
+#define BENCH_MAX_ROUNDS 100
+
+/**
+ * A benchmark. The operations are done by run, which the threaded benchmarks
+ * call in every thread with the thread's share. Only run is timed.
+ */
+typedef struct
+{
+    const char *name;                   /*< The name of the benchmark */
+    int        scale;                   /*< The operations are divided by this */
+    bool       threaded;                /*< Whether run is called in every thread */
+    bool       (*setup)(uint64_t n);    /*< Called before each round, may be NULL */
+    void       (*run)(int id, uint64_t n); /*< Does n operations in thread id */
+    void       (*teardown)();           /*< Called after each round, may be NULL */
+} BENCHMARK;
+
+static uint64_t n_operations = 1000000;
+static int n_threads = 4;
+static int n_rounds = 5;
+static bool csv = false;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** A generator of reproducible pseudo-random numbers, one per thread */
+static inline uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * Buffers
+ */
+
+static GWBUF *clone_source;
+
+static void bench_buffer_alloc(int id, uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        gwbuf_free(gwbuf_alloc(512));
+    }
+}
+
+static bool setup_buffer_clone(uint64_t n)
+{
+    return (clone_source = gwbuf_alloc(512)) != NULL;
+}
+
+static void bench_buffer_clone(int id, uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        gwbuf_free(gwbuf_clone(clone_source));
+    }
+}
+
+static void teardown_buffer_clone()
+{
+    gwbuf_free(clone_source);
+}
+
+/** An operation is appending eight 64 byte buffers and consuming the chain */
+static void bench_buffer_append(int id, uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        GWBUF *head = NULL;
+
+        for (int j = 0; j < 8; j++)
+        {
+            head = gwbuf_append(head, gwbuf_alloc(64));
+        }
+        while ((head = gwbuf_consume(head, 48)))
+        {
+            ;
+        }
+    }
+}
+
+/**
+ * Hash table
+ */
+
+static HASHTABLE *table;
+
+static int key_hash(void *key)
+{
+    uintptr_t k = (uintptr_t)key;
+    return (int)(k ^ (k >> 16)) & 0x7fffffff;
+}
+
+static int key_cmp(void *k1, void *k2)
+{
+    return k1 == k2 ? 0 : 1;
+}
+
+static bool setup_hashtable_add(uint64_t n)
+{
+    return (table = hashtable_alloc(1024, key_hash, key_cmp)) != NULL;
+}
+
+/** An operation is adding and deleting a key of the thread */
+static void bench_hashtable_add(int id, uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        void *key = (void *)(intptr_t)((id << 24) + (i % 4096) + 1);
+
+        hashtable_add(table, key, key);
+        hashtable_delete(table, key);
+    }
+}
+
+/** The table of the fetch benchmark has this many keys */
+#define FETCH_KEYS 65536
+
+static bool setup_hashtable_fetch(uint64_t n)
+{
+    if ((table = hashtable_alloc(FETCH_KEYS * 2, key_hash, key_cmp)) == NULL)
+    {
+        return false;
+    }
+
+    for (intptr_t i = 1; i <= FETCH_KEYS; i++)
+    {
+        hashtable_add(table, (void *)i, (void *)i);
+    }
+
+    return true;
+}
+
+/** The readers report quiescent states as the polling threads do and read without locking */
+static void bench_hashtable_fetch(int id, uint64_t n)
+{
+    uint64_t state = 88172645463325252ull + id;
+    uint64_t found = 0;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        intptr_t key = next_random(&state) % FETCH_KEYS + 1;
+
+        found += hashtable_fetch(table, (void *)key) != NULL;
+
+        if (i % 64 == 0)
+        {
+            epoch_quiescent(id);
+        }
+    }
+
+    if (found != n)
+    {
+        printf("hashtable_fetch: %lu of %lu keys were not found.\n", n - found, n);
+    }
+}
+
+static void teardown_hashtable()
+{
+    for (int i = 0; i < n_threads; i++)
+    {
+        epoch_quiescent(i);
+    }
+
+    hashtable_free(table);
+}
+
+/**
+ * Spinlocks
+ */
+
+static SPINLOCK bench_lock = SPINLOCK_INIT;
+static uint64_t bench_counter;
+
+static void bench_spinlock(int id, uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        spinlock_acquire(&bench_lock);
+        bench_counter++;
+        spinlock_release(&bench_lock);
+    }
+}
+
+/**
+ * Log manager
+ */
+
+static void bench_log(int id, uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        MXS_NOTICE("Benchmark message %lu of thread %d.", i, id);
+    }
+}
+
+/**
+ * Splitting of MySQL packets
+ */
+
+/** The buffers read from the network hold this many packets */
+#define PACKETS_PER_READ 32
+
+static uint8_t *packets;
+static size_t packets_len;
+
+static bool setup_modutil(uint64_t n)
+{
+    static const char query[] = "SELECT id, name, amount FROM accounts WHERE id = 12345";
+    size_t len = sizeof(query);     /*< The command byte and the query without the terminator */
+
+    packets_len = PACKETS_PER_READ * (MYSQL_HEADER_LEN + len);
+
+    if ((packets = malloc(packets_len)) == NULL)
+    {
+        return false;
+    }
+
+    uint8_t *ptr = packets;
+
+    for (int i = 0; i < PACKETS_PER_READ; i++)
+    {
+        gw_mysql_set_byte3(ptr, len);
+        ptr[3] = 0;
+        ptr[4] = MYSQL_COM_QUERY;
+        memcpy(ptr + 5, query, len - 1);
+        ptr += MYSQL_HEADER_LEN + len;
+    }
+
+    return true;
+}
+
+/** An operation is splitting a packet from a read and extracting its SQL */
+static void bench_modutil(int id, uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i += PACKETS_PER_READ)
+    {
+        GWBUF *readbuf = gwbuf_alloc_and_load(packets_len, packets);
+        GWBUF *complete = modutil_get_complete_packets(&readbuf);
+        GWBUF *packet;
+
+        while ((packet = modutil_get_next_MySQL_packet(&complete)))
+        {
+            char *sql;
+            int len;
+
+            if (!modutil_is_SQL(packet) || !modutil_extract_SQL(packet, &sql, &len))
+            {
+                printf("modutil: failed to extract the SQL of a packet.\n");
+            }
+
+            gwbuf_free(packet);
+        }
+
+        gwbuf_free(readbuf);
+    }
+}
+
+static void teardown_modutil()
+{
+    free(packets);
+}
+
+/**
+ * Epoll loopback echo
+ */
+
+/** The size of the echoed messages, a small query packet */
+#define ECHO_SIZE 64
+
+static int echo_client = -1;
+static int echo_server = -1;
+static pthread_t echo_thread;
+
+/** Echo the data of the server end of the connection until the client closes it */
+static void *echo_main(void *data)
+{
+    int efd = epoll_create(1);
+    struct epoll_event ev = {.events = EPOLLIN, .data = {.fd = echo_server}};
+    char buf[ECHO_SIZE * 4];
+    bool open = efd != -1 && epoll_ctl(efd, EPOLL_CTL_ADD, echo_server, &ev) == 0;
+
+    while (open)
+    {
+        if (epoll_wait(efd, &ev, 1, -1) == 1)
+        {
+            ssize_t len = read(echo_server, buf, sizeof(buf));
+
+            open = len > 0 && write(echo_server, buf, len) == len;
+        }
+    }
+
+    if (efd != -1)
+    {
+        close(efd);
+    }
+
+    close(echo_server);
+    return NULL;
+}
+
+static bool setup_echo(uint64_t n)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int one = 1;
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (lfd == -1 ||
+        bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(lfd, 1) != 0 ||
+        getsockname(lfd, (struct sockaddr *)&addr, &addrlen) != 0 ||
+        (echo_client = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+        connect(echo_client, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        (echo_server = accept(lfd, NULL, NULL)) == -1)
+    {
+        printf("echo: failed to open a loopback connection.\n");
+        return false;
+    }
+
+    close(lfd);
+    setsockopt(echo_client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(echo_server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return pthread_create(&echo_thread, NULL, echo_main, NULL) == 0;
+}
+
+/** An operation is a round trip of a message */
+static void bench_echo(int id, uint64_t n)
+{
+    char buf[ECHO_SIZE];
+
+    memset(buf, 'x', sizeof(buf));
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        size_t got = 0;
+        ssize_t len;
+
+        if (write(echo_client, buf, sizeof(buf)) != sizeof(buf))
+        {
+            printf("echo: write failed.\n");
+            return;
+        }
+
+        while (got < sizeof(buf) && (len = read(echo_client, buf + got, sizeof(buf) - got)) > 0)
+        {
+            got += len;
+        }
+    }
+}
+
+static void teardown_echo()
+{
+    close(echo_client);
+    pthread_join(echo_thread, NULL);
+}
+
+static BENCHMARK benchmarks[] =
+{
+    {"buffer_alloc_free", 1, false, NULL, bench_buffer_alloc, NULL},
+    {"buffer_clone_free", 1, false, setup_buffer_clone, bench_buffer_clone, teardown_buffer_clone},
+    {"buffer_append_consume", 8, false, NULL, bench_buffer_append, NULL},
+    {"buffer_alloc_free_mt", 1, true, NULL, bench_buffer_alloc, NULL},
+    {"hashtable_add_delete", 1, true, setup_hashtable_add, bench_hashtable_add, teardown_hashtable},
+    {"hashtable_fetch", 1, true, setup_hashtable_fetch, bench_hashtable_fetch, teardown_hashtable},
+    {"spinlock", 1, true, NULL, bench_spinlock, NULL},
+    {"log_notice", 10, true, NULL, bench_log, NULL},
+    {"modutil_split_packets", 1, false, setup_modutil, bench_modutil, teardown_modutil},
+    {"epoll_echo", 20, false, setup_echo, bench_echo, teardown_echo},
+    {NULL}
+};
+
+/**
+ * The threads of a threaded benchmark
+ */
+
+static BENCHMARK *current;
+static uint64_t thread_ops;
+static pthread_barrier_t barrier;
+
+static void *bench_thread(void *data)
+{
+    int id = (int)(intptr_t)data;
+
+    pthread_barrier_wait(&barrier);
+    current->run(id, thread_ops);
+    return NULL;
+}
+
+/**
+ * Run one round of a benchmark
+ *
+ * @param bench The benchmark
+ * @param ops   The number of operations
+ * @param ns    The elapsed time is stored here
+ * @return True if the round was run
+ */
+static bool run_round(BENCHMARK *bench, uint64_t ops, uint64_t *ns)
+{
+    if (bench->setup && !bench->setup(ops))
+    {
+        return false;
+    }
+
+    uint64_t start;
+
+    if (bench->threaded)
+    {
+        pthread_t threads[BENCH_MAX_THREADS];
+
+        current = bench;
+        thread_ops = ops / n_threads;
+        pthread_barrier_init(&barrier, NULL, n_threads + 1);
+
+        for (int i = 0; i < n_threads; i++)
+        {
+            pthread_create(&threads[i], NULL, bench_thread, (void *)(intptr_t)i);
+        }
+
+        pthread_barrier_wait(&barrier);
+        start = now();
+
+        for (int i = 0; i < n_threads; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+
+        pthread_barrier_destroy(&barrier);
+    }
+    else
+    {
+        start = now();
+        bench->run(0, ops);
+    }
+
+    *ns = now() - start;
+
+    if (bench->teardown)
+    {
+        bench->teardown();
+    }
+
+    return true;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Run a benchmark and print its results
+ *
+ * @param bench The benchmark
+ * @return True if all rounds were run
+ */
+static bool run_benchmark(BENCHMARK *bench)
+{
+    int threads = bench->threaded ? n_threads : 1;
+    uint64_t ops = n_operations / bench->scale / threads * threads;
+    uint64_t times[BENCH_MAX_ROUNDS];
+    uint64_t warmup;
+
+    if (ops == 0)
+    {
+        ops = threads;
+    }
+
+    if (!run_round(bench, ops / 10 + threads, &warmup))
+    {
+        printf("%s: setup failed.\n", bench->name);
+        return false;
+    }
+
+    for (int i = 0; i < n_rounds; i++)
+    {
+        if (!run_round(bench, ops, &times[i]))
+        {
+            printf("%s: setup failed.\n", bench->name);
+            return false;
+        }
+    }
+
+    qsort(times, n_rounds, sizeof(times[0]), compare_u64);
+
+    double min = (double)times[0] / ops;
+    double median = (double)times[n_rounds / 2] / ops;
+    double max = (double)times[n_rounds - 1] / ops;
+
+    if (csv)
+    {
+        printf("%s,%d,%lu,%d,%.2f,%.2f,%.2f,%.0f\n", bench->name, threads, ops, n_rounds,
+               min, median, max, 1000000000.0 / median);
+    }
+    else
+    {
+        printf("%-24s %3d %12lu %10.2f %10.2f %10.2f %14.0f\n", bench->name, threads, ops,
+               min, median, max, 1000000000.0 / median);
+    }
+
+    return true;
+}
+
+static bool selected(BENCHMARK *bench, int argc, char **argv)
+{
+    if (optind == argc)
+    {
+        return true;
+    }
+
+    for (int i = optind; i < argc; i++)
+    {
+        if (strstr(bench->name, argv[i]))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/** Remove the log files of the log benchmark */
+static void remove_logdir(const char *logdir)
+{
+    DIR *dir = opendir(logdir);
+    struct dirent *entry;
+    char path[PATH_MAX];
+
+    while (dir && (entry = readdir(dir)))
+    {
+        if (entry->d_name[0] != '.')
+        {
+            snprintf(path, sizeof(path), "%s/%s", logdir, entry->d_name);
+            unlink(path);
+        }
+    }
+
+    if (dir)
+    {
+        closedir(dir);
+    }
+
+    rmdir(logdir);
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "n:t:r:c")) >= 0)
+    {
+        switch (c)
+        {
+            case 'n':
+                n_operations = strtoul(optarg, NULL, 10);
+                break;
+
+            case 't':
+                n_threads = atoi(optarg);
+                break;
+
+            case 'r':
+                n_rounds = atoi(optarg);
+                break;
+
+            case 'c':
+                csv = true;
+                break;
+
+            default:
+                printf("Usage: %s [-n OPERATIONS] [-t THREADS] [-r ROUNDS] [-c] [NAME...]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (n_operations == 0 || n_threads < 1 || n_threads > BENCH_MAX_THREADS ||
+        n_rounds < 1 || n_rounds > BENCH_MAX_ROUNDS)
+    {
+        printf("Invalid operation count, thread count or round count.\n");
+        return 1;
+    }
+
+    char logdir[] = "/tmp/core_benchmark_XXXXXX";
+
+    if (mkdtemp(logdir) == NULL || !mxs_log_init(NULL, logdir, MXS_LOG_TARGET_FS))
+    {
+        printf("Failed to initialize the log manager.\n");
+        return 1;
+    }
+
+    epoch_init(n_threads);
+
+    if (csv)
+    {
+        printf("benchmark,threads,operations,rounds,min_ns,median_ns,max_ns,median_ops_per_s\n");
+    }
+    else
+    {
+        printf("%-24s %3s %12s %10s %10s %10s %14s\n", "Benchmark", "Thr", "Operations",
+               "Min ns/op", "Median", "Max", "Median ops/s");
+    }
+
+    int rval = 0;
+
+    for (BENCHMARK *bench = benchmarks; bench->name; bench++)
+    {
+        if (selected(bench, argc, argv) && !run_benchmark(bench))
+        {
+            rval = 1;
+        }
+    }
+
+    mxs_log_finish();
+    remove_logdir(logdir);
+    return rval;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testaffinity.c  - Tests for the consistent hashing of sessions to servers
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <skygw_debug.h>
+#include <affinity.h>
+
+#define N_SERVERS 4
+#define N_KEYS    10000
+
+static const char *servers[N_SERVERS] = {"server1", "server2", "server3", "server4"};
+
+/**
+ * Choose the server with the highest score among the first n servers,
+ * skipping the one at index skip
+ */
+static int
+choose(const char *key, int *weights, int n, int skip)
+{
+    int best = -1;
+    double best_score = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        double score = affinity_score(key, servers[i], weights[i]);
+
+        if (i != skip && score > best_score)
+        {
+            best = i;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * test1    The keys are spread by weight and only the keys of a removed
+ *          server move
+ */
+static int
+test1()
+{
+    int weights[N_SERVERS] = {1000, 1000, 1000, 1000};
+    int counts[N_SERVERS] = {0};
+    int moved = 0;
+    char key[32];
+
+    ss_dfprintf(stderr, "testaffinity : keys are spread evenly and move minimally");
+
+    for (int i = 0; i < N_KEYS; i++)
+    {
+        sprintf(key, "192.168.%d.%d", i / 256, i % 256);
+        int before = choose(key, weights, N_SERVERS, -1);
+        int after = choose(key, weights, N_SERVERS, 2);
+        ss_info_dassert(before == choose(key, weights, N_SERVERS, -1),
+                        "The same key should get the same server");
+        counts[before]++;
+
+        if (before != after)
+        {
+            ss_info_dassert(before == 2, "Only the keys of the removed server should move");
+            moved++;
+        }
+    }
+
+    for (int i = 0; i < N_SERVERS; i++)
+    {
+        ss_info_dassert(counts[i] > N_KEYS / N_SERVERS * 9 / 10 &&
+                        counts[i] < N_KEYS / N_SERVERS * 11 / 10,
+                        "Servers of equal weight should get as many keys");
+    }
+
+    ss_info_dassert(moved == counts[2], "All the keys of the removed server should move");
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+/**
+ * test2    A server with twice the weight gets twice the keys and a server
+ *          without weight gets none
+ */
+static int
+test2()
+{
+    int weights[N_SERVERS] = {2000, 1000, 1000, 0};
+    int counts[N_SERVERS] = {0};
+    char key[32];
+    affinity_key_t type;
+
+    ss_dfprintf(stderr, "testaffinity : keys are spread by weight");
+
+    for (int i = 0; i < N_KEYS; i++)
+    {
+        sprintf(key, "user%d", i);
+        counts[choose(key, weights, N_SERVERS, -1)]++;
+    }
+
+    ss_info_dassert(counts[3] == 0, "A server without weight should get no keys");
+    ss_info_dassert(counts[0] > N_KEYS / 2 * 9 / 10 && counts[0] < N_KEYS / 2 * 11 / 10,
+                    "A server with half of the weight should get half of the keys");
+
+    ss_info_dassert(affinity_parse_key("Client", &type) && type == AFFINITY_CLIENT,
+                    "Key type should be parsed");
+    ss_info_dassert(affinity_parse_key("database", &type) && type == AFFINITY_DATABASE,
+                    "Key type should be parsed");
+    ss_info_dassert(!affinity_parse_key("table", &type), "Bad key type should be rejected");
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+
+    exit(result);
+}
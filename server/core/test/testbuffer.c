@@ -318,6 +318,14 @@ void test_consume()
  * test1    Allocate a buffer and do lots of things
  *
  */
+static int bufobj_freed = 0;
+
+static void
+test_bufobj_done(void *data)
+{
+    bufobj_freed++;
+}
+
 static int
 test1()
 {
@@ -330,6 +338,7 @@ test1()
     int     buflen;
 
     /* Single buffer tests */
+    ss_info_dassert(sizeof(GWBUF) <= 64, "Buffer header should fit in a cache line");
     ss_dfprintf(stderr,
                 "testbuffer : creating buffer with data size %d bytes",
                 size);
@@ -347,6 +356,28 @@ test1()
     ss_dfprintf(stderr, "\t..done\nSet a property for the buffer");
     gwbuf_add_property(buffer, "name", "value");
     ss_info_dassert(0 == strcmp("value", gwbuf_get_property(buffer, "name")), "Should now have correct property");
+    ss_info_dassert(gwbuf_add_property(buffer, "name", "other"), "Property should be replaced");
+    ss_info_dassert(0 == strcmp("other", gwbuf_get_property(buffer, "name")), "Should have the new value");
+    ss_info_dassert(NULL == gwbuf_get_property(buffer, "no such name"), "Unknown property should not be found");
+    ss_dfprintf(stderr, "\t..done\nSet properties by ID");
+    int ids[GWBUF_N_PROPERTIES + 2];
+    char idname[20];
+    for (int j = 0; j < GWBUF_N_PROPERTIES + 2; j++)
+    {
+        sprintf(idname, "id%d", j);
+        ids[j] = gwbuf_property_id(idname);
+        ss_info_dassert(ids[j] > 0, "Property ID should be valid");
+        ss_info_dassert(gwbuf_set_property(buffer, ids[j], &ids[j]), "Property should be set");
+    }
+    ss_info_dassert(ids[0] == gwbuf_property_id("id0"), "Property ID should not change");
+    for (int j = 0; j < GWBUF_N_PROPERTIES + 2; j++)
+    {
+        ss_info_dassert(&ids[j] == gwbuf_get_property_value(buffer, ids[j]),
+                        "Inline and overflowed properties should be found");
+    }
+    gwbuf_set_property(buffer, ids[GWBUF_N_PROPERTIES + 1], NULL);
+    ss_info_dassert(NULL == gwbuf_get_property_value(buffer, ids[GWBUF_N_PROPERTIES + 1]),
+                    "Overflowed property should be replaced");
     strcpy(GWBUF_DATA(buffer), "The quick brown fox jumps over the lazy dog");
     ss_dfprintf(stderr, "\t..done\nLoad some data into the buffer");
     ss_info_dassert('q' == GWBUF_DATA_CHAR(buffer, 4), "Fourth character of buffer must be 'q'");
@@ -371,8 +402,13 @@ test1()
     ss_dfprintf(stderr, "\nCloned buffer length is now %d", buflen);
     ss_info_dassert(size == buflen, "Incorrect buffer size");
     ss_info_dassert(0 == GWBUF_EMPTY(clone), "Cloned buffer should not be empty");
+    ss_dfprintf(stderr, "\t..done\nAdd a buffer object to the clone");
+    gwbuf_add_buffer_object(clone, GWBUF_PARSING_INFO, &bufobj_freed, test_bufobj_done);
+    ss_info_dassert(&bufobj_freed == gwbuf_get_buffer_object_data(buffer, GWBUF_PARSING_INFO),
+                    "Buffer object should be shared with the original buffer");
     ss_dfprintf(stderr, "\t..done\n");
     gwbuf_free(clone);
+    ss_info_dassert(0 == bufobj_freed, "Buffer object should not be freed with the clone");
     ss_dfprintf(stderr, "Freed cloned buffer");
     ss_dfprintf(stderr, "\t..done\n");
     buffer = gwbuf_consume(buffer, bite1);
@@ -437,6 +473,7 @@ test1()
     ss_info_dassert(GWBUF_LENGTH(all_clones) == headsize, "First buffer should be 10 bytes");
     ss_info_dassert(GWBUF_LENGTH(all_clones->next) == tailsize, "Second buffer should be 20 bytes");
     ss_info_dassert(gwbuf_length(all_clones) == headsize + tailsize, "Total buffer length should be 30 bytes");
+    ss_info_dassert(all_clones->tail == all_clones->next, "The tail pointer of the clone should be the last clone");
 
     test_split();
     test_load_and_copy();
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testbufpool.c  - Tests for the buffer pools
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <skygw_debug.h>
+#include <bufpool.h>
+
+#define N_BLOCKS 1000
+
+static void *blocks[N_BLOCKS];
+
+/**
+ * test1    Freed blocks are reused by the same thread
+ */
+static int
+test1()
+{
+    BUFPOOL_STATS before, after;
+    void *ptr, *ptr2;
+    int unpooled = bufpool_unpooled();
+
+    ss_dfprintf(stderr, "testbufpool : blocks are reused");
+    bufpool_get_stats(1, &before);
+    ptr = bufpool_alloc(300);
+    ss_info_dassert(ptr != NULL, "Block should be allocated");
+    memset(ptr, 0xaa, 300);
+    bufpool_free(ptr, 300);
+    ptr2 = bufpool_alloc(400);
+    ss_info_dassert(ptr == ptr2, "Freed block should be reused");
+    bufpool_free(ptr2, 400);
+    bufpool_get_stats(1, &after);
+    ss_info_dassert(after.size >= 400, "Block size should fit the allocation");
+    ss_info_dassert(after.misses == before.misses + 1, "First allocation should miss");
+    ss_info_dassert(after.hits == before.hits + 1, "Second allocation should hit");
+
+    ptr = bufpool_alloc(1024 * 1024);
+    ss_info_dassert(ptr != NULL, "Large block should be allocated");
+    bufpool_free(ptr, 1024 * 1024);
+    ss_info_dassert(bufpool_unpooled() == unpooled + 1, "Large block should not be pooled");
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+static void *
+test2_free(void *data)
+{
+    int i;
+
+    for (i = 0; i < N_BLOCKS; i++)
+    {
+        bufpool_free(blocks[i], 2000);
+    }
+    return NULL;
+}
+
+/**
+ * test2    Blocks freed by one thread are moved to the depot and reused by
+ *          another thread
+ */
+static int
+test2()
+{
+    BUFPOOL_STATS before, after;
+    pthread_t thr;
+    int i;
+
+    ss_dfprintf(stderr, "testbufpool : blocks move between threads");
+    for (i = 0; i < N_BLOCKS; i++)
+    {
+        blocks[i] = bufpool_alloc(2000);
+        ss_info_dassert(blocks[i] != NULL, "Block should be allocated");
+    }
+    pthread_create(&thr, NULL, test2_free, NULL);
+    pthread_join(thr, NULL);
+
+    bufpool_get_stats(2, &before);
+    ss_info_dassert(before.depot_puts > 0, "Magazines should be given to the depot");
+    ss_info_dassert(before.depot_size > 0, "Depot should not be empty");
+    for (i = 0; i < N_BLOCKS; i++)
+    {
+        blocks[i] = bufpool_alloc(2000);
+    }
+    bufpool_get_stats(2, &after);
+    ss_info_dassert(after.depot_gets > before.depot_gets, "Magazines should be taken from the depot");
+    ss_info_dassert(after.hits > before.hits, "Blocks from the depot should be reused");
+    for (i = 0; i < N_BLOCKS; i++)
+    {
+        bufpool_free(blocks[i], 2000);
+    }
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+
+    exit(result);
+}
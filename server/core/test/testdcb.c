@@ -34,6 +34,7 @@
 #include <string.h>
 #include <listener.h>
 #include <dcb.h>
+#include <epoch.h>
 
 /**
  * test1    Allocate a dcb and do lots of other things
@@ -67,9 +68,10 @@ test1()
     ss_dfprintf(stderr, "\t..done\nMake clone DCB a zombie");
     clone->state = DCB_STATE_NOPOLLING;
     dcb_close(clone);
-    ss_info_dassert(dcb_get_zombies() == clone, "Clone DCB must be start of zombie list now");
-    ss_dfprintf(stderr, "\t..done\nProcess the zombies list");
-    dcb_process_zombies(0);
+    ss_info_dassert(clone->dcb_is_zombie, "Clone DCB must be a zombie now");
+    ss_info_dassert(epoch_pending() == 1, "Clone DCB must be waiting to be freed");
+    ss_dfprintf(stderr, "\t..done\nProcess the zombies");
+    epoch_quiescent(0);
     ss_dfprintf(stderr, "\t..done\nCheck clone no longer valid");
     ss_info_dassert(!dcb_isvalid(clone), "After zombie processing, clone DCB must not be valid");
     ss_dfprintf(stderr, "\t..done\n");
@@ -77,11 +79,66 @@ test1()
     return 0;
 }
 
+static int
+test_callback(DCB *dcb, DCB_REASON reason, void *userdata)
+{
+    return 0;
+}
+
+/**
+ * test2    Add and remove callbacks
+ *
+  */
+static int
+test2()
+{
+    DCB   *dcb;
+    SERV_LISTENER dummy;
+    intptr_t i;
+
+    ss_dfprintf(stderr, "testdcb : adding callbacks");
+    dcb = dcb_alloc(DCB_ROLE_SERVICE_LISTENER, &dummy);
+    for (i = 0; i < DCB_MAX_CALLBACKS; i++)
+    {
+        ss_info_dassert(dcb_add_callback(dcb, DCB_REASON_DRAINED, test_callback, (void *)i),
+                        "Callback must be added");
+    }
+    ss_info_dassert(!dcb_add_callback(dcb, DCB_REASON_DRAINED, test_callback, (void *)0),
+                    "Duplicate callback must not be added");
+    ss_info_dassert(!dcb_add_callback(dcb, DCB_REASON_HIGH_WATER, test_callback, NULL),
+                    "Callback must not be added to a full DCB");
+    ss_info_dassert(dcb->cb_reasons == DCB_REASON_BIT(DCB_REASON_DRAINED),
+                    "Only the drained reason must have callbacks");
+    ss_dfprintf(stderr, "\t..done\nRemoving callbacks");
+    ss_info_dassert(dcb_remove_callback(dcb, DCB_REASON_DRAINED, test_callback, (void *)1),
+                    "Callback must be removed");
+    ss_info_dassert(!dcb_remove_callback(dcb, DCB_REASON_DRAINED, test_callback, (void *)1),
+                    "Removed callback must not be found");
+    ss_info_dassert(dcb->n_callbacks == DCB_MAX_CALLBACKS - 1 &&
+                    dcb->callbacks[0].userdata == (void *)0 &&
+                    dcb->callbacks[1].userdata == (void *)2,
+                    "The other callbacks must keep their order");
+    ss_info_dassert(dcb_add_callback(dcb, DCB_REASON_HIGH_WATER, test_callback, NULL),
+                    "Callback must be added after a removal");
+    for (i = 0; i < DCB_MAX_CALLBACKS; i++)
+    {
+        dcb_remove_callback(dcb, DCB_REASON_DRAINED, test_callback, (void *)i);
+    }
+    ss_info_dassert(dcb->n_callbacks == 1 &&
+                    dcb->cb_reasons == DCB_REASON_BIT(DCB_REASON_HIGH_WATER),
+                    "Only the high water callback must be left");
+    dcb_close(dcb);
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
 
     result += test1();
+    result += test2();
 
     exit(result);
 }
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testepoch.c  - Tests for the epoch based memory reclamation
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <skygw_debug.h>
+#include <epoch.h>
+
+typedef struct
+{
+    EPOCH_ENTRY entry;
+    int reclaimed;   /*< How many times the object has been reclaimed */
+    int retire;      /*< How many more times the object retires itself */
+} TEST_OBJECT;
+
+static void
+test_reclaim(void *data)
+{
+    TEST_OBJECT *obj = (TEST_OBJECT *)data;
+    obj->reclaimed++;
+    if (obj->retire > 0)
+    {
+        obj->retire--;
+        epoch_retire(&obj->entry, test_reclaim, obj);
+    }
+}
+
+/**
+ * test1    Objects are reclaimed once all threads have been quiescent
+ */
+static int
+test1()
+{
+    TEST_OBJECT a = {}, b = {};
+
+    ss_dfprintf(stderr, "testepoch : reclamation waits for all threads");
+    epoch_init(2);
+    epoch_retire(&a.entry, test_reclaim, &a);
+    ss_info_dassert(epoch_quiescent(0) == 0, "Thread 1 has not been quiescent");
+    epoch_retire(&b.entry, test_reclaim, &b);
+    ss_info_dassert(epoch_pending() == 2, "Both objects should be pending");
+    ss_info_dassert(epoch_quiescent(1) == 1, "Only the first object is unreferenced");
+    ss_info_dassert(a.reclaimed == 1 && b.reclaimed == 0, "First object should be reclaimed");
+    ss_info_dassert(epoch_quiescent(1) == 0, "Thread 0 has not been quiescent since the retirement");
+    ss_info_dassert(epoch_quiescent(0) == 1, "Second object is unreferenced");
+    ss_info_dassert(b.reclaimed == 1, "Second object should be reclaimed");
+    ss_info_dassert(epoch_pending() == 0, "No objects should be pending");
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+/**
+ * test2    An object retired again by its reclamation function
+ */
+static int
+test2()
+{
+    TEST_OBJECT a = {};
+
+    ss_dfprintf(stderr, "testepoch : object retired again when reclaimed");
+    a.retire = 1;
+    epoch_retire(&a.entry, test_reclaim, &a);
+    epoch_quiescent(0);
+    epoch_quiescent(1);
+    ss_info_dassert(a.reclaimed == 1, "Object should be reclaimed once");
+    ss_info_dassert(epoch_pending() == 1, "Object should be retired again");
+    epoch_quiescent(0);
+    ss_info_dassert(a.reclaimed == 1, "Object should not be reclaimed before all threads are quiescent");
+    epoch_quiescent(1);
+    ss_info_dassert(a.reclaimed == 2, "Object should be reclaimed twice");
+    ss_info_dassert(epoch_pending() == 0, "No objects should be pending");
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+
+    exit(result);
+}
@@ -34,29 +34,10 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <hashtable.h>
-
-static void
-read_lock(HASHTABLE *table)
-{
-    spinlock_acquire(&table->spin);
-    while (table->writelock)
-    {
-        spinlock_release(&table->spin);
-        while (table->writelock)
-            ;
-        spinlock_acquire(&table->spin);
-    }
-    table->n_readers++;
-    spinlock_release(&table->spin);
-}
-
-static void
-read_unlock(HASHTABLE *table)
-{
-    atomic_add(&table->n_readers, -1);
-}
+#include <epoch.h>
 
 static int hfun(void* key);
 static int cmpfun (void *, void *);
@@ -138,7 +119,9 @@ static bool do_hashtest(
 
     ss_dfprintf(stderr, "\t..done\nValidate read values.");
 
-    ss_info_dassert(hsize == (argsize > 0 ? argsize : 1), "Invalid hash size");
+    ss_info_dassert(hsize >= (argsize > 0 ? argsize : 1), "Invalid hash size");
+    ss_info_dassert((hsize & (hsize - 1)) == 0, "Hash size should be a power of two");
+    ss_info_dassert(nelems * 4 <= hsize * 3, "Table should grow with the elements");
     ss_info_dassert((nelems == argelems) || (nelems == 0 && argsize == 0),
                     "Invalid element count");
     ss_info_dassert(longest <= nelems, "Too large longest list value");
@@ -150,7 +133,6 @@ static bool do_hashtest(
     ss_dfprintf(stderr, "\t..done\nValidate iterator.");
 
     HASHITERATOR *iterator = hashtable_iterator(h);
-    read_lock(h);
     for (i = 0; i < (argelems + 1); i++)
     {
         iter = (int *)hashtable_next(iterator);
@@ -163,7 +145,6 @@ static bool do_hashtest(
             ss_dfprintf(stderr, "\nNext item, iter = %d, i = %d", *iter, i);
         }
     }
-    read_unlock(h);
     ss_info_dassert((i == argelems) || (i == 0 && argsize == 0), "\nIncorrect number of elements from iterator");
     hashtable_iterator_free(iterator);
     if (argelems > 1000)
@@ -180,6 +161,137 @@ static bool do_hashtest(
     return succp;
 }
 
+/**
+ * Deleted keys are not found, the other keys survive the resizes and deleted
+ * slots are reused
+ */
+static bool do_deletetest(int argelems)
+{
+    HASHTABLE *h = hashtable_alloc(4, hfun, cmpfun);
+    int *val_arr = (int *)malloc(sizeof(int) * argelems);
+    int i, round, hsize, nelems, longest;
+
+    ss_dfprintf(stderr, "testhash : add and delete %d elements", argelems);
+    for (i = 0; i < argelems; i++)
+    {
+        val_arr[i] = i;
+    }
+    for (round = 0; round < 10; round++)
+    {
+        for (i = 0; i < argelems; i++)
+        {
+            ss_info_dassert(hashtable_add(h, &val_arr[i], &val_arr[i]) == 1, "Add should succeed");
+        }
+        ss_info_dassert(hashtable_add(h, &val_arr[0], &val_arr[0]) == 0, "Duplicate should be refused");
+        for (i = 0; i < argelems; i += 2)
+        {
+            ss_info_dassert(hashtable_delete(h, &val_arr[i]) == 1, "Delete should succeed");
+        }
+        for (i = 0; i < argelems; i++)
+        {
+            int *value = (int *)hashtable_fetch(h, &val_arr[i]);
+
+            ss_info_dassert(i % 2 ? value == &val_arr[i] : value == NULL, "Wrong value fetched");
+        }
+        ss_info_dassert(hashtable_size(h) == argelems / 2, "Wrong number of elements");
+        for (i = 1; i < argelems; i += 2)
+        {
+            hashtable_delete(h, &val_arr[i]);
+        }
+        ss_info_dassert(hashtable_size(h) == 0, "Table should be empty");
+    }
+    hashtable_get_stats(h, &hsize, &nelems, &longest);
+    ss_info_dassert(hsize <= argelems * 4, "Deleted slots should be reused");
+    ss_dfprintf(stderr, "\t..done\n");
+
+    hashtable_free(h);
+    free(val_arr);
+    return true;
+}
+
+#define N_THREADS 4
+#define N_KEYS    10000
+
+static HASHTABLE *shared;
+static int keys[N_THREADS][N_KEYS];
+static int constant[N_KEYS];
+
+/**
+ * Add and delete the keys of one thread while looking up a set of keys that
+ * stay in the table. Odd threads report quiescent states and read without locks.
+ */
+static void *
+concurrent_thread(void *data)
+{
+    int id = (int)(intptr_t)data;
+    bool lockfree = id % 2;
+    int i, n;
+
+    for (n = 0; n < 20; n++)
+    {
+        for (i = 0; i < N_KEYS; i++)
+        {
+            hashtable_add(shared, &keys[id][i], &keys[id][i]);
+            ss_info_dassert(hashtable_fetch(shared, &constant[i]) == &constant[i],
+                            "Constant key should always be found");
+            if (lockfree && i % 64 == 0)
+            {
+                epoch_quiescent(id);
+            }
+        }
+        for (i = 0; i < N_KEYS; i++)
+        {
+            ss_info_dassert(hashtable_fetch(shared, &keys[id][i]) == &keys[id][i],
+                            "Own key should be found");
+            hashtable_delete(shared, &keys[id][i]);
+        }
+        if (lockfree)
+        {
+            epoch_quiescent(id);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Readers and writers of several threads use the table while it resizes
+ */
+static bool do_concurrenttest()
+{
+    pthread_t threads[N_THREADS];
+    int i, j;
+
+    ss_dfprintf(stderr, "testhash : concurrent use by %d threads", N_THREADS);
+    epoch_init(N_THREADS);
+    shared = hashtable_alloc(16, hfun, cmpfun);
+    for (i = 0; i < N_KEYS; i++)
+    {
+        constant[i] = -1 - i;
+        hashtable_add(shared, &constant[i], &constant[i]);
+        for (j = 0; j < N_THREADS; j++)
+        {
+            keys[j][i] = N_KEYS * j + i;
+        }
+    }
+    for (i = 0; i < N_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, concurrent_thread, (void *)(intptr_t)i);
+    }
+    for (i = 0; i < N_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    ss_info_dassert(hashtable_size(shared) == N_KEYS, "Only the constant keys should remain");
+    for (i = 0; i < N_THREADS; i++)
+    {
+        epoch_quiescent(i);
+    }
+    ss_info_dassert(epoch_pending() == 0, "Retired entries should be reclaimed");
+    hashtable_free(shared);
+    ss_dfprintf(stderr, "\t..done\n");
+    return true;
+}
+
 /**
  * @node Simple test which creates hashtable and frees it. Size and number of entries
  * sre specified by user and passed as arguments.
@@ -236,6 +348,14 @@ int main(void)
     {
         goto return_rc;
     }
+    if (!do_deletetest(1000))
+    {
+        goto return_rc;
+    }
+    if (!do_concurrenttest())
+    {
+        goto return_rc;
+    }
 
     rc = 0;
 return_rc:
@@ -67,11 +67,61 @@ test1()
 
 }
 
+/**
+ * test2    Duplicate hints with short and long strings and reuse freed hints
+ */
+static int
+test2()
+{
+    char longname[200];
+    HINT *hint, *dup;
+
+    memset(longname, 'a', sizeof(longname) - 1);
+    longname[sizeof(longname) - 1] = '\0';
+
+    ss_dfprintf(stderr, "testhint : Duplicate hints with inline and allocated strings");
+    hint = hint_create_route(NULL, HINT_ROUTE_TO_NAMED_SERVER, "server1");
+    hint = hint_create_parameter(hint, longname, "value");
+    hint = hint_create_parameter(hint, "name", longname);
+    dup = hint_dup(hint);
+    ss_info_dassert(dup && dup->next && dup->next->next, "Duplicate should have three hints");
+    ss_info_dassert(strcmp(dup->data, "name") == 0 && strcmp(dup->value, longname) == 0,
+                    "First hint should be correct");
+    ss_info_dassert(strcmp(dup->next->data, longname) == 0 &&
+                    strcmp(dup->next->value, "value") == 0, "Second hint should be correct");
+    ss_info_dassert(strcmp(dup->next->next->data, "server1") == 0 &&
+                    dup->next->next->value == NULL, "Third hint should be correct");
+
+    while (hint)
+    {
+        HINT *next = hint->next;
+        hint_free(hint);
+        hint = next;
+    }
+
+    ss_dfprintf(stderr, "\t..done\nReuse freed hints.");
+    hint = hint_create_route(NULL, HINT_ROUTE_TO_MASTER, NULL);
+    ss_info_dassert(hint->data == NULL && hint->value == NULL && hint->next == NULL,
+                    "Reused hint should be empty");
+    hint_free(hint);
+
+    while (dup)
+    {
+        HINT *next = dup->next;
+        hint_free(dup);
+        dup = next;
+    }
+    ss_dfprintf(stderr, "\t..done\n");
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
 
     result += test1();
+    result += test2();
 
     exit(result);
 }
@@ -20,6 +20,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
+#include <glob.h>
+#include <unistd.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 
@@ -29,10 +31,13 @@ typedef struct thread_st
     simple_mutex_t*  mtx;
     size_t*          nactive;
     pthread_t        tid;
+    int              id;
 } thread_t;
 
 static void* thr_run(void* data);
 static void* thr_run_morelog(void* data);
+static void* thr_run_deferred(void* data);
+static int test_deferred(thread_t** thr, int nthr);
 
 #define MAX_NTHR 256
 #define NITER 100
@@ -47,6 +52,7 @@ static void* thr_run_morelog(void* data);
 
 #define TEST3
 #define TEST4
+#define TEST5
 
 const char USAGE[] =
     "usage: %s [-t <#threads>]\n"
@@ -495,6 +501,15 @@ int main(int argc, char* argv[])
     mxs_log_finish();
 
 #endif /* TEST 4 */
+
+#if defined(TEST5)
+    fprintf(stderr, "\nStarting test #5 \n");
+
+    if (test_deferred(thr, nthr) != 0)
+    {
+        err = 1;
+    }
+#endif /* TEST 5 */
     fprintf(stderr, ".. done.\n");
 return_err:
     if (thr != NULL)
@@ -715,3 +730,170 @@ static void* thr_run_morelog(void* data)
     skygw_message_send(td->mes);
     return NULL;
 }
+
+/** The pass of test #5 the threads are logging in */
+static const char* deferred_pass;
+
+static void* thr_run_deferred(void* data)
+{
+    thread_t*   td = (thread_t *)data;
+    const char* text = logs[td->id % nstr(logs)];
+    int         err;
+    int         i;
+
+    for (i = 0; i < NITER; i++)
+    {
+        const char* str = i % 2 ? NULL : text;
+
+        err = MXS_INFO("testlog %d %s %d/%d: [%.*s] %zu [%s] [%.*s]",
+                       (int)getpid(),
+                       deferred_pass,
+                       td->id,
+                       i,
+                       i % 20,
+                       text,
+                       (size_t)i * 1000003,
+                       str,
+                       i % 8,
+                       str);
+        if (err != 0)
+        {
+            TEST_ERROR("Error, log write failed.");
+        }
+    }
+    return NULL;
+}
+
+static int compare_lines(const void* l, const void* r)
+{
+    return strcmp(*(char* const*)l, *(char* const*)r);
+}
+
+/**
+ * Read the messages of one pass of test #5 from the log files
+ *
+ * @param pass  The pass
+ * @param lines The messages without the part that names the pass, sorted
+ * @param max   The size of lines
+ * @return The number of messages
+ */
+static int read_deferred_lines(const char* pass, char** lines, int max)
+{
+    char   tag[64];
+    char   buf[1024];
+    int    n = 0;
+    size_t i;
+    glob_t files;
+
+    /** The sequence number of the log file depends on the files in /tmp */
+    if (glob("/tmp/maxscale*.log", 0, NULL, &files) != 0)
+    {
+        TEST_ERROR("Failed to find the log file.");
+        return 0;
+    }
+
+    snprintf(tag, sizeof(tag), "testlog %d %s ", (int)getpid(), pass);
+
+    for (i = 0; i < files.gl_pathc; i++)
+    {
+        FILE* file = fopen(files.gl_pathv[i], "r");
+
+        while (file && fgets(buf, sizeof(buf), file))
+        {
+            char* msg = strstr(buf, tag);
+
+            if (msg && n < max)
+            {
+                lines[n++] = strdup(msg + strlen(tag));
+            }
+        }
+
+        if (file)
+        {
+            fclose(file);
+        }
+    }
+    globfree(&files);
+
+    qsort(lines, n, sizeof(char*), compare_lines);
+    return n;
+}
+
+/**
+ * Log the same info messages from several threads, first formatted by the
+ * threads themselves and then by the file writer, and check that the lines
+ * of both passes are identical
+ *
+ * @param thr   The thread structures
+ * @param nthr  The number of threads
+ * @return 0 on success
+ */
+static int test_deferred(thread_t** thr, int nthr)
+{
+    const char* passes[] = { "direct", "deferred" };
+    int         total = nthr * NITER;
+    char**      lines[2];
+    int         n[2];
+    int         rval = 0;
+    int         i, j;
+
+    mxs_log_init(NULL, "/tmp", MXS_LOG_TARGET_FS);
+    skygw_log_enable(LOG_INFO);
+
+    for (j = 0; j < 2; j++)
+    {
+        deferred_pass = passes[j];
+        mxs_log_set_deferred_enabled(j == 1);
+
+        for (i = 0; i < nthr; i++)
+        {
+            thr[i] = (thread_t*)calloc(1, sizeof(thread_t));
+            thr[i]->id = i;
+            pthread_create(&thr[i]->tid, NULL, thr_run_deferred, thr[i]);
+        }
+
+        for (i = 0; i < nthr; i++)
+        {
+            pthread_join(thr[i]->tid, NULL);
+            free(thr[i]);
+        }
+    }
+
+    mxs_log_set_deferred_enabled(false);
+    mxs_log_flush_sync();
+    mxs_log_finish();
+
+    for (j = 0; j < 2; j++)
+    {
+        lines[j] = (char**)calloc(total, sizeof(char*));
+        n[j] = read_deferred_lines(passes[j], lines[j], total);
+
+        if (n[j] != total)
+        {
+            fprintf(stderr, "Expected %d %s messages, found %d.\n", total, passes[j], n[j]);
+            rval = 1;
+        }
+    }
+
+    for (i = 0; i < n[0] && i < n[1]; i++)
+    {
+        if (strcmp(lines[0][i], lines[1][i]) != 0)
+        {
+            fprintf(stderr, "A deferred message differs from the direct one:\n%s%s",
+                    lines[1][i], lines[0][i]);
+            rval = 1;
+            break;
+        }
+    }
+
+    for (j = 0; j < 2; j++)
+    {
+        for (i = 0; i < n[j]; i++)
+        {
+            free(lines[j][i]);
+        }
+        free(lines[j]);
+    }
+
+    return rval;
+}
@@ -83,6 +83,8 @@ int main(int argc, char** argv)
     skygw_log_disable(LOG_INFO);
     skygw_log_disable(LOG_NOTICE);
     skygw_log_disable(LOG_DEBUG);
+    /** Every message must be in the log */
+    mxs_log_set_throttling(0, 0);
 
     for (i = 0; i < iterations; i++)
     {
@@ -18,6 +18,7 @@
  *
  * Date       Who           Description
  * 05-11-2015 Markus Makela Initial implementation
+ * 15-10-2016 Core Team     Tests for compiled patterns and literal prefilters
  *
  * @endverbatim
  */
@@ -95,12 +96,67 @@ static int test2()
     return 0;
 }
 
+/**
+ * Test the literal text found in patterns
+ */
+static int test3()
+{
+    size_t len = 0;
+    char *literal = mxs_pcre2_required_literal("^SELECT .* FROM t1", &len);
+    test_assert(literal && strcmp(literal, "SELECT ") == 0 && len == 7, "Literal should be the start of the pattern");
+    free(literal);
+
+    literal = mxs_pcre2_required_literal("colou?r", &len);
+    test_assert(literal && strcmp(literal, "colo") == 0, "Optional character should not be in the literal");
+    free(literal);
+
+    test_assert(mxs_pcre2_required_literal("select|insert", &len) == NULL, "Alternatives should have no literal");
+    test_assert(mxs_pcre2_required_literal(".*dog", &len) == NULL, "Pattern starting with a wildcard has no literal");
+    test_assert(mxs_pcre2_required_literal("\\d+", &len) == NULL, "Pattern starting with an escape has no literal");
+
+    test_assert(mxs_pcre2_contains("The lazy dog", 12, "LAZY", 4, true), "Literal should be found ignoring case");
+    test_assert(!mxs_pcre2_contains("The lazy dog", 12, "LAZY", 4, false), "Literal should not be found");
+    test_assert(!mxs_pcre2_contains("The lazy dog", 8, "dog", 3, false), "Literal after the length should not be found");
+    return 0;
+}
+
+/**
+ * Test matching with compiled patterns
+ */
+static int test4()
+{
+    int err;
+    size_t erroff;
+    const char *subject = "The quick brown fox jumps over the lazy dog";
+    MXS_PCRE2_PATTERN *re = mxs_pcre2_pattern_compile("brown (.*) (dog|cat)", 0, &err, &erroff);
+
+    test_assert(re != NULL, "Pattern should compile");
+    test_assert(mxs_pcre2_pattern_match(re, subject, strlen(subject)) == MXS_PCRE2_MATCH, "Pattern should match");
+    test_assert(mxs_pcre2_pattern_match(re, "brown cow", 9) == MXS_PCRE2_NOMATCH, "Pattern should not match");
+    test_assert(mxs_pcre2_pattern_match(re, "red fox", 7) == MXS_PCRE2_NOMATCH,
+                "Subject without the literal should not match");
+    test_assert(mxs_pcre2_thread_match_data(re->code) != NULL, "Thread should have matching data");
+    mxs_pcre2_pattern_free(re);
+
+    re = mxs_pcre2_pattern_compile("QUICK.*DOG", PCRE2_CASELESS, &err, &erroff);
+    test_assert(re != NULL, "Caseless pattern should compile");
+    test_assert(mxs_pcre2_pattern_match(re, subject, strlen(subject)) == MXS_PCRE2_MATCH,
+                "Caseless pattern should match");
+    mxs_pcre2_pattern_free(re);
+
+    re = mxs_pcre2_pattern_compile("black.*[dog", 0, &err, &erroff);
+    test_assert(re == NULL && err != 0, "Invalid pattern should fail with an error");
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
 
     result += test1();
     result += test2();
+    result += test3();
+    result += test4();
 
     return result;
 }
@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <modutil.h>
 #include <buffer.h>
@@ -96,6 +97,50 @@ test2()
 
 }
 
+/**
+ * Replace the statement of a query with shorter and longer ones, also when
+ * the buffer is shared with a clone
+ */
+void test_replace_sql()
+{
+    char longsql[2048];
+    GWBUF *buffer = modutil_create_query("SELECT * FROM some_table");
+    char *sql;
+
+    memset(longsql, 'a', sizeof(longsql) - 1);
+    longsql[sizeof(longsql) - 1] = '\0';
+
+    buffer = modutil_replace_SQL(buffer, "SELECT 1");
+    sql = modutil_get_SQL(buffer);
+    ss_info_dassert(strcmp(sql, "SELECT 1") == 0, "Shorter statement should be replaced");
+    ss_info_dassert(gwbuf_length(buffer) == 5 + strlen("SELECT 1"), "Packet should be trimmed");
+    free(sql);
+
+    buffer = modutil_replace_SQL(buffer, "SELECT * FROM some_other_table");
+    sql = modutil_get_SQL(buffer);
+    ss_info_dassert(strcmp(sql, "SELECT * FROM some_other_table") == 0,
+                    "Longer statement should be replaced");
+    free(sql);
+
+    buffer = modutil_replace_SQL(buffer, longsql);
+    buffer = gwbuf_make_contiguous(buffer);
+    sql = modutil_get_SQL(buffer);
+    ss_info_dassert(strcmp(sql, longsql) == 0, "Statement larger than the buffer should be replaced");
+    free(sql);
+
+    GWBUF *clone = gwbuf_clone(buffer);
+    buffer = modutil_replace_SQL(buffer, "SELECT 2");
+    sql = modutil_get_SQL(clone);
+    ss_info_dassert(strcmp(sql, longsql) == 0, "Clone should not be modified");
+    free(sql);
+    sql = modutil_get_SQL(buffer);
+    ss_info_dassert(strcmp(sql, "SELECT 2") == 0, "Shared statement should be replaced");
+    free(sql);
+
+    gwbuf_free(clone);
+    gwbuf_free(buffer);
+}
+
 /** This is a standard OK packet */
 static char ok[] =
 {
@@ -246,6 +291,70 @@ void test_multiple_sql_packets()
     ss_info_dassert(memcmp(databuf, resultset, sizeof(resultset)) == 0, "Data should be OK");
 }
 
+/** Counts the packets a scan calls back for */
+static bool count_scanned(void *data, uint8_t *header, size_t pktlen)
+{
+    int *n_eof = (int*)data;
+
+    if (PTR_IS_EOF(header))
+    {
+        ss_info_dassert(pktlen == 9, "EOF packet should be nine bytes long");
+        (*n_eof)++;
+    }
+    return true;
+}
+
+void test_packet_scan()
+{
+    int more = 0;
+    GWBUF* buffer = gwbuf_alloc_and_load(sizeof(resultset), resultset);
+    ss_info_dassert(modutil_count_signal_packets(buffer, 0, 0, &more) == 2,
+                    "Result set should have two EOF packets");
+    gwbuf_free(buffer);
+
+    /** Every split of the result set, scanned as one chain and as two buffers */
+    for (size_t i = 0; i < sizeof(resultset); i++)
+    {
+        GWBUF* head = gwbuf_alloc_and_load(i, resultset);
+        GWBUF* tail = gwbuf_alloc_and_load(sizeof(resultset) - i, resultset + i);
+        MODUTIL_PACKET_SCAN scan;
+        int n_eof = 0;
+
+        modutil_scan_init(&scan);
+        size_t scanned = modutil_scan_packets(&scan, head, count_scanned, &n_eof);
+        scanned += modutil_scan_packets(&scan, tail, count_scanned, &n_eof);
+        ss_info_dassert(scanned == sizeof(resultset), "Whole result set should be scanned");
+        ss_info_dassert(scan.n_packets == 5, "Result set should have five packets");
+        ss_info_dassert(scan.skip == 0 && scan.header_len == 0, "Scan should end at a packet boundary");
+        ss_info_dassert(n_eof == 2, "Both EOF packets should be found");
+
+        head = gwbuf_append(head, tail);
+        ss_info_dassert(modutil_count_signal_packets(head, 0, 0, &more) == 2,
+                        "Result set in a chain should have two EOF packets");
+        gwbuf_free(head);
+    }
+
+    /** A chain of one byte buffers */
+    GWBUF* head = NULL;
+
+    for (size_t i = 0; i < sizeof(resultset); i++)
+    {
+        head = gwbuf_append(head, gwbuf_alloc_and_load(1, resultset + i));
+    }
+
+    ss_info_dassert(modutil_count_signal_packets(head, 0, 0, &more) == 2,
+                    "Fragmented result set should have two EOF packets");
+
+    /** The second EOF is found when the first one was already seen */
+    GWBUF* rows = gwbuf_split(&head, 52);
+    ss_info_dassert(modutil_count_signal_packets(rows, 0, 0, &more) == 1,
+                    "First part should have one EOF packet");
+    ss_info_dassert(modutil_count_signal_packets(head, 0, 1, &more) == 1,
+                    "Second part should end with an EOF packet");
+    gwbuf_free(rows);
+    gwbuf_free(head);
+}
+
 void test_strnchr_esc_mysql()
 {
     char comment1[] = "This will -- fail.";
@@ -383,16 +492,104 @@ void test_large_packets()
     }
 }
 
+void test_canonical()
+{
+    static const char* tests[][2] =
+    {
+        {"SELECT * FROM t1 WHERE a = 1 AND b = 'hello'", "SELECT * FROM t1 WHERE a = ? AND b = '?'"},
+        {"  insert into t1 values (1, -2.5, \"it\\\"s\", '')", "insert into t1 values (?, ?, \"?\", '?')"},
+        {"select @a, @@version from `t 1` -- comment", "select @?, @@? from `t 1`"},
+        {"select truncate(5678.123451,6) /* comment */ from t", "select truncate(?,?) from t"},
+        {"select 1 /*!40101 executable */ #comment", "select ? /*!? executable */"},
+        {"update\tt1\n\nset   a=a+1\r\n", "update t1 set a=a+?"},
+        {"# only a comment", ""}
+    };
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        GWBUF* buffer = modutil_create_query((char*)tests[i][0]);
+        char* canonical = modutil_get_canonical(buffer);
+        ss_info_dassert(canonical, "The canonical form should be created");
+        ss_info_dassert(strcmp(canonical, tests[i][1]) == 0, "The canonical form should be correct");
+        free(canonical);
+        gwbuf_free(buffer);
+    }
+}
+
+void test_strnchr_esc_long()
+{
+    /** Longer than the sixteen bytes scanned at a time */
+    char quoted[] = "select 'a long string with a ; in it' from t1; select 2";
+    char* semicolon = strrchr(quoted, ';');
+    ss_info_dassert(strnchr_esc(quoted, ';', sizeof(quoted) - 1) == semicolon,
+                    "Semicolon after a long quoted string should be found");
+    ss_info_dassert(strnchr_esc_mysql(quoted, ';', sizeof(quoted) - 1) == semicolon,
+                    "Semicolon after a long quoted string should be found");
+
+    char escaped[] = "select \"a string with an escaped \\\" and a ;\" from t1 where a = 1";
+    ss_info_dassert(strnchr_esc(escaped, ';', sizeof(escaped) - 1) == NULL,
+                    "Semicolon in a string with an escaped quote should be ignored");
+
+    char comment[] = "select a /* a long comment with a ; in it */ from `table;name` where a = 12345;";
+    ss_info_dassert(strnchr_esc_mysql(comment, ';', sizeof(comment) - 1) == strrchr(comment, ';'),
+                    "Semicolons in long comments and identifiers should be ignored");
+
+    char tail[] = "select a from table_with_a_long_name;";
+    ss_info_dassert(strnchr_esc_mysql(tail, ';', sizeof(tail) - 1) == strrchr(tail, ';'),
+                    "Semicolon in the last bytes should be found");
+    ss_info_dassert(strnchr_esc_mysql(tail, ';', sizeof(tail) - 2) == NULL,
+                    "Bytes past the length should not be inspected");
+
+    char line_comment[] = "select a from table_with_a_long_name -- comment; select 2";
+    ss_info_dassert(strnchr_esc_mysql(line_comment, ';', sizeof(line_comment) - 1) == NULL,
+                    "Semicolon in a line comment should be ignored");
+}
+
+/**
+ * Print how long finding the end of a typical statement takes. This is not a
+ * test as such, it only shows the effect of changes to the scanning code.
+ */
+void benchmark_strnchr_esc()
+{
+    char query[] = "SELECT a.id, a.name, b.value FROM accounts a JOIN balances b "
+        "ON a.id = b.account_id WHERE a.status = 'active' AND b.updated > '2016-01-01' "
+        "ORDER BY a.name LIMIT 100";
+    const int rounds = 100000;
+    struct timespec start, end;
+    int found = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < rounds; i++)
+    {
+        found += strnchr_esc_mysql(query, ';', sizeof(query) - 1) != NULL;
+        found += strnchr_esc(query, ';', sizeof(query) - 1) != NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ss_info_dassert(found == 0, "The query has no semicolon");
+
+    double nsecs = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("strnchr_esc and strnchr_esc_mysql: %.1f ns per %lu byte statement\n",
+           nsecs / rounds, (unsigned long)sizeof(query) - 1);
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
 
     result += test1();
     result += test2();
+    test_replace_sql();
     test_single_sql_packet();
     test_multiple_sql_packets();
+    test_packet_scan();
     test_strnchr_esc();
     test_strnchr_esc_mysql();
+    test_strnchr_esc_long();
+    benchmark_strnchr_esc();
     test_large_packets();
+    test_canonical();
     exit(result);
 }
@@ -79,6 +79,8 @@ test1()
     status = server_status(server);
     mxs_log_flush_sync();
     ss_info_dassert(0 == strcmp("Master, Running", status), "Should find correct status.");
+    ss_info_dassert(server_get_state(server_states(), server).status & SERVER_MASTER,
+                    "Published state should have the master status.");
     server_clear_status(server, SERVER_MASTER);
     free(status);
     status = server_status(server);
@@ -100,11 +102,49 @@ test1()
 
 }
 
+/**
+ * test2    Parse and compare GTID positions
+ *
+  */
+static int
+test2()
+{
+    SERVER   *master = server_alloc("MyMaster", "HTTPD", 9877);
+    SERVER   *slave = server_alloc("MySlave", "HTTPD", 9878);
+    SERVER_GTID_POS master_pos;
+    SERVER_GTID_POS slave_pos;
+
+    ss_dfprintf(stderr, "testserver : GTID positions");
+    ss_info_dassert(server_set_gtid_pos(master, "0-1-100,1-2-5", 10), "Position should be parsed");
+    ss_info_dassert(server_set_gtid_pos(slave, "1-2-5,0-1-99", 20), "Position should be parsed");
+    ss_info_dassert(!server_set_gtid_pos(slave, "0-1", 30), "Truncated position should be rejected");
+    server_get_gtid_pos(master, &master_pos);
+    server_get_gtid_pos(slave, &slave_pos);
+    ss_info_dassert(master_pos.n_domains == 2 && master_pos.seqs[0] == 100 && master_pos.read_at == 10,
+                    "Position should be stored");
+    ss_info_dassert(slave_pos.read_at == 20, "Rejected position should not be stored");
+    ss_info_dassert(!server_gtid_pos_reached(&slave_pos, &master_pos), "Slave should be behind");
+    ss_info_dassert(server_gtid_pos_reached(&master_pos, &slave_pos), "Master should be ahead");
+
+    server_set_gtid_pos(slave, "0-1-100,1-2-5,2-3-1", 40);
+    server_get_gtid_pos(slave, &slave_pos);
+    ss_info_dassert(server_gtid_pos_reached(&slave_pos, &master_pos), "Slave should have caught up");
+    server_set_gtid_pos(master, "", 50);
+    server_get_gtid_pos(master, &master_pos);
+    ss_info_dassert(master_pos.n_domains == 0, "Empty position should have no domains");
+
+    server_free(master);
+    server_free(slave);
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
 
     result += test1();
+    result += test2();
 
     exit(result);
 }
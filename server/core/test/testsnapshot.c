@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testsnapshot.c  - Tests for the published versions of read-mostly data
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <skygw_debug.h>
+#include <snapshot.h>
+#include <epoch.h>
+
+/**
+ * test1    A published version replaces the current one, which stays readable
+ *          until the polling threads have been quiescent
+ */
+static int
+test1()
+{
+    SNAPSHOT snap = SNAPSHOT_INIT;
+    int *v1, *v2, *current;
+
+    ss_dfprintf(stderr, "testsnapshot : versions are published and retired");
+    epoch_init(2);
+    ss_info_dassert(snapshot_get(&snap) == NULL, "Snapshot should be empty");
+
+    v1 = (int *)snapshot_alloc(sizeof(int));
+    ss_info_dassert(v1 != NULL, "Version should be allocated");
+    *v1 = 1;
+    snapshot_write_begin(&snap);
+    snapshot_write_end(&snap, v1);
+    ss_info_dassert(snapshot_get(&snap) == v1, "First version should be current");
+    ss_info_dassert(epoch_pending() == 0, "Nothing should be retired");
+
+    current = (int *)snapshot_write_begin(&snap);
+    ss_info_dassert(current == v1, "Writer should see the current version");
+    v2 = (int *)snapshot_alloc(sizeof(int));
+    *v2 = *current + 1;
+    snapshot_write_end(&snap, v2);
+    ss_info_dassert(*(int *)snapshot_get(&snap) == 2, "Second version should be current");
+    ss_info_dassert(epoch_pending() == 1, "First version should be retired");
+    ss_info_dassert(*v1 == 1, "Retired version should still be readable");
+
+    epoch_quiescent(0);
+    ss_info_dassert(epoch_pending() == 1, "Version should wait for all threads");
+    epoch_quiescent(1);
+    ss_info_dassert(epoch_pending() == 0, "Version should be freed");
+
+    snapshot_write_begin(&snap);
+    snapshot_write_end(&snap, NULL);
+    ss_info_dassert(snapshot_get(&snap) == v2, "Current version should be kept");
+    snapshot_discard(snapshot_alloc(16));
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+
+    exit(result);
+}
@@ -245,6 +245,80 @@ test3()
     return 0 == failures ? 0 : 1;
 }
 
+/**
+ * test4    contention statistics
+ *
+ * Check that the acquisitions of a named lock are counted, that waiting
+ * threads that are parked get the lock and that the lock is reported once
+ * it has been contended.
+ */
+#define TEST4_THREADS 4
+#define TEST4_ITERATIONS 200
+
+static SPINLOCK test4_lck = SPINLOCK_INIT_NAMED("test4");
+static int test4_count;
+
+static void
+test4_helper(void *data)
+{
+    struct timespec sleeptime;
+    int i;
+
+    sleeptime.tv_sec = 0;
+    sleeptime.tv_nsec = 100000;
+
+    for (i = 0; i < TEST4_ITERATIONS; i++)
+    {
+        spinlock_acquire(&test4_lck);
+        test4_count++;
+        /** Hold the lock long enough for the other threads to park */
+        nanosleep(&sleeptime, NULL);
+        spinlock_release(&test4_lck);
+    }
+}
+
+static int
+test4()
+{
+    THREAD handle[TEST4_THREADS];
+    SPINLOCK_INFO info[10];
+    int i, n;
+
+    test4_count = 0;
+    for (i = 0; i < TEST4_THREADS; i++)
+    {
+        thread_start(&handle[i], test4_helper, NULL);
+    }
+    for (i = 0; i < TEST4_THREADS; i++)
+    {
+        thread_wait(handle[i]);
+    }
+
+    if (test4_count != TEST4_THREADS * TEST4_ITERATIONS ||
+        test4_lck.acquired != TEST4_THREADS * TEST4_ITERATIONS)
+    {
+        fprintf(stderr, "spinlock: test 4.1 failed, %d increments, %lu acquisitions.\n",
+                test4_count, test4_lck.acquired);
+        return 1;
+    }
+    if (test4_lck.contended == 0 || test4_lck.wait_cycles == 0)
+    {
+        fprintf(stderr, "spinlock: test 4.2 failed, the lock was not contended.\n");
+        return 1;
+    }
+    n = spinlock_contention(info, 10);
+    for (i = 0; i < n && info[i].address != &test4_lck; i++)
+    {
+        ;
+    }
+    if (i == n || info[i].contended != test4_lck.contended)
+    {
+        fprintf(stderr, "spinlock: test 4.3 failed, the lock was not reported.\n");
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int result = 0;
@@ -252,6 +326,7 @@ int main(int argc, char **argv)
     result += test1();
     result += test2();
     result += test3();
+    result += test4();
 
     exit(result);
 }
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file teststatistics.c  - Tests for the per-thread statistics
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <skygw_debug.h>
+#include <maxconfig.h>
+#include <statistics.h>
+
+#define N_THREADS 4
+#define N_VALUES  100000
+
+static ts_stats_t counter;
+static ts_stats_t gauge;
+static ts_histogram_t histogram;
+
+static void *
+test1_thread(void *data)
+{
+    int id = (int)(intptr_t)data;
+    int i;
+
+    ts_stats_set_thread_id(id);
+    for (i = 0; i < N_VALUES; i++)
+    {
+        ts_stats_add(counter, 1);
+    }
+    ts_stats_set(gauge, (id + 1) * 10);
+    return NULL;
+}
+
+/**
+ * test1    Counters are summed and gauges combined over the threads
+ */
+static int
+test1()
+{
+    pthread_t threads[N_THREADS];
+    int i;
+
+    ss_dfprintf(stderr, "teststatistics : counters and gauges");
+    counter = ts_stats_alloc();
+    gauge = ts_stats_alloc();
+    ss_info_dassert(counter && gauge, "Statistics should be allocated");
+    ss_info_dassert(((uintptr_t)counter & 63) == 0, "Statistics should be cache line aligned");
+
+    for (i = 0; i < N_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, test1_thread, (void *)(intptr_t)i);
+    }
+    for (i = 0; i < N_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    ss_info_dassert(ts_stats_sum(counter) == (int64_t)N_THREADS * N_VALUES, "Wrong sum");
+    ss_info_dassert(ts_stats_get(gauge, TS_STATS_MIN) == 10, "Wrong minimum");
+    ss_info_dassert(ts_stats_get(gauge, TS_STATS_MAX) == N_THREADS * 10, "Wrong maximum");
+    ss_info_dassert(ts_stats_get(gauge, TS_STATS_AVG) == 25, "Wrong average");
+
+    ts_stats_add(counter, 0x100000000LL);
+    ss_info_dassert(ts_stats_sum(counter) > 0x100000000LL, "Counters should be 64 bits");
+
+    ts_stats_free(counter);
+    ts_stats_free(gauge);
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+/**
+ * test2    Percentiles of a histogram are within the bucket precision
+ */
+static int
+test2()
+{
+    ts_histogram_summary_t sum;
+    uint64_t p;
+    int i;
+
+    ss_dfprintf(stderr, "teststatistics : histograms");
+    histogram = ts_histogram_alloc();
+    ss_info_dassert(histogram, "Histogram should be allocated");
+
+    ts_histogram_get(histogram, -1, &sum);
+    ss_info_dassert(sum.count == 0 && sum.p99 == 0, "Empty histogram should be zero");
+
+    ts_stats_set_thread_id(1);
+    for (i = 1; i <= 1000; i++)
+    {
+        ts_histogram_add(histogram, i);
+    }
+    ts_stats_set_thread_id(2);
+    ts_histogram_add(histogram, 1000000);
+
+    ts_histogram_get(histogram, -1, &sum);
+    ss_info_dassert(sum.count == 1001, "Wrong count");
+    ss_info_dassert(sum.min == 1, "Wrong minimum");
+    ss_info_dassert(sum.max == 1000000, "Wrong maximum");
+    ss_info_dassert(sum.p50 >= 500 && sum.p50 <= 500 * 1.125 + 1, "Median is not accurate");
+    ss_info_dassert(sum.p99 >= 990 && sum.p99 <= 990 * 1.125, "99th percentile is not accurate");
+    ss_info_dassert(sum.p999 >= 999, "99.9th percentile is not accurate");
+
+    p = ts_histogram_percentile(histogram, 2, 50);
+    ss_info_dassert(p == 1000000, "Percentile of one thread should only use its values");
+
+    ss_info_dassert(ts_histogram_range(histogram, -1, 0, 8) == 7, "Small values are exact");
+    ss_info_dassert(ts_histogram_range(histogram, -1, 512, 1024) == 1000 - 511,
+                    "Power of two ranges are exact");
+    ss_info_dassert(ts_histogram_range(histogram, -1, 1024, UINT64_MAX) == 1,
+                    "Unbounded range should count the largest value");
+
+    ts_histogram_add(histogram, UINT64_MAX);
+    ss_info_dassert(ts_histogram_percentile(histogram, -1, 100) == UINT64_MAX,
+                    "Values above the last bucket should be kept");
+    ts_histogram_free(histogram);
+    ts_stats_set_thread_id(0);
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    config_get_global_options()->n_threads = N_THREADS;
+    ts_stats_init();
+    result += test1();
+    result += test2();
+
+    exit(result);
+}
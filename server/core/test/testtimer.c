@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file testtimer.c  - Tests for the hierarchical timer wheel
+ */
+
+// To ensure that ss_info_assert asserts also when builing in non-debug mode.
+#if !defined(SS_DEBUG)
+#define SS_DEBUG
+#endif
+#if defined(NDEBUG)
+#undef NDEBUG
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <skygw_debug.h>
+#include <timer.h>
+#include <hk_heartbeat.h>
+
+typedef struct
+{
+    TIMER timer;
+    long  fired;     /*< The wheel time when the timer was run, -1 if not run */
+    TIMER_WHEEL *wheel;
+    long  rearm;     /*< Re-add the timer with this many ticks, 0 for none */
+} TEST_TIMER;
+
+static void
+test_timer_fn(void *data)
+{
+    TEST_TIMER *t = (TEST_TIMER *)data;
+    t->fired = t->wheel->current - 1;
+    if (t->rearm)
+    {
+        timer_add(t->wheel, &t->timer, t->rearm);
+    }
+}
+
+static void
+test_timer_setup(TEST_TIMER *t, TIMER_WHEEL *wheel, long ticks)
+{
+    timer_init(&t->timer, test_timer_fn, t);
+    t->fired = -1;
+    t->wheel = wheel;
+    t->rearm = 0;
+    timer_add(wheel, &t->timer, ticks);
+}
+
+/**
+ * test1    Timers on each level expire at the right time
+ */
+static int
+test1()
+{
+    static TIMER_WHEEL wheel;
+    long ticks[] = {1, 2, 255, 256, 257, 1000, 16383, 16384, 70000, 1 << 20, (1 << 21) + 17};
+    int n = sizeof(ticks) / sizeof(ticks[0]);
+    TEST_TIMER timers[n];
+    int i;
+
+    ss_dfprintf(stderr, "testtimer : timers expire on time");
+    timer_wheel_init(&wheel, 0);
+    for (i = 0; i < n; i++)
+    {
+        test_timer_setup(&timers[i], &wheel, ticks[i]);
+    }
+    ss_info_dassert(wheel.n_timers == n, "All timers should be pending");
+
+    for (i = 0; i < n; i++)
+    {
+        /** Run up to the heartbeat before the expiry, then over it */
+        timer_wheel_run(&wheel, ticks[i] - 1);
+        ss_info_dassert(timers[i].fired == -1, "Timer should not have expired early");
+        timer_wheel_run(&wheel, ticks[i]);
+        ss_info_dassert(timers[i].fired == ticks[i], "Timer should expire on time");
+        ss_info_dassert(!timer_pending(&timers[i].timer), "Expired timer should not be pending");
+    }
+    ss_info_dassert(wheel.n_timers == 0, "No timers should be pending");
+
+    /** A timer with no delay is run on the next heartbeat */
+    test_timer_setup(&timers[0], &wheel, 0);
+    timer_wheel_run(&wheel, wheel.current);
+    ss_info_dassert(timers[0].fired == ticks[n - 1] + 1, "Timer should be run on the next heartbeat");
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+/**
+ * test2    Removing and re-adding timers
+ */
+static int
+test2()
+{
+    static TIMER_WHEEL wheel;
+    TEST_TIMER a, b;
+
+    ss_dfprintf(stderr, "testtimer : remove and re-add timers");
+    timer_wheel_init(&wheel, 100);
+    test_timer_setup(&a, &wheel, 10);
+    test_timer_setup(&b, &wheel, 300);
+    ss_info_dassert(timer_remove(&a.timer), "Pending timer should be removed");
+    ss_info_dassert(!timer_remove(&a.timer), "Removed timer should not be pending");
+    timer_wheel_run(&wheel, 200);
+    ss_info_dassert(a.fired == -1, "Removed timer should not be run");
+
+    /** Move the timer closer, it should then expire at the new time */
+    timer_add(&wheel, &b.timer, 5);
+    ss_info_dassert(wheel.n_timers == 1, "Re-added timer should be pending once");
+    timer_wheel_run(&wheel, 204);
+    ss_info_dassert(b.fired == -1, "Re-added timer should not expire early");
+    timer_wheel_run(&wheel, 205);
+    ss_info_dassert(b.fired == 205, "Re-added timer should expire at the new time");
+
+    /** A repeating timer */
+    b.rearm = 10;
+    b.fired = -1;
+    timer_add(&wheel, &b.timer, 10);
+    timer_wheel_run(&wheel, 236);
+    ss_info_dassert(b.fired == 235, "Repeating timer should be run every 10 heartbeats");
+    ss_info_dassert(timer_pending(&b.timer), "Repeating timer should be pending");
+    ss_info_dassert(timer_remove(&b.timer), "Repeating timer should be removed");
+    ss_dfprintf(stderr, "\t..done\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    result += test1();
+    result += test2();
+
+    exit(result);
+}
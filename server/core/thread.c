@@ -10,6 +10,10 @@
  * of this software will be governed by version 2 or later of the General
  * Public License.
  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include <thread.h>
 
 /**
@@ -68,3 +72,106 @@ thread_millisleep(int ms)
     req.tv_nsec = (ms % 1000) * 1000000;
     nanosleep(&req, NULL);
 }
+
+/**
+ * Parse a list of CPU or NUMA node numbers. The list is a comma separated
+ * list of numbers and ranges of numbers, e.g. 0-3,8,10-11.
+ *
+ * @param str   The list to parse
+ * @param set   The set where the numbers are stored
+ * @return      True if the list was valid and not empty
+ */
+bool
+thread_parse_cpulist(const char *str, cpu_set_t *set)
+{
+    const char *ptr = str;
+
+    CPU_ZERO(set);
+    while (*ptr)
+    {
+        char *end;
+        long first, last;
+
+        while (isspace(*ptr))
+        {
+            ptr++;
+        }
+        first = strtol(ptr, &end, 10);
+        if (end == ptr || first < 0 || first >= CPU_SETSIZE)
+        {
+            return false;
+        }
+        last = first;
+        ptr = end;
+        if (*ptr == '-')
+        {
+            ptr++;
+            last = strtol(ptr, &end, 10);
+            if (end == ptr || last < first || last >= CPU_SETSIZE)
+            {
+                return false;
+            }
+            ptr = end;
+        }
+        while (first <= last)
+        {
+            CPU_SET(first, set);
+            first++;
+        }
+        while (isspace(*ptr))
+        {
+            ptr++;
+        }
+        if (*ptr == ',')
+        {
+            ptr++;
+        }
+        else if (*ptr)
+        {
+            return false;
+        }
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+/**
+ * Find the CPUs of a NUMA node
+ *
+ * @param node  The NUMA node
+ * @param set   The set where the CPUs are stored
+ * @return      True if the node exists and has CPUs
+ */
+bool
+thread_numa_node_cpus(int node, cpu_set_t *set)
+{
+    char path[80];
+    char buf[1024];
+    bool rval = false;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if ((file = fopen(path, "r")) != NULL)
+    {
+        if (fgets(buf, sizeof(buf), file))
+        {
+            buf[strcspn(buf, "\n")] = '\0';
+            rval = thread_parse_cpulist(buf, set);
+        }
+        fclose(file);
+    }
+    return rval;
+}
+
+/**
+ * Bind the calling thread and the threads it creates after this to a set of
+ * CPUs. Memory is by default allocated from the NUMA node of the CPU that first
+ * touches it, so the memory a bound thread allocates is local to it.
+ *
+ * @param set   The CPUs to run on
+ * @return      True if the affinity was set
+ */
+bool
+thread_set_cpus(cpu_set_t *set)
+{
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set) == 0;
+}
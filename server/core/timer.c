@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file timer.c  - Hierarchical timer wheel
+ *
+ * The timers that expire within TIMER_ROOT_SIZE heartbeats are kept in the
+ * root level, one slot per heartbeat. The timers that expire later are kept
+ * in the upper levels where a slot covers a range of heartbeats. Whenever the
+ * root level wraps around, the timers of the next slot of the first upper
+ * level are moved down, and so on for the levels above it. This is the same
+ * cascading scheme that the Linux kernel uses for its timers.
+ *
+ * The timer functions are called without the wheel lock being held, which
+ * allows them to add and remove timers, the timer that is being run included.
+ */
+
+#include <string.h>
+#include <sched.h>
+#include <timer.h>
+#include <hk_heartbeat.h>
+
+#define TIMER_ROOT_MASK  (TIMER_ROOT_SIZE - 1)
+#define TIMER_LEVEL_MASK (TIMER_LEVEL_SIZE - 1)
+#define TIMER_LEVEL_SHIFT(n) (TIMER_ROOT_BITS + (n) * TIMER_LEVEL_BITS)
+
+/**
+ * Link a timer to the slot that matches its expiry time.
+ * Must be called with the wheel lock held.
+ *
+ * @param wheel The timer wheel
+ * @param timer The timer to link
+ */
+static void
+timer_link(TIMER_WHEEL *wheel, TIMER *timer)
+{
+    long expires = timer->expires;
+    long delta = expires - wheel->current;
+    TIMER **slot;
+
+    if (delta < 0)
+    {
+        /** Already expired, run it when the next heartbeat is processed */
+        slot = &wheel->root[wheel->current & TIMER_ROOT_MASK];
+    }
+    else if (delta < TIMER_ROOT_SIZE)
+    {
+        slot = &wheel->root[expires & TIMER_ROOT_MASK];
+    }
+    else
+    {
+        int level = 0;
+
+        while (level < TIMER_LEVELS - 1 && delta >= (1L << TIMER_LEVEL_SHIFT(level + 1)))
+        {
+            level++;
+        }
+        slot = &wheel->levels[level][(expires >> TIMER_LEVEL_SHIFT(level)) & TIMER_LEVEL_MASK];
+    }
+
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot)
+    {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+    wheel->n_timers++;
+}
+
+/**
+ * Unlink a timer from the slot it is in.
+ * Must be called with the wheel lock held.
+ *
+ * @param wheel The timer wheel
+ * @param timer The timer to unlink
+ */
+static void
+timer_unlink(TIMER_WHEEL *wheel, TIMER *timer)
+{
+    if (timer->prev)
+    {
+        timer->prev->next = timer->next;
+    }
+    else
+    {
+        *timer->slot = timer->next;
+    }
+    if (timer->next)
+    {
+        timer->next->prev = timer->prev;
+    }
+    timer->slot = NULL;
+    timer->next = NULL;
+    timer->prev = NULL;
+    wheel->n_timers--;
+}
+
+/**
+ * Move the timers of the current slot of an upper level to the levels below.
+ * Must be called with the wheel lock held.
+ *
+ * @param wheel The timer wheel
+ * @param level The upper level to cascade
+ * @return      The index of the slot that was cascaded
+ */
+static int
+timer_cascade(TIMER_WHEEL *wheel, int level)
+{
+    int idx = (wheel->current >> TIMER_LEVEL_SHIFT(level)) & TIMER_LEVEL_MASK;
+    TIMER *timer = wheel->levels[level][idx];
+
+    wheel->levels[level][idx] = NULL;
+    while (timer)
+    {
+        TIMER *next = timer->next;
+        wheel->n_timers--;
+        timer_link(wheel, timer);
+        timer = next;
+    }
+    return idx;
+}
+
+/**
+ * Initialise a timer wheel
+ *
+ * @param wheel The timer wheel
+ * @param now   The current time in heartbeats, the first heartbeat processed
+ *              by the wheel is the one after it
+ */
+void
+timer_wheel_init(TIMER_WHEEL *wheel, long now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    spinlock_init(&wheel->lock);
+    wheel->current = now + 1;
+}
+
+/**
+ * Run the timers that have expired. The timers are run in the order of their
+ * expiry time.
+ *
+ * @param wheel The timer wheel
+ * @param now   The current time in heartbeats
+ * @return      The number of timers that were run
+ */
+int
+timer_wheel_run(TIMER_WHEEL *wheel, long now)
+{
+    int n_run = 0;
+
+    if (wheel->current > now)
+    {
+        /** Nothing can have expired since the previous call */
+        return 0;
+    }
+
+    spinlock_acquire(&wheel->lock);
+    while (wheel->current <= now)
+    {
+        int idx = wheel->current & TIMER_ROOT_MASK;
+        TIMER *timer;
+        TIMER *expired;
+
+        if (idx == 0)
+        {
+            int level;
+
+            for (level = 0; level < TIMER_LEVELS && timer_cascade(wheel, level) == 0; level++)
+            {
+                ;
+            }
+        }
+
+        /**
+         * Move the expired timers to a list of their own before running
+         * them, timers added by the timer functions are then not run on
+         * this heartbeat even if they end up in the same slot.
+         */
+        expired = wheel->root[idx];
+        wheel->root[idx] = NULL;
+        wheel->expired = expired;
+        for (timer = expired; timer; timer = timer->next)
+        {
+            timer->slot = &wheel->expired;
+        }
+        wheel->current++;
+
+        while ((timer = wheel->expired) != NULL)
+        {
+            void (*fn)(void *) = timer->fn;
+            void *data = timer->data;
+
+            timer_unlink(wheel, timer);
+            wheel->running = timer;
+            wheel->running_thread = pthread_self();
+            spinlock_release(&wheel->lock);
+
+            fn(data);
+            n_run++;
+
+            spinlock_acquire(&wheel->lock);
+            wheel->running = NULL;
+        }
+    }
+    spinlock_release(&wheel->lock);
+
+    return n_run;
+}
+
+/**
+ * Initialise a timer
+ *
+ * @param timer The timer
+ * @param fn    The function to call when the timer expires
+ * @param data  The data passed to the function
+ */
+void
+timer_init(TIMER *timer, void (*fn)(void *), void *data)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->fn = fn;
+    timer->data = data;
+}
+
+/**
+ * Add a timer to a wheel. If the timer is already pending it is first removed.
+ *
+ * The expiry time is counted from the current heartbeat, or from the last
+ * heartbeat processed by the wheel if that is later. A timer with an expiry
+ * time of zero heartbeats is run on the next heartbeat. A timer may be moved
+ * to another wheel, but not while it is being added or removed by another
+ * thread.
+ *
+ * @param wheel The timer wheel
+ * @param timer The timer to add
+ * @param ticks The number of heartbeats after which the timer expires
+ */
+void
+timer_add(TIMER_WHEEL *wheel, TIMER *timer, long ticks)
+{
+    long now;
+
+    if (timer->wheel && timer->wheel != wheel)
+    {
+        timer_remove(timer);
+    }
+
+    if (ticks < 0)
+    {
+        ticks = 0;
+    }
+    else if (ticks > TIMER_MAX_TICKS)
+    {
+        ticks = TIMER_MAX_TICKS;
+    }
+
+    spinlock_acquire(&wheel->lock);
+    now = wheel->current - 1;
+    if (hkheartbeat > now)
+    {
+        now = hkheartbeat;
+    }
+    if (timer->slot)
+    {
+        timer_unlink(wheel, timer);
+    }
+    timer->wheel = wheel;
+    timer->expires = now + ticks;
+    timer_link(wheel, timer);
+    spinlock_release(&wheel->lock);
+}
+
+/**
+ * Remove a timer from its wheel. If the function of the timer is being run by
+ * another thread, wait until it returns. After this the memory of the timer
+ * can be released. A timer function may remove its own timer.
+ *
+ * @param timer The timer to remove
+ * @return      True if the timer was pending
+ */
+bool
+timer_remove(TIMER *timer)
+{
+    TIMER_WHEEL *wheel = timer->wheel;
+    bool removed = false;
+
+    if (wheel == NULL)
+    {
+        return false;
+    }
+
+    spinlock_acquire(&wheel->lock);
+    if (timer->slot)
+    {
+        timer_unlink(wheel, timer);
+        removed = true;
+    }
+    while (wheel->running == timer && !pthread_equal(wheel->running_thread, pthread_self()))
+    {
+        spinlock_release(&wheel->lock);
+        sched_yield();
+        spinlock_acquire(&wheel->lock);
+    }
+    spinlock_release(&wheel->lock);
+
+    return removed;
+}
+
+/**
+ * Check whether a timer is waiting to expire
+ *
+ * @param timer The timer
+ * @return      True if the timer has been added and has not yet expired
+ */
+bool
+timer_pending(TIMER *timer)
+{
+    return timer->slot != NULL;
+}
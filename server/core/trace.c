@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file trace.c  - Sampled tracing of the query pipeline
+ *
+ * The sampling is counted per polling thread, so deciding whether a query is
+ * traced costs no shared writes. The stages are stamped into the trace of the
+ * session without locking: the stages of a query are passed one after another,
+ * even when the reply is read by another thread. The stages before the reply
+ * are stamped through the session where it is at hand and through
+ * trace_current where it is not, i.e. in the query classifier.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <session.h>
+#include <service.h>
+#include <spinlock.h>
+#include <dcb.h>
+#include <maxscale/poll.h>
+
+thread_local QUERY_TRACE *trace_current = NULL;
+
+static int trace_sample = 0;                    /*< One in this many queries is traced, 0 for none */
+static thread_local int trace_count = 0;        /*< Queries since the last traced one */
+
+static SPINLOCK trace_lock = SPINLOCK_INIT;     /*< Protects the ring */
+static QUERY_TRACE trace_ring[TRACE_RING_SIZE]; /*< The completed traces */
+static unsigned long trace_next = 0;            /*< The total number of completed traces */
+
+/**
+ * Set the sampling of the traced queries
+ *
+ * @param sample    One in this many queries is traced, 0 disables the tracing
+ */
+void
+trace_init(int sample)
+{
+    trace_sample = sample > 0 ? sample : 0;
+}
+
+/**
+ * Decide whether to trace a query that is about to be routed. A trace of an
+ * earlier query of the session that never completed is abandoned.
+ *
+ * @param session   The session of the query
+ * @param received  The time-stamp counter when the client event was received,
+ *                  0 if not known
+ */
+void
+trace_start(SESSION *session, CYCLES received)
+{
+    QUERY_TRACE *trace = &session->trace;
+
+    trace->active = false;
+    trace_current = NULL;
+
+    if (trace_sample > 0 && ++trace_count >= trace_sample)
+    {
+        CYCLES now = rdtsc();
+
+        trace_count = 0;
+        memset(trace->stamps, 0, sizeof(trace->stamps));
+        trace->ses_id = session->ses_id;
+        trace->service = session->service->name;
+        trace->stamps[TRACE_CLIENT_READ] = received && received <= now ? received : now;
+        trace->stamps[TRACE_ROUTE] = now;
+        trace->active = true;
+        trace_current = trace;
+    }
+}
+
+/**
+ * Abandon the trace of a session, called when a packet that is not traced is
+ * routed
+ *
+ * @param session   The session
+ */
+void
+trace_cancel(SESSION *session)
+{
+    session->trace.active = false;
+    trace_current = NULL;
+}
+
+/**
+ * Complete the trace of a query when the last packet of the reply has been
+ * written to the client and add it to the ring
+ *
+ * @param session   The session of the query
+ */
+void
+trace_end(SESSION *session)
+{
+    QUERY_TRACE *trace = &session->trace;
+
+    if (trace->active)
+    {
+        trace->stamps[TRACE_CLIENT_WRITE] = rdtsc();
+        trace->active = false;
+
+        spinlock_acquire(&trace_lock);
+        trace_ring[trace_next % TRACE_RING_SIZE] = *trace;
+        trace_next++;
+        spinlock_release(&trace_lock);
+    }
+}
+
+/**
+ * Print the offset of a stage from the client read in microseconds
+ *
+ * @param dcb           The DCB to print to
+ * @param trace         The trace
+ * @param stage         The stage
+ * @param per_usec      Time-stamp counter cycles per microsecond
+ */
+static void
+trace_print_stage(DCB *dcb, QUERY_TRACE *trace, trace_stage_t stage, double per_usec)
+{
+    CYCLES start = trace->stamps[TRACE_CLIENT_READ];
+
+    if (trace->stamps[stage] >= start)
+    {
+        dcb_printf(dcb, " | %9.1f", (trace->stamps[stage] - start) / per_usec);
+    }
+    else
+    {
+        dcb_printf(dcb, " | %9s", "-");
+    }
+}
+
+/**
+ * Print the completed traces, the oldest first. The times are the offsets of
+ * the stages from the client read event in microseconds.
+ *
+ * @param dcb   The DCB to print the traces to
+ */
+void
+dShowQueryTraces(DCB *dcb)
+{
+    QUERY_TRACE *traces = malloc(TRACE_RING_SIZE * sizeof(QUERY_TRACE));
+    double per_usec = poll_cycles_per_usec();
+    unsigned long first, next;
+
+    if (trace_sample == 0)
+    {
+        dcb_printf(dcb, "Query tracing is disabled, see query_trace_sample.\n");
+    }
+    if (traces == NULL)
+    {
+        return;
+    }
+
+    /** The ring is copied so that the tracing is not held up by the printing */
+    spinlock_acquire(&trace_lock);
+    next = trace_next;
+    first = next > TRACE_RING_SIZE ? next - TRACE_RING_SIZE : 0;
+    for (unsigned long i = first; i < next; i++)
+    {
+        traces[i - first] = trace_ring[i % TRACE_RING_SIZE];
+    }
+    spinlock_release(&trace_lock);
+
+    dcb_printf(dcb, "Query traces, in microseconds from the client read event.\n\n");
+    dcb_printf(dcb, "%-8s | %-20s | %-9s | %-9s | %-9s | %-9s | %-9s | %-9s\n",
+               "Session", "Service", "Route", "Classify", "Target", "Backend", "Reply", "Done");
+    dcb_printf(dcb, "---------+----------------------+-----------+-----------+-----------+"
+               "-----------+-----------+----------\n");
+    for (unsigned long i = 0; i < next - first; i++)
+    {
+        dcb_printf(dcb, "%-8lu | %-20.20s", (unsigned long)traces[i].ses_id, traces[i].service);
+        for (int stage = TRACE_ROUTE; stage < TRACE_N_STAGES; stage++)
+        {
+            trace_print_stage(dcb, &traces[i], stage, per_usec);
+        }
+        dcb_printf(dcb, "\n");
+    }
+
+    free(traces);
+}
@@ -28,6 +28,7 @@
  * 08/01/2014   Massimiliano Pinto      In user_alloc now we can pass function pointers for
  *                                      copying/freeing keys and values independently via
  *                                      hashtable_memory_fns() routine
+ * 15/10/2016   Core Team               Added users_retire
  *
  * @endverbatim
  */
@@ -82,9 +83,40 @@ users_free(USERS *users)
     {
         hashtable_free(users->data);
     }
+    if (users->index)
+    {
+        hashtable_free(users->index);
+    }
     free(users);
 }
 
+/**
+ * Epoch callback that frees a retired users table
+ *
+ * @param data The users table
+ */
+static void
+users_retired_free(void *data)
+{
+    users_free((USERS *)data);
+}
+
+/**
+ * Free a users table that has been replaced in its service. The polling
+ * threads read the tables without locks, so the table is freed only once
+ * none of them can still hold a reference to it.
+ *
+ * @param users The users table
+ */
+void
+users_retire(USERS *users)
+{
+    if (users)
+    {
+        epoch_retire(&users->retire, users_retired_free, users);
+    }
+}
+
 /**
  * Add a new user to the user table. The user name must be unique
  *
@@ -0,0 +1,68 @@
+#ifndef _AFFINITY_H
+#define _AFFINITY_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file affinity.h - Consistent hashing of sessions to servers
+ *
+ * A session is given to the server for which the key of the session, for
+ * example the address of the client, gets the highest score. The score is
+ * computed from the key and the name of the server, so the servers that are
+ * available do not change the scores of each other. When a server goes away,
+ * only the keys it had move to other servers and when it comes back, only
+ * those keys move back to it. The share of the keys a server gets is
+ * proportional to its weight.
+ */
+
+#include <stdbool.h>
+#include <session.h>
+
+/** What the key of a session is */
+typedef enum
+{
+    AFFINITY_NONE,      /*< No affinity */
+    AFFINITY_CLIENT,    /*< The address of the client */
+    AFFINITY_USER,      /*< The user name */
+    AFFINITY_DATABASE   /*< The default database given when connecting */
+} affinity_key_t;
+
+/**
+ * Parse the type of the key
+ *
+ * @param str  One of "client", "user" or "database"
+ * @param type The type is stored here
+ * @return True if the string was a valid key type
+ */
+bool affinity_parse_key(const char *str, affinity_key_t *type);
+
+/**
+ * Get the key of a session
+ *
+ * @param type    The type of the key
+ * @param session The session
+ * @return The key or NULL if the session has none
+ */
+const char* affinity_session_key(affinity_key_t type, SESSION *session);
+
+/**
+ * Compute the score of a server for a key
+ *
+ * @param key    The key of the session
+ * @param server The unique name of the server
+ * @param weight The weight of the server, zero gives a score of zero
+ * @return The score, the server with the highest score gets the key
+ */
+double affinity_score(const char *key, const char *server, int weight);
+
+#endif
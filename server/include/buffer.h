@@ -39,6 +39,7 @@
  *                                      Add more buffer handling macros
  *                                      Add gwbuf_rtrim (handle chains)
  * 09/11/2014   Martin Brampton         Add dprintAllBuffers (conditional compilation)
+ * 15/10/2016   Core Team               Add gwbuf_grow
  *
  * @endverbatim
  */
@@ -47,6 +48,7 @@
 #include <hint.h>
 #include <spinlock.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 EXTERN_C_BLOCK_BEGIN
 
@@ -54,11 +56,19 @@ EXTERN_C_BLOCK_BEGIN
  * Buffer properties - used to store properties related to the buffer
  * contents. This may be added at any point during the processing of the
  * data, especially in the protocol stage of the processing.
+ *
+ * The properties are identified by the IDs returned by gwbuf_property_id,
+ * which are looked up once, and the first GWBUF_N_PROPERTIES of them are
+ * stored in the same block as the buffer header. Only the properties past
+ * those are allocated, as a list of BUF_PROPERTY structures.
  */
+#define GWBUF_N_PROPERTIES 4
+
 typedef struct buf_property
 {
-    char                    *name;
-    char                    *value;
+    int                     id;     /*< The property ID */
+    void                    *value; /*< The property value */
+    bool                    owned;  /*< Whether the value is freed with the buffer */
     struct buf_property     *next;
 } BUF_PROPERTY;
 
@@ -71,7 +81,8 @@ typedef enum
     GWBUF_TYPE_SESCMD_RESPONSE = 0x08,
     GWBUF_TYPE_RESPONSE_END    = 0x10,
     GWBUF_TYPE_SESCMD          = 0x20,
-    GWBUF_TYPE_HTTP            = 0x40
+    GWBUF_TYPE_HTTP            = 0x40,
+    GWBUF_TYPE_STREAM          = 0x80
 } gwbuf_type_t;
 
 #define GWBUF_IS_TYPE_UNDEFINED(b)       (b->gwbuf_type == 0)
@@ -81,17 +92,7 @@ typedef enum
 #define GWBUF_IS_TYPE_SESCMD_RESPONSE(b) (b->gwbuf_type & GWBUF_TYPE_SESCMD_RESPONSE)
 #define GWBUF_IS_TYPE_RESPONSE_END(b)    (b->gwbuf_type & GWBUF_TYPE_RESPONSE_END)
 #define GWBUF_IS_TYPE_SESCMD(b)          (b->gwbuf_type & GWBUF_TYPE_SESCMD)
-
-/**
- * A structure to encapsulate the data in a form that the data itself can be
- * shared between multiple GWBUF's without the need to make multiple copies
- * but still maintain separate data pointers.
- */
-typedef struct
-{
-    unsigned char   *data;                  /*< Physical memory that was allocated */
-    int             refcount;               /*< Reference count on the buffer */
-} SHARED_BUF;
+#define GWBUF_IS_TYPE_STREAM(b)          (b->gwbuf_type & GWBUF_TYPE_STREAM)
 
 typedef enum
 {
@@ -109,7 +110,8 @@ typedef enum
  */
 typedef enum
 {
-    GWBUF_PARSING_INFO
+    GWBUF_PARSING_INFO,
+    GWBUF_CLASSIFIER_VIEW
 } bufobj_id_t;
 
 typedef struct buffer_object_st buffer_object_t;
@@ -122,6 +124,23 @@ struct buffer_object_st
     buffer_object_t* bo_next;
 };
 
+/**
+ * A structure to encapsulate the data in a form that the data itself can be
+ * shared between multiple GWBUF's without the need to make multiple copies
+ * but still maintain separate data pointers.
+ *
+ * The reference count is only modified atomically. The objects referred to
+ * by the data are shared by all buffers pointing to it and freed with it;
+ * objects are only ever appended to the list while the data is referenced.
+ */
+typedef struct
+{
+    unsigned char   *data;                  /*< Physical memory that was allocated */
+    size_t          size;                   /*< Size of the block holding the buffer */
+    int             refcount;               /*< Reference count on the buffer */
+    buffer_object_t *bufobj;                /*< List of objects referred to by the data */
+} SHARED_BUF;
+
 
 /**
  * The buffer structure used by the descriptor control blocks.
@@ -130,22 +149,35 @@ struct buffer_object_st
  * or written to a descriptor. The use of linked lists of buffers with
  * flexible data pointers is designed to minimise the need for data to
  * be copied within the gateway.
+ *
+ * A chain of buffers is owned by one session at a time and the buffer
+ * header is not locked, only the SHARED_BUF is shared between threads.
+ * The header fits in one cache line.
  */
 typedef struct gwbuf
 {
-    SPINLOCK        gwbuf_lock;
     struct gwbuf    *next;  /*< Next buffer in a linked chain of buffers */
     struct gwbuf    *tail;  /*< Last buffer in a linked chain of buffers */
     void            *start; /*< Start of the valid data */
     void            *end;   /*< First byte after the valid data */
     SHARED_BUF      *sbuf;  /*< The shared buffer with the real data */
-    buffer_object_t *gwbuf_bufobj; /*< List of objects referred to by GWBUF */
     gwbuf_info_t    gwbuf_info; /*< Info bits */
     gwbuf_type_t    gwbuf_type; /*< buffer's data type information */
     HINT            *hint;  /*< Hint data for this buffer */
-    BUF_PROPERTY    *properties; /*< Buffer properties */
+    BUF_PROPERTY    *properties; /*< Buffer properties past the inline ones */
 } GWBUF;
 
+/**
+ * An iterator over the bytes of a chain of buffers. The iterator borrows the
+ * data of the chain instead of copying it, the chain must not be modified
+ * while the iterator is in use.
+ */
+typedef struct
+{
+    GWBUF           *buf;   /*< The current buffer, NULL at the end of the chain */
+    uint8_t         *ptr;   /*< The current byte in the current buffer */
+} GWBUF_ITERATOR;
+
 /*<
  * Macros to access the data in the buffers
  */
@@ -195,12 +227,21 @@ extern int              gwbuf_count(GWBUF *head);
 extern size_t           gwbuf_copy_data(GWBUF *buffer, size_t offset, size_t bytes,
                                         uint8_t* dest);
 extern GWBUF            *gwbuf_split(GWBUF **buf, size_t length);
+extern uint8_t          *gwbuf_peek(GWBUF *buffer, size_t offset, size_t bytes);
+extern void             gwbuf_iter_init(GWBUF_ITERATOR *iter, GWBUF *head);
+extern size_t           gwbuf_iter_skip(GWBUF_ITERATOR *iter, size_t bytes);
+extern size_t           gwbuf_iter_copy(GWBUF_ITERATOR *iter, size_t bytes, uint8_t *dest);
+extern uint8_t          *gwbuf_iter_peek(GWBUF_ITERATOR *iter, size_t bytes);
 extern GWBUF            *gwbuf_clone_transform(GWBUF *head, gwbuf_type_t type);
 extern GWBUF            *gwbuf_clone_all(GWBUF* head);
 extern void             gwbuf_set_type(GWBUF *head, gwbuf_type_t type);
+extern int              gwbuf_property_id(const char *name);
+extern int              gwbuf_set_property(GWBUF *buf, int id, void *value);
+extern void             *gwbuf_get_property_value(GWBUF *buf, int id);
 extern int              gwbuf_add_property(GWBUF *buf, char *name, char *value);
 extern char             *gwbuf_get_property(GWBUF *buf, char *name);
 extern GWBUF            *gwbuf_make_contiguous(GWBUF *);
+extern bool             gwbuf_grow(GWBUF *head, unsigned int bytes);
 extern int              gwbuf_add_hint(GWBUF *, HINT *);
 
 void                    gwbuf_add_buffer_object(GWBUF* buf,
@@ -208,9 +249,7 @@ void                    gwbuf_add_buffer_object(GWBUF* buf,
                                                 void*  data,
                                                 void (*donefun_fp)(void *));
 void*                   gwbuf_get_buffer_object_data(GWBUF* buf, bufobj_id_t id);
-#if defined(BUFFER_TRACE)
 extern void             dprintAllBuffers(void *pdcb);
-#endif
 EXTERN_C_BLOCK_END
 
 
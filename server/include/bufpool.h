@@ -0,0 +1,52 @@
+#ifndef _BUFPOOL_H
+#define _BUFPOOL_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file bufpool.h  - Size classed memory pools for the buffers
+ *
+ * The memory is pooled in a fixed number of size classes. Each thread has a
+ * cache of free blocks of each class from which it allocates without locking.
+ * When the cache of a thread fills up, a magazine of blocks is moved to a
+ * global depot from which the other threads refill their caches. This keeps
+ * the memory balanced when the buffers are allocated by one thread and freed
+ * by another. Allocations larger than the largest class are not pooled.
+ *
+ * The DCBs and the sessions are allocated from the same pools.
+ */
+
+#include <stddef.h>
+
+#define BUFPOOL_N_CLASSES 5
+
+/**
+ * The statistics of a size class
+ */
+typedef struct
+{
+    size_t        size;         /*< The size of the blocks of the class */
+    unsigned long hits;         /*< Allocations from the thread caches */
+    unsigned long misses;       /*< Allocations from malloc */
+    unsigned long depot_gets;   /*< Magazines taken from the depot */
+    unsigned long depot_puts;   /*< Magazines given to the depot */
+    int           depot_size;   /*< Magazines currently in the depot */
+} BUFPOOL_STATS;
+
+extern void *bufpool_alloc(size_t size);
+extern void bufpool_free(void *ptr, size_t size);
+extern size_t bufpool_capacity(size_t size);
+extern void bufpool_get_stats(int pool, BUFPOOL_STATS *stats);
+extern int  bufpool_unpooled();
+
+#endif
@@ -29,6 +29,7 @@
  * 28/02/14 Massimiliano Pinto   Added MySQL user and host data structure
  * 03/10/14 Massimiliano Pinto   Added netmask to MySQL user and host data structure
  * 13/10/14 Massimiliano Pinto   Added resource to MySQL user and host data structure
+ * 15/10/16 Core Team            Added mysql_users_find
  *
  * @endverbatim
  */
@@ -70,6 +71,7 @@ extern int load_mysql_users(SERVICE *service);
 extern int mysql_users_add(USERS *users, MYSQL_USER_HOST *key, char *auth);
 extern USERS *mysql_users_alloc();
 extern char *mysql_users_fetch(USERS *users, MYSQL_USER_HOST *key);
+extern char *mysql_users_find(USERS *users, MYSQL_USER_HOST *key, bool wildcards);
 extern int reload_mysql_users(SERVICE *service);
 extern int replace_mysql_users(SERVICE *service);
 
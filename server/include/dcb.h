@@ -21,11 +21,16 @@
 #include <gwbitmask.h>
 #include <skygw_utils.h>
 #include <netinet/in.h>
+#include <sys/types.h>
+#include <rdtsc.h>
+#include <epoch.h>
+#include <ilist.h>
 
 #define ERRHANDLE
 
 struct session;
 struct server;
+struct server_pool;
 struct service;
 struct servlistener;
 
@@ -57,6 +62,8 @@ struct servlistener;
  * 19/06/2015   Martin Brampton         Provision of persistent connections
  * 20/01/2016   Martin Brampton         Moved GWPROTOCOL to gw_protocol.h
  * 01/02/2016   Martin Brampton         Added fields for SSL and authentication
+ * 15/10/2016   Core Team               Callbacks in a fixed array, DCBs listed by server
+ * 15/10/2016   Core Team               Connect queue of the servers
  *
  * @endverbatim
  */
@@ -75,6 +82,11 @@ struct dcb;
  *      eventqlock              Spinlock to protect this structure
  *      inserted                Insertion time for logging purposes
  *      started                 Time that the processign started
+ *      owner                   The polling thread that processes the events of
+ *                              the DCB when polling thread affinity is enabled,
+ *                              -1 if not owned by any thread
+ *      queued                  Time-stamp counter value at insertion, used for
+ *                              the queueing delay histograms
  */
 typedef struct
 {
@@ -86,6 +98,8 @@ typedef struct
     SPINLOCK        eventqlock;
     unsigned long   inserted;
     unsigned long   started;
+    int             owner;
+    CYCLES          queued;
 } DCBEVENTQ;
 
 #define DCBFD_CLOSED -1
@@ -101,6 +115,7 @@ typedef struct dcbstats
     int     n_buffered;     /*< Number of buffered writes */
     int     n_high_water;   /*< Number of crosses of high water mark */
     int     n_low_water;    /*< Number of crosses of low water mark */
+    int     n_stalls;       /*< Number of reads stopped by a full write queue in the session */
 } DCBSTATS;
 
 /**
@@ -115,18 +130,31 @@ typedef struct dcbstats
  * processing an event that will access the DCB.
  *
  * We solve this issue by making the dcb_free routine merely mark a DCB as a zombie and
- * place it on a special zombie list. Before placing the DCB on the zombie list we create
- * a bitmask with a bit set in it for each active polling thread. Each thread will call
- * a routine to process the zombie list at the end of the polling loop. This routine
- * will clear the bit value that corresponds to the calling thread. Once the bitmask
- * is completely cleared the DCB can finally be freed and removed from the zombie list.
+ * retire it with the epoch based reclamation in epoch.h. Each thread reports a quiescent
+ * state at the end of the polling loop. Once every thread has done so after the DCB
+ * was retired the DCB can finally be freed.
  */
 typedef struct
 {
-    GWBITMASK       bitmask;        /*< The bitmask of threads */
-    struct dcb      *next;          /*< Next pointer for the zombie list */
+    EPOCH_ENTRY     entry;          /*< The entry in the list of retired objects */
 } DCBMM;
 
+/**
+ * Two DCBs joined with dcb_splice. The data read from one of the DCBs is moved
+ * to the other one through a pipe with splice(2) and never copied to user space.
+ * A DCB starts splicing at its first read event after the join, so that the
+ * protocol module is done with the data it has already read.
+ */
+typedef struct dcb_splice
+{
+    SPINLOCK    lock;
+    struct dcb  *dcb[2];        /*< The joined DCBs, NULL once closed */
+    bool        active[2];      /*< Whether dcb[i] has started splicing */
+    int         pipe[2][2];     /*< pipe[i] carries the data read from dcb[i] */
+    size_t      pending[2];     /*< Bytes in pipe[i] not yet written to the other DCB */
+    int         refcount;       /*< No. of DCBs referring to this */
+} DCB_SPLICE;
+
 /* DCB states */
 typedef enum
 {
@@ -161,6 +189,12 @@ typedef enum
     DCB_REASON_NOT_RESPONDING       /*< Server connection was lost */
 } DCB_REASON;
 
+/** The bit of a callback reason in the reasons of the callbacks of a DCB */
+#define DCB_REASON_BIT(reason) (1U << (reason))
+
+/** The maximum number of callbacks of a DCB */
+#define DCB_MAX_CALLBACKS 4
+
 /**
  * Callback structure - used to track callbacks registered on a DCB
  */
@@ -169,7 +203,6 @@ typedef struct dcb_callback
     DCB_REASON           reason;         /*< The reason for the callback */
     int                 (*cb)(struct dcb *dcb, DCB_REASON reason, void *userdata);
     void                 *userdata;      /*< User data to be sent in the callback */
-    struct dcb_callback  *next;          /*< Next callback for this DCB */
 } DCB_CALLBACK;
 
 /**
@@ -203,6 +236,11 @@ typedef struct dcb
     bool            dcb_is_zombie;  /**< Whether the DCB is in the zombie list */
     bool            draining_flag;  /**< Set while write queue is drained */
     bool            drain_called_while_busy; /**< Set as described */
+    bool            flush_pending;  /**< Set while the DCB is on a deferred flush list */
+    bool            flow_stopped;   /**< Set from above high water until below low water */
+    bool            stalled;        /**< Set while the reads wait for the session to drain */
+    struct dcb      *nextstalled;   /**< Next DCB waiting for the session to drain */
+    struct dcb      *nextflush;     /**< Next DCB on the deferred flush list */
     dcb_role_t      dcb_role;
     SPINLOCK        dcb_initlock;
     DCBEVENTQ       evq;            /**< The event queue for this DCB */
@@ -232,14 +270,23 @@ typedef struct dcb
 
     DCBSTATS        stats;          /**< DCB related statistics */
     unsigned int    dcb_server_status; /*< the server role indicator from SERVER */
-    struct dcb      *next;          /**< Next DCB in the chain of allocated DCB's */
+    struct dcb      *next;          /**< Next DCB in the registry shard of the DCB */
+    struct dcb      *prev;          /**< Previous DCB in the registry shard of the DCB */
+    int             registry;       /**< The registry shard the DCB is in */
     struct dcb      *nextpersistent;   /**< Next DCB in the persistent pool for SERVER */
+    unsigned int    persistentkey;     /**< Hash of the user and protocol of a pooled DCB */
     time_t          persistentstart;   /**< Time when DCB placed in persistent pool */
     struct service  *service;       /**< The related service */
     void            *data;          /**< Specific client data */
     DCBMM           memdata;        /**< The data related to DCB memory management */
-    SPINLOCK        cb_lock;        /**< The lock for the callbacks linked list */
-    DCB_CALLBACK    *callbacks;     /**< The list of callbacks for the DCB */
+    DCB_SPLICE      *splice;        /**< Set if the DCB is spliced to another DCB */
+    SPINLOCK        cb_lock;        /**< The lock for the callbacks */
+    DCB_CALLBACK    callbacks[DCB_MAX_CALLBACKS]; /**< The callbacks in the order they were added */
+    int             n_callbacks;    /**< No. of callbacks */
+    unsigned int    cb_reasons;     /**< DCB_REASON_BIT of the reasons that have callbacks */
+    struct dcb      *nextserver;    /**< Next DCB connected to the same server */
+    struct dcb      *prevserver;    /**< Previous DCB connected to the same server */
+    ILIST_NODE      connnode;       /**< The node in the connect queue of the server */
     SPINLOCK        pollinlock;
     int             pollinbusy;
     int             readcheck;
@@ -248,6 +295,7 @@ typedef struct dcb
     int             polloutbusy;
     int             writecheck;
     long            last_read;      /*< Last time the DCB received data */
+    int             read_size;      /*< Moving average of the sizes of the reads */
     int             high_water;     /**< High water mark */
     int             low_water;      /**< Low water mark */
     struct server   *server;        /**< The associated backend server */
@@ -256,6 +304,7 @@ typedef struct dcb
     bool            ssl_read_want_write;    /*< Flag */
     bool            ssl_write_want_read;    /*< Flag */
     bool            ssl_write_want_write;    /*< Flag */
+    bool            ssl_ktls_send;  /*< The kernel encrypts the data written to the socket */
     int             dcb_port;       /**< port of target server */
     skygw_chk_t     dcb_chk_tail;
 } DCB;
@@ -294,8 +343,8 @@ int           fail_accept_errno;
 
 #define DCB_POLL_BUSY(x)                ((x)->evq.next != NULL)
 
-DCB *dcb_get_zombies(void);
 int dcb_write(DCB *, GWBUF *);
+int dcb_write_file(DCB *, GWBUF *, int, off_t, size_t);
 DCB *dcb_accept(DCB *listener, GWPROTOCOL *protocol_funcs);
 DCB *dcb_alloc(dcb_role_t, struct servlistener *);
 void dcb_free(DCB *);
@@ -304,8 +353,14 @@ DCB *dcb_connect(struct server *, struct session *, const char *);
 DCB *dcb_clone(DCB *);
 int dcb_read(DCB *, GWBUF **, int);
 int dcb_drain_writeq(DCB *);
+void dcb_defer_writes();
+bool dcb_read_stalled(DCB *);
+void dcb_flush_writes();
+int dcb_splice(DCB *, DCB *);
+int dcb_splice_read(DCB *);
 void dcb_close(DCB *);
-DCB *dcb_process_zombies(int);              /* Process Zombies except the one behind the pointer */
+void dcb_connect_queued(void *);
+void dcb_handshake_done(DCB *);
 void printAllDCBs();                         /* Debug to print all DCB in the system */
 void printDCB(DCB *);                        /* Debug print routine */
 void dprintAllDCBs(DCB *);                   /* Debug to print all DCB in the system */
@@ -320,7 +375,7 @@ int dcb_add_callback(DCB *, DCB_REASON, int (*)(struct dcb *, DCB_REASON, void *
 int dcb_remove_callback(DCB *, DCB_REASON, int (*)(struct dcb *, DCB_REASON, void *), void *);
 int dcb_isvalid(DCB *);                     /* Check the DCB is in the linked list */
 int dcb_count_by_usage(DCB_USAGE);          /* Return counts of DCBs */
-int dcb_persistent_clean_count(DCB *, bool);      /* Clean persistent and return count */
+int dcb_persistent_clean_count(struct server *, struct server_pool *, bool); /* Clean persistent and return count */
 
 void dcb_call_foreach (struct server* server, DCB_REASON reason);
 void dcb_hangup_foreach (struct server* server);
@@ -338,6 +393,8 @@ void dcb_append_readqueue(DCB *dcb, GWBUF *buffer);
 #define DCBF_CLONE              0x0001  /*< DCB is a clone */
 #define DCBF_HUNG               0x0002  /*< Hangup has been dispatched */
 #define DCBF_REPLIED    0x0004  /*< DCB was written to */
+#define DCBF_CONNECT_QUEUED     0x0008  /*< The connect waits in the queue of the server */
+#define DCBF_HANDSHAKE          0x0010  /*< The handshake counts against max_handshakes */
 
 #define DCB_IS_CLONE(d) ((d)->flags & DCBF_CLONE)
 #define DCB_REPLIED(d) ((d)->flags & DCBF_REPLIED)
@@ -0,0 +1,50 @@
+#ifndef _EPOCH_H
+#define _EPOCH_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file epoch.h  - Epoch based memory reclamation
+ *
+ * An object that can still be referenced by the polling threads is retired
+ * instead of being freed. Each polling thread reports a quiescent state at the
+ * end of every polling loop, at which point it holds no references to objects
+ * retired before that. Once every polling thread has reported a quiescent state
+ * after the retirement the function given to epoch_retire is called and the
+ * object can be freed.
+ *
+ * The entries are embedded in the objects they are for, retiring and
+ * reclaiming an object needs no memory allocation. Any object collected by the
+ * polling threads, DCBs, sessions and router sessions, can use it.
+ */
+
+#include <stdbool.h>
+
+/**
+ * An entry in the list of retired objects
+ */
+typedef struct epoch_entry
+{
+    void (*fn)(void *data);      /*< The function called once the object is unreferenced */
+    void *data;                  /*< Data passed to the function */
+    unsigned long epoch;         /*< The epoch in which the object was retired */
+    struct epoch_entry *next;    /*< The next retired object */
+} EPOCH_ENTRY;
+
+extern void epoch_init(int n_threads);
+extern void epoch_retire(EPOCH_ENTRY *entry, void (*fn)(void *), void *data);
+extern int  epoch_quiescent(int thread_id);
+extern int  epoch_pending();
+extern bool epoch_reporting();
+
+#endif
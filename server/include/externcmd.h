@@ -14,6 +14,7 @@
  */
 
 #include <unistd.h>
+#include <time.h>
 #include <string.h>
 #include <errno.h>
 #include <skygw_utils.h>
@@ -22,18 +23,31 @@
 
 #define MAXSCALE_EXTCMD_ARG_MAX 256
 
+/** Maximum number of commands waiting to be executed asynchronously */
+#define EXTERNCMD_QUEUE_MAX 64
+
+/** Maximum number of asynchronous commands running at the same time */
+#define EXTERNCMD_RUNNING_MAX 4
+
+/** Seconds after which an asynchronous command is killed */
+#define EXTERNCMD_TIMEOUT 60
+
 typedef struct extern_cmd_t
 {
     char** argv; /*< Argument vector for the command, first being the actual command
                 * being executed. */
     int n_exec; /*< Number of times executed */
     pid_t child; /*< PID of the child process */
+    time_t started; /*< When the asynchronous command was started */
+    bool killed; /*< The command was killed after the timeout */
+    struct extern_cmd_t* next; /*< Next command in the queue */
 } EXTERNCMD;
 
 char* externcmd_extract_command(const char* argstr);
 EXTERNCMD* externcmd_allocate(char* argstr);
 void externcmd_free(EXTERNCMD* cmd);
 int externcmd_execute(EXTERNCMD* cmd);
+bool externcmd_execute_async(EXTERNCMD* cmd);
 bool externcmd_substitute_arg(EXTERNCMD* cmd, const char* re, const char* replace);
 bool externcmd_can_execute(const char* argstr);
 bool externcmd_matches(const EXTERNCMD* cmd, const char* match);
@@ -20,12 +20,16 @@
  *
  * Date         Who                     Description
  * 27/05/2014   Mark Riddoch            Initial implementation
+ * 15/10/2016   Core Team               Added the getStatements entry point
  *
  */
 #include <dcb.h>
 #include <session.h>
 #include <buffer.h>
 #include <stdint.h>
+#include <metrics.h>
+#include <resultset.h>
+#include <statistics.h>
 
 /**
  * The FILTER handle points to module specific data, so the best we can do
@@ -42,6 +46,18 @@ typedef struct
     char    *value;         /**< Value of the parameter */
 } FILTER_PARAMETER;
 
+/** The longest statement text in FILTER_STATEMENT_STATS */
+#define FILTER_STATEMENT_LEN 1024
+
+/**
+ * The execution statistics of a statement tracked by a filter
+ */
+typedef struct filter_statement_stats
+{
+    char                   sql[FILTER_STATEMENT_LEN + 1]; /**< The canonical statement, may be truncated */
+    ts_histogram_summary_t duration;                      /**< Execution times in microseconds */
+} FILTER_STATEMENT_STATS;
+
 /**
  * @verbatim
  * The "module object" structure for a query router module
@@ -60,6 +76,13 @@ typedef struct
  *      clientReply             Called for each reply packet
  *      diagnostics             Called to force the filter to print
  *                              diagnostic output
+ *      getInterest             Called to get the packets an instance is
+ *                              interested in, may be NULL if the
+ *                              instance wants to see all of them
+ *      getStatements           Optional, returns the number of statements
+ *                              the instance reports and the statistics
+ *                              of the statement with the given index if
+ *                              there is one
  *
  * @endverbatim
  *
@@ -76,14 +99,27 @@ typedef struct filter_object
     int    (*routeQuery)(FILTER *instance, void *fsession, GWBUF *queue);
     int    (*clientReply)(FILTER *instance, void *fsession, GWBUF *queue);
     void   (*diagnostics)(FILTER *instance, void *fsession, DCB *dcb);
+    uint64_t (*getInterest)(FILTER *instance);
+    int    (*getStatements)(FILTER *instance, int n, FILTER_STATEMENT_STATS *stats);
 } FILTER_OBJECT;
 
+/**
+ * The interest of a filter instance in the packets of a session. A filter is
+ * only called for the commands whose bits it has set, the other packets are
+ * passed on to the next component of the chain without calling the filter.
+ * A filter without FILTER_INTEREST_REPLIES is left out of the upstream chain.
+ */
+#define FILTER_INTEREST_COMMAND(cmd)    ((uint64_t)1 << (cmd))
+#define FILTER_INTEREST_COMMANDS        ((uint64_t)0xffffffff)
+#define FILTER_INTEREST_REPLIES         ((uint64_t)1 << 32)
+#define FILTER_INTEREST_ALL             (FILTER_INTEREST_COMMANDS | FILTER_INTEREST_REPLIES)
+
 /**
  * The filter API version. If the FILTER_OBJECT structure or the filter API
  * is changed these values must be updated in line with the rules in the
  * file modinfo.h.
  */
-#define FILTER_VERSION  {1, 1, 0}
+#define FILTER_VERSION  {1, 3, 0}
 /**
  * The definition of a filter from the configuration file.
  * This is basically the link between a plugin to load and the
@@ -98,6 +134,7 @@ typedef struct filter_def
     FILTER filter;                 /**< The runtime filter */
     FILTER_OBJECT *obj;            /**< The "MODULE_OBJECT" for the filter */
     SPINLOCK spin;                 /**< Spinlock to protect the filter definition */
+    int n_sessions;                /**< No. of sessions the filter has been applied to */
     struct filter_def *next;       /**< Next filter in the chain of all filters */
 } FILTER_DEF;
 
@@ -109,9 +146,12 @@ void filterAddOption(FILTER_DEF *, char *);
 void filterAddParameter(FILTER_DEF *, char *, char *);
 DOWNSTREAM *filterApply(FILTER_DEF *, SESSION *, DOWNSTREAM *);
 UPSTREAM *filterUpstream(FILTER_DEF *, void *, UPSTREAM *);
+uint64_t filterInterest(FILTER_DEF *);
 int filter_standard_parameter(char *);
 void dprintAllFilters(DCB *);
 void dprintFilter(DCB *, FILTER_DEF *);
 void dListFilters(DCB *);
+void filter_metrics(METRICS *);
+RESULTSET *filterGetStatementList();
 
 #endif
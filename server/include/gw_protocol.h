@@ -24,6 +24,8 @@
  * Date         Who                     Description
  * 22/01/16     Martin Brampton         Initial implementation
  * 31/05/16     Martin Brampton         Add API entry for connection limit
+ * 15/10/2016   Core Team               Add API entry for reusing pooled connections
+ * 15/10/2016   Core Team               Add API entry for deferred connects
  *
  * @endverbatim
  */
@@ -51,6 +53,12 @@ struct session;
  *      listen          Create a listener for the protocol
  *      auth            Authentication entry point
  *  session         Session handling entry point
+ *      auth_default    The default authenticator of the protocol
+ *      connlimit       Called when the connection limit is reached
+ *      reuse           Prepare a connection taken from the persistent
+ *                      pool for a new session, optional
+ *      defer           Prepare a connection whose connect waits for the
+ *                      connection rate limit of the server, optional
  * @endverbatim
  *
  * This forms the "module object" for protocol modules within the gateway.
@@ -72,6 +80,8 @@ typedef struct gw_protocol
     int (*session)(struct dcb *, void *);
     char *(*auth_default)();
     int (*connlimit)(struct dcb *, int limit);
+    int (*reuse)(struct dcb *);
+    int (*defer)(struct dcb *, struct server *, struct session *);
 } GWPROTOCOL;
 
 /**
@@ -79,7 +89,7 @@ typedef struct gw_protocol
  * the GWPROTOCOL structure is changed. See the rules defined in modinfo.h
  * that define how these numbers should change.
  */
-#define GWPROTOCOL_VERSION      {1, 1, 0}
+#define GWPROTOCOL_VERSION      {1, 3, 0}
 
 
 #endif /* GW_PROTOCOL_H */
@@ -23,11 +23,13 @@
  *
  * Date         Who                     Description
  * 27/01/16     Martin Brampton         Initial implementation
+ * 15/10/2016   Core Team               Session resumption and kernel TLS
  *
  * @endverbatim
  */
 
 #include <gw_protocol.h>
+#include <spinlock.h>
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -69,6 +71,10 @@ typedef struct ssl_listener
     char *ssl_key;                      /*< SSL private key */
     char *ssl_ca_cert;                  /*< SSL CA certificate */
     bool ssl_init_done;                 /*< If SSL has already been initialized for this service */
+    bool ssl_session_cache;             /*< Resume sessions with session IDs and tickets */
+    bool ssl_ktls;                      /*< Let the kernel encrypt the TLS records */
+    SSL_SESSION *ssl_session;           /*< The latest session of a backend connection */
+    SPINLOCK ssl_session_lock;          /*< Protects ssl_session */
 } SSL_LISTENER;
 
 int ssl_authenticate_client(struct dcb *dcb, bool is_capable);
@@ -23,23 +23,33 @@
  * Date         Who             Description
  * 28/06/13     Mark Riddoch    Initial implementation
  * 17/10/15     Martin Brampton Add bitmask_render_readable
+ * 15/10/2016   Core Team       Lock-free bit operations on words
  *
  * @endverbatim
  */
 
-/* Both these numbers MUST be exact multiples of 8 */
+/* Both these numbers MUST be exact multiples of the bits in a word and the
+ * initial length an exact multiple of the increment */
 #define BIT_LENGTH_INITIAL      256      /**< Initial number of bits in the bitmask */
 #define BIT_LENGTH_INC          256      /**< Number of bits to add on each increment */
+#define BIT_MAX_BLOCKS          64       /**< The most increments, the bits beyond are ignored */
+
+#define BITMASK_WORD_BITS       (8 * sizeof(unsigned long))
+#define BITMASK_BLOCK_WORDS     (BIT_LENGTH_INC / BITMASK_WORD_BITS)
 
 /**
- * The bitmask structure used to store an arbitrary large bitmask
+ * The bitmask structure used to store an arbitrary large bitmask.
+ *
+ * The bits are kept in blocks of BIT_LENGTH_INC bits that are never moved
+ * once allocated, so that the bits can be set, cleared and tested with atomic
+ * operations on the words without taking the lock.
  */
 typedef struct
 {
-    SPINLOCK lock;          /**< Lock to protect the bitmask */
-    unsigned char *bits;    /**< Pointer to the bits themselves */
-    int length;          /**< The number of bits in the bitmask */
-    int size;            /**< The number of bytes in the bitmask */
+    SPINLOCK lock;                          /**< Lock to protect the growth of the bitmask */
+    unsigned long *blocks[BIT_MAX_BLOCKS];  /**< The blocks of bits */
+    int length;                             /**< The number of bits in the bitmask */
+    int size;                               /**< The number of bytes in the bitmask */
 
 } GWBITMASK;
 
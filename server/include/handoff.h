@@ -0,0 +1,44 @@
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file handoff.h  - Handing the listening sockets over to a new process
+ *
+ * A running MaxScale listens on a Unix domain socket for a new MaxScale
+ * process that is started with the --handoff option. The new process receives
+ * the listening sockets of the old one and starts its listeners with them, so
+ * that no connection attempt is refused during a restart. Once the new process
+ * has started its services, the old one stops accepting connections and shuts
+ * down when its last client session has closed.
+ */
+
+#include <stdbool.h>
+
+/** Name of the handoff socket in the PID file directory */
+#define HANDOFF_SOCKET_NAME "maxscale.handoff"
+
+/** Seconds the old process waits for its client sessions to close */
+#define HANDOFF_DRAIN_TIMEOUT 600
+
+/** Attempts, half a second apart, to take the PID file back from a failed new process */
+#define HANDOFF_ACQUIRE_RETRIES 10
+
+extern bool handoff_receive(const char *path);
+extern int handoff_take_listener(const char *bind);
+extern void handoff_complete(bool success);
+extern bool handoff_start(const char *path, void (*release)(void), bool (*acquire)(void),
+                          void (*shutdown)(void));
+
+#endif
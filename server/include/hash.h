@@ -0,0 +1,63 @@
+#ifndef _HASH_H
+#define _HASH_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file hash.h  - Seeded hashing of keys
+ *
+ * The hash reads the key eight bytes at a time and mixes the words with
+ * 64x64 -> 128 bit multiplications, in three independent lanes for keys
+ * longer than 48 bytes. The hash tables of the process are keyed with
+ * hash_seed(), a random seed chosen once per process, so that the buckets
+ * of a key cannot be predicted by the clients that choose the keys. The
+ * values are only meaningful within one process and must not be stored.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 15/10/2016   Core Team       Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+extern uint64_t hash_bytes(const void *data, size_t len, uint64_t seed);
+extern uint64_t hash_seed(void);
+
+/**
+ * Hash a null-terminated string
+ *
+ * @param str   The string
+ * @param seed  The seed, usually hash_seed()
+ * @return The hash of the string
+ */
+static inline uint64_t
+hash_str(const char *str, uint64_t seed)
+{
+    return hash_bytes(str, strlen(str), seed);
+}
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
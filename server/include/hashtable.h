@@ -33,18 +33,8 @@
 #include <atomic.h>
 #include <dcb.h>
 
-/**
- * The entries within a hashtable.
- *
- * A NULL value for key indicates an empty entry.
- * The next pointer is the overflow chain for this hashentry.
- */
-typedef struct hashentry
-{
-    void *key;              /**< The value of the key or NULL if empty entry */
-    void *value;            /**< The value associated with key */
-    struct hashentry *next; /**< The overflow chain */
-} HASHENTRIES;
+/** The number of write locks of a hashtable */
+#define HASHTABLE_STRIPES 16
 
 /**
  * HASHTABLE iterator - used to walk the hashtable in a thread safe
@@ -53,8 +43,7 @@ typedef struct hashentry
 typedef struct hashiterator
 {
     struct hashtable *table; /**< The hashtable the iterator refers to */
-    int chain;               /**< The current chain we are walking */
-    int depth;               /**< The current depth down the chain */
+    int slot;                /**< The next slot to look at */
 } HASHITERATOR;
 
 /**
@@ -70,17 +59,21 @@ typedef struct hashtable
 #if defined(SS_DEBUG)
     skygw_chk_t ht_chk_top;
 #endif
-    int hashsize;                 /**< The number of HASHENTRIES */
-    HASHENTRIES **entries;        /**< The entries themselves */
+    int hashsize;                 /**< The size the table was created with */
+    struct hashslots *slots;      /**< The slots of the table */
+    struct hashslots *resizing;   /**< The slots being moved to slots */
+    int migrate_next;             /**< The next slot of resizing to move */
+    int migrated;                 /**< No. of slots of resizing moved */
+    volatile int resize_seq;      /**< Odd while the slot arrays are swapped */
+    volatile int lockfree_reads;  /**< Set once a key has been looked up without locks */
     int (*hashfn)(void *);        /**< The hash function */
     int (*cmpfn)(void *, void *); /**< The key comparison function */
     HASHMEMORYFN kcopyfn;         /**< Optional key copy function */
     HASHMEMORYFN vcopyfn;         /**< Optional value copy function */
     HASHMEMORYFN kfreefn;         /**< Optional key free function */
     HASHMEMORYFN vfreefn;         /**< Optional value free function */
-    SPINLOCK spin;                /**< Internal spinlock for the hashtable */
-    int n_readers;                /**< Number of clients reading the table */
-    int writelock;                /**< The table is locked by a writer */
+    SPINLOCK spin;                /**< Protects the resizing of the table */
+    SPINLOCK stripes[HASHTABLE_STRIPES]; /**< Write locks, selected by the hash */
     bool ht_isflat;               /**< Indicates whether hashtable is in stack or heap */
     int n_elements;               /**< Number of added elements */
 #if defined(SS_DEBUG)
@@ -21,10 +21,13 @@
  *
  * Date         Who             Description
  * 10/07/14     Mark Riddoch    Initial implementation
+ * 15/10/2016   Core Team       Interned names of the servers and parameters
  *
  * @endverbatim
  */
 
+#include <stdbool.h>
+#include <strings.h>
 #include <skygw_debug.h>
 
 
@@ -54,6 +57,7 @@ typedef struct hint
     void            *data;  /*< Type specific data */
     void            *value; /*< Parameter value for hint */
     unsigned int    dsize;  /*< Size of the hint data */
+    int             id;     /*< The ID of the server or parameter name, 0 if none */
     struct hint     *next;  /*< Another hint for this buffer */
 } HINT;
 
@@ -63,4 +67,21 @@ extern  HINT    *hint_create_route(HINT *, HINT_TYPE, char *);
 extern  void    hint_free(HINT *);
 extern  HINT    *hint_dup(HINT *);
 bool            hint_exists(HINT **, HINT_TYPE);
+extern  int     hint_name_id(const char *);
+
+/**
+ * Check whether the server or parameter name of a hint is the name with an ID.
+ * The IDs are compared unless one of them is missing because the table of the
+ * names was full.
+ *
+ * @param hint  The hint
+ * @param id    The ID of the name from hint_name_id
+ * @param name  The name
+ * @return True if the name of the hint is the name, ignoring case
+ */
+static inline bool
+hint_name_is(HINT *hint, int id, const char *name)
+{
+    return hint->id && id ? hint->id == id : strcasecmp((char *)hint->data, name) == 0;
+}
 #endif
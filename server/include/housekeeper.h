@@ -15,6 +15,7 @@
 #include <time.h>
 #include <dcb.h>
 #include <hk_heartbeat.h>
+#include <timer.h>
 /**
  * @file housekeeper.h A mechanism to have task run periodically
  *
@@ -44,6 +45,7 @@ typedef struct hktask
     int frequency;            /*< How often to call the tasks (seconds) */
     time_t nextdue;           /*< When the task should be next run */
     HKTASK_TYPE type;         /*< The task type */
+    TIMER timer;              /*< The timer that runs the task */
     struct hktask *next;      /*< Next task in the list */
 } HKTASK;
 
@@ -0,0 +1,204 @@
+#ifndef _ILIST_H
+#define _ILIST_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file ilist.h  - Intrusive lists
+ *
+ * The node of a list is embedded in the object that is listed, so adding an
+ * object allocates nothing and ILIST_ENTRY gets back from the node to the
+ * object.
+ *
+ * ILIST is a FIFO queue that the caller protects as needed. ISTACK is a LIFO
+ * stack that any thread can push to without a lock while one thread at a time
+ * pops or removes nodes. With a single consumer a node cannot be popped and
+ * pushed again while another pop is in progress, so the stack is free of the
+ * ABA problem without tagged pointers.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 15/10/2016   Core Team       Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * The node embedded in a listed object
+ */
+typedef struct ilist_node
+{
+    struct ilist_node *next;    /*< The next node */
+} ILIST_NODE;
+
+/** The object of type that embeds node as member */
+#define ILIST_ENTRY(node, type, member) ((type *)((char *)(node) - offsetof(type, member)))
+
+/**
+ * A FIFO queue of nodes
+ */
+typedef struct
+{
+    ILIST_NODE *head;           /*< The oldest node */
+    ILIST_NODE *tail;           /*< The newest node */
+} ILIST;
+
+#define ILIST_INIT {NULL, NULL}
+
+/**
+ * A LIFO stack of nodes with lock-free pushes
+ */
+typedef struct
+{
+    ILIST_NODE * volatile head; /*< The newest node */
+} ISTACK;
+
+#define ISTACK_INIT {NULL}
+
+static inline void
+ilist_init(ILIST *list)
+{
+    list->head = list->tail = NULL;
+}
+
+static inline bool
+ilist_empty(ILIST *list)
+{
+    return list->head == NULL;
+}
+
+/**
+ * Append a node to a queue
+ *
+ * @param list  The queue
+ * @param node  The node
+ */
+static inline void
+ilist_push(ILIST *list, ILIST_NODE *node)
+{
+    node->next = NULL;
+    if (list->tail)
+    {
+        list->tail->next = node;
+    }
+    else
+    {
+        list->head = node;
+    }
+    list->tail = node;
+}
+
+/**
+ * Remove the oldest node of a queue
+ *
+ * @param list  The queue
+ * @return The node or NULL if the queue is empty
+ */
+static inline ILIST_NODE *
+ilist_pop(ILIST *list)
+{
+    ILIST_NODE *node = list->head;
+
+    if (node && (list->head = node->next) == NULL)
+    {
+        list->tail = NULL;
+    }
+    return node;
+}
+
+/**
+ * Push a node to a stack, from any thread
+ *
+ * @param stack The stack
+ * @param node  The node
+ */
+static inline void
+istack_push(ISTACK *stack, ILIST_NODE *node)
+{
+    ILIST_NODE *head;
+
+    do
+    {
+        head = stack->head;
+        node->next = head;
+    }
+    while (!__sync_bool_compare_and_swap(&stack->head, head, node));
+}
+
+/**
+ * Pop the newest node of a stack, from the consumer thread
+ *
+ * @param stack The stack
+ * @return The node or NULL if the stack is empty
+ */
+static inline ILIST_NODE *
+istack_pop(ISTACK *stack)
+{
+    ILIST_NODE *head;
+
+    do
+    {
+        if ((head = stack->head) == NULL)
+        {
+            return NULL;
+        }
+    }
+    while (!__sync_bool_compare_and_swap(&stack->head, head, head->next));
+    return head;
+}
+
+/**
+ * Take all the nodes of a stack, from any thread
+ *
+ * @param stack The stack
+ * @return The nodes, the newest first, or NULL if the stack was empty
+ */
+static inline ILIST_NODE *
+istack_pop_all(ISTACK *stack)
+{
+    return (ILIST_NODE *)__sync_lock_test_and_set(&stack->head, NULL);
+}
+
+/**
+ * Remove a node from a stack, from the consumer thread. The nodes below the
+ * head are only linked and unlinked by the consumer, so only the removal of
+ * the head competes with the pushes.
+ *
+ * @param stack The stack
+ * @param prev  The node above the node when the consumer walked the stack,
+ *              NULL if it was the head
+ * @param node  The node to remove
+ */
+static inline void
+istack_remove(ISTACK *stack, ILIST_NODE *prev, ILIST_NODE *node)
+{
+    if (prev == NULL)
+    {
+        if (__sync_bool_compare_and_swap(&stack->head, node, node->next))
+        {
+            return;
+        }
+        /** Nodes were pushed above it */
+        for (prev = stack->head; prev->next != node; prev = prev->next)
+        {
+        }
+    }
+    prev->next = node->next;
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef _LATENCY_H
+#define _LATENCY_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file latency.h  - Query latency histograms
+ *
+ * The latency of a query is the time from the client protocol routing it to
+ * the session until the last packet of its reply is written to the client.
+ * Every service and server keeps a histogram of the latencies of the queries
+ * routed as reads and another of those routed as writes, in microseconds.
+ */
+
+#include <stdint.h>
+#include <statistics.h>
+
+struct dcb;
+struct metrics;
+
+/** The classes of queries whose latencies are kept apart */
+typedef enum
+{
+    LATENCY_READ,
+    LATENCY_WRITE,
+    LATENCY_N_KINDS
+} latency_kind_t;
+
+/**
+ * The latency histograms of a service or a server
+ */
+typedef struct
+{
+    ts_histogram_t histograms[LATENCY_N_KINDS]; /*< Allocated by the first query of the kind */
+} LATENCY;
+
+extern uint64_t latency_now();
+extern const char *latency_kind_name(latency_kind_t kind);
+extern void latency_add(LATENCY *latency, latency_kind_t kind, uint64_t usecs);
+extern void latency_get(LATENCY *latency, latency_kind_t kind, ts_histogram_summary_t *summary);
+extern void latency_free(LATENCY *latency);
+extern void latency_print(struct dcb *dcb, LATENCY *latency);
+extern void latency_metrics(struct metrics *metrics, const char *name, const char *labels,
+                            LATENCY *latency);
+
+#endif
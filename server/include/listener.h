@@ -23,12 +23,18 @@
  *
  * Date         Who                     Description
  * 19/01/16     Martin Brampton         Initial implementation
+ * 15/10/2016   Core Team               Added the authentication cache
+ * 15/10/2016   Core Team               Added the loaded authenticator
+ * 15/10/2016   Core Team               Added the polling thread group
+ * 15/10/2016   Core Team               Added the queue of connections over the limit
  *
  * @endverbatim
  */
 
 #include <gw_protocol.h>
+#include <gw_authenticator.h>
 #include <gw_ssl.h>
+#include <queuemanager.h>
 
 struct dcb;
 
@@ -44,8 +50,16 @@ typedef struct servlistener
     unsigned short port;        /**< Port to listen on */
     char *address;              /**< Address to listen with */
     char *authenticator;        /**< Name of authenticator */
+    GWAUTHENTICATOR *authfuncs; /**< The authenticator, loaded for the first client */
     SSL_LISTENER *ssl;          /**< Structure of SSL data or NULL */
     struct dcb *listener;       /**< The DCB for the listener */
+    bool exclusive_accept;      /**< Wake up only one polling thread per new connection */
+    int busy_poll;              /**< SO_BUSY_POLL of the client sockets in microseconds, 0 if not set */
+    int thread_group;           /**< The polling thread group, -1 for the group of the service */
+    void *auth_cache;           /**< Cache of recent logins, owned by the authenticator */
+    int auth_cache_hits;        /**< Logins resolved from the authentication cache */
+    int auth_cache_misses;      /**< Logins that looked the user up from the users table */
+    QUEUE_CONFIG *queued_connections; /**< Connections accepted over the limit of the service, if set */
     struct  servlistener *next; /**< Next service protocol */
 } SERV_LISTENER;
 
@@ -93,6 +93,10 @@ int  mxs_log_set_priority_enabled(int priority, bool enabled);
 void mxs_log_set_syslog_enabled(bool enabled);
 void mxs_log_set_maxlog_enabled(bool enabled);
 void mxs_log_set_highprecision_enabled(bool enabled);
+void mxs_log_set_deferred_enabled(bool enabled);
+void mxs_log_set_throttling(size_t count, size_t window);
+void mxs_log_set_rotate_size(size_t size);
+void mxs_log_set_compress_enabled(bool enabled);
 void mxs_log_set_augmentation(int bits);
 
 int mxs_log_message(int priority,
@@ -37,6 +37,9 @@
 #define _SYSNAME_STR_LENGTH     256     /**< sysname len */
 #define _RELEASE_STR_LENGTH     256     /**< release len */
 #define DEFAULT_NTHREADS        1 /**< Default number of polling threads */
+#define DEFAULT_QC_SHADOW_SAMPLE  1 /**< Default percentage of statements given to the shadow */
+#define DEFAULT_QC_SHADOW_THREADS 1 /**< Default number of shadow query classifier threads */
+#define MAX_THREAD_GROUPS       8 /**< Maximum number of named polling thread groups */
 /**
  * Maximum length for configuration parameter value.
  */
@@ -102,6 +105,17 @@ typedef struct config_context
     struct config_context *next;       /**< Next pointer in the linked list */
 } CONFIG_CONTEXT;
 
+/**
+ * A named group of polling threads that only serves the services and
+ * listeners assigned to it
+ */
+typedef struct
+{
+    char *name;         /**< The name of the group */
+    int  n_threads;     /**< Number of polling threads in the group */
+    char *cpus;         /**< The CPUs the threads of the group are bound to, NULL if not bound */
+} THREAD_GROUP_CONF;
+
 /**
  * The gateway global configuration data
  */
@@ -115,6 +129,16 @@ typedef struct
     unsigned long id;                                  /**< MaxScale ID */
     unsigned int  n_nbpoll;                            /**< Tune number of non-blocking polls */
     unsigned int  pollsleep;                           /**< Wait time in blocking polls */
+    int           poll_affinity;                       /**< Bind DCBs to the polling thread that created them */
+    int           poll_steal;                          /**< Let idle threads process DCBs of busy threads */
+    int           poll_adaptive;                       /**< Adapt the spins and sleeps of the polls to the load */
+    char          *threads_affinity;                   /**< The CPUs the polling threads are bound to */
+    char          *numa_nodes;                         /**< The NUMA nodes the polling threads are spread over */
+    char          *aux_affinity;                       /**< The CPUs the other threads are bound to */
+    THREAD_GROUP_CONF thread_groups[MAX_THREAD_GROUPS]; /**< The named polling thread groups */
+    int           n_thread_groups;                     /**< Number of named polling thread groups */
+    unsigned int  writeq_high_water;                   /**< Write queue size that stops the peer reads */
+    unsigned int  writeq_low_water;                    /**< Write queue size that resumes the peer reads */
     int           syslog;                              /**< Log to syslog */
     int           maxlog;                              /**< Log to MaxScale's own logs */
     int           log_to_shm;                          /**< Write log-file to shared memory */
@@ -123,6 +147,11 @@ typedef struct
     unsigned int  auth_write_timeout;                  /**< Write timeout for the user authentication */
     char          qc_name[PATH_MAX];                   /**< The name of the query classifier to load */
     char*         qc_args;                             /**< Arguments for the query classifier */
+    char          qc_shadow_name[PATH_MAX];            /**< The name of the shadow query classifier */
+    char*         qc_shadow_args;                      /**< Arguments for the shadow query classifier */
+    int           qc_shadow_sample;                    /**< Percentage of statements given to the shadow */
+    int           qc_shadow_threads;                   /**< Threads of the shadow query classifier */
+    int           query_trace_sample;                  /**< One in this many queries is traced, 0 for none */
 } GATEWAY_CONF;
 
 
@@ -148,6 +177,17 @@ bool                config_get_valtarget(target_t*           val,
                                          config_param_type_t ptype);
 bool                config_load(char *);
 unsigned int        config_nbpolls();
+bool                config_poll_affinity();
+bool                config_poll_work_stealing();
+bool                config_poll_adaptive();
+const char*         config_threads_affinity();
+const char*         config_numa_nodes();
+const char*         config_auxiliary_threads_affinity();
+int                 config_thread_group_count();
+const THREAD_GROUP_CONF* config_thread_group(int group);
+int                 config_thread_group_find(const char *name);
+unsigned int        config_writeq_high_water();
+unsigned int        config_writeq_low_water();
 double              config_percentage_value(char *str);
 unsigned int        config_pollsleep();
 int                 config_reload();
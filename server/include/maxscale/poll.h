@@ -16,6 +16,8 @@
 #include <gwbitmask.h>
 #include <resultset.h>
 #include <sys/epoll.h>
+#include <timer.h>
+#include <metrics.h>
 
 /**
  * @file poll.h     The poll related functionality
@@ -63,8 +65,18 @@ extern  void            dShowEventQ(DCB *dcb);
 extern  void            dShowEventStats(DCB *dcb);
 extern  int             poll_get_stat(POLL_STAT stat);
 extern  RESULTSET       *eventTimesGetList();
+extern  RESULTSET       *eventLatencyGetList();
+extern  RESULTSET       *pollThreadsGetList();
+extern  void            poll_metrics(METRICS *metrics);
 extern  void            poll_fake_event(DCB *dcb, enum EPOLL_EVENTS ev);
 extern  void            poll_fake_hangup_event(DCB *dcb);
 extern  void            poll_fake_write_event(DCB *dcb);
 extern  void            poll_fake_read_event(DCB *dcb);
+extern  bool            poll_dcb_same_owner(DCB *dcb, DCB *other);
+extern  int             poll_dcb_thread(DCB *dcb);
+extern  void            poll_dcb_set_owner(DCB *dcb);
+extern  int             poll_current_thread();
+extern  void            poll_thread_io(int bytes_in, int bytes_out);
+extern  double          poll_cycles_per_usec();
+extern  TIMER_WHEEL     *poll_timer_wheel(DCB *dcb);
 #endif
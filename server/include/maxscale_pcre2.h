@@ -19,6 +19,8 @@
 #endif
 
 #include <pcre2.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 /**
  * @file maxscale_pcre2.h - Utility functions for regular expression matching
@@ -29,6 +31,7 @@
  *
  * Date       Who           Description
  * 30-10-2015 Markus Makela Initial implementation
+ * 15-10-2016 Core Team     JIT compiled patterns with per-thread matching data
  * @endverbatim
  */
 
@@ -39,6 +42,29 @@ typedef enum
     MXS_PCRE2_ERROR
 } mxs_pcre2_result_t;
 
+/**
+ * A compiled pattern that can be matched concurrently by several threads.
+ * The matching data and the JIT stack are taken from the calling thread.
+ */
+typedef struct mxs_pcre2_pattern
+{
+    pcre2_code *code;     /**< The compiled pattern */
+    bool jit;             /**< Whether the pattern was JIT compiled */
+    char *literal;        /**< Text that every match contains, NULL if not known */
+    size_t literal_len;   /**< Length of the literal */
+    bool caseless;        /**< Whether the literal is searched ignoring case */
+} MXS_PCRE2_PATTERN;
+
+MXS_PCRE2_PATTERN* mxs_pcre2_pattern_compile(const char *pattern, uint32_t options,
+                                             int *error, size_t *erroffset);
+void mxs_pcre2_pattern_free(MXS_PCRE2_PATTERN *pattern);
+mxs_pcre2_result_t mxs_pcre2_pattern_match(MXS_PCRE2_PATTERN *pattern, const char *subject,
+                                           size_t length);
+pcre2_match_data* mxs_pcre2_thread_match_data(const pcre2_code *code);
+pcre2_match_context* mxs_pcre2_thread_match_context();
+char* mxs_pcre2_required_literal(const char *pattern, size_t *length);
+bool mxs_pcre2_contains(const char *subject, size_t length, const char *literal,
+                        size_t literal_len, bool caseless);
 mxs_pcre2_result_t mxs_pcre2_substitute(pcre2_code *re, const char *subject,
                                         const char *replace, char** dest, size_t* size);
 mxs_pcre2_result_t mxs_pcre2_simple_match(const char* pattern, const char* subject,
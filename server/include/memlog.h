@@ -21,23 +21,47 @@
  *
  * Date         Who             Description
  * 26/09/14     Mark Riddoch    Initial implementation
+ * 15/10/2016   Core Team       A ring for each thread
  *
  * @endverbatim
  */
+#include <stdint.h>
 #include <spinlock.h>
 
+/** The threads that get a ring of their own, the others share one */
+#define MEMLOG_MAX_THREADS      128
+
 typedef enum { ML_INT, ML_LONG, ML_LONGLONG, ML_STRING } MEMLOGTYPE;
 
+/**
+ * A logged item
+ */
+typedef struct
+{
+    unsigned long long  timestamp;  /*< When the item was logged, in nanoseconds */
+    intptr_t            value;      /*< The item */
+} MEMLOG_ENTRY;
+
+/**
+ * The items logged by a thread. Only the thread moves the head and only the
+ * flush moves the flushed count, both count the items ever logged.
+ */
+typedef struct
+{
+    volatile unsigned long  head;       /*< Items logged */
+    volatile unsigned long  flushed;    /*< Items written to the file */
+    MEMLOG_ENTRY            entries[];  /*< The items, size of them */
+} MEMLOG_RING;
+
 typedef struct memlog
 {
     char            *name;
-    SPINLOCK        lock;
-    void            *values;
-    int             offset;
+    SPINLOCK        lock;           /*< Serialises the flushes */
+    SPINLOCK        shared_lock;    /*< Serialises the threads that share a ring */
     int             size;
     MEMLOGTYPE      type;
     unsigned int    flags;
-    unsigned int    iflags;
+    MEMLOG_RING     *rings[MEMLOG_MAX_THREADS + 1];
     struct memlog   *next;
 } MEMLOG;
 
@@ -46,11 +70,6 @@ typedef struct memlog
  */
 #define MLNOAUTOFLUSH           0x0001
 
-/*
- * MEMLOG internal flags
- */
-#define MLWRAPPED               0x0001
-
 
 extern MEMLOG *memlog_create(char *, MEMLOGTYPE, int);
 extern void    memlog_destroy(MEMLOG *);
@@ -0,0 +1,73 @@
+#ifndef _MEMSTATS_H
+#define _MEMSTATS_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file memstats.h  - Memory accounting by subsystem
+ *
+ * The memory in use is counted for each subsystem of the core and for the
+ * modules that tag their allocations. An allocation made with memstats_malloc
+ * and the related functions is counted to the tag it was made with and must be
+ * freed with memstats_free and the same tag. The blocks of the buffer pools
+ * are counted with memstats_add when they are taken and returned.
+ *
+ * Every thread counts to its own counters, which are summed when the
+ * statistics are read. The housekeeper samples the sums every second to keep
+ * the high-water marks.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <resultset.h>
+
+struct dcb;
+
+/** The maximum number of tags, the core ones included */
+#define MEMSTATS_MAX_TAGS 64
+
+/** The tags of the core, the modules get theirs with memstats_tag */
+typedef enum
+{
+    MEMSTATS_BUFFERS,       /*< The GWBUF headers and data */
+    MEMSTATS_DCBS,          /*< The DCBs */
+    MEMSTATS_SESSIONS,      /*< The sessions */
+    MEMSTATS_CLASSIFIER,    /*< The query classifier */
+    MEMSTATS_OTHER,         /*< Tags that did not fit in MEMSTATS_MAX_TAGS */
+    MEMSTATS_N_CORE_TAGS
+} memstats_core_tag_t;
+
+/**
+ * The memory statistics of a tag
+ */
+typedef struct
+{
+    const char *name;       /*< The name of the tag */
+    int64_t    bytes;       /*< Bytes in use */
+    int64_t    blocks;      /*< Allocations in use */
+    int64_t    high_water;  /*< The most bytes in use when sampled */
+} MEMSTATS;
+
+extern void memstats_init();
+extern int memstats_tag(const char *name);
+extern void memstats_add(int tag, int64_t bytes, int blocks);
+extern void *memstats_malloc(int tag, size_t size);
+extern void *memstats_calloc(int tag, size_t nmemb, size_t size);
+extern void *memstats_realloc(int tag, void *ptr, size_t size);
+extern char *memstats_strdup(int tag, const char *str);
+extern void memstats_free(int tag, void *ptr);
+extern int memstats_get(MEMSTATS *stats, int n);
+extern void dShowMemory(struct dcb *dcb);
+extern RESULTSET *memstatsGetList();
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file metrics.h  - Statistics in the Prometheus text exposition format
+ *
+ * The metrics are written straight from the statistics of the services,
+ * servers, filters and polling threads into buffers that are sent to the
+ * client as they fill up, so a scrape builds no result sets.
+ */
+
+#include <dcb.h>
+#include <statistics.h>
+
+/** The URL of the metrics */
+#define METRICS_URL "/metrics"
+
+/** The content type of the metrics */
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+/**
+ * The output of the metrics
+ */
+typedef struct metrics
+{
+    DCB   *dcb;   /*< The client */
+    GWBUF *buf;   /*< The buffer being filled */
+} METRICS;
+
+extern void metrics_stream(DCB *dcb);
+extern void metrics_printf(METRICS *metrics, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+extern void metrics_header(METRICS *metrics, const char *name, const char *type,
+                           const char *help);
+extern const char *metrics_label(const char *value, char *buf, int len);
+extern void metrics_summary(METRICS *metrics, const char *name, const char *labels,
+                            ts_histogram_t histogram, int thread);
+
+#endif
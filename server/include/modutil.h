@@ -23,6 +23,7 @@
  * 04/06/14     Mark Riddoch            Initial implementation
  * 24/06/14     Mark Riddoch            Add modutil_MySQL_Query to enable multipacket queries
  * 24/10/14     Massimiliano Pinto      Add modutil_send_mysql_err_packet to send a mysql ERR_Packet
+ * 15/10/2016   Core Team               Add the packet scan of replies
  *
  * @endverbatim
  */
@@ -37,7 +38,39 @@
 #define PTR_IS_ERR(b) (b[4] == 0xff)
 #define PTR_IS_LOCAL_INFILE(b) (b[4] == 0xfb)
 #define IS_FULL_RESPONSE(buf) (modutil_count_signal_packets(buf,0,0) == 2)
-#define PTR_EOF_MORE_RESULTS(b) ((PTR_IS_EOF(b) && ptr[7] & 0x08))
+#define PTR_EOF_MORE_RESULTS(b) ((PTR_IS_EOF(b) && b[7] & 0x08))
+
+/**
+ * The bytes at the start of a packet that a packet scan passes to its callback.
+ * This covers the header and the payload of an OK packet up to the warnings
+ * with the longest length-encoded affected rows and insert ID.
+ */
+#define MODUTIL_SCAN_HEADER_LEN (4 + 1 + 9 + 9 + 2 + 2)
+
+/**
+ * Called by a packet scan for a packet of a reply
+ *
+ * @param data      The data given to the scan
+ * @param header    The first MODUTIL_SCAN_HEADER_LEN bytes of the packet, the
+ *                  bytes past the end of a shorter packet are zero
+ * @param pktlen    The length of the packet with the header
+ * @return False to stop the scan after this packet
+ */
+typedef bool (*modutil_scan_fn)(void *data, uint8_t *header, size_t pktlen);
+
+/**
+ * The state of a scan of the packets of a reply. A reply can be scanned as it
+ * arrives, a buffer at a time, since the scan continues where the previous
+ * buffer ended even in the middle of a packet.
+ */
+typedef struct modutil_packet_scan
+{
+    uint8_t         header[MODUTIL_SCAN_HEADER_LEN]; /*< The start of a packet that spans buffers */
+    size_t          header_len;     /*< Bytes gathered into header */
+    size_t          skip;           /*< Bytes of the current packet left to skip */
+    uint64_t        n_packets;      /*< Number of packets whose start has been scanned */
+    bool            all_packets;    /*< Call the callback for rows and column definitions too */
+} MODUTIL_PACKET_SCAN;
 
 
 extern int      modutil_is_SQL(GWBUF *);
@@ -61,6 +94,8 @@ GWBUF*          modutil_create_mysql_err_msg(int             packet_number,
                                              const char      *statemsg,
                                              const char      *msg);
 int modutil_count_signal_packets(GWBUF*, int, int, int*);
+void modutil_scan_init(MODUTIL_PACKET_SCAN *scan);
+size_t modutil_scan_packets(MODUTIL_PACKET_SCAN *scan, GWBUF *buf, modutil_scan_fn fn, void *data);
 mxs_pcre2_result_t modutil_mysql_wildcard_match(const char* pattern, const char* string);
 
 /** Character and token searching functions */
@@ -150,6 +150,13 @@ typedef struct monitor_def_s
 
 extern const monitor_def_t monitor_event_definitions[];
 
+/**
+ * The query that reads the global system variables cached for the servers,
+ * the columns are in the order of server_var_t
+ */
+#define MON_SERVER_VARIABLES_QUERY "SELECT @@global.version_comment, @@global.tx_isolation, " \
+    "@@global.auto_increment_increment, @@global.max_allowed_packet, @@global.sql_mode"
+
 /**
  * The linked list of servers that are being monitored by the monitor module.
  */
@@ -219,6 +226,8 @@ bool mon_print_fail_status(MONITOR_SERVERS* mon_srv);
 void monitor_launch_script(MONITOR* mon, MONITOR_SERVERS* ptr, char* script);
 int mon_parse_event_string(bool* events, size_t count, char* string);
 connect_result_t mon_connect_to_db(MONITOR* mon, MONITOR_SERVERS *database);
+bool mon_query_multi(MONITOR_SERVERS *database, const char *query, MYSQL_RES **results, int n);
+void mon_store_server_variables(MONITOR_SERVERS *database, MYSQL_RES *result);
 void mon_log_connect_error(MONITOR_SERVERS* database, connect_result_t rval);
 void mon_log_state_change(MONITOR_SERVERS *ptr);
 
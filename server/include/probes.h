@@ -0,0 +1,60 @@
+#ifndef _PROBES_H
+#define _PROBES_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file probes.h  - Static probe points for tracing tools
+ *
+ * The probes are USDT probes of the provider maxscale, which tools like perf
+ * and bpftrace can attach to, e.g. usdt:/usr/bin/maxscale:maxscale:poll__dispatch__start.
+ * A probe that no tool is attached to is a single no-op instruction. When the
+ * build does not find sys/sdt.h, or WITH_PROBES is disabled, the probes are
+ * left out altogether.
+ *
+ * The probes and their arguments are:
+ *
+ * poll__dispatch__start      thread ID, DCB, epoll events
+ * poll__dispatch__end        thread ID, DCB, whether the events were processed
+ * dcb__read                  DCB, file descriptor, bytes read
+ * dcb__write                 DCB, file descriptor, bytes written
+ * session__create            session ID, service name
+ * session__close             session ID, service name
+ * qc__parse__start           statement buffer
+ * qc__parse__end             statement buffer, parse result
+ * route__target              session ID, server name, whether routed as a write
+ * backend__connect           DCB, server name, file descriptor
+ * backend__auth__complete    DCB, server name
+ * binlog__distribute__start  event type, event size, next position
+ * binlog__distribute__end    event type, event size, next position
+ */
+
+#if defined(HAVE_SYS_SDT_H)
+
+#include <sys/sdt.h>
+
+#define MXS_PROBE(name)                  DTRACE_PROBE(maxscale, name)
+#define MXS_PROBE1(name, a1)             DTRACE_PROBE1(maxscale, name, a1)
+#define MXS_PROBE2(name, a1, a2)         DTRACE_PROBE2(maxscale, name, a1, a2)
+#define MXS_PROBE3(name, a1, a2, a3)     DTRACE_PROBE3(maxscale, name, a1, a2, a3)
+
+#else
+
+#define MXS_PROBE(name)
+#define MXS_PROBE1(name, a1)
+#define MXS_PROBE2(name, a1, a2)
+#define MXS_PROBE3(name, a1, a2, a3)
+
+#endif
+
+#endif
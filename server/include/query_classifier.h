@@ -45,7 +45,8 @@ typedef enum
     QUERY_TYPE_CREATE_TMP_TABLE   = 0x080000, /*< Create temporary table:master (could be all) */
     QUERY_TYPE_READ_TMP_TABLE     = 0x100000, /*< Read temporary table:master (could be any) */
     QUERY_TYPE_SHOW_DATABASES     = 0x200000, /*< Show list of databases */
-    QUERY_TYPE_SHOW_TABLES        = 0x400000  /*< Show list of tables */
+    QUERY_TYPE_SHOW_TABLES        = 0x400000, /*< Show list of tables */
+    QUERY_TYPE_READ_ONLY_TRX      = 0x800000  /*< START TRANSACTION READ ONLY or SET TRANSACTION READ ONLY */
 } qc_query_type_t;
 
 typedef enum
@@ -73,11 +74,56 @@ typedef enum qc_parse_result
     QC_QUERY_PARSED           = 3  /*< The query was fully parsed; completely classified. */
 } qc_parse_result_t;
 
+/**
+ * What a query classifier collects about a statement when parsing it. The
+ * type, the operation and the other properties that cost nothing extra are
+ * always collected. The names and the fields require allocations, so they are
+ * only collected when asked for.
+ */
+typedef enum qc_collect_info
+{
+    QC_COLLECT_ESSENTIALS = 0x00, /*< Type, operation, is real query, has clause and is drop table */
+    QC_COLLECT_TABLES     = 0x01, /*< Table names and the name of a created table */
+    QC_COLLECT_DATABASES  = 0x02, /*< Database names */
+    QC_COLLECT_FIELDS     = 0x04, /*< Affected fields */
+
+    QC_COLLECT_ALL        = (QC_COLLECT_TABLES | QC_COLLECT_DATABASES | QC_COLLECT_FIELDS)
+} qc_collect_info_t;
+
 #define QUERY_IS_TYPE(mask,type) ((mask & type) == type)
 
+/**
+ * The statistics of the cache of classifications of a query classifier,
+ * summed over all threads.
+ */
+typedef struct qc_cache_stats
+{
+    uint64_t size;      /*< The maximum number of entries */
+    uint64_t entries;   /*< The number of entries */
+    uint64_t hits;      /*< Statements whose classification was found in the cache */
+    uint64_t misses;    /*< Cacheable statements that had to be parsed */
+    uint64_t evictions; /*< Entries replaced by another statement */
+} QC_CACHE_STATS;
+
+/**
+ * The statistics of the shadow classifier, see qc_shadow_start.
+ */
+typedef struct qc_shadow_stats
+{
+    uint64_t sampled;              /*< Statements queued for the shadow classifier */
+    uint64_t dropped;              /*< Sampled statements dropped because the queue was full */
+    uint64_t compared;             /*< Statements classified by the shadow classifier */
+    uint64_t type_mismatches;      /*< Statements whose types differed */
+    uint64_t operation_mismatches; /*< Statements whose operations differed */
+} QC_SHADOW_STATS;
+
 bool qc_init(const char* plugin_name, const char* plugin_args);
 void qc_end(void);
 
+bool qc_shadow_start(const char* plugin_name, const char* plugin_args, int sample, int n_threads);
+void qc_shadow_stop(void);
+bool qc_get_shadow_stats(QC_SHADOW_STATS* stats);
+
 typedef struct query_classifier QUERY_CLASSIFIER;
 
 QUERY_CLASSIFIER* qc_load(const char* plugin_name);
@@ -86,7 +132,7 @@ void qc_unload(QUERY_CLASSIFIER* classifier);
 bool qc_thread_init(void);
 void qc_thread_end(void);
 
-qc_parse_result_t qc_parse(GWBUF* querybuf);
+qc_parse_result_t qc_parse(GWBUF* querybuf, uint32_t collect);
 
 uint32_t qc_get_type(GWBUF* querybuf);
 qc_query_op_t qc_get_operation(GWBUF* querybuf);
@@ -100,6 +146,12 @@ bool qc_query_has_clause(GWBUF* buf);
 char* qc_get_qtype_str(qc_query_type_t qtype);
 char* qc_get_affected_fields(GWBUF* buf);
 char** qc_get_database_names(GWBUF* querybuf, int* size);
+bool qc_get_cache_stats(QC_CACHE_STATS* stats);
+
+const char* qc_get_created_table_name_view(GWBUF* querybuf);
+const char* const* qc_get_table_names_view(GWBUF* querybuf, int* tblsize, bool fullnames);
+const char* qc_get_affected_fields_view(GWBUF* buf);
+const char* const* qc_get_database_names_view(GWBUF* querybuf, int* size);
 
 const char* qc_op_to_string(qc_query_op_t op);
 const char* qc_type_to_string(qc_query_type_t type);
@@ -113,7 +165,7 @@ struct query_classifier
     bool (*qc_thread_init)(void);
     void (*qc_thread_end)(void);
 
-    qc_parse_result_t (*qc_parse)(GWBUF* querybuf);
+    qc_parse_result_t (*qc_parse)(GWBUF* querybuf, uint32_t collect);
 
     uint32_t (*qc_get_type)(GWBUF* querybuf);
     qc_query_op_t (*qc_get_operation)(GWBUF* querybuf);
@@ -126,6 +178,12 @@ struct query_classifier
     bool (*qc_query_has_clause)(GWBUF* buf);
     char* (*qc_get_affected_fields)(GWBUF* buf);
     char** (*qc_get_database_names)(GWBUF* querybuf, int* size);
+    bool (*qc_get_cache_stats)(QC_CACHE_STATS* stats);
+
+    const char* (*qc_get_created_table_name_view)(GWBUF* querybuf);
+    const char* const* (*qc_get_table_names_view)(GWBUF* querybuf, int* tblsize, bool fullnames);
+    const char* (*qc_get_affected_fields_view)(GWBUF* buf);
+    const char* const* (*qc_get_database_names_view)(GWBUF* querybuf, int* size);
 };
 
 #define QUERY_CLASSIFIER_VERSION {1, 0, 0}
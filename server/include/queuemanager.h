@@ -16,17 +16,23 @@
 /**
  * @file queuemanager.h  The Queue Manager header file
  *
+ * The queues are bounded lock-free FIFO queues that any number of threads
+ * can add to and remove from at the same time. Each cell of the ring has a
+ * sequence number that tells whether it is free for the position being
+ * written or holds the entry for the position being read, so the producers
+ * and the consumers only contend on the counter of their own end.
  *
  * @verbatim
  * Revision History
  *
  * Date         Who                     Description
  * 27/04/2016   Martin Brampton         Initial implementation
+ * 15/10/2016   Core Team               Lock-free queue with wait statistics
  *
  * @endverbatim
  */
 
-#include <spinlock.h>
+#include <stdbool.h>
 #include <skygw_debug.h>
 
 #define CONNECTION_QUEUE_LIMIT 1000
@@ -34,30 +40,47 @@
 typedef struct queue_entry
 {
     void            *queued_object;
-    long            heartbeat;
+    long            heartbeat;          /*< The hkheartbeat when the entry was queued */
 } QUEUE_ENTRY;
 
+typedef struct queue_cell
+{
+    unsigned long   sequence;           /*< The position the cell is next written or read at */
+    QUEUE_ENTRY     entry;
+} QUEUE_CELL;
+
 typedef struct queue_config
 {
-    int             queue_size;
-    int             queue_limit;
-    int             start;
-    int             end;
-    int             timeout;
-    SPINLOCK        queue_lock;
-    QUEUE_ENTRY     queue_array[CONNECTION_QUEUE_LIMIT];
+    int             queue_size;         /*< The number of cells */
+    int             queue_limit;        /*< The maximum number of entries, the same as queue_size */
+    int             timeout;            /*< Seconds an entry is valid for */
+    QUEUE_CELL      *cells;             /*< The ring */
+    unsigned long   start;              /*< The next position to read, moved by the consumers */
+    char            pad[64];            /*< Keeps the producers and consumers off each other's cache line */
+    unsigned long   end;                /*< The next position to write, moved by the producers */
+    int             n_queued;           /*< Entries added */
+    int             n_rejected;         /*< Entries not added because the queue was full */
+    int             n_released;         /*< Entries removed before they expired */
+    int             n_expired;          /*< Entries removed after they expired */
+    int             total_wait;         /*< Heartbeats waited by the removed entries */
+    int             max_wait;           /*< The longest wait of a removed entry in heartbeats */
 } QUEUE_CONFIG;
 
 QUEUE_CONFIG *mxs_queue_alloc(int limit, int timeout);
 void mxs_queue_free(QUEUE_CONFIG *queue_config);
 bool mxs_enqueue(QUEUE_CONFIG *queue_config, void *new_entry);
-QUEUE_ENTRY *mxs_dequeue(QUEUE_CONFIG *queue_config);
+bool mxs_dequeue(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *result);
+bool mxs_queue_expired(QUEUE_CONFIG *queue_config, QUEUE_ENTRY *entry);
 
+/**
+ * The number of entries in a queue. The value may be out of date by the time
+ * it is used, the entries being added or removed are counted.
+ */
 static inline int
 mxs_queue_count(QUEUE_CONFIG *queue_config)
 {
-    int count = queue_config->end - queue_config->start;
-    return count < 0 ? (count + queue_config->queue_size) : count;
+    long count = (long)(queue_config->end - queue_config->start);
+    return count < 0 ? 0 : count > queue_config->queue_size ? queue_config->queue_size : (int)count;
 }
 
 #endif /* QUEUEMANAGER_H */
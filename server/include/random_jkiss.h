@@ -25,6 +25,7 @@ extern "C" {
 #endif
 
 extern unsigned int random_jkiss(void);
+extern void random_jkiss_init(void);
 
 #ifdef  __cplusplus
 }
@@ -49,8 +49,8 @@ typedef unsigned long long CYCLES;
  */
 static __inline__ CYCLES rdtsc(void)
 {
-    unsigned long long int x;
-    __asm__ volatile (".byte 0x0f, 0x31" : "=A" (x));
-    return x;
+    unsigned int lo, hi;
+    __asm__ volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((CYCLES)hi << 32) | lo;
 }
 #endif
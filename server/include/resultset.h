@@ -21,11 +21,21 @@
  *
  * Date         Who             Description
  * 17/02/15     Mark Riddoch    Initial implementation
+ * 15/10/2016   Core Team       Write the rows in batches
+ * 15/10/2016   Core Team       Server status of the EOF packets
+ * 15/10/2016   Core Team       Column lists and conditions
  *
  * @endverbatim
  */
+#include <stdbool.h>
 #include <dcb.h>
 
+/**
+ * The rows are written to the client in batches of at most this many rows
+ * or bytes, whichever limit is reached first
+ */
+#define RESULTSET_BATCH_ROWS  128
+#define RESULTSET_BATCH_BYTES 65536
 
 /**
  * Column types
@@ -57,6 +67,18 @@ typedef struct resultrow
     char **cols; /*< The columns themselves */
 } RESULT_ROW;
 
+/**
+ * A condition on a column of a result set. Only the rows whose value of the
+ * column satisfies all the conditions of the result set are streamed.
+ */
+typedef struct resultcond
+{
+    int col;                   /*< The index of the column */
+    char *value;               /*< The value or LIKE pattern to compare with */
+    bool like;                 /*< Whether value is a LIKE pattern */
+    struct resultcond *next;   /*< Next condition */
+} RESULT_COND;
+
 struct resultset;
 
 /**
@@ -73,6 +95,10 @@ typedef struct resultset
     RESULT_COLUMN *column;  /*< Linked list of column definitions */
     RESULT_ROW_CB fetchrow; /*< Fetch a row for the result set */
     void *userdata;         /*< User data for the fetch row call */
+    uint16_t status;        /*< Server status sent in the EOF packets */
+    RESULT_COND *where;     /*< The conditions the streamed rows satisfy */
+    int *select;            /*< The indexes of the streamed columns, NULL for all */
+    int n_select;           /*< No. of streamed columns if select is set */
 } RESULTSET;
 
 extern RESULTSET *resultset_create(RESULT_ROW_CB, void *);
@@ -82,6 +108,11 @@ extern void resultset_column_free(RESULT_COLUMN *);
 extern RESULT_ROW *resultset_make_row(RESULTSET *);
 extern void resultset_free_row(RESULT_ROW *);
 extern int resultset_row_set(RESULT_ROW *, int, char *);
+extern int resultset_select_column(RESULTSET *, const char *);
+extern int resultset_add_condition(RESULTSET *, const char *, const char *, bool);
+extern bool resultset_column_needed(RESULTSET *, int);
+extern bool resultset_value_matches(RESULTSET *, int, const char *);
+extern bool resultset_like(const char *, const char *);
 extern void resultset_stream_mysql(RESULTSET *, DCB *);
 extern void resultset_stream_json(RESULTSET *, DCB *);
 
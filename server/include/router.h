@@ -25,6 +25,10 @@
  * 16/07/2013   Massimiliano Pinto  Added router commands values
  * 22/10/2013   Massimiliano Pinto  Added router errorReply entry point
  * 27/10/2015   Martin Brampton     Add RCAP_TYPE_NO_RSESSION
+ * 15/10/2016   Core Team           Added the getSlaveMetrics entry point
+ * 15/10/2016   Core Team           Add RCAP_TYPE_STREAM_INPUT
+ * 15/10/2016   Core Team           Add RCAP_TYPE_PARTIAL_REPLY
+ * 15/10/2016   Core Team           Added the addListener entry point
  *
  */
 #include <service.h>
@@ -38,6 +42,20 @@
  */
 typedef void *ROUTER;
 
+/**
+ * The replication metrics of a slave that replicates from a router
+ */
+typedef struct router_slave_metrics
+{
+    char                   host[80];       /*< The host and port of the slave */
+    int                    server_id;      /*< The server ID of the slave */
+    uint64_t               bytes_behind;   /*< Binlog bytes not yet sent to the slave */
+    uint64_t               seconds_behind; /*< Master time between the last received and sent events */
+    uint64_t               send_rate;      /*< Bytes sent per second in the last minute */
+    double                 catchup_ratio;  /*< Fraction of the connection time spent catching up */
+    ts_histogram_summary_t catchup_bursts; /*< Durations of the catchup bursts in microseconds */
+} ROUTER_SLAVE_METRICS;
+
 typedef enum error_action
 {
     ERRACT_NEW_CONNECTION = 0x001,
@@ -57,6 +75,11 @@ typedef enum error_action
  *  clientReply     Called to reply to client the data from one or all backends
  *  errorReply      Called to reply to client errors with optional closeSession or make a request for
  *                  a new backend connection
+ *  getSlaveMetrics Optional, returns the number of slaves replicating from the router and the
+ *                  replication metrics of the slave with the given index if there is one
+ *  addListener     Optional, registers a function that the router calls whenever it has stored
+ *                  new data that other modules of the process read, e.g. binlog events. The
+ *                  function must not block. Returns 0 if the listener was not registered
  *
  * @endverbatim
  *
@@ -78,6 +101,8 @@ typedef struct router_object
                            error_action_t action,
                            bool*          succp);
     int     (*getCapabilities)();
+    int     (*getSlaveMetrics)(ROUTER *instance, int n, ROUTER_SLAVE_METRICS *metrics);
+    int     (*addListener)(ROUTER *instance, void (*notify)(void *data), void *data);
 } ROUTER_OBJECT;
 
 /**
@@ -85,7 +110,7 @@ typedef struct router_object
  * must update these versions numbers in accordance with the rules in
  * modinfo.h.
  */
-#define ROUTER_VERSION  { 1, 0, 0 }
+#define ROUTER_VERSION  { 1, 2, 0 }
 
 /**
  * Router capability type. Indicates what kind of input router accepts.
@@ -95,7 +120,9 @@ typedef enum router_capability_t
     RCAP_TYPE_UNDEFINED    = 0x00,
     RCAP_TYPE_STMT_INPUT   = 0x01,  /*< statement per buffer */
     RCAP_TYPE_PACKET_INPUT = 0x02,  /*< data as it was read from DCB */
-    RCAP_TYPE_NO_RSESSION  = 0x04   /*< router does not use router sessions */
+    RCAP_TYPE_NO_RSESSION  = 0x04,  /*< router does not use router sessions */
+    RCAP_TYPE_STREAM_INPUT = 0x08,  /*< continuation of a packet as it is read */
+    RCAP_TYPE_PARTIAL_REPLY = 0x10  /*< session command replies as they arrive */
 } router_capability_t;
 
 
@@ -14,6 +14,10 @@
  */
 #include <dcb.h>
 #include <resultset.h>
+#include <metrics.h>
+#include <latency.h>
+#include <ilist.h>
+#include <timer.h>
 
 /**
  * @file service.h
@@ -40,6 +44,12 @@
  * 19/02/15     Mark Riddoch            Addition of serverGetList
  * 01/06/15     Massimiliano Pinto      Addition of server_update_address/port
  * 19/06/15     Martin Brampton         Extra fields for persistent connections, CHK_SERVER
+ * 15/10/2016   Core Team               Addition of Unix domain socket servers
+ * 15/10/2016   Core Team               Addition of rlag_us
+ * 15/10/2016   Core Team               Addition of load_weight
+ * 15/10/2016   Core Team               Addition of cached system variables
+ * 15/10/2016   Core Team               Addition of the list of connected DCBs
+ * 15/10/2016   Core Team               Addition of the connection rate limit
  *
  * @endverbatim
  */
@@ -70,6 +80,94 @@ typedef struct
     int n_persistent;  /**< Current persistent pool */
 } SERVER_STATS;
 
+/** The number of hash buckets in a persistent connection pool */
+#define SERVER_POOL_BUCKETS 16
+
+/**
+ * The idle persistent connections of a server that belong to one polling
+ * thread. The connections are kept in LIFO stacks selected by a hash of the
+ * user and the protocol, so that a thread reuses the connection it released
+ * last. The lock is only contended when the diagnostics or a thread that is not
+ * the owner of a connection clean the pool.
+ */
+typedef struct server_pool
+{
+    SPINLOCK       lock;                         /**< Lock for the stacks */
+    DCB            *stacks[SERVER_POOL_BUCKETS]; /**< The stacks of connections */
+} SERVER_POOL;
+
+/**
+ * Check whether an idle persistent connection has been in the pool for longer
+ * than persistmaxtime. The connections are not expired while the pools of the
+ * server hold no more than persistminsize connections.
+ */
+#define SERVER_PERSISTENT_EXPIRED(s, d) \
+    ((time(NULL) - (d)->persistentstart) > (s)->persistmaxtime && \
+     (s)->stats.n_persistent > (s)->persistminsize)
+
+/**
+ * The new connections to a server that wait for the connection rate limit.
+ * The bucket is refilled with connect_rate tokens per second and holds at most
+ * one second's worth of them. A connection starts when it gets a token and
+ * fewer than max_handshakes connections are in their handshake, in the order
+ * the connections were made.
+ */
+typedef struct server_connect_queue
+{
+    SPINLOCK       lock;           /**< Protects the queue */
+    double         tokens;         /**< The connections that may start now */
+    uint64_t       refilled;       /**< When the tokens were refilled, as returned by latency_now() */
+    int            n_handshakes;   /**< Connections in their handshake */
+    int            n_queued;       /**< Connections in the queue */
+    ILIST          queue;          /**< The waiting connections, the oldest first */
+    TIMER          timer;          /**< Starts the waiting connections */
+} SERVER_CONNECT_QUEUE;
+
+/** Check whether the new connections to a server are limited */
+#define SERVER_CONNECT_LIMITED(s) ((s)->connect_rate > 0 || (s)->max_handshakes > 0)
+
+/** The load weight of a server that is not throttled by the monitor */
+#define SERVER_LOAD_WEIGHT_MAX 1000
+
+/**
+ * The routing weight of a server scaled by the load weight set by the monitor.
+ * A positive weight stays positive.
+ */
+#define SERVER_WEIGHT(s, w)                                             \
+    ((w) > 0 && (w) * (s)->load_weight < SERVER_LOAD_WEIGHT_MAX ? 1 :   \
+     (w) * (s)->load_weight / SERVER_LOAD_WEIGHT_MAX)
+
+/** The maximum number of replication domains kept in a GTID position */
+#define SERVER_GTID_MAX_DOMAINS 8
+
+/**
+ * The GTID position of a server as read by a monitor. Positions are compared
+ * domain by domain, so only the latest sequence number of each domain is kept.
+ */
+typedef struct
+{
+    int            n_domains;      /**< No. of domains in the position */
+    uint32_t       domains[SERVER_GTID_MAX_DOMAINS]; /**< The replication domain IDs */
+    uint64_t       seqs[SERVER_GTID_MAX_DOMAINS];    /**< The sequence number of each domain */
+    uint64_t       read_at;        /**< When the monitor started to read the position,
+                                    *   as returned by latency_now(). 0 if never read. */
+} SERVER_GTID_POS;
+
+/**
+ * The global system variables the monitors cache for each server so that the
+ * routers can answer the queries of connectors that read them. The order is
+ * the order of the columns of MON_SERVER_VARIABLES_QUERY.
+ */
+typedef enum
+{
+    SERVER_VAR_VERSION_COMMENT,
+    SERVER_VAR_TX_ISOLATION,
+    SERVER_VAR_AUTO_INCREMENT_INCREMENT,
+    SERVER_VAR_MAX_ALLOWED_PACKET,
+    SERVER_VAR_SQL_MODE,
+    SERVER_N_VARS
+} server_var_t;
+
 /**
  * The SERVER structure defines a backend server. Each server has a name
  * or IP address for the server, a port that the server listens on and
@@ -85,17 +183,22 @@ typedef struct server
     char           *unique_name;   /**< Unique name for the server */
     char           *name;          /**< Server name/IP address*/
     unsigned short port;           /**< Port to listen on */
+    char           *socket;        /**< Unix domain socket of the server, NULL for TCP */
     char           *protocol;      /**< Protocol module to use */
     SSL_LISTENER   *server_ssl;    /**< SSL data structure for server, if any */
     unsigned int   status;         /**< Status flag bitmap for the server */
     char           *monuser;       /**< User name to use to monitor the db */
     char           *monpw;         /**< Password to use to monitor the db */
     SERVER_STATS   stats;          /**< The server statistics */
+    LATENCY        latency;        /**< The latencies of the queries routed to the server */
     struct  server *next;          /**< Next server */
     struct  server *nextdb;        /**< Next server in list attached to a service */
     char           *server_string; /**< Server version string, i.e. MySQL server version */
     long           node_id;        /**< Node id, server_id for M/S or local_index for Galera */
     int            rlag;           /**< Replication Lag for Master / Slave replication */
+    long           rlag_us;        /**< Replication lag in microseconds, same special values as rlag */
+    int            load_weight;    /**< Share of its routing weight the monitor gives the server
+                                    * from its load, 1 to SERVER_LOAD_WEIGHT_MAX */
     unsigned long  node_ts;        /**< Last timestamp set from M/S monitor module */
     SERVER_PARAM   *parameters;    /**< Parameters of a server that may be used to weight routing decisions */
     long           master_id;      /**< Master server id of this node */
@@ -104,16 +207,52 @@ typedef struct server
     bool           master_err_is_logged; /*< If node failed, this indicates whether it is logged */
     bool           slave_configured; /**< Server is configured as a replication slave
                                       * TODO: Remove this for 2.1 */
-    DCB            *persistent;    /**< List of unused persistent connections to the server */
-    SPINLOCK       persistlock;    /**< Lock for adjusting the persistent connections list */
+    SERVER_POOL    *persistent;    /**< The pools of unused persistent connections, one per thread */
+    int            n_persistent_pools; /**< No. of pools in persistent */
     long           persistpoolmax; /**< Maximum size of persistent connections pool */
+    long           persistminsize; /**< Minimum no. of idle connections kept past persistmaxtime */
     long           persistmaxtime; /**< Maximum number of seconds connection can live */
+    bool           compression;    /**< Use the compressed protocol with the server */
     int            persistmax;     /**< Maximum pool size actually achieved since startup */
+    int            state_index;    /**< The index of the server in the server states */
+    SERVER_GTID_POS gtid_pos;      /**< The GTID position, protected by lock */
+    char           *variables[SERVER_N_VARS]; /**< Cached global system variables,
+                                               * protected by lock */
+    SPINLOCK       dcbs_lock;      /**< Lock for dcbs */
+    struct dcb     *dcbs;          /**< The backend DCBs connected to the server,
+                                    * including the pooled ones */
+    int            connect_rate;   /**< New connections per second, 0 for no limit */
+    int            max_handshakes; /**< Connections in their handshake at a time, 0 for no limit */
+    SERVER_CONNECT_QUEUE connq;    /**< The connections waiting for the limits */
 #if defined(SS_DEBUG)
     skygw_chk_t    server_chk_tail;
 #endif
 } SERVER;
 
+/**
+ * The state of a server as set by the monitors. The SERVER_IS_ macros can be
+ * used with the states as well as with the servers.
+ */
+typedef struct
+{
+    SERVER         *server;        /**< The server, NULL if it has been freed */
+    unsigned int   status;         /**< Status flag bitmap for the server */
+    int            rlag;           /**< Replication Lag for Master / Slave replication */
+    long           rlag_us;        /**< Replication lag in microseconds */
+    int            depth;          /**< Replication level in the tree */
+} SERVER_STATE;
+
+/**
+ * A published version of the states of all servers. The routers read the states
+ * from one version, so that the states they see are consistent with each other,
+ * without locking. A version is replaced when a monitor has updated the servers.
+ */
+typedef struct
+{
+    int            n_servers;      /**< No. of states */
+    SERVER_STATE   servers[];      /**< The states, indexed by the state_index of a server */
+} SERVER_STATES;
+
 /**
  * Status bits in the server->status member.
  *
@@ -204,6 +343,7 @@ extern void dprintAllServersJson(DCB *);
 extern void dprintServer(DCB *, SERVER *);
 extern void dprintPersistentDCBs(DCB *, SERVER *);
 extern void dListServers(DCB *);
+extern void server_metrics(METRICS *);
 extern char *server_status(SERVER *);
 extern void server_clear_set_status(SERVER *server, int specified_bits, int bits_to_set);
 extern void server_set_status(SERVER *, int);
@@ -214,11 +354,23 @@ extern void serverAddParameter(SERVER *, char *, char *);
 extern char *serverGetParameter(SERVER *, char *);
 extern void server_update(SERVER *, char *, char *, char *);
 extern void server_set_unique_name(SERVER *, char *);
-extern DCB  *server_get_persistent(SERVER *, char *, const char *);
+extern DCB  *server_get_persistent(SERVER *, char *, const char *, DCB *);
+extern SERVER_POOL *server_persistent_pool(SERVER *, DCB *);
+extern unsigned int server_persistent_key(const char *, const char *);
 extern void server_update_address(SERVER *, char *);
 extern void server_update_port(SERVER *,  unsigned short);
 extern RESULTSET *serverGetList();
 extern unsigned int server_map_status(char *str);
 extern bool server_set_version_string(SERVER* server, const char* string);
+extern SERVER_STATES *server_states();
+extern SERVER_STATE server_get_state(SERVER_STATES *states, SERVER *server);
+extern void server_states_publish();
+extern bool server_set_gtid_pos(SERVER *server, const char *pos, uint64_t read_at);
+extern void server_get_gtid_pos(SERVER *server, SERVER_GTID_POS *pos);
+extern const char *server_var_name(server_var_t var);
+extern server_var_t server_var_find(const char *name, size_t len);
+extern bool server_set_variable(SERVER *server, server_var_t var, const char *value);
+extern bool server_get_variable(SERVER *server, server_var_t var, char *buf, size_t size);
+extern bool server_gtid_pos_reached(const SERVER_GTID_POS *pos, const SERVER_GTID_POS *target);
 
 #endif
@@ -22,6 +22,9 @@
 #include <filter.h>
 #include <hashtable.h>
 #include <resultset.h>
+#include <metrics.h>
+#include <latency.h>
+#include <statistics.h>
 #include <maxconfig.h>
 #include <queuemanager.h>
 #include <openssl/crypto.h>
@@ -67,6 +70,7 @@ typedef struct
     int    n_failed_starts; /**< Number of times this service has failed to start */
     int    n_sessions;      /**< Number of sessions created on service since start */
     int    n_current;       /**< Current number of sessions */
+    int    n_memory_closed; /**< Sessions closed for buffering more than max_session_memory */
 } SERVICE_STATS;
 
 /**
@@ -91,13 +95,35 @@ typedef struct
     time_t last;
 } SERVICE_REFRESH_RATE;
 
+/**
+ * The statistics of the traffic a service routes to one of its servers. The
+ * routers that record them get them with serviceGetBackendStats. Each thread
+ * updates its own copy of the values, see statistics.h.
+ */
+typedef struct
+{
+    ts_stats_t     queries;         /*< Queries routed to the server */
+    ts_stats_t     bytes_out;       /*< Bytes sent to the server */
+    ts_stats_t     bytes_in;        /*< Bytes received from the server */
+    ts_stats_t     errors;          /*< Errors on the connections to the server */
+    ts_stats_t     reconnects;      /*< Connections that replaced failed ones */
+    ts_stats_t     sescmd_replays;  /*< Session command histories executed */
+    ts_histogram_t latency;         /*< Response times in microseconds */
+} BACKEND_STATS;
+
 typedef struct server_ref_t
 {
     struct server_ref_t *next;
     SERVER* server;
+    BACKEND_STATS *stats;   /*< Allocated when a router asks for them */
 } SERVER_REF;
 
+/** The header of the lines printed by dprintBackendStats */
+#define BACKEND_STATS_HEADER "\t\tServer                  Queries    Bytes Out     Bytes In  Errors " \
+    "Reconnects P50 (usec) P99 (usec)\n"
+
 #define SERVICE_MAX_RETRY_INTERVAL 3600 /*< The maximum interval between service start retries */
+#define SERVICE_START_THREADS 8 /*< Number of threads preparing the services at startup */
 
 /** Value of service timeout if timeout checks are disabled */
 #define SERVICE_NO_SESSION_TIMEOUT LONG_MAX
@@ -121,7 +147,8 @@ typedef struct service
     int state;                         /**< The service state */
     int client_count;                  /**< Number of connected clients */
     int max_connections;               /**< Maximum client connections */
-    QUEUE_CONFIG *queued_connections;  /**< Queued connections, if set */
+    int max_queued_connections;        /**< Connections each listener queues at the limit */
+    int queued_connection_timeout;     /**< Seconds a connection may stay queued */
     SERV_LISTENER *ports;              /**< Linked list of ports and protocols
                                         * that this service will listen on.
                                         */
@@ -134,6 +161,7 @@ typedef struct service
     SERVICE_USER credentials;          /**< The cedentials of the service user */
     SPINLOCK spin;                     /**< The service spinlock */
     SERVICE_STATS stats;               /**< The service statistics */
+    LATENCY latency;                   /**< The latencies of the queries of the service */
     struct users *users;               /**< The user data for this service */
     int enable_root;                   /**< Allow root user  access */
     int localhost_match_wildcard_host; /**< Match localhost against wildcard */
@@ -147,13 +175,18 @@ typedef struct service
                                         * to escape at least the underscore character. */
     SPINLOCK users_table_spin;         /**< The spinlock for users data refresh */
     SERVICE_REFRESH_RATE rate_limit;   /**< The refresh rate limit for users table */
+    int users_reload_pending;          /**< A background reload of the users is scheduled */
     FILTER_DEF **filters;              /**< Ordered list of filters */
     int n_filters;                     /**< Number of filters */
     long conn_idle_timeout;            /**< Session timeout in seconds */
+    int max_session_memory;            /**< The bytes a session may buffer, 0 for no limit */
     char *weightby;
     struct service *next;              /**< The next service in the linked list */
     bool retry_start;                  /*< If starting of the service should be retried later */
     bool log_auth_warnings;            /*< Log authentication failures and warnings */
+    bool compression;                  /*< Allow clients to use the compressed protocol */
+    bool session_track;                /*< Allow clients to track the session state */
+    int thread_group;                  /*< The polling thread group, 0 for the default group */
 } SERVICE;
 
 typedef enum count_spec_t
@@ -184,6 +217,8 @@ extern int serviceStart(SERVICE *);
 extern int serviceStartAll();
 extern void serviceStartProtocol(SERVICE *, char *, int);
 extern int serviceStop(SERVICE *);
+extern int serviceStopAll();
+extern int serviceForEachListener(void (*func)(const char *bind, int fd, void *data), void *data);
 extern int serviceRestart(SERVICE *);
 extern int serviceSetUser(SERVICE *, char *, char *);
 extern int serviceGetUser(SERVICE *, char **, char **);
@@ -195,6 +230,7 @@ extern void serviceSetCertificates(SERVICE *service, char* cert, char* key, char
 extern int serviceEnableRootUser(SERVICE *, int );
 extern int serviceSetTimeout(SERVICE *, int );
 extern int serviceSetConnectionLimits(SERVICE *, int, int, int);
+extern int serviceSetSessionMemoryLimit(SERVICE *, int);
 extern void serviceSetRetryOnFailure(SERVICE *service, char* value);
 extern void serviceWeightBy(SERVICE *, char *);
 extern char *serviceGetWeightingParameter(SERVICE *);
@@ -203,6 +239,7 @@ extern int serviceStripDbEsc(SERVICE* service, int action);
 extern int serviceAuthAllServers(SERVICE *service, int action);
 extern void service_update(SERVICE *, char *, char *, char *);
 extern int service_refresh_users(SERVICE *);
+extern void service_refresh_users_async(SERVICE *);
 extern void printService(SERVICE *);
 extern void printAllServices();
 extern void dprintAllServices(DCB *);
@@ -212,13 +249,18 @@ extern bool service_set_param_value(SERVICE*            service,
                                     count_spec_t        count_spec,
                                     config_param_type_t type);
 extern void dprintService(DCB *, SERVICE *);
+extern void dprintBackendStats(DCB *, SERVER *, BACKEND_STATS *);
 extern void dListServices(DCB *);
+extern void service_metrics(METRICS *);
 extern void dListListeners(DCB *);
 extern char* service_get_name(SERVICE* svc);
 extern void service_shutdown();
 extern int serviceSessionCountAll();
 extern RESULTSET *serviceGetList();
 extern RESULTSET *serviceGetListenerList();
+extern BACKEND_STATS *serviceGetBackendStats(SERVICE *service, SERVER *server);
+extern RESULTSET *serviceGetBackendStatsList();
+extern RESULTSET *serviceGetSlaveMetricsList();
 extern bool service_all_services_have_listeners();
 
 #endif
@@ -33,12 +33,16 @@
  * @endverbatim
  */
 #include <time.h>
+#include <stdint.h>
 #include <atomic.h>
 #include <buffer.h>
 #include <spinlock.h>
 #include <resultset.h>
+#include <latency.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <timer.h>
+#include <trace.h>
 
 struct dcb;
 struct service;
@@ -91,12 +95,20 @@ typedef struct
 /**
  * Structure used to track the filter instances and sessions of the filters
  * that are in use within a session.
+ *
+ * A filter that is only interested in some of the commands is reached through
+ * a link that sends the packets of the other commands directly to the
+ * component after the filter.
  */
 typedef struct
 {
     struct filter_def *filter;
     void *instance;
     void *session;
+    uint64_t interest;      /*< The packets the filter is interested in */
+    DOWNSTREAM down;        /*< The filter, for the commands of interest */
+    DOWNSTREAM skip;        /*< The component after the filter, for the other commands */
+    bool skipped;           /*< The last packet was routed past the filter */
 } SESSION_FILTER;
 
 /**
@@ -133,21 +145,27 @@ typedef struct session
     SESSION_FILTER  *filters;         /*< The filters in use within this session */
     DOWNSTREAM      head;             /*< Head of the filter chain */
     UPSTREAM        tail;             /*< The tail of the filter chain */
-    struct session  *next;            /*< Linked list of all sessions */
+    int             n_flow_stopped;   /*< No. of backend DCBs above their high water mark */
+    struct dcb      *stalled;         /*< The DCBs whose reads wait for a write queue to drain */
+    struct session  *next;            /*< Next session in the registry bucket */
+    struct session  *next_by_id;      /*< Next session in the bucket of the ID index */
+    struct session  *next_by_rses;    /*< Next session in the bucket of the router session index */
     int             refcount;         /*< Reference count on the session */
     bool            ses_is_child;     /*< this is a child session */
+    TIMER           idle_timer;       /*< The connection idle timeout timer */
+    uint64_t        query_start;      /*< When the measured query was routed, 0 if none */
+    latency_kind_t  query_kind;       /*< Whether the query was routed as a read or a write */
+    struct server   *query_server;    /*< The server the query was routed to, if any */
+    QUERY_TRACE     trace;            /*< The trace of the query, see trace.h */
+    int             memory_limit;     /*< The bytes the session may buffer, 0 for no limit */
+    int             buffered;         /*< The bytes buffered for the session */
+    int             buffered_held;    /*< The part of buffered that is not in a write queue */
+    int             memory_exceeded;  /*< Set once the session is closed for its buffers */
 #if defined(SS_DEBUG)
     skygw_chk_t     ses_chk_tail;
 #endif
 } SESSION;
 
-/** Whether to do session timeout checks */
-extern bool check_timeouts;
-
-/** When the next timeout check is done. This is compared to hkheartbeat in
- * hk_heartbeat.h */
-extern long next_timeout_check;
-
 #define SESSION_PROTOCOL(x, type)       DCB_PROTOCOL((x)->client_dcb, type)
 
 /**
@@ -167,7 +185,7 @@ extern long next_timeout_check;
     ((sess)->tail.clientReply)((sess)->tail.instance,           \
                                (sess)->tail.session, (buf))
 
-SESSION *get_all_sessions();
+SESSION *session_get_by_id(size_t id);
 SESSION *session_alloc(struct service *, struct dcb *);
 SESSION *session_set_dummy(struct dcb *);
 bool session_free(SESSION *);
@@ -185,7 +203,21 @@ bool session_link_dcb(SESSION *, struct dcb *);
 SESSION* get_session_by_router_ses(void* rses);
 void session_enable_log_priority(SESSION* ses, int priority);
 void session_disable_log_priority(SESSION* ses, int priority);
+void session_latency_start(SESSION *session);
+void session_latency_target(SESSION *session, struct server *server, bool is_write);
+void session_latency_end(SESSION *session);
+void session_buffered_add(SESSION *session, int bytes, bool in_writeq);
 RESULTSET *sessionGetList(SESSIONLISTFILTER);
-void process_idle_sessions();
-void enable_session_timeouts();
+
+/**
+ * Check whether a session buffers more than its service allows
+ *
+ * @param session   The session
+ * @return True if the session is over its limit
+ */
+static inline bool
+session_over_memory_limit(SESSION *session)
+{
+    return session->memory_limit && session->buffered > session->memory_limit;
+}
 #endif
@@ -0,0 +1,53 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file slab.h  - Pools of fixed-size objects
+ *
+ * A pool allocates its objects in slabs of several objects and keeps the
+ * freed objects for reuse, so that an owner that allocates and frees many
+ * small objects of one type, e.g. a router session, makes one allocation per
+ * slab instead of one per object and releases them all in one go when it is
+ * done. A pool is not thread-safe, its owner serialises the access to it.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 15/10/2016   Core Team       Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stddef.h>
+
+/**
+ * A pool of objects of one size
+ */
+typedef struct
+{
+    size_t  size;       /*< The size of an object */
+    int     per_slab;   /*< The objects in a slab */
+    int     tag;        /*< The tag of the memory statistics */
+    void    *slabs;     /*< The slabs, linked through their first word */
+    void    *free;      /*< The free objects, linked through their first word */
+} SLAB_POOL;
+
+extern void slab_init(SLAB_POOL *pool, size_t size, int per_slab, int tag);
+extern void *slab_alloc(SLAB_POOL *pool);
+extern void slab_free(SLAB_POOL *pool, void *obj);
+extern void slab_release(SLAB_POOL *pool);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file snapshot.h  - Published versions of read-mostly data
+ *
+ * A snapshot holds the current version of some data that is read often and
+ * written rarely. A version is never modified once it has been published. A
+ * writer copies the current version, modifies the copy and publishes it, and
+ * the version it replaced is freed through the epoch reclamation once no
+ * polling thread can be reading it anymore.
+ *
+ * A reader only loads the pointer to the current version. The version stays
+ * valid until the polling thread reports its next quiescent state, so it must
+ * not be kept across polling loops. Threads that do not report quiescent states,
+ * like the monitors, may only read a snapshot between snapshot_write_begin and
+ * snapshot_write_end.
+ */
+
+#include <stddef.h>
+#include <spinlock.h>
+
+typedef struct snapshot
+{
+    void * volatile current;  /*< The published version */
+    SPINLOCK lock;            /*< Serialises the writers */
+} SNAPSHOT;
+
+#define SNAPSHOT_INIT {NULL, SPINLOCK_INIT}
+
+/**
+ * Get the current version of a snapshot
+ *
+ * @param snap  The snapshot
+ * @return      The current version or NULL if nothing has been published
+ */
+static inline void *
+snapshot_get(SNAPSHOT *snap)
+{
+    return snap->current;
+}
+
+extern void *snapshot_alloc(size_t size);
+extern void snapshot_discard(void *version);
+extern void *snapshot_write_begin(SNAPSHOT *snap);
+extern void snapshot_write_end(SNAPSHOT *snap, void *version);
+
+#endif
@@ -18,10 +18,17 @@
  *
  * Spinlock implementation for MaxScale.
  *
- * Spinlocks are cheap locks that can be used to protect short code blocks, they are
- * generally wasteful as any blocked threads will spin, consuming CPU cycles, waiting
- * for the lock to be released. However they are useful in that they do not involve
- * system calls and are light weight when the expected wait time for a lock is low.
+ * Spinlocks are cheap locks that can be used to protect short code blocks. They do
+ * not involve system calls and are light weight when the expected wait time for a
+ * lock is low. A thread that can not get a lock spins for a short while, and if
+ * the lock is still held, for example because its holder was preempted, the thread
+ * is parked on a futex until the lock is released instead of burning its quantum.
+ *
+ * Every lock counts its acquisitions, the acquisitions that had to wait and the
+ * cycles spent waiting. A lock that is given a name is reported by
+ * spinlock_contention once it has been contended. A named lock must exist for as
+ * long as the process, which is why only static locks and the locks of objects
+ * that are never freed are named.
  */
 #include <thread.h>
 #include <stdbool.h>
@@ -31,27 +38,43 @@
 /**
  * The spinlock structure.
  *
- * In normal builds the structure merely contains a lock value which
- * is 0 if the spinlock is not taken and greater than zero if it is held.
+ * The lock value is 0 if the spinlock is not taken, 1 if it is held and 2 if it
+ * is held and threads may be parked waiting for it. The statistics are updated by
+ * the holder of the lock.
  *
  * In builds with the SPINLOCK_PROFILE option set this structure also holds
- * a number of profile related fields that count the number of spins, number
- * of waiting threads and the number of times the lock has been acquired.
+ * a number of profile related fields that count the number of spins and the
+ * number of waiting threads.
  */
 typedef struct spinlock
 {
-    int lock;         /*< Is the lock held? */
+    int lock;                       /*< Is the lock held? */
+    bool registered;                /*< Is the lock in the list of named locks */
+    unsigned long acquired;         /*< No. of times lock was acquired */
+    unsigned long contended;        /*< No. of times acquire was contended */
+    unsigned long long wait_cycles; /*< Total cycles spent waiting for the lock */
+    const char *name;               /*< The name of the lock or NULL */
 #if SPINLOCK_PROFILE
     int spins;        /*< Number of spins on this lock */
     int maxspins;     /*< Max no of spins to acquire lock */
-    int acquired;     /*< No. of times lock was acquired */
     int waiting;      /*< No. of threads acquiring this lock */
     int max_waiting;  /*< Max no of threads waiting for lock */
-    int contended;    /*< No. of times acquire was contended */
     THREAD owner;     /*< Last owner of this lock */
 #endif
 } SPINLOCK;
 
+/**
+ * The contention statistics of a named lock
+ */
+typedef struct
+{
+    const char *name;               /*< The name of the lock */
+    void *address;                  /*< The address of the lock */
+    unsigned long acquired;         /*< No. of times the lock was acquired */
+    unsigned long contended;        /*< No. of acquisitions that had to wait */
+    unsigned long long wait_cycles; /*< Total cycles spent waiting */
+} SPINLOCK_INFO;
+
 #ifndef TRUE
 #define TRUE    true
 #endif
@@ -59,18 +82,17 @@ typedef struct spinlock
 #define FALSE   false
 #endif
 
-#if SPINLOCK_PROFILE
-#define SPINLOCK_INIT { 0, 0, 0, 0, 0, 0, 0, 0 }
-#else
 #define SPINLOCK_INIT { 0 }
-#endif
+#define SPINLOCK_INIT_NAMED(n) { 0, false, 0, 0, 0, (n) }
 
 #define SPINLOCK_IS_LOCKED(l) ((l)->lock != 0 ? true : false)
 
 extern void spinlock_init(SPINLOCK *lock);
+extern void spinlock_init_named(SPINLOCK *lock, const char *name);
 extern void spinlock_acquire(SPINLOCK *lock);
 extern int spinlock_acquire_nowait(SPINLOCK *lock);
 extern void spinlock_release(SPINLOCK *lock);
 extern void spinlock_stats(SPINLOCK *lock, void (*reporter)(void *, char *, int), void *hdl);
+extern int spinlock_contention(SPINLOCK_INFO *info, int n);
 
 #endif
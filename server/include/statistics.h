@@ -16,6 +16,13 @@
 /**
  * @file statistics.h  - Lock-free statistics gathering
  *
+ * Every thread updates its own copy of a statistic, which is on cache lines of
+ * its own, and the copies are combined when the statistic is read. A counter is
+ * read as the sum of the copies and a gauge set with ts_stats_set as their
+ * minimum, maximum or average. A histogram records values in log-linear
+ * buckets, eight for each power of two, so that the percentiles are accurate
+ * to within 12.5 percent of the value.
+ *
  * @verbatim
  * Revision History
  *
@@ -24,7 +31,36 @@
  * @endverbatim
  */
 
+#include <stdint.h>
+
 typedef void* ts_stats_t;
+typedef void* ts_histogram_t;
+
+/** How the values of the threads are combined */
+enum ts_stats_type
+{
+    TS_STATS_SUM,
+    TS_STATS_MIN,
+    TS_STATS_MAX,
+    TS_STATS_AVG
+};
+
+/** The number of buckets of a histogram */
+#define TS_HISTOGRAM_BUCKETS 312
+
+/** The summary of the values recorded in a histogram */
+typedef struct
+{
+    uint64_t count;     /*< No. of values */
+    uint64_t min;       /*< The smallest value */
+    uint64_t max;       /*< The largest value */
+    uint64_t sum;       /*< The sum of the values */
+    double   mean;      /*< The mean of the values */
+    uint64_t p50;       /*< The median */
+    uint64_t p90;       /*< The 90th percentile */
+    uint64_t p99;       /*< The 99th percentile */
+    uint64_t p999;      /*< The 99.9th percentile */
+} ts_histogram_summary_t;
 
 /** stats_init should be called only once */
 void ts_stats_init();
@@ -37,8 +73,16 @@ void ts_stats_set_thread_id(int id);
 
 ts_stats_t ts_stats_alloc();
 void ts_stats_free(ts_stats_t stats);
-void ts_stats_add(ts_stats_t stats, int value);
-void ts_stats_set(ts_stats_t stats, int value);
-int ts_stats_sum(ts_stats_t stats);
+void ts_stats_add(ts_stats_t stats, int64_t value);
+void ts_stats_set(ts_stats_t stats, int64_t value);
+int64_t ts_stats_sum(ts_stats_t stats);
+int64_t ts_stats_get(ts_stats_t stats, enum ts_stats_type type);
+
+ts_histogram_t ts_histogram_alloc();
+void ts_histogram_free(ts_histogram_t histogram);
+void ts_histogram_add(ts_histogram_t histogram, uint64_t value);
+void ts_histogram_get(ts_histogram_t histogram, int thread, ts_histogram_summary_t *summary);
+uint64_t ts_histogram_percentile(ts_histogram_t histogram, int thread, double pct);
+uint64_t ts_histogram_range(ts_histogram_t histogram, int thread, uint64_t lo, uint64_t hi);
 
 #endif
@@ -26,11 +26,16 @@
  * Thread type and thread identifier function macros
  */
 #include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
 #define THREAD         pthread_t
 #define thread_self()  pthread_self()
 
 extern THREAD *thread_start(THREAD *thd, void (*entry)(void *), void *arg);
 extern void thread_wait(THREAD thd);
 extern void thread_millisleep(int ms);
+extern bool thread_parse_cpulist(const char *str, cpu_set_t *set);
+extern bool thread_numa_node_cpus(int node, cpu_set_t *set);
+extern bool thread_set_cpus(cpu_set_t *set);
 
 #endif
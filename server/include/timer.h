@@ -0,0 +1,83 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file timer.h  - Hierarchical timer wheel
+ *
+ * A timer wheel keeps timers in slots indexed by their expiry time, which
+ * makes adding and removing a timer O(1) operations. The wheel has a root
+ * level of 256 slots of one heartbeat each and three further levels of 64
+ * slots, each level covering 64 times the time of the level below it. Timers
+ * on the upper levels are cascaded down as the time advances.
+ *
+ * The time is measured in housekeeper heartbeats, one heartbeat being 100
+ * milliseconds. Each polling thread has a wheel of its own that it services
+ * at the end of every polling loop, the housekeeper thread has a wheel for
+ * the housekeeper tasks.
+ */
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <spinlock.h>
+
+#define TIMER_ROOT_BITS  8
+#define TIMER_LEVEL_BITS 6
+#define TIMER_ROOT_SIZE  (1 << TIMER_ROOT_BITS)
+#define TIMER_LEVEL_SIZE (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS     3
+
+/** The longest time a timer can be set for, in heartbeats */
+#define TIMER_MAX_TICKS  ((1L << (TIMER_ROOT_BITS + TIMER_LEVELS * TIMER_LEVEL_BITS)) - 1)
+
+struct timer_wheel;
+
+/**
+ * A timer. The memory of the timer is owned by the caller, it is typically
+ * embedded in the structure the timer is for.
+ */
+typedef struct timer
+{
+    void (*fn)(void *data);      /*< The function to call when the timer expires */
+    void *data;                  /*< Data passed to the function */
+    long expires;                /*< The heartbeat at which the timer expires */
+    struct timer **slot;         /*< The slot the timer is in, NULL if not pending */
+    struct timer *next;          /*< Next timer in the slot */
+    struct timer *prev;          /*< Previous timer in the slot */
+    struct timer_wheel *wheel;   /*< The wheel the timer was last added to */
+} TIMER;
+
+/**
+ * A timer wheel. A zero filled wheel is a valid wheel whose time starts at 0.
+ */
+typedef struct timer_wheel
+{
+    SPINLOCK lock;                                        /*< Protects the wheel */
+    long current;                                         /*< The next heartbeat to process */
+    TIMER *root[TIMER_ROOT_SIZE];                         /*< The slots of the root level */
+    TIMER *levels[TIMER_LEVELS][TIMER_LEVEL_SIZE];        /*< The slots of the upper levels */
+    TIMER *expired;                                       /*< The expired timers being run */
+    TIMER *running;                                       /*< The timer whose function is running */
+    pthread_t running_thread;                             /*< The thread running the function */
+    int n_timers;                                         /*< No. of pending timers */
+} TIMER_WHEEL;
+
+extern void timer_wheel_init(TIMER_WHEEL *wheel, long now);
+extern int  timer_wheel_run(TIMER_WHEEL *wheel, long now);
+extern void timer_init(TIMER *timer, void (*fn)(void *), void *data);
+extern void timer_add(TIMER_WHEEL *wheel, TIMER *timer, long ticks);
+extern bool timer_remove(TIMER *timer);
+extern bool timer_pending(TIMER *timer);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file trace.h  - Sampled tracing of the query pipeline
+ *
+ * One in every N queries of a polling thread carries a trace record through
+ * the stages of the proxy. Each stage the query passes is stamped with the
+ * time-stamp counter and the completed records are kept in a ring that the
+ * show traces command of maxadmin prints. Only the queries whose latency is
+ * measured are traced, see session_latency_start.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <platform.h>
+#include <rdtsc.h>
+
+struct dcb;
+struct session;
+
+/** The number of completed traces kept */
+#define TRACE_RING_SIZE 1024
+
+/** The stages of a traced query, in the order the query passes them */
+typedef enum
+{
+    TRACE_CLIENT_READ,      /*< epoll returned the read event of the client */
+    TRACE_ROUTE,            /*< The query enters the filter chain */
+    TRACE_CLASSIFY,         /*< The query classifier returned the type of the query */
+    TRACE_TARGET,           /*< The router chose the server */
+    TRACE_BACKEND_WRITE,    /*< The query was written to the server */
+    TRACE_FIRST_REPLY,      /*< The first packets of the reply were read */
+    TRACE_CLIENT_WRITE,     /*< The last packet of the reply was written to the client */
+    TRACE_N_STAGES
+} trace_stage_t;
+
+/**
+ * The trace of a query. A session has one, which is active while a sampled
+ * query is in progress.
+ */
+typedef struct query_trace
+{
+    bool        active;                     /*< Whether the query is being traced */
+    size_t      ses_id;                     /*< The session of the query */
+    const char  *service;                   /*< The name of the service */
+    CYCLES      stamps[TRACE_N_STAGES];     /*< When the stages were passed, 0 if not */
+} QUERY_TRACE;
+
+/** The trace of the query being routed by the calling thread, if any */
+extern thread_local QUERY_TRACE *trace_current;
+
+extern void trace_init(int sample);
+extern void trace_start(struct session *session, CYCLES received);
+extern void trace_cancel(struct session *session);
+extern void trace_end(struct session *session);
+extern void dShowQueryTraces(struct dcb *dcb);
+
+/**
+ * Stamp a stage of a traced query. Only the first pass of a stage is recorded.
+ *
+ * @param trace The trace, may be NULL
+ * @param stage The stage
+ */
+static inline void trace_point(QUERY_TRACE *trace, trace_stage_t stage)
+{
+    if (trace && trace->active && trace->stamps[stage] == 0)
+    {
+        trace->stamps[stage] = rdtsc();
+    }
+}
+
+/**
+ * Called when the routing of a query returns, the stages after this are
+ * stamped through the session.
+ */
+static inline void trace_routed()
+{
+    trace_current = NULL;
+}
+
+#endif
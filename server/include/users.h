@@ -15,6 +15,7 @@
 #include <hashtable.h>
 #include <dcb.h>
 #include <openssl/sha.h>
+#include <epoch.h>
 
 /**
  * @file users.h The functions to manipulate the table of users maintained
@@ -28,6 +29,9 @@
  * 26/02/14     Massimiliano Pinto      Added checksum to users' table with SHA1
  * 27/02/14     Massimiliano Pinto      Added USERS_HASHTABLE_DEFAULT_SIZE
  * 28/02/14     Massimiliano Pinto      Added usersCustomUserFormat, optional username format routine
+ * 15/10/2016   Core Team               Added users_retire
+ * 15/10/2016   Core Team               Added the entry index
+ * 15/10/2016   Core Team               Added anonymous
  *
  * @endverbatim
  */
@@ -55,10 +59,14 @@ typedef struct users
     char *(*usersCustomUserFormat)(void *); /**< Optional username format routine */
     USERS_STATS stats;                      /**< The statistics for the users table */
     unsigned char cksum[SHA_DIGEST_LENGTH]; /**< The users' table ckecksum */
+    EPOCH_ENTRY retire;                     /**< Deferred freeing of a replaced table */
+    HASHTABLE *index;                       /**< Optional index of the entries, freed with the table */
+    bool anonymous;                         /**< The backends have anonymous users */
 } USERS;
 
 extern USERS *users_alloc();                      /**< Allocate a users table */
 extern void users_free(USERS *);                  /**< Free a users table */
+extern void users_retire(USERS *);                /**< Free a replaced users table once unused */
 extern int users_add(USERS *, char *, char *);    /**< Add a user to the users table */
 extern int users_delete(USERS *, char *);         /**< Delete a user from the users table */
 extern char *users_fetch(USERS *, char *);        /**< Fetch the authentication data for a user */
@@ -21,6 +21,9 @@
  * Revision History
  * Date         Who                     Description
  * 02/02/2016   Martin Brampton         Initial version
+ * 15/10/2016   Core Team               Per-listener cache of recent logins
+ * 15/10/2016   Core Team               Reload the users in the background on failure
+ * 15/10/2016   Core Team               Find the user with the grant index of the users table
  *
  * @endverbatim
  */
@@ -29,6 +32,9 @@
 #include <mysql_client_server_protocol.h>
 #include <gw_authenticator.h>
 #include <maxscale/poll.h>
+#include <listener.h>
+#include <spinlock.h>
+#include <hk_heartbeat.h>
 
 /* @see function load_module in load_utils.c for explanation of the following
  * lint directives.
@@ -75,6 +81,34 @@ static int mysql_auth_set_client_data(
     MySQLProtocol *protocol,
     GWBUF         *buffer);
 
+/** Number of entries in the authentication cache of a listener */
+#define MYSQL_AUTH_CACHE_SIZE 256
+
+/** How long a cached login stays valid, in heartbeats (100 milliseconds) */
+#define MYSQL_AUTH_CACHE_TTL 50
+
+/**
+ * A recent successful login. The stored SHA1(SHA1(password)) of the user
+ * is kept in binary form so that a later login of the same user from the
+ * same address to the same database skips the users table lookups with
+ * their wildcard fallbacks and the hex decoding.
+ */
+typedef struct
+{
+    char            user[MYSQL_USER_MAXLEN + 1];
+    char            db[MYSQL_DATABASE_MAXLEN + 1];
+    struct in_addr  addr;
+    void            *users;       /**< The users table the entry was resolved from */
+    long            expires;      /**< Heartbeat after which the entry is not used */
+    uint8_t         password[SHA_DIGEST_LENGTH];
+} MYSQL_AUTH_CACHE_ENTRY;
+
+typedef struct
+{
+    SPINLOCK               lock;
+    MYSQL_AUTH_CACHE_ENTRY entries[MYSQL_AUTH_CACHE_SIZE];
+} MYSQL_AUTH_CACHE;
+
 /**
  * Implementation of the mandatory version entry point
  *
@@ -170,12 +204,12 @@ mysql_auth_authenticate(DCB *dcb)
         auth_ret = combined_auth_check(dcb, client_data->auth_token, client_data->auth_token_len,
                                        protocol, client_data->user, client_data->client_sha1, client_data->db);
 
-        /* On failed authentication try to load user table from backend database */
-        /* Success for service_refresh_users returns 0 */
-        if (MYSQL_AUTH_SUCCEEDED != auth_ret && 0 == service_refresh_users(dcb->service))
+        /* On failed authentication load the user table from the backend database
+         * in the background, the polling thread is not stalled by the queries.
+         * The user can log in once the new table is in place. */
+        if (MYSQL_AUTH_SUCCEEDED != auth_ret)
         {
-            auth_ret = combined_auth_check(dcb, client_data->auth_token, client_data->auth_token_len, protocol,
-                                           client_data->user, client_data->client_sha1, client_data->db);
+            service_refresh_users_async(dcb->service);
         }
 
         /* on successful authentication, set user into dcb field */
@@ -442,6 +476,7 @@ int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password,
     memcpy(&key.ipv4, client, sizeof(struct sockaddr_in));
     key.netmask = 32;
     key.resource = client_data->db;
+    key.hostname[0] = '\0';
     if (strlen(dcb->remote) < MYSQL_HOST_MAXLEN)
     {
         strcpy(key.hostname, dcb->remote);
@@ -454,124 +489,192 @@ int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password,
               key.resource != NULL ? " db: " : "",
               key.resource != NULL ? key.resource : "");
 
-    /* look for user@current_ipv4 now */
-    user_password = mysql_users_fetch(service->users, &key);
+    /*
+     * Look for the user on the current IPv4 address, its class C, B and A
+     * networks, the hostname patterns and finally the wildcard host, user@%.
+     * Localhost, 127.0.0.1, only matches the exact address unless the service
+     * allows it to match the wildcard hosts.
+     */
+    bool wildcards = key.ipv4.sin_addr.s_addr != 0x0100007F ||
+                     dcb->service->localhost_match_wildcard_host;
+
+    user_password = mysql_users_find(service->users, &key, wildcards);
 
     if (!user_password)
     {
-        /* The user is not authenticated @ current IPv4 */
+        MXS_DEBUG("%lu [MySQL Client Auth], user [%s@%s] not existent",
+                  pthread_self(),
+                  key.user,
+                  dcb->remote);
+
+        MXS_INFO("Authentication Failed: user [%s@%s] not found.",
+                 key.user,
+                 dcb->remote);
+    }
 
-        while (1)
+    /* If user@host has been found we get the the password in binary format*/
+    if (user_password)
+    {
+        /*
+         * Convert the hex data (40 bytes) to binary (20 bytes).
+         * The gateway_password represents the SHA1(SHA1(real_password)).
+         * Please note: the real_password is unknown and SHA1(real_password) is unknown as well
+         */
+        int passwd_len = strlen(user_password);
+        if (passwd_len)
         {
-            /*
-             * (1) Check for localhost first: 127.0.0.1 (IPv4 only)
-             */
-
-            if ((key.ipv4.sin_addr.s_addr == 0x0100007F) &&
-                !dcb->service->localhost_match_wildcard_host)
-            {
-                /* Skip the wildcard check and return 1 */
-                break;
-            }
-
-            /*
-             * (2) check for possible IPv4 class C,B,A networks
-             */
+            passwd_len = (passwd_len <= (SHA_DIGEST_LENGTH * 2)) ? passwd_len : (SHA_DIGEST_LENGTH * 2);
+            gw_hex2bin(gateway_password, user_password, passwd_len);
+        }
 
-            /* Class C check */
-            key.ipv4.sin_addr.s_addr &= 0x00FFFFFF;
-            key.netmask -= 8;
+        return 0;
+    }
+    else
+    {
+        return 1;
+    }
+}
 
-            user_password = mysql_users_fetch(service->users, &key);
+/**
+ * @brief Get the authentication cache of the listener of a client DCB
+ *
+ * The cache is created when the first login through the listener is checked.
+ *
+ * @param dcb The client DCB
+ * @return The cache or NULL if the DCB has no listener or memory ran out
+ */
+static MYSQL_AUTH_CACHE* auth_cache_get(DCB *dcb)
+{
+    SERV_LISTENER *listener = dcb->listener;
 
-            if (user_password)
-            {
-                break;
-            }
+    if (listener == NULL)
+    {
+        return NULL;
+    }
 
-            /* Class B check */
-            key.ipv4.sin_addr.s_addr &= 0x0000FFFF;
-            key.netmask -= 8;
+    if (listener->auth_cache == NULL)
+    {
+        MYSQL_AUTH_CACHE *cache = calloc(1, sizeof(MYSQL_AUTH_CACHE));
 
-            user_password = mysql_users_fetch(service->users, &key);
+        if (cache)
+        {
+            spinlock_init(&cache->lock);
 
-            if (user_password)
+            if (!__sync_bool_compare_and_swap(&listener->auth_cache, NULL, cache))
             {
-                break;
+                free(cache);
             }
+        }
+    }
 
-            /* Class A check */
-            key.ipv4.sin_addr.s_addr &= 0x000000FF;
-            key.netmask -= 8;
+    return listener->auth_cache;
+}
 
-            user_password = mysql_users_fetch(service->users, &key);
+/**
+ * Find the cache slot of a login
+ *
+ * @param cache  The authentication cache
+ * @param user   The user name
+ * @param db     The requested database
+ * @param addr   The client address
+ * @return The slot where the login is stored
+ */
+static MYSQL_AUTH_CACHE_ENTRY* auth_cache_slot(MYSQL_AUTH_CACHE *cache, const char *user,
+                                              const char *db, struct in_addr addr)
+{
+    uint32_t hash = 2166136261u ^ addr.s_addr;
 
-            if (user_password)
-            {
-                break;
-            }
+    for (const char *c = user; *c; c++)
+    {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
 
-            /*
-             * (3) Continue check for wildcard host, user@%
-             */
+    for (const char *c = db; *c; c++)
+    {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
 
-            memset(&key.ipv4, 0, sizeof(struct sockaddr_in));
-            key.netmask = 0;
+    return &cache->entries[hash % MYSQL_AUTH_CACHE_SIZE];
+}
 
-            MXS_DEBUG("%lu [MySQL Client Auth], checking user [%s@%s] with "
-                      "wildcard host [%%]",
-                      pthread_self(),
-                      key.user,
-                      dcb->remote);
+/**
+ * @brief Look up the stored password of a user from the authentication cache
+ *
+ * @param dcb      The client DCB
+ * @param username The user name
+ * @param password Buffer of SHA_DIGEST_LENGTH bytes for SHA1(SHA1(password))
+ * @return True if a valid cached entry was found
+ */
+static bool auth_cache_fetch(DCB *dcb, char *username, uint8_t *password)
+{
+    MYSQL_AUTH_CACHE *cache = auth_cache_get(dcb);
+    MYSQL_session *client_data = (MYSQL_session *)dcb->data;
+    bool rval = false;
 
-            user_password = mysql_users_fetch(service->users, &key);
+    if (cache == NULL || client_data == NULL)
+    {
+        return false;
+    }
 
-            if (user_password)
-            {
-                break;
-            }
+    struct in_addr addr = dcb->ipv4.sin_addr;
+    MYSQL_AUTH_CACHE_ENTRY *entry = auth_cache_slot(cache, username, client_data->db, addr);
 
-            if (!user_password)
-            {
-                /*
-                 * user@% not found.
-                 */
-
-                MXS_DEBUG("%lu [MySQL Client Auth], user [%s@%s] not existent",
-                          pthread_self(),
-                          key.user,
-                          dcb->remote);
-
-                MXS_INFO("Authentication Failed: user [%s@%s] not found.",
-                         key.user,
-                         dcb->remote);
-                break;
-            }
+    spinlock_acquire(&cache->lock);
 
-        }
+    if (entry->expires >= hkheartbeat &&
+        entry->users == dcb->service->users &&
+        entry->addr.s_addr == addr.s_addr &&
+        strcmp(entry->user, username) == 0 &&
+        strcmp(entry->db, client_data->db) == 0)
+    {
+        memcpy(password, entry->password, SHA_DIGEST_LENGTH);
+        rval = true;
     }
 
-    /* If user@host has been found we get the the password in binary format*/
-    if (user_password)
-    {
-        /*
-         * Convert the hex data (40 bytes) to binary (20 bytes).
-         * The gateway_password represents the SHA1(SHA1(real_password)).
-         * Please note: the real_password is unknown and SHA1(real_password) is unknown as well
-         */
-        int passwd_len = strlen(user_password);
-        if (passwd_len)
-        {
-            passwd_len = (passwd_len <= (SHA_DIGEST_LENGTH * 2)) ? passwd_len : (SHA_DIGEST_LENGTH * 2);
-            gw_hex2bin(gateway_password, user_password, passwd_len);
-        }
+    spinlock_release(&cache->lock);
 
-        return 0;
+    if (rval)
+    {
+        atomic_add(&dcb->listener->auth_cache_hits, 1);
     }
     else
     {
-        return 1;
+        atomic_add(&dcb->listener->auth_cache_misses, 1);
+    }
+
+    return rval;
+}
+
+/**
+ * @brief Store a successful login in the authentication cache
+ *
+ * @param dcb      The client DCB
+ * @param username The user name
+ * @param password The SHA1(SHA1(password)) the login was checked against
+ */
+static void auth_cache_store(DCB *dcb, char *username, uint8_t *password)
+{
+    MYSQL_AUTH_CACHE *cache = auth_cache_get(dcb);
+    MYSQL_session *client_data = (MYSQL_session *)dcb->data;
+
+    if (cache == NULL || client_data == NULL ||
+        strlen(username) > MYSQL_USER_MAXLEN ||
+        strlen(client_data->db) > MYSQL_DATABASE_MAXLEN)
+    {
+        return;
     }
+
+    struct in_addr addr = dcb->ipv4.sin_addr;
+    MYSQL_AUTH_CACHE_ENTRY *entry = auth_cache_slot(cache, username, client_data->db, addr);
+
+    spinlock_acquire(&cache->lock);
+    strcpy(entry->user, username);
+    strcpy(entry->db, client_data->db);
+    entry->addr = addr;
+    entry->users = dcb->service->users;
+    entry->expires = hkheartbeat + MYSQL_AUTH_CACHE_TTL;
+    memcpy(entry->password, password, SHA_DIGEST_LENGTH);
+    spinlock_release(&cache->lock);
 }
 
 /**
@@ -615,9 +718,12 @@ gw_check_mysql_scramble_data(DCB *dcb,
     /*<
      * get the user's password from repository in SHA1(SHA1(real_password));
      * please note 'real_password' is unknown!
+     * A recent login of the same user from the same address already resolved it.
      */
 
-    if (gw_find_mysql_user_password_sha1(username, password, dcb))
+    bool cached = auth_cache_fetch(dcb, username, password);
+
+    if (!cached && gw_find_mysql_user_password_sha1(username, password, dcb))
     {
         /* if password was sent, fill stage1_hash with at least 1 byte in order
          * to create right error message: (using password: YES|NO)
@@ -642,8 +748,17 @@ gw_check_mysql_scramble_data(DCB *dcb,
     else
     {
         /* check if the password is not set in the user table */
-        return memcmp(password, null_client_sha1, MYSQL_SCRAMBLE_LEN) ?
-               MYSQL_FAILED_AUTH : MYSQL_AUTH_SUCCEEDED;
+        if (memcmp(password, null_client_sha1, MYSQL_SCRAMBLE_LEN))
+        {
+            return MYSQL_FAILED_AUTH;
+        }
+
+        if (!cached)
+        {
+            auth_cache_store(dcb, username, password);
+        }
+
+        return MYSQL_AUTH_SUCCEEDED;
     }
 
     /*<
@@ -697,8 +812,17 @@ gw_check_mysql_scramble_data(DCB *dcb,
 #endif
 
     /* now compare SHA1(SHA1(gateway_password)) and check_hash: return 0 is MYSQL_AUTH_OK */
-    return (0 == memcmp(password, check_hash, SHA_DIGEST_LENGTH)) ?
-           MYSQL_AUTH_SUCCEEDED : MYSQL_FAILED_AUTH;
+    if (memcmp(password, check_hash, SHA_DIGEST_LENGTH))
+    {
+        return MYSQL_FAILED_AUTH;
+    }
+
+    if (!cached)
+    {
+        auth_cache_store(dcb, username, password);
+    }
+
+    return MYSQL_AUTH_SUCCEEDED;
 }
 
 /**
@@ -0,0 +1,1009 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file admissionfilter.c - Limit the number of concurrently executed queries
+ * @verbatim
+ *
+ * The admission control filter caps the number of queries of a service that
+ * are being executed by the backend servers at the same time. A query is
+ * admitted if there is room for it and otherwise it is held by the filter in
+ * one of the priority queues. When an admitted query gets its first reply,
+ * the room it took is given to the highest priority query that has waited
+ * the longest. Queries that wait longer than the queue timeout are answered
+ * with an error.
+ *
+ * The parameters of the filter are:
+ *
+ *      max_queries         Maximum number of queries executed at the same time
+ *      max_user_queries    Maximum number of queries of one user executed at
+ *                          the same time, 0 for no limit
+ *      max_queued          Maximum number of queued queries, 0 for no limit
+ *      queue_timeout       Milliseconds a query may wait in the queue
+ *      high_priority_users Comma-separated list of users with a high priority
+ *      low_priority_users  Comma-separated list of users with a low priority
+ *      low_priority_type   Classify the statements and give reads or writes
+ *                          a low priority, either read or write
+ *
+ * A session holds at most one slot. Queries that the client pipelines while
+ * its previous query is executed share the slot of that query and the
+ * queries received while the session waits in a queue are admitted with it.
+ *
+ * Date         Who             Description
+ * 15/10/2016   Core Team       Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+#include <string.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <hashtable.h>
+#include <session.h>
+#include <timer.h>
+#include <query_classifier.h>
+#include <maxscale/poll.h>
+
+MODULE_INFO info =
+{
+    MODULE_API_FILTER,
+    MODULE_ALPHA_RELEASE,
+    FILTER_VERSION,
+    "A filter that limits the number of concurrently executed queries"
+};
+
+static char *version_str = "V1.0.0";
+
+/*
+ * The filter entry points
+ */
+static FILTER *createInstance(char **options, FILTER_PARAMETER **);
+static void *newSession(FILTER *instance, SESSION *session);
+static void closeSession(FILTER *instance, void *session);
+static void freeSession(FILTER *instance, void *session);
+static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static int clientReply(FILTER *instance, void *fsession, GWBUF *queue);
+static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static uint64_t getInterest(FILTER *instance);
+
+static FILTER_OBJECT MyObject =
+{
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    clientReply,
+    diagnostic,
+    getInterest,
+    NULL,               // No getStatements
+};
+
+/** The default time a query may wait in the queue, in milliseconds */
+#define ADM_DEFAULT_TIMEOUT 5000
+
+/** Milliseconds in one heartbeat */
+#define ADM_HEARTBEAT_MS 100
+
+/** The error sent to queries that are not admitted */
+#define ADM_ERRNO 1040
+
+/**
+ * The priorities of the queries, the queues are served in this order
+ */
+enum adm_priority
+{
+    ADM_HIGH,
+    ADM_NORMAL,
+    ADM_LOW,
+    ADM_N_PRIORITIES
+};
+
+static const char *priority_names[] = {"high", "normal", "low"};
+
+/**
+ * The number of queries a user is executing
+ */
+typedef struct
+{
+    int active;                     /*< Admitted queries of the user */
+} ADM_USER;
+
+/**
+ * The session structure for this filter
+ */
+typedef struct adm_session
+{
+    DOWNSTREAM down;                /*< The downstream filter */
+    UPSTREAM up;                    /*< The upstream filter */
+    struct adm_instance *instance;  /*< The filter instance */
+    SESSION *session;               /*< The client session */
+    ADM_USER *user;                 /*< The counter of the user, NULL if users are not limited */
+    enum adm_priority priority;     /*< Priority of the queries of the session */
+    enum adm_priority queue;        /*< The queue the session waits in */
+    bool active;                    /*< The session holds a slot */
+    bool waiting;                   /*< The session waits in a queue */
+    bool routing;                   /*< The held queries are being routed */
+    GWBUF *held;                    /*< The queries waiting to be routed */
+    TIMER timer;                    /*< Fires when the queue timeout is reached */
+    struct adm_session *next;       /*< Next session in the queue */
+    struct adm_session *prev;       /*< Previous session in the queue */
+    struct adm_session *ready;      /*< Next admitted session to be routed */
+} ADM_SESSION;
+
+/**
+ * The statistics of an instance
+ */
+typedef struct
+{
+    int n_admitted;                 /*< Queries admitted right away */
+    int n_queued;                   /*< Queries that waited in a queue */
+    int n_timeout;                  /*< Queries that waited too long */
+    int n_rejected;                 /*< Queries rejected because the queues were full */
+} ADM_STATS;
+
+/**
+ * The instance structure
+ */
+typedef struct adm_instance
+{
+    SPINLOCK lock;                  /*< Protects the counters and the queues */
+    int max_queries;                /*< Maximum number of admitted queries */
+    int max_user_queries;           /*< Maximum number of admitted queries of a user */
+    int max_queued;                 /*< Maximum number of queued sessions */
+    int timeout;                    /*< Queue timeout in milliseconds */
+    char *high_users;               /*< Users with a high priority */
+    char *low_users;                /*< Users with a low priority */
+    uint32_t low_type;              /*< Query types with a low priority */
+    HASHTABLE *users;               /*< The ADM_USER counters keyed by user name */
+    int active;                     /*< Admitted queries */
+    int n_waiting;                  /*< Sessions waiting in the queues */
+    ADM_SESSION *head[ADM_N_PRIORITIES]; /*< The queues, oldest first */
+    ADM_SESSION *tail[ADM_N_PRIORITIES];
+    ADM_STATS stats;
+} ADM_INSTANCE;
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+    return version_str;
+}
+
+/**
+ * The module initialization routine, called when the module
+ * is first loaded.
+ */
+void
+ModuleInit()
+{
+}
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+    return &MyObject;
+}
+
+/**
+ * Check whether a comma-separated list contains a name
+ *
+ * @param list The list, may be NULL
+ * @param name The name to look for
+ * @return True if the name is in the list
+ */
+static bool
+list_contains(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+
+    while (list && *list)
+    {
+        while (*list == ' ' || *list == ',')
+        {
+            list++;
+        }
+
+        const char *end = list;
+
+        while (*end && *end != ',' && *end != ' ')
+        {
+            end++;
+        }
+
+        if ((size_t)(end - list) == len && strncmp(list, name, len) == 0)
+        {
+            return true;
+        }
+
+        list = end;
+    }
+
+    return false;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options  The options for this filter
+ * @param params   The array of name/value pair parameters for the filter
+ *
+ * @return The instance data for this new instance
+ */
+static FILTER *
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+    ADM_INSTANCE *my_instance;
+
+    if ((my_instance = calloc(1, sizeof(ADM_INSTANCE))) != NULL)
+    {
+        spinlock_init(&my_instance->lock);
+        my_instance->timeout = ADM_DEFAULT_TIMEOUT;
+        bool error = false;
+
+        for (int i = 0; params && params[i]; i++)
+        {
+            if (!strcmp(params[i]->name, "max_queries"))
+            {
+                my_instance->max_queries = atoi(params[i]->value);
+            }
+            else if (!strcmp(params[i]->name, "max_user_queries"))
+            {
+                my_instance->max_user_queries = atoi(params[i]->value);
+            }
+            else if (!strcmp(params[i]->name, "max_queued"))
+            {
+                my_instance->max_queued = atoi(params[i]->value);
+            }
+            else if (!strcmp(params[i]->name, "queue_timeout"))
+            {
+                my_instance->timeout = atoi(params[i]->value);
+            }
+            else if (!strcmp(params[i]->name, "high_priority_users"))
+            {
+                my_instance->high_users = strdup(params[i]->value);
+            }
+            else if (!strcmp(params[i]->name, "low_priority_users"))
+            {
+                my_instance->low_users = strdup(params[i]->value);
+            }
+            else if (!strcmp(params[i]->name, "low_priority_type"))
+            {
+                if (!strcmp(params[i]->value, "read"))
+                {
+                    my_instance->low_type = QUERY_TYPE_READ;
+                }
+                else if (!strcmp(params[i]->value, "write"))
+                {
+                    my_instance->low_type = QUERY_TYPE_WRITE;
+                }
+                else
+                {
+                    MXS_ERROR("admissionfilter: Unknown value for 'low_priority_type': %s. "
+                              "Expected 'read' or 'write'.", params[i]->value);
+                    error = true;
+                }
+            }
+            else if (!filter_standard_parameter(params[i]->name))
+            {
+                MXS_ERROR("admissionfilter: Unexpected parameter '%s'.", params[i]->name);
+                error = true;
+            }
+        }
+
+        if (options && options[0])
+        {
+            MXS_ERROR("admissionfilter: The filter does not support any options.");
+            error = true;
+        }
+
+        if (my_instance->max_queries <= 0)
+        {
+            MXS_ERROR("admissionfilter: Missing or invalid required parameter 'max_queries'.");
+            error = true;
+        }
+
+        if (my_instance->max_user_queries < 0 || my_instance->max_queued < 0 ||
+            my_instance->timeout <= 0)
+        {
+            MXS_ERROR("admissionfilter: The values of 'max_user_queries' and 'max_queued' "
+                      "must not be negative and 'queue_timeout' must be positive.");
+            error = true;
+        }
+
+        if (!error && my_instance->max_user_queries > 0)
+        {
+            if ((my_instance->users = hashtable_alloc(100, simple_str_hash, strcmp)) == NULL)
+            {
+                error = true;
+            }
+            else
+            {
+                hashtable_memory_fns(my_instance->users, (HASHMEMORYFN) strdup, NULL,
+                                     (HASHMEMORYFN) free, (HASHMEMORYFN) free);
+            }
+        }
+
+        if (error)
+        {
+            free(my_instance->high_users);
+            free(my_instance->low_users);
+            free(my_instance);
+            my_instance = NULL;
+        }
+    }
+
+    return (FILTER *)my_instance;
+}
+
+/**
+ * Check whether a session can be given a slot. Called with the instance lock held.
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The session
+ * @return True if the session can be admitted
+ */
+static inline bool
+can_admit(ADM_INSTANCE *my_instance, ADM_SESSION *my_session)
+{
+    return my_instance->active < my_instance->max_queries &&
+           (my_session->user == NULL || my_session->user->active < my_instance->max_user_queries);
+}
+
+/**
+ * Give a slot to a session. Called with the instance lock held.
+ */
+static inline void
+take_slot(ADM_INSTANCE *my_instance, ADM_SESSION *my_session)
+{
+    my_session->active = true;
+    my_instance->active++;
+
+    if (my_session->user)
+    {
+        my_session->user->active++;
+    }
+}
+
+/**
+ * Free the slot of a session. Called with the instance lock held.
+ */
+static inline void
+free_slot(ADM_INSTANCE *my_instance, ADM_SESSION *my_session)
+{
+    my_session->active = false;
+    my_instance->active--;
+
+    if (my_session->user)
+    {
+        my_session->user->active--;
+    }
+}
+
+/**
+ * Add a session to the end of a queue. Called with the instance lock held.
+ */
+static void
+queue_push(ADM_INSTANCE *my_instance, ADM_SESSION *my_session, enum adm_priority prio)
+{
+    my_session->queue = prio;
+    my_session->waiting = true;
+    my_session->next = NULL;
+    my_session->prev = my_instance->tail[prio];
+
+    if (my_instance->tail[prio])
+    {
+        my_instance->tail[prio]->next = my_session;
+    }
+    else
+    {
+        my_instance->head[prio] = my_session;
+    }
+
+    my_instance->tail[prio] = my_session;
+    my_instance->n_waiting++;
+}
+
+/**
+ * Remove a session from its queue. Called with the instance lock held.
+ */
+static void
+queue_remove(ADM_INSTANCE *my_instance, ADM_SESSION *my_session)
+{
+    enum adm_priority prio = my_session->queue;
+
+    if (my_session->prev)
+    {
+        my_session->prev->next = my_session->next;
+    }
+    else
+    {
+        my_instance->head[prio] = my_session->next;
+    }
+
+    if (my_session->next)
+    {
+        my_session->next->prev = my_session->prev;
+    }
+    else
+    {
+        my_instance->tail[prio] = my_session->prev;
+    }
+
+    my_session->next = my_session->prev = NULL;
+    my_session->waiting = false;
+    my_instance->n_waiting--;
+}
+
+/**
+ * Check whether sessions of the same or a higher priority are waiting for
+ * a slot. Called with the instance lock held.
+ */
+static inline bool
+queue_has_waiting(ADM_INSTANCE *my_instance, enum adm_priority prio)
+{
+    for (int i = 0; i <= (int)prio; i++)
+    {
+        if (my_instance->head[i])
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Give the free slots to the waiting sessions, highest priority first. The
+ * sessions that are limited by the number of queries of their user are
+ * skipped. Called with the instance lock held.
+ *
+ * @param my_instance The filter instance
+ * @return The admitted sessions linked by their ready pointers
+ */
+static ADM_SESSION *
+admit_waiting(ADM_INSTANCE *my_instance)
+{
+    ADM_SESSION *ready = NULL;
+
+    for (int i = 0; i < ADM_N_PRIORITIES && my_instance->active < my_instance->max_queries; i++)
+    {
+        ADM_SESSION *my_session = my_instance->head[i];
+
+        while (my_session && my_instance->active < my_instance->max_queries)
+        {
+            ADM_SESSION *next = my_session->next;
+
+            if (can_admit(my_instance, my_session))
+            {
+                queue_remove(my_instance, my_session);
+                take_slot(my_instance, my_session);
+                my_session->routing = true;
+                my_session->ready = ready;
+                ready = my_session;
+            }
+
+            my_session = next;
+        }
+    }
+
+    return ready;
+}
+
+/**
+ * Take the next packet from the held queries. The streamed continuation of a
+ * packet is not made of complete packets and is taken as it was received.
+ *
+ * @param held The held queries
+ * @return The next packet or NULL if none are left
+ */
+static GWBUF*
+next_held_packet(GWBUF **held)
+{
+    GWBUF *buf = *held;
+
+    if (buf && GWBUF_IS_TYPE_STREAM(buf))
+    {
+        size_t len = 0;
+
+        while (buf && GWBUF_IS_TYPE_STREAM(buf))
+        {
+            len += GWBUF_LENGTH(buf);
+            buf = buf->next;
+        }
+
+        return gwbuf_split(held, len);
+    }
+
+    return modutil_get_next_MySQL_packet(held);
+}
+
+/**
+ * Route the held queries of admitted sessions. The queries that the clients
+ * send while this is done are appended to the held queries so that they are
+ * routed in the order they were received. The reference to the session that
+ * was taken when the session was queued is released.
+ *
+ * @param my_instance The filter instance
+ * @param ready       The admitted sessions
+ */
+static void
+route_ready(ADM_INSTANCE *my_instance, ADM_SESSION *ready)
+{
+    while (ready)
+    {
+        ADM_SESSION *my_session = ready;
+        SESSION *session = my_session->session;
+        ready = my_session->ready;
+
+        timer_remove(&my_session->timer);
+
+        while (true)
+        {
+            spinlock_acquire(&my_instance->lock);
+            GWBUF *held = my_session->held;
+            my_session->held = NULL;
+            my_session->routing = held != NULL;
+            spinlock_release(&my_instance->lock);
+
+            if (held == NULL)
+            {
+                break;
+            }
+
+            GWBUF *packet;
+
+            while ((packet = next_held_packet(&held)))
+            {
+                if (session->state == SESSION_STATE_ROUTER_READY)
+                {
+                    my_session->down.routeQuery(my_session->down.instance,
+                                                my_session->down.session,
+                                                packet);
+                }
+                else
+                {
+                    gwbuf_free(packet);
+                }
+            }
+
+            gwbuf_free(held);
+        }
+
+        session_free(session);
+    }
+}
+
+/**
+ * Free the slot of a session and give the free slots to waiting sessions
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The session that holds a slot
+ */
+static void
+release_slot(ADM_INSTANCE *my_instance, ADM_SESSION *my_session)
+{
+    spinlock_acquire(&my_instance->lock);
+
+    if (my_session->active)
+    {
+        free_slot(my_instance, my_session);
+    }
+
+    ADM_SESSION *ready = admit_waiting(my_instance);
+    spinlock_release(&my_instance->lock);
+
+    route_ready(my_instance, ready);
+}
+
+/**
+ * Send an error to the client of a session
+ *
+ * @param my_session The filter session
+ * @param msg        The error message
+ */
+static void
+send_error(ADM_SESSION *my_session, const char *msg)
+{
+    DCB *dcb = my_session->session->client_dcb;
+    GWBUF *err = modutil_create_mysql_err_msg(1, 0, ADM_ERRNO, "HY000", msg);
+
+    if (err && dcb)
+    {
+        dcb->func.write(dcb, err);
+    }
+    else
+    {
+        gwbuf_free(err);
+    }
+}
+
+/**
+ * Called when a session has waited in a queue for too long. The held queries
+ * are discarded and the client gets an error.
+ *
+ * @param data The filter session
+ */
+static void
+queue_timeout(void *data)
+{
+    ADM_SESSION *my_session = (ADM_SESSION *)data;
+    ADM_INSTANCE *my_instance = my_session->instance;
+    GWBUF *held = NULL;
+    bool timed_out = false;
+
+    spinlock_acquire(&my_instance->lock);
+
+    if (my_session->waiting)
+    {
+        queue_remove(my_instance, my_session);
+        held = my_session->held;
+        my_session->held = NULL;
+        my_instance->stats.n_timeout++;
+        timed_out = true;
+    }
+
+    spinlock_release(&my_instance->lock);
+
+    if (timed_out)
+    {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Query was not admitted within %d milliseconds.",
+                 my_instance->timeout);
+
+        gwbuf_free(held);
+        send_error(my_session, msg);
+        session_free(my_session->session);
+    }
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session itself
+ *
+ * @return Session specific data for this session
+ */
+static void *
+newSession(FILTER *instance, SESSION *session)
+{
+    ADM_INSTANCE *my_instance = (ADM_INSTANCE *)instance;
+    ADM_SESSION *my_session;
+    const char *user = session_getUser(session);
+
+    if ((my_session = calloc(1, sizeof(ADM_SESSION))) != NULL)
+    {
+        my_session->instance = my_instance;
+        my_session->session = session;
+        my_session->priority = ADM_NORMAL;
+        timer_init(&my_session->timer, queue_timeout, my_session);
+
+        if (user)
+        {
+            if (list_contains(my_instance->high_users, user))
+            {
+                my_session->priority = ADM_HIGH;
+            }
+            else if (list_contains(my_instance->low_users, user))
+            {
+                my_session->priority = ADM_LOW;
+            }
+        }
+
+        if (my_instance->users)
+        {
+            const char *key = user ? user : "";
+
+            spinlock_acquire(&my_instance->lock);
+
+            if ((my_session->user = hashtable_fetch(my_instance->users, (void *)key)) == NULL &&
+                (my_session->user = calloc(1, sizeof(ADM_USER))) != NULL &&
+                !hashtable_add(my_instance->users, (void *)key, my_session->user))
+            {
+                free(my_session->user);
+                my_session->user = NULL;
+            }
+
+            spinlock_release(&my_instance->lock);
+
+            if (my_session->user == NULL)
+            {
+                MXS_ERROR("admissionfilter: Memory allocation failed.");
+                free(my_session);
+                my_session = NULL;
+            }
+        }
+    }
+
+    return my_session;
+}
+
+/**
+ * Close a session with the filter. A session that is waiting in a queue
+ * holds a reference to the session, so this is only called for sessions
+ * that are not queued. The slot of the session, if it has one, is given to
+ * the waiting sessions.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+closeSession(FILTER *instance, void *session)
+{
+    ADM_INSTANCE *my_instance = (ADM_INSTANCE *)instance;
+    ADM_SESSION *my_session = (ADM_SESSION *)session;
+    GWBUF *held = NULL;
+
+    spinlock_acquire(&my_instance->lock);
+
+    if (my_session->waiting)
+    {
+        queue_remove(my_instance, my_session);
+    }
+
+    held = my_session->held;
+    my_session->held = NULL;
+    spinlock_release(&my_instance->lock);
+
+    timer_remove(&my_session->timer);
+    gwbuf_free(held);
+
+    if (my_session->active)
+    {
+        release_slot(my_instance, my_session);
+    }
+}
+
+/**
+ * Free the memory associated with this filter session.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+    free(session);
+}
+
+/**
+ * Set the downstream component for this filter.
+ *
+ * @param instance    The filter instance data
+ * @param session     The filter session
+ * @param downstream  The downstream filter or router
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+    ADM_SESSION *my_session = (ADM_SESSION *)session;
+    my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream component for this filter.
+ *
+ * @param instance    The filter instance data
+ * @param session     The filter session
+ * @param upstream    The upstream filter or session
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+    ADM_SESSION *my_session = (ADM_SESSION *)session;
+    my_session->up = *upstream;
+}
+
+/**
+ * Get the priority of a query. The statement is only classified if a query
+ * type was given a low priority.
+ *
+ * @param my_instance The filter instance
+ * @param my_session  The filter session
+ * @param queue       The query
+ * @return The priority of the query
+ */
+static enum adm_priority
+query_priority(ADM_INSTANCE *my_instance, ADM_SESSION *my_session, GWBUF **queue)
+{
+    if (my_instance->low_type && my_session->priority == ADM_NORMAL &&
+        !GWBUF_IS_TYPE_STREAM((*queue)) && modutil_is_SQL(*queue))
+    {
+        if ((*queue)->next)
+        {
+            *queue = gwbuf_make_contiguous(*queue);
+        }
+
+        if (qc_get_type(*queue) & my_instance->low_type)
+        {
+            return ADM_LOW;
+        }
+    }
+
+    return my_session->priority;
+}
+
+/**
+ * The routeQuery entry point. The query is passed downstream if it is
+ * admitted and otherwise it is held in a queue until a slot is free or
+ * the queue timeout is reached.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param queue     The query data
+ */
+static int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+    ADM_INSTANCE *my_instance = (ADM_INSTANCE *)instance;
+    ADM_SESSION *my_session = (ADM_SESSION *)session;
+    enum adm_priority prio = query_priority(my_instance, my_session, &queue);
+    bool route = false;
+    bool rejected = false;
+
+    spinlock_acquire(&my_instance->lock);
+
+    if (my_session->waiting || my_session->routing)
+    {
+        /** Keep the queries in the order the client sent them */
+        my_session->held = gwbuf_append(my_session->held, queue);
+    }
+    else if (my_session->active || GWBUF_IS_TYPE_STREAM(queue))
+    {
+        /**
+         * A pipelined query shares the slot of the previous query and the
+         * streamed rest of a packet follows the packet it continues
+         */
+        route = true;
+    }
+    else if (can_admit(my_instance, my_session) && !queue_has_waiting(my_instance, prio))
+    {
+        take_slot(my_instance, my_session);
+        my_instance->stats.n_admitted++;
+        route = true;
+    }
+    else if (my_instance->max_queued && my_instance->n_waiting >= my_instance->max_queued)
+    {
+        my_instance->stats.n_rejected++;
+        rejected = true;
+    }
+    else
+    {
+        /** The reference is released when the session leaves the queue */
+        atomic_add(&my_session->session->refcount, 1);
+        my_session->held = queue;
+        queue_push(my_instance, my_session, prio);
+        my_instance->stats.n_queued++;
+        timer_add(poll_timer_wheel(my_session->session->client_dcb), &my_session->timer,
+                  (my_instance->timeout + ADM_HEARTBEAT_MS - 1) / ADM_HEARTBEAT_MS);
+    }
+
+    spinlock_release(&my_instance->lock);
+
+    if (rejected)
+    {
+        gwbuf_free(queue);
+        send_error(my_session, "Too many queries are waiting to be executed.");
+        return 1;
+    }
+
+    return route ? my_session->down.routeQuery(my_session->down.instance,
+                                               my_session->down.session,
+                                               queue) : 1;
+}
+
+/**
+ * The clientReply entry point. The first reply to a query frees the slot of
+ * the session.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param reply     The reply data
+ */
+static int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+    ADM_INSTANCE *my_instance = (ADM_INSTANCE *)instance;
+    ADM_SESSION *my_session = (ADM_SESSION *)session;
+
+    if (my_session->active)
+    {
+        release_slot(my_instance, my_session);
+    }
+
+    return my_session->up.clientReply(my_session->up.instance,
+                                      my_session->up.session,
+                                      reply);
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param instance  The filter instance
+ * @param fsession  Filter session, may be NULL
+ * @param dcb       The DCB for diagnostic output
+ */
+static void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+    ADM_INSTANCE *my_instance = (ADM_INSTANCE *)instance;
+    ADM_SESSION *my_session = (ADM_SESSION *)fsession;
+
+    dcb_printf(dcb, "\t\tMaximum concurrent queries:     %d\n", my_instance->max_queries);
+
+    if (my_instance->max_user_queries)
+    {
+        dcb_printf(dcb, "\t\tMaximum queries per user:       %d\n",
+                   my_instance->max_user_queries);
+    }
+
+    dcb_printf(dcb, "\t\tQueue timeout:                  %d ms\n", my_instance->timeout);
+    dcb_printf(dcb, "\t\tExecuting queries:              %d\n", my_instance->active);
+    dcb_printf(dcb, "\t\tWaiting sessions:               %d\n", my_instance->n_waiting);
+    dcb_printf(dcb, "\t\tQueries admitted immediately:   %d\n", my_instance->stats.n_admitted);
+    dcb_printf(dcb, "\t\tQueries queued:                 %d\n", my_instance->stats.n_queued);
+    dcb_printf(dcb, "\t\tQueries timed out in queue:     %d\n", my_instance->stats.n_timeout);
+    dcb_printf(dcb, "\t\tQueries rejected:               %d\n", my_instance->stats.n_rejected);
+
+    if (my_session)
+    {
+        dcb_printf(dcb, "\t\tSession priority:               %s\n",
+                   priority_names[my_session->priority]);
+        dcb_printf(dcb, "\t\tSession state:                  %s\n",
+                   my_session->waiting ? "Waiting" : my_session->active ? "Executing" : "Idle");
+    }
+}
+
+/**
+ * Return the packets the filter is interested in. All commands except
+ * COM_QUIT, COM_STMT_SEND_LONG_DATA and COM_STMT_CLOSE get a reply and
+ * need a slot.
+ *
+ * @param instance      The filter instance
+ * @return The interest mask of the filter
+ */
+static uint64_t
+getInterest(FILTER *instance)
+{
+    return FILTER_INTEREST_ALL & ~(FILTER_INTEREST_COMMAND(0x01) |
+                                   FILTER_INTEREST_COMMAND(0x18) |
+                                   FILTER_INTEREST_COMMAND(0x19));
+}
@@ -0,0 +1,1069 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file cache.c - Query result cache
+ * @verbatim
+ *
+ * The cache filter stores the resultsets of SELECT statements and returns
+ * them to the clients that send the same statement again, without routing
+ * the statement to the backends.
+ *
+ * A resultset is stored by the user, the default database and the text of
+ * the statement, together with the names of the tables the statement reads.
+ * Every write that passes through the filter invalidates the resultsets of
+ * the tables it modifies. The resultsets also expire after a time to live,
+ * which limits how long changes done past the filter go unseen. Only
+ * statements that read tables are cached, and none are cached or served
+ * inside transactions.
+ *
+ * The filter has the following parameters:
+ *
+ *     ttl                 The time to live of a resultset in seconds
+ *     max_size            The maximum size of the cache in bytes
+ *     max_resultset_size  The maximum size of a cached resultset in bytes
+ *     storage             Where the resultsets are stored, see storage.h
+ *     storage_options     Options of the storage
+ *
+ * @endverbatim
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+#include <hashtable.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <query_classifier.h>
+#include <mysql_client_server_protocol.h>
+#include <sys/time.h>
+#include "storage.h"
+
+MODULE_INFO info =
+{
+    MODULE_API_FILTER,
+    MODULE_IN_DEVELOPMENT,
+    FILTER_VERSION,
+    "A query result cache filter"
+};
+
+static char *version_str = "V1.1.0";
+
+/** Default time to live of a resultset in seconds */
+#define CACHE_DEFAULT_TTL 10
+/** Default maximum size of the cache */
+#define CACHE_DEFAULT_MAX_SIZE (64 * 1024 * 1024)
+/** Default maximum size of one resultset */
+#define CACHE_DEFAULT_MAX_RESULTSET_SIZE (64 * 1024)
+
+/*
+ * The filter entry points
+ */
+static FILTER *createInstance(char **options, FILTER_PARAMETER **);
+static void *newSession(FILTER *instance, SESSION *session);
+static void closeSession(FILTER *instance, void *session);
+static void freeSession(FILTER *instance, void *session);
+static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static int clientReply(FILTER *instance, void *fsession, GWBUF *queue);
+static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+
+
+static FILTER_OBJECT MyObject =
+{
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    clientReply,
+    diagnostic,
+};
+
+/**
+ * The storages the cache can use
+ */
+static CACHE_STORAGE_API *storages[] =
+{
+    &storage_inmemory,
+    &storage_shm,
+    NULL
+};
+
+/**
+ * A resultset that is being read from a backend. In the storage, the
+ * resultset is preceded by the time the statement was routed and the names
+ * of the tables it reads, see cache_value_create.
+ */
+typedef struct
+{
+    char *key;                /*< User, default database and statement */
+    GWBUF *reply;             /*< The resultset read so far */
+    size_t size;              /*< Size of the resultset read so far */
+    char **tables;            /*< Tables read by the statement, as db.table */
+    int n_tables;
+    uint64_t created;         /*< When the statement was routed, in microseconds */
+} CACHE_ENTRY;
+
+/**
+ * The instance structure. The storage is shared by all sessions of the
+ * service so that a write seen by one thread invalidates the resultsets
+ * served by all threads.
+ *
+ * Invalidations are recorded as the wall clock time of the write, so that
+ * they can be compared to resultsets stored by other processes.
+ */
+typedef struct
+{
+    int ttl;                   /*< Time to live of a resultset */
+    size_t max_size;           /*< Maximum size of the cache */
+    size_t max_resultset_size; /*< Maximum size of one resultset */
+    CACHE_STORAGE_API *api;    /*< The storage */
+    CACHE_STORAGE *storage;
+    SPINLOCK lock;             /*< Protects the fields below */
+    HASHTABLE *invalidated;    /*< Time of the last write by table name */
+    uint64_t flushed;          /*< Time of the last invalidation of everything */
+    int hits;
+    int misses;
+    int invalidations;
+} CACHE_INSTANCE;
+
+/**
+ * Position in the resultset being stored
+ */
+typedef enum
+{
+    CACHE_REPLY_START,   /*< Expecting the column count */
+    CACHE_REPLY_COLDEF,  /*< Reading the column definitions */
+    CACHE_REPLY_ROWS     /*< Reading the rows */
+} cache_reply_state_t;
+
+/**
+ * The session structure for this cache filter.
+ */
+typedef struct
+{
+    DOWNSTREAM down;
+    UPSTREAM up;
+    SESSION *session;
+    char *user;
+    char db[MYSQL_DATABASE_MAXLEN + 1]; /*< The default database */
+    bool trx_active;          /*< An explicit transaction is open */
+    bool autocommit;          /*< Autocommit is enabled */
+    char **trx_tables;        /*< Tables written in the open transaction */
+    int n_trx_tables;
+    bool trx_flush;           /*< The transaction wrote to unknown tables */
+    CACHE_ENTRY *pending;     /*< The resultset being stored */
+    cache_reply_state_t state;
+} CACHE_SESSION;
+
+static void cache_invalidate(CACHE_INSTANCE *inst, char **tables, int n_tables, bool flush);
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+    return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ * @see function load_module in load_utils.c for explanation of lint
+ */
+/*lint -e14 */
+void
+ModuleInit()
+{
+}
+/*lint +e14 */
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+    return &MyObject;
+}
+
+/**
+ * Free an array of strings
+ *
+ * @param names The array
+ * @param n     Number of strings
+ */
+static void
+free_names(char **names, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+}
+
+/**
+ * Free a cache entry
+ *
+ * @param entry The entry to free
+ */
+static void
+cache_entry_free(CACHE_ENTRY *entry)
+{
+    if (entry)
+    {
+        free(entry->key);
+        gwbuf_free(entry->reply);
+        free_names(entry->tables, entry->n_tables);
+        free(entry);
+    }
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options   The options for this filter
+ * @param params    The array of name/value pair parameters for the filter
+ *
+ * @return The instance data for this new instance
+ */
+static FILTER *
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+    CACHE_INSTANCE *my_instance;
+
+    if ((my_instance = calloc(1, sizeof(CACHE_INSTANCE))) != NULL)
+    {
+        bool error = false;
+        const char *storage_options = NULL;
+
+        my_instance->ttl = CACHE_DEFAULT_TTL;
+        my_instance->max_size = CACHE_DEFAULT_MAX_SIZE;
+        my_instance->max_resultset_size = CACHE_DEFAULT_MAX_RESULTSET_SIZE;
+        my_instance->api = &storage_inmemory;
+        spinlock_init(&my_instance->lock);
+
+        for (int i = 0; params && params[i]; i++)
+        {
+            if (!strcmp(params[i]->name, "ttl"))
+            {
+                my_instance->ttl = atoi(params[i]->value);
+            }
+            else if (!strcmp(params[i]->name, "max_size"))
+            {
+                my_instance->max_size = strtoul(params[i]->value, NULL, 10);
+            }
+            else if (!strcmp(params[i]->name, "max_resultset_size"))
+            {
+                my_instance->max_resultset_size = strtoul(params[i]->value, NULL, 10);
+            }
+            else if (!strcmp(params[i]->name, "storage"))
+            {
+                my_instance->api = NULL;
+
+                for (int j = 0; storages[j]; j++)
+                {
+                    if (!strcmp(storages[j]->name, params[i]->value))
+                    {
+                        my_instance->api = storages[j];
+                    }
+                }
+
+                if (my_instance->api == NULL)
+                {
+                    MXS_ERROR("cache: Unknown storage '%s'.", params[i]->value);
+                    error = true;
+                }
+            }
+            else if (!strcmp(params[i]->name, "storage_options"))
+            {
+                storage_options = params[i]->value;
+            }
+            else if (!filter_standard_parameter(params[i]->name))
+            {
+                MXS_ERROR("cache: Unexpected parameter '%s'.", params[i]->name);
+                error = true;
+            }
+        }
+
+        if (options && options[0])
+        {
+            MXS_ERROR("cache: Unsupported option '%s'.", options[0]);
+            error = true;
+        }
+
+        if (my_instance->ttl <= 0)
+        {
+            MXS_ERROR("cache: The value of 'ttl' must be a positive number of seconds.");
+            error = true;
+        }
+
+        if (!error &&
+            (my_instance->invalidated = hashtable_alloc(100, simple_str_hash, strcmp)) == NULL)
+        {
+            MXS_ERROR("cache: Unable to allocate hashtable.");
+            error = true;
+        }
+
+        if (!error &&
+            (my_instance->storage = my_instance->api->createInstance(my_instance->max_size,
+                                                                     my_instance->max_resultset_size,
+                                                                     storage_options)) == NULL)
+        {
+            MXS_ERROR("cache: Failed to create the %s storage.", my_instance->api->name);
+            error = true;
+        }
+
+        if (error)
+        {
+            if (my_instance->invalidated)
+            {
+                hashtable_free(my_instance->invalidated);
+            }
+            free(my_instance);
+            my_instance = NULL;
+        }
+        else
+        {
+            hashtable_memory_fns(my_instance->invalidated, (HASHMEMORYFN) strdup, NULL,
+                                 (HASHMEMORYFN) free, NULL);
+        }
+    }
+
+    return (FILTER *) my_instance;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session itself
+ * @return Session specific data for this session
+ */
+static void *
+newSession(FILTER *instance, SESSION *session)
+{
+    CACHE_SESSION *my_session;
+    char *user;
+
+    if ((my_session = calloc(1, sizeof(CACHE_SESSION))) != NULL)
+    {
+        my_session->session = session;
+        my_session->autocommit = true;
+
+        if ((user = session_getUser(session)) == NULL ||
+            (my_session->user = strdup(user)) == NULL)
+        {
+            free(my_session);
+            return NULL;
+        }
+
+        if (session->client_dcb && session->client_dcb->data)
+        {
+            MYSQL_session *data = (MYSQL_session *) session->client_dcb->data;
+            strcpy(my_session->db, data->db);
+        }
+    }
+
+    return my_session;
+}
+
+/**
+ * Close a session with the filter. The tables written in an open
+ * transaction are invalidated as the transaction is rolled back.
+ *
+ * @param instance  The filter instance data
+ * @param session   The session being closed
+ */
+static void
+closeSession(FILTER *instance, void *session)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *) instance;
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    if (my_session->n_trx_tables || my_session->trx_flush)
+    {
+        cache_invalidate(my_instance, my_session->trx_tables, my_session->n_trx_tables,
+                         my_session->trx_flush);
+    }
+}
+
+/**
+ * Free the memory associated with the session
+ *
+ * @param instance  The filter instance
+ * @param session   The filter session
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    cache_entry_free(my_session->pending);
+    free_names(my_session->trx_tables, my_session->n_trx_tables);
+    free(my_session->user);
+    free(my_session);
+}
+
+/**
+ * Set the downstream filter or router to which queries will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param downstream    The downstream filter or router.
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream filter or session to which results will be
+ * passed from this filter.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param upstream  The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+
+    my_session->up = *upstream;
+}
+
+/**
+ * Get the names of the tables a statement uses, qualified with the default
+ * database if the statement doesn't name one. The names are in lower case.
+ *
+ * @param my_session The filter session
+ * @param queue      The statement
+ * @param n_tables   Set to the number of names
+ * @return The names or NULL if the statement uses no tables
+ */
+static char **
+get_tables(CACHE_SESSION *my_session, GWBUF *queue, int *n_tables)
+{
+    int n = 0;
+    char **names = qc_get_table_names(queue, &n, true);
+
+    for (int i = 0; i < n; i++)
+    {
+        if (strchr(names[i], '.') == NULL)
+        {
+            char *name = malloc(strlen(my_session->db) + strlen(names[i]) + 2);
+
+            if (name)
+            {
+                sprintf(name, "%s.%s", my_session->db, names[i]);
+                free(names[i]);
+                names[i] = name;
+            }
+        }
+
+        for (char *c = names[i]; *c; c++)
+        {
+            *c = tolower((unsigned char) *c);
+        }
+    }
+
+    *n_tables = n;
+    return names;
+}
+
+/**
+ * The wall clock time in microseconds
+ */
+static uint64_t
+cache_time_now()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * Check if a resultset read at a given time is still valid. The instance
+ * must be locked.
+ *
+ * @param inst     The filter instance
+ * @param created  When the statement was routed
+ * @param tables   The tables read by the statement
+ * @param n_tables Number of tables
+ * @param now      The current time
+ * @return True if no table was written after the statement was routed and
+ * the resultset has not expired
+ */
+static bool
+cache_is_valid(CACHE_INSTANCE *inst, uint64_t created, const char **tables,
+               int n_tables, uint64_t now)
+{
+    if (now - created >= (uint64_t) inst->ttl * 1000000 || created <= inst->flushed)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < n_tables; i++)
+    {
+        if (created <= (uintptr_t) hashtable_fetch(inst->invalidated, (void *) tables[i]))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Invalidate the resultsets that read the given tables. The resultsets are
+ * not removed here: the time of the write is recorded for each table and
+ * the resultsets are compared to it when they are looked up.
+ *
+ * @param inst     The filter instance
+ * @param tables   The modified tables
+ * @param n_tables Number of tables
+ * @param flush    Invalidate all resultsets
+ */
+static void
+cache_invalidate(CACHE_INSTANCE *inst, char **tables, int n_tables, bool flush)
+{
+    uint64_t now = cache_time_now();
+
+    spinlock_acquire(&inst->lock);
+
+    if (flush)
+    {
+        inst->flushed = now;
+    }
+
+    for (int i = 0; i < n_tables; i++)
+    {
+        hashtable_delete(inst->invalidated, tables[i]);
+        hashtable_add(inst->invalidated, tables[i], (void *) (uintptr_t) now);
+    }
+
+    inst->invalidations++;
+    spinlock_release(&inst->lock);
+}
+
+/**
+ * Look up a resultset from the storage. A resultset that is no longer
+ * valid is removed.
+ *
+ * @param inst The filter instance
+ * @param key  The key of the statement
+ * @return The resultset or NULL if there is none
+ */
+static GWBUF *
+cache_get(CACHE_INSTANCE *inst, const char *key)
+{
+    GWBUF *value = inst->api->getValue(inst->storage, key);
+    GWBUF *rval = NULL;
+
+    if (value)
+    {
+        const char *data = (const char *) GWBUF_DATA(value);
+        const char *end = data + GWBUF_LENGTH(value);
+        uint64_t created;
+        uint32_t n_tables;
+
+        if (end - data > (ptrdiff_t) (sizeof(created) + sizeof(n_tables)))
+        {
+            memcpy(&created, data, sizeof(created));
+            memcpy(&n_tables, data + sizeof(created), sizeof(n_tables));
+
+            const char *tables[n_tables ? n_tables : 1];
+            const char *ptr = data + sizeof(created) + sizeof(n_tables);
+            uint32_t i;
+
+            for (i = 0; i < n_tables && ptr < end; i++)
+            {
+                tables[i] = ptr;
+                ptr += strnlen(ptr, end - ptr) + 1;
+            }
+
+            uint64_t now = cache_time_now();
+
+            spinlock_acquire(&inst->lock);
+            bool valid = i == n_tables && ptr < end &&
+                cache_is_valid(inst, created, tables, n_tables, now);
+            spinlock_release(&inst->lock);
+
+            if (valid)
+            {
+                /** Leave only the resultset in the buffer */
+                rval = gwbuf_consume(value, ptr - data);
+                value = NULL;
+            }
+        }
+
+        if (value)
+        {
+            gwbuf_free(value);
+            inst->api->delValue(inst->storage, key);
+        }
+    }
+
+    atomic_add(rval ? &inst->hits : &inst->misses, 1);
+    return rval;
+}
+
+/**
+ * Store a complete resultset. It is not stored if a table it reads was
+ * written while the resultset was read.
+ *
+ * @param inst  The filter instance
+ * @param entry The resultset and the statement that produced it
+ */
+static void
+cache_put(CACHE_INSTANCE *inst, CACHE_ENTRY *entry)
+{
+    uint64_t now = cache_time_now();
+
+    spinlock_acquire(&inst->lock);
+    bool valid = cache_is_valid(inst, entry->created, (const char **) entry->tables,
+                                entry->n_tables, now);
+    spinlock_release(&inst->lock);
+
+    if (!valid)
+    {
+        return;
+    }
+
+    uint32_t n_tables = entry->n_tables;
+    size_t len = sizeof(entry->created) + sizeof(n_tables) + gwbuf_length(entry->reply);
+
+    for (int i = 0; i < entry->n_tables; i++)
+    {
+        len += strlen(entry->tables[i]) + 1;
+    }
+
+    GWBUF *value = gwbuf_alloc(len);
+
+    if (value)
+    {
+        char *ptr = (char *) GWBUF_DATA(value);
+
+        memcpy(ptr, &entry->created, sizeof(entry->created));
+        ptr += sizeof(entry->created);
+        memcpy(ptr, &n_tables, sizeof(n_tables));
+        ptr += sizeof(n_tables);
+
+        for (int i = 0; i < entry->n_tables; i++)
+        {
+            strcpy(ptr, entry->tables[i]);
+            ptr += strlen(entry->tables[i]) + 1;
+        }
+
+        gwbuf_copy_data(entry->reply, 0, gwbuf_length(entry->reply), (uint8_t *) ptr);
+        inst->api->putValue(inst->storage, entry->key, value);
+        gwbuf_free(value);
+    }
+}
+
+/**
+ * Create the entry for a statement that is not in the cache
+ *
+ * @param key      The key of the statement
+ * @param tables   The tables of the statement, owned by the entry on success
+ * @param n_tables Number of tables
+ * @return The new entry or NULL on memory allocation failure
+ */
+static CACHE_ENTRY *
+cache_entry_create(char *key, char **tables, int n_tables)
+{
+    CACHE_ENTRY *entry = calloc(1, sizeof(CACHE_ENTRY));
+
+    if (entry)
+    {
+        entry->key = key;
+        entry->tables = tables;
+        entry->n_tables = n_tables;
+        entry->created = cache_time_now();
+    }
+
+    return entry;
+}
+
+/**
+ * Record the tables written in a transaction. They are invalidated again
+ * when the transaction ends, since other sessions may have cached the old
+ * contents of the tables while the transaction was open.
+ *
+ * @param my_session The filter session
+ * @param tables     The written tables
+ * @param n_tables   Number of tables
+ */
+static void
+add_trx_tables(CACHE_SESSION *my_session, char **tables, int n_tables)
+{
+    char **names = realloc(my_session->trx_tables,
+                           (my_session->n_trx_tables + n_tables) * sizeof(char *));
+
+    if (names == NULL)
+    {
+        my_session->trx_flush = true;
+        return;
+    }
+
+    for (int i = 0; i < n_tables; i++)
+    {
+        if ((names[my_session->n_trx_tables] = strdup(tables[i])) != NULL)
+        {
+            my_session->n_trx_tables++;
+        }
+        else
+        {
+            my_session->trx_flush = true;
+        }
+    }
+
+    my_session->trx_tables = names;
+}
+
+/**
+ * Update the default database of the session from a COM_INIT_DB or a
+ * USE statement. The database is changed before the server replies, a
+ * failed change leaves a database that has no tables in the cache.
+ *
+ * @param my_session The filter session
+ * @param name       The database name, possibly quoted with backticks
+ * @param len        Length of the name
+ */
+static void
+set_db(CACHE_SESSION *my_session, const char *name, int len)
+{
+    while (len > 0 && (isspace(*name) || *name == '`'))
+    {
+        name++;
+        len--;
+    }
+
+    while (len > 0 && (isspace(name[len - 1]) || name[len - 1] == '`' || name[len - 1] == ';'))
+    {
+        len--;
+    }
+
+    if (len > MYSQL_DATABASE_MAXLEN)
+    {
+        len = MYSQL_DATABASE_MAXLEN;
+    }
+
+    memcpy(my_session->db, name, len);
+    my_session->db[len] = '\0';
+}
+
+/**
+ * The routeQuery entry point. Reads that are found in the cache are
+ * replied to from it, other statements are passed downstream.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param queue     The query data
+ */
+static int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *) instance;
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+    uint8_t *data;
+    char *sql;
+    int len;
+
+    /** The previous statement was not replied to, or its reply was not stored */
+    cache_entry_free(my_session->pending);
+    my_session->pending = NULL;
+
+    if (queue->next != NULL)
+    {
+        queue = gwbuf_make_contiguous(queue);
+    }
+
+    data = GWBUF_DATA(queue);
+
+    if (GWBUF_LENGTH(queue) > MYSQL_HEADER_LEN && MYSQL_GET_COMMAND(data) == MYSQL_COM_INIT_DB)
+    {
+        set_db(my_session, (char *) data + MYSQL_HEADER_LEN + 1,
+               GWBUF_LENGTH(queue) - MYSQL_HEADER_LEN - 1);
+    }
+    else if (modutil_extract_SQL(queue, &sql, &len))
+    {
+        qc_query_type_t type = qc_get_type(queue);
+        int n_tables = 0;
+        char **tables = NULL;
+
+        if (qc_get_operation(queue) == QUERY_OP_CHANGE_DB)
+        {
+            /** Skip the USE keyword */
+            int skip = 0;
+
+            while (skip < len && isspace(sql[skip]))
+            {
+                skip++;
+            }
+
+            if (len - skip > 3)
+            {
+                set_db(my_session, sql + skip + 3, len - skip - 3);
+            }
+        }
+
+        if (QUERY_IS_TYPE(type, QUERY_TYPE_ENABLE_AUTOCOMMIT))
+        {
+            my_session->autocommit = true;
+        }
+        else if (QUERY_IS_TYPE(type, QUERY_TYPE_DISABLE_AUTOCOMMIT))
+        {
+            my_session->autocommit = false;
+        }
+
+        if (QUERY_IS_TYPE(type, QUERY_TYPE_BEGIN_TRX))
+        {
+            my_session->trx_active = true;
+        }
+
+        if (QUERY_IS_TYPE(type, QUERY_TYPE_WRITE) ||
+            QUERY_IS_TYPE(type, QUERY_TYPE_COMMIT) ||
+            QUERY_IS_TYPE(type, QUERY_TYPE_ROLLBACK) ||
+            QUERY_IS_TYPE(type, QUERY_TYPE_ENABLE_AUTOCOMMIT) ||
+            type == QUERY_TYPE_READ)
+        {
+            tables = get_tables(my_session, queue, &n_tables);
+        }
+
+        if (QUERY_IS_TYPE(type, QUERY_TYPE_WRITE))
+        {
+            /** A write to unknown tables, for example a procedure call, invalidates everything */
+            cache_invalidate(my_instance, tables, n_tables, n_tables == 0);
+
+            if (my_session->trx_active || !my_session->autocommit)
+            {
+                add_trx_tables(my_session, tables, n_tables);
+                my_session->trx_flush |= n_tables == 0;
+            }
+        }
+
+        if (QUERY_IS_TYPE(type, QUERY_TYPE_COMMIT) ||
+            QUERY_IS_TYPE(type, QUERY_TYPE_ROLLBACK) ||
+            QUERY_IS_TYPE(type, QUERY_TYPE_ENABLE_AUTOCOMMIT))
+        {
+            if (my_session->n_trx_tables || my_session->trx_flush)
+            {
+                cache_invalidate(my_instance, my_session->trx_tables,
+                                 my_session->n_trx_tables, my_session->trx_flush);
+                free_names(my_session->trx_tables, my_session->n_trx_tables);
+                my_session->trx_tables = NULL;
+                my_session->n_trx_tables = 0;
+                my_session->trx_flush = false;
+            }
+
+            my_session->trx_active = false;
+        }
+
+        /** Only plain reads of tables outside transactions are cached */
+        if (type == QUERY_TYPE_READ && n_tables > 0 &&
+            !my_session->trx_active && my_session->autocommit)
+        {
+            char *key = malloc(strlen(my_session->user) + strlen(my_session->db) + len + 3);
+
+            if (key)
+            {
+                sprintf(key, "%s\n%s\n%.*s", my_session->user, my_session->db, len, sql);
+
+                GWBUF *reply = cache_get(my_instance, key);
+
+                if (reply)
+                {
+                    free(key);
+                    free_names(tables, n_tables);
+                    gwbuf_free(queue);
+                    return my_session->up.clientReply(my_session->up.instance,
+                                                      my_session->up.session, reply);
+                }
+
+                if ((my_session->pending = cache_entry_create(key, tables, n_tables)))
+                {
+                    my_session->state = CACHE_REPLY_START;
+                    tables = NULL;
+                    n_tables = 0;
+                }
+                else
+                {
+                    free(key);
+                }
+            }
+        }
+
+        free_names(tables, n_tables);
+    }
+
+    /* Pass the query downstream */
+    return my_session->down.routeQuery(my_session->down.instance,
+                                       my_session->down.session, queue);
+}
+
+/**
+ * Follow the resultset being stored.
+ *
+ * @param my_session The filter session
+ * @param reply      Complete packets of the reply
+ * @return 1 if the resultset is complete, 0 if more packets are needed and
+ * -1 if the reply can't be stored
+ */
+static int
+process_reply(CACHE_SESSION *my_session, GWBUF *reply)
+{
+    size_t len = gwbuf_length(reply);
+    size_t offset = 0;
+
+    while (offset < len)
+    {
+        uint8_t data[MYSQL_HEADER_LEN + 5];
+        size_t n = gwbuf_copy_data(reply, offset, sizeof(data), data);
+
+        if (n < MYSQL_HEADER_LEN + 1)
+        {
+            return -1;
+        }
+
+        uint8_t cmd = data[MYSQL_HEADER_LEN];
+
+        switch (my_session->state)
+        {
+        case CACHE_REPLY_START:
+            /** An OK, an error or a LOAD DATA LOCAL INFILE request */
+            if (cmd == 0x00 || cmd == 0xff || cmd == 0xfb)
+            {
+                return -1;
+            }
+            my_session->state = CACHE_REPLY_COLDEF;
+            break;
+
+        case CACHE_REPLY_COLDEF:
+            if (PTR_IS_EOF(data))
+            {
+                my_session->state = CACHE_REPLY_ROWS;
+            }
+            break;
+
+        case CACHE_REPLY_ROWS:
+            if (PTR_IS_ERR(data) || PTR_EOF_MORE_RESULTS(data))
+            {
+                return -1;
+            }
+            else if (PTR_IS_EOF(data))
+            {
+                return offset + MYSQL_HEADER_LEN + MYSQL_GET_PACKET_LEN(data) == len ? 1 : -1;
+            }
+            break;
+        }
+
+        offset += MYSQL_HEADER_LEN + MYSQL_GET_PACKET_LEN(data);
+    }
+
+    return 0;
+}
+
+/**
+ * The clientReply entry point. The reply to a statement that is being
+ * cached is collected and stored when it is complete.
+ *
+ * @param instance  The filter instance data
+ * @param session   The filter session
+ * @param reply     The reply
+ */
+static int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *) instance;
+    CACHE_SESSION *my_session = (CACHE_SESSION *) session;
+    CACHE_ENTRY *entry = my_session->pending;
+
+    if (entry)
+    {
+        int rc = process_reply(my_session, reply);
+
+        entry->size += gwbuf_length(reply);
+
+        if (rc < 0 || entry->size > my_instance->max_resultset_size)
+        {
+            cache_entry_free(entry);
+            my_session->pending = NULL;
+        }
+        else
+        {
+            entry->reply = gwbuf_append(entry->reply, gwbuf_clone_all(reply));
+
+            if (rc == 1)
+            {
+                my_session->pending = NULL;
+                cache_put(my_instance, entry);
+                cache_entry_free(entry);
+            }
+        }
+    }
+
+    /* Pass the result upstream */
+    return my_session->up.clientReply(my_session->up.instance,
+                                      my_session->up.session, reply);
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param   instance    The filter instance
+ * @param   fsession    Filter session, may be NULL
+ * @param   dcb     The DCB for diagnostic output
+ */
+static void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+    CACHE_INSTANCE *my_instance = (CACHE_INSTANCE *) instance;
+
+    dcb_printf(dcb, "\t\tStorage                        %s\n", my_instance->api->name);
+    dcb_printf(dcb, "\t\tTime to live                   %d seconds\n", my_instance->ttl);
+    dcb_printf(dcb, "\t\tHits                           %d\n", my_instance->hits);
+    dcb_printf(dcb, "\t\tMisses                         %d\n", my_instance->misses);
+    dcb_printf(dcb, "\t\tInvalidations                  %d\n", my_instance->invalidations);
+    my_instance->api->diagnostic(my_instance->storage, dcb);
+}
@@ -0,0 +1,89 @@
+#ifndef _CACHE_STORAGE_H
+#define _CACHE_STORAGE_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file storage.h - The storage interface of the cache filter
+ *
+ * A storage maps keys to values. The values are opaque to the storage: the
+ * filter validates what it gets back, so a storage may drop or replace any
+ * value at any time. A storage instance is shared by all the threads of a
+ * filter instance and must do its own locking.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <buffer.h>
+#include <dcb.h>
+
+typedef void CACHE_STORAGE;
+
+typedef struct cache_storage_api
+{
+    /** The name used in the storage parameter of the filter */
+    const char *name;
+
+    /**
+     * Create a storage instance
+     *
+     * @param max_size       Maximum size of the stored data in bytes
+     * @param max_value_size Maximum size of one value in bytes
+     * @param options        The storage_options parameter of the filter or NULL
+     * @return The new instance or NULL on error
+     */
+    CACHE_STORAGE *(*createInstance)(size_t max_size, size_t max_value_size,
+                                     const char *options);
+
+    /**
+     * Get a value
+     *
+     * @param storage The storage instance
+     * @param key     The key
+     * @return A contiguous buffer with the value or NULL if there is none
+     */
+    GWBUF *(*getValue)(CACHE_STORAGE *storage, const char *key);
+
+    /**
+     * Store a value, replacing any previous value of the key
+     *
+     * @param storage The storage instance
+     * @param key     The key
+     * @param value   A contiguous buffer with the value, not taken over
+     * @return True if the value was stored
+     */
+    bool (*putValue)(CACHE_STORAGE *storage, const char *key, GWBUF *value);
+
+    /**
+     * Remove a value
+     *
+     * @param storage The storage instance
+     * @param key     The key
+     */
+    void (*delValue)(CACHE_STORAGE *storage, const char *key);
+
+    /**
+     * Print diagnostics of the storage
+     *
+     * @param storage The storage instance
+     * @param dcb     The DCB to print to
+     */
+    void (*diagnostic)(CACHE_STORAGE *storage, DCB *dcb);
+} CACHE_STORAGE_API;
+
+/** Stores the values in the memory of the process, evicting the least recently used */
+extern CACHE_STORAGE_API storage_inmemory;
+/** Stores the values in POSIX shared memory that outlives the process */
+extern CACHE_STORAGE_API storage_shm;
+
+#endif
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file storage_inmemory.c - Cache storage in the memory of the process
+ *
+ * The values are kept in a hashtable and in a list ordered by their last
+ * use. When the storage is full, the least recently used values are removed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <hashtable.h>
+#include <spinlock.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+#include "storage.h"
+
+typedef struct inmemory_entry
+{
+    char *key;
+    GWBUF *value;
+    size_t size;                 /*< Memory accounted to the entry */
+    struct inmemory_entry *prev; /*< More recently used entry */
+    struct inmemory_entry *next; /*< Less recently used entry */
+} INMEMORY_ENTRY;
+
+typedef struct
+{
+    size_t max_size;
+    SPINLOCK lock;           /*< Protects the fields below */
+    HASHTABLE *entries;      /*< The entries by key */
+    INMEMORY_ENTRY *head;    /*< Most recently used entry */
+    INMEMORY_ENTRY *tail;    /*< Least recently used entry */
+    size_t size;
+    int n_entries;
+    int evictions;
+} INMEMORY_STORAGE;
+
+static CACHE_STORAGE *
+inmemory_create(size_t max_size, size_t max_value_size, const char *options)
+{
+    INMEMORY_STORAGE *storage = calloc(1, sizeof(INMEMORY_STORAGE));
+
+    if (storage == NULL)
+    {
+        return NULL;
+    }
+
+    if (options && *options)
+    {
+        MXS_ERROR("cache: The inmemory storage has no options, '%s' given.", options);
+        free(storage);
+        return NULL;
+    }
+
+    /** The entries own their keys */
+    if ((storage->entries = hashtable_alloc(1000, simple_str_hash, strcmp)) == NULL)
+    {
+        MXS_ERROR("cache: Unable to allocate hashtable.");
+        free(storage);
+        return NULL;
+    }
+
+    storage->max_size = max_size;
+    spinlock_init(&storage->lock);
+
+    return storage;
+}
+
+/**
+ * Remove an entry. The storage must be locked.
+ */
+static void
+inmemory_remove(INMEMORY_STORAGE *storage, INMEMORY_ENTRY *entry)
+{
+    hashtable_delete(storage->entries, entry->key);
+
+    if (entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        storage->head = entry->next;
+    }
+
+    if (entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        storage->tail = entry->prev;
+    }
+
+    storage->size -= entry->size;
+    storage->n_entries--;
+    free(entry->key);
+    gwbuf_free(entry->value);
+    free(entry);
+}
+
+static GWBUF *
+inmemory_get(CACHE_STORAGE *instance, const char *key)
+{
+    INMEMORY_STORAGE *storage = (INMEMORY_STORAGE *) instance;
+    GWBUF *rval = NULL;
+
+    spinlock_acquire(&storage->lock);
+
+    INMEMORY_ENTRY *entry = hashtable_fetch(storage->entries, (void *) key);
+
+    if (entry)
+    {
+        /** Move the entry to the head of the list */
+        if (entry != storage->head)
+        {
+            entry->prev->next = entry->next;
+
+            if (entry->next)
+            {
+                entry->next->prev = entry->prev;
+            }
+            else
+            {
+                storage->tail = entry->prev;
+            }
+
+            entry->prev = NULL;
+            entry->next = storage->head;
+            storage->head->prev = entry;
+            storage->head = entry;
+        }
+
+        rval = gwbuf_clone(entry->value);
+    }
+
+    spinlock_release(&storage->lock);
+    return rval;
+}
+
+static bool
+inmemory_put(CACHE_STORAGE *instance, const char *key, GWBUF *value)
+{
+    INMEMORY_STORAGE *storage = (INMEMORY_STORAGE *) instance;
+    INMEMORY_ENTRY *entry = calloc(1, sizeof(INMEMORY_ENTRY));
+
+    if (entry == NULL || (entry->key = strdup(key)) == NULL)
+    {
+        free(entry);
+        return false;
+    }
+
+    entry->value = gwbuf_clone(value);
+    entry->size = GWBUF_LENGTH(value) + strlen(key);
+
+    spinlock_acquire(&storage->lock);
+
+    INMEMORY_ENTRY *old = hashtable_fetch(storage->entries, entry->key);
+
+    if (old)
+    {
+        inmemory_remove(storage, old);
+    }
+
+    if (entry->value == NULL || hashtable_add(storage->entries, entry->key, entry) == 0)
+    {
+        spinlock_release(&storage->lock);
+        gwbuf_free(entry->value);
+        free(entry->key);
+        free(entry);
+        return false;
+    }
+
+    entry->next = storage->head;
+
+    if (storage->head)
+    {
+        storage->head->prev = entry;
+    }
+    else
+    {
+        storage->tail = entry;
+    }
+
+    storage->head = entry;
+    storage->size += entry->size;
+    storage->n_entries++;
+
+    while (storage->size > storage->max_size && storage->tail)
+    {
+        inmemory_remove(storage, storage->tail);
+        storage->evictions++;
+    }
+
+    spinlock_release(&storage->lock);
+    return true;
+}
+
+static void
+inmemory_del(CACHE_STORAGE *instance, const char *key)
+{
+    INMEMORY_STORAGE *storage = (INMEMORY_STORAGE *) instance;
+
+    spinlock_acquire(&storage->lock);
+
+    INMEMORY_ENTRY *entry = hashtable_fetch(storage->entries, (void *) key);
+
+    if (entry)
+    {
+        inmemory_remove(storage, entry);
+    }
+
+    spinlock_release(&storage->lock);
+}
+
+static void
+inmemory_diagnostic(CACHE_STORAGE *instance, DCB *dcb)
+{
+    INMEMORY_STORAGE *storage = (INMEMORY_STORAGE *) instance;
+
+    spinlock_acquire(&storage->lock);
+    dcb_printf(dcb, "\t\tCached resultsets              %d\n", storage->n_entries);
+    dcb_printf(dcb, "\t\tCache size                     %lu of %lu bytes\n",
+               storage->size, storage->max_size);
+    dcb_printf(dcb, "\t\tEvictions                      %d\n", storage->evictions);
+    spinlock_release(&storage->lock);
+}
+
+CACHE_STORAGE_API storage_inmemory =
+{
+    "inmemory",
+    inmemory_create,
+    inmemory_get,
+    inmemory_put,
+    inmemory_del,
+    inmemory_diagnostic
+};
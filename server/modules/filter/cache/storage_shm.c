@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file storage_shm.c - Cache storage in POSIX shared memory
+ *
+ * The values are stored in a shared memory object that is not removed when
+ * MaxScale stops. The values survive restarts and are shared by all the
+ * MaxScale processes on the host that use the same object.
+ *
+ * The object is divided into fixed size slots and a key is stored in the
+ * slot its hash selects, replacing the value that was there. The slots
+ * are protected by one robust, process-shared mutex. If a process dies while
+ * holding it, the slots are emptied as one of them may be half written.
+ *
+ * The processes that share an object must use the same max_size and
+ * max_resultset_size, since they define the layout of the slots.
+ *
+ * The only option is the name of the shared memory object:
+ *
+ *     storage_options=name=/maxscale-cache
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+#include <atomic.h>
+#include "storage.h"
+
+/** Identifies an initialized object, "MXSC" */
+#define SHM_MAGIC 0x4d585343
+#define SHM_VERSION 1
+/** Default name of the shared memory object */
+#define SHM_DEFAULT_NAME "/maxscale-cache"
+/** Room left in a slot for the key */
+#define SHM_KEY_SPACE 4096
+/** How many times to wait for another process to initialize the object */
+#define SHM_INIT_RETRIES 50
+
+typedef struct
+{
+    uint32_t magic;           /*< SHM_MAGIC once the object is initialized */
+    uint32_t version;
+    uint64_t n_slots;
+    uint64_t slot_size;
+    pthread_mutex_t lock;     /*< Protects the slots */
+} SHM_HEADER;
+
+typedef struct
+{
+    uint64_t hash;            /*< Hash of the key, 0 if the slot is empty */
+    uint32_t key_len;
+    uint32_t value_len;
+    char data[];              /*< The key followed by the value */
+} SHM_SLOT;
+
+typedef struct
+{
+    char *name;
+    SHM_HEADER *header;
+    size_t map_size;
+    int hits;
+    int misses;
+    int collisions;           /*< Values replaced by a value of another key */
+} SHM_STORAGE;
+
+/**
+ * 64-bit FNV-1a hash of a key, never 0
+ */
+static uint64_t
+shm_hash(const char *key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (const unsigned char *c = (const unsigned char *) key; *c; c++)
+    {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash ? hash : 1;
+}
+
+static SHM_SLOT *
+shm_slot(SHM_STORAGE *storage, uint64_t hash)
+{
+    SHM_HEADER *header = storage->header;
+    char *slots = (char *) header + sizeof(SHM_HEADER);
+
+    return (SHM_SLOT *) (slots + (hash % header->n_slots) * header->slot_size);
+}
+
+/**
+ * Lock the slots. If the previous owner of the lock died, the slots are
+ * emptied and the lock is made consistent.
+ *
+ * @return True if the lock was acquired
+ */
+static bool
+shm_lock(SHM_STORAGE *storage)
+{
+    int rc = pthread_mutex_lock(&storage->header->lock);
+
+    if (rc == EOWNERDEAD)
+    {
+        SHM_HEADER *header = storage->header;
+
+        MXS_WARNING("cache: A process died while using the shared memory cache '%s', "
+                    "emptying it.", storage->name);
+
+        for (uint64_t i = 0; i < header->n_slots; i++)
+        {
+            shm_slot(storage, i)->hash = 0;
+        }
+
+        pthread_mutex_consistent(&header->lock);
+        rc = 0;
+    }
+
+    return rc == 0;
+}
+
+/**
+ * Initialize a newly created object
+ */
+static bool
+shm_init_header(SHM_HEADER *header, uint64_t n_slots, uint64_t slot_size)
+{
+    pthread_mutexattr_t attr;
+    bool rval = false;
+
+    if (pthread_mutexattr_init(&attr) == 0)
+    {
+        if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0 &&
+            pthread_mutex_init(&header->lock, &attr) == 0)
+        {
+            header->version = SHM_VERSION;
+            header->n_slots = n_slots;
+            header->slot_size = slot_size;
+            /** The slots are zero filled by ftruncate */
+            __sync_synchronize();
+            header->magic = SHM_MAGIC;
+            rval = true;
+        }
+
+        pthread_mutexattr_destroy(&attr);
+    }
+
+    return rval;
+}
+
+static CACHE_STORAGE *
+shm_create(size_t max_size, size_t max_value_size, const char *options)
+{
+    const char *name = SHM_DEFAULT_NAME;
+
+    if (options && *options)
+    {
+        if (strncmp(options, "name=", 5) == 0 && options[5] == '/')
+        {
+            name = options + 5;
+        }
+        else
+        {
+            MXS_ERROR("cache: Invalid shm storage options '%s', expected "
+                      "'name=/<object name>'.", options);
+            return NULL;
+        }
+    }
+
+    uint64_t slot_size = sizeof(SHM_SLOT) + SHM_KEY_SPACE + max_value_size;
+    /** Keep the slots aligned */
+    slot_size = (slot_size + 7) & ~7ULL;
+    uint64_t n_slots = max_size / slot_size;
+
+    if (n_slots == 0)
+    {
+        n_slots = 1;
+    }
+
+    size_t map_size = sizeof(SHM_HEADER) + n_slots * slot_size;
+    bool created = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    if (fd == -1 && errno == EEXIST)
+    {
+        created = false;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+
+    if (fd == -1)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("cache: Failed to open shared memory object '%s': %s", name,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        return NULL;
+    }
+
+    if (created && ftruncate(fd, map_size) == -1)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("cache: Failed to resize shared memory object '%s': %s", name,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    /** Wait until the creator has sized the object */
+    struct stat st;
+    int retries = 0;
+
+    while (fstat(fd, &st) == 0 && (size_t) st.st_size < map_size && retries++ < SHM_INIT_RETRIES)
+    {
+        usleep(100000);
+    }
+
+    if ((size_t) st.st_size != map_size)
+    {
+        MXS_ERROR("cache: Shared memory object '%s' has a size of %ld bytes when %lu "
+                  "bytes are expected. All processes that share it must use the same "
+                  "max_size and max_resultset_size.", name, (long) st.st_size, map_size);
+        close(fd);
+        return NULL;
+    }
+
+    SHM_HEADER *header = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (header == MAP_FAILED)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("cache: Failed to map shared memory object '%s': %s", name,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        return NULL;
+    }
+
+    if (created)
+    {
+        if (!shm_init_header(header, n_slots, slot_size))
+        {
+            MXS_ERROR("cache: Failed to initialize the lock of shared memory object '%s'.", name);
+            munmap(header, map_size);
+            shm_unlink(name);
+            return NULL;
+        }
+    }
+    else
+    {
+        retries = 0;
+
+        while (header->magic != SHM_MAGIC && retries++ < SHM_INIT_RETRIES)
+        {
+            usleep(100000);
+        }
+
+        if (header->magic != SHM_MAGIC || header->version != SHM_VERSION ||
+            header->n_slots != n_slots || header->slot_size != slot_size)
+        {
+            MXS_ERROR("cache: Shared memory object '%s' was not created by a cache "
+                      "with the same max_size and max_resultset_size.", name);
+            munmap(header, map_size);
+            return NULL;
+        }
+    }
+
+    SHM_STORAGE *storage = calloc(1, sizeof(SHM_STORAGE));
+
+    if (storage == NULL || (storage->name = strdup(name)) == NULL)
+    {
+        free(storage);
+        munmap(header, map_size);
+        return NULL;
+    }
+
+    storage->header = header;
+    storage->map_size = map_size;
+
+    MXS_NOTICE("cache: %s shared memory object '%s' with %lu slots of %lu bytes.",
+               created ? "Created" : "Attached to", name, n_slots, slot_size);
+
+    return storage;
+}
+
+static GWBUF *
+shm_get(CACHE_STORAGE *instance, const char *key)
+{
+    SHM_STORAGE *storage = (SHM_STORAGE *) instance;
+    uint64_t hash = shm_hash(key);
+    size_t key_len = strlen(key);
+    GWBUF *rval = NULL;
+
+    if (shm_lock(storage))
+    {
+        SHM_SLOT *slot = shm_slot(storage, hash);
+
+        if (slot->hash == hash && slot->key_len == key_len &&
+            memcmp(slot->data, key, key_len) == 0)
+        {
+            rval = gwbuf_alloc_and_load(slot->value_len, slot->data + key_len);
+        }
+
+        pthread_mutex_unlock(&storage->header->lock);
+    }
+
+    atomic_add(rval ? &storage->hits : &storage->misses, 1);
+    return rval;
+}
+
+static bool
+shm_put(CACHE_STORAGE *instance, const char *key, GWBUF *value)
+{
+    SHM_STORAGE *storage = (SHM_STORAGE *) instance;
+    uint64_t hash = shm_hash(key);
+    size_t key_len = strlen(key);
+    size_t value_len = GWBUF_LENGTH(value);
+    bool rval = false;
+
+    if (sizeof(SHM_SLOT) + key_len + value_len > storage->header->slot_size)
+    {
+        return false;
+    }
+
+    if (shm_lock(storage))
+    {
+        SHM_SLOT *slot = shm_slot(storage, hash);
+
+        if (slot->hash && slot->hash != hash)
+        {
+            storage->collisions++;
+        }
+
+        slot->key_len = key_len;
+        slot->value_len = value_len;
+        memcpy(slot->data, key, key_len);
+        memcpy(slot->data + key_len, GWBUF_DATA(value), value_len);
+        slot->hash = hash;
+        rval = true;
+
+        pthread_mutex_unlock(&storage->header->lock);
+    }
+
+    return rval;
+}
+
+static void
+shm_del(CACHE_STORAGE *instance, const char *key)
+{
+    SHM_STORAGE *storage = (SHM_STORAGE *) instance;
+    uint64_t hash = shm_hash(key);
+    size_t key_len = strlen(key);
+
+    if (shm_lock(storage))
+    {
+        SHM_SLOT *slot = shm_slot(storage, hash);
+
+        if (slot->hash == hash && slot->key_len == key_len &&
+            memcmp(slot->data, key, key_len) == 0)
+        {
+            slot->hash = 0;
+        }
+
+        pthread_mutex_unlock(&storage->header->lock);
+    }
+}
+
+static void
+shm_diagnostic(CACHE_STORAGE *instance, DCB *dcb)
+{
+    SHM_STORAGE *storage = (SHM_STORAGE *) instance;
+
+    dcb_printf(dcb, "\t\tShared memory object           %s\n", storage->name);
+    dcb_printf(dcb, "\t\tSlots                          %lu of %lu bytes\n",
+               storage->header->n_slots, storage->header->slot_size);
+    dcb_printf(dcb, "\t\tStorage hits                   %d\n", storage->hits);
+    dcb_printf(dcb, "\t\tStorage misses                 %d\n", storage->misses);
+    dcb_printf(dcb, "\t\tCollisions                     %d\n", storage->collisions);
+}
+
+CACHE_STORAGE_API storage_shm =
+{
+    "shm",
+    shm_create,
+    shm_get,
+    shm_put,
+    shm_del,
+    shm_diagnostic
+};
@@ -73,6 +73,7 @@
 #include <skygw_types.h>
 #include <time.h>
 #include <assert.h>
+#include <ctype.h>
 #include <regex.h>
 #include <maxscale_pcre2.h>
 #include <dbfwfilter.h>
@@ -93,7 +94,7 @@ MODULE_INFO info =
     "Firewall Filter"
 };
 
-static char *version_str = "V1.2.0";
+static char *version_str = "V1.3.0";
 
 /*
  * The filter entry points
@@ -164,21 +165,37 @@ typedef struct timerange_t
 } TIMERANGE;
 
 /**
- * Query speed measurement and limitation structure
+ * Query speed limitation of a limit_queries rule
  */
 typedef struct queryspeed_t
 {
-    time_t first_query; /*< Time when the first query occurred */
-    time_t triggered; /*< Time when the limit was exceeded */
     int period; /*< Measurement interval in seconds */
     int cooldown; /*< Time the user is denied access for */
-    int count; /*< Number of queries done */
     int limit; /*< Maximum number of queries */
-    long id; /*< Unique id of the rule */
-    bool active; /*< If the rule has been triggered */
-    struct queryspeed_t* next; /*< Next node in the list */
+    long id; /*< Index of the rule's token bucket in USER::throttles */
 } QUERYSPEED;
 
+/**
+ * Token bucket of a limit_queries rule for one user
+ *
+ * The bucket holds the rule's limit of tokens and is refilled at the rate of
+ * limit tokens per period. It is stored as the time when the bucket would be
+ * full again, which allows it to be updated with one compare-and-swap.
+ */
+typedef struct throttle_t
+{
+    int64_t full_at; /*< Time when the bucket is full, in microseconds */
+    int64_t blocked_until; /*< End of the current cooldown, in microseconds */
+} THROTTLE;
+
+/** Results of counting a query against a token bucket */
+enum throttle_result
+{
+    THROTTLE_OK, /*< The query is allowed */
+    THROTTLE_TRIGGERED, /*< The query exceeded the limit and started a cooldown */
+    THROTTLE_BLOCKED /*< The query was done during a cooldown */
+};
+
 /**
  * A structure used to identify individual rules and to store their contents
  *
@@ -193,9 +210,16 @@ typedef struct rule_t
     qc_query_op_t on_queries; /*< Types of queries to inspect */
     int times_matched; /*< Number of times this rule has been matched */
     TIMERANGE* active; /*< List of times when this rule is active */
+    uint8_t* active_seconds; /*< Bitmap of the seconds of the day when the rule
+                              * is active, NULL if the rule is always active */
+    HASHTABLE* columns; /*< Lowercase column names of a column rule */
+    char* pattern; /*< Source of a regex rule */
     struct rule_t *next;
 } RULE;
 
+/** Number of seconds in a day, the size of the active_seconds bitmap in bits */
+#define FW_SECONDS_PER_DAY (24 * 60 * 60)
+
 /**
  * Linked list of pointers to a global pool of RULE structs
  */
@@ -205,6 +229,20 @@ typedef struct rulelist_t
     struct rulelist_t* next; /*< Next node in the list */
 } RULELIST;
 
+/**
+ * The rules of one matching mode of a user compiled for evaluation
+ *
+ * The regex rules of the set are combined into one alternation which is
+ * matched before the rules are evaluated. If it doesn't match, none of the
+ * regex rules can match and they are skipped.
+ */
+typedef struct ruleset_t
+{
+    RULE** rules; /*< The rules in evaluation order */
+    int n_rules; /*< Number of rules */
+    MXS_PCRE2_PATTERN* regex; /*< All regex rules in one pattern, NULL if not used */
+} RULESET;
+
 typedef struct user_template
 {
     char *name;
@@ -217,14 +255,40 @@ typedef struct user_t
 {
     char* name; /*< Name of the user */
     SPINLOCK lock; /*< User spinlock */
-    QUERYSPEED* qs_limit; /*< The query speed structure unique to this user */
+    THROTTLE* throttles; /*< Token buckets of the limit_queries rules of the user */
     RULELIST* rules_or; /*< If any of these rules match the action is triggered */
     RULELIST* rules_and; /*< All of these rules must match for the action to trigger */
     RULELIST* rules_strict_and; /*< rules that skip the rest of the rules if one of them
                  * fails. This is only for rules paired with 'match strict_all'. */
-
+    RULESET set_or; /*< Compiled rules_or */
+    RULESET set_and; /*< Compiled rules_and */
+    RULESET set_strict_and; /*< Compiled rules_strict_and */
 } USER;
 
+/**
+ * Information about the query that is being checked. The parts that need
+ * the query classifier are resolved when the first rule needs them and are
+ * shared by all the rules the query is checked against.
+ */
+typedef struct query_info_t
+{
+    GWBUF* queue; /*< The query */
+    char* query; /*< The SQL of the query, NULL if it has none */
+    size_t query_len; /*< Length of the SQL */
+    bool is_sql; /*< Whether the query is an SQL statement */
+    bool classified; /*< Whether the fields below have been resolved */
+    qc_parse_result_t parse_result; /*< Result of parsing the query */
+    qc_query_op_t optype; /*< Operation of the query */
+    bool is_real; /*< Whether the query is a real query */
+    char* fields; /*< Lowercase affected fields, NULL if not resolved */
+    char** columns; /*< The affected fields split into tokens */
+    int n_columns; /*< Number of tokens in columns */
+    bool skip_regex; /*< No regex rule of the current set can match */
+    time_t now; /*< Time the query was checked */
+    struct tm tm_now; /*< The local time */
+    int second; /*< Second of the day of the local time */
+} QUERY_INFO;
+
 /**
  * Linked list of IP adresses and subnet masks
  */
@@ -407,14 +471,27 @@ static void* rulelist_free(void* fval)
     return NULL;
 }
 
+static void ruleset_free(RULESET *set)
+{
+    free(set->rules);
+    mxs_pcre2_pattern_free(set->regex);
+    set->rules = NULL;
+    set->n_rules = 0;
+    set->regex = NULL;
+}
+
 static void* huserfree(void* fval)
 {
     USER* value = (USER*) fval;
 
+    ruleset_free(&value->set_or);
+    ruleset_free(&value->set_and);
+    ruleset_free(&value->set_strict_and);
+
     rulelist_free(value->rules_and);
     rulelist_free(value->rules_or);
     rulelist_free(value->rules_strict_and);
-    free(value->qs_limit);
+    free(value->throttles);
     free(value->name);
     free(value);
     return NULL;
@@ -733,7 +810,7 @@ static bool apply_rule_to_user(FW_INSTANCE *instance, char *username,
     }
 
     user->name = (char*) strdup(username);
-    user->qs_limit = NULL;
+    user->throttles = NULL;
     RULELIST *tl = (RULELIST*) rulelist_clone(rulelist);
     RULELIST *tail = tl;
 
@@ -886,6 +963,9 @@ bool create_rule(void* scanner, const char* name)
         ruledef->active = NULL;
         ruledef->times_matched = 0;
         ruledef->data = NULL;
+        ruledef->active_seconds = NULL;
+        ruledef->columns = NULL;
+        ruledef->pattern = NULL;
         rstack->rule = ruledef;
     }
     else
@@ -925,13 +1005,20 @@ static void free_rules(RULE* rule)
                 break;
 
             case RT_REGEX:
-                pcre2_code_free((pcre2_code*) rule->data);
+                mxs_pcre2_pattern_free((MXS_PCRE2_PATTERN*) rule->data);
                 break;
 
             default:
                 break;
         }
 
+        if (rule->columns)
+        {
+            hashtable_free(rule->columns);
+        }
+
+        free(rule->active_seconds);
+        free(rule->pattern);
         free(rule->name);
         rule = tmp;
     }
@@ -1143,7 +1230,7 @@ bool define_limit_queries_rule(void* scanner, int max, int timeperiod, int holdo
 {
     struct parser_stack* rstack = dbfw_yyget_extra((yyscan_t) scanner);
     ss_dassert(rstack);
-    QUERYSPEED* qs = malloc(sizeof(QUERYSPEED));
+    QUERYSPEED* qs = calloc(1, sizeof(QUERYSPEED));
 
     if (qs)
     {
@@ -1169,16 +1256,23 @@ bool define_limit_queries_rule(void* scanner, int max, int timeperiod, int holdo
 bool define_regex_rule(void* scanner, char* pattern)
 {
     /** This should never fail as long as the rule syntax is correct */
-    PCRE2_SPTR start = (PCRE2_SPTR) get_regex_string(&pattern);
+    char *start = get_regex_string(&pattern);
     ss_dassert(start);
-    pcre2_code *re;
+    MXS_PCRE2_PATTERN *re;
     int err;
     size_t offset;
-    if ((re = pcre2_compile(start, PCRE2_ZERO_TERMINATED,
-                            0, &err, &offset, NULL)))
+    if ((re = mxs_pcre2_pattern_compile(start, 0, &err, &offset)))
     {
         struct parser_stack* rstack = dbfw_yyget_extra((yyscan_t) scanner);
         ss_dassert(rstack);
+
+        if ((rstack->rule->pattern = strdup(start)) == NULL)
+        {
+            MXS_ERROR("Memory allocation failed.");
+            mxs_pcre2_pattern_free(re);
+            return false;
+        }
+
         rstack->rule->type = RT_REGEX;
         rstack->rule->data = (void*) re;
     }
@@ -1239,11 +1333,8 @@ static bool process_user_templates(FW_INSTANCE *instance, user_template_t *templ
 
         if (user == NULL)
         {
-            if ((user = malloc(sizeof(USER))) && (user->name = strdup(templates->name)))
+            if ((user = calloc(1, sizeof(USER))) && (user->name = strdup(templates->name)))
             {
-                user->rules_and = NULL;
-                user->rules_or = NULL;
-                user->rules_strict_and = NULL;
                 spinlock_init(&user->lock);
                 hashtable_add(instance->htable, user->name, user);
             }
@@ -1306,6 +1397,227 @@ static bool process_user_templates(FW_INSTANCE *instance, user_template_t *templ
     return rval;
 }
 
+/**
+ * @brief Compile the time ranges and the column list of a rule
+ *
+ * The time ranges are converted into a bitmap of the seconds of the day when
+ * the rule is active. A rule is active when the current time is strictly
+ * inside one of its time ranges.
+ *
+ * @param rule Rule to compile
+ * @return True on success, false on memory allocation failure
+ */
+static bool compile_rule(RULE *rule)
+{
+    if (rule->active)
+    {
+        if ((rule->active_seconds = calloc(FW_SECONDS_PER_DAY / 8, 1)) == NULL)
+        {
+            return false;
+        }
+
+        for (TIMERANGE *tr = rule->active; tr; tr = tr->next)
+        {
+            int start = tr->start.tm_hour * 3600 + tr->start.tm_min * 60 + tr->start.tm_sec;
+            int end = tr->end.tm_hour * 3600 + tr->end.tm_min * 60 + tr->end.tm_sec;
+
+            for (int i = start + 1; i < end && i < FW_SECONDS_PER_DAY; i++)
+            {
+                rule->active_seconds[i / 8] |= 1 << (i % 8);
+            }
+        }
+    }
+
+    if (rule->type == RT_COLUMN)
+    {
+        if ((rule->columns = hashtable_alloc(32, simple_str_hash, strcmp)) == NULL)
+        {
+            return false;
+        }
+
+        hashtable_memory_fns(rule->columns, (HASHMEMORYFN) strdup, NULL,
+                             (HASHMEMORYFN) free, NULL);
+
+        for (STRLINK *col = (STRLINK*) rule->data; col; col = col->next)
+        {
+            char lower[strlen(col->value) + 1];
+
+            for (int i = 0; i <= strlen(col->value); i++)
+            {
+                lower[i] = tolower(col->value[i]);
+            }
+
+            hashtable_add(rule->columns, lower, col->value);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Check if a regular expression can be a part of a combined pattern
+ *
+ * Patterns that refer to their own capture groups, use extended mode comments,
+ * quoting or verbs could change their meaning inside the combined pattern.
+ *
+ * @param pattern The regular expression
+ * @return True if the pattern matches the same queries inside a group
+ */
+static bool regex_can_combine(const char *pattern)
+{
+    for (const char *ptr = pattern; *ptr; ptr++)
+    {
+        if (*ptr == '\\')
+        {
+            ptr++;
+
+            if (isdigit(*ptr) || *ptr == 'g' || *ptr == 'k' || *ptr == 'Q' ||
+                *ptr == '\0')
+            {
+                return false;
+            }
+        }
+        else if (*ptr == '(' && (ptr[1] == '*' || (ptr[1] == '?' &&
+                                                    strchr("0123456789+-R&Px", ptr[2]))))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Compile a list of rules into a rule set
+ *
+ * @param set Set to build
+ * @param list The rules in evaluation order
+ * @return True on success, false on memory allocation failure
+ */
+static bool compile_ruleset(RULESET *set, RULELIST *list)
+{
+    int n_regex = 0;
+    size_t regex_len = 0;
+    bool combine = true;
+
+    for (RULELIST *r = list; r; r = r->next)
+    {
+        set->n_rules++;
+
+        if (r->rule->type == RT_REGEX)
+        {
+            n_regex++;
+            regex_len += strlen(r->rule->pattern) + sizeof("(?:)|");
+            combine = combine && regex_can_combine(r->rule->pattern);
+        }
+    }
+
+    if (set->n_rules == 0)
+    {
+        return true;
+    }
+
+    if ((set->rules = malloc(sizeof(RULE*) * set->n_rules)) == NULL)
+    {
+        return false;
+    }
+
+    int i = 0;
+
+    for (RULELIST *r = list; r; r = r->next)
+    {
+        set->rules[i++] = r->rule;
+    }
+
+    /** With only one regex rule, the rule itself is as fast as the combined pattern */
+    if (combine && n_regex > 1)
+    {
+        char *combined = malloc(regex_len + 1);
+
+        if (combined == NULL)
+        {
+            return false;
+        }
+
+        char *ptr = combined;
+
+        for (i = 0; i < set->n_rules; i++)
+        {
+            if (set->rules[i]->type == RT_REGEX)
+            {
+                ptr += sprintf(ptr, "%s(?:%s)", ptr == combined ? "" : "|",
+                               set->rules[i]->pattern);
+            }
+        }
+
+        int err;
+        size_t offset;
+
+        /** If the patterns can't be combined, the rules are matched one by one */
+        set->regex = mxs_pcre2_pattern_compile(combined, 0, &err, &offset);
+        free(combined);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Compile the rules and the rule lists of all users
+ *
+ * @param instance Filter instance
+ * @param rules List of all rules
+ * @return True on success, false on error
+ */
+static bool compile_rules(FW_INSTANCE *instance, RULE *rules)
+{
+    bool rval = true;
+    int n_throttles = 0;
+
+    for (RULE *rule = rules; rule && rval; rule = rule->next)
+    {
+        rval = compile_rule(rule);
+
+        if (rule->type == RT_THROTTLE)
+        {
+            ((QUERYSPEED*) rule->data)->id = n_throttles++;
+        }
+    }
+
+    HASHITERATOR *iter = rval ? hashtable_iterator(instance->htable) : NULL;
+
+    if (iter)
+    {
+        char *key;
+
+        while (rval && (key = hashtable_next(iter)))
+        {
+            USER *user = hashtable_fetch(instance->htable, key);
+
+            rval = compile_ruleset(&user->set_or, user->rules_or) &&
+                   compile_ruleset(&user->set_and, user->rules_and) &&
+                   compile_ruleset(&user->set_strict_and, user->rules_strict_and);
+
+            if (rval && n_throttles > 0)
+            {
+                rval = (user->throttles = calloc(n_throttles, sizeof(THROTTLE))) != NULL;
+            }
+        }
+
+        hashtable_iterator_free(iter);
+    }
+    else
+    {
+        rval = false;
+    }
+
+    if (!rval)
+    {
+        MXS_ERROR("Memory allocation failed when compiling the rules.");
+    }
+
+    return rval;
+}
+
 /**
  * Read a rule file from disk and process it into rule and user definitions
  * @param filename Name of the file
@@ -1339,7 +1651,8 @@ static bool process_rule_file(const char* filename, FW_INSTANCE* instance)
         dbfw_yylex_destroy(scanner);
         fclose(file);
 
-        if (rc == 0 && process_user_templates(instance, pstack.templates, pstack.rule))
+        if (rc == 0 && process_user_templates(instance, pstack.templates, pstack.rule) &&
+            compile_rules(instance, pstack.rule))
         {
             instance->rules = pstack.rule;
         }
@@ -1588,66 +1901,205 @@ GWBUF* gen_dummy_error(FW_SESSION* session, char* msg)
 }
 
 /**
- * Checks if the timerange object is active.
- * @return Whether the timerange is active
+ * Checks for active timeranges for a given rule.
+ * @param rule Pointer to a RULE object
+ * @param info The query being checked
+ * @return true if the rule is active
  */
-bool inside_timerange(TIMERANGE* comp)
+bool rule_is_active(RULE* rule, QUERY_INFO* info)
 {
+    return rule->active_seconds == NULL ||
+           (rule->active_seconds[info->second / 8] & (1 << (info->second % 8)));
+}
 
-    struct tm tm_now;
-    struct tm tm_before, tm_after;
-    time_t before, after, now, time_now;
-    double to_before, to_after;
-
-    time(&time_now);
-    localtime_r(&time_now, &tm_now);
-    memcpy(&tm_before, &tm_now, sizeof(struct tm));
-    memcpy(&tm_after, &tm_now, sizeof(struct tm));
+/**
+ * @brief Initialize the information about a query
+ *
+ * @param info Information to initialize
+ * @param queue The query
+ */
+static void query_info_init(QUERY_INFO* info, GWBUF* queue)
+{
+    memset(info, 0, sizeof(*info));
+    info->queue = queue;
+    info->is_sql = modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue);
+    info->optype = QUERY_OP_UNDEFINED;
 
+    if (info->is_sql || MYSQL_IS_COM_INIT_DB((uint8_t*)GWBUF_DATA(queue)))
+    {
+        if ((info->query = modutil_get_SQL(queue)))
+        {
+            info->query_len = strlen(info->query);
+        }
+    }
 
-    tm_before.tm_sec = comp->start.tm_sec;
-    tm_before.tm_min = comp->start.tm_min;
-    tm_before.tm_hour = comp->start.tm_hour;
-    tm_after.tm_sec = comp->end.tm_sec;
-    tm_after.tm_min = comp->end.tm_min;
-    tm_after.tm_hour = comp->end.tm_hour;
+    time(&info->now);
+    localtime_r(&info->now, &info->tm_now);
+    info->second = info->tm_now.tm_hour * 3600 + info->tm_now.tm_min * 60 +
+                   info->tm_now.tm_sec;
 
+    /** Leap seconds are counted as the last second of the day */
+    if (info->second >= FW_SECONDS_PER_DAY)
+    {
+        info->second = FW_SECONDS_PER_DAY - 1;
+    }
+}
 
-    before = mktime(&tm_before);
-    after = mktime(&tm_after);
-    now = mktime(&tm_now);
-    to_before = difftime(now, before);
-    to_after = difftime(now, after);
+/**
+ * @brief Free the information about a query
+ *
+ * @param info Information to free
+ */
+static void query_info_free(QUERY_INFO* info)
+{
+    free(info->query);
+    free(info->fields);
+    free(info->columns);
+}
 
-    if (to_before > 0.0 && to_after < 0.0)
+/**
+ * @brief Classify the query once for all the rules
+ *
+ * @param info The query being checked
+ */
+static void query_info_classify(QUERY_INFO* info)
+{
+    if (!info->classified)
     {
-        return true;
+        info->classified = true;
+        info->parse_result = qc_parse(info->queue, QC_COLLECT_ALL);
+
+        if (info->parse_result != QC_QUERY_INVALID)
+        {
+            info->optype = qc_get_operation(info->queue);
+            info->is_real = qc_is_real_query(info->queue);
+        }
     }
-    return false;
 }
 
 /**
- * Checks for active timeranges for a given rule.
- * @param rule Pointer to a RULE object
- * @return true if the rule is active
+ * @brief Resolve the fields the query affects
+ *
+ * The fields are converted to lowercase and split into tokens once so that
+ * the column rules can look them up directly from their hashtables.
+ *
+ * @param info The query being checked
+ * @return The lowercase fields or NULL if they could not be resolved
  */
-bool rule_is_active(RULE* rule)
+static char* query_info_fields(QUERY_INFO* info)
 {
-    TIMERANGE* times;
-    if (rule->active != NULL)
+    if (info->fields == NULL && (info->fields = qc_get_affected_fields(info->queue)))
     {
-        times = (TIMERANGE*) rule->active;
-        while (times)
+        int n = 1;
+
+        for (char *ptr = info->fields; *ptr; ptr++)
         {
-            if (inside_timerange(times))
+            *ptr = tolower(*ptr);
+
+            if (*ptr == ' ' || *ptr == ',')
             {
-                return true;
+                n++;
             }
-            times = times->next;
         }
-        return false;
+
+        char *copy = NULL;
+
+        /** The tokens point to a copy that is stored right after the pointer array */
+        if ((info->columns = malloc(sizeof(char*) * n + strlen(info->fields) + 1)))
+        {
+            copy = (char*) (info->columns + n);
+            strcpy(copy, info->fields);
+
+            char *saveptr;
+            char *tok = strtok_r(copy, " ,", &saveptr);
+
+            while (tok)
+            {
+                info->columns[info->n_columns++] = tok;
+                tok = strtok_r(NULL, " ,", &saveptr);
+            }
+        }
+        else
+        {
+            MXS_ERROR("Memory allocation failed.");
+        }
     }
-    return true;
+
+    return info->fields;
+}
+
+/**
+ * @brief Match the combined pattern of a rule set against the query
+ *
+ * @param set The rule set
+ * @param info The query being checked
+ */
+static void query_info_match_set(QUERY_INFO* info, RULESET* set)
+{
+    info->skip_regex = set->regex && info->query &&
+                       mxs_pcre2_pattern_match(set->regex, info->query,
+                                               info->query_len) == MXS_PCRE2_NOMATCH;
+}
+
+/**
+ * @brief Current time for the token buckets
+ *
+ * @return Monotonic time in microseconds
+ */
+static int64_t throttle_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Count a query against the token bucket of a limit_queries rule
+ *
+ * The bucket is shared by all the sessions of the user and is updated without
+ * locks. When the bucket is empty, the user is denied for the cooldown of the
+ * rule and the bucket is full again when the cooldown ends.
+ *
+ * @param throttle The token bucket
+ * @param qs The limit_queries rule
+ * @param now Current time from throttle_time()
+ * @param blocked_until Set to the end of the cooldown if the query is denied
+ * @return Whether the query is allowed
+ */
+static enum throttle_result throttle_query(THROTTLE* throttle, QUERYSPEED* qs,
+                                           int64_t now, int64_t* blocked_until)
+{
+    int64_t until = throttle->blocked_until;
+
+    if (now < until)
+    {
+        *blocked_until = until;
+        return THROTTLE_BLOCKED;
+    }
+
+    /** Each query takes one token, i.e. moves the time when the bucket is
+     * full forward by one refill interval */
+    int64_t period = (int64_t) qs->period * 1000000;
+    int64_t interval = qs->limit > 0 ? period / qs->limit : period + 1;
+    int64_t full_at, next;
+
+    do
+    {
+        full_at = throttle->full_at;
+        next = MAX(full_at, now) + interval;
+
+        if (next - now > period)
+        {
+            until = now + (int64_t) qs->cooldown * 1000000;
+            __sync_lock_test_and_set(&throttle->blocked_until, until);
+            __sync_bool_compare_and_swap(&throttle->full_at, full_at, until);
+            *blocked_until = until;
+            return THROTTLE_TRIGGERED;
+        }
+    }
+    while (!__sync_bool_compare_and_swap(&throttle->full_at, full_at, next));
+
+    return THROTTLE_OK;
 }
 
 /**
@@ -1698,55 +2150,47 @@ static char* create_parse_error(FW_INSTANCE* my_instance,
  * Check if a query matches a single rule
  * @param my_instance Fwfilter instance
  * @param my_session Fwfilter session
- * @param queue The GWBUF containing the query
- * @param rulelist The rule to check
- * @param query Pointer to the null-terminated query string
+ * @param user The user whose rule is checked
+ * @param rule The rule to check
+ * @param info The query being checked
  * @return true if the query matches the rule
  */
 bool rule_matches(FW_INSTANCE* my_instance,
                   FW_SESSION* my_session,
-                  GWBUF *queue,
                   USER* user,
-                  RULELIST *rulelist,
-                  char* query)
+                  RULE* rule,
+                  QUERY_INFO* info)
 {
-    char *ptr, *where, *msg = NULL;
+    char *where, *msg = NULL;
     char emsg[512];
 
-    unsigned char* memptr = (unsigned char*) queue->start;
+    GWBUF* queue = info->queue;
+    char* query = info->query;
     bool is_sql, is_real, matches;
     qc_query_op_t optype = QUERY_OP_UNDEFINED;
-    STRLINK* strln = NULL;
-    QUERYSPEED* queryspeed = NULL;
-    QUERYSPEED* rule_qs = NULL;
-    time_t time_now;
-    struct tm tm_now;
-
-    time(&time_now);
-    localtime_r(&time_now, &tm_now);
 
     matches = false;
-    is_sql = modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue);
+    is_sql = info->is_sql;
 
     if (is_sql)
     {
-        qc_parse_result_t parse_result = qc_parse(queue);
+        query_info_classify(info);
 
-        if (parse_result == QC_QUERY_INVALID)
+        if (info->parse_result == QC_QUERY_INVALID)
         {
             msg = create_parse_error(my_instance, "tokenized", query, &matches);
             goto queryresolved;
         }
         else
         {
-            optype = qc_get_operation(queue);
-            is_real = qc_is_real_query(queue);
+            optype = info->optype;
+            is_real = info->is_real;
 
-            if (parse_result != QC_QUERY_PARSED)
+            if (info->parse_result != QC_QUERY_PARSED)
             {
-                if ((rulelist->rule->type == RT_COLUMN) ||
-                    (rulelist->rule->type == RT_WILDCARD) ||
-                    (rulelist->rule->type == RT_CLAUSE))
+                if ((rule->type == RT_COLUMN) ||
+                    (rule->type == RT_WILDCARD) ||
+                    (rule->type == RT_CLAUSE))
                 {
                     switch (optype)
                     {
@@ -1771,43 +2215,35 @@ bool rule_matches(FW_INSTANCE* my_instance,
         is_real = false;
     }
 
-    if (rulelist->rule->on_queries == QUERY_OP_UNDEFINED ||
-        rulelist->rule->on_queries & optype ||
+    if (rule->on_queries == QUERY_OP_UNDEFINED ||
+        rule->on_queries & optype ||
         (MYSQL_IS_COM_INIT_DB((uint8_t*)GWBUF_DATA(queue)) &&
-         rulelist->rule->on_queries & QUERY_OP_CHANGE_DB))
+         rule->on_queries & QUERY_OP_CHANGE_DB))
     {
-        switch (rulelist->rule->type)
+        switch (rule->type)
         {
             case RT_UNDEFINED:
                 MXS_ERROR("Undefined rule type found.");
                 break;
 
             case RT_REGEX:
-                if (query)
+                if (query && !info->skip_regex)
                 {
-                    pcre2_match_data *mdata = pcre2_match_data_create_from_pattern(
-                                                  rulelist->rule->data, NULL);
+                    mxs_pcre2_result_t result = mxs_pcre2_pattern_match(
+                                                    (MXS_PCRE2_PATTERN*) rule->data,
+                                                    query, info->query_len);
 
-                    if (mdata)
+                    if (result == MXS_PCRE2_MATCH)
                     {
-                        if (pcre2_match((pcre2_code*) rulelist->rule->data,
-                                        (PCRE2_SPTR) query, PCRE2_ZERO_TERMINATED,
-                                        0, 0, mdata, NULL) > 0)
-                        {
-                            matches = true;
-                        }
-                        pcre2_match_data_free(mdata);
-                        if (matches)
-                        {
-                            msg = strdup("Permission denied, query matched regular expression.");
-                            MXS_INFO("dbfwfilter: rule '%s': regex matched on query", rulelist->rule->name);
-                            goto queryresolved;
-                        }
+                        matches = true;
+                        msg = strdup("Permission denied, query matched regular expression.");
+                        MXS_INFO("dbfwfilter: rule '%s': regex matched on query", rule->name);
+                        goto queryresolved;
                     }
-                    else
+                    else if (result == MXS_PCRE2_ERROR)
                     {
-                        MXS_ERROR("Allocation of matching data for PCRE2 failed."
-                                  " This is most likely caused by a lack of memory");
+                        MXS_ERROR("Matching the regular expression of rule '%s' failed.",
+                                  rule->name);
                     }
                 }
                 break;
@@ -1817,153 +2253,76 @@ bool rule_matches(FW_INSTANCE* my_instance,
                     matches = true;
                     msg = strdup("Permission denied at this time.");
                     char buffer[32]; // asctime documentation requires 26
-                    asctime_r(&tm_now, buffer);
-                    MXS_INFO("dbfwfilter: rule '%s': query denied at: %s", rulelist->rule->name, buffer);
+                    asctime_r(&info->tm_now, buffer);
+                    MXS_INFO("dbfwfilter: rule '%s': query denied at: %s", rule->name, buffer);
                     goto queryresolved;
                 }
                 break;
 
             case RT_COLUMN:
-                if (is_sql && is_real)
+                if (is_sql && is_real && query_info_fields(info))
                 {
-                    where = qc_get_affected_fields(queue);
-                    if (where != NULL)
+                    for (int i = 0; i < info->n_columns; i++)
                     {
-                        char* saveptr;
-                        char* tok = strtok_r(where, " ", &saveptr);
-                        while (tok)
-                        {
-                            strln = (STRLINK*) rulelist->rule->data;
-                            while (strln)
-                            {
-                                if (strcasecmp(tok, strln->value) == 0)
-                                {
-                                    matches = true;
-
-                                    sprintf(emsg, "Permission denied to column '%s'.", strln->value);
-                                    MXS_INFO("dbfwfilter: rule '%s': query targets forbidden column: %s",
-                                             rulelist->rule->name, strln->value);
-                                    msg = strdup(emsg);
-                                    free(where);
-                                    goto queryresolved;
-                                }
-                                strln = strln->next;
-                            }
-                            tok = strtok_r(NULL, ",", &saveptr);
-                        }
-                        free(where);
-                    }
-                }
-                break;
-
-            case RT_WILDCARD:
-                if (is_sql && is_real)
-                {
-                    char * strptr;
-                    where = qc_get_affected_fields(queue);
+                        char *column = hashtable_fetch(rule->columns, info->columns[i]);
 
-                    if (where != NULL)
-                    {
-                        strptr = where;
-
-                        if (strchr(strptr, '*'))
+                        if (column)
                         {
                             matches = true;
-                            msg = strdup("Usage of wildcard denied.");
-                            MXS_INFO("dbfwfilter: rule '%s': query contains a wildcard.",
-                                     rulelist->rule->name);
-                            free(where);
+
+                            snprintf(emsg, sizeof(emsg), "Permission denied to column '%s'.", column);
+                            MXS_INFO("dbfwfilter: rule '%s': query targets forbidden column: %s",
+                                     rule->name, column);
+                            msg = strdup(emsg);
                             goto queryresolved;
                         }
-                        free(where);
                     }
                 }
                 break;
 
-            case RT_THROTTLE:
-                /**
-                 * Check if this is the first time this rule is matched and if so, allocate
-                 * and initialize a new QUERYSPEED struct for this session.
-                 */
-                spinlock_acquire(&my_instance->lock);
-                rule_qs = (QUERYSPEED*) rulelist->rule->data;
-                spinlock_release(&my_instance->lock);
-
-                spinlock_acquire(&user->lock);
-                queryspeed = user->qs_limit;
-                spinlock_release(&user->lock);
-
-                while (queryspeed)
+            case RT_WILDCARD:
+                if (is_sql && is_real && (where = query_info_fields(info)))
                 {
-                    if (queryspeed->id == rule_qs->id)
+                    if (strchr(where, '*'))
                     {
-                        break;
+                        matches = true;
+                        msg = strdup("Usage of wildcard denied.");
+                        MXS_INFO("dbfwfilter: rule '%s': query contains a wildcard.",
+                                 rule->name);
+                        goto queryresolved;
                     }
-                    queryspeed = queryspeed->next;
                 }
+                break;
 
-                if (queryspeed == NULL)
+            case RT_THROTTLE:
                 {
+                    QUERYSPEED* qs = (QUERYSPEED*) rule->data;
+                    int64_t now = throttle_time();
+                    int64_t blocked_until;
 
-                    /**No match found*/
-                    queryspeed = (QUERYSPEED*) calloc(1, sizeof(QUERYSPEED));
-                    queryspeed->period = rule_qs->period;
-                    queryspeed->cooldown = rule_qs->cooldown;
-                    queryspeed->limit = rule_qs->limit;
-                    queryspeed->id = rule_qs->id;
-                    queryspeed->next = user->qs_limit;
-                    user->qs_limit = queryspeed;
-                }
+                    enum throttle_result result = throttle_query(&user->throttles[qs->id],
+                                                                 qs, now, &blocked_until);
 
-                if (queryspeed->active)
-                {
-                    if (difftime(time_now, queryspeed->triggered) < queryspeed->cooldown)
+                    if (result != THROTTLE_OK)
                     {
+                        double blocked_for = (blocked_until - now) / 1000000.0;
 
-                        double blocked_for =
-                            queryspeed->cooldown - difftime(time_now, queryspeed->triggered);
+                        if (result == THROTTLE_TRIGGERED)
+                        {
+                            MXS_INFO("dbfwfilter: rule '%s': query limit triggered (%d queries in %d seconds), "
+                                     "denying queries from user for %d seconds.",
+                                     rule->name, qs->limit, qs->period, qs->cooldown);
+                        }
+                        else
+                        {
+                            MXS_INFO("dbfwfilter: rule '%s': user denied for %f seconds",
+                                     rule->name, blocked_for);
+                        }
 
                         sprintf(emsg, "Queries denied for %f seconds", blocked_for);
-                        MXS_INFO("dbfwfilter: rule '%s': user denied for %f seconds",
-                                 rulelist->rule->name, blocked_for);
                         msg = strdup(emsg);
                         matches = true;
                     }
-                    else
-                    {
-                        queryspeed->active = false;
-                        queryspeed->count = 0;
-                    }
-                }
-                else
-                {
-                    if (queryspeed->count >= queryspeed->limit)
-                    {
-                        queryspeed->triggered = time_now;
-                        matches = true;
-                        queryspeed->active = true;
-
-                        MXS_INFO("dbfwfilter: rule '%s': query limit triggered (%d queries in %d seconds), "
-                                 "denying queries from user for %d seconds.",
-                                 rulelist->rule->name,
-                                 queryspeed->limit,
-                                 queryspeed->period,
-                                 queryspeed->cooldown);
-                        double blocked_for =
-                            queryspeed->cooldown - difftime(time_now, queryspeed->triggered);
-                        sprintf(emsg, "Queries denied for %f seconds", blocked_for);
-                        msg = strdup(emsg);
-                    }
-                    else if (queryspeed->count > 0 &&
-                             difftime(time_now, queryspeed->first_query) <= queryspeed->period)
-                    {
-                        queryspeed->count++;
-                    }
-                    else
-                    {
-                        queryspeed->first_query = time_now;
-                        queryspeed->count = 1;
-                    }
                 }
                 break;
 
@@ -1974,7 +2333,7 @@ bool rule_matches(FW_INSTANCE* my_instance,
                     matches = true;
                     msg = strdup("Required WHERE/HAVING clause is missing.");
                     MXS_INFO("dbfwfilter: rule '%s': query has no where/having "
-                             "clause, query is denied.", rulelist->rule->name);
+                             "clause, query is denied.", rule->name);
                 }
                 break;
 
@@ -1997,7 +2356,7 @@ queryresolved:
 
     if (matches)
     {
-        rulelist->rule->times_matched++;
+        rule->times_matched++;
     }
 
     return matches;
@@ -2007,38 +2366,33 @@ queryresolved:
  * Check if the query matches any of the rules in the user's rulelist.
  * @param my_instance Fwfilter instance
  * @param my_session Fwfilter session
- * @param queue The GWBUF containing the query
+ * @param info The query being checked
  * @param user The user whose rulelist is checked
  * @return True if the query matches at least one of the rules otherwise false
  */
 bool check_match_any(FW_INSTANCE* my_instance, FW_SESSION* my_session,
-                     GWBUF *queue, USER* user, char** rulename)
+                     QUERY_INFO* info, USER* user, char** rulename)
 {
-    RULELIST* rulelist;
+    RULESET* set = &user->set_or;
     bool rval = false;
 
-    if ((rulelist = user->rules_or) &&
-        (modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue) ||
-         MYSQL_IS_COM_INIT_DB((uint8_t*)GWBUF_DATA(queue))))
+    if (set->n_rules > 0 &&
+        (info->is_sql || MYSQL_IS_COM_INIT_DB((uint8_t*)GWBUF_DATA(info->queue))))
     {
-        char *fullquery = modutil_get_SQL(queue);
-        while (rulelist)
+        query_info_match_set(info, set);
+
+        for (int i = 0; i < set->n_rules; i++)
         {
-            if (!rule_is_active(rulelist->rule))
-            {
-                rulelist = rulelist->next;
-                continue;
-            }
-            if (rule_matches(my_instance, my_session, queue, user, rulelist, fullquery))
+            RULE* rule = set->rules[i];
+
+            if (rule_is_active(rule, info) &&
+                rule_matches(my_instance, my_session, user, rule, info))
             {
-                *rulename = strdup(rulelist->rule->name);
+                *rulename = strdup(rule->name);
                 rval = true;
                 break;
             }
-            rulelist = rulelist->next;
         }
-
-        free(fullquery);
     }
     return rval;
 }
@@ -2083,36 +2437,38 @@ void append_string(char** dest, size_t* size, const char* src)
  * Check if the query matches all rules in the user's rulelist.
  * @param my_instance Fwfilter instance
  * @param my_session Fwfilter session
- * @param queue The GWBUF containing the query
+ * @param info The query being checked
  * @param user The user whose rulelist is checked
  * @return True if the query matches all of the rules otherwise false
  */
 bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
-                     GWBUF *queue, USER* user, bool strict_all, char** rulename)
+                     QUERY_INFO* info, USER* user, bool strict_all, char** rulename)
 {
     bool rval = false;
     bool have_active_rule = false;
-    RULELIST* rulelist = strict_all ? user->rules_strict_and : user->rules_and;
+    RULESET* set = strict_all ? &user->set_strict_and : &user->set_and;
     char *matched_rules = NULL;
     size_t size = 0;
 
-    if (rulelist && (modutil_is_SQL(queue) || modutil_is_SQL_prepare(queue)))
+    if (set->n_rules > 0 && info->is_sql)
     {
-        char *fullquery = modutil_get_SQL(queue);
+        query_info_match_set(info, set);
         rval = true;
-        while (rulelist)
+
+        for (int i = 0; i < set->n_rules; i++)
         {
-            if (!rule_is_active(rulelist->rule))
+            RULE* rule = set->rules[i];
+
+            if (!rule_is_active(rule, info))
             {
-                rulelist = rulelist->next;
                 continue;
             }
 
             have_active_rule = true;
 
-            if (rule_matches(my_instance, my_session, queue, user, rulelist, fullquery))
+            if (rule_matches(my_instance, my_session, user, rule, info))
             {
-                append_string(&matched_rules, &size, rulelist->rule->name);
+                append_string(&matched_rules, &size, rule->name);
             }
             else
             {
@@ -2122,8 +2478,6 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
                     break;
                 }
             }
-
-            rulelist = rulelist->next;
         }
 
         if (!have_active_rule)
@@ -2131,7 +2485,6 @@ bool check_match_all(FW_INSTANCE* my_instance, FW_SESSION* my_session,
             /** No active rules */
             rval = false;
         }
-        free(fullquery);
     }
 
     /** Set the list of matched rule names */
@@ -2211,14 +2564,19 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
         {
             bool match = false;
             char* rname = NULL;
+            QUERY_INFO info;
 
-            if (check_match_any(my_instance, my_session, queue, user, &rname) ||
-                check_match_all(my_instance, my_session, queue, user, false, &rname) ||
-                check_match_all(my_instance, my_session, queue, user, true, &rname))
+            query_info_init(&info, queue);
+
+            if (check_match_any(my_instance, my_session, &info, user, &rname) ||
+                check_match_all(my_instance, my_session, &info, user, false, &rname) ||
+                check_match_all(my_instance, my_session, &info, user, true, &rname))
             {
                 match = true;
             }
 
+            query_info_free(&info);
+
             switch (my_instance->action)
             {
                 case FW_ACTION_ALLOW:
@@ -79,6 +79,54 @@ typedef enum
     HM_EXECUTE, HM_START, HM_PREPARE
 } HINT_MODE;
 
+/** Every hint starts with this keyword */
+#define HINT_MARKER     "maxscale"
+#define HINT_MARKER_LEN 8
+
+/**
+ * Check if a statement can contain a hint
+ *
+ * All hints start with the keyword 'maxscale' so a statement that doesn't
+ * contain it anywhere needs no parsing. The keyword is located with memchr,
+ * which scans several bytes at a time, instead of walking the statement one
+ * character at a time. Statements that span several buffers are always parsed.
+ *
+ * @param request The request buffer
+ * @param ptr     Start of the SQL
+ * @param len     Length of the SQL in the first buffer
+ * @return False if the statement can't contain a hint
+ */
+static bool hint_marker_present(GWBUF *request, char *ptr, int len)
+{
+    if (request->next)
+    {
+        return true;
+    }
+
+    char *end = ptr + len;
+
+    while (end - ptr >= HINT_MARKER_LEN)
+    {
+        size_t left = end - ptr - HINT_MARKER_LEN + 1;
+        char *lower = memchr(ptr, 'm', left);
+        char *upper = memchr(ptr, 'M', lower ? lower - ptr : left);
+        char *start = upper ? upper : lower;
+
+        if (start == NULL)
+        {
+            break;
+        }
+        else if (strncasecmp(start, HINT_MARKER, HINT_MARKER_LEN) == 0)
+        {
+            return true;
+        }
+
+        ptr = start + 1;
+    }
+
+    return false;
+}
+
 void token_free(HINT_TOKEN* token)
 {
     if (token->value != NULL)
@@ -147,6 +195,12 @@ hint_parser(HINT_SESSION *session, GWBUF *request)
 
     /* First look for any comment in the SQL */
     modutil_MySQL_Query(request, &ptr, &len, &residual);
+
+    if (!hint_marker_present(request, ptr, len))
+    {
+        goto retblock;
+    }
+
     buf = request;
     found = 0;
     escape = 0;
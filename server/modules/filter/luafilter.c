@@ -34,6 +34,12 @@
  * is defined and valid, the matching entry point function in Lua will be called.
  * The same holds true for session script apart from no calls to createInstance
  * or diagnostic being made for the session script.
+ *
+ * The global script is loaded into one Lua state per polling thread and one
+ * state shared by the other threads. Each thread calls the entry points in its
+ * own state, so the global script does not serialize the polling threads. The
+ * states do not share Lua variables; the shared_get, shared_set and shared_add
+ * functions store values that are visible to all states of the filter instance.
  */
 
 #include <skygw_types.h>
@@ -44,6 +50,10 @@
 #include <filter.h>
 #include <session.h>
 #include <modutil.h>
+#include <atomic.h>
+#include <hashtable.h>
+#include <maxconfig.h>
+#include <maxscale/poll.h>
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
@@ -56,7 +66,7 @@ MODULE_INFO info =
     "Lua Filter"
 };
 
-static const char *version_str = "V1.0.0";
+static const char *version_str = "V1.1.0";
 
 /**
  * Implementation of the mandatory version entry point
@@ -123,17 +133,386 @@ static int id_gen(lua_State* state)
     return 1;
 }
 
+/**
+ * A Lua state of the global script
+ */
+typedef struct
+{
+    lua_State* state;
+    SPINLOCK lock; /*< Only contended in the state of the non-polling threads */
+} LUA_GLOBAL_STATE;
+
 /**
  * The Lua filter instance.
  */
 typedef struct
 {
-    lua_State* global_lua_state;
+    LUA_GLOBAL_STATE* global_states; /*< A state for each polling thread and
+                                      * one for the other threads */
+    int n_global_states;
     char* global_script;
     char* session_script;
-    SPINLOCK lock;
+    HASHTABLE* shared; /*< Values shared by all Lua states */
+    SPINLOCK lock; /*< Protects the shared values */
 } LUA_INSTANCE;
 
+/**
+ * A value stored with shared_set
+ */
+typedef struct
+{
+    int type; /*< LUA_TNUMBER, LUA_TSTRING or LUA_TBOOLEAN */
+    lua_Number number;
+    char* string;
+    size_t length;
+} LUA_SHARED_VALUE;
+
+static void* shared_value_free(void* data)
+{
+    LUA_SHARED_VALUE* value = (LUA_SHARED_VALUE*) data;
+
+    if (value)
+    {
+        free(value->string);
+        free(value);
+    }
+
+    return NULL;
+}
+
+/**
+ * Copy a shared value
+ *
+ * @param dest Destination
+ * @param src Value to copy
+ * @return False on memory allocation failure
+ */
+static bool shared_value_copy(LUA_SHARED_VALUE* dest, const LUA_SHARED_VALUE* src)
+{
+    *dest = *src;
+
+    if (src->string)
+    {
+        if ((dest->string = malloc(src->length + 1)) == NULL)
+        {
+            return false;
+        }
+        memcpy(dest->string, src->string, src->length + 1);
+    }
+
+    return true;
+}
+
+/**
+ * Store a value that is visible to all Lua states of the filter instance
+ *
+ * Lua signature: shared_set(string key, (nil | number | string | boolean) value)
+ *
+ * Setting a key to nil removes it.
+ * @param state Lua state
+ * @return Always 0
+ */
+static int lua_shared_set(lua_State* state)
+{
+    LUA_INSTANCE* my_instance = (LUA_INSTANCE*) lua_touserdata(state, lua_upvalueindex(1));
+    const char* key = luaL_checkstring(state, 1);
+    int type = lua_type(state, 2);
+    LUA_SHARED_VALUE value = {type, 0, NULL, 0};
+
+    switch (type)
+    {
+        case LUA_TNIL:
+            break;
+
+        case LUA_TNUMBER:
+            value.number = lua_tonumber(state, 2);
+            break;
+
+        case LUA_TBOOLEAN:
+            value.number = lua_toboolean(state, 2);
+            break;
+
+        case LUA_TSTRING:
+            /** Lua strings are constant and not freed while on the stack */
+            value.string = (char*) lua_tolstring(state, 2, &value.length);
+            break;
+
+        default:
+            return luaL_argerror(state, 2, "expected nil, a number, a string or a boolean");
+    }
+
+    LUA_SHARED_VALUE* stored = NULL;
+
+    if (type != LUA_TNIL)
+    {
+        if ((stored = malloc(sizeof(LUA_SHARED_VALUE))) == NULL ||
+            !shared_value_copy(stored, &value))
+        {
+            free(stored);
+            return luaL_error(state, "Memory allocation failed.");
+        }
+    }
+
+    spinlock_acquire(&my_instance->lock);
+    hashtable_delete(my_instance->shared, (char*) key);
+
+    if (stored && hashtable_add(my_instance->shared, (char*) key, stored) == 0)
+    {
+        shared_value_free(stored);
+    }
+    spinlock_release(&my_instance->lock);
+
+    return 0;
+}
+
+/**
+ * Push a copy of a shared value to the stack and free the copy
+ *
+ * @param state Lua state
+ * @param value The copy
+ */
+static void push_shared_value(lua_State* state, LUA_SHARED_VALUE* value)
+{
+    switch (value->type)
+    {
+        case LUA_TNUMBER:
+            lua_pushnumber(state, value->number);
+            break;
+
+        case LUA_TBOOLEAN:
+            lua_pushboolean(state, value->number != 0);
+            break;
+
+        case LUA_TSTRING:
+            lua_pushlstring(state, value->string, value->length);
+            break;
+
+        default:
+            lua_pushnil(state);
+            break;
+    }
+
+    free(value->string);
+}
+
+/**
+ * Read a value stored with shared_set
+ *
+ * Lua signature: (nil | number | string | boolean) shared_get(string key)
+ *
+ * @param state Lua state
+ * @return Always 1
+ */
+static int lua_shared_get(lua_State* state)
+{
+    LUA_INSTANCE* my_instance = (LUA_INSTANCE*) lua_touserdata(state, lua_upvalueindex(1));
+    const char* key = luaL_checkstring(state, 1);
+    LUA_SHARED_VALUE value = {LUA_TNIL, 0, NULL, 0};
+    bool ok = true;
+
+    /** The value is copied so that the lock is not held when Lua can raise an error */
+    spinlock_acquire(&my_instance->lock);
+    LUA_SHARED_VALUE* stored = hashtable_fetch(my_instance->shared, (char*) key);
+
+    if (stored)
+    {
+        ok = shared_value_copy(&value, stored);
+    }
+    spinlock_release(&my_instance->lock);
+
+    if (!ok)
+    {
+        return luaL_error(state, "Memory allocation failed.");
+    }
+
+    push_shared_value(state, &value);
+    return 1;
+}
+
+/**
+ * Add a number to a shared value
+ *
+ * Lua signature: number shared_add(string key, number value)
+ *
+ * A key that has no value is treated as zero. The addition is atomic with
+ * respect to the other shared value functions.
+ * @param state Lua state
+ * @return Always 1
+ */
+static int lua_shared_add(lua_State* state)
+{
+    LUA_INSTANCE* my_instance = (LUA_INSTANCE*) lua_touserdata(state, lua_upvalueindex(1));
+    const char* key = luaL_checkstring(state, 1);
+    lua_Number add = luaL_checknumber(state, 2);
+    LUA_SHARED_VALUE* value = malloc(sizeof(LUA_SHARED_VALUE));
+    lua_Number result = 0;
+    bool is_number = true;
+
+    if (value == NULL)
+    {
+        return luaL_error(state, "Memory allocation failed.");
+    }
+
+    spinlock_acquire(&my_instance->lock);
+    LUA_SHARED_VALUE* stored = hashtable_fetch(my_instance->shared, (char*) key);
+
+    if (stored == NULL)
+    {
+        value->type = LUA_TNUMBER;
+        value->number = add;
+        value->string = NULL;
+        value->length = 0;
+        result = add;
+
+        if (hashtable_add(my_instance->shared, (char*) key, value))
+        {
+            value = NULL;
+        }
+    }
+    else if (stored->type == LUA_TNUMBER)
+    {
+        stored->number += add;
+        result = stored->number;
+    }
+    else
+    {
+        is_number = false;
+    }
+    spinlock_release(&my_instance->lock);
+
+    free(value);
+
+    if (!is_number)
+    {
+        return luaL_error(state, "The value of '%s' is not a number.", key);
+    }
+
+    lua_pushnumber(state, result);
+    return 1;
+}
+
+/**
+ * Export the C functions to a Lua state
+ *
+ * @param state Lua state
+ * @param my_instance The filter instance
+ */
+static void register_functions(lua_State* state, LUA_INSTANCE* my_instance)
+{
+    lua_pushcfunction(state, id_gen);
+    lua_setglobal(state, "id_gen");
+
+    lua_pushlightuserdata(state, my_instance);
+    lua_pushcclosure(state, lua_shared_set, 1);
+    lua_setglobal(state, "shared_set");
+
+    lua_pushlightuserdata(state, my_instance);
+    lua_pushcclosure(state, lua_shared_get, 1);
+    lua_setglobal(state, "shared_get");
+
+    lua_pushlightuserdata(state, my_instance);
+    lua_pushcclosure(state, lua_shared_add, 1);
+    lua_setglobal(state, "shared_add");
+}
+
+/**
+ * Get the global script state of the calling thread
+ *
+ * The state is returned locked and must be released with release_global_state.
+ * @param my_instance The filter instance
+ * @param gs Set to the state that must be released
+ * @return The locked Lua state or NULL if there is no global script
+ */
+static lua_State* acquire_global_state(LUA_INSTANCE* my_instance, LUA_GLOBAL_STATE** gs)
+{
+    if (my_instance->global_states == NULL)
+    {
+        return NULL;
+    }
+
+    int thread = poll_current_thread();
+
+    if (thread < 0 || thread >= my_instance->n_global_states - 1)
+    {
+        thread = my_instance->n_global_states - 1;
+    }
+
+    *gs = &my_instance->global_states[thread];
+    spinlock_acquire(&(*gs)->lock);
+    return (*gs)->state;
+}
+
+/**
+ * Release a state returned by acquire_global_state
+ *
+ * Any values the entry point left on the stack are removed.
+ * @param gs The state
+ */
+static void release_global_state(LUA_GLOBAL_STATE* gs)
+{
+    lua_settop(gs->state, 0);
+    spinlock_release(&gs->lock);
+}
+
+/**
+ * Free the states of the global script
+ *
+ * @param my_instance The filter instance
+ */
+static void free_global_states(LUA_INSTANCE* my_instance)
+{
+    for (int i = 0; my_instance->global_states && i < my_instance->n_global_states; i++)
+    {
+        if (my_instance->global_states[i].state)
+        {
+            lua_close(my_instance->global_states[i].state);
+        }
+    }
+
+    free(my_instance->global_states);
+    my_instance->global_states = NULL;
+}
+
+/**
+ * Load the global script into a new Lua state and call its createInstance
+ * entry point
+ *
+ * @param my_instance The filter instance
+ * @return The new state or NULL on error
+ */
+static lua_State* create_global_state(LUA_INSTANCE* my_instance)
+{
+    lua_State* state = luaL_newstate();
+
+    if (state == NULL)
+    {
+        MXS_ERROR("Unable to initialize new Lua state.");
+        return NULL;
+    }
+
+    luaL_openlibs(state);
+    register_functions(state, my_instance);
+
+    if (luaL_dofile(state, my_instance->global_script))
+    {
+        MXS_ERROR("luafilter: Failed to execute global script at '%s':%s.",
+                  my_instance->global_script, lua_tostring(state, -1));
+        lua_close(state);
+        return NULL;
+    }
+
+    lua_getglobal(state, "createInstance");
+    if (lua_pcall(state, 0, 0, 0))
+    {
+        MXS_WARNING("luafilter: Failed to get global variable 'createInstance':  %s."
+                    " The createInstance entry point will not be called for the global script.",
+                    lua_tostring(state, -1));
+    }
+    lua_settop(state, 0);
+
+    return state;
+}
+
 /**
  * The session structure for Lua filter.
  */
@@ -205,35 +584,40 @@ createInstance(char **options, FILTER_PARAMETER **params)
         return NULL;
     }
 
+    if ((my_instance->shared = hashtable_alloc(64, simple_str_hash, strcmp)) == NULL)
+    {
+        free(my_instance->global_script);
+        free(my_instance->session_script);
+        free(my_instance);
+        return NULL;
+    }
+
+    hashtable_memory_fns(my_instance->shared, (HASHMEMORYFN) strdup, NULL,
+                         (HASHMEMORYFN) free, shared_value_free);
+
     if (my_instance->global_script)
     {
-        if ((my_instance->global_lua_state = luaL_newstate()))
+        my_instance->n_global_states = config_threadcount() + 1;
+        my_instance->global_states = calloc(my_instance->n_global_states,
+                                            sizeof(LUA_GLOBAL_STATE));
+
+        for (int i = 0; my_instance->global_states && i < my_instance->n_global_states; i++)
         {
-            luaL_openlibs(my_instance->global_lua_state);
+            spinlock_init(&my_instance->global_states[i].lock);
 
-            if (luaL_dofile(my_instance->global_lua_state, my_instance->global_script))
-            {
-                MXS_ERROR("luafilter: Failed to execute global script at '%s':%s.",
-                          my_instance->global_script, lua_tostring(my_instance->global_lua_state, -1));
-                free(my_instance->global_script);
-                free(my_instance->session_script);
-                free(my_instance);
-                my_instance = NULL;
-            }
-            else if (my_instance->global_lua_state)
+            if ((my_instance->global_states[i].state = create_global_state(my_instance)) == NULL)
             {
-                lua_getglobal(my_instance->global_lua_state, "createInstance");
-                if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
-                {
-                    MXS_WARNING("luafilter: Failed to get global variable 'createInstance':  %s."
-                                " The createInstance entry point will not be called for the global script.",
-                                lua_tostring(my_instance->global_lua_state, -1));
-                }
+                error = true;
+                break;
             }
         }
-        else
+
+        if (my_instance->global_states == NULL || error)
         {
-            MXS_ERROR("Unable to initialize new Lua state.");
+            free_global_states(my_instance);
+            hashtable_free(my_instance->shared);
+            free(my_instance->global_script);
+            free(my_instance->session_script);
             free(my_instance);
             my_instance = NULL;
         }
@@ -287,8 +671,7 @@ static void * newSession(FILTER *instance, SESSION *session)
         }
         else
         {
-            lua_pushcfunction(my_session->lua_state, id_gen);
-            lua_setglobal(my_session->lua_state, "id_gen");
+            register_functions(my_session->lua_state, my_instance);
 
             lua_getglobal(my_session->lua_state, "newSession");
             if (lua_pcall(my_session->lua_state, 0, 0, 0))
@@ -300,17 +683,19 @@ static void * newSession(FILTER *instance, SESSION *session)
         }
     }
 
-    if (my_session && my_instance->global_lua_state)
+    LUA_GLOBAL_STATE* gs;
+    lua_State* global_state;
+
+    if (my_session && (global_state = acquire_global_state(my_instance, &gs)))
     {
-        spinlock_acquire(&my_instance->lock);
-        lua_getglobal(my_instance->global_lua_state, "newSession");
-        if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+        lua_getglobal(global_state, "newSession");
+        if (lua_pcall(global_state, 0, 0, 0))
         {
             MXS_WARNING("luafilter: Failed to get global variable 'newSession': '%s'."
                         " The newSession entry point will not be called for the global script.",
-                        lua_tostring(my_instance->global_lua_state, -1));
+                        lua_tostring(global_state, -1));
         }
-        spinlock_release(&my_instance->lock);
+        release_global_state(gs);
     }
 
     return my_session;
@@ -343,17 +728,19 @@ static void closeSession(FILTER *instance, void *session)
         spinlock_release(&my_session->lock);
     }
 
-    if (my_instance->global_lua_state)
+    LUA_GLOBAL_STATE* gs;
+    lua_State* global_state;
+
+    if ((global_state = acquire_global_state(my_instance, &gs)))
     {
-        spinlock_acquire(&my_instance->lock);
-        lua_getglobal(my_instance->global_lua_state, "closeSession");
-        if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+        lua_getglobal(global_state, "closeSession");
+        if (lua_pcall(global_state, 0, 0, 0))
         {
             MXS_WARNING("luafilter: Failed to get global variable 'closeSession': '%s'."
                         " The closeSession entry point will not be called for the global script.",
-                        lua_tostring(my_instance->global_lua_state, -1));
+                        lua_tostring(global_state, -1));
         }
-        spinlock_release(&my_instance->lock);
+        release_global_state(gs);
     }
 }
 
@@ -421,16 +808,18 @@ static int clientReply(FILTER *instance, void *session, GWBUF *queue)
         }
         spinlock_release(&my_session->lock);
     }
-    if (my_instance->global_lua_state)
+    LUA_GLOBAL_STATE* gs;
+    lua_State* global_state;
+
+    if ((global_state = acquire_global_state(my_instance, &gs)))
     {
-        spinlock_acquire(&my_instance->lock);
-        lua_getglobal(my_instance->global_lua_state, "clientReply");
-        if (lua_pcall(my_instance->global_lua_state, 0, 0, 0))
+        lua_getglobal(global_state, "clientReply");
+        if (lua_pcall(global_state, 0, 0, 0))
         {
             MXS_ERROR("luafilter: Global scope call to 'clientReply' failed: '%s'.",
-                      lua_tostring(my_session->lua_state, -1));
+                      lua_tostring(global_state, -1));
         }
-        spinlock_release(&my_instance->lock);
+        release_global_state(gs);
     }
 
     return my_session->up.clientReply(my_session->up.instance,
@@ -497,33 +886,34 @@ static int routeQuery(FILTER *instance, void *session, GWBUF *queue)
             spinlock_release(&my_session->lock);
         }
 
-        if (my_instance->global_lua_state)
+        LUA_GLOBAL_STATE* gs;
+        lua_State* global_state;
+
+        if (fullquery && (global_state = acquire_global_state(my_instance, &gs)))
         {
-            spinlock_acquire(&my_instance->lock);
-            lua_getglobal(my_instance->global_lua_state, "routeQuery");
-            lua_pushlstring(my_instance->global_lua_state, fullquery, strlen(fullquery));
-            if (lua_pcall(my_instance->global_lua_state, 1, 0, 0))
+            lua_getglobal(global_state, "routeQuery");
+            lua_pushlstring(global_state, fullquery, strlen(fullquery));
+            if (lua_pcall(global_state, 1, 0, 0))
             {
                 MXS_ERROR("luafilter: Global scope call to 'routeQuery' failed: '%s'.",
-                          lua_tostring(my_session->lua_state, -1));
+                          lua_tostring(global_state, -1));
             }
-            else if (lua_gettop(my_instance->global_lua_state))
+            else if (lua_gettop(global_state))
             {
-                if (lua_isstring(my_instance->global_lua_state, -1))
+                if (lua_isstring(global_state, -1))
                 {
                     if (forward)
                     {
                         gwbuf_free(forward);
                     }
-                    forward = modutil_create_query((char*)
-                                                   lua_tostring(my_instance->global_lua_state, -1));
+                    forward = modutil_create_query((char*) lua_tostring(global_state, -1));
                 }
-                else if (lua_isboolean(my_instance->global_lua_state, -1))
+                else if (lua_isboolean(global_state, -1))
                 {
-                    route = lua_toboolean(my_instance->global_lua_state, -1);
+                    route = lua_toboolean(global_state, -1);
                 }
             }
-            spinlock_release(&my_instance->lock);
+            release_global_state(gs);
         }
 
         free(fullquery);
@@ -559,25 +949,27 @@ static void diagnostic(FILTER *instance, void *fsession, DCB *dcb)
 
     if (my_instance)
     {
-        if (my_instance->global_lua_state)
+        LUA_GLOBAL_STATE* gs;
+        lua_State* global_state;
+
+        if ((global_state = acquire_global_state(my_instance, &gs)))
         {
-            spinlock_acquire(&my_instance->lock);
-            lua_getglobal(my_instance->global_lua_state, "diagnostic");
-            if (lua_pcall(my_instance->global_lua_state, 0, 1, 0) == 0)
+            lua_getglobal(global_state, "diagnostic");
+            if (lua_pcall(global_state, 0, 1, 0) == 0)
             {
-                lua_gettop(my_instance->global_lua_state);
-                if (lua_isstring(my_instance->global_lua_state, -1))
+                lua_gettop(global_state);
+                if (lua_isstring(global_state, -1))
                 {
-                    dcb_printf(dcb, lua_tostring(my_instance->global_lua_state, -1));
+                    dcb_printf(dcb, lua_tostring(global_state, -1));
                     dcb_printf(dcb, "\n");
                 }
             }
             else
             {
                 dcb_printf(dcb, "Global scope call to 'diagnostic' failed: '%s'.\n",
-                           lua_tostring(my_instance->global_lua_state, -1));
+                           lua_tostring(global_state, -1));
             }
-            spinlock_release(&my_instance->lock);
+            release_global_state(gs);
         }
         if (my_instance->global_script)
         {
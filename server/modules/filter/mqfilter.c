@@ -46,6 +46,14 @@
  *      ssl_CA_cert     Path to the CA certificate in PEM format
  *      ssl_client_cert Path to the client cerificate in PEM format
  *      ssl_client_key  Path to the client public key in PEM format
+ *      queue_size      Maximum number of messages waiting to be published
+ *      batch_size      Maximum number of messages published at a time
+ *      overflow        What to do when the queue is full: drop_new or drop_old
+ *      publisher_confirms  Wait for the server to confirm the published messages
+ *
+ * The messages are published by a dedicated thread. The routing threads only
+ * add the messages to a bounded lock-free queue, so a slow or unavailable
+ * server never delays the queries.
  *
  * The logging trigger levels are:
  *      all     Log everything
@@ -66,6 +74,7 @@
 #include <time.h>
 #include <sys/time.h>
 #include <atomic.h>
+#include <thread.h>
 #include <amqp.h>
 #include <amqp_framing.h>
 #include <amqp_tcp_socket.h>
@@ -75,7 +84,6 @@
 #include <query_classifier.h>
 #include <spinlock.h>
 #include <session.h>
-#include <housekeeper.h>
 
 MODULE_INFO info =
 {
@@ -85,9 +93,8 @@ MODULE_INFO info =
     "A RabbitMQ query logging filter"
 };
 
-static char *version_str = "V1.0.2";
+static char *version_str = "V1.1.0";
 static int uid_gen;
-static int hktask_id = 0;
 /*
  * The filter entry points
  */
@@ -122,9 +129,50 @@ typedef struct mqmessage_t
 {
     amqp_basic_properties_t *prop;
     char *msg;
-    struct mqmessage_t *next;
+    uint64_t tag; /*< Delivery tag of the last publish, used with confirms */
+    bool confirmed; /*< Whether the server has confirmed the message */
 } mqmessage;
 
+/**
+ * A slot of the message queue
+ */
+typedef struct mqslot_t
+{
+    uint64_t seq; /*< Position the slot is next written or read at */
+    mqmessage *msg;
+} MQSLOT;
+
+/**
+ * Bounded lock-free multi-producer multi-consumer queue of messages
+ *
+ * Each slot has a sequence number that tells whether it can be written or
+ * read at a given position. The producers and the consumers reserve positions
+ * with compare-and-swap and then publish the slot by updating its sequence.
+ */
+typedef struct mqqueue_t
+{
+    MQSLOT *slots;
+    uint64_t mask; /*< Number of slots minus one */
+    uint64_t head; /*< Next position to write */
+    uint64_t tail; /*< Next position to read */
+} MQQUEUE;
+
+/** Actions taken when the message queue is full */
+enum mq_overflow
+{
+    MQ_DROP_NEW, /*< Drop the new message */
+    MQ_DROP_OLD /*< Drop the oldest queued message */
+};
+
+#define MQ_DEFAULT_QUEUE_SIZE 4096
+#define MQ_DEFAULT_BATCH_SIZE 64
+
+/** How long the publisher sleeps when the queue is empty, in milliseconds */
+#define MQ_IDLE_SLEEP 10
+
+/** How long the publisher waits for confirmations, in seconds */
+#define MQ_CONFIRM_TIMEOUT 5
+
 /**
  *Logging trigger levels
  */
@@ -192,6 +240,8 @@ typedef struct mqstats_t
     int n_msg; /*< Total number of messages */
     int n_sent; /*< Number of sent messages */
     int n_queued; /*< Number of unsent messages */
+    int n_dropped; /*< Number of messages dropped because the queue was full */
+    int n_batches; /*< Number of published batches */
 } MQSTATS;
 
 /**
@@ -228,8 +278,12 @@ typedef struct
     int rconn_intv; /**delay for reconnects, in seconds*/
     time_t last_rconn; /**last reconnect attempt*/
     SPINLOCK rconn_lock;
-    SPINLOCK msg_lock;
-    mqmessage* messages;
+    MQQUEUE messages; /**Messages waiting to be published*/
+    uint64_t delivery_tag; /**Delivery tag of the last published message*/
+    int batch_size; /**Maximum number of messages published at a time*/
+    enum mq_overflow overflow; /**What to do when the queue is full*/
+    bool confirms; /**Whether publisher confirms are used*/
+    THREAD publisher; /**The thread publishing the messages*/
     enum log_trigger_t trgtype;
     SRC_TRIG* src_trg;
     SHM_TRIG* shm_trg;
@@ -256,7 +310,8 @@ typedef struct
     bool was_query; /**True if the previous routeQuery call had valid content*/
 } MQ_SESSION;
 
-void sendMessage(void* data);
+static void publisher_main(void* data);
+static bool mqqueue_init(MQQUEUE *queue, int size);
 
 /**
  * Implementation of the mandatory version entry point
@@ -508,12 +563,10 @@ createInstance(char **options, FILTER_PARAMETER **params)
     int paramcount = 0, parammax = 64, i = 0, x = 0, arrsize = 0;
     FILTER_PARAMETER** paramlist;
     char** arr = NULL;
-    char taskname[512];
 
     if ((my_instance = calloc(1, sizeof(MQ_INSTANCE))))
     {
         spinlock_init(&my_instance->rconn_lock);
-        spinlock_init(&my_instance->msg_lock);
         uid_gen = 0;
         paramlist = malloc(sizeof(FILTER_PARAMETER*) * 64);
 
@@ -525,9 +578,13 @@ createInstance(char **options, FILTER_PARAMETER **params)
         }
         my_instance->channel = 1;
         my_instance->last_rconn = time(NULL);
-        my_instance->conn_stat = AMQP_STATUS_OK;
+        my_instance->conn_stat = AMQP_STATUS_SOCKET_ERROR;
         my_instance->rconn_intv = 1;
         my_instance->port = 5672;
+        my_instance->batch_size = MQ_DEFAULT_BATCH_SIZE;
+        my_instance->overflow = MQ_DROP_NEW;
+        my_instance->confirms = false;
+        int queue_size = MQ_DEFAULT_QUEUE_SIZE;
         my_instance->trgtype = TRG_ALL;
         my_instance->log_all = false;
         my_instance->strict_logging = true;
@@ -586,6 +643,46 @@ createInstance(char **options, FILTER_PARAMETER **params)
 
                 my_instance->exchange_type = strdup(params[i]->value);
             }
+            else if (!strcmp(params[i]->name, "queue_size"))
+            {
+                queue_size = atoi(params[i]->value);
+
+                if (queue_size <= 0)
+                {
+                    MXS_ERROR("Invalid value for 'queue_size': %s", params[i]->value);
+                    queue_size = MQ_DEFAULT_QUEUE_SIZE;
+                }
+            }
+            else if (!strcmp(params[i]->name, "batch_size"))
+            {
+                my_instance->batch_size = atoi(params[i]->value);
+
+                if (my_instance->batch_size <= 0)
+                {
+                    MXS_ERROR("Invalid value for 'batch_size': %s", params[i]->value);
+                    my_instance->batch_size = MQ_DEFAULT_BATCH_SIZE;
+                }
+            }
+            else if (!strcmp(params[i]->name, "overflow"))
+            {
+                if (!strcmp(params[i]->value, "drop_new"))
+                {
+                    my_instance->overflow = MQ_DROP_NEW;
+                }
+                else if (!strcmp(params[i]->value, "drop_old"))
+                {
+                    my_instance->overflow = MQ_DROP_OLD;
+                }
+                else
+                {
+                    MXS_ERROR("Unknown option for 'overflow': %s. Expected "
+                              "'drop_new' or 'drop_old'.", params[i]->value);
+                }
+            }
+            else if (!strcmp(params[i]->name, "publisher_confirms"))
+            {
+                my_instance->confirms = config_truth_value(params[i]->value);
+            }
             else if (!strcmp(params[i]->name, "logging_trigger"))
             {
 
@@ -785,11 +882,13 @@ createInstance(char **options, FILTER_PARAMETER **params)
             amqp_set_initialize_ssl_library(0);
         }
 
-        /**Connect to the server*/
-        init_conn(my_instance);
+        /**The publisher thread connects to the server*/
+        if (!mqqueue_init(&my_instance->messages, queue_size) ||
+            thread_start(&my_instance->publisher, publisher_main, my_instance) == NULL)
+        {
+            MXS_ERROR("Failed to start the message publishing thread.");
+        }
 
-        snprintf(taskname, 511, "mqtask%d", atomic_add(&hktask_id, 1));
-        hktask_add(taskname, sendMessage, (void*) my_instance, 5);
         if (arr)
         {
             for (int x = 0; x < arrsize; x++)
@@ -845,103 +944,376 @@ int declareQueue(MQ_INSTANCE *my_instance, MQ_SESSION* my_session, char* qname)
 }
 
 /**
- * Broadcasts a message on the message stack to the RabbitMQ server
- * and frees the allocated memory if successful. This function is only called by
- * the housekeeper thread.
- * @param data MQfilter instance
+ * Initialize the message queue
+ *
+ * @param queue Queue to initialize
+ * @param size Minimum number of slots, rounded up to a power of two
+ * @return True on success, false on memory allocation failure
  */
-void sendMessage(void* data)
+static bool mqqueue_init(MQQUEUE *queue, int size)
 {
-    MQ_INSTANCE *instance = (MQ_INSTANCE*) data;
-    mqmessage *tmp;
-    int err_num = AMQP_STATUS_OK;
+    uint64_t n = 1;
+
+    while (n < size)
+    {
+        n <<= 1;
+    }
+
+    if ((queue->slots = malloc(sizeof(MQSLOT) * n)) == NULL)
+    {
+        return false;
+    }
 
-    spinlock_acquire(&instance->rconn_lock);
-    if (instance->conn_stat != AMQP_STATUS_OK)
+    for (uint64_t i = 0; i < n; i++)
     {
-        if (difftime(time(NULL), instance->last_rconn) > instance->rconn_intv)
+        queue->slots[i].seq = i;
+        queue->slots[i].msg = NULL;
+    }
+
+    queue->mask = n - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    return true;
+}
+
+/**
+ * Add a message to the queue
+ *
+ * @param queue The queue
+ * @param msg Message to add
+ * @return True if the message was added, false if the queue is full
+ */
+static bool mqqueue_push(MQQUEUE *queue, mqmessage *msg)
+{
+    uint64_t pos = queue->head;
+
+    while (true)
+    {
+        MQSLOT *slot = &queue->slots[pos & queue->mask];
+        int64_t diff = (int64_t)(slot->seq - pos);
+
+        if (diff == 0)
         {
-            instance->last_rconn = time(NULL);
+            uint64_t prev = __sync_val_compare_and_swap(&queue->head, pos, pos + 1);
 
-            if (init_conn(instance))
+            if (prev == pos)
             {
-                instance->rconn_intv = 1.0;
-                instance->conn_stat = AMQP_STATUS_OK;
+                slot->msg = msg;
+                __sync_synchronize();
+                slot->seq = pos + 1;
+                return true;
             }
-            else
+
+            pos = prev;
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = queue->head;
+        }
+    }
+}
+
+/**
+ * Remove the oldest message from the queue
+ *
+ * @param queue The queue
+ * @return The message or NULL if the queue is empty
+ */
+static mqmessage* mqqueue_pop(MQQUEUE *queue)
+{
+    uint64_t pos = queue->tail;
+
+    while (true)
+    {
+        MQSLOT *slot = &queue->slots[pos & queue->mask];
+        int64_t diff = (int64_t)(slot->seq - (pos + 1));
+
+        if (diff == 0)
+        {
+            uint64_t prev = __sync_val_compare_and_swap(&queue->tail, pos, pos + 1);
+
+            if (prev == pos)
             {
-                instance->rconn_intv += 5.0;
-                MXS_ERROR("Failed to reconnect to the MQRabbit server ");
+                mqmessage *msg = slot->msg;
+                __sync_synchronize();
+                slot->seq = pos + queue->mask + 1;
+                return msg;
             }
+
+            pos = prev;
+        }
+        else if (diff < 0)
+        {
+            return NULL;
+        }
+        else
+        {
+            pos = queue->tail;
         }
-        err_num = instance->conn_stat;
     }
-    spinlock_release(&instance->rconn_lock);
+}
 
-    if (err_num != AMQP_STATUS_OK)
+static void mqmessage_free(mqmessage *msg)
+{
+    free(msg->prop);
+    free(msg->msg);
+    free(msg);
+}
+
+/**
+ * Open a new connection to the server
+ *
+ * A connection that failed can't be reused so it is replaced with a new one.
+ * The reconnection interval grows while the server is unavailable.
+ *
+ * @param instance The filter instance
+ * @return True if the connection is usable
+ */
+static bool publisher_connect(MQ_INSTANCE *instance)
+{
+    if (difftime(time(NULL), instance->last_rconn) < instance->rconn_intv)
     {
-        /** No connection to the broker */
-        return;
+        return false;
     }
 
-    spinlock_acquire(&instance->msg_lock);
-    tmp = instance->messages;
+    instance->last_rconn = time(NULL);
+    amqp_destroy_connection(instance->conn);
+    instance->channel = 1;
 
-    if (tmp == NULL)
+    if ((instance->conn = amqp_new_connection()) && init_conn(instance))
     {
-        spinlock_release(&instance->msg_lock);
-        return;
+        if (instance->confirms)
+        {
+            amqp_confirm_select(instance->conn, instance->channel);
+
+            if (amqp_get_rpc_reply(instance->conn).reply_type != AMQP_RESPONSE_NORMAL)
+            {
+                MXS_ERROR("Failed to enable publisher confirms.");
+                instance->rconn_intv += 5;
+                return false;
+            }
+        }
+
+        instance->rconn_intv = 1;
+        instance->conn_stat = AMQP_STATUS_OK;
+        return true;
     }
 
-    instance->messages = instance->messages->next;
-    spinlock_release(&instance->msg_lock);
+    instance->rconn_intv += 5;
+    MXS_ERROR("Failed to reconnect to the MQRabbit server ");
+    return false;
+}
 
-    while (tmp)
+/**
+ * Mark the messages a confirmation applies to
+ *
+ * @param batch Messages waiting for confirmation
+ * @param n Number of messages
+ * @param tag Delivery tag of the confirmation
+ * @param multiple Whether all messages up to the tag are confirmed
+ * @param ack True for an acknowledgement, false for a rejection
+ */
+static void publisher_confirm(mqmessage **batch, int n, uint64_t tag, bool multiple, bool ack)
+{
+    for (int i = 0; i < n; i++)
     {
-        err_num = amqp_basic_publish(instance->conn, instance->channel,
-                                     amqp_cstring_bytes(instance->exchange),
-                                     amqp_cstring_bytes(instance->key),
-                                     0, 0, tmp->prop, amqp_cstring_bytes(tmp->msg));
+        if (batch[i]->tag == tag || (multiple && batch[i]->tag < tag))
+        {
+            batch[i]->confirmed = ack;
 
-        spinlock_acquire(&instance->rconn_lock);
-        instance->conn_stat = err_num;
-        spinlock_release(&instance->rconn_lock);
+            if (!ack)
+            {
+                /** Rejected messages are published again */
+                batch[i]->tag = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Wait until the server has confirmed or rejected all published messages
+ *
+ * @param instance The filter instance
+ * @param batch Published messages
+ * @param n Number of messages
+ * @return AMQP_STATUS_OK or the error that occurred
+ */
+static int publisher_wait_confirms(MQ_INSTANCE *instance, mqmessage **batch, int n)
+{
+    while (true)
+    {
+        bool pending = false;
 
-        if (err_num == AMQP_STATUS_OK)
+        for (int i = 0; i < n && !pending; i++)
         {
-            /**Message was sent successfully*/
-            free(tmp->prop);
-            free(tmp->msg);
-            free(tmp);
+            pending = batch[i]->tag != 0 && !batch[i]->confirmed;
+        }
 
-            atomic_add(&instance->stats.n_sent, 1);
-            atomic_add(&instance->stats.n_queued, -1);
-            spinlock_acquire(&instance->msg_lock);
-            tmp = instance->messages;
+        if (!pending)
+        {
+            return AMQP_STATUS_OK;
+        }
+
+        amqp_frame_t frame;
+        struct timeval tv = {MQ_CONFIRM_TIMEOUT, 0};
+        int rc = amqp_simple_wait_frame_noblock(instance->conn, &frame, &tv);
+
+        if (rc != AMQP_STATUS_OK)
+        {
+            return rc;
+        }
+
+        if (frame.frame_type == AMQP_FRAME_METHOD)
+        {
+            if (frame.payload.method.id == AMQP_BASIC_ACK_METHOD)
+            {
+                amqp_basic_ack_t *ack = (amqp_basic_ack_t*) frame.payload.method.decoded;
+                publisher_confirm(batch, n, ack->delivery_tag, ack->multiple, true);
+            }
+            else if (frame.payload.method.id == AMQP_BASIC_NACK_METHOD)
+            {
+                amqp_basic_nack_t *nack = (amqp_basic_nack_t*) frame.payload.method.decoded;
+                publisher_confirm(batch, n, nack->delivery_tag, nack->multiple, false);
+            }
+            else if (frame.payload.method.id == AMQP_CHANNEL_CLOSE_METHOD ||
+                     frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD)
+            {
+                return AMQP_STATUS_CONNECTION_CLOSED;
+            }
+        }
+
+        amqp_maybe_release_buffers(instance->conn);
+    }
+}
+
+/**
+ * Publish a batch of messages
+ *
+ * Messages that were published, and confirmed if confirms are used, are
+ * freed and removed from the batch. The rest stay in the batch and are
+ * published again after the connection has been restored.
+ *
+ * @param instance The filter instance
+ * @param batch The messages
+ * @param n Number of messages
+ * @return Number of messages left in the batch
+ */
+static int publisher_send(MQ_INSTANCE *instance, mqmessage **batch, int n)
+{
+    int err_num = AMQP_STATUS_OK;
 
-            if (tmp == NULL)
+    for (int i = 0; i < n && err_num == AMQP_STATUS_OK; i++)
+    {
+        if (!batch[i]->confirmed && batch[i]->tag == 0)
+        {
+            err_num = amqp_basic_publish(instance->conn, instance->channel,
+                                         amqp_cstring_bytes(instance->exchange),
+                                         amqp_cstring_bytes(instance->key),
+                                         0, 0, batch[i]->prop, amqp_cstring_bytes(batch[i]->msg));
+
+            if (err_num == AMQP_STATUS_OK)
             {
-                spinlock_release(&instance->msg_lock);
-                return;
+                /** Without confirms, a successful publish is all we get */
+                batch[i]->tag = ++instance->delivery_tag;
+                batch[i]->confirmed = !instance->confirms;
             }
+        }
+    }
+
+    if (err_num == AMQP_STATUS_OK && instance->confirms)
+    {
+        err_num = publisher_wait_confirms(instance, batch, n);
+    }
 
-            instance->messages = instance->messages->next;
-            spinlock_release(&instance->msg_lock);
+    if (err_num != AMQP_STATUS_OK)
+    {
+        MXS_ERROR("Failed to publish messages: %s", amqp_error_string2(err_num));
+        instance->conn_stat = err_num;
+        instance->delivery_tag = 0;
+    }
+
+    int left = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (batch[i]->confirmed)
+        {
+            mqmessage_free(batch[i]);
+            atomic_add(&instance->stats.n_sent, 1);
+            atomic_add(&instance->stats.n_queued, -1);
         }
         else
         {
-            spinlock_acquire(&instance->msg_lock);
-            tmp->next = instance->messages;
-            instance->messages = tmp;
-            spinlock_release(&instance->msg_lock);
-            return;
+            /** Unconfirmed messages are published again */
+            batch[i]->tag = 0;
+            batch[left++] = batch[i];
+        }
+    }
+
+    atomic_add(&instance->stats.n_batches, 1);
+    return left;
+}
+
+/**
+ * The publisher thread
+ *
+ * Takes the messages from the queue in batches and publishes them on the
+ * RabbitMQ server. This is the only thread that uses the connection.
+ *
+ * @param data The filter instance
+ */
+static void publisher_main(void* data)
+{
+    MQ_INSTANCE *instance = (MQ_INSTANCE*) data;
+    mqmessage **batch = malloc(sizeof(mqmessage*) * instance->batch_size);
+    int n = 0;
+
+    if (batch == NULL)
+    {
+        MXS_ERROR("Memory allocation failed, no messages will be published.");
+        return;
+    }
+
+    /** Connect right away */
+    instance->last_rconn = 0;
+
+    while (true)
+    {
+        if (instance->conn_stat != AMQP_STATUS_OK && !publisher_connect(instance))
+        {
+            thread_millisleep(1000);
+            continue;
+        }
+
+        mqmessage *msg;
+
+        while (n < instance->batch_size && (msg = mqqueue_pop(&instance->messages)))
+        {
+            msg->tag = 0;
+            msg->confirmed = false;
+            batch[n++] = msg;
+        }
+
+        if (n == 0)
+        {
+            thread_millisleep(MQ_IDLE_SLEEP);
+        }
+        else
+        {
+            n = publisher_send(instance, batch, n);
         }
     }
 }
 
 /**
- * Push a new message on the stack to be broadcasted later.
- * The message assumes ownership of the memory allocated to the message content and properties.
+ * Queue a new message to be published by the publisher thread. The message
+ * assumes ownership of the memory allocated to the message content and
+ * properties. This never blocks: when the queue is full, a message is
+ * dropped according to the overflow policy.
  * @param prop Message properties
  * @param msg Message content
  */
@@ -962,14 +1334,30 @@ void pushMessage(MQ_INSTANCE *instance, amqp_basic_properties_t* prop, char* msg
         return;
     }
 
-    spinlock_acquire(&instance->msg_lock);
+    atomic_add(&instance->stats.n_msg, 1);
 
-    newmsg->next = instance->messages;
-    instance->messages = newmsg;
+    while (!mqqueue_push(&instance->messages, newmsg))
+    {
+        mqmessage *dropped = newmsg;
 
-    spinlock_release(&instance->msg_lock);
+        if (instance->overflow == MQ_DROP_OLD &&
+            (dropped = mqqueue_pop(&instance->messages)) == NULL)
+        {
+            /** The publisher emptied the queue, try again */
+            continue;
+        }
+
+        mqmessage_free(dropped);
+        atomic_add(&instance->stats.n_dropped, 1);
+
+        if (dropped == newmsg)
+        {
+            return;
+        }
+
+        atomic_add(&instance->stats.n_queued, -1);
+    }
 
-    atomic_add(&instance->stats.n_msg, 1);
     atomic_add(&instance->stats.n_queued, 1);
 }
 
@@ -1685,11 +2073,13 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
                    my_instance->vhost, my_instance->exchange,
                    my_instance->key, my_instance->queue
                   );
-        dcb_printf(dcb, "%-16s%-16s%-16s\n",
-                   "Messages", "Queued", "Sent");
-        dcb_printf(dcb, "%-16d%-16d%-16d\n",
+        dcb_printf(dcb, "%-16s%-16s%-16s%-16s%-16s\n",
+                   "Messages", "Queued", "Sent", "Dropped", "Batches");
+        dcb_printf(dcb, "%-16d%-16d%-16d%-16d%-16d\n",
                    my_instance->stats.n_msg,
                    my_instance->stats.n_queued,
-                   my_instance->stats.n_sent);
+                   my_instance->stats.n_sent,
+                   my_instance->stats.n_dropped,
+                   my_instance->stats.n_batches);
     }
 }
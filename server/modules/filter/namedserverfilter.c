@@ -18,8 +18,11 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <regex.h>
 #include <hint.h>
+#include <maxscale_pcre2.h>
 
 /**
  * @file namedserverfilter.c - a very simple regular expression based filter
@@ -34,8 +37,23 @@
  *      source=<source address to limit filter>
  *      user=<username to limit filter>
  *
+ * Any number of numbered rules, up to REGEXHINT_MAX_RULES, can be defined
+ * instead of or in addition to the match and server parameters
+ *      match<N>=<PCRE2 regular expression>
+ *      server<N>=<server to route statement to>
+ *      source<N>=<source address to limit the rule>
+ *      user<N>=<username to limit the rule>
+ *
+ * The numbered rules are compiled into one pattern that is an alternation of
+ * the rules, so a statement is matched against all of them in one pass. Each
+ * alternative sets a mark that tells which rule matched. The rules limited by
+ * source or user are preceded by a callout that fails the alternative if the
+ * rule does not apply to the session.
+ *
  * Date         Who             Description
  * 22/01/2015   Mark Riddoch    Written as example based on regex filter
+ * 15/10/2016   Core Team       Literal text prefilter before the regex
+ * 15/10/2016   Core Team       Numbered rules matched with one combined pattern
  * @endverbatim
  */
 
@@ -47,7 +65,7 @@ MODULE_INFO info =
     "A routing hint filter that uses regular expressions to direct queries"
 };
 
-static char *version_str = "V1.1.0";
+static char *version_str = "V1.2.0";
 
 static FILTER *createInstance(char **options, FILTER_PARAMETER **params);
 static void *newSession(FILTER *instance, SESSION *session);
@@ -56,6 +74,7 @@ static void freeSession(FILTER *instance, void *session);
 static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static uint64_t getInterest(FILTER *instance);
 
 
 static FILTER_OBJECT MyObject =
@@ -69,8 +88,24 @@ static FILTER_OBJECT MyObject =
     routeQuery,
     NULL,
     diagnostic,
+    getInterest,
 };
 
+/** The maximum number of numbered rules, one bit of a session mask each */
+#define REGEXHINT_MAX_RULES 64
+
+/**
+ * A numbered rule
+ */
+typedef struct
+{
+    int number; /* Number of the rule in the parameter names */
+    char *match; /* PCRE2 regular expression to match */
+    char *server; /* Server to route to */
+    char *source; /* Source address to restrict the rule */
+    char *user; /* User name to restrict the rule */
+} REGEXHINT_RULE;
+
 /**
  * Instance structure
  */
@@ -81,6 +116,13 @@ typedef struct
     char *match; /* Regular expression to match */
     char *server; /* Server to route to */
     regex_t re; /* Compiled regex text */
+    char *literal; /* Text that every match contains, NULL if not known */
+    size_t literal_len; /* Length of the literal */
+    bool caseless; /* Whether the literal is searched ignoring case */
+    REGEXHINT_RULE rules[REGEXHINT_MAX_RULES]; /* The numbered rules in order */
+    int n_rules; /* Number of numbered rules */
+    MXS_PCRE2_PATTERN *rules_re; /* The rules combined into one pattern */
+    bool rules_limited; /* Whether any rule is limited by source or user */
 } REGEXHINT_INSTANCE;
 
 /**
@@ -92,6 +134,7 @@ typedef struct
     int n_diverted; /* No. of statements diverted */
     int n_undiverted; /* No. of statements not diverted */
     int active; /* Is filter active */
+    uint64_t rules; /* Mask of the numbered rules that apply to the session */
 } REGEXHINT_SESSION;
 
 /**
@@ -131,6 +174,128 @@ GetModuleObject()
     return &MyObject;
 }
 
+/**
+ * Get the rule number of a numbered rule parameter
+ *
+ * @param name      The parameter name
+ * @param prefix    The name of the parameter without the number
+ * @return The rule number or 0 if the parameter is not a numbered @c prefix
+ */
+static int
+rule_number(const char *name, const char *prefix)
+{
+    size_t len = strlen(prefix);
+    char *end;
+
+    if (strncmp(name, prefix, len) == 0 && isdigit(name[len]))
+    {
+        long n = strtol(name + len, &end, 10);
+
+        if (*end == '\0' && n >= 1 && n <= REGEXHINT_MAX_RULES)
+        {
+            return n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Free the numbered rules of an instance
+ *
+ * @param rules     The rules
+ * @param n_rules   Number of rules
+ */
+static void
+free_rules(REGEXHINT_RULE *rules, int n_rules)
+{
+    for (int i = 0; i < n_rules; i++)
+    {
+        free(rules[i].match);
+        free(rules[i].server);
+        free(rules[i].source);
+        free(rules[i].user);
+    }
+}
+
+/**
+ * Compile the numbered rules into one pattern. Each rule is first compiled
+ * alone so that an invalid rule is reported by its number and so that every
+ * rule is a complete pattern of its own inside the combined one.
+ *
+ * The rules are alternatives of a branch reset group, so the groups of each
+ * rule are numbered from one and the back references of the rules work as
+ * they would alone. The mark of an alternative is the index of its rule.
+ *
+ * @param my_instance   The filter instance
+ * @param options       PCRE2 compilation options
+ * @return True if the rules were compiled
+ */
+static bool
+compile_rules(REGEXHINT_INSTANCE *my_instance, uint32_t options)
+{
+    size_t len = sizeof("(?|)");
+    int errcode;
+    size_t erroffset;
+    PCRE2_UCHAR errbuf[STRERROR_BUFLEN];
+
+    for (int i = 0; i < my_instance->n_rules; i++)
+    {
+        REGEXHINT_RULE *rule = &my_instance->rules[i];
+        pcre2_code *code = pcre2_compile((PCRE2_SPTR) rule->match, PCRE2_ZERO_TERMINATED,
+                                         options, &errcode, &erroffset, NULL);
+
+        if (code == NULL)
+        {
+            pcre2_get_error_message(errcode, errbuf, sizeof(errbuf));
+            MXS_ERROR("namedserverfilter: Invalid regular expression '%s' of rule %d "
+                      "at offset %lu: %s", rule->match, rule->number, erroffset, errbuf);
+            return false;
+        }
+        pcre2_code_free(code);
+
+        /** |(?C255)(?:...)(*MARK:63) */
+        len += strlen(rule->match) + 32;
+    }
+
+    char *pattern = malloc(len);
+
+    if (pattern == NULL)
+    {
+        return false;
+    }
+
+    char *ptr = pattern + sprintf(pattern, "(?|");
+
+    for (int i = 0; i < my_instance->n_rules; i++)
+    {
+        REGEXHINT_RULE *rule = &my_instance->rules[i];
+
+        if (i > 0)
+        {
+            *ptr++ = '|';
+        }
+        if (rule->source || rule->user)
+        {
+            ptr += sprintf(ptr, "(?C%d)", i + 1);
+            my_instance->rules_limited = true;
+        }
+        ptr += sprintf(ptr, "(?:%s)(*MARK:%d)", rule->match, i);
+    }
+    strcpy(ptr, ")");
+
+    my_instance->rules_re = mxs_pcre2_pattern_compile(pattern, options, &errcode, &erroffset);
+
+    if (my_instance->rules_re == NULL)
+    {
+        pcre2_get_error_message(errcode, errbuf, sizeof(errbuf));
+        MXS_ERROR("namedserverfilter: Failed to combine the rules into one regular "
+                  "expression: %s", errbuf);
+    }
+
+    free(pattern);
+    return my_instance->rules_re != NULL;
+}
+
 /**
  * Create an instance of the filter for a particular service
  * within MaxScale.
@@ -145,8 +310,10 @@ createInstance(char **options, FILTER_PARAMETER **params)
 {
     REGEXHINT_INSTANCE *my_instance;
     int cflags = REG_ICASE;
+    REGEXHINT_RULE rules[REGEXHINT_MAX_RULES] = {{0}};
+    int n;
 
-    if ((my_instance = malloc(sizeof(REGEXHINT_INSTANCE))) != NULL)
+    if ((my_instance = calloc(1, sizeof(REGEXHINT_INSTANCE))) != NULL)
     {
         my_instance->match = NULL;
         my_instance->server = NULL;
@@ -172,6 +339,22 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 my_instance->user = strdup(params[i]->value);
             }
+            else if ((n = rule_number(params[i]->name, "match")))
+            {
+                rules[n - 1].match = strdup(params[i]->value);
+            }
+            else if ((n = rule_number(params[i]->name, "server")))
+            {
+                rules[n - 1].server = strdup(params[i]->value);
+            }
+            else if ((n = rule_number(params[i]->name, "source")))
+            {
+                rules[n - 1].source = strdup(params[i]->value);
+            }
+            else if ((n = rule_number(params[i]->name, "user")))
+            {
+                rules[n - 1].user = strdup(params[i]->value);
+            }
             else if (!filter_standard_parameter(params[i]->name))
             {
                 MXS_ERROR("namedserverfilter: Unexpected parameter '%s'.",
@@ -205,17 +388,42 @@ createInstance(char **options, FILTER_PARAMETER **params)
             }
         }
 
-        if (my_instance->match == NULL)
+        /** The rules are kept in the order of their numbers, without gaps */
+        for (int i = 0; i < REGEXHINT_MAX_RULES; i++)
+        {
+            REGEXHINT_RULE *rule = &rules[i];
+
+            if (rule->match || rule->server || rule->source || rule->user)
+            {
+                rule->number = i + 1;
+
+                if (rule->match == NULL || rule->server == NULL)
+                {
+                    MXS_ERROR("namedserverfilter: Rule %d requires both 'match%d' and "
+                              "'server%d'.", rule->number, rule->number, rule->number);
+                    error = true;
+                }
+                my_instance->rules[my_instance->n_rules++] = *rule;
+            }
+        }
+
+        if (my_instance->match == NULL && (my_instance->server || my_instance->n_rules == 0))
         {
             MXS_ERROR("namedserverfilter: Missing required parameters 'match'.");
             error = true;
         }
 
-        if (my_instance->server == NULL)
+        if (my_instance->server == NULL && (my_instance->match || my_instance->n_rules == 0))
         {
             MXS_ERROR("namedserverfilter: Missing required parameters 'server'.");
             error = true;
         }
+
+        if (!error && my_instance->n_rules > 0 &&
+            !compile_rules(my_instance, (cflags & REG_ICASE) ? PCRE2_CASELESS : 0))
+        {
+            error = true;
+        }
         if (my_instance->server && my_instance->match &&
             regcomp(&my_instance->re, my_instance->match, cflags))
         {
@@ -225,6 +433,12 @@ createInstance(char **options, FILTER_PARAMETER **params)
             my_instance->match = NULL;
             error = true;
         }
+        if (my_instance->match)
+        {
+            my_instance->literal = mxs_pcre2_required_literal(my_instance->match,
+                                                              &my_instance->literal_len);
+            my_instance->caseless = (cflags & REG_ICASE) != 0;
+        }
 
         if (error)
         {
@@ -233,9 +447,12 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 regfree(&my_instance->re);
                 free(my_instance->match);
             }
+            free(my_instance->literal);
             free(my_instance->server);
             free(my_instance->source);
             free(my_instance->user);
+            free_rules(my_instance->rules, my_instance->n_rules);
+            mxs_pcre2_pattern_free(my_instance->rules_re);
             free(my_instance);
             my_instance = NULL;
         }
@@ -277,6 +494,20 @@ newSession(FILTER *instance, SESSION *session)
         {
             my_session->active = 0;
         }
+
+        remote = session_get_remote(session);
+        user = session_getUser(session);
+
+        for (int i = 0; i < my_instance->n_rules; i++)
+        {
+            REGEXHINT_RULE *rule = &my_instance->rules[i];
+
+            if ((rule->source == NULL || (remote && strcmp(remote, rule->source) == 0)) &&
+                (rule->user == NULL || (user && strcmp(user, rule->user) == 0)))
+            {
+                my_session->rules |= (uint64_t)1 << i;
+            }
+        }
     }
 
     return my_session;
@@ -307,6 +538,68 @@ freeSession(FILTER *instance, void *session)
     return;
 }
 
+/**
+ * Callout of the combined pattern that fails the alternative of a rule that
+ * does not apply to the session
+ *
+ * @param block     The callout block, the callout number is the rule index plus one
+ * @param data      The filter session
+ * @return Zero to continue matching the rule, one to fail it
+ */
+static int
+rule_callout(pcre2_callout_block *block, void *data)
+{
+    REGEXHINT_SESSION *my_session = (REGEXHINT_SESSION *) data;
+
+    return (my_session->rules & ((uint64_t)1 << (block->callout_number - 1))) ? 0 : 1;
+}
+
+/**
+ * Find the numbered rule that matches a statement. The rule with the match
+ * that starts first in the statement wins and of those, the first rule.
+ *
+ * @param my_instance   The filter instance
+ * @param my_session    The filter session
+ * @param sql           The SQL statement
+ * @return The matching rule or NULL if no rule matched
+ */
+static REGEXHINT_RULE *
+match_rules(REGEXHINT_INSTANCE *my_instance, REGEXHINT_SESSION *my_session, const char *sql)
+{
+    pcre2_code *code = my_instance->rules_re->code;
+    pcre2_match_data *mdata = mxs_pcre2_thread_match_data(code);
+    pcre2_match_context *context = mxs_pcre2_thread_match_context();
+    REGEXHINT_RULE *rule = NULL;
+
+    if (mdata == NULL || context == NULL || my_session->rules == 0)
+    {
+        return NULL;
+    }
+
+    /** The match context belongs to the thread, so the callout is only set for this match */
+    if (my_instance->rules_limited)
+    {
+        pcre2_set_callout(context, rule_callout, my_session);
+    }
+
+    if (pcre2_match(code, (PCRE2_SPTR) sql, strlen(sql), 0, 0, mdata, context) > 0)
+    {
+        PCRE2_SPTR mark = pcre2_get_mark(mdata);
+
+        if (mark)
+        {
+            rule = &my_instance->rules[atoi((const char *) mark)];
+        }
+    }
+
+    if (my_instance->rules_limited)
+    {
+        pcre2_set_callout(context, NULL, NULL);
+    }
+
+    return rule;
+}
+
 /**
  * Set the downstream component for this filter.
  *
@@ -329,7 +622,9 @@ setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
  *
  * If the regular expressed configured in the match parameter of the
  * filter definition matches the SQL text then add the hint
- * "Route to named server" with the name defined in the server parameter
+ * "Route to named server" with the name defined in the server parameter.
+ * Otherwise the hint is added for the server of the numbered rule that
+ * matches the SQL text, if any.
  *
  * @param instance  The filter instance data
  * @param session   The filter session
@@ -350,13 +645,28 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
         }
         if ((sql = modutil_get_SQL(queue)) != NULL)
         {
-            if (regexec(&my_instance->re, sql, 0, NULL, 0) == 0)
+            REGEXHINT_RULE *rule;
+
+            /** Only statements that contain the literal text can match */
+            if (my_instance->match &&
+                (my_instance->literal == NULL ||
+                 mxs_pcre2_contains(sql, strlen(sql), my_instance->literal,
+                                    my_instance->literal_len, my_instance->caseless)) &&
+                regexec(&my_instance->re, sql, 0, NULL, 0) == 0)
             {
                 queue->hint = hint_create_route(queue->hint,
                                                 HINT_ROUTE_TO_NAMED_SERVER,
                                                 my_instance->server);
                 my_session->n_diverted++;
             }
+            else if (my_instance->n_rules > 0 &&
+                     (rule = match_rules(my_instance, my_session, sql)) != NULL)
+            {
+                queue->hint = hint_create_route(queue->hint,
+                                                HINT_ROUTE_TO_NAMED_SERVER,
+                                                rule->server);
+                my_session->n_diverted++;
+            }
             else
             {
                 my_session->n_undiverted++;
@@ -385,8 +695,26 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
     REGEXHINT_INSTANCE *my_instance = (REGEXHINT_INSTANCE *) instance;
     REGEXHINT_SESSION *my_session = (REGEXHINT_SESSION *) fsession;
 
-    dcb_printf(dcb, "\t\tMatch and route:           /%s/ -> %s\n",
-               my_instance->match, my_instance->server);
+    if (my_instance->match)
+    {
+        dcb_printf(dcb, "\t\tMatch and route:           /%s/ -> %s\n",
+                   my_instance->match, my_instance->server);
+    }
+    for (int i = 0; i < my_instance->n_rules; i++)
+    {
+        REGEXHINT_RULE *rule = &my_instance->rules[i];
+
+        dcb_printf(dcb, "\t\tRule %-2d match and route:   /%s/ -> %s\n",
+                   rule->number, rule->match, rule->server);
+        if (rule->source)
+        {
+            dcb_printf(dcb, "\t\t\tLimited to connections from  %s\n", rule->source);
+        }
+        if (rule->user)
+        {
+            dcb_printf(dcb, "\t\t\tLimited to user              %s\n", rule->user);
+        }
+    }
     if (my_session)
     {
         dcb_printf(dcb, "\t\tNo. of queries diverted by filter: %d\n",
@@ -407,3 +735,16 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
                    my_instance->user);
     }
 }
+
+/**
+ * Return the packets the filter is interested in. The hints are only added to
+ * COM_QUERY packets.
+ *
+ * @param instance      The filter instance
+ * @return The interest mask of the filter
+ */
+static uint64_t
+getInterest(FILTER *instance)
+{
+    return FILTER_INTEREST_COMMAND(0x03);
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file qladecode.c - Convert binary query logs of the qlafilter to text
+ *
+ * The records are printed in the same format as the text format of the
+ * unified log: time, session ID, user@host and the statement. The commands
+ * of a capture other than the queries are printed as CONNECT and USE with
+ * the database, and QUIT.
+ *
+ * Usage: qladecode [FILE...]
+ *
+ * The standard input is read if no files are given.
+ */
+
+#include <qlafilter.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <mysql_client_server_protocol.h>
+
+/**
+ * Decode all records of a binary log
+ *
+ * @param file The log file
+ * @param name Name of the file for error messages
+ * @return True if the whole file was decoded
+ */
+static bool decode_file(FILE *file, const char *name)
+{
+    uint8_t header[QLA_BINARY_HEADER_LEN];
+
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+        memcmp(header, QLA_BINARY_MAGIC, QLA_BINARY_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "%s: Not a binary query log.\n", name);
+        return false;
+    }
+
+    bool capture = header[QLA_BINARY_MAGIC_LEN] == QLA_CAPTURE_VERSION;
+
+    if (header[QLA_BINARY_MAGIC_LEN] != QLA_BINARY_VERSION && !capture)
+    {
+        fprintf(stderr, "%s: Unsupported version %d.\n", name, header[QLA_BINARY_MAGIC_LEN]);
+        return false;
+    }
+
+    uint8_t fixed[QLA_RECORD_HEADER_LEN];
+    char *data = NULL;
+    size_t data_size = 0;
+    bool rval = true;
+    size_t n;
+
+    while ((n = fread(fixed, 1, sizeof(fixed), file)) == sizeof(fixed))
+    {
+        uint64_t len = qla_get_uint(fixed + QLA_RECORD_LEN_OFFSET, 4);
+        uint64_t usec = qla_get_uint(fixed + QLA_RECORD_TIME_OFFSET, 8);
+        uint32_t ses_id = qla_get_uint(fixed + QLA_RECORD_SESSION_OFFSET, 4);
+        int user_len = qla_get_uint(fixed + QLA_RECORD_USER_LEN_OFFSET, 2);
+        int remote_len = qla_get_uint(fixed + QLA_RECORD_REMOTE_LEN_OFFSET, 2);
+        uint64_t sql_len = qla_get_uint(fixed + QLA_RECORD_SQL_LEN_OFFSET, 4);
+
+        if (len != QLA_RECORD_HEADER_LEN + user_len + remote_len + sql_len)
+        {
+            fprintf(stderr, "%s: Corrupted record at offset %ld.\n", name,
+                    ftell(file) - QLA_RECORD_HEADER_LEN);
+            rval = false;
+            break;
+        }
+
+        len -= QLA_RECORD_HEADER_LEN;
+
+        if (len > data_size)
+        {
+            char *tmp = realloc(data, len);
+
+            if (tmp == NULL)
+            {
+                fprintf(stderr, "Memory allocation failed.\n");
+                rval = false;
+                break;
+            }
+
+            data = tmp;
+            data_size = len;
+        }
+
+        if (fread(data, 1, len, file) != len)
+        {
+            fprintf(stderr, "%s: Truncated record at the end of the file.\n", name);
+            rval = false;
+            break;
+        }
+
+        char timestamp[64];
+        time_t secs = usec / 1000000;
+        struct tm t;
+        char *sql = data + user_len + remote_len;
+        const char *prefix = "";
+
+        if (capture && sql_len > 0)
+        {
+            switch ((uint8_t)*sql)
+            {
+                case QLA_COM_CONNECT:
+                    prefix = "CONNECT ";
+                    break;
+
+                case MYSQL_COM_INIT_DB:
+                    prefix = "USE ";
+                    break;
+
+                case MYSQL_COM_QUIT:
+                    prefix = "QUIT";
+                    break;
+
+                default:
+                    break;
+            }
+
+            sql++;
+            sql_len--;
+        }
+
+        localtime_r(&secs, &t);
+        strftime(timestamp, sizeof(timestamp), "%F %T", &t);
+        printf("%s,%u,%.*s@%.*s,%s%.*s\n", timestamp, ses_id, user_len, data,
+               remote_len, data + user_len, prefix, (int)sql_len, sql);
+    }
+
+    if (rval && n != 0)
+    {
+        fprintf(stderr, "%s: Truncated record at the end of the file.\n", name);
+        rval = false;
+    }
+
+    free(data);
+    return rval;
+}
+
+int main(int argc, char **argv)
+{
+    int rval = 0;
+
+    if (argc < 2)
+    {
+        return decode_file(stdin, "stdin") ? 0 : 1;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *file = fopen(argv[i], "rb");
+
+        if (file == NULL)
+        {
+            fprintf(stderr, "Failed to open file '%s'.\n", argv[i]);
+            rval = 1;
+        }
+        else
+        {
+            if (!decode_file(file, argv[i]))
+            {
+                rval = 1;
+            }
+
+            fclose(file);
+        }
+    }
+
+    return rval;
+}
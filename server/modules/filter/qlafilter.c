@@ -26,10 +26,23 @@
  * file to which the queries are logged. A serial number is appended to this
  * name in order that each session logs to a different file.
  *
+ * With log_type=unified all sessions log into one file. The statements are
+ * stored in a ring buffer of the thread that routes them and a writer thread
+ * drains the rings into the file, so the routing threads never wait for the
+ * disk. The unified log can be written as text or in the compact binary
+ * format described in qlafilter.h which the qladecode tool converts to text.
+ *
+ * With log_format=capture the unified log is a capture of the workload: the
+ * commands of each session that the qlareplay tool needs to replay them with
+ * the original timing, see qlafilter.h.
+ *
  * Date         Who             Description
  * 03/06/2014   Mark Riddoch    Initial implementation
  * 11/06/2014   Mark Riddoch    Addition of source and match parameters
  * 19/06/2014   Mark Riddoch    Addition of user parameter
+ * 15/10/2016   Core Team       Unified log with an asynchronous writer, binary
+ *                              format and sampling
+ * 15/10/2016   Core Team       Workload capture
  *
  * @endverbatim
  */
@@ -40,13 +53,20 @@
 #include <filter.h>
 #include <modinfo.h>
 #include <modutil.h>
+#include <mysql_client_server_protocol.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <time.h>
 #include <sys/time.h>
 #include <regex.h>
 #include <string.h>
+#include <unistd.h>
 #include <atomic.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <platform.h>
+#include <maxconfig.h>
+#include <qlafilter.h>
 
 MODULE_INFO info =
 {
@@ -56,11 +76,40 @@ MODULE_INFO info =
     "A simple query logging filter"
 };
 
-static char *version_str = "V1.1.1";
+static char *version_str = "V1.2.0";
 
 /** Formatting buffer size */
 #define QLA_STRING_BUFFER_SIZE 1024
 
+/** Default size of the ring buffer of each thread in bytes */
+#define QLA_RING_SIZE 1048576
+
+/** How long the writer sleeps when the rings are empty */
+#define QLA_WRITER_SLEEP_MS 10
+
+/** Where the statements are logged */
+typedef enum
+{
+    QLA_LOG_SESSION, /* A file for each session */
+    QLA_LOG_UNIFIED  /* One file for all sessions */
+} qla_log_type_t;
+
+/**
+ * A ring buffer of the records of one thread. The owning thread only moves
+ * the head and the writer thread only moves the tail, so neither needs a
+ * lock. The threads that do not own a ring share the last ring of the
+ * instance and serialise on its lock.
+ */
+typedef struct
+{
+    uint8_t *data;     /* The buffer */
+    uint64_t size;     /* Size of the buffer, a power of two */
+    uint64_t head;     /* Total bytes written, moved by the producer */
+    uint64_t tail;     /* Total bytes consumed, moved by the writer */
+    uint64_t dropped;  /* Records dropped because the ring was full */
+    SPINLOCK lock;     /* Taken by the producers of a shared ring */
+} QLA_RING;
+
 /*
  * The filter entry points
  */
@@ -71,6 +120,7 @@ static void freeSession(FILTER *instance, void *session);
 static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static uint64_t getInterest(FILTER *instance);
 
 
 static FILTER_OBJECT MyObject =
@@ -84,6 +134,7 @@ static FILTER_OBJECT MyObject =
     routeQuery,
     NULL, // No client reply
     diagnostic,
+    getInterest,
 };
 
 /**
@@ -104,6 +155,22 @@ typedef struct
     regex_t re; /* Compiled regex text */
     char *nomatch; /* Optional text to match against for exclusion */
     regex_t nore; /* Compiled regex nomatch text */
+    int sample_rate; /* Log every Nth statement of a session */
+    char *sample_match; /* Statements that are logged regardless of the rate */
+    regex_t sample_re; /* Compiled regex sample_match text */
+    qla_log_type_t log_type; /* A file per session or one for all sessions */
+    bool binary; /* Unified log in the binary format */
+    bool capture; /* Unified log in the capture format */
+    uint64_t ring_size; /* Size of the ring buffer of each thread */
+    uint64_t rotate_size; /* Size at which the unified log is rotated, 0 for never */
+    int n_rings; /* Number of rings, the last one is shared */
+    QLA_RING *rings; /* The ring buffers of the threads */
+    THREAD writer; /* The thread writing the unified log */
+    char *unified_name; /* Name of the current unified log file */
+    int unified_index; /* Index of the current unified log file */
+    FILE *unified_fp; /* The current unified log file */
+    uint64_t unified_size; /* Bytes written into the current file */
+    uint64_t records; /* Records written into the unified log */
 } QLA_INSTANCE;
 
 /**
@@ -122,8 +189,21 @@ typedef struct
     int active;
     char *user;
     char *remote;
+    uint32_t ses_id;
+    uint64_t n_statements; /* Statements that passed the match and exclude */
 } QLA_SESSION;
 
+/** The ring index of the calling thread, -1 until the first statement */
+static thread_local int qla_thread_id = -1;
+
+/** Number of threads that have been given a ring index */
+static int qla_thread_count = 0;
+
+static bool open_unified_file(QLA_INSTANCE *my_instance);
+static void unified_writer(void *arg);
+static void unified_log(QLA_INSTANCE *my_instance, QLA_SESSION *my_session,
+                        struct timeval *tv, uint8_t command, const char *sql, size_t sql_len);
+
 /**
  * Implementation of the mandatory version entry point
  *
@@ -176,8 +256,11 @@ createInstance(char **options, FILTER_PARAMETER **params)
     QLA_INSTANCE *my_instance;
     int i;
 
-    if ((my_instance = malloc(sizeof(QLA_INSTANCE))) != NULL)
+    if ((my_instance = calloc(1, sizeof(QLA_INSTANCE))) != NULL)
     {
+        my_instance->sample_rate = 1;
+        my_instance->log_type = QLA_LOG_SESSION;
+        my_instance->ring_size = QLA_RING_SIZE;
         my_instance->source = NULL;
         my_instance->userName = NULL;
         my_instance->match = NULL;
@@ -209,6 +292,76 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 {
                     my_instance->filebase = strdup(params[i]->value);
                 }
+                else if (!strcmp(params[i]->name, "sample_rate"))
+                {
+                    my_instance->sample_rate = atoi(params[i]->value);
+
+                    if (my_instance->sample_rate <= 0)
+                    {
+                        MXS_ERROR("qlafilter: Invalid value '%s' for the "
+                                  "'sample_rate' parameter.", params[i]->value);
+                        error = true;
+                    }
+                }
+                else if (!strcmp(params[i]->name, "sample_match"))
+                {
+                    my_instance->sample_match = strdup(params[i]->value);
+                }
+                else if (!strcmp(params[i]->name, "log_type"))
+                {
+                    if (!strcasecmp(params[i]->value, "unified"))
+                    {
+                        my_instance->log_type = QLA_LOG_UNIFIED;
+                    }
+                    else if (strcasecmp(params[i]->value, "session"))
+                    {
+                        MXS_ERROR("qlafilter: Invalid value '%s' for the "
+                                  "'log_type' parameter.", params[i]->value);
+                        error = true;
+                    }
+                }
+                else if (!strcmp(params[i]->name, "log_format"))
+                {
+                    if (!strcasecmp(params[i]->value, "binary"))
+                    {
+                        my_instance->binary = true;
+                    }
+                    else if (!strcasecmp(params[i]->value, "capture"))
+                    {
+                        my_instance->binary = true;
+                        my_instance->capture = true;
+                    }
+                    else if (strcasecmp(params[i]->value, "text"))
+                    {
+                        MXS_ERROR("qlafilter: Invalid value '%s' for the "
+                                  "'log_format' parameter.", params[i]->value);
+                        error = true;
+                    }
+                }
+                else if (!strcmp(params[i]->name, "ring_size"))
+                {
+                    long long size = atoll(params[i]->value);
+
+                    if (size < QLA_STRING_BUFFER_SIZE)
+                    {
+                        MXS_ERROR("qlafilter: The 'ring_size' parameter must be "
+                                  "at least %d bytes.", QLA_STRING_BUFFER_SIZE);
+                        error = true;
+                    }
+                    else
+                    {
+                        /** Round up to a power of two */
+                        my_instance->ring_size = 1;
+                        while (my_instance->ring_size < (uint64_t)size)
+                        {
+                            my_instance->ring_size <<= 1;
+                        }
+                    }
+                }
+                else if (!strcmp(params[i]->name, "rotate_size"))
+                {
+                    my_instance->rotate_size = strtoull(params[i]->value, NULL, 10);
+                }
                 else if (!filter_standard_parameter(params[i]->name))
                 {
                     MXS_ERROR("qlafilter: Unexpected parameter '%s'.",
@@ -251,6 +404,22 @@ createInstance(char **options, FILTER_PARAMETER **params)
             error = true;
         }
 
+        if (my_instance->binary && my_instance->log_type != QLA_LOG_UNIFIED)
+        {
+            MXS_ERROR("qlafilter: The binary log format requires 'log_type=unified'.");
+            error = true;
+        }
+
+        /** A replay needs all commands of the captured sessions */
+        if (my_instance->capture &&
+            (my_instance->match || my_instance->nomatch ||
+             my_instance->sample_rate > 1 || my_instance->sample_match))
+        {
+            MXS_ERROR("qlafilter: The 'match', 'exclude', 'sample_rate' and 'sample_match' "
+                      "parameters can not be used with 'log_format=capture'.");
+            error = true;
+        }
+
         my_instance->sessions = 0;
         if (my_instance->match &&
             regcomp(&my_instance->re, my_instance->match, cflags))
@@ -272,9 +441,65 @@ createInstance(char **options, FILTER_PARAMETER **params)
             my_instance->nomatch = NULL;
             error = true;
         }
+        if (my_instance->sample_match &&
+            regcomp(&my_instance->sample_re, my_instance->sample_match, cflags))
+        {
+            MXS_ERROR("qlafilter: Invalid regular expression '%s'"
+                      " for the 'sample_match' parameter.",
+                      my_instance->sample_match);
+            free(my_instance->sample_match);
+            my_instance->sample_match = NULL;
+            error = true;
+        }
+
+        if (!error && my_instance->log_type == QLA_LOG_UNIFIED)
+        {
+            my_instance->n_rings = config_threadcount() + 1;
+
+            if ((my_instance->rings = calloc(my_instance->n_rings, sizeof(QLA_RING))) == NULL)
+            {
+                error = true;
+            }
+
+            for (i = 0; !error && i < my_instance->n_rings; i++)
+            {
+                spinlock_init(&my_instance->rings[i].lock);
+                my_instance->rings[i].size = my_instance->ring_size;
+
+                if ((my_instance->rings[i].data = malloc(my_instance->ring_size)) == NULL)
+                {
+                    MXS_ERROR("qlafilter: Failed to allocate memory for the ring buffers.");
+                    error = true;
+                }
+            }
+
+            if (!error && (!open_unified_file(my_instance) ||
+                           thread_start(&my_instance->writer, unified_writer, my_instance) == NULL))
+            {
+                MXS_ERROR("qlafilter: Failed to start the unified log writer.");
+                error = true;
+            }
+        }
 
         if (error)
         {
+            if (my_instance->unified_fp)
+            {
+                fclose(my_instance->unified_fp);
+            }
+            for (i = 0; my_instance->rings && i < my_instance->n_rings; i++)
+            {
+                free(my_instance->rings[i].data);
+            }
+            free(my_instance->rings);
+            free(my_instance->unified_name);
+
+            if (my_instance->sample_match)
+            {
+                free(my_instance->sample_match);
+                regfree(&my_instance->sample_re);
+            }
+
             if (my_instance->match)
             {
                 free(my_instance->match);
@@ -314,7 +539,8 @@ newSession(FILTER *instance, SESSION *session)
 
     if ((my_session = calloc(1, sizeof(QLA_SESSION))) != NULL)
     {
-        if ((my_session->filename = (char *)malloc(strlen(my_instance->filebase) + 20)) == NULL)
+        if (my_instance->log_type == QLA_LOG_SESSION &&
+            (my_session->filename = (char *)malloc(strlen(my_instance->filebase) + 20)) == NULL)
         {
             char errbuf[STRERROR_BUFLEN];
             MXS_ERROR("Memory allocation for qla filter "
@@ -340,15 +566,29 @@ newSession(FILTER *instance, SESSION *session)
 
         my_session->user = userName;
         my_session->remote = remote;
+        my_session->ses_id = (uint32_t)session->ses_id;
+
+        if (my_session->active && my_instance->capture)
+        {
+            MYSQL_session *auth = (MYSQL_session *)session->client_dcb->data;
+            const char *db = auth ? auth->db : "";
+            struct timeval tv;
 
-        sprintf(my_session->filename, "%s.%d",
-                my_instance->filebase,
-                my_instance->sessions);
+            gettimeofday(&tv, NULL);
+            unified_log(my_instance, my_session, &tv, QLA_COM_CONNECT, db, strlen(db));
+        }
+
+        if (my_session->filename)
+        {
+            sprintf(my_session->filename, "%s.%d",
+                    my_instance->filebase,
+                    my_instance->sessions);
+        }
 
         // Multiple sessions can try to update my_instance->sessions simultaneously
         atomic_add(&(my_instance->sessions), 1);
 
-        if (my_session->active)
+        if (my_session->active && my_session->filename)
         {
             my_session->fp = fopen(my_session->filename, "w");
 
@@ -387,12 +627,20 @@ newSession(FILTER *instance, SESSION *session)
 static void
 closeSession(FILTER *instance, void *session)
 {
+    QLA_INSTANCE *my_instance = (QLA_INSTANCE *) instance;
     QLA_SESSION *my_session = (QLA_SESSION *) session;
 
     if (my_session->active && my_session->fp)
     {
         fclose(my_session->fp);
     }
+    if (my_session->active && my_instance->capture)
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        unified_log(my_instance, my_session, &tv, MYSQL_COM_QUIT, "", 0);
+    }
 }
 
 /**
@@ -427,6 +675,281 @@ setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
     my_session->down = *downstream;
 }
 
+/**
+ * Copy data into a ring buffer, wrapping around the end of the buffer
+ *
+ * @param ring      The ring
+ * @param pos       The position in the ring
+ * @param data      The data
+ * @param len       Length of the data
+ */
+static void
+ring_put(QLA_RING *ring, uint64_t pos, const void *data, uint64_t len)
+{
+    uint64_t offset = pos & (ring->size - 1);
+    uint64_t first = MIN(len, ring->size - offset);
+
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, (const uint8_t *)data + first, len - first);
+}
+
+/**
+ * Copy data out of a ring buffer, wrapping around the end of the buffer
+ *
+ * @param ring      The ring
+ * @param pos       The position in the ring
+ * @param dest      Where the data is copied
+ * @param len       Length of the data
+ */
+static void
+ring_get(QLA_RING *ring, uint64_t pos, void *dest, uint64_t len)
+{
+    uint64_t offset = pos & (ring->size - 1);
+    uint64_t first = MIN(len, ring->size - offset);
+
+    memcpy(dest, ring->data + offset, first);
+    memcpy((uint8_t *)dest + first, ring->data, len - first);
+}
+
+/**
+ * Store a statement in the ring buffer of the calling thread. If the ring
+ * is full, the statement is dropped.
+ *
+ * @param my_instance   The filter instance
+ * @param my_session    The filter session
+ * @param tv            Time the statement was received
+ * @param command       The command, stored before the statement in a capture
+ * @param sql           The statement or the argument of the command
+ * @param sql_len       Length of the statement
+ */
+static void
+unified_log(QLA_INSTANCE *my_instance, QLA_SESSION *my_session,
+            struct timeval *tv, uint8_t command, const char *sql, size_t sql_len)
+{
+    const char *user = my_session->user ? my_session->user : "";
+    const char *remote = my_session->remote ? my_session->remote : "";
+    size_t user_len = MIN(strlen(user), UINT16_MAX);
+    size_t remote_len = MIN(strlen(remote), UINT16_MAX);
+    size_t cmd_len = my_instance->capture ? 1 : 0;
+    uint64_t len = QLA_RECORD_HEADER_LEN + user_len + remote_len + cmd_len + sql_len;
+    uint8_t header[QLA_RECORD_HEADER_LEN];
+
+    if (qla_thread_id == -1)
+    {
+        qla_thread_id = atomic_add(&qla_thread_count, 1);
+    }
+
+    bool shared = qla_thread_id >= my_instance->n_rings - 1;
+    QLA_RING *ring = &my_instance->rings[shared ? my_instance->n_rings - 1 : qla_thread_id];
+
+    if (shared)
+    {
+        spinlock_acquire(&ring->lock);
+    }
+
+    uint64_t tail = ring->tail;
+    __sync_synchronize();
+
+    if (ring->size - (ring->head - tail) < len)
+    {
+        ring->dropped++;
+    }
+    else
+    {
+        qla_set_uint(header + QLA_RECORD_LEN_OFFSET, len, 4);
+        qla_set_uint(header + QLA_RECORD_TIME_OFFSET,
+                     (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec, 8);
+        qla_set_uint(header + QLA_RECORD_SESSION_OFFSET, my_session->ses_id, 4);
+        qla_set_uint(header + QLA_RECORD_USER_LEN_OFFSET, user_len, 2);
+        qla_set_uint(header + QLA_RECORD_REMOTE_LEN_OFFSET, remote_len, 2);
+        qla_set_uint(header + QLA_RECORD_SQL_LEN_OFFSET, cmd_len + sql_len, 4);
+
+        uint64_t pos = ring->head;
+        ring_put(ring, pos, header, QLA_RECORD_HEADER_LEN);
+        pos += QLA_RECORD_HEADER_LEN;
+        ring_put(ring, pos, user, user_len);
+        pos += user_len;
+        ring_put(ring, pos, remote, remote_len);
+        pos += remote_len;
+        ring_put(ring, pos, &command, cmd_len);
+        pos += cmd_len;
+        ring_put(ring, pos, sql, sql_len);
+
+        /** The record must be complete before the writer can see it */
+        __sync_synchronize();
+        ring->head += len;
+    }
+
+    if (shared)
+    {
+        spinlock_release(&ring->lock);
+    }
+}
+
+/**
+ * Open the next unified log file. The files are named filebase.unified.N
+ * and the first unused index is taken, so no old log is overwritten.
+ *
+ * @param my_instance   The filter instance
+ * @return True if the file was opened
+ */
+static bool
+open_unified_file(QLA_INSTANCE *my_instance)
+{
+    size_t len = strlen(my_instance->filebase) + 30;
+    char *name = malloc(len);
+
+    if (name == NULL)
+    {
+        return false;
+    }
+
+    do
+    {
+        my_instance->unified_index++;
+        snprintf(name, len, "%s.unified.%d", my_instance->filebase,
+                 my_instance->unified_index);
+    }
+    while (access(name, F_OK) == 0);
+
+    FILE *fp = fopen(name, "w");
+
+    if (fp == NULL)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("qlafilter: Failed to open unified log file '%s': %d, %s",
+                  name, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+        free(name);
+        return false;
+    }
+
+    my_instance->unified_size = 0;
+
+    if (my_instance->binary)
+    {
+        uint8_t header[QLA_BINARY_HEADER_LEN] = {0};
+
+        memcpy(header, QLA_BINARY_MAGIC, QLA_BINARY_MAGIC_LEN);
+        header[QLA_BINARY_MAGIC_LEN] = my_instance->capture ? QLA_CAPTURE_VERSION : QLA_BINARY_VERSION;
+        fwrite(header, 1, sizeof(header), fp);
+        my_instance->unified_size = sizeof(header);
+    }
+
+    if (my_instance->unified_fp)
+    {
+        fclose(my_instance->unified_fp);
+    }
+
+    /** The name is only freed here, the diagnostics may be printing the old one */
+    char *old = my_instance->unified_name;
+    my_instance->unified_name = name;
+    my_instance->unified_fp = fp;
+    free(old);
+
+    return true;
+}
+
+/**
+ * Write one record into the unified log
+ *
+ * @param my_instance   The filter instance
+ * @param rec           The record
+ * @param len           Length of the record
+ */
+static void
+write_record(QLA_INSTANCE *my_instance, uint8_t *rec, uint64_t len)
+{
+    if (my_instance->binary)
+    {
+        fwrite(rec, 1, len, my_instance->unified_fp);
+    }
+    else
+    {
+        uint64_t usec = qla_get_uint(rec + QLA_RECORD_TIME_OFFSET, 8);
+        int user_len = qla_get_uint(rec + QLA_RECORD_USER_LEN_OFFSET, 2);
+        int remote_len = qla_get_uint(rec + QLA_RECORD_REMOTE_LEN_OFFSET, 2);
+        int sql_len = qla_get_uint(rec + QLA_RECORD_SQL_LEN_OFFSET, 4);
+        char *user = (char *)rec + QLA_RECORD_HEADER_LEN;
+        char buffer[QLA_STRING_BUFFER_SIZE];
+        time_t secs = usec / 1000000;
+        struct tm t;
+
+        localtime_r(&secs, &t);
+        strftime(buffer, sizeof(buffer), "%F %T", &t);
+        len = fprintf(my_instance->unified_fp, "%s,%u,%.*s@%.*s,%.*s\n", buffer,
+                      (uint32_t)qla_get_uint(rec + QLA_RECORD_SESSION_OFFSET, 4),
+                      user_len, user, remote_len, user + user_len,
+                      sql_len, user + user_len + remote_len);
+    }
+
+    my_instance->records++;
+    my_instance->unified_size += len;
+
+    if (my_instance->rotate_size && my_instance->unified_size >= my_instance->rotate_size)
+    {
+        /** If the new file can't be opened, the old one is used */
+        open_unified_file(my_instance);
+    }
+}
+
+/**
+ * The unified log writer thread. The ring buffers of the threads are
+ * drained into the log file and the file is flushed whenever all rings
+ * are empty.
+ *
+ * @param arg   The filter instance
+ */
+static void
+unified_writer(void *arg)
+{
+    QLA_INSTANCE *my_instance = (QLA_INSTANCE *) arg;
+    uint8_t *rec = malloc(my_instance->ring_size);
+
+    if (rec == NULL)
+    {
+        MXS_ERROR("qlafilter: Failed to allocate memory for the unified log writer.");
+        return;
+    }
+
+    while (true)
+    {
+        bool written = false;
+
+        for (int i = 0; i < my_instance->n_rings; i++)
+        {
+            QLA_RING *ring = &my_instance->rings[i];
+            uint64_t head = ring->head;
+            uint64_t tail = ring->tail;
+            __sync_synchronize();
+
+            while (tail < head)
+            {
+                uint8_t lenbuf[4];
+
+                ring_get(ring, tail, lenbuf, sizeof(lenbuf));
+                uint64_t len = qla_get_uint(lenbuf, 4);
+                ring_get(ring, tail, rec, len);
+                tail += len;
+                write_record(my_instance, rec, len);
+            }
+
+            if (tail != ring->tail)
+            {
+                /** The records must be copied before the space is reused */
+                __sync_synchronize();
+                ring->tail = tail;
+                written = true;
+            }
+        }
+
+        if (!written)
+        {
+            fflush(my_instance->unified_fp);
+            thread_millisleep(QLA_WRITER_SLEEP_MS);
+        }
+    }
+}
+
 /**
  * The routeQuery entry point. This is passed the query buffer
  * to which the filter should be applied. Once applied the
@@ -447,7 +970,27 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
     struct tm t;
     struct timeval tv;
 
-    if (my_session->active)
+    if (my_session->active && my_instance->capture)
+    {
+        if (queue->next != NULL)
+        {
+            queue = gwbuf_make_contiguous(queue);
+        }
+        uint8_t *data = GWBUF_DATA(queue);
+        uint8_t command = GWBUF_LENGTH(queue) > MYSQL_HEADER_LEN &&
+                          MYSQL_GET_PACKET_LEN(data) > 0 ? MYSQL_GET_COMMAND(data) : 0;
+
+        if (command == MYSQL_COM_QUERY || command == MYSQL_COM_INIT_DB)
+        {
+            /** The argument is logged as it was sent, the replay sends it back */
+            size_t len = MIN(MYSQL_GET_PACKET_LEN(data), GWBUF_LENGTH(queue) - MYSQL_HEADER_LEN) - 1;
+
+            gettimeofday(&tv, NULL);
+            unified_log(my_instance, my_session, &tv, command,
+                        (char *)data + MYSQL_HEADER_LEN + 1, len);
+        }
+    }
+    else if (my_session->active)
     {
         if (queue->next != NULL)
         {
@@ -458,14 +1001,26 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
             if ((my_instance->match == NULL ||
                  regexec(&my_instance->re, ptr, 0, NULL, 0) == 0) &&
                 (my_instance->nomatch == NULL ||
-                 regexec(&my_instance->nore, ptr, 0, NULL, 0) != 0))
+                 regexec(&my_instance->nore, ptr, 0, NULL, 0) != 0) &&
+                (my_session->n_statements++ % my_instance->sample_rate == 0 ||
+                 (my_instance->sample_match &&
+                  regexec(&my_instance->sample_re, ptr, 0, NULL, 0) == 0)))
             {
-                char buffer[QLA_STRING_BUFFER_SIZE];
                 gettimeofday(&tv, NULL);
-                localtime_r(&tv.tv_sec, &t);
-                strftime(buffer, sizeof(buffer), "%F %T", &t);
-                fprintf(my_session->fp, "%s,%s@%s,%s\n", buffer, my_session->user,
-                        my_session->remote, trim(squeeze_whitespace(ptr)));
+
+                if (my_instance->log_type == QLA_LOG_UNIFIED)
+                {
+                    char *sql = trim(squeeze_whitespace(ptr));
+                    unified_log(my_instance, my_session, &tv, 0, sql, strlen(sql));
+                }
+                else
+                {
+                    char buffer[QLA_STRING_BUFFER_SIZE];
+                    localtime_r(&tv.tv_sec, &t);
+                    strftime(buffer, sizeof(buffer), "%F %T", &t);
+                    fprintf(my_session->fp, "%s,%s@%s,%s\n", buffer, my_session->user,
+                            my_session->remote, trim(squeeze_whitespace(ptr)));
+                }
             }
             free(ptr);
         }
@@ -492,11 +1047,35 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
     QLA_INSTANCE *my_instance = (QLA_INSTANCE *) instance;
     QLA_SESSION *my_session = (QLA_SESSION *) fsession;
 
-    if (my_session)
+    if (my_session && my_session->filename)
     {
         dcb_printf(dcb, "\t\tLogging to file            %s.\n",
                    my_session->filename);
     }
+    if (my_instance->log_type == QLA_LOG_UNIFIED)
+    {
+        uint64_t dropped = 0;
+
+        for (int i = 0; i < my_instance->n_rings; i++)
+        {
+            dropped += my_instance->rings[i].dropped;
+        }
+        dcb_printf(dcb, "\t\tUnified log file           %s (%s)\n",
+                   my_instance->unified_name, my_instance->capture ? "capture" :
+                   my_instance->binary ? "binary" : "text");
+        dcb_printf(dcb, "\t\tStatements logged          %lu\n", my_instance->records);
+        dcb_printf(dcb, "\t\tStatements dropped         %lu\n", dropped);
+    }
+    if (my_instance->sample_rate > 1)
+    {
+        dcb_printf(dcb, "\t\tLogging one statement in   %d\n",
+                   my_instance->sample_rate);
+    }
+    if (my_instance->sample_match)
+    {
+        dcb_printf(dcb, "\t\tAlways log queries that match  %s\n",
+                   my_instance->sample_match);
+    }
     if (my_instance->source)
     {
         dcb_printf(dcb, "\t\tLimit logging to connections from  %s\n",
@@ -518,3 +1097,24 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
                    my_instance->nomatch);
     }
 }
+
+/**
+ * Return the packets the filter is interested in. The statements of COM_QUERY
+ * and COM_STMT_PREPARE packets are logged, and a capture also logs the
+ * COM_INIT_DB packets. The replies are never looked at.
+ *
+ * @param instance      The filter instance
+ * @return The interest mask of the filter
+ */
+static uint64_t
+getInterest(FILTER *instance)
+{
+    QLA_INSTANCE *my_instance = (QLA_INSTANCE *) instance;
+    uint64_t interest = FILTER_INTEREST_COMMAND(0x03) | FILTER_INTEREST_COMMAND(0x16);
+
+    if (my_instance->capture)
+    {
+        interest |= FILTER_INTEREST_COMMAND(0x02);
+    }
+    return interest;
+}
@@ -0,0 +1,614 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file qlareplay.c - Replay a workload captured by the qlafilter
+ *
+ * The commands of a capture, see qlafilter.h, are grouped by session and each
+ * session is replayed by a thread of its own, so the sessions run with the
+ * concurrency they had when they were captured. A session connects at the
+ * time it was captured and sends each command at its captured offset from the
+ * start of the capture, divided by the speed. The commands are sent as fast as
+ * possible if a command is still running when the next one is due, or if the
+ * speed is 0.
+ *
+ * The latencies of the connects and the commands are reported as percentiles,
+ * along with how late the commands were sent compared to their schedule. A
+ * replay whose lag is large did not reproduce the captured load.
+ *
+ * The password of the captured users is not known, so all sessions log in with
+ * the given password and, if one is given, the given user.
+ *
+ * Usage: qlareplay [-h HOST] [-P PORT] [-u USER] [-p PASSWORD] [-s SPEED] FILE...
+ */
+
+#include <qlafilter.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <mysql.h>
+#include <mysql_client_server_protocol.h>
+
+/** The stack size of the session threads, there can be thousands of them */
+#define REPLAY_STACK_SIZE (256 * 1024)
+
+/**
+ * A captured command
+ */
+typedef struct
+{
+    uint32_t ses_id;    /*< The session */
+    uint64_t usec;      /*< When the command was received */
+    uint64_t seq;       /*< The position in the capture, orders commands with equal times */
+    uint8_t  command;   /*< The command */
+    char     *user;     /*< The user, NUL terminated */
+    char     *arg;      /*< The argument of the command, NUL terminated */
+    size_t   arg_len;   /*< Length of the argument */
+} REPLAY_COMMAND;
+
+/** The kinds of commands whose latencies are reported */
+typedef enum
+{
+    REPLAY_CONNECT,
+    REPLAY_QUERY,
+    REPLAY_INIT_DB,
+    REPLAY_N_KINDS
+} replay_kind_t;
+
+static const char *kind_names[REPLAY_N_KINDS] = {"connect", "query", "init_db"};
+
+/**
+ * A captured session and the results of its replay
+ */
+typedef struct
+{
+    REPLAY_COMMAND *cmds;                   /*< The commands of the session */
+    int            n_cmds;                  /*< The number of commands */
+    uint32_t       *latency;                /*< The latency of each command in microseconds */
+    uint64_t       lag;                     /*< The most a command was sent late, microseconds */
+    int            errors;                  /*< Commands that failed */
+} REPLAY_SESSION;
+
+static const char *host = "127.0.0.1";
+static int port = 3306;
+static const char *user = NULL;
+static const char *password = "";
+static double speed = 1.0;
+
+static uint64_t capture_start;              /*< When the first command was captured */
+static uint64_t replay_start;               /*< When the replay started */
+
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int running = 0;                     /*< Sessions being replayed */
+
+static REPLAY_COMMAND *commands = NULL;
+static size_t n_commands = 0;
+static size_t commands_size = 0;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+/**
+ * Wait until a captured time comes in the replay
+ *
+ * @param usec  The captured time
+ * @return How late the time was already, in microseconds
+ */
+static uint64_t wait_until(uint64_t usec)
+{
+    if (speed <= 0)
+    {
+        return 0;
+    }
+
+    uint64_t due = replay_start + (uint64_t)((usec - capture_start) / speed);
+    uint64_t t = now();
+
+    if (t >= due)
+    {
+        return t - due;
+    }
+
+    struct timespec ts = {(due - t) / 1000000, (due - t) % 1000000 * 1000};
+    nanosleep(&ts, NULL);
+    return 0;
+}
+
+/**
+ * Read the commands of a capture file
+ *
+ * @param name The file
+ * @return True if the file was read
+ */
+static bool read_file(const char *name)
+{
+    FILE *file = fopen(name, "rb");
+    uint8_t header[QLA_BINARY_HEADER_LEN];
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "Failed to open file '%s'.\n", name);
+        return false;
+    }
+
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+        memcmp(header, QLA_BINARY_MAGIC, QLA_BINARY_MAGIC_LEN) != 0 ||
+        header[QLA_BINARY_MAGIC_LEN] != QLA_CAPTURE_VERSION)
+    {
+        fprintf(stderr, "%s: Not a capture of the qlafilter.\n", name);
+        fclose(file);
+        return false;
+    }
+
+    uint8_t fixed[QLA_RECORD_HEADER_LEN];
+    bool rval = true;
+    size_t n;
+
+    while ((n = fread(fixed, 1, sizeof(fixed), file)) == sizeof(fixed))
+    {
+        uint64_t len = qla_get_uint(fixed + QLA_RECORD_LEN_OFFSET, 4);
+        int user_len = qla_get_uint(fixed + QLA_RECORD_USER_LEN_OFFSET, 2);
+        int remote_len = qla_get_uint(fixed + QLA_RECORD_REMOTE_LEN_OFFSET, 2);
+        uint64_t cmd_len = qla_get_uint(fixed + QLA_RECORD_SQL_LEN_OFFSET, 4);
+        char *data;
+
+        if (len != QLA_RECORD_HEADER_LEN + user_len + remote_len + cmd_len || cmd_len == 0)
+        {
+            fprintf(stderr, "%s: Corrupted record at offset %ld.\n", name,
+                    ftell(file) - QLA_RECORD_HEADER_LEN);
+            rval = false;
+            break;
+        }
+
+        len -= QLA_RECORD_HEADER_LEN;
+
+        if (n_commands == commands_size)
+        {
+            size_t size = commands_size ? commands_size * 2 : 4096;
+            REPLAY_COMMAND *tmp = realloc(commands, size * sizeof(REPLAY_COMMAND));
+
+            if (tmp == NULL)
+            {
+                fprintf(stderr, "Memory allocation failed.\n");
+                rval = false;
+                break;
+            }
+
+            commands = tmp;
+            commands_size = size;
+        }
+
+        /** The user and the argument are NUL terminated in place of the remote and the command */
+        if ((data = malloc(len + 1)) == NULL || fread(data, 1, len, file) != len)
+        {
+            fprintf(stderr, "%s: Truncated record at the end of the file.\n", name);
+            free(data);
+            rval = false;
+            break;
+        }
+
+        REPLAY_COMMAND *cmd = &commands[n_commands];
+
+        cmd->ses_id = qla_get_uint(fixed + QLA_RECORD_SESSION_OFFSET, 4);
+        cmd->usec = qla_get_uint(fixed + QLA_RECORD_TIME_OFFSET, 8);
+        cmd->seq = n_commands++;
+        cmd->command = data[user_len + remote_len];
+        cmd->user = data;
+        cmd->user[user_len] = '\0';
+        cmd->arg = data + user_len + remote_len + 1;
+        cmd->arg_len = cmd_len - 1;
+        cmd->arg[cmd->arg_len] = '\0';
+    }
+
+    if (rval && n != 0)
+    {
+        fprintf(stderr, "%s: Truncated record at the end of the file.\n", name);
+        rval = false;
+    }
+
+    fclose(file);
+    return rval;
+}
+
+/** Order the commands by session and by time within a session */
+static int compare_commands(const void *a, const void *b)
+{
+    const REPLAY_COMMAND *c1 = a;
+    const REPLAY_COMMAND *c2 = b;
+
+    if (c1->ses_id != c2->ses_id)
+    {
+        return c1->ses_id < c2->ses_id ? -1 : 1;
+    }
+    if (c1->usec != c2->usec)
+    {
+        return c1->usec < c2->usec ? -1 : 1;
+    }
+    return c1->seq < c2->seq ? -1 : c1->seq > c2->seq;
+}
+
+/** Order the sessions by the time of their first command */
+static int compare_sessions(const void *a, const void *b)
+{
+    const REPLAY_SESSION *s1 = a;
+    const REPLAY_SESSION *s2 = b;
+
+    if (s1->cmds[0].usec != s2->cmds[0].usec)
+    {
+        return s1->cmds[0].usec < s2->cmds[0].usec ? -1 : 1;
+    }
+    return s1->cmds[0].seq < s2->cmds[0].seq ? -1 : 1;
+}
+
+/**
+ * Send a query and read all of its results
+ *
+ * @param conn  The connection
+ * @param cmd   The command
+ * @return True if the query succeeded
+ */
+static bool run_query(MYSQL *conn, REPLAY_COMMAND *cmd)
+{
+    if (mysql_real_query(conn, cmd->arg, cmd->arg_len) != 0)
+    {
+        return false;
+    }
+
+    int rc;
+
+    do
+    {
+        MYSQL_RES *res = mysql_store_result(conn);
+
+        if (res)
+        {
+            mysql_free_result(res);
+        }
+        else if (mysql_field_count(conn) != 0)
+        {
+            return false;
+        }
+    }
+    while ((rc = mysql_next_result(conn)) == 0);
+
+    return rc == -1;
+}
+
+/**
+ * Replay a session. A session without a connect record, whose start was not
+ * captured, connects without a default database.
+ *
+ * @param data The session
+ */
+static void *replay_session(void *data)
+{
+    REPLAY_SESSION *ses = (REPLAY_SESSION *)data;
+    MYSQL *conn = NULL;
+    int i = 0;
+
+    mysql_thread_init();
+
+    if ((conn = mysql_init(NULL)) != NULL)
+    {
+        REPLAY_COMMAND *cmd = &ses->cmds[0];
+        const char *db = cmd->command == QLA_COM_CONNECT && cmd->arg_len ? cmd->arg : NULL;
+        uint64_t lag = wait_until(cmd->usec);
+        uint64_t start = now();
+
+        ses->lag = lag;
+
+        if (mysql_real_connect(conn, host, user ? user : cmd->user, password, db, port,
+                               NULL, CLIENT_MULTI_STATEMENTS) == NULL)
+        {
+            fprintf(stderr, "Session %u: failed to connect: %s\n", cmd->ses_id, mysql_error(conn));
+            ses->errors++;
+            ses->n_cmds = 0;
+        }
+        else if (cmd->command == QLA_COM_CONNECT)
+        {
+            ses->latency[0] = now() - start;
+        }
+
+        i = cmd->command == QLA_COM_CONNECT ? 1 : 0;
+    }
+
+    for (; conn && i < ses->n_cmds; i++)
+    {
+        REPLAY_COMMAND *cmd = &ses->cmds[i];
+        uint64_t lag = wait_until(cmd->usec);
+        uint64_t start = now();
+        bool ok = true;
+
+        if (lag > ses->lag)
+        {
+            ses->lag = lag;
+        }
+
+        switch (cmd->command)
+        {
+            case MYSQL_COM_QUERY:
+                ok = run_query(conn, cmd);
+                break;
+
+            case MYSQL_COM_INIT_DB:
+                ok = mysql_select_db(conn, cmd->arg) == 0;
+                break;
+
+            case MYSQL_COM_QUIT:
+                i = ses->n_cmds;
+                continue;
+
+            default:
+                continue;
+        }
+
+        ses->latency[i] = now() - start;
+
+        if (!ok)
+        {
+            ses->errors++;
+        }
+    }
+
+    if (conn)
+    {
+        mysql_close(conn);
+    }
+
+    mysql_thread_end();
+
+    pthread_mutex_lock(&done_lock);
+    running--;
+    pthread_cond_signal(&done_cond);
+    pthread_mutex_unlock(&done_lock);
+    return NULL;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Print the latency distribution of a kind of command
+ *
+ * @param kind      The kind
+ * @param lat       The latencies, sorted in place
+ * @param n         The number of latencies
+ */
+static void report(replay_kind_t kind, uint32_t *lat, size_t n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+
+    uint64_t sum = 0;
+
+    qsort(lat, n, sizeof(*lat), compare_u32);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += lat[i];
+    }
+
+    printf("%-8s %10lu %10.0f %10u %10u %10u %10u %10u\n", kind_names[kind], n,
+           (double)sum / n, lat[n / 2], lat[n * 90 / 100], lat[n * 99 / 100],
+           lat[n * 999 / 1000], lat[n - 1]);
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "h:P:u:p:s:")) >= 0)
+    {
+        switch (c)
+        {
+            case 'h':
+                host = optarg;
+                break;
+
+            case 'P':
+                port = atoi(optarg);
+                break;
+
+            case 'u':
+                user = optarg;
+                break;
+
+            case 'p':
+                password = optarg;
+                break;
+
+            case 's':
+                speed = atof(optarg);
+                break;
+
+            default:
+                printf("Usage: %s [-h HOST] [-P PORT] [-u USER] [-p PASSWORD] [-s SPEED] FILE...\n",
+                       argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind == argc)
+    {
+        printf("No capture files given.\n");
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++)
+    {
+        if (!read_file(argv[i]))
+        {
+            return 1;
+        }
+    }
+
+    if (n_commands == 0)
+    {
+        printf("The capture is empty.\n");
+        return 0;
+    }
+
+    qsort(commands, n_commands, sizeof(REPLAY_COMMAND), compare_commands);
+
+    size_t n_sessions = 0;
+
+    for (size_t i = 0; i < n_commands; i++)
+    {
+        if (i == 0 || commands[i].ses_id != commands[i - 1].ses_id)
+        {
+            n_sessions++;
+        }
+    }
+
+    REPLAY_SESSION *sessions = calloc(n_sessions, sizeof(REPLAY_SESSION));
+    uint32_t *latencies = calloc(n_commands, sizeof(uint32_t));
+
+    if (sessions == NULL || latencies == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 1;
+    }
+
+    capture_start = commands[0].usec;
+
+    for (size_t i = 0, s = 0; i < n_commands; i++)
+    {
+        if (i > 0 && commands[i].ses_id != commands[i - 1].ses_id)
+        {
+            s++;
+        }
+        if (sessions[s].cmds == NULL)
+        {
+            sessions[s].cmds = &commands[i];
+            sessions[s].latency = &latencies[i];
+        }
+        sessions[s].n_cmds++;
+
+        if (commands[i].usec < capture_start)
+        {
+            capture_start = commands[i].usec;
+        }
+    }
+
+    qsort(sessions, n_sessions, sizeof(REPLAY_SESSION), compare_sessions);
+
+    printf("Replaying %lu sessions with %lu commands to %s:%d at %.2fx speed.\n",
+           n_sessions, n_commands, host, port, speed);
+
+    if (mysql_library_init(0, NULL, NULL))
+    {
+        fprintf(stderr, "Failed to initialize the MySQL client library.\n");
+        return 1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, REPLAY_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    replay_start = now();
+
+    for (size_t i = 0; i < n_sessions; i++)
+    {
+        pthread_t thr;
+
+        wait_until(sessions[i].cmds[0].usec);
+
+        pthread_mutex_lock(&done_lock);
+        running++;
+        pthread_mutex_unlock(&done_lock);
+
+        if (pthread_create(&thr, &attr, replay_session, &sessions[i]) != 0)
+        {
+            fprintf(stderr, "Failed to start the thread of session %u.\n", sessions[i].cmds[0].ses_id);
+            sessions[i].errors++;
+            sessions[i].n_cmds = 0;
+            pthread_mutex_lock(&done_lock);
+            running--;
+            pthread_mutex_unlock(&done_lock);
+        }
+    }
+
+    pthread_mutex_lock(&done_lock);
+    while (running > 0)
+    {
+        pthread_cond_wait(&done_cond, &done_lock);
+    }
+    pthread_mutex_unlock(&done_lock);
+
+    double secs = (now() - replay_start) / 1000000.0;
+    uint32_t *lat[REPLAY_N_KINDS];
+    size_t n_lat[REPLAY_N_KINDS] = {0};
+    uint64_t max_lag = 0;
+    int errors = 0;
+
+    for (int k = 0; k < REPLAY_N_KINDS; k++)
+    {
+        lat[k] = malloc(n_commands * sizeof(uint32_t));
+    }
+
+    for (size_t i = 0; i < n_sessions; i++)
+    {
+        REPLAY_SESSION *ses = &sessions[i];
+
+        errors += ses->errors;
+        max_lag = ses->lag > max_lag ? ses->lag : max_lag;
+
+        for (int j = 0; j < ses->n_cmds; j++)
+        {
+            replay_kind_t kind = ses->cmds[j].command == QLA_COM_CONNECT ? REPLAY_CONNECT :
+                                  ses->cmds[j].command == MYSQL_COM_QUERY ? REPLAY_QUERY :
+                                  ses->cmds[j].command == MYSQL_COM_INIT_DB ? REPLAY_INIT_DB : REPLAY_N_KINDS;
+
+            if (kind != REPLAY_N_KINDS && lat[kind])
+            {
+                lat[kind][n_lat[kind]++] = ses->latency[j];
+            }
+        }
+    }
+
+    printf("Replayed in %.3f seconds, %d errors, commands sent at most %.3f seconds late.\n\n",
+           secs, errors, max_lag / 1000000.0);
+    printf("Latencies in microseconds:\n");
+    printf("%-8s %10s %10s %10s %10s %10s %10s %10s\n", "Command", "Count", "Mean",
+           "50%", "90%", "99%", "99.9%", "Max");
+
+    for (int k = 0; k < REPLAY_N_KINDS; k++)
+    {
+        if (lat[k])
+        {
+            report(k, lat[k], n_lat[k]);
+            free(lat[k]);
+        }
+    }
+
+    mysql_library_end();
+    return errors ? 1 : 0;
+}
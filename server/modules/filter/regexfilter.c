@@ -11,7 +11,6 @@
  * Public License.
  */
 
-#define PCRE2_CODE_UNIT_WIDTH 8
 #include <stdio.h>
 #include <filter.h>
 #include <modinfo.h>
@@ -19,7 +18,7 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <string.h>
-#include <pcre2.h>
+#include <maxscale_pcre2.h>
 #include <atomic.h>
 #include "maxconfig.h"
 
@@ -37,6 +36,7 @@
  *
  * Date         Who             Description
  * 19/06/2014   Mark Riddoch    Addition of source and user parameters
+ * 15/10/2016   Core Team       JIT compiled pattern matched with per-thread data
  * @endverbatim
  */
 
@@ -57,8 +57,9 @@ static void freeSession(FILTER *instance, void *session);
 static void setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static uint64_t getInterest(FILTER *instance);
 
-static char *regex_replace(const char *sql, pcre2_code *re, pcre2_match_data *study,
+static char *regex_replace(const char *sql, MXS_PCRE2_PATTERN *re,
                            const char *replace);
 
 static FILTER_OBJECT MyObject =
@@ -72,6 +73,7 @@ static FILTER_OBJECT MyObject =
     routeQuery,
     NULL,
     diagnostic,
+    getInterest,
 };
 
 /**
@@ -83,8 +85,7 @@ typedef struct
     char *user; /*< User name to restrict matches */
     char *match; /*< Regular expression to match */
     char *replace; /*< Replacement text */
-    pcre2_code *re; /*< Compiled regex text */
-    pcre2_match_data *match_data; /*< Matching data used by the compiled regex */
+    MXS_PCRE2_PATTERN *re; /*< Compiled regex text */
     FILE* logfile; /*< Log file */
     bool log_trace; /*< Whether messages should be printed to tracelog */
 } REGEX_INSTANCE;
@@ -149,16 +150,7 @@ void free_instance(REGEX_INSTANCE *instance)
 {
     if (instance)
     {
-        if (instance->re)
-        {
-            pcre2_code_free(instance->re);
-        }
-
-        if (instance->match_data)
-        {
-            pcre2_match_data_free(instance->match_data);
-        }
-
+        mxs_pcre2_pattern_free(instance->re);
         free(instance->match);
         free(instance->replace);
         free(instance->source);
@@ -268,29 +260,20 @@ createInstance(char **options, FILTER_PARAMETER **params)
             return NULL;
         }
 
-        if ((my_instance->re = pcre2_compile((PCRE2_SPTR) my_instance->match,
-                                             PCRE2_ZERO_TERMINATED,
-                                             cflags,
-                                             &errnumber,
-                                             &erroffset,
-                                             NULL)) == NULL)
+        if ((my_instance->re = mxs_pcre2_pattern_compile(my_instance->match, cflags,
+                                                         &errnumber, &erroffset)) == NULL)
         {
-            char errbuffer[1024];
-            pcre2_get_error_message(errnumber, (PCRE2_UCHAR*) & errbuffer, sizeof(errbuffer));
+            char errbuffer[1024] = "Out of memory";
+
+            if (errnumber)
+            {
+                pcre2_get_error_message(errnumber, (PCRE2_UCHAR*) & errbuffer, sizeof(errbuffer));
+            }
             MXS_ERROR("regexfilter: Compiling regular expression '%s' failed at %lu: %s",
                       my_instance->match, erroffset, errbuffer);
             free_instance(my_instance);
             return NULL;
         }
-
-        if ((my_instance->match_data =
-                 pcre2_match_data_create_from_pattern(my_instance->re, NULL)) == NULL)
-        {
-            MXS_ERROR("regexfilter: Failure to create PCRE2 matching data. "
-                      "This is most likely caused by a lack of available memory.");
-            free_instance(my_instance);
-            return NULL;
-        }
     }
     return (FILTER *) my_instance;
 }
@@ -399,7 +382,6 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
         {
             newsql = regex_replace(sql,
                                    my_instance->re,
-                                   my_instance->match_data,
                                    my_instance->replace);
             if (newsql)
             {
@@ -445,6 +427,8 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
 
     dcb_printf(dcb, "\t\tSearch and replace:            s/%s/%s/\n",
                my_instance->match, my_instance->replace);
+    dcb_printf(dcb, "\t\tJIT compiled:                  %s\n",
+               my_instance->re->jit ? "yes" : "no");
     if (my_session)
     {
         dcb_printf(dcb, "\t\tNo. of queries unaltered by filter:    %d\n",
@@ -469,27 +453,30 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
 /**
  * Perform a regular expression match and substitution on the SQL
  *
+ * The matching data of the calling thread is used, so the pattern can be
+ * matched by all threads at the same time.
+ *
  * @param   sql The original SQL text
  * @param   re  The compiled regular expression
- * @param   match_data The PCRE2 matching data buffer
  * @param   replace The replacement text
  * @return  The replaced text or NULL if no replacement was done.
  */
 static char *
-regex_replace(const char *sql, pcre2_code *re, pcre2_match_data *match_data, const char *replace)
+regex_replace(const char *sql, MXS_PCRE2_PATTERN *re, const char *replace)
 {
     char *result = NULL;
     size_t result_size;
 
-    /** This should never fail with rc == 0 because we used pcre2_match_data_create_from_pattern() */
-    if (pcre2_match(re, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED, 0, 0, match_data, NULL) > 0)
+    if (mxs_pcre2_pattern_match(re, sql, strlen(sql)) == MXS_PCRE2_MATCH)
     {
+        pcre2_match_data *match_data = mxs_pcre2_thread_match_data(re->code);
         result_size = strlen(sql) + strlen(replace);
         result = malloc(result_size);
 
         while (result &&
-               pcre2_substitute(re, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED, 0,
-                                PCRE2_SUBSTITUTE_GLOBAL, match_data, NULL,
+               pcre2_substitute(re->code, (PCRE2_SPTR) sql, PCRE2_ZERO_TERMINATED, 0,
+                                PCRE2_SUBSTITUTE_GLOBAL, match_data,
+                                mxs_pcre2_thread_match_context(),
                                 (PCRE2_SPTR) replace, PCRE2_ZERO_TERMINATED,
                                 (PCRE2_UCHAR*) result, (PCRE2_SIZE*) & result_size) == PCRE2_ERROR_NOMEMORY)
         {
@@ -544,3 +531,16 @@ void log_nomatch(REGEX_INSTANCE* inst, char* re, char* old)
         MXS_INFO("No match %s: [%s]", re, old);
     }
 }
+
+/**
+ * Return the packets the filter is interested in. Only the SQL of COM_QUERY
+ * packets is rewritten.
+ *
+ * @param instance      The filter instance
+ * @return The interest mask of the filter
+ */
+static uint64_t
+getInterest(FILTER *instance)
+{
+    return FILTER_INTEREST_COMMAND(0x03);
+}
@@ -29,6 +29,10 @@
  *          of the request (optional)
  * user     A user name to match against. If present only requests that
  *          originate from this user will be duplciated (optional)
+ * async    Don't wait for the branch to reply before replying to the
+ *          client (optional)
+ * async_queue_size  Maximum number of statements queued for the branch
+ *          of a session in async mode (optional)
  *
  * Revision History
  * ================
@@ -37,6 +41,8 @@
  * 20/06/2014   Mark Riddoch    Initial implementation
  * 24/06/2014   Mark Riddoch    Addition of support for multi-packet queries
  * 12/12/2014   Mark Riddoch    Add support for otehr packet types
+ * 15/10/2016   Core Team       Asynchronous branch with a bounded queue
+ * 15/10/2016   Core Team       Replies are scanned without joining the buffers
  *
  * @endverbatim
  */
@@ -58,6 +64,7 @@
 #include <maxscale/poll.h>
 #include <mysql_client_server_protocol.h>
 #include <housekeeper.h>
+#include <atomic.h>
 
 #define MYSQL_COM_QUIT                  0x01
 #define MYSQL_COM_INITDB                0x02
@@ -70,6 +77,9 @@
 #define MYSQL_COM_STMT_RESET            0x1a
 #define MYSQL_COM_CONNECT               0x1b
 
+/** Default maximum number of statements queued for the branch in async mode */
+#define TEE_ASYNC_QUEUE_SIZE            1000
+
 #define REPLY_TIMEOUT_SECOND            5
 #define REPLY_TIMEOUT_MILLISECOND       1
 #define PARENT                          0
@@ -142,6 +152,9 @@ typedef struct
     regex_t re; /* Compiled regex text */
     char *nomatch; /* Optional text to match against for exclusion */
     regex_t nore; /* Compiled regex nomatch text */
+    bool async; /* Don't wait for the branch before replying to the client */
+    int async_queue_size; /* Maximum number of statements queued for a branch */
+    int n_dropped; /* Number of statements dropped because a queue was full */
 } TEE_INSTANCE;
 
 /**
@@ -175,6 +188,12 @@ typedef struct
     GWBUF* tee_replybuf; /* Buffer for reply */
     GWBUF* tee_partials[2];
     GWBUF* queue;
+    GWBUF* branch_queue; /* Statements waiting for the branch in async mode */
+    int branch_queued; /* Number of statements in branch_queue */
+    unsigned char branch_command; /* The command the branch is replying to */
+    int branch_eofs; /* EOF packets that end the current branch result */
+    MODUTIL_PACKET_SCAN branch_scan; /* Scan of the branch replies in async mode */
+    int n_dropped; /* Number of statements dropped because branch_queue was full */
     SPINLOCK tee_lock;
     DCB* client_dcb;
 
@@ -208,6 +227,8 @@ int route_single_query(TEE_INSTANCE* my_instance,
                        GWBUF* clone);
 int reset_session_state(TEE_SESSION* my_session, GWBUF* buffer);
 void create_orphan(SESSION* ses);
+static int route_async_query(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* queue);
+static int async_reply(TEE_SESSION* my_session, int branch, GWBUF* reply);
 
 static void
 orphan_free(void* data)
@@ -370,6 +391,8 @@ createInstance(char **options, FILTER_PARAMETER **params)
         my_instance->userName = NULL;
         my_instance->match = NULL;
         my_instance->nomatch = NULL;
+        my_instance->async = false;
+        my_instance->async_queue_size = TEE_ASYNC_QUEUE_SIZE;
         if (params)
         {
             for (i = 0; params[i]; i++)
@@ -398,6 +421,22 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 {
                     my_instance->userName = strdup(params[i]->value);
                 }
+                else if (!strcmp(params[i]->name, "async"))
+                {
+                    my_instance->async = config_truth_value(params[i]->value);
+                }
+                else if (!strcmp(params[i]->name, "async_queue_size"))
+                {
+                    my_instance->async_queue_size = atoi(params[i]->value);
+
+                    if (my_instance->async_queue_size <= 0)
+                    {
+                        MXS_ERROR("tee: Invalid value for async_queue_size: %s. "
+                                  "Using default value of %d.", params[i]->value,
+                                  TEE_ASYNC_QUEUE_SIZE);
+                        my_instance->async_queue_size = TEE_ASYNC_QUEUE_SIZE;
+                    }
+                }
                 else if (!filter_standard_parameter(params[i]->name))
                 {
                     MXS_ERROR("tee: Unexpected parameter '%s'.",
@@ -517,6 +556,7 @@ newSession(FILTER *instance, SESSION *session)
         my_session->instance = my_instance;
         my_session->client_multistatement = false;
         my_session->queue = NULL;
+        modutil_scan_init(&my_session->branch_scan);
         spinlock_init(&my_session->tee_lock);
         if (my_instance->source &&
             (remote = session_get_remote(session)) != NULL)
@@ -724,6 +764,10 @@ freeSession(FILTER *instance, void *session)
     {
         gwbuf_free(my_session->tee_replybuf);
     }
+    gwbuf_free(my_session->queue);
+    gwbuf_free(my_session->branch_queue);
+    gwbuf_free(my_session->tee_partials[PARENT]);
+    gwbuf_free(my_session->tee_partials[CHILD]);
     free(session);
 
     orphan_free(NULL);
@@ -808,6 +852,13 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
         return 0;
     }
 
+    if (my_instance->async)
+    {
+        rval = route_async_query(my_instance, my_session, queue);
+        spinlock_release(&my_session->tee_lock);
+        return rval;
+    }
+
     if (my_session->queue)
     {
         my_session->queue = gwbuf_append(my_session->queue, queue);
@@ -842,40 +893,49 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
     return rval;
 }
 
-int count_replies(GWBUF* buffer)
+/** The state of count_replies */
+typedef struct
 {
-    unsigned char* ptr = (unsigned char*) buffer->start;
-    unsigned char* end = (unsigned char*) buffer->end;
-    int pktlen, eof = 0;
-    int replies = 0;
-    while (ptr < end)
-    {
-        pktlen = MYSQL_GET_PACKET_LEN(ptr) + 4;
-        if (PTR_IS_OK(ptr) || PTR_IS_ERR(ptr) || PTR_IS_LOCAL_INFILE(ptr))
+    MODUTIL_PACKET_SCAN scan;   /*< The scan of the buffer */
+    int                 eof;    /*< EOF or ERR packets of the current result set */
+    int                 replies; /*< Complete replies */
+} reply_count_t;
+
+static bool count_reply_packet(void *data, uint8_t *header, size_t pktlen)
+{
+    reply_count_t *count = (reply_count_t*)data;
+
+    if (count->scan.all_packets)
+    {
+        /** The first packet of a reply tells the result sets from the rest */
+        if (PTR_IS_OK(header) || PTR_IS_ERR(header) || PTR_IS_LOCAL_INFILE(header))
         {
-            replies++;
-            ptr += pktlen;
+            count->replies++;
         }
         else
         {
-            while (ptr < end && eof < 2)
-            {
-                pktlen = MYSQL_GET_PACKET_LEN(ptr) + 4;
-                if (PTR_IS_EOF(ptr) || PTR_IS_ERR(ptr))
-                {
-                    eof++;
-                }
-                ptr += pktlen;
-            }
-            if (eof == 2)
-            {
-                replies++;
-            }
-            eof = 0;
+            count->scan.all_packets = false;
         }
     }
+    else if ((PTR_IS_EOF(header) || PTR_IS_ERR(header)) && ++count->eof == 2)
+    {
+        count->replies++;
+        count->eof = 0;
+        count->scan.all_packets = true;
+    }
 
-    return replies;
+    return true;
+}
+
+int count_replies(GWBUF* buffer)
+{
+    reply_count_t count = {.eof = 0, .replies = 0};
+
+    modutil_scan_init(&count.scan);
+    count.scan.all_packets = true;
+    modutil_scan_packets(&count.scan, buffer, count_reply_packet, &count);
+
+    return count.replies;
 }
 
 int lenenc_length(uint8_t* ptr)
@@ -941,6 +1001,7 @@ clientReply(FILTER* instance, void *session, GWBUF *reply)
     bool route = true;
     GWBUF *complete = NULL;
     unsigned char *ptr;
+    uint8_t first[MODUTIL_SCAN_HEADER_LEN];
     uint16_t flags = 0;
     int more_results = 0;
 
@@ -957,8 +1018,12 @@ clientReply(FILTER* instance, void *session, GWBUF *reply)
 
     branch = instance == NULL ? CHILD : PARENT;
 
+    if (my_session->instance->async)
+    {
+        return async_reply(my_session, branch, reply);
+    }
+
     my_session->tee_partials[branch] = gwbuf_append(my_session->tee_partials[branch], reply);
-    my_session->tee_partials[branch] = gwbuf_make_contiguous(my_session->tee_partials[branch]);
     complete = modutil_get_complete_packets(&my_session->tee_partials[branch]);
 
     if (complete == NULL)
@@ -970,8 +1035,10 @@ clientReply(FILTER* instance, void *session, GWBUF *reply)
         return 1;
     }
 
-    complete = gwbuf_make_contiguous(complete);
-    ptr = (unsigned char*) complete->start;
+    /** Only the start of the first packet is inspected, the reply is not joined */
+    memset(first, 0, sizeof(first));
+    gwbuf_copy_data(complete, 0, sizeof(first), first);
+    ptr = first;
 
     if (my_session->replies[branch] == 0)
     {
@@ -1111,12 +1178,26 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         dcb_printf(dcb, "\t\tExclude queries that match		%s\n",
                    my_instance->nomatch);
     }
+    if (my_instance->async)
+    {
+        dcb_printf(dcb, "\t\tAsynchronous branch queue size		%d\n",
+                   my_instance->async_queue_size);
+        dcb_printf(dcb, "\t\tNo. of statements dropped:	%d.\n",
+                   my_instance->n_dropped);
+    }
     if (my_session)
     {
         dcb_printf(dcb, "\t\tNo. of statements duplicated:	%d.\n",
                    my_session->n_duped);
         dcb_printf(dcb, "\t\tNo. of statements rejected:	%d.\n",
                    my_session->n_rejected);
+        if (my_instance->async)
+        {
+            dcb_printf(dcb, "\t\tNo. of statements queued:	%d.\n",
+                       my_session->branch_queued);
+            dcb_printf(dcb, "\t\tNo. of statements dropped:	%d.\n",
+                       my_session->n_dropped);
+        }
     }
 }
 
@@ -1313,6 +1394,27 @@ int route_single_query(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF
     return rval;
 }
 
+/**
+ * Check if the reply to a command can consist of multiple packets
+ * @param command The command byte of the query
+ * @return True if the reply can be a result set
+ */
+static bool command_is_multipacket(unsigned char command)
+{
+    switch (command)
+    {
+        case 0x1b:
+        case 0x03:
+        case 0x16:
+        case 0x17:
+        case 0x04:
+        case 0x0a:
+            return true;
+        default:
+            return false;
+    }
+}
+
 /**
  * Reset the session's internal counters.
  * @param my_session Tee session
@@ -1328,24 +1430,15 @@ int reset_session_state(TEE_SESSION* my_session, GWBUF* buffer)
 
     unsigned char command = *((unsigned char*) buffer->start + 4);
 
-    switch (command)
+    if (command == 0x1b)
     {
-        case 0x1b:
-            my_session->client_multistatement = *((unsigned char*) buffer->start + 5);
-            MXS_INFO("tee: client %s multistatements",
-                     my_session->client_multistatement ? "enabled" : "disabled");
-        case 0x03:
-        case 0x16:
-        case 0x17:
-        case 0x04:
-        case 0x0a:
-            memset(my_session->multipacket, (char) true, 2 * sizeof(bool));
-            break;
-        default:
-            memset(my_session->multipacket, (char) false, 2 * sizeof(bool));
-            break;
+        my_session->client_multistatement = *((unsigned char*) buffer->start + 5);
+        MXS_INFO("tee: client %s multistatements",
+                 my_session->client_multistatement ? "enabled" : "disabled");
     }
 
+    memset(my_session->multipacket, (char) command_is_multipacket(command), 2 * sizeof(bool));
+
     memset(my_session->replies, 0, 2 * sizeof(int));
     memset(my_session->reply_packets, 0, 2 * sizeof(int));
     memset(my_session->eof, 0, 2 * sizeof(int));
@@ -1373,3 +1466,202 @@ void create_orphan(SESSION* ses)
         spinlock_release(&orphanLock);
     }
 }
+
+/**
+ * Check if the server replies to a command
+ * @param command The command byte of the query
+ * @return False for the commands that the server never replies to
+ */
+static bool command_has_reply(unsigned char command)
+{
+    return command != MYSQL_COM_QUIT &&
+           command != MYSQL_COM_STMT_SEND_LONG_DATA &&
+           command != MYSQL_COM_STMT_CLOSE;
+}
+
+/**
+ * Route the queued statements to the branch session in async mode. A statement
+ * is routed only after the branch has replied to the previous one. The caller
+ * must hold the tee_lock.
+ * @param my_session Tee session
+ */
+static void route_branch_queue(TEE_SESSION* my_session)
+{
+    GWBUF* clone;
+
+    while (!my_session->waiting[CHILD] && my_session->branch_queue &&
+           (clone = modutil_get_next_MySQL_packet(&my_session->branch_queue)))
+    {
+        my_session->branch_queued--;
+
+        if (my_session->branch_session == NULL ||
+            my_session->branch_session->state != SESSION_STATE_ROUTER_READY)
+        {
+            /** The branch is gone, the client session is not affected */
+            gwbuf_free(clone);
+            continue;
+        }
+
+        my_session->branch_command = GWBUF_LENGTH(clone) > 4 ?
+                                     ((uint8_t*) GWBUF_DATA(clone))[4] : 0;
+        my_session->waiting[CHILD] = command_has_reply(my_session->branch_command);
+        my_session->replies[CHILD] = 0;
+        my_session->eof[CHILD] = 0;
+        my_session->n_duped++;
+        SESSION_ROUTE_QUERY(my_session->branch_session, clone);
+    }
+}
+
+/**
+ * Route a query in async mode. The query is routed downstream immediately and
+ * its clone is queued for the branch session. If the queue of the branch is
+ * full, the clone is dropped unless it is needed to keep the state of the
+ * branch session consistent. The caller must hold the tee_lock.
+ * @param my_instance Tee instance
+ * @param my_session Tee session
+ * @param queue The query data
+ * @return 1 on success, 0 on failure
+ */
+static int route_async_query(TEE_INSTANCE* my_instance, TEE_SESSION* my_session, GWBUF* queue)
+{
+    GWBUF* buffer;
+    int rval = 1;
+
+    my_session->queue = gwbuf_append(my_session->queue, queue);
+
+    while (rval && (buffer = modutil_get_next_MySQL_packet(&my_session->queue)))
+    {
+        GWBUF* clone = clone_query(my_instance, my_session, buffer);
+
+        if (clone == NULL)
+        {
+            my_session->n_rejected++;
+        }
+        else if (my_session->branch_queued >= my_instance->async_queue_size &&
+                 !packet_is_required(clone))
+        {
+            gwbuf_free(clone);
+            my_session->n_dropped++;
+            atomic_add(&my_instance->n_dropped, 1);
+        }
+        else
+        {
+            my_session->branch_queue = gwbuf_append(my_session->branch_queue, clone);
+            my_session->branch_queued++;
+        }
+
+        rval = my_session->down.routeQuery(my_session->down.instance,
+                                           my_session->down.session,
+                                           buffer);
+    }
+
+    route_branch_queue(my_session);
+    return rval;
+}
+
+/**
+ * Process one reply packet of the branch in async mode. Only the first packet
+ * of a result and the packets that can be EOF or ERR packets are processed.
+ * @param my_session Tee session
+ * @param ptr Start of the packet, MODUTIL_SCAN_HEADER_LEN bytes
+ */
+static void process_branch_packet(TEE_SESSION* my_session, uint8_t* ptr)
+{
+    bool first = my_session->replies[CHILD]++ == 0;
+    bool done = false;
+    bool more = false;
+
+    if (first)
+    {
+        my_session->branch_eofs = my_session->branch_command == MYSQL_COM_FIELD_LIST ? 1 : 2;
+    }
+
+    if (first && my_session->branch_command == MYSQL_COM_STMT_PREPARE && PTR_IS_OK(ptr))
+    {
+        /** The columns and the parameters are both followed by an EOF packet */
+        my_session->branch_eofs = (MYSQL_GET_STMTOK_NPARAM(ptr) > 0) +
+                                  (MYSQL_GET_STMTOK_NATTR(ptr) > 0);
+        done = my_session->branch_eofs == 0;
+    }
+    else if (PTR_IS_ERR(ptr) ||
+             (first && (PTR_IS_EOF(ptr) || PTR_IS_LOCAL_INFILE(ptr) ||
+                        !command_is_multipacket(my_session->branch_command))))
+    {
+        done = true;
+    }
+    else if (first && PTR_IS_OK(ptr))
+    {
+        /** The status follows the affected rows and the insert ID */
+        uint8_t* status = ptr + 5;
+        status += lenenc_length(status);
+        status += lenenc_length(status);
+        done = true;
+        more = gw_mysql_get_byte2(status) & SERVER_MORE_RESULTS_EXIST;
+    }
+    else if (PTR_IS_EOF(ptr) && ++my_session->eof[CHILD] >= my_session->branch_eofs)
+    {
+        done = true;
+        more = PTR_EOF_MORE_RESULTS(ptr);
+    }
+
+    if (done)
+    {
+        /** The next result of a multi-statement query starts with a new packet */
+        my_session->waiting[CHILD] = more;
+        my_session->replies[CHILD] = 0;
+        my_session->eof[CHILD] = 0;
+    }
+}
+
+/**
+ * Called by the scan of the branch replies in async mode
+ * @param data Tee session
+ * @param header Start of the packet
+ * @param pktlen Length of the packet
+ * @return Always true, the whole reply is scanned to keep track of the packets
+ */
+static bool scan_branch_packet(void *data, uint8_t *header, size_t pktlen)
+{
+    TEE_SESSION *my_session = (TEE_SESSION*)data;
+
+    if (my_session->waiting[CHILD])
+    {
+        process_branch_packet(my_session, header);
+    }
+
+    /** The first packet of the next result is processed whatever it is */
+    my_session->branch_scan.all_packets = my_session->waiting[CHILD] &&
+                                          my_session->replies[CHILD] == 0;
+    return true;
+}
+
+/**
+ * Process a reply in async mode. The replies to the client are routed upstream
+ * as they arrive and the replies of the branch are discarded. When the branch
+ * has replied to its statement, the next queued statement is routed to it. The
+ * caller must hold the tee_lock, it is released by this function.
+ * @param my_session Tee session
+ * @param branch PARENT or CHILD
+ * @param reply The reply
+ * @return The return value of the upstream clientReply or 1 for the branch
+ */
+static int async_reply(TEE_SESSION* my_session, int branch, GWBUF* reply)
+{
+    if (branch == PARENT)
+    {
+        spinlock_release(&my_session->tee_lock);
+        return my_session->up.clientReply(my_session->up.instance,
+                                          my_session->up.session,
+                                          reply);
+    }
+
+    /** The scan continues across the replies so partial packets need not be kept */
+    my_session->branch_scan.all_packets = my_session->waiting[CHILD] &&
+                                          my_session->replies[CHILD] == 0;
+    modutil_scan_packets(&my_session->branch_scan, reply, scan_branch_packet, my_session);
+    gwbuf_free(reply);
+    route_branch_queue(my_session);
+
+    spinlock_release(&my_session->tee_lock);
+    return 1;
+}
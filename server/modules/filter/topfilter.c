@@ -26,8 +26,15 @@
  * file to which the queries are logged. A serial number is appended to this
  * name in order that each session logs to a different file.
  *
+ * With the tracked_statements parameter the filter also keeps an instance
+ * wide list of the slowest statements, keyed by the canonical form of the
+ * statement. Each poll thread tracks the statements it executes in a shard
+ * of its own and the shards are merged into a top N report when the list is
+ * queried with the maxinfo "show statements" command.
+ *
  * Date         Who             Description
  * 18/06/2014   Mark Riddoch    Addition of source and user filters
+ * 15/10/2016   Core Team       Instance wide tracking of the slowest statements
  *
  * @endverbatim
  */
@@ -44,6 +51,10 @@
 #include <sys/time.h>
 #include <regex.h>
 #include <atomic.h>
+#include <spinlock.h>
+#include <hashtable.h>
+#include <maxconfig.h>
+#include <maxscale/poll.h>
 
 MODULE_INFO info =
 {
@@ -67,7 +78,7 @@ static void setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
 static int routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static int clientReply(FILTER *instance, void *fsession, GWBUF *queue);
 static void diagnostic(FILTER *instance, void *fsession, DCB *dcb);
-
+static int getStatements(FILTER *instance, int n, FILTER_STATEMENT_STATS *stats);
 
 static FILTER_OBJECT MyObject =
 {
@@ -80,8 +91,48 @@ static FILTER_OBJECT MyObject =
     routeQuery,
     clientReply,
     diagnostic,
+    NULL,               // No getInterest
+    getStatements,
 };
 
+/**
+ * The number of histogram buckets of each power of two of the execution
+ * times of a tracked statement
+ */
+#define TOPN_SUB_BITS 2
+#define TOPN_SUB      (1 << TOPN_SUB_BITS)
+
+/** The number of histogram buckets, the last one holds times above ~9.5 hours */
+#define TOPN_BUCKETS  136
+
+/**
+ * A statement tracked by the instance
+ */
+typedef struct topn_stmt
+{
+    char *sql;                      /* The canonical statement */
+    uint64_t count;                 /* Number of executions */
+    uint64_t sum;                   /* Total execution time in microseconds */
+    uint64_t min;                   /* Shortest execution time */
+    uint64_t max;                   /* Longest execution time */
+    uint32_t buckets[TOPN_BUCKETS]; /* Histogram of the execution times */
+    int heap_index;                 /* Position in the heap of the shard */
+} TOPN_STMT;
+
+/**
+ * The statements tracked by one poll thread. The statements are kept in a
+ * min-heap ordered by the longest execution time, so when the shard is full
+ * a statement slower than the fastest tracked statement replaces it.
+ */
+typedef struct
+{
+    SPINLOCK lock;       /* Only contended when the report is built */
+    HASHTABLE *stmts;    /* The statements keyed by the canonical SQL */
+    TOPN_STMT **heap;    /* The statements ordered by the longest time */
+    int n_stmts;         /* Number of tracked statements */
+    uint64_t evictions;  /* Statements replaced by slower ones */
+} TOPN_SHARD;
+
 /**
  * A instance structure, the assumption is that the option passed
  * to the filter is simply a base for the filename to which the queries
@@ -101,6 +152,12 @@ typedef struct
     regex_t re; /* Compiled regex text */
     char *exclude; /* Optional text to match against for exclusion */
     regex_t exre; /* Compiled regex nomatch text */
+    int tracked; /* Statements tracked by each thread, 0 if not tracked */
+    int n_shards; /* Number of shards */
+    TOPN_SHARD *shards; /* The statements tracked by each thread */
+    SPINLOCK report_lock; /* Protects the report */
+    TOPN_STMT *report; /* The merged top N statements */
+    int report_count; /* Number of statements in the report */
 } TOPN_INSTANCE;
 
 /**
@@ -174,6 +231,413 @@ GetModuleObject()
 {
     return &MyObject;
 }
+
+/**
+ * Swap two statements in a min-heap
+ *
+ * @param heap  The heap
+ * @param a     Index of the first statement
+ * @param b     Index of the second statement
+ */
+static void
+heap_swap(TOPN_STMT **heap, int a, int b)
+{
+    TOPN_STMT *tmp = heap[a];
+
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    heap[a]->heap_index = a;
+    heap[b]->heap_index = b;
+}
+
+/**
+ * Move a statement towards the root of a min-heap until its parent is faster
+ *
+ * @param heap  The heap
+ * @param i     Index of the statement
+ */
+static void
+heap_sift_up(TOPN_STMT **heap, int i)
+{
+    while (i > 0 && heap[i]->max < heap[(i - 1) / 2]->max)
+    {
+        heap_swap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/**
+ * Move a statement away from the root of a min-heap until its children are
+ * slower
+ *
+ * @param heap  The heap
+ * @param n     Number of statements in the heap
+ * @param i     Index of the statement
+ */
+static void
+heap_sift_down(TOPN_STMT **heap, int n, int i)
+{
+    while (true)
+    {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+
+        if (left < n && heap[left]->max < heap[smallest]->max)
+        {
+            smallest = left;
+        }
+        if (right < n && heap[right]->max < heap[smallest]->max)
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            break;
+        }
+        heap_swap(heap, i, smallest);
+        i = smallest;
+    }
+}
+
+/**
+ * Free the shards of the tracked statements
+ *
+ * @param my_instance   The filter instance
+ */
+static void
+free_shards(TOPN_INSTANCE *my_instance)
+{
+    for (int i = 0; my_instance->shards && i < my_instance->n_shards; i++)
+    {
+        TOPN_SHARD *shard = &my_instance->shards[i];
+
+        for (int j = 0; j < shard->n_stmts; j++)
+        {
+            free(shard->heap[j]->sql);
+            free(shard->heap[j]);
+        }
+        if (shard->stmts)
+        {
+            hashtable_free(shard->stmts);
+        }
+        free(shard->heap);
+    }
+    free(my_instance->shards);
+    my_instance->shards = NULL;
+}
+
+/**
+ * Allocate the shards of the tracked statements, one for each poll thread
+ *
+ * @param my_instance   The filter instance
+ * @return True if the shards were allocated
+ */
+static bool
+create_shards(TOPN_INSTANCE *my_instance)
+{
+    my_instance->n_shards = config_threadcount();
+    spinlock_init(&my_instance->report_lock);
+
+    if ((my_instance->shards = calloc(my_instance->n_shards, sizeof(TOPN_SHARD))) == NULL)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < my_instance->n_shards; i++)
+    {
+        TOPN_SHARD *shard = &my_instance->shards[i];
+
+        spinlock_init(&shard->lock);
+        if ((shard->stmts = hashtable_alloc(my_instance->tracked, simple_str_hash, strcmp)) == NULL ||
+            (shard->heap = calloc(my_instance->tracked, sizeof(TOPN_STMT *))) == NULL)
+        {
+            MXS_ERROR("topfilter: Failed to allocate memory for the tracked statements.");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Find the histogram bucket of an execution time. The times below TOPN_SUB
+ * microseconds have buckets of their own, the longer ones share a bucket
+ * with the times that have the same highest TOPN_SUB_BITS + 1 bits.
+ *
+ * @param value The execution time
+ * @return The bucket
+ */
+static int
+stmt_bucket(uint64_t value)
+{
+    if (value < TOPN_SUB)
+    {
+        return (int) value;
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    int bucket = (msb - TOPN_SUB_BITS + 1) * TOPN_SUB +
+        (int) ((value >> (msb - TOPN_SUB_BITS)) & (TOPN_SUB - 1));
+
+    return bucket < TOPN_BUCKETS ? bucket : TOPN_BUCKETS - 1;
+}
+
+/**
+ * Find a percentile of the execution times of a statement. The largest
+ * time of the bucket holding the percentile is returned.
+ *
+ * @param stmt  The statement
+ * @param pct   The percentile, between 0 and 100
+ * @return The percentile
+ */
+static uint64_t
+stmt_percentile(TOPN_STMT *stmt, double pct)
+{
+    uint64_t target = (uint64_t) (stmt->count * pct / 100);
+    uint64_t count = 0;
+
+    if (target < 1)
+    {
+        target = 1;
+    }
+
+    for (int i = 0; i < TOPN_BUCKETS - 1; i++)
+    {
+        count += stmt->buckets[i];
+        if (count >= target)
+        {
+            int bucket = i + 1;
+            uint64_t value = bucket < TOPN_SUB ? bucket :
+                (uint64_t) (TOPN_SUB + bucket % TOPN_SUB) << (bucket / TOPN_SUB - 1);
+
+            value -= 1;
+            if (value < stmt->min)
+            {
+                value = stmt->min;
+            }
+            return value < stmt->max ? value : stmt->max;
+        }
+    }
+    return stmt->max;
+}
+
+/**
+ * Record an execution of a statement in the shard of the current thread
+ *
+ * @param my_instance   The filter instance
+ * @param sql           The statement
+ * @param usec          The execution time in microseconds
+ */
+static void
+track_statement(TOPN_INSTANCE *my_instance, const char *sql, uint64_t usec)
+{
+    size_t len = strlen(sql);
+    char canonical[CANONICAL_SQL_SIZE(FILTER_STATEMENT_LEN)];
+
+    if (len > FILTER_STATEMENT_LEN)
+    {
+        len = FILTER_STATEMENT_LEN;
+    }
+
+    if (canonicalize_sql(sql, len, canonical) > FILTER_STATEMENT_LEN)
+    {
+        canonical[FILTER_STATEMENT_LEN] = '\0';
+    }
+
+    TOPN_SHARD *shard = &my_instance->shards[poll_dcb_thread(NULL) % my_instance->n_shards];
+    TOPN_STMT *stmt;
+
+    spinlock_acquire(&shard->lock);
+
+    if ((stmt = hashtable_fetch(shard->stmts, canonical)) == NULL)
+    {
+        if (shard->n_stmts == my_instance->tracked)
+        {
+            /** The shard is full, replace the fastest statement if this one is slower */
+            stmt = shard->heap[0];
+
+            if (usec <= stmt->max)
+            {
+                spinlock_release(&shard->lock);
+                return;
+            }
+
+            hashtable_delete(shard->stmts, stmt->sql);
+            free(stmt->sql);
+            shard->heap[0] = shard->heap[--shard->n_stmts];
+            shard->heap[0]->heap_index = 0;
+            heap_sift_down(shard->heap, shard->n_stmts, 0);
+            shard->evictions++;
+            memset(stmt, 0, sizeof(*stmt));
+        }
+        else if ((stmt = calloc(1, sizeof(TOPN_STMT))) == NULL)
+        {
+            spinlock_release(&shard->lock);
+            return;
+        }
+
+        if ((stmt->sql = strdup(canonical)) == NULL ||
+            !hashtable_add(shard->stmts, stmt->sql, stmt))
+        {
+            spinlock_release(&shard->lock);
+            free(stmt->sql);
+            free(stmt);
+            return;
+        }
+
+        stmt->min = usec;
+        stmt->max = usec;
+        stmt->heap_index = shard->n_stmts;
+        shard->heap[shard->n_stmts++] = stmt;
+        heap_sift_up(shard->heap, stmt->heap_index);
+    }
+    else if (usec > stmt->max)
+    {
+        stmt->max = usec;
+        heap_sift_down(shard->heap, shard->n_stmts, stmt->heap_index);
+    }
+
+    if (usec < stmt->min)
+    {
+        stmt->min = usec;
+    }
+    stmt->count++;
+    stmt->sum += usec;
+    stmt->buckets[stmt_bucket(usec)]++;
+
+    spinlock_release(&shard->lock);
+}
+
+static int
+cmp_stmt_sql(const void *va, const void *vb)
+{
+    const TOPN_STMT *a = (const TOPN_STMT *) va;
+    const TOPN_STMT *b = (const TOPN_STMT *) vb;
+
+    return strcmp(a->sql, b->sql);
+}
+
+static int
+cmp_stmt_max(const void *va, const void *vb)
+{
+    const TOPN_STMT *a = (const TOPN_STMT *) va;
+    const TOPN_STMT *b = (const TOPN_STMT *) vb;
+
+    return a->max < b->max ? 1 : a->max > b->max ? -1 : 0;
+}
+
+/**
+ * Merge the shards into the report of the top N statements. The statements
+ * tracked by several threads are combined and the N slowest statements are
+ * selected with a min-heap of N statements. The caller must hold the report
+ * lock.
+ *
+ * @param my_instance   The filter instance
+ */
+static void
+build_report(TOPN_INSTANCE *my_instance)
+{
+    TOPN_STMT *all;
+    int n_all = 0;
+
+    for (int i = 0; i < my_instance->report_count; i++)
+    {
+        free(my_instance->report[i].sql);
+    }
+    free(my_instance->report);
+    my_instance->report = NULL;
+    my_instance->report_count = 0;
+
+    if ((all = malloc(my_instance->n_shards * my_instance->tracked * sizeof(TOPN_STMT))) == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < my_instance->n_shards; i++)
+    {
+        TOPN_SHARD *shard = &my_instance->shards[i];
+
+        spinlock_acquire(&shard->lock);
+        for (int j = 0; j < shard->n_stmts; j++)
+        {
+            all[n_all] = *shard->heap[j];
+            if ((all[n_all].sql = strdup(shard->heap[j]->sql)))
+            {
+                n_all++;
+            }
+        }
+        spinlock_release(&shard->lock);
+    }
+
+    /** Combine the statements that were tracked by more than one thread */
+    qsort(all, n_all, sizeof(TOPN_STMT), cmp_stmt_sql);
+    int n_merged = 0;
+
+    for (int i = 0; i < n_all; i++)
+    {
+        TOPN_STMT *stmt = n_merged > 0 ? &all[n_merged - 1] : NULL;
+
+        if (stmt && strcmp(stmt->sql, all[i].sql) == 0)
+        {
+            stmt->count += all[i].count;
+            stmt->sum += all[i].sum;
+            stmt->min = MIN(stmt->min, all[i].min);
+            stmt->max = MAX(stmt->max, all[i].max);
+            for (int j = 0; j < TOPN_BUCKETS; j++)
+            {
+                stmt->buckets[j] += all[i].buckets[j];
+            }
+            free(all[i].sql);
+        }
+        else
+        {
+            all[n_merged++] = all[i];
+        }
+    }
+
+    /** Select the N slowest statements */
+    TOPN_STMT **heap = malloc(my_instance->topN * sizeof(TOPN_STMT *));
+    int n_heap = 0;
+
+    if (heap)
+    {
+        for (int i = 0; i < n_merged; i++)
+        {
+            if (n_heap < my_instance->topN)
+            {
+                all[i].heap_index = n_heap;
+                heap[n_heap++] = &all[i];
+                heap_sift_up(heap, n_heap - 1);
+            }
+            else if (all[i].max > heap[0]->max)
+            {
+                all[i].heap_index = 0;
+                heap[0] = &all[i];
+                heap_sift_down(heap, n_heap, 0);
+            }
+        }
+
+        if ((my_instance->report = malloc(n_heap * sizeof(TOPN_STMT))))
+        {
+            for (int i = 0; i < n_heap; i++)
+            {
+                my_instance->report[i] = *heap[i];
+                heap[i]->sql = NULL;
+            }
+            my_instance->report_count = n_heap;
+            qsort(my_instance->report, n_heap, sizeof(TOPN_STMT), cmp_stmt_max);
+        }
+        free(heap);
+    }
+
+    for (int i = 0; i < n_merged; i++)
+    {
+        free(all[i].sql);
+    }
+    free(all);
+}
+
 /**
  * Create an instance of the filter for a particular service
  * within MaxScale.
@@ -189,7 +653,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
     int i;
     TOPN_INSTANCE *my_instance;
 
-    if ((my_instance = malloc(sizeof(TOPN_INSTANCE))) != NULL)
+    if ((my_instance = calloc(1, sizeof(TOPN_INSTANCE))) != NULL)
     {
         my_instance->topN = 10;
         my_instance->match = NULL;
@@ -225,6 +689,17 @@ createInstance(char **options, FILTER_PARAMETER **params)
             {
                 my_instance->user = strdup(params[i]->value);
             }
+            else if (!strcmp(params[i]->name, "tracked_statements"))
+            {
+                my_instance->tracked = atoi(params[i]->value);
+
+                if (my_instance->tracked < 0)
+                {
+                    MXS_ERROR("topfilter: Invalid value '%s' for the "
+                              "'tracked_statements' parameter.", params[i]->value);
+                    error = true;
+                }
+            }
             else if (!filter_standard_parameter(params[i]->name))
             {
                 MXS_ERROR("topfilter: Unexpected parameter '%s'.",
@@ -260,9 +735,21 @@ createInstance(char **options, FILTER_PARAMETER **params)
             }
         }
 
-        if (my_instance->filebase == NULL)
+        if (my_instance->topN <= 0)
+        {
+            MXS_ERROR("topfilter: The 'count' parameter must be a positive number.");
+            error = true;
+        }
+
+        if (my_instance->filebase == NULL && my_instance->tracked == 0)
+        {
+            MXS_ERROR("topfilter: Neither 'filebase' nor 'tracked_statements' "
+                      "parameter defined.");
+            error = true;
+        }
+
+        if (!error && my_instance->tracked > 0 && !create_shards(my_instance))
         {
-            MXS_ERROR("topfilter: No 'filebase' parameter defined.");
             error = true;
         }
 
@@ -302,6 +789,7 @@ createInstance(char **options, FILTER_PARAMETER **params)
                 regfree(&my_instance->re);
                 free(my_instance->match);
             }
+            free_shards(my_instance);
             free(my_instance->filebase);
             free(my_instance->source);
             free(my_instance->user);
@@ -331,15 +819,14 @@ newSession(FILTER *instance, SESSION *session)
 
     if ((my_session = calloc(1, sizeof(TOPN_SESSION))) != NULL)
     {
-        if ((my_session->filename =
+        if (my_instance->filebase &&
+            (my_session->filename =
                  (char *) malloc(strlen(my_instance->filebase) + 20))
             == NULL)
         {
             free(my_session);
             return NULL;
         }
-        sprintf(my_session->filename, "%s.%d", my_instance->filebase,
-                my_instance->sessions);
         atomic_add(&my_instance->sessions, 1);
         my_session->top = (TOPNQ **) calloc(my_instance->topN + 1,
                                             sizeof(TOPNQ *));
@@ -380,8 +867,11 @@ newSession(FILTER *instance, SESSION *session)
             my_session->active = 0;
         }
 
-        sprintf(my_session->filename, "%s.%d", my_instance->filebase,
-                my_instance->sessions);
+        if (my_session->filename)
+        {
+            sprintf(my_session->filename, "%s.%d", my_instance->filebase,
+                    my_instance->sessions);
+        }
         gettimeofday(&my_session->connect, NULL);
     }
 
@@ -408,7 +898,7 @@ closeSession(FILTER *instance, void *session)
 
     gettimeofday(&my_session->disconnect, NULL);
     timersub((&my_session->disconnect), &(my_session->connect), &diff);
-    if ((fp = fopen(my_session->filename, "w")) != NULL)
+    if (my_session->filename && (fp = fopen(my_session->filename, "w")) != NULL)
     {
         statements = my_session->n_statements != 0 ? my_session->n_statements : 1;
 
@@ -583,6 +1073,12 @@ clientReply(FILTER *instance, void *session, GWBUF *reply)
 
         timeradd(&(my_session->total), &diff, &(my_session->total));
 
+        if (my_instance->tracked)
+        {
+            track_statement(my_instance, my_session->current,
+                            (uint64_t) diff.tv_sec * 1000000 + diff.tv_usec);
+        }
+
         inserted = 0;
         for (i = 0; i < my_instance->topN; i++)
         {
@@ -662,10 +1158,26 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         dcb_printf(dcb, "\t\tExclude queries that match     %s\n",
                    my_instance->exclude);
     }
-    if (my_session)
+    if (my_instance->tracked)
+    {
+        uint64_t evictions = 0;
+
+        for (i = 0; i < my_instance->n_shards; i++)
+        {
+            evictions += my_instance->shards[i].evictions;
+        }
+        dcb_printf(dcb, "\t\tStatements tracked per thread  %d\n",
+                   my_instance->tracked);
+        dcb_printf(dcb, "\t\tTracked statements replaced    %lu\n",
+                   evictions);
+    }
+    if (my_session && my_session->filename)
     {
         dcb_printf(dcb, "\t\tLogging to file %s.\n",
                    my_session->filename);
+    }
+    if (my_session)
+    {
         dcb_printf(dcb, "\t\tCurrent Top %d:\n", my_instance->topN);
         for (i = 0; i < my_instance->topN; i++)
         {
@@ -681,3 +1193,53 @@ diagnostic(FILTER *instance, void *fsession, DCB *dcb)
         }
     }
 }
+
+/**
+ * Return the statistics of the slowest statements tracked by the instance.
+ * The report is built from the shards of the threads when the first
+ * statement is requested and the other statements are returned from it.
+ *
+ * @param instance  The filter instance
+ * @param n         The index of the statement
+ * @param stats     The statistics of the statement are stored here
+ * @return The number of statements in the report
+ */
+static int
+getStatements(FILTER *instance, int n, FILTER_STATEMENT_STATS *stats)
+{
+    TOPN_INSTANCE *my_instance = (TOPN_INSTANCE *) instance;
+    int rval;
+
+    if (my_instance->tracked == 0)
+    {
+        return 0;
+    }
+
+    spinlock_acquire(&my_instance->report_lock);
+
+    if (n == 0)
+    {
+        build_report(my_instance);
+    }
+
+    if (n < my_instance->report_count)
+    {
+        TOPN_STMT *stmt = &my_instance->report[n];
+
+        strcpy(stats->sql, stmt->sql);
+        stats->duration.count = stmt->count;
+        stats->duration.min = stmt->min;
+        stats->duration.max = stmt->max;
+        stats->duration.sum = stmt->sum;
+        stats->duration.mean = (double) stmt->sum / stmt->count;
+        stats->duration.p50 = stmt_percentile(stmt, 50);
+        stats->duration.p90 = stmt_percentile(stmt, 90);
+        stats->duration.p99 = stmt_percentile(stmt, 99);
+        stats->duration.p999 = stmt_percentile(stmt, 99.9);
+    }
+
+    rval = my_instance->report_count;
+    spinlock_release(&my_instance->report_lock);
+
+    return rval;
+}
@@ -11,6 +11,7 @@
 #include <dcb.h>
 #include <service.h>
 #include <spinlock.h>
+#include <thread.h>
 #include <mysql_binlog.h>
 #include <users.h>
 #include <dbusers.h>
@@ -39,6 +40,12 @@
 #define AVRO_DEFAULT_BLOCK_TRX_COUNT 1
 #define AVRO_DEFAULT_BLOCK_ROW_COUNT 1000
 
+/** Default maximum memory used by the decoded block cache */
+#define AVRO_DEFAULT_BLOCK_CACHE_SIZE (16 * 1024 * 1024)
+
+/** Maximum delay in seconds between two checks for new binlog data */
+#define AVRO_TASK_DELAY_MAX 15
+
 #define MAX_MAPPED_TABLES 1024
 
 #define GTID_TABLE_NAME        "gtid"
@@ -53,6 +60,9 @@
 /** Buffer limits */
 #define AVRO_SQL_BUFFER_SIZE 2048
 
+/** How long an SQLite statement waits for a lock on the index database, in milliseconds */
+#define AVRO_SQLITE_BUSY_TIMEOUT 5000
+
 /** Avro filename maxlen */
 #ifdef NAME_MAX
 #define AVRO_MAX_FILENAME_LEN NAME_MAX
@@ -93,6 +103,12 @@ typedef enum avro_binlog_end
 /** How many bytes each thread tries to send */
 #define AVRO_DATA_BURST_SIZE MAX_BUFFER_SIZE
 
+/** Queued bytes after which a client is sent no more data until the queue drains */
+#define AVRO_CLIENT_WRITEQ_MAX (4 * AVRO_DATA_BURST_SIZE)
+
+/** Credit of a client that has not granted any, it is never consumed */
+#define AVRO_CREDIT_UNLIMITED INT64_MAX
+
 /** A CREATE TABLE abstraction */
 typedef struct table_create
 {
@@ -104,6 +120,35 @@ typedef struct table_create
     bool was_used; /**< Has this schema been persisted to disk */
 } TABLE_CREATE;
 
+/** The fields that the avrorouter adds to each record before the columns */
+#define AVRO_GENERATED_FIELDS 6
+
+struct column_decoder;
+
+/**
+ * Decode the value of a column of a row into an Avro field
+ *
+ * @param col   The decoder of the column
+ * @param field The Avro field of the column
+ * @param ptr   Pointer to the value in the row
+ * @return Pointer to the value of the next column
+ */
+typedef uint8_t* (*COLUMN_DECODE_FN)(const struct column_decoder *col, avro_value_t *field,
+                                     uint8_t *ptr);
+
+/**
+ * How to decode a column of the row events of a table. The decoders are built
+ * once for each version of a table map so that the rows are decoded without
+ * looking at the column types and metadata again.
+ */
+typedef struct column_decoder
+{
+    COLUMN_DECODE_FN decode;    /*< The function specialised for the type of the column */
+    uint8_t type;               /*< The type of the column */
+    uint8_t *metadata;          /*< The metadata of the column in the table map */
+    size_t size;                /*< Bytes of the value if it has a fixed size */
+} COLUMN_DECODER;
+
 /** A representation of a table map event read from a binary log. A table map
  * maps a table to a unique ID which can be used to match row events to table map
  * events. The table map event tells us how the table is laid out and gives us
@@ -118,6 +163,7 @@ typedef struct table_map
     uint8_t *column_metadata;
     size_t column_metadata_size;
     TABLE_CREATE *table_create; /*< The definition of the table */
+    COLUMN_DECODER *decoders;   /*< The decoders of the columns */
     int version;
     char version_string[TABLE_MAP_VERSION_DIGITS + 1];
     char *table;
@@ -163,6 +209,7 @@ typedef struct avro_table_t
     avro_file_writer_t avro_file; /*< Current Avro data file */
     avro_value_iface_t *avro_writer_iface; /*< Avro C API writer interface */
     avro_schema_t avro_schema; /*< Native Avro schema of the table */
+    struct avro_tail *tail; /*< Unflushed records, NULL without stream_unflushed */
 } AVRO_TABLE;
 
 /** Data format used when streaming data to the clients */
@@ -185,6 +232,194 @@ typedef struct gtid_pos
                          * rebuild GTID events in the correct order. */
 } gtid_pos_t;
 
+/** A record of a tail */
+typedef struct avro_tail_row
+{
+    char            *json;  /*< The record as JSON */
+    gtid_pos_t      gtid;   /*< GTID of the record */
+    uint64_t        trx;    /*< Number of the transaction of the record */
+} AVRO_TAIL_ROW;
+
+/** The records of an Avro file that are not yet flushed */
+typedef struct avro_tail
+{
+    SPINLOCK        lock;       /*< Protects the records */
+    AVRO_TAIL_ROW   *rows;      /*< The records in the order of the file */
+    size_t          n_rows;     /*< Number of records */
+    size_t          size;       /*< Allocated number of records */
+    uint64_t        flushed;    /*< Number of records in the file before the first one */
+    struct avro_instance *router; /*< The owning router */
+} AVRO_TAIL;
+
+/** The result of reading a record from a tail */
+enum avro_tail_result
+{
+    AVRO_TAIL_OK,       /*< The record was read */
+    AVRO_TAIL_NO_DATA,  /*< The record is not yet committed */
+    AVRO_TAIL_ON_DISK   /*< The record has been flushed to the file */
+};
+
+/**
+ * The GTID of a transaction whose row events are converted by the conversion
+ * threads. The threads share the subsequence counter of the transaction.
+ */
+typedef struct avro_trx
+{
+    gtid_pos_t gtid;            /*< GTID of the transaction */
+    int        event_num;       /*< The last subsequence number given to a record */
+    int        refcount;        /*< The router and the queued row events using this */
+    uint64_t   tail_trx;        /*< Number of the transaction in the tails */
+} AVRO_TRX;
+
+/** A row event queued to a conversion thread */
+typedef struct avro_row_job
+{
+    REP_HEADER          hdr;    /*< Replication header of the event */
+    uint8_t             *data;  /*< Copy of the event payload */
+    int                 offset; /*< Offset of the column count in the payload */
+    TABLE_MAP           *map;   /*< Table map of the event */
+    AVRO_TABLE          *table; /*< Avro file of the table */
+    AVRO_TRX            *trx;   /*< Transaction of the event */
+    struct avro_row_job *next;
+} AVRO_ROW_JOB;
+
+/**
+ * A conversion thread. The row events of a table are always converted by the
+ * same thread so the records of each table are written in binlog order.
+ */
+typedef struct avro_worker
+{
+    SPINLOCK            lock;       /*< Protects the queue */
+    AVRO_ROW_JOB        *head;      /*< First queued row event */
+    AVRO_ROW_JOB        *tail;      /*< Last queued row event */
+    int                 pending;    /*< Queued row events and the one being converted */
+    uint64_t            n_events;   /*< Number of row events converted */
+    THREAD              thread;     /*< The thread */
+    bool                running;    /*< Cleared to stop the thread */
+} AVRO_WORKER;
+
+/** An Avro file with flushed data that is not yet indexed */
+typedef struct avro_index_file
+{
+    char                    *filename;  /*< Path of the Avro file */
+    off_t                   size;       /*< Size of the file when it was flushed */
+    struct avro_index_file  *next;
+} AVRO_INDEX_FILE;
+
+/** The position of the first record of a GTID in an Avro file */
+typedef struct avro_gtid_entry
+{
+    uint64_t    seq;        /*< GTID sequence number */
+    long        position;   /*< Offset of the data block */
+    uint64_t    record;     /*< Index of the record in the data block */
+} AVRO_GTID_ENTRY;
+
+/** The GTIDs of one domain and server in one Avro file, in ascending order */
+typedef struct avro_gtid_list
+{
+    AVRO_GTID_ENTRY *entries;
+    size_t          n_entries;
+    size_t          size;       /*< Allocated number of entries */
+} AVRO_GTID_LIST;
+
+/**
+ * In-memory copy of the GTID index. It is loaded from the index database at
+ * startup and the indexing thread adds the new GTIDs to it, so clients find
+ * the position of a GTID without querying the database.
+ */
+typedef struct avro_gtid_index
+{
+    SPINLOCK        lock;       /*< Protects the lists */
+    HASHTABLE       *lists;     /*< GTID lists keyed by file:domain:server_id */
+    uint64_t        n_entries;  /*< Number of indexed GTIDs */
+} AVRO_GTID_INDEX;
+
+/**
+ * The GTID indexing thread. The conversion queues the Avro files after they
+ * are flushed and the thread indexes the new data blocks of the files in
+ * batches, one transaction per batch.
+ */
+typedef struct avro_indexer
+{
+    sqlite3             *handle;        /*< SQLite handle of the indexing thread */
+    sqlite3_stmt        *insert_gtid;   /*< Inserts the position of a GTID */
+    sqlite3_stmt        *read_progress; /*< Reads the indexed position of a file */
+    sqlite3_stmt        *save_progress; /*< Stores the indexed position of a file */
+    SPINLOCK            lock;           /*< Protects the queue */
+    AVRO_INDEX_FILE     *queue;         /*< Files waiting to be indexed */
+    THREAD              thread;         /*< The thread */
+    bool                running;        /*< Whether the thread is running */
+    AVRO_GTID_INDEX     gtids;          /*< In-memory copy of the index */
+} AVRO_INDEXER;
+
+/** The thread that converts the binlogs as soon as they change */
+typedef struct avro_watcher
+{
+    int                 inotify_fd;     /*< Watches the binlog directory, -1 if not used */
+    int                 event_fd;       /*< Signaled by the binlog router of the process */
+    volatile int        pending;        /*< Whether event_fd has been signaled */
+    bool                listening;      /*< Whether the source service notifies the thread */
+    THREAD              thread;         /*< The thread */
+    bool                running;        /*< Whether the thread is running */
+} AVRO_WATCHER;
+
+/** The decoded records of a data block, shared by the JSON clients */
+typedef struct avro_cached_block
+{
+    char                *key;       /*< File name and offset of the block */
+    char                **rows;     /*< The records as JSON */
+    gtid_pos_t          *gtids;     /*< The GTID of each record */
+    uint64_t            n_rows;     /*< Number of records */
+    size_t              size;       /*< Memory used by the block */
+    int                 refcount;   /*< References from the cache and the clients */
+    struct avro_cached_block *prev; /*< More recently used block */
+    struct avro_cached_block *next; /*< Less recently used block */
+} AVRO_CACHED_BLOCK;
+
+/** Router wide cache of decoded data blocks with LRU eviction */
+typedef struct avro_block_cache
+{
+    SPINLOCK            lock;       /*< Protects the cache */
+    HASHTABLE           *blocks;    /*< The blocks by key */
+    AVRO_CACHED_BLOCK   *head;      /*< Most recently used block */
+    AVRO_CACHED_BLOCK   *tail;      /*< Least recently used block */
+    size_t              size;       /*< Memory used by the cached blocks */
+    size_t              max_size;   /*< Maximum memory used by the cached blocks */
+    uint64_t            hits;       /*< Blocks found in the cache */
+    uint64_t            misses;     /*< Blocks not found in the cache */
+    uint64_t            evictions;  /*< Blocks evicted from the cache */
+} AVRO_BLOCK_CACHE;
+
+/** Comparison operators of the row filters */
+enum avro_filter_op
+{
+    AVRO_FILTER_EQ,
+    AVRO_FILTER_NE,
+    AVRO_FILTER_LT,
+    AVRO_FILTER_LE,
+    AVRO_FILTER_GT,
+    AVRO_FILTER_GE
+};
+
+/** A row filter of the form column OP value */
+typedef struct avro_predicate
+{
+    char                    *column;    /*< Compared column */
+    enum avro_filter_op     op;         /*< Comparison operator */
+    char                    *value;     /*< Value as given by the client */
+    double                  number;     /*< Numeric value, if is_number is set */
+    bool                    is_number;  /*< Whether the value is a number */
+    struct avro_predicate   *next;
+} AVRO_PREDICATE;
+
+/** The columns and rows requested by a client */
+typedef struct avro_filter
+{
+    char            **columns;      /*< Sent columns, NULL for all columns */
+    int             n_columns;      /*< Number of sent columns */
+    AVRO_PREDICATE  *predicates;    /*< Row filters, all of them must match */
+} AVRO_FILTER;
+
 /**
  * The client structure used within this router.
  * This represents the clients that are requesting AVRO files from MaxScale.
@@ -213,6 +448,13 @@ typedef struct avro_client
     gtid_pos_t      gtid_start; /*< First sent GTID */
     unsigned int    cstate;         /*< Catch up state */
     sqlite3       *sqlite_handle;
+    AVRO_FILTER     filter;         /*< Requested columns and rows */
+    int64_t         credit_records; /*< Records granted with CREDIT, protected by catch_lock */
+    int64_t         credit_bytes;   /*< Bytes granted with CREDIT, protected by catch_lock */
+    int64_t         burst_records;  /*< Records that can be sent in the current burst */
+    int64_t         burst_bytes;    /*< Bytes that can be sent in the current burst */
+    AVRO_TAIL       *tail;          /*< Unflushed records of the current file */
+    uint64_t        tail_pos;       /*< Index of the record after the last one sent from the tail */
 #if defined(SS_DEBUG)
     skygw_chk_t     rses_chk_tail;
 #endif
@@ -261,6 +503,18 @@ typedef struct avro_instance
     uint64_t        row_count; /*< Row events processed */
     uint64_t        row_target; /*< Minimum about of row events that will trigger
                                  * a flush of all tables */
+    int             conversion_threads; /*< Number of threads converting row events */
+    enum maxavro_codec codec; /*< Compression codec of new Avro files */
+    AVRO_WORKER     *workers;   /*< The conversion threads */
+    AVRO_TRX        *trx;       /*< The transaction being read when using conversion threads */
+    AVRO_INDEXER    indexer;    /*< The GTID indexing thread */
+    AVRO_WATCHER    watcher;    /*< The conversion thread */
+    SERVICE         *source;    /*< The binlogrouter service of the source option */
+    AVRO_BLOCK_CACHE block_cache; /*< Decoded data blocks shared by the clients */
+    bool            stream_unflushed; /*< Send committed records before they are flushed */
+    HASHTABLE       *tails;     /*< Unflushed records by file name */
+    uint64_t        tail_trx;   /*< Number of the transaction being read */
+    volatile uint64_t tail_committed; /*< Number of the last committed transaction */
     struct avro_instance  *next;
 } AVRO_INSTANCE;
 
@@ -268,6 +522,7 @@ extern void read_table_info(uint8_t *ptr, uint8_t post_header_len, uint64_t *tab
                             char* dest, size_t len);
 extern TABLE_MAP *table_map_alloc(uint8_t *ptr, uint8_t hdr_len, TABLE_CREATE* create);
 extern void* table_map_free(TABLE_MAP *map);
+extern COLUMN_DECODER* column_decoders_alloc(TABLE_MAP *map);
 extern TABLE_CREATE* table_create_alloc(const char* sql, const char* db);
 extern void* table_create_free(TABLE_CREATE* value);
 extern bool table_create_save(TABLE_CREATE *create, const char *filename);
@@ -278,7 +533,9 @@ extern void avro_client_rotate(AVRO_INSTANCE *router, AVRO_CLIENT *client, uint8
 extern bool avro_open_binlog(const char *binlogdir, const char *file, int *fd);
 extern void avro_close_binlog(int fd);
 extern avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router);
-extern AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema);
+extern avro_binlog_end_t avro_convert_binlogs(AVRO_INSTANCE *router);
+extern AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema,
+                                    enum maxavro_codec codec);
 extern void* avro_table_free(AVRO_TABLE *table);
 extern void avro_flush_all_tables(AVRO_INSTANCE *router);
 extern char* json_new_schema_from_table(TABLE_MAP *map);
@@ -286,6 +543,37 @@ extern void save_avro_schema(const char *path, const char* schema, TABLE_MAP *ma
 extern bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr);
 extern bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr);
 extern void table_map_remap(uint8_t *ptr, uint8_t hdr_len, TABLE_MAP *map);
+extern bool avro_write_row_event(TABLE_MAP *map, AVRO_TABLE *table, gtid_pos_t *gtid,
+                                 AVRO_TRX *trx, REP_HEADER *hdr, uint8_t *ptr, uint8_t *end);
+extern bool avro_worker_start(AVRO_INSTANCE *router);
+extern void avro_worker_stop(AVRO_INSTANCE *router);
+extern bool avro_worker_queue(AVRO_INSTANCE *router, const char *table_ident, TABLE_MAP *map,
+                              AVRO_TABLE *table, REP_HEADER *hdr, uint8_t *ptr, int offset);
+extern void avro_worker_drain(AVRO_INSTANCE *router);
+extern void avro_worker_new_trx(AVRO_INSTANCE *router);
+extern bool avro_index_start(AVRO_INSTANCE *router, const char *dbpath);
+extern bool avro_watch_start(AVRO_INSTANCE *router);
+extern void avro_index_queue(AVRO_INSTANCE *router, const char *filename);
+extern bool avro_index_find(AVRO_INSTANCE *router, const char *filename, gtid_pos_t *gtid,
+                            long *position, uint64_t *record);
+extern bool avro_cache_init(AVRO_BLOCK_CACHE *cache, size_t max_size);
+extern AVRO_CACHED_BLOCK* avro_cache_get(AVRO_INSTANCE *router, MAXAVRO_FILE *file);
+extern void avro_cache_release(AVRO_CACHED_BLOCK *block);
+extern bool avro_filter_parse(AVRO_FILTER *filter, const char *str, char *err, size_t errlen);
+extern void avro_filter_free(AVRO_FILTER *filter);
+extern bool avro_filter_active(AVRO_FILTER *filter);
+extern json_t* avro_filter_row(AVRO_FILTER *filter, json_t *row);
+extern GWBUF* avro_filter_schema(AVRO_FILTER *filter, GWBUF *schema);
+extern void avro_gtid_from_integers(MAXAVRO_SCHEMA *schema, const uint64_t *integers,
+                                    gtid_pos_t *gtid);
+extern AVRO_TAIL* avro_tail_get(AVRO_INSTANCE *router, const char *filename);
+extern AVRO_TAIL* avro_tail_find(AVRO_INSTANCE *router, const char *name);
+extern void avro_tail_append(AVRO_TAIL *tail, avro_value_t *record, gtid_pos_t *gtid,
+                             uint64_t trx);
+extern void avro_tail_flush(AVRO_TAIL *tail);
+extern void avro_tail_commit(AVRO_INSTANCE *router);
+extern enum avro_tail_result avro_tail_read(AVRO_TAIL *tail, uint64_t pos, char **json,
+                                            gtid_pos_t *gtid);
 
 #define AVRO_CLIENT_UNREGISTERED 0x0000
 #define AVRO_CLIENT_REGISTERED   0x0001
@@ -298,5 +586,6 @@ extern void table_map_remap(uint8_t *ptr, uint8_t hdr_len, TABLE_MAP *map);
  */
 #define AVRO_CS_BUSY             0x0001
 #define AVRO_WAIT_DATA           0x0002
+#define AVRO_WAIT_CREDIT         0x0004
 
 #endif
@@ -251,34 +251,138 @@ typedef struct rep_header
 } REP_HEADER;
 
 /**
- * The binlog record structure. This contains the actual packet read from the binlog
- * file.
+ * A binlog event in the binlog cache
  */
 typedef struct
 {
-    unsigned long   position;       /*< binlog record position for this cache entry */
-    GWBUF           *pkt;           /*< The packet received from the master */
-    REP_HEADER      hdr;            /*< The packet header */
+    uint32_t        file;           /*< Sequence number of the binlog file */
+    uint32_t        pos;            /*< Position of the event in the binlog file */
+    uint32_t        size;           /*< Size of the event */
+    size_t          offset;         /*< Offset of the event in the cache buffer */
 } BLCACHE_RECORD;
 
 /**
- * The binlog cache. A cache exists for each file that hold cached bin log records.
- * Caches will be used for all files being read by more than 1 slave.
+ * The binlog cache. The latest events written to the binlog files are kept in
+ * a ring buffer so that the slaves that are catching up can be sent them from
+ * memory. The records are ordered by binlog file and position, oldest first.
  */
 typedef struct
 {
-    BLCACHE_RECORD  **records;      /*< The actual binlog records */
-    int             current;        /*< The next record that will be inserted */
+    uint8_t         *data;          /*< The ring buffer of events */
+    size_t          size;           /*< Size of the ring buffer */
+    size_t          end;            /*< Offset after the newest event */
+    BLCACHE_RECORD  *records;       /*< The records, a ring of max_records entries */
+    int             max_records;    /*< Maximum number of records */
+    int             first;          /*< The oldest record */
     int             cnt;            /*< The number of records in the cache */
     SPINLOCK        lock;           /*< The spinlock for the cache */
 } BLCACHE;
 
+/** The average event size the number of cache records is calculated with */
+#define BLCACHE_AVG_EVENT_SIZE 64
+
+/**
+ * An entry of the GTID index, the position of a MariaDB 10 GTID event. The
+ * entries are stored in the index file as they are in memory.
+ */
+typedef struct
+{
+    uint32_t        domain;         /*< The replication domain */
+    uint32_t        server_id;      /*< The server that logged the transaction */
+    uint64_t        seq;            /*< The sequence number */
+    uint32_t        file;           /*< Sequence number of the binlog file */
+    uint32_t        pos;            /*< Position of the GTID event in the file */
+} BLGTID_RECORD;
+
+/** The entries of one replication domain in the order of their sequence numbers */
+typedef struct
+{
+    uint32_t        domain;         /*< The replication domain */
+    BLGTID_RECORD   *records;       /*< The entries */
+    int             cnt;            /*< Number of entries */
+    int             size;           /*< Number of allocated entries */
+} BLGTID_DOMAIN;
+
+/**
+ * The GTID index, an append-only file next to the binlog files that maps
+ * the GTIDs of the transactions to their positions in the binlog files
+ */
+typedef struct
+{
+    int             fd;             /*< The index file */
+    BLGTID_DOMAIN   *domains;       /*< The replication domains */
+    int             n_domains;      /*< Number of domains */
+    SPINLOCK        lock;           /*< Protects the domains from the readers */
+} BLGTID_INDEX;
+
+/** Name of the GTID index file in the binlog directory */
+#define BLGTID_INDEX_FILE "gtid_index"
+
+/**
+ * When the binlog file is synced to disk, see the binlog_flush option
+ */
+typedef enum
+{
+    BLR_FLUSH_BATCH,        /*< After each batch of events read from the master */
+    BLR_FLUSH_EVENT,        /*< After each event */
+    BLR_FLUSH_TRX,          /*< After each transaction */
+    BLR_FLUSH_INTERVAL      /*< At most once per flush interval */
+} blr_flush_t;
+
+/** Size of the buffer the events are written to the binlog file from */
+#define BLR_WRITE_BUFFER_SIZE (64 * 1024)
+
+/**
+ * The events written to the current binlog file that have not yet been
+ * written to the file. The readers of the file take the part of the file
+ * that is in the buffer from it.
+ */
+typedef struct
+{
+    uint8_t         *data;          /*< The buffered data */
+    unsigned long   len;            /*< Number of bytes in the buffer */
+    unsigned long   pos;            /*< Position of the buffered data in the file */
+    SPINLOCK        lock;           /*< Protects the buffer from the readers */
+} BLWRITEBUF;
+
+/** Suffix of the compressed binlog files */
+#define BLR_COMPRESSED_SUFFIX ".z"
+#define BLR_COMPRESSED_MAGIC "MXSBLZ1"
+/** Size of the independently compressed chunks of a binlog file */
+#define BLR_COMPRESS_CHUNK (64 * 1024)
+
+/**
+ * The header of a compressed binlog file. The compressed chunks follow the
+ * header and the index of the chunks, n_chunks + 1 file offsets, follows them.
+ */
+typedef struct
+{
+    char            magic[8];       /*< BLR_COMPRESSED_MAGIC */
+    uint32_t        chunk_size;     /*< Uncompressed size of a chunk */
+    uint32_t        n_chunks;       /*< Number of chunks */
+    uint64_t        size;           /*< Size of the uncompressed binlog file */
+    uint64_t        index_offset;   /*< Offset of the chunk index */
+} BLZHEADER;
+
+/**
+ * An open compressed binlog file
+ */
+typedef struct
+{
+    BLZHEADER       header;         /*< The header of the file */
+    uint64_t        *index;         /*< Offsets of the chunks and the end of the last one */
+    uint8_t         *chunk;         /*< The last decompressed chunk */
+    int             chunk_no;       /*< Number of the decompressed chunk, -1 if none */
+    uint8_t         *zbuf;          /*< Buffer of a compressed chunk */
+    uint32_t        zbuf_size;      /*< Size of the buffer of a compressed chunk */
+} BLZFILE;
+
 typedef struct blfile
 {
     char            binlogname[BINLOG_FNAMELEN + 1]; /*< Name of the binlog file */
     int             fd;                             /*< Actual file descriptor */
+    BLZFILE         *z;                             /*< The compressed file, NULL if not compressed */
     int             refcnt;                         /*< Reference count for file */
-    BLCACHE         *cache;                         /*< Record cache for this file */
     SPINLOCK        lock;                           /*< The file lock */
     struct blfile   *next;                          /*< Next file in list */
 } BLFILE;
@@ -300,12 +404,19 @@ typedef struct
     int             n_dcb;
     int             n_above;
     int             n_failed_read;
+    int             n_sendfile;     /*< Number of events sent from the binlog file */
+    int             n_filtered;     /*< Number of events removed by the replication filters */
     int             n_overrun;
     int             n_caughtup;
     int             n_actions[3];
     uint64_t        lastsample;
     int             minno;
     int             minavgs[BLR_NSTATS_MINUTES];
+    unsigned long   lastsample_bytes; /*< Number of bytes sent at the last sample */
+    unsigned long   send_rate;      /*< Bytes sent per second between the last samples */
+    long            catchup_start;  /*< Heartbeat when the slave last started to catch up */
+    long            catchup_time;   /*< Heartbeats spent catching up before catchup_start */
+    ts_histogram_t  bursts;         /*< Durations of the catchup bursts in microseconds */
 } SLAVE_STATS;
 
 typedef enum blr_thread_role
@@ -359,6 +470,12 @@ typedef struct router_slave
     SLAVE_STATS     stats;          /*< Slave statistics */
     time_t          connect_time;   /*< Connect time of slave */
     char            *warning_msg;   /*< Warning message */
+    char            *gtid_state;    /*< The GTIDs the slave connects with, if any */
+    struct router_slave *catchup_next; /*< Next slave in the catchup queue */
+    struct session  *catchup_session; /*< Reference to the session while queued */
+    uint64_t        *filtered_tables; /*< Table IDs of the statement removed by the filters */
+    int             n_filtered_tables; /*< Number of table IDs in filtered_tables */
+    int             filtered_tables_size; /*< Allocated size of filtered_tables */
     int             heartbeat;      /*< Heartbeat in seconds */
     uint8_t         lastEventReceived; /*< Last event received */
     time_t          lastReply;      /*< Last event sent */
@@ -372,6 +489,40 @@ typedef struct router_slave
 #endif
 } ROUTER_SLAVE;
 
+/**
+ * The databases or tables of a replicate_do_* or replicate_ignore_* option
+ */
+typedef struct
+{
+    char            **names;        /*< The databases, or the tables as db.table */
+    int             count;          /*< Number of names */
+} BLFILTER_LIST;
+
+/**
+ * A module of the process that is notified of the events the router writes
+ * to the binlog files
+ */
+typedef struct blr_listener
+{
+    void            (*notify)(void *data); /*< Called after an event is written */
+    void            *data;          /*< Passed to notify */
+    struct blr_listener *next;      /*< The next listener */
+} BLR_LISTENER;
+
+/**
+ * The I/O threads that send the catchup bursts of the slaves, so that the
+ * binlog file reads do not block the poll threads
+ */
+typedef struct
+{
+    SPINLOCK        lock;           /*< Protects the queue */
+    THREAD          *threads;       /*< The I/O threads */
+    int             n_threads;      /*< Number of running I/O threads */
+    bool            running;        /*< Cleared to stop the I/O threads */
+    ROUTER_SLAVE    *head;          /*< First slave waiting for a catchup burst */
+    ROUTER_SLAVE    *tail;          /*< Last slave waiting for a catchup burst */
+} BLCATCHUP_POOL;
+
 
 /**
  * The statistics for this router instance
@@ -390,6 +541,7 @@ typedef struct
     int             n_masterstarts; /*< Number of times connection restarted */
     int             n_delayedreconnects;
     int             n_residuals;    /*< Number of times residual data was buffered */
+    uint64_t        n_streamed;     /*< Packets of large events written as they arrived */
     int             n_heartbeats;   /*< Number of heartbeat messages */
     time_t          lastReply;
     uint64_t        n_fakeevents;   /*< Fake events not written to disk */
@@ -462,6 +614,8 @@ typedef struct router_instance
     uint8_t                 partial_checksum_bytes; /*< How many bytes of the checksum we have read  */
     uint64_t                checksum_size; /*< Data size for the checksum */
     REP_HEADER              stored_header; /*< Relication header of the event the master is sending */
+    uint32_t                master_packet_remaining; /*< Bytes of a packet of a large event that
+                                                      * are still to be received and written */
     uint64_t                last_safe_pos; /* last committed transaction */
     char                    binlog_name[BINLOG_FNAMELEN + 1];
     /*< Name of the current binlog file */
@@ -485,6 +639,24 @@ typedef struct router_instance
     unsigned int      short_burst;  /*< Short burst for slave catchup */
     unsigned int      long_burst;   /*< Long burst for slave catchup */
     unsigned long     burst_size;   /*< Maximum size of burst to send */
+    unsigned long     cache_size;   /*< Size of the binlog event cache */
+    BLCACHE           *cache;       /*< The binlog event cache, NULL if disabled */
+    bool              sendfile_catchup; /*< Send catchup events straight from the binlog files */
+    BLWRITEBUF        wbuf;         /*< The write buffer of the current binlog file */
+    blr_flush_t       flush_policy; /*< When the binlog file is synced to disk */
+    unsigned long     flush_interval; /*< Milliseconds between syncs with BLR_FLUSH_INTERVAL */
+    uint64_t          last_sync;    /*< When the binlog file was synced, see latency_now */
+    bool              gtid_indexing; /*< Whether the GTID index is kept */
+    BLGTID_INDEX      *gtid_index;  /*< The GTID index, NULL if not kept */
+    int               catchup_threads; /*< Number of catchup I/O threads, 0 for none */
+    BLCATCHUP_POOL    catchup;      /*< The catchup I/O threads */
+    BLFILTER_LIST     do_db;        /*< The replicate_do_db databases */
+    BLFILTER_LIST     ignore_db;    /*< The replicate_ignore_db databases */
+    BLFILTER_LIST     do_table;     /*< The replicate_do_table tables */
+    BLFILTER_LIST     ignore_table; /*< The replicate_ignore_table tables */
+    bool              compress_binlogs; /*< Compress the binlog files no longer written to */
+    bool              compress_running; /*< Cleared to stop the compression thread */
+    THREAD            compress_thread; /*< The thread that compresses the binlog files */
     unsigned long     heartbeat;    /*< Configured heartbeat value */
     ROUTER_STATS      stats;        /*< Statistics for this router */
     int               active_logs;
@@ -499,6 +671,7 @@ typedef struct router_instance
     char              *set_master_uuid; /*< Send custom Master UUID to slaves */
     char              *set_master_server_id; /*< Send custom Master server_id to slaves */
     int               send_slave_heartbeat; /*< Enable sending heartbeat to slaves */
+    BLR_LISTENER      *listeners;   /*< Notified of the distributed events, never removed */
     struct router_instance  *next;
 } ROUTER_INSTANCE;
 
@@ -607,16 +780,44 @@ extern int blr_master_connected(ROUTER_INSTANCE *);
 extern int blr_slave_request(ROUTER_INSTANCE *, ROUTER_SLAVE *, GWBUF *);
 extern void blr_slave_rotate(ROUTER_INSTANCE *, ROUTER_SLAVE *, uint8_t *);
 extern int blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large);
+extern bool blr_catchup_start(ROUTER_INSTANCE *);
+extern void blr_catchup_stop(ROUTER_INSTANCE *);
 extern void blr_init_cache(ROUTER_INSTANCE *);
+extern void blr_free_cache(ROUTER_INSTANCE *);
+extern void blr_cache_add(ROUTER_INSTANCE *, const char *, uint32_t, uint8_t *, uint32_t);
+extern GWBUF *blr_cache_read(ROUTER_INSTANCE *, const char *, uint32_t);
+extern void blr_gtid_index_open(ROUTER_INSTANCE *);
+extern void blr_gtid_index_close(ROUTER_INSTANCE *);
+extern void blr_gtid_index_add(ROUTER_INSTANCE *, uint32_t, uint32_t, uint64_t, const char *, uint32_t);
+extern bool blr_gtid_index_find(ROUTER_INSTANCE *, uint32_t, uint64_t, bool, BLGTID_RECORD *);
+extern bool blr_gtid_parse(const char *, uint32_t *, uint32_t *, uint64_t *);
+extern bool blr_gtid_start_position(ROUTER_INSTANCE *, const char *, char *, uint32_t *);
+extern BLFILTER_LIST *blr_filter_list(ROUTER_INSTANCE *, const char *);
+extern bool blr_filter_add(BLFILTER_LIST *, const char *);
+extern bool blr_filter_enabled(ROUTER_INSTANCE *);
+extern void blr_filter_free(ROUTER_INSTANCE *);
+extern bool blr_event_filtered(ROUTER_INSTANCE *, ROUTER_SLAVE *, REP_HEADER *, uint8_t *);
 
 extern int  blr_file_init(ROUTER_INSTANCE *);
 extern int  blr_write_binlog_record(ROUTER_INSTANCE *, REP_HEADER *, uint32_t pos, uint8_t *);
 extern int  blr_file_rotate(ROUTER_INSTANCE *, char *, uint64_t);
-extern void blr_file_flush(ROUTER_INSTANCE *);
+extern int  blr_file_flush(ROUTER_INSTANCE *);
+extern int  blr_file_event_flush(ROUTER_INSTANCE *);
+extern int  blr_file_sync(ROUTER_INSTANCE *);
+extern int  blr_file_write(ROUTER_INSTANCE *, uint8_t *, uint32_t);
+extern int  blr_file_read(ROUTER_INSTANCE *, int, const char *, uint8_t *, uint32_t, unsigned long);
+extern bool blr_file_buffered(ROUTER_INSTANCE *, const char *, unsigned long);
 extern BLFILE *blr_open_binlog(ROUTER_INSTANCE *, char *);
 extern GWBUF *blr_read_binlog(ROUTER_INSTANCE *, BLFILE *, unsigned long, REP_HEADER *, char *);
+extern bool blr_read_binlog_header(ROUTER_INSTANCE *, BLFILE *, unsigned long, REP_HEADER *, char *);
 extern void blr_close_binlog(ROUTER_INSTANCE *, BLFILE *);
 extern unsigned long blr_file_size(BLFILE *);
+extern BLZFILE *blr_zfile_open(int fd, const char *path);
+extern int blr_zfile_read(BLZFILE *, int fd, uint8_t *buf, uint32_t len, unsigned long pos);
+extern void blr_zfile_close(BLZFILE *);
+extern bool blr_compress_binlog(ROUTER_INSTANCE *, const char *binlog);
+extern bool blr_compress_start(ROUTER_INSTANCE *);
+extern void blr_compress_stop(ROUTER_INSTANCE *);
 extern int blr_statistics(ROUTER_INSTANCE *, ROUTER_SLAVE *, GWBUF *);
 extern int blr_ping(ROUTER_INSTANCE *, ROUTER_SLAVE *, GWBUF *);
 extern int blr_send_custom_error(DCB *, int, int, char *, char *, unsigned int);
@@ -635,6 +836,13 @@ extern bool blr_send_event(blr_thread_role_t role,
                            uint32_t binlog_pos,
                            ROUTER_SLAVE *slave,
                            REP_HEADER *hdr,
-                           uint8_t *buf);
+                           uint8_t *buf,
+                           GWBUF **shared);
+extern int blr_send_event_file(blr_thread_role_t role,
+                               const char* binlog_name,
+                               uint32_t binlog_pos,
+                               ROUTER_SLAVE *slave,
+                               REP_HEADER *hdr,
+                               int fd);
 
 #endif
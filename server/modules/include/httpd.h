@@ -16,6 +16,7 @@
  *
  * Date         Who                 Description
  * 08-07-2013   Massimiliano Pinto  Added HTTPD protocol header file
+ * 15/10/2016   Core Team           Keep-alive, pipelining and chunked replies
  */
 
 #include <stdio.h>
@@ -42,6 +43,8 @@
 #define HTTPD_USERAGENT_MAXLEN 1024
 #define HTTPD_FIELD_MAXLEN 8192
 #define HTTPD_REQUESTLINE_MAXLEN 8192
+#define HTTPD_REQUEST_MAXLEN 65536      /*< Largest accepted request head */
+#define HTTPD_CHUNK_SIZE 16384          /*< Reply data collected before a chunk is sent */
 
 /**
  * HTTPD session specific data
@@ -58,4 +61,9 @@ typedef struct httpd_session
     char *path_info;                /*< the Pathinfo, starts with /, is the extra path segments after the document name */
     char *query_string;             /*< the Query string, starts with ?, after path_info and document name */
     int headers_received;               /*< All the headers has been received, if 1 */
+    GWBUF *request;                 /*< Received data not yet handled as a request */
+    GWBUF *chunk;                   /*< Reply data not yet sent as a chunk */
+    bool keepalive;                 /*< Keep the connection open after the reply */
+    bool chunked;                   /*< The reply body is sent with chunked encoding */
+    bool in_body;                   /*< The router is writing the reply body */
 } HTTPD_session;
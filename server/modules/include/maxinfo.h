@@ -24,6 +24,7 @@
  *
  * Date     Who             Description
  * 16/02/15 Mark Riddoch    Initial implementation
+ * 15/10/2016 Core Team     Column lists and WHERE conditions in SELECT
  *
  * @endverbatim
  */
@@ -117,6 +118,8 @@ typedef struct maxinfo_tree
 #define LT_CLEAR        12
 #define LT_SHUTDOWN     13
 #define LT_RESTART      14
+#define LT_WHERE        15
+#define LT_AND          16
 
 
 /**
@@ -127,7 +130,8 @@ typedef enum
     PARSE_NOERROR,
     PARSE_MALFORMED_SHOW,
     PARSE_EXPECTED_LIKE,
-    PARSE_SYNTAX_ERROR
+    PARSE_SYNTAX_ERROR,
+    PARSE_MALFORMED_SELECT
 } PARSE_ERROR;
 
 
@@ -138,4 +142,5 @@ extern void         maxinfo_send_parse_error(DCB *, char *, PARSE_ERROR);
 extern void     maxinfo_send_error(DCB *, int, char  *);
 extern RESULTSET    *maxinfo_variables();
 extern RESULTSET    *maxinfo_status();
+extern RESULTSET    *maxinfo_table(const char *);
 #endif
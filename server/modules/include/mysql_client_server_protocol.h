@@ -61,6 +61,7 @@
 #include <version.h>
 #include <housekeeper.h>
 #include <mysql.h>
+#include <hashtable.h>
 
 #define GW_MYSQL_VERSION "5.5.5-10.0.0 "MAXSCALE_VERSION"-maxscale"
 #define GW_MYSQL_LOOP_TIMEOUT 300000000
@@ -81,6 +82,9 @@
 /** Maximum length of a MySQL packet */
 #define MYSQL_PACKET_LENGTH_MAX 0x00ffffff
 
+/** COM_RESET_CONNECTION, not in the command enum of the client library */
+#define GW_MYSQL_COM_RESET_CONNECTION 0x1f
+
 #ifndef MYSQL_SCRAMBLE_LEN
 # define MYSQL_SCRAMBLE_LEN GW_MYSQL_SCRAMBLE_SIZE
 #endif
@@ -212,6 +216,7 @@ typedef enum
     GW_MYSQL_CAPABILITIES_MULTI_RESULTS =          (1 << 17),
     GW_MYSQL_CAPABILITIES_PS_MULTI_RESULTS =       (1 << 18),
     GW_MYSQL_CAPABILITIES_PLUGIN_AUTH =            (1 << 19),
+    GW_MYSQL_CAPABILITIES_SESSION_TRACK =          (1 << 23),
     GW_MYSQL_CAPABILITIES_SSL_VERIFY_SERVER_CERT = (1 << 30),
     GW_MYSQL_CAPABILITIES_REMEMBER_OPTIONS =       (1 << 31),
     GW_MYSQL_CAPABILITIES_CLIENT = (GW_MYSQL_CAPABILITIES_LONG_PASSWORD |
@@ -241,6 +246,50 @@ typedef enum
                                             ),
 } gw_mysql_capabilities_t;
 
+/** The server status flag of the OK packets that carry session state changes */
+#ifndef SERVER_SESSION_STATE_CHANGED
+#define SERVER_SESSION_STATE_CHANGED (1 << 14)
+#endif
+
+/** The types of the session state changes in an OK packet */
+typedef enum
+{
+    MYSQL_SESSION_TRACK_SYSTEM_VARIABLES,
+    MYSQL_SESSION_TRACK_SCHEMA,
+    MYSQL_SESSION_TRACK_STATE_CHANGE,
+    MYSQL_SESSION_TRACK_GTIDS,
+    MYSQL_SESSION_TRACK_TRANSACTION_CHARACTERISTICS,
+    MYSQL_SESSION_TRACK_TRANSACTION_STATE
+} mysql_session_track_t;
+
+/** Length of the transaction state, one character for each kind of activity */
+#define MYSQL_TRX_STATE_LEN 8
+
+/** The longest GTID that is kept */
+#define MYSQL_GTID_MAXLEN 128
+
+/** OK packets longer than this are not looked at for session state changes */
+#define MYSQL_SESSION_TRACK_MAXLEN 4096
+
+/**
+ * The state of the session of a client as the replies to its queries tell it.
+ * The server status is in every OK packet and in the EOF packet that ends a
+ * result set. The rest is only known when the client requests the session
+ * state tracking, see the session_track parameter of the services.
+ */
+typedef struct
+{
+    uint64_t        query;          /*< The command whose reply set the state, 0 if none did */
+    bool            current;        /*< The state is the one after the previous command */
+    uint16_t        status;         /*< The server status flags */
+    char            schema[MYSQL_DATABASE_MAXLEN + 1];   /*< The default database, empty
+        * until a change is tracked */
+    char            trx_state[MYSQL_TRX_STATE_LEN + 1]; /*< The transaction state, empty
+        * until a change is tracked */
+    char            gtid[MYSQL_GTID_MAXLEN + 1];        /*< The GTID of the last transaction,
+        * empty until a change is tracked */
+} MYSQL_SESSION_STATE;
+
 typedef enum enum_server_command mysql_server_cmd_t;
 
 static const mysql_server_cmd_t MYSQL_COM_UNDEFINED = (mysql_server_cmd_t) - 1;
@@ -258,6 +307,19 @@ typedef struct server_command_st
     struct server_command_st* scom_next;
 } server_command_t;
 
+/**
+ * The part of the reply to a measured query that the client protocol expects
+ * next. The reply ends with an OK or an ERR packet, or with the EOF packet
+ * after the rows of a result set, unless that packet says more results follow.
+ */
+typedef enum
+{
+    MYSQL_REPLY_NONE,       /*< No query is measured */
+    MYSQL_REPLY_START,      /*< The first packet of a result */
+    MYSQL_REPLY_COLUMNS,    /*< The column definitions of a result set */
+    MYSQL_REPLY_ROWS        /*< The rows of a result set */
+} mysql_reply_state_t;
+
 /**
  * MySQL Protocol specific state data.
  *
@@ -287,6 +349,32 @@ typedef struct
     unsigned        long tid;                         /*< MySQL Thread ID, in
         * handshake */
     unsigned int    charset;                          /*< MySQL character set at connect time */
+    mysql_reply_state_t reply_state;                  /*< The part of the reply being written */
+    size_t          reply_skip;                       /*< Bytes of a reply packet not yet written */
+    HASHTABLE       *ps_types;                        /*< The types of the prepared statements
+        * of the client by statement ID, see MYSQL_PS_KEY */
+    bool            ps_pending;                       /*< A COM_STMT_PREPARE awaits its reply */
+    uint32_t        ps_pending_type;                  /*< The type of the awaited statement */
+    bool            compress;                         /*< The compressed protocol is in use */
+    uint8_t         compress_seq;                     /*< Sequence number of the next
+        * compressed packet written */
+    GWBUF           *compress_readq;                  /*< Incomplete compressed packets read */
+    bool            load_data;                        /*< The client sends the file of a
+        * LOAD DATA LOCAL INFILE */
+    bool            stream_next;                      /*< The next packet continues the
+        * previous packet */
+    size_t          stream_left;                      /*< Bytes of the streamed packet
+        * not yet read */
+    GWBUF           *sescmd_replyq;                   /*< Packets of an incomplete session
+        * command reply */
+    bool            reset_supported;                  /*< The server supports
+        * COM_RESET_CONNECTION */
+    bool            session_changed;                  /*< Commands that may have changed
+        * the session state were sent */
+    bool            reset_pending;                    /*< The reply to COM_RESET_CONNECTION
+        * has not been read */
+    uint64_t        command_seq;                      /*< Commands routed for the client */
+    MYSQL_SESSION_STATE session_state;                /*< The session state the replies tell */
 #if defined(SS_DEBUG)
     skygw_chk_t     protocol_chk_tail;
 #endif
@@ -316,10 +404,50 @@ typedef struct
 #define MYSQL_IS_COM_INIT_DB(payload)           (MYSQL_GET_COMMAND(payload)==MYSQL_COM_INIT_DB)
 #define MYSQL_IS_CHANGE_USER(payload)       (MYSQL_GET_COMMAND(payload)==MYSQL_COM_CHANGE_USER)
 #define MYSQL_GET_NATTR(payload)                ((int)payload[4])
+#define MYSQL_GET_STMT_ID(payload)              (gw_mysql_get_byte4(&payload[5]))
+#define MYSQL_GET_STMT_EXECUTE_FLAGS(payload)   (payload[9])
+
+/** The key of a prepared statement ID in MySQLProtocol.ps_types, the value is its type */
+#define MYSQL_PS_KEY(id)                        ((void*)(uintptr_t)(id))
+
+/**
+ * The header of a packet of the compressed protocol: the length of the
+ * compressed payload, the sequence number and the length of the payload
+ * before compression, zero if the payload is not compressed
+ */
+#define MYSQL_COMPRESSED_HEADER_LEN             7
 
+/** Payloads shorter than this are sent without compressing them */
+#define MYSQL_MIN_COMPRESS_LENGTH               50
+
+/** Largest payload of a compressed packet */
+#define MYSQL_COMPRESSED_MAX_PAYLOAD            0xffffff
+
+
+/**
+ * Return the server status after the previous command of a client. It tells
+ * whether a transaction is open and whether autocommit is enabled, even when
+ * a stored procedure changed them.
+ *
+ * @param proto     The protocol of the client
+ * @param status    Where the status is stored
+ * @return True if the complete reply to the previous command has been written
+ *         to the client and it ended with a status
+ */
+static inline bool mysql_session_status(MySQLProtocol *proto, uint16_t *status)
+{
+    if (proto->session_state.current)
+    {
+        *status = proto->session_state.status;
+        return true;
+    }
+    return false;
+}
 
 MySQLProtocol* mysql_protocol_init(DCB* dcb, int fd);
 void           mysql_protocol_done (DCB* dcb);
+int            mysql_compressed_read(DCB *dcb, GWBUF **head, int maxbytes);
+GWBUF*         mysql_compress(MySQLProtocol *proto, GWBUF *queue, bool command);
 const char *gw_mysql_protocol_state2string(int state);
 int        mysql_send_com_quit(DCB* dcb, int packet_number, GWBUF* buf);
 GWBUF*     mysql_create_com_quit(GWBUF* bufparam, int packet_number);
@@ -0,0 +1,117 @@
+#ifndef _QLAFILTER_H
+#define _QLAFILTER_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file qlafilter.h - The binary format of the unified query log
+ *
+ * A binary log file starts with a header of QLA_BINARY_HEADER_LEN bytes,
+ * the QLA_BINARY_MAGIC string followed by the format version and a zero
+ * byte. The header is followed by the records. All integers are stored in
+ * little-endian byte order.
+ *
+ * The records of a capture, version QLA_CAPTURE_VERSION, have the same
+ * layout but the statement is the payload of the command packet: the
+ * command byte followed by its argument. The captured commands are
+ * COM_QUERY, COM_INIT_DB and the pseudo commands QLA_COM_CONNECT, whose
+ * argument is the default database of the session, and COM_QUIT, which
+ * the filter logs when the session is closed. Every captured session thus
+ * starts with a connect record and ends with a quit record.
+ *
+ * @verbatim
+ * Record layout
+ *
+ * Offset  Size  Description
+ *  0      4     Length of the whole record, including this field
+ *  4      8     Time the statement was received, microseconds since the epoch
+ * 12      4     Session ID
+ * 16      2     Length of the user name
+ * 18      2     Length of the client address
+ * 20      4     Length of the statement, or of the command in a capture
+ * 24      -     The user name, the client address and the statement, not
+ *               NUL terminated
+ *
+ * Revision History
+ *
+ * Date         Who             Description
+ * 15/10/2016   Core Team       Initial implementation
+ * 15/10/2016   Core Team       The capture format
+ *
+ * @endverbatim
+ */
+
+#include <stdint.h>
+
+/** The magic string at the start of a binary log file */
+#define QLA_BINARY_MAGIC "MXSQLA"
+#define QLA_BINARY_MAGIC_LEN 6
+
+/** The version of the binary format */
+#define QLA_BINARY_VERSION 1
+
+/** The version of the capture format */
+#define QLA_CAPTURE_VERSION 2
+
+/** The command of the connect records of a capture, not a valid MySQL command */
+#define QLA_COM_CONNECT 0xff
+
+/** Length of the file header */
+#define QLA_BINARY_HEADER_LEN 8
+
+/** Length of the fixed part of a record */
+#define QLA_RECORD_HEADER_LEN 24
+
+/** Offsets of the fields of a record */
+#define QLA_RECORD_LEN_OFFSET       0
+#define QLA_RECORD_TIME_OFFSET      4
+#define QLA_RECORD_SESSION_OFFSET   12
+#define QLA_RECORD_USER_LEN_OFFSET  16
+#define QLA_RECORD_REMOTE_LEN_OFFSET 18
+#define QLA_RECORD_SQL_LEN_OFFSET   20
+
+/**
+ * Store an integer in little-endian byte order
+ *
+ * @param ptr   Where to store the integer
+ * @param value The integer
+ * @param bytes Number of bytes to store
+ */
+static inline void qla_set_uint(uint8_t *ptr, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        ptr[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+/**
+ * Read an integer stored in little-endian byte order
+ *
+ * @param ptr   The integer
+ * @param bytes Number of bytes to read
+ * @return The integer
+ */
+static inline uint64_t qla_get_uint(const uint8_t *ptr, int bytes)
+{
+    uint64_t value = 0;
+
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+        value = (value << 8) | ptr[i];
+    }
+
+    return value;
+}
+
+#endif
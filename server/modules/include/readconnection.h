@@ -26,6 +26,9 @@
  * @endverbatim
  */
 #include <dcb.h>
+#include <statistics.h>
+#include <affinity.h>
+#include <service.h>
 
 /**
  * Internal structure used to define the set of backend servers we are routing
@@ -35,8 +38,10 @@
 typedef struct backend
 {
     SERVER *server; /*< The server itself */
-    int current_connection_count; /*< Number of connections to the server */
+    ts_stats_t connections; /*< Number of connections to the server, counted
+                             * separately by each thread */
     int weight; /*< Desired routing weight */
+    BACKEND_STATS *stats; /*< Statistics of the traffic routed to the server */
 } BACKEND;
 
 /**
@@ -55,6 +60,9 @@ typedef struct router_client_session
     DCB *client_dcb; /**< Client DCB */
     struct router_client_session *next;
     int rses_capabilities; /*< input type, for example */
+    bool splice_tried; /*< Whether the DCBs have been spliced */
+    uint64_t query_start; /*< When the last query was routed, zero once
+                           * its reply has started */
 #if defined(SS_DEBUG)
     skygw_chk_t rses_chk_tail;
 #endif
@@ -67,6 +75,7 @@ typedef struct
 {
     int n_sessions; /*< Number sessions created     */
     int n_queries; /*< Number of queries forwarded */
+    int n_spliced; /*< Number of sessions spliced */
 } ROUTER_STATS;
 
 /**
@@ -78,9 +87,12 @@ typedef struct router_instance
     ROUTER_CLIENT_SES *connections; /*< Link list of all the client connections  */
     SPINLOCK lock; /*< Spinlock for the instance data           */
     BACKEND **servers; /*< List of backend servers                  */
+    int n_servers; /*< Number of backend servers                */
     unsigned int bitmask; /*< Bitmask to apply to server->status       */
     unsigned int bitvalue; /*< Required value of server->status         */
     ROUTER_STATS stats; /*< Statistics for this router               */
+    bool splice; /*< Splice the client and backend connections  */
+    affinity_key_t affinity; /*< The key that sessions are hashed on */
     struct router_instance
         *next;
 } ROUTER_INSTANCE;
@@ -26,6 +26,12 @@
 
 #include <dcb.h>
 #include <hashtable.h>
+#include <affinity.h>
+#include <snapshot.h>
+#include <slab.h>
+#include <service.h>
+#include <timer.h>
+#include <maxscale_pcre2.h>
 #include <math.h>
 
 #undef PREP_STMT_CACHING
@@ -54,15 +60,32 @@ typedef enum bref_state
     BREF_WAITING_RESULT   = 0x02, /*< for session commands only */
     BREF_QUERY_ACTIVE     = 0x04, /*< for other queries */
     BREF_CLOSED           = 0x08,
-    BREF_SESCMD_FAILED    = 0x10 /*< Backend references that should be dropped */
+    BREF_SESCMD_FAILED    = 0x10, /*< Backend references that should be dropped */
+    BREF_CONNECT_RACE     = 0x20, /*< A slave connection racing another one to finish
+                                   * its handshake first */
+    BREF_HEDGE_DRAIN      = 0x40 /*< A slave discarding its reply to a hedged read
+                                  * that another slave answered first */
 } bref_state_t;
 
+/**
+ * Where the reply to a statement is when its packets are tracked
+ */
+typedef enum reply_state
+{
+    REPLY_STATE_START,       /*< Expecting the first packet of a result */
+    REPLY_STATE_RSET_COLDEF, /*< Reading the column definitions of a resultset */
+    REPLY_STATE_RSET_ROWS,   /*< Reading the rows of a resultset */
+    REPLY_STATE_PS_DEFS      /*< Reading the definitions that follow COM_STMT_PREPARE_OK */
+} reply_state_t;
+
 #define BREF_IS_NOT_USED(s)         ((s)->bref_state & ~BREF_IN_USE)
 #define BREF_IS_IN_USE(s)           ((s)->bref_state & BREF_IN_USE)
 #define BREF_IS_WAITING_RESULT(s)   ((s)->bref_num_result_wait > 0)
 #define BREF_IS_QUERY_ACTIVE(s)     ((s)->bref_state & BREF_QUERY_ACTIVE)
 #define BREF_IS_CLOSED(s)           ((s)->bref_state & BREF_CLOSED)
 #define BREF_HAS_FAILED(s)          ((s)->bref_state & BREF_SESCMD_FAILED)
+#define BREF_IS_RACING(s)           ((s)->bref_state & BREF_CONNECT_RACE)
+#define BREF_IS_DRAINING(s)         ((s)->bref_state & BREF_HEDGE_DRAIN)
 
 typedef enum backend_type_t
 {
@@ -116,8 +139,10 @@ typedef enum select_criteria
     LEAST_ROUTER_CONNECTIONS,   /*< connections established by this router */
     LEAST_BEHIND_MASTER,
     LEAST_CURRENT_OPERATIONS,
-    DEFAULT_CRITERIA   = LEAST_CURRENT_OPERATIONS,
-    LAST_CRITERIA               /*< not used except for an index */
+    LEAST_RESPONSE_TIME,        /*< average response time of the recent queries */
+    AFFINITY,                   /*< consistent hash of the key of the session */
+    LAST_CRITERIA,              /*< not used except for an index */
+    DEFAULT_CRITERIA   = LEAST_CURRENT_OPERATIONS
 } select_criteria_t;
 
 
@@ -134,7 +159,36 @@ typedef enum select_criteria
         strncmp(s,"LEAST_ROUTER_CONNECTIONS", strlen("LEAST_ROUTER_CONNECTIONS")) == 0 ?        \
         LEAST_ROUTER_CONNECTIONS : (                                                            \
         strncmp(s,"LEAST_CURRENT_OPERATIONS", strlen("LEAST_CURRENT_OPERATIONS")) == 0 ?        \
-        LEAST_CURRENT_OPERATIONS : UNDEFINED_CRITERIA))))
+        LEAST_CURRENT_OPERATIONS : (                                                            \
+        strncmp(s,"LEAST_RESPONSE_TIME", strlen("LEAST_RESPONSE_TIME")) == 0 ?                  \
+        LEAST_RESPONSE_TIME : (                                                                 \
+        strncmp(s,"AFFINITY", strlen("AFFINITY")) == 0 ?                                        \
+        AFFINITY : UNDEFINED_CRITERIA))))))
+
+/**
+ * The weight of the previous average when a new response time is added to
+ * the moving average of a backend: avg += (sample - avg) / weight
+ */
+#define RESPONSE_TIME_AVG_WEIGHT 8
+
+/** How often the p95 response time of a slave is computed for hedge_delay=p95,
+ * in microseconds */
+#define HEDGE_P95_INTERVAL 100000
+
+/**
+ * With LEAST_RESPONSE_TIME, one in this many slave selections uses
+ * LEAST_CURRENT_OPERATIONS instead so that the servers which were left
+ * idle because of a slow average get new samples.
+ */
+#define RESPONSE_TIME_EXPLORE_RATIO 16
+
+/**
+ * The query types a multi-statement query may consist of to be routed as a
+ * read instead of locking the session to the master
+ */
+#define MULTI_STMT_READ_TYPES (QUERY_TYPE_READ | QUERY_TYPE_LOCAL_READ |         \
+                               QUERY_TYPE_SYSVAR_READ | QUERY_TYPE_GSYSVAR_READ | \
+                               QUERY_TYPE_SHOW_TABLES)
 
 /**
  * Session variable command
@@ -152,6 +206,10 @@ typedef struct mysql_sescmd_st
                                    *  LOCAL_INFILE. Slave servers are compared to this
                                    *  when they return session command replies.*/
     int      position; /*< Position of this command */
+    char*    my_sescmd_key; /*< Session state this command sets or NULL if the
+                             *  command can't be compacted from the history */
+    uint32_t my_sescmd_ps_id; /*< The statement ID the client sees for a
+                               *  COM_STMT_PREPARE, 0 for other commands */
 #if defined(SS_DEBUG)
     skygw_chk_t        my_sescmd_chk_tail;
 #endif
@@ -211,6 +269,13 @@ typedef struct backend_st
     int             backend_conn_count;  /*< Number of connections to the server */
     bool            be_valid; /*< Valid when belongs to the router's configuration */
     int             weight; /*< Desired weighting on the load. Expressed in .1% increments */
+    int             backend_response_time; /*< Moving average of the query response
+                                            *  time in microseconds, 0 if not measured */
+    BACKEND_STATS*  backend_stats; /*< Statistics of the traffic routed to the server */
+    int             backend_hedge_delay; /*< The p95 response time in microseconds
+                                          *  when hedge_delay=p95 */
+    uint64_t        backend_hedge_updated; /*< When backend_hedge_delay was computed */
+    int             hint_id; /*< The ID of the server name in the routing hints */
 #if defined(SS_DEBUG)
     skygw_chk_t     be_chk_tail;
 #endif
@@ -231,9 +296,33 @@ typedef struct backend_ref_st
     bref_state_t    bref_state;
     int             bref_num_result_wait;
     sescmd_cursor_t bref_sescmd_cur;
-    GWBUF*          bref_pending_cmd; /**< For stmt which can't be routed due active sescmd execution */
+    GWBUF*          bref_pending_cmd; /**< Queue of stmts which can't be routed due active sescmd execution */
     unsigned char   reply_cmd;  /**< The reply the backend server sent to a session command.
                                  * Used to detect slaves that fail to execute session command. */
+    uint64_t        bref_query_start; /**< When the active query was sent, in microseconds */
+    int             bref_reply_count; /**< Statements whose replies haven't fully arrived,
+                                       * only tracked when multiplexing */
+    reply_state_t   bref_reply_state; /**< Position in the reply being read */
+    uint32_t        bref_reply_defs;  /**< Definition packets left in a prepare reply */
+    int             bref_n_queued;    /**< Statements in bref_pending_cmd */
+    int             bref_n_batch;     /**< Statements sent from bref_pending_cmd, or after
+                                       * them, whose replies haven't ended */
+    uint32_t*       bref_ps_fifo;     /**< For the statements counted in bref_n_batch and
+                                       * then in bref_n_queued, in order: the ID the client
+                                       * sees for a COM_STMT_PREPARE, 0 for the others */
+    int             bref_ps_fifo_size; /**< Size of bref_ps_fifo */
+    bool            bref_sescmd_partial; /**< The rest of the reply to the current
+                                          * session command is still to come */
+    bool            bref_sescmd_forward; /**< The reply to the current session
+                                          * command is sent to the client */
+    uint32_t*       bref_ps_ids;      /**< The IDs of the prepared statements in this backend,
+                                       * indexed by the ID the client sees */
+    uint32_t        bref_ps_ids_size; /**< Size of bref_ps_ids */
+    uint32_t        bref_ps_pending;  /**< ID for the reply of a COM_STMT_PREPARE that
+                                       * was routed only to this backend */
+    double          bref_affinity;    /**< Score of the server for the affinity key of
+                                       * the session, zero if the session has no key */
+    DCB*            bref_race_dcb;    /**< The other connection of a connect race */
 #if defined(SS_DEBUG)
     skygw_chk_t     bref_chk_tail;
 #endif
@@ -249,6 +338,50 @@ enum failure_mode
     RW_ERROR_ON_WRITE /**< Don't close the connection but send an error for writes */
 };
 
+/**
+ * The queries of the connectors that the router can answer without the
+ * backends, the bits of rw_local_queries. The cached system variables use
+ * the bits of their server_var_t values.
+ */
+#define RW_LOCAL_VAR(v)      (1 << (v))
+#define RW_LOCAL_PING        (1 << SERVER_N_VARS)       /**< SELECT 1 */
+#define RW_LOCAL_AUTOCOMMIT  (1 << (SERVER_N_VARS + 1)) /**< @@autocommit from the session state */
+#define RW_LOCAL_ALL         ((1 << (SERVER_N_VARS + 2)) - 1)
+
+/** What a pool rule matches */
+typedef enum pool_match
+{
+    POOL_MATCH_USER,  /**< The user of the session */
+    POOL_MATCH_HINT,  /**< A pool=<name> hint of the statement */
+    POOL_MATCH_REGEX, /**< A regular expression matching the statement */
+    POOL_MATCH_TABLE  /**< A table that the statement uses */
+} pool_match_t;
+
+/**
+ * A rule which sends the matching reads to a pool, the slaves which carry a
+ * tag. A tag is a server parameter with a given value.
+ */
+typedef struct pool_rule
+{
+    pool_match_t       match;     /**< What the rule matches */
+    char*              value;     /**< The user, hint, table or pattern */
+    MXS_PCRE2_PATTERN* re;        /**< The compiled pattern of a POOL_MATCH_REGEX rule */
+    char*              tag_name;  /**< The server parameter of the tag */
+    char*              tag_value; /**< The value of the tag */
+    struct pool_rule*  next;      /**< The next rule in the file */
+} POOL_RULE;
+
+/**
+ * The pool rules read from a file. The sessions refer to the rules without
+ * copying them, so a router keeps every set it has read until it is freed.
+ */
+typedef struct pool_rules
+{
+    char*              path;  /**< The file the rules were read from */
+    POOL_RULE*         rules; /**< The rules in the order of the file */
+    struct pool_rules* next;  /**< The previously read set of the router */
+} POOL_RULES;
+
 typedef struct rwsplit_config_st
 {
     int               rw_max_slave_conn_percent; /**< Maximum percentage of slaves
@@ -256,17 +389,55 @@ typedef struct rwsplit_config_st
     int               rw_max_slave_conn_count; /**< Maximum number of slaves for each connection*/
     select_criteria_t rw_slave_select_criteria; /**< The slave selection criteria */
     int               rw_max_slave_replication_lag; /**< Maximum replication lag */
+    int               rw_max_slave_replication_lag_ms; /**< Maximum replication lag in
+                                                        * milliseconds, overrides the
+                                                        * limit in seconds */
     target_t          rw_use_sql_variables_in; /**< Whether to send user variables
                                                 * to master or all nodes */
     int               rw_max_sescmd_history_size; /**< Maximum amount of session commands to store */
     bool              rw_disable_sescmd_hist; /**< Disable session command history */
+    bool              rw_compact_sescmd_hist; /**< Drop superseded session commands
+                                               * from the history */
     bool              rw_master_reads; /**< Use master for reads */
     bool              rw_strict_multi_stmt; /**< Force non-multistatement queries to be routed
                                              * to the master after a multistatement query. */
     enum failure_mode rw_master_failure_mode; /**< Master server failure handling mode.
                                                * @see enum failure_mode */
+    bool              rw_causal_reads; /**< Route reads after a write only to slaves
+                                        * that have replicated the write */
+    bool              rw_lazy_connect; /**< Connect to the slaves on the first read */
+    bool              rw_multiplex; /**< Return the backend connections of an idle
+                                     * session to the connection pool */
+    affinity_key_t    rw_affinity_key; /**< The key hashed by the AFFINITY criteria */
+    uint32_t          rw_local_queries; /**< The queries answered without the backends,
+                                         * RW_LOCAL_ bits */
+    int               rw_slave_connect_fallback; /**< Milliseconds after which a slave that
+                                                  * hasn't finished its handshake gets a
+                                                  * fallback connection, 0 if disabled */
+    POOL_RULES*       rw_pool_rules; /**< The rules routing reads to tagged slaves, NULL if none */
+    bool              rw_galera_write_hash; /**< Spread the writes over the Galera nodes
+                                             * by hashing their tables */
+    int               rw_hedge_delay; /**< Milliseconds after which a read that a slave
+                                       * hasn't started to answer is sent to a second
+                                       * slave, RW_HEDGE_P95 or 0 if disabled */
+    int               rw_hedge_budget; /**< Maximum percentage of the reads that are hedged */
 } rwsplit_config_t;
 
+/** The reads are hedged after the p95 response time of their slave */
+#define RW_HEDGE_P95 -1
+/** The default maximum percentage of the reads that are hedged */
+#define RW_HEDGE_BUDGET_DEFAULT 10
+
+/**
+ * A published version of the router configuration, the sessions copy the
+ * latest one when they are created.
+ */
+typedef struct rwsplit_config_snapshot_st
+{
+    rwsplit_config_t config;  /**< The configuration */
+    int              version; /**< Service configuration version the snapshot was built from */
+} rwsplit_config_snapshot_t;
+
 #if defined(PREP_STMT_CACHING)
 
 typedef struct prep_stmt_st
@@ -301,8 +472,9 @@ struct router_client_session
     int              rses_versno;    /*< even = no active update, else odd. not used 4/14 */
     bool             rses_closed;    /*< true when closeSession is called */
     rses_property_t* rses_properties[RSES_PROP_TYPE_COUNT]; /*< Properties listed by their type */
+    SLAB_POOL        rses_prop_pool; /*< The properties are allocated from here */
     backend_ref_t*   rses_master_ref;
-    backend_ref_t*   rses_backend_ref; /*< Pointer to backend reference array */
+    backend_ref_t*   rses_backend_ref; /*< Backend reference array, allocated with the session */
     rwsplit_config_t rses_config;    /*< copied config info from router instance */
     int              rses_nbackends;
     int              rses_nsescmd;  /*< Number of executed session commands */
@@ -310,10 +482,24 @@ struct router_client_session
     bool             rses_transaction_active;
     bool             rses_load_active; /*< If LOAD DATA LOCAL INFILE is being currently executed */
     bool             have_tmp_tables;
+    bool             rses_write_active; /*< If a write is waiting for its reply from the master */
+    uint64_t         rses_last_write; /*< When the last write was replied to, 0 if none */
+    bool             rses_slaves_pending; /*< The slaves are connected on the first read */
+    SERVER*          rses_ro_trx_server; /*< Slave the read-only transaction is pinned to */
+    bool             rses_backends_released; /*< The backends were returned to the pool */
+    bool             rses_multiplex_blocked; /*< The session has state that can't be replayed */
+    bool             rses_ro_trx_next; /*< SET TRANSACTION READ ONLY was routed to rses_ro_trx_server */
+    uint32_t         rses_local_vars_set; /*< RW_LOCAL_VAR bits of the variables the session has set */
     uint64_t         rses_load_data_sent; /*< How much data has been sent */
     DCB*             client_dcb;
     int              pos_generator;
+    uint32_t         rses_ps_seq; /*< The last prepared statement ID given to the client */
     backend_ref_t    *forced_node; /*< Current server where all queries should be sent */
+    backend_ref_t    *rses_stream_bref; /*< Where the streamed continuation of a packet goes */
+    TIMER            rses_fallback_timer; /*< Starts and ends the fallback slave connections */
+    TIMER            rses_hedge_timer; /*< Sends the hedged read to a second slave */
+    GWBUF*           rses_hedge_query; /*< The read to hedge, NULL once it is sent or dropped */
+    backend_ref_t    *rses_hedge_bref[2]; /*< The slaves of the undecided hedged read */
 #if defined(PREP_STMT_CACHING)
     HASHTABLE*       rses_prep_stmt[2];
 #endif
@@ -334,6 +520,12 @@ typedef struct
     int     n_master;   /*< Number of stmts sent to master */
     int     n_slave;    /*< Number of stmts sent to slave */
     int     n_all;      /*< Number of stmts sent to all */
+    int     n_local;    /*< Number of queries answered by the router */
+    int     n_fallback; /*< Number of fallback slave connections started */
+    int     n_pool;     /*< Number of stmts sent to a pool of tagged slaves */
+    int     n_write_hash; /*< Number of writes routed by hashing their tables */
+    int     n_hedged;   /*< Number of reads sent to a second slave */
+    int     n_hedge_won; /*< Number of hedged reads the second slave answered first */
 } ROUTER_STATS;
 
 /**
@@ -348,6 +540,9 @@ typedef struct router_instance
     BACKEND*                master;      /*< NULL or pointer */
     rwsplit_config_t        rwsplit_config; /*< expanded config info from SERVICE */
     int                     rwsplit_version; /*< version number for router's config */
+    SNAPSHOT                rwsplit_snapshot; /*< The published rwsplit_config_snapshot_t */
+    SPINLOCK                config_lock; /*< Held while a new configuration is built */
+    POOL_RULES*             pool_rules;  /*< Every set of pool rules the router has read */
     ROUTER_STATS            stats;       /*< Statistics for this router */
     struct router_instance* next;        /*< Next router on the list */
     bool                    available_slaves; /*< The router has some slaves avialable */
@@ -0,0 +1,85 @@
+#ifndef _SCATTER_GATHER_H
+#define _SCATTER_GATHER_H
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file scatter_gather.h - Merging the resultsets of a SELECT sent to several shards
+ *
+ * A SELECT that reads one table that is split across shards is sent to all
+ * of them. The rows of the resultsets are merged as they arrive: without an
+ * ORDER BY they are returned in the order they are received, with one the
+ * shards are merged on the ORDER BY columns. A LIMIT is pushed down to the
+ * shards and applied to the merged rows.
+ */
+
+#include <stdbool.h>
+#include <buffer.h>
+
+typedef struct scatter SCATTER;
+
+/**
+ * Check if a query can be merged from several shards and create the merge
+ * state for it
+ *
+ * @param query       A complete COM_QUERY packet
+ * @param shard_query The query to send to the shards is stored here
+ * @return The merge state or NULL if the query can't be merged
+ */
+SCATTER* scatter_create(GWBUF* query, GWBUF** shard_query);
+
+/**
+ * Add a shard to the merge
+ *
+ * @param sc  The merge state
+ * @param tag Identifies the shard in the other calls
+ * @return True on success, false on memory allocation failure
+ */
+bool scatter_add_shard(SCATTER* sc, const void* tag);
+
+/**
+ * Check if a shard takes part in the merge and has not returned its
+ * whole resultset yet
+ */
+bool scatter_is_pending(SCATTER* sc, const void* tag);
+
+/**
+ * Process a reply from a shard
+ *
+ * @param sc         The merge state
+ * @param tag        The shard
+ * @param reply      The reply, freed by this function
+ * @param shard_done Set to true when the shard has returned its whole resultset
+ * @return Packets to send to the client or NULL
+ */
+GWBUF* scatter_process_reply(SCATTER* sc, const void* tag, GWBUF* reply, bool* shard_done);
+
+/**
+ * End the reply of a shard with an error, for example when the connection
+ * to it is lost. What the shard has returned so far is discarded.
+ *
+ * @param sc    The merge state
+ * @param tag   The shard
+ * @param error An error packet, freed by this function
+ * @return Packets to send to the client or NULL
+ */
+GWBUF* scatter_shard_error(SCATTER* sc, const void* tag, GWBUF* error);
+
+/**
+ * Check if all shards have replied and the merged resultset has been returned
+ */
+bool scatter_is_complete(SCATTER* sc);
+
+void scatter_free(SCATTER* sc);
+
+#endif
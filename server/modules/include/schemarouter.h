@@ -31,6 +31,9 @@
 #include <hashtable.h>
 #include <mysql_client_server_protocol.h>
 #include <pcre2.h>
+#include <scatter_gather.h>
+#include <service.h>
+#include <slab.h>
 /**
  * Bitmask values for the router session's initialization. These values are used
  * to prevent responses from internal commands being forwarded to the client.
@@ -60,15 +63,22 @@ enum shard_map_state
 };
 
 /**
- * A map of the shards tied to a single user.
+ * A map of the shards tied to a single user or, with the shared_shard_map
+ * option, shared by all the sessions of the router instance.
  */
 typedef struct shard_map
 {
     HASHTABLE *hash; /*< A hashtable of database names and the servers which
                        * have these databases. */
+    HASHTABLE *tables; /*< Servers of the tables by db.table, NULL unless
+                        * table level sharding is used */
+    HASHTABLE *scattered; /*< Comma separated servers of the tables that are
+                           * split across servers, NULL unless scatter_gather
+                           * is used */
     SPINLOCK lock;
     time_t last_updated;
     enum shard_map_state state; /*< State of the shard map */
+    int refcount; /*< Number of sessions and routers using a shared shard map */
 } shard_map_t;
 
 /**
@@ -241,6 +251,7 @@ typedef struct backend_st
     {
         int queries;
     } stats;
+    BACKEND_STATS*  backend_stats; /*< Statistics of the traffic routed to the server */
 #if defined(SS_DEBUG)
     skygw_chk_t     be_chk_tail;
 #endif
@@ -263,10 +274,14 @@ typedef struct backend_ref_st
     DCB*            bref_dcb; /*< Backend DCB */
     bref_state_t    bref_state; /*< State of the backend */
     bool            bref_mapped; /*< Whether the backend has been mapped */
+    bool            bref_map_late; /*< The reply to SHOW DATABASES timed out and
+                                    * is discarded when it arrives */
     bool            last_sescmd_replied;
     int             bref_num_result_wait; /*< Number of not yet received results */
     sescmd_cursor_t bref_sescmd_cur; /*< Session command cursor */
     GWBUF*          bref_pending_cmd; /*< For stmt which can't be routed due active sescmd execution */
+    uint64_t        bref_query_start; /*< When the query being replied to was sent,
+                                       * zero once its reply has started */
 #if defined(SS_DEBUG)
     skygw_chk_t     bref_chk_tail;
 #endif
@@ -286,6 +301,11 @@ typedef struct schemarouter_config_st
     double refresh_min_interval; /*< Minimum required interval between refreshes of databases */
     bool refresh_databases; /*< Are databases refreshed when they are not found in the hashtable */
     bool debug; /*< Enable verbose debug messages to clients */
+    bool shared_shard_map; /*< Use the shard map of the router instance */
+    bool table_sharding; /*< Map the tables of the shared shard map to servers */
+    bool scatter_gather; /*< Merge SELECTs from all servers of a split table */
+    int mapping_timeout; /*< Seconds to wait for the servers to reply to
+                          * SHOW DATABASES, 0 for no limit */
 } schemarouter_config_t;
 
 /**
@@ -304,6 +324,9 @@ typedef struct
     double          ses_average; /*< Average session length */
     int             shmap_cache_hit; /*< Shard map was found from the cache */
     int             shmap_cache_miss;/*< No shard map found from the cache */
+    int             n_scatter;       /*< Queries merged from several servers */
+    int             n_mapping_timeouts; /*< Servers that did not reply to
+                                         * SHOW DATABASES in time */
 } ROUTER_STATS;
 
 /**
@@ -321,8 +344,9 @@ struct router_client_session
     MYSQL_session*   rses_mysql_session; /*< Session client data (username, password, SHA1). */
     /** Properties listed by their type */
     rses_property_t* rses_properties[RSES_PROP_TYPE_COUNT]; /*< Session properties */
+    SLAB_POOL        rses_prop_pool; /*< The properties are allocated from here */
     backend_ref_t*   rses_master_ref; /*< Router session master reference */
-    backend_ref_t*   rses_backend_ref; /*< Pointer to backend reference array */
+    backend_ref_t*   rses_backend_ref; /*< Backend reference array, allocated with the session */
     schemarouter_config_t rses_config;    /*< Copied config info from router instance */
     int              rses_nbackends; /*< Number of backends */
     bool             rses_autocommit_enabled; /*< Is autocommit enabled */
@@ -337,6 +361,10 @@ struct router_client_session
     GWBUF*          queue; /*< Query that was received before the session was ready */
     DCB*            dcb_route; /*< Internal DCB used to trigger re-routing of buffers */
     DCB*            dcb_reply; /*< Internal DCB used to send replies to the client */
+    SCATTER*        rses_scatter; /*< The SELECT being merged from several servers */
+    GWBUF*          rses_scatter_queue; /*< Queries received during the merge */
+    time_t          rses_mapping_start; /*< When the database mapping was started */
+    bool            rses_mapping_expired; /*< The mapping has timed out */
     ROUTER_STATS    stats;     /*< Statistics for this router         */
     int             n_sescmd;
     int             pos_generator;
@@ -352,6 +380,9 @@ struct router_client_session
 typedef struct router_instance
 {
     HASHTABLE*              shard_maps;  /*< Shard maps hashed by user name */
+    shard_map_t*            shard_map;   /*< The shard map of the instance, built
+                                          * by a housekeeper task when the
+                                          * shared_shard_map option is used */
     SERVICE*                service;     /*< Pointer to service                 */
     ROUTER_CLIENT_SES*      connections; /*< List of client connections         */
     SPINLOCK                lock;        /*< Lock for the instance data         */
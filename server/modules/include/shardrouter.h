@@ -81,6 +81,7 @@ typedef enum rses_property_type_t
 #define SUBSVC_IS_CLOSED(s)         (s->state & SUBSVC_CLOSED)
 #define SUBSVC_IS_OK(s)         (s->state & SUBSVC_OK)
 #define SUBSVC_IS_WAITING(s)         (s->state & SUBSVC_WAITING_RESULT)
+#define SUBSVC_IS_CONNECTING(s)      (s->state & SUBSVC_CONNECTING)
 
 /**
  * Session variable command
@@ -151,7 +152,8 @@ typedef enum
     SUBSVC_FAILED = (1 << 2), /* This is when something went wrong */
     SUBSVC_QUERY_ACTIVE = (1 << 3),
     SUBSVC_WAITING_RESULT = (1 << 4),
-    SUBSVC_MAPPED = (1 << 5)
+    SUBSVC_MAPPED = (1 << 5),
+    SUBSVC_CONNECTING = (1 << 6) /* The session is being opened in a worker thread */
 } subsvc_state_t;
 
 typedef struct subservice_t
@@ -159,7 +161,9 @@ typedef struct subservice_t
     SERVICE* service;
     SESSION* session;
     DCB* dcb;
-    GWBUF* pending_cmd;
+    GWBUF* queue; /* Queries routed before the session was opened or while
+                   * the session command history is executed */
+    ROUTER_CLIENT_SES* rses; /* The router session the subservice belongs to */
     sescmd_cursor_t* scur;
     int state;
     int n_res_waiting;
@@ -211,6 +215,9 @@ struct router_client_session
     char            connect_db[MYSQL_DATABASE_MAXLEN + 1]; /*< Database the user was trying to connect to */
     char            current_db[MYSQL_DATABASE_MAXLEN + 1]; /*< Current active database */
     shard_init_mask_t    init; /*< Initialization state bitmask */
+    int             n_connecting; /*< Subservice sessions still being opened */
+    bool            rses_freed; /*< freeSession was called while subservice
+                                 * sessions were being opened */
 #if defined(SS_DEBUG)
     skygw_chk_t      rses_chk_tail;
 #endif
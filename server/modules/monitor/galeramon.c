@@ -29,6 +29,7 @@
  * 22/04/15 Martin Brampton     Addition of disableMasterRoleSetting
  * 08/05/15 Markus Makela       Addition of launchable scripts
  * 17/10/15 Martin Brampton     Change DCB callback to hangup
+ * 15/10/16 Core Team           Load weights from the flow control of the nodes
  *
  * @endverbatim
  */
@@ -63,6 +64,7 @@ static void diagnostics(DCB *, void *);
 static MONITOR_SERVERS *get_candidate_master(MONITOR*);
 static MONITOR_SERVERS *set_cluster_master(MONITOR_SERVERS *, MONITOR_SERVERS *, int);
 static void disableMasterFailback(void *, int);
+static void update_flow_control(GALERA_MONITOR *, MONITOR_SERVERS *);
 bool isGaleraEvent(monitor_event_t event);
 
 static MONITOR_OBJECT MyObject =
@@ -147,6 +149,8 @@ startMonitor(void *arg, void* opt)
         handle->master = NULL;
         handle->script = NULL;
         handle->use_priority = false;
+        handle->flow_control_weighting = false;
+        handle->nodes = NULL;
         memset(handle->events, false, sizeof(handle->events));
         spinlock_init(&handle->lock);
     }
@@ -170,6 +174,10 @@ startMonitor(void *arg, void* opt)
         {
             handle->use_priority = config_truth_value(params->value);
         }
+        else if (!strcmp(params->name, "flow_control_weighting"))
+        {
+            handle->flow_control_weighting = config_truth_value(params->value);
+        }
         else if (!strcmp(params->name, "script"))
         {
             if (externcmd_can_execute(params->value))
@@ -274,6 +282,8 @@ diagnostics(DCB *dcb, void *arg)
     dcb_printf(dcb, "\tAvailable when Donor:\t%s\n", (handle->availableWhenDonor == 1) ? "on" : "off");
     dcb_printf(dcb, "\tMaster Role Setting Disabled:\t%s\n",
                (handle->disableMasterRoleSetting == 1) ? "on" : "off");
+    dcb_printf(dcb, "\tFlow control weighting:\t%s\n",
+               handle->flow_control_weighting ? "on" : "off");
     dcb_printf(dcb, "\tConnect Timeout:\t%i seconds\n", mon->connect_timeout);
     dcb_printf(dcb, "\tRead Timeout:\t\t%i seconds\n", mon->read_timeout);
     dcb_printf(dcb, "\tWrite Timeout:\t\t%i seconds\n", mon->write_timeout);
@@ -288,6 +298,20 @@ diagnostics(DCB *dcb, void *arg)
         db = db->next;
     }
     dcb_printf(dcb, "\n");
+
+    if (handle->flow_control_weighting)
+    {
+        dcb_printf(dcb, "\t%-20s %10s %8s %10s %12s %8s\n", "Server", "Recv queue",
+                   "FC sent", "FC paused", "Cert deps", "Weight");
+
+        for (GALERA_NODE *node = handle->nodes; node; node = node->next)
+        {
+            dcb_printf(dcb, "\t%-20s %10ld %8ld %9.1f%% %12.1f %7.1f%%\n",
+                       node->db->server->unique_name, node->recv_queue,
+                       node->fc_sent_interval, node->fc_paused * 100,
+                       node->cert_deps_distance, node->db->server->load_weight / 10.0);
+        }
+    }
 }
 
 /**
@@ -356,6 +380,11 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
         server_set_version_string(database->server, server_string);
     }
 
+    if (mysql_query(database->con, MON_SERVER_VARIABLES_QUERY) == 0)
+    {
+        mon_store_server_variables(database, mysql_store_result(database->con));
+    }
+
     /* Check if the the Galera FSM shows this node is joined to the cluster */
     if (mysql_query(database->con, "SHOW STATUS LIKE 'wsrep_local_state'") == 0
         && (result = mysql_store_result(database->con)) != NULL)
@@ -440,10 +469,16 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
         }
 
         server_set_status(&temp_server, SERVER_JOINED);
+
+        if (handle->flow_control_weighting)
+        {
+            update_flow_control(handle, database);
+        }
     }
     else
     {
         server_clear_status(&temp_server, SERVER_JOINED);
+        database->server->load_weight = SERVER_LOAD_WEIGHT_MAX;
     }
 
     /* clear bits for non member nodes */
@@ -462,6 +497,140 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
     server_transfer_status(database->server, &temp_server);
 }
 
+/**
+ * Find the flow control statistics of a node, allocating them on the first call
+ *
+ * @param handle    The monitor handle
+ * @param database  The node
+ * @return The statistics of the node or NULL if memory allocation failed
+ */
+static GALERA_NODE *
+get_galera_node(GALERA_MONITOR *handle, MONITOR_SERVERS *database)
+{
+    GALERA_NODE *node;
+
+    for (node = handle->nodes; node; node = node->next)
+    {
+        if (node->db == database)
+        {
+            return node;
+        }
+    }
+
+    if ((node = calloc(1, sizeof(GALERA_NODE))) != NULL)
+    {
+        node->db = database;
+        node->fc_limit = GALERAMON_FC_LIMIT;
+        node->next = handle->nodes;
+        handle->nodes = node;
+    }
+
+    return node;
+}
+
+/**
+ * Read the flow control status of a joined node and set its load weight.
+ *
+ * The node that sends flow control messages pauses the replication of the
+ * whole cluster, so it gets only GALERAMON_FC_WEIGHT of its weight. The other
+ * nodes are weighted by how full their receive queue is compared to the
+ * gcs.fc_limit at which the node would start sending the messages.
+ *
+ * @param handle    The monitor handle
+ * @param database  The node
+ */
+static void
+update_flow_control(GALERA_MONITOR *handle, MONITOR_SERVERS *database)
+{
+    GALERA_NODE *node = get_galera_node(handle, database);
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+
+    if (node == NULL)
+    {
+        return;
+    }
+
+    if (mysql_query(database->con, "SHOW STATUS WHERE Variable_name IN "
+                    "('wsrep_flow_control_sent', 'wsrep_flow_control_paused_ns', "
+                    "'wsrep_local_recv_queue', 'wsrep_cert_deps_distance')") != 0 ||
+        (result = mysql_store_result(database->con)) == NULL)
+    {
+        MXS_ERROR("Failed to read the flow control status of server '%s': %s",
+                  database->server->unique_name, mysql_error(database->con));
+        return;
+    }
+
+    unsigned long fc_sent = node->fc_sent;
+    unsigned long fc_paused_ns = node->fc_paused_ns;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    while ((row = mysql_fetch_row(result)))
+    {
+        if (strcasecmp(row[0], "wsrep_flow_control_sent") == 0)
+        {
+            fc_sent = strtoul(row[1], NULL, 10);
+        }
+        else if (strcasecmp(row[0], "wsrep_flow_control_paused_ns") == 0)
+        {
+            fc_paused_ns = strtoul(row[1], NULL, 10);
+        }
+        else if (strcasecmp(row[0], "wsrep_local_recv_queue") == 0)
+        {
+            node->recv_queue = strtol(row[1], NULL, 10);
+        }
+        else if (strcasecmp(row[0], "wsrep_cert_deps_distance") == 0)
+        {
+            node->cert_deps_distance = strtod(row[1], NULL);
+        }
+    }
+    mysql_free_result(result);
+
+    /** The counters are reset by FLUSH STATUS and when the node restarts */
+    if (node->sampled.tv_sec != 0 && fc_sent >= node->fc_sent && fc_paused_ns >= node->fc_paused_ns)
+    {
+        double elapsed_ns = (now.tv_sec - node->sampled.tv_sec) * 1000000000.0 +
+                            (now.tv_nsec - node->sampled.tv_nsec);
+
+        node->fc_sent_interval = fc_sent - node->fc_sent;
+        node->fc_paused = elapsed_ns > 0 ? MIN((fc_paused_ns - node->fc_paused_ns) / elapsed_ns, 1.0) : 0;
+    }
+    else
+    {
+        node->fc_sent_interval = 0;
+        node->fc_paused = 0;
+    }
+
+    node->fc_sent = fc_sent;
+    node->fc_paused_ns = fc_paused_ns;
+    node->sampled = now;
+
+    if (mysql_query(database->con, "SHOW VARIABLES LIKE 'wsrep_provider_options'") == 0 &&
+        (result = mysql_store_result(database->con)) != NULL)
+    {
+        char *limit;
+
+        if ((row = mysql_fetch_row(result)) && mysql_num_fields(result) > 1 && row[1] &&
+            (limit = strstr(row[1], "gcs.fc_limit = ")) != NULL)
+        {
+            node->fc_limit = MAX(strtol(limit + strlen("gcs.fc_limit = "), NULL, 10), 1);
+        }
+        mysql_free_result(result);
+    }
+
+    if (node->fc_sent_interval > 0)
+    {
+        database->server->load_weight = GALERAMON_FC_WEIGHT;
+    }
+    else
+    {
+        database->server->load_weight =
+            MAX(SERVER_LOAD_WEIGHT_MAX * node->fc_limit / (node->fc_limit + MAX(node->recv_queue, 0)), 1);
+    }
+}
+
 /**
  * The entry point for the monitoring module thread
  *
@@ -633,6 +802,9 @@ monitorMain(void *arg)
             }
         }
 
+        /** Publish the server states of this cycle to the routers */
+        server_states_publish();
+
         ptr = mon->databases;
 
         while (ptr)
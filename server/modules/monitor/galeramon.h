@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <monitor.h>
 #include <spinlock.h>
 #include <externcmd.h>
@@ -37,9 +38,33 @@
  *
  * Date      Who             Description
  * 07/05/15  Markus Makela   Initial Implementation of galeramon.h
+ * 15/10/16  Core Team       Addition of flow control weighting
  * @endverbatim
  */
 
+/** The default gcs.fc_limit of the Galera provider */
+#define GALERAMON_FC_LIMIT 16
+
+/** Load weight of a node that sent flow control messages during the last interval */
+#define GALERAMON_FC_WEIGHT 10
+
+/**
+ * The flow control statistics of a Galera node
+ */
+typedef struct galera_node
+{
+    MONITOR_SERVERS *db; /**< The monitored server */
+    unsigned long fc_sent; /**< wsrep_flow_control_sent at the last round */
+    unsigned long fc_paused_ns; /**< wsrep_flow_control_paused_ns at the last round */
+    struct timespec sampled; /**< When the counters were read */
+    long fc_sent_interval; /**< Flow control messages sent during the last interval */
+    double fc_paused; /**< Fraction of the last interval the cluster was paused */
+    long recv_queue; /**< wsrep_local_recv_queue */
+    double cert_deps_distance; /**< wsrep_cert_deps_distance */
+    long fc_limit; /**< gcs.fc_limit of the node */
+    struct galera_node *next; /**< The next node */
+} GALERA_NODE;
+
 /**
  * The handle for an instance of a Galera Monitor module
  */
@@ -56,6 +81,8 @@ typedef struct
     MONITOR_SERVERS *master; /**< Master server for MySQL Master/Slave replication */
     char* script;
     bool use_priority; /*< Use server priorities */
+    bool flow_control_weighting; /*< Set the load weights from the flow control */
+    GALERA_NODE *nodes; /*< The flow control statistics of the nodes */
     bool events[MAX_MONITOR_EVENT]; /*< enabled events */
 } GALERA_MONITOR;
 
@@ -21,6 +21,7 @@
  * 08/09/14 Massimiliano Pinto  Initial implementation
  * 08/05/15 Markus Makela       Addition of launchable scripts
  * 17/10/15 Martin Brampton     Change DCB callback to hangup
+ * 15/10/16 Core Team           Read the server state with one round trip
  *
  * @endverbatim
  */
@@ -324,16 +325,30 @@ monitorDatabase(MONITOR* mon, MONITOR_SERVERS *database)
         server_set_version_string(database->server, server_string);
     }
 
+    /**
+     * The server_id, the variable 'read_only' set by an external component and
+     * the replication status are read with one round trip
+     */
+    MYSQL_RES *results[2];
+    int read_only = -1;
+
+    mon_query_multi(database, server_version >= 100000 ?
+                    "SELECT @@server_id, @@read_only; SHOW ALL SLAVES STATUS" :
+                    "SELECT @@server_id, @@read_only; SHOW SLAVE STATUS", results, 2);
+
     /* get server_id form current node */
-    if (mysql_query(database->con, "SELECT @@server_id") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    if ((result = results[0]) != NULL)
     {
         long server_id = -1;
 
-        if (mysql_field_count(database->con) != 1)
+        if (mysql_num_fields(result) != 2)
         {
             mysql_free_result(result);
-            MXS_ERROR("Unexpected result for 'SELECT @@server_id'. Expected 1 column."
+            if (results[1])
+            {
+                mysql_free_result(results[1]);
+            }
+            MXS_ERROR("Unexpected result for 'SELECT @@server_id, @@read_only'. Expected 2 columns."
                       " MySQL Version: %s", version_str);
             return;
         }
@@ -347,6 +362,11 @@ monitorDatabase(MONITOR* mon, MONITOR_SERVERS *database)
                 server_id = -1;
             }
             database->server->node_id = server_id;
+
+            if (row[1])
+            {
+                read_only = strcmp(row[1], "0") != 0;
+            }
         }
         mysql_free_result(result);
     }
@@ -359,13 +379,12 @@ monitorDatabase(MONITOR* mon, MONITOR_SERVERS *database)
     if (server_version >= 100000)
     {
 
-        if (mysql_query(database->con, "SHOW ALL SLAVES STATUS") == 0
-            && (result = mysql_store_result(database->con)) != NULL)
+        if ((result = results[1]) != NULL)
         {
             int i = 0;
             long master_id = -1;
 
-            if (mysql_field_count(database->con) < 42)
+            if (mysql_num_fields(result) < 42)
             {
                 mysql_free_result(result);
                 MXS_ERROR("\"SHOW ALL SLAVES STATUS\" returned less than the expected"
@@ -418,12 +437,11 @@ monitorDatabase(MONITOR* mon, MONITOR_SERVERS *database)
     }
     else
     {
-        if (mysql_query(database->con, "SHOW SLAVE STATUS") == 0
-            && (result = mysql_store_result(database->con)) != NULL)
+        if ((result = results[1]) != NULL)
         {
             long master_id = -1;
 
-            if (mysql_field_count(database->con) < 40)
+            if (mysql_num_fields(result) < 40)
             {
                 mysql_free_result(result);
 
@@ -478,30 +496,14 @@ monitorDatabase(MONITOR* mon, MONITOR_SERVERS *database)
         }
     }
 
-    /* get variable 'read_only' set by an external component */
-    if (mysql_query(database->con, "SHOW GLOBAL VARIABLES LIKE 'read_only'") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    /* the variable 'read_only' set by an external component */
+    if (read_only == 0)
     {
-        if (mysql_field_count(database->con) < 2)
-        {
-            mysql_free_result(result);
-            MXS_ERROR("Unexpected result for \"SHOW GLOBAL VARIABLES LIKE 'read_only'\". "
-                      "Expected 2 columns. MySQL Version: %s", version_str);
-            return;
-        }
-
-        while ((row = mysql_fetch_row(result)))
-        {
-            if (strncasecmp(row[1], "OFF", 3) == 0)
-            {
-                ismaster = 1;
-            }
-            else
-            {
-                isslave = 1;
-            }
-        }
-        mysql_free_result(result);
+        ismaster = 1;
+    }
+    else if (read_only == 1)
+    {
+        isslave = 1;
     }
 
     /* Remove addition info */
@@ -661,6 +663,9 @@ monitorMain(void *arg)
             ptr = ptr->next;
         }
 
+        /** Publish the server states of this cycle to the routers */
+        server_states_publish();
+
         ptr = mon->databases;
         monitor_event_t evtype;
         while (ptr)
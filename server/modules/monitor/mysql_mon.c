@@ -41,6 +41,10 @@
  *                              be present in mysql_mon and in router sections as well.
  * 08/05/15 Markus Makela       Added launchable scripts
  * 17/10/15 Martin Brampton     Change DCB callback to hangup
+ * 15/10/16 Core Team           Probe the servers concurrently
+ * 15/10/16 Core Team           Check the monitor connections between the rounds
+ * 15/10/16 Core Team           Replication heartbeat with microsecond resolution
+ * 15/10/16 Core Team           Read the server_id and the replication status with one round trip
  *
  * @endverbatim
  */
@@ -48,6 +52,12 @@
 #include <mysqlmon.h>
 #include <dcb.h>
 #include <modutil.h>
+#include <atomic.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 
 extern char *strcasestr(const char *haystack, const char *needle);
 
@@ -80,6 +90,7 @@ static int add_slave_to_master(long *, int, long);
 static bool isMySQLEvent(monitor_event_t event);
 void check_maxscale_schema_replication(MONITOR *monitor);
 static bool report_version_err = true;
+static bool report_gtid_err = true;
 static const char* hb_table_name = "maxscale_schema.replication_heartbeat";
 
 static MONITOR_OBJECT MyObject =
@@ -149,6 +160,7 @@ startMonitor(void *arg, void* opt)
     if (handle)
     {
         handle->shutdown = 0;
+        handle->heartbeat_us_server = NULL;
     }
     else
     {
@@ -162,8 +174,11 @@ startMonitor(void *arg, void* opt)
         handle->detectStaleMaster = true;
         handle->detectStaleSlave = true;
         handle->master = NULL;
+        handle->heartbeat_us_server = NULL;
         handle->script = NULL;
         handle->mysql51_replication = false;
+        handle->probe_threads = MYSQLMON_PROBE_THREADS;
+        handle->liveness_check = false;
         memset(handle->events, false, sizeof(handle->events));
         spinlock_init(&handle->lock);
     }
@@ -209,6 +224,24 @@ startMonitor(void *arg, void* opt)
         {
             handle->mysql51_replication = config_truth_value(params->value);
         }
+        else if (!strcmp(params->name, "liveness_check"))
+        {
+            handle->liveness_check = config_truth_value(params->value);
+        }
+        else if (!strcmp(params->name, "probe_threads"))
+        {
+            int threads = atoi(params->value);
+
+            if (threads > 0)
+            {
+                handle->probe_threads = threads;
+            }
+            else
+            {
+                MXS_ERROR("Invalid value for 'probe_threads' for the monitor '%s': %s. "
+                          "The value must be a positive integer.", monitor->name, params->value);
+            }
+        }
         params = params->next;
     }
 
@@ -289,6 +322,8 @@ static void diagnostics(DCB *dcb, void *arg)
     dcb_printf(dcb, "\tConnect Timeout:\t%i seconds\n", mon->connect_timeout);
     dcb_printf(dcb, "\tRead Timeout:\t\t%i seconds\n", mon->read_timeout);
     dcb_printf(dcb, "\tWrite Timeout:\t\t%i seconds\n", mon->write_timeout);
+    dcb_printf(dcb, "\tProbe threads:\t\t%i\n", handle->probe_threads);
+    dcb_printf(dcb, "\tLiveness check:\t\t%s\n", handle->liveness_check ? "enabled" : "disabled");
     dcb_printf(dcb, "\tMonitored servers:	");
 
     db = mon->databases;
@@ -302,19 +337,24 @@ static void diagnostics(DCB *dcb, void *arg)
     dcb_printf(dcb, "\n");
 }
 
-static inline void monitor_mysql100_db(MONITOR_SERVERS* database)
+/**
+ * Set the replication status of a MariaDB 10 server
+ *
+ * @param database The server
+ * @param result   The result of SHOW ALL SLAVES STATUS or NULL if it failed,
+ *                 freed by this function
+ */
+static inline void monitor_mysql100_db(MONITOR_SERVERS* database, MYSQL_RES* result)
 {
     int isslave = 0;
-    MYSQL_RES* result;
     MYSQL_ROW row;
 
-    if (mysql_query(database->con, "SHOW ALL SLAVES STATUS") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    if (result != NULL)
     {
         int i = 0;
         long master_id = -1;
 
-        if (mysql_field_count(database->con) < 42)
+        if (mysql_num_fields(result) < 42)
         {
             mysql_free_result(result);
             MXS_ERROR("\"SHOW ALL SLAVES STATUS\" "
@@ -391,17 +431,22 @@ static inline void monitor_mysql100_db(MONITOR_SERVERS* database)
     }
 }
 
-static inline void monitor_mysql55_db(MONITOR_SERVERS* database)
+/**
+ * Set the replication status of a MySQL 5.5 server
+ *
+ * @param database The server
+ * @param result   The result of SHOW SLAVE STATUS or NULL if it failed, freed
+ *                 by this function
+ */
+static inline void monitor_mysql55_db(MONITOR_SERVERS* database, MYSQL_RES* result)
 {
     bool isslave = false;
-    MYSQL_RES* result;
     MYSQL_ROW row;
 
-    if (mysql_query(database->con, "SHOW SLAVE STATUS") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    if (result != NULL)
     {
         long master_id = -1;
-        if (mysql_field_count(database->con) < 40)
+        if (mysql_num_fields(result) < 40)
         {
             mysql_free_result(result);
             MXS_ERROR("\"SHOW SLAVE STATUS\" "
@@ -466,16 +511,21 @@ static inline void monitor_mysql55_db(MONITOR_SERVERS* database)
     }
 }
 
-static inline void monitor_mysql51_db(MONITOR_SERVERS* database)
+/**
+ * Set the replication status of a MySQL 5.1 server
+ *
+ * @param database The server
+ * @param result   The result of SHOW SLAVE STATUS or NULL if it failed, freed
+ *                 by this function
+ */
+static inline void monitor_mysql51_db(MONITOR_SERVERS* database, MYSQL_RES* result)
 {
     bool isslave = false;
-    MYSQL_RES* result;
     MYSQL_ROW row;
 
-    if (mysql_query(database->con, "SHOW SLAVE STATUS") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    if (result != NULL)
     {
-        if (mysql_field_count(database->con) < 38)
+        if (mysql_num_fields(result) < 38)
         {
             mysql_free_result(result);
 
@@ -713,17 +763,67 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
         server_set_version_string(database->server, server_string);
     }
 
+    /** The time is taken before the query so that the GTID position is known
+     * to include every transaction committed before that time */
+    uint64_t gtid_read_at = latency_now();
+    MYSQL_RES *results[3];
+    int nresults = 2;
+    int nfields = 1;
+    const char *query;
+
+    /**
+     * The server_id, the replication status and the cached system variables
+     * are read with one round trip. The variables are read last so that the
+     * other statements are executed even if they fail. Check first for
+     * MariaDB 10.x.x and get status for multi-master replication.
+     */
+    if (server_version >= 100000)
+    {
+        query = "SELECT @@server_id, @@gtid_current_pos; SHOW ALL SLAVES STATUS; "
+            MON_SERVER_VARIABLES_QUERY;
+        nfields = 2;
+    }
+    else if (server_version >= 5 * 10000 + 5 * 100 || handle->mysql51_replication)
+    {
+        query = "SELECT @@server_id; SHOW SLAVE STATUS; " MON_SERVER_VARIABLES_QUERY;
+    }
+    else
+    {
+        query = "SELECT @@server_id; " MON_SERVER_VARIABLES_QUERY;
+        nresults = 1;
+
+        if (report_version_err)
+        {
+            report_version_err = false;
+            MXS_ERROR("MySQL version is lower than 5.5 and 'mysql51_replication' option is "
+                      "not enabled, replication tree cannot be resolved. To enable MySQL 5.1 replication "
+                      "detection, add 'mysql51_replication=true' to the monitor section.");
+        }
+    }
+
+    mon_query_multi(database, query, results, nresults + 1);
+    mon_store_server_variables(database, results[nresults]);
+
+    if (nresults == 1)
+    {
+        results[1] = NULL;
+    }
+
     /* get server_id form current node */
-    if (mysql_query(database->con, "SELECT @@server_id") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
+    if ((result = results[0]) != NULL)
     {
         long server_id = -1;
 
-        if (mysql_field_count(database->con) != 1)
+        if (mysql_num_fields(result) != nfields)
         {
             mysql_free_result(result);
-            MXS_ERROR("Unexpected result for 'SELECT @@server_id'. Expected 1 column."
-                      " MySQL Version: %s", version_str);
+            if (results[1])
+            {
+                mysql_free_result(results[1]);
+            }
+            MXS_ERROR("Unexpected result for '%.*s'. Expected %d column%s."
+                      " MySQL Version: %s", (int)strcspn(query, ";"), query,
+                      nfields, nfields > 1 ? "s" : "", version_str);
             return;
         }
 
@@ -736,34 +836,161 @@ monitorDatabase(MONITOR *mon, MONITOR_SERVERS *database)
                 server_id = -1;
             }
             database->server->node_id = server_id;
+
+            if (nfields > 1 && row[1] &&
+                !server_set_gtid_pos(database->server, row[1], gtid_read_at) &&
+                report_gtid_err)
+            {
+                report_gtid_err = false;
+                MXS_WARNING("Could not parse the GTID position '%s' of server '%s'. "
+                            "Causal reads will not use the server.",
+                            row[1], database->server->unique_name);
+            }
         }
         mysql_free_result(result);
     }
 
-    /* Check first for MariaDB 10.x.x and get status for multi-master replication */
     if (server_version >= 100000)
     {
-        monitor_mysql100_db(database);
+        monitor_mysql100_db(database, results[1]);
     }
     else if (server_version >= 5 * 10000 + 5 * 100)
     {
-        monitor_mysql55_db(database);
+        monitor_mysql55_db(database, results[1]);
     }
-    else
+    else if (handle->mysql51_replication)
     {
-        if (handle->mysql51_replication)
-        {
-            monitor_mysql51_db(database);
-        }
-        else if (report_version_err)
-        {
-            report_version_err = false;
-            MXS_ERROR("MySQL version is lower than 5.5 and 'mysql51_replication' option is "
-                      "not enabled, replication tree cannot be resolved. To enable MySQL 5.1 replication "
-                      "detection, add 'mysql51_replication=true' to the monitor section.");
-        }
+        monitor_mysql51_db(database, results[1]);
+    }
+}
+
+/** The servers probed in one monitoring round */
+typedef struct
+{
+    MONITOR         *mon;
+    MONITOR_SERVERS **servers;
+    int             nservers;
+    int             next;       /**< Index of the next server to probe */
+} MYSQL_MONITOR_PROBE;
+
+/**
+ * Probe servers of a monitoring round until all of them have been taken
+ *
+ * @param data The MYSQL_MONITOR_PROBE of the round
+ */
+static void
+probe_servers(void *data)
+{
+    MYSQL_MONITOR_PROBE *probe = (MYSQL_MONITOR_PROBE*)data;
+    int i;
+
+    while ((i = atomic_add(&probe->next, 1)) < probe->nservers)
+    {
+        monitorDatabase(probe->mon, probe->servers[i]);
+    }
+}
+
+/**
+ * Thread entry point for probing the servers
+ *
+ * @param data The MYSQL_MONITOR_PROBE of the round
+ */
+static void
+probe_servers_thread(void *data)
+{
+    mysql_thread_init();
+    probe_servers(data);
+    mysql_thread_end();
+}
+
+/**
+ * Probe all the servers of the monitor
+ *
+ * The servers are probed concurrently by at most probe_threads threads, the
+ * monitor thread being one of them. A server that does not respond only holds
+ * up the thread probing it. The function returns when all the servers have
+ * been probed.
+ *
+ * @param mon       The monitor
+ * @param servers   The servers to probe
+ * @param nservers  Number of servers
+ */
+static void
+monitor_all_databases(MONITOR *mon, MONITOR_SERVERS **servers, int nservers)
+{
+    MYSQL_MONITOR *handle = (MYSQL_MONITOR*)mon->handle;
+    MYSQL_MONITOR_PROBE probe = {mon, servers, nservers, 0};
+    int nthreads = MIN(nservers, handle->probe_threads) - 1;
+    THREAD threads[nthreads > 0 ? nthreads : 1];
+    int started = 0;
+
+    while (started < nthreads &&
+           thread_start(&threads[started], probe_servers_thread, &probe) != NULL)
+    {
+        started++;
     }
 
+    probe_servers(&probe);
+
+    for (int i = 0; i < started; i++)
+    {
+        thread_wait(threads[i]);
+    }
+}
+
+/**
+ * Enable the TCP keepalive probes on the connection to a server
+ *
+ * A connection to a host that has gone away is reported as broken by the
+ * kernel after about MYSQLMON_KEEPALIVE_IDLE + MYSQLMON_KEEPALIVE_INTERVAL *
+ * MYSQLMON_KEEPALIVE_COUNT seconds of silence.
+ *
+ * @param database The server
+ */
+static void
+set_liveness_keepalive(MONITOR_SERVERS *database)
+{
+    int fd = mysql_get_socket(database->con);
+    int on = 1;
+    int idle = MYSQLMON_KEEPALIVE_IDLE;
+    int interval = MYSQLMON_KEEPALIVE_INTERVAL;
+    int count = MYSQLMON_KEEPALIVE_COUNT;
+
+    if (fd >= 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    }
+}
+
+/**
+ * Check whether the connection to a running server has been lost
+ *
+ * The monitor connection is idle between the monitoring rounds. If its socket
+ * is readable, the server has closed the connection or the connection has
+ * failed. The check does not send anything to the server and never blocks.
+ *
+ * @param database The server
+ * @return True if the connection has been lost
+ */
+static bool
+connection_lost(MONITOR_SERVERS *database)
+{
+    if (database->con == NULL || SERVER_IN_MAINT(database->server) ||
+        !SERVER_IS_RUNNING(database->server))
+    {
+        return false;
+    }
+
+    struct pollfd pfd;
+
+    pfd.fd = mysql_get_socket(database->con);
+    pfd.events = POLLIN | POLLRDHUP;
+    pfd.revents = 0;
+
+    return pfd.fd >= 0 && poll(&pfd, 1, 0) > 0;
 }
 
 /**
@@ -827,9 +1054,30 @@ monitorMain(void *arg)
             MON_BASE_INTERVAL_MS)
         {
             nrounds += 1;
-            continue;
+
+            /**
+             * Between the rounds, look for lost connections to the running
+             * servers and probe all the servers at once if one is found.
+             */
+            for (ptr = mon->databases; handle->liveness_check && ptr; ptr = ptr->next)
+            {
+                if (connection_lost(ptr))
+                {
+                    MXS_NOTICE("Monitor connection to server %s:%d was lost, "
+                               "probing the servers.", ptr->server->name, ptr->server->port);
+                    break;
+                }
+            }
+
+            if (ptr == NULL)
+            {
+                continue;
+            }
+        }
+        else
+        {
+            nrounds += 1;
         }
-        nrounds += 1;
         /* reset num_servers */
         num_servers = 0;
 
@@ -843,13 +1091,36 @@ monitorMain(void *arg)
             /* copy server status into monitor pending_status */
             ptr->pending_status = ptr->server->status;
 
-            /* monitor current node */
-            monitorDatabase(mon, ptr);
+            num_servers++;
+            ptr = ptr->next;
+        }
+
+        MONITOR_SERVERS *servers[num_servers > 0 ? num_servers : 1];
+
+        ptr = mon->databases;
+
+        int nprobe = 0;
+
+        while (nprobe < num_servers && ptr)
+        {
+            servers[nprobe++] = ptr;
+            ptr = ptr->next;
+        }
+
+        /* monitor all the nodes */
+        monitor_all_databases(mon, servers, nprobe);
 
+        ptr = mon->databases;
+
+        while (ptr)
+        {
             /* reset the slave list of current node */
             memset(&ptr->server->slaves, 0, sizeof(ptr->server->slaves));
 
-            num_servers++;
+            if (handle->liveness_check && ptr->con && SERVER_IS_RUNNING(ptr->server))
+            {
+                set_liveness_keepalive(ptr);
+            }
 
             if (mon_status_changed(ptr))
             {
@@ -1015,6 +1286,9 @@ monitorMain(void *arg)
             ptr = ptr->next;
         }
 
+        /** Publish the server states of this cycle to the routers */
+        server_states_publish();
+
         ptr = mon->databases;
         monitor_event_t evtype;
         while (ptr)
@@ -1139,6 +1413,19 @@ getSlaveOfNodeId(MONITOR_SERVERS *ptr, long node_id)
     return NULL;
 }
 
+/**
+ * Get the time for the replication heartbeat
+ *
+ * @return Microseconds since the epoch
+ */
+static unsigned long heartbeat_time_us()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
 /*******
  * This function sets the replication heartbeat
  * into the maxscale_schema.replication_heartbeat table in the current master.
@@ -1151,7 +1438,9 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
 {
     unsigned long id = handle->id;
     time_t heartbeat;
+    unsigned long heartbeat_us;
     time_t purge_time;
+    bool use_us;
     char heartbeat_insert_query[512] = "";
     char heartbeat_purge_query[512] = "";
 
@@ -1168,6 +1457,7 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
                   ": %s", mysql_error(database->con));
 
         database->server->rlag = -1;
+        database->server->rlag_us = -1;
     }
 
     /* create repl_heartbeat table in maxscale_schema database */
@@ -1176,6 +1466,7 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
                     "(maxscale_id INT NOT NULL, "
                     "master_server_id INT NOT NULL, "
                     "master_timestamp INT UNSIGNED NOT NULL, "
+                    "master_timestamp_us BIGINT UNSIGNED NOT NULL DEFAULT 0, "
                     "PRIMARY KEY ( master_server_id, maxscale_id ) ) "
                     "ENGINE=MYISAM DEFAULT CHARSET=latin1"))
     {
@@ -1183,8 +1474,32 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
                   "table in Master server: %s", mysql_error(database->con));
 
         database->server->rlag = -1;
+        database->server->rlag_us = -1;
+    }
+
+    /**
+     * Tables created by older versions have only the timestamp in seconds. The
+     * column is added once for each master, the change replicates to the slaves.
+     */
+    if (handle->heartbeat_us_server != database->server)
+    {
+        if (mysql_query(database->con, "ALTER TABLE maxscale_schema.replication_heartbeat "
+                        "ADD COLUMN master_timestamp_us BIGINT UNSIGNED NOT NULL DEFAULT 0") == 0 ||
+            mysql_errno(database->con) == ER_DUP_FIELDNAME)
+        {
+            handle->heartbeat_us_server = database->server;
+        }
+        else
+        {
+            MXS_ERROR("[mysql_mon]: Error adding column master_timestamp_us to "
+                      "maxscale_schema.replication_heartbeat in Master server, the "
+                      "replication lag is measured in seconds: %s",
+                      mysql_error(database->con));
+        }
     }
 
+    use_us = handle->heartbeat_us_server == database->server;
+
     /* auto purge old values after 48 hours*/
     purge_time = time(0) - (3600 * 48);
 
@@ -1199,20 +1514,31 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
                   mysql_error(database->con));
     }
 
-    heartbeat = time(0);
+    heartbeat_us = heartbeat_time_us();
+    heartbeat = heartbeat_us / 1000000;
 
     /* set node_ts for master as time(0) */
     database->server->node_ts = heartbeat;
 
-    sprintf(heartbeat_insert_query,
-            "UPDATE maxscale_schema.replication_heartbeat SET master_timestamp = %lu WHERE master_server_id = %li AND maxscale_id = %lu",
-            heartbeat, handle->master->server->node_id, id);
+    if (use_us)
+    {
+        sprintf(heartbeat_insert_query,
+                "UPDATE maxscale_schema.replication_heartbeat SET master_timestamp = %lu, master_timestamp_us = %lu WHERE master_server_id = %li AND maxscale_id = %lu",
+                heartbeat, heartbeat_us, handle->master->server->node_id, id);
+    }
+    else
+    {
+        sprintf(heartbeat_insert_query,
+                "UPDATE maxscale_schema.replication_heartbeat SET master_timestamp = %lu WHERE master_server_id = %li AND maxscale_id = %lu",
+                heartbeat, handle->master->server->node_id, id);
+    }
 
     /* Try to insert MaxScale timestamp into master */
     if (mysql_query(database->con, heartbeat_insert_query))
     {
 
         database->server->rlag = -1;
+        database->server->rlag_us = -1;
 
         MXS_ERROR("[mysql_mon]: Error updating maxscale_schema.replication_heartbeat table: [%s], %s",
                   heartbeat_insert_query,
@@ -1222,15 +1548,27 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
     {
         if (mysql_affected_rows(database->con) == 0)
         {
-            heartbeat = time(0);
-            sprintf(heartbeat_insert_query,
-                    "REPLACE INTO maxscale_schema.replication_heartbeat (master_server_id, maxscale_id, master_timestamp ) VALUES ( %li, %lu, %lu)",
-                    handle->master->server->node_id, id, heartbeat);
+            heartbeat_us = heartbeat_time_us();
+            heartbeat = heartbeat_us / 1000000;
+
+            if (use_us)
+            {
+                sprintf(heartbeat_insert_query,
+                        "REPLACE INTO maxscale_schema.replication_heartbeat (master_server_id, maxscale_id, master_timestamp, master_timestamp_us ) VALUES ( %li, %lu, %lu, %lu)",
+                        handle->master->server->node_id, id, heartbeat, heartbeat_us);
+            }
+            else
+            {
+                sprintf(heartbeat_insert_query,
+                        "REPLACE INTO maxscale_schema.replication_heartbeat (master_server_id, maxscale_id, master_timestamp ) VALUES ( %li, %lu, %lu)",
+                        handle->master->server->node_id, id, heartbeat);
+            }
 
             if (mysql_query(database->con, heartbeat_insert_query))
             {
 
                 database->server->rlag = -1;
+                database->server->rlag_us = -1;
 
                 MXS_ERROR("[mysql_mon]: Error inserting into "
                           "maxscale_schema.replication_heartbeat table: [%s], %s",
@@ -1241,6 +1579,7 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
             {
                 /* Set replication lag to 0 for the master */
                 database->server->rlag = 0;
+                database->server->rlag_us = 0;
 
                 MXS_DEBUG("[mysql_mon]: heartbeat table inserted data for %s:%i",
                           database->server->name, database->server->port);
@@ -1250,6 +1589,7 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
         {
             /* Set replication lag as 0 for the master */
             database->server->rlag = 0;
+            database->server->rlag_us = 0;
 
             MXS_DEBUG("[mysql_mon]: heartbeat table updated for Master %s:%i",
                       database->server->name, database->server->port);
@@ -1269,7 +1609,8 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
 {
     MYSQL_MONITOR *handle = (MYSQL_MONITOR*) mon->handle;
     unsigned long id = handle->id;
-    time_t heartbeat;
+    unsigned long heartbeat_us;
+    bool use_us;
     char select_heartbeat_query[256] = "";
     MYSQL_ROW row;
     MYSQL_RES *result;
@@ -1280,11 +1621,15 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
         return;
     }
 
+    /** The microsecond column exists if it was added on the current master */
+    use_us = handle->heartbeat_us_server == handle->master->server;
+
     /* Get the master_timestamp value from maxscale_schema.replication_heartbeat table */
 
-    sprintf(select_heartbeat_query, "SELECT master_timestamp "
+    sprintf(select_heartbeat_query, "SELECT master_timestamp%s "
             "FROM maxscale_schema.replication_heartbeat "
             "WHERE maxscale_id = %lu AND master_server_id = %li",
+            use_us ? ", master_timestamp_us" : "",
             id, handle->master->server->node_id);
 
     /* if there is a master then send the query to the slave with master_id */
@@ -1295,12 +1640,13 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
 
         while ((row = mysql_fetch_row(result)))
         {
-            int rlag = -1;
+            long rlag_us = -1;
             time_t slave_read;
+            unsigned long slave_read_us = 0;
 
             rows_found = 1;
 
-            heartbeat = time(0);
+            heartbeat_us = heartbeat_time_us();
             slave_read = strtoul(row[0], NULL, 10);
 
             if ((errno == ERANGE && (slave_read == LONG_MAX || slave_read == LONG_MIN)) || (errno != 0 &&
@@ -1309,33 +1655,50 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
                 slave_read = 0;
             }
 
+            if (use_us && row[1])
+            {
+                slave_read_us = strtoul(row[1], NULL, 10);
+            }
+
+            /** Rows written by older versions only have the seconds */
+            if (slave_read_us == 0)
+            {
+                slave_read_us = slave_read * 1000000UL;
+            }
+
             if (slave_read)
             {
                 /* set the replication lag */
-                rlag = heartbeat - slave_read;
+                rlag_us = heartbeat_us - slave_read_us;
             }
 
             /* set this node_ts as master_timestamp read from replication_heartbeat table */
             database->server->node_ts = slave_read;
 
-            if (rlag >= 0)
+            if (rlag_us >= 0)
             {
+                int rlag = rlag_us / 1000000;
+
                 /* store rlag only if greater than monitor sampling interval */
                 database->server->rlag = ((unsigned int)rlag > (mon->interval / 1000)) ? rlag : 0;
+                database->server->rlag_us = rlag_us;
             }
             else
             {
                 database->server->rlag = -1;
+                database->server->rlag_us = -1;
             }
 
-            MXS_DEBUG("Slave %s:%i has %i seconds lag",
+            MXS_DEBUG("Slave %s:%i has %i seconds lag (%ld microseconds)",
                       database->server->name,
                       database->server->port,
-                      database->server->rlag);
+                      database->server->rlag,
+                      database->server->rlag_us);
         }
         if (!rows_found)
         {
             database->server->rlag = -1;
+            database->server->rlag_us = -1;
             database->server->node_ts = 0;
         }
 
@@ -1344,6 +1707,7 @@ static void set_slave_heartbeat(MONITOR* mon, MONITOR_SERVERS *database)
     else
     {
         database->server->rlag = -1;
+        database->server->rlag_us = -1;
         database->server->node_ts = 0;
 
         if (handle->master->server->node_id < 0)
@@ -46,9 +46,20 @@
  * 20/04/15 Guillaume Lefranc   Addition of availableWhenDonor
  * 22/04/15 Martin Brampton     Addition of disableMasterRoleSetting
  * 07/05/15 Markus Makela       Addition of command execution on Master server failure
+ * 15/10/16 Core Team           Addition of probe_threads
+ * 15/10/16 Core Team           Addition of liveness_check
+ * 15/10/16 Core Team           Addition of heartbeat_us_server
  * @endverbatim
  */
 
+/** Default maximum number of threads probing the servers */
+#define MYSQLMON_PROBE_THREADS 8
+
+/** TCP keepalive of the monitor connections with liveness_check, in seconds */
+#define MYSQLMON_KEEPALIVE_IDLE     1
+#define MYSQLMON_KEEPALIVE_INTERVAL 1
+#define MYSQLMON_KEEPALIVE_COUNT    2
+
 /**
  * The handle for an instance of a MySQL Monitor module
  */
@@ -66,7 +77,10 @@ typedef struct
     int availableWhenDonor; /**< Monitor flag for Galera Cluster Donor availability */
     int disableMasterRoleSetting; /**< Monitor flag to disable setting master role */
     bool mysql51_replication; /**< Use MySQL 5.1 replication */
+    int probe_threads; /**< Maximum number of threads probing the servers */
+    bool liveness_check; /**< Check the connections between the monitoring rounds */
     MONITOR_SERVERS *master; /**< Master server for MySQL Master/Slave replication */
+    SERVER *heartbeat_us_server; /**< Master whose heartbeat table has the microsecond column */
     char* script; /*< Script to call when state changes occur on servers */
     bool events[MAX_MONITOR_EVENT]; /*< enabled events */
 } MYSQL_MONITOR;
@@ -21,6 +21,7 @@
  * 25/07/14 Massimiliano Pinto  Initial implementation
  * 10/11/14 Massimiliano Pinto  Added setNetworkTimeout for connect,read,write
  * 08/05/15 Markus Makela       Addition of launchable scripts
+ * 15/10/16 Core Team           Read the status variables with one query
  *
  * @endverbatim
  */
@@ -296,52 +297,42 @@ monitorDatabase(MONITOR_SERVERS *database, char *defaultUser, char *defaultPassw
         server_set_version_string(database->server, server_string);
     }
 
-    /* Check if the the SQL node is able to contact one or more data nodes */
-    if (mysql_query(database->con, "SHOW STATUS LIKE 'Ndb_number_of_ready_data_nodes'") == 0
+    /**
+     * Check if the the SQL node is able to contact one or more data nodes and
+     * the SQL node id in the MySQL cluster with one query
+     */
+    if (mysql_query(database->con, "SHOW STATUS WHERE Variable_name IN "
+                    "('Ndb_number_of_ready_data_nodes', 'Ndb_cluster_node_id')") == 0
         && (result = mysql_store_result(database->con)) != NULL)
     {
-        if (mysql_field_count(database->con) < 2)
+        if (mysql_num_fields(result) < 2)
         {
             mysql_free_result(result);
-            MXS_ERROR("Unexpected result for \"SHOW STATUS LIKE "
-                      "'Ndb_number_of_ready_data_nodes'\". Expected 2 columns."
-                      " MySQL Version: %s", version_str);
+            MXS_ERROR("Unexpected result for \"SHOW STATUS WHERE Variable_name IN "
+                      "('Ndb_number_of_ready_data_nodes', 'Ndb_cluster_node_id')\". "
+                      "Expected 2 columns. MySQL Version: %s", version_str);
             return;
         }
 
         while ((row = mysql_fetch_row(result)))
         {
-            if (atoi(row[1]) > 0)
+            if (strcasecmp(row[0], "Ndb_number_of_ready_data_nodes") == 0)
             {
-                isjoined = 1;
+                if (atoi(row[1]) > 0)
+                {
+                    isjoined = 1;
+                }
             }
-        }
-        mysql_free_result(result);
-    }
-
-    /* Check the the SQL node id in the MySQL cluster */
-    if (mysql_query(database->con, "SHOW STATUS LIKE 'Ndb_cluster_node_id'") == 0
-        && (result = mysql_store_result(database->con)) != NULL)
-    {
-        if (mysql_field_count(database->con) < 2)
-        {
-            mysql_free_result(result);
-            MXS_ERROR("Unexpected result for \"SHOW STATUS LIKE 'Ndb_cluster_node_id'\". "
-                      "Expected 2 columns."
-                      " MySQL Version: %s", version_str);
-            return;
-        }
-
-        long cluster_node_id = -1;
-        while ((row = mysql_fetch_row(result)))
-        {
-            cluster_node_id = strtol(row[1], NULL, 10);
-            if ((errno == ERANGE && (cluster_node_id == LONG_MAX
-                                     || cluster_node_id == LONG_MIN)) || (errno != 0 && cluster_node_id == 0))
+            else if (strcasecmp(row[0], "Ndb_cluster_node_id") == 0)
             {
-                cluster_node_id = -1;
+                long cluster_node_id = strtol(row[1], NULL, 10);
+                if ((errno == ERANGE && (cluster_node_id == LONG_MAX
+                                         || cluster_node_id == LONG_MIN)) || (errno != 0 && cluster_node_id == 0))
+                {
+                    cluster_node_id = -1;
+                }
+                database->server->node_id = cluster_node_id;
             }
-            database->server->node_id = cluster_node_id;
         }
         mysql_free_result(result);
     }
@@ -427,6 +418,9 @@ monitorMain(void *arg)
             ptr = ptr->next;
         }
 
+        /** Publish the server states of this cycle to the routers */
+        server_states_publish();
+
         ptr = mon->databases;
         monitor_event_t evtype;
 
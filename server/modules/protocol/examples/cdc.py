@@ -23,10 +23,18 @@ import selectors
 import binascii
 import os
 
+# Grant more credit once half of the previous grant has been consumed
+def top_up_credit(consumed, unit):
+    if opts.credit > 0 and consumed >= opts.credit // 2:
+        sock.send(bytes(("CREDIT " + str(consumed) + " " + unit).encode()))
+        return 0
+    return consumed
+
 # Read data as JSON
 def read_json():
     decoder = json.JSONDecoder()
     rbuf = bytes()
+    records = 0
     ep = selectors.EpollSelector()
     ep.register(sock, selectors.EVENT_READ)
 
@@ -40,6 +48,7 @@ def read_json():
                 data = decoder.raw_decode(rbuf.decode('ascii'))
                 rbuf = rbuf[data[1]:]
                 print(json.dumps(data[0]))
+                records = top_up_credit(records + 1, "RECORDS")
         except ValueError as err:
             sys.stdout.flush()
             pass
@@ -48,6 +57,7 @@ def read_json():
 
 # Read data as Avro
 def read_avro():
+    consumed = 0
     ep = selectors.EpollSelector()
     ep.register(sock, selectors.EVENT_READ)
 
@@ -57,6 +67,7 @@ def read_avro():
             buf = sock.recv(4096, socket.MSG_DONTWAIT)
             os.write(sys.stdout.fileno(), buf)
             sys.stdout.flush()
+            consumed = top_up_credit(consumed + len(buf), "BYTES")
         except Exception:
             break
 
@@ -67,6 +78,8 @@ parser.add_argument("-u", "--user", dest="user", help="Username used when connec
 parser.add_argument("-p", "--password", dest="password", help="Password used when connecting", default="")
 parser.add_argument("-f", "--format", dest="format", help="Data transmission format", default="JSON", choices=["AVRO", "JSON"])
 parser.add_argument("-t", "--timeout", dest="read_timeout", help="Read timeout", default=0)
+parser.add_argument("-c", "--credit", dest="credit", type=int, default=0,
+                    help="Number of records (JSON) or bytes (AVRO) the server can send before more are granted")
 parser.add_argument("FILE", help="Requested table name in the following format: DATABASE.TABLE[.VERSION]")
 parser.add_argument("GTID", help="Requested GTID position", default=None, nargs='?')
 
@@ -88,6 +101,10 @@ sock.send(bytes(("REGISTER UUID=XXX-YYY_YYY, TYPE=" + opts.format).encode()))
 # Discard the response again
 response = str(sock.recv(1024)).encode('utf_8')
 
+# Limit the data that is sent before it is consumed
+if opts.credit > 0:
+    sock.send(bytes(("CREDIT " + str(opts.credit) + (" RECORDS" if opts.format == "JSON" else " BYTES")).encode()))
+
 # Request a data stream
 sock.send(bytes(("REQUEST-DATA " + opts.FILE + (" " + opts.GTID if opts.GTID else "")).encode()))
 
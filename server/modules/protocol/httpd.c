@@ -28,6 +28,8 @@
  * Date         Who                     Description
  * 08/07/2013   Massimiliano Pinto      Initial version
  * 09/07/2013   Massimiliano Pinto      Added /show?dcb|session for all dcbs|sessions
+ * 15/10/2016   Core Team               HTTP/1.1 keep-alive, pipelined requests and
+ *                                      chunked replies
  *
  * @endverbatim
  */
@@ -38,6 +40,7 @@
 #include <modinfo.h>
 #include <log_manager.h>
 #include <resultset.h>
+#include <metrics.h>
 
  /* @see function load_module in load_utils.c for explanation of the following
   * lint directives.
@@ -64,8 +67,12 @@ static int httpd_hangup(DCB *dcb);
 static int httpd_accept(DCB *dcb);
 static int httpd_close(DCB *dcb);
 static int httpd_listen(DCB *dcb, char *config);
-static int httpd_get_line(int sock, char *buf, int size);
-static void httpd_send_headers(DCB *dcb, int final);
+static int httpd_parse_request(HTTPD_session *client_data, char *head, char *url, size_t url_size,
+                               size_t *content_length);
+static void httpd_handle_request(DCB *dcb, HTTPD_session *client_data, char *url);
+static void httpd_flush_chunk(DCB *dcb, HTTPD_session *client_data);
+static void httpd_send_headers(DCB *dcb, int final, const char *content_type);
+static void httpd_send_error(DCB *dcb, const char *status);
 static char *httpd_default_auth();
 
 /**
@@ -137,161 +144,266 @@ static char *httpd_default_auth()
 /**
  * Read event for EPOLLIN on the httpd protocol module.
  *
+ * The received data is collected until the head of a request, and the body
+ * announced with Content-Length, has arrived. All complete requests are
+ * handled in the order they were sent so that pipelined requests get their
+ * replies in order. The connection is kept open after the reply unless the
+ * client asked otherwise or does not speak HTTP/1.1.
+ *
  * @param dcb   The descriptor control block
- * @return
+ * @return 0
  */
 static int httpd_read_event(DCB* dcb)
 {
-    SESSION *session = dcb->session;
-
-    int numchars = 1;
-    char buf[HTTPD_REQUESTLINE_MAXLEN-1] = "";
-    char *query_string = NULL;
-    char method[HTTPD_METHOD_MAXLEN-1] = "";
-    char url[HTTPD_SMALL_BUFFER] = "";
-    size_t i, j;
-    int headers_read = 0;
-    HTTPD_session *client_data = NULL;
-    GWBUF *uri;
+    HTTPD_session *client_data = dcb->data;
+    GWBUF *head = NULL;
+
+    if (dcb_read(dcb, &head, 0) < 0)
+    {
+        gwbuf_free(head);
+        dcb_close(dcb);
+        return 0;
+    }
+
+    client_data->request = gwbuf_append(client_data->request, head);
+
+    while (client_data->request)
+    {
+        client_data->request = gwbuf_make_contiguous(client_data->request);
+
+        if (client_data->request == NULL)
+        {
+            dcb_close(dcb);
+            return 0;
+        }
+
+        char *data = (char *)GWBUF_DATA(client_data->request);
+        size_t len = GWBUF_LENGTH(client_data->request);
+        char *end = memmem(data, len, "\r\n\r\n", 4);
+        size_t head_len;
+
+        if (end)
+        {
+            head_len = end - data + 4;
+        }
+        else if ((end = memmem(data, len, "\n\n", 2)))
+        {
+            head_len = end - data + 2;
+        }
+        else
+        {
+            if (len > HTTPD_REQUEST_MAXLEN)
+            {
+                httpd_send_error(dcb, "431 Request Header Fields Too Large");
+                dcb_close(dcb);
+            }
+            return 0;
+        }
+
+        char *request_head = strndup(data, head_len);
+        char url[HTTPD_SMALL_BUFFER] = "";
+        size_t content_length = 0;
+
+        if (request_head == NULL)
+        {
+            dcb_close(dcb);
+            return 0;
+        }
+
+        int rc = httpd_parse_request(client_data, request_head, url, sizeof(url), &content_length);
+        free(request_head);
+
+        if (rc != 0)
+        {
+            httpd_send_error(dcb, rc == 1 ? "501 Not Implemented" : "400 Bad Request");
+            dcb_close(dcb);
+            return 0;
+        }
+
+        if (len < head_len + content_length)
+        {
+            /** Wait for the rest of the request body */
+            return 0;
+        }
 
-    client_data = dcb->data;
+        /** The request body is not used by any of the handlers */
+        client_data->request = gwbuf_consume(client_data->request, head_len + content_length);
+        client_data->headers_received = 1;
 
-    /**
-     * get the request line
-     * METHOD URL HTTP_VER\r\n
-     */
+        httpd_handle_request(dcb, client_data, url);
 
-    numchars = httpd_get_line(dcb->fd, buf, sizeof(buf));
+        if (!client_data->keepalive)
+        {
+            dcb_close(dcb);
+            return 0;
+        }
+    }
 
-    i = 0; j = 0;
-    while (!ISspace(buf[j]) && (i < sizeof(method) - 1))
+    return 0;
+}
+
+/**
+ * Parse the head of a request
+ *
+ * @param client_data    The HTTPD session
+ * @param head           The request line and the headers, NUL terminated
+ * @param url            Buffer where the URL without the query string is stored
+ * @param url_size       Size of the URL buffer
+ * @param content_length The length of the request body
+ * @return 0 on success, 1 for an unsupported method and -1 for a malformed request
+ */
+static int httpd_parse_request(HTTPD_session *client_data, char *head, char *url, size_t url_size,
+                               size_t *content_length)
+{
+    char *saveptr;
+    char *line = strtok_r(head, "\r\n", &saveptr);
+    char *lineptr;
+    char *method = line ? strtok_r(line, " \t", &lineptr) : NULL;
+    char *uri = method ? strtok_r(NULL, " \t", &lineptr) : NULL;
+    char *version = uri ? strtok_r(NULL, " \t", &lineptr) : NULL;
+
+    if (uri == NULL || strlen(method) >= HTTPD_METHOD_MAXLEN)
     {
-        method[i] = buf[j];
-        i++; j++;
+        return -1;
     }
-    method[i] = '\0';
 
     strcpy(client_data->method, method);
 
     /* check allowed http methods */
     if (strcasecmp(method, "GET") && strcasecmp(method, "POST"))
     {
-        //httpd_unimplemented(dcb->fd);
-        return 0;
+        return 1;
     }
 
-    i = 0;
+    /** Strip the query string */
+    snprintf(url, url_size, "%.*s", (int)strcspn(uri, "?"), uri);
 
-    while ( (j < sizeof(buf)) && ISspace(buf[j]))
-    {
-        j++;
-    }
+    /** HTTP/1.1 keeps the connection open by default, older versions close it */
+    client_data->keepalive = version && strcasecmp(version, "HTTP/1.1") == 0;
+    client_data->chunked = client_data->keepalive;
+    *content_length = 0;
 
-    while ((j < sizeof(buf) - 1) && !ISspace(buf[j]) && (i < sizeof(url) - 1))
+    while ((line = strtok_r(NULL, "\r\n", &saveptr)))
     {
-        url[i] = buf[j];
-        i++; j++;
-    }
+        char *value = strchr(line, ':');
 
-    url[i] = '\0';
+        if (value == NULL)
+        {
+            continue;
+        }
 
-    /**
-     * Get the query string if availble
-     */
+        *value++ = '\0';
+        value += strspn(value, " \t");
 
-    if (strcasecmp(method, "GET") == 0)
-    {
-        query_string = url;
-        while ((*query_string != '?') && (*query_string != '\0'))
+        if (strcasecmp(line, "Host") == 0)
         {
-            query_string++;
+            snprintf(client_data->hostname, sizeof(client_data->hostname), "%s", value);
         }
-        if (*query_string == '?')
+        else if (strcasecmp(line, "User-Agent") == 0)
         {
-            *query_string = '\0';
+            snprintf(client_data->useragent, sizeof(client_data->useragent), "%s", value);
         }
-    }
-
-    /**
-     * Get the request headers
-     */
-
-    while ((numchars > 0) && strcmp("\n", buf))
-    {
-        char *value = NULL;
-        char *end = NULL;
-        numchars = httpd_get_line(dcb->fd, buf, sizeof(buf));
-        if ((value = strchr(buf, ':')))
+        else if (strcasecmp(line, "Connection") == 0)
         {
-            *value = '\0';
-            value++;
-            end = &value[strlen(value) -1];
-            *end = '\0';
-
-            if (strncasecmp(buf, "Hostname", 6) == 0)
+            if (strcasecmp(value, "close") == 0)
             {
-                strcpy(client_data->hostname, value);
+                client_data->keepalive = false;
             }
-            if (strncasecmp(buf, "useragent", 9) == 0)
+            else if (strcasecmp(value, "keep-alive") == 0 && client_data->chunked)
             {
-                strcpy(client_data->useragent, value);
+                client_data->keepalive = true;
             }
         }
-    }
+        else if (strcasecmp(line, "Content-Length") == 0)
+        {
+            char *end;
+            unsigned long length = strtoul(value, &end, 10);
 
-    if (numchars)
-    {
-        headers_read = 1;
-        memcpy(&client_data->headers_received, &headers_read, sizeof(int));
+            if (end == value || length > HTTPD_REQUEST_MAXLEN)
+            {
+                return -1;
+            }
+
+            *content_length = length;
+        }
     }
 
-    /**
-     * Now begins the server reply
-     */
+    return 0;
+}
+
+/**
+ * Send the reply to one request
+ *
+ * The router writes the reply body through httpd_write, which collects it into
+ * chunks when the reply uses the chunked transfer encoding. The last chunk is
+ * sent once the router has returned.
+ *
+ * @param dcb           The client DCB
+ * @param client_data   The HTTPD session
+ * @param url           The requested URL
+ */
+static void httpd_handle_request(DCB *dcb, HTTPD_session *client_data, char *url)
+{
+    GWBUF *uri;
 
     /* send all the basic headers and close with \r\n */
-    httpd_send_headers(dcb, 1);
-
-#if 0
-    /**
-     * ToDO: launch proper content handling based on the requested URI, later REST interface
-     *
-     */
-    if (strcmp(url, "/show") == 0)
+    httpd_send_headers(dcb, 1, strcmp(url, METRICS_URL) == 0 ?
+                       METRICS_CONTENT_TYPE : "application/json");
+
+    if ((uri = gwbuf_alloc(strlen(url) + 1)) != NULL)
     {
-        if (query_string && strlen(query_string))
-        {
-            if (strcmp(query_string, "dcb") == 0)
-            {
-                dprintAllDCBs(dcb);
-            }
-            if (strcmp(query_string, "session") == 0)
-            {
-                dprintAllSessions(dcb);
-            }
-        }
+        strcpy((char *)GWBUF_DATA(uri), url);
+        gwbuf_set_type(uri, GWBUF_TYPE_HTTP);
+        client_data->in_body = true;
+        SESSION_ROUTE_QUERY(dcb->session, uri);
+        client_data->in_body = false;
     }
-    if (strcmp(url, "/services") == 0)
+
+    if (client_data->chunked)
     {
-        RESULTSET *set, *seviceGetList();
-        if ((set = serviceGetList()) != NULL)
+        GWBUF *last;
+
+        httpd_flush_chunk(dcb, client_data);
+
+        if ((last = gwbuf_alloc_and_load(5, "0\r\n\r\n")))
         {
-            resultset_stream_json(set, dcb);
-            resultset_free(set);
+            dcb_write(dcb, last);
         }
     }
-#endif
-    if ((uri = gwbuf_alloc(strlen(url) + 1)) != NULL)
+}
+
+/**
+ * Send the collected reply data as one chunk
+ *
+ * @param dcb           The client DCB
+ * @param client_data   The HTTPD session
+ */
+static void httpd_flush_chunk(DCB *dcb, HTTPD_session *client_data)
+{
+    if (client_data->chunk == NULL)
     {
-        strcpy((char *)GWBUF_DATA(uri), url);
-        gwbuf_set_type(uri, GWBUF_TYPE_HTTP);
-        SESSION_ROUTE_QUERY(session, uri);
+        return;
     }
 
-    /* force the client connecton close */
-    dcb_close(dcb);
+    char size[32];
+    int len = snprintf(size, sizeof(size), "%x\r\n", gwbuf_length(client_data->chunk));
+    GWBUF *head = gwbuf_alloc_and_load(len, size);
+    GWBUF *tail = gwbuf_alloc_and_load(2, "\r\n");
 
-    return 0;
+    if (head && tail)
+    {
+        dcb_write(dcb, gwbuf_append(gwbuf_append(head, client_data->chunk), tail));
+    }
+    else
+    {
+        gwbuf_free(head);
+        gwbuf_free(tail);
+        gwbuf_free(client_data->chunk);
+        /** The reply can't be completed, make sure the connection closes */
+        client_data->keepalive = false;
+    }
+
+    client_data->chunk = NULL;
 }
 
 /**
@@ -316,7 +428,22 @@ static int httpd_write_event(DCB *dcb)
  */
 static int httpd_write(DCB *dcb, GWBUF *queue)
 {
+    HTTPD_session *client_data = dcb->data;
     int rc;
+
+    if (client_data && client_data->chunked && client_data->in_body)
+    {
+        /** Collect the small writes of the router into larger chunks */
+        client_data->chunk = gwbuf_append(client_data->chunk, queue);
+
+        if (gwbuf_length(client_data->chunk) >= HTTPD_CHUNK_SIZE)
+        {
+            httpd_flush_chunk(dcb, client_data);
+        }
+
+        return 1;
+    }
+
     rc = dcb_write(dcb, queue);
     return rc;
 }
@@ -387,6 +514,16 @@ static int httpd_accept(DCB *listener)
 
 static int httpd_close(DCB *dcb)
 {
+    HTTPD_session *client_data = dcb->data;
+
+    if (client_data)
+    {
+        gwbuf_free(client_data->request);
+        gwbuf_free(client_data->chunk);
+        client_data->request = NULL;
+        client_data->chunk = NULL;
+    }
+
     return 0;
 }
 
@@ -401,55 +538,14 @@ static int httpd_listen(DCB *listener, char *config)
     return (dcb_listen(listener, config, "HTTPD") < 0) ? 0 : 1;
 }
 
-/**
- * HTTPD get line from client
- */
-static int httpd_get_line(int sock, char *buf, int size)
-{
-    int i = 0;
-    char c = '\0';
-    int n;
-
-    while ((i < size - 1) && (c != '\n'))
-    {
-        n = recv(sock, &c, 1, 0);
-        /* DEBUG printf("%02X\n", c); */
-        if (n > 0)
-        {
-            if (c == '\r')
-            {
-                n = recv(sock, &c, 1, MSG_PEEK);
-                /* DEBUG printf("%02X\n", c); */
-                if ((n > 0) && (c == '\n'))
-                {
-                    if (recv(sock, &c, 1, 0) < 0)
-                    {
-                        c = '\n';
-                    }
-                }
-                else
-                {
-                    c = '\n';
-                }
-            }
-            buf[i] = c;
-            i++;
-        }
-        else
-        {
-            c = '\n';
-        }
-    }
-
-    buf[i] = '\0';
-
-    return i;
-}
-
 /**
  * HTTPD send basic headers with 200 OK
+ *
+ * @param dcb           The client
+ * @param final         Close the headers
+ * @param content_type  The content type of the reply
  */
-static void httpd_send_headers(DCB *dcb, int final)
+static void httpd_send_headers(DCB *dcb, int final, const char *content_type)
 {
     char date[64] = "";
     const char *fmt = "%a, %d %b %Y %H:%M:%S GMT";
@@ -459,10 +555,15 @@ static void httpd_send_headers(DCB *dcb, int final)
     localtime_r(&httpd_current_time, &tm);
     strftime(date, sizeof(date), fmt, &tm);
 
+    HTTPD_session *client_data = dcb->data;
+    bool keepalive = client_data && client_data->keepalive;
+    bool chunked = client_data && client_data->chunked;
+
     dcb_printf(dcb,
                "HTTP/1.1 200 OK\r\nDate: %s\r\nServer: %s\r\nConnection: "
-               "close\r\nContent-Type: application/json\r\n",
-               date, HTTP_SERVER_STRING);
+               "%s\r\nContent-Type: %s\r\n%s",
+               date, HTTP_SERVER_STRING, keepalive ? "keep-alive" : "close", content_type,
+               chunked ? "Transfer-Encoding: chunked\r\n" : "");
 
     /* close the headers */
     if (final)
@@ -470,3 +571,15 @@ static void httpd_send_headers(DCB *dcb, int final)
         dcb_printf(dcb, "\r\n");
     }
 }
+
+/**
+ * Send an error reply that ends the connection
+ *
+ * @param dcb     The client
+ * @param status  The status code and reason phrase
+ */
+static void httpd_send_error(DCB *dcb, const char *status)
+{
+    dcb_printf(dcb, "HTTP/1.1 %s\r\nServer: %s\r\nConnection: close\r\n"
+               "Content-Length: 0\r\n\r\n", status, HTTP_SERVER_STRING);
+}
@@ -18,6 +18,7 @@
 #include <modutil.h>
 #include <utils.h>
 #include <netinet/tcp.h>
+#include <sys/un.h>
 #include <gw.h>
 
 /* The following can be compared using memcmp to detect a null password */
@@ -49,11 +50,21 @@ uint8_t null_client_sha1[MYSQL_SCRAMBLE_LEN]="";
  * 07/10/2015   Martin Brampton         Remove calls to dcb_close - should be done by routers
  * 27/10/2015   Martin Brampton         Test for RCAP_TYPE_NO_RSESSION before calling clientReply
  * 23/05/2016   Martin Brampton         Provide for backend SSL
+ * 15/10/2016   Core Team               Compressed protocol
+ * 15/10/2016   Core Team               Forward session command replies as they arrive
+ * 15/10/2016   Core Team               Reset pooled connections with COM_RESET_CONNECTION
+ * 15/10/2016   Core Team               Pipeline the first statements with the authentication
+ * 15/10/2016   Core Team               Connections to Unix domain sockets
+ * 15/10/2016   Core Team               Reload the users in the background
+ * 15/10/2016   Core Team               Sampled query tracing
+ * 15/10/2016   Core Team               Static probes for tracing tools
+ * 15/10/2016   Core Team               Deferred connects for the connection rate limit
  *
  */
 #include <modinfo.h>
 #include <gw_protocol.h>
 #include <mysql_auth.h>
+#include <probes.h>
 
  /* @see function load_module in load_utils.c for explanation of the following
   * lint directives.
@@ -69,6 +80,8 @@ MODULE_INFO info = {
 
 static char *version_str = "V2.0.0";
 static int gw_create_backend_connection(DCB *backend, SERVER *server, SESSION *in_session);
+static int gw_defer_backend_connection(DCB *backend, SERVER *server, SESSION *in_session);
+static MySQLProtocol *gw_init_backend_protocol(DCB *backend_dcb);
 static int gw_read_backend_event(DCB* dcb);
 static int gw_write_backend_event(DCB *dcb);
 static int gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue);
@@ -77,9 +90,10 @@ static int gw_backend_close(DCB *dcb);
 static int gw_backend_hangup(DCB *dcb);
 static int backend_write_delayqueue(DCB *dcb);
 static void backend_set_delayqueue(DCB *dcb, GWBUF *queue);
+static GWBUF *backend_take_delayqueue(DCB *dcb);
 static int gw_change_user(DCB *backend_dcb, SERVER *server, SESSION *in_session, GWBUF *queue);
 static char *gw_backend_default_auth();
-static GWBUF* process_response_data(DCB* dcb, GWBUF* readbuf, int nbytes_to_process);
+static GWBUF* process_response_data(DCB* dcb, GWBUF* readbuf);
 extern char* create_auth_failed_msg(GWBUF* readbuf, char* hostaddr, uint8_t* sha1);
 static bool sescmd_response_complete(DCB* dcb);
 static int gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session);
@@ -95,6 +109,7 @@ static uint32_t create_capabilities(MySQLProtocol *conn, bool db_specified, bool
 static int response_length(MySQLProtocol *conn, char *user, uint8_t *passwd, char *dbname);
 static uint8_t *load_hashed_password(MySQLProtocol *conn, uint8_t *payload, uint8_t *passwd);
 static int gw_do_connect_to_backend(char *host, int port, int *fd);
+static int gw_do_connect_to_socket(char *path, int *fd);
 static void inline close_socket(int socket);
 static GWBUF *gw_create_change_user_packet(MYSQL_session*  mses,
                                     MySQLProtocol*  protocol);
@@ -107,6 +122,9 @@ static int gw_send_change_user_to_backend(char          *dbname,
 static int gw_session(DCB *backend_dcb, void *data);
 #endif
 static bool gw_get_shared_session_auth_info(DCB* dcb, MYSQL_session* session);
+static int gw_backend_reuse(DCB *dcb);
+static void backend_pipeline_delayqueue(MySQLProtocol *conn, bool compress);
+static bool reset_connection_supported(const char *version);
 
 static GWPROTOCOL MyObject = {
                               gw_read_backend_event, /* Read - EPOLLIN handler        */
@@ -121,7 +139,9 @@ static GWPROTOCOL MyObject = {
                               gw_change_user, /* Authentication                */
                               NULL, /* Session                       */
                               gw_backend_default_auth, /* Default authenticator */
-                              NULL  /**< Connection limit reached      */
+                              NULL, /**< Connection limit reached      */
+                              gw_backend_reuse, /**< Reuse a pooled connection  */
+                              gw_defer_backend_connection /**< Defer the connect */
 };
 
 /*
@@ -207,37 +227,26 @@ static int gw_create_backend_connection(DCB *backend_dcb,
     int rv = -1;
     int fd = -1;
 
-    protocol = mysql_protocol_init(backend_dcb, -1);
-    ss_dassert(protocol != NULL);
-
-    if (protocol == NULL)
+    /** A deferred connection already has its protocol object */
+    if (backend_dcb->protocol)
+    {
+        protocol = (MySQLProtocol *)backend_dcb->protocol;
+    }
+    else if ((protocol = gw_init_backend_protocol(backend_dcb)) == NULL)
     {
-        MXS_DEBUG("%lu [gw_create_backend_connection] Failed to create "
-                  "protocol object for backend connection.",
-                  pthread_self());
-        MXS_ERROR("Failed to create protocol object for backend connection.");
         goto return_fd;
     }
 
-    /** Copy client flags to backend protocol */
-    if (backend_dcb->session->client_dcb->protocol)
+    /*< if succeed, fd > 0, -1 otherwise */
+    /* TODO: Better if function returned a protocol auth state */
+    if (server->socket)
     {
-        /** Copy client flags to backend protocol */
-        protocol->client_capabilities =
-            ((MySQLProtocol *)(backend_dcb->session->client_dcb->protocol))->client_capabilities;
-        /** Copy client charset to backend protocol */
-        protocol->charset =
-            ((MySQLProtocol *)(backend_dcb->session->client_dcb->protocol))->charset;
+        rv = gw_do_connect_to_socket(server->socket, &fd);
     }
     else
     {
-        protocol->client_capabilities = (int)GW_MYSQL_CAPABILITIES_CLIENT;
-        protocol->charset = 0x08;
+        rv = gw_do_connect_to_backend(server->name, server->port, &fd);
     }
-
-    /*< if succeed, fd > 0, -1 otherwise */
-    /* TODO: Better if function returned a protocol auth state */
-    rv = gw_do_connect_to_backend(server->name, server->port, &fd);
     /*< Assign protocol with backend_dcb */
     backend_dcb->protocol = protocol;
 
@@ -292,6 +301,126 @@ return_fd:
     return fd;
 }
 
+/**
+ * Create the protocol object of a backend connection and copy the client
+ * flags and charset of the session to it
+ *
+ * @param backend_dcb The backend DCB
+ * @return The protocol object or NULL on failure
+ */
+static MySQLProtocol *gw_init_backend_protocol(DCB *backend_dcb)
+{
+    MySQLProtocol *protocol = mysql_protocol_init(backend_dcb, -1);
+    ss_dassert(protocol != NULL);
+
+    if (protocol == NULL)
+    {
+        MXS_DEBUG("%lu [gw_create_backend_connection] Failed to create "
+                  "protocol object for backend connection.",
+                  pthread_self());
+        MXS_ERROR("Failed to create protocol object for backend connection.");
+        return NULL;
+    }
+
+    /** Copy client flags to backend protocol */
+    if (backend_dcb->session->client_dcb->protocol)
+    {
+        /** Copy client flags to backend protocol */
+        protocol->client_capabilities =
+            ((MySQLProtocol *)(backend_dcb->session->client_dcb->protocol))->client_capabilities;
+        /** Copy client charset to backend protocol */
+        protocol->charset =
+            ((MySQLProtocol *)(backend_dcb->session->client_dcb->protocol))->charset;
+    }
+    else
+    {
+        protocol->client_capabilities = (int)GW_MYSQL_CAPABILITIES_CLIENT;
+        protocol->charset = 0x08;
+    }
+
+    return protocol;
+}
+
+/**
+ * Prepare a backend connection whose connect waits for the connection rate
+ * limit of the server. The protocol object is created in the MYSQL_ALLOC
+ * state, so the writes to the connection are kept in the delay queue until
+ * it has connected and authenticated.
+ *
+ * @param backend_dcb The backend DCB allocated by dcb_connect
+ * @param server The server to connect to
+ * @param session The session of the connection
+ * @return 1 on success, 0 on failure
+ */
+static int gw_defer_backend_connection(DCB *backend_dcb, SERVER *server, SESSION *session)
+{
+    MySQLProtocol *protocol = gw_init_backend_protocol(backend_dcb);
+
+    if (protocol == NULL)
+    {
+        return 0;
+    }
+
+    backend_dcb->protocol = protocol;
+    return 1;
+}
+
+/**
+ * Create a socket and connect it to the Unix domain socket of a backend server
+ * on the same host. The connection skips the TCP stack of the loopback
+ * interface. Like gw_do_connect_to_backend, the connect is non-blocking.
+ *
+ * @param path The path of the socket
+ * @param fd   Where the connected socket is stored
+ * @return 0 if connected, 1 if the connect is in progress and -1 on failure,
+ *         in which case fd is -1
+ */
+static int
+gw_do_connect_to_socket(char *path, int *fd)
+{
+    struct sockaddr_un addr;
+    char errbuf[STRERROR_BUFLEN];
+    int so;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        MXS_ERROR("The socket path '%s' is too long.", path);
+        return -1;
+    }
+
+    if ((so = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        MXS_ERROR("Establishing connection to backend server socket %s failed. "
+                  "Socket creation failed due %d, %s.", path, errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    setnonblocking(so);
+
+    int rv = connect(so, (struct sockaddr *)&addr, sizeof(addr));
+
+    if (rv != 0)
+    {
+        if (errno != EINPROGRESS)
+        {
+            MXS_ERROR("Failed to connect backend server socket %s, due %d, %s.",
+                      path, errno, strerror_r(errno, errbuf, sizeof(errbuf)));
+            close_socket(so);
+            return -1;
+        }
+        rv = 1;
+    }
+
+    *fd = so;
+    MXS_DEBUG("%lu [gw_do_connect_to_socket] Connected to backend server "
+              "socket %s, fd %d.", pthread_self(), path, so);
+    return rv;
+}
+
 /**
  * gw_do_connect_to_backend
  *
@@ -747,7 +876,9 @@ gw_send_authentication_to_backend(char *dbname,
         return MYSQL_AUTH_FAILED;
     }
 
-    capabilities = create_capabilities(conn, (dbname && strlen(dbname)), false);
+    bool compress = conn->owner_dcb->server->compression &&
+        (conn->server_capabilities & GW_MYSQL_CAPABILITIES_COMPRESS);
+    capabilities = create_capabilities(conn, (dbname && strlen(dbname)), compress);
     gw_mysql_set_byte4(client_capabilities, capabilities);
 
     bytes = response_length(conn, user, passwd, dbname);
@@ -827,7 +958,44 @@ gw_send_authentication_to_backend(char *dbname,
     /* Following needed if payload is used again */
     /* payload += strlen("mysql_native_password"); */
 
-    return dcb_write(conn->owner_dcb, buffer) ? MYSQL_AUTH_RECV : MYSQL_AUTH_FAILED;
+    if (!dcb_write(conn->owner_dcb, buffer))
+    {
+        return MYSQL_AUTH_FAILED;
+    }
+
+    backend_pipeline_delayqueue(conn, compress);
+    return MYSQL_AUTH_RECV;
+}
+
+/**
+ * Send the statements queued while the connection was being created right
+ * behind the authentication packet. The server executes them as soon as the
+ * authentication succeeds, which saves a round trip from the start of every
+ * session. The replies follow the AUTH_OK packet and are read once the
+ * authentication is complete, see gw_receive_backend_auth.
+ *
+ * With the compressed protocol the statements are sent only after the
+ * AUTH_OK packet, as the compression starts with the packet following it.
+ * A COM_CHANGE_USER is not pipelined because it is rewritten with the
+ * scramble of the server when the delay queue is written.
+ *
+ * The caller must hold the authlock of the DCB.
+ *
+ * @param conn     MySQL protocol structure
+ * @param compress Whether the compressed protocol was requested
+ */
+static void backend_pipeline_delayqueue(MySQLProtocol *conn, bool compress)
+{
+    DCB *dcb = conn->owner_dcb;
+
+    if (dcb->delayq && !compress &&
+        !MYSQL_IS_CHANGE_USER(((uint8_t *)GWBUF_DATA(dcb->delayq))))
+    {
+        GWBUF *localq = backend_take_delayqueue(dcb);
+
+        /** A failed write shows up as a failed authentication */
+        dcb_write(dcb, localq);
+    }
 }
 
 /**
@@ -901,6 +1069,13 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
                     break;
                 case 1:
                     backend_protocol->protocol_auth_state = MYSQL_IDLE;
+                    MXS_PROBE2(backend__auth__complete, dcb, dcb->server->unique_name);
+                    /** The packets after the AUTH_OK packet are compressed */
+                    if (dcb->server->compression &&
+                        (backend_protocol->server_capabilities & GW_MYSQL_CAPABILITIES_COMPRESS))
+                    {
+                        backend_protocol->compress = true;
+                    }
                     MXS_DEBUG("%lu [gw_read_backend_event] "
                           "gw_receive_backend_auth succeed. "
                           "dcb %p fd %d, user %s.",
@@ -924,6 +1099,14 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
             } /* switch */
         }
 
+        if (backend_protocol->protocol_auth_state == MYSQL_IDLE ||
+            backend_protocol->protocol_auth_state == MYSQL_AUTH_FAILED ||
+            backend_protocol->protocol_auth_state == MYSQL_HANDSHAKE_FAILED)
+        {
+            /** The next connection waiting for the server may start its handshake */
+            dcb_handshake_done(dcb);
+        }
+
         if (backend_protocol->protocol_auth_state == MYSQL_AUTH_FAILED ||
             backend_protocol->protocol_auth_state == MYSQL_HANDSHAKE_FAILED)
         {
@@ -934,8 +1117,7 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
              * First free delay queue - which is only ever processed while
              * authlock is held.
              */
-            gwbuf_free(dcb->delayq);
-            dcb->delayq = NULL;
+            gwbuf_free(backend_take_delayqueue(dcb));
             spinlock_release(&dcb->authlock);
 
             /* Only reload the users table if authentication failed and the
@@ -945,7 +1127,7 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
             if (backend_protocol->protocol_auth_state == MYSQL_AUTH_FAILED &&
                 dcb->session->state != SESSION_STATE_STOPPING)
             {
-                service_refresh_users(dcb->session->service);
+                service_refresh_users_async(dcb->session->service);
             }
 #if defined(SS_DEBUG)
             MXS_DEBUG("%lu [gw_read_backend_event] "
@@ -1001,7 +1183,8 @@ gw_read_reply_or_error(DCB *dcb, MYSQL_session local_session)
             {
                 return_code = backend_write_delayqueue(dcb);
                 spinlock_release(&dcb->authlock);
-                return return_code;
+                /** Route the replies to the pipelined statements */
+                return return_code && dcb->dcb_readqueue ? 2 : return_code;
             }
         }
     spinlock_release(&dcb->authlock);
@@ -1026,7 +1209,7 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
         CHK_SESSION(session);
 
         /* read available backend data */
-        return_code = dcb_read(dcb, &read_buffer, 0);
+        return_code = mysql_compressed_read(dcb, &read_buffer, 0);
 
         if (return_code < 0)
         {
@@ -1067,6 +1250,7 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
         else
         {
             ss_dassert(read_buffer != NULL);
+            trace_point(&session->trace, TRACE_FIRST_REPLY);
         }
 
         if (nbytes_read < 3)
@@ -1094,33 +1278,47 @@ gw_read_and_write(DCB *dcb, MYSQL_session local_session)
             }
         }
 
-        /**
-         * If protocol has session command set, concatenate whole
-         * response into one buffer.
-         */
-        if (protocol_get_srv_command((MySQLProtocol *) dcb->protocol, false) != MYSQL_COM_UNDEFINED)
+        /** The reply to the reset of a pooled connection is not routed */
+        if (((MySQLProtocol *)dcb->protocol)->reset_pending)
         {
-            read_buffer = process_response_data(dcb, read_buffer, gwbuf_length(read_buffer));
-            /**
-             * Received incomplete response to session command.
-             * Store it to readqueue and return.
-             */
-            if (!sescmd_response_complete(dcb))
+            GWBUF *reply = modutil_get_next_MySQL_packet(&read_buffer);
+
+            ((MySQLProtocol *)dcb->protocol)->reset_pending = false;
+
+            if (reply && MYSQL_IS_ERROR_PACKET((uint8_t *)GWBUF_DATA(reply)))
+            {
+                MXS_ERROR("Failed to reset the connection to '%s', the state of "
+                          "the previous session may remain.", dcb->server->unique_name);
+            }
+            gwbuf_free(reply);
+
+            if (read_buffer == NULL)
             {
                 return_code = 0;
                 goto return_rc;
             }
+        }
 
-            if (!read_buffer)
+        /**
+         * If protocol has session command set, mark the replies to the
+         * session commands. A router that does not accept partial replies
+         * gets the packets once the whole reply has arrived.
+         */
+        if (protocol_get_srv_command((MySQLProtocol *) dcb->protocol, false) != MYSQL_COM_UNDEFINED)
+        {
+            MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+            read_buffer = process_response_data(dcb, read_buffer);
+
+            if (!sescmd_response_complete(dcb) &&
+                (session->service->router->getCapabilities() & (int)RCAP_TYPE_PARTIAL_REPLY) == 0)
             {
-                MXS_NOTICE("%lu [gw_read_backend_event] "
-                           "Read buffer unexpectedly null, even though response "
-                           "not marked as complete. User: %s",
-                           pthread_self(),
-                           local_session.user);
+                proto->sescmd_replyq = gwbuf_append(proto->sescmd_replyq, read_buffer);
                 return_code = 0;
                 goto return_rc;
             }
+
+            read_buffer = gwbuf_append(proto->sescmd_replyq, read_buffer);
+            proto->sescmd_replyq = NULL;
         }
         /**
          * Check that session is operable, and that client DCB is
@@ -1307,8 +1505,17 @@ static int gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue)
                 /** Record the command to backend's protocol */
                 protocol_add_srv_command(backend_protocol, cmd);
             }
+            if (cmd != MYSQL_COM_PING && cmd != MYSQL_COM_QUIT && cmd != MYSQL_COM_STATISTICS)
+            {
+                backend_protocol->session_changed = true;
+            }
             /** Write to backend */
-            rc = dcb_write(dcb, queue);
+            if (backend_protocol->compress)
+            {
+                queue = mysql_compress(backend_protocol, queue, !GWBUF_IS_TYPE_STREAM(queue));
+            }
+            rc = queue ? dcb_write(dcb, queue) : 0;
+            trace_point(&dcb->session->trace, TRACE_BACKEND_WRITE);
         }
         break;
 
@@ -1333,6 +1540,8 @@ static int gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue)
                 /** Record the command to backend's protocol */
                 protocol_add_srv_command(backend_protocol, cmd);
             }
+            /** Anything sent before the authentication may change the state */
+            backend_protocol->session_changed = true;
             /*<
              * Now put the incoming data to the delay queue unless backend is
              * connected with auth ok
@@ -1649,10 +1858,32 @@ static int gw_backend_close(DCB *dcb)
  */
 static void backend_set_delayqueue(DCB *dcb, GWBUF *queue)
 {
+    if (dcb->session)
+    {
+        session_buffered_add(dcb->session, gwbuf_length(queue), false);
+    }
     /* Append data */
     dcb->delayq = gwbuf_append(dcb->delayq, queue);
 }
 
+/**
+ * Take the data of the delay queue out of the DCB
+ *
+ * @param dcb   The current backend DCB
+ * @return The data of the delay queue, NULL if it was empty
+ */
+static GWBUF *backend_take_delayqueue(DCB *dcb)
+{
+    GWBUF *localq = dcb->delayq;
+
+    dcb->delayq = NULL;
+    if (localq && dcb->session)
+    {
+        session_buffered_add(dcb->session, -(int)gwbuf_length(localq), false);
+    }
+    return localq;
+}
+
 /**
  * This routine writes the delayq via dcb_write
  * The dcb->delayq contains data received from the client before
@@ -1672,8 +1903,7 @@ static int backend_write_delayqueue(DCB *dcb)
     }
     else
     {
-        localq = dcb->delayq;
-        dcb->delayq = NULL;
+        localq = backend_take_delayqueue(dcb);
 
         if (MYSQL_IS_CHANGE_USER(((uint8_t *)GWBUF_DATA(localq))))
         {
@@ -1689,7 +1919,12 @@ static int backend_write_delayqueue(DCB *dcb)
             localq = gwbuf_consume(localq, GWBUF_LENGTH(localq));
             localq = gwbuf_append(localq, new_packet);
         }
-        rc = dcb_write(dcb, localq);
+
+        if (((MySQLProtocol *)dcb->protocol)->compress)
+        {
+            localq = mysql_compress((MySQLProtocol *)dcb->protocol, localq, true);
+        }
+        rc = localq ? dcb_write(dcb, localq) : 0;
     }
 
     if (rc == 0)
@@ -1834,21 +2069,8 @@ static int gw_change_user(DCB *backend,
 
     if (auth_ret != 0)
     {
-        if (service_refresh_users(backend->session->client_dcb->service) == 0)
-        {
-            /* Try authentication again with new repository data */
-            /* Note: if no auth client authentication will fail */
-            spinlock_acquire(&in_session->ses_lock);
-            strncpy(current_session->db, "", MYSQL_DATABASE_MAXLEN);
-            auth_ret = gw_check_mysql_scramble_data(
-                                                    backend->session->client_dcb,
-                                                    auth_token, auth_token_len,
-                                                    client_protocol->scramble,
-                                                    sizeof(client_protocol->scramble),
-                                                    username, client_sha1);
-            strncpy(current_session->db, current_database, MYSQL_DATABASE_MAXLEN);
-            spinlock_release(&in_session->ses_lock);
-        }
+        /* Load the users in the background, a later attempt sees the new data */
+        service_refresh_users_async(backend->session->client_dcb->service);
     }
 
     /* let's free the auth_token now */
@@ -1916,27 +2138,23 @@ retblock:
 }
 
 /**
- * Move packets or parts of packets from readbuf to outbuf as the packet headers
- * and lengths have been noticed and counted.
- * Session commands need to be marked so that they can be handled properly in
- * the router's clientReply.
+ * Follow the replies to the session commands. The packets of the replies are
+ * marked so that they can be handled properly in the router's clientReply
+ * and the last packet of each reply is marked as the end of the response.
+ * The progress of a reply is kept in the protocol so that each packet is
+ * inspected only once, however the reply is split across reads.
  *
- * @param dcb                   Backend's DCB where data was read from
- * @param readbuf               GWBUF where data was read to
- * @param nbytes_to_process     Number of bytes that has been read and need to be processed
+ * @param dcb       Backend's DCB where data was read from
+ * @param readbuf   Complete packets read from the backend
  *
- * @return GWBUF which includes complete MySQL packet
+ * @return The packets, followed by the replies to the commands that were
+ * sent after the session commands
  */
-static GWBUF* process_response_data(DCB* dcb,
-                                    GWBUF* readbuf,
-                                    int nbytes_to_process)
+static GWBUF* process_response_data(DCB* dcb, GWBUF* readbuf)
 {
-    int npackets_left = 0; /*< response's packet count */
-    ssize_t nbytes_left = 0; /*< nbytes to be read for the packet */
     MySQLProtocol* p;
     GWBUF* outbuf = NULL;
-    int initial_packets = npackets_left;
-    ssize_t initial_bytes = nbytes_left;
+    mysql_server_cmd_t srvcmd;
 
     /** Get command which was stored in gw_MySQLWrite_backend */
     p = DCB_PROTOCOL(dcb, MySQLProtocol);
@@ -1945,142 +2163,45 @@ static GWBUF* process_response_data(DCB* dcb,
         CHK_PROTOCOL(p);
     }
 
-    /** All buffers processed here are sescmd responses */
-    gwbuf_set_type(readbuf, GWBUF_TYPE_SESCMD_RESPONSE);
-
-    /**
-     * Now it is known how many packets there should be and how much
-     * is read earlier.
-     */
-    while (nbytes_to_process != 0)
+    while (readbuf && (srvcmd = protocol_get_srv_command(p, false)) != MYSQL_COM_UNDEFINED)
     {
-        mysql_server_cmd_t srvcmd;
-        bool succp;
-
-        srvcmd = protocol_get_srv_command(p, false);
+        int npackets_left;
+        ssize_t nbytes_left;
+        uint8_t packet_len[3];
 
-        MXS_DEBUG("%lu [process_response_data] Read command %s for DCB %p fd %d.",
-                  pthread_self(),
-                  STRPACKETTYPE(srvcmd),
-                  dcb,
-                  dcb->fd);
         /**
          * Read values from protocol structure, fails if values are
-         * uninitialized.
+         * uninitialized. The packet count of a new reply is concluded
+         * from the command type or from the first packet content.
          */
-        if (npackets_left == 0)
+        if (!protocol_get_response_status(p, &npackets_left, &nbytes_left) ||
+            npackets_left == 0)
         {
-            succp = protocol_get_response_status(p, &npackets_left, &nbytes_left);
-
-            if (!succp || npackets_left == 0)
-            {
-                /**
-                 * Examine command type and the readbuf. Conclude response
-                 * packet count from the command type or from the first
-                 * packet content. Fails if read buffer doesn't include
-                 * enough data to read the packet length.
-                 */
-                init_response_status(readbuf, srvcmd, &npackets_left, &nbytes_left);
-            }
-
-            initial_packets = npackets_left;
-            initial_bytes = nbytes_left;
+            init_response_status(readbuf, srvcmd, &npackets_left, &nbytes_left);
         }
-        /** Only session commands with responses should be processed */
-        ss_dassert(npackets_left > 0);
 
-        /** Read incomplete packet. */
-        if (nbytes_left > nbytes_to_process)
-        {
-            /** Includes length info so it can be processed */
-            if (nbytes_to_process >= 5)
-            {
-                /** discard source buffer */
-                readbuf = gwbuf_consume(readbuf, GWBUF_LENGTH(readbuf));
-                nbytes_left -= nbytes_to_process;
-            }
-            nbytes_to_process = 0;
-        }
-            /** Packet was read. All bytes belonged to the last packet. */
-        else if (nbytes_left == nbytes_to_process)
-        {
-            nbytes_left = 0;
-            nbytes_to_process = 0;
-            ss_dassert(npackets_left > 0);
-            npackets_left -= 1;
-            outbuf = gwbuf_append(outbuf, readbuf);
-            readbuf = NULL;
-        }
-        /**
-         * Buffer contains more data than we need. Split the complete packet and
-         * the extra data into two separate buffers.
-         */
-        else
-        {
-            ss_dassert(nbytes_left < nbytes_to_process);
-            ss_dassert(nbytes_left > 0);
-            ss_dassert(npackets_left > 0);
-            outbuf = gwbuf_append(outbuf, gwbuf_split(&readbuf, nbytes_left));
-            nbytes_to_process -= nbytes_left;
-            npackets_left -= 1;
-            nbytes_left = 0;
-        }
-
-        /** Store new status to protocol structure */
-        protocol_set_response_status(p, npackets_left, nbytes_left);
-
-        /** A complete packet was read */
-        if (nbytes_left == 0)
-        {
-            /** No more packets in this response */
-            if (npackets_left == 0 && outbuf != NULL)
-            {
-                GWBUF* b = outbuf;
+        MXS_DEBUG("%lu [process_response_data] Read command %s for DCB %p fd %d, "
+                  "%d packets left.", pthread_self(), STRPACKETTYPE(srvcmd),
+                  dcb, dcb->fd, npackets_left);
 
-                while (b->next != NULL)
-                {
-                    b = b->next;
-                }
-                /** Mark last as end of response */
-                gwbuf_set_type(b, GWBUF_TYPE_RESPONSE_END);
+        gwbuf_copy_data(readbuf, 0, 3, packet_len);
+        GWBUF* packet = gwbuf_split(&readbuf, gw_mysql_get_byte3(packet_len) + MYSQL_HEADER_LEN);
+        gwbuf_set_type(packet, GWBUF_TYPE_SESCMD_RESPONSE);
 
-                /** Archive the command */
-                protocol_archive_srv_command(p);
-            }
-                /** Read next packet */
-            else
-            {
-                uint8_t* data;
+        npackets_left = npackets_left > 0 ? npackets_left - 1 : 0;
+        protocol_set_response_status(p, npackets_left, 0);
 
-                /** Read next packet length if there is at least
-                 * three bytes left. If there is less than three
-                 * bytes in the buffer or it is NULL, we need to
-                 wait for more data from the backend server.*/
-                if (readbuf == NULL || gwbuf_length(readbuf) < 3)
-                {
-                    MXS_DEBUG("%lu [%s] Read %d packets. Waiting for %d more "
-                              "packets for a total of %d packets.",
-                              pthread_self(), __FUNCTION__,
-                              initial_packets - npackets_left,
-                              npackets_left, initial_packets);
-
-                    /** Store the already read data into the readqueue of the DCB
-                     * and restore the response status to the initial number of packets */
-                    spinlock_acquire(&dcb->authlock);
-                    dcb->dcb_readqueue = gwbuf_append(outbuf, dcb->dcb_readqueue);
-                    spinlock_release(&dcb->authlock);
-                    protocol_set_response_status(p, initial_packets, initial_bytes);
-                    return NULL;
-                }
-                uint8_t packet_len[3];
-                gwbuf_copy_data(readbuf, 0, 3, packet_len);
-                nbytes_left = gw_mysql_get_byte3(packet_len) + MYSQL_HEADER_LEN;
-                /** Store new status to protocol structure */
-                protocol_set_response_status(p, npackets_left, nbytes_left);
-            }
+        if (npackets_left == 0)
+        {
+            /** Mark last as end of response and archive the command */
+            gwbuf_set_type(packet->tail, GWBUF_TYPE_RESPONSE_END);
+            protocol_archive_srv_command(p);
         }
+
+        outbuf = gwbuf_append(outbuf, packet);
     }
-    return outbuf;
+
+    return gwbuf_append(outbuf, readbuf);
 }
 
 static bool sescmd_response_complete(DCB* dcb)
@@ -2144,6 +2265,7 @@ gw_decode_mysql_server_handshake(MySQLProtocol *conn, uint8_t *payload)
 
     // Get server version (string)
     server_version_end = (uint8_t *) gw_strend((char*) payload);
+    conn->reset_supported = reset_connection_supported((char*) payload);
 
     payload = server_version_end + 1;
 
@@ -2171,6 +2293,7 @@ gw_decode_mysql_server_handshake(MySQLProtocol *conn, uint8_t *payload)
 
     // get capabilities part 2 (2 bytes)
     memcpy(&capab_ptr[2], &mysql_server_capabilities_two, 2);
+    conn->server_capabilities = gw_mysql_get_byte4(capab_ptr);
 
     // 2 bytes shift
     payload += 2;
@@ -2224,10 +2347,39 @@ gw_receive_backend_auth(MySQLProtocol *protocol)
     uint8_t *ptr = NULL;
     int rc = 0;
 
+    /**
+     * The caller holds the authlock which dcb_read would take to prepend
+     * the read queue, so an incomplete reply is taken from it here.
+     */
+    head = dcb->dcb_readqueue;
+    dcb->dcb_readqueue = NULL;
     n = dcb_read(dcb, &head, 0);
 
     dcb->last_read = hkheartbeat;
 
+    if (n == -1)
+    {
+        gwbuf_free(head);
+        head = NULL;
+    }
+    else if (head)
+    {
+        n = gwbuf_length(head);
+        /**
+         * The replies to the statements pipelined with the authentication
+         * may follow the reply to it, they are left in the read queue.
+         */
+        GWBUF *reply = modutil_get_next_MySQL_packet(&head);
+
+        dcb->dcb_readqueue = head;
+        head = reply;
+
+        if (head == NULL)
+        {
+            return 0;
+        }
+    }
+
     /*<
      * Read didn't fail and there is enough data for mysql packet.
      */
@@ -2331,13 +2483,13 @@ gw_receive_backend_auth(MySQLProtocol *protocol)
  * We start by taking the default bitmask and removing any bits not set in
  * the bitmask contained in the connection structure. Then add SSL flag if
  * the connection requires SSL (set from the MaxScale configuration). The
- * compression flag may be set, although compression is NOT SUPPORTED. If a
- * database name has been specified in the function call, the relevant flag
- * is set.
+ * compression flag is set if the server supports it and the server is
+ * configured to use it. If a database name has been specified in the function
+ * call, the relevant flag is set.
  *
  * @param conn  The MySQLProtocol structure for the connection
  * @param db_specified Whether the connection request specified a database
- * @param compress Whether compression is requested - NOT SUPPORTED
+ * @param compress Whether compression is requested
  * @return Bit mask (32 bits)
  * @note Capability bits are defined in mysql_client_server_protocol.h
  */
@@ -2357,7 +2509,6 @@ create_capabilities(MySQLProtocol *conn, bool db_specified, bool compress)
         /* final_capabilities |= (uint32_t)GW_MYSQL_CAPABILITIES_SSL_VERIFY_SERVER_CERT; */
     }
 
-    /* Compression is not currently supported */
     if (compress)
     {
         final_capabilities |= (uint32_t)GW_MYSQL_CAPABILITIES_COMPRESS;
@@ -2379,6 +2530,10 @@ create_capabilities(MySQLProtocol *conn, bool db_specified, bool compress)
 
     final_capabilities |= (int)GW_MYSQL_CAPABILITIES_PLUGIN_AUTH;
 
+    /** The OK packets carry the session state changes only if the client asked for them */
+    final_capabilities |= conn->client_capabilities & conn->server_capabilities &
+                          (uint32_t)GW_MYSQL_CAPABILITIES_SESSION_TRACK;
+
     return final_capabilities;
 }
 
@@ -2507,7 +2662,6 @@ gw_create_change_user_packet(MYSQL_session*  mses,
     char* user;
     uint8_t* pwd;
     GWBUF* buffer;
-    int compress = 0;
     uint8_t* payload = NULL;
     uint8_t* payload_start = NULL;
     long bytes;
@@ -2533,13 +2687,6 @@ gw_create_change_user_packet(MYSQL_session*  mses,
     /* get charset the client sent and use it for connection auth */
     charset = protocol->charset;
 
-    if (compress)
-    {
-#ifdef DEBUG_MYSQL_CONN
-        fprintf(stderr, ">>>> Backend Connection with compression\n");
-#endif
-    }
-
     /**
      * Protocol MySQL COM_CHANGE_USER for CLIENT_PROTOCOL_41
      * 1 byte COMMAND
@@ -2691,3 +2838,78 @@ gw_send_change_user_to_backend(char          *dbname,
     }
     return rc;
 }
+
+/**
+ * Prepare a connection taken from the persistent pool for a new session.
+ * The pools are per user so the connection is already authenticated as the
+ * user of the session. If the previous session sent commands that may have
+ * changed the session state, the state is cleared with COM_RESET_CONNECTION,
+ * which costs neither a new authentication nor a wait for the reply. The
+ * reply is discarded when it arrives. Servers that do not support the
+ * command are used as before, the routers recreate the state they need.
+ *
+ * @param dcb The backend DCB
+ * @return 1 on success, 0 if the reset could not be written
+ */
+static int gw_backend_reuse(DCB *dcb)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+    CHK_PROTOCOL(proto);
+
+    if (!proto->session_changed || !proto->reset_supported ||
+        proto->protocol_auth_state != MYSQL_IDLE)
+    {
+        return 1;
+    }
+
+    GWBUF *buf = gwbuf_alloc(MYSQL_HEADER_LEN + 1);
+
+    if (buf == NULL)
+    {
+        return 0;
+    }
+
+    uint8_t *data = GWBUF_DATA(buf);
+    gw_mysql_set_byte3(data, 1);
+    data[3] = 0;
+    data[4] = GW_MYSQL_COM_RESET_CONNECTION;
+
+    if (proto->compress && (buf = mysql_compress(proto, buf, true)) == NULL)
+    {
+        return 0;
+    }
+
+    proto->session_changed = false;
+    proto->reset_pending = true;
+
+    return dcb_write(dcb, buf);
+}
+
+/**
+ * Check whether a server supports COM_RESET_CONNECTION. It was added in
+ * MySQL 5.7.3 and MariaDB 10.2.4.
+ *
+ * @param version The version string of the server handshake
+ * @return True if the server supports the command
+ */
+static bool reset_connection_supported(const char *version)
+{
+    int major = 0, minor = 0, patch = 0;
+    bool mariadb = strstr(version, "MariaDB") != NULL;
+
+    /** MariaDB 10 servers prefix the version with 5.5.5- */
+    if (strncmp(version, "5.5.5-", 6) == 0)
+    {
+        version += 6;
+    }
+
+    sscanf(version, "%d.%d.%d", &major, &minor, &patch);
+
+    if (mariadb)
+    {
+        return major > 10 || (major == 10 && (minor > 2 || (minor == 2 && patch >= 4)));
+    }
+
+    return major > 5 || (major == 5 && (minor > 7 || (minor == 7 && patch >= 3)));
+}
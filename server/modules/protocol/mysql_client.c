@@ -44,6 +44,9 @@
  *                                      replace gwbuf_consume by gwbuf_free (multiple).
  * 07/02/2016   Martin Brampton         Split off authentication and SSL.
  * 31/05/2016   Martin Brampton         Implement connection throttling
+ * 15/10/2016   Core Team               Compressed protocol
+ * 15/10/2016   Core Team               Stream large packets and LOAD DATA LOCAL INFILE
+ * 15/10/2016   Core Team               Sampled query tracing
  */
 #include <gw_protocol.h>
 #include <skygw_utils.h>
@@ -56,6 +59,8 @@
 #include <modinfo.h>
 #include <sys/stat.h>
 #include <modutil.h>
+#include <mysql_utils.h>
+#include <query_classifier.h>
 #include <netinet/tcp.h>
 
 #include "gw_authenticator.h"
@@ -87,13 +92,17 @@ static char *gw_default_auth();
 static int gw_connection_limit(DCB *dcb, int limit);
 static int mysql_send_ok(DCB *dcb, int packet_number, int in_affected_rows, const char* mysql_message);
 static int MySQLSendHandshake(DCB* dcb);
-static int route_by_statement(SESSION *, GWBUF **);
+static int route_by_statement(SESSION *, GWBUF **, bool);
 static void mysql_client_auth_error_handling(DCB *dcb, int auth_val);
 static int gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read);
 static int gw_read_normal_data(DCB *dcb, GWBUF *read_buffer, int nbytes_read);
 static int gw_read_finish_processing(DCB *dcb, GWBUF *read_buffer, uint8_t capabilities);
 extern char* create_auth_fail_str(char *username, char *hostaddr, char *sha1, char *db,int);
 static bool ensure_complete_packet(DCB *dcb, GWBUF **read_buffer, int nbytes_read);
+static void mysql_latency_start(SESSION *session, GWBUF *packet);
+static void mysql_ps_track(SESSION *session, GWBUF *packet);
+static void mysql_ps_reply(MySQLProtocol *proto, GWBUF *queue);
+static bool mysql_reply_complete(MySQLProtocol *proto, GWBUF *queue);
 
 /*
  * The "module object" for the mysqld client protocol module.
@@ -361,7 +370,10 @@ int MySQLSendHandshake(DCB* dcb)
     mysql_server_capabilities_one[1] = GW_MYSQL_SERVER_CAPABILITIES_BYTE2;
 
 
-    mysql_server_capabilities_one[0] &= ~(int)GW_MYSQL_CAPABILITIES_COMPRESS;
+    if (!dcb->service->compression)
+    {
+        mysql_server_capabilities_one[0] &= ~(int)GW_MYSQL_CAPABILITIES_COMPRESS;
+    }
 
     if (ssl_required_by_dcb(dcb))
     {
@@ -385,6 +397,11 @@ int MySQLSendHandshake(DCB* dcb)
     mysql_server_capabilities_two[0] = 15;
     mysql_server_capabilities_two[1] = 128;
 
+    if (dcb->service->session_track)
+    {
+        mysql_server_capabilities_two[0] |= (int)GW_MYSQL_CAPABILITIES_SESSION_TRACK >> 16;
+    }
+
     memcpy(mysql_handshake_payload, mysql_server_capabilities_two, sizeof(mysql_server_capabilities_two));
     mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_capabilities_two);
 
@@ -425,9 +442,418 @@ int MySQLSendHandshake(DCB* dcb)
  */
 int gw_MySQLWrite_client(DCB *dcb, GWBUF *queue)
 {
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+    if (proto->reply_state != MYSQL_REPLY_NONE && queue && dcb->session &&
+        mysql_reply_complete(proto, queue))
+    {
+        session_latency_end(dcb->session);
+    }
+    if (proto->ps_pending && queue)
+    {
+        mysql_ps_reply(proto, queue);
+    }
+    if (proto->compress && queue && (queue = mysql_compress(proto, queue, false)) == NULL)
+    {
+        return 0;
+    }
     return dcb_write(dcb, queue);
 }
 
+/**
+ * Start measuring the latency of a query that is about to be routed. Only
+ * the text and the prepared statement queries are measured, as the replies
+ * of the other commands do not have the same structure. Any other command
+ * abandons the measurement of an earlier query.
+ *
+ * @param session   The session of the client
+ * @param packet    The packet starting the query
+ */
+static void
+mysql_latency_start(SESSION *session, GWBUF *packet)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)session->client_dcb->protocol;
+    uint8_t cmd;
+
+    /** The session state is current if the reply to the previous command set it */
+    proto->session_state.current = proto->command_seq > 0 &&
+                                   proto->session_state.query == proto->command_seq;
+    proto->command_seq++;
+
+    if (gwbuf_copy_data(packet, MYSQL_HEADER_LEN, 1, &cmd) == 1 &&
+        (cmd == MYSQL_COM_QUERY || cmd == MYSQL_COM_STMT_EXECUTE))
+    {
+        proto->reply_state = MYSQL_REPLY_START;
+        proto->reply_skip = 0;
+        session_latency_start(session);
+        trace_start(session, session->client_dcb->evq.queued);
+    }
+    else
+    {
+        proto->reply_state = MYSQL_REPLY_NONE;
+        session->query_start = 0;
+        trace_cancel(session);
+    }
+}
+
+/** The number of buckets of the table of prepared statements of a client */
+#define MYSQL_PS_HASHSIZE 31
+
+static int
+mysql_ps_hash(void *key)
+{
+    return (int)((uintptr_t)key & 0x7fffffff);
+}
+
+static int
+mysql_ps_cmp(void *key1, void *key2)
+{
+    return key1 != key2;
+}
+
+/**
+ * Keep track of the prepared statements of a client. A COM_STMT_PREPARE is
+ * classified before it is routed, which the router then reuses, and its type
+ * is recorded once the reply tells the ID of the statement. A statement that
+ * is closed, or whose parameters are sent separately to the server that
+ * receives COM_STMT_SEND_LONG_DATA, is forgotten so that its executions are
+ * routed conservatively.
+ *
+ * @param session   The session of the client
+ * @param packet    The packet about to be routed, a contiguous buffer
+ */
+static void
+mysql_ps_track(SESSION *session, GWBUF *packet)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)session->client_dcb->protocol;
+    uint8_t *data = GWBUF_DATA(packet);
+
+    if (GWBUF_LENGTH(packet) <= MYSQL_HEADER_LEN)
+    {
+        return;
+    }
+
+    switch (MYSQL_GET_COMMAND(data))
+    {
+    case MYSQL_COM_STMT_PREPARE:
+        proto->ps_pending_type = qc_get_type(packet);
+        proto->ps_pending = true;
+        break;
+
+    case MYSQL_COM_STMT_CLOSE:
+    case MYSQL_COM_STMT_SEND_LONG_DATA:
+        if (proto->ps_types && GWBUF_LENGTH(packet) >= MYSQL_HEADER_LEN + 5)
+        {
+            hashtable_delete(proto->ps_types, MYSQL_PS_KEY(MYSQL_GET_STMT_ID(data)));
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/**
+ * Record the type of a prepared statement when the reply to its
+ * COM_STMT_PREPARE is written to the client. The first packet of a successful
+ * reply is COM_STMT_PREPARE_OK, which starts with the ID of the statement.
+ *
+ * @param proto The protocol of the client
+ * @param queue The reply
+ */
+static void
+mysql_ps_reply(MySQLProtocol *proto, GWBUF *queue)
+{
+    uint8_t data[MYSQL_HEADER_LEN + 5];
+
+    if (gwbuf_copy_data(queue, 0, sizeof(data), data) == sizeof(data) &&
+        MYSQL_GET_COMMAND(data) == 0x00)
+    {
+        void *key = MYSQL_PS_KEY(MYSQL_GET_STMT_ID(data));
+
+        spinlock_acquire(&proto->protocol_lock);
+
+        if (proto->protocol_state == MYSQL_PROTOCOL_ACTIVE &&
+            (proto->ps_types ||
+             (proto->ps_types = hashtable_alloc(MYSQL_PS_HASHSIZE, mysql_ps_hash, mysql_ps_cmp))))
+        {
+            hashtable_delete(proto->ps_types, key);
+            hashtable_add(proto->ps_types, key, (void *)(uintptr_t)proto->ps_pending_type);
+        }
+
+        spinlock_release(&proto->protocol_lock);
+    }
+
+    proto->ps_pending = false;
+}
+
+/**
+ * Return the size of a length-encoded integer
+ *
+ * @param first The first byte of the integer
+ * @return      The size in bytes
+ */
+static size_t
+mysql_lenenc_size(uint8_t first)
+{
+    return first < 0xfb ? 1 : first == 0xfc ? 3 : first == 0xfd ? 4 : 9;
+}
+
+/**
+ * Copy a length-encoded string of a session state change
+ *
+ * @param dest  Where the string is stored, it is truncated to fit
+ * @param size  Size of dest
+ * @param data  The data of the change
+ * @param end   The end of the data
+ */
+static void
+mysql_session_track_copy(char *dest, size_t size, uint8_t *data, uint8_t *end)
+{
+    size_t len;
+    char *str;
+
+    if (data < end && data + mysql_lenenc_size(*data) <= end)
+    {
+        str = lestr_consume(&data, &len);
+
+        if (data <= end)
+        {
+            len = MIN(len, size - 1);
+            memcpy(dest, str, len);
+            dest[len] = '\0';
+        }
+    }
+}
+
+/**
+ * Record the session state changes that an OK packet carries. The message of
+ * the packet is a length-encoded string when the session state is tracked and
+ * is followed by the changes, each of them a type and a length-encoded string
+ * of data.
+ *
+ * @param state The session state
+ * @param ptr   The message of the OK packet, after the warning count
+ * @param end   The end of the packet
+ */
+static void
+mysql_session_track(MYSQL_SESSION_STATE *state, uint8_t *ptr, uint8_t *end)
+{
+    size_t len;
+
+    /** Skip the message and read the length of the changes */
+    if (ptr >= end || ptr + mysql_lenenc_size(*ptr) > end)
+    {
+        return;
+    }
+    lestr_consume(&ptr, &len);
+
+    if (ptr >= end || ptr + mysql_lenenc_size(*ptr) > end)
+    {
+        return;
+    }
+    uint64_t total = leint_consume(&ptr);
+
+    if (total < (uint64_t)(end - ptr))
+    {
+        end = ptr + total;
+    }
+
+    while (ptr < end)
+    {
+        uint8_t type = *ptr++;
+
+        if (ptr >= end || ptr + mysql_lenenc_size(*ptr) > end)
+        {
+            break;
+        }
+
+        uint8_t *data = (uint8_t *)lestr_consume(&ptr, &len);
+
+        if (ptr > end)
+        {
+            break;
+        }
+
+        switch (type)
+        {
+        case MYSQL_SESSION_TRACK_SCHEMA:
+            mysql_session_track_copy(state->schema, sizeof(state->schema), data, ptr);
+            break;
+
+        case MYSQL_SESSION_TRACK_GTIDS:
+            /** The GTIDs follow the byte that tells how they are encoded */
+            mysql_session_track_copy(state->gtid, sizeof(state->gtid), data + 1, ptr);
+            break;
+
+        case MYSQL_SESSION_TRACK_TRANSACTION_STATE:
+            mysql_session_track_copy(state->trx_state, sizeof(state->trx_state), data, ptr);
+            break;
+
+        default:
+            /** The status flags tell the autocommit mode, the other variables are not kept */
+            break;
+        }
+    }
+}
+
+/**
+ * Record the server status of an OK packet of a reply and the session state
+ * changes that it carries
+ *
+ * @param proto     The client protocol
+ * @param iter      The reply, at the start of the packet
+ * @param pkt       The start of the packet
+ * @param n         Bytes of the packet in pkt
+ * @param pktlen    Length of the packet
+ * @param pos       Position of the status in the packet
+ */
+static void
+mysql_session_ok(MySQLProtocol *proto, GWBUF_ITERATOR *iter, uint8_t *pkt, size_t n,
+                 size_t pktlen, size_t pos)
+{
+    MYSQL_SESSION_STATE *state = &proto->session_state;
+
+    if (pos + 2 > n)
+    {
+        return;
+    }
+    state->status = gw_mysql_get_byte2(pkt + pos);
+    state->query = proto->command_seq;
+
+    if ((state->status & SERVER_SESSION_STATE_CHANGED) &&
+        (proto->client_capabilities & GW_MYSQL_CAPABILITIES_SESSION_TRACK) &&
+        pktlen <= MYSQL_SESSION_TRACK_MAXLEN)
+    {
+        uint8_t ok[MYSQL_SESSION_TRACK_MAXLEN];
+
+        if (gwbuf_iter_copy(iter, pktlen, ok) == pktlen)
+        {
+            /** The message follows the status and the warning count */
+            mysql_session_track(state, ok + pos + 4, ok + pktlen);
+        }
+    }
+}
+
+/**
+ * Follow the reply to a measured query as it is written to the client. The
+ * packets can be split across writes, only their headers must not be.
+ *
+ * @param proto The client protocol
+ * @param queue The data written to the client
+ * @return      True if the data ends the reply
+ */
+static bool
+mysql_reply_complete(MySQLProtocol *proto, GWBUF *queue)
+{
+    GWBUF_ITERATOR iter;
+    /** The header and an OK packet up to the status, the longest part inspected */
+    uint8_t pkt[MYSQL_HEADER_LEN + 1 + 9 + 9 + 2];
+    size_t len = gwbuf_length(queue);
+    size_t offset = proto->reply_skip;
+
+    if (offset >= len)
+    {
+        proto->reply_skip = offset - len;
+        return false;
+    }
+
+    gwbuf_iter_init(&iter, queue);
+    gwbuf_iter_skip(&iter, offset);
+
+    while (offset < len)
+    {
+        size_t n = gwbuf_iter_copy(&iter, sizeof(pkt), pkt);
+        size_t pktlen;
+
+        if (n < MYSQL_HEADER_LEN + 1)
+        {
+            /** The rest of the reply can not be followed */
+            proto->reply_state = MYSQL_REPLY_NONE;
+            return false;
+        }
+        pktlen = MYSQL_GET_PACKET_LEN(pkt) + MYSQL_HEADER_LEN;
+
+        switch (proto->reply_state)
+        {
+        case MYSQL_REPLY_START:
+            if (PTR_IS_OK(pkt))
+            {
+                size_t pos = MYSQL_HEADER_LEN + 1;
+
+                /** Skip the affected rows and the insert ID to the status */
+                pos += mysql_lenenc_size(pkt[pos]);
+                pos += mysql_lenenc_size(pkt[pos]);
+                mysql_session_ok(proto, &iter, pkt, n, pktlen, pos);
+
+                if (pos + 2 > n || (pkt[pos] & SERVER_MORE_RESULTS_EXIST) == 0)
+                {
+                    proto->reply_state = MYSQL_REPLY_NONE;
+                    return true;
+                }
+            }
+            else if (PTR_IS_ERR(pkt))
+            {
+                proto->reply_state = MYSQL_REPLY_NONE;
+                return true;
+            }
+            else if (PTR_IS_LOCAL_INFILE(pkt))
+            {
+                /** The client sends a file before the server replies */
+                proto->reply_state = MYSQL_REPLY_NONE;
+                proto->load_data = true;
+                return false;
+            }
+            else
+            {
+                proto->reply_state = MYSQL_REPLY_COLUMNS;
+            }
+            break;
+
+        case MYSQL_REPLY_COLUMNS:
+            if (PTR_IS_EOF(pkt))
+            {
+                proto->reply_state = MYSQL_REPLY_ROWS;
+            }
+            break;
+
+        case MYSQL_REPLY_ROWS:
+            if (PTR_IS_EOF(pkt) && n >= MYSQL_HEADER_LEN + 5)
+            {
+                /** The status follows the warning count */
+                proto->session_state.status = gw_mysql_get_byte2(pkt + MYSQL_HEADER_LEN + 3);
+                proto->session_state.query = proto->command_seq;
+            }
+
+            if (PTR_IS_EOF(pkt) && !PTR_EOF_MORE_RESULTS(pkt))
+            {
+                proto->reply_state = MYSQL_REPLY_NONE;
+                return true;
+            }
+            else if (PTR_IS_EOF(pkt))
+            {
+                proto->reply_state = MYSQL_REPLY_START;
+            }
+            else if (PTR_IS_ERR(pkt))
+            {
+                proto->reply_state = MYSQL_REPLY_NONE;
+                return true;
+            }
+            break;
+
+        default:
+            return false;
+        }
+
+        offset += pktlen;
+        gwbuf_iter_skip(&iter, pktlen);
+    }
+
+    /** The last packet continues in the next write */
+    proto->reply_skip = offset - len;
+    return false;
+}
+
 /**
  * @brief Client read event triggered by EPOLLIN
  *
@@ -480,7 +906,7 @@ int gw_read_client_event(DCB* dcb)
     {
         max_bytes = 36;
     }
-    return_code = dcb_read(dcb, &read_buffer, max_bytes);
+    return_code = mysql_compressed_read(dcb, &read_buffer, max_bytes);
     if (return_code < 0)
     {
         dcb_close(dcb);
@@ -560,7 +986,6 @@ gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
     int auth_val;
 
     protocol = (MySQLProtocol *)dcb->protocol;
-    /* int compress = -1; */
 
     /**
      * The first step in the authentication process is to extract the
@@ -574,12 +999,6 @@ gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
     if (MYSQL_AUTH_SUCCEEDED == (
         auth_val = dcb->authfunc.extract(dcb, read_buffer)))
     {
-        /*
-         * Maybe this comment will be useful some day:
-          compress =
-          GW_MYSQL_CAPABILITIES_COMPRESS & gw_mysql_get_byte4(
-          &protocol->client_capabilities);
-        */
         auth_val = dcb->authfunc.authenticate(dcb);
     }
 
@@ -619,6 +1038,14 @@ gw_read_do_authentication(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
              * packet sequence is # packet_number
              */
             mysql_send_ok(dcb, packet_number, 0, NULL);
+
+            /** The packets after the AUTH_OK packet are compressed */
+            if (dcb->service->compression &&
+                (gw_mysql_get_byte4((uint8_t *)&protocol->client_capabilities) &
+                 GW_MYSQL_CAPABILITIES_COMPRESS))
+            {
+                protocol->compress = true;
+            }
         }
         else
         {
@@ -832,8 +1259,15 @@ gw_read_normal_data(DCB *dcb, GWBUF *read_buffer, int nbytes_read)
      * we need to make sure that a complete SQL packet is read before continuing */
     if (capabilities & (int)RCAP_TYPE_STMT_INPUT)
     {
-        uint8_t* data;
-        int packet_size;
+        MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+        /** The continuation of a packet is routed as it is read */
+        if ((capabilities & (int)RCAP_TYPE_STREAM_INPUT) &&
+            (proto->stream_left || proto->stream_next || proto->load_data))
+        {
+            gwbuf_set_type(read_buffer, GWBUF_TYPE_MYSQL);
+            return gw_read_finish_processing(dcb, read_buffer, capabilities);
+        }
 
         if (nbytes_read < 3 || nbytes_read <
             (MYSQL_GET_PACKET_LEN((uint8_t *) GWBUF_DATA(read_buffer)) + 4))
@@ -895,7 +1329,8 @@ gw_read_finish_processing(DCB *dcb, GWBUF *read_buffer, uint8_t capabilities)
              * to router. The routing functions return 1 for
              * success or 0 for failure.
              */
-            return_code = route_by_statement(session, &read_buffer) ? 0 : 1;
+            return_code = route_by_statement(session, &read_buffer,
+                                             capabilities & (int)RCAP_TYPE_STREAM_INPUT) ? 0 : 1;
 
             if (read_buffer != NULL)
             {
@@ -911,7 +1346,9 @@ gw_read_finish_processing(DCB *dcb, GWBUF *read_buffer, uint8_t capabilities)
             /** Feed whole packet to router, which will free it
              *  and return 1 for success, 0 for failure
              */
+            mysql_latency_start(session, read_buffer);
             return_code = SESSION_ROUTE_QUERY(session, read_buffer) ? 0 : 1;
+            trace_routed();
         }
         /* else return_code is still 0 from when it was originally set */
         /* Note that read_buffer has been freed or transferred by this point */
@@ -1338,15 +1775,22 @@ retblock:
  * Return 1 in success. If the last packet is incomplete return success but
  * leave incomplete packet to readbuf.
  *
+ * If the router accepts streamed input, the packets that continue a packet
+ * of the maximum size and the contents of a LOAD DATA LOCAL INFILE file are
+ * routed as they are read, in buffers of the type GWBUF_TYPE_STREAM. The
+ * router sends them to the target of the packet they continue.
+ *
  * @param session       Session pointer
  * @param p_readbuf     Pointer to the address of GWBUF including the query
+ * @param stream        Whether the router accepts streamed input
  *
  * @return 1 if succeed,
  */
-static int route_by_statement(SESSION* session, GWBUF** p_readbuf)
+static int route_by_statement(SESSION* session, GWBUF** p_readbuf, bool stream)
 {
     int rc;
     GWBUF* packetbuf;
+    MySQLProtocol *proto = (MySQLProtocol *)session->client_dcb->protocol;
 #if defined(SS_DEBUG)
     GWBUF* tmpbuf;
 
@@ -1361,6 +1805,41 @@ static int route_by_statement(SESSION* session, GWBUF** p_readbuf)
     {
         ss_dassert(GWBUF_IS_TYPE_MYSQL((*p_readbuf)));
 
+        if (stream && proto->stream_left == 0 && (proto->stream_next || proto->load_data))
+        {
+            uint8_t header[MYSQL_HEADER_LEN];
+
+            if (gwbuf_copy_data(*p_readbuf, 0, MYSQL_HEADER_LEN, header) != MYSQL_HEADER_LEN)
+            {
+                rc = 1;
+                goto return_rc;
+            }
+
+            size_t len = MYSQL_GET_PACKET_LEN(header);
+
+            if (len == 0 && proto->load_data && !proto->stream_next)
+            {
+                /** The empty packet ends the file and is routed as a statement */
+                proto->load_data = false;
+            }
+            else
+            {
+                proto->stream_left = len + MYSQL_HEADER_LEN;
+                proto->stream_next = len == MYSQL_PACKET_LENGTH_MAX;
+            }
+        }
+
+        if (stream && proto->stream_left > 0)
+        {
+            size_t len = MIN(proto->stream_left, gwbuf_length(*p_readbuf));
+
+            packetbuf = gwbuf_split(p_readbuf, len);
+            proto->stream_left -= len;
+            gwbuf_set_type(packetbuf, GWBUF_TYPE_STREAM);
+            rc = SESSION_ROUTE_QUERY(session, packetbuf);
+            continue;
+        }
+
         /**
          * Collect incoming bytes to a buffer until complete packet has
          * arrived and then return the buffer.
@@ -1384,8 +1863,18 @@ static int route_by_statement(SESSION* session, GWBUF** p_readbuf)
              * sure it is set to each (MySQL) packet.
              */
             gwbuf_set_type(packetbuf, GWBUF_TYPE_SINGLE_STMT);
+
+            /** The packets that follow a packet of the maximum size continue it */
+            if (stream && MYSQL_GET_PACKET_LEN((uint8_t *)GWBUF_DATA(packetbuf)) == MYSQL_PACKET_LENGTH_MAX)
+            {
+                proto->stream_next = true;
+            }
+
+            mysql_latency_start(session, packetbuf);
+            mysql_ps_track(session, packetbuf);
             /** Route query */
             rc = SESSION_ROUTE_QUERY(session, packetbuf);
+            trace_routed();
         }
         else
         {
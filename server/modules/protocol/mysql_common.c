@@ -39,6 +39,7 @@
  * 07/07/2015   Martin Brampton         Fix problem recognising null password
  * 07/02/2016   Martin Brampton         Remove authentication functions to mysql_auth.c
  * 31/05/2016   Martin Brampton         Add mysql_create_standard_error function
+ * 15/10/2016   Core Team               Compressed protocol
  *
  */
 
@@ -49,6 +50,7 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <netinet/tcp.h>
+#include <zlib.h>
 
 static server_command_t* server_command_init(server_command_t* srvcmd, mysql_server_cmd_t cmd);
 
@@ -133,12 +135,198 @@ void mysql_protocol_done(DCB* dcb)
         free(scmd);
         scmd = scmd2;
     }
+    if (p->ps_types)
+    {
+        hashtable_free(p->ps_types);
+        p->ps_types = NULL;
+    }
+    gwbuf_free(p->compress_readq);
+    p->compress_readq = NULL;
+    gwbuf_free(p->sescmd_replyq);
+    p->sescmd_replyq = NULL;
     p->protocol_state = MYSQL_PROTOCOL_DONE;
 
 retblock:
     spinlock_release(&p->protocol_lock);
 }
 
+/**
+ * Decompress the complete compressed packets read from a connection. The
+ * incomplete packet at the end is kept until the rest of it is read.
+ *
+ * @param proto The protocol of the connection
+ * @param raw   The data read from the socket
+ * @param err   Set to true if a packet could not be decompressed
+ * @return The decompressed data, NULL if there was no complete packet
+ */
+static GWBUF* mysql_decompress(MySQLProtocol *proto, GWBUF *raw, bool *err)
+{
+    GWBUF *rval = NULL;
+    uint8_t hdr[MYSQL_COMPRESSED_HEADER_LEN];
+
+    proto->compress_readq = gwbuf_append(proto->compress_readq, raw);
+
+    while (gwbuf_copy_data(proto->compress_readq, 0, sizeof(hdr), hdr) == sizeof(hdr))
+    {
+        size_t complen = gw_mysql_get_byte3(hdr);
+        size_t len = gw_mysql_get_byte3(hdr + 4);
+
+        if (gwbuf_length(proto->compress_readq) < sizeof(hdr) + complen)
+        {
+            break;
+        }
+
+        /** The replies continue the sequence of the packets that were read */
+        proto->compress_seq = hdr[3] + 1;
+        proto->compress_readq = gwbuf_consume(proto->compress_readq, sizeof(hdr));
+
+        if (complen == 0)
+        {
+            continue;
+        }
+
+        GWBUF *payload = gwbuf_split(&proto->compress_readq, complen);
+
+        if (len > 0)
+        {
+            GWBUF *plain = gwbuf_alloc(len);
+            uLongf plainlen = len;
+
+            payload = gwbuf_make_contiguous(payload);
+
+            if (plain == NULL || payload == NULL ||
+                uncompress(GWBUF_DATA(plain), &plainlen, GWBUF_DATA(payload), complen) != Z_OK ||
+                plainlen != len)
+            {
+                MXS_ERROR("Failed to decompress a packet of %lu bytes.", complen);
+                gwbuf_free(plain);
+                gwbuf_free(payload);
+                *err = true;
+                break;
+            }
+
+            gwbuf_free(payload);
+            payload = plain;
+        }
+
+        rval = gwbuf_append(rval, payload);
+    }
+
+    return rval;
+}
+
+/**
+ * Read data from a connection. If the compressed protocol is in use, the
+ * compressed packets are decompressed and only the decompressed data is
+ * returned. The data that the protocol has put back to the read queue of
+ * the DCB is already decompressed and is returned before the new data.
+ *
+ * @param dcb       The DCB to read from
+ * @param head      Pointer to linked list to append data to
+ * @param maxbytes  Maximum bytes to read (0 = no limit)
+ * @return -1 on error, otherwise the number of bytes returned
+ */
+int mysql_compressed_read(DCB *dcb, GWBUF **head, int maxbytes)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)dcb->protocol;
+
+    if (!proto->compress)
+    {
+        return dcb_read(dcb, head, maxbytes);
+    }
+
+    GWBUF *plain;
+    GWBUF *raw = NULL;
+
+    spinlock_acquire(&dcb->authlock);
+    plain = dcb->dcb_readqueue;
+    dcb->dcb_readqueue = NULL;
+    spinlock_release(&dcb->authlock);
+
+    int rc = dcb_read(dcb, &raw, maxbytes);
+    bool err = false;
+
+    if (raw)
+    {
+        plain = gwbuf_append(plain, mysql_decompress(proto, raw, &err));
+    }
+
+    *head = gwbuf_append(*head, plain);
+
+    return rc < 0 || err ? -1 : (int)gwbuf_length(*head);
+}
+
+/**
+ * Compress data written to a connection that uses the compressed protocol.
+ * The data is split into compressed packets. Short payloads, and payloads
+ * that do not get any shorter, are sent uncompressed like the server does.
+ *
+ * The packets of the compressed protocol have a sequence number of their own.
+ * It starts from zero when a new command is sent and otherwise continues
+ * from the last packet read from the other end.
+ *
+ * @param proto   The protocol of the connection
+ * @param queue   The data to write, freed by this function
+ * @param command True if the data may start a new command
+ * @return The compressed packets or NULL on error
+ */
+GWBUF* mysql_compress(MySQLProtocol *proto, GWBUF *queue, bool command)
+{
+    uint8_t seq;
+
+    if (command && gwbuf_copy_data(queue, 3, 1, &seq) == 1 && seq == 0)
+    {
+        proto->compress_seq = 0;
+    }
+
+    if ((queue = gwbuf_make_contiguous(queue)) == NULL)
+    {
+        return NULL;
+    }
+
+    GWBUF *rval = NULL;
+    uint8_t *data = GWBUF_DATA(queue);
+    size_t total = GWBUF_LENGTH(queue);
+
+    for (size_t offset = 0; offset < total;)
+    {
+        size_t len = MIN(total - offset, MYSQL_COMPRESSED_MAX_PAYLOAD);
+        uLongf complen = compressBound(len);
+        GWBUF *packet = gwbuf_alloc(MYSQL_COMPRESSED_HEADER_LEN + complen);
+
+        if (packet == NULL)
+        {
+            gwbuf_free(rval);
+            rval = NULL;
+            break;
+        }
+
+        uint8_t *ptr = GWBUF_DATA(packet);
+
+        if (len < MYSQL_MIN_COMPRESS_LENGTH ||
+            compress2(ptr + MYSQL_COMPRESSED_HEADER_LEN, &complen,
+                      data + offset, len, Z_BEST_SPEED) != Z_OK || complen >= len)
+        {
+            memcpy(ptr + MYSQL_COMPRESSED_HEADER_LEN, data + offset, len);
+            complen = len;
+            gw_mysql_set_byte3(ptr + 4, 0);
+        }
+        else
+        {
+            gw_mysql_set_byte3(ptr + 4, len);
+        }
+
+        gw_mysql_set_byte3(ptr, complen);
+        ptr[3] = proto->compress_seq++;
+        packet = gwbuf_rtrim(packet, GWBUF_LENGTH(packet) - MYSQL_COMPRESSED_HEADER_LEN - complen);
+        rval = gwbuf_append(rval, packet);
+        offset += len;
+    }
+
+    gwbuf_free(queue);
+    return rval;
+}
+
 /**
  * Return a string representation of a MySQL protocol state.
  *
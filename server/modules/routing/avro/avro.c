@@ -20,6 +20,12 @@
  *
  * Date         Who                   Description
  * 25/02/2016   Massimiliano Pinto    Initial implementation
+ * 15/10/2016   Core Team             Addition of conversion_threads option
+ * 15/10/2016   Core Team             Addition of codec option
+ * 15/10/2016   Core Team             GTID index in WAL mode, updated by a separate thread
+ * 15/10/2016   Core Team             Addition of block_cache_size option
+ * 15/10/2016   Core Team             Addition of stream_unflushed option
+ * 15/10/2016   Core Team             Conversion thread notified of the binlog changes
  *
  * @endverbatim
  */
@@ -56,8 +62,6 @@
 #define BINLOG_NAMEFMT      "%s.%06d"
 #endif
 
-#define AVRO_TASK_DELAY_MAX 15
-
 static char *version_str = "V1.0.0";
 static const char* avro_task_name = "binlog_to_avro";
 static const char* index_task_name = "avro_indexing";
@@ -92,8 +96,6 @@ int avro_client_callback(DCB *dcb, DCB_REASON reason, void *userdata);
 static bool ensure_dir_ok(const char* path, int mode);
 bool avro_save_conversion_state(AVRO_INSTANCE *router);
 static void stats_func(void *);
-void avro_index_file(AVRO_INSTANCE *router, const char* path);
-void avro_update_index(AVRO_INSTANCE* router);
 
 /** The module object definition */
 static ROUTER_OBJECT MyObject =
@@ -163,6 +165,31 @@ void* safe_key_free(void *data)
     return NULL;
 }
 
+/**
+ * Set the journaling options of the sqlite database. In WAL mode the
+ * indexing thread, the conversion and the clients can use the database
+ * at the same time.
+ *
+ * @param handle SQLite handle
+ * @return True on success, false on error
+ */
+static bool set_index_options(sqlite3* handle)
+{
+    char* errmsg = NULL;
+
+    if (sqlite3_busy_timeout(handle, AVRO_SQLITE_BUSY_TIMEOUT) != SQLITE_OK ||
+        sqlite3_exec(handle, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;",
+                     NULL, NULL, &errmsg) != SQLITE_OK)
+    {
+        MXS_ERROR("Failed to set the journaling options of the GTID index: %s",
+                  sqlite3_errmsg(handle));
+        sqlite3_free(errmsg);
+        return false;
+    }
+
+    return true;
+}
+
 /**
  * Create the required tables in the sqlite database
  *
@@ -332,6 +359,15 @@ createInstance(SERVICE *service, char **options)
     inst->trx_count = 0;
     inst->row_target = AVRO_DEFAULT_BLOCK_ROW_COUNT;
     inst->trx_target = AVRO_DEFAULT_BLOCK_TRX_COUNT;
+    inst->codec = MAXAVRO_CODEC_NULL;
+    inst->stream_unflushed = false;
+    inst->tails = NULL;
+    inst->tail_trx = 1;
+    inst->tail_committed = 0;
+    inst->source = NULL;
+    inst->watcher.inotify_fd = -1;
+    inst->watcher.event_fd = -1;
+    size_t block_cache_size = AVRO_DEFAULT_BLOCK_CACHE_SIZE;
     int first_file = 1;
     bool err = false;
 
@@ -346,6 +382,7 @@ createInstance(SERVICE *service, char **options)
                 MXS_NOTICE("[%s] Using configuration options from service '%s'.",
                            service->name, source->name);
                 read_source_service_options(inst, (const char**)source->routerOptions);
+                inst->source = source;
             }
             else
             {
@@ -402,6 +439,26 @@ createInstance(SERVICE *service, char **options)
                 {
                     first_file = MAX(1, atoi(value));
                 }
+                else if (strcmp(options[i], "conversion_threads") == 0)
+                {
+                    inst->conversion_threads = MAX(0, atoi(value));
+                }
+                else if (strcmp(options[i], "block_cache_size") == 0)
+                {
+                    block_cache_size = MAX(0, atol(value));
+                }
+                else if (strcmp(options[i], "stream_unflushed") == 0)
+                {
+                    inst->stream_unflushed = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "codec") == 0)
+                {
+                    if ((inst->codec = maxavro_get_codec(value)) == MAXAVRO_CODEC_UNKNOWN)
+                    {
+                        MXS_ERROR("[%s] Unsupported Avro codec '%s'.", service->name, value);
+                        err = true;
+                    }
+                }
                 else
                 {
                     MXS_WARNING("[avrorouter] Unknown router option: '%s'", options[i]);
@@ -465,6 +522,22 @@ createInstance(SERVICE *service, char **options)
                              safe_key_free, (HASHMEMORYFN)avro_table_free);
         hashtable_memory_fns(inst->created_tables, (HASHMEMORYFN)strdup, NULL,
                              safe_key_free, (HASHMEMORYFN)table_create_free);
+
+        /** The tails are referred to by the clients until the router is freed */
+        if (inst->stream_unflushed)
+        {
+            if ((inst->tails = hashtable_alloc(1000, simple_str_hash, strcmp)))
+            {
+                hashtable_memory_fns(inst->tails, (HASHMEMORYFN)strdup, NULL,
+                                     safe_key_free, NULL);
+            }
+            else
+            {
+                MXS_ERROR("Hashtable allocation failed. This is most likely caused "
+                          "by a lack of available memory.");
+                err = true;
+            }
+        }
     }
     else
     {
@@ -507,7 +580,7 @@ createInstance(SERVICE *service, char **options)
                   sqlite3_errmsg(inst->sqlite_handle));
         err = true;
     }
-    else if (!create_tables(inst->sqlite_handle))
+    else if (!set_index_options(inst->sqlite_handle) || !create_tables(inst->sqlite_handle))
     {
         err = true;
     }
@@ -518,6 +591,7 @@ createInstance(SERVICE *service, char **options)
         hashtable_free(inst->table_maps);
         hashtable_free(inst->open_tables);
         hashtable_free(inst->created_tables);
+        hashtable_free(inst->tails);
         free(inst->avrodir);
         free(inst->binlogdir);
         free(inst->fileroot);
@@ -537,6 +611,9 @@ createInstance(SERVICE *service, char **options)
     /* AVRO converter init */
     avro_load_conversion_state(inst);
     avro_load_metadata_from_schemas(inst);
+    avro_worker_start(inst);
+    avro_index_start(inst, dbpath);
+    avro_cache_init(&inst->block_cache, block_cache_size);
 
     /*
      * Add tasks for statistic computation
@@ -546,8 +623,11 @@ createInstance(SERVICE *service, char **options)
     hktask_add(task_name, stats_func, inst, AVRO_STATS_FREQ);
      */
 
-    /* Start the scan, read, convert AVRO task */
-    add_conversion_task(inst);
+    /* Start the scan, read, convert AVRO thread, or poll with a task if it can't be used */
+    if (!avro_watch_start(inst))
+    {
+        add_conversion_task(inst);
+    }
 
     MXS_INFO("AVRO: current MySQL binlog file is %s, pos is %lu\n",
              inst->binlog_name, inst->current_pos);
@@ -595,6 +675,8 @@ newSession(ROUTER *instance, SESSION *session)
     client->format = AVRO_FORMAT_UNDEFINED;
 
     client->cstate = 0;
+    client->credit_records = AVRO_CREDIT_UNLIMITED;
+    client->credit_bytes = AVRO_CREDIT_UNLIMITED;
 
     client->connect_time = time(0);
     client->last_sent_pos = 0;
@@ -653,6 +735,7 @@ static void freeSession(ROUTER* router_instance, void* router_client_ses)
     free(client->uuid);
     maxavro_file_close(client->file_handle);
     sqlite3_close_v2(client->sqlite_handle);
+    avro_filter_free(&client->filter);
 
     /*
      * Remove the slave session form the list of slaves that are using the
@@ -816,6 +899,40 @@ diagnostics(ROUTER *router, DCB *dcb)
     dcb_printf(dcb, "\tCurrent GTID #events:                %lu\n",
                router_inst->gtid.event_num);
 
+    dcb_printf(dcb, "\tIndexed GTIDs:                       %lu\n",
+               router_inst->indexer.gtids.n_entries);
+    dcb_printf(dcb, "\tAvro codec:                          %s\n",
+               maxavro_codec_to_string(router_inst->codec));
+    dcb_printf(dcb, "\tStream unflushed records:            %s\n",
+               router_inst->stream_unflushed ? "yes" : "no");
+    dcb_printf(dcb, "\tBinlog change notification:          %s\n",
+               router_inst->watcher.listening ? "binlogrouter" :
+               router_inst->watcher.inotify_fd != -1 ? "inotify" : "polling");
+
+    if (router_inst->block_cache.max_size > 0)
+    {
+        dcb_printf(dcb, "\tDecoded block cache size:            %lu / %lu bytes\n",
+                   router_inst->block_cache.size, router_inst->block_cache.max_size);
+        dcb_printf(dcb, "\tDecoded block cache hits:            %lu\n",
+                   router_inst->block_cache.hits);
+        dcb_printf(dcb, "\tDecoded block cache misses:          %lu\n",
+                   router_inst->block_cache.misses);
+        dcb_printf(dcb, "\tDecoded block cache evictions:       %lu\n",
+                   router_inst->block_cache.evictions);
+    }
+
+    if (router_inst->conversion_threads > 0)
+    {
+        dcb_printf(dcb, "\tConversion threads:                  %d\n",
+                   router_inst->conversion_threads);
+
+        for (i = 0; i < router_inst->conversion_threads; i++)
+        {
+            dcb_printf(dcb, "\t\tThread %d: %lu row events converted, %d queued\n", i,
+                       router_inst->workers[i].n_events, router_inst->workers[i].pending);
+        }
+    }
+
     dcb_printf(dcb, "\tCurrent GTID affected tables: ");
     avro_get_used_tables(router_inst, dcb);
     dcb_printf(dcb, "\n");
@@ -866,6 +983,16 @@ diagnostics(ROUTER *router, DCB *dcb)
                        session->gtid.domain, session->gtid.server_id,
                        session->gtid.seq);
 
+            if (session->credit_records != AVRO_CREDIT_UNLIMITED)
+            {
+                dcb_printf(dcb, "\t\tRecord credit:               %ld\n", session->credit_records);
+            }
+
+            if (session->credit_bytes != AVRO_CREDIT_UNLIMITED)
+            {
+                dcb_printf(dcb, "\t\tByte credit:                 %ld\n", session->credit_bytes);
+            }
+
             // TODO: Add real value for this
             //dcb_printf(dcb, "\t\tAvro Transaction ID:         %u\n", 0);
             // TODO: Add real value for this
@@ -990,11 +1117,13 @@ stats_func(void *inst)
 */
 
 /**
- * Conversion task: MySQL binlogs to AVRO files
+ * Convert the binlogs to Avro files until the end of the last binlog
+ *
+ * @param router Avro router instance
+ * @return How the last binlog file that was read ended
  */
-void converter_func(void* data)
+avro_binlog_end_t avro_convert_binlogs(AVRO_INSTANCE *router)
 {
-    AVRO_INSTANCE* router = (AVRO_INSTANCE*) data;
     bool ok = true;
     avro_binlog_end_t binlog_end = AVRO_OK;
     while (ok && binlog_end == AVRO_OK)
@@ -1028,6 +1157,20 @@ void converter_func(void* data)
     if (binlog_end == AVRO_LAST_FILE)
     {
         router->task_delay = MIN(router->task_delay + 1, AVRO_TASK_DELAY_MAX);
+    }
+
+    return binlog_end;
+}
+
+/**
+ * Conversion task: MySQL binlogs to AVRO files
+ */
+void converter_func(void* data)
+{
+    AVRO_INSTANCE* router = (AVRO_INSTANCE*) data;
+
+    if (avro_convert_binlogs(router) == AVRO_LAST_FILE)
+    {
         add_conversion_task(router);
         MXS_INFO("Stopped processing file %s at position %lu. Waiting until"
                  " more data is written before continuing. Next check in %d seconds.",
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avro_cache.c - Decoded data blocks shared by the JSON clients
+ *
+ * Clients that stream the same table read the same data blocks at roughly
+ * the same time. The first client to read a block decodes its records into
+ * JSON and stores them in a router wide cache keyed by the file name and the
+ * offset of the block. The other clients send the records from the cache
+ * without reading or decoding the block. The cache is bounded by the
+ * block_cache_size option and the least recently used blocks are evicted.
+ *
+ * A block is referenced by the cache and by every client sending from it, so
+ * an evicted block is freed only after the last client has released it.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 15/10/2016   Core Team       Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic.h>
+#include <avrorouter.h>
+#include <log_manager.h>
+#include <skygw_utils.h>
+
+/** Initial number of records allocated for a block */
+#define AVRO_CACHE_ROWS_MIN 16
+
+/**
+ * Free a block
+ *
+ * @param block The block
+ */
+static void avro_block_free(AVRO_CACHED_BLOCK *block)
+{
+    for (uint64_t i = 0; i < block->n_rows; i++)
+    {
+        free(block->rows[i]);
+    }
+
+    free(block->rows);
+    free(block->gtids);
+    free(block->key);
+    free(block);
+}
+
+/**
+ * Release a reference to a block
+ *
+ * @param block The block
+ */
+void avro_cache_release(AVRO_CACHED_BLOCK *block)
+{
+    if (block && atomic_add(&block->refcount, -1) == 1)
+    {
+        avro_block_free(block);
+    }
+}
+
+/**
+ * Decode the records of the current data block of a file. The records are
+ * read from the file, so the file is at the end of the block afterwards.
+ *
+ * @param file The file, at the start of a data block
+ * @param key The cache key of the block
+ * @return The decoded block, possibly with only the records that were read
+ *         before an error, or NULL if memory could not be allocated
+ */
+static AVRO_CACHED_BLOCK* avro_block_decode(MAXAVRO_FILE *file, const char *key)
+{
+    AVRO_CACHED_BLOCK *block = calloc(1, sizeof(AVRO_CACHED_BLOCK));
+    uint64_t n = MAX(file->records_in_block, AVRO_CACHE_ROWS_MIN);
+
+    if (block == NULL ||
+        (block->key = strdup(key)) == NULL ||
+        (block->rows = malloc(n * sizeof(char*))) == NULL ||
+        (block->gtids = malloc(n * sizeof(gtid_pos_t))) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for a decoded data block.");
+
+        if (block)
+        {
+            avro_block_free(block);
+        }
+        return NULL;
+    }
+
+    block->refcount = 1;
+    block->size = sizeof(AVRO_CACHED_BLOCK) + strlen(key) + n * (sizeof(char*) + sizeof(gtid_pos_t));
+
+    MAXAVRO_JSON_BUFFER buf = {NULL, 0, 0};
+    uint64_t integers[file->schema->num_fields];
+
+    while (block->n_rows < n && maxavro_record_read_json_string(file, &buf, integers))
+    {
+        char *json = malloc(buf.len + 1);
+
+        if (json == NULL)
+        {
+            MXS_ERROR("Failed to allocate memory for a decoded record.");
+            break;
+        }
+
+        memcpy(json, buf.data, buf.len + 1);
+        avro_gtid_from_integers(file->schema, integers, &block->gtids[block->n_rows]);
+        block->rows[block->n_rows++] = json;
+        block->size += buf.len + 1;
+    }
+
+    maxavro_json_buffer_free(&buf);
+    return block;
+}
+
+/**
+ * Remove the least recently used block from the cache. The caller must hold
+ * the cache lock.
+ *
+ * @param cache The cache
+ */
+static void avro_cache_evict(AVRO_BLOCK_CACHE *cache)
+{
+    AVRO_CACHED_BLOCK *block = cache->tail;
+
+    cache->tail = block->prev;
+
+    if (cache->tail)
+    {
+        cache->tail->next = NULL;
+    }
+    else
+    {
+        cache->head = NULL;
+    }
+
+    hashtable_delete(cache->blocks, block->key);
+    cache->size -= block->size;
+    cache->evictions++;
+    avro_cache_release(block);
+}
+
+/**
+ * Move a block to the head of the LRU list. The caller must hold the cache
+ * lock.
+ *
+ * @param cache The cache
+ * @param block A block in the cache or a new block
+ */
+static void avro_cache_touch(AVRO_BLOCK_CACHE *cache, AVRO_CACHED_BLOCK *block)
+{
+    if (cache->head == block)
+    {
+        return;
+    }
+
+    if (block->prev)
+    {
+        block->prev->next = block->next;
+    }
+
+    if (block->next)
+    {
+        block->next->prev = block->prev;
+    }
+    else if (cache->tail == block)
+    {
+        cache->tail = block->prev;
+    }
+
+    block->prev = NULL;
+    block->next = cache->head;
+
+    if (cache->head)
+    {
+        cache->head->prev = block;
+    }
+
+    cache->head = block;
+
+    if (cache->tail == NULL)
+    {
+        cache->tail = block;
+    }
+}
+
+/**
+ * Initialize the decoded block cache
+ *
+ * @param cache The cache
+ * @param max_size Maximum memory used by the cached blocks, 0 disables the cache
+ * @return False if memory could not be allocated
+ */
+bool avro_cache_init(AVRO_BLOCK_CACHE *cache, size_t max_size)
+{
+    memset(cache, 0, sizeof(*cache));
+    spinlock_init(&cache->lock);
+    cache->max_size = max_size;
+
+    if (max_size > 0 && (cache->blocks = hashtable_alloc(1000, simple_str_hash, strcmp)) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the decoded block cache.");
+        cache->max_size = 0;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Get the decoded records of the current data block of a file
+ *
+ * The block is taken from the cache if another client has decoded it. If it
+ * is not in the cache and the file is at the start of a complete block, the
+ * block is decoded from the file and added to the cache. Otherwise the
+ * records must be read from the file.
+ *
+ * If the block is decoded, the file is left at the end of the block. If the
+ * block is taken from the cache, the file is not read at all. In both cases
+ * the caller sends the records starting from the number of records that had
+ * been read from the block before the call and then moves to the next block
+ * with maxavro_next_block.
+ *
+ * @param router The router instance
+ * @param file The file of the client
+ * @return The block that must be released with avro_cache_release or NULL
+ *         if the records must be read from the file
+ */
+AVRO_CACHED_BLOCK* avro_cache_get(AVRO_INSTANCE *router, MAXAVRO_FILE *file)
+{
+    AVRO_BLOCK_CACHE *cache = &router->block_cache;
+    AVRO_CACHED_BLOCK *block;
+    off_t offset;
+    size_t len;
+
+    if (cache->max_size == 0 || !maxavro_record_binary_range(file, &offset, &len) ||
+        file->records_read_from_block >= file->records_in_block)
+    {
+        return NULL;
+    }
+
+    char key[strlen(file->filename) + 32];
+    snprintf(key, sizeof(key), "%s:%ld", file->filename, file->block_start_pos);
+
+    spinlock_acquire(&cache->lock);
+
+    if ((block = hashtable_fetch(cache->blocks, key)))
+    {
+        avro_cache_touch(cache, block);
+        atomic_add(&block->refcount, 1);
+        cache->hits++;
+    }
+    else
+    {
+        cache->misses++;
+    }
+
+    spinlock_release(&cache->lock);
+
+    if (block || file->records_read_from_block > 0)
+    {
+        /** Partially read blocks are not decoded, the client reads the rest itself */
+        return block;
+    }
+
+    if ((block = avro_block_decode(file, key)) == NULL ||
+        block->n_rows < file->records_in_block || block->size > cache->max_size)
+    {
+        /** Sent to this client only */
+        return block;
+    }
+
+    spinlock_acquire(&cache->lock);
+    AVRO_CACHED_BLOCK *cached = hashtable_fetch(cache->blocks, key);
+
+    if (cached)
+    {
+        /** Another client decoded the same block at the same time */
+        avro_cache_touch(cache, cached);
+        atomic_add(&cached->refcount, 1);
+    }
+    else
+    {
+        while (cache->tail && cache->size + block->size > cache->max_size)
+        {
+            avro_cache_evict(cache);
+        }
+
+        if (hashtable_add(cache->blocks, block->key, block))
+        {
+            block->refcount++;
+            cache->size += block->size;
+            avro_cache_touch(cache, block);
+        }
+    }
+
+    spinlock_release(&cache->lock);
+
+    if (cached)
+    {
+        avro_cache_release(block);
+        block = cached;
+    }
+
+    return block;
+}
@@ -20,6 +20,12 @@
  * Date     Who         Description
  * 10/03/2016   Massimiliano Pinto   Initial implementation
  * 11/03/2016   Massimiliano Pinto   Addition of JSON output
+ * 15/10/2016   Core Team            Binary data blocks are sent with sendfile
+ * 15/10/2016   Core Team            JSON records are sent from the decoded block cache
+ * 15/10/2016   Core Team            Column and row filters for REQUEST-DATA
+ * 15/10/2016   Core Team            JSON records are encoded without jansson objects
+ * 15/10/2016   Core Team            GTID positions are read from the in-memory index
+ * 15/10/2016   Core Team            Credit based flow control with the CREDIT command
  *
  * @endverbatim
  */
@@ -28,6 +34,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <service.h>
 #include <server.h>
 #include <router.h>
@@ -240,6 +247,36 @@ void extract_gtid_request(gtid_pos_t *gtid, const char *start, int len)
     }
 }
 
+/**
+ * Find the start of the column list or the conditions of a REQUEST-DATA command
+ *
+ * @param ptr The part of the command after the file name
+ * @return Pointer to the COLUMNS or WHERE keyword or NULL if neither is present
+ */
+static const char* find_filter_start(const char *ptr)
+{
+    while (*ptr)
+    {
+        while (isspace(*ptr))
+        {
+            ptr++;
+        }
+
+        if ((strncasecmp(ptr, "COLUMNS", 7) == 0 && (isspace(ptr[7]) || ptr[7] == '\0')) ||
+            (strncasecmp(ptr, "WHERE", 5) == 0 && (isspace(ptr[5]) || ptr[5] == '\0')))
+        {
+            return ptr;
+        }
+
+        while (*ptr && !isspace(*ptr))
+        {
+            ptr++;
+        }
+    }
+
+    return NULL;
+}
+
 /**
  * Callback for GTID retrieval
  * @param data User data
@@ -433,6 +470,76 @@ bool file_in_dir(const char *dir, const char *file)
     return access(path, F_OK) == 0;
 }
 
+/**
+ * @brief Check if the client has credit left
+ *
+ * The client catch_lock must be held when calling this function.
+ *
+ * @param client The client
+ * @return True if both the record and the byte credit are positive
+ */
+static bool avro_client_has_credit(AVRO_CLIENT *client)
+{
+    return client->credit_records > 0 && client->credit_bytes > 0;
+}
+
+/**
+ * @brief Handle a CREDIT command
+ *
+ * The command is of the form CREDIT N [RECORDS|BYTES]. The first grant of a
+ * unit limits the data sent to the client and later grants add to the limit.
+ * A client that ran out of credit is woken up.
+ *
+ * @param client The client
+ * @param args The arguments of the command
+ */
+static void avro_client_add_credit(AVRO_CLIENT *client, const char *args)
+{
+    char buf[strlen(args) + 1];
+    char *saveptr;
+    strcpy(buf, args);
+
+    char *amount = strtok_r(buf, " \t\r\n", &saveptr);
+    char *unit = strtok_r(NULL, " \t\r\n", &saveptr);
+    char *end = NULL;
+    long long value = amount ? strtoll(amount, &end, 10) : 0;
+    bool bytes = unit && strcasecmp(unit, "BYTES") == 0;
+
+    if (amount == NULL || *end != '\0' || value <= 0 || value == LLONG_MAX)
+    {
+        dcb_printf(client->dcb, "ERR CREDIT Invalid amount '%s'", amount ? amount : "");
+    }
+    else if (unit && !bytes && strcasecmp(unit, "RECORDS") != 0)
+    {
+        dcb_printf(client->dcb, "ERR CREDIT Unknown unit '%s'", unit);
+    }
+    else if (strtok_r(NULL, " \t\r\n", &saveptr))
+    {
+        dcb_printf(client->dcb, "ERR CREDIT Too many arguments");
+    }
+    else
+    {
+        spinlock_acquire(&client->catch_lock);
+        int64_t *credit = bytes ? &client->credit_bytes : &client->credit_records;
+
+        if (*credit == AVRO_CREDIT_UNLIMITED)
+        {
+            *credit = value;
+        }
+        else if (*credit < AVRO_CREDIT_UNLIMITED - value)
+        {
+            *credit += value;
+        }
+
+        if ((client->cstate & AVRO_WAIT_CREDIT) && avro_client_has_credit(client))
+        {
+            client->cstate &= ~AVRO_WAIT_CREDIT;
+            avro_notify_client(client);
+        }
+        spinlock_release(&client->catch_lock);
+    }
+}
+
 /**
  * Process command from client
  *
@@ -447,6 +554,7 @@ avro_client_process_command(AVRO_INSTANCE *router, AVRO_CLIENT *client, GWBUF *q
     const char req_data[] = "REQUEST-DATA";
     const char req_last_gtid[] = "QUERY-LAST-TRANSACTION";
     const char req_gtid[] = "QUERY-TRANSACTION";
+    const char req_credit[] = "CREDIT";
     const size_t req_data_len = sizeof(req_data) - 1;
     size_t buflen = gwbuf_length(queue);
     uint8_t data[buflen + 1];
@@ -462,15 +570,36 @@ avro_client_process_command(AVRO_INSTANCE *router, AVRO_CLIENT *client, GWBUF *q
         if (data_len > 1)
         {
             const char *gtid_ptr = get_avrofile_name(file_ptr, data_len, client->avro_binfile);
+            const char *filter_ptr = gtid_ptr ? find_filter_start(gtid_ptr) : NULL;
+            char err[200] = "";
+
+            if (filter_ptr)
+            {
+                if (client->format != AVRO_FORMAT_JSON)
+                {
+                    snprintf(err, sizeof(err), "Column and row filters require the JSON format");
+                }
+                else
+                {
+                    avro_filter_parse(&client->filter, filter_ptr, err, sizeof(err));
+                }
+
+                /** Only the part before the filter can contain the GTID */
+                data_len = filter_ptr - file_ptr;
+            }
 
-            if (gtid_ptr)
+            if (gtid_ptr && strspn(gtid_ptr, " \t\r\n") < (size_t)(data_len - (gtid_ptr - file_ptr)))
             {
                 client->requested_gtid = true;
                 extract_gtid_request(&client->gtid, gtid_ptr, data_len - (gtid_ptr - file_ptr));
                 memcpy(&client->gtid_start, &client->gtid, sizeof(client->gtid_start));
             }
 
-            if (file_in_dir(router->avrodir, client->avro_binfile))
+            if (*err)
+            {
+                dcb_printf(client->dcb, "ERR REQUEST-DATA %s", err);
+            }
+            else if (file_in_dir(router->avrodir, client->avro_binfile))
             {
                 /* set callback routine for data sending */
                 dcb_add_callback(client->dcb, DCB_REASON_DRAINED, avro_client_callback, client);
@@ -501,6 +630,11 @@ avro_client_process_command(AVRO_INSTANCE *router, AVRO_CLIENT *client, GWBUF *q
                              GWBUF_LENGTH(queue) - sizeof(req_gtid));
         send_gtid_info(router, &gtid, client->dcb);
     }
+    /** Grant more data to the client */
+    else if (strncmp((char *)data, req_credit, sizeof(req_credit) - 1) == 0)
+    {
+        avro_client_add_credit(client, (char*)data + sizeof(req_credit) - 1);
+    }
     else
     {
         GWBUF *reply = gwbuf_alloc(5);
@@ -555,7 +689,88 @@ const char* get_avrofile_name(const char *file_ptr, int data_len, char *dest)
     return rval;
 }
 
-static int send_row(DCB *dcb, json_t* row)
+/**
+ * @brief Start sending a burst of data to a client
+ *
+ * The credit of the client is moved to the burst. The credit granted while the
+ * burst is being sent is added to the remaining credit when the burst ends.
+ *
+ * @param client The client
+ */
+static void avro_client_begin_burst(AVRO_CLIENT *client)
+{
+    spinlock_acquire(&client->catch_lock);
+    client->burst_records = client->credit_records;
+    client->burst_bytes = client->credit_bytes;
+
+    if (client->credit_records != AVRO_CREDIT_UNLIMITED)
+    {
+        client->credit_records = 0;
+    }
+
+    if (client->credit_bytes != AVRO_CREDIT_UNLIMITED)
+    {
+        client->credit_bytes = 0;
+    }
+    spinlock_release(&client->catch_lock);
+}
+
+/**
+ * @brief Return the unused credit of a burst to the client
+ *
+ * The client catch_lock must be held when calling this function.
+ *
+ * @param client The client
+ */
+static void avro_client_end_burst(AVRO_CLIENT *client)
+{
+    if (client->burst_records != AVRO_CREDIT_UNLIMITED)
+    {
+        client->credit_records += client->burst_records;
+    }
+
+    if (client->burst_bytes != AVRO_CREDIT_UNLIMITED)
+    {
+        client->credit_bytes += client->burst_bytes;
+    }
+}
+
+/**
+ * @brief Check if more data can be sent in the current burst
+ *
+ * @param client The client
+ * @return True if the client has credit and its write queue is not full
+ */
+static bool avro_client_can_send(AVRO_CLIENT *client)
+{
+    return client->burst_records > 0 && client->burst_bytes > 0 &&
+           client->dcb->writeqlen < AVRO_CLIENT_WRITEQ_MAX;
+}
+
+/**
+ * @brief Consume credit of the current burst
+ *
+ * A data block is sent whole, so the credit can become negative. The excess
+ * is deducted from the next grant.
+ *
+ * @param client The client
+ * @param records Number of records sent
+ * @param bytes Number of bytes sent
+ */
+static void avro_client_use_credit(AVRO_CLIENT *client, int64_t records, int64_t bytes)
+{
+    if (client->burst_records != AVRO_CREDIT_UNLIMITED)
+    {
+        client->burst_records -= records;
+    }
+
+    if (client->burst_bytes != AVRO_CREDIT_UNLIMITED)
+    {
+        client->burst_bytes -= bytes;
+    }
+}
+
+static int send_row(AVRO_CLIENT *client, json_t* row)
 {
     char *json = json_dumps(row, JSON_PRESERVE_ORDER);
     GWBUF *buf;
@@ -563,7 +778,8 @@ static int send_row(DCB *dcb, json_t* row)
 
     if (json && (buf = gwbuf_alloc_and_load(strlen(json), (void*)json)))
     {
-        rc = dcb->func.write(dcb, buf);
+        avro_client_use_credit(client, 1, GWBUF_LENGTH(buf));
+        rc = client->dcb->func.write(client->dcb, buf);
     }
     else
     {
@@ -574,6 +790,70 @@ static int send_row(DCB *dcb, json_t* row)
     return rc;
 }
 
+/**
+ * @brief Send the records of a decoded data block
+ *
+ * @param client The client
+ * @param block The decoded block
+ * @param next The first record to send, set to the first record that was not
+ * sent when the client runs out of credit
+ * @return Return value of the last write
+ */
+static int send_cached_rows(AVRO_CLIENT *client, AVRO_CACHED_BLOCK *block, uint64_t *next)
+{
+    int rc = 1;
+    uint64_t i;
+
+    for (i = *next; rc > 0 && i < block->n_rows && avro_client_can_send(client); i++)
+    {
+        GWBUF *buf = gwbuf_alloc_and_load(strlen(block->rows[i]), block->rows[i]);
+
+        if (buf)
+        {
+            avro_client_use_credit(client, 1, GWBUF_LENGTH(buf));
+            rc = client->dcb->func.write(client->dcb, buf);
+            client->gtid.domain = block->gtids[i].domain;
+            client->gtid.server_id = block->gtids[i].server_id;
+            client->gtid.seq = block->gtids[i].seq;
+        }
+        else
+        {
+            rc = 0;
+        }
+    }
+
+    *next = i;
+    return rc;
+}
+
+/**
+ * @brief Position a file at a record of its current data block
+ *
+ * This is used when a client stops sending a cached block in the middle. The
+ * file is still where sending started if the block was taken from the cache
+ * and at the end of the block if the block was decoded from the file.
+ *
+ * @param file The file
+ * @param first The record where sending started
+ * @param record The record to position the file at
+ * @return True if the file was positioned
+ */
+static bool seek_in_block(MAXAVRO_FILE *file, uint64_t first, uint64_t record)
+{
+    if (file->records_read_from_block != first)
+    {
+        file->records_read -= file->records_read_from_block;
+
+        if (!maxavro_record_set_pos(file, file->block_start_pos))
+        {
+            return false;
+        }
+    }
+
+    return record == file->records_read_from_block ||
+           maxavro_record_seek(file, record - file->records_read_from_block);
+}
+
 static void set_current_gtid(AVRO_CLIENT *client, json_t *row)
 {
     json_t *obj = json_object_get(row, avro_sequence);
@@ -589,9 +869,120 @@ static void set_current_gtid(AVRO_CLIENT *client, json_t *row)
     client->gtid.domain = json_integer_value(obj);
 }
 
+/**
+ * @brief Get the GTID of a record from its integer fields
+ *
+ * @param schema Schema of the record
+ * @param integers Integer values of the record, as returned by
+ * maxavro_record_read_json_string
+ * @param gtid Where the GTID is stored
+ */
+void avro_gtid_from_integers(MAXAVRO_SCHEMA *schema, const uint64_t *integers, gtid_pos_t *gtid)
+{
+    for (size_t i = 0; i < schema->num_fields; i++)
+    {
+        const char *name = schema->fields[i].name;
+
+        if (strcmp(name, avro_sequence) == 0)
+        {
+            gtid->seq = integers[i];
+        }
+        else if (strcmp(name, avro_server_id) == 0)
+        {
+            gtid->server_id = integers[i];
+        }
+        else if (strcmp(name, avro_domain) == 0)
+        {
+            gtid->domain = integers[i];
+        }
+    }
+}
+
+/**
+ * @brief Get the number of records of the current data block that were
+ * already sent from the tail
+ *
+ * @param client The client
+ * @param file The file of the client
+ * @return Number of records to skip in the block
+ */
+static uint64_t tail_skip(AVRO_CLIENT *client, MAXAVRO_FILE *file)
+{
+    uint64_t left = file->records_in_block - file->records_read_from_block;
+
+    return client->tail_pos > file->records_read ?
+           MIN(client->tail_pos - file->records_read, left) : 0;
+}
+
+/**
+ * @brief Send the committed records that are not yet flushed to the file
+ *
+ * This is called when the client has read the whole file. The records are
+ * sent from the tail of the file, starting from the first record that the
+ * client has not read from the file or sent from the tail.
+ *
+ * @param client The client
+ * @return True if the client ran out of credit before all committed records
+ * were sent
+ */
+static bool stream_tail(AVRO_CLIENT *client)
+{
+    MAXAVRO_FILE *file = client->file_handle;
+
+    if (client->tail == NULL &&
+        (client->tail = avro_tail_find(client->router, client->avro_binfile)) == NULL)
+    {
+        return false;
+    }
+
+    uint64_t pos = MAX(client->tail_pos, file->records_read);
+    enum avro_tail_result res = AVRO_TAIL_OK;
+    int rc = 1;
+    char *json;
+    gtid_pos_t gtid;
+
+    while (rc > 0 && avro_client_can_send(client) &&
+           (res = avro_tail_read(client->tail, pos, &json, &gtid)) == AVRO_TAIL_OK)
+    {
+        if (avro_filter_active(&client->filter))
+        {
+            json_t *row = json_loads(json, 0, NULL);
+            json_t *filtered = row ? avro_filter_row(&client->filter, row) : NULL;
+
+            if (filtered)
+            {
+                rc = send_row(client, filtered);
+                json_decref(filtered);
+            }
+            json_decref(row);
+        }
+        else
+        {
+            GWBUF *buf = gwbuf_alloc_and_load(strlen(json), json);
+            avro_client_use_credit(client, 1, buf ? GWBUF_LENGTH(buf) : 0);
+            rc = buf ? client->dcb->func.write(client->dcb, buf) : 0;
+        }
+
+        free(json);
+        client->gtid.domain = gtid.domain;
+        client->gtid.server_id = gtid.server_id;
+        client->gtid.seq = gtid.seq;
+        client->tail_pos = ++pos;
+    }
+
+    /** Flushed records are read from the file on the next notification */
+    return res == AVRO_TAIL_OK;
+}
+
 /**
  * @brief Stream Avro data in JSON format
  *
+ * Unless the client has filters, the records are encoded straight from the
+ * data blocks with maxavro_record_read_json_string. Streaming stops at the
+ * first record the client has no credit for. With stream_unflushed, the
+ * records that the client already got from the tail of the file are skipped
+ * and the committed records of the tail are sent once the file has been read.
+ *
  * @param file File to stream from
  * @param dcb DCB to stream to
  * @return True if more data is readable, false if all data was sent
@@ -601,27 +992,91 @@ static bool stream_json(AVRO_CLIENT *client)
     int bytes = 0;
     MAXAVRO_FILE *file = client->file_handle;
     DCB *dcb = client->dcb;
+    MAXAVRO_JSON_BUFFER json = {NULL, 0, 0};
+    uint64_t integers[file->schema->num_fields];
+    bool stopped = false;
 
     do
     {
         json_t *row;
         int rc = 1;
-        while (rc > 0 && (row = maxavro_record_read_json(file)))
+        uint64_t first = file->records_read_from_block;
+        uint64_t skip = tail_skip(client, file);
+        AVRO_CACHED_BLOCK *block = NULL;
+
+        if (skip > 0 && skip == file->records_in_block - first)
         {
-            rc = send_row(dcb, row);
-            set_current_gtid(client, row);
-            json_decref(row);
+            /** The rest of the block was sent from the tail */
+        }
+        /** The cache only has complete rows, filtered rows are read from the file */
+        else if (!avro_filter_active(&client->filter) &&
+                 (block = avro_cache_get(client->router, file)))
+        {
+            uint64_t next = first + skip;
+            rc = send_cached_rows(client, block, &next);
+
+            if (next < block->n_rows && rc > 0)
+            {
+                /** Out of credit, the rest of the block is read from the file */
+                seek_in_block(file, first, next);
+            }
+
+            avro_cache_release(block);
+        }
+        else if ((skip == 0 || maxavro_record_seek(file, skip)) &&
+                 !avro_filter_active(&client->filter))
+        {
+            while (rc > 0 && avro_client_can_send(client) &&
+                   maxavro_record_read_json_string(file, &json, integers))
+            {
+                GWBUF *buf = gwbuf_alloc_and_load(json.len, json.data);
+                avro_client_use_credit(client, 1, json.len);
+                rc = buf ? dcb->func.write(dcb, buf) : 0;
+                avro_gtid_from_integers(file->schema, integers, &client->gtid);
+            }
+        }
+        else
+        {
+            while (rc > 0 && avro_client_can_send(client) &&
+                   (row = maxavro_record_read_json(file)))
+            {
+                json_t *filtered = avro_filter_row(&client->filter, row);
+
+                if (filtered)
+                {
+                    rc = send_row(client, filtered);
+                    json_decref(filtered);
+                }
+
+                set_current_gtid(client, row);
+                json_decref(row);
+            }
         }
         bytes += file->block_size;
+        stopped = !avro_client_can_send(client);
+    }
+    while (!stopped && maxavro_next_block(file) && bytes < AVRO_DATA_BURST_SIZE);
+
+    maxavro_json_buffer_free(&json);
+
+    if (!stopped && bytes < AVRO_DATA_BURST_SIZE && client->router->stream_unflushed &&
+        !client->requested_gtid)
+    {
+        /** The whole file has been read */
+        stopped = stream_tail(client);
     }
-    while (maxavro_next_block(file) && bytes < AVRO_DATA_BURST_SIZE);
 
-    return bytes >= AVRO_DATA_BURST_SIZE;
+    return stopped || bytes >= AVRO_DATA_BURST_SIZE;
 }
 
 /**
  * @brief Stream Avro data in native Avro format
  *
+ * The data blocks that are completely written to the file are sent straight
+ * from the file with sendfile, see dcb_write_file. The blocks are read into
+ * buffers only if the DCB can not be written to that way. A block is sent if
+ * the client has any credit left, so the last block can exceed the credit.
+ *
  * @param file File to stream from
  * @param dcb DCB to stream to
  * @return True if streaming was successful, false if an error occurred
@@ -634,11 +1089,23 @@ static bool stream_binary(AVRO_CLIENT *client)
     MAXAVRO_FILE *file = client->file_handle;
     DCB *dcb = client->dcb;
 
-    while (rc > 0 && bytes < AVRO_DATA_BURST_SIZE)
+    while (rc > 0 && bytes < AVRO_DATA_BURST_SIZE && avro_client_can_send(client))
     {
+        off_t offset;
+        size_t len;
+        uint64_t records = file->records_in_block;
+
         bytes += file->block_size;
-        if ((buffer = maxavro_record_read_binary(file)))
+
+        if (maxavro_record_binary_range(file, &offset, &len) &&
+            (rc = dcb_write_file(dcb, NULL, fileno(file->file), offset, len)) != 0)
+        {
+            avro_client_use_credit(client, records, len);
+            maxavro_next_block(file);
+        }
+        else if ((buffer = maxavro_record_read_binary(file)))
         {
+            avro_client_use_credit(client, records, gwbuf_length(buffer));
             rc = dcb->func.write(dcb, buffer);
         }
         else
@@ -647,53 +1114,35 @@ static bool stream_binary(AVRO_CLIENT *client)
         }
     }
 
-    return bytes >= AVRO_DATA_BURST_SIZE;
+    return rc > 0;
 }
 
-static int sqlite_cb(void* data, int rows, char** values, char** names)
-{
-    for (int i = 0; i < rows; i++)
-    {
-        if (values[i])
-        {
-            *((long*)data) = strtol(values[i], NULL, 10);
-            return 0;
-        }
-    }
-    return 0;
-}
-
-static const char select_template[] = "SELECT max(position) FROM gtid WHERE domain=%lu "
-                                      "AND server_id=%lu AND sequence <= %lu AND avrofile=\"%s\";";
-
+/**
+ * @brief Seek to the position of the requested GTID in the in-memory index
+ *
+ * @param client The client
+ * @param file File to seek
+ * @return True if the file was positioned, false if an error occurred
+ */
 static bool seek_to_index_pos(AVRO_CLIENT *client, MAXAVRO_FILE* file)
 {
     char *name = strrchr(client->file_handle->filename, '/');
     ss_dassert(name);
     name++;
 
-    char sql[sizeof(select_template) + NAME_MAX + 80];
-    snprintf(sql, sizeof(sql), select_template, client->gtid.domain,
-             client->gtid.server_id, client->gtid.seq, name);
+    long position;
+    uint64_t record;
+    bool rval = true;
 
-    long offset = -1;
-    char *errmsg = NULL;
-    bool rval = false;
-
-    if (sqlite3_exec(client->sqlite_handle, sql, sqlite_cb, &offset, &errmsg) == SQLITE_OK)
-    {
-        rval = true;
-        if (offset > 0 && !maxavro_record_set_pos(file, offset))
-        {
-            rval = false;
-        }
-    }
-    else
+    if (avro_index_find(client->router, name, &client->gtid, &position, &record) &&
+        (!maxavro_record_set_pos(file, position) ||
+         (record > 0 && !maxavro_record_seek(file, record))))
     {
-        MXS_ERROR("Failed to query index position for GTID %lu-%lu-%lu: %s",
-                  client->gtid.domain, client->gtid.server_id, client->gtid.seq, errmsg);
+        MXS_ERROR("Failed to seek to the indexed position of GTID %lu-%lu-%lu in '%s'.",
+                  client->gtid.domain, client->gtid.server_id, client->gtid.seq, name);
+        rval = false;
     }
-    sqlite3_free(errmsg);
+
     return rval;
 }
 
@@ -709,7 +1158,8 @@ static bool seek_to_gtid(AVRO_CLIENT *client, MAXAVRO_FILE* file)
     do
     {
         json_t *row;
-        while ((row = maxavro_record_read_json(file)))
+        while ((seeking || avro_client_can_send(client)) &&
+               (row = maxavro_record_read_json(file)))
         {
             json_t *obj = json_object_get(row, avro_sequence);
             ss_dassert(json_is_integer(obj));
@@ -740,9 +1190,12 @@ static bool seek_to_gtid(AVRO_CLIENT *client, MAXAVRO_FILE* file)
 
             /** We'll send the first found row immediately since we have already
              * read the row into memory */
-            if (!seeking)
+            json_t *filtered;
+
+            if (!seeking && (filtered = avro_filter_row(&client->filter, row)))
             {
-                send_row(client->dcb, row);
+                send_row(client, filtered);
+                json_decref(filtered);
             }
 
             json_decref(row);
@@ -778,6 +1231,12 @@ static bool avro_client_stream_data(AVRO_CLIENT *client)
         }
         spinlock_release(&client->file_lock);
 
+        if (!avro_client_can_send(client))
+        {
+            /** Out of credit or the write queue is full */
+            return true;
+        }
+
         switch (client->format)
         {
             case AVRO_FORMAT_JSON:
@@ -812,7 +1271,7 @@ static bool avro_client_stream_data(AVRO_CLIENT *client)
         memcpy(&client->avro_file, client->file_handle, sizeof(client->avro_file));
 
         /* may be just use client->avro_file->records_read and remove this var */
-        client->last_sent_pos = client->avro_file.records_read;
+        client->last_sent_pos = MAX(client->avro_file.records_read, client->tail_pos);
     }
     else
     {
@@ -895,6 +1354,8 @@ static void rotate_avro_file(AVRO_CLIENT *client, char *fullname)
     char *filename = strrchr(fullname, '/') + 1;
     strncpy(client->avro_binfile, filename, sizeof(client->avro_binfile));
     client->last_sent_pos = 0;
+    client->tail = NULL;
+    client->tail_pos = 0;
 
     spinlock_acquire(&client->file_lock);
     maxavro_file_close(client->file_handle);
@@ -955,7 +1416,7 @@ int avro_client_callback(DCB *dcb, DCB_REASON reason, void *userdata)
         AVRO_CLIENT *client = (AVRO_CLIENT*)userdata;
 
         spinlock_acquire(&client->catch_lock);
-        if (client->cstate & AVRO_CS_BUSY)
+        if (client->cstate & (AVRO_CS_BUSY | AVRO_WAIT_CREDIT))
         {
             spinlock_release(&client->catch_lock);
             return 0;
@@ -964,6 +1425,8 @@ int avro_client_callback(DCB *dcb, DCB_REASON reason, void *userdata)
         client->cstate |= AVRO_CS_BUSY;
         spinlock_release(&client->catch_lock);
 
+        avro_client_begin_burst(client);
+
         if (client->last_sent_pos == 0)
         {
             /** Send the schema of the current file */
@@ -973,6 +1436,7 @@ int avro_client_callback(DCB *dcb, DCB_REASON reason, void *userdata)
             {
                 case AVRO_FORMAT_JSON:
                     schema = read_avro_json_schema(client->avro_binfile, client->router->avrodir);
+                    schema = avro_filter_schema(&client->filter, schema);
                     break;
 
                 case AVRO_FORMAT_AVRO:
@@ -997,25 +1461,35 @@ int avro_client_callback(DCB *dcb, DCB_REASON reason, void *userdata)
                             filename, sizeof(filename));
 
         bool next_file;
-        /** If the next file is available, send it to the client */
-        if ((next_file = (access(filename, R_OK) == 0)))
+        /** If the current file is sent and the next file is available, send it to the client */
+        if ((next_file = (!read_more && access(filename, R_OK) == 0)))
         {
             rotate_avro_file(client, filename);
         }
 
         spinlock_acquire(&client->catch_lock);
+        avro_client_end_burst(client);
         client->cstate &= ~AVRO_CS_BUSY;
-        client->cstate |= AVRO_WAIT_DATA;
 
-        if (next_file || read_more)
+        if (!avro_client_has_credit(client))
         {
-#ifdef SS_DEBUG
-            if (read_more)
+            /** Streaming continues when the client grants more credit */
+            client->cstate |= AVRO_WAIT_CREDIT;
+        }
+        else
+        {
+            client->cstate |= AVRO_WAIT_DATA;
+
+            if (next_file || read_more)
             {
-                MXS_DEBUG("Burst limit hit, need to read more data.");
-            }
+#ifdef SS_DEBUG
+                if (read_more)
+                {
+                    MXS_DEBUG("Burst limit hit, need to read more data.");
+                }
 #endif
-            avro_notify_client(client);
+                avro_notify_client(client);
+            }
         }
         spinlock_release(&client->catch_lock);
     }
@@ -26,6 +26,7 @@
  *
  * Date         Who             Description
  * 25/02/2016   Markus Mäkelä   Initial implementation
+ * 15/10/2016   Core Team       Row events are converted by the conversion threads
  *
  * @endverbatim
  */
@@ -47,7 +48,6 @@ void handle_query_event(AVRO_INSTANCE *router, REP_HEADER *hdr,
 bool is_create_table_statement(AVRO_INSTANCE *router, char* ptr, size_t len);
 void avro_flush_all_tables(AVRO_INSTANCE *router);
 void avro_notify_client(AVRO_CLIENT *client);
-void avro_update_index(AVRO_INSTANCE* router);
 void update_used_tables(AVRO_INSTANCE* router);
 TABLE_CREATE* table_create_from_schema(const char* file, const char* db,
                                        const char* table, int version);
@@ -96,11 +96,14 @@ void avro_close_binlog(int fd)
 /**
  * @brief Allocate an Avro table
  *
- * Create an Aro table and prepare it for writing.
+ * Create an Aro table and prepare it for writing. Existing files keep the
+ * codec they were created with.
  * @param filepath Path to the created file
  * @param json_schema The schema of the table in JSON format
+ * @param codec Compression codec of the data blocks of a new file
  */
-AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema)
+AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema,
+                             enum maxavro_codec codec)
 {
     AVRO_TABLE *table = calloc(1, sizeof(AVRO_TABLE));
     if (table)
@@ -121,7 +124,9 @@ AVRO_TABLE* avro_table_alloc(const char* filepath, const char* json_schema)
         }
         else
         {
-            rc = avro_file_writer_create(filepath, table->avro_schema, &table->avro_file);
+            rc = avro_file_writer_create_with_codec(filepath, table->avro_schema,
+                                                    &table->avro_file,
+                                                    maxavro_codec_to_string(codec), 0);
         }
 
         if (rc)
@@ -305,6 +310,11 @@ void* avro_table_free(AVRO_TABLE *table)
     {
         avro_file_writer_flush(table->avro_file);
         avro_file_writer_close(table->avro_file);
+
+        if (table->tail)
+        {
+            avro_tail_flush(table->tail);
+        }
         avro_value_iface_decref(table->avro_writer_iface);
         avro_schema_decref(table->avro_schema);
         free(table->json_schema);
@@ -697,6 +707,7 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
             router->gtid.seq = n_sequence;
             router->gtid.event_num = 0;
             router->gtid.timestamp = hdr.timestamp;
+            avro_worker_new_trx(router);
 
             /* GTID event flags check, for 10.0 and 10.1 */
             if ((flags & (MARIADB_FL_DDL | MARIADB_FL_STANDALONE)) == 0)
@@ -719,6 +730,11 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
             {
                 /** A non-transactional engine finished a transaction */
                 router->trx_count++;
+
+                if (router->stream_unflushed)
+                {
+                    avro_tail_commit(router);
+                }
             }
         }
         else if (hdr.event_type == XID_EVENT)
@@ -726,6 +742,11 @@ avro_binlog_end_t avro_read_all_events(AVRO_INSTANCE *router)
             router->trx_count++;
             pending_transaction = 0;
 
+            if (router->stream_unflushed)
+            {
+                avro_tail_commit(router);
+            }
+
             if (router->row_count >= router->row_target ||
                 router->trx_count >= router->trx_target)
             {
@@ -846,6 +867,9 @@ void avro_load_metadata_from_schemas(AVRO_INSTANCE *router)
  */
 void avro_flush_all_tables(AVRO_INSTANCE *router)
 {
+    /** The queued row events must be in the files before they are flushed */
+    avro_worker_drain(router);
+
     HASHITERATOR *iter = hashtable_iterator(router->open_tables);
 
     if (iter)
@@ -858,13 +882,18 @@ void avro_flush_all_tables(AVRO_INSTANCE *router)
             if (table)
             {
                 avro_file_writer_flush(table->avro_file);
+
+                if (table->tail)
+                {
+                    avro_tail_flush(table->tail);
+                }
+
+                /** Update the GTID index */
+                avro_index_queue(router, table->filename);
             }
         }
         hashtable_iterator_free(iter);
     }
-
-    /** Update the GTID index */
-    avro_update_index(router);
 }
 
 /**
@@ -995,6 +1024,8 @@ void handle_query_event(AVRO_INSTANCE *router, REP_HEADER *hdr, int *pending_tra
 
     if (is_create_table_statement(router, sql, len))
     {
+        /** The conversion threads must not use the replaced table definition */
+        avro_worker_drain(router);
         TABLE_CREATE *created = table_create_alloc(sql, db);
 
         if (created && !save_and_replace_table_create(router, created))
@@ -1004,6 +1035,7 @@ void handle_query_event(AVRO_INSTANCE *router, REP_HEADER *hdr, int *pending_tra
     }
     else if (is_alter_table_statement(router, sql, len))
     {
+        avro_worker_drain(router);
         char ident[MYSQL_TABLE_MAXLEN + MYSQL_DATABASE_MAXLEN + 2];
         char full_ident[MYSQL_TABLE_MAXLEN + MYSQL_DATABASE_MAXLEN + 2];
         read_alter_identifier(sql, sql + len, ident, sizeof(ident));
@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avro_filter.c - Column and row filters of the CDC clients
+ *
+ * A REQUEST-DATA command can limit the columns that are sent with a COLUMNS
+ * list and the rows that are sent with WHERE conditions:
+ *
+ * REQUEST-DATA db.table [GTID] [COLUMNS col1,col2,...] [WHERE cond [AND cond]...]
+ *
+ * A condition is of the form column OP value without spaces, where OP is one
+ * of =, !=, <, <=, > and >=. Values are compared as numbers if both the column
+ * and the value are numbers and as strings otherwise. A row is sent only if
+ * all conditions match it, a missing or a null column never matches.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 15/10/2016   Core Team       Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <avrorouter.h>
+#include <log_manager.h>
+#include <skygw_utils.h>
+
+static const char filter_columns[] = "COLUMNS";
+static const char filter_where[] = "WHERE";
+static const char filter_and[] = "AND";
+
+/**
+ * Free a list of predicates
+ *
+ * @param pred First predicate of the list
+ */
+static void avro_predicate_free(AVRO_PREDICATE *pred)
+{
+    while (pred)
+    {
+        AVRO_PREDICATE *next = pred->next;
+        free(pred->column);
+        free(pred->value);
+        free(pred);
+        pred = next;
+    }
+}
+
+/**
+ * Free the columns and predicates of a filter
+ *
+ * @param filter The filter
+ */
+void avro_filter_free(AVRO_FILTER *filter)
+{
+    for (int i = 0; i < filter->n_columns; i++)
+    {
+        free(filter->columns[i]);
+    }
+
+    free(filter->columns);
+    avro_predicate_free(filter->predicates);
+    memset(filter, 0, sizeof(*filter));
+}
+
+/**
+ * Check if a filter limits the columns or the rows
+ *
+ * @param filter The filter
+ * @return True if not all data is sent
+ */
+bool avro_filter_active(AVRO_FILTER *filter)
+{
+    return filter->columns || filter->predicates;
+}
+
+/**
+ * Parse a comma separated column list
+ *
+ * @param filter The filter
+ * @param list The column list
+ * @return False if memory could not be allocated
+ */
+static bool parse_columns(AVRO_FILTER *filter, char *list)
+{
+    char *saveptr;
+
+    for (char *tok = strtok_r(list, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr))
+    {
+        char **columns = realloc(filter->columns, (filter->n_columns + 1) * sizeof(char*));
+
+        if (columns == NULL)
+        {
+            return false;
+        }
+
+        filter->columns = columns;
+
+        if ((filter->columns[filter->n_columns] = strdup(tok)) == NULL)
+        {
+            return false;
+        }
+
+        filter->n_columns++;
+    }
+
+    return true;
+}
+
+/**
+ * Parse one condition
+ *
+ * @param filter The filter
+ * @param cond The condition
+ * @param err Buffer where the error is stored
+ * @param errlen Size of @p err
+ * @return False if the condition is invalid
+ */
+static bool parse_predicate(AVRO_FILTER *filter, char *cond, char *err, size_t errlen)
+{
+    size_t len = strcspn(cond, "!=<>");
+    char *op = cond + len;
+    char *value;
+    enum avro_filter_op type;
+
+    if (strncmp(op, "!=", 2) == 0)
+    {
+        type = AVRO_FILTER_NE;
+        value = op + 2;
+    }
+    else if (strncmp(op, "<=", 2) == 0)
+    {
+        type = AVRO_FILTER_LE;
+        value = op + 2;
+    }
+    else if (strncmp(op, ">=", 2) == 0)
+    {
+        type = AVRO_FILTER_GE;
+        value = op + 2;
+    }
+    else if (*op == '=' || *op == '<' || *op == '>')
+    {
+        type = *op == '=' ? AVRO_FILTER_EQ : *op == '<' ? AVRO_FILTER_LT : AVRO_FILTER_GT;
+        value = op + 1;
+    }
+    else
+    {
+        snprintf(err, errlen, "Invalid condition '%s'", cond);
+        return false;
+    }
+
+    if (len == 0 || *value == '\0')
+    {
+        snprintf(err, errlen, "Invalid condition '%s'", cond);
+        return false;
+    }
+
+    AVRO_PREDICATE *pred = calloc(1, sizeof(AVRO_PREDICATE));
+
+    if (pred == NULL || (pred->column = strndup(cond, len)) == NULL ||
+        (pred->value = strdup(value)) == NULL)
+    {
+        avro_predicate_free(pred);
+        snprintf(err, errlen, "Memory allocation failed");
+        return false;
+    }
+
+    char *end;
+    pred->op = type;
+    pred->number = strtod(value, &end);
+    pred->is_number = *end == '\0';
+    pred->next = filter->predicates;
+    filter->predicates = pred;
+
+    return true;
+}
+
+/**
+ * Parse the column list and the conditions of a REQUEST-DATA command
+ *
+ * Any previous filter is freed first.
+ *
+ * @param filter The filter
+ * @param str The part of the command starting with COLUMNS or WHERE
+ * @param err Buffer where the error is stored
+ * @param errlen Size of @p err
+ * @return False if the filter is invalid
+ */
+bool avro_filter_parse(AVRO_FILTER *filter, const char *str, char *err, size_t errlen)
+{
+    char buf[strlen(str) + 1];
+    char *saveptr;
+    bool in_where = false;
+    bool rval = true;
+
+    strcpy(buf, str);
+    avro_filter_free(filter);
+
+    for (char *tok = strtok_r(buf, " \t\r\n", &saveptr); tok && rval;
+         tok = strtok_r(NULL, " \t\r\n", &saveptr))
+    {
+        if (strcasecmp(tok, filter_columns) == 0)
+        {
+            char *list = strtok_r(NULL, " \t\r\n", &saveptr);
+            in_where = false;
+
+            if (list == NULL || filter->columns)
+            {
+                snprintf(err, errlen, "Expected one column list after %s", filter_columns);
+                rval = false;
+            }
+            else if (!parse_columns(filter, list))
+            {
+                snprintf(err, errlen, "Memory allocation failed");
+                rval = false;
+            }
+        }
+        else if (strcasecmp(tok, filter_where) == 0)
+        {
+            in_where = true;
+        }
+        else if (in_where && strcasecmp(tok, filter_and) == 0)
+        {
+            continue;
+        }
+        else if (in_where)
+        {
+            rval = parse_predicate(filter, tok, err, errlen);
+        }
+        else
+        {
+            snprintf(err, errlen, "Unexpected '%s'", tok);
+            rval = false;
+        }
+    }
+
+    if (rval && in_where && filter->predicates == NULL)
+    {
+        snprintf(err, errlen, "Expected a condition after %s", filter_where);
+        rval = false;
+    }
+
+    if (!rval)
+    {
+        avro_filter_free(filter);
+    }
+
+    return rval;
+}
+
+/**
+ * Check if a row matches a condition
+ *
+ * @param pred The condition
+ * @param row The row
+ * @return True if the row matches
+ */
+static bool predicate_match(AVRO_PREDICATE *pred, json_t *row)
+{
+    json_t *value = json_object_get(row, pred->column);
+    int cmp;
+
+    if (value && json_is_number(value) && pred->is_number)
+    {
+        double number = json_number_value(value);
+        cmp = number < pred->number ? -1 : number > pred->number ? 1 : 0;
+    }
+    else if (value && json_is_string(value))
+    {
+        cmp = strcmp(json_string_value(value), pred->value);
+    }
+    else
+    {
+        return false;
+    }
+
+    switch (pred->op)
+    {
+        case AVRO_FILTER_EQ:
+            return cmp == 0;
+        case AVRO_FILTER_NE:
+            return cmp != 0;
+        case AVRO_FILTER_LT:
+            return cmp < 0;
+        case AVRO_FILTER_LE:
+            return cmp <= 0;
+        case AVRO_FILTER_GT:
+            return cmp > 0;
+        case AVRO_FILTER_GE:
+            return cmp >= 0;
+    }
+
+    return false;
+}
+
+/**
+ * Apply a filter to a row
+ *
+ * @param filter The filter
+ * @param row The row
+ * @return A new reference to the row or to a row with only the requested
+ *         columns, NULL if the row is filtered out
+ */
+json_t* avro_filter_row(AVRO_FILTER *filter, json_t *row)
+{
+    for (AVRO_PREDICATE *pred = filter->predicates; pred; pred = pred->next)
+    {
+        if (!predicate_match(pred, row))
+        {
+            return NULL;
+        }
+    }
+
+    if (filter->columns == NULL)
+    {
+        return json_incref(row);
+    }
+
+    json_t *rval = json_object();
+
+    for (int i = 0; rval && i < filter->n_columns; i++)
+    {
+        json_t *value = json_object_get(row, filter->columns[i]);
+
+        if (value)
+        {
+            json_object_set(rval, filter->columns[i], value);
+        }
+    }
+
+    return rval;
+}
+
+/**
+ * Remove the fields that are not requested from a JSON schema
+ *
+ * @param filter The filter
+ * @param schema The schema, freed by this function
+ * @return The schema with the fields in the requested order or the original
+ *         schema if all columns are requested or the schema can't be parsed
+ */
+GWBUF* avro_filter_schema(AVRO_FILTER *filter, GWBUF *schema)
+{
+    if (filter->columns == NULL || schema == NULL)
+    {
+        return schema;
+    }
+
+    size_t len = gwbuf_length(schema);
+    char str[len + 1];
+    gwbuf_copy_data(schema, 0, len, (uint8_t*)str);
+    str[len] = '\0';
+
+    json_error_t error;
+    json_t *json = json_loads(str, 0, &error);
+    json_t *fields = json ? json_object_get(json, "fields") : NULL;
+    json_t *arr = json_array();
+
+    if (json == NULL || !json_is_array(fields) || arr == NULL)
+    {
+        MXS_ERROR("Failed to parse JSON schema: %s", json ? "No fields" : error.text);
+        json_decref(json);
+        json_decref(arr);
+        return schema;
+    }
+
+    for (int i = 0; i < filter->n_columns; i++)
+    {
+        for (size_t j = 0; j < json_array_size(fields); j++)
+        {
+            json_t *field = json_array_get(fields, j);
+            const char *name = json_string_value(json_object_get(field, "name"));
+
+            if (name && strcmp(name, filter->columns[i]) == 0)
+            {
+                json_array_append(arr, field);
+                break;
+            }
+        }
+    }
+
+    json_object_set_new(json, "fields", arr);
+    char *dump = json_dumps(json, JSON_PRESERVE_ORDER);
+    GWBUF *rval = dump ? gwbuf_alloc_and_load(strlen(dump), dump) : NULL;
+
+    free(dump);
+    json_decref(json);
+
+    if (rval)
+    {
+        gwbuf_free(schema);
+        return rval;
+    }
+
+    return schema;
+}
@@ -21,159 +21,473 @@
  * seeking to the offset of the file and reading the record instead of iterating
  * through all the records and looking for a matching record.
  *
- * The index is stored as an SQLite3 database.
+ * The index is stored as an SQLite3 database in WAL mode. The index is
+ * updated by a separate thread that indexes the files the conversion has
+ * flushed, so indexing does not stall the conversion.
+ *
+ * The index is also kept in memory. Each GTID is stored with the offset of
+ * its data block and the index of its first record in the block, so a client
+ * can seek straight to the record without querying the database.
  *
  * @verbatim
  * Revision History
  *
  * Date         Who             Description
  * 2/04/2016   Markus Mäkelä   Initial implementation
+ * 15/10/2016   Core Team       Indexing in a separate thread with prepared statements
+ * 15/10/2016   Core Team       In-memory GTID index
  *
  * @endverbatim
  */
 
 #include <avrorouter.h>
 #include <skygw_debug.h>
+#include <thread.h>
 #include <glob.h>
+#include <sys/stat.h>
 
 void* safe_key_free(void *data);
 
-static const char insert_template[] = "INSERT INTO gtid(domain, server_id, "
-                                      "sequence, avrofile, position) values (%lu, %lu, %lu, \"%s\", %ld);";
-
-static void set_gtid(gtid_pos_t *gtid, json_t *row)
-{
-    json_t *obj = json_object_get(row, avro_sequence);
-    ss_dassert(json_is_integer(obj));
-    gtid->seq = json_integer_value(obj);
+static const char insert_sql_template[] = "INSERT INTO "GTID_TABLE_NAME"(domain, server_id, "
+                                          "sequence, avrofile, position) values (?, ?, ?, ?, ?);";
+static const char read_progress_sql[] = "SELECT position FROM "INDEX_TABLE_NAME" WHERE filename=?;";
+static const char save_progress_sql[] = "INSERT OR REPLACE INTO "INDEX_TABLE_NAME" values (?, ?);";
+static const char load_index_sql[] = "SELECT domain, server_id, sequence, avrofile, position FROM "
+                                     GTID_TABLE_NAME" ORDER BY rowid;";
 
-    obj = json_object_get(row, avro_server_id);
-    ss_dassert(json_is_integer(obj));
-    gtid->server_id = json_integer_value(obj);
+/** Initial number of entries in a GTID list */
+#define AVRO_GTID_LIST_MIN 64
 
-    obj = json_object_get(row, avro_domain);
-    ss_dassert(json_is_integer(obj));
-    gtid->domain = json_integer_value(obj);
+/**
+ * @brief Free a GTID list
+ *
+ * @param list The list
+ * @return Always NULL
+ */
+static void* gtid_list_free(void *data)
+{
+    AVRO_GTID_LIST *list = (AVRO_GTID_LIST*)data;
+    free(list->entries);
+    free(list);
+    return NULL;
 }
 
-int index_query_cb(void *data, int rows, char** values, char** names)
+/**
+ * @brief Add a GTID to the in-memory index
+ *
+ * The GTIDs of a domain and server are added in file order, so each list stays
+ * sorted. A GTID that is not larger than the last GTID in its list is
+ * ignored, a client then starts from the earlier position.
+ *
+ * @param index The in-memory index
+ * @param name Name of the Avro file
+ * @param gtid The GTID
+ * @param position Offset of the data block
+ * @param record Index of the record in the data block
+ */
+static void gtid_index_add(AVRO_GTID_INDEX *index, const char *name, gtid_pos_t *gtid,
+                           long position, uint64_t record)
 {
-    for (int i = 0; i < rows; i++)
+    char key[strlen(name) + 50];
+    snprintf(key, sizeof(key), "%s:%lu:%lu", name, gtid->domain, gtid->server_id);
+
+    spinlock_acquire(&index->lock);
+    AVRO_GTID_LIST *list = hashtable_fetch(index->lists, key);
+
+    if (list == NULL && (list = calloc(1, sizeof(AVRO_GTID_LIST))) &&
+        !hashtable_add(index->lists, key, list))
+    {
+        free(list);
+        list = NULL;
+    }
+
+    if (list && (list->n_entries == 0 || list->entries[list->n_entries - 1].seq < gtid->seq))
     {
-        if (values[i])
+        if (list->n_entries == list->size)
         {
-            *((long*)data) = strtol(values[i], NULL, 10);
-            return 0;
+            size_t size = list->size ? list->size * 2 : AVRO_GTID_LIST_MIN;
+            AVRO_GTID_ENTRY *entries = realloc(list->entries, size * sizeof(AVRO_GTID_ENTRY));
+
+            if (entries)
+            {
+                list->entries = entries;
+                list->size = size;
+            }
+        }
+
+        if (list->n_entries < list->size)
+        {
+            AVRO_GTID_ENTRY *entry = &list->entries[list->n_entries++];
+            entry->seq = gtid->seq;
+            entry->position = position;
+            entry->record = record;
+            index->n_entries++;
         }
     }
-    return 0;
+
+    spinlock_release(&index->lock);
 }
 
-void avro_index_file(AVRO_INSTANCE *router, const char* filename)
+/**
+ * @brief Find the position of a GTID in an Avro file
+ *
+ * The position is that of the largest indexed GTID of the same domain and
+ * server that is not larger than the requested GTID.
+ *
+ * @param router Avro router instance
+ * @param filename Name of the Avro file
+ * @param gtid The requested GTID
+ * @param position Offset of the data block
+ * @param record Index of the record in the data block
+ * @return True if a position was found, false if the file must be read from
+ * the start
+ */
+bool avro_index_find(AVRO_INSTANCE *router, const char *filename, gtid_pos_t *gtid,
+                     long *position, uint64_t *record)
 {
-    MAXAVRO_FILE *file = maxavro_file_open(filename);
-    if (file)
+    AVRO_GTID_INDEX *index = &router->indexer.gtids;
+    char key[strlen(filename) + 50];
+    snprintf(key, sizeof(key), "%s:%lu:%lu", filename, gtid->domain, gtid->server_id);
+    bool rval = false;
+
+    if (index->lists == NULL)
     {
-        char *name = strrchr(filename, '/');
-        ss_dassert(name);
+        return false;
+    }
 
-        if (name)
+    spinlock_acquire(&index->lock);
+    AVRO_GTID_LIST *list = hashtable_fetch(index->lists, key);
+
+    if (list && list->n_entries > 0 && list->entries[0].seq <= gtid->seq)
+    {
+        /** Binary search for the last entry with a sequence <= the requested one */
+        size_t lo = 0;
+        size_t hi = list->n_entries;
+
+        while (hi - lo > 1)
         {
-            char sql[AVRO_SQL_BUFFER_SIZE];
-            char *errmsg;
-            long pos = -1;
-            name++;
-
-            snprintf(sql, sizeof(sql), "SELECT position FROM "INDEX_TABLE_NAME
-                     " WHERE filename=\"%s\";", name);
-            if (sqlite3_exec(router->sqlite_handle, sql, index_query_cb, &pos, &errmsg) != SQLITE_OK)
+            size_t mid = lo + (hi - lo) / 2;
+
+            if (list->entries[mid].seq <= gtid->seq)
             {
-                MXS_ERROR("Failed to read last indexed position of file '%s': %s",
-                          name, errmsg);
+                lo = mid;
             }
-            else if (pos > 0)
+            else
             {
-                /** Continue from last position */
-                maxavro_record_set_pos(file, pos);
+                hi = mid;
             }
-            sqlite3_free(errmsg);
-            errmsg = NULL;
+        }
 
-            gtid_pos_t prev_gtid = {0, 0, 0, 0, 0};
+        *position = list->entries[lo].position;
+        *record = list->entries[lo].record;
+        rval = true;
+    }
 
-            if (sqlite3_exec(router->sqlite_handle, "BEGIN", NULL, NULL, &errmsg) != SQLITE_OK)
+    spinlock_release(&index->lock);
+    return rval;
+}
+
+/**
+ * @brief Load the in-memory GTID index from the index database
+ *
+ * @param router Avro router instance
+ * @return False if memory could not be allocated
+ */
+static bool gtid_index_load(AVRO_INSTANCE *router)
+{
+    AVRO_INDEXER *indexer = &router->indexer;
+    AVRO_GTID_INDEX *index = &indexer->gtids;
+    sqlite3_stmt *stmt;
+    int rc;
+
+    spinlock_init(&index->lock);
+    index->n_entries = 0;
+
+    if ((index->lists = hashtable_alloc(1000, simple_str_hash, strcmp)) == NULL)
+    {
+        MXS_ERROR("[%s] Failed to allocate memory for the GTID index.", router->service->name);
+        return false;
+    }
+
+    hashtable_memory_fns(index->lists, (HASHMEMORYFN)strdup, NULL,
+                         safe_key_free, gtid_list_free);
+
+    if (sqlite3_prepare_v2(indexer->handle, load_index_sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        MXS_ERROR("[%s] Failed to load the GTID index: %s", router->service->name,
+                  sqlite3_errmsg(indexer->handle));
+        return true;
+    }
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        gtid_pos_t gtid = {0, 0, 0, 0, 0};
+        gtid.domain = sqlite3_column_int64(stmt, 0);
+        gtid.server_id = sqlite3_column_int64(stmt, 1);
+        gtid.seq = sqlite3_column_int64(stmt, 2);
+        const char *name = (const char*)sqlite3_column_text(stmt, 3);
+
+        if (name)
+        {
+            gtid_index_add(index, name, &gtid, sqlite3_column_int64(stmt, 4), 0);
+        }
+    }
+
+    if (rc != SQLITE_DONE)
+    {
+        MXS_ERROR("[%s] Failed to load the GTID index: %s", router->service->name,
+                  sqlite3_errmsg(indexer->handle));
+    }
+
+    sqlite3_finalize(stmt);
+    MXS_NOTICE("[%s] Loaded %lu GTIDs from the GTID index.", router->service->name,
+               index->n_entries);
+    return true;
+}
+
+/**
+ * @brief Read the position up to which a file is indexed
+ *
+ * @param indexer The indexing thread
+ * @param name Name of the file
+ * @return The position or -1 if the file has not been indexed
+ */
+static long read_progress(AVRO_INDEXER *indexer, const char *name)
+{
+    long pos = -1;
+    int rc;
+
+    sqlite3_bind_text(indexer->read_progress, 1, name, -1, SQLITE_STATIC);
+
+    while ((rc = sqlite3_step(indexer->read_progress)) == SQLITE_ROW)
+    {
+        pos = sqlite3_column_int64(indexer->read_progress, 0);
+    }
+
+    if (rc != SQLITE_DONE)
+    {
+        MXS_ERROR("Failed to read last indexed position of file '%s': %s",
+                  name, sqlite3_errmsg(indexer->handle));
+    }
+
+    sqlite3_reset(indexer->read_progress);
+    return pos;
+}
+
+/**
+ * @brief Index the new data blocks of an Avro file
+ *
+ * Only the data blocks that were completely written when the file was
+ * flushed are indexed, the rest are indexed when the file is flushed again.
+ *
+ * @param router Avro router instance
+ * @param filename Path of the file
+ * @param size Size of the file when it was flushed
+ */
+static void avro_index_file(AVRO_INSTANCE *router, const char* filename, off_t size)
+{
+    AVRO_INDEXER *indexer = &router->indexer;
+    const char *name = strrchr(filename, '/');
+    ss_dassert(name);
+
+    if (name == NULL)
+    {
+        MXS_ERROR("Malformed filename: %s", filename);
+        return;
+    }
+
+    MAXAVRO_FILE *file = maxavro_file_open(filename);
+
+    if (file)
+    {
+        name++;
+        long pos = read_progress(indexer, name);
+
+        if (pos > 0)
+        {
+            /** Continue from last position */
+            maxavro_record_set_pos(file, pos);
+        }
+
+        gtid_pos_t prev_gtid = {0, 0, 0, 0, 0};
+        MAXAVRO_JSON_BUFFER buf = {NULL, 0, 0};
+        uint64_t integers[file->schema->num_fields];
+
+        do
+        {
+            off_t offset;
+            size_t len;
+
+            if (!maxavro_record_binary_range(file, &offset, &len) ||
+                offset + (off_t)len > size)
             {
-                MXS_ERROR("Failed to start transaction: %s", errmsg);
+                break;
             }
-            sqlite3_free(errmsg);
 
-            do
+            uint64_t record = file->records_read_from_block;
+
+            for (; maxavro_record_read_json_string(file, &buf, integers); record++)
             {
-                json_t *row = maxavro_record_read_json(file);
+                gtid_pos_t gtid = {0, 0, 0, 0, 0};
+                avro_gtid_from_integers(file->schema, integers, &gtid);
 
-                if (row)
+                if (prev_gtid.domain != gtid.domain ||
+                    prev_gtid.server_id != gtid.server_id ||
+                    prev_gtid.seq != gtid.seq)
                 {
-                    gtid_pos_t gtid;
-                    set_gtid(&gtid, row);
+                    sqlite3_bind_int64(indexer->insert_gtid, 1, gtid.domain);
+                    sqlite3_bind_int64(indexer->insert_gtid, 2, gtid.server_id);
+                    sqlite3_bind_int64(indexer->insert_gtid, 3, gtid.seq);
+                    sqlite3_bind_text(indexer->insert_gtid, 4, name, -1, SQLITE_STATIC);
+                    sqlite3_bind_int64(indexer->insert_gtid, 5, file->block_start_pos);
 
-                    if (prev_gtid.domain != gtid.domain ||
-                        prev_gtid.server_id != gtid.server_id ||
-                        prev_gtid.seq != gtid.seq)
+                    if (sqlite3_step(indexer->insert_gtid) != SQLITE_DONE)
                     {
-                        snprintf(sql, sizeof(sql), insert_template, gtid.domain,
-                                 gtid.server_id, gtid.seq, name, file->block_start_pos);
-                        if (sqlite3_exec(router->sqlite_handle, sql, NULL, NULL,
-                                         &errmsg) != SQLITE_OK)
-                        {
-                            MXS_ERROR("Failed to insert GTID %lu-%lu-%lu for %s "
-                                      "into index database: %s", gtid.domain,
-                                      gtid.server_id, gtid.seq, name, errmsg);
-
-                        }
-                        sqlite3_free(errmsg);
-                        errmsg = NULL;
-                        prev_gtid = gtid;
+                        MXS_ERROR("Failed to insert GTID %lu-%lu-%lu for %s "
+                                  "into index database: %s", gtid.domain,
+                                  gtid.server_id, gtid.seq, name,
+                                  sqlite3_errmsg(indexer->handle));
                     }
-                }
-                else
-                {
-                    break;
+
+                    sqlite3_reset(indexer->insert_gtid);
+                    gtid_index_add(&indexer->gtids, name, &gtid, file->block_start_pos, record);
+                    prev_gtid = gtid;
                 }
             }
-            while (maxavro_next_block(file));
+        }
+        while (maxavro_next_block(file));
+
+        maxavro_json_buffer_free(&buf);
+
+        sqlite3_bind_int64(indexer->save_progress, 1, file->block_start_pos);
+        sqlite3_bind_text(indexer->save_progress, 2, name, -1, SQLITE_STATIC);
+
+        if (sqlite3_step(indexer->save_progress) != SQLITE_DONE)
+        {
+            MXS_ERROR("Failed to update indexing progress: %s",
+                      sqlite3_errmsg(indexer->handle));
+        }
+
+        sqlite3_reset(indexer->save_progress);
+        maxavro_file_close(file);
+    }
+}
+
+/**
+ * @brief Execute a statement on the index database of the indexing thread
+ *
+ * @param indexer The indexing thread
+ * @param sql The statement
+ * @return True on success
+ */
+static bool indexer_exec(AVRO_INDEXER *indexer, const char *sql)
+{
+    char *errmsg = NULL;
+    bool rval = sqlite3_exec(indexer->handle, sql, NULL, NULL, &errmsg) == SQLITE_OK;
+
+    if (!rval)
+    {
+        MXS_ERROR("Failed to execute '%s' on the GTID index: %s", sql, errmsg);
+    }
+
+    sqlite3_free(errmsg);
+    return rval;
+}
+
+/**
+ * @brief The main loop of the indexing thread
+ *
+ * The files queued since the last batch are indexed in one transaction.
+ *
+ * @param arg The router instance
+ */
+static void avro_index_main(void *arg)
+{
+    AVRO_INSTANCE *router = (AVRO_INSTANCE*)arg;
+    AVRO_INDEXER *indexer = &router->indexer;
 
-            if (sqlite3_exec(router->sqlite_handle, "COMMIT", NULL, NULL, &errmsg) != SQLITE_OK)
+    while (indexer->running)
+    {
+        spinlock_acquire(&indexer->lock);
+        AVRO_INDEX_FILE *files = indexer->queue;
+        indexer->queue = NULL;
+        spinlock_release(&indexer->lock);
+
+        if (files)
+        {
+            bool trx = indexer_exec(indexer, "BEGIN");
+
+            while (files)
             {
-                MXS_ERROR("Failed to commit transaction: %s", errmsg);
+                AVRO_INDEX_FILE *next = files->next;
+                avro_index_file(router, files->filename, files->size);
+                free(files->filename);
+                free(files);
+                files = next;
             }
-            sqlite3_free(errmsg);
 
-            snprintf(sql, sizeof(sql), "INSERT OR REPLACE INTO "INDEX_TABLE_NAME
-                     " values (%lu, \"%s\");", file->block_start_pos, name);
-            if (sqlite3_exec(router->sqlite_handle, sql, NULL, NULL,
-                             &errmsg) != SQLITE_OK)
+            if (trx)
             {
-                MXS_ERROR("Failed to update indexing progress: %s", errmsg);
+                indexer_exec(indexer, "COMMIT");
             }
-            sqlite3_free(errmsg);
-            errmsg = NULL;
         }
         else
         {
-            MXS_ERROR("Malformed filename: %s", filename);
+            thread_millisleep(100);
         }
+    }
+}
 
-        maxavro_file_close(file);
+/**
+ * @brief Queue an Avro file for indexing after it has been flushed
+ *
+ * @param router Avro router instance
+ * @param filename Path of the file
+ */
+void avro_index_queue(AVRO_INSTANCE *router, const char *filename)
+{
+    AVRO_INDEXER *indexer = &router->indexer;
+    struct stat st;
+
+    if (!indexer->running || stat(filename, &st) != 0)
+    {
+        return;
+    }
+
+    spinlock_acquire(&indexer->lock);
+    AVRO_INDEX_FILE *file = indexer->queue;
+
+    while (file && strcmp(file->filename, filename) != 0)
+    {
+        file = file->next;
+    }
+
+    if (file)
+    {
+        file->size = st.st_size;
     }
+    else if ((file = malloc(sizeof(AVRO_INDEX_FILE))) &&
+             (file->filename = strdup(filename)))
+    {
+        file->size = st.st_size;
+        file->next = indexer->queue;
+        indexer->queue = file;
+    }
+    else
+    {
+        MXS_ERROR("Failed to allocate memory for indexing file '%s'.", filename);
+        free(file);
+    }
+    spinlock_release(&indexer->lock);
 }
 
 /**
  * @brief Avro file indexing task
  *
- * Builds an index of filenames, GTIDs and positions in the Avro file.
- * This allows all tables that contain a GTID to be fetched in an effiecent
- * manner.
- * @param data The router instance
+ * Queues all Avro files for the indexing thread, which builds an index of
+ * filenames, GTIDs and positions in the Avro file. This allows all tables
+ * that contain a GTID to be fetched in an effiecent manner.
+ * @param router The router instance
  */
 void avro_update_index(AVRO_INSTANCE* router)
 {
@@ -185,13 +499,64 @@ void avro_update_index(AVRO_INSTANCE* router)
     {
         for (int i = 0; i < files.gl_pathc; i++)
         {
-            avro_index_file(router, files.gl_pathv[i]);
+            avro_index_queue(router, files.gl_pathv[i]);
         }
     }
 
     globfree(&files);
 }
 
+/**
+ * @brief Start the GTID indexing thread
+ *
+ * The thread uses its own connection to the index database and indexes all
+ * existing Avro files first.
+ *
+ * @param router Avro router instance
+ * @param dbpath Path to the index database
+ * @return False if the thread could not be started
+ */
+bool avro_index_start(AVRO_INSTANCE *router, const char *dbpath)
+{
+    AVRO_INDEXER *indexer = &router->indexer;
+
+    spinlock_init(&indexer->lock);
+    indexer->queue = NULL;
+
+    if (sqlite3_open_v2(dbpath, &indexer->handle, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK ||
+        sqlite3_busy_timeout(indexer->handle, AVRO_SQLITE_BUSY_TIMEOUT) != SQLITE_OK ||
+        sqlite3_prepare_v2(indexer->handle, insert_sql_template, -1,
+                           &indexer->insert_gtid, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(indexer->handle, read_progress_sql, -1,
+                           &indexer->read_progress, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(indexer->handle, save_progress_sql, -1,
+                           &indexer->save_progress, NULL) != SQLITE_OK)
+    {
+        MXS_ERROR("[%s] Failed to prepare the GTID index '%s' for indexing: %s",
+                  router->service->name, dbpath, sqlite3_errmsg(indexer->handle));
+        sqlite3_finalize(indexer->insert_gtid);
+        sqlite3_finalize(indexer->read_progress);
+        sqlite3_finalize(indexer->save_progress);
+        sqlite3_close_v2(indexer->handle);
+        indexer->handle = NULL;
+        return false;
+    }
+
+    gtid_index_load(router);
+
+    indexer->running = true;
+
+    if (thread_start(&indexer->thread, avro_index_main, router) == NULL)
+    {
+        MXS_ERROR("[%s] Failed to start the GTID indexing thread.", router->service->name);
+        indexer->running = false;
+        return false;
+    }
+
+    avro_update_index(router);
+    return true;
+}
+
 /** The SQL for the in-memory used_tables table */
 static const char *insert_sql = "INSERT OR IGNORE INTO "MEMORY_TABLE_NAME
                                 "(domain, server_id, sequence, binlog_timestamp, table_name)"
@@ -16,6 +16,7 @@
 #include <jansson.h>
 #include <avrorouter.h>
 #include <strings.h>
+#include <atomic.h>
 
 #define WRITE_EVENT         0
 #define UPDATE_EVENT        1
@@ -27,8 +28,7 @@ static bool warn_bit = false; /**< Remove when support for BIT is added */
 static bool warn_large_enumset = false; /**< Remove when support for ENUM/SET values
                                          * larger than 255 is added */
 
-uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create,
-                                avro_value_t *record, uint8_t *ptr,
+uint8_t* process_row_event_data(TABLE_MAP *map, avro_value_t *record, uint8_t *ptr,
                                 uint8_t *columns_present);
 void notify_all_clients(AVRO_INSTANCE *router);
 void add_used_table(AVRO_INSTANCE* router, const char* table);
@@ -90,6 +90,8 @@ bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr
 
         if (old == NULL || old->version != create->version)
         {
+            /** The conversion threads may still use the old map and Avro file */
+            avro_worker_drain(router);
             TABLE_MAP *map = table_map_alloc(ptr, ev_len, create);
 
             if (map)
@@ -104,7 +106,13 @@ bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr
 
                     /** Close the file and open a new one */
                     hashtable_delete(router->open_tables, table_ident);
-                    AVRO_TABLE *avro_table = avro_table_alloc(filepath, json_schema);
+                    AVRO_TABLE *avro_table = avro_table_alloc(filepath, json_schema, router->codec);
+
+                    if (avro_table && router->stream_unflushed)
+                    {
+                        /** Without a tail the records are sent after the flush */
+                        avro_table->tail = avro_tail_get(router, filepath);
+                    }
 
                     if (avro_table)
                     {
@@ -170,27 +178,29 @@ bool handle_table_map_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr
  * This sets the domain, server ID, sequence and event position fields of
  * the GTID. It also sets the event timestamp and event type fields.
  *
- * @param router Avro router instance
+ * @param gtid GTID of the event, its subsequence counter is used if @c trx is NULL
+ * @param trx Transaction of the event when it is converted by a conversion
+ * thread, the transaction's counter is shared by the threads
  * @param hdr Replication header
  * @param event_type Event type
  * @param record Record to prepare
  */
-static void prepare_record(AVRO_INSTANCE *router, REP_HEADER *hdr,
+static void prepare_record(gtid_pos_t *gtid, AVRO_TRX *trx, REP_HEADER *hdr,
                            int event_type, avro_value_t *record)
 {
     avro_value_t field;
     avro_value_get_by_name(record, avro_domain, &field, NULL);
-    avro_value_set_int(&field, router->gtid.domain);
+    avro_value_set_int(&field, gtid->domain);
 
     avro_value_get_by_name(record, avro_server_id, &field, NULL);
-    avro_value_set_int(&field, router->gtid.server_id);
+    avro_value_set_int(&field, gtid->server_id);
 
     avro_value_get_by_name(record, avro_sequence, &field, NULL);
-    avro_value_set_int(&field, router->gtid.seq);
+    avro_value_set_int(&field, gtid->seq);
 
-    router->gtid.event_num++;
+    uint64_t event_num = trx ? (uint64_t)atomic_add(&trx->event_num, 1) + 1 : ++gtid->event_num;
     avro_value_get_by_name(record, avro_event_number, &field, NULL);
-    avro_value_set_int(&field, router->gtid.event_num);
+    avro_value_set_int(&field, event_num);
 
     avro_value_get_by_name(record, avro_timestamp, &field, NULL);
     avro_value_set_int(&field, hdr->timestamp);
@@ -199,11 +209,103 @@ static void prepare_record(AVRO_INSTANCE *router, REP_HEADER *hdr,
     avro_value_set_enum(&field, event_type);
 }
 
+/**
+ * @brief Convert the rows of a row event into Avro records
+ *
+ * The records are appended to the Avro file of the table. This is called
+ * either by the thread reading the binlog or by the conversion thread the
+ * table belongs to.
+ *
+ * @param map Table map of the event
+ * @param table Avro file of the table
+ * @param gtid GTID of the event
+ * @param trx Transaction of the event if converted by a conversion thread, otherwise NULL
+ * @param hdr Replication header
+ * @param ptr Pointer to the column count of the event, after the table ID and flags
+ * @param end Pointer to the end of the event
+ * @return True on success, false on error
+ */
+bool avro_write_row_event(TABLE_MAP *map, AVRO_TABLE *table, gtid_pos_t *gtid,
+                          AVRO_TRX *trx, REP_HEADER *hdr, uint8_t *ptr, uint8_t *end)
+{
+    /** Number of columns in the table */
+    uint64_t ncolumns = leint_consume(&ptr);
+
+    /** If full row image is used, all columns are present. Currently only full
+     * row image is supported and thus the bitfield should be all ones. In
+     * the future partial row images could be used if the bitfield containing
+     * the columns that are present in this event is used. */
+    const int coldata_size = (ncolumns + 7) / 8;
+    uint8_t col_present[coldata_size];
+    memcpy(&col_present, ptr, coldata_size);
+    ptr += coldata_size;
+
+    /** Update events have the before and after images of the row. This can be
+     * used to calculate a "delta" of sorts if necessary. Currently we store
+     * both the before and the after images. */
+    uint8_t col_update[coldata_size];
+    if (hdr->event_type == UPDATE_ROWS_EVENTv1 ||
+        hdr->event_type == UPDATE_ROWS_EVENTv2)
+    {
+        memcpy(&col_update, ptr, coldata_size);
+        ptr += coldata_size;
+    }
+
+    if (ncolumns != map->columns)
+    {
+        MXS_ERROR("Row event and table map event have different column counts."
+                  " Only full row image is currently supported.");
+        return false;
+    }
+
+    avro_value_t record;
+    avro_generic_value_new(table->avro_writer_iface, &record);
+
+    /** The records are committed with the transaction they belong to */
+    uint64_t tail_trx = !table->tail ? 0 : trx ? trx->tail_trx : table->tail->router->tail_trx;
+
+    /** Each event has one or more rows in it. The number of rows is not known
+     * beforehand so we must continue processing them until we reach the end
+     * of the event. */
+    while (ptr < end)
+    {
+        /** Add the current GTID and timestamp */
+        int event_type = get_event_type(hdr->event_type);
+        prepare_record(gtid, trx, hdr, event_type, &record);
+        ptr = process_row_event_data(map, &record, ptr, col_present);
+        avro_file_writer_append_value(table->avro_file, &record);
+
+        if (table->tail)
+        {
+            avro_tail_append(table->tail, &record, gtid, tail_trx);
+        }
+
+        /** Update rows events have the before and after images of the
+         * affected rows so we'll process them as another record with
+         * a different type */
+        if (event_type == UPDATE_EVENT)
+        {
+            prepare_record(gtid, trx, hdr, UPDATE_EVENT_AFTER, &record);
+            ptr = process_row_event_data(map, &record, ptr, col_present);
+            avro_file_writer_append_value(table->avro_file, &record);
+
+            if (table->tail)
+            {
+                avro_tail_append(table->tail, &record, gtid, tail_trx);
+            }
+        }
+    }
+
+    avro_value_decref(&record);
+    return true;
+}
+
 /**
  * @brief Handle a single RBR row event
  *
  * These events contain the changes in the data. This function assumes that full
- * row image is sent in every row event.
+ * row image is sent in every row event. With conversion threads the event is
+ * queued to the thread of its table, otherwise it is converted right away.
  *
  * @param router Avro router instance
  * @param hdr Replication header
@@ -245,29 +347,6 @@ bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
         ptr += 2 + extra_len;
     }
 
-    /** Number of columns in the table */
-    uint64_t ncolumns = leint_consume(&ptr);
-
-    /** If full row image is used, all columns are present. Currently only full
-     * row image is supported and thus the bitfield should be all ones. In
-     * the future partial row images could be used if the bitfield containing
-     * the columns that are present in this event is used. */
-    const int coldata_size = (ncolumns + 7) / 8;
-    uint8_t col_present[coldata_size];
-    memcpy(&col_present, ptr, coldata_size);
-    ptr += coldata_size;
-
-    /** Update events have the before and after images of the row. This can be
-     * used to calculate a "delta" of sorts if necessary. Currently we store
-     * both the before and the after images. */
-    uint8_t col_update[coldata_size];
-    if (hdr->event_type == UPDATE_ROWS_EVENTv1 ||
-        hdr->event_type == UPDATE_ROWS_EVENTv2)
-    {
-        memcpy(&col_update, ptr, coldata_size);
-        ptr += coldata_size;
-    }
-
     /** There should always be a table map event prior to a row event.
      * TODO: Make the active_maps dynamic */
     TABLE_MAP *map = router->active_maps[table_id % sizeof(router->active_maps)];
@@ -279,57 +358,32 @@ bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
         snprintf(table_ident, sizeof(table_ident), "%s.%s", map->database, map->table);
         AVRO_TABLE* table = hashtable_fetch(router->open_tables, table_ident);
         TABLE_CREATE* create = map->table_create;
+        uint8_t *end = start + hdr->event_size - BINLOG_EVENT_HDR_LEN;
 
-        if (table && create && ncolumns == map->columns)
+        if (table && create)
         {
-            avro_value_t record;
-            avro_generic_value_new(table->avro_writer_iface, &record);
-
-            /** Each event has one or more rows in it. The number of rows is not known
-             * beforehand so we must continue processing them until we reach the end
-             * of the event. */
-            int rows = 0;
-            while (ptr - start < hdr->event_size - BINLOG_EVENT_HDR_LEN)
+            if (router->conversion_threads > 0)
             {
-                /** Add the current GTID and timestamp */
-                int event_type = get_event_type(hdr->event_type);
-                prepare_record(router, hdr, event_type, &record);
-                ptr = process_row_event_data(map, create, &record, ptr, col_present);
-                avro_file_writer_append_value(table->avro_file, &record);
-
-                /** Update rows events have the before and after images of the
-                 * affected rows so we'll process them as another record with
-                 * a different type */
-                if (event_type == UPDATE_EVENT)
-                {
-                    prepare_record(router, hdr, UPDATE_EVENT_AFTER, &record);
-                    ptr = process_row_event_data(map, create, &record, ptr, col_present);
-                    avro_file_writer_append_value(table->avro_file, &record);
-                }
-
-                rows++;
+                rval = avro_worker_queue(router, table_ident, map, table, hdr, start, ptr - start);
+            }
+            else
+            {
+                rval = avro_write_row_event(map, table, &router->gtid, NULL, hdr, ptr, end);
             }
 
             add_used_table(router, table_ident);
-            avro_value_decref(&record);
-            rval = true;
         }
         else if (table == NULL)
         {
             MXS_ERROR("Avro file handle was not found for table %s.%s. See earlier"
                       " errors for more details.", map->database, map->table);
         }
-        else if (create == NULL)
+        else
         {
             MXS_ERROR("Create table statement for %s.%s was not found from the "
                       "binary logs or the stored schema was not correct.",
                       map->database, map->table);
         }
-        else
-        {
-            MXS_ERROR("Row event and table map event have different column counts."
-                      " Only full row image is currently supported.");
-        }
     }
     else
     {
@@ -340,79 +394,16 @@ bool handle_row_event(AVRO_INSTANCE *router, REP_HEADER *hdr, uint8_t *ptr)
     return rval;
 }
 
-/**
- * @brief Unpack numeric types
- *
- * Convert the stored value into an Avro value and pack it in the record.
- *
- * @param field Avro value in a record
- * @param type Type of the field
- * @param metadata Field metadata
- * @param value Pointer to the start of the in-memory representation of the data
- */
-void set_numeric_field_value(avro_value_t *field, uint8_t type, uint8_t *metadata, uint8_t *value)
-{
-    int64_t i = 0;
-
-    switch (type)
-    {
-        case TABLE_COL_TYPE_TINY:
-            i = *value;
-            avro_value_set_int(field, i);
-            break;
-
-        case TABLE_COL_TYPE_SHORT:
-            memcpy(&i, value, 2);
-            avro_value_set_int(field, i);
-            break;
-
-        case TABLE_COL_TYPE_INT24:
-            memcpy(&i, value, 3);
-            avro_value_set_int(field, i);
-            break;
-
-        case TABLE_COL_TYPE_LONG:
-            memcpy(&i, value, 4);
-            avro_value_set_int(field, i);
-            break;
-
-        case TABLE_COL_TYPE_LONGLONG:
-            memcpy(&i, value, 8);
-            avro_value_set_int(field, i);
-            break;
-
-        case TABLE_COL_TYPE_FLOAT:
-            memcpy(&i, value, 4);
-            avro_value_set_float(field, (float)i);
-            break;
-
-        case TABLE_COL_TYPE_DOUBLE:
-            memcpy(&i, value, 8);
-            avro_value_set_float(field, (double)i);
-            break;
-
-        default:
-            break;
-    }
-}
-
 /**
  * @brief Check if a bit is set
  *
  * @param ptr Pointer to start of bitfield
- * @param columns Number of columns (bits)
- * @param current_column Zero indexed column number
+ * @param column Zero indexed column number
  * @return True if the bit is set
  */
-static bool bit_is_set(uint8_t *ptr, int columns, int current_column)
+static inline bool bit_is_set(uint8_t *ptr, long column)
 {
-    if (current_column >= 8)
-    {
-        ptr += current_column / 8;
-        current_column = current_column % 8;
-    }
-
-    return ((*ptr) & (1 << current_column));
+    return ptr[column / 8] & (1 << (column % 8));
 }
 
 /**
@@ -421,7 +412,7 @@ static bool bit_is_set(uint8_t *ptr, int columns, int current_column)
  * @param type Type of the field
  * @return Length of the metadata for this field
  */
-int get_metadata_len(uint8_t type)
+static int get_metadata_len(uint8_t type)
 {
     switch (type)
     {
@@ -448,154 +439,300 @@ int get_metadata_len(uint8_t type)
     }
 }
 
+/** ENUM and SET values, stored as STRING with the real type in the metadata */
+static uint8_t* decode_enum(const COLUMN_DECODER *col, avro_value_t *field, uint8_t *ptr)
+{
+    char strval[32];
+
+    /** Right now only ENUMs/SETs with less than 256 values are printed correctly */
+    snprintf(strval, sizeof(strval), "%hhu", *ptr);
+    if (col->size > 1 && !warn_large_enumset)
+    {
+        warn_large_enumset = true;
+        MXS_WARNING("ENUM/SET values larger than 255 values aren't supported.");
+    }
+    avro_value_set_string(field, strval);
+    return ptr + col->size;
+}
+
+/** CHAR values, prefixed with a one byte length */
+static uint8_t* decode_fixed_string(const COLUMN_DECODER *col, avro_value_t *field, uint8_t *ptr)
+{
+    uint8_t bytes = *ptr;
+    char str[bytes + 1];
+    memcpy(str, ptr + 1, bytes);
+    str[bytes] = '\0';
+    avro_value_set_string(field, str);
+    return ptr + bytes + 1;
+}
+
+/** BIT values, the part of the value that is stored in the row */
+static uint8_t* decode_bit(const COLUMN_DECODER *col, avro_value_t *field, uint8_t *ptr)
+{
+    // TODO: extract the bytes
+    if (!warn_bit)
+    {
+        warn_bit = true;
+        MXS_WARNING("BIT is not currently supported, values are stored as 0.");
+    }
+    avro_value_set_int(field, 0);
+    return ptr + col->size;
+}
+
+/** DECIMAL values */
+static uint8_t* decode_decimal(const COLUMN_DECODER *col, avro_value_t *field, uint8_t *ptr)
+{
+    // TODO: Add support for DECIMAL
+    if (!warn_decimal)
+    {
+        warn_decimal = true;
+        MXS_WARNING("DECIMAL is not currently supported, values are stored as 0.");
+    }
+    avro_value_set_int(field, 0);
+    return ptr + col->size;
+}
+
+/** VARCHAR values, prefixed with a length-encoded integer */
+static uint8_t* decode_variable_string(const COLUMN_DECODER *col, avro_value_t *field, uint8_t *ptr)
+{
+    size_t sz;
+    char *str = lestr_consume(&ptr, &sz);
+    char buf[sz + 1];
+    memcpy(buf, str, sz);
+    buf[sz] = '\0';
+    avro_value_set_string(field, buf);
+    return ptr;
+}
+
+/** BLOB values, prefixed with a length of as many bytes as the metadata says */
+static uint8_t* decode_blob(const COLUMN_DECODER *col, avro_value_t *field, uint8_t *ptr)
+{
+    uint64_t len = 0;
+    memcpy(&len, ptr, col->size);
+    ptr += col->size;
+    avro_value_set_bytes(field, ptr, len);
+    return ptr + len;
+}
+
+/** Dates and times, stored as strings */
+static uint8_t* decode_temporal(const COLUMN_DECODER *col, avro_value_t *field, uint8_t *ptr)
+{
+    char buf[80];
+    struct tm tm;
+    ptr += unpack_temporal_value(col->type, ptr, col->metadata, &tm);
+    format_temporal_value(buf, sizeof(buf), col->type, &tm);
+    avro_value_set_string(field, buf);
+    return ptr;
+}
+
+/** Integers of all sizes */
+static uint8_t* decode_integer(const COLUMN_DECODER *col, avro_value_t *field, uint8_t *ptr)
+{
+    int64_t i = 0;
+    memcpy(&i, ptr, col->size);
+    avro_value_set_int(field, i);
+    return ptr + col->size;
+}
+
+/** FLOAT and DOUBLE values */
+static uint8_t* decode_float(const COLUMN_DECODER *col, avro_value_t *field, uint8_t *ptr)
+{
+    int64_t i = 0;
+    memcpy(&i, ptr, col->size);
+    avro_value_set_float(field, col->size == 4 ? (float)i : (double)i);
+    return ptr + col->size;
+}
+
+/** Types that are not supported, the field is left as it is */
+static uint8_t* decode_unknown(const COLUMN_DECODER *col, avro_value_t *field, uint8_t *ptr)
+{
+    return ptr;
+}
+
+/**
+ * @brief Get the size of a stored DECIMAL value
+ *
+ * @param metadata Field metadata, the precision and the number of decimals
+ * @return Number of bytes the value takes
+ */
+static size_t decimal_size(uint8_t *metadata)
+{
+    const int dec_dig = 9;
+    int precision = metadata[0];
+    int decimals = metadata[1];
+    int dig_bytes[] = {0, 1, 1, 2, 2, 3, 3, 4, 4, 4};
+    int ipart = precision - decimals;
+    int ipart1 = ipart / dec_dig;
+    int fpart1 = decimals / dec_dig;
+    int ipart2 = ipart - ipart1 * dec_dig;
+    int fpart2 = decimals - fpart1 * dec_dig;
+    int ibytes = ipart1 * 4 + dig_bytes[ipart2];
+    int fbytes = fpart1 * 4 + dig_bytes[fpart2];
+    return ibytes + fbytes;
+}
+
+/**
+ * @brief Build the decoders of the columns of a table map
+ *
+ * The type of each column is looked at once here instead of for every value
+ * of every row. The decoders are built again only when the table is mapped
+ * with a new version of its definition.
+ *
+ * @param map The table map, with its column types and metadata
+ * @return The decoders, one for each column, or NULL if memory allocation failed
+ */
+COLUMN_DECODER* column_decoders_alloc(TABLE_MAP *map)
+{
+    COLUMN_DECODER *decoders = calloc(map->columns ? map->columns : 1, sizeof(COLUMN_DECODER));
+
+    if (decoders == NULL)
+    {
+        return NULL;
+    }
+
+    uint8_t *metadata = map->column_metadata;
+    size_t metadata_offset = 0;
+
+    /** BIT type values use the extra bits in the row event header */
+    int extra_bits = (((map->columns + 7) / 8) * 8) - map->columns;
+
+    for (uint64_t i = 0; i < map->columns; i++)
+    {
+        COLUMN_DECODER *col = &decoders[i];
+        uint8_t type = map->column_types[i];
+        col->type = type;
+        col->metadata = &metadata[metadata_offset];
+
+        if (column_is_fixed_string(type))
+        {
+            if (fixed_string_is_enum(col->metadata[0]))
+            {
+                col->decode = decode_enum;
+                col->size = col->metadata[1];
+            }
+            else
+            {
+                col->decode = decode_fixed_string;
+            }
+        }
+        else if (column_is_bit(type))
+        {
+            int width = col->metadata[0] + col->metadata[1] * 8;
+            int bits_in_nullmap = MIN(width, extra_bits);
+            extra_bits -= bits_in_nullmap;
+            width -= bits_in_nullmap;
+            col->decode = decode_bit;
+            col->size = width / 8;
+        }
+        else if (column_is_decimal(type))
+        {
+            col->decode = decode_decimal;
+            col->size = decimal_size(col->metadata);
+        }
+        else if (column_is_variable_string(type))
+        {
+            col->decode = decode_variable_string;
+        }
+        else if (column_is_blob(type))
+        {
+            col->decode = decode_blob;
+            col->size = col->metadata[0];
+        }
+        else if (column_is_temporal(type))
+        {
+            col->decode = decode_temporal;
+        }
+        else
+        {
+            /** All numeric types (INT, LONG, FLOAT etc.) */
+            switch (type)
+            {
+                case TABLE_COL_TYPE_FLOAT:
+                    col->decode = decode_float;
+                    col->size = 4;
+                    break;
+
+                case TABLE_COL_TYPE_DOUBLE:
+                    col->decode = decode_float;
+                    col->size = 8;
+                    break;
+
+                case TABLE_COL_TYPE_TINY:
+                    col->decode = decode_integer;
+                    col->size = 1;
+                    break;
+
+                case TABLE_COL_TYPE_SHORT:
+                    col->decode = decode_integer;
+                    col->size = 2;
+                    break;
+
+                case TABLE_COL_TYPE_INT24:
+                    col->decode = decode_integer;
+                    col->size = 3;
+                    break;
+
+                case TABLE_COL_TYPE_LONG:
+                    col->decode = decode_integer;
+                    col->size = 4;
+                    break;
+
+                case TABLE_COL_TYPE_LONGLONG:
+                    col->decode = decode_integer;
+                    col->size = 8;
+                    break;
+
+                default:
+                    MXS_ERROR("Bad column type: %x %s", type, column_type_to_string(type));
+                    col->decode = decode_unknown;
+                    break;
+            }
+        }
+
+        metadata_offset += get_metadata_len(type);
+        ss_dassert(metadata_offset <= map->column_metadata_size);
+    }
+
+    return decoders;
+}
+
 /**
  * @brief Extract the values from a single row  in a row event
  *
  * @param map Table map event associated with this row
- * @param create Table creation associated with this row
  * @param record Avro record used for storing this row
  * @param ptr Pointer to the start of the row data, should be after the row event header
  * @param columns_present The bitfield holding the columns that are present for
  * this row event. Currently this should be a bitfield which has all bits set.
  * @return Pointer to the first byte after the current row event
  */
-uint8_t* process_row_event_data(TABLE_MAP *map, TABLE_CREATE *create, avro_value_t *record,
-                                uint8_t *ptr, uint8_t *columns_present)
+uint8_t* process_row_event_data(TABLE_MAP *map, avro_value_t *record, uint8_t *ptr,
+                                uint8_t *columns_present)
 {
-    int npresent = 0;
-    avro_value_t field;
     long ncolumns = map->columns;
-    uint8_t *metadata = map->column_metadata;
-    size_t metadata_offset = 0;
-
-    /** BIT type values use the extra bits in the row event header */
-    int extra_bits = (((ncolumns + 7) / 8) * 8) - ncolumns;
+    COLUMN_DECODER *decoders = map->decoders;
 
     /** Store the null value bitmap */
     uint8_t *null_bitmap = ptr;
     ptr += (ncolumns + 7) / 8;
 
-    for (long i = 0; i < map->columns && npresent < ncolumns; i++)
+    for (long i = 0; i < ncolumns; i++)
     {
-        ss_dassert(create->columns == map->columns);
-        avro_value_get_by_name(record, create->column_names[i], &field, NULL);
-
-        if (bit_is_set(columns_present, ncolumns, i))
+        if (bit_is_set(columns_present, i))
         {
-            npresent++;
-            if (bit_is_set(null_bitmap, ncolumns, i))
+            avro_value_t field;
+
+            /** The columns follow the generated fields in the schema */
+            avro_value_get_by_index(record, AVRO_GENERATED_FIELDS + i, &field, NULL);
+
+            if (bit_is_set(null_bitmap, i))
             {
                 avro_value_set_null(&field);
             }
-            else if (column_is_fixed_string(map->column_types[i]))
-            {
-                /** ENUM and SET are stored as STRING types with the type stored
-                 * in the metadata. */
-                if (fixed_string_is_enum(metadata[metadata_offset]))
-                {
-                    uint8_t val[metadata[metadata_offset + 1]];
-                    uint64_t bytes = unpack_enum(ptr, &metadata[metadata_offset], val);
-                    char strval[32];
-
-                    /** Right now only ENUMs/SETs with less than 256 values
-                     * are printed correctly */
-                    snprintf(strval, sizeof(strval), "%hhu", val[0]);
-                    if (bytes > 1 && warn_large_enumset)
-                    {
-                        warn_large_enumset = true;
-                        MXS_WARNING("ENUM/SET values larger than 255 values aren't supported.");
-                    }
-                    avro_value_set_string(&field, strval);
-                    ptr += bytes;
-                }
-                else
-                {
-                    uint8_t bytes = *ptr;
-                    char str[bytes + 1];
-                    memcpy(str, ptr + 1, bytes);
-                    str[bytes] = '\0';
-                    avro_value_set_string(&field, str);
-                    ptr += bytes + 1;
-                }
-            }
-            else if (column_is_bit(map->column_types[i]))
-            {
-                uint64_t value = 0;
-                int width = metadata[metadata_offset] + metadata[metadata_offset + 1] * 8;
-                int bits_in_nullmap = MIN(width, extra_bits);
-                extra_bits -= bits_in_nullmap;
-                width -= bits_in_nullmap;
-                size_t bytes = width / 8;
-
-                // TODO: extract the bytes
-                if (!warn_bit)
-                {
-                    warn_bit = true;
-                    MXS_WARNING("BIT is not currently supported, values are stored as 0.");
-                }
-                avro_value_set_int(&field, value);
-                ptr += bytes;
-            }
-            else if (column_is_decimal(map->column_types[i]))
-            {
-                const int dec_dig = 9;
-                int precision = metadata[metadata_offset];
-                int decimals = metadata[metadata_offset + 1];
-                int dig_bytes[] = {0, 1, 1, 2, 2, 3, 3, 4, 4, 4};
-                int ipart = precision - decimals;
-                int ipart1 = ipart / dec_dig;
-                int fpart1 = decimals / dec_dig;
-                int ipart2 = ipart - ipart1 * dec_dig;
-                int fpart2 = decimals - fpart1 * dec_dig;
-                int ibytes = ipart1 * 4 + dig_bytes[ipart2];
-                int fbytes = fpart1 * 4 + dig_bytes[fpart2];
-                ptr += ibytes + fbytes;
-
-                // TODO: Add support for DECIMAL
-                if (!warn_decimal)
-                {
-                    warn_decimal = true;
-                    MXS_WARNING("DECIMAL is not currently supported, values are stored as 0.");
-                }
-                avro_value_set_int(&field, 0);
-            }
-            else if (column_is_variable_string(map->column_types[i]))
-            {
-                size_t sz;
-                char *str = lestr_consume(&ptr, &sz);
-                char buf[sz + 1];
-                memcpy(buf, str, sz);
-                buf[sz] = '\0';
-                avro_value_set_string(&field, buf);
-            }
-            else if (column_is_blob(map->column_types[i]))
-            {
-                uint8_t bytes = metadata[metadata_offset];
-                uint64_t len = 0;
-                memcpy(&len, ptr, bytes);
-                ptr += bytes;
-                avro_value_set_bytes(&field, ptr, len);
-                ptr += len;
-            }
-            else if (column_is_temporal(map->column_types[i]))
-            {
-                char buf[80];
-                struct tm tm;
-                ptr += unpack_temporal_value(map->column_types[i], ptr, &metadata[metadata_offset], &tm);
-                format_temporal_value(buf, sizeof(buf), map->column_types[i], &tm);
-                avro_value_set_string(&field, buf);
-            }
-            /** All numeric types (INT, LONG, FLOAT etc.) */
             else
             {
-                uint8_t lval[16];
-                memset(lval, 0, sizeof(lval));
-                ptr += unpack_numeric_field(ptr, map->column_types[i],
-                                            &metadata[metadata_offset], lval);
-                set_numeric_field_value(&field, map->column_types[i], &metadata[metadata_offset], lval);
+                ptr = decoders[i].decode(&decoders[i], &field, ptr);
             }
-            ss_dassert(metadata_offset <= map->column_metadata_size);
-            metadata_offset += get_metadata_len(map->column_types[i]);
         }
     }
 
@@ -979,14 +979,17 @@ TABLE_MAP *table_map_alloc(uint8_t *ptr, uint8_t hdr_len, TABLE_CREATE* create)
         map->database = strdup(schema_name);
         map->table = strdup(table_name);
         map->table_create = create;
+        map->decoders = NULL;
         if (map->column_types && map->database && map->table &&
             map->column_metadata && map->null_bitmap)
         {
             memcpy(map->column_types, column_types, column_count);
             memcpy(map->null_bitmap, nullmap, nullmap_size);
             memcpy(map->column_metadata, metadata, metadata_size);
+            map->decoders = column_decoders_alloc(map);
         }
-        else
+
+        if (map->decoders == NULL)
         {
             free(map->null_bitmap);
             free(map->column_metadata);
@@ -1014,6 +1017,9 @@ void* table_map_free(TABLE_MAP *map)
 {
     if (map)
     {
+        free(map->decoders);
+        free(map->null_bitmap);
+        free(map->column_metadata);
         free(map->column_types);
         free(map->database);
         free(map->table);
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avro_tail.c - Records that are not yet flushed to the Avro files
+ *
+ * The records reach the files when the tables are flushed after group_trx
+ * transactions or group_rows rows. With the stream_unflushed option the
+ * records are also kept as JSON in a tail per file until they are flushed,
+ * and the JSON clients that have read the whole file get the committed
+ * records from the tail. The latency of the clients then doesn't depend on
+ * the size of the data blocks.
+ *
+ * The records of a tail are the records of the file that follow the first
+ * @c flushed ones, in the same order. A client sending from the tail remembers
+ * how far it got and skips those records when it reads them from the file
+ * after the flush.
+ *
+ * A record is committed when the transaction it belongs to has been read
+ * up to its commit. The transactions are numbered as they are read and the
+ * records carry the number of their transaction.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 15/10/2016   Core Team       Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <avrorouter.h>
+#include <log_manager.h>
+#include <skygw_utils.h>
+
+/** Initial number of records allocated for a tail */
+#define AVRO_TAIL_ROWS_MIN 64
+
+void notify_all_clients(AVRO_INSTANCE *router);
+
+/**
+ * Count the records of an Avro file
+ *
+ * @param filename Path of the file
+ * @return Number of records in the complete data blocks of the file
+ */
+static uint64_t count_records(const char *filename)
+{
+    uint64_t n = 0;
+    MAXAVRO_FILE *file = maxavro_file_open(filename);
+
+    if (file)
+    {
+        while (maxavro_next_block(file))
+        {
+            ;
+        }
+        n = file->records_read;
+        maxavro_file_close(file);
+    }
+
+    return n;
+}
+
+/**
+ * Get the tail of an Avro file, creating it if it doesn't exist. The tails
+ * are kept until the router is freed so the clients can refer to them.
+ *
+ * This is called by the conversion before the file is opened for writing.
+ *
+ * @param router Avro router instance
+ * @param filename Path of the file
+ * @return The tail or NULL if memory allocation failed
+ */
+AVRO_TAIL* avro_tail_get(AVRO_INSTANCE *router, const char *filename)
+{
+    const char *name = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+    AVRO_TAIL *tail = hashtable_fetch(router->tails, (char*)name);
+
+    if (tail == NULL && (tail = calloc(1, sizeof(AVRO_TAIL))) != NULL)
+    {
+        spinlock_init(&tail->lock);
+        tail->router = router;
+        tail->flushed = access(filename, F_OK) == 0 ? count_records(filename) : 0;
+
+        if (!hashtable_add(router->tails, (char*)name, tail))
+        {
+            free(tail);
+            tail = NULL;
+        }
+    }
+
+    if (tail == NULL)
+    {
+        MXS_ERROR("[%s] Failed to allocate memory for the unflushed records of %s.",
+                  router->service->name, name);
+    }
+
+    return tail;
+}
+
+/**
+ * Find the tail of an Avro file
+ *
+ * @param router Avro router instance
+ * @param name Name of the file in the Avro directory
+ * @return The tail or NULL if the file has none
+ */
+AVRO_TAIL* avro_tail_find(AVRO_INSTANCE *router, const char *name)
+{
+    return router->tails ? hashtable_fetch(router->tails, (char*)name) : NULL;
+}
+
+/**
+ * Add a record to a tail. This is called right after the record is appended
+ * to the file, by the thread that converts the table.
+ *
+ * @param tail Tail of the file
+ * @param record The record
+ * @param gtid GTID of the record
+ * @param trx Number of the transaction of the record
+ */
+void avro_tail_append(AVRO_TAIL *tail, avro_value_t *record, gtid_pos_t *gtid, uint64_t trx)
+{
+    char *json = NULL;
+
+    if (avro_value_to_json(record, 1, &json) != 0)
+    {
+        MXS_ERROR("Failed to convert a record to JSON: %s", avro_strerror());
+        return;
+    }
+
+    bool notify = false;
+
+    spinlock_acquire(&tail->lock);
+
+    if (tail->n_rows == tail->size)
+    {
+        size_t size = MAX(AVRO_TAIL_ROWS_MIN, tail->size * 2);
+        AVRO_TAIL_ROW *rows = realloc(tail->rows, size * sizeof(AVRO_TAIL_ROW));
+
+        if (rows == NULL)
+        {
+            /** The clients get the record from the file after the flush */
+            spinlock_release(&tail->lock);
+            free(json);
+            return;
+        }
+        tail->rows = rows;
+        tail->size = size;
+    }
+
+    AVRO_TAIL_ROW *row = &tail->rows[tail->n_rows++];
+    row->json = json;
+    row->gtid = *gtid;
+    row->trx = trx;
+
+    /** A conversion thread can convert a record after its commit was read */
+    notify = trx <= tail->router->tail_committed;
+    spinlock_release(&tail->lock);
+
+    if (notify)
+    {
+        notify_all_clients(tail->router);
+    }
+}
+
+/**
+ * Drop the records of a tail after they have been flushed to the file
+ *
+ * @param tail Tail of the file
+ */
+void avro_tail_flush(AVRO_TAIL *tail)
+{
+    spinlock_acquire(&tail->lock);
+
+    for (size_t i = 0; i < tail->n_rows; i++)
+    {
+        free(tail->rows[i].json);
+    }
+
+    tail->flushed += tail->n_rows;
+    tail->n_rows = 0;
+    spinlock_release(&tail->lock);
+}
+
+/**
+ * Mark the records of the current transaction as committed and notify the
+ * waiting clients
+ *
+ * @param router Avro router instance
+ */
+void avro_tail_commit(AVRO_INSTANCE *router)
+{
+    router->tail_committed = router->tail_trx++;
+    notify_all_clients(router);
+}
+
+/**
+ * Copy a committed record of a tail
+ *
+ * @param tail Tail of the file
+ * @param pos Index of the record in the file
+ * @param json The record as JSON, freed by the caller
+ * @param gtid GTID of the record
+ * @return AVRO_TAIL_OK if the record was copied, AVRO_TAIL_NO_DATA if the
+ * record is not yet committed or converted and AVRO_TAIL_ON_DISK if the
+ * record must be read from the file
+ */
+enum avro_tail_result avro_tail_read(AVRO_TAIL *tail, uint64_t pos, char **json,
+                                     gtid_pos_t *gtid)
+{
+    enum avro_tail_result rval = AVRO_TAIL_NO_DATA;
+
+    spinlock_acquire(&tail->lock);
+
+    if (pos < tail->flushed)
+    {
+        rval = AVRO_TAIL_ON_DISK;
+    }
+    else if (pos - tail->flushed < tail->n_rows)
+    {
+        AVRO_TAIL_ROW *row = &tail->rows[pos - tail->flushed];
+
+        if (row->trx <= tail->router->tail_committed &&
+            (*json = strdup(row->json)) != NULL)
+        {
+            *gtid = row->gtid;
+            rval = AVRO_TAIL_OK;
+        }
+    }
+
+    spinlock_release(&tail->lock);
+    return rval;
+}
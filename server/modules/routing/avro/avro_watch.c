@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avro_watch.c - Conversion of the binlogs as soon as they change
+ *
+ * The conversion of the binlogs runs in a thread of its own that sleeps until
+ * the binlogs change. The binlog directory is watched with inotify, so the
+ * thread wakes up when the binlog files are written to or created. When the
+ * binlogrouter service of the source option runs in the same process, the
+ * binlogrouter also notifies the thread directly after each event it has
+ * written, through an eventfd.
+ *
+ * The thread still converts the binlogs once every AVRO_TASK_DELAY_MAX seconds
+ * in case a change is missed, e.g. when the binlog directory is replaced. If
+ * inotify cannot be used, the conversion is done by a housekeeper task that
+ * polls the binlogs instead.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 15/10/2016   Core Team       Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <avrorouter.h>
+#include <router.h>
+#include <log_manager.h>
+#include <skygw_utils.h>
+
+/** The binlog directory changes that wake up the conversion */
+#define AVRO_WATCH_EVENTS (IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE)
+
+/**
+ * Called by the binlogrouter after it has written an event. The eventfd is
+ * only written to once until the conversion thread has woken up.
+ *
+ * @param data Avro router instance
+ */
+static void avro_watch_notify(void *data)
+{
+    AVRO_INSTANCE *router = (AVRO_INSTANCE*)data;
+
+    if (__sync_lock_test_and_set(&router->watcher.pending, 1) == 0)
+    {
+        uint64_t one = 1;
+
+        if (write(router->watcher.event_fd, &one, sizeof(one)) != sizeof(one))
+        {
+            router->watcher.pending = 0;
+        }
+    }
+}
+
+/**
+ * Register the conversion thread to the binlogrouter of the source service.
+ * The binlogrouter instance is created when its service is started, which may
+ * happen after this service is started, so this is retried until it succeeds.
+ *
+ * @param router Avro router instance
+ */
+static void avro_watch_listen(AVRO_INSTANCE *router)
+{
+    SERVICE *source = router->source;
+    AVRO_WATCHER *watcher = &router->watcher;
+
+    if (!watcher->listening && watcher->event_fd != -1 && source &&
+        source->router && source->router->addListener && source->router_instance)
+    {
+        if (source->router->addListener(source->router_instance, avro_watch_notify, router))
+        {
+            watcher->listening = true;
+            MXS_NOTICE("[%s] Converting the binlog events of service '%s' as they are written.",
+                       router->service->name, source->name);
+        }
+        else
+        {
+            MXS_ERROR("[%s] Failed to register to service '%s' for binlog event notifications.",
+                      router->service->name, source->name);
+            close(watcher->event_fd);
+            watcher->event_fd = -1;
+        }
+    }
+}
+
+/**
+ * Check whether the inotify events are about the binlog files. The conversion
+ * writes its state to the Avro directory, which can be the binlog directory,
+ * so the other files are ignored to not wake up the thread in vain.
+ *
+ * @param router Avro router instance
+ * @return True if a binlog file has changed
+ */
+static bool avro_watch_binlog_changed(AVRO_INSTANCE *router)
+{
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+    size_t rootlen = strlen(router->fileroot);
+    bool changed = false;
+    ssize_t len;
+
+    while ((len = read(router->watcher.inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        for (char *ptr = buf; ptr < buf + len;)
+        {
+            struct inotify_event *event = (struct inotify_event*)ptr;
+
+            if ((event->mask & IN_Q_OVERFLOW) ||
+                (event->len && strncmp(event->name, router->fileroot, rootlen) == 0))
+            {
+                changed = true;
+            }
+
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    return changed;
+}
+
+/**
+ * Wait until the binlogs change or AVRO_TASK_DELAY_MAX seconds have passed
+ *
+ * @param router Avro router instance
+ */
+static void avro_watch_wait(AVRO_INSTANCE *router)
+{
+    AVRO_WATCHER *watcher = &router->watcher;
+    struct pollfd fds[2];
+    nfds_t nfds = 0;
+
+    fds[nfds].fd = watcher->inotify_fd;
+    fds[nfds++].events = POLLIN;
+
+    if (watcher->listening)
+    {
+        fds[nfds].fd = watcher->event_fd;
+        fds[nfds++].events = POLLIN;
+    }
+
+    time_t deadline = time(NULL) + AVRO_TASK_DELAY_MAX;
+    time_t now;
+
+    while (watcher->running && (now = time(NULL)) < deadline)
+    {
+        if (poll(fds, nfds, (deadline - now) * 1000) > 0)
+        {
+            if (nfds > 1 && (fds[1].revents & POLLIN))
+            {
+                uint64_t count;
+
+                if (read(watcher->event_fd, &count, sizeof(count)) == sizeof(count))
+                {
+                    /** Events written from now on wake up the thread again */
+                    watcher->pending = 0;
+                    return;
+                }
+            }
+
+            if ((fds[0].revents & POLLIN) && avro_watch_binlog_changed(router))
+            {
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * The conversion thread
+ *
+ * @param data Avro router instance
+ */
+static void avro_watch_main(void *data)
+{
+    AVRO_INSTANCE *router = (AVRO_INSTANCE*)data;
+    avro_binlog_end_t binlog_end = AVRO_LAST_FILE;
+
+    while (router->watcher.running && binlog_end == AVRO_LAST_FILE)
+    {
+        avro_watch_listen(router);
+
+        if ((binlog_end = avro_convert_binlogs(router)) == AVRO_LAST_FILE)
+        {
+            MXS_INFO("Stopped processing file %s at position %lu. Waiting until"
+                     " more data is written before continuing.",
+                     router->binlog_name, router->current_pos);
+            avro_watch_wait(router);
+        }
+    }
+
+    router->watcher.running = false;
+}
+
+/**
+ * @brief Start the conversion thread
+ *
+ * The binlog directory must exist when the thread is started. The thread
+ * registers to the source service for binlog event notifications once the
+ * service has been started.
+ *
+ * @param router Avro router instance
+ * @return False if the binlog directory cannot be watched or the thread could
+ * not be started, in which case the binlogs must be polled
+ */
+bool avro_watch_start(AVRO_INSTANCE *router)
+{
+    AVRO_WATCHER *watcher = &router->watcher;
+    char err[STRERROR_BUFLEN];
+
+    watcher->pending = 0;
+    watcher->listening = false;
+
+    if ((watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ||
+        inotify_add_watch(watcher->inotify_fd, router->binlogdir, AVRO_WATCH_EVENTS) == -1)
+    {
+        MXS_WARNING("[%s] Failed to watch the binlog directory '%s', polling it for "
+                    "changes instead: %d, %s", router->service->name, router->binlogdir,
+                    errno, strerror_r(errno, err, sizeof(err)));
+
+        if (watcher->inotify_fd != -1)
+        {
+            close(watcher->inotify_fd);
+            watcher->inotify_fd = -1;
+        }
+        return false;
+    }
+
+    if (router->source && (watcher->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+        MXS_WARNING("[%s] Failed to create an eventfd, the binlog events of service '%s' "
+                    "are only noticed through the binlog files: %d, %s",
+                    router->service->name, router->source->name,
+                    errno, strerror_r(errno, err, sizeof(err)));
+    }
+
+    watcher->running = true;
+
+    if (thread_start(&watcher->thread, avro_watch_main, router) == NULL)
+    {
+        MXS_ERROR("[%s] Failed to start the binlog conversion thread.", router->service->name);
+        watcher->running = false;
+        close(watcher->inotify_fd);
+        watcher->inotify_fd = -1;
+
+        if (watcher->event_fd != -1)
+        {
+            close(watcher->event_fd);
+            watcher->event_fd = -1;
+        }
+        return false;
+    }
+
+    return true;
+}
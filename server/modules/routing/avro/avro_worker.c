@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file avro_worker.c - Conversion threads of the Avro router
+ *
+ * With the conversion_threads option the thread reading the binlog files only
+ * parses the events and keeps track of the table maps, the table definitions
+ * and the GTIDs. The row events are decoded, converted into Avro records and
+ * written to the Avro files by the conversion threads. The tables are divided
+ * between the threads by the hash of the table name, so all the row events of
+ * a table are converted by one thread in the order they were read.
+ *
+ * The reading thread waits for the conversion threads to finish the queued
+ * events before the Avro files are flushed and before table maps or table
+ * definitions that the queued events may use are changed.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date         Who             Description
+ * 15/10/2016   Core Team       Initial implementation
+ *
+ * @endverbatim
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic.h>
+#include <thread.h>
+#include <avrorouter.h>
+#include <log_manager.h>
+#include <skygw_utils.h>
+
+/** How many row events may be queued to a conversion thread before the reading thread waits */
+#define AVRO_WORKER_QUEUE_MAX 10000
+
+/**
+ * Release a reference to a transaction
+ *
+ * @param trx The transaction
+ */
+static void avro_trx_release(AVRO_TRX *trx)
+{
+    if (trx && atomic_add(&trx->refcount, -1) == 1)
+    {
+        free(trx);
+    }
+}
+
+/**
+ * Convert one queued row event
+ *
+ * @param job The row event
+ */
+static void avro_worker_convert(AVRO_ROW_JOB *job)
+{
+    uint8_t *end = job->data + job->hdr.event_size - BINLOG_EVENT_HDR_LEN;
+
+    avro_write_row_event(job->map, job->table, &job->trx->gtid, job->trx,
+                         &job->hdr, job->data + job->offset, end);
+}
+
+/**
+ * The main loop of a conversion thread
+ *
+ * @param arg The conversion thread
+ */
+static void avro_worker_main(void *arg)
+{
+    AVRO_WORKER *worker = (AVRO_WORKER*)arg;
+
+    while (worker->running || worker->head)
+    {
+        spinlock_acquire(&worker->lock);
+        AVRO_ROW_JOB *job = worker->head;
+
+        if (job)
+        {
+            worker->head = job->next;
+
+            if (worker->head == NULL)
+            {
+                worker->tail = NULL;
+            }
+        }
+        spinlock_release(&worker->lock);
+
+        if (job)
+        {
+            avro_worker_convert(job);
+            avro_trx_release(job->trx);
+            free(job->data);
+            free(job);
+            worker->n_events++;
+            atomic_add(&worker->pending, -1);
+        }
+        else
+        {
+            thread_millisleep(1);
+        }
+    }
+}
+
+/**
+ * Start the conversion threads of the router, if the conversion_threads
+ * option is set
+ *
+ * @param router Avro router instance
+ * @return False if the threads could not be started
+ */
+bool avro_worker_start(AVRO_INSTANCE *router)
+{
+    int n = router->conversion_threads;
+
+    if (n == 0)
+    {
+        return true;
+    }
+
+    if ((router->workers = calloc(n, sizeof(AVRO_WORKER))) == NULL)
+    {
+        MXS_ERROR("[%s] Failed to allocate memory for the conversion threads.",
+                  router->service->name);
+        router->conversion_threads = 0;
+        return false;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        AVRO_WORKER *worker = &router->workers[i];
+        spinlock_init(&worker->lock);
+        worker->running = true;
+
+        if (thread_start(&worker->thread, avro_worker_main, worker) == NULL)
+        {
+            MXS_ERROR("[%s] Failed to start conversion thread %d.", router->service->name, i);
+            worker->running = false;
+            router->conversion_threads = i;
+            avro_worker_stop(router);
+            return false;
+        }
+    }
+
+    MXS_NOTICE("[%s] Started %d conversion threads.", router->service->name, n);
+    return true;
+}
+
+/**
+ * Stop the conversion threads after they have converted the queued row events
+ *
+ * @param router Avro router instance
+ */
+void avro_worker_stop(AVRO_INSTANCE *router)
+{
+    for (int i = 0; i < router->conversion_threads; i++)
+    {
+        router->workers[i].running = false;
+        thread_wait(router->workers[i].thread);
+    }
+
+    avro_trx_release(router->trx);
+    router->trx = NULL;
+    free(router->workers);
+    router->workers = NULL;
+    router->conversion_threads = 0;
+}
+
+/**
+ * Start a new transaction for the row events read after a GTID event
+ *
+ * @param router Avro router instance
+ */
+void avro_worker_new_trx(AVRO_INSTANCE *router)
+{
+    if (router->conversion_threads > 0)
+    {
+        AVRO_TRX *trx = malloc(sizeof(AVRO_TRX));
+
+        if (trx)
+        {
+            trx->gtid = router->gtid;
+            trx->event_num = 0;
+            trx->refcount = 1;
+            trx->tail_trx = router->tail_trx;
+        }
+
+        avro_trx_release(router->trx);
+        router->trx = trx;
+    }
+}
+
+/**
+ * Queue a row event to the conversion thread of its table. The event is
+ * copied, so the caller may free it.
+ *
+ * @param router Avro router instance
+ * @param table_ident The table as db.table
+ * @param map Table map of the event
+ * @param table Avro file of the table
+ * @param hdr Replication header
+ * @param ptr Pointer to the start of the event payload
+ * @param offset Offset of the column count in the payload
+ * @return True if the event was queued
+ */
+bool avro_worker_queue(AVRO_INSTANCE *router, const char *table_ident, TABLE_MAP *map,
+                       AVRO_TABLE *table, REP_HEADER *hdr, uint8_t *ptr, int offset)
+{
+    AVRO_WORKER *worker = &router->workers[(unsigned int)simple_str_hash((char*)table_ident) %
+                                           router->conversion_threads];
+    size_t len = hdr->event_size - BINLOG_EVENT_HDR_LEN;
+    AVRO_ROW_JOB *job = malloc(sizeof(AVRO_ROW_JOB));
+    uint8_t *data = malloc(len);
+
+    if (router->trx == NULL)
+    {
+        /** No GTID event was read, the binlog is not from a MariaDB 10 server */
+        avro_worker_new_trx(router);
+    }
+
+    if (job == NULL || data == NULL || router->trx == NULL)
+    {
+        MXS_ERROR("[%s] Failed to allocate memory for a row event.", router->service->name);
+        free(job);
+        free(data);
+        return false;
+    }
+
+    memcpy(data, ptr, len);
+    job->hdr = *hdr;
+    job->data = data;
+    job->offset = offset;
+    job->map = map;
+    job->table = table;
+    job->trx = router->trx;
+    job->next = NULL;
+    atomic_add(&job->trx->refcount, 1);
+
+    /** Wait for the thread to catch up instead of queuing the whole binlog */
+    while (worker->pending >= AVRO_WORKER_QUEUE_MAX)
+    {
+        thread_millisleep(1);
+    }
+
+    atomic_add(&worker->pending, 1);
+    spinlock_acquire(&worker->lock);
+
+    if (worker->tail)
+    {
+        worker->tail->next = job;
+    }
+    else
+    {
+        worker->head = job;
+    }
+
+    worker->tail = job;
+    spinlock_release(&worker->lock);
+
+    return true;
+}
+
+/**
+ * Wait until the conversion threads have converted all the queued row events
+ *
+ * @param router Avro router instance
+ */
+void avro_worker_drain(AVRO_INSTANCE *router)
+{
+    for (int i = 0; i < router->conversion_threads; i++)
+    {
+        while (router->workers[i].pending > 0)
+        {
+            thread_millisleep(1);
+        }
+    }
+
+    if (router->trx)
+    {
+        /** The records of the current transaction have been numbered */
+        router->gtid.event_num = router->trx->event_num;
+    }
+}
@@ -46,6 +46,15 @@
  * 23/10/2015   Markus Makela       Added current_safe_event
  * 27/10/2015   Martin Brampton     Amend getCapabilities to return RCAP_TYPE_NO_RSESSION
  * 19/04/2016   Massimiliano Pinto  UUID generation now comes from libuuid
+ * 15/10/2016   Core Team           Addition of event_cache_size option
+ * 15/10/2016   Core Team           Addition of sendfile_catchup option
+ * 15/10/2016   Core Team           Addition of binlog_flush option
+ * 15/10/2016   Core Team           Addition of gtid_index option
+ * 15/10/2016   Core Team           Addition of catchup_threads option
+ * 15/10/2016   Core Team           Addition of replicate_do/ignore_db/table options
+ * 15/10/2016   Core Team           Addition of compress_binlogs option
+ * 15/10/2016   Core Team           Addition of the getSlaveMetrics entry point
+ * 15/10/2016   Core Team           Addition of the addListener entry point
  *
  * @endverbatim
  */
@@ -98,11 +107,14 @@ static  void    errorReply(ROUTER  *instance,
                            bool    *succp);
 
 static  int getCapabilities();
+static  int getSlaveMetrics(ROUTER *instance, int n, ROUTER_SLAVE_METRICS *metrics);
+static  int addListener(ROUTER *instance, void (*notify)(void *data), void *data);
 static int blr_handler_config(void *userdata, const char *section, const char *name, const char *value);
 static int blr_handle_config_item(const char *name, const char *value, ROUTER_INSTANCE *inst);
 static int blr_set_service_mysql_user(SERVICE *service);
 static int blr_load_dbusers(const ROUTER_INSTANCE *router);
 static int blr_check_binlog(ROUTER_INSTANCE *router);
+static unsigned long blr_parse_size(const char *value);
 int blr_read_events_all_events(ROUTER_INSTANCE *router, int fix, int debug);
 void blr_master_close(ROUTER_INSTANCE *);
 
@@ -117,7 +129,9 @@ static ROUTER_OBJECT MyObject =
     diagnostics,
     clientReply,
     errorReply,
-    getCapabilities
+    getCapabilities,
+    getSlaveMetrics,
+    addListener
 };
 
 static void stats_func(void *);
@@ -190,6 +204,7 @@ createInstance(SERVICE *service, char **options)
     char filename[PATH_MAX + 1] = "";
     int rc = 0;
     char task_name[BLRM_TASK_NAME_LEN + 1] = "";
+    BLFILTER_LIST *filter;
 
     if (service->credentials.name == NULL ||
         service->credentials.authdata == NULL)
@@ -240,6 +255,7 @@ createInstance(SERVICE *service, char **options)
     inst->files = NULL;
     spinlock_init(&inst->fileslock);
     spinlock_init(&inst->binlog_lock);
+    spinlock_init(&inst->wbuf.lock);
 
     inst->binlog_fd = -1;
     inst->master_chksum = true;
@@ -427,29 +443,82 @@ createInstance(SERVICE *service, char **options)
                 }
                 else if (strcmp(options[i], "burstsize") == 0)
                 {
-                    unsigned long size = atoi(value);
-                    char    *ptr = value;
-                    while (*ptr && isdigit(*ptr))
+                    inst->burst_size = blr_parse_size(value);
+                }
+                else if (strcmp(options[i], "event_cache_size") == 0)
+                {
+                    inst->cache_size = blr_parse_size(value);
+                }
+                else if (strcmp(options[i], "sendfile_catchup") == 0)
+                {
+                    inst->sendfile_catchup = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "catchup_threads") == 0)
+                {
+                    int n_threads = atoi(value);
+
+                    if (n_threads < 0)
                     {
-                        ptr++;
+                        MXS_WARNING("Invalid catchup_threads value %s. The slaves "
+                                    "catch up in the poll threads.", value);
                     }
-                    switch (*ptr)
+                    else
                     {
-                    case 'G':
-                    case 'g':
-                        size = size * 1024 * 1000 * 1000;
-                        break;
-                    case 'M':
-                    case 'm':
-                        size = size * 1024 * 1000;
-                        break;
-                    case 'K':
-                    case 'k':
-                        size = size * 1024;
-                        break;
+                        inst->catchup_threads = n_threads;
                     }
-                    inst->burst_size = size;
+                }
+                else if ((filter = blr_filter_list(inst, options[i])) != NULL)
+                {
+                    if (filter != &inst->do_db && filter != &inst->ignore_db &&
+                        strchr(value, '.') == NULL)
+                    {
+                        MXS_WARNING("Invalid %s value %s. The tables are given as "
+                                    "database.table.", options[i], value);
+                    }
+                    else if (!blr_filter_add(filter, value))
+                    {
+                        MXS_ERROR("%s: Error: Memory allocation failed for the %s option.",
+                                  service->name, options[i]);
+                        free_instance(inst);
+                        return NULL;
+                    }
+                }
+                else if (strcmp(options[i], "compress_binlogs") == 0)
+                {
+                    inst->compress_binlogs = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "gtid_index") == 0)
+                {
+                    inst->gtid_indexing = config_truth_value(value);
+                }
+                else if (strcmp(options[i], "binlog_flush") == 0)
+                {
+                    char *end;
+                    long interval;
 
+                    if (strcmp(value, "every_event") == 0)
+                    {
+                        inst->flush_policy = BLR_FLUSH_EVENT;
+                    }
+                    else if (strcmp(value, "every_trx") == 0)
+                    {
+                        inst->flush_policy = BLR_FLUSH_TRX;
+                    }
+                    else if (strcmp(value, "every_batch") == 0)
+                    {
+                        inst->flush_policy = BLR_FLUSH_BATCH;
+                    }
+                    else if ((interval = strtol(value, &end, 10)) > 0 &&
+                             (*end == '\0' || strcmp(end, "ms") == 0))
+                    {
+                        inst->flush_policy = BLR_FLUSH_INTERVAL;
+                        inst->flush_interval = interval;
+                    }
+                    else
+                    {
+                        MXS_WARNING("Invalid binlog_flush value %s. The binlog file "
+                                    "is flushed after each batch of events.", value);
+                    }
                 }
                 else if (strcmp(options[i], "heartbeat") == 0)
                 {
@@ -506,6 +575,7 @@ createInstance(SERVICE *service, char **options)
     inst->current_pos = 0;
     inst->current_safe_event = 0;
     inst->master_event_state = BLR_EVENT_DONE;
+    inst->master_packet_remaining = 0;
 
     strcpy(inst->binlog_name, "");
     strcpy(inst->prevbinlog, "");
@@ -686,6 +756,27 @@ createInstance(SERVICE *service, char **options)
      */
     blr_init_cache(inst);
 
+    /*
+     * Load the GTID index of the binlog files
+     */
+    blr_gtid_index_open(inst);
+
+    /*
+     * Start the I/O threads that send the catchup events
+     */
+    if (!blr_catchup_start(inst))
+    {
+        MXS_WARNING("%s: The slaves catch up in the poll threads.", service->name);
+    }
+
+    /*
+     * Start the thread that compresses the old binlog files
+     */
+    if (!blr_compress_start(inst))
+    {
+        MXS_WARNING("%s: The binlog files are not compressed.", service->name);
+    }
+
     /*
      * Add tasks for statistic computation
      */
@@ -732,9 +823,50 @@ createInstance(SERVICE *service, char **options)
     return (ROUTER *)inst;
 }
 
+/**
+ * Parse a size given in bytes or with the qualifier K, M or G
+ *
+ * @param value The size
+ * @return The size in bytes
+ */
+static unsigned long
+blr_parse_size(const char *value)
+{
+    unsigned long size = atoi(value);
+    const char *ptr = value;
+
+    while (*ptr && isdigit(*ptr))
+    {
+        ptr++;
+    }
+    switch (*ptr)
+    {
+    case 'G':
+    case 'g':
+        size = size * 1024 * 1000 * 1000;
+        break;
+    case 'M':
+    case 'm':
+        size = size * 1024 * 1000;
+        break;
+    case 'K':
+    case 'k':
+        size = size * 1024;
+        break;
+    }
+
+    return size;
+}
+
 static void
 free_instance(ROUTER_INSTANCE *instance)
 {
+    blr_free_cache(instance);
+    free(instance->wbuf.data);
+    blr_gtid_index_close(instance);
+    blr_catchup_stop(instance);
+    blr_compress_stop(instance);
+    blr_filter_free(instance);
     free(instance->uuid);
     free(instance->user);
     free(instance->password);
@@ -801,6 +933,8 @@ newSession(ROUTER *instance, SESSION *session)
     slave->mariadb10_compat = false;
     slave->heartbeat = 0;
     slave->lastEventReceived = 0;
+    slave->stats.catchup_start = hkheartbeat;
+    slave->stats.bursts = ts_histogram_alloc();
 
     /**
          * Add this session to the list of active sessions.
@@ -881,6 +1015,9 @@ static void freeSession(ROUTER* router_instance,
     {
         free(slave->passwd);
     }
+    free(slave->gtid_state);
+    free(slave->filtered_tables);
+    ts_histogram_free(slave->stats.bursts);
     free(slave);
 }
 
@@ -1122,6 +1259,8 @@ diagnostics(ROUTER *router, DCB *dcb)
     }
     dcb_printf(dcb, "\tNumber of slave servers:                     %u\n",
                router_inst->stats.n_slaves);
+    dcb_printf(dcb, "\tNumber of catchup I/O threads:               %d\n",
+               router_inst->catchup.n_threads);
     dcb_printf(dcb, "\tNo. of binlog events received this session:  %lu\n",
                router_inst->stats.n_binlogs_ses);
     dcb_printf(dcb, "\tTotal no. of binlog events received:         %lu\n",
@@ -1145,12 +1284,25 @@ diagnostics(ROUTER *router, DCB *dcb)
                router_inst->stats.n_binlog_errors);
     dcb_printf(dcb, "\tNumber of binlog rotate events:              %lu\n",
                router_inst->stats.n_rotates);
+    if (router_inst->cache)
+    {
+        spinlock_acquire(&router_inst->cache->lock);
+        dcb_printf(dcb, "\tBinlog events in the event cache:            %d\n",
+                   router_inst->cache->cnt);
+        dcb_printf(dcb, "\tEvents read from the event cache:            %lu\n",
+                   router_inst->stats.n_cachehits);
+        dcb_printf(dcb, "\tEvents not found in the event cache:         %lu\n",
+                   router_inst->stats.n_cachemisses);
+        spinlock_release(&router_inst->cache->lock);
+    }
     dcb_printf(dcb, "\tNumber of heartbeat events:                  %u\n",
                router_inst->stats.n_heartbeats);
     dcb_printf(dcb, "\tNumber of packets received:                  %u\n",
                router_inst->stats.n_reads);
     dcb_printf(dcb, "\tNumber of residual data packets:             %u\n",
                router_inst->stats.n_residuals);
+    dcb_printf(dcb, "\tNumber of streamed large event packets:      %lu\n",
+               router_inst->stats.n_streamed);
     dcb_printf(dcb, "\tAverage events per packet:                   %.1f\n",
                router_inst->stats.n_reads != 0 ?
                ((double)router_inst->stats.n_binlogs / router_inst->stats.n_reads) : 0);
@@ -1362,6 +1514,21 @@ diagnostics(ROUTER *router, DCB *dcb)
                        session->stats.n_dcb);
             dcb_printf(dcb, "\t\tNo. of failed reads                      %u\n",
                        session->stats.n_failed_read);
+            dcb_printf(dcb, "\t\tNo. of events sent from binlog file      %u\n",
+                       session->stats.n_sendfile);
+            dcb_printf(dcb, "\t\tNo. of events filtered                   %u\n",
+                       session->stats.n_filtered);
+            dcb_printf(dcb, "\t\tSend rate (bytes/s)                      %lu\n",
+                       session->stats.send_rate);
+
+            if (session->stats.bursts)
+            {
+                ts_histogram_summary_t bursts;
+                ts_histogram_get(session->stats.bursts, -1, &bursts);
+                dcb_printf(dcb, "\t\tCatchup burst time (us) P50/P99/Max     %lu/%lu/%lu\n",
+                           (unsigned long)bursts.p50, (unsigned long)bursts.p99,
+                           (unsigned long)bursts.max);
+            }
 
 #ifdef DETAILED_DIAG
             dcb_printf(dcb, "\t\tNo. of nested distribute events          %u\n",
@@ -1627,6 +1794,143 @@ static int getCapabilities()
     return (int)RCAP_TYPE_NO_RSESSION;
 }
 
+/**
+ * Return the number of binlog bytes the master has sent to the router but
+ * the router has not yet sent to a slave. The router must hold binlog_lock.
+ *
+ * @param router    The router instance
+ * @param slave     The slave
+ * @return          The number of bytes in the binlog files after the
+ *                  position of the slave
+ */
+static uint64_t
+blr_slave_bytes_behind(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
+{
+    const char *sptr = strrchr(slave->binlogfile, '.');
+    const char *rptr = strrchr(router->binlog_name, '.');
+    uint64_t bytes = router->current_pos;
+
+    if (strcmp(slave->binlogfile, router->binlog_name) == 0)
+    {
+        return router->current_pos > slave->binlog_pos ? router->current_pos - slave->binlog_pos : 0;
+    }
+
+    if (sptr == NULL || rptr == NULL)
+    {
+        return 0;
+    }
+
+    /** Add the rest of the file of the slave and the files between it and the current file */
+    for (int seq = atoi(sptr + 1); seq < atoi(rptr + 1); seq++)
+    {
+        char path[PATH_MAX + 1];
+        struct stat statb;
+        off_t start = seq == atoi(sptr + 1) ? slave->binlog_pos : 0;
+
+        snprintf(path, PATH_MAX, "%s/%.*s.%06d", router->binlogdir,
+                 (int)(sptr - slave->binlogfile), slave->binlogfile, seq);
+
+        if (stat(path, &statb) == 0 && statb.st_size > start)
+        {
+            bytes += statb.st_size - start;
+        }
+    }
+
+    return bytes;
+}
+
+/**
+ * Return the replication metrics of a slave of the router
+ *
+ * @param instance  The router instance
+ * @param n         The index of the slave in the list of slaves
+ * @param metrics   The metrics of the slave, set if the slave exists
+ * @return          The number of slaves
+ */
+static int
+getSlaveMetrics(ROUTER *instance, int n, ROUTER_SLAVE_METRICS *metrics)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)instance;
+    ROUTER_SLAVE *slave;
+    int n_slaves = 0;
+
+    spinlock_acquire(&router->lock);
+
+    for (slave = router->slaves; slave; slave = slave->next)
+    {
+        if (n_slaves++ == n)
+        {
+            long catchup = slave->stats.catchup_time;
+            time_t connected = time(0) - slave->connect_time;
+
+            if ((slave->cstate & CS_UPTODATE) == 0)
+            {
+                catchup += hkheartbeat - slave->stats.catchup_start;
+            }
+
+            snprintf(metrics->host, sizeof(metrics->host), "%s:%d",
+                     slave->dcb->remote ? slave->dcb->remote : "",
+                     ntohs((slave->dcb->ipv4).sin_port));
+            metrics->server_id = slave->serverid;
+            metrics->seconds_behind = router->lastEventTimestamp > slave->lastEventTimestamp &&
+                                      slave->lastEventTimestamp ?
+                                      router->lastEventTimestamp - slave->lastEventTimestamp : 0;
+            metrics->send_rate = slave->stats.send_rate;
+            metrics->catchup_ratio = connected > 0 ? MIN(catchup / 10.0 / connected, 1.0) : 0.0;
+            memset(&metrics->catchup_bursts, 0, sizeof(metrics->catchup_bursts));
+
+            if (slave->stats.bursts)
+            {
+                ts_histogram_get(slave->stats.bursts, -1, &metrics->catchup_bursts);
+            }
+
+            spinlock_acquire(&router->binlog_lock);
+            metrics->bytes_behind = blr_slave_bytes_behind(router, slave);
+            spinlock_release(&router->binlog_lock);
+        }
+    }
+
+    spinlock_release(&router->lock);
+
+    return n_slaves;
+}
+
+/**
+ * Register a function that is called whenever an event has been written to
+ * the binlog and distributed to the slaves. This lets the modules that read
+ * the binlog files in the same process, e.g. the avrorouter, follow the
+ * binlog without polling the files.
+ *
+ * The function is called by the thread that reads the events from the master.
+ *
+ * @param instance  The router instance
+ * @param notify    The function to call
+ * @param data      Data passed to the function
+ * @return          1 if the listener was registered, 0 on memory allocation failure
+ */
+static int
+addListener(ROUTER *instance, void (*notify)(void *data), void *data)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)instance;
+    BLR_LISTENER *listener = malloc(sizeof(BLR_LISTENER));
+
+    if (listener == NULL)
+    {
+        return 0;
+    }
+
+    listener->notify = notify;
+    listener->data = data;
+
+    /** The listeners are read without the lock so they are only ever added */
+    spinlock_acquire(&router->lock);
+    listener->next = router->listeners;
+    router->listeners = listener;
+    spinlock_release(&router->lock);
+
+    return 1;
+}
+
 /**
  * The stats gathering function called from the housekeeper so that we
  * can get timed averages of binlog records shippped
@@ -1652,6 +1956,8 @@ stats_func(void *inst)
     {
         slave->stats.minavgs[slave->stats.minno++] = slave->stats.n_events - slave->stats.lastsample;
         slave->stats.lastsample = slave->stats.n_events;
+        slave->stats.send_rate = (slave->stats.n_bytes - slave->stats.lastsample_bytes) / BLR_STATS_FREQ;
+        slave->stats.lastsample_bytes = slave->stats.n_bytes;
         if (slave->stats.minno == BLR_NSTATS_MINUTES)
         {
             slave->stats.minno = 0;
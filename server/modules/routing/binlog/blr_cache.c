@@ -28,6 +28,7 @@
  *
  * Date     Who     Description
  * 07/04/2014   Mark Riddoch        Initial implementation
+ * 15/10/2016   Core Team           Cache of the latest binlog events
  *
  * @endverbatim
  */
@@ -49,13 +50,238 @@
 
 
 /**
- * Initialise the cache for this instanceof the binlog router. As a side
- * effect also determine the binlog file to read and the position to read
- * from.
+ * The sequence number of a binlog file, the numeric suffix of its name
+ *
+ * @param binlog    The name of the binlog file
+ * @return The sequence number
+ */
+static uint32_t
+blr_cache_file_seqno(const char *binlog)
+{
+    const char *sptr = strrchr(binlog, '.');
+
+    return sptr ? strtoul(sptr + 1, NULL, 10) : 0;
+}
+
+/** The record at index i, counted from the oldest one */
+static inline BLCACHE_RECORD *
+blr_cache_record(BLCACHE *cache, int i)
+{
+    return &cache->records[(cache->first + i) % cache->max_records];
+}
+
+/** Remove the oldest record from the cache */
+static inline void
+blr_cache_evict(BLCACHE *cache)
+{
+    cache->first = (cache->first + 1) % cache->max_records;
+    cache->cnt--;
+
+    if (cache->cnt == 0)
+    {
+        cache->first = 0;
+        cache->end = 0;
+    }
+}
+
+/**
+ * Initialise the cache for this instance of the binlog router. The cache
+ * holds the latest binlog events written by the router so that the slaves
+ * that are catching up read them from memory instead of the binlog files.
+ * Nothing is done if the cache_size option is not set.
  *
  * @param   router      The router instance
  */
 void
 blr_init_cache(ROUTER_INSTANCE *router)
 {
+    BLCACHE *cache;
+
+    if (router->cache_size == 0)
+    {
+        return;
+    }
+
+    if ((cache = calloc(1, sizeof(BLCACHE))) == NULL ||
+        (cache->data = malloc(router->cache_size)) == NULL ||
+        (cache->records = malloc((router->cache_size / BLCACHE_AVG_EVENT_SIZE + 1) *
+                                 sizeof(BLCACHE_RECORD))) == NULL)
+    {
+        MXS_ERROR("%s: Failed to allocate a binlog cache of %lu bytes, the slaves "
+                  "that are catching up will be read from the binlog files.",
+                  router->service->name, router->cache_size);
+        if (cache)
+        {
+            free(cache->data);
+            free(cache);
+        }
+        return;
+    }
+
+    cache->size = router->cache_size;
+    cache->max_records = router->cache_size / BLCACHE_AVG_EVENT_SIZE + 1;
+    spinlock_init(&cache->lock);
+    router->cache = cache;
+}
+
+/**
+ * Free the binlog cache of the router
+ *
+ * @param   router      The router instance
+ */
+void
+blr_free_cache(ROUTER_INSTANCE *router)
+{
+    if (router->cache)
+    {
+        free(router->cache->records);
+        free(router->cache->data);
+        free(router->cache);
+        router->cache = NULL;
+    }
+}
+
+/**
+ * Add a binlog event to the cache. The oldest events are removed to make
+ * room for it. Events must be added in the order they are in the binlog
+ * files, an event that is not after the newest one in the cache empties
+ * the cache first.
+ *
+ * @param router    The router instance
+ * @param binlog    The binlog file the event was written to
+ * @param pos       The position of the event in the file
+ * @param event     The event, header included
+ * @param size      Size of the event
+ */
+void
+blr_cache_add(ROUTER_INSTANCE *router, const char *binlog, uint32_t pos,
+              uint8_t *event, uint32_t size)
+{
+    BLCACHE *cache = router->cache;
+    uint32_t file = blr_cache_file_seqno(binlog);
+
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    spinlock_acquire(&cache->lock);
+
+    if (cache->cnt > 0)
+    {
+        BLCACHE_RECORD *newest = blr_cache_record(cache, cache->cnt - 1);
+
+        if (file < newest->file || (file == newest->file && pos <= newest->pos))
+        {
+            /** The binlog files were reset or a file was truncated */
+            cache->cnt = 0;
+            cache->first = 0;
+            cache->end = 0;
+        }
+    }
+
+    if (size <= cache->size)
+    {
+        size_t offset = cache->end;
+        bool wrap = offset + size > cache->size;
+
+        if (wrap)
+        {
+            offset = 0;
+        }
+
+        /**
+         * Remove the records the new event overwrites. When the event wraps
+         * to the start of the buffer, the records at the end of the buffer
+         * are the oldest ones and they are removed first.
+         */
+        while (cache->cnt > 0)
+        {
+            BLCACHE_RECORD *oldest = blr_cache_record(cache, 0);
+
+            if (cache->cnt == cache->max_records ||
+                (wrap && oldest->offset >= cache->end) ||
+                (oldest->offset < offset + size && oldest->offset + oldest->size > offset))
+            {
+                blr_cache_evict(cache);
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        BLCACHE_RECORD *record = blr_cache_record(cache, cache->cnt);
+        record->file = file;
+        record->pos = pos;
+        record->size = size;
+        record->offset = offset;
+        memcpy(cache->data + offset, event, size);
+        cache->end = offset + size;
+        cache->cnt++;
+    }
+
+    spinlock_release(&cache->lock);
+}
+
+/**
+ * Read a binlog event from the cache
+ *
+ * @param router    The router instance
+ * @param binlog    The binlog file to read from
+ * @param pos       The position of the event
+ * @return A copy of the event or NULL if it is not in the cache
+ */
+GWBUF *
+blr_cache_read(ROUTER_INSTANCE *router, const char *binlog, uint32_t pos)
+{
+    BLCACHE *cache = router->cache;
+    uint32_t file = blr_cache_file_seqno(binlog);
+    GWBUF *result = NULL;
+
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    spinlock_acquire(&cache->lock);
+
+    int low = 0;
+    int high = cache->cnt - 1;
+
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        BLCACHE_RECORD *record = blr_cache_record(cache, mid);
+
+        if (record->file < file || (record->file == file && record->pos < pos))
+        {
+            low = mid + 1;
+        }
+        else if (record->file > file || record->pos > pos)
+        {
+            high = mid - 1;
+        }
+        else
+        {
+            if ((result = gwbuf_alloc(record->size)))
+            {
+                memcpy(GWBUF_DATA(result), cache->data + record->offset, record->size);
+            }
+            break;
+        }
+    }
+
+    if (result)
+    {
+        router->stats.n_cachehits++;
+    }
+    else
+    {
+        router->stats.n_cachemisses++;
+    }
+
+    spinlock_release(&cache->lock);
+
+    return result;
 }
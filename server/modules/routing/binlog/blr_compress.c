@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file blr_compress.c - binlog router compressed binlog files
+ *
+ * With the compress_binlogs option the binlog files that are no longer
+ * written to are compressed by a background thread. A compressed file is
+ * stored next to the binlog files with the BLR_COMPRESSED_SUFFIX suffix and
+ * replaces the binlog file. The file is compressed with zlib in chunks of
+ * BLR_COMPRESS_CHUNK bytes that are decompressed independently, so that an
+ * event is read by decompressing only the chunks it is in.
+ *
+ * The current binlog file and the one before it, which may still be
+ * truncated after a partial transaction, are never compressed.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date     Who     Description
+ * 15/10/2016   Core Team           Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <service.h>
+#include <thread.h>
+#include <blr.h>
+
+#include <skygw_types.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+/** How often the compression thread looks for binlog files to compress, in seconds */
+#define BLR_COMPRESS_INTERVAL 10
+
+/**
+ * Read a compressed binlog file header and chunk index
+ *
+ * @param fd        The compressed binlog file
+ * @param path      The path of the file, for error messages
+ * @return          The compressed file or NULL if the file is not valid
+ */
+BLZFILE *
+blr_zfile_open(int fd, const char *path)
+{
+    BLZFILE *z = calloc(1, sizeof(BLZFILE));
+    size_t index_len;
+
+    if (z == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the compressed binlog file %s.", path);
+        return NULL;
+    }
+
+    if (pread(fd, &z->header, sizeof(z->header), 0) != sizeof(z->header) ||
+        memcmp(z->header.magic, BLR_COMPRESSED_MAGIC, sizeof(BLR_COMPRESSED_MAGIC)) != 0 ||
+        z->header.chunk_size == 0)
+    {
+        MXS_ERROR("The compressed binlog file %s has an invalid header.", path);
+        free(z);
+        return NULL;
+    }
+
+    index_len = (z->header.n_chunks + 1) * sizeof(uint64_t);
+    z->chunk_no = -1;
+    z->zbuf_size = compressBound(z->header.chunk_size);
+
+    if ((z->index = malloc(index_len)) == NULL ||
+        (z->chunk = malloc(z->header.chunk_size)) == NULL ||
+        (z->zbuf = malloc(z->zbuf_size)) == NULL)
+    {
+        MXS_ERROR("Failed to allocate memory for the compressed binlog file %s.", path);
+        blr_zfile_close(z);
+        return NULL;
+    }
+
+    if (pread(fd, z->index, index_len, z->header.index_offset) != index_len)
+    {
+        MXS_ERROR("Failed to read the chunk index of the compressed binlog file %s.", path);
+        blr_zfile_close(z);
+        return NULL;
+    }
+
+    return z;
+}
+
+/**
+ * Free a compressed binlog file
+ *
+ * @param z         The compressed file
+ */
+void
+blr_zfile_close(BLZFILE *z)
+{
+    if (z)
+    {
+        free(z->index);
+        free(z->chunk);
+        free(z->zbuf);
+        free(z);
+    }
+}
+
+/**
+ * Decompress a chunk of a compressed binlog file, unless it is the chunk
+ * that was decompressed last
+ *
+ * @param z         The compressed file
+ * @param fd        The compressed binlog file
+ * @param chunk_no  The number of the chunk
+ * @return          The uncompressed length of the chunk or -1 on error
+ */
+static int
+blr_zfile_chunk(BLZFILE *z, int fd, int chunk_no)
+{
+    uint64_t zlen = z->index[chunk_no + 1] - z->index[chunk_no];
+    uLongf len = z->header.chunk_size;
+
+    if (chunk_no == z->chunk_no)
+    {
+        return MIN(z->header.chunk_size, z->header.size - (uint64_t)chunk_no * z->header.chunk_size);
+    }
+
+    z->chunk_no = -1;
+
+    if (zlen > z->zbuf_size ||
+        pread(fd, z->zbuf, zlen, z->index[chunk_no]) != zlen ||
+        uncompress(z->chunk, &len, z->zbuf, zlen) != Z_OK)
+    {
+        return -1;
+    }
+
+    z->chunk_no = chunk_no;
+    return len;
+}
+
+/**
+ * Read from a compressed binlog file as if it was the binlog file itself.
+ * The caller must hold the lock of the file.
+ *
+ * @param z         The compressed file
+ * @param fd        The compressed binlog file
+ * @param buf       The buffer to read to
+ * @param len       The number of bytes to read
+ * @param pos       The position in the uncompressed binlog file
+ * @return          The number of bytes read, less at the end of the file,
+ *                  or -1 on error
+ */
+int
+blr_zfile_read(BLZFILE *z, int fd, uint8_t *buf, uint32_t len, unsigned long pos)
+{
+    int n = 0;
+
+    while (n < len && pos < z->header.size)
+    {
+        int chunk_no = pos / z->header.chunk_size;
+        int offset = pos % z->header.chunk_size;
+        int chunk_len = blr_zfile_chunk(z, fd, chunk_no);
+
+        if (chunk_len <= offset)
+        {
+            errno = EIO;
+            return -1;
+        }
+
+        int count = MIN(len - n, chunk_len - offset);
+        memcpy(buf + n, z->chunk + offset, count);
+        n += count;
+        pos += count;
+    }
+
+    return n;
+}
+
+/**
+ * Compress a binlog file. The compressed file is written next to the binlog
+ * file and then replaces it. Slaves that have the binlog file open keep
+ * reading it until they close it.
+ *
+ * @param router    The router instance
+ * @param binlog    The name of the binlog file
+ * @return          True if the file was compressed
+ */
+bool
+blr_compress_binlog(ROUTER_INSTANCE *router, const char *binlog)
+{
+    char path[PATH_MAX + 1];
+    char zpath[PATH_MAX + 1];
+    char tmppath[PATH_MAX + 1];
+    char err_msg[STRERROR_BUFLEN];
+    uint8_t *chunk = malloc(BLR_COMPRESS_CHUNK);
+    uint8_t *zbuf = malloc(compressBound(BLR_COMPRESS_CHUNK));
+    uint64_t *index = NULL;
+    BLZHEADER header;
+    struct stat statb;
+    bool rval = false;
+    int fd, zfd = -1;
+
+    snprintf(path, PATH_MAX, "%s/%s", router->binlogdir, binlog);
+    snprintf(zpath, PATH_MAX, "%s%s", path, BLR_COMPRESSED_SUFFIX);
+    snprintf(tmppath, PATH_MAX, "%s.tmp", zpath);
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &statb) == -1 ||
+        (zfd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    {
+        MXS_ERROR("%s: Failed to open binlog file %s for compression, %s.",
+                  router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
+    }
+    else if (chunk && zbuf)
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BLR_COMPRESSED_MAGIC, sizeof(BLR_COMPRESSED_MAGIC));
+        header.chunk_size = BLR_COMPRESS_CHUNK;
+        header.n_chunks = (statb.st_size + BLR_COMPRESS_CHUNK - 1) / BLR_COMPRESS_CHUNK;
+        header.size = statb.st_size;
+
+        if ((index = malloc((header.n_chunks + 1) * sizeof(uint64_t))) != NULL)
+        {
+            uint64_t offset = sizeof(header);
+            uint32_t i;
+
+            for (i = 0; i < header.n_chunks; i++)
+            {
+                ssize_t len = pread(fd, chunk, BLR_COMPRESS_CHUNK, (off_t)i * BLR_COMPRESS_CHUNK);
+                uLongf zlen = compressBound(BLR_COMPRESS_CHUNK);
+
+                if (len <= 0 || compress(zbuf, &zlen, chunk, len) != Z_OK ||
+                    pwrite(zfd, zbuf, zlen, offset) != zlen)
+                {
+                    break;
+                }
+
+                index[i] = offset;
+                offset += zlen;
+            }
+
+            index[i] = offset;
+            header.index_offset = offset;
+
+            rval = i == header.n_chunks &&
+                pwrite(zfd, index, (header.n_chunks + 1) * sizeof(uint64_t), offset) ==
+                (header.n_chunks + 1) * sizeof(uint64_t) &&
+                pwrite(zfd, &header, sizeof(header), 0) == sizeof(header) &&
+                fsync(zfd) == 0;
+        }
+
+        if (!rval)
+        {
+            MXS_ERROR("%s: Failed to compress binlog file %s, %s.",
+                      router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
+        }
+    }
+
+    if (zfd != -1)
+    {
+        close(zfd);
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
+    if (rval && rename(tmppath, zpath) == 0)
+    {
+        unlink(path);
+        MXS_NOTICE("%s: Compressed binlog file %s from %lu to %lu bytes.",
+                   router->service->name, binlog, (unsigned long)header.size,
+                   (unsigned long)(header.index_offset + (header.n_chunks + 1) * sizeof(uint64_t)));
+    }
+    else
+    {
+        unlink(tmppath);
+        rval = false;
+    }
+
+    free(index);
+    free(zbuf);
+    free(chunk);
+    return rval;
+}
+
+/**
+ * Compress the binlog files of the router that are no longer written to
+ *
+ * @param router    The router instance
+ */
+static void
+blr_compress_binlogs(ROUTER_INSTANCE *router)
+{
+    int root_len = strlen(router->fileroot);
+    const char *sptr;
+    struct dirent *dp;
+    DIR *dirp;
+    int current;
+
+    spinlock_acquire(&router->binlog_lock);
+    sptr = strrchr(router->binlog_name, '.');
+    current = sptr ? atoi(sptr + 1) : 0;
+    spinlock_release(&router->binlog_lock);
+
+    if (current == 0 || (dirp = opendir(router->binlogdir)) == NULL)
+    {
+        return;
+    }
+
+    while (router->compress_running && (dp = readdir(dirp)) != NULL)
+    {
+        char *end;
+
+        /** Binlog files are named fileroot.000001 */
+        if (strncmp(dp->d_name, router->fileroot, root_len) == 0 &&
+            dp->d_name[root_len] == '.' &&
+            strtol(dp->d_name + root_len + 1, &end, 10) + 1 < current &&
+            end != dp->d_name + root_len + 1 && *end == '\0')
+        {
+            blr_compress_binlog(router, dp->d_name);
+        }
+    }
+
+    closedir(dirp);
+}
+
+/**
+ * The entry point of the compression thread
+ *
+ * @param arg       The router instance
+ */
+static void
+blr_compress_main(void *arg)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)arg;
+
+    while (router->compress_running)
+    {
+        blr_compress_binlogs(router);
+
+        for (int i = 0; i < BLR_COMPRESS_INTERVAL && router->compress_running; i++)
+        {
+            thread_millisleep(1000);
+        }
+    }
+}
+
+/**
+ * Start the thread that compresses the binlog files of the router, if the
+ * compress_binlogs option is set
+ *
+ * @param router    The router instance
+ * @return          False if the thread could not be started
+ */
+bool
+blr_compress_start(ROUTER_INSTANCE *router)
+{
+    if (!router->compress_binlogs)
+    {
+        return true;
+    }
+
+    router->compress_running = true;
+
+    if (thread_start(&router->compress_thread, blr_compress_main, router) == NULL)
+    {
+        MXS_ERROR("%s: Failed to start the binlog compression thread.", router->service->name);
+        router->compress_running = false;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Stop the thread that compresses the binlog files of the router
+ *
+ * @param router    The router instance
+ */
+void
+blr_compress_stop(ROUTER_INSTANCE *router)
+{
+    if (router->compress_running)
+    {
+        router->compress_running = false;
+        thread_wait(router->compress_thread);
+    }
+}
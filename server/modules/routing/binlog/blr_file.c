@@ -34,6 +34,11 @@
  *                                  It's no longer using QUERY_EVENT with BEGIN
  * 23/10/2015     Markus Makela       Added current_safe_event
  * 26/04/2016   Massimiliano Pinto  Added MariaDB 10.0 and 10.1 GTID event flags detection
+ * 15/10/2016   Core Team           Read the events from the binlog cache
+ * 15/10/2016   Core Team           Events are written through a write buffer, binlog_flush
+ *                                  option
+ * 15/10/2016   Core Team           Binlog files opened for the slaves are read ahead sequentially
+ * 15/10/2016   Core Team           Compressed binlog files are read transparently
  *
  * @endverbatim
  */
@@ -58,6 +63,7 @@
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <latency.h>
 
 static int  blr_file_create(ROUTER_INSTANCE *router, char *file);
 static void blr_log_header(int priority, char *msg, uint8_t *ptr);
@@ -237,6 +243,7 @@ blr_file_create(ROUTER_INSTANCE *router, char *file)
     {
         if (blr_file_add_magic(fd))
         {
+            blr_file_sync(router);
             close(router->binlog_fd);
             spinlock_acquire(&router->binlog_lock);
             strncpy(router->binlog_name, file, BINLOG_FNAMELEN);
@@ -294,6 +301,7 @@ blr_file_append(ROUTER_INSTANCE *router, char *file)
         return;
     }
     fsync(fd);
+    blr_file_sync(router);
     close(router->binlog_fd);
     spinlock_acquire(&router->binlog_lock);
     memmove(router->binlog_name, file, BINLOG_FNAMELEN);
@@ -330,7 +338,7 @@ blr_file_append(ROUTER_INSTANCE *router, char *file)
 }
 
 /**
- * Write a binlog entry to disk.
+ * Write a binlog entry to the binlog file, through the write buffer.
  *
  * @param router The router instance
  * @param buf    The binlog record
@@ -342,42 +350,284 @@ blr_write_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint32_t size,
 {
     int n;
 
-    if ((n = pwrite(router->binlog_fd, buf, size,
-                    router->last_written)) != size)
+    if ((n = blr_file_write(router, buf, size)) == 0)
+    {
+        return 0;
+    }
+
+    /** Events that are sent in several packets are not cached */
+    if (router->cache && size == hdr->event_size)
+    {
+        blr_cache_add(router, router->binlog_name, router->last_written, buf, size);
+    }
+
+    spinlock_acquire(&router->binlog_lock);
+    router->current_pos = hdr->next_pos;
+    router->last_written += size;
+    router->last_event_pos = hdr->next_pos - hdr->event_size;
+    spinlock_release(&router->binlog_lock);
+    return n;
+}
+
+/**
+ * Write the write buffer to the binlog file. If the write fails, the file is
+ * truncated to the position of the buffered data, the buffered events are
+ * lost and the positions of the router are moved back to the end of the file.
+ *
+ * @param router    The router instance
+ * @return          1 on success, 0 on error
+ */
+static int
+blr_file_write_out(ROUTER_INSTANCE *router)
+{
+    BLWRITEBUF *wbuf = &router->wbuf;
+    int rval = 1;
+
+    if (wbuf->len == 0)
+    {
+        return 1;
+    }
+
+    if (pwrite(router->binlog_fd, wbuf->data, wbuf->len, wbuf->pos) != (ssize_t)wbuf->len)
     {
         char err_msg[STRERROR_BUFLEN];
-        MXS_ERROR("%s: Failed to write binlog record at %lu of %s, %s. "
-                  "Truncating to previous record.",
-                  router->service->name, router->last_written,
+        MXS_ERROR("%s: Failed to write %lu bytes of binlog records at %lu of %s, %s. "
+                  "Truncating to previous write.",
+                  router->service->name, wbuf->len, wbuf->pos,
                   router->binlog_name,
                   strerror_r(errno, err_msg, sizeof(err_msg)));
-        /* Remove any partial event that was written */
-        if (ftruncate(router->binlog_fd, router->last_written))
+        /* Remove any partial events that were written */
+        if (ftruncate(router->binlog_fd, wbuf->pos))
         {
-            MXS_ERROR("%s: Failed to truncate binlog record at %lu of %s, %s. ",
-                      router->service->name, router->last_written,
+            MXS_ERROR("%s: Failed to truncate binlog records at %lu of %s, %s. ",
+                      router->service->name, wbuf->pos,
                       router->binlog_name,
                       strerror_r(errno, err_msg, sizeof(err_msg)));
         }
+
+        spinlock_acquire(&router->binlog_lock);
+        router->last_written = wbuf->pos;
+        router->current_pos = wbuf->pos;
+        if (router->binlog_position > wbuf->pos)
+        {
+            router->binlog_position = wbuf->pos;
+        }
+        spinlock_release(&router->binlog_lock);
+        rval = 0;
+    }
+
+    spinlock_acquire(&wbuf->lock);
+    if (rval)
+    {
+        wbuf->pos += wbuf->len;
+    }
+    wbuf->len = 0;
+    spinlock_release(&wbuf->lock);
+
+    return rval;
+}
+
+/**
+ * Write data at the end of the current binlog file. The data is collected
+ * in the write buffer, which is written to the file when it is full and
+ * when the file is flushed. Data larger than the buffer is written directly.
+ *
+ * The caller adds the size to router->last_written.
+ *
+ * @param router    The router instance
+ * @param buf       The data
+ * @param size      Size of the data
+ * @return          The number of bytes written, 0 on error
+ */
+int
+blr_file_write(ROUTER_INSTANCE *router, uint8_t *buf, uint32_t size)
+{
+    BLWRITEBUF *wbuf = &router->wbuf;
+
+    if (wbuf->len + size > BLR_WRITE_BUFFER_SIZE && !blr_file_write_out(router))
+    {
         return 0;
     }
-    spinlock_acquire(&router->binlog_lock);
-    router->current_pos = hdr->next_pos;
-    router->last_written += size;
-    router->last_event_pos = hdr->next_pos - hdr->event_size;
-    spinlock_release(&router->binlog_lock);
-    return n;
+
+    if (size >= BLR_WRITE_BUFFER_SIZE ||
+        (wbuf->data == NULL && (wbuf->data = malloc(BLR_WRITE_BUFFER_SIZE)) == NULL))
+    {
+        if (pwrite(router->binlog_fd, buf, size, router->last_written) != size)
+        {
+            char err_msg[STRERROR_BUFLEN];
+            MXS_ERROR("%s: Failed to write binlog record at %lu of %s, %s. "
+                      "Truncating to previous record.",
+                      router->service->name, router->last_written,
+                      router->binlog_name,
+                      strerror_r(errno, err_msg, sizeof(err_msg)));
+            /* Remove any partial event that was written */
+            if (ftruncate(router->binlog_fd, router->last_written))
+            {
+                MXS_ERROR("%s: Failed to truncate binlog record at %lu of %s, %s. ",
+                          router->service->name, router->last_written,
+                          router->binlog_name,
+                          strerror_r(errno, err_msg, sizeof(err_msg)));
+            }
+            return 0;
+        }
+        return size;
+    }
+
+    spinlock_acquire(&wbuf->lock);
+    if (wbuf->len == 0)
+    {
+        wbuf->pos = router->last_written;
+    }
+    memcpy(wbuf->data + wbuf->len, buf, size);
+    wbuf->len += size;
+    spinlock_release(&wbuf->lock);
+
+    return size;
 }
 
 /**
- * Flush the content of the binlog file to disk.
+ * Write the write buffer to the binlog file and sync the file to disk.
  *
  * @param   router  The binlog router
+ * @return  1 on success, 0 if the write buffer could not be written
  */
-void
+int
+blr_file_sync(ROUTER_INSTANCE *router)
+{
+    int rval = blr_file_write_out(router);
+
+    if (router->binlog_fd != -1)
+    {
+        fsync(router->binlog_fd);
+    }
+    router->last_sync = latency_now();
+
+    return rval;
+}
+
+/**
+ * Check whether the binlog file is due to be synced by the flush interval
+ *
+ * @param   router  The binlog router
+ * @return  True if the flush interval has passed since the last sync
+ */
+static bool
+blr_file_sync_due(ROUTER_INSTANCE *router)
+{
+    return latency_now() - router->last_sync >= router->flush_interval * 1000;
+}
+
+/**
+ * Flush the content of the binlog file after a batch of events has been read
+ * from the master. The write buffer is always written to the file, which is
+ * synced to disk as the binlog_flush option tells.
+ *
+ * @param   router  The binlog router
+ * @return  1 on success, 0 if the write buffer could not be written
+ */
+int
 blr_file_flush(ROUTER_INSTANCE *router)
 {
-    fsync(router->binlog_fd);
+    if (router->flush_policy == BLR_FLUSH_BATCH ||
+        (router->flush_policy == BLR_FLUSH_INTERVAL && blr_file_sync_due(router)))
+    {
+        return blr_file_sync(router);
+    }
+
+    return blr_file_write_out(router);
+}
+
+/**
+ * Flush the content of the binlog file after an event has been written, if
+ * the binlog_flush option asks for it.
+ *
+ * @param   router  The binlog router
+ * @return  1 on success, 0 if the write buffer could not be written
+ */
+int
+blr_file_event_flush(ROUTER_INSTANCE *router)
+{
+    if (router->flush_policy == BLR_FLUSH_EVENT ||
+        (router->flush_policy == BLR_FLUSH_TRX && router->pending_transaction == 0) ||
+        (router->flush_policy == BLR_FLUSH_INTERVAL && blr_file_sync_due(router)))
+    {
+        return blr_file_sync(router);
+    }
+
+    return 1;
+}
+
+/**
+ * Check whether a part of a binlog file is still in the write buffer
+ *
+ * @param router    The router instance
+ * @param binlog    Name of the binlog file
+ * @param end       End of the part of the file
+ * @return          True if some of the part has not been written to the file
+ */
+bool
+blr_file_buffered(ROUTER_INSTANCE *router, const char *binlog, unsigned long end)
+{
+    bool rval = false;
+
+    spinlock_acquire(&router->wbuf.lock);
+    if (router->wbuf.len && end > router->wbuf.pos)
+    {
+        rval = strcmp(binlog, router->binlog_name) == 0;
+    }
+    spinlock_release(&router->wbuf.lock);
+
+    return rval;
+}
+
+/**
+ * Read from a binlog file like pread. The part of the current binlog file
+ * that is still in the write buffer is copied from the buffer.
+ *
+ * @param router    The router instance
+ * @param fd        The binlog file
+ * @param binlog    Name of the binlog file
+ * @param buf       Where the data is read to
+ * @param len       Number of bytes to read
+ * @param pos       Position to read from
+ * @return          The number of bytes read or -1 on error
+ */
+int
+blr_file_read(ROUTER_INSTANCE *router, int fd, const char *binlog, uint8_t *buf,
+              uint32_t len, unsigned long pos)
+{
+    BLWRITEBUF *wbuf = &router->wbuf;
+    unsigned long end = pos + len;
+    unsigned long copied = 0;
+
+    spinlock_acquire(&wbuf->lock);
+    if (wbuf->len && end > wbuf->pos && strcmp(binlog, router->binlog_name) == 0)
+    {
+        unsigned long start = MAX(pos, wbuf->pos);
+        unsigned long last = MIN(end, wbuf->pos + wbuf->len);
+
+        if (last > start)
+        {
+            memcpy(buf + (start - pos), wbuf->data + (start - wbuf->pos), last - start);
+            copied = last - start;
+        }
+        /** Only the part before the buffer is read from the file */
+        end = start;
+    }
+    spinlock_release(&wbuf->lock);
+
+    if (end > pos)
+    {
+        int n = pread(fd, buf, end - pos, pos);
+
+        if (n != (int)(end - pos))
+        {
+            /** A short read ends at the end of the file, not in the buffer */
+            return n;
+        }
+    }
+
+    return end - pos + copied;
 }
 
 /**
@@ -414,14 +664,26 @@ blr_open_binlog(ROUTER_INSTANCE *router, char *binlog)
     }
     strncpy(file->binlogname, binlog, BINLOG_FNAMELEN);
     file->refcnt = 1;
-    file->cache = 0;
     spinlock_init(&file->lock);
 
     strncpy(path, router->binlogdir, PATH_MAX);
     strncat(path, "/", PATH_MAX - strlen(path));
     strncat(path, binlog, PATH_MAX - strlen(path));
 
-    if ((file->fd = open(path, O_RDONLY, 0666)) == -1)
+    if ((file->fd = open(path, O_RDONLY, 0666)) == -1 && errno == ENOENT)
+    {
+        /** The file may have been compressed */
+        strncat(path, BLR_COMPRESSED_SUFFIX, PATH_MAX - strlen(path));
+
+        if ((file->fd = open(path, O_RDONLY, 0666)) != -1 &&
+            (file->z = blr_zfile_open(file->fd, path)) == NULL)
+        {
+            close(file->fd);
+            file->fd = -1;
+        }
+    }
+
+    if (file->fd == -1)
     {
         MXS_ERROR("Failed to open binlog file %s", path);
         free(file);
@@ -429,6 +691,9 @@ blr_open_binlog(ROUTER_INSTANCE *router, char *binlog)
         return NULL;
     }
 
+    /** The slaves read the file from start to end */
+    posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
     file->next = router->files;
     router->files = file;
     spinlock_release(&router->fileslock);
@@ -437,17 +702,67 @@ blr_open_binlog(ROUTER_INSTANCE *router, char *binlog)
 }
 
 /**
- * Read a replication event into a GWBUF structure.
+ * Read from a binlog file opened with blr_open_binlog, decompressing the
+ * data of compressed files
+ *
+ * @param router    The router instance
+ * @param file      The binlog file
+ * @param buf       The buffer to read to
+ * @param len       The number of bytes to read
+ * @param pos       The position in the binlog file
+ * @return          The number of bytes read or -1 on error
+ */
+static int
+blr_file_pread(ROUTER_INSTANCE *router, BLFILE *file, uint8_t *buf, uint32_t len,
+               unsigned long pos)
+{
+    int n;
+
+    if (file->z == NULL)
+    {
+        return blr_file_read(router, file->fd, file->binlogname, buf, len, pos);
+    }
+
+    spinlock_acquire(&file->lock);
+    n = blr_zfile_read(file->z, file->fd, buf, len, pos);
+    spinlock_release(&file->lock);
+
+    return n;
+}
+
+/**
+ * Extract the header of a binlog event
+ *
+ * @param ptr   The event
+ * @param hdr   The header to populate
+ */
+static void
+blr_file_extract_header(uint8_t *ptr, REP_HEADER *hdr)
+{
+    hdr->timestamp = EXTRACT32(ptr);
+    hdr->event_type = ptr[4];
+    hdr->serverid = EXTRACT32(&ptr[5]);
+    hdr->event_size = extract_field(&ptr[9], 32);
+    hdr->next_pos = EXTRACT32(&ptr[13]);
+    hdr->flags = EXTRACT16(&ptr[17]);
+}
+
+/**
+ * Read and check the header of a replication event and optionally the
+ * whole event into a GWBUF structure. The whole event is read from the
+ * binlog cache if it is there.
  *
  * @param router    The router instance
  * @param file      File record
  * @param pos       Position of binlog record to read
  * @param hdr       Binlog header to populate
  * @param errmsg    Allocated BINLOG_ERROR_MSG_LEN bytes message error buffer
- * @return          The binlog record wrapped in a GWBUF structure
+ * @param event     Where the event is stored, NULL to read only the header
+ * @return          True if the event was read
  */
-GWBUF *
-blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HEADER *hdr, char *errmsg)
+static bool
+blr_read_event(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HEADER *hdr,
+               char *errmsg, GWBUF **event)
 {
     uint8_t hdbuf[BINLOG_EVENT_HDR_LEN];
     GWBUF *result;
@@ -465,11 +780,32 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
     {
         snprintf(errmsg, BINLOG_ERROR_MSG_LEN,
                  "Invalid file pointer for requested binlog at position %lu", pos);
-        return NULL;
+        return false;
+    }
+
+    if (event && router->cache)
+    {
+        /** Only events before the latest safe position are sent to the slaves */
+        spinlock_acquire(&router->binlog_lock);
+        bool safe = strcmp(router->binlog_name, file->binlogname) != 0 ||
+            pos < router->binlog_position;
+        spinlock_release(&router->binlog_lock);
+
+        if (safe && (result = blr_cache_read(router, file->binlogname, pos)) != NULL)
+        {
+            blr_file_extract_header(GWBUF_DATA(result), hdr);
+            hdr->ok = SLAVE_POS_READ_OK;
+            *event = result;
+            return true;
+        }
     }
 
     spinlock_acquire(&file->lock);
-    if (fstat(file->fd, &statb) == 0)
+    if (file->z)
+    {
+        filelen = file->z->header.size;
+    }
+    else if (fstat(file->fd, &statb) == 0)
     {
         filelen = statb.st_size;
     }
@@ -481,11 +817,19 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
             snprintf(errmsg, BINLOG_ERROR_MSG_LEN,
                      "blr_read_binlog called with invalid file->fd, pos %lu", pos);
             spinlock_release(&file->lock);
-            return NULL;
+            return false;
         }
     }
     spinlock_release(&file->lock);
 
+    /* The events still in the write buffer are part of the file */
+    spinlock_acquire(&router->wbuf.lock);
+    if (router->wbuf.len && strcmp(router->binlog_name, file->binlogname) == 0)
+    {
+        filelen = MAX(filelen, router->wbuf.pos + router->wbuf.len);
+    }
+    spinlock_release(&router->wbuf.lock);
+
     if (pos > filelen)
     {
         spinlock_acquire(&router->binlog_lock);
@@ -511,7 +855,7 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
         spinlock_release(&file->lock);
         spinlock_release(&router->binlog_lock);
 
-        return NULL;
+        return false;
     }
 
     spinlock_acquire(&router->binlog_lock);
@@ -537,13 +881,14 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
         spinlock_release(&file->lock);
         spinlock_release(&router->binlog_lock);
 
-        return NULL;
+        return false;
     }
     spinlock_release(&file->lock);
     spinlock_release(&router->binlog_lock);
 
     /* Read the header information from the file */
-    if ((n = pread(file->fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
+    if ((n = blr_file_pread(router, file, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) !=
+        BINLOG_EVENT_HDR_LEN)
     {
         switch (n)
         {
@@ -576,15 +921,10 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
                      BINLOG_EVENT_HDR_LEN, n, pos, file->binlogname);
             break;
         }
-        return NULL;
+        return false;
     }
 
-    hdr->timestamp = EXTRACT32(hdbuf);
-    hdr->event_type = hdbuf[4];
-    hdr->serverid = EXTRACT32(&hdbuf[5]);
-    hdr->event_size = extract_field(&hdbuf[9], 32);
-    hdr->next_pos = EXTRACT32(&hdbuf[13]);
-    hdr->flags = EXTRACT16(&hdbuf[17]);
+    blr_file_extract_header(hdbuf, hdr);
 
     /* event pos & size checks */
     if (hdr->event_size == 0 || ((hdr->next_pos != (pos + hdr->event_size)) &&
@@ -594,7 +934,7 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
                  "Client requested master to start replication from invalid "
                  "position %lu in binlog file '%s'", pos,
                  file->binlogname);
-        return NULL;
+        return false;
     }
 
     /* event type checks */
@@ -605,7 +945,7 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
             snprintf(errmsg, BINLOG_ERROR_MSG_LEN,
                      "Invalid MariaDB 10 event type 0x%x at %lu in binlog file '%s'",
                      hdr->event_type, pos, file->binlogname);
-            return NULL;
+            return false;
         }
     }
     else
@@ -615,7 +955,7 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
             snprintf(errmsg, BINLOG_ERROR_MSG_LEN,
                      "Invalid event type 0x%x at %lu in binlog file '%s'", hdr->event_type,
                      pos, file->binlogname);
-            return NULL;
+            return false;
         }
     }
 
@@ -627,7 +967,8 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
                   pos, file->binlogname, filelen, router->binlog_position,
                   router->binlog_name);
 
-        if ((n = pread(file->fd, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) != BINLOG_EVENT_HDR_LEN)
+        if ((n = blr_file_pread(router, file, hdbuf, BINLOG_EVENT_HDR_LEN, pos)) !=
+            BINLOG_EVENT_HDR_LEN)
         {
             switch (n)
             {
@@ -660,21 +1001,16 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
                          BINLOG_EVENT_HDR_LEN, n, pos, file->binlogname);
                 break;
             }
-            return NULL;
+            return false;
         }
 
-        hdr->timestamp = EXTRACT32(hdbuf);
-        hdr->event_type = hdbuf[4];
-        hdr->serverid = EXTRACT32(&hdbuf[5]);
-        hdr->event_size = extract_field(&hdbuf[9], 32);
-        hdr->next_pos = EXTRACT32(&hdbuf[13]);
-        hdr->flags = EXTRACT16(&hdbuf[17]);
+        blr_file_extract_header(hdbuf, hdr);
 
         if (hdr->next_pos < pos && hdr->event_type != ROTATE_EVENT)
         {
             snprintf(errmsg, BINLOG_ERROR_MSG_LEN, "Next event position still incorrect after rereading, "
                      "event at %lu in binlog file '%s'", pos, file->binlogname);
-            return NULL;
+            return false;
         }
         else
         {
@@ -682,20 +1018,27 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
                       "rereading");
         }
     }
+    if (event == NULL)
+    {
+        /* set OK indicator, the caller reads the rest of the event */
+        hdr->ok = SLAVE_POS_READ_OK;
+        return true;
+    }
+
     if ((result = gwbuf_alloc(hdr->event_size)) == NULL)
     {
         snprintf(errmsg, BINLOG_ERROR_MSG_LEN,
                  "Failed to allocate memory for binlog entry, size %d, event at %lu in binlog file '%s'",
                  hdr->event_size, pos, file->binlogname);
-        return NULL;
+        return false;
     }
 
     data = GWBUF_DATA(result);
 
     memcpy(data, hdbuf, BINLOG_EVENT_HDR_LEN);  // Copy the header in
 
-    if ((n = pread(file->fd, &data[BINLOG_EVENT_HDR_LEN], hdr->event_size - BINLOG_EVENT_HDR_LEN,
-                   pos + BINLOG_EVENT_HDR_LEN))
+    if ((n = blr_file_pread(router, file, &data[BINLOG_EVENT_HDR_LEN],
+                            hdr->event_size - BINLOG_EVENT_HDR_LEN, pos + BINLOG_EVENT_HDR_LEN))
         != hdr->event_size - BINLOG_EVENT_HDR_LEN)  // Read the balance
     {
         if (n == -1)
@@ -726,15 +1069,54 @@ blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HE
 
         gwbuf_free(result);
 
-        return NULL;
+        return false;
     }
 
     /* set OK indicator */
     hdr->ok = SLAVE_POS_READ_OK;
+    *event = result;
 
+    return true;
+}
+
+/**
+ * Read a replication event into a GWBUF structure. The event is read from
+ * the binlog cache if it is there.
+ *
+ * @param router    The router instance
+ * @param file      File record
+ * @param pos       Position of binlog record to read
+ * @param hdr       Binlog header to populate
+ * @param errmsg    Allocated BINLOG_ERROR_MSG_LEN bytes message error buffer
+ * @return          The binlog record wrapped in a GWBUF structure
+ */
+GWBUF *
+blr_read_binlog(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HEADER *hdr, char *errmsg)
+{
+    GWBUF *result = NULL;
+    blr_read_event(router, file, pos, hdr, errmsg, &result);
     return result;
 }
 
+/**
+ * Read and check the header of a replication event without reading the rest
+ * of the event. The event can then be sent to a slave straight from the file.
+ *
+ * @param router    The router instance
+ * @param file      File record
+ * @param pos       Position of binlog record to read
+ * @param hdr       Binlog header to populate
+ * @param errmsg    Allocated BINLOG_ERROR_MSG_LEN bytes message error buffer
+ * @return          True if the header was read, false if there was no event
+ *                  to read at the position, hdr->ok tells why
+ */
+bool
+blr_read_binlog_header(ROUTER_INSTANCE *router, BLFILE *file, unsigned long pos, REP_HEADER *hdr,
+                       char *errmsg)
+{
+    return blr_read_event(router, file, pos, hdr, errmsg, NULL);
+}
+
 /**
  * Close a binlog file that has been opened to read binlog records
  *
@@ -778,6 +1160,7 @@ blr_close_binlog(ROUTER_INSTANCE *router, BLFILE *file)
     {
         close(file->fd);
         file->fd = -1;
+        blr_zfile_close(file->z);
         free(file);
     }
 }
@@ -815,6 +1198,11 @@ blr_file_size(BLFILE *file)
 {
     struct stat statb;
 
+    if (file->z)
+    {
+        return file->z->header.size;
+    }
+
     if (fstat(file->fd, &statb) == 0)
     {
         return statb.st_size;
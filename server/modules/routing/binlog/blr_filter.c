@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file blr_filter.c - binlog router replication filters
+ *
+ * The replicate_do_db, replicate_ignore_db, replicate_do_table and
+ * replicate_ignore_table options remove the events that change other
+ * databases or tables from the events sent to the slaves. The transactions
+ * themselves are still sent, so a transaction that only changes filtered
+ * tables reaches the slaves as an empty transaction and the binlog positions
+ * of the slaves advance as usual.
+ *
+ * The table filters apply to row based events, the database filters to
+ * both row based events and to the default database of statements.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date     Who     Description
+ * 15/10/2016   Core Team           Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <service.h>
+#include <blr.h>
+
+#include <skygw_types.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+/** Length of the fixed part of a query event after the event header */
+#define QUERY_EVENT_POST_HDR_LEN 13
+
+/** Length of the table ID in table map and rows events */
+#define TABLE_ID_LEN 6
+
+/** The flag of a rows event that ends a statement */
+#define ROWS_STMT_END_F 0x0001
+
+/**
+ * Find the filter list of a router option
+ *
+ * @param router    The router instance
+ * @param option    The name of the router option
+ * @return          The filter list or NULL if the option is not a filter option
+ */
+BLFILTER_LIST *
+blr_filter_list(ROUTER_INSTANCE *router, const char *option)
+{
+    if (strcmp(option, "replicate_do_db") == 0)
+    {
+        return &router->do_db;
+    }
+    else if (strcmp(option, "replicate_ignore_db") == 0)
+    {
+        return &router->ignore_db;
+    }
+    else if (strcmp(option, "replicate_do_table") == 0)
+    {
+        return &router->do_table;
+    }
+    else if (strcmp(option, "replicate_ignore_table") == 0)
+    {
+        return &router->ignore_table;
+    }
+
+    return NULL;
+}
+
+/**
+ * Add a database or a table to a filter list
+ *
+ * @param list      The filter list
+ * @param name      The database or the table as db.table
+ * @return          False on memory allocation error
+ */
+bool
+blr_filter_add(BLFILTER_LIST *list, const char *name)
+{
+    char **names = realloc(list->names, (list->count + 1) * sizeof(char *));
+
+    if (names == NULL)
+    {
+        return false;
+    }
+
+    list->names = names;
+
+    if ((list->names[list->count] = strdup(name)) == NULL)
+    {
+        return false;
+    }
+
+    list->count++;
+    return true;
+}
+
+/**
+ * Check whether the router has replication filters
+ *
+ * @param router    The router instance
+ * @return          True if some of the events may be filtered
+ */
+bool
+blr_filter_enabled(ROUTER_INSTANCE *router)
+{
+    return router->do_db.count || router->ignore_db.count ||
+           router->do_table.count || router->ignore_table.count;
+}
+
+/**
+ * Free the replication filters of the router
+ *
+ * @param router    The router instance
+ */
+void
+blr_filter_free(ROUTER_INSTANCE *router)
+{
+    BLFILTER_LIST *lists[] = {&router->do_db, &router->ignore_db,
+                              &router->do_table, &router->ignore_table};
+
+    for (int i = 0; i < sizeof(lists) / sizeof(lists[0]); i++)
+    {
+        for (int j = 0; j < lists[i]->count; j++)
+        {
+            free(lists[i]->names[j]);
+        }
+
+        free(lists[i]->names);
+        lists[i]->names = NULL;
+        lists[i]->count = 0;
+    }
+}
+
+/**
+ * Check whether a name is in a filter list
+ *
+ * @param list      The filter list
+ * @param name      The name, not null terminated
+ * @param len       The length of the name
+ * @return          True if the name is in the list
+ */
+static bool
+blr_filter_match(BLFILTER_LIST *list, const char *name, int len)
+{
+    for (int i = 0; i < list->count; i++)
+    {
+        if (strncmp(list->names[i], name, len) == 0 && list->names[i][len] == '\0')
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Check whether the changes of a database are filtered
+ *
+ * @param router    The router instance
+ * @param db        The database, not null terminated
+ * @param len       The length of the database name
+ * @return          True if the changes are not sent to the slaves
+ */
+static bool
+blr_filter_db(ROUTER_INSTANCE *router, const char *db, int len)
+{
+    if (router->do_db.count)
+    {
+        return !blr_filter_match(&router->do_db, db, len);
+    }
+
+    return blr_filter_match(&router->ignore_db, db, len);
+}
+
+/**
+ * Check whether the changes of a table are filtered
+ *
+ * @param router    The router instance
+ * @param db        The database of the table, not null terminated
+ * @param db_len    The length of the database name
+ * @param table     The table, not null terminated
+ * @param table_len The length of the table name
+ * @return          True if the changes are not sent to the slaves
+ */
+static bool
+blr_filter_table(ROUTER_INSTANCE *router, const char *db, int db_len,
+                 const char *table, int table_len)
+{
+    char name[db_len + table_len + 2];
+
+    if (blr_filter_db(router, db, db_len))
+    {
+        return true;
+    }
+
+    memcpy(name, db, db_len);
+    name[db_len] = '.';
+    memcpy(name + db_len + 1, table, table_len);
+    name[db_len + table_len + 1] = '\0';
+
+    if (router->do_table.count)
+    {
+        return !blr_filter_match(&router->do_table, name, db_len + table_len + 1);
+    }
+
+    return blr_filter_match(&router->ignore_table, name, db_len + table_len + 1);
+}
+
+/**
+ * Check whether a query event is a transaction boundary. These are sent
+ * whatever their default database is, so that the transaction stays whole.
+ *
+ * @param query     The statement, not null terminated
+ * @param len       The length of the statement
+ * @return          True if the statement starts or ends a transaction
+ */
+static bool
+blr_filter_trx_statement(const char *query, int len)
+{
+    static const char *statements[] = {"BEGIN", "COMMIT", "ROLLBACK", "XA", "SAVEPOINT", NULL};
+
+    for (int i = 0; statements[i]; i++)
+    {
+        int n = strlen(statements[i]);
+
+        if (len >= n && strncasecmp(query, statements[i], n) == 0 &&
+            (len == n || query[n] == ' ' || query[n] == '\0'))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Remember a table ID of the current statement whose rows events are filtered
+ *
+ * @param slave     The slave
+ * @param table_id  The table ID
+ */
+static void
+blr_filter_add_table_id(ROUTER_SLAVE *slave, uint64_t table_id)
+{
+    if (slave->n_filtered_tables == slave->filtered_tables_size)
+    {
+        int size = slave->filtered_tables_size ? slave->filtered_tables_size * 2 : 8;
+        uint64_t *ids = realloc(slave->filtered_tables, size * sizeof(uint64_t));
+
+        if (ids == NULL)
+        {
+            MXS_ERROR("Failed to allocate memory for the filtered tables of a slave.");
+            return;
+        }
+
+        slave->filtered_tables = ids;
+        slave->filtered_tables_size = size;
+    }
+
+    slave->filtered_tables[slave->n_filtered_tables++] = table_id;
+}
+
+/**
+ * Check whether a table ID of the current statement is filtered
+ *
+ * @param slave     The slave
+ * @param table_id  The table ID
+ * @return          True if the rows events of the table are filtered
+ */
+static bool
+blr_filter_table_id(ROUTER_SLAVE *slave, uint64_t table_id)
+{
+    for (int i = 0; i < slave->n_filtered_tables; i++)
+    {
+        if (slave->filtered_tables[i] == table_id)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Check whether an event is removed from the events sent to a slave by the
+ * replication filters. The table map events of the filtered tables are
+ * remembered by the slave until the end of the statement so that the rows
+ * events of the tables are filtered as well.
+ *
+ * @param router    The router instance
+ * @param slave     The slave the event is sent to
+ * @param hdr       The header of the event
+ * @param event     The event, starting from the event header
+ * @return          True if the event is not sent to the slave
+ */
+bool
+blr_event_filtered(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, REP_HEADER *hdr, uint8_t *event)
+{
+    uint8_t *ptr = event + BINLOG_EVENT_HDR_LEN;
+    uint8_t *end = event + hdr->event_size;
+    bool rval = false;
+
+    switch (hdr->event_type)
+    {
+    case TABLE_MAP_EVENT:
+        if (ptr + TABLE_ID_LEN + 2 + 1 < end)
+        {
+            uint64_t table_id = extract_field(ptr, 32) + ((uint64_t)extract_field(ptr + 4, 16) << 32);
+            uint8_t *db = ptr + TABLE_ID_LEN + 2 + 1;
+            int db_len = db[-1];
+            uint8_t *table = db + db_len + 2;
+
+            if (table + table[-1] <= end &&
+                blr_filter_table(router, (char *)db, db_len, (char *)table, table[-1]))
+            {
+                blr_filter_add_table_id(slave, table_id);
+                rval = true;
+            }
+        }
+        break;
+
+    case WRITE_ROWS_EVENTv0:
+    case UPDATE_ROWS_EVENTv0:
+    case DELETE_ROWS_EVENTv0:
+    case WRITE_ROWS_EVENTv1:
+    case UPDATE_ROWS_EVENTv1:
+    case DELETE_ROWS_EVENTv1:
+    case WRITE_ROWS_EVENTv2:
+    case UPDATE_ROWS_EVENTv2:
+    case DELETE_ROWS_EVENTv2:
+        if (ptr + TABLE_ID_LEN + 2 <= end)
+        {
+            uint64_t table_id = extract_field(ptr, 32) + ((uint64_t)extract_field(ptr + 4, 16) << 32);
+            rval = blr_filter_table_id(slave, table_id);
+
+            /** The table IDs are only valid until the end of the statement */
+            if (extract_field(ptr + TABLE_ID_LEN, 16) & ROWS_STMT_END_F)
+            {
+                slave->n_filtered_tables = 0;
+            }
+        }
+        break;
+
+    case QUERY_EVENT:
+        slave->n_filtered_tables = 0;
+
+        if (ptr + QUERY_EVENT_POST_HDR_LEN <= end)
+        {
+            int db_len = ptr[8];
+            uint8_t *db = ptr + QUERY_EVENT_POST_HDR_LEN + extract_field(ptr + 11, 16);
+            uint8_t *query = db + db_len + 1;
+
+            if (query <= end &&
+                !blr_filter_trx_statement((char *)query, end - query) &&
+                blr_filter_db(router, (char *)db, db_len))
+            {
+                rval = true;
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    if (rval)
+    {
+        slave->stats.n_filtered++;
+    }
+
+    return rval;
+}
@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file blr_gtid.c - binlog router GTID index, map MariaDB 10 GTIDs to binlog positions
+ *
+ * The position of each MariaDB 10 GTID event received from the master is
+ * appended to an index file in the binlog directory. The index is read into
+ * memory when the router starts and kept per replication domain in the
+ * order of the sequence numbers, so that the position of a GTID is found
+ * with a binary search instead of by reading the binlog files.
+ *
+ * @verbatim
+ * Revision History
+ *
+ * Date     Who     Description
+ * 15/10/2016   Core Team           Initial implementation
+ *
+ * @endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <service.h>
+#include <spinlock.h>
+#include <blr.h>
+
+#include <skygw_types.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+/** Number of entries read from the index file at a time */
+#define BLGTID_READ_CHUNK 256
+
+/**
+ * The sequence number of a binlog file, the numeric suffix of its name
+ *
+ * @param binlog    The name of the binlog file
+ * @return The sequence number
+ */
+static uint32_t
+blr_gtid_file_seqno(const char *binlog)
+{
+    const char *sptr = strrchr(binlog, '.');
+
+    return sptr ? strtoul(sptr + 1, NULL, 10) : 0;
+}
+
+/**
+ * Find the index of the first entry of a domain with a sequence number that
+ * is not smaller than, or with after set larger than, the given one
+ *
+ * @param dom       The domain
+ * @param seq       The sequence number
+ * @param after     Whether the sequence number itself is skipped
+ * @return          The index of the entry, dom->cnt if there is none
+ */
+static int
+blr_gtid_search(BLGTID_DOMAIN *dom, uint64_t seq, bool after)
+{
+    int low = 0;
+    int high = dom->cnt;
+
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+
+        if (dom->records[mid].seq < seq || (after && dom->records[mid].seq == seq))
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * Find a replication domain of the index
+ *
+ * @param index     The GTID index
+ * @param domain    The domain ID
+ * @return          The domain or NULL if it has no entries
+ */
+static BLGTID_DOMAIN *
+blr_gtid_domain(BLGTID_INDEX *index, uint32_t domain)
+{
+    for (int i = 0; i < index->n_domains; i++)
+    {
+        if (index->domains[i].domain == domain)
+        {
+            return &index->domains[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Add an entry to the in-memory index. A sequence number that is not larger
+ * than the latest one of the domain, which happens when the master is changed
+ * or its binlogs are reset, replaces the entries of the domain from it on.
+ *
+ * @param index     The GTID index
+ * @param rec       The entry
+ * @return          True if the entry was added, false on memory allocation error
+ */
+static bool
+blr_gtid_insert(BLGTID_INDEX *index, BLGTID_RECORD *rec)
+{
+    BLGTID_DOMAIN *dom = blr_gtid_domain(index, rec->domain);
+
+    if (dom == NULL)
+    {
+        BLGTID_DOMAIN *domains = realloc(index->domains, (index->n_domains + 1) * sizeof(BLGTID_DOMAIN));
+
+        if (domains == NULL)
+        {
+            return false;
+        }
+
+        index->domains = domains;
+        dom = &index->domains[index->n_domains++];
+        memset(dom, 0, sizeof(*dom));
+        dom->domain = rec->domain;
+    }
+
+    if (dom->cnt > 0 && rec->seq <= dom->records[dom->cnt - 1].seq)
+    {
+        dom->cnt = blr_gtid_search(dom, rec->seq, false);
+    }
+
+    if (dom->cnt == dom->size)
+    {
+        int size = dom->size ? dom->size * 2 : BLGTID_READ_CHUNK;
+        BLGTID_RECORD *records = realloc(dom->records, size * sizeof(BLGTID_RECORD));
+
+        if (records == NULL)
+        {
+            return false;
+        }
+
+        dom->records = records;
+        dom->size = size;
+    }
+
+    dom->records[dom->cnt++] = *rec;
+    return true;
+}
+
+/**
+ * Open the GTID index of the router and read it into memory, if the
+ * gtid_index option is set. The index file is created if it does not exist.
+ *
+ * @param router    The router instance
+ */
+void
+blr_gtid_index_open(ROUTER_INSTANCE *router)
+{
+    char path[PATH_MAX + 1];
+    char err_msg[STRERROR_BUFLEN];
+    BLGTID_RECORD records[BLGTID_READ_CHUNK];
+    BLGTID_INDEX *index;
+    struct stat statb;
+    ssize_t n;
+    int fd;
+
+    if (!router->gtid_indexing)
+    {
+        return;
+    }
+
+    snprintf(path, PATH_MAX, "%s/%s", router->binlogdir, BLGTID_INDEX_FILE);
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666)) == -1)
+    {
+        MXS_ERROR("%s: Failed to open the GTID index %s, %s.",
+                  router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
+        return;
+    }
+
+    if ((index = calloc(1, sizeof(BLGTID_INDEX))) == NULL)
+    {
+        MXS_ERROR("%s: Failed to allocate memory for the GTID index.", router->service->name);
+        close(fd);
+        return;
+    }
+
+    index->fd = fd;
+    spinlock_init(&index->lock);
+
+    /** An entry that was being written when MaxScale stopped is removed */
+    if (fstat(fd, &statb) == 0 && statb.st_size % sizeof(BLGTID_RECORD))
+    {
+        MXS_WARNING("%s: Removing a partial entry at the end of the GTID index %s.",
+                    router->service->name, path);
+
+        if (ftruncate(fd, statb.st_size - statb.st_size % sizeof(BLGTID_RECORD)))
+        {
+            MXS_ERROR("%s: Failed to truncate the GTID index %s, %s.",
+                      router->service->name, path, strerror_r(errno, err_msg, sizeof(err_msg)));
+        }
+    }
+
+    while ((n = read(fd, records, sizeof(records))) > 0)
+    {
+        for (int i = 0; i < n / (ssize_t)sizeof(BLGTID_RECORD); i++)
+        {
+            if (!blr_gtid_insert(index, &records[i]))
+            {
+                MXS_ERROR("%s: Failed to allocate memory for the GTID index.",
+                          router->service->name);
+                router->gtid_index = index;
+                blr_gtid_index_close(router);
+                return;
+            }
+        }
+    }
+
+    router->gtid_index = index;
+}
+
+/**
+ * Close the GTID index of the router and free its memory
+ *
+ * @param router    The router instance
+ */
+void
+blr_gtid_index_close(ROUTER_INSTANCE *router)
+{
+    BLGTID_INDEX *index = router->gtid_index;
+
+    if (index)
+    {
+        for (int i = 0; i < index->n_domains; i++)
+        {
+            free(index->domains[i].records);
+        }
+
+        free(index->domains);
+        close(index->fd);
+        free(index);
+        router->gtid_index = NULL;
+    }
+}
+
+/**
+ * Add the position of a GTID event to the index
+ *
+ * @param router    The router instance
+ * @param domain    The replication domain of the GTID
+ * @param server_id The server ID of the GTID
+ * @param seq       The sequence number of the GTID
+ * @param binlog    The binlog file the GTID event is in
+ * @param pos       The position of the GTID event in the file
+ */
+void
+blr_gtid_index_add(ROUTER_INSTANCE *router, uint32_t domain, uint32_t server_id,
+                   uint64_t seq, const char *binlog, uint32_t pos)
+{
+    BLGTID_INDEX *index = router->gtid_index;
+    BLGTID_RECORD rec;
+    bool added;
+
+    if (index == NULL)
+    {
+        return;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.domain = domain;
+    rec.server_id = server_id;
+    rec.seq = seq;
+    rec.file = blr_gtid_file_seqno(binlog);
+    rec.pos = pos;
+
+    spinlock_acquire(&index->lock);
+    added = blr_gtid_insert(index, &rec);
+    spinlock_release(&index->lock);
+
+    if (!added)
+    {
+        MXS_ERROR("%s: Failed to allocate memory for the GTID index.", router->service->name);
+    }
+
+    if (write(index->fd, &rec, sizeof(rec)) != sizeof(rec))
+    {
+        char err_msg[STRERROR_BUFLEN];
+        struct stat statb;
+
+        MXS_ERROR("%s: Failed to write GTID %u-%u-%lu to the GTID index, %s.",
+                  router->service->name, domain, server_id, seq,
+                  strerror_r(errno, err_msg, sizeof(err_msg)));
+
+        /** Keep the entries of the file aligned for the next entries */
+        if (fstat(index->fd, &statb) == 0 && statb.st_size % sizeof(BLGTID_RECORD) &&
+            ftruncate(index->fd, statb.st_size - statb.st_size % sizeof(BLGTID_RECORD)))
+        {
+            MXS_ERROR("%s: Failed to truncate the GTID index, %s.",
+                      router->service->name, strerror_r(errno, err_msg, sizeof(err_msg)));
+        }
+    }
+}
+
+/**
+ * Find a GTID in the index
+ *
+ * @param router    The router instance
+ * @param domain    The replication domain of the GTID
+ * @param seq       The sequence number of the GTID
+ * @param after     Find the first GTID of the domain after the given one
+ *                  instead of the GTID itself
+ * @param rec       The entry that was found is copied here
+ * @return          True if an entry was found
+ */
+bool
+blr_gtid_index_find(ROUTER_INSTANCE *router, uint32_t domain, uint64_t seq, bool after,
+                    BLGTID_RECORD *rec)
+{
+    BLGTID_INDEX *index = router->gtid_index;
+    BLGTID_DOMAIN *dom;
+    bool rval = false;
+
+    if (index == NULL)
+    {
+        return false;
+    }
+
+    spinlock_acquire(&index->lock);
+
+    if ((dom = blr_gtid_domain(index, domain)) != NULL)
+    {
+        int i = blr_gtid_search(dom, seq, after);
+
+        if (i < dom->cnt && (after || dom->records[i].seq == seq))
+        {
+            *rec = dom->records[i];
+            rval = true;
+        }
+    }
+
+    spinlock_release(&index->lock);
+
+    return rval;
+}
+
+/**
+ * Parse a GTID of the form domain-server_id-sequence
+ *
+ * @param str       The GTID
+ * @param domain    The replication domain is stored here
+ * @param server_id The server ID is stored here
+ * @param seq       The sequence number is stored here
+ * @return          True if the GTID was valid
+ */
+bool
+blr_gtid_parse(const char *str, uint32_t *domain, uint32_t *server_id, uint64_t *seq)
+{
+    char *end;
+
+    *domain = strtoul(str, &end, 10);
+
+    if (end == str || *end != '-')
+    {
+        return false;
+    }
+
+    str = end + 1;
+    *server_id = strtoul(str, &end, 10);
+
+    if (end == str || *end != '-')
+    {
+        return false;
+    }
+
+    str = end + 1;
+    *seq = strtoull(str, &end, 10);
+
+    return end != str && *end == '\0';
+}
+
+/**
+ * Find the binlog position a slave that connects with GTIDs starts from.
+ * This is the earliest of the GTID events that follow the GTIDs of the slave
+ * in their domains. A slave that already has the latest GTIDs of all its
+ * domains starts from the latest safe position of the current binlog file.
+ *
+ * @param router    The router instance
+ * @param state     The GTIDs of the slave, separated by commas
+ * @param binlog    The binlog file is stored here, BINLOG_FNAMELEN + 1 bytes
+ * @param pos       The position is stored here
+ * @return          True if the position was found, false if a GTID is not
+ *                  in the index
+ */
+bool
+blr_gtid_start_position(ROUTER_INSTANCE *router, const char *state, char *binlog, uint32_t *pos)
+{
+    char *copy = strdup(state);
+    char *brkb;
+    BLGTID_RECORD start;
+    bool found = false;
+    bool known = copy != NULL;
+    int n_gtids = 0;
+
+    for (char *gtid = copy ? strtok_r(copy, ", \t", &brkb) : NULL; gtid && known;
+         gtid = strtok_r(NULL, ", \t", &brkb))
+    {
+        BLGTID_RECORD rec;
+        uint32_t domain, server_id;
+        uint64_t seq;
+
+        n_gtids++;
+
+        if (!blr_gtid_parse(gtid, &domain, &server_id, &seq) ||
+            !blr_gtid_index_find(router, domain, seq, false, &rec) ||
+            rec.server_id != server_id)
+        {
+            known = false;
+        }
+        else if (blr_gtid_index_find(router, domain, seq, true, &rec) &&
+                 (!found || rec.file < start.file || (rec.file == start.file && rec.pos < start.pos)))
+        {
+            start = rec;
+            found = true;
+        }
+    }
+
+    free(copy);
+
+    if (!known || n_gtids == 0)
+    {
+        return false;
+    }
+
+    if (found)
+    {
+        snprintf(binlog, BINLOG_FNAMELEN + 1, BINLOG_NAMEFMT, router->fileroot, start.file);
+        *pos = start.pos;
+    }
+    else
+    {
+        spinlock_acquire(&router->binlog_lock);
+        strcpy(binlog, router->binlog_name);
+        *pos = router->binlog_position;
+        spinlock_release(&router->binlog_lock);
+    }
+
+    return true;
+}
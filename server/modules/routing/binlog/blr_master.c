@@ -47,6 +47,14 @@
  * 25/09/2015   Massimiliano Pinto  Addition of lastEventReceived for slaves
  * 23/10/2015   Markus Makela       Added current_safe_event
  * 26/04/2016   Massimiliano Pinto  Added MariaDB 10.0 and 10.1 GTID event flags detection
+ * 15/10/2016   Core Team           The payload of a distributed event is built once and
+ *                                  shared by the slaves
+ * 15/10/2016   Core Team           Added blr_send_event_file
+ * 15/10/2016   Core Team           The binlog file is flushed as the binlog_flush option tells
+ * 15/10/2016   Core Team           The positions of GTID events are added to the GTID index
+ * 15/10/2016   Core Team           Events removed by the replication filters are not sent
+ * 15/10/2016   Core Team           Static probes around the distribution of the events
+ * 15/10/2016   Core Team           Notify the listeners of the distributed events
  *
  * @endverbatim
  */
@@ -72,6 +80,7 @@
 #include <log_manager.h>
 
 #include <rdtsc.h>
+#include <probes.h>
 #include <thread.h>
 
 /* Temporary requirement for auth data */
@@ -102,6 +111,8 @@ static void blr_distribute_error_message(ROUTER_INSTANCE *router, char *message,
 
 int blr_write_data_into_binlog(ROUTER_INSTANCE *router, uint32_t data_len, uint8_t *buf);
 void extract_checksum(ROUTER_INSTANCE* router, uint8_t *cksumptr, uint8_t len);
+static bool blr_stream_packet_start(ROUTER_INSTANCE *router, GWBUF **pkt, unsigned int *pkt_length);
+static bool blr_stream_packet(ROUTER_INSTANCE *router, GWBUF **pkt, unsigned int *pkt_length);
 static void blr_terminate_master_replication(ROUTER_INSTANCE *router, uint8_t* ptr, int len);
 
 static int keepalive = 1;
@@ -304,6 +315,7 @@ blr_master_close(ROUTER_INSTANCE *router)
     dcb_close(router->master);
     router->master_state = BLRM_UNCONNECTED;
     router->master_event_state = BLR_EVENT_DONE;
+    router->master_packet_remaining = 0;
 }
 
 /**
@@ -882,8 +894,26 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
      * and the packet length is enough to hold a replication event
      * header.
      */
-    while (pkt && pkt_length > 24)
+    while (pkt && (pkt_length > 24 || router->master_packet_remaining > 0))
     {
+        /** Write what has arrived of a packet of a large event */
+        if (router->master_packet_remaining > 0)
+        {
+            if (!blr_stream_packet(router, &pkt, &pkt_length))
+            {
+                /** Failed to write to the binlog file, destroy the buffer
+                 * chain and close the connection with the master */
+                while (pkt)
+                {
+                    pkt = GWBUF_CONSUME_ALL(pkt);
+                }
+                blr_master_close(router);
+                blr_master_delayed_connect(router);
+                return;
+            }
+            continue;
+        }
+
         reslen = GWBUF_LENGTH(pkt);
         pdata = GWBUF_DATA(pkt);
         if (reslen < 3) // Payload length straddles buffers
@@ -911,7 +941,17 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
         }
         /* len is now the payload length for the packet we are working on */
 
-        if (reslen < len && pkt_length >= len)
+        if (reslen < len && len - MYSQL_HEADER_LEN == MYSQL_PACKET_LENGTH_MAX &&
+            blr_stream_packet_start(router, &pkt, &pkt_length))
+        {
+            /*
+             * A full packet of a large event that is not in one buffer is
+             * written as its data arrives instead of being gathered and
+             * copied into a contiguous buffer first.
+             */
+            continue;
+        }
+        else if (reslen < len && pkt_length >= len)
         {
             /*
              * The message is contained in more than the current
@@ -1469,6 +1509,18 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                             }
                         }
 
+                        /** Add the position of the GTID to the GTID index */
+                        if (hdr.event_type == MARIADB10_GTID_EVENT && router->gtid_index &&
+                            router->master_event_state == BLR_EVENT_DONE)
+                        {
+                            blr_gtid_index_add(router,
+                                               extract_field(ptr + BINLOG_EVENT_HDR_LEN + 8, 32),
+                                               hdr.serverid,
+                                               gw_mysql_get_byte8(ptr + BINLOG_EVENT_HDR_LEN),
+                                               router->binlog_name,
+                                               router->last_event_pos);
+                        }
+
                         /**
                          * Distributing binlog events to slaves
                          * may depend on pending transaction
@@ -1670,6 +1722,19 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
                 {
                     router->master_event_state = BLR_EVENT_DONE;
                 }
+
+                if (router->master_event_state == BLR_EVENT_DONE && !blr_file_event_flush(router))
+                {
+                    /** Failed to write to the binlog file, destroy the buffer
+                     * chain and close the connection with the master */
+                    while ((pkt = gwbuf_consume(pkt, GWBUF_LENGTH(pkt))) != NULL)
+                    {
+                        ;
+                    }
+                    blr_master_close(router);
+                    blr_master_delayed_connect(router);
+                    return;
+                }
             }
             else
             {
@@ -1709,7 +1774,117 @@ blr_handle_binlog_record(ROUTER_INSTANCE *router, GWBUF *pkt)
     {
         ss_dassert(pkt_length == 0);
     }
-    blr_file_flush(router);
+
+    if (!blr_file_flush(router))
+    {
+        /** Failed to write to the binlog file, close the connection with the master */
+        blr_master_close(router);
+        blr_master_delayed_connect(router);
+    }
+}
+
+/**
+ * Start writing a packet of a large event as its data arrives
+ *
+ * A packet with a payload of MYSQL_PACKET_LENGTH_MAX bytes is never the last
+ * packet of an event, so nothing but the binlog file and the checksum needs
+ * its data: the event is distributed to the slaves from the binlog file
+ * once its last packet has been received. Only the replication header of
+ * the first packet of an event is looked at.
+ *
+ * @param router        The router instance
+ * @param pkt           The buffer chain starting with the packet, the packet
+ *                      header is consumed from it
+ * @param pkt_length    Length of the buffer chain, updated
+ * @return True if the packet is streamed, false if it must be processed whole
+ */
+static bool
+blr_stream_packet_start(ROUTER_INSTANCE *router, GWBUF **pkt, unsigned int *pkt_length)
+{
+    unsigned int offset = MYSQL_HEADER_LEN;
+
+    if (router->master_event_state == BLR_EVENT_DONE)
+    {
+        uint8_t header[MYSQL_HEADER_LEN + 1 + BINLOG_EVENT_HDR_LEN];
+        REP_HEADER hdr;
+
+        gwbuf_copy_data(*pkt, 0, sizeof(header), header);
+        blr_extract_header(header, &hdr);
+
+        if (hdr.ok != 0 || (hdr.event_size + 1) < MYSQL_PACKET_LENGTH_MAX)
+        {
+            /** Not the start of a large event, let the checks report it */
+            return false;
+        }
+
+        spinlock_acquire(&router->lock);
+        router->stats.n_binlogs++;
+        router->stats.n_binlogs_ses++;
+        router->m_errno = 0;
+        free(router->m_errmsg);
+        router->m_errmsg = NULL;
+        spinlock_release(&router->lock);
+
+        /** Store the header for later use */
+        memcpy(&router->stored_header, &hdr, sizeof(hdr));
+
+        /** Prepare the checksum variables for this event */
+        router->stored_checksum = crc32(0L, NULL, 0);
+        router->checksum_size = hdr.event_size - MYSQL_CHECKSUM_LEN;
+        router->partial_checksum_bytes = 0;
+
+        /** Don't write the OK byte into the binlog */
+        offset++;
+    }
+
+    router->master_event_state = BLR_EVENT_ONGOING;
+    router->master_packet_remaining = MYSQL_PACKET_LENGTH_MAX + MYSQL_HEADER_LEN - offset;
+    router->stats.n_streamed++;
+    *pkt = gwbuf_consume(*pkt, offset);
+    *pkt_length -= offset;
+
+    return true;
+}
+
+/**
+ * Write the data of a packet of a large event that has arrived so far
+ *
+ * @param router        The router instance
+ * @param pkt           The buffer chain, the written data is consumed from it
+ * @param pkt_length    Length of the buffer chain, updated
+ * @return True on success, false if writing to the binlog file failed
+ */
+static bool
+blr_stream_packet(ROUTER_INSTANCE *router, GWBUF **pkt, unsigned int *pkt_length)
+{
+    while (*pkt && router->master_packet_remaining > 0)
+    {
+        uint8_t *data = GWBUF_DATA(*pkt);
+        uint32_t n = MIN(GWBUF_LENGTH(*pkt), router->master_packet_remaining);
+
+        if (router->master_chksum)
+        {
+            uint32_t size = MIN(n, router->checksum_size);
+            router->stored_checksum = crc32(router->stored_checksum, data, size);
+            router->checksum_size -= size;
+
+            if (router->checksum_size == 0 && size < n)
+            {
+                extract_checksum(router, data + size, n - size);
+            }
+        }
+
+        if (blr_write_data_into_binlog(router, n, data) == 0)
+        {
+            return false;
+        }
+
+        *pkt = gwbuf_consume(*pkt, n);
+        *pkt_length -= n;
+        router->master_packet_remaining -= n;
+    }
+
+    return true;
 }
 
 /**
@@ -1842,7 +2017,9 @@ blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *
     ROUTER_SLAVE *slave;
     int action;
     unsigned int cstate;
+    GWBUF *shared = NULL; /*< The event packet payload shared by the slaves */
 
+    MXS_PROBE3(binlog__distribute__start, hdr->event_type, hdr->event_size, hdr->next_pos);
     spinlock_acquire(&router->lock);
     slave = router->slaves;
     while (slave)
@@ -1992,7 +2169,7 @@ blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *
                     blr_slave_rotate(router, slave, ptr);
                 }
 
-                if (blr_send_event(role, binlog_name, binlog_pos, slave, hdr, ptr))
+                if (blr_send_event(role, binlog_name, binlog_pos, slave, hdr, ptr, &shared))
                 {
                     spinlock_acquire(&slave->catch_lock);
                     if (hdr->event_type != ROTATE_EVENT)
@@ -2039,6 +2216,7 @@ blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *
                 spinlock_release(&slave->catch_lock);
                 if ((cstate & CS_UPTODATE) == CS_UPTODATE)
                 {
+                    slave->stats.catchup_start = hkheartbeat;
 #ifdef STATE_CHANGE_LOGGING_ENABLED
                     MXS_NOTICE("%s: Slave %s:%d, server-id %d transition from "
                                "up-to-date to catch-up in blr_distribute_binlog_record, "
@@ -2076,6 +2254,15 @@ blr_distribute_binlog_record(ROUTER_INSTANCE *router, REP_HEADER *hdr, uint8_t *
         slave = slave->next;
     }
     spinlock_release(&router->lock);
+
+    gwbuf_free(shared);
+
+    for (BLR_LISTENER *listener = router->listeners; listener; listener = listener->next)
+    {
+        listener->notify(listener->data);
+    }
+
+    MXS_PROBE3(binlog__distribute__end, hdr->event_type, hdr->event_size, hdr->next_pos);
 }
 
 /**
@@ -2241,7 +2428,7 @@ GWBUF
     }
 
     /* Read the event header information from the file */
-    if ((n = pread(router->binlog_fd, hdbuf, 19, pos)) != 19)
+    if ((n = blr_file_read(router, router->binlog_fd, router->binlog_name, hdbuf, 19, pos)) != 19)
     {
         switch (n)
         {
@@ -2306,7 +2493,8 @@ GWBUF
     memcpy(data, hdbuf, 19);
 
     /* Read event data and put int into buffer after header */
-    if ((n = pread(router->binlog_fd, &data[19], hdr->event_size - 19, pos + 19)) != hdr->event_size - 19)
+    if ((n = blr_file_read(router, router->binlog_fd, router->binlog_name, &data[19],
+                           hdr->event_size - 19, pos + 19)) != hdr->event_size - 19)
     {
         if (n == -1)
         {
@@ -2589,24 +2777,8 @@ blr_write_data_into_binlog(ROUTER_INSTANCE *router, uint32_t data_len, uint8_t *
 {
     int n;
 
-    if ((n = pwrite(router->binlog_fd, buf, data_len,
-                    router->last_written)) != data_len)
+    if ((n = blr_file_write(router, buf, data_len)) == 0)
     {
-        char err_msg[STRERROR_BUFLEN];
-        MXS_ERROR("%s: Failed to write binlog record at %lu of %s, %s. "
-                  "Truncating to previous record.",
-                  router->service->name, router->last_written,
-                  router->binlog_name,
-                  strerror_r(errno, err_msg, sizeof(err_msg)));
-
-        /* Remove any partial event that was written */
-        if (ftruncate(router->binlog_fd, router->last_written))
-        {
-            MXS_ERROR("%s: Failed to truncate binlog record at %lu of %s, %s. ",
-                      router->service->name, router->last_written,
-                      router->binlog_name,
-                      strerror_r(errno, err_msg, sizeof(err_msg)));
-        }
         return 0;
     }
     router->last_written += data_len;
@@ -2663,28 +2835,62 @@ bool blr_send_packet(ROUTER_SLAVE *slave, uint8_t *buf, uint32_t len, bool first
 }
 
 /**
- * Send a single replication event to a slave
+ * Send a replication event that fits into a single packet to a slave
  *
- * This sends the complete replication event to a slave. If the event size exceeds
- * the maximum size of a MySQL packet, it will be sent in multiple packets.
+ * The payload of the packet, the OK byte and the event, is copied once into
+ * @c shared and the slaves are sent clones of it. Only the packet header,
+ * which contains the sequence number of the slave, is built for each slave.
+ *
+ * @param slave Slave where the packet is sent to
+ * @param buf The replication event
+ * @param len Length of the event
+ * @param shared The shared payload, built by the first call
+ * @return True on success, false when memory allocation fails
+ */
+static bool blr_send_shared_packet(ROUTER_SLAVE *slave, uint8_t *buf, uint32_t len,
+                                   GWBUF **shared)
+{
+    GWBUF *header = NULL;
+    GWBUF *payload = NULL;
+
+    if (*shared == NULL && (*shared = gwbuf_alloc(len + 1)) != NULL)
+    {
+        uint8_t *data = GWBUF_DATA(*shared);
+        *data++ = 0; // OK byte
+        memcpy(data, buf, len);
+    }
+
+    if (*shared && (header = gwbuf_alloc(MYSQL_HEADER_LEN)) != NULL &&
+        (payload = gwbuf_clone(*shared)) != NULL)
+    {
+        uint8_t *data = GWBUF_DATA(header);
+        encode_value(data, len + 1, 24);
+        data[3] = slave->seqno++;
+
+        slave->stats.n_bytes += MYSQL_HEADER_LEN + len + 1;
+        slave->dcb->func.write(slave->dcb, gwbuf_append(header, payload));
+        return true;
+    }
+
+    gwbuf_free(header);
+    MXS_ERROR("failed to allocate memory when writing an event of %u bytes.", len);
+    return false;
+}
+
+/**
+ * Check whether an event is the one that was last sent to a slave
  *
  * @param role  What is the role of the caller, slave or master.
  * @param binlog_name The name of the binlogfile.
  * @param binlog_pos The position in the binlogfile.
- * @param slave Slave where the event is sent to
- * @param hdr   Replication header
- * @param buf   Pointer to the replication event as it was read from the disk
- * @return True on success, false if memory allocation failed
+ * @param slave The slave
+ * @return True if the event has already been sent, an error is logged
  */
-bool blr_send_event(blr_thread_role_t role,
-                    const char* binlog_name,
-                    uint32_t binlog_pos,
-                    ROUTER_SLAVE *slave,
-                    REP_HEADER *hdr,
-                    uint8_t *buf)
+static bool blr_event_already_sent(blr_thread_role_t role,
+                               const char* binlog_name,
+                               uint32_t binlog_pos,
+                               ROUTER_SLAVE *slave)
 {
-    bool rval = true;
-
     if ((strcmp(slave->lsi_binlog_name, binlog_name) == 0) &&
         (slave->lsi_binlog_pos == binlog_pos))
     {
@@ -2703,13 +2909,76 @@ bool blr_send_event(blr_thread_role_t role,
                   ROLETOSTR(slave->lsi_sender_role),
                   gwbuf_length(slave->dcb->writeq), slave->dcb,
                   slave->router->stats.n_binlogs);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Record the event last sent to a slave
+ *
+ * @param role  What is the role of the caller, slave or master.
+ * @param binlog_name The name of the binlogfile.
+ * @param binlog_pos The position in the binlogfile.
+ * @param slave The slave
+ */
+static void blr_event_sent(blr_thread_role_t role,
+                           const char* binlog_name,
+                           uint32_t binlog_pos,
+                           ROUTER_SLAVE *slave)
+{
+    strcpy(slave->lsi_binlog_name, binlog_name);
+    slave->lsi_binlog_pos = binlog_pos;
+    slave->lsi_sender_role = role;
+    slave->lsi_sender_tid = thread_self();
+}
+
+/**
+ * Send a single replication event to a slave
+ *
+ * This sends the complete replication event to a slave. If the event size exceeds
+ * the maximum size of a MySQL packet, it will be sent in multiple packets.
+ *
+ * @param role  What is the role of the caller, slave or master.
+ * @param binlog_name The name of the binlogfile.
+ * @param binlog_pos The position in the binlogfile.
+ * @param slave Slave where the event is sent to
+ * @param hdr   Replication header
+ * @param buf   Pointer to the replication event as it was read from the disk
+ * @param shared The packet payload shared by the slaves the same event is sent
+ *               to, see blr_send_shared_packet, or NULL to copy the event for
+ *               this slave only. The caller frees it.
+ * @return True on success or if the replication filters removed the event,
+ *         false if memory allocation failed
+ */
+bool blr_send_event(blr_thread_role_t role,
+                    const char* binlog_name,
+                    uint32_t binlog_pos,
+                    ROUTER_SLAVE *slave,
+                    REP_HEADER *hdr,
+                    uint8_t *buf,
+                    GWBUF **shared)
+{
+    bool rval = true;
+
+    if (blr_event_already_sent(role, binlog_name, binlog_pos, slave))
+    {
         return false;
     }
 
+    /** The slave advances past the filtered events without receiving them */
+    if (blr_filter_enabled(slave->router) &&
+        blr_event_filtered(slave->router, slave, hdr, buf))
+    {
+        blr_event_sent(role, binlog_name, binlog_pos, slave);
+        return true;
+    }
+
     /** Check if the event and the OK byte fit into a single packet  */
     if (hdr->event_size + 1 < MYSQL_PACKET_LENGTH_MAX)
     {
-        rval = blr_send_packet(slave, buf, hdr->event_size, true);
+        rval = shared ? blr_send_shared_packet(slave, buf, hdr->event_size, shared) :
+               blr_send_packet(slave, buf, hdr->event_size, true);
     }
     else
     {
@@ -2747,10 +3016,80 @@ bool blr_send_event(blr_thread_role_t role,
 
     if (rval)
     {
-        strcpy(slave->lsi_binlog_name, binlog_name);
-        slave->lsi_binlog_pos = binlog_pos;
-        slave->lsi_sender_role = role;
-        slave->lsi_sender_tid = thread_self();
+        blr_event_sent(role, binlog_name, binlog_pos, slave);
+    }
+    else
+    {
+        MXS_ERROR("Failed to send an event of %u bytes to slave at %s:%d.",
+                  hdr->event_size, slave->dcb->remote,
+                  ntohs(slave->dcb->ipv4.sin_port));
+    }
+    return rval;
+}
+
+/**
+ * Send a replication event to a slave straight from the binlog file
+ *
+ * Only the packet header and the OK byte are built, the event itself is sent
+ * from the file with sendfile and is not copied to user space. Events that do
+ * not fit into a single packet and slaves that can not be written to with
+ * sendfile, see dcb_write_file, have to be sent with blr_send_event.
+ *
+ * @param role  What is the role of the caller, slave or master.
+ * @param binlog_name The name of the binlogfile.
+ * @param binlog_pos The position of the event in the binlogfile.
+ * @param slave Slave where the event is sent to
+ * @param hdr   Replication header of the event
+ * @param fd    The binlog file
+ * @return 1 if the event was sent, 0 if it must be sent with blr_send_event
+ *         and -1 on error
+ */
+int blr_send_event_file(blr_thread_role_t role,
+                        const char* binlog_name,
+                        uint32_t binlog_pos,
+                        ROUTER_SLAVE *slave,
+                        REP_HEADER *hdr,
+                        int fd)
+{
+    GWBUF *head;
+    int rval;
+
+    if (hdr->event_size + 1 >= MYSQL_PACKET_LENGTH_MAX)
+    {
+        return 0;
+    }
+
+    if (blr_event_already_sent(role, binlog_name, binlog_pos, slave))
+    {
+        return -1;
+    }
+
+    if ((head = gwbuf_alloc(MYSQL_HEADER_LEN + 1)) == NULL)
+    {
+        MXS_ERROR("failed to allocate memory when writing an event of %u bytes.",
+                  hdr->event_size);
+        return -1;
+    }
+
+    uint8_t *data = GWBUF_DATA(head);
+    encode_value(data, hdr->event_size + 1, 24);
+    data[3] = slave->seqno;
+    data[4] = 0; // OK byte
+
+    if ((rval = dcb_write_file(slave->dcb, head, fd, binlog_pos, hdr->event_size)) == 0)
+    {
+        gwbuf_free(head);
+        return 0;
+    }
+
+    slave->seqno++;
+    slave->stats.n_bytes += MYSQL_HEADER_LEN + 1 + hdr->event_size;
+    slave->stats.n_events++;
+    slave->stats.n_sendfile++;
+
+    if (rval > 0)
+    {
+        blr_event_sent(role, binlog_name, binlog_pos, slave);
     }
     else
     {
@@ -59,6 +59,10 @@
  * 25/09/2015   Martin Brampton     Block callback processing when no router session in the DCB
  * 23/10/2015   Markus Makela       Added current_safe_event
  * 09/05/2016   Massimiliano Pinto  Added SELECT USER()
+ * 15/10/2016   Core Team           Catchup events can be sent from the binlog file with sendfile
+ * 15/10/2016   Core Team           Slaves can connect with GTIDs when the GTID index is used
+ * 15/10/2016   Core Team           Catchup bursts can be sent by dedicated I/O threads
+ * 15/10/2016   Core Team           Compressed binlog files are not sent with sendfile
  *
  * @endverbatim
  */
@@ -77,7 +81,10 @@
 #include <dcb.h>
 #include <spinlock.h>
 #include <housekeeper.h>
+#include <latency.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <thread.h>
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
@@ -108,6 +115,8 @@ static int blr_slave_send_server_id(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave
 static int blr_slave_send_maxscale_variables(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 static int blr_slave_send_master_status(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 static int blr_slave_send_slave_status(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
+static int blr_slave_send_gtid_position(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, const char *gtid);
+static void blr_catchup_queue(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 static int blr_slave_send_slave_hosts(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave);
 static int blr_slave_send_fieldcount(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, int count);
 static int blr_slave_send_columndef(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, char *name, int type,
@@ -298,7 +307,7 @@ blr_slave_request(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
  *  SELECT @@[GLOBAL.]server_uuid
  *  SELECT USER()
  *
- * Eight show commands are supported:
+ * Nine show commands are supported:
  *  SHOW [GLOBAL] VARIABLES LIKE 'SERVER_ID'
  *  SHOW [GLOBAL] VARIABLES LIKE 'SERVER_UUID'
  *  SHOW [GLOBAL] VARIABLES LIKE 'MAXSCALE%'
@@ -307,11 +316,13 @@ blr_slave_request(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
  *  SHOW SLAVE HOSTS
  *  SHOW WARNINGS
  *  SHOW [GLOBAL] STATUS LIKE 'Uptime'
+ *  SHOW GTID POSITION 'gtid'
  *
- * Seven set commands are supported:
+ * Eight set commands are supported:
  *  SET @master_binlog_checksum = @@global.binlog_checksum
  *  SET @master_heartbeat_period=...
  *  SET @slave_slave_uuid=...
+ *  SET @slave_connect_state=...
  *  SET NAMES latin1
  *  SET NAMES utf8
  *  SET NAMES XXX
@@ -619,6 +630,31 @@ blr_slave_query(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
                 MXS_ERROR("%s: Expected LIKE clause in SHOW VARIABLES.",
                           router->service->name);
         }
+        else if (strcasecmp(word, "GTID") == 0)
+        {
+            if ((word = strtok_r(NULL, sep, &brkb)) == NULL ||
+                strcasecmp(word, "POSITION") != 0 ||
+                (word = strtok_r(NULL, sep, &brkb)) == NULL)
+            {
+                MXS_ERROR("%s: Expected SHOW GTID POSITION 'gtid' command",
+                          router->service->name);
+            }
+            else
+            {
+                int rc;
+                int len = strlen(word);
+
+                if (len > 1 && word[0] == '\'' && word[len - 1] == '\'')
+                {
+                    word[len - 1] = '\0';
+                    word++;
+                }
+
+                rc = blr_slave_send_gtid_position(router, slave, word);
+                free(query_text);
+                return rc;
+            }
+        }
         else if (strcasecmp(word, "MASTER") == 0)
         {
             if ((word = strtok_r(NULL, sep, &brkb)) == NULL)
@@ -768,6 +804,28 @@ blr_slave_query(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue)
             free(query_text);
             return blr_slave_replay(router, slave, router->saved_master.chksum1);
         }
+        else if (strcasecmp(word, "@slave_connect_state") == 0)
+        {
+            /** The GTIDs are separated by commas, use the rest of the query */
+            char *state = brkb + strspn(brkb, " \t='");
+            int len = strlen(state);
+
+            while (len > 0 && strchr(" \t;'", state[len - 1]))
+            {
+                len--;
+            }
+
+            free(slave->gtid_state);
+            slave->gtid_state = strndup(state, len);
+            free(query_text);
+            return blr_slave_send_ok(router, slave);
+        }
+        else if (strcasecmp(word, "@slave_gtid_strict_mode") == 0 ||
+                 strcasecmp(word, "@slave_gtid_ignore_duplicates") == 0)
+        {
+            free(query_text);
+            return blr_slave_send_ok(router, slave);
+        }
         else if (strcasecmp(word, "@slave_uuid") == 0)
         {
             if ((word = strtok_r(NULL, sep, &brkb)) != NULL)
@@ -1392,6 +1450,61 @@ blr_slave_send_master_status(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
     return blr_slave_send_eof(router, slave, 9);
 }
 
+/**
+ * Send the response to the SQL command "SHOW GTID POSITION 'gtid'", the binlog
+ * file and position of a GTID event. The result set is empty if the GTID is
+ * not in the GTID index.
+ *
+ * @param   router      The binlog router instance
+ * @param   slave       The slave server to which we are sending the response
+ * @param   gtid        The GTID to look for
+ * @return  Non-zero if data was sent
+ */
+static int
+blr_slave_send_gtid_position(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, const char *gtid)
+{
+    GWBUF *pkt;
+    BLGTID_RECORD rec;
+    char file[BINLOG_FNAMELEN + 1];
+    char position[40];
+    uint32_t domain, server_id;
+    uint64_t seq;
+    uint8_t *ptr;
+    int len;
+
+    blr_slave_send_fieldcount(router, slave, 2);
+    blr_slave_send_columndef(router, slave, "File", BLR_TYPE_STRING, 40, 2);
+    blr_slave_send_columndef(router, slave, "Position", BLR_TYPE_STRING, 40, 3);
+    blr_slave_send_eof(router, slave, 4);
+
+    if (!blr_gtid_parse(gtid, &domain, &server_id, &seq) ||
+        !blr_gtid_index_find(router, domain, seq, false, &rec) ||
+        rec.server_id != server_id)
+    {
+        return blr_slave_send_eof(router, slave, 5);
+    }
+
+    snprintf(file, sizeof(file), BINLOG_NAMEFMT, router->fileroot, rec.file);
+    sprintf(position, "%u", rec.pos);
+
+    len = 5 + strlen(file) + 1 + strlen(position);
+    if ((pkt = gwbuf_alloc(len)) == NULL)
+    {
+        return 0;
+    }
+    ptr = GWBUF_DATA(pkt);
+    encode_value(ptr, len - 4, 24);                    // Add length of data packet
+    ptr += 3;
+    *ptr++ = 0x05;                                     // Sequence number in response
+    *ptr++ = strlen(file);                             // Length of result string
+    memcpy(ptr, file, strlen(file));                   // Result string
+    ptr += strlen(file);
+    *ptr++ = strlen(position);                         // Length of result string
+    memcpy(ptr, position, strlen(position));           // Result string
+    slave->dcb->func.write(slave->dcb, pkt);
+    return blr_slave_send_eof(router, slave, 6);
+}
+
 /*
  * Columns to send for a "SHOW SLAVE STATUS" command
  */
@@ -1942,6 +2055,34 @@ blr_slave_binlog_dump(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, GWBUF *queue
     strncpy(slave->binlogfile, (char *)ptr, binlognamelen);
     slave->binlogfile[binlognamelen] = 0;
 
+    /** A slave that connects with GTIDs starts after its latest GTIDs */
+    if (binlognamelen == 0 && slave->gtid_state && router->gtid_index)
+    {
+        uint32_t pos;
+
+        if (!blr_gtid_start_position(router, slave->gtid_state, slave->binlogfile, &pos))
+        {
+            char err_msg[BINLOG_ERROR_MSG_LEN + 1];
+
+            MXS_ERROR("%s: Slave %s:%i, server-id %d requested GTID state '%s' "
+                      "which is not in the GTID index.",
+                      router->service->name,
+                      slave->dcb->remote,
+                      ntohs((slave->dcb->ipv4).sin_port),
+                      slave->serverid,
+                      slave->gtid_state);
+
+            snprintf(err_msg, BINLOG_ERROR_MSG_LEN, "Requested GTID state '%s' is not "
+                     "in the binlog files", slave->gtid_state);
+            blr_send_custom_error(slave->dcb, 1, 0, err_msg, "HY000", 1236);
+            dcb_close(slave->dcb);
+            return 1;
+        }
+
+        slave->binlog_pos = pos;
+        binlognamelen = strlen(slave->binlogfile);
+    }
+
     if (router->trx_safe)
     {
         /**
@@ -2159,7 +2300,7 @@ blr_build_header(GWBUF  *pkt, REP_HEADER *hdr)
 int
 blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
 {
-    GWBUF *record;
+    GWBUF *record = NULL;
     REP_HEADER hdr;
     int rval = 1, burst;
     int rotating = 0;
@@ -2250,20 +2391,53 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
 
     slave->stats.n_bursts++;
 
+    /** Have the kernel read the burst from the disk ahead of the reads */
+    posix_fadvise(file->fd, slave->binlog_pos, burst_size, POSIX_FADV_WILLNEED);
+
 #ifdef BLSLAVE_IN_FILE
     slave->file = file;
 #endif
     int events_before = slave->stats.n_events;
+    uint64_t burst_start = latency_now();
 
-    while (burst-- && burst_size > 0 &&
-           (record = blr_read_binlog(router, file, slave->binlog_pos, &hdr, read_errmsg)) != NULL)
+    while (burst-- && burst_size > 0)
     {
         char binlog_name[BINLOG_FNAMELEN + 1];
         uint32_t binlog_pos;
+        int sent = 0;
 
         strcpy(binlog_name, slave->binlogfile);
         binlog_pos = slave->binlog_pos;
 
+        /*
+         * With sendfile_catchup only the event header is read and the event
+         * is sent straight from the file. Rotate events are processed here,
+         * the events still in the write buffer are not yet in the file and
+         * the events that can not be sent that way are read and sent as usual.
+         * The replication filters need the whole event and compressed
+         * files are decompressed.
+         */
+        if (router->sendfile_catchup && !blr_filter_enabled(router) && file->z == NULL)
+        {
+            if (!blr_read_binlog_header(router, file, binlog_pos, &hdr, read_errmsg))
+            {
+                break;
+            }
+
+            if (hdr.event_type != ROTATE_EVENT &&
+                !blr_file_buffered(router, binlog_name, binlog_pos + hdr.event_size))
+            {
+                sent = blr_send_event_file(BLR_THREAD_ROLE_SLAVE, binlog_name, binlog_pos,
+                                           slave, &hdr, file->fd);
+            }
+        }
+
+        if (sent == 0 &&
+            (record = blr_read_binlog(router, file, binlog_pos, &hdr, read_errmsg)) == NULL)
+        {
+            break;
+        }
+
         if (hdr.event_type == ROTATE_EVENT)
         {
             unsigned long beat1 = hkheartbeat;
@@ -2318,8 +2492,13 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
             }
         }
 
-        if (blr_send_event(BLR_THREAD_ROLE_SLAVE, binlog_name, binlog_pos,
-                           slave, &hdr, (uint8_t*) record->start))
+        if (sent == 0)
+        {
+            sent = blr_send_event(BLR_THREAD_ROLE_SLAVE, binlog_name, binlog_pos,
+                                  slave, &hdr, (uint8_t*) record->start, NULL) ? 1 : -1;
+        }
+
+        if (sent > 0)
         {
             if (hdr.event_type != ROTATE_EVENT)
             {
@@ -2354,6 +2533,12 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
             slave->lastReply = time(0);
         }
     }
+
+    if (slave->stats.bursts)
+    {
+        ts_histogram_add(slave->stats.bursts, latency_now() - burst_start);
+    }
+
     if (record == NULL)
     {
         slave->stats.n_failed_read++;
@@ -2470,6 +2655,7 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
 
             if ((cstate & CS_UPTODATE) == CS_UPTODATE)
             {
+                slave->stats.catchup_start = hkheartbeat;
 #ifdef STATE_CHANGE_LOGGING_ENABLED
                 MXS_NOTICE("%s: Slave %s:%d, server-id %d transition from up-to-date to "
                            "catch-up in blr_slave_catchup, binlog file '%s', position %lu.",
@@ -2488,6 +2674,7 @@ blr_slave_catchup(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave, bool large)
             if ((slave->cstate & CS_UPTODATE) == 0)
             {
                 slave->stats.n_upd++;
+                slave->stats.catchup_time += hkheartbeat - slave->stats.catchup_start;
                 slave->cstate |= CS_UPTODATE;
                 spinlock_release(&slave->catch_lock);
                 spinlock_release(&router->binlog_lock);
@@ -2632,6 +2819,7 @@ blr_slave_callback(DCB *dcb, DCB_REASON reason, void *data)
 
             if ((cstate & CS_UPTODATE) == CS_UPTODATE)
             {
+                slave->stats.catchup_start = hkheartbeat;
 #ifdef STATE_CHANGE_LOGGING_ENABLED
                 MXS_NOTICE("%s: Slave %s:%d, server-id %d transition from up-to-date to "
                            "catch-up in blr_slave_callback, binlog file '%s', position %lu.",
@@ -2644,7 +2832,15 @@ blr_slave_callback(DCB *dcb, DCB_REASON reason, void *data)
             }
 
             slave->stats.n_dcb++;
-            blr_slave_catchup(router, slave, true);
+
+            if (router->catchup.n_threads > 0)
+            {
+                blr_catchup_queue(router, slave);
+            }
+            else
+            {
+                blr_slave_catchup(router, slave, true);
+            }
         }
         else
         {
@@ -2668,6 +2864,173 @@ blr_slave_callback(DCB *dcb, DCB_REASON reason, void *data)
     return 0;
 }
 
+/**
+ * Queue a slave for a catchup burst by the catchup I/O threads. The session
+ * of the slave is referenced until the burst is sent so that the slave and
+ * its DCB are not freed while the slave is queued or the burst is sent.
+ *
+ * @param router    The router instance
+ * @param slave     The slave that is catching up
+ */
+static void
+blr_catchup_queue(ROUTER_INSTANCE *router, ROUTER_SLAVE *slave)
+{
+    BLCATCHUP_POOL *pool = &router->catchup;
+    SESSION *session = slave->dcb->session;
+
+    atomic_add(&session->refcount, 1);
+
+    spinlock_acquire(&pool->lock);
+    slave->catchup_session = session;
+    slave->catchup_next = NULL;
+
+    if (pool->tail)
+    {
+        pool->tail->catchup_next = slave;
+    }
+    else
+    {
+        pool->head = slave;
+    }
+
+    pool->tail = slave;
+    spinlock_release(&pool->lock);
+}
+
+/**
+ * The entry point of the catchup I/O threads. The threads send a burst of
+ * events to each queued slave in turn. The end of the burst queues the
+ * slave again through the DCB drained callback, as with the poll threads.
+ *
+ * @param arg       The router instance
+ */
+static void
+blr_catchup_main(void *arg)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)arg;
+    BLCATCHUP_POOL *pool = &router->catchup;
+
+    while (pool->running)
+    {
+        ROUTER_SLAVE *slave;
+        SESSION *session = NULL;
+
+        spinlock_acquire(&pool->lock);
+
+        if ((slave = pool->head) != NULL)
+        {
+            if ((pool->head = slave->catchup_next) == NULL)
+            {
+                pool->tail = NULL;
+            }
+
+            session = slave->catchup_session;
+            slave->catchup_next = NULL;
+            slave->catchup_session = NULL;
+        }
+
+        spinlock_release(&pool->lock);
+
+        if (slave)
+        {
+            if (slave->state == BLRS_DUMPING && slave->dcb->state == DCB_STATE_POLLING)
+            {
+                blr_slave_catchup(router, slave, true);
+            }
+            else
+            {
+                spinlock_acquire(&slave->catch_lock);
+                slave->cstate &= ~CS_BUSY;
+                spinlock_release(&slave->catch_lock);
+            }
+
+            session_free(session);
+        }
+        else
+        {
+            thread_millisleep(1);
+        }
+    }
+}
+
+/**
+ * Start the catchup I/O threads of the router, if the catchup_threads
+ * option is set
+ *
+ * @param router    The router instance
+ * @return          False if no thread could be started
+ */
+bool
+blr_catchup_start(ROUTER_INSTANCE *router)
+{
+    BLCATCHUP_POOL *pool = &router->catchup;
+
+    if (router->catchup_threads <= 0)
+    {
+        return true;
+    }
+
+    if ((pool->threads = calloc(router->catchup_threads, sizeof(THREAD))) == NULL)
+    {
+        MXS_ERROR("%s: Failed to allocate memory for the catchup threads.",
+                  router->service->name);
+        return false;
+    }
+
+    spinlock_init(&pool->lock);
+    pool->running = true;
+
+    for (pool->n_threads = 0; pool->n_threads < router->catchup_threads; pool->n_threads++)
+    {
+        if (thread_start(&pool->threads[pool->n_threads], blr_catchup_main, router) == NULL)
+        {
+            MXS_ERROR("%s: Failed to start a catchup thread.", router->service->name);
+            break;
+        }
+    }
+
+    if (pool->n_threads == 0)
+    {
+        blr_catchup_stop(router);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Stop the catchup I/O threads of the router and release the queued slaves
+ *
+ * @param router    The router instance
+ */
+void
+blr_catchup_stop(ROUTER_INSTANCE *router)
+{
+    BLCATCHUP_POOL *pool = &router->catchup;
+
+    if (pool->threads)
+    {
+        pool->running = false;
+
+        for (int i = 0; i < pool->n_threads; i++)
+        {
+            thread_wait(pool->threads[i]);
+        }
+
+        while (pool->head)
+        {
+            ROUTER_SLAVE *slave = pool->head;
+            pool->head = slave->catchup_next;
+            session_free(slave->catchup_session);
+        }
+
+        pool->tail = NULL;
+        pool->n_threads = 0;
+        free(pool->threads);
+        pool->threads = NULL;
+    }
+}
+
 /**
  * Rotate the slave to the new binlog file
  *
@@ -3773,7 +4136,7 @@ int blr_handle_change_master(ROUTER_INSTANCE* router, char *command, char *error
             router->current_safe_event = 4;
 
             /* close current file binlog file, next start slave will create the new one */
-            fsync(router->binlog_fd);
+            blr_file_sync(router);
             close(router->binlog_fd);
             router->binlog_fd = -1;
 
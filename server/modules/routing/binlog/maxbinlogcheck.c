@@ -28,6 +28,9 @@
  *                  Currently MariadDB 10 starting transactions
  *                  are detected checking GTID event
  *                  with flags = 0
+ * 15/10/2016   Core Team           Added the verify mode that checks the event
+ *                  headers and checksums of several binlog files
+ *                  in parallel
  *
  * @endverbatim
  */
@@ -55,7 +58,10 @@
 #include <mysql_client_server_protocol.h>
 #include <ini.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <getopt.h>
+#include <zlib.h>
+#include <thread.h>
 
 #include <version.h>
 #include <gwdirs.h>
@@ -71,11 +77,40 @@ static struct option long_options[] =
     {"version",   no_argument,        0,  'V'},
     {"fix",   no_argument,        0,  'f'},
     {"mariadb10", no_argument,        0,  'M'},
+    {"verify",    no_argument,        0,  'c'},
+    {"threads",   required_argument,  0,  't'},
     {"help",  no_argument,        0,  '?'},
     {0, 0, 0, 0}
 };
 
-char *binlog_check_version = "1.1.0";
+char *binlog_check_version = "1.2.0";
+
+/** The size of the checksum at the end of the events */
+#define BINLOG_EVENT_CRC_SIZE 4
+
+/** The default number of threads of the verify mode */
+#define VERIFY_DEFAULT_THREADS 4
+
+/** The result of the verification of a binlog file */
+typedef struct
+{
+    const char    *path;        /*< The binlog file */
+    unsigned long size;         /*< The size of the file */
+    unsigned long n_events;     /*< The number of events checked */
+    unsigned long error_pos;    /*< The position of the first invalid event */
+    const char    *error;       /*< The error or NULL if the file is valid */
+    bool          checksums;    /*< Whether the events have checksums */
+} VERIFY_FILE;
+
+/** The binlog files shared by the verify threads */
+typedef struct
+{
+    VERIFY_FILE *files;         /*< The binlog files */
+    int         n_files;        /*< The number of binlog files */
+    int         next;           /*< The next file to verify */
+} VERIFY_JOB;
+
+static int verify_binlogs(char **paths, int n_paths, int n_threads);
 
 int
 maxscale_uptime()
@@ -98,8 +133,10 @@ int main(int argc, char **argv)
     int debug_out = 0;
     int fix_file = 0;
     int mariadb10_compat = 0;
+    int verify = 0;
+    int n_threads = VERIFY_DEFAULT_THREADS;
 
-    while ((c = getopt_long(argc, argv, "dVfM?", long_options, &option_index)) >= 0)
+    while ((c = getopt_long(argc, argv, "dVfMct:?", long_options, &option_index)) >= 0)
     {
         switch (c)
         {
@@ -116,6 +153,17 @@ int main(int argc, char **argv)
         case 'M':
             mariadb10_compat = 1;
             break;
+        case 'c':
+            verify = 1;
+            break;
+        case 't':
+            n_threads = atoi(optarg);
+            if (n_threads <= 0)
+            {
+                printf("ERROR: Invalid number of threads: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         case '?':
             printUsage(*argv);
             exit(optopt ? EXIT_FAILURE : EXIT_SUCCESS);
@@ -128,6 +176,24 @@ int main(int argc, char **argv)
     mxs_log_set_augmentation(0);
     mxs_log_set_priority_enabled(LOG_DEBUG, debug_out);
 
+    if (verify)
+    {
+        if (argv[num_args] == NULL)
+        {
+            printf("ERROR: No binlog file was specified\n");
+            exit(EXIT_FAILURE);
+        }
+
+        MXS_NOTICE("maxbinlogcheck %s", binlog_check_version);
+
+        ret = verify_binlogs(argv + num_args, argc - num_args, n_threads);
+
+        mxs_log_flush_sync();
+        mxs_log_finish();
+
+        return ret;
+    }
+
     if ((inst = calloc(1, sizeof(ROUTER_INSTANCE))) == NULL)
     {
         MXS_ERROR("Memory allocation failed for ROUTER_INSTANCE");
@@ -211,6 +277,235 @@ int main(int argc, char **argv)
     return 0;
 }
 
+/**
+ * Check the events of a memory mapped binlog file. The event headers must
+ * form a chain from the start to the end of the file and the events must
+ * have valid checksums if the format description event enables them.
+ *
+ * @param file      The result of the verification
+ * @param data      The binlog file
+ */
+static void
+verify_events(VERIFY_FILE *file, uint8_t *data)
+{
+    uint8_t magic[] = BINLOG_MAGIC;
+    unsigned long pos = BINLOG_MAGIC_SIZE;
+
+    if (file->size < BINLOG_MAGIC_SIZE || memcmp(data, magic, BINLOG_MAGIC_SIZE) != 0)
+    {
+        file->error = "not a binlog file";
+        return;
+    }
+
+    while (pos < file->size)
+    {
+        uint8_t *event = data + pos;
+        uint32_t event_size;
+        uint32_t next_pos;
+
+        if (file->size - pos < BINLOG_EVENT_HDR_LEN)
+        {
+            file->error = "truncated event header";
+            break;
+        }
+
+        event_size = extract_field(event + 9, 32);
+        next_pos = extract_field(event + 13, 32);
+
+        if (event_size < BINLOG_EVENT_HDR_LEN)
+        {
+            file->error = "invalid event size";
+            break;
+        }
+
+        if (event_size > file->size - pos)
+        {
+            file->error = "truncated event";
+            break;
+        }
+
+        /** The next position of the events is zero in files of old servers */
+        if (next_pos != 0 && next_pos != (uint32_t)(pos + event_size))
+        {
+            file->error = "next event position does not match the event size";
+            break;
+        }
+
+        /**
+         * The checksum algorithm is the byte before the checksum of the
+         * format description event. The event always has the checksum
+         * when the server supports checksums.
+         */
+        if (event[4] == FORMAT_DESCRIPTION_EVENT &&
+            event_size >= BINLOG_EVENT_HDR_LEN + BINLOG_EVENT_CRC_SIZE + 1)
+        {
+            file->checksums = event[event_size - BINLOG_EVENT_CRC_SIZE - 1] == 1;
+        }
+
+        if (file->checksums)
+        {
+            uint32_t crc = crc32(0L, event, event_size - BINLOG_EVENT_CRC_SIZE);
+
+            if (event_size < BINLOG_EVENT_HDR_LEN + BINLOG_EVENT_CRC_SIZE ||
+                crc != extract_field(event + event_size - BINLOG_EVENT_CRC_SIZE, 32))
+            {
+                file->error = "invalid event checksum";
+                break;
+            }
+        }
+
+        file->n_events++;
+        pos += event_size;
+    }
+
+    if (file->error)
+    {
+        file->error_pos = pos;
+    }
+}
+
+/**
+ * Verify a binlog file by mapping it to memory
+ *
+ * @param file      The binlog file and the result of the verification
+ */
+static void
+verify_file(VERIFY_FILE *file)
+{
+    struct stat statb;
+    uint8_t *data;
+    int fd;
+
+    if ((fd = open(file->path, O_RDONLY)) == -1 || fstat(fd, &statb) == -1)
+    {
+        file->error = strerror(errno);
+    }
+    else if ((file->size = statb.st_size) == 0)
+    {
+        file->error = "empty file";
+    }
+    else if ((data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        file->error = strerror(errno);
+    }
+    else
+    {
+        madvise(data, file->size, MADV_SEQUENTIAL);
+        verify_events(file, data);
+        munmap(data, file->size);
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+/**
+ * The entry point of the verify threads. The threads take the binlog files
+ * one at a time until all the files are verified.
+ *
+ * @param arg       The files to verify
+ */
+static void
+verify_main(void *arg)
+{
+    VERIFY_JOB *job = (VERIFY_JOB *)arg;
+    int i;
+
+    while ((i = atomic_add(&job->next, 1)) < job->n_files)
+    {
+        verify_file(&job->files[i]);
+    }
+}
+
+/**
+ * Verify the event headers and the checksums of binlog files in parallel
+ * and report the results and the throughput
+ *
+ * @param paths     The binlog files
+ * @param n_paths   The number of binlog files
+ * @param n_threads The number of threads to use
+ * @return          0 if all the files are valid, 1 otherwise
+ */
+static int
+verify_binlogs(char **paths, int n_paths, int n_threads)
+{
+    VERIFY_JOB job = {calloc(n_paths, sizeof(VERIFY_FILE)), n_paths, 0};
+    THREAD *threads = calloc(n_threads, sizeof(THREAD));
+    unsigned long total = 0;
+    struct timespec start, end;
+    double secs;
+    int n_started = 0;
+    int n_errors = 0;
+
+    if (job.files == NULL || threads == NULL)
+    {
+        MXS_ERROR("Memory allocation failed for the binlog files");
+        free(job.files);
+        free(threads);
+        return 1;
+    }
+
+    for (int i = 0; i < n_paths; i++)
+    {
+        job.files[i].path = paths[i];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < MIN(n_threads, n_paths); i++)
+    {
+        if (thread_start(&threads[n_started], verify_main, &job) != NULL)
+        {
+            n_started++;
+        }
+    }
+
+    /** Verify the files in this thread if no threads could be started */
+    if (n_started == 0)
+    {
+        verify_main(&job);
+    }
+
+    for (int i = 0; i < n_started; i++)
+    {
+        thread_wait(threads[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+    for (int i = 0; i < n_paths; i++)
+    {
+        VERIFY_FILE *file = &job.files[i];
+
+        total += file->size;
+
+        if (file->error)
+        {
+            n_errors++;
+            MXS_ERROR("%s: %s at pos %lu, %lu valid events",
+                      file->path, file->error, file->error_pos, file->n_events);
+        }
+        else
+        {
+            MXS_NOTICE("%s: OK, %lu events, %lu bytes, checksums %s",
+                       file->path, file->n_events, file->size,
+                       file->checksums ? "CRC32" : "none");
+        }
+    }
+
+    MXS_NOTICE("Verified %d files, %lu bytes in %.3f seconds with %d threads, %.1f MB/s, %d errors",
+               n_paths, total, secs, MAX(n_started, 1),
+               secs > 0 ? total / secs / (1024 * 1024) : 0.0, n_errors);
+
+    free(threads);
+    free(job.files);
+
+    return n_errors ? 1 : 0;
+}
+
 /**
  * Print version information
  */
@@ -229,10 +524,13 @@ printUsage(const char *progname)
     printVersion(progname);
 
     printf("The MaxScale binlog check utility.\n\n");
-    printf("Usage: %s [-f] [-d] [-v] [<binlog file>]\n\n", progname);
+    printf("Usage: %s [-f] [-d] [-v] [<binlog file>]\n", progname);
+    printf("       %s -c [-t <threads>] <binlog file> ...\n\n", progname);
     printf("  -f|--fix		Fix binlog file, require write permissions (truncate)\n");
     printf("  -d|--debug		Print debug messages\n");
     printf("  -M|--mariadb10	MariaDB 10 binlog compatibility\n");
+    printf("  -c|--verify		Verify the event headers and checksums of the binlog files\n");
+    printf("  -t|--threads		Number of threads for --verify, default %d\n", VERIFY_DEFAULT_THREADS);
     printf("  -V|--version          print version information and exit\n");
     printf("  -?|--help             Print this help text\n");
 }
@@ -45,6 +45,8 @@
 #include <ini.h>
 #include <sys/stat.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include <version.h>
 
@@ -569,6 +571,372 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
+	tests++;
+
+	/**
+	 * Test 24: events added to the binlog cache are read back from it
+	 *
+	 * Expected: the event at each added position is found
+	 */
+	{
+		uint8_t event[100];
+		GWBUF *buf;
+		int pos;
+
+		inst->cache_size = 1024;
+		blr_init_cache(inst);
+
+		if (inst->cache == NULL) {
+			printf("Test %d: binlog cache allocation FAILED\n", tests);
+			return 1;
+		}
+
+		for (pos = 4; pos < 4 + 5 * sizeof(event); pos += sizeof(event)) {
+			memset(event, pos, sizeof(event));
+			blr_cache_add(inst, "file.000001", pos, event, sizeof(event));
+		}
+
+		for (pos = 4; pos < 4 + 5 * sizeof(event); pos += sizeof(event)) {
+			if ((buf = blr_cache_read(inst, "file.000001", pos)) == NULL ||
+			    GWBUF_LENGTH(buf) != sizeof(event) || ((uint8_t *)GWBUF_DATA(buf))[50] != (uint8_t)pos) {
+				printf("Test %d: binlog cache read of position %d FAILED\n", tests, pos);
+				return 1;
+			}
+			gwbuf_free(buf);
+		}
+
+		if (blr_cache_read(inst, "file.000001", 5) != NULL ||
+		    blr_cache_read(inst, "file.000002", 4) != NULL) {
+			printf("Test %d: binlog cache returned an event that was not added\n", tests);
+			return 1;
+		}
+
+		printf("Test %d PASSED, events read from binlog cache\n", tests);
+		tests++;
+
+		/**
+		 * Test 25: the oldest events are removed when the cache is full
+		 *
+		 * Expected: the ten latest events of the two files are found
+		 */
+		for (pos = 4 + 5 * sizeof(event); pos < 4 + 10 * sizeof(event); pos += sizeof(event)) {
+			memset(event, pos, sizeof(event));
+			blr_cache_add(inst, "file.000001", pos, event, sizeof(event));
+		}
+		for (pos = 4; pos < 4 + 10 * sizeof(event); pos += sizeof(event)) {
+			memset(event, pos, sizeof(event));
+			blr_cache_add(inst, "file.000002", pos, event, sizeof(event));
+		}
+
+		for (pos = 4; pos < 4 + 10 * sizeof(event); pos += sizeof(event)) {
+			if ((buf = blr_cache_read(inst, "file.000001", pos)) != NULL) {
+				printf("Test %d: binlog cache kept old event at %d FAILED\n", tests, pos);
+				return 1;
+			}
+			if ((buf = blr_cache_read(inst, "file.000002", pos)) == NULL ||
+			    ((uint8_t *)GWBUF_DATA(buf))[0] != (uint8_t)pos || ((uint8_t *)GWBUF_DATA(buf))[99] != (uint8_t)pos) {
+				printf("Test %d: binlog cache read of position %d FAILED\n", tests, pos);
+				return 1;
+			}
+			gwbuf_free(buf);
+		}
+
+		printf("Test %d PASSED, oldest events removed from binlog cache\n", tests);
+		tests++;
+
+		/**
+		 * Test 26: an event before the newest one empties the cache
+		 *
+		 * Expected: only the new event is found
+		 */
+		blr_cache_add(inst, "file.000001", 4, event, sizeof(event));
+
+		if (blr_cache_read(inst, "file.000002", 4) != NULL ||
+		    (buf = blr_cache_read(inst, "file.000001", 4)) == NULL) {
+			printf("Test %d: binlog cache reset FAILED\n", tests);
+			return 1;
+		}
+		gwbuf_free(buf);
+
+		printf("Test %d PASSED, binlog cache emptied by older event\n", tests);
+		blr_free_cache(inst);
+	}
+
+	tests++;
+
+	/**
+	 * Test 27: events in the write buffer are read from it until the file is flushed
+	 *
+	 * Expected: the events are read back before and after the flush
+	 */
+	{
+		char path[] = "/tmp/testbinlogXXXXXX";
+		uint8_t event[100];
+		uint8_t data[200];
+		struct stat statb;
+		int pos;
+
+		if ((inst->binlog_fd = mkstemp(path)) == -1) {
+			printf("Test %d: binlog file creation FAILED\n", tests);
+			return 1;
+		}
+		unlink(path);
+		strcpy(inst->binlog_name, "file.000001");
+		inst->last_written = 4;
+
+		for (pos = 4; pos < 4 + 3 * sizeof(event); pos += sizeof(event)) {
+			memset(event, pos, sizeof(event));
+			if (blr_file_write(inst, event, sizeof(event)) != sizeof(event)) {
+				printf("Test %d: binlog write FAILED\n", tests);
+				return 1;
+			}
+			inst->last_written += sizeof(event);
+		}
+
+		if (fstat(inst->binlog_fd, &statb) != 0 || statb.st_size != 0 ||
+		    !blr_file_buffered(inst, "file.000001", 104) ||
+		    blr_file_buffered(inst, "file.000002", 104) ||
+		    blr_file_read(inst, inst->binlog_fd, "file.000001", data, 100, 104) != 100 ||
+		    data[0] != 104 || data[99] != 104) {
+			printf("Test %d: binlog read from write buffer FAILED\n", tests);
+			return 1;
+		}
+
+		memset(event, 0xff, sizeof(event));
+		if (!blr_file_flush(inst) || blr_file_write(inst, event, sizeof(event)) != sizeof(event)) {
+			printf("Test %d: binlog flush FAILED\n", tests);
+			return 1;
+		}
+		inst->last_written += sizeof(event);
+
+		/** The first half is in the file, the second half in the write buffer */
+		if (fstat(inst->binlog_fd, &statb) != 0 || statb.st_size != 304 ||
+		    blr_file_buffered(inst, "file.000001", 304) ||
+		    blr_file_read(inst, inst->binlog_fd, "file.000001", data, 200, 204) != 200 ||
+		    data[0] != 204 || data[99] != 204 || data[100] != 0xff || data[199] != 0xff) {
+			printf("Test %d: binlog read across the write buffer FAILED\n", tests);
+			return 1;
+		}
+
+		close(inst->binlog_fd);
+		free(inst->wbuf.data);
+		printf("Test %d PASSED, events read from the binlog write buffer\n", tests);
+	}
+
+	tests++;
+
+	/**
+	 * Test 28: GTID positions are found in the GTID index and read back from its file
+	 *
+	 * Expected: the GTIDs and the positions after them are found before and after reopening
+	 */
+	{
+		char dir[] = "/tmp/testbinlogXXXXXX";
+		char path[PATH_MAX + 1];
+		char binlog[BINLOG_FNAMELEN + 1];
+		char *binlogdir = inst->binlogdir;
+		BLGTID_RECORD rec;
+		uint32_t pos;
+		int i;
+
+		if (mkdtemp(dir) == NULL) {
+			printf("Test %d: GTID index directory creation FAILED\n", tests);
+			return 1;
+		}
+		inst->binlogdir = dir;
+		inst->gtid_indexing = true;
+		blr_gtid_index_open(inst);
+
+		for (i = 1; i <= 100; i++) {
+			blr_gtid_index_add(inst, 0, 10, i, i <= 50 ? "file.000001" : "file.000002", i * 100);
+		}
+		blr_gtid_index_add(inst, 1, 20, 7, "file.000002", 20000);
+
+		for (i = 0; i < 2; i++) {
+			if (!blr_gtid_index_find(inst, 0, 50, false, &rec) || rec.file != 1 || rec.pos != 5000 ||
+			    !blr_gtid_index_find(inst, 0, 50, true, &rec) || rec.file != 2 || rec.pos != 5100 ||
+			    blr_gtid_index_find(inst, 0, 100, true, &rec) ||
+			    blr_gtid_index_find(inst, 2, 1, false, &rec) ||
+			    !blr_gtid_start_position(inst, "0-10-60,1-20-7", binlog, &pos) ||
+			    strcmp(binlog, "file.000002") != 0 || pos != 6100 ||
+			    blr_gtid_start_position(inst, "0-10-60,1-20-5", binlog, &pos)) {
+				printf("Test %d: GTID index lookup FAILED\n", tests);
+				return 1;
+			}
+
+			/** Reopen the index with a partial entry at the end */
+			snprintf(path, PATH_MAX, "%s/%s", dir, BLGTID_INDEX_FILE);
+			write(inst->gtid_index->fd, &rec, sizeof(rec) / 2);
+			blr_gtid_index_close(inst);
+			blr_gtid_index_open(inst);
+		}
+
+		/** A sequence number that goes back replaces the later entries */
+		blr_gtid_index_add(inst, 0, 11, 40, "file.000003", 4000);
+		if (!blr_gtid_index_find(inst, 0, 40, false, &rec) || rec.file != 3 || rec.server_id != 11 ||
+		    blr_gtid_index_find(inst, 0, 40, true, &rec)) {
+			printf("Test %d: GTID index reset FAILED\n", tests);
+			return 1;
+		}
+
+		blr_gtid_index_close(inst);
+		unlink(path);
+		rmdir(dir);
+		inst->binlogdir = binlogdir;
+		printf("Test %d PASSED, GTID positions found in the GTID index\n", tests);
+	}
+
+	tests++;
+
+	/**
+	 * Test 29: the replication filters remove the events of other databases and tables
+	 *
+	 * Expected: the table map and rows events of ignored tables and the statements
+	 * of ignored databases are filtered, transaction boundaries never are
+	 */
+	{
+		ROUTER_SLAVE *slave = calloc(1, sizeof(ROUTER_SLAVE));
+		REP_HEADER ev_hdr;
+		uint8_t event[100];
+
+		memset(&ev_hdr, 0, sizeof(ev_hdr));
+		blr_filter_add(blr_filter_list(inst, "replicate_ignore_db"), "logs");
+		blr_filter_add(blr_filter_list(inst, "replicate_ignore_table"), "shop.tmp");
+
+		if (!blr_filter_enabled(inst) || blr_filter_list(inst, "replicate_rewrite_db")) {
+			printf("Test %d: replication filter options FAILED\n", tests);
+			return 1;
+		}
+
+		/** Table map of shop.tmp with table ID 70 */
+		memset(event, 0, sizeof(event));
+		ev_hdr.event_type = TABLE_MAP_EVENT;
+		ev_hdr.event_size = BINLOG_EVENT_HDR_LEN + 8 + 1 + 5 + 1 + 4 + 2;
+		event[BINLOG_EVENT_HDR_LEN] = 70;
+		event[BINLOG_EVENT_HDR_LEN + 8] = 4;
+		memcpy(event + BINLOG_EVENT_HDR_LEN + 9, "shop", 5);
+		event[BINLOG_EVENT_HDR_LEN + 14] = 3;
+		memcpy(event + BINLOG_EVENT_HDR_LEN + 15, "tmp", 4);
+
+		if (!blr_event_filtered(inst, slave, &ev_hdr, event)) {
+			printf("Test %d: table map filtering FAILED\n", tests);
+			return 1;
+		}
+
+		/** shop.orders with table ID 71 is replicated */
+		event[BINLOG_EVENT_HDR_LEN] = 71;
+		event[BINLOG_EVENT_HDR_LEN + 14] = 6;
+		memcpy(event + BINLOG_EVENT_HDR_LEN + 15, "orders", 7);
+		ev_hdr.event_size += 3;
+
+		if (blr_event_filtered(inst, slave, &ev_hdr, event)) {
+			printf("Test %d: table map of a replicated table FAILED\n", tests);
+			return 1;
+		}
+
+		/** Rows of table 70, then rows of table 71 that end the statement */
+		memset(event, 0, sizeof(event));
+		ev_hdr.event_type = WRITE_ROWS_EVENTv1;
+		ev_hdr.event_size = BINLOG_EVENT_HDR_LEN + 8 + 10;
+		event[BINLOG_EVENT_HDR_LEN] = 70;
+
+		if (!blr_event_filtered(inst, slave, &ev_hdr, event)) {
+			printf("Test %d: rows event filtering FAILED\n", tests);
+			return 1;
+		}
+
+		event[BINLOG_EVENT_HDR_LEN] = 71;
+		event[BINLOG_EVENT_HDR_LEN + 6] = 1;
+
+		if (blr_event_filtered(inst, slave, &ev_hdr, event) || slave->n_filtered_tables != 0) {
+			printf("Test %d: rows event of a replicated table FAILED\n", tests);
+			return 1;
+		}
+
+		/** Statements in the ignored database, BEGIN is always sent */
+		memset(event, 0, sizeof(event));
+		ev_hdr.event_type = QUERY_EVENT;
+		ev_hdr.event_size = BINLOG_EVENT_HDR_LEN + 13 + 5 + 16;
+		event[BINLOG_EVENT_HDR_LEN + 8] = 4;
+		memcpy(event + BINLOG_EVENT_HDR_LEN + 13, "logs", 5);
+		memcpy(event + BINLOG_EVENT_HDR_LEN + 18, "DELETE FROM log", 16);
+
+		if (!blr_event_filtered(inst, slave, &ev_hdr, event) || slave->stats.n_filtered != 3) {
+			printf("Test %d: statement filtering FAILED\n", tests);
+			return 1;
+		}
+
+		memcpy(event + BINLOG_EVENT_HDR_LEN + 18, "BEGIN", 6);
+
+		if (blr_event_filtered(inst, slave, &ev_hdr, event)) {
+			printf("Test %d: transaction boundary filtering FAILED\n", tests);
+			return 1;
+		}
+
+		blr_filter_free(inst);
+		free(slave->filtered_tables);
+		free(slave);
+		printf("Test %d PASSED, events filtered by database and table\n", tests);
+	}
+
+	tests++;
+
+	/**
+	 * Test 30: a compressed binlog file replaces the binlog file and reads as it
+	 *
+	 * Expected: the data read across the chunks is the data of the binlog file
+	 */
+	{
+		char dir[] = "/tmp/testbinlogXXXXXX";
+		char path[PATH_MAX + 1];
+		char *binlogdir = inst->binlogdir;
+		int size = 3 * BLR_COMPRESS_CHUNK + 1000;
+		uint8_t *data = malloc(size);
+		uint8_t buf[2000];
+		BLFILE *file;
+		int fd;
+
+		if (mkdtemp(dir) == NULL || data == NULL) {
+			printf("Test %d: binlog directory creation FAILED\n", tests);
+			return 1;
+		}
+		inst->binlogdir = dir;
+
+		for (int i = 0; i < size; i++) {
+			data[i] = (i / 7) % 251;
+		}
+
+		snprintf(path, PATH_MAX, "%s/file.000001", dir);
+		if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) == -1 || write(fd, data, size) != size) {
+			printf("Test %d: binlog file creation FAILED\n", tests);
+			return 1;
+		}
+		close(fd);
+
+		if (!blr_compress_binlog(inst, "file.000001") || access(path, F_OK) == 0) {
+			printf("Test %d: binlog file compression FAILED\n", tests);
+			return 1;
+		}
+
+		if ((file = blr_open_binlog(inst, "file.000001")) == NULL || file->z == NULL ||
+		    blr_file_size(file) != size ||
+		    blr_zfile_read(file->z, file->fd, buf, sizeof(buf), BLR_COMPRESS_CHUNK - 1000) != sizeof(buf) ||
+		    memcmp(buf, data + BLR_COMPRESS_CHUNK - 1000, sizeof(buf)) != 0 ||
+		    blr_zfile_read(file->z, file->fd, buf, sizeof(buf), size - 500) != 500 ||
+		    memcmp(buf, data + size - 500, 500) != 0) {
+			printf("Test %d: compressed binlog file read FAILED\n", tests);
+			return 1;
+		}
+
+		blr_close_binlog(inst, file);
+		strcat(path, BLR_COMPRESSED_SUFFIX);
+		unlink(path);
+		rmdir(dir);
+		free(data);
+		inst->binlogdir = binlogdir;
+		printf("Test %d PASSED, compressed binlog file read\n", tests);
+	}
+
 	mxs_log_flush_sync();
 	mxs_log_finish();
 
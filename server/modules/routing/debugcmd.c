@@ -49,6 +49,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <service.h>
 #include <session.h>
@@ -69,6 +70,9 @@
 #include <monitor.h>
 #include <debugcli.h>
 #include <housekeeper.h>
+#include <query_classifier.h>
+#include <trace.h>
+#include <memstats.h>
 
 #include <skygw_utils.h>
 #include <log_manager.h>
@@ -102,16 +106,17 @@ struct subcommand {
 };
 
 static  void    telnetdShowUsers(DCB *);
+static  void    dShowLocks(DCB *);
+static  void    dShowQcCache(DCB *);
+static  void    dShowQcShadow(DCB *);
 /**
  * The subcommands of the show command
  */
 struct subcommand showoptions[] = {
-#if defined(BUFFER_TRACE)
     { "buffers",	0, dprintAllBuffers,
-	  "Show all buffers with backtrace",
-      "Show all buffers with backtrace",
+      "Show the buffer pool statistics and, in buffer trace builds, all buffers with backtrace",
+      "Show the buffer pool statistics and, in buffer trace builds, all buffers with backtrace",
       {0, 0, 0} },
-#endif
     { "dcbs", 0, dprintAllDCBs,
       "Show all descriptor control blocks (network connections)",
       "Show all descriptor control blocks (network connections)",
@@ -150,6 +155,14 @@ struct subcommand showoptions[] = {
       "Show all filters",
       "Show all filters",
       {0, 0, 0} },
+    { "locks", 0, dShowLocks,
+      "Show the most contended locks, ranked by the time spent waiting for them",
+      "Show the most contended locks, ranked by the time spent waiting for them",
+      {0, 0, 0} },
+    { "memory", 0, dShowMemory,
+      "Show the memory in use by each subsystem and module",
+      "Show the memory in use by each subsystem and module",
+      {0, 0, 0} },
     { "modules", 0, dprintAllModules,
       "Show all currently loaded modules",
       "Show all currently loaded modules",
@@ -167,6 +180,14 @@ struct subcommand showoptions[] = {
       "Show persistent pool for a server, e.g. show persistent 0x485390. "
       "The address may also be replaced with the server name from the configuration file",
       {ARG_TYPE_SERVER, 0, 0} },
+    { "qc_cache", 0, dShowQcCache,
+      "Show the statistics of the query classification cache",
+      "Show the statistics of the query classification cache",
+      {0, 0, 0} },
+    { "qc_shadow", 0, dShowQcShadow,
+      "Show how often the shadow query classifier disagreed with the query classifier",
+      "Show how often the shadow query classifier disagreed with the query classifier",
+      {0, 0, 0} },
     { "server", 1, dprintServer,
       "Show details for a named server, e.g. show server dbnode1",
       "Show details for a server, e.g. show server 0x485390. The address may also be "
@@ -204,6 +225,10 @@ struct subcommand showoptions[] = {
       "Show the status of the polling threads in MaxScale",
       "Show the status of the polling threads in MaxScale",
       {0, 0, 0} },
+    { "traces", 0, dShowQueryTraces,
+      "Show the stage timings of the most recent sampled queries",
+      "Show the stage timings of the most recent sampled queries",
+      {0, 0, 0} },
     { "users", 0, telnetdShowUsers,
       "Show all maxadmin enabled Linux accounts and created maxadmin users",
       "Show all maxadmin enabled Linux accounts and created maxadmin users",
@@ -1368,6 +1393,85 @@ telnetdShowUsers(DCB *dcb)
     dcb_PrintAdminUsers(dcb);
 }
 
+/** The maximum number of locks shown by show locks */
+#define SHOW_LOCKS_MAX 30
+
+/**
+ * Print the named locks that have been contended, the hottest lock first
+ *
+ * @param dcb   The DCB to print the locks to
+ */
+static void
+dShowLocks(DCB *dcb)
+{
+    SPINLOCK_INFO info[SHOW_LOCKS_MAX];
+    int n = spinlock_contention(info, SHOW_LOCKS_MAX);
+    int i;
+
+    dcb_printf(dcb, "%-22s | %-18s | %-12s | %-12s | %-5s | %-18s | %s\n",
+               "Lock", "Address", "Acquired", "Contended", "%", "Wait cycles", "Avg wait");
+    dcb_printf(dcb, "-----------------------+--------------------+--------------+"
+               "--------------+-------+--------------------+----------\n");
+    for (i = 0; i < n; i++)
+    {
+        dcb_printf(dcb, "%-22s | %-18p | %-12lu | %-12lu | %-5lu | %-18llu | %llu\n",
+                   info[i].name, info[i].address, info[i].acquired, info[i].contended,
+                   info[i].acquired ? (info[i].contended * 100) / info[i].acquired : 0,
+                   info[i].wait_cycles,
+                   info[i].contended ? info[i].wait_cycles / info[i].contended : 0);
+    }
+}
+
+/**
+ * Print the statistics of the query classification cache, summed over all threads
+ *
+ * @param dcb   The DCB to print the statistics to
+ */
+static void
+dShowQcCache(DCB *dcb)
+{
+    QC_CACHE_STATS stats;
+
+    if (!qc_get_cache_stats(&stats))
+    {
+        dcb_printf(dcb, "The query classifier has no classification cache.\n");
+        return;
+    }
+
+    dcb_printf(dcb, "Query Classification Cache\n");
+    dcb_printf(dcb, "\tEntries per thread:     %" PRIu64 "\n", stats.size);
+    dcb_printf(dcb, "\tEntries in use:         %" PRIu64 "\n", stats.entries);
+    dcb_printf(dcb, "\tHits:                   %" PRIu64 "\n", stats.hits);
+    dcb_printf(dcb, "\tMisses:                 %" PRIu64 "\n", stats.misses);
+    dcb_printf(dcb, "\tEvictions:              %" PRIu64 "\n", stats.evictions);
+    dcb_printf(dcb, "\tHit rate:               %" PRIu64 "%%\n",
+               stats.hits + stats.misses ? (stats.hits * 100) / (stats.hits + stats.misses) : 0);
+}
+
+/**
+ * Print the statistics of the shadow query classifier
+ *
+ * @param dcb   The DCB to print the statistics to
+ */
+static void
+dShowQcShadow(DCB *dcb)
+{
+    QC_SHADOW_STATS stats;
+
+    if (!qc_get_shadow_stats(&stats))
+    {
+        dcb_printf(dcb, "No shadow query classifier is in use.\n");
+        return;
+    }
+
+    dcb_printf(dcb, "Shadow Query Classifier\n");
+    dcb_printf(dcb, "\tSampled statements:     %" PRIu64 "\n", stats.sampled);
+    dcb_printf(dcb, "\tDropped statements:     %" PRIu64 "\n", stats.dropped);
+    dcb_printf(dcb, "\tCompared statements:    %" PRIu64 "\n", stats.compared);
+    dcb_printf(dcb, "\tType mismatches:        %" PRIu64 "\n", stats.type_mismatches);
+    dcb_printf(dcb, "\tOperation mismatches:   %" PRIu64 "\n", stats.operation_mismatches);
+}
+
 /**
  * Command to shutdown a running monitor
  *
@@ -1502,24 +1606,14 @@ static void enable_sess_log_action(DCB *dcb, char *arg1, char *arg2)
     {
         size_t id = (size_t) strtol(arg2, 0, 0);
 
-        // TODO: This is totally non thread-safe.
-        SESSION* session = get_all_sessions();
+        SESSION* session = session_get_by_id(id);
 
-        while (session)
+        if (session)
         {
-            if (false == session->ses_is_in_use)
-            {
-                continue;
-            }
-            if (session->ses_id == id)
-            {
-                session_enable_log_priority(session, entry.priority);
-                break;
-            }
-            session = session->next;
+            session_enable_log_priority(session, entry.priority);
+            session_free(session);
         }
-
-        if (!session)
+        else
         {
             dcb_printf(dcb, "Session not found: %s.\n", arg2);
         }
@@ -1544,24 +1638,14 @@ static void disable_sess_log_action(DCB *dcb, char *arg1, char *arg2)
     {
         size_t id = (size_t) strtol(arg2, 0, 0);
 
-        // TODO: This is totally non thread-safe.
-        SESSION* session = get_all_sessions();
+        SESSION* session = session_get_by_id(id);
 
-        while (session)
+        if (session)
         {
-            if (false == session->ses_is_in_use)
-            {
-                continue;
-            }
-            if (session->ses_id == id)
-            {
-                session_disable_log_priority(session, entry.priority);
-                break;
-            }
-            session = session->next;
+            session_disable_log_priority(session, entry.priority);
+            session_free(session);
         }
-
-        if (!session)
+        else
         {
             dcb_printf(dcb, "Session not found: %s.\n", arg2);
         }
@@ -1623,24 +1707,14 @@ static void enable_sess_log_priority(DCB *dcb, char *arg1, char *arg2)
     {
         size_t id = (size_t) strtol(arg2, 0, 0);
 
-        // TODO: This is totally non thread-safe.
-        SESSION* session = get_all_sessions();
+        SESSION* session = session_get_by_id(id);
 
-        while (session)
+        if (session)
         {
-            if (false == session->ses_is_in_use)
-            {
-                continue;
-            }
-            if (session->ses_id == id)
-            {
-                session_enable_log_priority(session, priority);
-                break;
-            }
-            session = session->next;
+            session_enable_log_priority(session, priority);
+            session_free(session);
         }
-
-        if (!session)
+        else
         {
             dcb_printf(dcb, "Session not found: %s.\n", arg2);
         }
@@ -1665,24 +1739,14 @@ static void disable_sess_log_priority(DCB *dcb, char *arg1, char *arg2)
     {
         size_t id = (size_t) strtol(arg2, 0, 0);
 
-        // TODO: This is totally non thread-safe.
-        SESSION* session = get_all_sessions();
+        SESSION* session = session_get_by_id(id);
 
-        while (session)
+        if (session)
         {
-            if (false == session->ses_is_in_use)
-            {
-                continue;
-            }
-            if (session->ses_id == id)
-            {
-                session_disable_log_priority(session, priority);
-                break;
-            }
-            session = session->next;
+            session_disable_log_priority(session, priority);
+            session_free(session);
         }
-
-        if (!session)
+        else
         {
             dcb_printf(dcb, "Session not found: %s.\n", arg2);
         }
@@ -22,6 +22,7 @@
  * 16/02/15	Mark Riddoch		Initial implementation
  * 27/02/15	Massimiliano Pinto	Added maxinfo_add_mysql_user
  * 09/09/2015   Martin Brampton         Modify error handler
+ * 15/10/2016   Core Team               Tables of the SELECT statements
  *
  * @endverbatim
  */
@@ -46,6 +47,8 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <resultset.h>
+#include <metrics.h>
+#include <memstats.h>
 #include <version.h>
 #include <resultset.h>
 #include <secrets.h>
@@ -672,25 +675,54 @@ typedef RESULTSET *(*RESULTSETFUNC)();
 
 /**
  * Table that maps a URI to a function to call to
- * to obtain the result set related to that URI
+ * to obtain the result set related to that URI. The
+ * same result sets are the tables of the SELECT statements.
  */
 static struct uri_table {
 	char		*uri;
+	char		*table;
 	RESULTSETFUNC	func;
 } supported_uri[] = {
-	{ "/services", serviceGetList },
-	{ "/listeners", serviceGetListenerList },
-	{ "/modules", moduleGetList },
-	{ "/monitors", monitorGetList },
-	{ "/sessions", maxinfoSessionsAll },
-	{ "/clients", maxinfoClientSessions },
-	{ "/servers", serverGetList },
-	{ "/variables", maxinfo_variables },
-	{ "/status", maxinfo_status },
-	{ "/event/times", eventTimesGetList },
-	{ NULL, NULL }
+	{ "/services", "services", serviceGetList },
+	{ "/listeners", "listeners", serviceGetListenerList },
+	{ "/modules", "modules", moduleGetList },
+	{ "/monitors", "monitors", monitorGetList },
+	{ "/sessions", "sessions", maxinfoSessionsAll },
+	{ "/clients", "clients", maxinfoClientSessions },
+	{ "/servers", "servers", serverGetList },
+	{ "/backends", "backends", serviceGetBackendStatsList },
+	{ "/slaves", "slaves", serviceGetSlaveMetricsList },
+	{ "/statements", "statements", filterGetStatementList },
+	{ "/variables", "variables", maxinfo_variables },
+	{ "/status", "status", maxinfo_status },
+	{ "/event/times", "eventTimes", eventTimesGetList },
+	{ "/event/latency", "eventLatency", eventLatencyGetList },
+	{ "/threads", "threads", pollThreadsGetList },
+	{ "/memory", "memory", memstatsGetList },
+	{ NULL, NULL, NULL }
 };
 
+/**
+ * Create the result set of a table of the SELECT statements
+ *
+ * @param name	The table name
+ * @return The result set or NULL if there is no such table
+ */
+RESULTSET *
+maxinfo_table(const char *name)
+{
+int	i;
+
+	for (i = 0; supported_uri[i].uri; i++)
+	{
+		if (strcasecmp(supported_uri[i].table, name) == 0)
+		{
+			return (*supported_uri[i].func)();
+		}
+	}
+	return NULL;
+}
+
 /**
  * We have data from the client, this is a HTTP URL
  *
@@ -707,6 +739,11 @@ int		i;
 RESULTSET	*set;
 
 	uri = (char *)GWBUF_DATA(queue);
+	if (strcmp(uri, METRICS_URL) == 0)
+	{
+		/** The metrics are written without building a result set */
+		metrics_stream(session->dcb);
+	}
 	for (i = 0; supported_uri[i].uri; i++)
 	{
 		if (strcmp(uri, supported_uri[i].uri) == 0)
@@ -68,6 +68,9 @@ int	len;
 	case PARSE_SYNTAX_ERROR:
 		desc = "Syntax error";
 		break;
+	case PARSE_MALFORMED_SELECT:
+		desc = "Expected select <columns> from <table> [where <column> = <value> [and ...]]";
+		break;
 	}
 
 	len = strlen(sql) + strlen(desc) + 20;
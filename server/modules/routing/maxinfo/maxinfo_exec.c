@@ -20,6 +20,7 @@
  *
  * Date		Who		Description
  * 17/02/15	Mark Riddoch	Initial implementation
+ * 15/10/2016	Core Team	SELECT with column lists and WHERE conditions
  *
  * @endverbatim
  */
@@ -44,6 +45,7 @@
 #include <log_manager.h>
 #include <resultset.h>
 #include <maxconfig.h>
+#include <memstats.h>
 
 static void exec_show(DCB *dcb, MAXINFO_TREE *tree);
 static void exec_select(DCB *dcb, MAXINFO_TREE *tree);
@@ -245,6 +247,96 @@ RESULTSET	*set;
 	resultset_free(set);
 }
 
+/**
+ * Fetch the CPU time and load of the polling threads
+ *
+ * @param dcb	DCB to which to stream result set
+ * @param tree	Potential like clause (currently unused)
+ */
+static void
+exec_show_threads(DCB *dcb, MAXINFO_TREE *tree)
+{
+RESULTSET	*set;
+
+	if ((set = pollThreadsGetList()) == NULL)
+		return;
+	
+	resultset_stream_mysql(set, dcb);
+	resultset_free(set);
+}
+
+/**
+ * Fetch the memory in use by each subsystem and module
+ *
+ * @param dcb	DCB to which to stream result set
+ * @param tree	Potential like clause (currently unused)
+ */
+static void
+exec_show_memory(DCB *dcb, MAXINFO_TREE *tree)
+{
+RESULTSET	*set;
+
+	if ((set = memstatsGetList()) == NULL)
+		return;
+	
+	resultset_stream_mysql(set, dcb);
+	resultset_free(set);
+}
+
+/**
+ * Fetch the statistics of the servers of the services and stream as a result set
+ *
+ * @param dcb	DCB to which to stream result set
+ * @param tree	Potential like clause (currently unused)
+ */
+static void
+exec_show_backends(DCB *dcb, MAXINFO_TREE *tree)
+{
+RESULTSET	*set;
+
+	if ((set = serviceGetBackendStatsList()) == NULL)
+		return;
+	
+	resultset_stream_mysql(set, dcb);
+	resultset_free(set);
+}
+
+/**
+ * Fetch the replication metrics of the slaves of the services and stream as a result set
+ *
+ * @param dcb	DCB to which to stream result set
+ * @param tree	Potential like clause (currently unused)
+ */
+static void
+exec_show_slaves(DCB *dcb, MAXINFO_TREE *tree)
+{
+RESULTSET	*set;
+
+	if ((set = serviceGetSlaveMetricsList()) == NULL)
+		return;
+	
+	resultset_stream_mysql(set, dcb);
+	resultset_free(set);
+}
+
+/**
+ * Fetch the statements tracked by the filters and stream as a result set
+ *
+ * @param dcb	DCB to which to stream result set
+ * @param tree	Potential like clause (currently unused)
+ */
+static void
+exec_show_statements(DCB *dcb, MAXINFO_TREE *tree)
+{
+RESULTSET	*set;
+
+	if ((set = filterGetStatementList()) == NULL)
+		return;
+	
+	resultset_stream_mysql(set, dcb);
+	resultset_free(set);
+}
+
 /**
  * The table of show commands that are supported
  */
@@ -262,6 +354,11 @@ static struct {
 	{ "modules", exec_show_modules },
 	{ "monitors", exec_show_monitors },
 	{ "eventTimes", exec_show_eventTimes },
+	{ "threads", exec_show_threads },
+	{ "memory", exec_show_memory },
+	{ "backends", exec_show_backends },
+	{ "slaves", exec_show_slaves },
+	{ "statements", exec_show_statements },
 	{ NULL, NULL }
 };
 
@@ -1176,7 +1273,69 @@ static VARCONTEXT	context;
 static void
 exec_select(DCB *dcb, MAXINFO_TREE *tree)
 {
-	maxinfo_send_error(dcb, 0, "Select not yet implemented");
+    MAXINFO_TREE *table = tree->right;
+    MAXINFO_TREE *node;
+    RESULTSET *set;
+    char errmsg[120];
+
+    if (strlen(table->value) > 80)	// Prevent buffer overrun
+    {
+        table->value[80] = 0;
+    }
+    if ((set = maxinfo_table(table->value)) == NULL)
+    {
+        sprintf(errmsg, "Unknown table '%s'", table->value);
+        maxinfo_send_error(dcb, 1146, errmsg);
+        return;
+    }
+
+    /**
+     * The column list and the conditions are given to the result set, so
+     * the rows are filtered as they are fetched and only the selected columns
+     * are sent
+     */
+    for (node = tree->left; node && node->op == MAXOP_COLUMNS; node = node->right)
+    {
+        if (!resultset_select_column(set, node->value))
+        {
+            break;
+        }
+    }
+
+    if (node == NULL || node->op == MAXOP_ALL_COLUMNS)
+    {
+        for (node = table->left; node; node = node->right)
+        {
+            if (!resultset_add_condition(set, node->value, node->left->value,
+                                         node->op == MAXOP_LIKE))
+            {
+                break;
+            }
+        }
+    }
+
+    if (node)
+    {
+        RESULT_ROW *row;
+
+        if (strlen(node->value) > 80)
+        {
+            node->value[80] = 0;
+        }
+        sprintf(errmsg, "Unknown column '%s' in table '%s'", node->value, table->value);
+        maxinfo_send_error(dcb, 1054, errmsg);
+
+        /** The row callbacks free their data after the last row */
+        while ((row = (*set->fetchrow)(set, set->userdata)) != NULL)
+        {
+            resultset_free_row(row);
+        }
+    }
+    else
+    {
+        resultset_stream_mysql(set, dcb);
+    }
+    resultset_free(set);
 }
 
 /**
@@ -20,6 +20,7 @@
  *
  * Date		Who		Description
  * 16/02/15	Mark Riddoch	Initial implementation
+ * 15/10/2016	Core Team	SELECT with column lists and WHERE conditions
  *
  * @endverbatim
  */
@@ -43,8 +44,8 @@
 static MAXINFO_TREE *make_tree_node(MAXINFO_OPERATOR, char *, MAXINFO_TREE *, MAXINFO_TREE *);
 static void free_tree(MAXINFO_TREE *);
 static char *fetch_token(char *, int *, char **);
-static MAXINFO_TREE *parse_column_list(char **sql);
-static MAXINFO_TREE *parse_table_name(char **sql);
+static MAXINFO_TREE *parse_select(char *ptr, PARSE_ERROR *parse_error);
+static MAXINFO_TREE *parse_where(char *ptr);
 MAXINFO_TREE* maxinfo_parse_literals(MAXINFO_TREE *tree, int min_args, char *ptr,
                                      PARSE_ERROR *parse_error);
 
@@ -60,7 +61,6 @@ maxinfo_parse(char *sql, PARSE_ERROR *parse_error)
 int		token;
 char		*ptr, *text;
 MAXINFO_TREE	*tree = NULL;
-MAXINFO_TREE	*col, *table;
 
 	*parse_error = PARSE_NOERROR;
 	while ((ptr  = fetch_token(sql, &token, &text)) != NULL)
@@ -79,6 +79,25 @@ MAXINFO_TREE	*col, *table;
 			tree = make_tree_node(MAXOP_SHOW, text, NULL, NULL);
 			if ((ptr = fetch_token(ptr, &token, &text)) == NULL)
 				return tree;
+			else if (token == LT_WHERE)
+			{
+				/** SHOW <table> WHERE ... is SELECT * FROM <table> WHERE ... */
+				MAXINFO_TREE *select;
+
+				free(text);
+				select = make_tree_node(MAXOP_SELECT, NULL,
+						make_tree_node(MAXOP_ALL_COLUMNS, NULL, NULL, NULL),
+						make_tree_node(MAXOP_TABLE, tree->value, NULL, NULL));
+				tree->value = NULL;
+				free_tree(tree);
+				if ((select->right->left = parse_where(ptr)) == NULL)
+				{
+					*parse_error = PARSE_MALFORMED_SHOW;
+					free_tree(select);
+					return NULL;
+				}
+				return select;
+			}
 			else if (token == LT_LIKE)
 			{
 				if ((ptr = fetch_token(ptr, &token, &text)) != NULL)
@@ -100,13 +119,9 @@ MAXINFO_TREE	*col, *table;
 			free_tree(tree);
 			*parse_error = PARSE_MALFORMED_SHOW;
 			return NULL;
-#if 0
 		case	LT_SELECT:
 			free(text);	// not needed
-			col = parse_column_list(&ptr);
-			table = parse_table_name(&ptr);
-			return make_tree_node(MAXOP_SELECT, NULL, col, table);
-#endif
+			return parse_select(ptr, parse_error);
             case LT_FLUSH:
                 free(text);	// not needed
                 ptr = fetch_token(ptr, &token, &text);
@@ -179,70 +194,168 @@ MAXINFO_TREE	*col, *table;
 }
 
 /**
- * Parse a column list, may be a * or a valid list of string name
- * separated by a comma
+ * Parse the rest of a SELECT statement:
  *
- * @param sql	Pointer to pointer to column list updated to point to the table name
- * @return	A tree of column names
+ *	<columns> FROM <table> [WHERE <conditions>]
+ *
+ * The columns are a * or a list of column names separated by commas. The
+ * SELECT node has the columns on the left and the table on the right, the
+ * table has the conditions on the left.
+ *
+ * @param ptr		The SQL following the SELECT keyword
+ * @param parse_error	Set to the error if the statement is malformed
+ * @return The parse tree or NULL on error
  */
 static MAXINFO_TREE *
-parse_column_list(char **ptr)
+parse_select(char *ptr, PARSE_ERROR *parse_error)
 {
-int	token, lookahead;
-char	*text, *text2;
-MAXINFO_TREE	*tree = NULL;
-MAXINFO_TREE * rval = NULL;
-	*ptr = fetch_token(*ptr, &token, &text);
-	*ptr = fetch_token(*ptr, &lookahead, &text2);
-	switch (token)
-	{
-	case LT_STRING:
-		switch (lookahead)
-		{
-		case LT_COMMA:
-			rval = make_tree_node(MAXOP_COLUMNS, text, NULL,
-				parse_column_list(ptr));
-			break;
-		case LT_FROM:
-			rval = make_tree_node(MAXOP_COLUMNS, text, NULL,
-				NULL);
-			break;
-		default:
-		    break;
-		}
-		break;
-	case LT_STAR:
-		if (lookahead != LT_FROM)
-			rval = make_tree_node(MAXOP_ALL_COLUMNS, NULL, NULL,
-				NULL);
-		break;
-	default:
-	    break;
-	}
-	free(text);
-	free(text2);
-	return rval;
-}
+    MAXINFO_TREE *columns = NULL, *last = NULL, *table, *tree;
+    int token;
+    char *text;
+
+    for (;;)
+    {
+        if ((ptr = fetch_token(ptr, &token, &text)) == NULL)
+        {
+            goto malformed;
+        }
+        if (token == LT_STAR && columns == NULL)
+        {
+            free(text);
+            columns = make_tree_node(MAXOP_ALL_COLUMNS, NULL, NULL, NULL);
+        }
+        else if (token == LT_STRING && (columns == NULL || columns->op == MAXOP_COLUMNS))
+        {
+            MAXINFO_TREE *node = make_tree_node(MAXOP_COLUMNS, text, NULL, NULL);
+
+            if (last)
+            {
+                last->right = node;
+            }
+            else
+            {
+                columns = node;
+            }
+            last = node;
+        }
+        else
+        {
+            free(text);
+            goto malformed;
+        }
 
+        if ((ptr = fetch_token(ptr, &token, &text)) == NULL)
+        {
+            goto malformed;
+        }
+        free(text);
+        if (token == LT_FROM)
+        {
+            break;
+        }
+        if (token != LT_COMMA || columns->op == MAXOP_ALL_COLUMNS)
+        {
+            goto malformed;
+        }
+    }
+
+    if ((ptr = fetch_token(ptr, &token, &text)) == NULL || token != LT_STRING)
+    {
+        free(text);
+        goto malformed;
+    }
+    table = make_tree_node(MAXOP_TABLE, text, NULL, NULL);
+    tree = make_tree_node(MAXOP_SELECT, NULL, columns, table);
+
+    if ((ptr = fetch_token(ptr, &token, &text)) != NULL)
+    {
+        free(text);
+        if (token != LT_WHERE || (table->left = parse_where(ptr)) == NULL)
+        {
+            *parse_error = PARSE_MALFORMED_SELECT;
+            free_tree(tree);
+            return NULL;
+        }
+    }
+    return tree;
+
+malformed:
+    if (columns)
+    {
+        free_tree(columns);
+    }
+    *parse_error = PARSE_MALFORMED_SELECT;
+    return NULL;
+}
 
 /**
- * Parse a table name
+ * Parse the conditions of a WHERE clause:
+ *
+ *	<column> = <value> | <column> LIKE <pattern> [AND ...]
+ *
+ * Each condition is an EQUAL or a LIKE node with the column name as its value
+ * and the literal on the left. The next condition is on the right.
  *
- * @param sql	Pointer to pointer to column list updated to point to the table name
- * @return	A tree of table names
+ * @param ptr	The SQL following the WHERE keyword
+ * @return The conditions or NULL on error
  */
 static MAXINFO_TREE *
-parse_table_name(char **ptr)
+parse_where(char *ptr)
 {
-int	token;
-char	*text;
-MAXINFO_TREE	*tree = NULL;
+    MAXINFO_TREE *conds = NULL, *last = NULL;
+    int token;
 
-	*ptr = fetch_token(*ptr, &token, &text);
-	if  (token == LT_STRING)
-		return make_tree_node(MAXOP_TABLE, text, NULL, NULL);
-	free(text);
-	return NULL;
+    do
+    {
+        char *column, *op, *value;
+        int op_token;
+
+        if ((ptr = fetch_token(ptr, &token, &column)) == NULL || token != LT_STRING)
+        {
+            free(column);
+            break;
+        }
+        if ((ptr = fetch_token(ptr, &op_token, &op)) == NULL ||
+            (op_token != LT_EQUAL && op_token != LT_LIKE))
+        {
+            free(column);
+            free(op);
+            break;
+        }
+        free(op);
+        if ((ptr = fetch_token(ptr, &token, &value)) == NULL || token != LT_STRING)
+        {
+            free(column);
+            free(value);
+            break;
+        }
+
+        MAXINFO_TREE *node = make_tree_node(op_token == LT_EQUAL ? MAXOP_EQUAL : MAXOP_LIKE, column,
+                                            make_tree_node(MAXOP_LITERAL, value, NULL, NULL), NULL);
+        if (last)
+        {
+            last->right = node;
+        }
+        else
+        {
+            conds = node;
+        }
+        last = node;
+
+        if ((ptr = fetch_token(ptr, &token, &value)) == NULL)
+        {
+            /** The end of the statement */
+            return conds;
+        }
+        free(value);
+    }
+    while (token == LT_AND);
+
+    if (conds)
+    {
+        free_tree(conds);
+    }
+    return NULL;
 }
 
 /**
@@ -306,6 +419,8 @@ static struct
     { "clear",      LT_CLEAR},
     { "shutdown",   LT_SHUTDOWN},
     { "restart",    LT_RESTART},
+    { "where",      LT_WHERE},
+    { "and",        LT_AND},
     { NULL, 0}
 };
 
@@ -352,7 +467,12 @@ int	i;
 		}
 	}
 	s2 = s1;
-	while (*s2)
+	if (quote == '\0' && (*s2 == ',' || *s2 == '='))
+	{
+		/** A comma or an equal sign is a token of its own */
+		s2++;
+	}
+	else while (*s2)
 	{
 		if (quote == '\0' && (isspace(*s2)
 				|| *s2 == ',' || *s2 == '='))
@@ -371,6 +491,14 @@ int	i;
 		return s2;
 	}
 
+	if (quote != '\0')
+	{
+		/** A quoted string is never a keyword, the closing quote is skipped */
+		*text = strndup(s1, s2 - s1);
+		*token = LT_STRING;
+		return *s2 ? s2 + 1 : s2;
+	}
+
 	if (s1 == s2)
 	{
 		*text = NULL;
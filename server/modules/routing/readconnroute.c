@@ -66,6 +66,12 @@
  * 09/09/2015   Martin Brampton         Modify error handler
  * 25/09/2015   Martin Brampton         Block callback processing when no router session in the DCB
  * 09/11/2015   Martin Brampton         Modified routeQuery - must free "queue" regardless of outcome
+ * 14/10/2016   Core Team               Added the passthrough=splice option
+ * 15/10/2016   Core Team               Per-thread connection counts, choose the less
+ *                                      loaded of two random servers
+ * 15/10/2016   Core Team               Added the affinity option
+ * 15/10/2016   Core Team               Per-server statistics of the routed traffic
+ * 15/10/2016   Core Team               Scale the weights by the load weights of the monitor
  *
  * @endverbatim
  */
@@ -82,6 +88,8 @@
 #include <dcb.h>
 #include <spinlock.h>
 #include <modinfo.h>
+#include <platform.h>
+#include <random_jkiss.h>
 
 #include <skygw_types.h>
 #include <skygw_utils.h>
@@ -133,7 +141,7 @@ static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES* rses);
 
 static void rses_end_locked_router_action(ROUTER_CLIENT_SES* rses);
 
-static BACKEND *get_root_master(BACKEND **servers);
+static BACKEND *get_root_master(BACKEND **servers, SERVER_STATES *states);
 static int handle_state_switch(DCB* dcb, DCB_REASON reason, void * routersession);
 static SPINLOCK instlock;
 static ROUTER_INSTANCE *instances;
@@ -183,6 +191,7 @@ static inline void free_readconn_instance(ROUTER_INSTANCE *router)
         {
             for (int i = 0; router->servers[i]; i++)
             {
+                ts_stats_free(router->servers[i]->connections);
                 free(router->servers[i]);
             }
         }
@@ -243,11 +252,21 @@ createInstance(SERVICE *service, char **options)
             return NULL;
         }
         inst->servers[n]->server = sref->server;
-        inst->servers[n]->current_connection_count = 0;
         inst->servers[n]->weight = 1000;
+        inst->servers[n]->stats = serviceGetBackendStats(service, sref->server);
+
+        if (inst->servers[n]->stats == NULL ||
+            (inst->servers[n]->connections = ts_stats_alloc()) == NULL)
+        {
+            free(inst->servers[n]);
+            inst->servers[n] = NULL;
+            free_readconn_instance(inst);
+            return NULL;
+        }
         n++;
     }
     inst->servers[n] = NULL;
+    inst->n_servers = n;
 
     if ((weightby = serviceGetWeightingParameter(service)) != NULL)
     {
@@ -350,12 +369,34 @@ createInstance(SERVICE *service, char **options)
                 inst->bitmask |= (SERVER_NDB);
                 inst->bitvalue |= SERVER_NDB;
             }
+            else if (!strncasecmp(options[i], "affinity=", 9))
+            {
+                if (!affinity_parse_key(options[i] + 9, &inst->affinity))
+                {
+                    MXS_ERROR("Unknown value for router option 'affinity' of "
+                              "service '%s': %s. Expected client, user or database.",
+                              service->name, options[i] + 9);
+                    error = true;
+                }
+            }
+            else if (!strcasecmp(options[i], "passthrough=splice"))
+            {
+                if (service->n_filters > 0)
+                {
+                    MXS_WARNING("Service '%s' has filters, the router option "
+                                "'%s' is ignored.", service->name, options[i]);
+                }
+                else
+                {
+                    inst->splice = true;
+                }
+            }
             else
             {
                 MXS_WARNING("Unsupported router "
                             "option \'%s\' for readconnroute. "
                             "Expected router options are "
-                            "[slave|master|synced|ndb|running]",
+                            "[slave|master|synced|ndb|running|affinity=<key>|passthrough=splice]",
                             options[i]);
                 error = true;
             }
@@ -387,6 +428,108 @@ createInstance(SERVICE *service, char **options)
     return(ROUTER *) inst;
 }
 
+/** State of the random number generator of the calling thread */
+static thread_local uint32_t random_state = 0;
+
+/**
+ * A xorshift random number generator that is seeded once per thread, so that
+ * the threads don't contend on a shared generator.
+ */
+static uint32_t
+next_random()
+{
+    if (random_state == 0)
+    {
+        random_state = random_jkiss() | 1;
+    }
+
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+/**
+ * The number of connections of a server in relation to its weight and the
+ * load weight set by the monitor
+ */
+static int64_t
+backend_load(BACKEND *backend)
+{
+    return (ts_stats_sum(backend->connections) + 1) * 1000 /
+           SERVER_WEIGHT(backend->server, backend->weight);
+}
+
+/**
+ * Choose the less loaded of two random servers. If the server with the least
+ * connections was always chosen, all the sessions created at the same time
+ * would go to the same server before its connection count is updated. Ties
+ * are broken by the number of connections over time.
+ *
+ * @param candidates    The eligible servers
+ * @param n             Number of eligible servers, at least one
+ * @return The chosen server
+ */
+static BACKEND *
+choose_backend(BACKEND **candidates, int n)
+{
+    if (n == 1)
+    {
+        return candidates[0];
+    }
+
+    int a = next_random() % n;
+    int b = next_random() % (n - 1);
+
+    if (b >= a)
+    {
+        b++;
+    }
+
+    BACKEND *first = candidates[a];
+    BACKEND *second = candidates[b];
+    int64_t first_load = backend_load(first);
+    int64_t second_load = backend_load(second);
+
+    if (second_load < first_load ||
+        (second_load == first_load &&
+         second->server->stats.n_connections < first->server->stats.n_connections))
+    {
+        return second;
+    }
+
+    return first;
+}
+
+/**
+ * Choose the server that gets the highest score for the key of a session
+ *
+ * @param candidates    The eligible servers
+ * @param n             Number of eligible servers, at least one
+ * @param key           The key of the session
+ * @return The chosen server
+ */
+static BACKEND *
+choose_affinity_backend(BACKEND **candidates, int n, const char *key)
+{
+    BACKEND *best = candidates[0];
+    double best_score = affinity_score(key, best->server->unique_name, best->weight);
+
+    for (int i = 1; i < n; i++)
+    {
+        double score = affinity_score(key, candidates[i]->server->unique_name,
+                                      candidates[i]->weight);
+
+        if (score > best_score)
+        {
+            best = candidates[i];
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
 /**
  * Associate a new session with this instance of the router.
  *
@@ -402,6 +545,8 @@ newSession(ROUTER *instance, SESSION *session)
     BACKEND *candidate = NULL;
     int i;
     BACKEND *master_host = NULL;
+    /** All servers are examined in the same published state */
+    SERVER_STATES *states = server_states();
 
     MXS_DEBUG("%lu [newSession] new router session with session "
               "%p, and inst %p.",
@@ -426,7 +571,7 @@ newSession(ROUTER *instance, SESSION *session)
     /**
      * Find the Master host from available servers
      */
-    master_host = get_root_master(inst->servers);
+    master_host = get_root_master(inst->servers, states);
 
     /**
      * Find a backend server to connect to. This is the extent of the
@@ -435,32 +580,28 @@ newSession(ROUTER *instance, SESSION *session)
      */
 
     /*
-     * Loop over all the servers and find any that have fewer connections
-     * than the candidate server.
-     *
-     * If a server has less connections than the current candidate we mark this
-     * as the new candidate to connect to.
-     *
-     * If a server has the same number of connections currently as the candidate
-     * and has had less connections over time than the candidate it will also
-     * become the new candidate. This has the effect of spreading the
-     * connections over different servers during periods of very low load.
+     * Collect the servers that are eligible for the session. Unless the
+     * root master is requested, the session is given to the server its key
+     * hashes to or, without affinity, to the less loaded of two of them
+     * chosen at random.
      */
+    BACKEND *candidates[inst->n_servers + 1];
+    int n_candidates = 0;
+
     for (i = 0; inst->servers[i]; i++)
     {
-        if (inst->servers[i])
-        {
-            MXS_DEBUG("%lu [newSession] Examine server in port %d with "
-                      "%d connections. Status is %s, "
-                      "inst->bitvalue is %d",
-                      pthread_self(),
-                      inst->servers[i]->server->port,
-                      inst->servers[i]->current_connection_count,
-                      STRSRVSTATUS(inst->servers[i]->server),
-                      inst->bitmask);
-        }
-
-        if (SERVER_IN_MAINT(inst->servers[i]->server))
+        SERVER_STATE state = server_get_state(states, inst->servers[i]->server);
+
+        MXS_DEBUG("%lu [newSession] Examine server in port %d with "
+                  "%ld connections. Status is %s, "
+                  "inst->bitvalue is %d",
+                  pthread_self(),
+                  inst->servers[i]->server->port,
+                  ts_stats_sum(inst->servers[i]->connections),
+                  STRSRVSTATUS(inst->servers[i]->server),
+                  inst->bitmask);
+
+        if (SERVER_IN_MAINT(&state))
         {
             continue;
         }
@@ -471,9 +612,8 @@ newSession(ROUTER *instance, SESSION *session)
         }
 
         /* Check server status bits against bitvalue from router_options */
-        if (inst->servers[i] &&
-            SERVER_IS_RUNNING(inst->servers[i]->server) &&
-            (inst->servers[i]->server->status & inst->bitmask & inst->bitvalue))
+        if (SERVER_IS_RUNNING(&state) &&
+            (state.status & inst->bitmask & inst->bitvalue))
         {
             if (master_host)
             {
@@ -506,42 +646,23 @@ newSession(ROUTER *instance, SESSION *session)
                  */
                 if (inst->bitvalue & SERVER_MASTER)
                 {
-                    candidate = NULL;
+                    n_candidates = 0;
                     break;
                 }
             }
 
-            /* If no candidate set, set first running server as
-            our initial candidate server */
-            if (candidate == NULL)
-            {
-                candidate = inst->servers[i];
-            }
-            else if (((inst->servers[i]->current_connection_count + 1)
-                      * 1000) / inst->servers[i]->weight <
-                     ((candidate->current_connection_count + 1) *
-                      1000) / candidate->weight)
-            {
-                /* This running server has fewer
-                connections, set it as a new candidate */
-                candidate = inst->servers[i];
-            }
-            else if (((inst->servers[i]->current_connection_count + 1)
-                      * 1000) / inst->servers[i]->weight ==
-                     ((candidate->current_connection_count + 1) *
-                      1000) / candidate->weight &&
-                     inst->servers[i]->server->stats.n_connections <
-                     candidate->server->stats.n_connections)
-            {
-                /* This running server has the same number
-                of connections currently as the candidate
-                but has had fewer connections over time
-                than candidate, set this server to candidate*/
-                candidate = inst->servers[i];
-            }
+            candidates[n_candidates++] = inst->servers[i];
         }
     }
 
+    if (candidate == NULL && n_candidates > 0)
+    {
+        const char *key = affinity_session_key(inst->affinity, session);
+
+        candidate = key ? choose_affinity_backend(candidates, n_candidates, key) :
+                    choose_backend(candidates, n_candidates);
+    }
+
     /* There is no candidate server here!
      * With router_option=slave a master_host could be set, so route traffic there.
      * Otherwise, just clean up and return NULL
@@ -565,16 +686,15 @@ newSession(ROUTER *instance, SESSION *session)
     client_rses->rses_capabilities = RCAP_TYPE_PACKET_INPUT;
 
     /*
-     * We now have the server with the least connections.
-     * Bump the connection count for this server
+     * Bump the connection count for the chosen server
      */
-    atomic_add(&candidate->current_connection_count, 1);
+    ts_stats_add(candidate->connections, 1);
     client_rses->backend = candidate;
     MXS_DEBUG("%lu [newSession] Selected server in port %d. "
-              "Connections : %d\n",
+              "Connections : %ld\n",
               pthread_self(),
               candidate->server->port,
-              candidate->current_connection_count);
+              ts_stats_sum(candidate->connections));
 
     /*
      * Open a backend connection, putting the DCB for this
@@ -585,7 +705,7 @@ newSession(ROUTER *instance, SESSION *session)
                                            candidate->server->protocol);
     if (client_rses->backend_dcb == NULL)
     {
-        atomic_add(&candidate->current_connection_count, -1);
+        ts_stats_add(candidate->connections, -1);
         free(client_rses);
         return NULL;
     }
@@ -607,9 +727,9 @@ newSession(ROUTER *instance, SESSION *session)
     CHK_CLIENT_RSES(client_rses);
 
     MXS_INFO("Readconnroute: New session for server %s. "
-             "Connections : %d",
+             "Connections : %ld",
              candidate->server->unique_name,
-             candidate->current_connection_count);
+             ts_stats_sum(candidate->connections));
 
     return(void *) client_rses;
 }
@@ -636,10 +756,8 @@ static void freeSession(ROUTER* router_instance, void* router_client_ses)
     ROUTER_INSTANCE* router = (ROUTER_INSTANCE *) router_instance;
     ROUTER_CLIENT_SES* router_cli_ses =
         (ROUTER_CLIENT_SES *) router_client_ses;
-    int prev_val;
 
-    prev_val = atomic_add(&router_cli_ses->backend->current_connection_count, -1);
-    ss_dassert(prev_val > 0);
+    ts_stats_add(router_cli_ses->backend->connections, -1);
 
     spinlock_acquire(&router->lock);
 
@@ -664,12 +782,12 @@ static void freeSession(ROUTER* router_instance, void* router_client_ses)
     spinlock_release(&router->lock);
 
     MXS_DEBUG("%lu [freeSession] Unlinked router_client_session %p from "
-              "router %p and from server on port %d. Connections : %d. ",
+              "router %p and from server on port %d. Connections : %ld. ",
               pthread_self(),
               router_cli_ses,
               router,
               router_cli_ses->backend->server->port,
-              prev_val - 1);
+              ts_stats_sum(router_cli_ses->backend->connections));
 
     free(router_cli_ses);
 }
@@ -771,6 +889,11 @@ routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
     }
 
     char* trc = NULL;
+    BACKEND_STATS *stats = router_cli_ses->backend->stats;
+    int len = gwbuf_length(queue);
+
+    session_latency_target(backend_dcb->session, backend_dcb->server,
+                           SERVER_IS_MASTER(backend_dcb->server));
 
     switch (mysql_command)
     {
@@ -788,6 +911,13 @@ routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
             break;
     }
 
+    if (rc)
+    {
+        ts_stats_add(stats->queries, 1);
+        ts_stats_add(stats->bytes_out, len);
+        router_cli_ses->query_start = latency_now();
+    }
+
     MXS_INFO("Routed [%s] to '%s'%s%s",
              STRPACKETTYPE(mysql_command),
              backend_dcb->server->unique_name,
@@ -829,6 +959,11 @@ diagnostics(ROUTER *router, DCB *dcb)
     dcb_printf(dcb, "\tCurrent no. of router sessions:	%d\n", i);
     dcb_printf(dcb, "\tNumber of queries forwarded:   	%d\n",
                router_inst->stats.n_queries);
+    if (router_inst->splice)
+    {
+        dcb_printf(dcb, "\tNumber of spliced sessions:   	%d\n",
+                   router_inst->stats.n_spliced);
+    }
     if ((weightby = serviceGetWeightingParameter(router_inst->service))
         != NULL)
     {
@@ -840,19 +975,30 @@ diagnostics(ROUTER *router, DCB *dcb)
         for (i = 0; router_inst->servers[i]; i++)
         {
             backend = router_inst->servers[i];
-            dcb_printf(dcb, "\t\t%-20s %3.1f%%     %d\n",
+            dcb_printf(dcb, "\t\t%-20s %3.1f%%     %ld\n",
                        backend->server->unique_name,
                        (float) backend->weight / 10,
-                       backend->current_connection_count);
+                       ts_stats_sum(backend->connections));
         }
 
     }
+
+    dcb_printf(dcb, "\tTraffic routed to the servers:\n");
+    dcb_printf(dcb, BACKEND_STATS_HEADER);
+    for (i = 0; router_inst->servers[i]; i++)
+    {
+        backend = router_inst->servers[i];
+        dprintBackendStats(dcb, backend->server, backend->stats);
+    }
 }
 
 /**
  * Client Reply routine
  *
- * The routine will reply to client data from backend server
+ * The routine will reply to client data from backend server. With the
+ * passthrough=splice option the client and backend connections are spliced
+ * after the first reply, by which time both connections are authenticated.
+ * From then on the data is not seen by the router.
  *
  * @param       instance        The router instance
  * @param       router_session  The router session
@@ -862,8 +1008,36 @@ diagnostics(ROUTER *router, DCB *dcb)
 static void
 clientReply(ROUTER *instance, void *router_session, GWBUF *queue, DCB *backend_dcb)
 {
+    ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *) instance;
+    ROUTER_CLIENT_SES *router_cli_ses = (ROUTER_CLIENT_SES *) router_session;
+
+    BACKEND_STATS *stats = router_cli_ses->backend->stats;
+
     ss_dassert(backend_dcb->session->client_dcb != NULL);
+    ts_stats_add(stats->bytes_in, gwbuf_length(queue));
+
+    /** The response time is the time to the first packet of the reply */
+    if (router_cli_ses->query_start)
+    {
+        ts_histogram_add(stats->latency, latency_now() - router_cli_ses->query_start);
+        router_cli_ses->query_start = 0;
+    }
+
     SESSION_ROUTE_REPLY(backend_dcb->session, queue);
+
+    if (inst->splice && !router_cli_ses->splice_tried)
+    {
+        router_cli_ses->splice_tried = true;
+        if (dcb_splice(router_cli_ses->client_dcb, backend_dcb))
+        {
+            atomic_add(&inst->stats.n_spliced, 1);
+        }
+        else
+        {
+            MXS_INFO("Could not splice the connections of session %p, "
+                     "routing it normally.", backend_dcb->session);
+        }
+    }
 }
 
 /**
@@ -920,6 +1094,7 @@ static void handleError(ROUTER *instance, void *router_session, GWBUF *errbuf,
     }
     else if (router_cli_ses && problem_dcb == router_cli_ses->backend_dcb)
     {
+        ts_stats_add(router_cli_ses->backend->stats->errors, 1);
         router_cli_ses->backend_dcb = NULL;
         dcb_close(problem_dcb);
     }
@@ -1002,25 +1177,30 @@ static int getCapabilities()
  * Servers are checked even if they are in 'maintenance'
  *
  * @param servers	The list of servers
+ * @param states	The server states to use
  * @return		The Master found
  *
  */
 
-static BACKEND *get_root_master(BACKEND **servers)
+static BACKEND *get_root_master(BACKEND **servers, SERVER_STATES *states)
 {
     int i = 0;
     BACKEND *master_host = NULL;
+    SERVER_STATE master_state;
 
     for (i = 0; servers[i]; i++)
     {
-        if (servers[i] && (servers[i]->server->status & (SERVER_MASTER | SERVER_MAINT)) == SERVER_MASTER)
+        SERVER_STATE state = server_get_state(states, servers[i]->server);
+
+        if ((state.status & (SERVER_MASTER | SERVER_MAINT)) == SERVER_MASTER)
         {
             if (master_host == NULL)
             {
                 master_host = servers[i];
+                master_state = state;
             }
-            else if (servers[i]->server->depth < master_host->server->depth ||
-                    (servers[i]->server->depth == master_host->server->depth &&
+            else if (state.depth < master_state.depth ||
+                    (state.depth == master_state.depth &&
                      servers[i]->weight > master_host->weight))
             {
                 /**
@@ -1028,6 +1208,7 @@ static BACKEND *get_root_master(BACKEND **servers)
                  * the depths are equal but this master has a higher weight
                  */
                 master_host = servers[i];
+                master_state = state;
             }
         }
     }
@@ -16,6 +16,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <ctype.h>
 
 #include <router.h>
 #include <readwritesplit.h>
@@ -30,6 +31,11 @@
 #include <modutil.h>
 #include <mysql_client_server_protocol.h>
 #include <mysqld_error.h>
+#include <random_jkiss.h>
+#include <memstats.h>
+#include <hash.h>
+#include <resultset.h>
+#include <maxscale/poll.h>
 
 MODULE_INFO info =
 {
@@ -43,6 +49,9 @@ MODULE_INFO info =
 
 #define RWSPLIT_TRACE_MSG_LEN 1000
 
+/** The router session properties allocated at a time */
+#define RWSPLIT_PROPS_PER_SLAB 16
+
 /**
  * @file readwritesplit.c   The entry points for the read/write query splitting
  * router module.
@@ -65,6 +74,7 @@ MODULE_INFO info =
  * 09/09/2015    Martin Brampton     Modify error handler
  * 25/09/2015    Martin Brampton     Block callback processing when no router
  * session in the DCB
+ * 15/10/2016    Core Team           Hedged reads
  *
  * @endverbatim
  */
@@ -90,6 +100,8 @@ static int router_get_servercount(ROUTER_INSTANCE *router);
 static int rses_get_max_slavecount(ROUTER_CLIENT_SES *rses,
                                    int router_nservers);
 static int rses_get_max_replication_lag(ROUTER_CLIENT_SES *rses);
+static int parse_rlag_ms(const char *value);
+static bool rlag_is_within(long rlag_us, int max_rlag);
 static backend_ref_t *get_bref_from_dcb(ROUTER_CLIENT_SES *rses, DCB *dcb);
 static DCB *rses_get_client_dcb(ROUTER_CLIENT_SES *rses);
 
@@ -103,8 +115,13 @@ static qc_query_type_t is_read_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
 static void check_create_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
                                    GWBUF *querybuf, qc_query_type_t type);
 
+static qc_query_type_t get_prepared_stmt_type(ROUTER_CLIENT_SES *rses,
+                                              GWBUF *querybuf);
+
 static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
                               GWBUF *querybuf);
+static bool route_stream(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                         GWBUF *querybuf);
 
 static int getCapabilities();
 
@@ -126,6 +143,10 @@ int bref_cmp_behind_master(const void *bref1, const void *bref2);
 
 int bref_cmp_current_load(const void *bref1, const void *bref2);
 
+int bref_cmp_response_time(const void *bref1, const void *bref2);
+
+int bref_cmp_affinity(const void *bref1, const void *bref2);
+
 /**
  * The order of functions _must_ match with the order the select criteria are
  * listed in select_criteria_t definition in readwritesplit.h
@@ -136,7 +157,9 @@ int (*criteria_cmpfun[LAST_CRITERIA])(const void *, const void *) =
     bref_cmp_global_conn,
     bref_cmp_router_conn,
     bref_cmp_behind_master,
-    bref_cmp_current_load
+    bref_cmp_current_load,
+    bref_cmp_response_time,
+    bref_cmp_affinity
 };
 
 static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
@@ -148,10 +171,18 @@ static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
                                            ROUTER_INSTANCE *router);
 
 static bool get_dcb(DCB **dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
-                    char *name, int max_rlag);
+                    char *name, int name_id, int max_rlag, POOL_RULE *pool);
 
 static bool rwsplit_process_router_options(ROUTER_INSTANCE *router,
                                            char **options);
+static void pool_rules_free(POOL_RULES *rules);
+static bool server_in_pool(SERVER *server, POOL_RULE *rule);
+static bool server_in_any_pool(SERVER *server, POOL_RULES *rules);
+static POOL_RULE *pool_rule_match(ROUTER_CLIENT_SES *rses, GWBUF *querybuf);
+static backend_ref_t *connect_pool_slave(ROUTER_CLIENT_SES *rses, POOL_RULE *pool);
+static backend_ref_t *get_write_hash_bref(ROUTER_CLIENT_SES *rses, GWBUF *querybuf,
+                                          mysql_server_cmd_t packet_type,
+                                          qc_query_type_t qtype);
 
 
 
@@ -181,7 +212,7 @@ static mysql_sescmd_t *mysql_sescmd_init(rses_property_t *rses_prop,
 
 static rses_property_t *mysql_sescmd_get_property(mysql_sescmd_t *scmd);
 
-static rses_property_t *rses_property_init(rses_property_type_t prop_type);
+static rses_property_t *rses_property_init(ROUTER_CLIENT_SES *rses, rses_property_type_t prop_type);
 
 static int rses_property_add(ROUTER_CLIENT_SES *rses, rses_property_t *prop);
 
@@ -191,6 +222,10 @@ static mysql_sescmd_t *rses_property_get_sescmd(rses_property_t *prop);
 
 static bool execute_sescmd_history(backend_ref_t *bref);
 
+static char *get_sescmd_compaction_key(GWBUF *buf, unsigned char packet_type);
+
+static void compact_sescmd_history(ROUTER_CLIENT_SES *rses, const char *key);
+
 static bool execute_sescmd_in_backend(backend_ref_t *backend_ref);
 
 static void sescmd_cursor_reset(sescmd_cursor_t *scur);
@@ -223,6 +258,10 @@ static void refreshInstance(ROUTER_INSTANCE *router, CONFIG_PARAMETER *param);
 
 static void bref_clear_state(backend_ref_t *bref, bref_state_t state);
 static void bref_set_state(backend_ref_t *bref, bref_state_t state);
+static void bref_update_response_time(backend_ref_t *bref);
+static select_criteria_t get_select_criteria(select_criteria_t sc);
+static bool bref_has_replicated_write(backend_ref_t *bref, SERVER_GTID_POS *master_pos,
+                                      uint64_t last_write);
 static sescmd_cursor_t *backend_ref_get_sescmd_cursor(backend_ref_t *bref);
 
 static int router_handle_state_switch(DCB *dcb, DCB_REASON reason, void *data);
@@ -241,12 +280,42 @@ static bool have_enough_servers(ROUTER_CLIENT_SES **rses, const int nsrv,
 
 static SPINLOCK instlock;
 static ROUTER_INSTANCE *instances;
+static int rwsplit_memtag = MEMSTATS_OTHER; /*< The tag of the sessions in the memory statistics */
+static int rwsplit_rlag_hint_id = 0; /*< The ID of max_slave_replication_lag in the hints */
+static int rwsplit_pool_hint_id = 0; /*< The ID of pool in the hints */
 
 static int hashkeyfun(void *key);
 static int hashcmpfun(void *, void *);
 static bool check_for_multi_stmt(ROUTER_CLIENT_SES *rses, GWBUF *buf,
-                                 mysql_server_cmd_t packet_type);
+                                 mysql_server_cmd_t packet_type,
+                                 qc_query_type_t *qtype);
+static uint32_t get_multi_stmt_type(GWBUF *buf);
 static bool send_readonly_error(DCB *dcb);
+static void connect_pending_slaves(ROUTER_CLIENT_SES *rses);
+static bool get_read_only_trx_target(ROUTER_CLIENT_SES *rses, qc_query_type_t qtype,
+                                     bool trx_started, bool trx_ended,
+                                     backend_ref_t **p_bref);
+static size_t bref_track_reply(backend_ref_t *bref, GWBUF *reply, int n_replies);
+static void bref_map_ps_reply(backend_ref_t *bref, uint32_t id, GWBUF *reply, size_t offset);
+static bool bref_ps_fifo_reserve(backend_ref_t *bref, uint32_t id);
+static GWBUF *bref_ps_clone(backend_ref_t *bref, GWBUF *buf);
+static bool is_lock_stmt(GWBUF *buf);
+static void release_idle_backends(ROUTER_CLIENT_SES *rses);
+static bool reattach_backends(ROUTER_CLIENT_SES *rses);
+static bool rses_reply_pending(ROUTER_CLIENT_SES *rses);
+static bool route_local_query(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                              GWBUF *querybuf);
+static uint32_t local_vars_in_stmt(GWBUF *querybuf);
+static bool parse_local_queries(char *value, uint32_t *enabled);
+static void slave_fallback_arm(ROUTER_CLIENT_SES *rses);
+static bool bref_is_authenticated(backend_ref_t *bref);
+static void slave_fallback_timeout(void *data);
+static bool hedge_allowed(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                          route_target_t route_target, mysql_server_cmd_t packet_type);
+static void hedge_arm(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, GWBUF *querybuf);
+static void hedge_timeout(void *data);
+static void hedge_decide(ROUTER_CLIENT_SES *rses, backend_ref_t *winner);
+static GWBUF *hedge_drain_reply(backend_ref_t *bref, GWBUF *reply);
 
 static int hashkeyfun(void *key)
 {
@@ -254,15 +323,7 @@ static int hashkeyfun(void *key)
     {
         return 0;
     }
-
-    unsigned int hash = 0, c = 0;
-    char *ptr = (char *)key;
-
-    while ((c = *ptr++))
-    {
-        hash = c + (hash << 6) + (hash << 16) - hash;
-    }
-    return hash;
+    return (int)hash_str((char *)key, hash_seed());
 }
 
 static int hashcmpfun(void *v1, void *v2)
@@ -304,6 +365,9 @@ void ModuleInit()
     MXS_NOTICE("Initializing statemend-based read/write split router module.");
     spinlock_init(&instlock);
     instances = NULL;
+    rwsplit_memtag = memstats_tag("readwritesplit");
+    rwsplit_rlag_hint_id = hint_name_id("max_slave_replication_lag");
+    rwsplit_pool_hint_id = hint_name_id("pool");
 }
 
 /**
@@ -473,10 +537,83 @@ static inline void free_rwsplit_instance(ROUTER_INSTANCE *router)
             }
         }
         free(router->servers);
+        snapshot_discard(snapshot_get(&router->rwsplit_snapshot));
+
+        while (router->pool_rules)
+        {
+            POOL_RULES *rules = router->pool_rules;
+            router->pool_rules = rules->next;
+            pool_rules_free(rules);
+        }
         free(router);
     }
 }
 
+/**
+ * Publish the configuration of the router as a new snapshot
+ *
+ * @param router Router instance
+ * @return True if the snapshot was published
+ */
+static bool rwsplit_publish_config(ROUTER_INSTANCE *router)
+{
+    rwsplit_config_snapshot_t *snap;
+
+    snapshot_write_begin(&router->rwsplit_snapshot);
+
+    if ((snap = snapshot_alloc(sizeof(rwsplit_config_snapshot_t))) != NULL)
+    {
+        snap->config = router->rwsplit_config;
+        snap->version = router->rwsplit_version;
+    }
+
+    snapshot_write_end(&router->rwsplit_snapshot, snap);
+
+    return snap != NULL;
+}
+
+/**
+ * Get the latest configuration of the router
+ *
+ * If the service configuration has changed, a new snapshot is built from it by
+ * one session while the others keep using the current snapshot, the sessions
+ * never wait for each other.
+ *
+ * @param router Router instance
+ * @return The configuration snapshot
+ */
+static rwsplit_config_snapshot_t* rwsplit_get_config(ROUTER_INSTANCE *router)
+{
+    SERVICE *service = router->service;
+    rwsplit_config_snapshot_t *snap = snapshot_get(&router->rwsplit_snapshot);
+
+    if (service->svc_config_version > snap->version &&
+        spinlock_acquire_nowait(&router->config_lock))
+    {
+        if (service->svc_config_version > router->rwsplit_version)
+        {
+            /** The parameters can't change while they are being read */
+            spinlock_acquire(&service->spin);
+            router->rwsplit_version = service->svc_config_version;
+            refreshInstance(router, NULL);
+            rwsplit_process_router_options(router, service->routerOptions);
+            spinlock_release(&service->spin);
+
+            if (!rwsplit_publish_config(router))
+            {
+                MXS_ERROR("%s: Failed to allocate memory for the new configuration, "
+                          "the sessions keep using the old one.", service->name);
+                router->rwsplit_version = snap->version;
+            }
+        }
+
+        spinlock_release(&router->config_lock);
+        snap = snapshot_get(&router->rwsplit_snapshot);
+    }
+
+    return snap;
+}
+
 /**
  * Create an instance of read/write statement router within the MaxScale.
  *
@@ -500,6 +637,8 @@ static ROUTER *createInstance(SERVICE *service, char **options)
     }
     router->service = service;
     spinlock_init(&router->lock);
+    spinlock_init(&router->config_lock);
+    spinlock_init(&router->rwsplit_snapshot.lock);
 
     /** Calculate number of servers */
     sref = service->dbref;
@@ -537,6 +676,19 @@ static ROUTER *createInstance(SERVICE *service, char **options)
         router->servers[nservers]->backend_conn_count = 0;
         router->servers[nservers]->be_valid = false;
         router->servers[nservers]->weight = 1000;
+        router->servers[nservers]->backend_response_time = 0;
+        router->servers[nservers]->backend_hedge_delay = 0;
+        router->servers[nservers]->backend_hedge_updated = 0;
+        router->servers[nservers]->backend_stats = serviceGetBackendStats(service, sref->server);
+        router->servers[nservers]->hint_id = hint_name_id(sref->server->unique_name);
+
+        if (router->servers[nservers]->backend_stats == NULL)
+        {
+            free(router->servers[nservers]);
+            router->servers[nservers] = NULL;
+            free_rwsplit_instance(router);
+            return NULL;
+        }
 #if defined(SS_DEBUG)
         router->servers[nservers]->be_chk_top = CHK_NUM_BACKEND;
         router->servers[nservers]->be_chk_tail = CHK_NUM_BACKEND;
@@ -629,10 +781,19 @@ static ROUTER *createInstance(SERVICE *service, char **options)
     /** Enable strict multistatement handling by default */
     router->rwsplit_config.rw_strict_multi_stmt = true;
 
+    /** Compact the session command history by default */
+    router->rwsplit_config.rw_compact_sescmd_hist = true;
+
     /** By default, the client connection is closed immediately when a master
      * failure is detected */
     router->rwsplit_config.rw_master_failure_mode = RW_FAIL_INSTANTLY;
 
+    /** The AFFINITY criteria hashes the client address by default */
+    router->rwsplit_config.rw_affinity_key = AFFINITY_CLIENT;
+
+    /** At most one read in ten is hedged by default */
+    router->rwsplit_config.rw_hedge_budget = RW_HEDGE_BUDGET_DEFAULT;
+
     /** Call this before refreshInstance */
     if (options && !rwsplit_process_router_options(router, options))
     {
@@ -688,6 +849,13 @@ static ROUTER *createInstance(SERVICE *service, char **options)
     {
         refreshInstance(router, param);
     }
+
+    if (!rwsplit_publish_config(router))
+    {
+        free_rwsplit_instance(router);
+        return NULL;
+    }
+
     /**
      * We have completed the creation of the router data, so now
      * insert this router into the linked list of routers
@@ -725,13 +893,20 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
     int i;
     const int min_nservers = 1; /*< hard-coded for now */
 
-    client_rses = (ROUTER_CLIENT_SES *)calloc(1, sizeof(ROUTER_CLIENT_SES));
+    router_nservers = router_get_servercount(router);
+
+    /** The backend references are allocated with the session */
+    client_rses = (ROUTER_CLIENT_SES *)memstats_calloc(rwsplit_memtag, 1, sizeof(ROUTER_CLIENT_SES) +
+                                                       router_nservers * sizeof(backend_ref_t));
 
     if (client_rses == NULL)
     {
         ss_dassert(false);
         goto return_rses;
     }
+    backend_ref = (backend_ref_t *)(client_rses + 1);
+    slab_init(&client_rses->rses_prop_pool, sizeof(rses_property_t),
+              RWSPLIT_PROPS_PER_SLAB, rwsplit_memtag);
 #if defined(SS_DEBUG)
     client_rses->rses_chk_top = CHK_NUM_ROUTER_SES;
     client_rses->rses_chk_tail = CHK_NUM_ROUTER_SES;
@@ -739,25 +914,11 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
 
     client_rses->router = router;
     client_rses->client_dcb = session->client_dcb;
-    /**
-     * If service config has been changed, reload config from service to
-     * router instance first.
-     */
-    spinlock_acquire(&router->lock);
-
-    if (router->service->svc_config_version > router->rwsplit_version)
-    {
-        /** re-read all parameters to rwsplit config structure */
-        refreshInstance(router, NULL); /*< scan through all parameters */
-        /** increment rwsplit router's config version number */
-        router->rwsplit_version = router->service->svc_config_version;
-        /** Read options */
-        rwsplit_process_router_options(router, router->service->routerOptions);
-    }
-    /** Copy config struct from router instance */
-    memcpy(&client_rses->rses_config, &router->rwsplit_config, sizeof(rwsplit_config_t));
-
-    spinlock_release(&router->lock);
+    timer_init(&client_rses->rses_fallback_timer, slave_fallback_timeout, client_rses);
+    timer_init(&client_rses->rses_hedge_timer, hedge_timeout, client_rses);
+    /** Copy the latest configuration, the session uses it until it is closed */
+    memcpy(&client_rses->rses_config, &rwsplit_get_config(router)->config,
+           sizeof(rwsplit_config_t));
     /**
      * Set defaults to session variables.
      */
@@ -765,26 +926,20 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
     client_rses->rses_transaction_active = false;
     client_rses->have_tmp_tables = false;
     client_rses->forced_node = NULL;
-
-    router_nservers = router_get_servercount(router);
+    client_rses->rses_ro_trx_server = NULL;
+    client_rses->rses_ro_trx_next = false;
 
     if (!have_enough_servers(&client_rses, min_nservers, router_nservers, router))
     {
         goto return_rses;
     }
-    /**
-     * Create backend reference objects for this session.
-     */
-    backend_ref = (backend_ref_t *)calloc(1, router_nservers * sizeof(backend_ref_t));
+    const char *affinity_key = NULL;
 
-    if (backend_ref == NULL)
+    if (client_rses->rses_config.rw_slave_select_criteria == AFFINITY)
     {
-        /** log this */
-        free(client_rses);
-        free(backend_ref);
-        client_rses = NULL;
-        goto return_rses;
+        affinity_key = affinity_session_key(client_rses->rses_config.rw_affinity_key, session);
     }
+
     /**
      * Initialize backend references with BACKEND ptr.
      * Initialize session command cursors for each backend reference.
@@ -805,6 +960,13 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
         backend_ref[i].bref_sescmd_cur.scmd_cur_ptr_property =
             &client_rses->rses_properties[RSES_PROP_TYPE_SESCMD];
         backend_ref[i].bref_sescmd_cur.scmd_cur_cmd = NULL;
+
+        if (affinity_key)
+        {
+            backend_ref[i].bref_affinity =
+                affinity_score(affinity_key, router->servers[i]->backend_server->unique_name,
+                               router->servers[i]->weight);
+        }
     }
     max_nslaves = rses_get_max_slavecount(client_rses, router_nservers);
     max_slave_rlag = rses_get_max_replication_lag(client_rses);
@@ -821,16 +983,34 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
 
     if (!succp)
     {
-        free(client_rses->rses_backend_ref);
-        free(client_rses);
+        memstats_free(rwsplit_memtag, client_rses);
         client_rses = NULL;
         goto return_rses;
     }
+    /**
+     * With lazy_connect, only the master is connected here. The slaves get the
+     * session command history when they are connected.
+     */
+    client_rses->rses_slaves_pending = client_rses->rses_config.rw_lazy_connect &&
+                                       !client_rses->rses_config.rw_disable_sescmd_hist;
+
     succp = select_connect_backend_servers(&master_ref, backend_ref, router_nservers,
-                                           max_nslaves, max_slave_rlag,
+                                           client_rses->rses_slaves_pending ? 0 : max_nslaves,
+                                           max_slave_rlag,
                                            client_rses->rses_config.rw_slave_select_criteria,
                                            session, router);
 
+    if (succp && client_rses->rses_slaves_pending &&
+        (master_ref == NULL || !BREF_IS_IN_USE(master_ref)))
+    {
+        /** Without a master, the slaves are needed right away */
+        client_rses->rses_slaves_pending = false;
+        succp = select_connect_backend_servers(&master_ref, backend_ref, router_nservers,
+                                               max_nslaves, max_slave_rlag,
+                                               client_rses->rses_config.rw_slave_select_criteria,
+                                               session, router);
+    }
+
     rses_end_locked_router_action(client_rses);
 
     /**
@@ -840,8 +1020,7 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
      */
     if (!succp)
     {
-        free(client_rses->rses_backend_ref);
-        free(client_rses);
+        memstats_free(rwsplit_memtag, client_rses);
         client_rses = NULL;
         goto return_rses;
     }
@@ -874,6 +1053,8 @@ static void *newSession(ROUTER *router_inst, SESSION *session)
     router->connections = client_rses;
     spinlock_release(&router->lock);
 
+    slave_fallback_arm(client_rses);
+
 return_rses:
 #if defined(SS_DEBUG)
     if (client_rses != NULL)
@@ -922,6 +1103,8 @@ static void closeSession(ROUTER *instance, void *router_session)
          * without checking this first.
          */
         router_cli_ses->rses_closed = true;
+        gwbuf_free(router_cli_ses->rses_hedge_query);
+        router_cli_ses->rses_hedge_query = NULL;
 
         for (i = 0; i < router_cli_ses->rses_nbackends; i++)
         {
@@ -968,9 +1151,19 @@ static void closeSession(ROUTER *instance, void *router_session)
                     bref_clear_state(bref, BREF_WAITING_RESULT);
                 }
             }
+
+            /** Discard the statements that were queued behind session commands */
+            gwbuf_free(bref->bref_pending_cmd);
+            bref->bref_pending_cmd = NULL;
+            bref->bref_n_queued = 0;
+            bref->bref_n_batch = 0;
         }
         /** Unlock */
         rses_end_locked_router_action(router_cli_ses);
+
+        /** The closed session doesn't add the timers back */
+        timer_remove(&router_cli_ses->rses_fallback_timer);
+        timer_remove(&router_cli_ses->rses_hedge_timer);
     }
 }
 
@@ -1014,8 +1207,8 @@ static void freeSession(ROUTER *router_instance, void *router_client_session)
     spinlock_release(&router->lock);
 
     /**
-     * For each property type, walk through the list, finalize properties
-     * and free the allocated memory.
+     * For each property type, walk through the list and finalize the
+     * properties, their memory is released with the pool.
      */
     for (i = RSES_PROP_TYPE_FIRST; i < RSES_PROP_TYPE_COUNT; i++)
     {
@@ -1034,8 +1227,13 @@ static void freeSession(ROUTER *router_instance, void *router_client_session)
      * all the memory and other resources associated
      * to the client session.
      */
-    free(router_cli_ses->rses_backend_ref);
-    free(router_cli_ses);
+    for (i = 0; i < router_cli_ses->rses_nbackends; i++)
+    {
+        free(router_cli_ses->rses_backend_ref[i].bref_ps_ids);
+        free(router_cli_ses->rses_backend_ref[i].bref_ps_fifo);
+    }
+    slab_release(&router_cli_ses->rses_prop_pool);
+    memstats_free(rwsplit_memtag, router_cli_ses);
     return;
 }
 
@@ -1051,16 +1249,22 @@ static void freeSession(ROUTER *router_instance, void *router_client_session)
  * @param rses  Pointer to router client session
  * @param btype Backend type
  * @param name  Name of the backend which is primarily searched. May be NULL.
+ * @param name_id The ID of the name in the routing hints, 0 if it has none
+ * @param pool  The pool rule of a slave read, NULL if the read doesn't
+ *              belong to a pool. Without one the slaves of the pools are
+ *              not used.
  *
  * @return True if proper DCB was found, false otherwise.
  */
 static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
-                    char *name, int max_rlag)
+                    char *name, int name_id, int max_rlag, POOL_RULE *pool)
 {
     backend_ref_t *backend_ref;
     backend_ref_t *master_bref;
     int i;
     bool succp = false;
+    /** The servers are compared in the same published state */
+    SERVER_STATES *states = server_states();
 
     CHK_CLIENT_RSES(rses);
     ss_dassert(p_dcb != NULL && *(p_dcb) == NULL);
@@ -1081,8 +1285,7 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
         for (i = 0; i < rses->rses_nbackends; i++)
         {
             BACKEND *b = backend_ref[i].bref_backend;
-            SERVER server;
-            server.status = backend_ref[i].bref_backend->backend_server->status;
+            SERVER_STATE server = server_get_state(states, b->backend_server);
             /**
              * To become chosen:
              * backend must be in use, name must match,
@@ -1090,7 +1293,8 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
              * server, or master.
              */
             if (BREF_IS_IN_USE((&backend_ref[i])) &&
-                (strncasecmp(name, b->backend_server->unique_name, PATH_MAX) == 0) &&
+                (name_id && b->hint_id ? name_id == b->hint_id :
+                 strncasecmp(name, b->backend_server->unique_name, PATH_MAX) == 0) &&
                 (SERVER_IS_SLAVE(&server) || SERVER_IS_RELAY_SERVER(&server) ||
                  SERVER_IS_MASTER(&server)))
             {
@@ -1113,13 +1317,22 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
     if (btype == BE_SLAVE)
     {
         backend_ref_t *candidate_bref = NULL;
+        select_criteria_t sc = get_select_criteria(rses->rses_config.rw_slave_select_criteria);
+        SERVER_GTID_POS causal_pos;
+        bool causal_read = rses->rses_config.rw_causal_reads && rses->rses_last_write &&
+                           master_bref && BREF_IS_IN_USE(master_bref);
+        POOL_RULES *pool_rules = rses->rses_config.rw_pool_rules;
+
+        if (causal_read)
+        {
+            server_get_gtid_pos(master_bref->bref_backend->backend_server, &causal_pos);
+        }
 
         for (i = 0; i < rses->rses_nbackends; i++)
         {
             BACKEND *b = (&backend_ref[i])->bref_backend;
-            SERVER server;
-            SERVER candidate;
-            server.status = backend_ref[i].bref_backend->backend_server->status;
+            SERVER_STATE server = server_get_state(states, b->backend_server);
+            SERVER_STATE candidate;
             /**
              * Unused backend or backend which is not master nor
              * slave can't be used
@@ -1129,6 +1342,44 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
             {
                 continue;
             }
+            /**
+             * With fallback connections, a slave only gets reads once it has
+             * finished its handshake. A slave that never finishes it would
+             * hold the reads until the connect timeout.
+             */
+            else if (rses->rses_config.rw_slave_connect_fallback > 0 &&
+                     &backend_ref[i] != master_bref && !bref_is_authenticated(&backend_ref[i]))
+            {
+                continue;
+            }
+            /**
+             * A slave that lost a hedged read is still sending the reply that
+             * is discarded, a read routed to it would wait for the reply.
+             */
+            else if (BREF_IS_DRAINING(&backend_ref[i]))
+            {
+                continue;
+            }
+            /**
+             * The reads of a pool only go to its servers and the slaves of
+             * the pools only get the reads of their pools.
+             */
+            else if (pool ? !server_in_pool(b->backend_server, pool) :
+                     (pool_rules && &backend_ref[i] != master_bref &&
+                      server_in_any_pool(b->backend_server, pool_rules)))
+            {
+                continue;
+            }
+            /**
+             * A causal read can only go to the master or to a slave which has
+             * replicated the last write of the session.
+             */
+            else if (causal_read && &backend_ref[i] != master_bref &&
+                     !bref_has_replicated_write(&backend_ref[i], &causal_pos,
+                                                rses->rses_last_write))
+            {
+                continue;
+            }
             /**
              * If there are no candidates yet accept both master or
              * slave.
@@ -1143,7 +1394,7 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
                 {
                     /** found master */
                     candidate_bref = &backend_ref[i];
-                    candidate.status = candidate_bref->bref_backend->backend_server->status;
+                    candidate = server_get_state(states, candidate_bref->bref_backend->backend_server);
                     succp = true;
                 }
                 /**
@@ -1151,13 +1402,11 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
                  * or that candidate's lag doesn't exceed the
                  * maximum allowed replication lag.
                  */
-                else if (max_rlag == MAX_RLAG_UNDEFINED ||
-                         (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                          b->backend_server->rlag <= max_rlag))
+                else if (rlag_is_within(server.rlag_us, max_rlag))
                 {
                     /** found slave */
                     candidate_bref = &backend_ref[i];
-                    candidate.status = candidate_bref->bref_backend->backend_server->status;
+                    candidate = server_get_state(states, candidate_bref->bref_backend->backend_server);
                     succp = true;
                 }
             }
@@ -1166,14 +1415,12 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
              * replication lag limits replaces it.
              */
             else if (SERVER_IS_MASTER(&candidate) && SERVER_IS_SLAVE(&server) &&
-                     (max_rlag == MAX_RLAG_UNDEFINED ||
-                      (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                       b->backend_server->rlag <= max_rlag)) &&
+                     rlag_is_within(server.rlag_us, max_rlag) &&
                      !rses->rses_config.rw_master_reads)
             {
                 /** found slave */
                 candidate_bref = &backend_ref[i];
-                candidate.status = candidate_bref->bref_backend->backend_server->status;
+                candidate = server_get_state(states, candidate_bref->bref_backend->backend_server);
                 succp = true;
             }
             /**
@@ -1183,22 +1430,18 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
              */
             else if (SERVER_IS_SLAVE(&server))
             {
-                if (max_rlag == MAX_RLAG_UNDEFINED ||
-                    (b->backend_server->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                     b->backend_server->rlag <= max_rlag))
+                if (rlag_is_within(server.rlag_us, max_rlag))
                 {
                     candidate_bref =
-                        check_candidate_bref(candidate_bref, &backend_ref[i],
-                                             rses->rses_config.rw_slave_select_criteria);
-                    candidate.status =
-                        candidate_bref->bref_backend->backend_server->status;
+                        check_candidate_bref(candidate_bref, &backend_ref[i], sc);
+                    candidate = server_get_state(states, candidate_bref->bref_backend->backend_server);
                 }
                 else
                 {
                     MXS_INFO("Server %s:%d is too much behind the "
-                             "master, %d s. and can't be chosen.",
+                             "master, %.3f ms. and can't be chosen.",
                              b->backend_server->name, b->backend_server->port,
-                             b->backend_server->rlag);
+                             server.rlag_us / 1000.0);
                 }
             }
         } /*<  for */
@@ -1221,8 +1464,8 @@ static bool get_dcb(DCB **p_dcb, ROUTER_CLIENT_SES *rses, backend_type_t btype,
             /** It is possible for the server status to change at any point in time
              * so copying it locally will make possible error messages
              * easier to understand */
-            SERVER server;
-            server.status = master_bref->bref_backend->backend_server->status;
+            SERVER_STATE server = server_get_state(states,
+                                                   master_bref->bref_backend->backend_server);
             if (BREF_IS_IN_USE(master_bref) && SERVER_IS_MASTER(&server))
             {
                 *p_dcb = master_bref->bref_dcb;
@@ -1248,7 +1491,11 @@ return_succp:
 
 /**
  * Find out which of the two backend servers has smaller value for select
- * criteria property.
+ * criteria property. A backend which is still executing session commands is
+ * only chosen if both are. A query routed to it would wait until the session
+ * commands complete even though the client already has their replies.
+ *
+ * Router session must be locked.
  *
  * @param cand  previously selected candidate
  * @param new   challenger
@@ -1270,6 +1517,12 @@ static backend_ref_t *check_candidate_bref(backend_ref_t *cand,
     {
         return cand;
     }
+    else if (cand != NULL &&
+             sescmd_cursor_is_active(&cand->bref_sescmd_cur) !=
+             sescmd_cursor_is_active(&new->bref_sescmd_cur))
+    {
+        return sescmd_cursor_is_active(&cand->bref_sescmd_cur) ? new : cand;
+    }
     else if (cand == NULL || (p((void *)cand, (void *)new) > 0))
     {
         return new;
@@ -1327,9 +1580,8 @@ static route_target_t get_route_target(ROUTER_CLIENT_SES *rses,
          * They can be safely routed to all backends since the execution
          * is done later.
          *
-         * With prepared statement caching the task of routing
-         * the execution of the prepared statements to the right server would be
-         * an easy one. Currently this is not supported.
+         * The executions of the prepared statements are routed by the type
+         * the statement had when it was prepared, see get_prepared_stmt_type.
          */
         if (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) &&
             !(QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
@@ -1452,8 +1704,7 @@ static route_target_t get_route_target(ROUTER_CLIENT_SES *rses,
         }
         else if (hint->type == HINT_PARAMETER)
         {
-            if (strncasecmp((char *)hint->data, "max_slave_replication_lag",
-                            strlen("max_slave_replication_lag")) == 0)
+            if (hint_name_is(hint, rwsplit_rlag_hint_id, "max_slave_replication_lag"))
             {
                 target |= TARGET_RLAG_MAX;
             }
@@ -1493,7 +1744,7 @@ void check_drop_tmp_table(ROUTER_CLIENT_SES *router_cli_ses, GWBUF *querybuf,
 {
 
     int tsize = 0, klen = 0, i;
-    char **tbl = NULL;
+    const char* const* tbl = NULL;
     char *hkey, *dbname;
     MYSQL_session *data;
     rses_property_t *rses_prop_tmp;
@@ -1525,7 +1776,7 @@ void check_drop_tmp_table(ROUTER_CLIENT_SES *router_cli_ses, GWBUF *querybuf,
 
     if (qc_is_drop_table_query(querybuf))
     {
-        tbl = qc_get_table_names(querybuf, &tsize, false);
+        tbl = qc_get_table_names_view(querybuf, &tsize, false);
         if (tbl != NULL)
         {
             for (i = 0; i < tsize; i++)
@@ -1544,13 +1795,46 @@ void check_drop_tmp_table(ROUTER_CLIENT_SES *router_cli_ses, GWBUF *querybuf,
                         MXS_INFO("Temporary table dropped: %s", hkey);
                     }
                 }
-                free(tbl[i]);
                 free(hkey);
             }
+        }
+    }
+}
+
+/**
+ * Get the type of a COM_STMT_EXECUTE from the type its statement had when it
+ * was prepared. The client protocol records the types of the prepared
+ * statements of the client by their IDs.
+ *
+ * Only plain reads are routed by their prepared type. An execution that opens
+ * a cursor stays on the master since the COM_STMT_FETCH packets that follow
+ * it are routed there, and so do all executions while the session has
+ * temporary tables.
+ *
+ * @param rses      Router client session
+ * @param querybuf  The COM_STMT_EXECUTE packet
+ * @return The type of the execution
+ */
+static qc_query_type_t get_prepared_stmt_type(ROUTER_CLIENT_SES *rses,
+                                              GWBUF *querybuf)
+{
+    qc_query_type_t qtype = QUERY_TYPE_EXEC_STMT;
+    MySQLProtocol *proto;
+    uint8_t *packet = GWBUF_DATA(querybuf);
 
-            free(tbl);
+    if (rses->client_dcb && (proto = rses->client_dcb->protocol) && proto->ps_types &&
+        !rses->have_tmp_tables && GWBUF_LENGTH(querybuf) > MYSQL_HEADER_LEN + 5 &&
+        MYSQL_GET_STMT_EXECUTE_FLAGS(packet) == 0)
+    {
+        void *value = hashtable_fetch(proto->ps_types, MYSQL_PS_KEY(MYSQL_GET_STMT_ID(packet)));
+
+        if ((uintptr_t)value == QUERY_TYPE_READ)
+        {
+            qtype = QUERY_TYPE_READ;
         }
     }
+
+    return qtype;
 }
 
 /**
@@ -1567,7 +1851,7 @@ static qc_query_type_t is_read_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
 
     bool target_tmp_table = false;
     int tsize = 0, klen = 0, i;
-    char **tbl = NULL;
+    const char* const* tbl = NULL;
     char *dbname;
     char hkey[MYSQL_DATABASE_MAXLEN + MYSQL_TABLE_MAXLEN + 2];
     MYSQL_session *data;
@@ -1604,7 +1888,7 @@ static qc_query_type_t is_read_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
         QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) ||
         QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ))
     {
-        tbl = qc_get_table_names(querybuf, &tsize, false);
+        tbl = qc_get_table_names_view(querybuf, &tsize, false);
 
         if (tbl != NULL && tsize > 0)
         {
@@ -1626,15 +1910,6 @@ static qc_query_type_t is_read_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
         }
     }
 
-    if (tbl != NULL)
-    {
-        for (i = 0; i < tsize; i++)
-        {
-            free(tbl[i]);
-        }
-        free(tbl);
-    }
-
     return qtype;
 }
 
@@ -1688,9 +1963,9 @@ static void check_create_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
     dbname = (char *)data->db;
 
     bool is_temp = true;
-    char *tblname = NULL;
+    const char *tblname = NULL;
 
-    tblname = qc_get_created_table_name(querybuf);
+    tblname = qc_get_created_table_name_view(querybuf);
 
     if (tblname && strlen(tblname) > 0)
     {
@@ -1707,22 +1982,16 @@ static void check_create_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
 
     if (rses_prop_tmp == NULL)
     {
-        if ((rses_prop_tmp = (rses_property_t *)calloc(1, sizeof(rses_property_t))))
+        /** The pool of the properties is shared with the session commands */
+        spinlock_acquire(&router_cli_ses->rses_lock);
+        rses_prop_tmp = rses_property_init(router_cli_ses, RSES_PROP_TYPE_TMPTABLES);
+        spinlock_release(&router_cli_ses->rses_lock);
+
+        if (rses_prop_tmp)
         {
-#if defined(SS_DEBUG)
-            rses_prop_tmp->rses_prop_chk_top = CHK_NUM_ROUTER_PROPERTY;
-            rses_prop_tmp->rses_prop_chk_tail = CHK_NUM_ROUTER_PROPERTY;
-#endif
-            rses_prop_tmp->rses_prop_rsession = router_cli_ses;
             rses_prop_tmp->rses_prop_refcount = 1;
-            rses_prop_tmp->rses_prop_next = NULL;
-            rses_prop_tmp->rses_prop_type = RSES_PROP_TYPE_TMPTABLES;
             router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES] = rses_prop_tmp;
         }
-        else
-        {
-            MXS_ERROR("Call to malloc() failed.");
-        }
     }
     if (rses_prop_tmp)
     {
@@ -1758,7 +2027,6 @@ static void check_create_tmp_table(ROUTER_CLIENT_SES *router_cli_ses,
     }
 
     free(hkey);
-    free(tblname);
 }
 
 /**
@@ -1819,6 +2087,11 @@ static int routeQuery(ROUTER *instance, void *router_session, GWBUF *querybuf)
             free(query_str);
         }
     }
+    else if (GWBUF_IS_TYPE_STREAM(querybuf))
+    {
+        rval = route_stream(inst, rses, querybuf) ? 1 : 0;
+        querybuf = NULL;
+    }
     else
     {
         if (GWBUF_IS_TYPE_UNDEFINED(querybuf))
@@ -1837,10 +2110,33 @@ static int routeQuery(ROUTER *instance, void *router_session, GWBUF *querybuf)
             gwbuf_set_type(querybuf, GWBUF_TYPE_SINGLE_STMT);
         }
 
-        if (route_single_stmt(inst, rses, querybuf))
+        /** Connector probes are answered before the backends are needed */
+        bool answered = false;
+
+        if (rses->rses_config.rw_local_queries && rses_begin_locked_router_action(rses))
+        {
+            answered = route_local_query(inst, rses, querybuf);
+            rses_end_locked_router_action(rses);
+        }
+
+        if (answered)
         {
             rval = 1;
         }
+        else
+        {
+            /** The backends of a multiplexed session are taken back on its next query */
+            if (rses->rses_backends_released && !MYSQL_IS_COM_QUIT((uint8_t*)GWBUF_DATA(querybuf)) &&
+                !reattach_backends(rses))
+            {
+                MXS_ERROR("Failed to reconnect the backend servers of a multiplexed session.");
+            }
+
+            if (route_single_stmt(inst, rses, querybuf))
+            {
+                rval = 1;
+            }
+        }
     }
 
     if (querybuf != NULL)
@@ -1852,1329 +2148,3632 @@ static int routeQuery(ROUTER *instance, void *router_session, GWBUF *querybuf)
 }
 
 /**
- * Routing function. Find out query type, backend type, and target DCB(s).
- * Then route query to found target(s).
- * @param inst      router instance
- * @param rses      router session
- * @param querybuf  GWBUF including the query
+ * Route the streamed continuation of a packet, either the packets that
+ * follow a packet of the maximum size or the file of a LOAD DATA LOCAL
+ * INFILE, to the backend that the packet was routed to. The data is not
+ * made of complete packets and is not inspected.
  *
- * @return true if routing succeed or if it failed due to unsupported query.
- * false if backend failure was encountered.
+ * @param inst      Router instance
+ * @param rses      Router session
+ * @param querybuf  The streamed data, freed by this function
+ * @return True if the data was routed
  */
-static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
-                              GWBUF *querybuf)
+static bool route_stream(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                         GWBUF *querybuf)
 {
-    qc_query_type_t qtype = QUERY_TYPE_UNKNOWN;
-    mysql_server_cmd_t packet_type = MYSQL_COM_UNDEFINED;
-    uint8_t *packet;
-    size_t packet_len;
-    int ret = 0;
-    DCB *target_dcb = NULL;
-    route_target_t route_target;
     bool succp = false;
-    int rlag_max = MAX_RLAG_UNDEFINED;
-    backend_type_t btype; /*< target backend type */
+    size_t len = gwbuf_length(querybuf);
 
-    ss_dassert(querybuf->next == NULL); // The buffer must be contiguous.
-    ss_dassert(!GWBUF_IS_TYPE_UNDEFINED(querybuf));
+    if (!rses_begin_locked_router_action(rses))
+    {
+        gwbuf_free(querybuf);
+        return false;
+    }
 
-    packet = GWBUF_DATA(querybuf);
-    packet_len = gw_mysql_get_byte3(packet);
+    backend_ref_t *bref = rses->rses_stream_bref;
 
-    if (packet_len == 0)
+    if (bref == NULL || !BREF_IS_IN_USE(bref))
     {
-        /** Empty packet signals end of LOAD DATA LOCAL INFILE, send it to master*/
-        route_target = TARGET_MASTER;
-        packet_type = MYSQL_COM_UNDEFINED;
-        rses->rses_load_active = false;
-        route_target = TARGET_MASTER;
-        MXS_INFO("> LOAD DATA LOCAL INFILE finished: %lu bytes sent.",
-                 rses->rses_load_data_sent + gwbuf_length(querybuf));
+        MXS_ERROR("The server that the start of a streamed packet was routed "
+                  "to is no longer available.");
+        gwbuf_free(querybuf);
+    }
+    else if (sescmd_cursor_is_active(&bref->bref_sescmd_cur))
+    {
+        /** The start of the packet is waiting for the session commands */
+        bref->bref_pending_cmd = gwbuf_append(bref->bref_pending_cmd, querybuf);
+        succp = true;
+    }
+    else if (bref->bref_dcb->func.write(bref->bref_dcb, querybuf) == 1)
+    {
+        ts_stats_add(bref->bref_backend->backend_stats->bytes_out, len);
+        succp = true;
     }
     else
     {
-        packet_type = packet[4];
+        MXS_ERROR("Routing the continuation of a packet failed.");
+    }
 
-        switch (packet_type)
+    if (succp && rses->rses_load_active)
+    {
+        rses->rses_load_data_sent += len;
+    }
+
+    rses_end_locked_router_action(rses);
+    return succp;
+}
+
+/**
+ * Check if the reply to an earlier statement of a session has not been
+ * completely sent to the client.
+ *
+ * Router session must be locked.
+ *
+ * @param rses Router client session
+ * @return True if a reply is pending
+ */
+static bool rses_reply_pending(ROUTER_CLIENT_SES *rses)
+{
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+
+        if (BREF_IS_IN_USE(bref) &&
+            (BREF_IS_WAITING_RESULT(bref) || bref->bref_reply_count > 0 ||
+             bref->bref_pending_cmd || sescmd_cursor_is_active(&bref->bref_sescmd_cur)))
         {
-            case MYSQL_COM_QUIT:        /*< 1 QUIT will close all sessions */
-            case MYSQL_COM_INIT_DB:     /*< 2 DDL must go to the master */
-            case MYSQL_COM_REFRESH:     /*< 7 - I guess this is session but not sure */
-            case MYSQL_COM_DEBUG:       /*< 0d all servers dump debug info to stdout */
-            case MYSQL_COM_PING:        /*< 0e all servers are pinged */
-            case MYSQL_COM_CHANGE_USER: /*< 11 all servers change it accordingly */
-                qtype = QUERY_TYPE_SESSION_WRITE;
-                break;
+            return true;
+        }
+    }
 
-            case MYSQL_COM_CREATE_DB:           /**< 5 DDL must go to the master */
-            case MYSQL_COM_DROP_DB:             /**< 6 DDL must go to the master */
-            case MYSQL_COM_STMT_CLOSE:          /*< free prepared statement */
-            case MYSQL_COM_STMT_SEND_LONG_DATA: /*< send data to column */
-            case MYSQL_COM_STMT_RESET: /*< resets the data of a prepared statement */
-                qtype = QUERY_TYPE_WRITE;
-                break;
+    return false;
+}
 
-            case MYSQL_COM_QUERY:
-                qtype = qc_get_type(querybuf);
-                break;
+/** The maximum number of columns of a query answered by the router */
+#define RW_LOCAL_MAX_COLS 8
+/** The size of the column names of a query answered by the router */
+#define RW_LOCAL_NAME_LEN 64
+/** The size of the values of a query answered by the router */
+#define RW_LOCAL_VALUE_LEN 512
 
-            case MYSQL_COM_STMT_PREPARE:
-                qtype = qc_get_type(querybuf);
-                qtype |= QUERY_TYPE_PREPARE_STMT;
-                break;
+/**
+ * The single row reply to a query answered by the router
+ */
+typedef struct
+{
+    int  n_cols;                                        /*< No. of columns */
+    bool sent;                                          /*< The row has been sent */
+    char names[RW_LOCAL_MAX_COLS][RW_LOCAL_NAME_LEN];   /*< The column names */
+    char values[RW_LOCAL_MAX_COLS][RW_LOCAL_VALUE_LEN]; /*< The values of the row */
+} rw_local_reply_t;
 
-            case MYSQL_COM_STMT_EXECUTE:
-                /** Parsing is not needed for this type of packet */
-                qtype = QUERY_TYPE_EXEC_STMT;
-                break;
+/**
+ * Provide the row of a query answered by the router
+ *
+ * @param set   The result set
+ * @param data  The reply
+ * @return The row or NULL once it has been sent
+ */
+static RESULT_ROW *local_reply_row(RESULTSET *set, void *data)
+{
+    rw_local_reply_t *reply = (rw_local_reply_t *)data;
+    RESULT_ROW *row;
 
-            case MYSQL_COM_SHUTDOWN:       /**< 8 where should shutdown be routed ? */
-            case MYSQL_COM_STATISTICS:     /**< 9 ? */
-            case MYSQL_COM_PROCESS_INFO:   /**< 0a ? */
-            case MYSQL_COM_CONNECT:        /**< 0b ? */
-            case MYSQL_COM_PROCESS_KILL:   /**< 0c ? */
-            case MYSQL_COM_TIME:           /**< 0f should this be run in gateway ? */
-            case MYSQL_COM_DELAYED_INSERT: /**< 10 ? */
-            case MYSQL_COM_DAEMON:         /**< 1d ? */
-            default:
-                break;
-        } /**< switch by packet type */
+    if (reply->sent || (row = resultset_make_row(set)) == NULL)
+    {
+        return NULL;
+    }
 
-        /** This might not be absolutely necessary as some parts of the code
-         * can only be executed by one thread at a time. */
-        if (!rses_begin_locked_router_action(rses))
+    for (int i = 0; i < reply->n_cols; i++)
+    {
+        resultset_row_set(row, i, reply->values[i]);
+    }
+    reply->sent = true;
+    return row;
+}
+
+/**
+ * Skip the whitespace and the comments of a statement. The executable
+ * comments are not skipped.
+ *
+ * @param ptr   Position in the statement
+ * @param end   End of the statement
+ * @return The position of the next token
+ */
+static const char *local_skip_space(const char *ptr, const char *end)
+{
+    while (ptr < end)
+    {
+        if (isspace((unsigned char)*ptr))
         {
-            succp = false;
-            goto retblock;
+            ptr++;
         }
+        else if (end - ptr > 2 && ptr[0] == '/' && ptr[1] == '*' && ptr[2] != '!' && ptr[2] != 'M')
+        {
+            const char *close = memmem(ptr + 2, end - ptr - 2, "*/", 2);
 
-        /** Check for multi-statement queries. If no master server is available
-         * and a multi-statement is issued, an error is returned to the client
-         * when the query is routed.
-         *
-         * If we do not have a master node, assigning the forced node is not
-         * effective since we don't have a node to force queries to. In this
-         * situation, assigning QUERY_TYPE_WRITE for the query will trigger
-         * the error processing. */
-        if (check_for_multi_stmt(rses, querybuf, packet_type) &&
-            rses->rses_master_ref == NULL)
+            if (close == NULL)
+            {
+                break;
+            }
+            ptr = close + 2;
+        }
+        else
         {
-            qtype |= QUERY_TYPE_WRITE;
+            break;
         }
+    }
 
-        /**
-         * Check if the query has anything to do with temporary tables.
-         */
-        if (rses->have_tmp_tables &&
-            (packet_type == MYSQL_COM_QUERY || packet_type == MYSQL_COM_DROP_DB))
+    return ptr;
+}
+
+/**
+ * Return the length of the identifier at a position of a statement
+ *
+ * @param ptr   Position in the statement
+ * @param end   End of the statement
+ * @return The length of the identifier, 0 if there is none
+ */
+static size_t local_ident_len(const char *ptr, const char *end)
+{
+    const char *p = ptr;
+
+    while (p < end && (isalnum((unsigned char)*p) || *p == '_' || *p == '$'))
+    {
+        p++;
+    }
+
+    return p - ptr;
+}
+
+/**
+ * Check if a token of a statement is a keyword
+ *
+ * @param ptr   The token
+ * @param len   The length of the token
+ * @param word  The keyword
+ * @return True if the token is the keyword, in any case
+ */
+static bool local_is_word(const char *ptr, size_t len, const char *word)
+{
+    return len == strlen(word) && strncasecmp(ptr, word, len) == 0;
+}
+
+/**
+ * Consume a keyword of a statement and the whitespace after it
+ *
+ * @param ptr   Position in the statement, moved past the keyword if it matched
+ * @param end   End of the statement
+ * @param word  The keyword
+ * @return True if the keyword is at the position
+ */
+static bool local_match_word(const char **ptr, const char *end, const char *word)
+{
+    size_t len = local_ident_len(*ptr, end);
+
+    if (local_is_word(*ptr, len, word))
+    {
+        *ptr = local_skip_space(*ptr + len, end);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Check that nothing but a semicolon and whitespace follows a position
+ *
+ * @param ptr   Position in the statement
+ * @param end   End of the statement
+ * @return True if the statement ends at the position
+ */
+static bool local_statement_end(const char *ptr, const char *end)
+{
+    if (ptr < end && *ptr == ';')
+    {
+        ptr = local_skip_space(ptr + 1, end);
+    }
+
+    return ptr == end;
+}
+
+/**
+ * Return the server whose cached variables answer the queries of a session,
+ * the master if the session has one
+ *
+ * @param rses Router client session
+ * @return The server or NULL if no server is running
+ */
+static SERVER *local_query_server(ROUTER_CLIENT_SES *rses)
+{
+    SERVER *rval = NULL;
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        SERVER *server = rses->rses_backend_ref[i].bref_backend->backend_server;
+
+        if (SERVER_IS_MASTER(server))
         {
-            check_drop_tmp_table(rses, querybuf, qtype);
-            if (packet_type == MYSQL_COM_QUERY)
-            {
-                qtype = is_read_tmp_table(rses, querybuf, qtype);
-            }
+            return server;
         }
-        check_create_tmp_table(rses, querybuf, qtype);
+        else if (rval == NULL && SERVER_IS_RUNNING(server))
+        {
+            rval = server;
+        }
+    }
 
-        /**
-         * Check if this is a LOAD DATA LOCAL INFILE query. If so, send all queries
-         * to the master until the last, empty packet arrives.
-         */
-        if (rses->rses_load_active)
+    return rval;
+}
+
+/**
+ * Get the value of a system variable for a query answered by the router. The
+ * session value of a cached variable is only known if the session has not
+ * set it, autocommit is known from the session state.
+ *
+ * @param rses      Router client session
+ * @param name      The name of the variable
+ * @param len       The length of the name
+ * @param global    The global value is read
+ * @param show      The value is for SHOW VARIABLES
+ * @param status    The server status of the session
+ * @param buf       Where the value is stored
+ * @return True if the router can answer the value
+ */
+static bool local_variable(ROUTER_CLIENT_SES *rses, const char *name, size_t len,
+                           bool global, bool show, uint16_t status, char *buf)
+{
+    uint32_t enabled = rses->rses_config.rw_local_queries;
+
+    if (local_is_word(name, len, "autocommit"))
+    {
+        if (global || (enabled & RW_LOCAL_AUTOCOMMIT) == 0)
         {
-            rses->rses_load_data_sent += gwbuf_length(querybuf);
+            return false;
         }
-        else if (packet_type == MYSQL_COM_QUERY)
+        bool on = (status & SERVER_STATUS_AUTOCOMMIT) != 0;
+        strcpy(buf, show ? (on ? "ON" : "OFF") : (on ? "1" : "0"));
+        return true;
+    }
+
+    server_var_t var = server_var_find(name, len);
+    SERVER *server;
+
+    return var < SERVER_N_VARS && (enabled & RW_LOCAL_VAR(var)) &&
+           (global || (rses->rses_local_vars_set & RW_LOCAL_VAR(var)) == 0) &&
+           (server = local_query_server(rses)) != NULL &&
+           server_get_variable(server, var, buf, RW_LOCAL_VALUE_LEN);
+}
+
+/**
+ * Parse the rest of a SELECT of constants and system variables, e.g.
+ * SELECT 1 or SELECT @@session.auto_increment_increment AS auto_increment_increment
+ *
+ * @param rses      Router client session
+ * @param ptr       Position after the SELECT keyword
+ * @param end       End of the statement
+ * @param status    The server status of the session
+ * @param reply     Where the reply is stored
+ * @return True if the router can answer the statement
+ */
+static bool local_parse_select(ROUTER_CLIENT_SES *rses, const char *ptr, const char *end,
+                               uint16_t status, rw_local_reply_t *reply)
+{
+    while (reply->n_cols < RW_LOCAL_MAX_COLS)
+    {
+        const char *start = ptr;
+        char *name = reply->names[reply->n_cols];
+        char *value = reply->values[reply->n_cols];
+        size_t len;
+
+        if (ptr < end && *ptr == '1' && local_ident_len(ptr, end) == 1)
         {
-            qc_query_op_t queryop = qc_get_operation(querybuf);
-            if (queryop == QUERY_OP_LOAD)
+            if ((rses->rses_config.rw_local_queries & RW_LOCAL_PING) == 0)
             {
-                rses->rses_load_active = true;
-                rses->rses_load_data_sent = 0;
+                return false;
             }
+            strcpy(value, "1");
+            ptr++;
         }
-
-        rses_end_locked_router_action(rses);
-        /**
-         * If autocommit is disabled or transaction is explicitly started
-         * transaction becomes active and master gets all statements until
-         * transaction is committed and autocommit is enabled again.
-         */
-        if (rses->rses_autocommit_enabled &&
-            QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT))
+        else if (end - ptr > 2 && ptr[0] == '@' && ptr[1] == '@')
         {
-            rses->rses_autocommit_enabled = false;
+            bool global = false;
 
-            if (!rses->rses_transaction_active)
+            ptr += 2;
+            len = local_ident_len(ptr, end);
+
+            if (ptr + len < end && ptr[len] == '.')
             {
-                rses->rses_transaction_active = true;
+                if (local_is_word(ptr, len, "global"))
+                {
+                    global = true;
+                }
+                else if (!local_is_word(ptr, len, "session") && !local_is_word(ptr, len, "local"))
+                {
+                    return false;
+                }
+                ptr += len + 1;
+                len = local_ident_len(ptr, end);
+            }
+
+            if (len == 0 || !local_variable(rses, ptr, len, global, false, status, value))
+            {
+                return false;
             }
+            ptr += len;
         }
-        else if (!rses->rses_transaction_active &&
-                 QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX))
+        else
         {
-            rses->rses_transaction_active = true;
+            return false;
         }
-        /**
-         * Explicit COMMIT and ROLLBACK, implicit COMMIT.
-         */
-        if (rses->rses_autocommit_enabled && rses->rses_transaction_active &&
-            (QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
-             QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK)))
+
+        /** The column is named after the expression unless it has an alias */
+        len = ptr - start;
+        ptr = local_skip_space(ptr, end);
+
+        bool as = local_match_word(&ptr, end, "AS");
+        size_t alias_len = local_ident_len(ptr, end);
+
+        if (ptr < end && *ptr == '`')
         {
-            rses->rses_transaction_active = false;
+            const char *close = memchr(ptr + 1, '`', end - ptr - 1);
+
+            if (close == NULL)
+            {
+                return false;
+            }
+            start = ptr + 1;
+            len = close - start;
+            ptr = local_skip_space(close + 1, end);
         }
-        else if (!rses->rses_autocommit_enabled &&
-                 QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT))
+        else if (alias_len > 0 && (as || (!local_is_word(ptr, alias_len, "FROM") &&
+                                          !local_is_word(ptr, alias_len, "LIMIT"))))
         {
-            rses->rses_autocommit_enabled = true;
-            rses->rses_transaction_active = false;
+            start = ptr;
+            len = alias_len;
+            ptr = local_skip_space(ptr + alias_len, end);
+        }
+        else if (as)
+        {
+            return false;
         }
 
-        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+        if (len >= RW_LOCAL_NAME_LEN)
         {
-            if (!rses->rses_load_active)
-            {
-                uint8_t *packet = GWBUF_DATA(querybuf);
-                unsigned char ptype = packet[4];
-                size_t len = MIN(GWBUF_LENGTH(querybuf),
-                                 MYSQL_GET_PACKET_LEN((unsigned char *)querybuf->start) - 1);
-                char *data = (char *)&packet[5];
-                char *contentstr = strndup(data, MIN(len, RWSPLIT_TRACE_MSG_LEN));
-                char *qtypestr = qc_get_qtype_str(qtype);
-                MXS_INFO("> Autocommit: %s, trx is %s, cmd: %s, type: %s, stmt: %s%s %s",
-                         (rses->rses_autocommit_enabled ? "[enabled]" : "[disabled]"),
-                         (rses->rses_transaction_active ? "[open]" : "[not open]"),
-                         STRPACKETTYPE(ptype), (qtypestr == NULL ? "N/A" : qtypestr),
-                         contentstr, (querybuf->hint == NULL ? "" : ", Hint:"),
-                         (querybuf->hint == NULL ? "" : STRHINTTYPE(querybuf->hint->type)));
-                free(contentstr);
-                free(qtypestr);
-            }
-            else
-            {
-                MXS_INFO("> Processing LOAD DATA LOCAL INFILE: %lu bytes sent.",
-                         rses->rses_load_data_sent);
-            }
+            return false;
         }
-        /**
-         * Find out where to route the query. Result may not be clear; it is
-         * possible to have a hint for routing to a named server which can
-         * be either slave or master.
-         * If query would otherwise be routed to slave then the hint determines
-         * actual target server if it exists.
-         *
-         * route_target is a bitfield and may include :
-         * TARGET_ALL
-         * - route to all connected backend servers
-         * TARGET_SLAVE[|TARGET_NAMED_SERVER|TARGET_RLAG_MAX]
-         * - route primarily according to hints, then to slave and if those
-         *   failed, eventually to master
-         * TARGET_MASTER[|TARGET_NAMED_SERVER|TARGET_RLAG_MAX]
-         * - route primarily according to the hints and if they failed,
-         *   eventually to master
-         */
-        route_target = get_route_target(rses, qtype, querybuf->hint);
+        memcpy(name, start, len);
+        name[len] = '\0';
+        reply->n_cols++;
 
-        if (TARGET_IS_ALL(route_target))
+        if (ptr < end && *ptr == ',')
         {
-            /** Multiple, conflicting routing target. Return error */
-            if (TARGET_IS_MASTER(route_target) || TARGET_IS_SLAVE(route_target))
-            {
-                backend_ref_t *bref = rses->rses_backend_ref;
+            ptr = local_skip_space(ptr + 1, end);
+        }
+        else
+        {
+            break;
+        }
+    }
 
-                char *query_str = modutil_get_query(querybuf);
-                char *qtype_str = qc_get_qtype_str(qtype);
+    /** Only FROM DUAL and a LIMIT that keeps the row may follow */
+    if (local_match_word(&ptr, end, "FROM") && !local_match_word(&ptr, end, "DUAL"))
+    {
+        return false;
+    }
 
-                MXS_ERROR("Can't route %s:%s:\"%s\". SELECT with session data "
-                          "modification is not supported if configuration parameter "
-                          "use_sql_variables_in=all .", STRPACKETTYPE(packet_type),
-                          qtype_str, (query_str == NULL ? "(empty)" : query_str));
+    if (local_match_word(&ptr, end, "LIMIT"))
+    {
+        if (ptr == end || *ptr < '1' || *ptr > '9')
+        {
+            return false;
+        }
+        while (ptr < end && isdigit((unsigned char)*ptr))
+        {
+            ptr++;
+        }
+        ptr = local_skip_space(ptr, end);
+    }
 
-                MXS_INFO("Unable to route the query without losing session data "
-                         "modification from other servers. <");
+    return local_statement_end(ptr, end);
+}
 
-                while (bref != NULL && !BREF_IS_IN_USE(bref))
-                {
-                    bref++;
-                }
+/**
+ * Parse the rest of a SHOW VARIABLES LIKE 'name' statement. Only a name
+ * without the % wildcard is answered.
+ *
+ * @param rses      Router client session
+ * @param ptr       Position after the SHOW keyword
+ * @param end       End of the statement
+ * @param status    The server status of the session
+ * @param reply     Where the reply is stored
+ * @return True if the router can answer the statement
+ */
+static bool local_parse_show(ROUTER_CLIENT_SES *rses, const char *ptr, const char *end,
+                             uint16_t status, rw_local_reply_t *reply)
+{
+    bool global = local_match_word(&ptr, end, "GLOBAL");
 
-                if (bref != NULL && BREF_IS_IN_USE(bref))
-                {
-                    /** Create and add MySQL error to eventqueue */
-                    modutil_reply_parse_error(bref->bref_dcb,
-                                              strdup("Routing query to backend failed. "
-                                                     "See the error log for further "
-                                                     "details."), 0);
-                    succp = true;
-                }
-                else
+    if (!global && !local_match_word(&ptr, end, "SESSION"))
+    {
+        local_match_word(&ptr, end, "LOCAL");
+    }
+
+    if (!local_match_word(&ptr, end, "VARIABLES") || !local_match_word(&ptr, end, "LIKE") ||
+        ptr == end || (*ptr != '\'' && *ptr != '"'))
+    {
+        return false;
+    }
+
+    const char *name = ptr + 1;
+    const char *close = memchr(name, *ptr, end - name);
+    size_t len;
+
+    if (close == NULL || (len = close - name) >= RW_LOCAL_NAME_LEN ||
+        memchr(name, '%', len) || memchr(name, '\\', len) ||
+        !local_variable(rses, name, len, global, true, status, reply->values[1]))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < len; i++)
+    {
+        reply->values[0][i] = tolower((unsigned char)name[i]);
+    }
+    reply->values[0][len] = '\0';
+    strcpy(reply->names[0], "Variable_name");
+    strcpy(reply->names[1], "Value");
+    reply->n_cols = 2;
+
+    return local_statement_end(local_skip_space(close + 1, end), end);
+}
+
+/**
+ * Answer a query of a connector that only reads a constant or system
+ * variables without a round trip to the backends. The variables are answered
+ * from the values the monitor cached for the servers or from the session
+ * state. The query is answered only if the replies to the earlier statements
+ * of the session have been sent, so that the replies stay in order.
+ *
+ * Router session must be locked.
+ *
+ * @param inst      Router instance
+ * @param rses      Router client session
+ * @param querybuf  The query, a contiguous buffer
+ * @return True if the query was answered
+ */
+static bool route_local_query(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                              GWBUF *querybuf)
+{
+    rw_local_reply_t reply;
+    uint16_t status;
+    char *sql;
+    int len;
+
+    if (querybuf->hint || rses->rses_load_active || rses_reply_pending(rses) ||
+        !modutil_extract_SQL(querybuf, &sql, &len))
+    {
+        return false;
+    }
+
+    /** The status of the reply tells the client whether a transaction is open */
+    if (!mysql_session_status((MySQLProtocol *)rses->client_dcb->protocol, &status))
+    {
+        status = (rses->rses_autocommit_enabled ? SERVER_STATUS_AUTOCOMMIT : 0) |
+                 (rses->rses_transaction_active ? SERVER_STATUS_IN_TRANS : 0);
+    }
+    status &= SERVER_STATUS_AUTOCOMMIT | SERVER_STATUS_IN_TRANS;
+
+    const char *end = sql + len;
+    const char *ptr = local_skip_space(sql, end);
+
+    reply.n_cols = 0;
+    reply.sent = false;
+
+    if (local_match_word(&ptr, end, "SELECT"))
+    {
+        if (!local_parse_select(rses, ptr, end, status, &reply))
+        {
+            return false;
+        }
+    }
+    else if (!local_match_word(&ptr, end, "SHOW") ||
+             !local_parse_show(rses, ptr, end, status, &reply))
+    {
+        return false;
+    }
+
+    RESULTSET *set = resultset_create(local_reply_row, &reply);
+
+    if (set == NULL)
+    {
+        return false;
+    }
+
+    set->status = status;
+
+    for (int i = 0; i < reply.n_cols; i++)
+    {
+        resultset_add_column(set, reply.names[i], RW_LOCAL_VALUE_LEN, COL_TYPE_VARCHAR);
+    }
+
+    resultset_stream_mysql(set, rses->client_dcb);
+    resultset_free(set);
+    atomic_add(&inst->stats.n_local, 1);
+    MXS_INFO("Answered \"%.*s\" without the backends.", len, sql);
+
+    return true;
+}
+
+/**
+ * Return the cached variables that a session command sets for the session,
+ * e.g. SET SESSION sql_mode or SET TRANSACTION ISOLATION LEVEL. The
+ * statement is only searched for the names of the variables.
+ *
+ * @param querybuf  The session command
+ * @return The RW_LOCAL_VAR bits of the variables
+ */
+static uint32_t local_vars_in_stmt(GWBUF *querybuf)
+{
+    uint32_t rval = 0;
+    char *sql;
+    int len;
+
+    if (modutil_extract_SQL(querybuf, &sql, &len))
+    {
+        for (int i = 0; i < len; i++)
+        {
+            size_t n = local_ident_len(sql + i, sql + len);
+
+            if (n > 0)
+            {
+                server_var_t var = server_var_find(sql + i, n);
+
+                if (var < SERVER_N_VARS)
                 {
-                    /**
-                     * If there were no available backend references
-                     * available return false - session will be closed
-                     */
-                    MXS_ERROR("Sending error message to client "
-                              "failed. Router doesn't have any "
-                              "available backends. Session will be "
-                              "closed.");
-                    succp = false;
+                    rval |= RW_LOCAL_VAR(var);
                 }
-                if (query_str)
+                else if (local_is_word(sql + i, n, "ISOLATION"))
                 {
-                    free(query_str);
+                    rval |= RW_LOCAL_VAR(SERVER_VAR_TX_ISOLATION);
                 }
-                if (qtype_str)
+                i += n - 1;
+            }
+        }
+    }
+
+    return rval;
+}
+
+/**
+ * Routing function. Find out query type, backend type, and target DCB(s).
+ * Then route query to found target(s).
+ * @param inst      router instance
+ * @param rses      router session
+ * @param querybuf  GWBUF including the query
+ *
+ * @return true if routing succeed or if it failed due to unsupported query.
+ * false if backend failure was encountered.
+ */
+static bool route_single_stmt(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+                              GWBUF *querybuf)
+{
+    qc_query_type_t qtype = QUERY_TYPE_UNKNOWN;
+    mysql_server_cmd_t packet_type = MYSQL_COM_UNDEFINED;
+    uint8_t *packet;
+    size_t packet_len;
+    int ret = 0;
+    DCB *target_dcb = NULL;
+    route_target_t route_target;
+    bool succp = false;
+    int rlag_max = MAX_RLAG_UNDEFINED;
+    backend_type_t btype; /*< target backend type */
+    bool trx_started = false;
+    bool trx_ended = false;
+    backend_ref_t *ro_trx_bref = NULL;
+    backend_ref_t *hash_bref;
+
+    ss_dassert(querybuf->next == NULL); // The buffer must be contiguous.
+    ss_dassert(!GWBUF_IS_TYPE_UNDEFINED(querybuf));
+
+    /** Only a packet routed to a single backend can be continued */
+    rses->rses_stream_bref = NULL;
+
+    packet = GWBUF_DATA(querybuf);
+    packet_len = gw_mysql_get_byte3(packet);
+
+    if (packet_len == 0)
+    {
+        /** Empty packet signals end of LOAD DATA LOCAL INFILE, send it to master*/
+        route_target = TARGET_MASTER;
+        packet_type = MYSQL_COM_UNDEFINED;
+        rses->rses_load_active = false;
+        route_target = TARGET_MASTER;
+        MXS_INFO("> LOAD DATA LOCAL INFILE finished: %lu bytes sent.",
+                 rses->rses_load_data_sent + gwbuf_length(querybuf));
+    }
+    else
+    {
+        packet_type = packet[4];
+
+        switch (packet_type)
+        {
+            case MYSQL_COM_QUIT:        /*< 1 QUIT will close all sessions */
+            case MYSQL_COM_INIT_DB:     /*< 2 DDL must go to the master */
+            case MYSQL_COM_REFRESH:     /*< 7 - I guess this is session but not sure */
+            case MYSQL_COM_DEBUG:       /*< 0d all servers dump debug info to stdout */
+            case MYSQL_COM_PING:        /*< 0e all servers are pinged */
+            case MYSQL_COM_CHANGE_USER: /*< 11 all servers change it accordingly */
+                qtype = QUERY_TYPE_SESSION_WRITE;
+                break;
+
+            case MYSQL_COM_STMT_CLOSE:          /*< free prepared statement */
+            case MYSQL_COM_STMT_SEND_LONG_DATA: /*< send data to column */
+                /** Sent to all backends as the statement is prepared in all of them */
+                qtype = QUERY_TYPE_SESSION_WRITE;
+                break;
+
+            case MYSQL_COM_CREATE_DB:           /**< 5 DDL must go to the master */
+            case MYSQL_COM_DROP_DB:             /**< 6 DDL must go to the master */
+            case MYSQL_COM_STMT_RESET: /*< resets the data of a prepared statement */
+                qtype = QUERY_TYPE_WRITE;
+                break;
+
+            case MYSQL_COM_QUERY:
+                qtype = qc_get_type(querybuf);
+                break;
+
+            case MYSQL_COM_STMT_PREPARE:
+                qtype = qc_get_type(querybuf);
+                qtype |= QUERY_TYPE_PREPARE_STMT;
+
+                /**
+                 * The statement is prepared in all backends so that its
+                 * executions can be routed to any of them. A statement that
+                 * may refer to a temporary table is only prepared in the master.
+                 */
+                if (!rses->have_tmp_tables)
                 {
-                    free(qtype_str);
+                    qtype |= QUERY_TYPE_SESSION_WRITE;
                 }
-                goto retblock;
+                break;
+
+            case MYSQL_COM_STMT_EXECUTE:
+                /** Parsing is not needed for this type of packet */
+                qtype = get_prepared_stmt_type(rses, querybuf);
+                break;
+
+            case MYSQL_COM_SHUTDOWN:       /**< 8 where should shutdown be routed ? */
+            case MYSQL_COM_STATISTICS:     /**< 9 ? */
+            case MYSQL_COM_PROCESS_INFO:   /**< 0a ? */
+            case MYSQL_COM_CONNECT:        /**< 0b ? */
+            case MYSQL_COM_PROCESS_KILL:   /**< 0c ? */
+            case MYSQL_COM_TIME:           /**< 0f should this be run in gateway ? */
+            case MYSQL_COM_DELAYED_INSERT: /**< 10 ? */
+            case MYSQL_COM_DAEMON:         /**< 1d ? */
+            default:
+                break;
+        } /**< switch by packet type */
+
+        /** This might not be absolutely necessary as some parts of the code
+         * can only be executed by one thread at a time. */
+        if (!rses_begin_locked_router_action(rses))
+        {
+            succp = false;
+            goto retblock;
+        }
+
+        /** Check for multi-statement queries. If no master server is available
+         * and a multi-statement is issued, an error is returned to the client
+         * when the query is routed.
+         *
+         * If we do not have a master node, assigning the forced node is not
+         * effective since we don't have a node to force queries to. In this
+         * situation, assigning QUERY_TYPE_WRITE for the query will trigger
+         * the error processing. */
+        if (check_for_multi_stmt(rses, querybuf, packet_type, &qtype) &&
+            rses->rses_master_ref == NULL)
+        {
+            qtype |= QUERY_TYPE_WRITE;
+        }
+
+        /**
+         * Prepared statements and locks live in the backend connection and
+         * can't be recreated from the session command history. A session
+         * that uses them keeps its backends.
+         */
+        if (rses->rses_config.rw_multiplex && !rses->rses_multiplex_blocked &&
+            (QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
+             QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT) ||
+             QUERY_IS_TYPE(qtype, QUERY_TYPE_EXEC_STMT) ||
+             (packet_type == MYSQL_COM_QUERY && is_lock_stmt(querybuf))))
+        {
+            rses->rses_multiplex_blocked = true;
+            MXS_INFO("Session uses prepared statements or locks, multiplexing is disabled.");
+        }
+
+        /**
+         * Check if the query has anything to do with temporary tables.
+         */
+        if (rses->have_tmp_tables &&
+            (packet_type == MYSQL_COM_QUERY || packet_type == MYSQL_COM_DROP_DB))
+        {
+            check_drop_tmp_table(rses, querybuf, qtype);
+            if (packet_type == MYSQL_COM_QUERY)
+            {
+                qtype = is_read_tmp_table(rses, querybuf, qtype);
             }
-            /**
-             * It is not sure if the session command in question requires
-             * response. Statement is examined in route_session_write.
-             * Router locking is done inside the function.
-             */
-            succp = route_session_write(rses, gwbuf_clone(querybuf), inst,
-                                        packet_type, qtype);
+        }
+        check_create_tmp_table(rses, querybuf, qtype);
+
+        /**
+         * The session values of the variables the session sets are not
+         * answered from the cached global values. A change of user resets them.
+         */
+        if (rses->rses_config.rw_local_queries)
+        {
+            if (packet_type == MYSQL_COM_CHANGE_USER)
+            {
+                rses->rses_local_vars_set = 0;
+            }
+            else if (packet_type == MYSQL_COM_QUERY &&
+                     QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE))
+            {
+                rses->rses_local_vars_set |= local_vars_in_stmt(querybuf);
+            }
+        }
+
+        /**
+         * Check if this is a LOAD DATA LOCAL INFILE query. If so, send all queries
+         * to the master until the last, empty packet arrives.
+         */
+        if (rses->rses_load_active)
+        {
+            rses->rses_load_data_sent += gwbuf_length(querybuf);
+        }
+        else if (packet_type == MYSQL_COM_QUERY)
+        {
+            qc_query_op_t queryop = qc_get_operation(querybuf);
+            if (queryop == QUERY_OP_LOAD)
+            {
+                rses->rses_load_active = true;
+                rses->rses_load_data_sent = 0;
+            }
+        }
+
+        rses_end_locked_router_action(rses);
+
+        /**
+         * The status of the reply to the previous command tells whether a
+         * transaction is open even when a stored procedure opened or ended it.
+         */
+        uint16_t status;
+
+        if (mysql_session_status((MySQLProtocol *)rses->client_dcb->protocol, &status))
+        {
+            rses->rses_autocommit_enabled = (status & SERVER_STATUS_AUTOCOMMIT) != 0;
+            rses->rses_transaction_active = (status & SERVER_STATUS_IN_TRANS) != 0 ||
+                                            !rses->rses_autocommit_enabled;
+        }
+
+        bool trx_was_active = rses->rses_transaction_active;
+
+        /**
+         * If autocommit is disabled or transaction is explicitly started
+         * transaction becomes active and master gets all statements until
+         * transaction is committed and autocommit is enabled again.
+         */
+        if (rses->rses_autocommit_enabled &&
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT))
+        {
+            rses->rses_autocommit_enabled = false;
+
+            if (!rses->rses_transaction_active)
+            {
+                rses->rses_transaction_active = true;
+            }
+        }
+        else if (!rses->rses_transaction_active &&
+                 QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX))
+        {
+            rses->rses_transaction_active = true;
+        }
+        /**
+         * Explicit COMMIT and ROLLBACK, implicit COMMIT.
+         */
+        if (rses->rses_autocommit_enabled && rses->rses_transaction_active &&
+            (QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
+             QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK)))
+        {
+            rses->rses_transaction_active = false;
+        }
+        else if (!rses->rses_autocommit_enabled &&
+                 QUERY_IS_TYPE(qtype, QUERY_TYPE_ENABLE_AUTOCOMMIT))
+        {
+            rses->rses_autocommit_enabled = true;
+            rses->rses_transaction_active = false;
+        }
+
+        trx_started = !trx_was_active && rses->rses_transaction_active;
+        trx_ended = trx_was_active && !rses->rses_transaction_active;
+
+        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+        {
+            if (!rses->rses_load_active)
+            {
+                uint8_t *packet = GWBUF_DATA(querybuf);
+                unsigned char ptype = packet[4];
+                size_t len = MIN(GWBUF_LENGTH(querybuf),
+                                 MYSQL_GET_PACKET_LEN((unsigned char *)querybuf->start) - 1);
+                char *data = (char *)&packet[5];
+                char *contentstr = strndup(data, MIN(len, RWSPLIT_TRACE_MSG_LEN));
+                char *qtypestr = qc_get_qtype_str(qtype);
+                MXS_INFO("> Autocommit: %s, trx is %s, cmd: %s, type: %s, stmt: %s%s %s",
+                         (rses->rses_autocommit_enabled ? "[enabled]" : "[disabled]"),
+                         (rses->rses_transaction_active ? "[open]" : "[not open]"),
+                         STRPACKETTYPE(ptype), (qtypestr == NULL ? "N/A" : qtypestr),
+                         contentstr, (querybuf->hint == NULL ? "" : ", Hint:"),
+                         (querybuf->hint == NULL ? "" : STRHINTTYPE(querybuf->hint->type)));
+                free(contentstr);
+                free(qtypestr);
+            }
+            else
+            {
+                MXS_INFO("> Processing LOAD DATA LOCAL INFILE: %lu bytes sent.",
+                         rses->rses_load_data_sent);
+            }
+        }
+        /**
+         * Find out where to route the query. Result may not be clear; it is
+         * possible to have a hint for routing to a named server which can
+         * be either slave or master.
+         * If query would otherwise be routed to slave then the hint determines
+         * actual target server if it exists.
+         *
+         * route_target is a bitfield and may include :
+         * TARGET_ALL
+         * - route to all connected backend servers
+         * TARGET_SLAVE[|TARGET_NAMED_SERVER|TARGET_RLAG_MAX]
+         * - route primarily according to hints, then to slave and if those
+         *   failed, eventually to master
+         * TARGET_MASTER[|TARGET_NAMED_SERVER|TARGET_RLAG_MAX]
+         * - route primarily according to the hints and if they failed,
+         *   eventually to master
+         */
+        route_target = get_route_target(rses, qtype, querybuf->hint);
+
+        if (TARGET_IS_ALL(route_target))
+        {
+            /** Multiple, conflicting routing target. Return error */
+            if (TARGET_IS_MASTER(route_target) || TARGET_IS_SLAVE(route_target))
+            {
+                backend_ref_t *bref = rses->rses_backend_ref;
+
+                char *query_str = modutil_get_query(querybuf);
+                char *qtype_str = qc_get_qtype_str(qtype);
+
+                MXS_ERROR("Can't route %s:%s:\"%s\". SELECT with session data "
+                          "modification is not supported if configuration parameter "
+                          "use_sql_variables_in=all .", STRPACKETTYPE(packet_type),
+                          qtype_str, (query_str == NULL ? "(empty)" : query_str));
+
+                MXS_INFO("Unable to route the query without losing session data "
+                         "modification from other servers. <");
+
+                while (bref != NULL && !BREF_IS_IN_USE(bref))
+                {
+                    bref++;
+                }
+
+                if (bref != NULL && BREF_IS_IN_USE(bref))
+                {
+                    /** Create and add MySQL error to eventqueue */
+                    modutil_reply_parse_error(bref->bref_dcb,
+                                              strdup("Routing query to backend failed. "
+                                                     "See the error log for further "
+                                                     "details."), 0);
+                    succp = true;
+                }
+                else
+                {
+                    /**
+                     * If there were no available backend references
+                     * available return false - session will be closed
+                     */
+                    MXS_ERROR("Sending error message to client "
+                              "failed. Router doesn't have any "
+                              "available backends. Session will be "
+                              "closed.");
+                    succp = false;
+                }
+                if (query_str)
+                {
+                    free(query_str);
+                }
+                if (qtype_str)
+                {
+                    free(qtype_str);
+                }
+                goto retblock;
+            }
+            /**
+             * A session command outside a transaction consumes the
+             * characteristics set by SET TRANSACTION READ ONLY.
+             */
+            if (!rses->rses_transaction_active)
+            {
+                rses->rses_ro_trx_server = NULL;
+                rses->rses_ro_trx_next = false;
+            }
+
+            /**
+             * It is not sure if the session command in question requires
+             * response. Statement is examined in route_session_write.
+             * Router locking is done inside the function.
+             */
+            succp = route_session_write(rses, gwbuf_clone(querybuf), inst,
+                                        packet_type, qtype);
+
+            if (succp)
+            {
+                atomic_add(&inst->stats.n_all, 1);
+            }
+            goto retblock;
+        }
+    }
+    /** Lock router session */
+    if (!rses_begin_locked_router_action(rses))
+    {
+        if (packet_type != MYSQL_COM_QUIT)
+        {
+            char *query_str = modutil_get_query(querybuf);
+
+            MXS_ERROR("Can't route %s:%s:\"%s\" to "
+                      "backend server. Router is closed.",
+                      STRPACKETTYPE(packet_type), STRQTYPE(qtype),
+                      (query_str == NULL ? "(empty)" : query_str));
+            free(query_str);
+        }
+        succp = false;
+        goto retblock;
+    }
+
+    if (rses->rses_slaves_pending &&
+        (TARGET_IS_SLAVE(route_target) || TARGET_IS_NAMED_SERVER(route_target) ||
+         TARGET_IS_RLAG_MAX(route_target) || QUERY_IS_TYPE(qtype, QUERY_TYPE_READ_ONLY_TRX)))
+    {
+        connect_pending_slaves(rses);
+    }
+
+    DCB *master_dcb = rses->rses_master_ref ? rses->rses_master_ref->bref_dcb : NULL;
+
+    if (!get_read_only_trx_target(rses, qtype, trx_started, trx_ended, &ro_trx_bref))
+    {
+        MXS_ERROR("The slave server that the read-only transaction was routed "
+                  "to is no longer available.");
+        rses_end_locked_router_action(rses);
+        goto retblock;
+    }
+
+    /**
+     * A read-only transaction is routed to one slave from its start
+     * until it is committed or rolled back.
+     */
+    if (ro_trx_bref)
+    {
+        target_dcb = ro_trx_bref->bref_dcb;
+        route_target = TARGET_SLAVE;
+        atomic_add(&inst->stats.n_slave, 1);
+        succp = true;
+    }
+    /**
+     * There is a hint which either names the target backend or
+     * hint which sets maximum allowed replication lag for the
+     * backend.
+     */
+    else if (TARGET_IS_NAMED_SERVER(route_target) ||
+             TARGET_IS_RLAG_MAX(route_target))
+    {
+        HINT *hint;
+        char *named_server = NULL;
+        int named_server_id = 0;
+
+        hint = querybuf->hint;
+
+        while (hint != NULL)
+        {
+            if (hint->type == HINT_ROUTE_TO_NAMED_SERVER)
+            {
+                /**
+                 * Set the name of searched
+                 * backend server.
+                 */
+                named_server = hint->data;
+                named_server_id = hint->id;
+                MXS_INFO("Hint: route to server "
+                         "'%s'",
+                         named_server);
+            }
+            else if (hint->type == HINT_PARAMETER &&
+                     hint_name_is(hint, rwsplit_rlag_hint_id, "max_slave_replication_lag"))
+            {
+                int val = parse_rlag_ms((char *)hint->value);
+
+                if (val >= 0)
+                {
+                    /** Set max. acceptable replication lag value for backend srv */
+                    rlag_max = val;
+                    MXS_INFO("Hint: max_slave_replication_lag=%d ms", rlag_max);
+                }
+            }
+            hint = hint->next;
+        } /*< while */
+
+        if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
+        {
+            rlag_max = rses_get_max_replication_lag(rses);
+        }
+
+        /** target may be master or slave */
+        btype = route_target & TARGET_SLAVE ? BE_SLAVE : BE_MASTER;
+
+        /**
+         * Search backend server by name or replication lag.
+         * If it fails, then try to find valid slave or master.
+         */
+        succp = get_dcb(&target_dcb, rses, btype, named_server, named_server_id, rlag_max, NULL);
+
+        if (!succp)
+        {
+            if (TARGET_IS_NAMED_SERVER(route_target))
+            {
+                MXS_INFO("Was supposed to route to named server "
+                         "%s but couldn't find the server in a "
+                         "suitable state.", named_server);
+            }
+            else if (TARGET_IS_RLAG_MAX(route_target))
+            {
+                MXS_INFO("Was supposed to route to server with "
+                         "replication lag at most %d ms but couldn't "
+                         "find such a slave.", rlag_max);
+            }
+        }
+    }
+    else if (TARGET_IS_SLAVE(route_target))
+    {
+        btype = BE_SLAVE;
+
+        if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
+        {
+            rlag_max = rses_get_max_replication_lag(rses);
+        }
+        POOL_RULE *pool = rses->rses_config.rw_pool_rules ?
+                          pool_rule_match(rses, querybuf) : NULL;
+
+        if (pool)
+        {
+            /**
+             * The slaves of the pools are connected when the first read of
+             * their pool arrives. If none of them can be used, the read is
+             * routed like any other read.
+             */
+            backend_ref_t *pool_bref;
+
+            if (get_dcb(&target_dcb, rses, BE_SLAVE, NULL, 0, rlag_max, pool) ||
+                ((pool_bref = connect_pool_slave(rses, pool)) != NULL &&
+                 (target_dcb = pool_bref->bref_dcb) != NULL))
+            {
+                MXS_INFO("Read matches the pool rule '%s', routing it to %s=%s.",
+                         pool->value, pool->tag_name, pool->tag_value);
+                atomic_add(&inst->stats.n_pool, 1);
+                succp = true;
+            }
+            else
+            {
+                MXS_INFO("No slave of the pool %s=%s is available.",
+                         pool->tag_name, pool->tag_value);
+                target_dcb = NULL;
+            }
+        }
+        /**
+         * Search suitable backend server, get DCB in target_dcb
+         */
+        if (!succp)
+        {
+            succp = get_dcb(&target_dcb, rses, BE_SLAVE, NULL, 0, rlag_max, NULL);
+        }
+
+        if (succp)
+        {
+#if defined(SS_EXTRA_DEBUG)
+            MXS_INFO("Found DCB for slave.");
+#endif
+            atomic_add(&inst->stats.n_slave, 1);
+        }
+        else
+        {
+            MXS_INFO("Was supposed to route to slave but finding suitable one failed.");
+        }
+    }
+    /**
+     * With galera_write_hash the writes are spread over the Galera nodes by
+     * the tables they use.
+     */
+    else if (TARGET_IS_MASTER(route_target) &&
+             (hash_bref = get_write_hash_bref(rses, querybuf, packet_type, qtype)) != NULL)
+    {
+        target_dcb = hash_bref->bref_dcb;
+        atomic_add(&inst->stats.n_write_hash, 1);
+        succp = true;
+    }
+    else if (TARGET_IS_MASTER(route_target))
+    {
+        DCB *curr_master_dcb = NULL;
+
+        succp = get_dcb(&curr_master_dcb, rses, BE_MASTER, NULL, 0, MAX_RLAG_UNDEFINED, NULL);
+
+        if (succp && master_dcb == curr_master_dcb)
+        {
+            atomic_add(&inst->stats.n_master, 1);
+            target_dcb = master_dcb;
+        }
+        else
+        {
+            if (succp && master_dcb != curr_master_dcb)
+            {
+                MXS_INFO("Was supposed to route to master but master has changed.");
+            }
+            else
+            {
+                MXS_INFO("Was supposed to route to master but couldn't find master"
+                         " in a suitable state.");
+            }
+
+            if (rses->rses_config.rw_master_failure_mode == RW_ERROR_ON_WRITE)
+            {
+                /** Old master is no longer available */
+                succp = send_readonly_error(rses->client_dcb);
+            }
+            else
+            {
+                MXS_WARNING("[%s] Write query received from %s@%s when no master is "
+                            "available, closing client connection.", inst->service->name,
+                            rses->client_dcb->user, rses->client_dcb->remote);
+                succp = false;
+            }
+
+            rses_end_locked_router_action(rses);
+            goto retblock;
+        }
+    }
+
+    if (succp) /*< Have DCB of the target backend */
+    {
+        backend_ref_t *bref;
+        sescmd_cursor_t *scur;
+
+        bref = get_bref_from_dcb(rses, target_dcb);
+        scur = &bref->bref_sescmd_cur;
+
+        ss_dassert(target_dcb != NULL);
+
+        session_latency_target(target_dcb->session, bref->bref_backend->backend_server,
+                               !TARGET_IS_SLAVE(route_target));
+
+        MXS_INFO("Route query to %s \t%s:%d <",
+                 (SERVER_IS_MASTER(bref->bref_backend->backend_server) ? "master"
+                  : "slave"), bref->bref_backend->backend_server->name,
+                 bref->bref_backend->backend_server->port);
+        if (rses->rses_config.rw_causal_reads && bref == rses->rses_master_ref &&
+            !QUERY_IS_TYPE(qtype, QUERY_TYPE_READ))
+        {
+            /** Reads after this one must see its changes */
+            rses->rses_write_active = true;
+        }
+
+        /**
+         * Queue the statement if execution of previous session commands
+         * hasn't completed yet.
+         *
+         * A client that pipelines its queries can send several statements
+         * before the session commands are replied to. The statements are
+         * appended to bref_pending_cmd in the order they arrive and are all
+         * sent in one write once the session commands are done. The server
+         * replies to them in the same order, so the replies are tracked to
+         * know which of them belong to a COM_STMT_PREPARE and when the last
+         * one has ended. The statements routed while the replies are tracked
+         * are tracked as well.
+         */
+        uint32_t ps_id = packet_type == MYSQL_COM_STMT_PREPARE ? ++rses->rses_ps_seq : 0;
+        bool tracked = sescmd_cursor_is_active(scur) || bref->bref_n_batch > 0;
+
+        if (tracked && !bref_ps_fifo_reserve(bref, ps_id))
+        {
+            MXS_ERROR("Failed to allocate memory for the queued statements of a session.");
+            rses_end_locked_router_action(rses);
+            succp = false;
+            goto retblock;
+        }
+        else if (!tracked && ps_id)
+        {
+            bref->bref_ps_pending = ps_id;
+        }
+
+        rses->rses_stream_bref = bref;
+
+        if (sescmd_cursor_is_active(scur))
+        {
+            bref->bref_pending_cmd = gwbuf_append(bref->bref_pending_cmd,
+                                                  bref_ps_clone(bref, querybuf));
+            bref->bref_n_queued++;
+
+            if (rses->rses_config.rw_multiplex)
+            {
+                bref->bref_reply_count++;
+            }
+
+            rses_end_locked_router_action(rses);
+            goto retblock;
+        }
+
+        int len = gwbuf_length(querybuf);
+        bool hedge = hedge_allowed(rses, bref, route_target, packet_type);
+
+        if ((ret = target_dcb->func.write(target_dcb, bref_ps_clone(bref, querybuf))) == 1)
+        {
+            atomic_add(&inst->stats.n_queries, 1);
+            ts_stats_add(bref->bref_backend->backend_stats->queries, 1);
+            ts_stats_add(bref->bref_backend->backend_stats->bytes_out, len);
+            /**
+             * Add one query response waiter to backend reference
+             */
+            if (tracked)
+            {
+                bref->bref_n_batch++;
+            }
+            else
+            {
+                bref->bref_query_start = latency_now();
+            }
+            bref_set_state(bref, BREF_QUERY_ACTIVE);
+            bref_set_state(bref, BREF_WAITING_RESULT);
+
+            if (rses->rses_config.rw_multiplex)
+            {
+                bref->bref_reply_count++;
+            }
+
+            if (hedge)
+            {
+                hedge_arm(rses, bref, querybuf);
+            }
+        }
+        else
+        {
+            MXS_ERROR("Routing query failed.");
+
+            if (!tracked)
+            {
+                bref->bref_ps_pending = 0;
+            }
+            succp = false;
+        }
+    }
+    rses_end_locked_router_action(rses);
+
+retblock :
+#if defined(SS_DEBUG2)
+    {
+        char *canonical_query_str;
+
+        canonical_query_str = skygw_get_canonical(querybuf);
+
+        if (canonical_query_str != NULL)
+        {
+            MXS_INFO("Canonical version: %s", canonical_query_str);
+            free(canonical_query_str);
+        }
+    }
+#endif
+    return succp;
+}
+
+/**
+ * @node Acquires lock to router client session if it is not closed.
+ *
+ * Parameters:
+ * @param rses - in, use
+ *
+ *
+ * @return true if router session was not closed. If return value is true
+ * it means that router is locked, and must be unlocked later. False, if
+ * router was closed before lock was acquired.
+ *
+ *
+ * @details (write detailed description here)
+ *
+ */
+static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES *rses)
+{
+    bool succp = false;
+
+    if (rses == NULL)
+    {
+        return false;
+    }
+
+    CHK_CLIENT_RSES(rses);
+
+    if (rses->rses_closed)
+    {
+
+        goto return_succp;
+    }
+    spinlock_acquire(&rses->rses_lock);
+    if (rses->rses_closed)
+    {
+        spinlock_release(&rses->rses_lock);
+        goto return_succp;
+    }
+    succp = true;
+
+return_succp:
+    return succp;
+}
+
+/** to be inline'd */
+
+/**
+ * @node Releases router client session lock.
+ *
+ * Parameters:
+ * @param rses - <usage>
+ *          <description>
+ *
+ * @return void
+ *
+ *
+ * @details (write detailed description here)
+ *
+ */
+static void rses_end_locked_router_action(ROUTER_CLIENT_SES *rses)
+{
+    CHK_CLIENT_RSES(rses);
+    spinlock_release(&rses->rses_lock);
+}
+
+/**
+ * Diagnostics routine
+ *
+ * Print query router statistics to the DCB passed in
+ *
+ * @param   instance    The router instance
+ * @param   dcb     The DCB for diagnostic output
+ */
+static void diagnostic(ROUTER *instance, DCB *dcb)
+{
+    ROUTER_CLIENT_SES *router_cli_ses;
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)instance;
+    int i = 0;
+    BACKEND *backend;
+    char *weightby;
+
+    spinlock_acquire(&router->lock);
+    router_cli_ses = router->connections;
+    while (router_cli_ses)
+    {
+        i++;
+        router_cli_ses = router_cli_ses->next;
+    }
+    spinlock_release(&router->lock);
+
+    double master_pct = 0.0, slave_pct = 0.0, all_pct = 0.0;
+
+    if (router->stats.n_queries > 0)
+    {
+        master_pct = ((double)router->stats.n_master / (double)router->stats.n_queries) * 100.0;
+        slave_pct = ((double)router->stats.n_slave / (double)router->stats.n_queries) * 100.0;
+        all_pct = ((double)router->stats.n_all / (double)router->stats.n_queries) * 100.0;
+    }
+
+    dcb_printf(dcb, "\tNumber of router sessions:           	%d\n",
+               router->stats.n_sessions);
+    dcb_printf(dcb, "\tCurrent no. of router sessions:      	%d\n", i);
+    dcb_printf(dcb, "\tNumber of queries forwarded:          	%d\n",
+               router->stats.n_queries);
+    dcb_printf(dcb, "\tNumber of queries forwarded to master:	%d (%.2f%%)\n",
+               router->stats.n_master, master_pct);
+    dcb_printf(dcb, "\tNumber of queries forwarded to slave: 	%d (%.2f%%)\n",
+               router->stats.n_slave, slave_pct);
+    dcb_printf(dcb, "\tNumber of queries forwarded to all:   	%d (%.2f%%)\n",
+               router->stats.n_all, all_pct);
+    dcb_printf(dcb, "\tNumber of queries answered locally:   	%d\n",
+               router->stats.n_local);
+    dcb_printf(dcb, "\tNumber of fallback slave connections: 	%d\n",
+               router->stats.n_fallback);
+    dcb_printf(dcb, "\tNumber of queries forwarded to pools: 	%d\n",
+               router->stats.n_pool);
+    dcb_printf(dcb, "\tNumber of writes routed by table hash:	%d\n",
+               router->stats.n_write_hash);
+    dcb_printf(dcb, "\tNumber of hedged reads:               	%d\n",
+               router->stats.n_hedged);
+    dcb_printf(dcb, "\tNumber of hedged reads won by hedge:  	%d\n",
+               router->stats.n_hedge_won);
+
+    if ((weightby = serviceGetWeightingParameter(router->service)) != NULL)
+    {
+        dcb_printf(dcb, "\tConnection distribution based on %s "
+                   "server parameter.\n",
+                   weightby);
+        dcb_printf(dcb, "\t\tServer               Target %%    Connections  "
+                   "Operations\n");
+        dcb_printf(dcb, "\t\t                               Global  Router\n");
+        for (i = 0; router->servers[i]; i++)
+        {
+            backend = router->servers[i];
+            dcb_printf(dcb, "\t\t%-20s %3.1f%%     %-6d  %-6d  %d\n",
+                       backend->backend_server->unique_name, (float)backend->weight / 10,
+                       backend->backend_server->stats.n_current, backend->backend_conn_count,
+                       backend->backend_server->stats.n_current_ops);
+        }
+    }
+
+    dcb_printf(dcb, "\tTraffic routed to the servers:\n");
+    dcb_printf(dcb, BACKEND_STATS_HEADER);
+    for (i = 0; router->servers[i]; i++)
+    {
+        backend = router->servers[i];
+        dprintBackendStats(dcb, backend->backend_server, backend->backend_stats);
+    }
+}
+
+/**
+ * Client Reply routine
+ *
+ * The routine will reply to client for session change with master server data
+ *
+ * @param   instance    The router instance
+ * @param   router_session  The router session
+ * @param   backend_dcb The backend DCB
+ * @param   queue       The GWBUF with reply data
+ */
+static void clientReply(ROUTER *instance, void *router_session, GWBUF *writebuf,
+                        DCB *backend_dcb)
+{
+    DCB *client_dcb;
+    ROUTER_CLIENT_SES *router_cli_ses;
+    sescmd_cursor_t *scur = NULL;
+    backend_ref_t *bref;
+
+    router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
+    CHK_CLIENT_RSES(router_cli_ses);
+
+    /**
+     * Lock router client session for secure read of router session members.
+     * Note that this could be done without lock by using version #
+     */
+    if (!rses_begin_locked_router_action(router_cli_ses))
+    {
+        print_error_packet(router_cli_ses, writebuf, backend_dcb);
+        goto lock_failed;
+    }
+    /** Holding lock ensures that router session remains open */
+    ss_dassert(backend_dcb->session != NULL);
+    client_dcb = backend_dcb->session->client_dcb;
+
+    /** Unlock */
+    rses_end_locked_router_action(router_cli_ses);
+    /**
+     * 1. Check if backend received reply to sescmd.
+     * 2. Check sescmd's state whether OK_PACKET has been
+     *    sent to client already and if not, lock property cursor,
+     *    reply to client, and move property cursor forward. Finally
+     *    release the lock.
+     * 3. If reply for this sescmd is sent, lock property cursor
+     *    and
+     */
+    if (client_dcb == NULL)
+    {
+        gwbuf_free(writebuf);
+        /** Log that client was closed before reply */
+        goto lock_failed;
+    }
+    /** Lock router session */
+    if (!rses_begin_locked_router_action(router_cli_ses))
+    {
+        /** Log to debug that router was closed */
+        goto lock_failed;
+    }
+    bref = get_bref_from_dcb(router_cli_ses, backend_dcb);
+
+#if !defined(FOR_BUG548_FIX_ONLY)
+    /** This makes the issue becoming visible in poll.c */
+    if (bref == NULL)
+    {
+        /** Unlock router session */
+        rses_end_locked_router_action(router_cli_ses);
+        goto lock_failed;
+    }
+#endif
+
+    CHK_BACKEND_REF(bref);
+    scur = &bref->bref_sescmd_cur;
+    ts_stats_add(bref->bref_backend->backend_stats->bytes_in, gwbuf_length(writebuf));
+
+    if (BREF_IS_DRAINING(bref) && !sescmd_cursor_is_active(scur))
+    {
+        /** What is left after the discarded reply is the reply to a later statement */
+        writebuf = hedge_drain_reply(bref, writebuf);
+    }
+    else if (bref == router_cli_ses->rses_hedge_bref[0] ||
+             bref == router_cli_ses->rses_hedge_bref[1])
+    {
+        hedge_decide(router_cli_ses, bref);
+    }
+
+    int n_batch = bref->bref_n_batch;
+
+    if (writebuf && (bref->bref_reply_count > 0 || n_batch > 0) &&
+        !sescmd_cursor_is_active(scur))
+    {
+        bref_track_reply(bref, writebuf, MAX(bref->bref_reply_count, n_batch));
+    }
+
+    /**
+     * Active cursor means that reply is from session command
+     * execution.
+     */
+    if (sescmd_cursor_is_active(scur))
+    {
+        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_ERR) && !bref->bref_sescmd_partial &&
+            MYSQL_IS_ERROR_PACKET(((uint8_t *)GWBUF_DATA(writebuf))))
+        {
+            uint8_t *buf = (uint8_t *)GWBUF_DATA((scur->scmd_cur_cmd->my_sescmd_buf));
+            uint8_t *replybuf = (uint8_t *)GWBUF_DATA(writebuf);
+            size_t len = MYSQL_GET_PACKET_LEN(buf);
+            size_t replylen = MYSQL_GET_PACKET_LEN(replybuf);
+            char *err = strndup(&((char *)replybuf)[8], 5);
+            char *replystr = strndup(&((char *)replybuf)[13], replylen - 4 - 5);
+
+            ss_dassert(len + 4 == GWBUF_LENGTH(scur->scmd_cur_cmd->my_sescmd_buf));
+
+            MXS_ERROR("Failed to execute session command in %s:%d. Error was: %s %s",
+                      bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port, err, replystr);
+            free(err);
+            free(replystr);
+        }
+
+        if (GWBUF_IS_TYPE_SESCMD_RESPONSE(writebuf))
+        {
+            /**
+             * Discard all those responses that have already been sent to
+             * the client. Return with buffer including response that
+             * needs to be sent to client or NULL.
+             */
+            bool rconn = false;
+            writebuf = sescmd_cursor_process_replies(writebuf, bref, &rconn);
+
+            if (rconn && !router_cli_ses->rses_config.rw_disable_sescmd_hist)
+            {
+                select_connect_backend_servers(
+                    &router_cli_ses->rses_master_ref, router_cli_ses->rses_backend_ref,
+                    router_cli_ses->rses_nbackends,
+                    router_cli_ses->rses_config.rw_max_slave_conn_count,
+                    rses_get_max_replication_lag(router_cli_ses),
+                    router_cli_ses->rses_config.rw_slave_select_criteria,
+                    router_cli_ses->rses_master_ref->bref_dcb->session,
+                    router_cli_ses->router);
+            }
+        }
+        /**
+         * If response will be sent to client, decrease waiter count.
+         * This applies to session commands only. Counter decrement
+         * for other type of queries is done outside this block.
+         */
+        if (!bref->bref_sescmd_partial)
+        {
+            /** Set response status as replied */
+            bref_clear_state(bref, BREF_WAITING_RESULT);
+        }
+    }
+    /**
+     * Clear BREF_QUERY_ACTIVE flag and decrease waiter counter.
+     * This applies for queries  other than session commands.
+     */
+    else if (BREF_IS_QUERY_ACTIVE(bref) && !BREF_IS_DRAINING(bref))
+    {
+        if (router_cli_ses->rses_write_active && bref == router_cli_ses->rses_master_ref)
+        {
+            /** The write is committed, positions read from now on include it */
+            router_cli_ses->rses_last_write = latency_now();
+            router_cli_ses->rses_write_active = false;
+        }
+        if (n_batch > 0)
+        {
+            /** Each tracked statement that got its reply adds a response time */
+            for (int i = bref->bref_n_batch; i < n_batch; i++)
+            {
+                uint64_t start = bref->bref_query_start;
+                bref_update_response_time(bref);
+
+                if (bref->bref_n_batch > 0)
+                {
+                    bref->bref_query_start = start;
+                }
+            }
+        }
+        else if (bref->bref_ps_pending)
+        {
+            bref_map_ps_reply(bref, bref->bref_ps_pending, writebuf, 0);
+            bref->bref_ps_pending = 0;
+        }
+
+        if (bref->bref_n_batch == 0)
+        {
+            bref_update_response_time(bref);
+            bref_clear_state(bref, BREF_QUERY_ACTIVE);
+            /** Set response status as replied */
+            bref_clear_state(bref, BREF_WAITING_RESULT);
+        }
+    }
+
+    if (writebuf != NULL && client_dcb != NULL)
+    {
+        /** Write reply to client DCB */
+        SESSION_ROUTE_REPLY(backend_dcb->session, writebuf);
+    }
+    /** Unlock router session */
+    rses_end_locked_router_action(router_cli_ses);
+
+    /** Lock router session */
+    if (!rses_begin_locked_router_action(router_cli_ses))
+    {
+        /** Log to debug that router was closed */
+        goto lock_failed;
+    }
+    if (bref->bref_sescmd_partial)
+    {
+        /** The rest of the session command reply is still to come */
+    }
+    /** There is one pending session command to be executed. */
+    else if (sescmd_cursor_is_active(scur))
+    {
+        bool succp;
+
+        MXS_INFO("Backend %s:%d processed reply and starts to execute "
+                 "active cursor.", bref->bref_backend->backend_server->name,
+                 bref->bref_backend->backend_server->port);
+
+        succp = execute_sescmd_in_backend(bref);
+
+        if (!succp)
+        {
+            MXS_INFO("Backend %s:%d failed to execute session command.",
+                     bref->bref_backend->backend_server->name,
+                     bref->bref_backend->backend_server->port);
+        }
+    }
+    else if (bref->bref_pending_cmd != NULL) /*< non-sescmds are waiting to be routed */
+    {
+        int ret;
+        int len = gwbuf_length(bref->bref_pending_cmd);
+        int n_queued = bref->bref_n_queued;
+
+        CHK_GWBUF(bref->bref_pending_cmd);
+
+        /** All queued statements are sent in one write, in their original order */
+        if ((ret = bref->bref_dcb->func.write(bref->bref_dcb,
+                       gwbuf_clone_all(bref->bref_pending_cmd))) == 1)
+        {
+            ROUTER_INSTANCE* inst = (ROUTER_INSTANCE *)instance;
+            atomic_add(&inst->stats.n_queries, n_queued);
+            ts_stats_add(bref->bref_backend->backend_stats->queries, n_queued);
+            ts_stats_add(bref->bref_backend->backend_stats->bytes_out, len);
+            /**
+             * The backend stays active until the replies to all the
+             * statements have ended
+             */
+            bref->bref_query_start = latency_now();
+            bref->bref_n_batch += n_queued;
+            bref_set_state(bref, BREF_QUERY_ACTIVE);
+            bref_set_state(bref, BREF_WAITING_RESULT);
+        }
+        else
+        {
+            char* sql = modutil_get_SQL(bref->bref_pending_cmd);
+
+            if (sql)
+            {
+                MXS_ERROR("Routing query \"%s\" failed.", sql);
+                free(sql);
+            }
+            else
+            {
+                MXS_ERROR("Failed to route query.");
+            }
+        }
+        gwbuf_free(bref->bref_pending_cmd);
+        bref->bref_pending_cmd = NULL;
+        bref->bref_n_queued = 0;
+    }
+    else if (router_cli_ses->rses_config.rw_multiplex)
+    {
+        release_idle_backends(router_cli_ses);
+    }
+    /** Unlock router session */
+    rses_end_locked_router_action(router_cli_ses);
+
+lock_failed:
+    return;
+}
+
+/** Compare nunmber of connections from this router in backend servers */
+int bref_cmp_router_conn(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    if (b1->weight == 0 && b2->weight == 0)
+    {
+        return b1->backend_server->stats.n_current -
+               b2->backend_server->stats.n_current;
+    }
+    else if (b1->weight == 0)
+    {
+        return 1;
+    }
+    else if (b2->weight == 0)
+    {
+        return -1;
+    }
+
+    return ((1000 + 1000 * b1->backend_conn_count) / SERVER_WEIGHT(b1->backend_server, b1->weight)) -
+           ((1000 + 1000 * b2->backend_conn_count) / SERVER_WEIGHT(b2->backend_server, b2->weight));
+}
+
+/** Compare nunmber of global connections in backend servers */
+int bref_cmp_global_conn(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    if (b1->weight == 0 && b2->weight == 0)
+    {
+        return b1->backend_server->stats.n_current -
+               b2->backend_server->stats.n_current;
+    }
+    else if (b1->weight == 0)
+    {
+        return 1;
+    }
+    else if (b2->weight == 0)
+    {
+        return -1;
+    }
+
+    return ((1000 + 1000 * b1->backend_server->stats.n_current) /
+            SERVER_WEIGHT(b1->backend_server, b1->weight)) -
+           ((1000 + 1000 * b2->backend_server->stats.n_current) /
+            SERVER_WEIGHT(b2->backend_server, b2->weight));
+}
+
+/** Compare relication lag between backend servers */
+int bref_cmp_behind_master(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    return ((b1->backend_server->rlag_us < b2->backend_server->rlag_us) ? -1
+            : ((b1->backend_server->rlag_us > b2->backend_server->rlag_us) ? 1 : 0));
+}
+
+/** Compare nunmber of current operations in backend servers */
+int bref_cmp_current_load(const void *bref1, const void *bref2)
+{
+    SERVER *s1 = ((backend_ref_t *)bref1)->bref_backend->backend_server;
+    SERVER *s2 = ((backend_ref_t *)bref2)->bref_backend->backend_server;
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    if (b1->weight == 0 && b2->weight == 0)
+    {
+        return b1->backend_server->stats.n_current -
+               b2->backend_server->stats.n_current;
+    }
+    else if (b1->weight == 0)
+    {
+        return 1;
+    }
+    else if (b2->weight == 0)
+    {
+        return -1;
+    }
+
+    return ((1000 * s1->stats.n_current_ops) - SERVER_WEIGHT(s1, b1->weight)) -
+           ((1000 * s2->stats.n_current_ops) - SERVER_WEIGHT(s2, b2->weight));
+}
+
+/** Compare the average response times of backend servers */
+int bref_cmp_response_time(const void *bref1, const void *bref2)
+{
+    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
+    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+
+    if (b1->weight == 0 && b2->weight == 0)
+    {
+        return b1->backend_response_time < b2->backend_response_time ? -1 :
+               (b1->backend_response_time > b2->backend_response_time ? 1 : 0);
+    }
+    else if (b1->weight == 0)
+    {
+        return 1;
+    }
+    else if (b2->weight == 0)
+    {
+        return -1;
+    }
+
+    int64_t t1 = (int64_t)b1->backend_response_time * 1000 /
+                 SERVER_WEIGHT(b1->backend_server, b1->weight);
+    int64_t t2 = (int64_t)b2->backend_response_time * 1000 /
+                 SERVER_WEIGHT(b2->backend_server, b2->weight);
+
+    return t1 < t2 ? -1 : (t1 > t2 ? 1 : 0);
+}
+
+/**
+ * Compare the scores of backend servers for the affinity key of the session.
+ * The server with the highest score comes first. Sessions without a key get
+ * the same score for all servers and are balanced by the current operations.
+ */
+int bref_cmp_affinity(const void *bref1, const void *bref2)
+{
+    double a1 = ((backend_ref_t *)bref1)->bref_affinity;
+    double a2 = ((backend_ref_t *)bref2)->bref_affinity;
+
+    if (a1 == a2)
+    {
+        return bref_cmp_current_load(bref1, bref2);
+    }
+
+    return a1 > a2 ? -1 : 1;
+}
+
+/**
+ * Check if a slave has replicated the last write of the session. The position
+ * of the master includes the write only if the monitor read it after the write
+ * was replied to. Until then no slave is known to have the write.
+ *
+ * @param bref Backend reference of the slave
+ * @param master_pos GTID position of the master
+ * @param last_write When the last write of the session was replied to
+ * @return True if the slave has replicated the write
+ */
+static bool bref_has_replicated_write(backend_ref_t *bref, SERVER_GTID_POS *master_pos,
+                                      uint64_t last_write)
+{
+    SERVER_GTID_POS pos;
+
+    if (master_pos->read_at <= last_write)
+    {
+        return false;
+    }
+
+    server_get_gtid_pos(bref->bref_backend->backend_server, &pos);
+    return server_gtid_pos_reached(&pos, master_pos);
+}
+
+/**
+ * Choose the criteria for one slave selection. With LEAST_RESPONSE_TIME the
+ * servers with a slow average would never be chosen again, so now and then
+ * the current load is used instead to give them new samples.
+ *
+ * @param sc The configured slave selection criteria
+ * @return The criteria to use
+ */
+static select_criteria_t get_select_criteria(select_criteria_t sc)
+{
+    if (sc == LEAST_RESPONSE_TIME && random_jkiss() % RESPONSE_TIME_EXPLORE_RATIO == 0)
+    {
+        sc = LEAST_CURRENT_OPERATIONS;
+    }
+
+    return sc;
+}
+
+/**
+ * Add the response time of the query a backend just replied to to the moving
+ * average of the server. Concurrent updates from other sessions may be lost,
+ * which only makes the average a little less accurate.
+ *
+ * @param bref Backend reference that replied
+ */
+static void bref_update_response_time(backend_ref_t *bref)
+{
+    if (bref->bref_query_start)
+    {
+        BACKEND *b = bref->bref_backend;
+        uint64_t usecs = latency_now() - bref->bref_query_start;
+        int sample = usecs < INT_MAX ? (int)usecs : INT_MAX;
+        int avg = b->backend_response_time;
+
+        b->backend_response_time = avg ? avg + (sample - avg) / RESPONSE_TIME_AVG_WEIGHT : sample;
+        ts_histogram_add(b->backend_stats->latency, usecs);
+        bref->bref_query_start = 0;
+    }
+}
+
+static void bref_clear_state(backend_ref_t *bref, bref_state_t state)
+{
+    if (bref == NULL)
+    {
+        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
+        return;
+    }
+
+    if ((state & BREF_WAITING_RESULT) && (bref->bref_state & BREF_WAITING_RESULT))
+    {
+        int prev1;
+        int prev2;
+
+        /** Decrease waiter count */
+        prev1 = atomic_add(&bref->bref_num_result_wait, -1);
+
+        if (prev1 <= 0)
+        {
+            atomic_add(&bref->bref_num_result_wait, 1);
+        }
+        else
+        {
+            /** Decrease global operation count */
+            prev2 = atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, -1);
+            ss_dassert(prev2 > 0);
+            if (prev2 <= 0)
+            {
+                MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
+                          __FUNCTION__, bref->bref_backend->backend_server->name,
+                          bref->bref_backend->backend_server->port);
+            }
+        }
+    }
+
+    bref->bref_state &= ~state;
+}
+
+static void bref_set_state(backend_ref_t *bref, bref_state_t state)
+{
+    if (bref == NULL)
+    {
+        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
+        return;
+    }
+
+    if ((state & BREF_WAITING_RESULT) && (bref->bref_state & BREF_WAITING_RESULT) == 0)
+    {
+        int prev1;
+        int prev2;
+
+        /** Increase waiter count */
+        prev1 = atomic_add(&bref->bref_num_result_wait, 1);
+        ss_dassert(prev1 >= 0);
+        if (prev1 < 0)
+        {
+            MXS_ERROR("[%s] Error: negative number of connections waiting for "
+                      "results in backend %s:%u",
+                      __FUNCTION__, bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port);
+        }
+        /** Increase global operation count */
+        prev2 =
+            atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, 1);
+        ss_dassert(prev2 >= 0);
+        if (prev2 < 0)
+        {
+            MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
+                      __FUNCTION__, bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port);
+        }
+    }
+
+    bref->bref_state |= state;
+}
+
+/**
+ * @brief Connect a server
+ *
+ * Connects to a server, adds callbacks to the created DCB and updates
+ * router statistics. If @p execute_history is true, the session command
+ * history will be executed on this server.
+ *
+ * @param b Router's backend structure for the server
+ * @param session Client's session object
+ * @param execute_history Execute session command history
+ * @return True if successful, false if an error occurred
+ */
+bool connect_server(backend_ref_t *bref, SESSION *session, bool execute_history)
+{
+    SERVER *serv = bref->bref_backend->backend_server;
+    bool rval = false;
+    /** A closed reference had a connection that failed or was closed */
+    bool reconnect = BREF_IS_CLOSED(bref);
+
+    bref->bref_dcb = dcb_connect(serv, session, serv->protocol);
+
+    if (bref->bref_dcb != NULL)
+    {
+        bref_clear_state(bref, BREF_CLOSED);
+        bref->bref_sescmd_partial = false;
+        bref->bref_sescmd_forward = false;
+
+        if (!execute_history || execute_sescmd_history(bref))
+        {
+            /** Add a callback for unresponsive server */
+            dcb_add_callback(bref->bref_dcb, DCB_REASON_NOT_RESPONDING,
+                             &router_handle_state_switch, (void *) bref);
+            bref->bref_state = 0;
+            bref->bref_reply_count = 0;
+            bref->bref_reply_state = REPLY_STATE_START;
+            bref->bref_n_queued = 0;
+            bref->bref_n_batch = 0;
+            /** The history executes the prepares again */
+            memset(bref->bref_ps_ids, 0, bref->bref_ps_ids_size * sizeof(uint32_t));
+            bref->bref_ps_pending = 0;
+            bref_set_state(bref, BREF_IN_USE);
+            atomic_add(&bref->bref_backend->backend_conn_count, 1);
+            rval = true;
 
-            if (succp)
+            if (reconnect)
             {
-                atomic_add(&inst->stats.n_all, 1);
+                ts_stats_add(bref->bref_backend->backend_stats->reconnects, 1);
             }
-            goto retblock;
+        }
+        else
+        {
+            MXS_ERROR("Failed to execute session command in %s (%s:%d). See earlier "
+                      "errors for more details.",
+                      bref->bref_backend->backend_server->unique_name,
+                      bref->bref_backend->backend_server->name,
+                      bref->bref_backend->backend_server->port);
+            dcb_close(bref->bref_dcb);
+            bref->bref_dcb = NULL;
         }
     }
-    /** Lock router session */
-    if (!rses_begin_locked_router_action(rses))
+    else
     {
-        if (packet_type != MYSQL_COM_QUIT)
+        MXS_ERROR("Unable to establish connection with server %s:%d",
+                  serv->name, serv->port);
+    }
+
+    return rval;
+}
+
+/**
+ * @brief Log server connections
+ *
+ * @param select_criteria Slave selection criteria
+ * @param backend_ref Backend reference array
+ * @param router_nservers Number of backends in @p backend_ref
+ */
+void log_server_connections(select_criteria_t select_criteria,
+                            backend_ref_t *backend_ref, int router_nservers)
+{
+    if (select_criteria == LEAST_GLOBAL_CONNECTIONS ||
+        select_criteria == LEAST_ROUTER_CONNECTIONS ||
+        select_criteria == LEAST_BEHIND_MASTER ||
+        select_criteria == LEAST_CURRENT_OPERATIONS ||
+        select_criteria == LEAST_RESPONSE_TIME ||
+        select_criteria == AFFINITY)
+    {
+        MXS_INFO("Servers and %s connection counts:",
+                 select_criteria == LEAST_GLOBAL_CONNECTIONS ? "all MaxScale"
+                 : "router");
+
+        for (int i = 0; i < router_nservers; i++)
         {
-            char *query_str = modutil_get_query(querybuf);
+            BACKEND *b = backend_ref[i].bref_backend;
 
-            MXS_ERROR("Can't route %s:%s:\"%s\" to "
-                      "backend server. Router is closed.",
-                      STRPACKETTYPE(packet_type), STRQTYPE(qtype),
-                      (query_str == NULL ? "(empty)" : query_str));
-            free(query_str);
+            switch (select_criteria)
+            {
+                case LEAST_GLOBAL_CONNECTIONS:
+                    MXS_INFO("MaxScale connections : %d in \t%s:%d %s",
+                             b->backend_server->stats.n_current, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
+
+                case LEAST_ROUTER_CONNECTIONS:
+                    MXS_INFO("RWSplit connections : %d in \t%s:%d %s",
+                             b->backend_conn_count, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
+
+                case LEAST_CURRENT_OPERATIONS:
+                    MXS_INFO("current operations : %d in \t%s:%d %s",
+                             b->backend_server->stats.n_current_ops,
+                             b->backend_server->name, b->backend_server->port,
+                             STRSRVSTATUS(b->backend_server));
+                    break;
+
+                case LEAST_BEHIND_MASTER:
+                    MXS_INFO("replication lag : %.3f ms in \t%s:%d %s",
+                             b->backend_server->rlag_us / 1000.0, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
+
+                case LEAST_RESPONSE_TIME:
+                    MXS_INFO("average response time : %dus in \t%s:%d %s",
+                             b->backend_response_time, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
+
+                case AFFINITY:
+                    MXS_INFO("affinity score : %f in \t%s:%d %s",
+                             backend_ref[i].bref_affinity, b->backend_server->name,
+                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
+                    break;
+
+                default:
+                    break;
+            }
         }
-        succp = false;
-        goto retblock;
     }
+}
 
-    DCB *master_dcb = rses->rses_master_ref ? rses->rses_master_ref->bref_dcb : NULL;
+/**
+ * @brief Search suitable backend servers from those of router instance
+ *
+ * It is assumed that there is only one master among servers of a router instance.
+ * As a result, the first master found is chosen. There will possibly be more
+ * backend references than connected backends because only those in correct state
+ * are connected to.
+ *
+ * @param p_master_ref Pointer to location where master's backend reference is to  be stored
+ * @param backend_ref Pointer to backend server reference object array
+ * @param router_nservers Number of backend server pointers pointed to by @p backend_ref
+ * @param max_nslaves Upper limit for the number of slaves
+ * @param max_slave_rlag Maximum allowed replication lag for any slave
+ * @param select_criteria Slave selection criteria
+ * @param session Client session
+ * @param router Router instance
+ * @return true, if at least one master and one slave was found.
+ */
+static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
+                                           backend_ref_t *backend_ref,
+                                           int router_nservers, int max_nslaves,
+                                           int max_slave_rlag,
+                                           select_criteria_t select_criteria,
+                                           SESSION *session,
+                                           ROUTER_INSTANCE *router)
+{
+    if (p_master_ref == NULL || backend_ref == NULL)
+    {
+        MXS_ERROR("Master reference (%p) or backend reference (%p) is NULL.",
+                  p_master_ref, backend_ref);
+        ss_dassert(false);
+        return false;
+    }
+
+    /* get the root Master */
+    BACKEND *master_host = get_root_master(backend_ref, router_nservers);
+
+    rwsplit_config_snapshot_t *snap = snapshot_get(&router->rwsplit_snapshot);
+
+    if (snap->config.rw_master_failure_mode == RW_FAIL_INSTANTLY &&
+        (master_host == NULL || SERVER_IS_DOWN(master_host->backend_server)))
+    {
+        MXS_ERROR("Couldn't find suitable Master from %d candidates.", router_nservers);
+        return false;
+    }
 
     /**
-     * There is a hint which either names the target backend or
-     * hint which sets maximum allowed replication lag for the
-     * backend.
+     * Existing session : master is already chosen and connected.
+     * The function was called because new slave must be selected to replace
+     * failed one.
      */
-    if (TARGET_IS_NAMED_SERVER(route_target) ||
-        TARGET_IS_RLAG_MAX(route_target))
+    bool master_connected = *p_master_ref != NULL;
+
+    /** Check slave selection criteria and set compare function */
+    select_criteria = get_select_criteria(select_criteria);
+    int (*p)(const void *, const void *) = criteria_cmpfun[select_criteria];
+    ss_dassert(p);
+
+    /** Sort the pointer list to servers according to slave selection criteria.
+     * The servers that match the criteria the best are at the beginning of
+     * the list. */
+    qsort(backend_ref, (size_t) router_nservers, sizeof(backend_ref_t), p);
+
+    if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
     {
-        HINT *hint;
-        char *named_server = NULL;
+        log_server_connections(select_criteria, backend_ref, router_nservers);
+    }
 
-        hint = querybuf->hint;
+    int slaves_found = 0;
+    int slaves_connected = 0;
+    const int min_nslaves = 0; /*< not configurable at the time */
+    bool succp = false;
 
-        while (hint != NULL)
+    /**
+     * Choose at least 1+min_nslaves (master and slave) and at most 1+max_nslaves
+     * servers from the sorted list. First master found is selected.
+     */
+    for (int i = 0; i < router_nservers &&
+         (slaves_connected < max_nslaves || !master_connected); i++)
+    {
+        SERVER *serv = backend_ref[i].bref_backend->backend_server;
+
+        if (!BREF_HAS_FAILED(&backend_ref[i]) && SERVER_IS_RUNNING(serv))
         {
-            if (hint->type == HINT_ROUTE_TO_NAMED_SERVER)
+            /* check also for relay servers and don't take the master_host */
+            if (slaves_found < max_nslaves &&
+                rlag_is_within(serv->rlag_us, max_slave_rlag) &&
+                (SERVER_IS_SLAVE(serv) || SERVER_IS_RELAY_SERVER(serv)) &&
+                (master_host == NULL || (serv != master_host->backend_server)) &&
+                !(snap->config.rw_pool_rules &&
+                  server_in_any_pool(serv, snap->config.rw_pool_rules)))
             {
-                /**
-                 * Set the name of searched
-                 * backend server.
-                 */
-                named_server = hint->data;
-                MXS_INFO("Hint: route to server "
-                         "'%s'",
-                         named_server);
+                slaves_found += 1;
+
+                if (BREF_IS_IN_USE((&backend_ref[i])) ||
+                    connect_server(&backend_ref[i], session, true))
+                {
+                    slaves_connected += 1;
+                }
             }
-            else if (hint->type == HINT_PARAMETER &&
-                     (strncasecmp((char *)hint->data, "max_slave_replication_lag",
-                                  strlen("max_slave_replication_lag")) == 0))
+                /* take the master_host for master */
+            else if (master_host && (serv == master_host->backend_server))
             {
-                int val = (int)strtol((char *)hint->value, (char **)NULL, 10);
+                /** p_master_ref must be assigned with this backend_ref pointer
+                 * because its original value may have been lost when backend
+                 * references were sorted with qsort. */
+                *p_master_ref = &backend_ref[i];
 
-                if (val != 0 || errno == 0)
+                if (!master_connected)
                 {
-                    /** Set max. acceptable replication lag value for backend srv */
-                    rlag_max = val;
-                    MXS_INFO("Hint: max_slave_replication_lag=%d", rlag_max);
+                    if (connect_server(&backend_ref[i], session, false))
+                    {
+                        master_connected = true;
+                    }
                 }
             }
-            hint = hint->next;
-        } /*< while */
-
-        if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
-        {
-            rlag_max = rses_get_max_replication_lag(rses);
         }
+    } /*< for */
 
-        /** target may be master or slave */
-        btype = route_target & TARGET_SLAVE ? BE_SLAVE : BE_MASTER;
+    /**
+     * Successful cases
+     */
+    if (slaves_connected >= min_nslaves && slaves_connected <= max_nslaves)
+    {
+        succp = true;
 
-        /**
-         * Search backend server by name or replication lag.
-         * If it fails, then try to find valid slave or master.
-         */
-        succp = get_dcb(&target_dcb, rses, btype, named_server, rlag_max);
+        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+        {
+            if (slaves_connected < max_nslaves)
+            {
+                MXS_INFO("Couldn't connect to maximum number of "
+                         "slaves. Connected successfully to %d slaves "
+                         "of %d of them.", slaves_connected, slaves_found);
+            }
+
+            for (int i = 0; i < router_nservers; i++)
+            {
+                if (BREF_IS_IN_USE((&backend_ref[i])))
+                {
+                    MXS_INFO("Selected %s in \t%s:%d",
+                             STRSRVSTATUS(backend_ref[i].bref_backend->backend_server),
+                             backend_ref[i].bref_backend->backend_server->name,
+                             backend_ref[i].bref_backend->backend_server->port);
+                }
+            } /* for */
+        }
+    }
+        /** Failure cases */
+    else
+    {
+        if (slaves_connected < min_nslaves)
+        {
+            MXS_ERROR("Couldn't establish required amount of "
+                      "slave connections for router session.");
+        }
 
-        if (!succp)
+        /** Clean up connections */
+        for (int i = 0; i < router_nservers; i++)
         {
-            if (TARGET_IS_NAMED_SERVER(route_target))
-            {
-                MXS_INFO("Was supposed to route to named server "
-                         "%s but couldn't find the server in a "
-                         "suitable state.", named_server);
-            }
-            else if (TARGET_IS_RLAG_MAX(route_target))
+            if (BREF_IS_IN_USE((&backend_ref[i])))
             {
-                MXS_INFO("Was supposed to route to server with "
-                         "replication lag at most %d but couldn't "
-                         "find such a slave.", rlag_max);
+                ss_dassert(backend_ref[i].bref_backend->backend_conn_count > 0);
+
+                /** disconnect opened connections */
+                if (BREF_IS_WAITING_RESULT(&backend_ref[i]))
+                {
+                    bref_clear_state(&backend_ref[i], BREF_WAITING_RESULT);
+                }
+                bref_clear_state(&backend_ref[i], BREF_IN_USE);
+                /** Decrease backend's connection counter. */
+                atomic_add(&backend_ref[i].bref_backend->backend_conn_count, -1);
+                dcb_close(backend_ref[i].bref_dcb);
             }
         }
     }
-    else if (TARGET_IS_SLAVE(route_target))
+
+    return succp;
+}
+
+/**
+ * Connect the slaves of a session which was created with lazy_connect. The
+ * session command history is executed on the slaves as they are connected.
+ * If no slaves can be connected, the reads go to the master.
+ *
+ * Router session must be locked.
+ *
+ * @param rses Router client session
+ */
+static void connect_pending_slaves(ROUTER_CLIENT_SES *rses)
+{
+    rses->rses_slaves_pending = false;
+
+    /** Without the history the slaves would not have the session state */
+    if (rses->rses_config.rw_disable_sescmd_hist)
     {
-        btype = BE_SLAVE;
+        return;
+    }
 
-        if (rlag_max == MAX_RLAG_UNDEFINED) /*< no rlag max hint, use config */
+    /** The backend references are sorted when the slaves are selected */
+    bool forced_master = rses->forced_node && rses->forced_node == rses->rses_master_ref;
+
+    select_connect_backend_servers(&rses->rses_master_ref, rses->rses_backend_ref,
+                                   rses->rses_nbackends,
+                                   rses_get_max_slavecount(rses, rses->rses_nbackends),
+                                   rses_get_max_replication_lag(rses),
+                                   rses->rses_config.rw_slave_select_criteria,
+                                   rses->client_dcb->session, rses->router);
+
+    if (forced_master)
+    {
+        rses->forced_node = rses->rses_master_ref;
+    }
+
+    slave_fallback_arm(rses);
+}
+
+/**
+ * Check whether a server carries the tag of a pool rule. The server
+ * parameter of the tag may list several values separated by commas.
+ *
+ * @param server Server to check
+ * @param rule   The pool rule
+ * @return True if the server belongs to the pool of the rule
+ */
+static bool server_in_pool(SERVER *server, POOL_RULE *rule)
+{
+    const char *value = serverGetParameter(server, rule->tag_name);
+    size_t len = strlen(rule->tag_value);
+
+    while (value && *value)
+    {
+        value += strspn(value, " \t,");
+        size_t n = strcspn(value, ",");
+        size_t vlen = n;
+
+        while (vlen > 0 && isspace(value[vlen - 1]))
         {
-            rlag_max = rses_get_max_replication_lag(rses);
+            vlen--;
         }
-        /**
-         * Search suitable backend server, get DCB in target_dcb
-         */
-        succp = get_dcb(&target_dcb, rses, BE_SLAVE, NULL, rlag_max);
 
-        if (succp)
+        if (vlen == len && strncasecmp(value, rule->tag_value, len) == 0)
         {
-#if defined(SS_EXTRA_DEBUG)
-            MXS_INFO("Found DCB for slave.");
-#endif
-            atomic_add(&inst->stats.n_slave, 1);
+            return true;
         }
-        else
+        value += n;
+    }
+
+    return false;
+}
+
+/**
+ * Check whether a server belongs to the pool of any rule
+ *
+ * @param server Server to check
+ * @param rules  The pool rules
+ * @return True if the server is reserved for the reads of a pool
+ */
+static bool server_in_any_pool(SERVER *server, POOL_RULES *rules)
+{
+    for (POOL_RULE *rule = rules->rules; rule; rule = rule->next)
+    {
+        if (server_in_pool(server, rule))
         {
-            MXS_INFO("Was supposed to route to slave but finding suitable one failed.");
+            return true;
         }
     }
-    else if (TARGET_IS_MASTER(route_target))
+    return false;
+}
+
+/**
+ * Compare a table of a statement to the table of a pool rule. A rule table
+ * without a database matches the table in any database and a table without
+ * a database in the statement matches the rule table in any database.
+ *
+ * @param table      Table name from the query classifier
+ * @param rule_table Table name of the rule
+ * @return True if the names match
+ */
+static bool pool_table_is(const char *table, const char *rule_table)
+{
+    const char *dot = strchr(table, '.');
+    const char *rule_dot = strchr(rule_table, '.');
+
+    if (dot && rule_dot)
     {
-        DCB *curr_master_dcb = NULL;
+        return strcasecmp(table, rule_table) == 0;
+    }
 
-        succp = get_dcb(&curr_master_dcb, rses, BE_MASTER, NULL, MAX_RLAG_UNDEFINED);
+    return strcasecmp(dot ? dot + 1 : table, rule_dot ? rule_dot + 1 : rule_table) == 0;
+}
 
-        if (succp && master_dcb == curr_master_dcb)
-        {
-            atomic_add(&inst->stats.n_master, 1);
-            target_dcb = master_dcb;
-        }
-        else
+/**
+ * Find the first pool rule that matches a read. The statement is parsed and
+ * its text extracted only if a rule needs them.
+ *
+ * @param rses     Router client session
+ * @param querybuf The statement
+ * @return The matching rule or NULL if the read doesn't belong to a pool
+ */
+static POOL_RULE *pool_rule_match(ROUTER_CLIENT_SES *rses, GWBUF *querybuf)
+{
+    const char * const *tables = NULL;
+    int n_tables = -1;
+    char *sql = NULL;
+    int len = -1;
+
+    for (POOL_RULE *rule = rses->rses_config.rw_pool_rules->rules; rule; rule = rule->next)
+    {
+        switch (rule->match)
         {
-            if (succp && master_dcb != curr_master_dcb)
+        case POOL_MATCH_USER:
+            if (rses->client_dcb->user && strcmp(rses->client_dcb->user, rule->value) == 0)
             {
-                MXS_INFO("Was supposed to route to master but master has changed.");
+                return rule;
             }
-            else
+            break;
+
+        case POOL_MATCH_HINT:
+            for (HINT *hint = querybuf->hint; hint; hint = hint->next)
             {
-                MXS_INFO("Was supposed to route to master but couldn't find master"
-                         " in a suitable state.");
+                if (hint->type == HINT_PARAMETER &&
+                    hint_name_is(hint, rwsplit_pool_hint_id, "pool") &&
+                    strcasecmp((char *)hint->value, rule->value) == 0)
+                {
+                    return rule;
+                }
             }
+            break;
 
-            if (rses->rses_config.rw_master_failure_mode == RW_ERROR_ON_WRITE)
+        case POOL_MATCH_REGEX:
+            if (len < 0 && !modutil_extract_SQL(querybuf, &sql, &len))
             {
-                /** Old master is no longer available */
-                succp = send_readonly_error(rses->client_dcb);
+                sql = NULL;
+                len = 0;
             }
-            else
+            else if (sql)
             {
-                MXS_WARNING("[%s] Write query received from %s@%s when no master is "
-                            "available, closing client connection.", inst->service->name,
-                            rses->client_dcb->user, rses->client_dcb->remote);
-                succp = false;
+                /** Only the first packet of a large statement is matched */
+                len = MIN(len, (int)GWBUF_LENGTH(querybuf) - 5);
             }
 
-            rses_end_locked_router_action(rses);
-            goto retblock;
-        }
-    }
+            if (sql && mxs_pcre2_pattern_match(rule->re, sql, len) == MXS_PCRE2_MATCH)
+            {
+                return rule;
+            }
+            break;
 
-    if (succp) /*< Have DCB of the target backend */
-    {
-        backend_ref_t *bref;
-        sescmd_cursor_t *scur;
+        case POOL_MATCH_TABLE:
+            if (n_tables < 0 && (tables = qc_get_table_names_view(querybuf, &n_tables, true)) == NULL)
+            {
+                n_tables = 0;
+            }
 
-        bref = get_bref_from_dcb(rses, target_dcb);
-        scur = &bref->bref_sescmd_cur;
+            for (int i = 0; i < n_tables; i++)
+            {
+                if (pool_table_is(tables[i], rule->value))
+                {
+                    return rule;
+                }
+            }
+            break;
+        }
+    }
 
-        ss_dassert(target_dcb != NULL);
+    return NULL;
+}
 
-        MXS_INFO("Route query to %s \t%s:%d <",
-                 (SERVER_IS_MASTER(bref->bref_backend->backend_server) ? "master"
-                  : "slave"), bref->bref_backend->backend_server->name,
-                 bref->bref_backend->backend_server->port);
-        /**
-         * Store current stmt if execution of previous session command
-         * haven't completed yet.
-         *
-         * !!! Note that according to MySQL protocol
-         * there can only be one such non-sescmd stmt at the time.
-         * It is possible that bref->bref_pending_cmd includes a pending
-         * command if rwsplit is parent or child for another router,
-         * which runs all the same commands.
-         *
-         * If the assertion below traps, pending queries are treated
-         * somehow wrong, or client is sending more queries before
-         * previous is received.
-         */
-        if (sescmd_cursor_is_active(scur))
-        {
-            ss_dassert(bref->bref_pending_cmd == NULL);
-            bref->bref_pending_cmd = gwbuf_clone(querybuf);
+/**
+ * Connect a slave of a pool when the first read of the pool arrives. The
+ * session command history is executed on the slave so that it has the state
+ * of the session.
+ *
+ * Router session must be locked.
+ *
+ * @param rses Router client session
+ * @param pool The pool rule of the read
+ * @return The connected slave or NULL if none could be connected
+ */
+static backend_ref_t *connect_pool_slave(ROUTER_CLIENT_SES *rses, POOL_RULE *pool)
+{
+    /** Without the history the slave would not have the session state */
+    if (rses->rses_config.rw_disable_sescmd_hist)
+    {
+        return NULL;
+    }
 
-            rses_end_locked_router_action(rses);
-            goto retblock;
-        }
+    BACKEND *master_host = get_root_master(rses->rses_backend_ref, rses->rses_nbackends);
+    select_criteria_t sc = get_select_criteria(rses->rses_config.rw_slave_select_criteria);
+    int max_rlag = rses_get_max_replication_lag(rses);
+    backend_ref_t *candidate = NULL;
 
-        if ((ret = target_dcb->func.write(target_dcb, gwbuf_clone(querybuf))) == 1)
-        {
-            backend_ref_t *bref;
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        SERVER *serv = bref->bref_backend->backend_server;
 
-            atomic_add(&inst->stats.n_queries, 1);
-            /**
-             * Add one query response waiter to backend reference
-             */
-            bref = get_bref_from_dcb(rses, target_dcb);
-            bref_set_state(bref, BREF_QUERY_ACTIVE);
-            bref_set_state(bref, BREF_WAITING_RESULT);
-        }
-        else
+        if (!BREF_IS_IN_USE(bref) && !BREF_HAS_FAILED(bref) && SERVER_IS_RUNNING(serv) &&
+            (SERVER_IS_SLAVE(serv) || SERVER_IS_RELAY_SERVER(serv)) &&
+            (master_host == NULL || serv != master_host->backend_server) &&
+            rlag_is_within(serv->rlag_us, max_rlag) && server_in_pool(serv, pool))
         {
-            MXS_ERROR("Routing query failed.");
-            succp = false;
+            candidate = check_candidate_bref(candidate, bref, sc);
         }
     }
-    rses_end_locked_router_action(rses);
 
-retblock :
-#if defined(SS_DEBUG2)
+    if (candidate && connect_server(candidate, rses->client_dcb->session, true))
     {
-        char *canonical_query_str;
+        MXS_INFO("Connected to %s for the reads of the pool %s=%s.",
+                 candidate->bref_backend->backend_server->unique_name,
+                 pool->tag_name, pool->tag_value);
+        return candidate;
+    }
 
-        canonical_query_str = skygw_get_canonical(querybuf);
+    return NULL;
+}
 
-        if (canonical_query_str != NULL)
-        {
-            MXS_INFO("Canonical version: %s", canonical_query_str);
-            free(canonical_query_str);
-        }
-    }
-#endif
-    return succp;
+/**
+ * Compare two table names for qsort
+ */
+static int table_name_cmp(const void *a, const void *b)
+{
+    return strcasecmp(*(const char * const *)a, *(const char * const *)b);
 }
 
 /**
- * @node Acquires lock to router client session if it is not closed.
- *
- * Parameters:
- * @param rses - in, use
+ * Choose the Galera node of a write from the tables it uses. The sorted table
+ * set is the key of consistent hashing over the joined nodes, so writes to
+ * the same tables are certified on one node and don't conflict with each
+ * other while writes to other tables spread over the cluster. When a node
+ * leaves the cluster, only the table sets it had move to other nodes.
  *
+ * Only autocommit writes outside transactions are hashed. The others, and
+ * writes without tables, go to the master.
  *
- * @return true if router session was not closed. If return value is true
- * it means that router is locked, and must be unlocked later. False, if
- * router was closed before lock was acquired.
- *
- *
- * @details (write detailed description here)
+ * Router session must be locked.
  *
+ * @param rses        Router client session
+ * @param querybuf    The statement
+ * @param packet_type The command of the statement
+ * @param qtype       The type of the statement
+ * @return The node for the write or NULL if it goes to the master
  */
-static bool rses_begin_locked_router_action(ROUTER_CLIENT_SES *rses)
+static backend_ref_t *get_write_hash_bref(ROUTER_CLIENT_SES *rses, GWBUF *querybuf,
+                                          mysql_server_cmd_t packet_type,
+                                          qc_query_type_t qtype)
 {
-    bool succp = false;
+    if (!rses->rses_config.rw_galera_write_hash || packet_type != MYSQL_COM_QUERY ||
+        !QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) || rses->rses_transaction_active ||
+        !rses->rses_autocommit_enabled || rses->have_tmp_tables || rses->forced_node)
+    {
+        return NULL;
+    }
 
-    if (rses == NULL)
+    int n_tables = 0;
+    const char * const *tables = qc_get_table_names_view(querybuf, &n_tables, true);
+
+    if (tables == NULL || n_tables <= 0)
     {
-        return false;
+        return NULL;
     }
 
-    CHK_CLIENT_RSES(rses);
+    const char *sorted[n_tables];
+    size_t keylen = 0;
 
-    if (rses->rses_closed)
+    for (int i = 0; i < n_tables; i++)
     {
+        sorted[i] = tables[i];
+        keylen += strlen(tables[i]) + 1;
+    }
+    qsort(sorted, n_tables, sizeof(sorted[0]), table_name_cmp);
 
-        goto return_succp;
+    char key[keylen];
+    char *ptr = key;
+
+    for (int i = 0; i < n_tables; i++)
+    {
+        for (const char *c = sorted[i]; *c; c++)
+        {
+            *ptr++ = tolower(*c);
+        }
+        *ptr++ = i < n_tables - 1 ? ',' : '\0';
     }
-    spinlock_acquire(&rses->rses_lock);
-    if (rses->rses_closed)
+
+    SERVER_STATES *states = server_states();
+    int n = rses->rses_nbackends;
+    double score[n];
+
+    for (int i = 0; i < n; i++)
     {
-        spinlock_release(&rses->rses_lock);
-        goto return_succp;
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        SERVER_STATE server = server_get_state(states, bref->bref_backend->backend_server);
+
+        score[i] = SERVER_IS_JOINED(&server) && !BREF_HAS_FAILED(bref) ?
+                   affinity_score(key, bref->bref_backend->backend_server->unique_name,
+                                  bref->bref_backend->weight) : 0;
     }
-    succp = true;
 
-return_succp:
-    return succp;
+    /** If the best node can't be connected, the next best one gets the write */
+    for (int attempt = 0; attempt < n; attempt++)
+    {
+        int best = -1;
+
+        for (int i = 0; i < n; i++)
+        {
+            if (score[i] > 0 && (best < 0 || score[i] > score[best]))
+            {
+                best = i;
+            }
+        }
+
+        if (best < 0)
+        {
+            break;
+        }
+
+        backend_ref_t *bref = &rses->rses_backend_ref[best];
+
+        if (BREF_IS_IN_USE(bref) ||
+            (!rses->rses_config.rw_disable_sescmd_hist &&
+             connect_server(bref, rses->client_dcb->session, true)))
+        {
+            MXS_INFO("Write to tables '%s' hashed to %s.", key,
+                     bref->bref_backend->backend_server->unique_name);
+            return bref;
+        }
+        score[best] = 0;
+    }
+
+    return NULL;
+}
+
+/**
+ * Check whether the handshake and the authentication of a backend connection
+ * have finished
+ *
+ * @param bref  Backend reference in use
+ * @return True if the connection can execute statements
+ */
+static bool bref_is_authenticated(backend_ref_t *bref)
+{
+    MySQLProtocol *proto = (MySQLProtocol *)bref->bref_dcb->protocol;
+
+    return proto && proto->protocol_auth_state == MYSQL_IDLE;
 }
 
-/** to be inline'd */
-
 /**
- * @node Releases router client session lock.
- *
- * Parameters:
- * @param rses - <usage>
- *          <description>
- *
- * @return void
- *
+ * Return the slave that a racing slave races against
  *
- * @details (write detailed description here)
+ * @param rses  Router client session
+ * @param bref  A racing slave
+ * @return The other slave of the race or NULL if it is no longer in use
+ */
+static backend_ref_t *bref_race_peer(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *peer = &rses->rses_backend_ref[i];
+
+        if (peer != bref && BREF_IS_IN_USE(peer) && BREF_IS_RACING(peer) &&
+            peer->bref_dcb == bref->bref_race_dcb)
+        {
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Close the slave that lost a connect race. Its handshake hasn't finished and
+ * nothing but the session command history was sent to it.
  *
+ * @param bref  The losing slave
  */
-static void rses_end_locked_router_action(ROUTER_CLIENT_SES *rses)
+static void bref_close_race_loser(backend_ref_t *bref)
 {
-    CHK_CLIENT_RSES(rses);
-    spinlock_release(&rses->rses_lock);
+    bref_clear_state(bref, BREF_IN_USE | BREF_CONNECT_RACE);
+    bref_set_state(bref, BREF_CLOSED);
+    atomic_add(&bref->bref_backend->backend_conn_count, -1);
+    gwbuf_free(bref->bref_pending_cmd);
+    bref->bref_pending_cmd = NULL;
+    bref->bref_n_queued = 0;
+    bref->bref_n_batch = 0;
+    dcb_remove_callback(bref->bref_dcb, DCB_REASON_NOT_RESPONDING,
+                        &router_handle_state_switch, (void *)bref);
+    dcb_close(bref->bref_dcb);
+    bref->bref_dcb = NULL;
+    bref->bref_race_dcb = NULL;
 }
 
 /**
- * Diagnostics routine
+ * Start a fallback connection for a slave whose handshake has not finished.
+ * The backend references are sorted by the slave selection criteria, so the
+ * first unused slave is the next-best candidate.
  *
- * Print query router statistics to the DCB passed in
+ * Router session must be locked.
  *
- * @param   instance    The router instance
- * @param   dcb     The DCB for diagnostic output
+ * @param rses  Router client session
+ * @param slow  The slow slave
+ * @return True if a fallback connection was started
  */
-static void diagnostic(ROUTER *instance, DCB *dcb)
+static bool start_slave_fallback(ROUTER_CLIENT_SES *rses, backend_ref_t *slow)
 {
-    ROUTER_CLIENT_SES *router_cli_ses;
-    ROUTER_INSTANCE *router = (ROUTER_INSTANCE *)instance;
-    int i = 0;
-    BACKEND *backend;
-    char *weightby;
+    BACKEND *master_host = get_root_master(rses->rses_backend_ref, rses->rses_nbackends);
+    int max_rlag = rses_get_max_replication_lag(rses);
 
-    spinlock_acquire(&router->lock);
-    router_cli_ses = router->connections;
-    while (router_cli_ses)
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        i++;
-        router_cli_ses = router_cli_ses->next;
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        SERVER *serv = bref->bref_backend->backend_server;
+
+        if (!BREF_IS_IN_USE(bref) && !BREF_HAS_FAILED(bref) && SERVER_IS_RUNNING(serv) &&
+            (SERVER_IS_SLAVE(serv) || SERVER_IS_RELAY_SERVER(serv)) &&
+            (master_host == NULL || serv != master_host->backend_server) &&
+            rlag_is_within(serv->rlag_us, max_rlag) &&
+            !(rses->rses_config.rw_pool_rules &&
+              server_in_any_pool(serv, rses->rses_config.rw_pool_rules)) &&
+            connect_server(bref, rses->client_dcb->session, true))
+        {
+            bref_set_state(slow, BREF_CONNECT_RACE);
+            bref_set_state(bref, BREF_CONNECT_RACE);
+            slow->bref_race_dcb = bref->bref_dcb;
+            bref->bref_race_dcb = slow->bref_dcb;
+            atomic_add(&rses->router->stats.n_fallback, 1);
+            MXS_INFO("Slave %s has not finished its handshake, connecting to %s in parallel.",
+                     slow->bref_backend->backend_server->unique_name, serv->unique_name);
+            return true;
+        }
     }
-    spinlock_release(&router->lock);
+    return false;
+}
 
-    double master_pct = 0.0, slave_pct = 0.0, all_pct = 0.0;
+/**
+ * Add the fallback timer of a session if it has slaves whose handshake has
+ * not finished. The first check is made after slave_connect_fallback
+ * milliseconds, rounded up to whole heartbeats.
+ *
+ * @param rses  Router client session
+ */
+static void slave_fallback_arm(ROUTER_CLIENT_SES *rses)
+{
+    int delay = rses->rses_config.rw_slave_connect_fallback;
 
-    if (router->stats.n_queries > 0)
+    if (delay <= 0 || timer_pending(&rses->rses_fallback_timer))
     {
-        master_pct = ((double)router->stats.n_master / (double)router->stats.n_queries) * 100.0;
-        slave_pct = ((double)router->stats.n_slave / (double)router->stats.n_queries) * 100.0;
-        all_pct = ((double)router->stats.n_all / (double)router->stats.n_queries) * 100.0;
+        return;
     }
 
-    dcb_printf(dcb, "\tNumber of router sessions:           	%d\n",
-               router->stats.n_sessions);
-    dcb_printf(dcb, "\tCurrent no. of router sessions:      	%d\n", i);
-    dcb_printf(dcb, "\tNumber of queries forwarded:          	%d\n",
-               router->stats.n_queries);
-    dcb_printf(dcb, "\tNumber of queries forwarded to master:	%d (%.2f%%)\n",
-               router->stats.n_master, master_pct);
-    dcb_printf(dcb, "\tNumber of queries forwarded to slave: 	%d (%.2f%%)\n",
-               router->stats.n_slave, slave_pct);
-    dcb_printf(dcb, "\tNumber of queries forwarded to all:   	%d (%.2f%%)\n",
-               router->stats.n_all, all_pct);
-
-    if ((weightby = serviceGetWeightingParameter(router->service)) != NULL)
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        dcb_printf(dcb, "\tConnection distribution based on %s "
-                   "server parameter.\n",
-                   weightby);
-        dcb_printf(dcb, "\t\tServer               Target %%    Connections  "
-                   "Operations\n");
-        dcb_printf(dcb, "\t\t                               Global  Router\n");
-        for (i = 0; router->servers[i]; i++)
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+
+        if (BREF_IS_IN_USE(bref) && bref != rses->rses_master_ref && !bref_is_authenticated(bref))
         {
-            backend = router->servers[i];
-            dcb_printf(dcb, "\t\t%-20s %3.1f%%     %-6d  %-6d  %d\n",
-                       backend->backend_server->unique_name, (float)backend->weight / 10,
-                       backend->backend_server->stats.n_current, backend->backend_conn_count,
-                       backend->backend_server->stats.n_current_ops);
+            timer_add(poll_timer_wheel(rses->client_dcb), &rses->rses_fallback_timer,
+                      (delay + 99) / 100);
+            return;
         }
     }
 }
 
 /**
- * Client Reply routine
- *
- * The routine will reply to client for session change with master server data
+ * The fallback timer of a session. A slave that has not finished its
+ * handshake in time gets a fallback connection to the next-best slave. The
+ * first of the two to finish its handshake is kept and the other one is
+ * closed. The timer is added back every heartbeat while a race is undecided.
  *
- * @param   instance    The router instance
- * @param   router_session  The router session
- * @param   backend_dcb The backend DCB
- * @param   queue       The GWBUF with reply data
+ * @param data  Router client session
  */
-static void clientReply(ROUTER *instance, void *router_session, GWBUF *writebuf,
-                        DCB *backend_dcb)
+static void slave_fallback_timeout(void *data)
 {
-    DCB *client_dcb;
-    ROUTER_INSTANCE *router_inst;
-    ROUTER_CLIENT_SES *router_cli_ses;
-    sescmd_cursor_t *scur = NULL;
-    backend_ref_t *bref;
-
-    router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
-    router_inst = (ROUTER_INSTANCE *)instance;
-    CHK_CLIENT_RSES(router_cli_ses);
+    ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *)data;
+    bool undecided = false;
 
-    /**
-     * Lock router client session for secure read of router session members.
-     * Note that this could be done without lock by using version #
-     */
-    if (!rses_begin_locked_router_action(router_cli_ses))
+    if (!rses_begin_locked_router_action(rses))
     {
-        print_error_packet(router_cli_ses, writebuf, backend_dcb);
-        goto lock_failed;
+        return;
     }
-    /** Holding lock ensures that router session remains open */
-    ss_dassert(backend_dcb->session != NULL);
-    client_dcb = backend_dcb->session->client_dcb;
 
-    /** Unlock */
-    rses_end_locked_router_action(router_cli_ses);
-    /**
-     * 1. Check if backend received reply to sescmd.
-     * 2. Check sescmd's state whether OK_PACKET has been
-     *    sent to client already and if not, lock property cursor,
-     *    reply to client, and move property cursor forward. Finally
-     *    release the lock.
-     * 3. If reply for this sescmd is sent, lock property cursor
-     *    and
-     */
-    if (client_dcb == NULL)
+    /** End the races that have a winner or that lost a slave to an error */
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        gwbuf_free(writebuf);
-        /** Log that client was closed before reply */
-        goto lock_failed;
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        backend_ref_t *peer;
+
+        if (!BREF_IS_RACING(bref))
+        {
+            continue;
+        }
+        else if (!BREF_IS_IN_USE(bref) || (peer = bref_race_peer(rses, bref)) == NULL)
+        {
+            bref_clear_state(bref, BREF_CONNECT_RACE);
+        }
+        else if (bref_is_authenticated(bref))
+        {
+            /** A statement routed to the loser by a hint keeps it open */
+            if (bref_is_authenticated(peer) || BREF_IS_WAITING_RESULT(peer) ||
+                BREF_IS_QUERY_ACTIVE(peer) || peer->bref_reply_count > 0)
+            {
+                bref_clear_state(peer, BREF_CONNECT_RACE);
+            }
+            else
+            {
+                bref_close_race_loser(peer);
+            }
+            bref_clear_state(bref, BREF_CONNECT_RACE);
+        }
     }
-    /** Lock router session */
-    if (!rses_begin_locked_router_action(router_cli_ses))
+
+    /** Race the slaves that are still connecting */
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        /** Log to debug that router was closed */
-        goto lock_failed;
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+
+        if (BREF_IS_IN_USE(bref) && bref != rses->rses_master_ref && !bref_is_authenticated(bref) &&
+            (BREF_IS_RACING(bref) || start_slave_fallback(rses, bref)))
+        {
+            undecided = true;
+        }
     }
-    bref = get_bref_from_dcb(router_cli_ses, backend_dcb);
 
-#if !defined(FOR_BUG548_FIX_ONLY)
-    /** This makes the issue becoming visible in poll.c */
-    if (bref == NULL)
+    if (undecided)
     {
-        /** Unlock router session */
-        rses_end_locked_router_action(router_cli_ses);
-        goto lock_failed;
+        timer_add(poll_timer_wheel(rses->client_dcb), &rses->rses_fallback_timer, 1);
     }
-#endif
 
-    CHK_BACKEND_REF(bref);
-    scur = &bref->bref_sescmd_cur;
-    /**
-     * Active cursor means that reply is from session command
-     * execution.
-     */
-    if (sescmd_cursor_is_active(scur))
-    {
-        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_ERR) &&
-            MYSQL_IS_ERROR_PACKET(((uint8_t *)GWBUF_DATA(writebuf))))
-        {
-            uint8_t *buf = (uint8_t *)GWBUF_DATA((scur->scmd_cur_cmd->my_sescmd_buf));
-            uint8_t *replybuf = (uint8_t *)GWBUF_DATA(writebuf);
-            size_t len = MYSQL_GET_PACKET_LEN(buf);
-            size_t replylen = MYSQL_GET_PACKET_LEN(replybuf);
-            char *err = strndup(&((char *)replybuf)[8], 5);
-            char *replystr = strndup(&((char *)replybuf)[13], replylen - 4 - 5);
+    rses_end_locked_router_action(rses);
+}
 
-            ss_dassert(len + 4 == GWBUF_LENGTH(scur->scmd_cur_cmd->my_sescmd_buf));
+/**
+ * Check whether a read can be hedged. Only plain reads routed to a slave
+ * outside transactions are hedged, executing them twice changes nothing.
+ * The reads that must go to a named server or that must see the last write of
+ * the session are not hedged, and neither are the reads that were sent while
+ * other replies were pending.
+ *
+ * This is called before the read is sent.
+ *
+ * @param rses          Router client session
+ * @param bref          The slave the read is sent to
+ * @param route_target  The target of the read
+ * @param packet_type   The command of the read
+ * @return True if the read can be hedged
+ */
+static bool hedge_allowed(ROUTER_CLIENT_SES *rses, backend_ref_t *bref,
+                          route_target_t route_target, mysql_server_cmd_t packet_type)
+{
+    return rses->rses_config.rw_hedge_delay != 0 && rses->rses_config.rw_hedge_budget > 0 &&
+           packet_type == MYSQL_COM_QUERY && TARGET_IS_SLAVE(route_target) &&
+           !TARGET_IS_NAMED_SERVER(route_target) && bref != rses->rses_master_ref &&
+           rses->rses_autocommit_enabled && !rses->rses_transaction_active &&
+           !rses->have_tmp_tables && !rses->rses_load_active &&
+           !(rses->rses_config.rw_causal_reads && rses->rses_last_write) &&
+           !rses_reply_pending(rses);
+}
 
-            MXS_ERROR("Failed to execute session command in %s:%d. Error was: %s %s",
-                      bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port, err, replystr);
-            free(err);
-            free(replystr);
-        }
+/**
+ * Get the delay after which a read is hedged. With hedge_delay=p95 the delay is
+ * the p95 response time of the slave, computed at most every
+ * HEDGE_P95_INTERVAL microseconds. Concurrent updates from other sessions
+ * compute the same value.
+ *
+ * @param rses  Router client session
+ * @param bref  The slave the read was sent to
+ * @return The delay in microseconds, 0 if the slave has no response times yet
+ */
+static uint64_t hedge_delay_us(ROUTER_CLIENT_SES *rses, backend_ref_t *bref)
+{
+    BACKEND *b = bref->bref_backend;
 
-        if (GWBUF_IS_TYPE_SESCMD_RESPONSE(writebuf))
-        {
-            /**
-             * Discard all those responses that have already been sent to
-             * the client. Return with buffer including response that
-             * needs to be sent to client or NULL.
-             */
-            bool rconn = false;
-            writebuf = sescmd_cursor_process_replies(writebuf, bref, &rconn);
+    if (rses->rses_config.rw_hedge_delay != RW_HEDGE_P95)
+    {
+        return (uint64_t)rses->rses_config.rw_hedge_delay * 1000;
+    }
 
-            if (rconn && !router_inst->rwsplit_config.rw_disable_sescmd_hist)
-            {
-                select_connect_backend_servers(
-                    &router_cli_ses->rses_master_ref, router_cli_ses->rses_backend_ref,
-                    router_cli_ses->rses_nbackends,
-                    router_cli_ses->rses_config.rw_max_slave_conn_count,
-                    router_cli_ses->rses_config.rw_max_slave_replication_lag,
-                    router_cli_ses->rses_config.rw_slave_select_criteria,
-                    router_cli_ses->rses_master_ref->bref_dcb->session,
-                    router_cli_ses->router);
-            }
-        }
-        /**
-         * If response will be sent to client, decrease waiter count.
-         * This applies to session commands only. Counter decrement
-         * for other type of queries is done outside this block.
-         */
+    uint64_t now = latency_now();
 
-        /** Set response status as replied */
-        bref_clear_state(bref, BREF_WAITING_RESULT);
-    }
-    /**
-     * Clear BREF_QUERY_ACTIVE flag and decrease waiter counter.
-     * This applies for queries  other than session commands.
-     */
-    else if (BREF_IS_QUERY_ACTIVE(bref))
+    if (now - b->backend_hedge_updated >= HEDGE_P95_INTERVAL)
     {
-        bref_clear_state(bref, BREF_QUERY_ACTIVE);
-        /** Set response status as replied */
-        bref_clear_state(bref, BREF_WAITING_RESULT);
+        uint64_t p95 = ts_histogram_percentile(b->backend_stats->latency, -1, 95.0);
+
+        b->backend_hedge_delay = p95 < INT_MAX ? (int)p95 : INT_MAX;
+        b->backend_hedge_updated = now;
     }
 
-    if (writebuf != NULL && client_dcb != NULL)
+    return b->backend_hedge_delay;
+}
+
+/**
+ * Add the hedge timer of a session for a read that was just sent to a slave.
+ * The delay is rounded up to whole heartbeats.
+ *
+ * @param rses      Router client session
+ * @param bref      The slave the read was sent to
+ * @param querybuf  The read
+ */
+static void hedge_arm(ROUTER_CLIENT_SES *rses, backend_ref_t *bref, GWBUF *querybuf)
+{
+    uint64_t delay = hedge_delay_us(rses, bref);
+
+    if (delay > 0 && (rses->rses_hedge_query = gwbuf_clone_all(querybuf)) != NULL)
     {
-        /** Write reply to client DCB */
-        SESSION_ROUTE_REPLY(backend_dcb->session, writebuf);
+        rses->rses_hedge_bref[0] = bref;
+        rses->rses_hedge_bref[1] = NULL;
+        timer_add(poll_timer_wheel(rses->client_dcb), &rses->rses_hedge_timer,
+                  (delay + 99999) / 100000);
     }
-    /** Unlock router session */
-    rses_end_locked_router_action(router_cli_ses);
+}
+
+/**
+ * Forget the hedged read of a session. The timer is not removed, it could be
+ * waiting for the session lock. It finds no read to hedge when it expires.
+ *
+ * @param rses  Router client session
+ */
+static void hedge_clear(ROUTER_CLIENT_SES *rses)
+{
+    gwbuf_free(rses->rses_hedge_query);
+    rses->rses_hedge_query = NULL;
+    rses->rses_hedge_bref[0] = NULL;
+    rses->rses_hedge_bref[1] = NULL;
+}
+
+/**
+ * Pick the slave a read is hedged to. It is the slave with the lowest response
+ * time of the ones that have nothing else to do. If pools are used, a read is
+ * only hedged if it went to a slave outside the pools.
+ *
+ * @param rses      Router client session
+ * @param primary   The slave the read was sent to
+ * @return The slave or NULL if none is idle
+ */
+static backend_ref_t *hedge_pick_slave(ROUTER_CLIENT_SES *rses, backend_ref_t *primary)
+{
+    POOL_RULES *pool_rules = rses->rses_config.rw_pool_rules;
+    int max_rlag = rses_get_max_replication_lag(rses);
+    backend_ref_t *best = NULL;
 
-    /** Lock router session */
-    if (!rses_begin_locked_router_action(router_cli_ses))
+    if (pool_rules && server_in_any_pool(primary->bref_backend->backend_server, pool_rules))
     {
-        /** Log to debug that router was closed */
-        goto lock_failed;
+        return NULL;
     }
-    /** There is one pending session command to be executed. */
-    if (sescmd_cursor_is_active(scur))
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        bool succp;
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+        SERVER *serv = bref->bref_backend->backend_server;
+
+        if (bref != primary && bref != rses->rses_master_ref && BREF_IS_IN_USE(bref) &&
+            SERVER_IS_SLAVE(serv) && rlag_is_within(serv->rlag_us, max_rlag) &&
+            bref_is_authenticated(bref) && !BREF_IS_WAITING_RESULT(bref) &&
+            !BREF_IS_QUERY_ACTIVE(bref) && bref->bref_reply_count == 0 &&
+            bref->bref_pending_cmd == NULL && !sescmd_cursor_is_active(&bref->bref_sescmd_cur) &&
+            !(pool_rules && server_in_any_pool(serv, pool_rules)) &&
+            (best == NULL ||
+             bref->bref_backend->backend_response_time < best->bref_backend->backend_response_time))
+        {
+            best = bref;
+        }
+    }
 
-        MXS_INFO("Backend %s:%d processed reply and starts to execute "
-                 "active cursor.", bref->bref_backend->backend_server->name,
-                 bref->bref_backend->backend_server->port);
+    return best;
+}
 
-        succp = execute_sescmd_in_backend(bref);
+/**
+ * The hedge timer of a session. If the slave has not started to reply to the
+ * read, the read is sent to a second slave as long as the hedged reads stay
+ * within hedge_budget percent of the reads routed to slaves.
+ *
+ * Both slaves owe a tracked reply so that the reply of the slave which loses
+ * can be discarded up to its end.
+ *
+ * @param data  Router client session
+ */
+static void hedge_timeout(void *data)
+{
+    ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *)data;
+    ROUTER_INSTANCE *inst = rses->router;
+    backend_ref_t *primary;
+    backend_ref_t *bref;
 
-        if (!succp)
-        {
-            MXS_INFO("Backend %s:%d failed to execute session command.",
-                     bref->bref_backend->backend_server->name,
-                     bref->bref_backend->backend_server->port);
-        }
+    if (!rses_begin_locked_router_action(rses))
+    {
+        return;
     }
-    else if (bref->bref_pending_cmd != NULL) /*< non-sescmd is waiting to be routed */
+
+    primary = rses->rses_hedge_bref[0];
+
+    if (rses->rses_hedge_query && primary && BREF_IS_IN_USE(primary) &&
+        BREF_IS_QUERY_ACTIVE(primary) &&
+        (int64_t)inst->stats.n_hedged * 100 <
+        (int64_t)inst->stats.n_slave * rses->rses_config.rw_hedge_budget &&
+        (bref = hedge_pick_slave(rses, primary)) != NULL)
     {
-        int ret;
+        GWBUF *querybuf = rses->rses_hedge_query;
+        int len = gwbuf_length(querybuf);
 
-        CHK_GWBUF(bref->bref_pending_cmd);
+        rses->rses_hedge_query = NULL;
 
-        if ((ret = bref->bref_dcb->func.write(bref->bref_dcb,
-                       gwbuf_clone(bref->bref_pending_cmd))) == 1)
+        if (bref->bref_dcb->func.write(bref->bref_dcb, querybuf) == 1)
         {
-            ROUTER_INSTANCE* inst = (ROUTER_INSTANCE *)instance;
+            MXS_INFO("Slave %s:%d hasn't replied in time, hedging the read to %s:%d.",
+                     primary->bref_backend->backend_server->name,
+                     primary->bref_backend->backend_server->port,
+                     bref->bref_backend->backend_server->name,
+                     bref->bref_backend->backend_server->port);
             atomic_add(&inst->stats.n_queries, 1);
-            /**
-             * Add one query response waiter to backend reference
-             */
+            atomic_add(&inst->stats.n_hedged, 1);
+            ts_stats_add(bref->bref_backend->backend_stats->queries, 1);
+            ts_stats_add(bref->bref_backend->backend_stats->bytes_out, len);
+            bref->bref_query_start = latency_now();
             bref_set_state(bref, BREF_QUERY_ACTIVE);
             bref_set_state(bref, BREF_WAITING_RESULT);
-        }
-        else
-        {
-            char* sql = modutil_get_SQL(bref->bref_pending_cmd);
+            bref->bref_reply_count++;
 
-            if (sql)
-            {
-                MXS_ERROR("Routing query \"%s\" failed.", sql);
-                free(sql);
-            }
-            else
+            if (!rses->rses_config.rw_multiplex)
             {
-                MXS_ERROR("Failed to route query.");
+                /** With multiplexing the reply is already tracked */
+                primary->bref_reply_count++;
             }
+            rses->rses_hedge_bref[1] = bref;
         }
-        gwbuf_free(bref->bref_pending_cmd);
-        bref->bref_pending_cmd = NULL;
     }
-    /** Unlock router session */
-    rses_end_locked_router_action(router_cli_ses);
-
-lock_failed:
-    return;
-}
 
-/** Compare nunmber of connections from this router in backend servers */
-int bref_cmp_router_conn(const void *bref1, const void *bref2)
-{
-    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
-    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
-
-    if (b1->weight == 0 && b2->weight == 0)
-    {
-        return b1->backend_server->stats.n_current -
-               b2->backend_server->stats.n_current;
-    }
-    else if (b1->weight == 0)
-    {
-        return 1;
-    }
-    else if (b2->weight == 0)
+    if (rses->rses_hedge_bref[1] == NULL)
     {
-        return -1;
+        hedge_clear(rses);
     }
 
-    return ((1000 + 1000 * b1->backend_conn_count) / b1->weight) -
-           ((1000 + 1000 * b2->backend_conn_count) / b2->weight);
+    rses_end_locked_router_action(rses);
 }
 
-/** Compare nunmber of global connections in backend servers */
-int bref_cmp_global_conn(const void *bref1, const void *bref2)
+/**
+ * Called when a slave of a hedged read starts to reply. The first slave to
+ * reply wins and the reply of the other one is discarded when it arrives.
+ *
+ * @param rses      Router client session
+ * @param winner    The slave that replied
+ */
+static void hedge_decide(ROUTER_CLIENT_SES *rses, backend_ref_t *winner)
 {
-    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
-    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+    backend_ref_t *loser = rses->rses_hedge_bref[winner == rses->rses_hedge_bref[0] ? 1 : 0];
 
-    if (b1->weight == 0 && b2->weight == 0)
-    {
-        return b1->backend_server->stats.n_current -
-               b2->backend_server->stats.n_current;
-    }
-    else if (b1->weight == 0)
-    {
-        return 1;
-    }
-    else if (b2->weight == 0)
+    if (loser)
     {
-        return -1;
+        if (winner == rses->rses_hedge_bref[1])
+        {
+            atomic_add(&rses->router->stats.n_hedge_won, 1);
+        }
+
+        if (BREF_IS_IN_USE(loser) && BREF_IS_QUERY_ACTIVE(loser))
+        {
+            bref_set_state(loser, BREF_HEDGE_DRAIN);
+        }
     }
 
-    return ((1000 + 1000 * b1->backend_server->stats.n_current) / b1->weight) -
-           ((1000 + 1000 * b2->backend_server->stats.n_current) / b2->weight);
+    hedge_clear(rses);
 }
 
-/** Compare relication lag between backend servers */
-int bref_cmp_behind_master(const void *bref1, const void *bref2)
+/**
+ * Discard the reply of a slave that lost a hedged read. The reply ends when
+ * the slave owes one tracked reply less. The slave then returns to normal use.
+ *
+ * @param bref  The slave
+ * @param reply Packets read from the slave
+ * @return The packets that follow the discarded reply or NULL if none
+ */
+static GWBUF *hedge_drain_reply(backend_ref_t *bref, GWBUF *reply)
 {
-    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
-    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+    int owed = bref->bref_reply_count;
+    size_t offset = bref_track_reply(bref, reply, 1);
 
-    return ((b1->backend_server->rlag < b2->backend_server->rlag) ? -1
-            : ((b1->backend_server->rlag > b2->backend_server->rlag) ? 1 : 0));
-}
-
-/** Compare nunmber of current operations in backend servers */
-int bref_cmp_current_load(const void *bref1, const void *bref2)
-{
-    SERVER *s1 = ((backend_ref_t *)bref1)->bref_backend->backend_server;
-    SERVER *s2 = ((backend_ref_t *)bref2)->bref_backend->backend_server;
-    BACKEND *b1 = ((backend_ref_t *)bref1)->bref_backend;
-    BACKEND *b2 = ((backend_ref_t *)bref2)->bref_backend;
+    bref_update_response_time(bref);
 
-    if (b1->weight == 0 && b2->weight == 0)
-    {
-        return b1->backend_server->stats.n_current -
-               b2->backend_server->stats.n_current;
-    }
-    else if (b1->weight == 0)
-    {
-        return 1;
-    }
-    else if (b2->weight == 0)
+    if (bref->bref_reply_count < owed || owed == 0)
     {
-        return -1;
+        bref_clear_state(bref, BREF_HEDGE_DRAIN);
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+        bref_clear_state(bref, BREF_WAITING_RESULT);
+        return gwbuf_consume(reply, offset);
     }
 
-    return ((1000 * s1->stats.n_current_ops) - b1->weight) -
-           ((1000 * s2->stats.n_current_ops) - b2->weight);
+    gwbuf_free(reply);
+    return NULL;
 }
 
-static void bref_clear_state(backend_ref_t *bref, bref_state_t state)
+/**
+ * Track the reply of a backend to the statements routed to it. When the last
+ * packet of a reply is seen, the backend owes one reply less.
+ *
+ * The reply contains only complete packets. A reply is an OK packet, an ERR
+ * packet or a resultset and an OK packet or a resultset can be followed by
+ * more results. The reply to a tracked COM_STMT_PREPARE is a
+ * COM_STMT_PREPARE_OK followed by the parameter and column definitions, its
+ * statement ID is replaced with the one the client uses.
+ *
+ * @param bref      Backend reference
+ * @param reply     Packets read from the backend
+ * @param n_replies Stop after this many replies have ended
+ * @return The offset of the first packet that was not tracked
+ */
+static size_t bref_track_reply(backend_ref_t *bref, GWBUF *reply, int n_replies)
 {
-    if (bref == NULL)
-    {
-        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
-        return;
-    }
+    size_t len = gwbuf_length(reply);
+    size_t offset = 0;
 
-    if ((state & BREF_WAITING_RESULT) && (bref->bref_state & BREF_WAITING_RESULT))
+    while (offset < len && (bref->bref_reply_count > 0 || bref->bref_n_batch > 0) &&
+           n_replies > 0)
     {
-        int prev1;
-        int prev2;
+        /** Header, command byte, affected rows, insert ID and status of an OK packet */
+        uint8_t data[MYSQL_HEADER_LEN + 1 + 9 + 9 + 2];
+        size_t n = gwbuf_copy_data(reply, offset, sizeof(data), data);
 
-        /** Decrease waiter count */
-        prev1 = atomic_add(&bref->bref_num_result_wait, -1);
+        if (n < MYSQL_HEADER_LEN + 1)
+        {
+            break;
+        }
 
-        if (prev1 <= 0)
+        size_t pktlen = MYSQL_GET_PACKET_LEN(data);
+        uint8_t cmd = data[MYSQL_HEADER_LEN];
+        bool done = false;
+
+        switch (bref->bref_reply_state)
         {
-            atomic_add(&bref->bref_num_result_wait, 1);
+        case REPLY_STATE_START:
+            if (cmd == 0x00 && bref->bref_n_batch > 0 && bref->bref_ps_fifo[0])
+            {
+                /** The parameter and column counts, each followed by an EOF if not zero */
+                uint16_t columns = gw_mysql_get_byte2(&data[MYSQL_HEADER_LEN + 5]);
+                uint16_t params = gw_mysql_get_byte2(&data[MYSQL_HEADER_LEN + 7]);
+
+                bref_map_ps_reply(bref, bref->bref_ps_fifo[0], reply, offset);
+                bref->bref_reply_defs = columns + (columns ? 1 : 0) + params + (params ? 1 : 0);
+
+                if (bref->bref_reply_defs)
+                {
+                    bref->bref_reply_state = REPLY_STATE_PS_DEFS;
+                }
+                else
+                {
+                    done = true;
+                }
+            }
+            else if (cmd == 0x00)
+            {
+                /** Skip the affected rows and the last insert ID */
+                size_t pos = MYSQL_HEADER_LEN + 1;
+
+                for (int i = 0; i < 2 && pos < n; i++)
+                {
+                    pos += data[pos] < 0xfb ? 1 : data[pos] == 0xfc ? 3 : data[pos] == 0xfd ? 4 : 9;
+                }
+
+                /** The SERVER_MORE_RESULTS_EXIST status flag */
+                done = pos + 2 > n || !(data[pos] & 0x08);
+            }
+            else if (cmd == 0xff || cmd == 0xfb)
+            {
+                /** An error or a LOAD DATA LOCAL INFILE request */
+                done = true;
+            }
+            else
+            {
+                bref->bref_reply_state = REPLY_STATE_RSET_COLDEF;
+            }
+            break;
+
+        case REPLY_STATE_RSET_COLDEF:
+            if (PTR_IS_EOF(data))
+            {
+                bref->bref_reply_state = REPLY_STATE_RSET_ROWS;
+            }
+            break;
+
+        case REPLY_STATE_RSET_ROWS:
+            if (PTR_IS_ERR(data))
+            {
+                done = true;
+            }
+            else if (PTR_IS_EOF(data))
+            {
+                if (PTR_EOF_MORE_RESULTS(data))
+                {
+                    bref->bref_reply_state = REPLY_STATE_START;
+                }
+                else
+                {
+                    done = true;
+                }
+            }
+            break;
+
+        case REPLY_STATE_PS_DEFS:
+            done = --bref->bref_reply_defs == 0;
+            break;
         }
-        else
+
+        if (done)
         {
-            /** Decrease global operation count */
-            prev2 = atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, -1);
-            ss_dassert(prev2 > 0);
-            if (prev2 <= 0)
+            if (bref->bref_reply_count > 0)
             {
-                MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
-                          __FUNCTION__, bref->bref_backend->backend_server->name,
-                          bref->bref_backend->backend_server->port);
+                bref->bref_reply_count--;
+            }
+            if (bref->bref_n_batch > 0)
+            {
+                bref->bref_n_batch--;
+                memmove(bref->bref_ps_fifo, bref->bref_ps_fifo + 1,
+                        (bref->bref_n_batch + bref->bref_n_queued) * sizeof(uint32_t));
             }
+            bref->bref_reply_state = REPLY_STATE_START;
+            n_replies--;
         }
+
+        offset += MYSQL_HEADER_LEN + pktlen;
     }
 
-    bref->bref_state &= ~state;
+    return offset;
 }
 
-static void bref_set_state(backend_ref_t *bref, bref_state_t state)
+/**
+ * Record the ID a backend gave to a prepared statement and replace it with
+ * the ID the client uses. The first packet of a successful reply to
+ * COM_STMT_PREPARE is COM_STMT_PREPARE_OK, which starts with the ID.
+ *
+ * @param bref   Backend reference
+ * @param id     The ID the client sees
+ * @param reply  Packets read from the backend
+ * @param offset Offset of the reply to the COM_STMT_PREPARE in the packets
+ */
+static void bref_map_ps_reply(backend_ref_t *bref, uint32_t id, GWBUF *reply, size_t offset)
 {
-    if (bref == NULL)
+    uint8_t data[MYSQL_HEADER_LEN + 5];
+
+    if (gwbuf_copy_data(reply, offset, sizeof(data), data) < sizeof(data) ||
+        data[MYSQL_HEADER_LEN] != 0x00)
     {
-        MXS_ERROR("[%s] Error: NULL parameter.", __FUNCTION__);
         return;
     }
 
-    if ((state & BREF_WAITING_RESULT) && (bref->bref_state & BREF_WAITING_RESULT) == 0)
+    if (id >= bref->bref_ps_ids_size)
     {
-        int prev1;
-        int prev2;
+        uint32_t size = id * 2;
+        uint32_t *ids = realloc(bref->bref_ps_ids, size * sizeof(uint32_t));
 
-        /** Increase waiter count */
-        prev1 = atomic_add(&bref->bref_num_result_wait, 1);
-        ss_dassert(prev1 >= 0);
-        if (prev1 < 0)
-        {
-            MXS_ERROR("[%s] Error: negative number of connections waiting for "
-                      "results in backend %s:%u",
-                      __FUNCTION__, bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port);
-        }
-        /** Increase global operation count */
-        prev2 =
-            atomic_add(&bref->bref_backend->backend_server->stats.n_current_ops, 1);
-        ss_dassert(prev2 >= 0);
-        if (prev2 < 0)
+        if (ids == NULL)
         {
-            MXS_ERROR("[%s] Error: negative current operation count in backend %s:%u",
-                      __FUNCTION__, bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port);
+            MXS_ERROR("Failed to allocate memory for the prepared statements of a session.");
+            return;
         }
-    }
 
-    bref->bref_state |= state;
-}
+        memset(ids + bref->bref_ps_ids_size, 0, (size - bref->bref_ps_ids_size) * sizeof(uint32_t));
+        bref->bref_ps_ids = ids;
+        bref->bref_ps_ids_size = size;
+    }
 
-/**
- * @brief Connect a server
- *
- * Connects to a server, adds callbacks to the created DCB and updates
- * router statistics. If @p execute_history is true, the session command
- * history will be executed on this server.
- *
- * @param b Router's backend structure for the server
- * @param session Client's session object
- * @param execute_history Execute session command history
- * @return True if successful, false if an error occurred
- */
-bool connect_server(backend_ref_t *bref, SESSION *session, bool execute_history)
-{
-    SERVER *serv = bref->bref_backend->backend_server;
-    bool rval = false;
+    bref->bref_ps_ids[id] = MYSQL_GET_STMT_ID(data);
+    gw_mysql_set_byte4(&data[MYSQL_HEADER_LEN + 1], id);
 
-    bref->bref_dcb = dcb_connect(serv, session, serv->protocol);
+    /** The ID can be split between the buffers of the chain */
+    offset += MYSQL_HEADER_LEN + 1;
 
-    if (bref->bref_dcb != NULL)
+    for (int i = 0; i < 4; i++, offset++)
     {
-        bref_clear_state(bref, BREF_CLOSED);
+        GWBUF *buf = reply;
+        size_t pos = offset;
 
-        if (!execute_history || execute_sescmd_history(bref))
-        {
-            /** Add a callback for unresponsive server */
-            dcb_add_callback(bref->bref_dcb, DCB_REASON_NOT_RESPONDING,
-                             &router_handle_state_switch, (void *) bref);
-            bref->bref_state = 0;
-            bref_set_state(bref, BREF_IN_USE);
-            atomic_add(&bref->bref_backend->backend_conn_count, 1);
-            rval = true;
-        }
-        else
+        while (pos >= GWBUF_LENGTH(buf))
         {
-            MXS_ERROR("Failed to execute session command in %s (%s:%d). See earlier "
-                      "errors for more details.",
-                      bref->bref_backend->backend_server->unique_name,
-                      bref->bref_backend->backend_server->name,
-                      bref->bref_backend->backend_server->port);
-            dcb_close(bref->bref_dcb);
-            bref->bref_dcb = NULL;
+            pos -= GWBUF_LENGTH(buf);
+            buf = buf->next;
         }
+        ((uint8_t *)GWBUF_DATA(buf))[pos] = data[MYSQL_HEADER_LEN + 1 + i];
     }
-    else
-    {
-        MXS_ERROR("Unable to establish connection with server %s:%d",
-                  serv->name, serv->port);
-    }
-
-    return rval;
 }
 
 /**
- * @brief Log server connections
+ * Store the prepared statement ID of the next tracked statement of a backend
+ * at the end of the FIFO. The caller counts the statement in bref_n_queued or
+ * bref_n_batch once it has been queued or sent.
  *
- * @param select_criteria Slave selection criteria
- * @param backend_ref Backend reference array
- * @param router_nservers Number of backends in @p backend_ref
+ * @param bref Backend reference
+ * @param id   The ID the client sees for a COM_STMT_PREPARE, 0 for other statements
+ * @return False if memory allocation failed
  */
-void log_server_connections(select_criteria_t select_criteria,
-                            backend_ref_t *backend_ref, int router_nservers)
+static bool bref_ps_fifo_reserve(backend_ref_t *bref, uint32_t id)
 {
-    if (select_criteria == LEAST_GLOBAL_CONNECTIONS ||
-        select_criteria == LEAST_ROUTER_CONNECTIONS ||
-        select_criteria == LEAST_BEHIND_MASTER ||
-        select_criteria == LEAST_CURRENT_OPERATIONS)
+    int n = bref->bref_n_batch + bref->bref_n_queued;
+
+    if (n >= bref->bref_ps_fifo_size)
     {
-        MXS_INFO("Servers and %s connection counts:",
-                 select_criteria == LEAST_GLOBAL_CONNECTIONS ? "all MaxScale"
-                 : "router");
+        int size = MAX(16, bref->bref_ps_fifo_size * 2);
+        uint32_t *fifo = realloc(bref->bref_ps_fifo, size * sizeof(uint32_t));
 
-        for (int i = 0; i < router_nservers; i++)
+        if (fifo == NULL)
         {
-            BACKEND *b = backend_ref[i].bref_backend;
+            return false;
+        }
 
-            switch (select_criteria)
-            {
-                case LEAST_GLOBAL_CONNECTIONS:
-                    MXS_INFO("MaxScale connections : %d in \t%s:%d %s",
-                             b->backend_server->stats.n_current, b->backend_server->name,
-                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
-                    break;
+        bref->bref_ps_fifo = fifo;
+        bref->bref_ps_fifo_size = size;
+    }
 
-                case LEAST_ROUTER_CONNECTIONS:
-                    MXS_INFO("RWSplit connections : %d in \t%s:%d %s",
-                             b->backend_conn_count, b->backend_server->name,
-                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
-                    break;
+    bref->bref_ps_fifo[n] = id;
+    return true;
+}
 
-                case LEAST_CURRENT_OPERATIONS:
-                    MXS_INFO("current operations : %d in \t%s:%d %s",
-                             b->backend_server->stats.n_current_ops,
-                             b->backend_server->name, b->backend_server->port,
-                             STRSRVSTATUS(b->backend_server));
-                    break;
+/**
+ * Clone a query for a backend. If the query refers to a prepared statement,
+ * the ID the client uses is replaced with the one the backend gave to it.
+ *
+ * @param bref Backend reference
+ * @param buf  Contiguous buffer with the query
+ * @return Buffer to write to the backend
+ */
+static GWBUF *bref_ps_clone(backend_ref_t *bref, GWBUF *buf)
+{
+    uint8_t *data = GWBUF_DATA(buf);
 
-                case LEAST_BEHIND_MASTER:
-                    MXS_INFO("replication lag : %d in \t%s:%d %s",
-                             b->backend_server->rlag, b->backend_server->name,
-                             b->backend_server->port, STRSRVSTATUS(b->backend_server));
-                default:
-                    break;
-            }
+    if (GWBUF_LENGTH(buf) >= MYSQL_HEADER_LEN + 5 &&
+        (MYSQL_GET_COMMAND(data) == MYSQL_COM_STMT_EXECUTE ||
+         MYSQL_GET_COMMAND(data) == MYSQL_COM_STMT_SEND_LONG_DATA ||
+         MYSQL_GET_COMMAND(data) == MYSQL_COM_STMT_CLOSE ||
+         MYSQL_GET_COMMAND(data) == MYSQL_COM_STMT_RESET ||
+         MYSQL_GET_COMMAND(data) == MYSQL_COM_STMT_FETCH))
+    {
+        uint32_t id = MYSQL_GET_STMT_ID(data);
+        GWBUF *copy;
+
+        if (id < bref->bref_ps_ids_size && bref->bref_ps_ids[id] &&
+            (copy = gwbuf_alloc_and_load(GWBUF_LENGTH(buf), data)))
+        {
+            copy->gwbuf_type = buf->gwbuf_type;
+            gw_mysql_set_byte4((uint8_t *)GWBUF_DATA(copy) + MYSQL_HEADER_LEN + 1,
+                               bref->bref_ps_ids[id]);
+            return copy;
         }
     }
+
+    return gwbuf_clone(buf);
 }
 
 /**
- * @brief Search suitable backend servers from those of router instance
- *
- * It is assumed that there is only one master among servers of a router instance.
- * As a result, the first master found is chosen. There will possibly be more
- * backend references than connected backends because only those in correct state
- * are connected to.
+ * Check if a query takes a lock that is held by the backend connection
  *
- * @param p_master_ref Pointer to location where master's backend reference is to  be stored
- * @param backend_ref Pointer to backend server reference object array
- * @param router_nservers Number of backend server pointers pointed to by @p backend_ref
- * @param max_nslaves Upper limit for the number of slaves
- * @param max_slave_rlag Maximum allowed replication lag for any slave
- * @param select_criteria Slave selection criteria
- * @param session Client session
- * @param router Router instance
- * @return true, if at least one master and one slave was found.
+ * @param buf Buffer containing the query
+ * @return True if the query contains GET_LOCK or LOCK TABLE
  */
-static bool select_connect_backend_servers(backend_ref_t **p_master_ref,
-                                           backend_ref_t *backend_ref,
-                                           int router_nservers, int max_nslaves,
-                                           int max_slave_rlag,
-                                           select_criteria_t select_criteria,
-                                           SESSION *session,
-                                           ROUTER_INSTANCE *router)
+static bool is_lock_stmt(GWBUF *buf)
 {
-    if (p_master_ref == NULL || backend_ref == NULL)
+    char *sql;
+    int len;
+
+    if (!modutil_extract_SQL(buf, &sql, &len))
     {
-        MXS_ERROR("Master reference (%p) or backend reference (%p) is NULL.",
-                  p_master_ref, backend_ref);
-        ss_dassert(false);
         return false;
     }
 
-    /* get the root Master */
-    BACKEND *master_host = get_root_master(backend_ref, router_nservers);
-
-    if (router->rwsplit_config.rw_master_failure_mode == RW_FAIL_INSTANTLY &&
-        (master_host == NULL || SERVER_IS_DOWN(master_host->backend_server)))
+    for (int i = 0; i < len; i++)
     {
-        MXS_ERROR("Couldn't find suitable Master from %d candidates.", router_nservers);
-        return false;
+        if ((len - i >= 8 && strncasecmp(sql + i, "GET_LOCK", 8) == 0) ||
+            (len - i >= 10 && strncasecmp(sql + i, "LOCK TABLE", 10) == 0))
+        {
+            return true;
+        }
     }
 
-    /**
-     * Existing session : master is already chosen and connected.
-     * The function was called because new slave must be selected to replace
-     * failed one.
-     */
-    bool master_connected = *p_master_ref != NULL;
+    return false;
+}
 
-    /** Check slave selection criteria and set compare function */
-    int (*p)(const void *, const void *) = criteria_cmpfun[select_criteria];
-    ss_dassert(p);
+/**
+ * Return the backend connections of an idle session to the persistent
+ * connection pools of the servers. This is only done when the state of the
+ * session can be recreated from the session command history: outside
+ * transactions and when no temporary tables, prepared statements or locks
+ * are in use. The backends are taken back with reattach_backends().
+ *
+ * Router session must be locked.
+ *
+ * @param rses Router client session
+ */
+static void release_idle_backends(ROUTER_CLIENT_SES *rses)
+{
+    if (rses->rses_backends_released || rses->rses_multiplex_blocked ||
+        rses->rses_transaction_active || !rses->rses_autocommit_enabled ||
+        rses->have_tmp_tables || rses->rses_load_active || rses->forced_node ||
+        rses->rses_ro_trx_server || rses->rses_config.rw_disable_sescmd_hist)
+    {
+        return;
+    }
 
-    /** Sort the pointer list to servers according to slave selection criteria.
-     * The servers that match the criteria the best are at the beginning of
-     * the list. */
-    qsort(backend_ref, (size_t) router_nservers, sizeof(backend_ref_t), p);
+    if (rses_reply_pending(rses))
+    {
+        return;
+    }
 
-    if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+    for (int i = 0; i < rses->rses_nbackends; i++)
     {
-        log_server_connections(select_criteria, backend_ref, router_nservers);
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+
+        if (BREF_IS_IN_USE(bref))
+        {
+            bref_clear_state(bref, BREF_IN_USE);
+            bref_set_state(bref, BREF_CLOSED);
+            atomic_add(&bref->bref_backend->backend_conn_count, -1);
+            /** The connection goes to the persistent pool of the server */
+            dcb_close(bref->bref_dcb);
+            bref->bref_dcb = NULL;
+        }
     }
 
-    int slaves_found = 0;
-    int slaves_connected = 0;
-    const int min_nslaves = 0; /*< not configurable at the time */
+    rses->rses_backends_released = true;
+    MXS_INFO("Session is idle, released its backend connections.");
+}
+
+/**
+ * Connect the backends of a session whose backends were released. The
+ * session command history is executed on all servers, the master included.
+ *
+ * @param rses Router client session
+ * @return True if the servers were connected
+ */
+static bool reattach_backends(ROUTER_CLIENT_SES *rses)
+{
     bool succp = false;
 
-    /**
-     * Choose at least 1+min_nslaves (master and slave) and at most 1+max_nslaves
-     * servers from the sorted list. First master found is selected.
-     */
-    for (int i = 0; i < router_nservers &&
-         (slaves_connected < max_nslaves || !master_connected); i++)
+    if (rses_begin_locked_router_action(rses))
     {
-        SERVER *serv = backend_ref[i].bref_backend->backend_server;
+        bool lazy = rses->rses_config.rw_lazy_connect;
 
-        if (!BREF_HAS_FAILED(&backend_ref[i]) && SERVER_IS_RUNNING(serv))
-        {
-            /* check also for relay servers and don't take the master_host */
-            if (slaves_found < max_nslaves &&
-                (max_slave_rlag == MAX_RLAG_UNDEFINED ||
-                 (serv->rlag != MAX_RLAG_NOT_AVAILABLE &&
-                  serv->rlag <= max_slave_rlag)) &&
-                (SERVER_IS_SLAVE(serv) || SERVER_IS_RELAY_SERVER(serv)) &&
-                (master_host == NULL || (serv != master_host->backend_server)))
-            {
-                slaves_found += 1;
+        rses->rses_backends_released = false;
+        rses->rses_slaves_pending = lazy;
+        rses->rses_master_ref = NULL;
 
-                if (BREF_IS_IN_USE((&backend_ref[i])) ||
-                    connect_server(&backend_ref[i], session, true))
-                {
-                    slaves_connected += 1;
-                }
-            }
-                /* take the master_host for master */
-            else if (master_host && (serv == master_host->backend_server))
-            {
-                /** p_master_ref must be assigned with this backend_ref pointer
-                 * because its original value may have been lost when backend
-                 * references were sorted with qsort. */
-                *p_master_ref = &backend_ref[i];
+        succp = select_connect_backend_servers(&rses->rses_master_ref, rses->rses_backend_ref,
+                                               rses->rses_nbackends,
+                                               lazy ? 0 : rses_get_max_slavecount(rses, rses->rses_nbackends),
+                                               rses_get_max_replication_lag(rses),
+                                               rses->rses_config.rw_slave_select_criteria,
+                                               rses->client_dcb->session, rses->router);
 
-                if (!master_connected)
-                {
-                    if (connect_server(&backend_ref[i], session, false))
-                    {
-                        master_connected = true;
-                    }
-                }
-            }
+        /** The master is connected without the history */
+        if (succp && rses->rses_master_ref && BREF_IS_IN_USE(rses->rses_master_ref))
+        {
+            succp = execute_sescmd_history(rses->rses_master_ref);
         }
-    } /*< for */
 
-    /**
-     * Successful cases
-     */
-    if (slaves_connected >= min_nslaves && slaves_connected <= max_nslaves)
+        slave_fallback_arm(rses);
+
+        rses_end_locked_router_action(rses);
+    }
+
+    return succp;
+}
+
+/**
+ * Find the slave that a read-only transaction is routed to.
+ *
+ * A transaction started with START TRANSACTION READ ONLY, or one that
+ * follows SET TRANSACTION READ ONLY, is pinned to one slave from its start
+ * until COMMIT or ROLLBACK. SET TRANSACTION READ ONLY is routed to the same
+ * slave so that the characteristic never lingers on the master.
+ *
+ * Router session must be locked.
+ *
+ * @param rses        Router client session
+ * @param qtype       Type of the statement being routed
+ * @param trx_started Whether the statement started a transaction
+ * @param trx_ended   Whether the statement ended a transaction
+ * @param p_bref      The backend the statement is routed to, or NULL if the
+ *                    statement is routed normally
+ *
+ * @return False if the slave of an open read-only transaction has failed
+ */
+static bool get_read_only_trx_target(ROUTER_CLIENT_SES *rses, qc_query_type_t qtype,
+                                     bool trx_started, bool trx_ended,
+                                     backend_ref_t **p_bref)
+{
+    *p_bref = NULL;
+
+    /** SET TRANSACTION READ ONLY only affects the next statement */
+    if (rses->rses_ro_trx_next)
     {
-        succp = true;
+        rses->rses_ro_trx_next = false;
 
-        if (MXS_LOG_PRIORITY_IS_ENABLED(LOG_INFO))
+        if (!trx_started)
         {
-            if (slaves_connected < max_nslaves)
-            {
-                MXS_INFO("Couldn't connect to maximum number of "
-                         "slaves. Connected successfully to %d slaves "
-                         "of %d of them.", slaves_connected, slaves_found);
-            }
-
-            for (int i = 0; i < router_nservers; i++)
-            {
-                if (BREF_IS_IN_USE((&backend_ref[i])))
-                {
-                    MXS_INFO("Selected %s in \t%s:%d",
-                             STRSRVSTATUS(backend_ref[i].bref_backend->backend_server),
-                             backend_ref[i].bref_backend->backend_server->name,
-                             backend_ref[i].bref_backend->backend_server->port);
-                }
-            } /* for */
+            rses->rses_ro_trx_server = NULL;
         }
     }
-        /** Failure cases */
-    else
+
+    if (rses->rses_ro_trx_server == NULL)
     {
-        if (slaves_connected < min_nslaves)
+        if (rses->rses_autocommit_enabled &&
+            QUERY_IS_TYPE(qtype, QUERY_TYPE_READ_ONLY_TRX) &&
+            (trx_started || !rses->rses_transaction_active))
         {
-            MXS_ERROR("Couldn't establish required amount of "
-                      "slave connections for router session.");
-        }
+            DCB *dcb = NULL;
 
-        /** Clean up connections */
-        for (int i = 0; i < router_nservers; i++)
-        {
-            if (BREF_IS_IN_USE((&backend_ref[i])))
+            if (get_dcb(&dcb, rses, BE_SLAVE, NULL, 0, rses_get_max_replication_lag(rses), NULL))
             {
-                ss_dassert(backend_ref[i].bref_backend->backend_conn_count > 0);
+                backend_ref_t *bref = get_bref_from_dcb(rses, dcb);
 
-                /** disconnect opened connections */
-                if (BREF_IS_WAITING_RESULT(&backend_ref[i]))
-                {
-                    bref_clear_state(&backend_ref[i], BREF_WAITING_RESULT);
-                }
-                bref_clear_state(&backend_ref[i], BREF_IN_USE);
-                /** Decrease backend's connection counter. */
-                atomic_add(&backend_ref[i].bref_backend->backend_conn_count, -1);
-                dcb_close(backend_ref[i].bref_dcb);
+                /** If no slave was found, the master runs the transaction */
+                if (bref && bref != rses->rses_master_ref)
+                {
+                    rses->rses_ro_trx_server = bref->bref_backend->backend_server;
+                    rses->rses_ro_trx_next = !trx_started;
+                    *p_bref = bref;
+                }
             }
         }
+
+        return true;
     }
 
-    return succp;
+    /** The backend references are reordered on reconnection */
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t *bref = &rses->rses_backend_ref[i];
+
+        if (bref->bref_backend->backend_server == rses->rses_ro_trx_server &&
+            BREF_IS_IN_USE(bref))
+        {
+            *p_bref = bref;
+            break;
+        }
+    }
+
+    bool open_trx = rses->rses_transaction_active || trx_ended;
+
+    if (trx_ended || *p_bref == NULL)
+    {
+        rses->rses_ro_trx_server = NULL;
+        rses->rses_ro_trx_next = false;
+    }
+
+    return *p_bref != NULL || !open_trx;
 }
 
 /**
- * Create a generic router session property strcture.
+ * Create a generic router session property strcture. The property is allocated
+ * from the pool of the router session.
+ *
+ * Router client session must be locked.
  */
-static rses_property_t *rses_property_init(rses_property_type_t prop_type)
+static rses_property_t *rses_property_init(ROUTER_CLIENT_SES *rses, rses_property_type_t prop_type)
 {
     rses_property_t *prop;
 
-    prop = (rses_property_t *)calloc(1, sizeof(rses_property_t));
+    prop = (rses_property_t *)slab_alloc(&rses->rses_prop_pool);
     if (prop == NULL)
     {
         MXS_ERROR("Error: Malloc returned NULL. (%s:%d)", __FILE__, __LINE__);
         return NULL;
     }
     prop->rses_prop_type = prop_type;
+    prop->rses_prop_rsession = rses;
 #if defined(SS_DEBUG)
     prop->rses_prop_chk_top = CHK_NUM_ROUTER_PROPERTY;
     prop->rses_prop_chk_tail = CHK_NUM_ROUTER_PROPERTY;
@@ -3213,7 +5812,7 @@ static void rses_property_done(rses_property_t *prop)
             ss_dassert(false);
             break;
     }
-    free(prop);
+    slab_free(&prop->rses_prop_rsession->rses_prop_pool, prop);
 }
 
 /**
@@ -3308,6 +5907,13 @@ static mysql_sescmd_t *mysql_sescmd_init(rses_property_t *rses_prop,
     sescmd->my_sescmd_buf = sescmd_buf;
     sescmd->my_sescmd_packet_type = packet_type;
     sescmd->position = atomic_add(&rses->pos_generator, 1);
+    sescmd->my_sescmd_ps_id = packet_type == MYSQL_COM_STMT_PREPARE ? ++rses->rses_ps_seq : 0;
+
+    /** The history counts to the bytes the session may buffer */
+    if (rses->client_dcb->session)
+    {
+        session_buffered_add(rses->client_dcb->session, gwbuf_length(sescmd_buf), false);
+    }
 
     return sescmd;
 }
@@ -3320,10 +5926,44 @@ static void mysql_sescmd_done(mysql_sescmd_t *sescmd)
         return;
     }
     CHK_RSES_PROP(sescmd->my_sescmd_prop);
+    ROUTER_CLIENT_SES *rses = sescmd->my_sescmd_prop->rses_prop_rsession;
+
+    if (rses && rses->client_dcb && rses->client_dcb->session && sescmd->my_sescmd_buf)
+    {
+        session_buffered_add(rses->client_dcb->session,
+                             -(int)gwbuf_length(sescmd->my_sescmd_buf), false);
+    }
     gwbuf_free(sescmd->my_sescmd_buf);
+    free(sescmd->my_sescmd_key);
     memset(sescmd, 0, sizeof(mysql_sescmd_t));
 }
 
+/**
+ * Take the packets of one session command reply from the replies of a backend.
+ * The reply may be incomplete, the rest of it then arrives with the next
+ * replies of the backend.
+ *
+ * @param replybuf  The replies of the backend
+ * @param complete  Set to true if the reply was complete
+ * @return The packets of the reply
+ */
+static GWBUF *sescmd_take_reply(GWBUF **replybuf, bool *complete)
+{
+    GWBUF *buf = *replybuf;
+    size_t len = 0;
+
+    *complete = false;
+
+    while (buf && !*complete)
+    {
+        len += GWBUF_LENGTH(buf);
+        *complete = GWBUF_IS_TYPE_RESPONSE_END(buf);
+        buf = buf->next;
+    }
+
+    return gwbuf_split(replybuf, len);
+}
+
 /**
  * All cases where backend message starts at least with one response to session
  * command are handled here.
@@ -3331,6 +5971,10 @@ static void mysql_sescmd_done(mysql_sescmd_t *sescmd)
  * discard packet. Else send reply to client. In both cases move cursor forward
  * until all session command replies are handled.
  *
+ * The replies are handled as their packets arrive. Whether the reply is sent
+ * to the client is decided from its first packet, the rest of the reply
+ * follows that decision.
+ *
  * Cases that are expected to happen and which are handled:
  * s = response not yet replied to client, S = already replied response,
  * q = query
@@ -3351,6 +5995,7 @@ static GWBUF *sescmd_cursor_process_replies(GWBUF *replybuf,
     mysql_sescmd_t *scmd;
     sescmd_cursor_t *scur;
     ROUTER_CLIENT_SES *ses;
+    GWBUF *rval = NULL;
 
     scur = &bref->bref_sescmd_cur;
     ss_dassert(SPINLOCK_IS_LOCKED(&(scur->scmd_cur_rses->rses_lock)));
@@ -3364,24 +6009,29 @@ static GWBUF *sescmd_cursor_process_replies(GWBUF *replybuf,
      */
     while (scmd != NULL && replybuf != NULL)
     {
-        bref->reply_cmd = *((unsigned char *)replybuf->start + 4);
-        scur->position = scmd->position;
-        /** Faster backend has already responded to client : discard */
-        if (scmd->my_sescmd_is_replied)
-        {
-            bool last_packet = false;
+        bool complete;
+        bool first = !bref->bref_sescmd_partial;
+        GWBUF *reply = sescmd_take_reply(&replybuf, &complete);
 
-            CHK_GWBUF(replybuf);
+        if (first)
+        {
+            bref->reply_cmd = *((unsigned char *)reply->start + 4);
+            scur->position = scmd->position;
+            bref->bref_sescmd_forward = false;
 
-            while (!last_packet)
+            if (scmd->my_sescmd_ps_id)
             {
-                int buflen;
-
-                buflen = GWBUF_LENGTH(replybuf);
-                last_packet = GWBUF_IS_TYPE_RESPONSE_END(replybuf);
-                /** discard packet */
-                replybuf = gwbuf_consume(replybuf, buflen);
+                bref_map_ps_reply(bref, scmd->my_sescmd_ps_id, reply, 0);
             }
+        }
+
+        /** Faster backend has already responded to client : discard */
+        if (!first)
+        {
+            /** The rest of a reply is handled like its first packet */
+        }
+        else if (scmd->my_sescmd_is_replied)
+        {
             /** Set response status received */
             bref_clear_state(bref, BREF_WAITING_RESULT);
 
@@ -3402,6 +6052,7 @@ static GWBUF *sescmd_cursor_process_replies(GWBUF *replybuf,
                 *reconnect = true;
                 gwbuf_free(replybuf);
                 replybuf = NULL;
+                complete = true;
             }
         }
         /** This is a response from the master and it is the "right" one.
@@ -3418,7 +6069,8 @@ static GWBUF *sescmd_cursor_process_replies(GWBUF *replybuf,
         {
             /** Mark the rest session commands as replied */
             scmd->my_sescmd_is_replied = true;
-            scmd->reply_cmd = *((unsigned char *)replybuf->start + 4);
+            scmd->reply_cmd = bref->reply_cmd;
+            bref->bref_sescmd_forward = true;
 
             MXS_INFO("Server '%s' responded to a session command, sending the response "
                      "to the client.", bref->bref_backend->backend_server->unique_name);
@@ -3462,9 +6114,23 @@ static GWBUF *sescmd_cursor_process_replies(GWBUF *replybuf,
                 MXS_ERROR("Slave '%s' (%s:%u) failed to execute session command.",
                           serv->unique_name, serv->name, serv->port);
             }
+        }
+
+        if (bref->bref_sescmd_forward)
+        {
+            rval = gwbuf_append(rval, reply);
+        }
+        else
+        {
+            gwbuf_free(reply);
+        }
+
+        bref->bref_sescmd_partial = !complete;
 
-            gwbuf_free(replybuf);
-            replybuf = NULL;
+        if (!complete)
+        {
+            /** The rest of the reply comes with the next read */
+            break;
         }
 
         if (sescmd_cursor_next(scur))
@@ -3480,7 +6146,7 @@ static GWBUF *sescmd_cursor_process_replies(GWBUF *replybuf,
     }
     ss_dassert(replybuf == NULL || *scur->scmd_cur_ptr_property == NULL);
 
-    return replybuf;
+    return gwbuf_append(rval, replybuf);
 }
 
 /**
@@ -3607,11 +6273,368 @@ static bool execute_sescmd_history(backend_ref_t *bref)
     {
         sescmd_cursor_reset(scur);
         succp = execute_sescmd_in_backend(bref);
+        ts_stats_add(bref->bref_backend->backend_stats->sescmd_replays, 1);
     }
 
     return succp;
 }
 
+/** Skip whitespace */
+static const char *sescmd_skip_space(const char *ptr, const char *end)
+{
+    while (ptr < end && isspace((unsigned char)*ptr))
+    {
+        ptr++;
+    }
+    return ptr;
+}
+
+/** Skip an unquoted identifier or a keyword */
+static const char *sescmd_skip_word(const char *ptr, const char *end)
+{
+    while (ptr < end && (isalnum((unsigned char)*ptr) || *ptr == '_' || *ptr == '$'))
+    {
+        ptr++;
+    }
+    return ptr;
+}
+
+/** Check if @p ptr starts with the keyword @p word */
+static bool sescmd_is_keyword(const char *ptr, const char *end, const char *word)
+{
+    size_t len = strlen(word);
+
+    return (size_t)(end - ptr) >= len && strncasecmp(ptr, word, len) == 0 &&
+           sescmd_skip_word(ptr + len, end) == ptr + len;
+}
+
+/**
+ * Skip a literal value: a quoted string, a number or a bare word such as ON
+ * or DEFAULT. Anything that could refer to other variables or call functions
+ * is not a literal.
+ *
+ * @return Pointer past the literal or NULL if @p ptr is not at a literal
+ */
+static const char *sescmd_skip_literal(const char *ptr, const char *end)
+{
+    if (ptr < end && (*ptr == '\'' || *ptr == '"' || *ptr == '`'))
+    {
+        char quote = *ptr++;
+
+        while (ptr < end)
+        {
+            if (*ptr == '\\' && quote != '`')
+            {
+                ptr += 2;
+            }
+            else if (*ptr == quote)
+            {
+                if (ptr + 1 < end && ptr[1] == quote)
+                {
+                    ptr += 2;
+                }
+                else
+                {
+                    return ptr + 1;
+                }
+            }
+            else
+            {
+                ptr++;
+            }
+        }
+        return NULL;
+    }
+
+    if (ptr < end && (*ptr == '-' || *ptr == '+'))
+    {
+        ptr++;
+    }
+
+    const char *start = ptr;
+
+    while (ptr < end && (isalnum((unsigned char)*ptr) || *ptr == '_' || *ptr == '$' || *ptr == '.'))
+    {
+        ptr++;
+    }
+
+    return ptr > start ? ptr : NULL;
+}
+
+/** Check that only whitespace and an optional semicolon remain */
+static bool sescmd_is_end(const char *ptr, const char *end)
+{
+    ptr = sescmd_skip_space(ptr, end);
+
+    if (ptr < end && *ptr == ';')
+    {
+        ptr = sescmd_skip_space(ptr + 1, end);
+    }
+
+    return ptr == end;
+}
+
+static char *sescmd_make_key(const char *start, const char *end)
+{
+    char *key = strndup(start, end - start);
+
+    if (key)
+    {
+        for (char *c = key; *c; c++)
+        {
+            *c = tolower((unsigned char)*c);
+        }
+    }
+    else
+    {
+        MXS_ERROR("Memory allocation failed.");
+    }
+
+    return key;
+}
+
+/**
+ * Get the compaction key of a SET statement. Only statements that assign
+ * a literal value to exactly one session or user variable are compacted.
+ */
+static char *get_set_compaction_key(const char *ptr, const char *end)
+{
+    const char *name = NULL;
+    const char *name_end = NULL;
+
+    if (sescmd_is_keyword(ptr, end, "GLOBAL"))
+    {
+        return NULL;
+    }
+    else if (sescmd_is_keyword(ptr, end, "SESSION"))
+    {
+        ptr = sescmd_skip_space(ptr + strlen("SESSION"), end);
+    }
+    else if (sescmd_is_keyword(ptr, end, "LOCAL"))
+    {
+        ptr = sescmd_skip_space(ptr + strlen("LOCAL"), end);
+    }
+
+    if (sescmd_is_keyword(ptr, end, "NAMES") ||
+        sescmd_is_keyword(ptr, end, "CHARSET") ||
+        sescmd_is_keyword(ptr, end, "CHARACTER"))
+    {
+        name = ptr;
+        ptr = sescmd_skip_word(ptr, end);
+        name_end = ptr;
+        ptr = sescmd_skip_space(ptr, end);
+
+        if (sescmd_is_keyword(name, end, "CHARACTER"))
+        {
+            if (!sescmd_is_keyword(ptr, end, "SET"))
+            {
+                return NULL;
+            }
+            /** CHARACTER SET and CHARSET are the same statement */
+            name = "charset";
+            name_end = name + strlen("charset");
+            ptr = sescmd_skip_space(ptr + strlen("SET"), end);
+        }
+
+        if ((ptr = sescmd_skip_literal(ptr, end)) == NULL)
+        {
+            return NULL;
+        }
+
+        ptr = sescmd_skip_space(ptr, end);
+
+        if (sescmd_is_keyword(ptr, end, "COLLATE"))
+        {
+            ptr = sescmd_skip_space(ptr + strlen("COLLATE"), end);
+
+            if ((ptr = sescmd_skip_literal(ptr, end)) == NULL)
+            {
+                return NULL;
+            }
+        }
+    }
+    else
+    {
+        if (end - ptr > 2 && ptr[0] == '@' && ptr[1] == '@')
+        {
+            ptr += 2;
+
+            if (end - ptr > 8 && strncasecmp(ptr, "session.", 8) == 0)
+            {
+                ptr += 8;
+            }
+            else if (end - ptr > 6 && strncasecmp(ptr, "local.", 6) == 0)
+            {
+                ptr += 6;
+            }
+            name = ptr;
+        }
+        else if (ptr < end && *ptr == '@')
+        {
+            /** User variables keep the @ so they don't clash with system variables */
+            name = ptr++;
+        }
+        else if (sescmd_is_keyword(ptr, end, "PASSWORD"))
+        {
+            return NULL;
+        }
+        else
+        {
+            name = ptr;
+        }
+
+        name_end = sescmd_skip_word(ptr, end);
+
+        if (name_end == ptr)
+        {
+            return NULL;
+        }
+
+        ptr = sescmd_skip_space(name_end, end);
+
+        if (ptr < end && *ptr == '=')
+        {
+            ptr++;
+        }
+        else if (end - ptr > 1 && ptr[0] == ':' && ptr[1] == '=')
+        {
+            ptr += 2;
+        }
+        else
+        {
+            return NULL;
+        }
+
+        ptr = sescmd_skip_space(ptr, end);
+
+        if ((ptr = sescmd_skip_literal(ptr, end)) == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    return sescmd_is_end(ptr, end) ? sescmd_make_key(name, name_end) : NULL;
+}
+
+/**
+ * Get the key used to compact the session command history. A later command
+ * with the same key completely overrides the session state set by an earlier
+ * one. The key is the variable name for a SET of a single variable and "use"
+ * for a change of the default database.
+ *
+ * @param buf Session command buffer
+ * @param packet_type Command byte of the packet
+ *
+ * @return The key or NULL if the command can't be compacted. The caller must
+ * free the returned key.
+ */
+static char *get_sescmd_compaction_key(GWBUF *buf, unsigned char packet_type)
+{
+    char *sql;
+    int len;
+
+    if (packet_type == MYSQL_COM_INIT_DB)
+    {
+        return strdup("use");
+    }
+
+    if (packet_type != MYSQL_COM_QUERY || !modutil_extract_SQL(buf, &sql, &len) ||
+        len > (int)GWBUF_LENGTH(buf) - 5)
+    {
+        return NULL;
+    }
+
+    const char *end = sql + len;
+    const char *ptr = sescmd_skip_space(sql, end);
+
+    if (sescmd_is_keyword(ptr, end, "USE"))
+    {
+        ptr = sescmd_skip_space(ptr + strlen("USE"), end);
+        const char *db = sescmd_skip_literal(ptr, end);
+
+        if (db && *ptr != '\'' && *ptr != '"' && sescmd_is_end(db, end))
+        {
+            return strdup("use");
+        }
+    }
+    else if (sescmd_is_keyword(ptr, end, "SET"))
+    {
+        return get_set_compaction_key(sescmd_skip_space(ptr + strlen("SET"), end), end);
+    }
+
+    return NULL;
+}
+
+/**
+ * Check if a backend's session command cursor still refers to a property.
+ * The cursor holds the address of the link to its current property which
+ * is the link of the previous property once the cursor has run out of commands.
+ */
+static bool sescmd_cursor_refers_to(sescmd_cursor_t *scur, rses_property_t *prop)
+{
+    return *scur->scmd_cur_ptr_property == prop ||
+           scur->scmd_cur_ptr_property == &prop->rses_prop_next ||
+           scur->scmd_cur_cmd == &prop->rses_prop_data.sescmd;
+}
+
+/**
+ * Remove session commands that a new command with the same compaction key
+ * supersedes. Only the commands after the last command that can't be
+ * compacted are removed as the ones before it may depend on the earlier state.
+ * Commands that a backend in use is still executing are kept until the next
+ * compaction.
+ *
+ * Router session must be locked.
+ *
+ * @param rses Router client session
+ * @param key Compaction key of the new session command
+ */
+static void compact_sescmd_history(ROUTER_CLIENT_SES *rses, const char *key)
+{
+    rses_property_t **start = &rses->rses_properties[RSES_PROP_TYPE_SESCMD];
+    rses_property_t **pp;
+
+    ss_dassert(SPINLOCK_IS_LOCKED(&rses->rses_lock));
+
+    for (pp = start; *pp; pp = &(*pp)->rses_prop_next)
+    {
+        if ((*pp)->rses_prop_data.sescmd.my_sescmd_key == NULL)
+        {
+            start = &(*pp)->rses_prop_next;
+        }
+    }
+
+    pp = start;
+
+    while (*pp)
+    {
+        rses_property_t *prop = *pp;
+        bool in_use = strcmp(prop->rses_prop_data.sescmd.my_sescmd_key, key) != 0;
+
+        for (int i = 0; i < rses->rses_nbackends && !in_use; i++)
+        {
+            backend_ref_t *bref = &rses->rses_backend_ref[i];
+
+            if (BREF_IS_IN_USE(bref) && sescmd_cursor_refers_to(&bref->bref_sescmd_cur, prop))
+            {
+                in_use = true;
+            }
+        }
+
+        if (in_use)
+        {
+            pp = &prop->rses_prop_next;
+        }
+        else
+        {
+            MXS_DEBUG("Removing superseded session command from the history: %s", key);
+            *pp = prop->rses_prop_next;
+            rses_property_done(prop);
+            atomic_add(&rses->rses_nsescmd, -1);
+        }
+    }
+}
+
 /**
  * If session command cursor is passive, sends the command to backend for
  * execution.
@@ -3664,6 +6687,8 @@ static bool execute_sescmd_in_backend(backend_ref_t *backend_ref)
         sescmd_cursor_set_active(scur, true);
     }
 
+    int len = gwbuf_length(scur->scmd_cur_cmd->my_sescmd_buf);
+
     switch (scur->scmd_cur_cmd->my_sescmd_packet_type)
     {
         case MYSQL_COM_CHANGE_USER:
@@ -3707,6 +6732,8 @@ static bool execute_sescmd_in_backend(backend_ref_t *backend_ref)
 
     if (rc == 1)
     {
+        ts_stats_add(backend_ref->bref_backend->backend_stats->queries, 1);
+        ts_stats_add(backend_ref->bref_backend->backend_stats->bytes_out, len);
         succp = true;
     }
     else
@@ -3851,11 +6878,11 @@ static void tracelog_routed_query(ROUTER_CLIENT_SES *rses, char *funcname,
 }
 
 /**
- * Return RCAP_TYPE_STMT_INPUT.
+ * Return RCAP_TYPE_STMT_INPUT, RCAP_TYPE_STREAM_INPUT and RCAP_TYPE_PARTIAL_REPLY.
  */
 static int getCapabilities()
 {
-    return RCAP_TYPE_STMT_INPUT;
+    return RCAP_TYPE_STMT_INPUT | RCAP_TYPE_STREAM_INPUT | RCAP_TYPE_PARTIAL_REPLY;
 }
 
 /**
@@ -3934,11 +6961,22 @@ static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
             if (BREF_IS_IN_USE((&backend_ref[i])))
             {
                 nbackends += 1;
-                if ((rc = dcb->func.write(dcb, gwbuf_clone(querybuf))) == 1)
+                if ((rc = dcb->func.write(dcb, bref_ps_clone(&backend_ref[i], querybuf))) == 1)
                 {
                     nsucc += 1;
                 }
             }
+
+            if (packet_type == MYSQL_COM_STMT_CLOSE && GWBUF_LENGTH(querybuf) >= MYSQL_HEADER_LEN + 5)
+            {
+                uint8_t *data = GWBUF_DATA(querybuf);
+                uint32_t id = MYSQL_GET_STMT_ID(data);
+
+                if (id < backend_ref[i].bref_ps_ids_size)
+                {
+                    backend_ref[i].bref_ps_ids[id] = 0;
+                }
+            }
         }
         rses_end_locked_router_action(router_cli_ses);
         gwbuf_free(querybuf);
@@ -4011,7 +7049,7 @@ static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
      * prevent it from being released before properties
      * are cleaned up as a part of router sessionclean-up.
      */
-    if ((prop = rses_property_init(RSES_PROP_TYPE_SESCMD)) == NULL)
+    if ((prop = rses_property_init(router_cli_ses, RSES_PROP_TYPE_SESCMD)) == NULL)
     {
         MXS_ERROR("Router session property initialization failed");
         rses_end_locked_router_action(router_cli_ses);
@@ -4020,6 +7058,19 @@ static bool route_session_write(ROUTER_CLIENT_SES *router_cli_ses,
 
     mysql_sescmd_init(prop, querybuf, packet_type, router_cli_ses);
 
+    if (router_cli_ses->rses_config.rw_compact_sescmd_hist &&
+        !router_cli_ses->rses_config.rw_disable_sescmd_hist)
+    {
+        prop->rses_prop_data.sescmd.my_sescmd_key =
+            get_sescmd_compaction_key(querybuf, packet_type);
+
+        if (prop->rses_prop_data.sescmd.my_sescmd_key)
+        {
+            compact_sescmd_history(router_cli_ses,
+                                   prop->rses_prop_data.sescmd.my_sescmd_key);
+        }
+    }
+
     /** Add sescmd property to router client session */
     if (rses_property_add(router_cli_ses, prop) != 0)
     {
@@ -4131,6 +7182,295 @@ static bool router_option_configured(ROUTER_INSTANCE *router,
 }
 #endif /*< NOT_USED */
 
+/**
+ * Parse the value of the local_queries router option, a list of the queries
+ * the router answers separated by '|'
+ *
+ * @param value     The value of the option
+ * @param enabled   Where the RW_LOCAL_ bits of the queries are stored
+ * @return True if the value is valid
+ */
+static bool parse_local_queries(char *value, uint32_t *enabled)
+{
+    uint32_t rval = 0;
+    char *lasts;
+
+    for (char *tok = strtok_r(value, "| ", &lasts); tok; tok = strtok_r(NULL, "| ", &lasts))
+    {
+        server_var_t var;
+
+        if (strcasecmp(tok, "all") == 0)
+        {
+            rval |= RW_LOCAL_ALL;
+        }
+        else if (strcasecmp(tok, "ping") == 0)
+        {
+            rval |= RW_LOCAL_PING;
+        }
+        else if (strcasecmp(tok, "autocommit") == 0)
+        {
+            rval |= RW_LOCAL_AUTOCOMMIT;
+        }
+        else if ((var = server_var_find(tok, strlen(tok))) < SERVER_N_VARS)
+        {
+            rval |= RW_LOCAL_VAR(var);
+        }
+        else
+        {
+            MXS_ERROR("Unknown value for 'local_queries': %s. Allowed values are all, "
+                      "ping, autocommit, version_comment, tx_isolation, "
+                      "auto_increment_increment, max_allowed_packet and sql_mode.", tok);
+            return false;
+        }
+    }
+
+    *enabled = rval;
+    return true;
+}
+
+/**
+ * Free a set of pool rules
+ *
+ * @param rules The rules
+ */
+static void pool_rules_free(POOL_RULES *rules)
+{
+    if (rules)
+    {
+        while (rules->rules)
+        {
+            POOL_RULE *rule = rules->rules;
+            rules->rules = rule->next;
+
+            if (rule->re)
+            {
+                mxs_pcre2_pattern_free(rule->re);
+            }
+            free(rule->value);
+            free(rule->tag_name);
+            free(rule->tag_value);
+            free(rule);
+        }
+        free(rules->path);
+        free(rules);
+    }
+}
+
+/**
+ * Parse one line of a pool rule file. A rule has the form
+ *
+ *     <user|hint|match|table> <value> <tag>=<value>
+ *
+ * where the value of a match rule is a regular expression which may contain
+ * spaces.
+ *
+ * @param line   The line without the newline
+ * @param path   The rule file, for the error messages
+ * @param lineno The line number, for the error messages
+ * @return The rule or NULL on error
+ */
+static POOL_RULE *pool_rule_parse(char *line, const char *path, int lineno)
+{
+    static const struct
+    {
+        const char   *name;
+        pool_match_t match;
+    } kinds[] =
+    {
+        {"user", POOL_MATCH_USER},
+        {"hint", POOL_MATCH_HINT},
+        {"match", POOL_MATCH_REGEX},
+        {"table", POOL_MATCH_TABLE}
+    };
+    char *kind = line + strspn(line, " \t");
+    char *value = kind + strcspn(kind, " \t");
+    char *end = value + strlen(value);
+
+    while (end > value && isspace(end[-1]))
+    {
+        *--end = '\0';
+    }
+
+    char *tag = end;
+
+    while (tag > value && !isspace(tag[-1]))
+    {
+        tag--;
+    }
+
+    char *eq = strchr(tag, '=');
+
+    if (*value == '\0' || tag == value || eq == NULL || eq == tag || eq[1] == '\0')
+    {
+        MXS_ERROR("%s:%d: Expected '<user|hint|match|table> <value> <tag>=<value>'.",
+                  path, lineno);
+        return NULL;
+    }
+
+    *value++ = '\0';
+    *eq = '\0';
+    end = tag;
+
+    while (end > value && isspace(end[-1]))
+    {
+        end--;
+    }
+    *end = '\0';
+    value += strspn(value, " \t");
+
+    int k;
+
+    for (k = 0; k < (int)(sizeof(kinds) / sizeof(kinds[0])); k++)
+    {
+        if (strcasecmp(kind, kinds[k].name) == 0)
+        {
+            break;
+        }
+    }
+
+    if (k == (int)(sizeof(kinds) / sizeof(kinds[0])))
+    {
+        MXS_ERROR("%s:%d: Unknown pool rule '%s', expected user, hint, match or table.",
+                  path, lineno, kind);
+        return NULL;
+    }
+
+    POOL_RULE *rule = calloc(1, sizeof(POOL_RULE));
+
+    if (rule == NULL || (rule->value = strdup(value)) == NULL ||
+        (rule->tag_name = strdup(tag)) == NULL || (rule->tag_value = strdup(eq + 1)) == NULL)
+    {
+        MXS_ERROR("Memory allocation failed when reading pool rules.");
+        goto error;
+    }
+
+    rule->match = kinds[k].match;
+
+    if (rule->match == POOL_MATCH_REGEX)
+    {
+        int errnumber;
+        size_t erroffset;
+
+        if ((rule->re = mxs_pcre2_pattern_compile(value, PCRE2_CASELESS,
+                                                  &errnumber, &erroffset)) == NULL)
+        {
+            char errbuf[512] = "Out of memory";
+
+            if (errnumber)
+            {
+                pcre2_get_error_message(errnumber, (PCRE2_UCHAR*)errbuf, sizeof(errbuf));
+            }
+            MXS_ERROR("%s:%d: Compiling regular expression '%s' failed at %lu: %s",
+                      path, lineno, value, erroffset, errbuf);
+            goto error;
+        }
+    }
+
+    return rule;
+
+error:
+    if (rule)
+    {
+        free(rule->value);
+        free(rule->tag_name);
+        free(rule->tag_value);
+        free(rule);
+    }
+    return NULL;
+}
+
+/**
+ * Read the pool rules from a file. Empty lines and lines starting with '#'
+ * are ignored.
+ *
+ * @param path The rule file
+ * @return The rules or NULL on error
+ */
+static POOL_RULES *pool_rules_load(const char *path)
+{
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL)
+    {
+        char errbuf[STRERROR_BUFLEN];
+        MXS_ERROR("Failed to open pool rule file '%s': %d, %s", path, errno,
+                  strerror_r(errno, errbuf, sizeof(errbuf)));
+        return NULL;
+    }
+
+    POOL_RULES *rules = calloc(1, sizeof(POOL_RULES));
+    POOL_RULE **tail = rules ? &rules->rules : NULL;
+    bool ok = rules && (rules->path = strdup(path));
+    char line[4096];
+    int lineno = 0;
+
+    while (ok && fgets(line, sizeof(line), file))
+    {
+        char *start = line + strspn(line, " \t");
+
+        lineno++;
+        start[strcspn(start, "\r\n")] = '\0';
+
+        if (*start != '\0' && *start != '#')
+        {
+            if ((*tail = pool_rule_parse(start, path, lineno)) != NULL)
+            {
+                tail = &(*tail)->next;
+            }
+            else
+            {
+                ok = false;
+            }
+        }
+    }
+
+    fclose(file);
+
+    if (ok && rules->rules == NULL)
+    {
+        MXS_ERROR("Pool rule file '%s' has no rules.", path);
+        ok = false;
+    }
+
+    if (!ok)
+    {
+        pool_rules_free(rules);
+        rules = NULL;
+    }
+
+    return rules;
+}
+
+/**
+ * Get the pool rules of a file. A file is read once and the rules are kept
+ * until the router is freed, the sessions refer to them from their copies
+ * of the configuration.
+ *
+ * @param router Router instance
+ * @param path   The rule file
+ * @return The rules or NULL on error
+ */
+static POOL_RULES *pool_rules_get(ROUTER_INSTANCE *router, const char *path)
+{
+    POOL_RULES *rules;
+
+    for (rules = router->pool_rules; rules; rules = rules->next)
+    {
+        if (strcmp(rules->path, path) == 0)
+        {
+            return rules;
+        }
+    }
+
+    if ((rules = pool_rules_load(path)) != NULL)
+    {
+        rules->next = router->pool_rules;
+        router->pool_rules = rules;
+    }
+
+    return rules;
+}
+
 /**
  * @brief Process router options
  *
@@ -4145,6 +7485,9 @@ static bool rwsplit_process_router_options(ROUTER_INSTANCE *router,
     char *value;
     select_criteria_t c;
 
+    /** The rules are only used while the option is present */
+    router->rwsplit_config.rw_pool_rules = NULL;
+
     if (options == NULL)
     {
         return true;
@@ -4168,14 +7511,15 @@ static bool rwsplit_process_router_options(ROUTER_INSTANCE *router,
                 c = GET_SELECT_CRITERIA(value);
                 ss_dassert(c == LEAST_GLOBAL_CONNECTIONS ||
                            c == LEAST_ROUTER_CONNECTIONS || c == LEAST_BEHIND_MASTER ||
-                           c == LEAST_CURRENT_OPERATIONS || c == UNDEFINED_CRITERIA);
+                           c == LEAST_CURRENT_OPERATIONS || c == LEAST_RESPONSE_TIME ||
+                           c == AFFINITY || c == UNDEFINED_CRITERIA);
 
                 if (c == UNDEFINED_CRITERIA)
                 {
                     MXS_ERROR("Unknown slave selection criteria \"%s\". "
                                 "Allowed values are LEAST_GLOBAL_CONNECTIONS, "
-                                "LEAST_ROUTER_CONNECTIONS, LEAST_BEHIND_MASTER,"
-                                "and LEAST_CURRENT_OPERATIONS.",
+                                "LEAST_ROUTER_CONNECTIONS, LEAST_BEHIND_MASTER, "
+                                "LEAST_CURRENT_OPERATIONS, LEAST_RESPONSE_TIME and AFFINITY.",
                                 STRCRITERIA(router->rwsplit_config.rw_slave_select_criteria));
                     success = false;
                 }
@@ -4192,6 +7536,35 @@ static bool rwsplit_process_router_options(ROUTER_INSTANCE *router,
             {
                 router->rwsplit_config.rw_disable_sescmd_hist = config_truth_value(value);
             }
+            else if (strcmp(options[i], "compact_sescmd_history") == 0)
+            {
+                router->rwsplit_config.rw_compact_sescmd_hist = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "lazy_connect") == 0)
+            {
+                router->rwsplit_config.rw_lazy_connect = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "max_slave_replication_lag_ms") == 0)
+            {
+                router->rwsplit_config.rw_max_slave_replication_lag_ms = atoi(value);
+            }
+            else if (strcmp(options[i], "causal_reads") == 0)
+            {
+                router->rwsplit_config.rw_causal_reads = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "multiplex") == 0)
+            {
+                router->rwsplit_config.rw_multiplex = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "affinity") == 0)
+            {
+                if (!affinity_parse_key(value, &router->rwsplit_config.rw_affinity_key))
+                {
+                    MXS_ERROR("Unknown value for 'affinity': %s. Allowed values are "
+                              "client, user and database.", value);
+                    success = false;
+                }
+            }
             else if (strcmp(options[i], "master_accept_reads") == 0)
             {
                 router->rwsplit_config.rw_master_reads = config_truth_value(value);
@@ -4200,6 +7573,56 @@ static bool rwsplit_process_router_options(ROUTER_INSTANCE *router,
             {
                 router->rwsplit_config.rw_strict_multi_stmt = config_truth_value(value);
             }
+            else if (strcmp(options[i], "slave_connect_fallback") == 0)
+            {
+                router->rwsplit_config.rw_slave_connect_fallback = atoi(value);
+            }
+            else if (strcmp(options[i], "galera_write_hash") == 0)
+            {
+                router->rwsplit_config.rw_galera_write_hash = config_truth_value(value);
+            }
+            else if (strcmp(options[i], "hedge_delay") == 0)
+            {
+                if (strcasecmp(value, "p95") == 0)
+                {
+                    router->rwsplit_config.rw_hedge_delay = RW_HEDGE_P95;
+                }
+                else if ((router->rwsplit_config.rw_hedge_delay = atoi(value)) < 0)
+                {
+                    MXS_ERROR("Invalid value for 'hedge_delay': %s. Expected milliseconds "
+                              "or p95.", value);
+                    success = false;
+                }
+            }
+            else if (strcmp(options[i], "hedge_budget") == 0)
+            {
+                int val = atoi(value);
+
+                if (val < 0 || val > 100)
+                {
+                    MXS_ERROR("Invalid value for 'hedge_budget': %s. Expected a percentage "
+                              "between 0 and 100.", value);
+                    success = false;
+                }
+                else
+                {
+                    router->rwsplit_config.rw_hedge_budget = val;
+                }
+            }
+            else if (strcmp(options[i], "pool_rules") == 0)
+            {
+                if ((router->rwsplit_config.rw_pool_rules = pool_rules_get(router, value)) == NULL)
+                {
+                    success = false;
+                }
+            }
+            else if (strcmp(options[i], "local_queries") == 0)
+            {
+                if (!parse_local_queries(value, &router->rwsplit_config.rw_local_queries))
+                {
+                    success = false;
+                }
+            }
             else if (strcmp(options[i], "master_failure_mode") == 0)
             {
                 if (strcasecmp(value, "fail_instantly") == 0)
@@ -4317,6 +7740,7 @@ static void handleError(ROUTER *instance, void *router_session,
                     if (bref != NULL)
                     {
                         CHK_BACKEND_REF(bref);
+                        ts_stats_add(bref->bref_backend->backend_stats->errors, 1);
                         bref_clear_state(bref, BREF_IN_USE);
                         bref_set_state(bref, BREF_CLOSED);
                         if (BREF_IS_WAITING_RESULT(bref))
@@ -4496,6 +7920,7 @@ static bool handle_error_new_connection(ROUTER_INSTANCE *inst,
         goto return_succp;
     }
     CHK_BACKEND_REF(bref);
+    ts_stats_add(bref->bref_backend->backend_stats->errors, 1);
 
     /**
      * If query was sent through the bref and it is waiting for reply from
@@ -4548,6 +7973,7 @@ static bool handle_error_new_connection(ROUTER_INSTANCE *inst,
                                                max_nslaves, max_slave_rlag,
                                                myrses->rses_config.rw_slave_select_criteria,
                                                ses, inst);
+        slave_fallback_arm(myrses);
     }
 
 return_succp:
@@ -4656,7 +8082,7 @@ static bool have_enough_servers(ROUTER_CLIENT_SES **p_rses, const int min_nsrv,
                           (*p_rses)->rses_config.rw_max_slave_conn_percent, dbgpct);
             }
         }
-        free(*p_rses);
+        memstats_free(rwsplit_memtag, *p_rses);
         *p_rses = NULL;
         succp = false;
     }
@@ -4693,6 +8119,12 @@ static int rses_get_max_slavecount(ROUTER_CLIENT_SES *rses,
     return max_nslaves;
 }
 
+/**
+ * Get the maximum replication lag of the slaves of a session
+ *
+ * @param rses Router client session
+ * @return The maximum lag in milliseconds
+ */
 static int rses_get_max_replication_lag(ROUTER_CLIENT_SES *rses)
 {
     int conf_max_rlag;
@@ -4700,9 +8132,14 @@ static int rses_get_max_replication_lag(ROUTER_CLIENT_SES *rses)
     CHK_CLIENT_RSES(rses);
 
     /** if there is no configured value, then longest possible int is used */
-    if (rses->rses_config.rw_max_slave_replication_lag > 0)
+    if (rses->rses_config.rw_max_slave_replication_lag_ms > 0)
+    {
+        conf_max_rlag = rses->rses_config.rw_max_slave_replication_lag_ms;
+    }
+    else if (rses->rses_config.rw_max_slave_replication_lag > 0 &&
+             rses->rses_config.rw_max_slave_replication_lag < INT_MAX / 1000)
     {
-        conf_max_rlag = rses->rses_config.rw_max_slave_replication_lag;
+        conf_max_rlag = rses->rses_config.rw_max_slave_replication_lag * 1000;
     }
     else
     {
@@ -4712,6 +8149,47 @@ static int rses_get_max_replication_lag(ROUTER_CLIENT_SES *rses)
     return conf_max_rlag;
 }
 
+/**
+ * Parse a replication lag limit of a hint. The value is in seconds or, with
+ * the suffix ms, in milliseconds.
+ *
+ * @param value The value of the hint
+ * @return The limit in milliseconds or -1 if the value is invalid
+ */
+static int parse_rlag_ms(const char *value)
+{
+    char *end;
+    long val = strtol(value, &end, 10);
+
+    if (end == value || val < 0)
+    {
+        return -1;
+    }
+    else if (strcasecmp(end, "ms") == 0)
+    {
+        return val < INT_MAX ? val : INT_MAX;
+    }
+    else if (*end == '\0' || strcasecmp(end, "s") == 0)
+    {
+        return val < INT_MAX / 1000 ? val * 1000 : INT_MAX;
+    }
+
+    return -1;
+}
+
+/**
+ * Check that the replication lag of a server does not exceed a limit
+ *
+ * @param rlag_us  The lag of the server in microseconds
+ * @param max_rlag The limit in milliseconds or MAX_RLAG_UNDEFINED
+ * @return True if the server can be used
+ */
+static bool rlag_is_within(long rlag_us, int max_rlag)
+{
+    return max_rlag == MAX_RLAG_UNDEFINED ||
+           (rlag_us != MAX_RLAG_NOT_AVAILABLE && rlag_us <= max_rlag * 1000L);
+}
+
 /**
  * Finds out if there is a backend reference pointing at the DCB given as
  * parameter.
@@ -4956,6 +8434,53 @@ static backend_ref_t *get_root_master_bref(ROUTER_CLIENT_SES *rses)
     return candidate_bref;
 }
 
+/**
+ * @brief Get the type of a multi-statement query
+ *
+ * Each statement of the query is classified separately.
+ *
+ * @param buf Buffer containing the full query
+ * @return The types of all statements combined or QUERY_TYPE_UNKNOWN if
+ * a statement could not be classified
+ */
+static uint32_t get_multi_stmt_type(GWBUF *buf)
+{
+    char *start = (char *)GWBUF_DATA(buf) + 5;
+    char *end = start + gw_mysql_get_byte3((uint8_t *)GWBUF_DATA(buf)) - 1;
+    uint32_t types = QUERY_TYPE_UNKNOWN;
+
+    while (start < end)
+    {
+        while (start < end && isspace(*start))
+        {
+            start++;
+        }
+
+        if (start == end)
+        {
+            break;
+        }
+
+        char *ptr = strnchr_esc_mysql(start, ';', end - start);
+        char *sql = strndup(start, ptr ? ptr - start : end - start);
+        GWBUF *stmt = modutil_create_query(sql);
+        uint32_t type = stmt ? qc_get_type(stmt) : QUERY_TYPE_UNKNOWN;
+
+        gwbuf_free(stmt);
+        free(sql);
+
+        if (type == QUERY_TYPE_UNKNOWN)
+        {
+            return QUERY_TYPE_UNKNOWN;
+        }
+
+        types |= type;
+        start = ptr ? ptr + 1 : end;
+    }
+
+    return types;
+}
+
 /**
  * @brief Detect multi-statement queries
  *
@@ -4964,12 +8489,18 @@ static backend_ref_t *get_root_master_bref(ROUTER_CLIENT_SES *rses)
  * this, for the duration of this session, all queries will be sent to the
  * master
  * if the current query contains a multi-statement query.
+ *
+ * A multi-statement query where every statement is a read can't modify the
+ * session state. Its type is set to the combined type of the statements and
+ * it is routed like any other read, in one packet.
  * @param rses Router client session
  * @param buf Buffer containing the full query
- * @return True if the query contains multiple statements
+ * @param qtype Type of the query, updated if all statements are reads
+ * @return True if the query contains multiple statements that are not all reads
  */
 static bool check_for_multi_stmt(ROUTER_CLIENT_SES *rses, GWBUF *buf,
-                                 mysql_server_cmd_t packet_type)
+                                 mysql_server_cmd_t packet_type,
+                                 qc_query_type_t *qtype)
 {
     MySQLProtocol *proto = (MySQLProtocol *)rses->client_dcb->protocol;
     bool rval = false;
@@ -4995,9 +8526,21 @@ static bool check_for_multi_stmt(ROUTER_CLIENT_SES *rses, GWBUF *buf,
                 if (ptr < data + buflen &&
                     !is_mysql_statement_end(ptr, buflen - (ptr - data)))
                 {
-                    rses->forced_node = rses->rses_master_ref;
-                    rval = true;
-                    MXS_INFO("Multi-statement query, routing all future queries to master.");
+                    uint32_t types = rses->have_tmp_tables ? QUERY_TYPE_UNKNOWN :
+                        get_multi_stmt_type(buf);
+
+                    if (QUERY_IS_TYPE(types, QUERY_TYPE_READ) &&
+                        (types & ~MULTI_STMT_READ_TYPES) == 0)
+                    {
+                        *qtype = (qc_query_type_t)types;
+                        MXS_INFO("Multi-statement query with only reads, routing it as a read.");
+                    }
+                    else
+                    {
+                        rses->forced_node = rses->rses_master_ref;
+                        rval = true;
+                        MXS_INFO("Multi-statement query, routing all future queries to master.");
+                    }
                 }
             }
         }
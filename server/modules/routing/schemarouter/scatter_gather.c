@@ -0,0 +1,1089 @@
+/*
+ * Copyright (c) 2016 MariaDB Corporation Ab
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file and at www.mariadb.com/bsl.
+ *
+ * Change Date: 2019-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2 or later of the General
+ * Public License.
+ */
+
+/**
+ * @file scatter_gather.c - Merging the resultsets of a SELECT sent to several shards
+ *
+ * Only simple statements are merged: a SELECT of rows without aggregate
+ * functions, DISTINCT, GROUP BY, joins or subqueries. The ORDER BY may only
+ * name columns of the resultset, by name or by position, and the LIMIT may
+ * only have constant values.
+ *
+ * The shards send their resultsets in parallel. The column definitions of
+ * the first shard are sent to the client once every shard has sent its own,
+ * after which the rows are merged. With an ORDER BY the next row is only
+ * known once every shard that has rows left has sent its next row, so
+ * only one row per shard plus the data that is still being read is held
+ * in memory. A LIMIT with an offset is sent to the shards as a LIMIT of
+ * the offset and the row count and the offset is applied to the merged rows.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <modutil.h>
+#include <mysql_utils.h>
+#include <log_manager.h>
+#include <mysql_client_server_protocol.h>
+#include <scatter_gather.h>
+
+/** Maximum number of ORDER BY columns */
+#define SCATTER_MAX_KEYS 16
+
+/** Status flag of an EOF packet telling that more resultsets follow */
+#define SCATTER_MORE_RESULTS 0x08
+
+typedef enum
+{
+    TOK_WORD,
+    TOK_QUOTED,
+    TOK_STRING,
+    TOK_NUMBER,
+    TOK_SYMBOL
+} scatter_token_type_t;
+
+typedef struct
+{
+    scatter_token_type_t type;
+    const char *start;
+    size_t len;
+    int depth;               /*< Parenthesis depth of the token */
+} scatter_token_t;
+
+typedef struct
+{
+    char *name;              /*< Name of the column, NULL if given by position */
+    int position;            /*< Position of the column, starting from 1 */
+    bool desc;
+    int column;              /*< Index of the column in the resultset */
+    bool numeric;            /*< Compare the values as numbers */
+} scatter_key_t;
+
+typedef enum
+{
+    SHARD_HEADER,            /*< Waiting for the column count */
+    SHARD_COLUMNS,           /*< Reading the column definitions */
+    SHARD_ROWS,              /*< Reading the rows */
+    SHARD_DONE               /*< The whole reply has been read */
+} scatter_shard_state_t;
+
+typedef struct
+{
+    const void *tag;
+    scatter_shard_state_t state;
+    GWBUF *readbuf;          /*< Data that has not been processed yet */
+    GWBUF *head;             /*< The next row of the shard */
+    bool head_parsed;        /*< Are the keys of the head row parsed */
+    const char *key_value[SCATTER_MAX_KEYS];
+    size_t key_len[SCATTER_MAX_KEYS];
+} scatter_shard_t;
+
+struct scatter
+{
+    scatter_key_t keys[SCATTER_MAX_KEYS];
+    int n_keys;
+    uint64_t offset;         /*< Rows to skip */
+    uint64_t limit;          /*< Rows to send */
+    bool has_limit;
+    uint64_t n_skipped;
+    uint64_t n_sent;
+    scatter_shard_t *shards;
+    int n_shards;
+    scatter_shard_t *header_shard; /*< The shard whose column definitions are sent */
+    GWBUF *header;           /*< Column count, column definitions and EOF */
+    uint8_t eof[MYSQL_HEADER_LEN + 5]; /*< The EOF after the column definitions */
+    uint64_t n_columns;
+    uint64_t n_coldefs;
+    bool *numeric;           /*< Is the column numeric */
+    char **names;            /*< Names of the columns */
+    char **org_names;        /*< Original names of the columns */
+    GWBUF *error;            /*< The first error from a shard */
+    bool header_sent;
+    bool finished;           /*< The whole reply has been sent to the client */
+    uint8_t seq;             /*< Sequence number of the next packet to the client */
+};
+
+static const char *aggregate_functions[] =
+{
+    "COUNT", "SUM", "MIN", "MAX", "AVG", "GROUP_CONCAT", "STD", "STDDEV",
+    "STDDEV_POP", "STDDEV_SAMP", "VARIANCE", "VAR_POP", "VAR_SAMP", "BIT_AND",
+    "BIT_OR", "BIT_XOR", NULL
+};
+
+static const char *unsupported_keywords[] =
+{
+    "UNION", "GROUP", "HAVING", "DISTINCT", "DISTINCTROW", "INTO", "FOR", "LOCK",
+    "PROCEDURE", "JOIN", "SQL_CALC_FOUND_ROWS", "OVER", "SELECT", NULL
+};
+
+static bool token_is(const scatter_token_t *tok, const char *word)
+{
+    return tok->type == TOK_WORD && strlen(word) == tok->len &&
+           strncasecmp(tok->start, word, tok->len) == 0;
+}
+
+static bool token_is_symbol(const scatter_token_t *tok, char c)
+{
+    return tok->type == TOK_SYMBOL && *tok->start == c;
+}
+
+static bool token_in(const scatter_token_t *tok, const char **words)
+{
+    for (int i = 0; words[i]; i++)
+    {
+        if (token_is(tok, words[i]))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool token_to_uint(const scatter_token_t *tok, uint64_t *value)
+{
+    if (tok->type != TOK_NUMBER)
+    {
+        return false;
+    }
+
+    *value = 0;
+
+    for (size_t i = 0; i < tok->len; i++)
+    {
+        if (!isdigit(tok->start[i]))
+        {
+            return false;
+        }
+        *value = *value * 10 + tok->start[i] - '0';
+    }
+
+    return true;
+}
+
+/**
+ * Split an SQL statement into tokens. Comments are skipped.
+ *
+ * @param sql      The statement
+ * @param tokens   The tokens are stored here, must be freed by the caller
+ * @param n_tokens Number of tokens
+ * @return True if the statement was tokenized, false on memory allocation
+ * failure or if it contains unterminated strings or executable comments
+ */
+static bool tokenize(const char *sql, scatter_token_t **tokens, int *n_tokens)
+{
+    const char *ptr = sql;
+    int depth = 0;
+    int size = 32;
+    int n = 0;
+    bool error = false;
+    scatter_token_t *arr = malloc(size * sizeof(scatter_token_t));
+
+    while (arr && *ptr && !error)
+    {
+        if (isspace(*ptr))
+        {
+            ptr++;
+            continue;
+        }
+
+        if (*ptr == '#' || (ptr[0] == '-' && ptr[1] == '-' && (ptr[2] == '\0' || isspace(ptr[2]))))
+        {
+            while (*ptr && *ptr != '\n')
+            {
+                ptr++;
+            }
+            continue;
+        }
+
+        if (ptr[0] == '/' && ptr[1] == '*')
+        {
+            const char *end = strstr(ptr + 2, "*/");
+
+            if (ptr[2] == '!' || end == NULL)
+            {
+                error = true;
+                continue;
+            }
+            ptr = end + 2;
+            continue;
+        }
+
+        if (n == size)
+        {
+            scatter_token_t *tmp = realloc(arr, (size *= 2) * sizeof(scatter_token_t));
+
+            if (tmp == NULL)
+            {
+                error = true;
+                continue;
+            }
+            arr = tmp;
+        }
+
+        scatter_token_t *tok = &arr[n++];
+        tok->start = ptr;
+        tok->depth = depth;
+
+        if (*ptr == '\'' || *ptr == '"' || *ptr == '`')
+        {
+            char quote = *ptr++;
+
+            while (*ptr && *ptr != quote)
+            {
+                if (*ptr == '\\' && quote != '`' && ptr[1])
+                {
+                    ptr++;
+                }
+                ptr++;
+            }
+
+            if (*ptr == '\0')
+            {
+                error = true;
+                continue;
+            }
+
+            tok->type = quote == '`' ? TOK_QUOTED : TOK_STRING;
+            /** Quoted identifiers are stored without the quotes */
+            tok->start += quote == '`' ? 1 : 0;
+            tok->len = ptr - tok->start;
+            ptr++;
+        }
+        else if (isdigit(*ptr))
+        {
+            while (isalnum(*ptr) || *ptr == '.')
+            {
+                ptr++;
+            }
+            tok->type = TOK_NUMBER;
+            tok->len = ptr - tok->start;
+        }
+        else if (isalpha(*ptr) || *ptr == '_' || *ptr == '$')
+        {
+            while (isalnum(*ptr) || *ptr == '_' || *ptr == '$')
+            {
+                ptr++;
+            }
+            tok->type = TOK_WORD;
+            tok->len = ptr - tok->start;
+        }
+        else
+        {
+            if (*ptr == '(')
+            {
+                depth++;
+            }
+            else if (*ptr == ')')
+            {
+                tok->depth = --depth;
+            }
+            tok->type = TOK_SYMBOL;
+            tok->len = 1;
+            ptr++;
+        }
+    }
+
+    if (arr == NULL || error)
+    {
+        free(arr);
+        return false;
+    }
+
+    *tokens = arr;
+    *n_tokens = n;
+    return true;
+}
+
+/**
+ * Parse the ORDER BY of a statement
+ *
+ * @param sc     The merge state
+ * @param tokens The tokens of the statement
+ * @param n      Number of tokens
+ * @param pos    The first token after ORDER BY, set to the first token after
+ *               the ORDER BY
+ * @return True if the ORDER BY is supported
+ */
+static bool parse_order_by(SCATTER *sc, scatter_token_t *tokens, int n, int *pos)
+{
+    int i = *pos;
+
+    while (i < n && sc->n_keys < SCATTER_MAX_KEYS)
+    {
+        scatter_key_t *key = &sc->keys[sc->n_keys];
+        uint64_t position;
+
+        if (token_to_uint(&tokens[i], &position) && position > 0)
+        {
+            key->position = position;
+            i++;
+        }
+        else if (tokens[i].type == TOK_WORD || tokens[i].type == TOK_QUOTED)
+        {
+            /** Only the last part of a qualified name is matched */
+            while (i + 2 < n && token_is_symbol(&tokens[i + 1], '.') &&
+                   (tokens[i + 2].type == TOK_WORD || tokens[i + 2].type == TOK_QUOTED))
+            {
+                i += 2;
+            }
+
+            if ((key->name = strndup(tokens[i].start, tokens[i].len)) == NULL)
+            {
+                return false;
+            }
+            i++;
+        }
+        else
+        {
+            return false;
+        }
+
+        sc->n_keys++;
+
+        if (i < n && (token_is(&tokens[i], "ASC") || token_is(&tokens[i], "DESC")))
+        {
+            key->desc = token_is(&tokens[i], "DESC");
+            i++;
+        }
+
+        if (i < n && token_is_symbol(&tokens[i], ','))
+        {
+            i++;
+        }
+        else
+        {
+            *pos = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Parse the LIMIT of a statement
+ *
+ * @param sc     The merge state
+ * @param tokens The tokens of the statement
+ * @param n      Number of tokens
+ * @param pos    The first token after LIMIT, set to the first token after
+ *               the LIMIT
+ * @return True if the LIMIT is supported
+ */
+static bool parse_limit(SCATTER *sc, scatter_token_t *tokens, int n, int *pos)
+{
+    int i = *pos;
+    uint64_t first, second;
+
+    if (i >= n || !token_to_uint(&tokens[i], &first))
+    {
+        return false;
+    }
+
+    sc->has_limit = true;
+    sc->limit = first;
+    i++;
+
+    if (i + 1 < n && token_is_symbol(&tokens[i], ',') && token_to_uint(&tokens[i + 1], &second))
+    {
+        sc->offset = first;
+        sc->limit = second;
+        i += 2;
+    }
+    else if (i + 1 < n && token_is(&tokens[i], "OFFSET") && token_to_uint(&tokens[i + 1], &second))
+    {
+        sc->offset = second;
+        i += 2;
+    }
+
+    *pos = i;
+    return true;
+}
+
+/**
+ * Parse a statement and check that it can be merged
+ *
+ * @param sc          The merge state
+ * @param sql         The statement
+ * @param limit_start Start of the LIMIT clause or NULL if there is none
+ * @param limit_end   End of the LIMIT clause
+ * @return True if the statement can be merged
+ */
+static bool parse_statement(SCATTER *sc, const char *sql, const char **limit_start,
+                            const char **limit_end)
+{
+    scatter_token_t *tokens;
+    int n;
+
+    if (!tokenize(sql, &tokens, &n))
+    {
+        return false;
+    }
+
+    bool rval = n > 0 && token_is(&tokens[0], "SELECT");
+    int i = 1;
+
+    *limit_start = NULL;
+
+    while (rval && i < n)
+    {
+        scatter_token_t *tok = &tokens[i];
+
+        if (tok->type == TOK_WORD && i + 1 < n && token_is_symbol(&tokens[i + 1], '(') &&
+            token_in(tok, aggregate_functions))
+        {
+            rval = false;
+        }
+        else if (tok->type == TOK_WORD && token_in(tok, unsupported_keywords))
+        {
+            rval = false;
+        }
+        else if (tok->depth == 0 && token_is(tok, "ORDER") && i + 1 < n &&
+                 token_is(&tokens[i + 1], "BY") && sc->n_keys == 0 && !sc->has_limit)
+        {
+            i += 2;
+            rval = parse_order_by(sc, tokens, n, &i);
+        }
+        else if (tok->depth == 0 && token_is(tok, "LIMIT") && !sc->has_limit)
+        {
+            i++;
+            if ((rval = parse_limit(sc, tokens, n, &i)))
+            {
+                *limit_start = tok->start;
+                *limit_end = tokens[i - 1].start + tokens[i - 1].len;
+            }
+        }
+        else if (token_is_symbol(tok, '?') ||
+                 ((sc->n_keys > 0 || sc->has_limit) && !token_is_symbol(tok, ';')) ||
+                 (token_is_symbol(tok, ';') && i + 1 != n))
+        {
+            /** Only a LIMIT may follow the ORDER BY and nothing but the end
+             * of the statement may follow the LIMIT */
+            rval = false;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    free(tokens);
+    return rval;
+}
+
+SCATTER* scatter_create(GWBUF* query, GWBUF** shard_query)
+{
+    SCATTER *sc = calloc(1, sizeof(SCATTER));
+    char *sql = modutil_get_SQL(query);
+    const char *limit_start, *limit_end;
+
+    if (sc == NULL || sql == NULL || !parse_statement(sc, sql, &limit_start, &limit_end))
+    {
+        free(sql);
+        scatter_free(sc);
+        return NULL;
+    }
+
+    if (sc->offset > 0)
+    {
+        /** The shards return the rows up to the end of the limit and the
+         * offset is applied to the merged rows */
+        uint64_t rows = sc->offset + sc->limit < sc->offset ? UINT64_MAX : sc->offset + sc->limit;
+        size_t len = strlen(sql) + 32;
+        char *rewritten = malloc(len);
+
+        if (rewritten)
+        {
+            snprintf(rewritten, len, "%.*sLIMIT %lu%s", (int)(limit_start - sql), sql,
+                     rows, limit_end);
+            *shard_query = modutil_create_query(rewritten);
+            free(rewritten);
+        }
+        else
+        {
+            *shard_query = NULL;
+        }
+    }
+    else
+    {
+        *shard_query = gwbuf_clone(query);
+    }
+
+    free(sql);
+
+    if (*shard_query == NULL)
+    {
+        scatter_free(sc);
+        return NULL;
+    }
+
+    return sc;
+}
+
+bool scatter_add_shard(SCATTER* sc, const void* tag)
+{
+    scatter_shard_t *shards = realloc(sc->shards, (sc->n_shards + 1) * sizeof(scatter_shard_t));
+
+    if (shards == NULL)
+    {
+        return false;
+    }
+
+    sc->shards = shards;
+    memset(&shards[sc->n_shards], 0, sizeof(scatter_shard_t));
+    shards[sc->n_shards].tag = tag;
+    shards[sc->n_shards].state = SHARD_HEADER;
+    sc->n_shards++;
+    return true;
+}
+
+static scatter_shard_t* find_shard(SCATTER* sc, const void* tag)
+{
+    for (int i = 0; i < sc->n_shards; i++)
+    {
+        if (sc->shards[i].tag == tag)
+        {
+            return &sc->shards[i];
+        }
+    }
+
+    return NULL;
+}
+
+bool scatter_is_pending(SCATTER* sc, const void* tag)
+{
+    scatter_shard_t *shard = find_shard(sc, tag);
+    return shard && shard->state != SHARD_DONE;
+}
+
+/**
+ * Read a length-encoded string or NULL from a row
+ *
+ * @param ptr  Pointer to the value, advanced past it
+ * @param end  End of the row
+ * @param len  Length of the value
+ * @return The value or NULL if the value is NULL or the row is malformed
+ */
+static const char* read_value(uint8_t **ptr, uint8_t *end, size_t *len)
+{
+    if (*ptr >= end || **ptr == 0xfb)
+    {
+        (*ptr)++;
+        return NULL;
+    }
+
+    const char *value = lestr_consume(ptr, len);
+    return *ptr <= end ? value : NULL;
+}
+
+/**
+ * Store the definition of a column of the resultset that is sent to the client
+ */
+static bool add_column(SCATTER* sc, GWBUF* packet)
+{
+    uint8_t *ptr = GWBUF_DATA(packet) + MYSQL_HEADER_LEN;
+    uint8_t *end = GWBUF_DATA(packet) + GWBUF_LENGTH(packet);
+    size_t len;
+    const char *value;
+
+    if (sc->n_coldefs >= sc->n_columns)
+    {
+        return false;
+    }
+
+    /** Skip the catalog, schema, table and original table */
+    for (int i = 0; i < 4; i++)
+    {
+        read_value(&ptr, end, &len);
+    }
+
+    uint64_t col = sc->n_coldefs++;
+
+    if ((value = read_value(&ptr, end, &len)))
+    {
+        sc->names[col] = strndup(value, len);
+    }
+
+    if ((value = read_value(&ptr, end, &len)))
+    {
+        sc->org_names[col] = strndup(value, len);
+    }
+
+    /** The length of the fixed fields, the character set and the length
+     * of the column precede the type */
+    if (ptr + 7 < end)
+    {
+        switch (ptr[7])
+        {
+        case 0x00: /*< DECIMAL */
+        case 0x01: /*< TINY */
+        case 0x02: /*< SHORT */
+        case 0x03: /*< LONG */
+        case 0x04: /*< FLOAT */
+        case 0x05: /*< DOUBLE */
+        case 0x08: /*< LONGLONG */
+        case 0x09: /*< INT24 */
+        case 0x0d: /*< YEAR */
+        case 0xf6: /*< NEWDECIMAL */
+            sc->numeric[col] = true;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Find the columns of the ORDER BY from the resultset
+ *
+ * @return NULL on success, otherwise the key that was not found
+ */
+static scatter_key_t* resolve_keys(SCATTER* sc)
+{
+    for (int i = 0; i < sc->n_keys; i++)
+    {
+        scatter_key_t *key = &sc->keys[i];
+        key->column = -1;
+
+        if (key->name == NULL)
+        {
+            if ((uint64_t)key->position <= sc->n_coldefs)
+            {
+                key->column = key->position - 1;
+            }
+        }
+        else
+        {
+            for (uint64_t col = 0; col < sc->n_coldefs && key->column == -1; col++)
+            {
+                if ((sc->names[col] && strcasecmp(sc->names[col], key->name) == 0) ||
+                    (sc->org_names[col] && strcasecmp(sc->org_names[col], key->name) == 0))
+                {
+                    key->column = col;
+                }
+            }
+        }
+
+        if (key->column == -1)
+        {
+            return key;
+        }
+
+        key->numeric = sc->numeric[key->column];
+    }
+
+    return NULL;
+}
+
+/**
+ * Read the next packets of a shard. The column definitions of the first
+ * shard to reply are stored, the rest are discarded. In the rows, the
+ * packets are read until the shard has a row to merge.
+ */
+static void read_shard(SCATTER* sc, scatter_shard_t* shard)
+{
+    GWBUF *packet;
+
+    while (shard->state != SHARD_DONE && (shard->state != SHARD_ROWS || shard->head == NULL) &&
+           (packet = modutil_get_next_MySQL_packet(&shard->readbuf)))
+    {
+        uint8_t *data = GWBUF_DATA(packet);
+        bool keep = false;
+
+        if (PTR_IS_ERR(data) || (shard->state == SHARD_HEADER && PTR_IS_OK(data)))
+        {
+            /** An error or a reply without a resultset ends the reply */
+            if (sc->error == NULL)
+            {
+                sc->error = packet;
+                keep = true;
+            }
+            shard->state = SHARD_DONE;
+        }
+        else if (shard->state == SHARD_HEADER)
+        {
+            shard->state = SHARD_COLUMNS;
+
+            if (sc->header_shard == NULL)
+            {
+                uint8_t *ptr = data + MYSQL_HEADER_LEN;
+                sc->header_shard = shard;
+                sc->n_columns = leint_consume(&ptr);
+                sc->numeric = calloc(sc->n_columns, sizeof(bool));
+                sc->names = calloc(sc->n_columns, sizeof(char*));
+                sc->org_names = calloc(sc->n_columns, sizeof(char*));
+                sc->header = gwbuf_append(sc->header, packet);
+                keep = true;
+            }
+        }
+        else if (shard->state == SHARD_COLUMNS)
+        {
+            if (PTR_IS_EOF(data))
+            {
+                shard->state = SHARD_ROWS;
+            }
+
+            if (shard == sc->header_shard)
+            {
+                if (PTR_IS_EOF(data))
+                {
+                    memcpy(sc->eof, data, sizeof(sc->eof));
+                }
+                else if (sc->numeric && sc->names && sc->org_names)
+                {
+                    add_column(sc, packet);
+                }
+                sc->header = gwbuf_append(sc->header, packet);
+                keep = true;
+            }
+        }
+        else if (PTR_IS_EOF(data))
+        {
+            shard->state = SHARD_DONE;
+        }
+        else if (!sc->finished)
+        {
+            shard->head = packet;
+            shard->head_parsed = false;
+            keep = true;
+        }
+
+        if (!keep)
+        {
+            gwbuf_free(packet);
+        }
+    }
+
+    if (shard->state == SHARD_DONE)
+    {
+        gwbuf_free(shard->readbuf);
+        shard->readbuf = NULL;
+    }
+}
+
+static void parse_keys(SCATTER* sc, scatter_shard_t* shard)
+{
+    uint8_t *ptr = GWBUF_DATA(shard->head) + MYSQL_HEADER_LEN;
+    uint8_t *end = GWBUF_DATA(shard->head) + GWBUF_LENGTH(shard->head);
+
+    for (uint64_t col = 0; col < sc->n_coldefs; col++)
+    {
+        size_t len = 0;
+        const char *value = read_value(&ptr, end, &len);
+
+        for (int i = 0; i < sc->n_keys; i++)
+        {
+            if ((uint64_t)sc->keys[i].column == col)
+            {
+                shard->key_value[i] = value;
+                shard->key_len[i] = len;
+            }
+        }
+    }
+
+    shard->head_parsed = true;
+}
+
+static int compare_values(const char *a, size_t a_len, const char *b, size_t b_len, bool numeric)
+{
+    if (a == NULL || b == NULL)
+    {
+        /** NULL is smaller than any value */
+        return (a != NULL) - (b != NULL);
+    }
+
+    /** The longest numeric value is a DECIMAL with 65 digits */
+    if (numeric && a_len < 80 && b_len < 80)
+    {
+        char abuf[80];
+        char bbuf[80];
+        memcpy(abuf, a, a_len);
+        abuf[a_len] = '\0';
+        memcpy(bbuf, b, b_len);
+        bbuf[b_len] = '\0';
+
+        long double x = strtold(abuf, NULL);
+        long double y = strtold(bbuf, NULL);
+
+        return x < y ? -1 : x > y ? 1 : 0;
+    }
+
+    int rval = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+    return rval ? rval : (a_len > b_len) - (a_len < b_len);
+}
+
+static int compare_rows(SCATTER* sc, scatter_shard_t* a, scatter_shard_t* b)
+{
+    for (int i = 0; i < sc->n_keys; i++)
+    {
+        int rval = compare_values(a->key_value[i], a->key_len[i],
+                                  b->key_value[i], b->key_len[i],
+                                  sc->keys[i].numeric);
+
+        if (rval)
+        {
+            return sc->keys[i].desc ? -rval : rval;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Find the shard whose row is sent next
+ *
+ * @return The shard or NULL if the next row is not yet known
+ */
+static scatter_shard_t* next_row(SCATTER* sc)
+{
+    scatter_shard_t *rval = NULL;
+
+    for (int i = 0; i < sc->n_shards; i++)
+    {
+        scatter_shard_t *shard = &sc->shards[i];
+
+        if (shard->head)
+        {
+            if (sc->n_keys == 0)
+            {
+                return shard;
+            }
+
+            if (!shard->head_parsed)
+            {
+                parse_keys(sc, shard);
+            }
+
+            if (rval == NULL || compare_rows(sc, shard, rval) < 0)
+            {
+                rval = shard;
+            }
+        }
+        else if (shard->state != SHARD_DONE && sc->n_keys > 0)
+        {
+            /** The shard may still have a smaller row */
+            return NULL;
+        }
+    }
+
+    return rval;
+}
+
+static GWBUF* add_packet(SCATTER* sc, GWBUF* out, GWBUF* packet)
+{
+    ((uint8_t*)GWBUF_DATA(packet))[3] = sc->seq++;
+    return gwbuf_append(out, packet);
+}
+
+static bool all_done(SCATTER* sc)
+{
+    for (int i = 0; i < sc->n_shards; i++)
+    {
+        if (sc->shards[i].state != SHARD_DONE)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Send the packets to the client that are known
+ */
+static GWBUF* merge(SCATTER* sc)
+{
+    GWBUF *out = NULL;
+
+    if (!sc->header_sent)
+    {
+        for (int i = 0; i < sc->n_shards; i++)
+        {
+            if (sc->shards[i].state == SHARD_HEADER || sc->shards[i].state == SHARD_COLUMNS)
+            {
+                return NULL;
+            }
+        }
+
+        sc->header_sent = true;
+        sc->seq = 1;
+
+        if (sc->error == NULL && sc->header_shard)
+        {
+            scatter_key_t *key = resolve_keys(sc);
+
+            if (key)
+            {
+                char msg[512];
+                snprintf(msg, sizeof(msg), "Cannot merge the results of the shards: "
+                         "ORDER BY column '%s' is not in the result set.",
+                         key->name ? key->name : "(position)");
+                sc->error = modutil_create_mysql_err_msg(1, 0, 1054, "42S22", msg);
+            }
+            else
+            {
+                out = sc->header;
+                sc->header = NULL;
+                sc->seq = sc->eof[3] + 1;
+            }
+        }
+    }
+
+    if (sc->finished)
+    {
+        return out;
+    }
+
+    scatter_shard_t *shard;
+
+    while (sc->error == NULL && (!sc->has_limit || sc->n_sent < sc->limit) &&
+           (shard = next_row(sc)))
+    {
+        GWBUF *row = shard->head;
+        shard->head = NULL;
+
+        if (sc->n_skipped < sc->offset)
+        {
+            sc->n_skipped++;
+            gwbuf_free(row);
+        }
+        else
+        {
+            out = add_packet(sc, out, row);
+            sc->n_sent++;
+        }
+
+        read_shard(sc, shard);
+    }
+
+    if (sc->error)
+    {
+        /** An error ends the reply, also in the middle of the rows */
+        out = add_packet(sc, out, sc->error);
+        sc->error = NULL;
+        sc->finished = true;
+    }
+    else if ((sc->has_limit && sc->n_sent >= sc->limit) || (all_done(sc) && next_row(sc) == NULL))
+    {
+        GWBUF *eof = gwbuf_alloc_and_load(sizeof(sc->eof), sc->eof);
+
+        if (eof)
+        {
+            /** The status is the one of the EOF after the column definitions */
+            ((uint8_t*)GWBUF_DATA(eof))[7] &= ~SCATTER_MORE_RESULTS;
+            out = add_packet(sc, out, eof);
+        }
+        sc->finished = true;
+    }
+
+    if (sc->finished)
+    {
+        /** The rows that were not sent are no longer needed */
+        for (int i = 0; i < sc->n_shards; i++)
+        {
+            gwbuf_free(sc->shards[i].head);
+            sc->shards[i].head = NULL;
+        }
+    }
+
+    return out;
+}
+
+GWBUF* scatter_process_reply(SCATTER* sc, const void* tag, GWBUF* reply, bool* shard_done)
+{
+    scatter_shard_t *shard = find_shard(sc, tag);
+
+    if (shard == NULL || shard->state == SHARD_DONE)
+    {
+        gwbuf_free(reply);
+        *shard_done = true;
+        return NULL;
+    }
+
+    shard->readbuf = gwbuf_append(shard->readbuf, reply);
+    read_shard(sc, shard);
+    *shard_done = shard->state == SHARD_DONE;
+
+    return merge(sc);
+}
+
+GWBUF* scatter_shard_error(SCATTER* sc, const void* tag, GWBUF* error)
+{
+    scatter_shard_t *shard = find_shard(sc, tag);
+
+    if (shard == NULL || shard->state == SHARD_DONE)
+    {
+        gwbuf_free(error);
+        return NULL;
+    }
+
+    gwbuf_free(shard->readbuf);
+    gwbuf_free(shard->head);
+    shard->readbuf = NULL;
+    shard->head = NULL;
+    shard->state = SHARD_DONE;
+
+    if (sc->error == NULL)
+    {
+        sc->error = error;
+    }
+    else
+    {
+        gwbuf_free(error);
+    }
+
+    return merge(sc);
+}
+
+bool scatter_is_complete(SCATTER* sc)
+{
+    return sc->finished && all_done(sc);
+}
+
+void scatter_free(SCATTER* sc)
+{
+    if (sc)
+    {
+        for (int i = 0; i < sc->n_keys; i++)
+        {
+            free(sc->keys[i].name);
+        }
+
+        for (int i = 0; i < sc->n_shards; i++)
+        {
+            gwbuf_free(sc->shards[i].readbuf);
+            gwbuf_free(sc->shards[i].head);
+        }
+
+        for (uint64_t i = 0; i < sc->n_coldefs; i++)
+        {
+            free(sc->names[i]);
+            free(sc->org_names[i]);
+        }
+
+        free(sc->shards);
+        free(sc->names);
+        free(sc->org_names);
+        free(sc->numeric);
+        gwbuf_free(sc->header);
+        gwbuf_free(sc->error);
+        free(sc);
+    }
+}
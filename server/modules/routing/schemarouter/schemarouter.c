@@ -30,7 +30,11 @@
 #include <modutil.h>
 #include <mysql_client_server_protocol.h>
 #include <maxscale/poll.h>
+#include <housekeeper.h>
+#include <mysql_utils.h>
 #include <pcre.h>
+#include <memstats.h>
+#include <hash.h>
 
 #define DEFAULT_REFRESH_INTERVAL 30.0
 
@@ -40,6 +44,9 @@
 /** Hashtable size for the per user shard maps */
 #define SCHEMAROUTER_USERHASH_SIZE 10
 
+/** The router session properties allocated at a time */
+#define SCHEMAROUTER_PROPS_PER_SLAB 16
+
 MODULE_INFO info =
 {
     MODULE_API_ROUTER,
@@ -124,7 +131,7 @@ static mysql_sescmd_t* mysql_sescmd_init(rses_property_t*   rses_prop,
                                          unsigned char      packet_type,
                                          ROUTER_CLIENT_SES* rses);
 static rses_property_t* mysql_sescmd_get_property(mysql_sescmd_t* scmd);
-static rses_property_t* rses_property_init(rses_property_type_t prop_type);
+static rses_property_t* rses_property_init(ROUTER_CLIENT_SES* rses, rses_property_type_t prop_type);
 static void rses_property_add(ROUTER_CLIENT_SES* rses,
                               rses_property_t*   prop);
 static void rses_property_done(rses_property_t* prop);
@@ -150,6 +157,7 @@ static bool route_session_write(ROUTER_CLIENT_SES* router_client_ses,
                                 unsigned char      packet_type,
                                 qc_query_type_t    qtype);
 static void bref_clear_state(backend_ref_t* bref, bref_state_t state);
+static void bref_record_query(backend_ref_t* bref, int len);
 static void bref_set_state(backend_ref_t*   bref, bref_state_t state);
 static sescmd_cursor_t* backend_ref_get_sescmd_cursor (backend_ref_t* bref);
 static int  router_handle_state_switch(DCB* dcb, DCB_REASON reason, void* data);
@@ -164,6 +172,7 @@ static void handle_error_reply_client(SESSION*           ses,
 
 static SPINLOCK instlock;
 static ROUTER_INSTANCE* instances;
+static int schemarouter_memtag = MEMSTATS_OTHER; /*< The tag of the session properties in the memory statistics */
 
 bool detect_show_shards(GWBUF* query);
 int process_show_shards(ROUTER_CLIENT_SES* rses);
@@ -177,6 +186,14 @@ int inspect_backend_mapping_states(ROUTER_CLIENT_SES *router_cli_ses,
 bool handle_default_db(ROUTER_CLIENT_SES *router_cli_ses);
 void route_queued_query(ROUTER_CLIENT_SES *router_cli_ses);
 void synchronize_shard_map(ROUTER_CLIENT_SES *client);
+static void refresh_shard_map(void *data);
+static void check_mapping_timeouts(void *data);
+static void handle_mapping_timeout(ROUTER_CLIENT_SES* rses);
+static void finish_database_mapping(ROUTER_CLIENT_SES* rses);
+static void discard_late_mapping_reply(backend_ref_t* bref, GWBUF** buffer);
+
+static const char* shard_map_task_name = "shard_map";
+static const char* mapping_task_name = "mapping_timeout";
 
 static int hashkeyfun(void* key)
 {
@@ -184,14 +201,7 @@ static int hashkeyfun(void* key)
     {
         return 0;
     }
-    int hash = 0, c = 0;
-    char* ptr = (char*)key;
-    while ((c = *ptr++))
-    {
-        hash = c + (hash << 6) + (hash << 16) - hash;
-    }
-
-    return hash;
+    return (int)hash_str((char *)key, hash_seed());
 }
 
 static int hashcmpfun(void* v1, void* v2)
@@ -224,8 +234,11 @@ shard_map_t* shard_map_alloc()
             HASHMEMORYFN kfree = (HASHMEMORYFN)keyfreefun;
             hashtable_memory_fns(rval->hash, kcopy, kcopy, kfree, kfree);
             spinlock_init(&rval->lock);
+            rval->tables = NULL;
+            rval->scattered = NULL;
             rval->last_updated = 0;
             rval->state = SHMAP_UNINIT;
+            rval->refcount = 1;
         }
         else
         {
@@ -236,6 +249,28 @@ shard_map_t* shard_map_alloc()
     return rval;
 }
 
+/**
+ * Release a reference to a shard map. The shard map is freed when the last
+ * reference to it is released.
+ * @param map Shard map to release or NULL
+ */
+void shard_map_release(shard_map_t *map)
+{
+    if (map && atomic_add(&map->refcount, -1) == 1)
+    {
+        hashtable_free(map->hash);
+        if (map->tables)
+        {
+            hashtable_free(map->tables);
+        }
+        if (map->scattered)
+        {
+            hashtable_free(map->scattered);
+        }
+        free(map);
+    }
+}
+
 /**
  * Convert a length encoded string into a C string.
  * @param data Pointer to the first byte of the string
@@ -294,11 +329,42 @@ char* get_lenenc_str(void* data)
     return rval;
 }
 
+/**
+ * Read the start of the packet at the position of an iterator. The iterator
+ * is not advanced.
+ *
+ * @param iter Iterator over the response
+ * @param header Where the first bytes of the packet are copied
+ * @param size Size of @c header, at least MYSQL_HEADER_LEN
+ * @return Length of the packet or 0 at the end of the response
+ */
+static size_t showdb_packet_start(GWBUF_ITERATOR *iter, uint8_t *header, size_t size)
+{
+    memset(header, 0, size);
+    if (gwbuf_iter_copy(iter, size, header) < MYSQL_HEADER_LEN)
+    {
+        return 0;
+    }
+    return gw_mysql_get_byte3(header) + MYSQL_HEADER_LEN;
+}
+
+/**
+ * Stop the scan of a SHOW DATABASES response at the EOF after the columns
+ * @param data Set to true when the EOF packet is found
+ * @param header Start of the packet
+ * @param pktlen Length of the packet
+ * @return False at the EOF packet
+ */
+static bool showdb_scan_eof(void *data, uint8_t *header, size_t pktlen)
+{
+    return !(*(bool*)data = PTR_IS_EOF(header));
+}
+
 /**
  * Parses a response set to a SHOW DATABASES query and inserts them into the
  * router client session's database hashtable. The name of the database is used
- * as the key and the unique name of the server is the value. The function
- * currently supports only result sets that span a single SQL packet.
+ * as the key and the unique name of the server is the value. The response is
+ * read in place, only a row that spans buffers is copied.
  * @param rses Router client session
  * @param target Target server where the database is
  * @param buf GWBUF containing the result set
@@ -307,7 +373,9 @@ char* get_lenenc_str(void* data)
  */
 showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t* bref, GWBUF** buffer)
 {
-    unsigned char* ptr;
+    GWBUF_ITERATOR iter;
+    uint8_t ptr[MYSQL_HEADER_LEN + 5];
+    size_t len;
     char* target = bref->bref_backend->backend_server->unique_name;
     GWBUF* buf;
     bool duplicate_found = false;
@@ -318,8 +386,6 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
         return SHOWDB_FATAL_ERROR;
     }
 
-    /** TODO: Don't make the buffer contiguous but process it as a buffer chain */
-    *buffer = gwbuf_make_contiguous(*buffer);
     buf = modutil_get_complete_packets(buffer);
 
     if (buf == NULL)
@@ -327,7 +393,8 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
         return SHOWDB_PARTIAL_RESPONSE;
     }
 
-    ptr = (unsigned char*) buf->start;
+    gwbuf_iter_init(&iter, buf);
+    len = showdb_packet_start(&iter, ptr, sizeof(ptr));
 
     if (PTR_IS_ERR(ptr))
     {
@@ -338,13 +405,14 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
 
     if (bref->n_mapping_eof == 0)
     {
-        /** Skip column definitions */
-        while (ptr < (unsigned char*) buf->end && !PTR_IS_EOF(ptr))
-        {
-            ptr += gw_mysql_get_byte3(ptr) + 4;
-        }
+        /** Skip column definitions and the first EOF packet */
+        MODUTIL_PACKET_SCAN scan;
+        bool eof = false;
 
-        if (ptr >= (unsigned char*) buf->end)
+        modutil_scan_init(&scan);
+        size_t skipped = modutil_scan_packets(&scan, buf, showdb_scan_eof, &eof);
+
+        if (!eof || scan.skip > 0)
         {
             MXS_INFO("schemarouter: Malformed packet for SHOW DATABASES.");
             *buffer = gwbuf_append(buf, *buffer);
@@ -352,16 +420,22 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
         }
 
         atomic_add(&bref->n_mapping_eof, 1);
-        /** Skip first EOF packet */
-        ptr += gw_mysql_get_byte3(ptr) + 4;
+        gwbuf_iter_skip(&iter, skipped);
+        len = showdb_packet_start(&iter, ptr, sizeof(ptr));
     }
 
     spinlock_acquire(&rses->shardmap->lock);
-    while (ptr < (unsigned char*) buf->end && !PTR_IS_EOF(ptr))
+    while (len > 0 && !PTR_IS_EOF(ptr))
     {
-        int payloadlen = gw_mysql_get_byte3(ptr);
-        int packetlen = payloadlen + 4;
-        char* data = get_lenenc_str(ptr + 4);
+        uint8_t* packet = gwbuf_iter_peek(&iter, len);
+        uint8_t* copy = NULL;
+
+        if (packet == NULL && (packet = copy = malloc(len)))
+        {
+            gwbuf_iter_copy(&iter, len, copy);
+        }
+
+        char* data = packet ? get_lenenc_str(packet + 4) : NULL;
 
         if (data)
         {
@@ -371,7 +445,10 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
             }
             else
             {
-                if (!(hashtable_fetch(rses->router->ignored_dbs, data) ||
+                /** With table level sharding a database can be split
+                 * across servers, the shared shard map has its tables */
+                if (!(rses->rses_config.table_sharding ||
+                      hashtable_fetch(rses->router->ignored_dbs, data) ||
                       (rses->router->ignore_regex &&
                        pcre2_match(rses->router->ignore_regex, (PCRE2_SPTR)data,
                                    PCRE2_ZERO_TERMINATED, 0, 0,
@@ -387,11 +464,13 @@ showdb_response_t parse_showdb_response(ROUTER_CLIENT_SES* rses, backend_ref_t*
             }
             free(data);
         }
-        ptr += packetlen;
+        free(copy);
+        gwbuf_iter_skip(&iter, len);
+        len = showdb_packet_start(&iter, ptr, sizeof(ptr));
     }
     spinlock_release(&rses->shardmap->lock);
 
-    if (ptr < (unsigned char*) buf->end && PTR_IS_EOF(ptr) && bref->n_mapping_eof == 1)
+    if (len > 0 && PTR_IS_EOF(ptr) && bref->n_mapping_eof == 1)
     {
         atomic_add(&bref->n_mapping_eof, 1);
         MXS_INFO("schemarouter: SHOW DATABASES fully received from %s.",
@@ -436,12 +515,19 @@ int gen_databaselist(ROUTER_INSTANCE* inst, ROUTER_CLIENT_SES* session)
 
     for (i = 0; i < session->rses_nbackends; i++)
     {
-        session->rses_backend_ref[i].bref_mapped = false;
-        session->rses_backend_ref[i].n_mapping_eof = 0;
+        /** A server that is still sending the reply to the previous
+         * SHOW DATABASES is not waited for */
+        session->rses_backend_ref[i].bref_mapped = session->rses_backend_ref[i].bref_map_late;
+        if (!session->rses_backend_ref[i].bref_map_late)
+        {
+            session->rses_backend_ref[i].n_mapping_eof = 0;
+        }
     }
 
     session->init |= INIT_MAPPING;
     session->init &= ~INIT_UNINT;
+    session->rses_mapping_start = time(NULL);
+    session->rses_mapping_expired = false;
     len = strlen(query) + 1;
     buffer = gwbuf_alloc(len + 4);
     *((unsigned char*)buffer->start) = len;
@@ -455,7 +541,8 @@ int gen_databaselist(ROUTER_INSTANCE* inst, ROUTER_CLIENT_SES* session)
     {
         if (BREF_IS_IN_USE(&session->rses_backend_ref[i]) &&
             !BREF_IS_CLOSED(&session->rses_backend_ref[i]) &
-            SERVER_IS_RUNNING(session->rses_backend_ref[i].bref_backend->backend_server))
+            SERVER_IS_RUNNING(session->rses_backend_ref[i].bref_backend->backend_server) &&
+            !session->rses_backend_ref[i].bref_map_late)
         {
             clone = gwbuf_clone(buffer);
             dcb = session->rses_backend_ref[i].bref_dcb;
@@ -470,6 +557,310 @@ int gen_databaselist(ROUTER_INSTANCE* inst, ROUTER_CLIENT_SES* session)
     return !rval;
 }
 
+/**
+ * Check if a database is ignored when looking for duplicate databases
+ * @param router Router instance
+ * @param db Database name
+ * @param match_data Match data for the ignore_databases_regex pattern
+ * @return True if the database is ignored
+ */
+static bool is_ignored_database(ROUTER_INSTANCE* router, const char* db,
+                                pcre2_match_data* match_data)
+{
+    return hashtable_fetch(router->ignored_dbs, (char*)db) ||
+           (router->ignore_regex &&
+            pcre2_match(router->ignore_regex, (PCRE2_SPTR)db, PCRE2_ZERO_TERMINATED,
+                        0, 0, match_data, NULL) >= 0);
+}
+
+/**
+ * Add the tables of a server to a shard map
+ * @param router Router instance
+ * @param map Shard map being built
+ * @param mysql Connection to the server
+ * @param server The server
+ * @param match_data Match data for the ignore_databases_regex pattern
+ * @return True if the tables were added, false if the query failed or a table
+ * was found on more than one server and scatter_gather is not used
+ */
+static bool add_shard_tables(ROUTER_INSTANCE* router, shard_map_t* map, MYSQL* mysql,
+                             SERVER* server, pcre2_match_data* match_data)
+{
+    const char* query = "SELECT TABLE_SCHEMA, TABLE_NAME FROM information_schema.TABLES "
+        "WHERE TABLE_SCHEMA NOT IN ('mysql', 'information_schema', 'performance_schema')";
+    MYSQL_RES *result;
+    bool rval = true;
+
+    if (mysql_query(mysql, query) != 0 || (result = mysql_store_result(mysql)) == NULL)
+    {
+        MXS_ERROR("Failed to fetch the tables of server '%s' for the shard "
+                  "map of service '%s': %s", server->unique_name,
+                  router->service->name, mysql_error(mysql));
+        return false;
+    }
+
+    MYSQL_ROW row;
+
+    while ((row = mysql_fetch_row(result)))
+    {
+        char name[MYSQL_DATABASE_MAXLEN * 2 + 2];
+
+        if (row[0] == NULL || row[1] == NULL)
+        {
+            continue;
+        }
+
+        snprintf(name, sizeof(name), "%s.%s", row[0], row[1]);
+
+        if (hashtable_add(map->tables, name, server->unique_name) ||
+            is_ignored_database(router, row[0], match_data))
+        {
+            continue;
+        }
+
+        if (map->scattered)
+        {
+            /** The table is split across servers, SELECTs from it are merged
+             * from all of them */
+            char* servers = (char*)hashtable_fetch(map->scattered, name);
+            const char* first = servers ? servers : (char*)hashtable_fetch(map->tables, name);
+            size_t len = strlen(first) + strlen(server->unique_name) + 2;
+            char* list = malloc(len);
+
+            if (list == NULL)
+            {
+                rval = false;
+                break;
+            }
+
+            snprintf(list, len, "%s,%s", first, server->unique_name);
+            hashtable_delete(map->scattered, name);
+            hashtable_add(map->scattered, name, list);
+            free(list);
+        }
+        else
+        {
+            MXS_ERROR("Table '%s' found on servers '%s' and '%s' for service '%s'.",
+                      name, server->unique_name, (char*)hashtable_fetch(map->tables, name),
+                      router->service->name);
+            rval = false;
+        }
+    }
+
+    mysql_free_result(result);
+    return rval;
+}
+
+/**
+ * Build a shard map by sending a SHOW DATABASES query to all the running
+ * servers with the credentials of the service. With table level sharding the
+ * tables of the servers are read from information_schema. This is done by
+ * the housekeeper thread, so the queries can block.
+ * @param router Router instance
+ * @return The new shard map or NULL if no server could be queried, a query
+ * failed or a database or a table was found on more than one server
+ */
+static shard_map_t* build_shard_map(ROUTER_INSTANCE* router)
+{
+    shard_map_t *map = shard_map_alloc();
+    pcre2_match_data *match_data = NULL;
+    bool table_sharding = router->schemarouter_config.table_sharding;
+
+    if (map == NULL ||
+        (table_sharding &&
+         (map->tables = hashtable_alloc(SCHEMAROUTER_HASHSIZE, hashkeyfun, hashcmpfun)) == NULL) ||
+        (router->ignore_regex &&
+         (match_data = pcre2_match_data_create_from_pattern(router->ignore_regex, NULL)) == NULL))
+    {
+        MXS_ERROR("Memory allocation failed when building the shard map of service '%s'.",
+                  router->service->name);
+        shard_map_release(map);
+        return NULL;
+    }
+
+    if (table_sharding)
+    {
+        HASHMEMORYFN kcopy = (HASHMEMORYFN)strdup;
+        HASHMEMORYFN kfree = (HASHMEMORYFN)keyfreefun;
+        hashtable_memory_fns(map->tables, kcopy, kcopy, kfree, kfree);
+
+        if (router->schemarouter_config.scatter_gather)
+        {
+            if ((map->scattered = hashtable_alloc(SCHEMAROUTER_HASHSIZE, hashkeyfun,
+                                                  hashcmpfun)) == NULL)
+            {
+                MXS_ERROR("Memory allocation failed when building the shard map "
+                          "of service '%s'.", router->service->name);
+                shard_map_release(map);
+                pcre2_match_data_free(match_data);
+                return NULL;
+            }
+            hashtable_memory_fns(map->scattered, kcopy, kcopy, kfree, kfree);
+        }
+    }
+
+    char *user = router->service->credentials.name;
+    char *dpwd = decryptPassword(router->service->credentials.authdata);
+    GATEWAY_CONF *cnf = config_get_global_options();
+    bool error = false;
+    int n_servers = 0;
+
+    for (int i = 0; router->servers[i] && !error; i++)
+    {
+        SERVER *server = router->servers[i]->backend_server;
+
+        if (!SERVER_IS_RUNNING(server))
+        {
+            continue;
+        }
+
+        MYSQL *mysql = mysql_init(NULL);
+        MYSQL_RES *result = NULL;
+
+        if (mysql == NULL)
+        {
+            MXS_ERROR("MySQL connection initialization failed when building the "
+                      "shard map of service '%s'.", router->service->name);
+            error = true;
+            break;
+        }
+
+        mysql_options(mysql, MYSQL_OPT_READ_TIMEOUT, &cnf->auth_read_timeout);
+        mysql_options(mysql, MYSQL_OPT_CONNECT_TIMEOUT, &cnf->auth_conn_timeout);
+        mysql_options(mysql, MYSQL_OPT_WRITE_TIMEOUT, &cnf->auth_write_timeout);
+
+        if (mxs_mysql_real_connect(mysql, server, user, dpwd) == NULL ||
+            mysql_query(mysql, "SHOW DATABASES") != 0 ||
+            (result = mysql_store_result(mysql)) == NULL)
+        {
+            MXS_ERROR("Failed to fetch the databases of server '%s' for the shard "
+                      "map of service '%s': %s", server->unique_name,
+                      router->service->name, mysql_error(mysql));
+            error = true;
+        }
+        else
+        {
+            MYSQL_ROW row;
+
+            while ((row = mysql_fetch_row(result)))
+            {
+                /** With table level sharding a database can be split across
+                 * servers, only its tables must be unique */
+                if (row[0] && !hashtable_add(map->hash, row[0], server->unique_name) &&
+                    !table_sharding && !is_ignored_database(router, row[0], match_data))
+                {
+                    MXS_ERROR("Database '%s' found on servers '%s' and '%s' for service '%s'.",
+                              row[0], server->unique_name,
+                              (char*)hashtable_fetch(map->hash, row[0]),
+                              router->service->name);
+                    error = true;
+                }
+            }
+
+            mysql_free_result(result);
+            n_servers++;
+
+            if (table_sharding && !error &&
+                !add_shard_tables(router, map, mysql, server, match_data))
+            {
+                error = true;
+            }
+        }
+
+        mysql_close(mysql);
+    }
+
+    free(dpwd);
+    pcre2_match_data_free(match_data);
+
+    if (error || n_servers == 0)
+    {
+        shard_map_release(map);
+        map = NULL;
+    }
+    else
+    {
+        map->state = SHMAP_READY;
+        map->last_updated = time(NULL);
+    }
+
+    return map;
+}
+
+/**
+ * Housekeeper task that rebuilds the shard map of a router instance. New
+ * sessions take a reference to the current shard map, which is never
+ * modified once it has been published. If the shard map can't be built, the
+ * previous one is kept.
+ * @param data Router instance
+ */
+static void refresh_shard_map(void *data)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE*)data;
+    shard_map_t *map = build_shard_map(router);
+
+    if (map)
+    {
+        spinlock_acquire(&router->lock);
+        shard_map_t *old = router->shard_map;
+        router->shard_map = map;
+        spinlock_release(&router->lock);
+
+        shard_map_release(old);
+        MXS_INFO("schemarouter: Refreshed the shard map of service '%s'.",
+                 router->service->name);
+    }
+}
+
+/**
+ * Find the server of the tables of a query from the table level shard map.
+ * Tables without a database are looked up from the current database.
+ * @param client Client router session
+ * @param buffer Query to inspect
+ * @return Name of the server or NULL if no table of the query is in the map
+ */
+static char* get_table_target_name(ROUTER_CLIENT_SES* client, GWBUF* buffer)
+{
+    int n_tables = 0;
+    const char* const* tables = qc_get_table_names_view(buffer, &n_tables, true);
+    char* rval = NULL;
+
+    for (int i = 0; i < n_tables; i++)
+    {
+        char name[MYSQL_DATABASE_MAXLEN * 2 + 2];
+        char* server;
+
+        if (strchr(tables[i], '.'))
+        {
+            snprintf(name, sizeof(name), "%s", tables[i]);
+        }
+        else if (client->current_db[0] != '\0')
+        {
+            snprintf(name, sizeof(name), "%s.%s", client->current_db, tables[i]);
+        }
+        else
+        {
+            continue;
+        }
+
+        if ((server = (char*)hashtable_fetch(client->shardmap->tables, name)))
+        {
+            if (rval && strcmp(server, rval) != 0)
+            {
+                MXS_ERROR("Schemarouter: Query targets tables on servers '%s' and '%s'. "
+                          "Cross server queries are not supported.", rval, server);
+            }
+            else if (rval == NULL)
+            {
+                rval = server;
+                MXS_INFO("schemarouter: Query targets table '%s' on server '%s'", name, rval);
+            }
+        }
+    }
+
+    return rval;
+}
+
 /**
  * Check the hashtable for the right backend for this query.
  * @param router Router instance
@@ -483,20 +874,28 @@ char* get_shard_target_name(ROUTER_INSTANCE* router,
                             qc_query_type_t qtype)
 {
     int sz = 0, i, j;
-    char** dbnms = NULL;
+    const char* const* dbnms = NULL;
     char* rval = NULL, *query, *tmp = NULL;
     bool has_dbs = false; /**If the query targets any database other than the current one*/
 
-    dbnms = qc_get_database_names(buffer, &sz);
+    dbnms = qc_get_database_names_view(buffer, &sz);
 
     HASHTABLE* ht = client->shardmap->hash;
 
-    if (sz > 0)
+    /** The tables of a query take precedence over their databases, a
+     * database can be split across servers with table level sharding */
+    if (client->shardmap->tables &&
+        (rval = get_table_target_name(client, buffer)))
+    {
+        has_dbs = true;
+    }
+
+    if (rval == NULL && sz > 0)
     {
         for (i = 0; i < sz; i++)
         {
             char* name;
-            if ((name = (char*)hashtable_fetch(ht, dbnms[i])))
+            if ((name = (char*)hashtable_fetch(ht, (char*)dbnms[i])))
             {
                 if (strcmp(dbnms[i], "information_schema") == 0 && rval == NULL)
                 {
@@ -519,9 +918,7 @@ char* get_shard_target_name(ROUTER_INSTANCE* router,
                     }
                 }
             }
-            free(dbnms[i]);
         }
-        free(dbnms);
     }
 
     /* Check if the query is a show tables query with a specific database */
@@ -622,6 +1019,11 @@ bool check_shard_status(ROUTER_INSTANCE* router, char* shard)
  */
 int internalRoute(DCB* dcb)
 {
+    if (dcb->session && dcb->session->router_session)
+    {
+        handle_mapping_timeout((ROUTER_CLIENT_SES*)dcb->session->router_session);
+    }
+
     if (dcb->dcb_readqueue && dcb->session)
     {
         GWBUF* tmp = dcb->dcb_readqueue;
@@ -669,6 +1071,7 @@ void ModuleInit()
     MXS_NOTICE("Initializing Schema Sharding Router.");
     spinlock_init(&instlock);
     instances = NULL;
+    schemarouter_memtag = memstats_tag("schemarouter");
 }
 
 /**
@@ -837,6 +1240,22 @@ static ROUTER* createInstance(SERVICE *service, char **options)
         {
             router->schemarouter_config.debug = config_truth_value(value);
         }
+        else if (strcmp(options[i], "shared_shard_map") == 0)
+        {
+            router->schemarouter_config.shared_shard_map = config_truth_value(value);
+        }
+        else if (strcmp(options[i], "table_sharding") == 0)
+        {
+            router->schemarouter_config.table_sharding = config_truth_value(value);
+        }
+        else if (strcmp(options[i], "scatter_gather") == 0)
+        {
+            router->schemarouter_config.scatter_gather = config_truth_value(value);
+        }
+        else if (strcmp(options[i], "mapping_timeout") == 0)
+        {
+            router->schemarouter_config.mapping_timeout = atoi(value);
+        }
         else
         {
             MXS_ERROR("Unknown router options for Schemarouter: %s", options[i]);
@@ -851,6 +1270,20 @@ static ROUTER* createInstance(SERVICE *service, char **options)
         router->schemarouter_config.max_sescmd_hist = 0;
     }
 
+    if (router->schemarouter_config.table_sharding &&
+        !router->schemarouter_config.shared_shard_map)
+    {
+        MXS_ERROR("Schemarouter: The table_sharding option requires shared_shard_map.");
+        failure = true;
+    }
+
+    if (router->schemarouter_config.scatter_gather &&
+        !router->schemarouter_config.table_sharding)
+    {
+        MXS_ERROR("Schemarouter: The scatter_gather option requires table_sharding.");
+        failure = true;
+    }
+
     if (failure)
     {
         free(router);
@@ -888,6 +1321,13 @@ static ROUTER* createInstance(SERVICE *service, char **options)
         router->servers[nservers]->weight = 1;
         router->servers[nservers]->be_valid = false;
         router->servers[nservers]->stats.queries = 0;
+        router->servers[nservers]->backend_stats = serviceGetBackendStats(service, server->server);
+
+        if (router->servers[nservers]->backend_stats == NULL)
+        {
+            free(router->servers[nservers]);
+            goto clean_up;
+        }
         if (server->server->monuser == NULL && service->credentials.name != NULL)
         {
             router->servers[nservers]->backend_server->monuser =
@@ -929,6 +1369,26 @@ static ROUTER* createInstance(SERVICE *service, char **options)
     router->next = instances;
     instances = router;
     spinlock_release(&instlock);
+
+    if (router->schemarouter_config.shared_shard_map)
+    {
+        char tasknm[strlen(service->name) + strlen(shard_map_task_name) + 7];
+        int frequency = router->schemarouter_config.refresh_min_interval;
+
+        /** Build the first shard map right away, sessions map the databases
+         * themselves until it is ready */
+        snprintf(tasknm, sizeof(tasknm), "%s-%s-init", service->name, shard_map_task_name);
+        hktask_oneshot(tasknm, refresh_shard_map, router, 1);
+        snprintf(tasknm, sizeof(tasknm), "%s-%s", service->name, shard_map_task_name);
+        hktask_add(tasknm, refresh_shard_map, router, frequency > 0 ? frequency : 1);
+    }
+
+    if (router->schemarouter_config.mapping_timeout > 0)
+    {
+        char tasknm[strlen(service->name) + strlen(mapping_task_name) + 2];
+        snprintf(tasknm, sizeof(tasknm), "%s-%s", service->name, mapping_task_name);
+        hktask_add(tasknm, check_mapping_timeouts, router, 1);
+    }
     goto retblock;
 
 clean_up:
@@ -1012,13 +1472,20 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
 
     spinlock_release(&session->ses_lock);
 
-    client_rses = (ROUTER_CLIENT_SES *)calloc(1, sizeof(ROUTER_CLIENT_SES));
+    router_nservers = router_get_servercount(router);
+
+    /** The backend references are allocated with the session */
+    client_rses = (ROUTER_CLIENT_SES *)calloc(1, sizeof(ROUTER_CLIENT_SES) +
+                                              router_nservers * sizeof(backend_ref_t));
 
     if (client_rses == NULL)
     {
         ss_dassert(false);
         goto return_rses;
     }
+    backend_ref = (backend_ref_t *)(client_rses + 1);
+    slab_init(&client_rses->rses_prop_pool, sizeof(rses_property_t),
+              SCHEMAROUTER_PROPS_PER_SLAB, schemarouter_memtag);
 #if defined(SS_DEBUG)
     client_rses->rses_chk_top = CHK_NUM_ROUTER_SES;
     client_rses->rses_chk_tail = CHK_NUM_ROUTER_SES;
@@ -1030,10 +1497,18 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
 
     spinlock_acquire(&router->lock);
 
-    shard_map_t *map = hashtable_fetch(router->shard_maps, session->client_dcb->user);
-    enum shard_map_state state;
+    shard_map_t *map;
+    enum shard_map_state state = SHMAP_UNINIT;
 
-    if (map)
+    if (router->schemarouter_config.shared_shard_map)
+    {
+        if ((map = router->shard_map))
+        {
+            atomic_add(&map->refcount, 1);
+            state = SHMAP_READY;
+        }
+    }
+    else if ((map = hashtable_fetch(router->shard_maps, session->client_dcb->user)))
     {
         state = shard_map_update_state(map, router);
     }
@@ -1042,6 +1517,8 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
 
     if (map == NULL || state != SHMAP_READY)
     {
+        shard_map_release(router->schemarouter_config.shared_shard_map ? map : NULL);
+
         if ((map = shard_map_alloc()) == NULL)
         {
             MXS_ERROR("Failed to allocate enough memory to create"
@@ -1080,26 +1557,6 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
     client_rses->rses_autocommit_enabled = true;
     client_rses->rses_transaction_active = false;
 
-    /**
-     * Instead of calling this, ensure that there is at least one
-     * responding server.
-     */
-
-    router_nservers = router_get_servercount(router);
-
-    /**
-     * Create backend reference objects for this session.
-     */
-    backend_ref = (backend_ref_t *)calloc(1, router_nservers*sizeof(backend_ref_t));
-
-    if (backend_ref == NULL)
-    {
-        /** log this */
-        free(client_rses);
-        free(backend_ref);
-        client_rses = NULL;
-        goto return_rses;
-    }
     /**
      * Initialize backend references with BACKEND ptr.
      * Initialize session command cursors for each backend reference.
@@ -1133,7 +1590,6 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
      */
     if (!(succp = rses_begin_locked_router_action(client_rses)))
     {
-        free(client_rses->rses_backend_ref);
         free(client_rses);
         client_rses = NULL;
         goto return_rses;
@@ -1152,7 +1608,6 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
      * Master and at least <min_nslaves> slaves must be found
      */
     if (!succp) {
-        free(client_rses->rses_backend_ref);
         free(client_rses);
         client_rses = NULL;
         goto return_rses;
@@ -1163,7 +1618,6 @@ static void* newSession(ROUTER* router_inst, SESSION* session)
 
     if (!(succp = rses_begin_locked_router_action(client_rses)))
     {
-        free(client_rses->rses_backend_ref);
         free(client_rses);
 
         client_rses = NULL;
@@ -1361,8 +1815,8 @@ static void freeSession(ROUTER* router_instance, void* router_client_session)
     spinlock_release(&router->lock);
 
     /**
-     * For each property type, walk through the list, finalize properties
-     * and free the allocated memory.
+     * For each property type, walk through the list and finalize the
+     * properties, their memory is released with the pool.
      */
     for (i = RSES_PROP_TYPE_FIRST; i < RSES_PROP_TYPE_COUNT; i++)
     {
@@ -1376,12 +1830,19 @@ static void freeSession(ROUTER* router_instance, void* router_client_session)
             p = q;
         }
     }
+    if (router_cli_ses->rses_config.shared_shard_map)
+    {
+        shard_map_release(router_cli_ses->shardmap);
+    }
+    scatter_free(router_cli_ses->rses_scatter);
+    gwbuf_free(router_cli_ses->rses_scatter_queue);
+
     /*
      * We are no longer in the linked list, free
      * all the memory and other resources associated
      * to the client session.
      */
-    free(router_cli_ses->rses_backend_ref);
+    slab_release(&router_cli_ses->rses_prop_pool);
     free(router_cli_ses);
     return;
 }
@@ -1498,7 +1959,7 @@ void check_drop_tmp_table(ROUTER* instance,
                           qc_query_type_t type)
 {
     int tsize = 0, klen = 0, i;
-    char** tbl = NULL;
+    const char* const* tbl = NULL;
     char *hkey, *dbname;
 
     ROUTER_CLIENT_SES* router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
@@ -1509,7 +1970,7 @@ void check_drop_tmp_table(ROUTER* instance,
 
     if (qc_is_drop_table_query(querybuf))
     {
-        tbl = qc_get_table_names(querybuf, &tsize, false);
+        tbl = qc_get_table_names_view(querybuf, &tsize, false);
         if (tbl != NULL)
         {
             for (i = 0; i < tsize; i++)
@@ -1528,11 +1989,8 @@ void check_drop_tmp_table(ROUTER* instance,
                         MXS_INFO("Temporary table dropped: %s", hkey);
                     }
                 }
-                free(tbl[i]);
                 free(hkey);
             }
-
-            free(tbl);
         }
     }
 }
@@ -1553,7 +2011,7 @@ qc_query_type_t is_read_tmp_table(ROUTER* instance,
 
     bool target_tmp_table = false;
     int tsize = 0, klen = 0, i;
-    char** tbl = NULL;
+    const char* const* tbl = NULL;
     char *hkey, *dbname;
 
     ROUTER_CLIENT_SES* router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
@@ -1569,7 +2027,7 @@ qc_query_type_t is_read_tmp_table(ROUTER* instance,
         QUERY_IS_TYPE(qtype, QUERY_TYPE_SYSVAR_READ) ||
         QUERY_IS_TYPE(qtype, QUERY_TYPE_GSYSVAR_READ))
     {
-        tbl = qc_get_table_names(querybuf, &tsize, false);
+        tbl = qc_get_table_names_view(querybuf, &tsize, false);
 
         if (tbl != NULL && tsize > 0)
         {
@@ -1599,15 +2057,6 @@ qc_query_type_t is_read_tmp_table(ROUTER* instance,
         }
     }
 
-    if (tbl != NULL)
-    {
-        for (i = 0; i < tsize; i++)
-        {
-            free(tbl[i]);
-        }
-        free(tbl);
-    }
-
     return qtype;
 }
 
@@ -1639,9 +2088,9 @@ void check_create_tmp_table(ROUTER* instance,
     if (QUERY_IS_TYPE(type, QUERY_TYPE_CREATE_TMP_TABLE))
     {
         bool  is_temp = true;
-        char* tblname = NULL;
+        const char* tblname = NULL;
 
-        tblname = qc_get_created_table_name(querybuf);
+        tblname = qc_get_created_table_name_view(querybuf);
 
         if (tblname && strlen(tblname) > 0)
         {
@@ -1658,17 +2107,14 @@ void check_create_tmp_table(ROUTER* instance,
 
         if (rses_prop_tmp == NULL)
         {
-            if ((rses_prop_tmp =
-                 (rses_property_t*)calloc(1, sizeof(rses_property_t))))
+            /** The pool of the properties is shared with the session commands */
+            spinlock_acquire(&router_cli_ses->rses_lock);
+            rses_prop_tmp = rses_property_init(router_cli_ses, RSES_PROP_TYPE_TMPTABLES);
+            spinlock_release(&router_cli_ses->rses_lock);
+
+            if (rses_prop_tmp)
             {
-#if defined(SS_DEBUG)
-                rses_prop_tmp->rses_prop_chk_top = CHK_NUM_ROUTER_PROPERTY;
-                rses_prop_tmp->rses_prop_chk_tail = CHK_NUM_ROUTER_PROPERTY;
-#endif
-                rses_prop_tmp->rses_prop_rsession = router_cli_ses;
                 rses_prop_tmp->rses_prop_refcount = 1;
-                rses_prop_tmp->rses_prop_next = NULL;
-                rses_prop_tmp->rses_prop_type = RSES_PROP_TYPE_TMPTABLES;
                 router_cli_ses->rses_properties[RSES_PROP_TYPE_TMPTABLES] = rses_prop_tmp;
             }
             else
@@ -1712,7 +2158,6 @@ void check_create_tmp_table(ROUTER* instance,
         }
 
         free(hkey);
-        free(tblname);
     }
 }
 
@@ -1741,67 +2186,326 @@ RESULT_ROW *result_set_cb(struct resultset * rset, void *data)
     RESULT_ROW *row = NULL;
     struct string_array *strarray = (struct string_array*) data;
 
-    if (strarray->position < strarray->size && (row = resultset_make_row(rset)))
+    if (strarray->position < strarray->size && (row = resultset_make_row(rset)))
+    {
+        if (resultset_row_set(row, 0, strarray->array[strarray->position++]) == 0)
+        {
+            resultset_free_row(row);
+            row = NULL;
+        }
+    }
+
+    return row;
+}
+
+/**
+ * Generates a custom SHOW DATABASES result set from all the databases in the
+ * hashtable. Only backend servers that are up and in a proper state are listed
+ * in it.
+ * @param router Router instance
+ * @param client Router client session
+ * @return True if the sending of the database list was successful, otherwise false
+ */
+bool send_database_list(ROUTER_INSTANCE* router, ROUTER_CLIENT_SES* client)
+{
+    bool rval = false;
+    spinlock_acquire(&client->shardmap->lock);
+    if (client->shardmap->state != SHMAP_UNINIT)
+    {
+        struct string_array strarray;
+        const int size = hashtable_size(client->shardmap->hash);
+        strarray.array = malloc(size * sizeof(char*));
+        strarray.position = 0;
+        HASHITERATOR *iter = hashtable_iterator(client->shardmap->hash);
+        RESULTSET* resultset = resultset_create(result_set_cb, &strarray);
+
+        if (strarray.array && iter && resultset)
+        {
+            char *key;
+            int i = 0;
+            while ((key = hashtable_next(iter)))
+            {
+                char *value = hashtable_fetch(client->shardmap->hash, key);
+                SERVER * server = server_find_by_unique_name(value);
+                if (SERVER_IS_RUNNING(server))
+                {
+                    strarray.array[i++] = key;
+                }
+            }
+            strarray.size = i;
+            qsort(strarray.array, strarray.size, sizeof(char*), cmpfn);
+            if (resultset_add_column(resultset, "Database", MYSQL_DATABASE_MAXLEN,
+                                     COL_TYPE_VARCHAR))
+            {
+                resultset_stream_mysql(resultset, client->rses_client_dcb);
+                rval = true;
+            }
+        }
+        resultset_free(resultset);
+        hashtable_iterator_free(iter);
+        free(strarray.array);
+    }
+    spinlock_release(&client->shardmap->lock);
+    return rval;
+}
+
+/**
+ * Find the backend reference of a server that can be used
+ * @param rses Router client session
+ * @param name Unique name of the server
+ * @return The backend reference or NULL if the server is not in use or not running
+ */
+static backend_ref_t* get_shard_bref(ROUTER_CLIENT_SES* rses, const char* name)
+{
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t* bref = &rses->rses_backend_ref[i];
+
+        if (BREF_IS_IN_USE(bref) &&
+            strcmp(name, bref->bref_backend->backend_server->unique_name) == 0 &&
+            SERVER_IS_RUNNING(bref->bref_backend->backend_server))
+        {
+            return bref;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Send the merged rows to the client and clear the state of a server that
+ * has returned its whole reply. The merge ends when all servers have replied.
+ * The router session must be locked.
+ * @param rses Router client session
+ * @param bref The server that replied
+ * @param out Packets to send to the client or NULL
+ * @param shard_done True if the server has returned its whole reply
+ */
+static void route_scatter_reply(ROUTER_CLIENT_SES* rses, backend_ref_t* bref,
+                                GWBUF* out, bool shard_done)
+{
+    if (out)
+    {
+        SESSION_ROUTE_REPLY(rses->rses_client_dcb->session, out);
+    }
+
+    if (shard_done)
+    {
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+        bref_clear_state(bref, BREF_WAITING_RESULT);
+    }
+
+    if (scatter_is_complete(rses->rses_scatter))
+    {
+        scatter_free(rses->rses_scatter);
+        rses->rses_scatter = NULL;
+    }
+}
+
+/**
+ * End the reply of a server taking part in a merge with an error. The router
+ * session must be locked.
+ * @param rses Router client session
+ * @param bref The failed server
+ */
+static void route_scatter_error(ROUTER_CLIENT_SES* rses, backend_ref_t* bref)
+{
+    GWBUF* err = modutil_create_mysql_err_msg(1, 0, 2013, "HY000",
+                                              "Lost connection to backend server.");
+    route_scatter_reply(rses, bref, scatter_shard_error(rses->rses_scatter, bref, err), true);
+}
+
+/**
+ * Send a SELECT from a table that is split across servers to all of them and
+ * start merging their resultsets. The queries received before the merge is
+ * complete are queued.
+ * @param inst Router instance
+ * @param rses Router client session
+ * @param querybuf The query, not taken over
+ * @param ret The return value of routeQuery is stored here
+ * @return False if the query can't be merged and is routed to one server
+ */
+static bool route_scatter_query(ROUTER_INSTANCE* inst, ROUTER_CLIENT_SES* rses,
+                                GWBUF* querybuf, int* ret)
+{
+    int n_tables = 0;
+    const char* const* tables = qc_get_table_names_view(querybuf, &n_tables, true);
+    char name[MYSQL_DATABASE_MAXLEN * 2 + 2];
+    char* servers = NULL;
+
+    if (n_tables != 1)
+    {
+        return false;
+    }
+
+    if (strchr(tables[0], '.'))
+    {
+        snprintf(name, sizeof(name), "%s", tables[0]);
+    }
+    else if (rses->current_db[0] != '\0')
+    {
+        snprintf(name, sizeof(name), "%s.%s", rses->current_db, tables[0]);
+    }
+    else
+    {
+        return false;
+    }
+
+    spinlock_acquire(&rses->shardmap->lock);
+    if (rses->shardmap->scattered &&
+        (servers = (char*)hashtable_fetch(rses->shardmap->scattered, name)))
+    {
+        servers = strdup(servers);
+    }
+    spinlock_release(&rses->shardmap->lock);
+
+    if (servers == NULL)
+    {
+        return false;
+    }
+
+    GWBUF* shard_query = NULL;
+    SCATTER* sc = scatter_create(querybuf, &shard_query);
+
+    if (sc == NULL)
+    {
+        MXS_INFO("schemarouter: Table '%s' is split across servers '%s' but the "
+                 "query can't be merged, routing it to one server.", name, servers);
+        free(servers);
+        return false;
+    }
+
+    *ret = 1;
+
+    if (!rses_begin_locked_router_action(rses))
+    {
+        scatter_free(sc);
+        gwbuf_free(shard_query);
+        free(servers);
+        *ret = 0;
+        return true;
+    }
+
+    char* saveptr;
+    bool available = true;
+
+    for (char* tok = strtok_r(servers, ",", &saveptr); tok && available;
+         tok = strtok_r(NULL, ",", &saveptr))
+    {
+        backend_ref_t* bref = get_shard_bref(rses, tok);
+        available = bref && scatter_add_shard(sc, bref);
+    }
+
+    if (!available)
+    {
+        char errmsg[MYSQL_DATABASE_MAXLEN * 2 + 128];
+        snprintf(errmsg, sizeof(errmsg), "Table '%s' is split across servers and not "
+                 "all of them are available.", name);
+        write_error_to_client(rses->rses_client_dcb, 1105, "HY000", errmsg);
+        MXS_ERROR("Schemarouter: Table '%s' is split across servers '%s' and not "
+                  "all of them are available.", name, servers);
+        rses_end_locked_router_action(rses);
+        scatter_free(sc);
+        gwbuf_free(shard_query);
+        free(servers);
+        return true;
+    }
+
+    MXS_INFO("schemarouter: Merging the resultsets of table '%s' from servers '%s'",
+             name, servers);
+    free(servers);
+    rses->rses_scatter = sc;
+    atomic_add(&inst->stats.n_queries, 1);
+    atomic_add(&inst->stats.n_scatter, 1);
+
+    for (int i = 0; i < rses->rses_nbackends && rses->rses_scatter; i++)
     {
-        if (resultset_row_set(row, 0, strarray->array[strarray->position++]) == 0)
+        backend_ref_t* bref = &rses->rses_backend_ref[i];
+
+        if (!scatter_is_pending(sc, bref))
         {
-            resultset_free_row(row);
-            row = NULL;
+            continue;
+        }
+
+        /** Sent once the session command being executed has completed */
+        if (sescmd_cursor_is_active(&bref->bref_sescmd_cur))
+        {
+            ss_dassert(bref->bref_pending_cmd == NULL);
+            bref->bref_pending_cmd = gwbuf_clone(shard_query);
+        }
+        else if (bref->bref_dcb->func.write(bref->bref_dcb, gwbuf_clone(shard_query)) == 1)
+        {
+            bref_set_state(bref, BREF_QUERY_ACTIVE);
+            bref_set_state(bref, BREF_WAITING_RESULT);
+            atomic_add(&bref->bref_backend->stats.queries, 1);
+            bref_record_query(bref, gwbuf_length(shard_query));
+        }
+        else
+        {
+            MXS_ERROR("Routing query to '%s' failed.",
+                      bref->bref_backend->backend_server->unique_name);
+            route_scatter_error(rses, bref);
         }
     }
 
-    return row;
+    rses_end_locked_router_action(rses);
+    gwbuf_free(shard_query);
+    return true;
 }
 
 /**
- * Generates a custom SHOW DATABASES result set from all the databases in the
- * hashtable. Only backend servers that are up and in a proper state are listed
- * in it.
- * @param router Router instance
- * @param client Router client session
- * @return True if the sending of the database list was successful, otherwise false
+ * Route the queries that were queued while a SELECT was being merged. A
+ * queued query can start a new merge, the rest of the queries are then
+ * queued again.
+ * @param instance Router instance
+ * @param rses Router client session
  */
-bool send_database_list(ROUTER_INSTANCE* router, ROUTER_CLIENT_SES* client)
+static void route_scatter_queue(ROUTER* instance, ROUTER_CLIENT_SES* rses)
 {
-    bool rval = false;
-    spinlock_acquire(&client->shardmap->lock);
-    if (client->shardmap->state != SHMAP_UNINIT)
+    GWBUF* queue = NULL;
+
+    if (rses_begin_locked_router_action(rses))
     {
-        struct string_array strarray;
-        const int size = hashtable_size(client->shardmap->hash);
-        strarray.array = malloc(size * sizeof(char*));
-        strarray.position = 0;
-        HASHITERATOR *iter = hashtable_iterator(client->shardmap->hash);
-        RESULTSET* resultset = resultset_create(result_set_cb, &strarray);
+        if (rses->rses_scatter == NULL)
+        {
+            queue = rses->rses_scatter_queue;
+            rses->rses_scatter_queue = NULL;
+        }
+        rses_end_locked_router_action(rses);
+    }
 
-        if (strarray.array && iter && resultset)
+    while (queue)
+    {
+        GWBUF* next = queue->next;
+        queue->next = NULL;
+        routeQuery(instance, rses, queue);
+
+        if (next)
         {
-            char *key;
-            int i = 0;
-            while ((key = hashtable_next(iter)))
+            if (!rses_begin_locked_router_action(rses))
             {
-                char *value = hashtable_fetch(client->shardmap->hash, key);
-                SERVER * server = server_find_by_unique_name(value);
-                if (SERVER_IS_RUNNING(server))
-                {
-                    strarray.array[i++] = key;
-                }
+                gwbuf_free(next);
+                break;
             }
-            strarray.size = i;
-            qsort(strarray.array, strarray.size, sizeof(char*), cmpfn);
-            if (resultset_add_column(resultset, "Database", MYSQL_DATABASE_MAXLEN,
-                                     COL_TYPE_VARCHAR))
+
+            if (rses->rses_scatter)
             {
-                resultset_stream_mysql(resultset, client->rses_client_dcb);
-                rval = true;
+                GWBUF* tail = next;
+
+                while (tail->next)
+                {
+                    tail = tail->next;
+                }
+
+                tail->next = rses->rses_scatter_queue;
+                rses->rses_scatter_queue = next;
+                next = NULL;
             }
+            rses_end_locked_router_action(rses);
         }
-        resultset_free(resultset);
-        hashtable_iterator_free(iter);
-        free(strarray.array);
+
+        queue = next;
     }
-    spinlock_release(&client->shardmap->lock);
-    return rval;
 }
 
 /**
@@ -1912,6 +2616,32 @@ static int routeQuery(ROUTER* instance,
             return init_rval;
         }
 
+        /**
+         * The replies can't be sent to the client in the middle of the merged
+         * resultset of a SELECT. The queries are routed once it is complete.
+         */
+        if (router_cli_ses->rses_scatter)
+        {
+            querybuf = gwbuf_make_contiguous(querybuf);
+            GWBUF* ptr = router_cli_ses->rses_scatter_queue;
+
+            while (ptr && ptr->next)
+            {
+                ptr = ptr->next;
+            }
+
+            if (ptr == NULL)
+            {
+                router_cli_ses->rses_scatter_queue = querybuf;
+            }
+            else
+            {
+                ptr->next = querybuf;
+            }
+
+            rses_end_locked_router_action(router_cli_ses);
+            return 1;
+        }
     }
 
     rses_end_locked_router_action(router_cli_ses);
@@ -2042,9 +2772,18 @@ static int routeQuery(ROUTER* instance,
                 difftime(now, router_cli_ses->rses_config.last_refresh) >
                 router_cli_ses->rses_config.refresh_min_interval)
             {
-                spinlock_acquire(&router_cli_ses->shardmap->lock);
-                router_cli_ses->shardmap->state = SHMAP_STALE;
-                spinlock_release(&router_cli_ses->shardmap->lock);
+                if (router_cli_ses->rses_config.shared_shard_map)
+                {
+                    /** A shared shard map is never modified, map the
+                     * databases for this session only */
+                    shard_map_release(router_cli_ses->shardmap);
+                }
+                else
+                {
+                    spinlock_acquire(&router_cli_ses->shardmap->lock);
+                    router_cli_ses->shardmap->state = SHMAP_STALE;
+                    spinlock_release(&router_cli_ses->shardmap->lock);
+                }
 
                 rses_begin_locked_router_action(router_cli_ses);
 
@@ -2093,6 +2832,17 @@ static int routeQuery(ROUTER* instance,
         goto retblock;
     }
 
+    /** A SELECT from a table that is split across servers is merged from all of them */
+    if (router_cli_ses->rses_config.scatter_gather &&
+        packet_type == MYSQL_COM_QUERY &&
+        querybuf->hint == NULL &&
+        QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) &&
+        !QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE) &&
+        route_scatter_query(inst, router_cli_ses, querybuf, &ret))
+    {
+        goto retblock;
+    }
+
     route_target = get_shard_route_target(qtype,
                                           router_cli_ses->rses_transaction_active,
                                           querybuf->hint);
@@ -2314,6 +3064,7 @@ static int routeQuery(ROUTER* instance,
             bref_set_state(bref, BREF_QUERY_ACTIVE);
             bref_set_state(bref, BREF_WAITING_RESULT);
             atomic_add(&bref->bref_backend->stats.queries, 1);
+            bref_record_query(bref, gwbuf_length(querybuf));
         }
         else
         {
@@ -2413,6 +3164,14 @@ static void diagnostic(ROUTER *instance, DCB *dcb)
                    "\33[30;41mDOWN\33[0m");
     }
 
+    dcb_printf(dcb, "\n\33[1;4mTraffic Routed to the Servers\33[0m\n");
+    dcb_printf(dcb, BACKEND_STATS_HEADER);
+    for (i = 0; router->servers[i]; i++)
+    {
+        dprintBackendStats(dcb, router->servers[i]->backend_server,
+                           router->servers[i]->backend_stats);
+    }
+
     /** Session command statistics */
     dcb_printf(dcb, "\n\33[1;4mSession Commands\33[0m\n");
     dcb_printf(dcb, "Total number of queries: %d\n",
@@ -2452,6 +3211,14 @@ static void diagnostic(ROUTER *instance, DCB *dcb)
     }
     dcb_printf(dcb, "Shard map cache hits: %d\n", router->stats.shmap_cache_hit);
     dcb_printf(dcb, "Shard map cache misses: %d\n", router->stats.shmap_cache_miss);
+    if (router->schemarouter_config.mapping_timeout > 0)
+    {
+        dcb_printf(dcb, "SHOW DATABASES timeouts: %d\n", router->stats.n_mapping_timeouts);
+    }
+    if (router->schemarouter_config.scatter_gather)
+    {
+        dcb_printf(dcb, "Queries merged from several servers: %d\n", router->stats.n_scatter);
+    }
     dcb_printf(dcb, "\n");
 }
 
@@ -2514,6 +3281,16 @@ static void clientReply(ROUTER* instance,
         return;
     }
 
+    ts_stats_add(bref->bref_backend->backend_stats->bytes_in, gwbuf_length(writebuf));
+
+    /** The response time is the time to the first packet of the reply */
+    if (bref->bref_query_start)
+    {
+        ts_histogram_add(bref->bref_backend->backend_stats->latency,
+                         latency_now() - bref->bref_query_start);
+        bref->bref_query_start = 0;
+    }
+
     MXS_DEBUG("schemarouter: Reply from [%s] session [%p]"
               " mapping [%s] queries queued [%s]",
               bref->bref_backend->backend_server->unique_name,
@@ -2524,6 +3301,18 @@ static void clientReply(ROUTER* instance,
 
 
 
+    /** The reply to SHOW DATABASES of a server that did not reply in time */
+    if (bref->bref_map_late)
+    {
+        discard_late_mapping_reply(bref, &writebuf);
+
+        if (writebuf == NULL)
+        {
+            rses_end_locked_router_action(router_cli_ses);
+            return;
+        }
+    }
+
     if (router_cli_ses->init & INIT_MAPPING)
     {
         int rc = inspect_backend_mapping_states(router_cli_ses, bref, &writebuf);
@@ -2535,46 +3324,8 @@ static void clientReply(ROUTER* instance,
 
         if (rc == 1)
         {
-            spinlock_acquire(&router_cli_ses->shardmap->lock);
-
-            router_cli_ses->shardmap->state = SHMAP_READY;
-            router_cli_ses->shardmap->last_updated = time(NULL);
-            spinlock_release(&router_cli_ses->shardmap->lock);
-
-            rses_end_locked_router_action(router_cli_ses);
-
-            synchronize_shard_map(router_cli_ses);
-
-            if (!rses_begin_locked_router_action(router_cli_ses))
-            {
-                return;
-            }
-
-            /*
-             * Check if the session is reconnecting with a database name
-             * that is not in the hashtable. If the database is not found
-             * then close the session.
-             */
-            router_cli_ses->init &= ~INIT_MAPPING;
-
-            if (router_cli_ses->init & INIT_USE_DB)
-            {
-                bool success = handle_default_db(router_cli_ses);
-                rses_end_locked_router_action(router_cli_ses);
-                if (!success)
-                {
-                    dcb_close(router_cli_ses->rses_client_dcb);
-                }
-                return;
-            }
-
-            if (router_cli_ses->queue)
-            {
-                ss_dassert(router_cli_ses->init == INIT_READY);
-                route_queued_query(router_cli_ses);
-            }
-            MXS_DEBUG("session [%p] database map finished.",
-                      router_cli_ses);
+            finish_database_mapping(router_cli_ses);
+            return;
         }
 
         rses_end_locked_router_action(router_cli_ses);
@@ -2673,6 +3424,16 @@ static void clientReply(ROUTER* instance,
             bref_clear_state(bref, BREF_WAITING_RESULT);
         }
     }
+    /** Part of the reply to a SELECT that is merged from several servers */
+    else if (router_cli_ses->rses_scatter &&
+             scatter_is_pending(router_cli_ses->rses_scatter, bref))
+    {
+        bool shard_done = false;
+        GWBUF* out = scatter_process_reply(router_cli_ses->rses_scatter, bref,
+                                           writebuf, &shard_done);
+        route_scatter_reply(router_cli_ses, bref, out, shard_done);
+        writebuf = NULL;
+    }
     /**
      * Clear BREF_QUERY_ACTIVE flag and decrease waiter counter.
      * This applies for queries  other than session commands.
@@ -2727,6 +3488,7 @@ static void clientReply(ROUTER* instance,
         {
             ROUTER_INSTANCE* inst = (ROUTER_INSTANCE *) instance;
             atomic_add(&inst->stats.n_queries, 1);
+            bref_record_query(bref, gwbuf_length(bref->bref_pending_cmd));
             /**
              * Add one query response waiter to backend reference
              */
@@ -2746,6 +3508,12 @@ static void clientReply(ROUTER* instance,
             {
                 MXS_ERROR("Routing query failed.");
             }
+
+            if (router_cli_ses->rses_scatter &&
+                scatter_is_pending(router_cli_ses->rses_scatter, bref))
+            {
+                route_scatter_error(router_cli_ses, bref);
+            }
         }
         gwbuf_free(bref->bref_pending_cmd);
         bref->bref_pending_cmd = NULL;
@@ -2753,6 +3521,7 @@ static void clientReply(ROUTER* instance,
     /** Unlock router session */
     rses_end_locked_router_action(router_cli_ses);
 
+    route_scatter_queue(instance, router_cli_ses);
     return;
 }
 
@@ -2783,8 +3552,8 @@ int bref_cmp_behind_master(const void* bref1, const void* bref2)
     BACKEND* b1 = ((backend_ref_t *)bref1)->bref_backend;
     BACKEND* b2 = ((backend_ref_t *)bref2)->bref_backend;
 
-    return ((b1->backend_server->rlag < b2->backend_server->rlag) ? -1 :
-            ((b1->backend_server->rlag > b2->backend_server->rlag) ? 1 : 0));
+    return ((b1->backend_server->rlag_us < b2->backend_server->rlag_us) ? -1 :
+            ((b1->backend_server->rlag_us > b2->backend_server->rlag_us) ? 1 : 0));
 }
 
 /** Compare number of current operations in backend servers */
@@ -2799,6 +3568,21 @@ int bref_cmp_current_load(const void* bref1, const void* bref2)
         - ((1000 * s2->stats.n_current_ops) - b2->weight);
 }
 
+/**
+ * Record a query sent to a server in the statistics of the server
+ *
+ * @param bref Backend reference the query was sent to
+ * @param len  Length of the query in bytes
+ */
+static void bref_record_query(backend_ref_t* bref, int len)
+{
+    BACKEND_STATS* stats = bref->bref_backend->backend_stats;
+
+    ts_stats_add(stats->queries, 1);
+    ts_stats_add(stats->bytes_out, len);
+    bref->bref_query_start = latency_now();
+}
+
 static void bref_clear_state(backend_ref_t* bref, bref_state_t state)
 {
     if (bref == NULL)
@@ -2973,6 +3757,9 @@ static bool connect_backend_servers(backend_ref_t*   backend_ref,
             /** New server connection */
             else
             {
+                /** A closed reference had a connection that failed or was closed */
+                bool reconnect = BREF_IS_CLOSED(&backend_ref[i]);
+
                 backend_ref[i].bref_dcb = dcb_connect(b->backend_server,
                                                       session,
                                                       b->backend_server->protocol);
@@ -2980,6 +3767,11 @@ static bool connect_backend_servers(backend_ref_t*   backend_ref,
                 if (backend_ref[i].bref_dcb != NULL)
                 {
                     servers_connected += 1;
+
+                    if (reconnect)
+                    {
+                        ts_stats_add(b->backend_stats->reconnects, 1);
+                    }
                     /**
                      * Start executing session command
                      * history.
@@ -3066,18 +3858,22 @@ static bool connect_backend_servers(backend_ref_t*   backend_ref,
 }
 
 /**
- * Create a generic router session property strcture.
+ * Create a generic router session property strcture. The property is allocated
+ * from the pool of the router session.
+ *
+ * Router client session must be locked.
  */
-static rses_property_t* rses_property_init(rses_property_type_t prop_type)
+static rses_property_t* rses_property_init(ROUTER_CLIENT_SES* rses, rses_property_type_t prop_type)
 {
     rses_property_t* prop;
 
-    prop = (rses_property_t*)calloc(1, sizeof(rses_property_t));
+    prop = (rses_property_t*)slab_alloc(&rses->rses_prop_pool);
     if (prop == NULL)
     {
         goto return_prop;
     }
     prop->rses_prop_type = prop_type;
+    prop->rses_prop_rsession = rses;
 #if defined(SS_DEBUG)
     prop->rses_prop_chk_top = CHK_NUM_ROUTER_PROPERTY;
     prop->rses_prop_chk_tail = CHK_NUM_ROUTER_PROPERTY;
@@ -3114,7 +3910,7 @@ static void rses_property_done(rses_property_t* prop)
         ss_dassert(false);
         break;
     }
-    free(prop);
+    slab_free(&prop->rses_prop_rsession->rses_prop_pool, prop);
 }
 
 /**
@@ -3384,6 +4180,7 @@ static bool execute_sescmd_history(backend_ref_t* bref)
     {
         sescmd_cursor_reset(scur);
         succp = execute_sescmd_in_backend(bref);
+        ts_stats_add(bref->bref_backend->backend_stats->sescmd_replays, 1);
     }
     else
     {
@@ -3485,6 +4282,7 @@ static bool execute_sescmd_in_backend(backend_ref_t* backend_ref)
 
     if (rc == 1)
     {
+        bref_record_query(backend_ref, gwbuf_length(scur->scmd_cur_cmd->my_sescmd_buf));
         succp = true;
     }
     else
@@ -3713,6 +4511,11 @@ static bool route_session_write(ROUTER_CLIENT_SES* router_cli_ses,
             {
                 rc = dcb->func.write(dcb, gwbuf_clone(querybuf));
                 atomic_add(&backend_ref[i].bref_backend->stats.queries, 1);
+
+                if (rc == 1)
+                {
+                    bref_record_query(&backend_ref[i], gwbuf_length(querybuf));
+                }
                 if (rc != 1)
                 {
                     succp = false;
@@ -3793,7 +4596,7 @@ static bool route_session_write(ROUTER_CLIENT_SES* router_cli_ses,
      * prevent it from being released before properties
      * are cleaned up as a part of router session clean-up.
      */
-    prop = rses_property_init(RSES_PROP_TYPE_SESCMD);
+    prop = rses_property_init(router_cli_ses, RSES_PROP_TYPE_SESCMD);
     mysql_sescmd_init(prop, querybuf, packet_type, router_cli_ses);
 
     /** Add sescmd property to router client session */
@@ -3939,6 +4742,7 @@ static void handleError(ROUTER*        instance,
                                                  problem_dcb,
                                                  errmsgbuf);
             rses_end_locked_router_action(rses);
+            route_scatter_queue(instance, rses);
             break;
         }
 
@@ -4054,13 +4858,19 @@ static bool handle_error_new_connection(ROUTER_INSTANCE*   inst,
     }
 
     CHK_BACKEND_REF(bref);
+    ts_stats_add(bref->bref_backend->backend_stats->errors, 1);
 
     /**
      * If query was sent through the bref and it is waiting for reply from
      * the backend server it is necessary to send an error to the client
      * because it is waiting for reply.
      */
-    if (BREF_IS_WAITING_RESULT(bref))
+    if (rses->rses_scatter && scatter_is_pending(rses->rses_scatter, bref))
+    {
+        /** The other servers of a merged SELECT are still replying */
+        route_scatter_error(rses, bref);
+    }
+    else if (BREF_IS_WAITING_RESULT(bref))
     {
         DCB* client_dcb;
         client_dcb = ses->client_dcb;
@@ -4069,6 +4879,8 @@ static bool handle_error_new_connection(ROUTER_INSTANCE*   inst,
     }
     bref_clear_state(bref, BREF_IN_USE);
     bref_set_state(bref, BREF_CLOSED);
+    /** The rest of a late reply to SHOW DATABASES will not arrive */
+    bref->bref_map_late = false;
 
     /**
      * Error handler is already called for this DCB because
@@ -4568,6 +5380,181 @@ void replace_shard_map(shard_map_t **target, shard_map_t **source)
     *source = NULL;
 }
 
+/**
+ * Complete the mapping of the databases of a session and route the first
+ * query that was queued during it. If a server did not reply in time, the
+ * shard map is marked stale so that the next session maps the databases
+ * again. The router session must be locked and it is unlocked by this
+ * function.
+ * @param rses Router client session
+ */
+static void finish_database_mapping(ROUTER_CLIENT_SES* rses)
+{
+    bool complete = true;
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        if (BREF_IS_IN_USE(&rses->rses_backend_ref[i]) &&
+            rses->rses_backend_ref[i].bref_map_late)
+        {
+            complete = false;
+        }
+    }
+
+    spinlock_acquire(&rses->shardmap->lock);
+    rses->shardmap->state = complete ? SHMAP_READY : SHMAP_STALE;
+    rses->shardmap->last_updated = time(NULL);
+    spinlock_release(&rses->shardmap->lock);
+
+    rses_end_locked_router_action(rses);
+
+    synchronize_shard_map(rses);
+
+    if (!rses_begin_locked_router_action(rses))
+    {
+        return;
+    }
+
+    /*
+     * Check if the session is reconnecting with a database name
+     * that is not in the hashtable. If the database is not found
+     * then close the session.
+     */
+    rses->init &= ~INIT_MAPPING;
+
+    if (rses->init & INIT_USE_DB)
+    {
+        bool success = handle_default_db(rses);
+        rses_end_locked_router_action(rses);
+        if (!success)
+        {
+            dcb_close(rses->rses_client_dcb);
+        }
+        return;
+    }
+
+    if (rses->queue)
+    {
+        ss_dassert(rses->init == INIT_READY);
+        route_queued_query(rses);
+    }
+    MXS_DEBUG("session [%p] database map finished.", rses);
+
+    rses_end_locked_router_action(rses);
+}
+
+/**
+ * Stop waiting for the servers that have not replied to SHOW DATABASES in
+ * mapping_timeout seconds. Their databases are left out of the shard map of
+ * the session and their replies are discarded when they arrive.
+ * @param rses Router client session
+ */
+static void handle_mapping_timeout(ROUTER_CLIENT_SES* rses)
+{
+    if (!rses_begin_locked_router_action(rses))
+    {
+        return;
+    }
+
+    if (!rses->rses_mapping_expired || (rses->init & INIT_MAPPING) == 0 ||
+        (rses->init & INIT_FAILED))
+    {
+        rses_end_locked_router_action(rses);
+        return;
+    }
+
+    rses->rses_mapping_expired = false;
+
+    for (int i = 0; i < rses->rses_nbackends; i++)
+    {
+        backend_ref_t* bref = &rses->rses_backend_ref[i];
+
+        if (BREF_IS_IN_USE(bref) && !BREF_IS_MAPPED(bref))
+        {
+            MXS_WARNING("Server '%s' did not reply to SHOW DATABASES in %d seconds, "
+                        "its databases are not mapped for user %s@%s.",
+                        bref->bref_backend->backend_server->unique_name,
+                        rses->rses_config.mapping_timeout,
+                        rses->rses_client_dcb->user,
+                        rses->rses_client_dcb->remote);
+            bref->bref_mapped = true;
+            bref->bref_map_late = true;
+            atomic_add(&rses->router->stats.n_mapping_timeouts, 1);
+        }
+    }
+
+    finish_database_mapping(rses);
+}
+
+/**
+ * Discard the reply to SHOW DATABASES from a server that did not reply in time.
+ * @param bref The server
+ * @param buffer The data received from the server, replaced with what follows
+ * the reply or NULL
+ */
+static void discard_late_mapping_reply(backend_ref_t* bref, GWBUF** buffer)
+{
+    GWBUF* packet;
+
+    bref->map_queue = gwbuf_append(bref->map_queue, *buffer);
+    *buffer = NULL;
+
+    while (bref->n_mapping_eof < 2 &&
+           (packet = modutil_get_next_MySQL_packet(&bref->map_queue)))
+    {
+        uint8_t* data = GWBUF_DATA(packet);
+
+        if (PTR_IS_ERR(data))
+        {
+            bref->n_mapping_eof = 2;
+        }
+        else if (PTR_IS_EOF(data))
+        {
+            bref->n_mapping_eof++;
+        }
+        gwbuf_free(packet);
+    }
+
+    if (bref->n_mapping_eof == 2)
+    {
+        MXS_INFO("schemarouter: Discarded the late SHOW DATABASES reply from %s.",
+                 bref->bref_backend->backend_server->unique_name);
+        bref->bref_map_late = false;
+        *buffer = bref->map_queue;
+        bref->map_queue = NULL;
+    }
+}
+
+/**
+ * Housekeeper task that finds the sessions of a router instance that have
+ * waited for the replies to SHOW DATABASES for longer than mapping_timeout.
+ * The timeout is handled by the session in a worker thread.
+ * @param data Router instance
+ */
+static void check_mapping_timeouts(void *data)
+{
+    ROUTER_INSTANCE *router = (ROUTER_INSTANCE*)data;
+    time_t now = time(NULL);
+
+    spinlock_acquire(&router->lock);
+
+    for (ROUTER_CLIENT_SES *rses = router->connections; rses; rses = rses->next)
+    {
+        if (rses_begin_locked_router_action(rses))
+        {
+            if ((rses->init & INIT_MAPPING) && !rses->rses_mapping_expired &&
+                difftime(now, rses->rses_mapping_start) >= rses->rses_config.mapping_timeout)
+            {
+                rses->rses_mapping_expired = true;
+                poll_add_epollin_event_to_dcb(rses->dcb_route, NULL);
+            }
+            rses_end_locked_router_action(rses);
+        }
+    }
+
+    spinlock_release(&router->lock);
+}
+
 /**
  * Synchronize the router client session shard map with the global shard map for
  * this user.
@@ -4577,6 +5564,9 @@ void replace_shard_map(shard_map_t **target, shard_map_t **source)
  * out of date, its contents are replaced with the contents of the current client
  * session. If the router has a usable shard map, the current shard map of the client
  * is discarded and the router's shard map is used.
+ *
+ * With the shared_shard_map option the session keeps its own shard map, the
+ * shard map of the router is only replaced by the housekeeper task.
  * @param client Router session
  */
 void synchronize_shard_map(ROUTER_CLIENT_SES *client)
@@ -4585,6 +5575,12 @@ void synchronize_shard_map(ROUTER_CLIENT_SES *client)
 
     client->router->stats.shmap_cache_miss++;
 
+    if (client->rses_config.shared_shard_map)
+    {
+        spinlock_release(&client->router->lock);
+        return;
+    }
+
     shard_map_t *map = hashtable_fetch(client->router->shard_maps,
                                        client->rses_client_dcb->user);
     if (map)
@@ -31,6 +31,8 @@
 #include <modinfo.h>
 #include <modutil.h>
 #include <mysql_client_server_protocol.h>
+#include <maxscale/poll.h>
+#include <hash.h>
 
 
 MODULE_INFO info = {
@@ -187,6 +189,10 @@ static GWBUF* sescmd_cursor_process_replies(GWBUF* replybuf, SUBSERVICE* bref);
 
 static bool execute_sescmd_in_backend(SUBSERVICE* subsvc);
 
+static void route_subsvc_queue(ROUTER_CLIENT_SES* rses, SUBSERVICE* subsvc);
+
+static void free_router_session(ROUTER_CLIENT_SES* rses);
+
 static bool route_session_write(
                                 ROUTER_CLIENT_SES* router_client_ses,
                                 GWBUF* querybuf,
@@ -209,17 +215,11 @@ static int hashcmpfun(void *, void *);
 static int
 hashkeyfun(void* key)
 {
-    if(key == NULL)
+    if (key == NULL)
     {
         return 0;
     }
-    int hash = 0, c = 0;
-    char* ptr = (char*) key;
-    while((c = *ptr++))
-    {
-        hash = c + (hash << 6) + (hash << 16) - hash;
-    }
-    return hash;
+    return (int)hash_str((char *)key, hash_seed());
 }
 
 static int
@@ -705,13 +705,32 @@ filterReply(FILTER* instance, void *session, GWBUF *reply)
 
     if(sescmd_cursor_is_active(scur))
     {
+        mysql_sescmd_t* scmd = sescmd_cursor_get_command(scur);
+        /**
+         * A command that another subservice has already replied to, for
+         * example one in the history executed in a newly opened session,
+         * is not replied to again.
+         */
+        bool replied = scmd && scmd->my_sescmd_is_replied;
+
+        if(scmd)
+        {
+            scmd->my_sescmd_is_replied = true;
+        }
+
         if(!sescmd_cursor_next(scur))
         {
             sescmd_cursor_set_active(scur, false);
+            route_subsvc_queue(rses, subsvc);
         }
         else
         {
             execute_sescmd_in_backend(subsvc);
+        }
+
+        if(replied)
+        {
+            gwbuf_free(reply);
             goto retblock;
         }
     }
@@ -762,6 +781,185 @@ int fakeQuery(DCB* dcb)
     return 1;
 }
 
+/**
+ * Open the session of a subservice. The router session is not locked as
+ * this is done concurrently for all the subservices of a session.
+ * @param rses Router client session
+ * @param subsvc The subservice
+ * @return The new session or NULL on error
+ */
+static SESSION*
+open_subsvc_session(ROUTER_CLIENT_SES* rses, SUBSERVICE* subsvc)
+{
+    FILTER_DEF* dummy_filterdef;
+    UPSTREAM* dummy_upstream;
+    SESSION* session = session_alloc(subsvc->service,subsvc->dcb);
+
+    if(session == NULL)
+    {
+        MXS_ERROR("Failed to create subsession for service %s in shardrouter.",subsvc->service->name);
+        return NULL;
+    }
+
+    dummy_filterdef = filter_alloc("tee_dummy","tee_dummy");
+
+    if(dummy_filterdef == NULL)
+    {
+        MXS_ERROR("Failed to allocate filter definition in shardrouter.");
+        return NULL;
+    }
+    dummy_filterdef->obj = &dummyObject;
+    dummy_filterdef->filter = (FILTER*)rses;
+    dummy_upstream = filterUpstream(dummy_filterdef,session,&session->tail);
+
+    if(dummy_upstream == NULL)
+    {
+        MXS_ERROR("Failed to set filterUpstream in shardrouter.");
+        return NULL;
+    }
+
+    session->tail = *dummy_upstream;
+    free(dummy_upstream);
+
+    return session;
+}
+
+/**
+ * Close the session of a subservice. Router session must be locked.
+ * @param subsvc The subservice
+ */
+static void
+close_subsvc_session(SUBSERVICE* subsvc)
+{
+    SESSION* one_session = subsvc->session;
+
+    if(one_session != NULL)
+    {
+        ROUTER_OBJECT* rtr = subsvc->service->router;
+        ROUTER* rinst = subsvc->service->router_instance;
+        void* rses = one_session->router_session;
+
+        one_session->state = SESSION_STATE_STOPPING;
+        rtr->closeSession(rinst,rses);
+    }
+}
+
+/**
+ * Finish opening the session of a subservice. The session command history
+ * is executed in it and the queries that were routed to it are sent once
+ * the history has been replied to.
+ * @param subsvc The subservice
+ * @param session The new session or NULL if it could not be opened
+ */
+static void
+subsvc_connected(SUBSERVICE* subsvc, SESSION* session)
+{
+    ROUTER_CLIENT_SES* rses = subsvc->rses;
+    bool free_rses;
+
+    spinlock_acquire(&rses->rses_lock);
+    subsvc_clear_state(subsvc,SUBSVC_CONNECTING);
+    subsvc->session = session;
+
+    if(rses->rses_closed)
+    {
+        close_subsvc_session(subsvc);
+        subsvc->state = SUBSVC_CLOSED;
+    }
+    else if(session)
+    {
+        subsvc_set_state(subsvc,SUBSVC_OK);
+        execute_sescmd_history(subsvc);
+        route_subsvc_queue(rses, subsvc);
+    }
+    else
+    {
+        subsvc_set_state(subsvc,SUBSVC_FAILED);
+
+        if(subsvc->queue)
+        {
+            char errmsg[512];
+            GWBUF* err;
+
+            gwbuf_free(subsvc->queue);
+            subsvc->queue = NULL;
+            snprintf(errmsg,sizeof(errmsg),"Failed to open a session to service %s",
+                     subsvc->service->name);
+
+            if((err = modutil_create_mysql_err_msg(1, 0, 2003, "HY000", errmsg)))
+            {
+                poll_add_epollin_event_to_dcb(rses->replydcb,err);
+            }
+        }
+    }
+
+    free_rses = --rses->n_connecting == 0 && rses->rses_freed;
+    spinlock_release(&rses->rses_lock);
+
+    if(free_rses)
+    {
+        free_router_session(rses);
+    }
+}
+
+/**
+ * Open the session of a subservice in the calling thread
+ * @param subsvc The subservice
+ */
+static void
+connect_subsvc_now(SUBSERVICE* subsvc)
+{
+    subsvc_connected(subsvc, open_subsvc_session(subsvc->rses, subsvc));
+}
+
+/**
+ * Open the session of a subservice. This is the read function of the
+ * internal DCB that newSession creates for each subservice and it is
+ * called by one of the worker threads.
+ * @param dcb The internal DCB, closed by this function
+ * @return Always 1
+ */
+static int
+connect_subsvc(DCB* dcb)
+{
+    SUBSERVICE* subsvc = (SUBSERVICE*) dcb->data;
+
+    dcb->data = NULL;
+    dcb_close(dcb);
+    connect_subsvc_now(subsvc);
+
+    return 1;
+}
+
+/**
+ * Send the queries that were routed to a subservice before its session was
+ * opened or while the session command history was executed in it. Router
+ * session must be locked.
+ * @param rses Router client session
+ * @param subsvc The subservice
+ */
+static void
+route_subsvc_queue(ROUTER_CLIENT_SES* rses, SUBSERVICE* subsvc)
+{
+    while(subsvc->queue && !sescmd_cursor_is_active(subsvc->scur))
+    {
+        GWBUF* querybuf = subsvc->queue;
+        subsvc->queue = querybuf->next;
+        querybuf->next = NULL;
+
+        if(SESSION_ROUTE_QUERY(subsvc->session,querybuf) == 1)
+        {
+            atomic_add(&rses->router->stats.n_queries, 1);
+            subsvc_set_state(subsvc,SUBSVC_QUERY_ACTIVE|SUBSVC_WAITING_RESULT);
+        }
+        else
+        {
+            MXS_ERROR("Routing queued query to service %s failed.",
+                      subsvc->service->name);
+        }
+    }
+}
+
 /**
  * Implementation of the mandatory version entry point
  *
@@ -995,8 +1193,6 @@ newSession(
     SUBSERVICE* subsvc;
     ROUTER_CLIENT_SES* client_rses = NULL;
     ROUTER_INSTANCE* router = (ROUTER_INSTANCE *) router_inst;
-    FILTER_DEF* dummy_filterdef;
-    UPSTREAM* dummy_upstream;
 
     int i, j;
     client_rses = (ROUTER_CLIENT_SES *) calloc(1, sizeof(ROUTER_CLIENT_SES));
@@ -1068,41 +1264,9 @@ newSession(
             continue;
         }
 
-        subsvc->session = session_alloc(subsvc->service,subsvc->dcb);
-
-        if(subsvc->session == NULL){
-            dcb_close(subsvc->dcb);
-            subsvc->dcb = NULL;
-            subsvc_set_state(subsvc,SUBSVC_FAILED);
-            MXS_ERROR("Failed to create subsession for service %s in shardrouter.",subsvc->service->name);
-            continue;
-        }
-
-        dummy_filterdef = filter_alloc("tee_dummy","tee_dummy");
-
-        if(dummy_filterdef == NULL)
-        {
-            subsvc_set_state(subsvc,SUBSVC_FAILED);
-            MXS_ERROR("Failed to allocate filter definition in shardrouter.");
-            continue;
-        }
-        dummy_filterdef->obj = &dummyObject;
-        dummy_filterdef->filter = (FILTER*)client_rses;
-        dummy_upstream = filterUpstream(dummy_filterdef,subsvc->session,&subsvc->session->tail);
-
-        if(dummy_upstream == NULL)
-        {
-           subsvc_set_state(subsvc,SUBSVC_FAILED);
-           MXS_ERROR("Failed to set filterUpstream in shardrouter.");
-            continue;
-        }
-
-        subsvc->session->tail = *dummy_upstream;
-
-
-        subsvc_set_state(subsvc,SUBSVC_OK);
-
-        free(dummy_upstream);
+        subsvc->rses = client_rses;
+        subsvc_set_state(subsvc,SUBSVC_CONNECTING);
+        client_rses->n_connecting++;
     }
 
     router->stats.n_sessions += 1;
@@ -1126,6 +1290,33 @@ newSession(
     client_rses->next = router->connections;
     router->connections = client_rses;
     spinlock_release(&router->lock);
+
+    /**
+     * The subservice sessions are opened concurrently by the worker threads
+     * so that the backend connections are made in parallel. Queries to a
+     * subservice are queued until its session is open.
+     */
+    for(i = 0; i < client_rses->n_subservice; i++)
+    {
+        subsvc = client_rses->subservice[i];
+
+        if(SUBSVC_IS_CONNECTING(subsvc))
+        {
+            DCB* dcb = dcb_alloc(DCB_ROLE_INTERNAL, NULL);
+
+            if(dcb)
+            {
+                dcb->func.read = connect_subsvc;
+                dcb->state = DCB_STATE_POLLING;
+                dcb->data = subsvc;
+                poll_add_epollin_event_to_dcb(dcb, NULL);
+            }
+            else
+            {
+                connect_subsvc_now(subsvc);
+            }
+        }
+    }
     goto retblock;
 return_rses:
 #if defined(SS_DEBUG)
@@ -1183,23 +1374,14 @@ closeSession(
     if(!router_cli_ses->rses_closed &&
        rses_begin_locked_router_action(router_cli_ses))
     {
-        ROUTER_OBJECT* rtr;
-        ROUTER* rinst;
-        void *rses;
-        SESSION *one_session;
-
         for(i = 0;i<router_cli_ses->n_subservice;i++)
         {
-            rtr = router_cli_ses->subservice[i]->service->router;
-            rinst = router_cli_ses->subservice[i]->service->router_instance;
-            one_session = router_cli_ses->subservice[i]->session;
-            if(one_session != NULL)
+            /** Sessions that are still being opened are closed once they are open */
+            if(!SUBSVC_IS_CONNECTING(router_cli_ses->subservice[i]))
             {
-                rses = one_session->router_session;
-                one_session->state = SESSION_STATE_STOPPING;
-                rtr->closeSession(rinst,rses);
+                close_subsvc_session(router_cli_ses->subservice[i]);
+                router_cli_ses->subservice[i]->state = SUBSVC_CLOSED;
             }
-            router_cli_ses->subservice[i]->state = SUBSVC_CLOSED;
         }
         router_cli_ses->replydcb->session = NULL;
         router_cli_ses->routedcb->session = NULL;
@@ -1217,10 +1399,29 @@ freeSession(
             void* router_client_session)
 {
     ROUTER_CLIENT_SES* router_cli_ses;
-    int i;
+    bool connecting;
 
     router_cli_ses = (ROUTER_CLIENT_SES *) router_client_session;
 
+    /**
+     * If subservice sessions are still being opened, the last one to finish
+     * frees the router session.
+     */
+    spinlock_acquire(&router_cli_ses->rses_lock);
+    connecting = router_cli_ses->n_connecting > 0;
+    router_cli_ses->rses_freed = true;
+    spinlock_release(&router_cli_ses->rses_lock);
+
+    if(!connecting)
+    {
+        free_router_session(router_cli_ses);
+    }
+}
+
+static void
+free_router_session(ROUTER_CLIENT_SES* router_cli_ses)
+{
+    int i;
 
     /**
      * For each property type, walk through the list, finalize properties
@@ -1243,6 +1444,7 @@ freeSession(
     {
 
         /* TODO: free router client session */
+        gwbuf_free(router_cli_ses->subservice[i]->queue);
         free(router_cli_ses->subservice[i]);
     }
 
@@ -1755,6 +1957,16 @@ routeQuery(ROUTER* instance,
             }
         }
 
+        /** Use a subservice that is being opened if none are open yet */
+        for(z = 0; TARGET_IS_ANY(route_target) && z < router_cli_ses->n_subservice; z++)
+        {
+            if(SUBSVC_IS_CONNECTING(router_cli_ses->subservice[z]))
+            {
+                tname = router_cli_ses->subservice[z]->service->name;
+                route_target = TARGET_NAMED_SERVER;
+            }
+        }
+
         if(TARGET_IS_ANY(route_target))
         {
 
@@ -1771,6 +1983,24 @@ routeQuery(ROUTER* instance,
      */
     if(TARGET_IS_NAMED_SERVER(route_target))
     {
+        /**
+         * The query is queued if the session of the subservice is still
+         * being opened. It is sent once the session is open.
+         */
+        for(i = 0; i < router_cli_ses->n_subservice; i++)
+        {
+            target_subsvc = router_cli_ses->subservice[i];
+
+            if(SUBSVC_IS_CONNECTING(target_subsvc) &&
+               strcmp(target_subsvc->service->name, tname) == 0)
+            {
+                target_subsvc->queue = gwbuf_append(target_subsvc->queue, querybuf);
+                rses_end_locked_router_action(router_cli_ses);
+                ret = 1;
+                goto retblock;
+            }
+        }
+
         /**
          * Search backend server by name or replication lag.
          * If it fails, then try to find valid slave or master.
@@ -1792,13 +2022,12 @@ routeQuery(ROUTER* instance,
         sescmd_cursor_t* scur;
         scur = target_subsvc->scur;
         /**
-         * Store current stmt if execution of previous session command
-         * haven't completed yet. Note that according to MySQL protocol
-         * there can only be one such non-sescmd stmt at the time.
+         * Queue the query if execution of previous session commands
+         * haven't completed yet. It is sent when the last one is replied to.
          */
-        if(scur && sescmd_cursor_is_active(scur))
+        if(scur && (sescmd_cursor_is_active(scur) || target_subsvc->queue))
         {
-            target_subsvc->pending_cmd = gwbuf_clone(querybuf);
+            target_subsvc->queue = gwbuf_append(target_subsvc->queue, querybuf);
             rses_end_locked_router_action(router_cli_ses);
             ret = 1;
             goto retblock;
@@ -2602,6 +2831,12 @@ route_session_write(
     {
         subsvc = router_cli_ses->subservice[i];
 
+        if(SUBSVC_IS_CONNECTING(subsvc))
+        {
+            /** The command is executed with the history once the session is open */
+            continue;
+        }
+
         if(!SUBSVC_IS_CLOSED(subsvc))
         {
             sescmd_cursor_t* scur;
@@ -265,7 +265,9 @@ typedef enum skygw_chk_t
                         ((c) == LEAST_GLOBAL_CONNECTIONS ? "LEAST_GLOBAL_CONNECTIONS" : \
                         ((c) == LEAST_ROUTER_CONNECTIONS ? "LEAST_ROUTER_CONNECTIONS" : \
                         ((c) == LEAST_BEHIND_MASTER ? "LEAST_BEHIND_MASTER"           : \
-                        ((c) == LEAST_CURRENT_OPERATIONS ? "LEAST_CURRENT_OPERATIONS" : "Unknown criteria")))))
+                        ((c) == LEAST_CURRENT_OPERATIONS ? "LEAST_CURRENT_OPERATIONS" : \
+                        ((c) == LEAST_RESPONSE_TIME ? "LEAST_RESPONSE_TIME"           : \
+                        ((c) == AFFINITY ? "AFFINITY"                                 : "Unknown criteria")))))))
 
 #define STRSRVSTATUS(s) (SERVER_IS_MASTER(s)  ? "RUNNING MASTER" :     \
                         (SERVER_IS_SLAVE(s)   ? "RUNNING SLAVE" :       \
@@ -302,94 +304,6 @@ typedef enum skygw_chk_t
 			((r) == DCB_REASON_NOT_RESPONDING ? "DCB_REASON_NOT_RESPONDING" : 	\
 			"Unknown DCB reason")))))))
 
-#define CHK_MLIST(l) {                                                  \
-            ss_info_dassert((l->mlist_chk_top ==  CHK_NUM_MLIST &&      \
-                             l->mlist_chk_tail == CHK_NUM_MLIST),       \
-                            "Single-linked list structure under- or overflow"); \
-            if (l->mlist_first == NULL) {                                \
-                ss_info_dassert(l->mlist_nodecount == 0,                   \
-                                "List head is NULL but element counter is not zero."); \
-                ss_info_dassert(l->mlist_last == NULL,                  \
-                                "List head is NULL but tail has node"); \
-            } else {                                                    \
-                ss_info_dassert(l->mlist_nodecount > 0,                    \
-                                "List head has node but element counter is not " \
-                                "positive.");                           \
-                CHK_MLIST_NODE(l->mlist_first);                         \
-                CHK_MLIST_NODE(l->mlist_last);                          \
-            }                                                           \
-            if (l->mlist_nodecount == 0) {                                 \
-                ss_info_dassert(l->mlist_first == NULL,                 \
-                                "Element counter is zero but head has node"); \
-                ss_info_dassert(l->mlist_last == NULL,                  \
-                                "Element counter is zero but tail has node"); \
-            }                                                           \
-    }
-
-
-
-#define CHK_MLIST_NODE(n) {                                             \
-            ss_info_dassert((n->mlnode_chk_top == CHK_NUM_MLIST_NODE && \
-                             n->mlnode_chk_tail == CHK_NUM_MLIST_NODE), \
-                            "Single-linked list node under- or overflow"); \
-    }
-
-#define CHK_MLIST_CURSOR(c) {                                           \
-    ss_info_dassert(c->mlcursor_chk_top == CHK_NUM_MLIST_CURSOR &&      \
-                    c->mlcursor_chk_tail == CHK_NUM_MLIST_CURSOR,       \
-                    "List cursor under- or overflow");                  \
-    ss_info_dassert(c->mlcursor_list != NULL,                           \
-                    "List cursor doesn't have list");                   \
-    ss_info_dassert(c->mlcursor_pos != NULL ||                          \
-                    (c->mlcursor_pos == NULL &&                         \
-                     c->mlcursor_list->mlist_first == NULL),            \
-                    "List cursor doesn't have position");               \
-    }
-
-#define CHK_SLIST(l) { \
-    ss_info_dassert((l->slist_chk_top ==  CHK_NUM_SLIST &&              \
-                     l->slist_chk_tail == CHK_NUM_SLIST),               \
-                    "Single-linked list structure under- or overflow"); \
-    if (l->slist_head == NULL) {                                        \
-        ss_info_dassert(l->slist_nelems == 0,                           \
-                        "List head is NULL but element counter is not zero."); \
-        ss_info_dassert(l->slist_tail == NULL,                          \
-                        "List head is NULL but tail has node");         \
-    } else {                                                            \
-        ss_info_dassert(l->slist_nelems > 0,                            \
-                        "List head has node but element counter is not " \
-                        "positive.");                                   \
-        CHK_SLIST_NODE(l->slist_head);                                  \
-        CHK_SLIST_NODE(l->slist_tail);                                  \
-    }                                                                   \
-    if (l->slist_nelems == 0) {                                         \
-        ss_info_dassert(l->slist_head == NULL,                          \
-                        "Element counter is zero but head has node");   \
-        ss_info_dassert(l->slist_tail == NULL,                          \
-                        "Element counter is zero but tail has node");   \
-    }                                                                   \
-    }
-
-
-
-#define CHK_SLIST_NODE(n) {                                             \
-            ss_info_dassert((n->slnode_chk_top == CHK_NUM_SLIST_NODE && \
-                             n->slnode_chk_tail == CHK_NUM_SLIST_NODE), \
-                            "Single-linked list node under- or overflow"); \
-          }
-
-#define CHK_SLIST_CURSOR(c) {                                           \
-                  ss_info_dassert(c->slcursor_chk_top == CHK_NUM_SLIST_CURSOR && \
-                                  c->slcursor_chk_tail == CHK_NUM_SLIST_CURSOR, \
-                    "List cursor under- or overflow");                  \
-    ss_info_dassert(c->slcursor_list != NULL,                           \
-                    "List cursor doesn't have list");                   \
-    ss_info_dassert(c->slcursor_pos != NULL ||                          \
-                    (c->slcursor_pos == NULL &&                         \
-                     c->slcursor_list->slist_head == NULL),             \
-                    "List cursor doesn't have position");               \
-          }
-
 #define CHK_QUERY_TEST(q) {                                             \
                 ss_info_dassert(q->qt_chk_top == CHK_NUM_QUERY_TEST &&  \
                                 q->qt_chk_tail == CHK_NUM_QUERY_TEST,   \
@@ -432,13 +346,6 @@ typedef enum skygw_chk_t
     }
 
 
-#define CHK_MLIST_ISLOCKED(l) {                                         \
-    ss_info_dassert((l.mlist_uselock && l.mlist_islocked) ||            \
-                    !(l.mlist_uselock || l.mlist_islocked),             \
-                        ("mlist is not locked although it should."));   \
-    CHK_MUTEXED_FOR_THR(l.mlist_uselock,l.mlist_rwlock);               \
-    }
-
 #define CHK_MUTEXED_FOR_THR(b,l) {                                      \
         ss_info_dassert(!b ||                                           \
             (b && (l->srw_rwlock_thr == pthread_self())),               \
@@ -29,8 +29,13 @@
 #include "skygw_utils.h"
 #include <atomic.h>
 #include <random_jkiss.h>
+#include <hash.h>
 #include <pcre2.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 static bool file_write_header(skygw_file_t* file);
 static void simple_mutex_free_memory(simple_mutex_t* sm);
 static void thread_free_memory(skygw_thread_t* th, char* name);
@@ -243,6 +248,45 @@ retblock:
     return rval;
 }
 
+/**
+ * Write the timestamp of a given time to location passed as argument by
+ * using at most tslen characters. Used for messages that are formatted
+ * after they were logged.
+ *
+ * @param p_ts          Write position in memory
+ * @param tslen         The size of the location
+ * @param tv            The time
+ * @param highprecision Whether the milliseconds are written
+ *
+ * @return Length of string written to p_ts.
+ */
+size_t snprint_timestamp_tv(char* p_ts, size_t tslen, const struct timeval* tv, bool highprecision)
+{
+    struct tm tm;
+    time_t t = tv->tv_sec;
+
+    if (p_ts == NULL)
+    {
+        return 0;
+    }
+
+    localtime_r(&t, &tm);
+
+    if (highprecision)
+    {
+        snprintf(p_ts, MIN(tslen, timestamp_len_hp), timestamp_formatstr_hp,
+                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                 tm.tm_hour, tm.tm_min, tm.tm_sec, (int)(tv->tv_usec / 1000));
+    }
+    else
+    {
+        snprintf(p_ts, MIN(tslen, timestamp_len), timestamp_formatstr,
+                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+                 tm.tm_min, tm.tm_sec);
+    }
+    return strlen(p_ts);
+}
+
 /**
  * @node Initialize thread data structure
  *
@@ -1519,15 +1563,7 @@ int simple_str_hash(char* key)
         return 0;
     }
 
-    int hash = 0, c = 0;
-    char* ptr = key;
-
-    while ((c = *ptr++))
-    {
-        hash = c + (hash << 6) + (hash << 16) - hash;
-    }
-
-    return hash;
+    return (int)hash_str(key, hash_seed());
 }
 
 /**
@@ -1613,6 +1649,482 @@ char* squeeze_whitespace(char* str)
     return str;
 }
 
+/**
+ * CANONICAL FORM OF A STATEMENT
+ *
+ * canonicalize_sql gives the same result as replace_quoted, remove_mysql_comments,
+ * replace_values and squeeze_whitespace applied in turn, but each of the steps
+ * is a scan of the statement instead of a regular expression substitution and
+ * the only memory used is the buffer of the caller. The statement is first
+ * copied with the quoted strings replaced, the other steps only shorten it and
+ * are done in place in the output buffer.
+ *
+ * The scans skip the bytes that cannot begin a match sixteen at a time when
+ * SSE2 is available, which it always is on x86-64, and one at a time otherwise.
+ */
+
+/** The bytes that a step of the canonicalization looks for */
+typedef enum
+{
+    CANON_QUOTES,   /*< ' and " */
+    CANON_COMMENTS, /*< `, /, # and - */
+    CANON_VALUES,   /*< Digits, ., - and @ */
+    CANON_SPACES    /*< Whitespace */
+} canon_class_t;
+
+static inline bool canon_is_space(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool canon_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline bool canon_is_word(char c)
+{
+    return canon_is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static inline bool canon_in_class(canon_class_t cls, char c)
+{
+    switch (cls)
+    {
+    case CANON_QUOTES:
+        return c == '\'' || c == '"';
+
+    case CANON_COMMENTS:
+        return c == '`' || c == '/' || c == '#' || c == '-';
+
+    case CANON_VALUES:
+        return canon_is_digit(c) || c == '.' || c == '-' || c == '@';
+
+    default:
+        return canon_is_space(c);
+    }
+}
+
+#if defined(__SSE2__)
+static inline int canon_class_mask(canon_class_t cls, __m128i x)
+{
+    __m128i m;
+
+    switch (cls)
+    {
+    case CANON_QUOTES:
+        m = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\'')),
+                         _mm_cmpeq_epi8(x, _mm_set1_epi8('"')));
+        break;
+
+    case CANON_COMMENTS:
+        m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('`')),
+                                      _mm_cmpeq_epi8(x, _mm_set1_epi8('/'))),
+                         _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('#')),
+                                      _mm_cmpeq_epi8(x, _mm_set1_epi8('-'))));
+        break;
+
+    case CANON_VALUES:
+        m = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)),
+                          _mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('.')),
+                                         _mm_cmpeq_epi8(x, _mm_set1_epi8('-'))));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('@')));
+        break;
+
+    default:
+        m = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('\t' - 1)),
+                          _mm_cmplt_epi8(x, _mm_set1_epi8('\r' + 1)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+        break;
+    }
+
+    return _mm_movemask_epi8(m);
+}
+#endif
+
+/**
+ * Find the first byte of a class
+ *
+ * @param cls   The class
+ * @param s     The string to search
+ * @param n     The length of the string
+ * @return      The offset of the first byte of the class, or n if there is none
+ */
+static inline size_t canon_find(canon_class_t cls, const char* s, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16)
+    {
+        int mask = canon_class_mask(cls, _mm_loadu_si128((const __m128i*)(s + i)));
+
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    while (i < n && !canon_in_class(cls, s[i]))
+    {
+        i++;
+    }
+
+    return i;
+}
+
+/**
+ * Copy a statement replacing the contents of the quoted strings with a
+ * question mark, like replace_quoted. A quote preceded by a backslash does
+ * not end a string, unless the string is not otherwise terminated.
+ */
+static size_t canon_quoted(const char* s, size_t n, char* out)
+{
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i < n)
+    {
+        size_t k = canon_find(CANON_QUOTES, s + i, n - i);
+
+        memcpy(out + o, s + i, k);
+        o += k;
+        i += k;
+
+        if (i == n)
+        {
+            break;
+        }
+
+        char quote = s[i];
+        size_t end = 0;
+        size_t last_escaped = 0;
+        size_t j = i + 1;
+        const char* p;
+
+        while ((p = (const char*)memchr(s + j, quote, n - j)) != NULL)
+        {
+            j = p - s;
+
+            if (s[j - 1] != '\\')
+            {
+                end = j;
+                break;
+            }
+            last_escaped = j++;
+        }
+
+        if (end == 0)
+        {
+            end = last_escaped;
+        }
+
+        out[o++] = quote;
+
+        if (end)
+        {
+            out[o++] = '?';
+            out[o++] = quote;
+            i = end + 1;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    /** The other steps work on what precedes the first NUL, as the original ones */
+    return strnlen(out, o);
+}
+
+/**
+ * Remove the comments, other than executable ones, like remove_mysql_comments.
+ * A comment begun with slash and asterisk ends on the line it begins on.
+ */
+static size_t canon_comments(char* s, size_t n)
+{
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i < n)
+    {
+        size_t k = canon_find(CANON_COMMENTS, s + i, n - i);
+
+        memmove(s + o, s + i, k);
+        o += k;
+        i += k;
+
+        if (i == n)
+        {
+            break;
+        }
+
+        char c = s[i];
+
+        if (c == '`')
+        {
+            const char* p = (const char*)memchr(s + i + 1, '`', n - i - 1);
+            size_t len = p ? (size_t)(p - (s + i)) + 1 : 1;
+
+            memmove(s + o, s + i, len);
+            o += len;
+            i += len;
+        }
+        else if (c == '/' && i + 1 < n && s[i + 1] == '*' &&
+                 !(i + 2 < n && (s[i + 2] == '!' || (s[i + 2] == 'M' && i + 3 < n && s[i + 3] == '!'))))
+        {
+            size_t j = i + 2;
+
+            while (j + 1 < n && s[j] != '\n' && !(s[j] == '*' && s[j + 1] == '/'))
+            {
+                j++;
+            }
+
+            if (j + 1 < n && s[j] == '*' && s[j + 1] == '/')
+            {
+                i = j + 2;
+            }
+            else
+            {
+                s[o++] = s[i++];
+            }
+        }
+        else if (c == '#' || (c == '-' && i + 2 < n && s[i + 1] == '-' && canon_is_space(s[i + 2])))
+        {
+            size_t j = c == '#' ? i + 1 : i + 3;
+            const char* p = (const char*)memchr(s + j, '\n', n - j);
+
+            i = p ? (size_t)(p - s) : n;
+        }
+        else
+        {
+            s[o++] = s[i++];
+        }
+    }
+
+    return o;
+}
+
+static inline bool canon_is_value_prefix(char c)
+{
+    return c == '-' || c == '=' || c == ',' || c == '+' || c == '*' || c == '/' || c == '(' ||
+        canon_is_space(c);
+}
+
+static inline bool canon_is_value_suffix(char c)
+{
+    return c == '-' || c == '=' || c == ',' || c == '+' || c == '*' || c == '/' || c == ')' ||
+        c == ';' || canon_is_space(c);
+}
+
+static inline bool canon_is_number(char c)
+{
+    return canon_is_digit(c) || c == '.' || c == '-';
+}
+
+/**
+ * Match a value and what follows it, trying the lengths from the longest
+ *
+ * @return The length of the value, or 0 if there is no match
+ */
+static inline size_t canon_match_value_body(const char* s, size_t n, size_t b,
+                                            bool (*is_body)(char), size_t* suffix)
+{
+    size_t len = 0;
+
+    while (b + len < n && is_body(s[b + len]))
+    {
+        len++;
+    }
+
+    for (; len > 0; len--)
+    {
+        size_t e = b + len;
+
+        if (e == n || canon_is_value_suffix(s[e]))
+        {
+            *suffix = e < n ? 1 : 0;
+            return len;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Match a replaced value at an offset, in the same order as the expression of
+ * replace_values: a number or, after @, a name, preceded by an operator or
+ * whitespace, a word boundary or @ and followed by an operator, whitespace or
+ * the end of the statement.
+ *
+ * @param s         The statement
+ * @param n         The length of the statement
+ * @param i         The offset
+ * @param prev      The byte preceding the offset in the statement
+ * @param prefix    The length of what precedes the value
+ * @param suffix    The length of what follows the value
+ * @return          The length of the match, or 0 if there is none
+ */
+static size_t canon_match_value(const char* s, size_t n, size_t i, char prev,
+                                size_t* prefix, size_t* suffix)
+{
+    for (int alt = 0; alt < 3; alt++)
+    {
+        size_t b;
+        char before;
+
+        if (alt == 0 && canon_is_value_prefix(s[i]))
+        {
+            b = i + 1;
+            before = s[i];
+        }
+        else if (alt == 1 && canon_is_word(prev) != canon_is_word(s[i]))
+        {
+            b = i;
+            before = prev;
+        }
+        else if (alt == 2 && s[i] == '@')
+        {
+            b = i + 1;
+            before = '@';
+        }
+        else
+        {
+            continue;
+        }
+
+        size_t len = canon_match_value_body(s, n, b, canon_is_number, suffix);
+
+        if (len == 0 && before == '@')
+        {
+            len = canon_match_value_body(s, n, b, canon_is_word, suffix);
+        }
+
+        if (len)
+        {
+            *prefix = b - i;
+            return *prefix + len + *suffix;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Replace the numbers and user variables with a question mark, like
+ * replace_values.
+ */
+static size_t canon_values(char* s, size_t n)
+{
+    size_t i = 0;
+    size_t o = 0;
+    char prev = '\0';
+
+    while (i < n)
+    {
+        /** A match begins at a value or at what precedes it */
+        size_t k = canon_find(CANON_VALUES, s + i, n - i);
+        size_t start = k > 0 ? i + k - 1 : i;
+
+        if (start > i)
+        {
+            prev = s[start - 1];
+            memmove(s + o, s + i, start - i);
+            o += start - i;
+            i = start;
+        }
+
+        size_t prefix;
+        size_t suffix;
+        size_t len = canon_match_value(s, n, i, prev, &prefix, &suffix);
+
+        if (len)
+        {
+            char first = s[i];
+            char last = s[i + len - 1];
+
+            if (prefix)
+            {
+                s[o++] = first;
+            }
+            s[o++] = '?';
+            if (suffix)
+            {
+                s[o++] = last;
+            }
+            prev = last;
+            i += len;
+        }
+        else
+        {
+            prev = s[i];
+            s[o++] = s[i++];
+        }
+    }
+
+    return o;
+}
+
+/**
+ * Replace each run of whitespace with a space and remove the leading and
+ * trailing whitespace, like squeeze_whitespace.
+ */
+static size_t canon_whitespace(char* s, size_t n)
+{
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i < n && canon_is_space(s[i]))
+    {
+        i++;
+    }
+
+    while (i < n)
+    {
+        size_t k = canon_find(CANON_SPACES, s + i, n - i);
+
+        memmove(s + o, s + i, k);
+        o += k;
+        i += k;
+
+        while (i < n && canon_is_space(s[i]))
+        {
+            i++;
+        }
+
+        if (i < n)
+        {
+            s[o++] = ' ';
+        }
+    }
+
+    return o;
+}
+
+/**
+ * Write the canonical form of a statement into a buffer. The canonical form is
+ * the same as the result of replace_quoted, remove_mysql_comments, replace_values
+ * and squeeze_whitespace applied in that order.
+ *
+ * @param src       The statement
+ * @param srcsize   The length of the statement
+ * @param dest      The buffer, at least CANONICAL_SQL_SIZE(srcsize) bytes
+ * @return          The length of the canonical form, which is NUL terminated
+ */
+size_t canonicalize_sql(const char* src, size_t srcsize, char* dest)
+{
+    size_t len = canon_quoted(src, srcsize, dest);
+
+    len = canon_comments(dest, len);
+    len = canon_values(dest, len);
+    len = canon_whitespace(dest, len);
+    dest[len] = '\0';
+
+    return len;
+}
+
 /**
  * Initialize the utils library
  *
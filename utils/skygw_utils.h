@@ -30,6 +30,7 @@
 
 #include "skygw_types.h"
 #include "skygw_debug.h"
+#include <sys/time.h>
 
 #define DISKWRITE_LATENCY (5*MSEC_USEC)
 
@@ -125,6 +126,7 @@ size_t get_timestamp_len(void);
 size_t get_timestamp_len_hp(void);
 size_t snprint_timestamp(char* p_ts, size_t tslen);
 size_t snprint_timestamp_hp(char* p_ts, size_t tslen);
+size_t snprint_timestamp_tv(char* p_ts, size_t tslen, const struct timeval* tv, bool highprecision);
 
 EXTERN_C_BLOCK_BEGIN
 
@@ -194,6 +196,10 @@ bool is_valid_posix_path(char* path);
 bool strip_escape_chars(char*);
 char* trim(char *str);
 char* squeeze_whitespace(char* str);
+
+/** The size of the buffer canonicalize_sql needs for a statement of a length */
+#define CANONICAL_SQL_SIZE(len) ((len) + (len) / 2 + 1)
+size_t canonicalize_sql(const char* src, size_t srcsize, char* dest);
 int simple_str_hash(char* key);
 
 EXTERN_C_BLOCK_END